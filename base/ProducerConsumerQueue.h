@@ -20,17 +20,24 @@
 //
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <memory>
 #include <type_traits>
 #include <utility>
 
+#include "base/integral_types.h"
+
 namespace folly {
 
 /*
  * ProducerConsumerQueue is a one producer and one consumer queue
  * without locks.
+ * The indices of the producer and the consumer reside in separate cache lines, each with a
+ * copy of the other side's index that is refreshed only when the queue looks full (or empty),
+ * hence the sides do not read each other's line on every operation. writeBulk/readBulk
+ * transfer several elements and publish the index once.
  */
 template <typename T> class ProducerConsumerQueue {
  public:
@@ -59,23 +66,51 @@ template <typename T> class ProducerConsumerQueue {
     if (nextRecord == size_) {
       nextRecord = 0;
     }
-    if (nextRecord != readIndex_.load(std::memory_order_acquire)) {
-      std::allocator_traits<allocator_type>::construct(alloc_, &records_[currentWrite],
-                                                       std::forward<Args>(recordArgs)...);
-      writeIndex_.store(nextRecord, std::memory_order_release);
-      return true;
+    if (nextRecord == readIndexCache_) {
+      readIndexCache_ = readIndex_.load(std::memory_order_acquire);
+      if (nextRecord == readIndexCache_) {
+        // queue is full
+        return false;
+      }
     }
+    std::allocator_traits<allocator_type>::construct(alloc_, &records_[currentWrite],
+                                                     std::forward<Args>(recordArgs)...);
+    writeIndex_.store(nextRecord, std::memory_order_release);
+    return true;
+  }
 
-    // queue is full
-    return false;
+  // Moves up to n items into the queue. Returns the number of the moved items.
+  size_t writeBulk(T* items, size_t n) noexcept {
+    auto currentWrite = writeIndex_.load(std::memory_order_relaxed);
+    size_t cnt = freeSlots(currentWrite, readIndexCache_);
+    if (cnt < n) {
+      readIndexCache_ = readIndex_.load(std::memory_order_acquire);
+      cnt = freeSlots(currentWrite, readIndexCache_);
+    }
+    cnt = std::min(cnt, n);
+    if (cnt == 0)
+      return 0;
+
+    for (size_t i = 0; i < cnt; ++i) {
+      std::allocator_traits<allocator_type>::construct(alloc_, &records_[currentWrite],
+                                                       std::move(items[i]));
+      if (++currentWrite == size_) {
+        currentWrite = 0;
+      }
+    }
+    writeIndex_.store(currentWrite, std::memory_order_release);
+    return cnt;
   }
 
   // move (or copy) the value at the front of the queue to given variable
   bool read(T& record) noexcept {
     auto const currentRead = readIndex_.load(std::memory_order_relaxed);
-    if (currentRead == writeIndex_.load(std::memory_order_acquire)) {
-      // queue is empty
-      return false;
+    if (currentRead == writeIndexCache_) {
+      writeIndexCache_ = writeIndex_.load(std::memory_order_acquire);
+      if (currentRead == writeIndexCache_) {
+        // queue is empty
+        return false;
+      }
     }
 
     auto nextRecord = currentRead + 1;
@@ -88,13 +123,40 @@ template <typename T> class ProducerConsumerQueue {
     return true;
   }
 
+  // Moves up to n items from the front of the queue into dest.
+  // Returns the number of the moved items.
+  size_t readBulk(T* dest, size_t n) noexcept {
+    auto currentRead = readIndex_.load(std::memory_order_relaxed);
+    size_t cnt = usedSlots(writeIndexCache_, currentRead);
+    if (cnt < n) {
+      writeIndexCache_ = writeIndex_.load(std::memory_order_acquire);
+      cnt = usedSlots(writeIndexCache_, currentRead);
+    }
+    cnt = std::min(cnt, n);
+    if (cnt == 0)
+      return 0;
+
+    for (size_t i = 0; i < cnt; ++i) {
+      dest[i] = std::move(records_[currentRead]);
+      std::allocator_traits<allocator_type>::destroy(alloc_, &records_[currentRead]);
+      if (++currentRead == size_) {
+        currentRead = 0;
+      }
+    }
+    readIndex_.store(currentRead, std::memory_order_release);
+    return cnt;
+  }
+
   // pointer to the value at the front of the queue (for use in-place) or
   // nullptr if empty.
   T* frontPtr() {
     auto const currentRead = readIndex_.load(std::memory_order_relaxed);
-    if (currentRead == writeIndex_.load(std::memory_order_acquire)) {
-      // queue is empty
-      return nullptr;
+    if (currentRead == writeIndexCache_) {
+      writeIndexCache_ = writeIndex_.load(std::memory_order_acquire);
+      if (currentRead == writeIndexCache_) {
+        // queue is empty
+        return nullptr;
+      }
     }
     return &records_[currentRead];
   }
@@ -146,6 +208,14 @@ template <typename T> class ProducerConsumerQueue {
   size_t capacity() const { return size_; }
 
  private:
+  size_t usedSlots(uint32_t write, uint32_t read) const {
+    return write >= read ? write - read : size_ - (read - write);
+  }
+
+  size_t freeSlots(uint32_t write, uint32_t read) const {
+    return size_ - 1 - usedSlots(write, read);
+  }
+
   void destroy() {
     if (std::is_trivially_destructible<T>::value)
       return;
@@ -164,8 +234,13 @@ template <typename T> class ProducerConsumerQueue {
   const uint32_t size_;
   T* const records_;
 
-  std::atomic<uint32_t> readIndex_;
-  std::atomic<uint32_t> writeIndex_;
+  // The consumer's line. writeIndexCache_ is the last writeIndex_ the consumer has seen.
+  alignas(base::CACHE_LINE_SIZE) std::atomic<uint32_t> readIndex_;
+  uint32_t writeIndexCache_ = 0;
+
+  // The producer's line. readIndexCache_ is the last readIndex_ the producer has seen.
+  alignas(base::CACHE_LINE_SIZE) std::atomic<uint32_t> writeIndex_;
+  uint32_t readIndexCache_ = 0;  // the alignment pads the objects that follow the queue.
 
   ProducerConsumerQueue(const ProducerConsumerQueue&) = delete;
   ProducerConsumerQueue& operator=(const ProducerConsumerQueue&) = delete;
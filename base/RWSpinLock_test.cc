@@ -23,6 +23,7 @@
 #include <cstdlib>
 
 #include "base/RWSpinLock.h"
+#include "base/distributed_rw_spinlock.h"
 #include <unistd.h>
 
 
@@ -40,7 +41,7 @@ template<typename RWSpinLockT> struct RWSpinLockTest: public testing::Test {
   typedef RWSpinLockT RWSpinLockType;
 };
 
-typedef testing::Types<RWSpinLock
+typedef testing::Types<RWSpinLock, base::DistributedRWSpinLock
 #if 0
 #ifdef RW_SPINLOCK_USE_X86_INTRINSIC_
         , RWTicketSpinLockT<32, true>,
@@ -151,6 +152,7 @@ TYPED_TEST(RWSpinLockTest, ConcurrentTests) {
   typedef typename TestFixture::RWSpinLockType RWSpinLockType;
   RWSpinLockType l;
   srand(time(nullptr));
+  stopThread.store(false, std::memory_order_release);
 
   std::vector<std::thread> threads;
   for (int i = 0; i < FLAGS_num_threads; ++i) {
@@ -4,25 +4,32 @@
 
 #include "base/arena.h"
 #include <cassert>
+#include <utility>
 
 namespace base {
 
-static const int kBlockSize = 8192;
+Arena::Arena(size_t block_size) : Arena(nullptr, 0, block_size) {
+}
 
-Arena::Arena() {
+Arena::Arena(char* inline_block, size_t inline_size, size_t block_size)
+    : block_size_(block_size), inline_block_(inline_block), inline_size_(inline_size) {
+  assert(block_size_ >= 64);
   blocks_memory_ = 0;
-  alloc_ptr_ = NULL;  // First allocation will allocate a block
-  alloc_bytes_remaining_ = 0;
+  alloc_ptr_ = inline_block;  // NULL - first allocation will allocate a block
+  alloc_bytes_remaining_ = inline_size;
 }
 
 Arena::~Arena() {
   for (size_t i = 0; i < blocks_.size(); i++) {
     delete[] blocks_[i];
   }
+  for (char* b : free_blocks_) {
+    delete[] b;
+  }
 }
 
 char* Arena::AllocateFallback(size_t bytes) {
-  if (bytes > kBlockSize / 4) {
+  if (bytes > block_size_ / 4) {
     // Object is more than a quarter of our block size.  Allocate it separately
     // to avoid wasting too much space in leftover bytes.
     char* result = AllocateNewBlock(bytes);
@@ -30,8 +37,8 @@ char* Arena::AllocateFallback(size_t bytes) {
   }
 
   // We waste the remaining space in the current block.
-  alloc_ptr_ = AllocateNewBlock(kBlockSize);
-  alloc_bytes_remaining_ = kBlockSize;
+  alloc_ptr_ = AllocateNewBlock(block_size_);
+  alloc_bytes_remaining_ = block_size_;
 
   char* result = alloc_ptr_;
   alloc_ptr_ += bytes;
@@ -39,9 +46,8 @@ char* Arena::AllocateFallback(size_t bytes) {
   return result;
 }
 
-char* Arena::AllocateAligned(size_t bytes) {
-  const int align = sizeof(void*);    // We'll align to pointer size
-  assert((align & (align-1)) == 0);   // Pointer size should be a power of 2
+char* Arena::AllocateAligned(size_t bytes, size_t align) {
+  assert((align & (align-1)) == 0);   // align should be a power of 2
   size_t current_mod = reinterpret_cast<uintptr_t>(alloc_ptr_) & (align-1);
   size_t slop = (current_mod == 0 ? 0 : align - current_mod);
   size_t needed = bytes + slop;
@@ -50,34 +56,66 @@ char* Arena::AllocateAligned(size_t bytes) {
     result = alloc_ptr_ + slop;
     alloc_ptr_ += needed;
     alloc_bytes_remaining_ -= needed;
-  } else {
+  } else if (align <= alignof(std::max_align_t)) {
     // AllocateFallback always returned aligned memory
     result = AllocateFallback(bytes);
+  } else {
+    // Over-aligned allocations are rare, pad them in their own block.
+    char* block = AllocateNewBlock(bytes + align);
+    current_mod = reinterpret_cast<uintptr_t>(block) & (align-1);
+    result = block + (current_mod == 0 ? 0 : align - current_mod);
   }
   assert((reinterpret_cast<uintptr_t>(result) & (align-1)) == 0);
   return result;
 }
 
 char* Arena::AllocateNewBlock(size_t block_bytes) {
-  char* result = new char[block_bytes];
-  blocks_memory_ += block_bytes;
+  char* result;
+  if (block_bytes == block_size_ && !free_blocks_.empty()) {
+    result = free_blocks_.back();
+    free_blocks_.pop_back();
+  } else {
+    result = new char[block_bytes];
+    blocks_memory_ += block_bytes;
+  }
   blocks_.push_back(result);
+  oversized_.push_back(block_bytes == block_size_ ? 0 : block_bytes);
   return result;
 }
 
-void Arena::Swap(Arena& other) {
-  char* tmp = other.alloc_ptr_;
-  other.alloc_ptr_ = alloc_ptr_;
-  alloc_ptr_ = tmp;
+void Arena::Rewind(const Mark& m) {
+  assert(m.num_blocks <= blocks_.size());
 
-  size_t s = other.alloc_bytes_remaining_;
-  other.alloc_bytes_remaining_ = alloc_bytes_remaining_;
-  alloc_bytes_remaining_ = s;
+  for (size_t i = m.num_blocks; i < blocks_.size(); ++i) {
+    if (oversized_[i]) {
+      delete[] blocks_[i];
+      blocks_memory_ -= oversized_[i];
+    } else {
+      free_blocks_.push_back(blocks_[i]);
+    }
+  }
+  blocks_.resize(m.num_blocks);
+  oversized_.resize(m.num_blocks);
+
+  alloc_ptr_ = m.alloc_ptr;
+  alloc_bytes_remaining_ = m.alloc_bytes_remaining;
+}
+
+void Arena::Reset() {
+  Rewind(Mark{0, inline_block_, inline_size_});
+}
+
+void Arena::Swap(Arena& other) {
+  std::swap(block_size_, other.block_size_);
+  std::swap(alloc_ptr_, other.alloc_ptr_);
+  std::swap(alloc_bytes_remaining_, other.alloc_bytes_remaining_);
+  std::swap(inline_block_, other.inline_block_);
+  std::swap(inline_size_, other.inline_size_);
 
   blocks_.swap(other.blocks_);
-  s = other.blocks_memory_;
-  other.blocks_memory_ = blocks_memory_;
-  blocks_memory_ = s;
+  oversized_.swap(other.oversized_);
+  free_blocks_.swap(other.free_blocks_);
+  std::swap(blocks_memory_, other.blocks_memory_);
 }
 
 }  // namespace base
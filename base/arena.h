@@ -11,11 +11,20 @@
 #include <cassert>
 #include <cstdint>
 
+#include <pmr/polymorphic_allocator.h>
+
 namespace base {
 
 class Arena {
  public:
-  Arena();
+  enum { kDefaultBlockSize = 8192 };
+
+  // Allocations larger than a quarter of block_size get their own blocks.
+  explicit Arena(size_t block_size = kDefaultBlockSize);
+
+  // Serves the first allocations from [inline_block, inline_block + inline_size) that is
+  // owned by the caller and must outlive the arena. See InlinedArena.
+  Arena(char* inline_block, size_t inline_size, size_t block_size = kDefaultBlockSize);
   ~Arena();
 
   // Return a pointer to a newly allocated memory block of "bytes" bytes.
@@ -24,26 +33,59 @@ class Arena {
   // Allocate memory with the normal alignment guarantees provided by malloc
   char* AllocateAligned(size_t bytes);
 
+  // align must be a power of 2.
+  char* AllocateAligned(size_t bytes, size_t align);
+
   // Returns an estimate of the total memory usage of data allocated
   // by the arena (including space allocated but not yet used for user
-  // allocations).
+  // allocations and the blocks kept for reuse).
   size_t MemoryUsage() const {
-    return blocks_memory_ + blocks_.capacity() * sizeof(char*);
+    return blocks_memory_ + (blocks_.capacity() + free_blocks_.capacity()) * sizeof(char*);
   }
 
+  // The allocation state of the arena. Rewinding to a mark frees everything that was allocated
+  // after it was taken.
+  struct Mark {
+    size_t num_blocks;
+    char* alloc_ptr;
+    size_t alloc_bytes_remaining;
+  };
+
+  Mark GetMark() const { return Mark{blocks_.size(), alloc_ptr_, alloc_bytes_remaining_}; }
+
+  // Invalidates all the allocations done after m was taken. The full-sized blocks are kept for
+  // the following allocations, the oversized ones are freed. Marks taken after m become invalid.
+  void Rewind(const Mark& m);
+
+  // Rewinds to the empty state keeping the blocks, the cheap way of reusing a per-request or
+  // per-batch arena.
+  void Reset();
+
+  // Exchanges the inline blocks as well, so they must outlive both arenas.
   void Swap(Arena& other);
 
  private:
   char* AllocateFallback(size_t bytes);
   char* AllocateNewBlock(size_t block_bytes);
 
+  size_t block_size_;
+
   // Allocation state
   char* alloc_ptr_;
   size_t alloc_bytes_remaining_;
 
+  char* inline_block_ = nullptr;
+  size_t inline_size_ = 0;
+
   // Array of new[] allocated memory blocks
   std::vector<char*> blocks_;
 
+  // Sizes of the oversized blocks, in parallel to blocks_. 0 for the full-sized ones.
+  std::vector<size_t> oversized_;
+
+  // Full-sized blocks freed by Rewind, reused by AllocateNewBlock.
+  std::vector<char*> free_blocks_;
+
   // Bytes of memory in blocks allocated so far
   size_t blocks_memory_;
 
@@ -66,6 +108,41 @@ inline char* Arena::Allocate(size_t bytes) {
   return AllocateFallback(bytes);
 }
 
+inline char* Arena::AllocateAligned(size_t bytes) {
+  return AllocateAligned(bytes, sizeof(void*));
+}
+
+// Arena with the first N bytes inside the object, for short-lived arenas on the stack that
+// usually fit into them.
+template <size_t N> class InlinedArena : public Arena {
+ public:
+  explicit InlinedArena(size_t block_size = kDefaultBlockSize)
+      : Arena(inline_buf_, N, block_size) {}
+
+ private:
+  alignas(std::max_align_t) char inline_buf_[N];
+};
+
+// pmr::memory_resource over an arena for base/pmr.h containers and strings/strpmr.
+// Deallocations are no-ops, the memory is reclaimed by Arena::Rewind/Reset or its destruction.
+class ArenaResource final : public pmr::memory_resource {
+ public:
+  explicit ArenaResource(Arena* arena) : arena_(arena) {}
+
+  Arena* arena() { return arena_; }
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    return arena_->AllocateAligned(bytes ? bytes : 1, alignment);
+  }
+
+  void do_deallocate(void*, size_t, size_t) override {}
+
+  bool do_is_equal(const pmr::memory_resource& o) const noexcept override { return this == &o; }
+
+  Arena* arena_;
+};
+
 }  // namespace base
 
 #endif  // _BASE_UTIL_ARENA_H_
@@ -5,6 +5,7 @@
 #include "base/arena.h"
 
 #include <sys/mman.h>
+#include <cstring>
 #include <random>
 
 #include "base/gtest.h"
@@ -67,4 +68,59 @@ TEST(ArenaTest, Simple) {
   }
 }
 
+TEST(ArenaTest, Rewind) {
+  Arena arena;
+  char* a = arena.Allocate(100);
+  memset(a, 'a', 100);
+
+  Arena::Mark m = arena.GetMark();
+  for (unsigned i = 0; i < 100; ++i) {
+    arena.Allocate(1000);
+  }
+  arena.Allocate(10000);  // oversized.
+  size_t usage = arena.MemoryUsage();
+
+  arena.Rewind(m);
+  EXPECT_EQ(a + 100, arena.Allocate(1));
+  EXPECT_EQ(string(100, 'a'), string(a, 100));
+  EXPECT_LT(arena.MemoryUsage(), usage);
+
+  // Full-sized blocks are reused.
+  usage = arena.MemoryUsage();
+  for (unsigned k = 0; k < 10; ++k) {
+    arena.Reset();
+    for (unsigned i = 0; i < 100; ++i) {
+      arena.Allocate(1000);
+    }
+  }
+  EXPECT_EQ(usage, arena.MemoryUsage());
+}
+
+TEST(ArenaTest, Inlined) {
+  InlinedArena<256> arena;
+  char* a = arena.Allocate(200);
+  EXPECT_EQ(0, arena.MemoryUsage());
+  arena.Allocate(100);
+  EXPECT_GT(arena.MemoryUsage(), 0);
+
+  arena.Reset();
+  EXPECT_EQ(a, arena.Allocate(200));
+}
+
+TEST(ArenaTest, Resource) {
+  Arena arena;
+  ArenaResource mr(&arena);
+
+  std::vector<int, pmr::polymorphic_allocator<int>> vec(&mr);
+  for (int i = 0; i < 1000; ++i) {
+    vec.push_back(i);
+  }
+  EXPECT_EQ(999, vec.back());
+  EXPECT_GT(arena.MemoryUsage(), 1000 * sizeof(int));
+
+  void* p = mr.allocate(64, 64);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(p) % 64);
+  EXPECT_TRUE(mr.is_equal(mr));
+}
+
 }  // namespace base
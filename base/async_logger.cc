@@ -0,0 +1,304 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/async_logger.h"
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "base/pthread_utils.h"
+
+DEFINE_bool(log_async, false, "Writes the log files from a background thread, see async_logger.h");
+DEFINE_uint32(log_async_buffer_kb, 256, "The size of the log buffer of every logging thread");
+DEFINE_uint32(log_async_period_ms, 10, "How often the buffered log messages are written");
+
+namespace base {
+
+using namespace std;
+
+namespace {
+
+/*
+  Single producer, single consumer ring of the log messages of a thread. The records are
+  aligned to 8 bytes and do not wrap around; a record that does not fit the end of the buffer
+  starts at its beginning and the end is skipped.
+*/
+class LogRing {
+ public:
+  struct Header {
+    int64_t timestamp;
+    uint32_t len;  // of the message that follows, kSkip marks the skipped end.
+    uint8_t severity;
+    bool flush;
+  };
+
+  explicit LogRing(size_t size) : size_(size), buf_(new char[size]) {}  // size % 8 == 0
+
+  // Called by the owning thread. Returns false if the ring is full.
+  bool Push(const Header& hdr, const char* msg);
+
+  // Called by one thread at a time. f(const Header&, const char* msg) is called for every
+  // record in the order of Push().
+  template <typename F> void Drain(F&& f);
+
+  size_t size() const { return size_; }
+
+  // The longest message that fits, the longer ones are truncated.
+  size_t max_len() const { return size_ / 4; }
+
+ private:
+  static constexpr uint32_t kSkip = ~0u;
+  static size_t RecordSize(uint32_t len) { return (sizeof(Header) + len + 7) & ~size_t(7); }
+
+  const size_t size_;
+  unique_ptr<char[]> buf_;
+  atomic<uint64_t> head_{0}, tail_{0};  // positions, head_ is written only by the producer.
+};
+
+bool LogRing::Push(const Header& hdr, const char* msg) {
+  size_t need = RecordSize(hdr.len);
+  uint64_t head = head_.load(memory_order_relaxed);
+  uint64_t tail = tail_.load(memory_order_acquire);
+  size_t offs = head % size_, to_end = size_ - offs;
+  size_t skip = to_end < need ? to_end : 0;
+
+  if (head + skip + need - tail > size_)
+    return false;
+
+  if (skip) {
+    if (skip >= sizeof(Header)) {
+      Header marker{0, kSkip, 0, false};
+      memcpy(buf_.get() + offs, &marker, sizeof(marker));
+    }
+    head += skip;
+    offs = 0;
+  }
+  memcpy(buf_.get() + offs, &hdr, sizeof(hdr));
+  memcpy(buf_.get() + offs + sizeof(hdr), msg, hdr.len);
+  head_.store(head + need, memory_order_release);
+  return true;
+}
+
+template <typename F> void LogRing::Drain(F&& f) {
+  uint64_t tail = tail_.load(memory_order_relaxed);
+  uint64_t head = head_.load(memory_order_acquire);
+  while (tail < head) {
+    size_t offs = tail % size_, to_end = size_ - offs;
+    Header hdr;
+    if (to_end >= sizeof(Header))
+      memcpy(&hdr, buf_.get() + offs, sizeof(hdr));
+    if (to_end < sizeof(Header) || hdr.len == kSkip) {
+      tail += to_end;
+      continue;
+    }
+    f(hdr, buf_.get() + offs + sizeof(hdr));
+    tail += RecordSize(hdr.len);
+  }
+  tail_.store(tail, memory_order_release);
+}
+
+class AsyncLogger;
+
+// The process-wide state, never destroyed since the threads may log during the exit.
+struct Pipeline {
+  mutex mu;  // protects rings and free_rings.
+  vector<LogRing*> rings, free_rings;
+
+  mutex drain_mu;  // the rings are drained by one thread at a time.
+  string batches[google::NUM_SEVERITIES];
+
+  AsyncLogger* loggers[google::NUM_SEVERITIES] = {nullptr};
+  pthread_t drainer = 0;
+  atomic_bool stopped{false};
+  atomic_bool sync{false};  // once a FATAL message is logged.
+
+  atomic<uint64_t> messages{0}, dropped{0}, batch_count{0};
+  uint64_t reported_drops = 0;  // protected by drain_mu.
+
+  void DrainAll();
+  void Run();
+};
+
+Pipeline& pipeline() {
+  static Pipeline* res = new Pipeline;
+  return *res;
+}
+
+// The rings of the exited threads are reused by the new ones, since the drainer may still
+// read them.
+class ThreadRing {
+ public:
+  LogRing* get() {
+    if (!ring_) {
+      Pipeline& pl = pipeline();
+      lock_guard<mutex> lk(pl.mu);
+      size_t size = max(1u, FLAGS_log_async_buffer_kb) * 1024;
+      for (size_t i = 0; i < pl.free_rings.size(); ++i) {
+        if (pl.free_rings[i]->size() == size) {
+          ring_ = pl.free_rings[i];
+          pl.free_rings.erase(pl.free_rings.begin() + i);
+          return ring_;
+        }
+      }
+      pl.rings.push_back(new LogRing(size));
+      ring_ = pl.rings.back();
+    }
+    return ring_;
+  }
+
+  ~ThreadRing() {
+    if (ring_) {
+      Pipeline& pl = pipeline();
+      lock_guard<mutex> lk(pl.mu);
+      pl.free_rings.push_back(ring_);
+    }
+  }
+
+ private:
+  LogRing* ring_ = nullptr;
+};
+
+thread_local ThreadRing this_thread_ring;
+
+// Replaces the glog logger of a severity. glog calls Write() and Flush() under its log mutex.
+class AsyncLogger : public google::base::Logger {
+ public:
+  AsyncLogger(google::LogSeverity severity, google::base::Logger* wrapped)
+      : severity_(severity), wrapped_(wrapped) {}
+
+  void Write(bool force_flush, time_t timestamp, const char* message, int message_len) override;
+
+  void Flush() override {
+    pipeline().DrainAll();
+    wrapped_->Flush();
+  }
+
+  uint32_t LogSize() override { return wrapped_->LogSize(); }
+
+  google::base::Logger* wrapped() { return wrapped_; }
+
+ private:
+  const google::LogSeverity severity_;
+  google::base::Logger* const wrapped_;
+};
+
+void AsyncLogger::Write(bool force_flush, time_t timestamp, const char* message,
+                        int message_len) {
+  Pipeline& pl = pipeline();
+  if (severity_ == google::FATAL)
+    pl.sync = true;
+
+  if (pl.sync.load(memory_order_relaxed)) {
+    pl.DrainAll();
+    wrapped_->Write(true, timestamp, message, message_len);
+    return;
+  }
+
+  LogRing* ring = this_thread_ring.get();
+  LogRing::Header hdr{timestamp, uint32_t(min<size_t>(message_len, ring->max_len())),
+                      uint8_t(severity_), force_flush};
+  if (ring->Push(hdr, message)) {
+    pl.messages.fetch_add(1, memory_order_relaxed);
+  } else if (severity_ >= google::ERROR) {
+    wrapped_->Write(force_flush, timestamp, message, message_len);
+  } else {
+    pl.dropped.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void Pipeline::DrainAll() {
+  lock_guard<mutex> drain_lk(drain_mu);
+
+  bool flush[google::NUM_SEVERITIES] = {false};
+  time_t timestamp[google::NUM_SEVERITIES] = {0};
+  auto cb = [&](const LogRing::Header& hdr, const char* msg) {
+    batches[hdr.severity].append(msg, hdr.len);
+    flush[hdr.severity] |= hdr.flush;
+    timestamp[hdr.severity] = hdr.timestamp;
+  };
+  {
+    lock_guard<mutex> lk(mu);
+    for (LogRing* ring : rings) {
+      ring->Drain(cb);
+    }
+  }
+
+  // The drops are reported in the INFO log, which gets all the messages.
+  uint64_t drops = dropped.load(memory_order_relaxed);
+  if (drops != reported_drops) {
+    batches[google::INFO].append("Async logging dropped " + to_string(drops - reported_drops) +
+                                 " messages\n");
+    timestamp[google::INFO] = max(timestamp[google::INFO], time(nullptr));
+    reported_drops = drops;
+  }
+
+  for (int i = 0; i < google::NUM_SEVERITIES; ++i) {
+    string& batch = batches[i];
+    if (batch.empty() || !loggers[i])
+      continue;
+    loggers[i]->wrapped()->Write(flush[i], timestamp[i], batch.data(), batch.size());
+    batch_count.fetch_add(1, memory_order_relaxed);
+    batch.clear();
+  }
+}
+
+void Pipeline::Run() {
+  const auto period = chrono::milliseconds(max(1u, FLAGS_log_async_period_ms));
+  while (!stopped.load(memory_order_acquire)) {
+    this_thread::sleep_for(period);
+    DrainAll();
+  }
+}
+
+}  // namespace
+
+void StartAsyncLogging() {
+  Pipeline& pl = pipeline();
+  CHECK(!pl.drainer) << "Async logging already started";
+
+  for (int i = 0; i < google::NUM_SEVERITIES; ++i) {
+    pl.loggers[i] = new AsyncLogger(i, google::base::GetLogger(i));
+    google::base::SetLogger(i, pl.loggers[i]);
+  }
+  pl.stopped = false;
+  pl.drainer = StartThread("async_log", [&pl] { pl.Run(); });
+}
+
+void StopAsyncLogging() {
+  Pipeline& pl = pipeline();
+  if (!pl.drainer)
+    return;
+
+  pl.stopped = true;
+  PTHREAD_CHECK(join(pl.drainer, nullptr));
+  pl.drainer = 0;
+
+  // SetLogger waits for the writes in flight since glog holds its log mutex for both.
+  for (int i = 0; i < google::NUM_SEVERITIES; ++i) {
+    google::base::SetLogger(i, pl.loggers[i]->wrapped());
+  }
+  pl.DrainAll();
+  for (int i = 0; i < google::NUM_SEVERITIES; ++i) {
+    pl.loggers[i]->wrapped()->Flush();
+    delete pl.loggers[i];
+    pl.loggers[i] = nullptr;
+  }
+}
+
+AsyncLogStats GetAsyncLogStats() {
+  Pipeline& pl = pipeline();
+  AsyncLogStats res;
+  res.messages = pl.messages.load(memory_order_relaxed);
+  res.dropped = pl.dropped.load(memory_order_relaxed);
+  res.batches = pl.batch_count.load(memory_order_relaxed);
+  return res;
+}
+
+}  // namespace base
@@ -0,0 +1,35 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstdint>
+
+namespace base {
+
+/*
+  Makes the glog log files asynchronous, so that a LOG(INFO) in an IO thread does not block
+  on the disk while glog writes or flushes the file. Every logging thread appends its
+  messages to its own lock-free ring of --log_async_buffer_kb and a background thread
+  writes them to the original glog loggers in batches every --log_async_period_ms.
+
+  When the ring of a thread is full, the INFO and WARNING messages are dropped and counted,
+  the ERROR ones are still written synchronously. Once a FATAL message is logged, all the
+  pending messages are written and the logging becomes synchronous.
+
+  MainInitGuard starts it if --log_async is set.
+*/
+void StartAsyncLogging();
+
+// Writes the pending messages and restores the synchronous loggers.
+void StopAsyncLogging();
+
+struct AsyncLogStats {
+  uint64_t messages = 0;  // written to the rings.
+  uint64_t dropped = 0;   // because the rings were full.
+  uint64_t batches = 0;   // written to the glog loggers.
+};
+
+AsyncLogStats GetAsyncLogStats();
+
+}  // namespace base
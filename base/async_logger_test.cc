@@ -0,0 +1,99 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/async_logger.h"
+
+#include <mutex>
+#include <thread>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+
+DECLARE_uint32(log_async_buffer_kb);
+
+namespace base {
+
+using namespace std;
+
+class TestLogger : public google::base::Logger {
+ public:
+  void Write(bool force_flush, time_t timestamp, const char* message, int message_len) override {
+    lock_guard<mutex> lk(mu);
+    text.append(message, message_len);
+    ++writes;
+  }
+
+  void Flush() override {}
+  uint32_t LogSize() override { return 0; }
+
+  mutex mu;  // blocks the writes while held.
+  string text;
+  unsigned writes = 0;
+};
+
+class AsyncLoggerTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    prev_ = google::base::GetLogger(google::INFO);
+    google::base::SetLogger(google::INFO, &logger_);
+  }
+
+  void TearDown() override {
+    StopAsyncLogging();
+    google::base::SetLogger(google::INFO, prev_);
+  }
+
+  // Logs as glog does.
+  static void Log(const string& msg) {
+    google::base::GetLogger(google::INFO)->Write(false, time(nullptr), msg.data(), msg.size());
+  }
+
+  TestLogger logger_;
+  google::base::Logger* prev_ = nullptr;
+};
+
+TEST_F(AsyncLoggerTest, Batches) {
+  StartAsyncLogging();
+  EXPECT_NE(&logger_, google::base::GetLogger(google::INFO));
+
+  string expected;
+  for (unsigned i = 0; i < 1000; ++i) {
+    string msg = absl::StrCat("message ", i, "\n");
+    Log(msg);
+    expected += msg;
+  }
+  thread([&] { Log("from another thread\n"); }).join();
+  StopAsyncLogging();
+
+  EXPECT_EQ(&logger_, google::base::GetLogger(google::INFO));
+  EXPECT_TRUE(absl::StartsWith(logger_.text, expected));
+  EXPECT_TRUE(absl::EndsWith(logger_.text, "from another thread\n"));
+  EXPECT_LT(logger_.writes, 1000);
+}
+
+TEST_F(AsyncLoggerTest, Drops) {
+  FLAGS_log_async_buffer_kb = 1;
+  AsyncLogStats before = GetAsyncLogStats();
+
+  unique_lock<mutex> lk(logger_.mu);
+  StartAsyncLogging();
+
+  // The rings are per thread, the new thread gets the small one.
+  thread([] {
+    for (unsigned i = 0; i < 1000; ++i) {
+      Log(string(100, 'a') + "\n");
+    }
+  }).join();
+  lk.unlock();
+  StopAsyncLogging();
+
+  AsyncLogStats after = GetAsyncLogStats();
+  EXPECT_GT(after.dropped, before.dropped);
+  EXPECT_EQ(1000, after.messages - before.messages + after.dropped - before.dropped);
+  EXPECT_TRUE(absl::StrContains(logger_.text, "Async logging dropped")) << logger_.text;
+  FLAGS_log_async_buffer_kb = 256;
+}
+
+}  // namespace base
@@ -0,0 +1,502 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+// The micro-benchmarks of the base containers and primitives. For the regression tracking:
+//   base_bench --perf_counters --benchmark_out=base.json --benchmark_out_format=json
+// --perf_counters adds the hardware events per iteration to the results when the host allows
+// them, see PerfCounters.
+//
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/RWSpinLock.h"
+#include "base/arena.h"
+#include "base/chunked_array.h"
+#include "base/crc32c.h"
+#include "base/distributed_rw_spinlock.h"
+#include "base/flit.h"
+#include "base/hash.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "base/mpmc_bounded_queue.h"
+#include "base/mpmc_unbounded_queue.h"
+#include "base/perf_counters.h"
+#include "base/pod_array.h"
+#include "base/varint.h"
+#include "strings/string_flat_map.h"
+#include "strings/unique_strings.h"
+
+DEFINE_bool(perf_counters, false, "Reports the hardware events per iteration, see PerfCounters");
+
+namespace base {
+
+using benchmark::DoNotOptimize;
+using namespace std;
+
+namespace {
+
+// Counts the hardware events from its construction until the scope ends and adds them to the
+// results of the benchmark per iteration. Must be constructed right before the loop.
+class BenchCounters {
+ public:
+  explicit BenchCounters(benchmark::State& state) : state_(state) {
+    if (FLAGS_perf_counters && perf_.valid())
+      perf_.Start();
+  }
+
+  ~BenchCounters() {
+    if (!FLAGS_perf_counters || !perf_.valid())
+      return;
+    perf_.Stop();
+    for (unsigned i = 0; i < PerfCounters::NUM_EVENTS; ++i) {
+      auto e = PerfCounters::Event(i);
+      state_.counters[PerfCounters::Name(e)] =
+          benchmark::Counter(perf_.value(e), benchmark::Counter::kAvgIterations);
+    }
+  }
+
+ private:
+  benchmark::State& state_;
+  PerfCounters perf_;
+};
+
+vector<uint64_t> RandomNumbers(size_t count) {
+  mt19937_64 rng(10);
+  vector<uint64_t> res(count);
+  for (auto& v : res) {
+    v = rng() >> (rng() % 64);  // all the lengths of the encodings.
+  }
+  return res;
+}
+
+vector<string> RandomKeys(size_t count) {
+  mt19937_64 rng(10);
+  vector<string> res(count);
+  for (auto& key : res) {
+    key = "key" + to_string(rng());
+  }
+  return res;
+}
+
+constexpr size_t kBatch = 1024;
+
+}  // namespace
+
+// Containers.
+
+static void BM_PODArrayPushBack(benchmark::State& state) {
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    PODArray<uint64_t> arr;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      arr.push_back(i);
+    }
+    DoNotOptimize(arr.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PODArrayPushBack)->Arg(16)->Arg(1024)->Arg(1 << 16);
+
+// Grows by doubling to range(0) bytes, with mremap from kPODArrayMmapThreshold on.
+static void BM_PODArrayGrowLarge(benchmark::State& state) {
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    PODArray<uint8_t> arr(pmr::new_delete_resource());
+    for (size_t sz = 4096; sz <= size_t(state.range(0)); sz *= 2) {
+      arr.resize(sz);
+      memset(arr.data() + sz / 2, 1, sz / 2);
+    }
+    DoNotOptimize(arr.data());
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PODArrayGrowLarge)->Arg(16 << 20)->Arg(256 << 20);
+
+static void BM_InlinedPODArray(benchmark::State& state) {
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    InlinedPODArray<uint64_t, 16> arr;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      arr.push_back(i);
+    }
+    DoNotOptimize(arr.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InlinedPODArray)->Arg(16);
+
+static void BM_VectorPushBack(benchmark::State& state) {
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    vector<uint64_t> arr;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      arr.push_back(i);
+    }
+    DoNotOptimize(arr.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VectorPushBack)->Arg(16)->Arg(1024)->Arg(1 << 16);
+
+static void BM_ChunkedArrayEmplace(benchmark::State& state) {
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    ChunkedArray<uint64_t> arr;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      arr.emplace_back(i);
+    }
+    DoNotOptimize(arr[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ChunkedArrayEmplace)->Arg(16)->Arg(1024)->Arg(1 << 16);
+
+static void BM_ArenaAllocate(benchmark::State& state) {
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    Arena arena;
+    for (size_t i = 0; i < kBatch; ++i) {
+      DoNotOptimize(arena.Allocate(state.range(0)));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_ArenaAllocate)->Arg(8)->Arg(64)->Arg(1024);
+
+static void BM_MpmcQueue(benchmark::State& state) {
+  static mpmc_bounded_queue<uint64_t>* queue = nullptr;
+  if (state.thread_index == 0)
+    queue = new mpmc_bounded_queue<uint64_t>(1 << 16);
+
+  BenchCounters counters(state);
+  uint64_t val = 0;
+  for (auto _ : state) {
+    for (unsigned i = 0; i < 64; ++i) {
+      queue->try_enqueue(i);
+    }
+    for (unsigned i = 0; i < 64; ++i) {
+      queue->try_dequeue(val);
+    }
+  }
+  DoNotOptimize(val);
+  state.SetItemsProcessed(state.iterations() * 64);
+
+  if (state.thread_index == 0) {
+    delete queue;
+    queue = nullptr;
+  }
+}
+BENCHMARK(BM_MpmcQueue)->ThreadRange(1, 8);
+
+static void BM_MpmcUnboundedQueue(benchmark::State& state) {
+  static mpmc_unbounded_queue<uint64_t>* queue = nullptr;
+  if (state.thread_index == 0)
+    queue = new mpmc_unbounded_queue<uint64_t>;
+
+  BenchCounters counters(state);
+  uint64_t val = 0;
+  for (auto _ : state) {
+    for (unsigned i = 0; i < 64; ++i) {
+      queue->enqueue(i);
+    }
+    for (unsigned i = 0; i < 64; ++i) {
+      queue->try_dequeue(val);
+    }
+  }
+  DoNotOptimize(val);
+  state.SetItemsProcessed(state.iterations() * 64);
+
+  if (state.thread_index == 0) {
+    delete queue;
+    queue = nullptr;
+  }
+}
+BENCHMARK(BM_MpmcUnboundedQueue)->ThreadRange(1, 8);
+
+static void BM_RWSpinLockShared(benchmark::State& state) {
+  static folly::RWSpinLock lock;
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    lock.lock_shared();
+    lock.unlock_shared();
+  }
+}
+BENCHMARK(BM_RWSpinLockShared)->ThreadRange(1, 8);
+
+static void BM_RWSpinLockExclusive(benchmark::State& state) {
+  static folly::RWSpinLock lock;
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    lock.lock();
+    lock.unlock();
+  }
+}
+BENCHMARK(BM_RWSpinLockExclusive)->ThreadRange(1, 8);
+
+static void BM_DistributedRWSpinLockShared(benchmark::State& state) {
+  static base::DistributedRWSpinLock lock;
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    lock.lock_shared();
+    lock.unlock_shared();
+  }
+}
+BENCHMARK(BM_DistributedRWSpinLockShared)->ThreadRange(1, 8);
+
+static void BM_DistributedRWSpinLockExclusive(benchmark::State& state) {
+  static base::DistributedRWSpinLock lock;
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    lock.lock();
+    lock.unlock();
+  }
+}
+BENCHMARK(BM_DistributedRWSpinLockExclusive)->ThreadRange(1, 8);
+
+// Encodings.
+
+static void BM_VarintEncode(benchmark::State& state) {
+  vector<uint64_t> input = RandomNumbers(kBatch);
+  vector<uint8_t> buf(kBatch * Varint::kMax64);
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    uint8_t* next = buf.data();
+    for (uint64_t v : input) {
+      next = Varint::Encode64(next, v);
+    }
+    DoNotOptimize(next);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_VarintEncode);
+
+static void BM_VarintDecode(benchmark::State& state) {
+  vector<uint64_t> input = RandomNumbers(kBatch);
+  vector<uint8_t> buf(kBatch * Varint::kMax64);
+  uint8_t* end = buf.data();
+  for (uint64_t v : input) {
+    end = Varint::Encode64(end, v);
+  }
+
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    uint64_t val = 0;
+    for (const uint8_t* next = buf.data(); next < end;) {
+      next = Varint::Parse64(next, &val);
+    }
+    DoNotOptimize(val);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_VarintDecode);
+
+static void BM_FlitEncode(benchmark::State& state) {
+  vector<uint64_t> input = RandomNumbers(kBatch);
+  vector<uint8_t> buf(kBatch * 9);
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    uint8_t* next = buf.data();
+    for (uint64_t v : input) {
+      next += flit::EncodeT<uint64_t>(v, next);
+    }
+    DoNotOptimize(next);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_FlitEncode);
+
+static void BM_FlitDecode(benchmark::State& state) {
+  vector<uint64_t> input = RandomNumbers(kBatch);
+  vector<uint8_t> buf(kBatch * 9 + 8);  // Parse64Fast loads 8 bytes.
+  uint8_t* end = buf.data();
+  for (uint64_t v : input) {
+    end += flit::EncodeT<uint64_t>(v, end);
+  }
+
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    uint64_t val = 0;
+    for (const uint8_t* next = buf.data(); next < end;) {
+      next += flit::Parse64Fast(next, &val);
+    }
+    DoNotOptimize(val);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_FlitDecode);
+
+// Checksums and hashes.
+
+static void BM_Crc32c(benchmark::State& state) {
+  string buf(state.range(0), 'a');
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(buf.data());
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    DoNotOptimize(crc32c::Value(data, buf.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_Crc32c)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
+static void BM_Murmur3(benchmark::State& state) {
+  string buf(state.range(0), 'a');
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(buf.data());
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    DoNotOptimize(MurmurHash3_x86_32(data, buf.size(), 10));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_Murmur3)->Arg(16)->Arg(256)->Arg(4096);
+
+static void BM_Fingerprint(benchmark::State& state) {
+  string buf(state.range(0), 'a');
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    DoNotOptimize(Fingerprint(buf.data(), buf.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_Fingerprint)->Arg(16)->Arg(256)->Arg(4096);
+
+// String maps.
+
+template <typename Map> void InsertKeys(const vector<string>& keys, Map* map) {
+  for (const string& key : keys) {
+    map->emplace(key, 1);
+  }
+}
+
+template <typename Map> void FindKeys(const vector<string>& keys, const Map& map) {
+  for (const string& key : keys) {
+    DoNotOptimize(map.find(key));
+  }
+}
+
+static void BM_StringPieceMapInsert(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    StringPieceMap<int> map;
+    InsertKeys(keys, &map);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringPieceMapInsert)->Arg(1024)->Arg(1 << 16);
+
+static void BM_StringPieceDenseMapInsert(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    StringPieceDenseMap<int> map;
+    map.set_empty_key(StringPiece());
+    InsertKeys(keys, &map);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringPieceDenseMapInsert)->Arg(1024)->Arg(1 << 16);
+
+static void BM_StringPieceMapFind(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  StringPieceMap<int> map;
+  InsertKeys(keys, &map);
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    FindKeys(keys, map);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringPieceMapFind)->Arg(1024)->Arg(1 << 16);
+
+static void BM_StringPieceDenseMapFind(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  StringPieceDenseMap<int> map;
+  map.set_empty_key(StringPiece());
+  InsertKeys(keys, &map);
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    FindKeys(keys, map);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringPieceDenseMapFind)->Arg(1024)->Arg(1 << 16);
+
+static void BM_StringFlatMapInsert(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    strings::StringFlatMap<int> map;
+    InsertKeys(keys, &map);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringFlatMapInsert)->Arg(1024)->Arg(1 << 16);
+
+static void BM_StringFlatMapFind(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  strings::StringFlatMap<int> map;
+  InsertKeys(keys, &map);
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    FindKeys(keys, map);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringFlatMapFind)->Arg(1024)->Arg(1 << 16);
+
+static void BM_StringFlatMapFindBulk(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  vector<StringPiece> pieces(keys.begin(), keys.end());
+  vector<const int*> dest(keys.size());
+  strings::StringFlatMap<int> map;
+  InsertKeys(keys, &map);
+  map.Freeze();
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    map.FindBulk(pieces.data(), pieces.size(), dest.data());
+    DoNotOptimize(dest.back());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_StringFlatMapFindBulk)->Arg(1024)->Arg(1 << 16);
+
+static void BM_UniqueStrings(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    UniqueStrings strings;
+    for (const string& key : keys) {
+      DoNotOptimize(strings.Insert(key));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_UniqueStrings)->Arg(1024)->Arg(1 << 16);
+
+static void BM_UniqueStringsBulk(benchmark::State& state) {
+  vector<string> keys = RandomKeys(state.range(0));
+  vector<StringPiece> pieces(keys.begin(), keys.end());
+  vector<StringPiece> dest(keys.size());
+  BenchCounters counters(state);
+  for (auto _ : state) {
+    UniqueStrings strings;
+    strings.GetBulk(pieces.data(), pieces.size(), dest.data());
+    DoNotOptimize(dest.back());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_UniqueStringsBulk)->Arg(1024)->Arg(1 << 16);
+
+}  // namespace base
+
+int main(int argc, char** argv) {
+  // Removes the benchmark flags before gflags parses the rest.
+  benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,207 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/cpu_topology.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <tuple>
+
+#include "base/logging.h"
+
+namespace base {
+
+using std::vector;
+
+namespace {
+
+constexpr char kCpuDir[] = "/sys/devices/system/cpu";
+constexpr char kNodeDir[] = "/sys/devices/system/node";
+
+bool ReadLine(const char* path, char* buf, size_t size) {
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return false;
+  bool res = fgets(buf, size, f) != nullptr;
+  fclose(f);
+  return res;
+}
+
+int ReadInt(const char* path) {
+  char buf[32];
+  if (!ReadLine(path, buf, sizeof(buf)))
+    return -1;
+  return atoi(buf);
+}
+
+// Parses the list format of sysfs, i.e. "0-3,8,10-11".
+vector<unsigned> ParseList(const char* str) {
+  vector<unsigned> res;
+  while (*str >= '0' && *str <= '9') {
+    char* end;
+    unsigned first = strtoul(str, &end, 10), last = first;
+    if (*end == '-')
+      last = strtoul(end + 1, &end, 10);
+    for (unsigned i = first; i <= last; ++i)
+      res.push_back(i);
+    if (*end != ',')
+      break;
+    str = end + 1;
+  }
+  return res;
+}
+
+vector<CpuTopology::Cpu> ReadCpus() {
+  cpu_set_t cps;
+  CPU_ZERO(&cps);
+  if (sched_getaffinity(0, sizeof(cps), &cps) != 0) {
+    LOG(WARNING) << "Error calling sched_getaffinity: " << strerror(errno);
+    return {};
+  }
+
+  char path[128], buf[1024];
+  std::map<unsigned, unsigned> node_of;
+
+  snprintf(path, sizeof(path), "%s/online", kNodeDir);
+  if (ReadLine(path, buf, sizeof(buf))) {
+    for (unsigned node : ParseList(buf)) {
+      snprintf(path, sizeof(path), "%s/node%u/cpulist", kNodeDir, node);
+      if (!ReadLine(path, buf, sizeof(buf)))
+        continue;
+      for (unsigned cpu : ParseList(buf))
+        node_of[cpu] = node;
+    }
+  }
+
+  // (package, core_id) -> core.
+  std::map<std::pair<int, int>, unsigned> cores;
+  vector<CpuTopology::Cpu> res;
+
+  for (unsigned id = 0; id < CPU_SETSIZE; ++id) {
+    if (!CPU_ISSET(id, &cps))
+      continue;
+    snprintf(path, sizeof(path), "%s/cpu%u/topology/physical_package_id", kCpuDir, id);
+    int package = ReadInt(path);
+    snprintf(path, sizeof(path), "%s/cpu%u/topology/core_id", kCpuDir, id);
+    int core_id = ReadInt(path);
+
+    // Unknown cores are not shared with other cpus.
+    auto key = core_id < 0 ? std::make_pair(-1, -int(id) - 1) : std::make_pair(package, core_id);
+    auto it = cores.emplace(key, cores.size()).first;
+
+    auto node_it = node_of.find(id);
+    unsigned node = node_it == node_of.end() ? 0 : node_it->second;
+
+    res.push_back(CpuTopology::Cpu{id, it->second, node, 0});
+  }
+  return res;
+}
+
+}  // namespace
+
+CpuTopology::CpuTopology(vector<Cpu> cpus) : cpus_(std::move(cpus)) {
+  std::sort(cpus_.begin(), cpus_.end(), [](const Cpu& a, const Cpu& b) { return a.id < b.id; });
+
+  std::map<unsigned, unsigned> core_size;
+  unsigned max_node = 0;
+  for (Cpu& cpu : cpus_) {
+    cpu.smt_rank = core_size[cpu.core]++;
+    max_node = std::max(max_node, cpu.node);
+  }
+  num_nodes_ = max_node + 1;
+}
+
+const CpuTopology& CpuTopology::Get() {
+  static const CpuTopology* topology = [] {
+    CpuTopology* res = new CpuTopology(ReadCpus());
+    if (res->cpus_.empty()) {
+      for (unsigned i = 0; i < std::thread::hardware_concurrency(); ++i)
+        res->cpus_.push_back(Cpu{i, i, 0, 0});
+    }
+    VLOG(1) << "Cpus: " << res->cpus_.size() << ", NUMA nodes: " << res->num_nodes_;
+    return res;
+  }();
+
+  return *topology;
+}
+
+int CpuTopology::NodeOf(unsigned cpu) const {
+  auto it = std::lower_bound(cpus_.begin(), cpus_.end(), cpu,
+                             [](const Cpu& a, unsigned id) { return a.id < id; });
+  return it != cpus_.end() && it->id == cpu ? int(it->node) : -1;
+}
+
+vector<unsigned> CpuTopology::NodeCpus(unsigned node) const {
+  vector<unsigned> res;
+  for (const Cpu& cpu : cpus_) {
+    if (cpu.node == node)
+      res.push_back(cpu.id);
+  }
+  return res;
+}
+
+vector<unsigned> CpuTopology::Order(Placement placement) const {
+  vector<Cpu> sorted = cpus_;
+
+  if (placement == CORES) {
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Cpu& a, const Cpu& b) {
+      return std::tie(a.smt_rank, a.node) < std::tie(b.smt_rank, b.node);
+    });
+  } else if (placement == NODES) {
+    // The position of every cpu among the cpus of its node with the same smt_rank.
+    std::map<std::pair<unsigned, unsigned>, unsigned> count;
+    vector<unsigned> pos(sorted.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      pos[i] = count[std::make_pair(sorted[i].node, sorted[i].smt_rank)]++;
+    }
+
+    vector<size_t> indices(sorted.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+      indices[i] = i;
+    std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
+      return std::tie(sorted[a].smt_rank, pos[a], sorted[a].node) <
+             std::tie(sorted[b].smt_rank, pos[b], sorted[b].node);
+    });
+
+    vector<unsigned> res;
+    for (size_t i : indices)
+      res.push_back(sorted[i].id);
+    return res;
+  }
+
+  vector<unsigned> res;
+  for (const Cpu& cpu : sorted)
+    res.push_back(cpu.id);
+  return res;
+}
+
+bool ParsePlacement(const char* str, CpuTopology::Placement* placement) {
+  if (!strcmp(str, "linear")) {
+    *placement = CpuTopology::LINEAR;
+  } else if (!strcmp(str, "cores")) {
+    *placement = CpuTopology::CORES;
+  } else if (!strcmp(str, "nodes")) {
+    *placement = CpuTopology::NODES;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int SetThreadAffinity(pthread_t tid, const vector<unsigned>& cpus) {
+  cpu_set_t cps;
+  CPU_ZERO(&cps);
+  for (unsigned cpu : cpus)
+    CPU_SET(cpu, &cps);
+
+  return pthread_setaffinity_np(tid, sizeof(cpu_set_t), &cps);
+}
+
+}  // namespace base
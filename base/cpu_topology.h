@@ -0,0 +1,61 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <pthread.h>
+
+#include <vector>
+
+namespace base {
+
+// Cpus available to the process, their physical cores and NUMA nodes. Read from sysfs once.
+// If sysfs is not available every cpu is treated as a separate core of node 0.
+class CpuTopology {
+ public:
+  // Thread placement policies.
+  enum Placement {
+    LINEAR,  // by cpu id.
+    CORES,   // a single cpu of every physical core, then their SMT siblings.
+    NODES,   // like CORES, but round-robin over NUMA nodes.
+  };
+
+  struct Cpu {
+    unsigned id;
+    unsigned core;      // unique over the whole machine.
+    unsigned node;      // NUMA node.
+    unsigned smt_rank;  // 0 for the first hardware thread of its core, 1 for its sibling etc.
+  };
+
+  static const CpuTopology& Get();
+
+  // Sorted by id.
+  const std::vector<Cpu>& cpus() const { return cpus_; }
+
+  unsigned num_nodes() const { return num_nodes_; }
+
+  // Returns NUMA node of the cpu or -1 if the cpu is not available to the process.
+  int NodeOf(unsigned cpu) const;
+
+  // Cpu ids of the node.
+  std::vector<unsigned> NodeCpus(unsigned node) const;
+
+  // All the cpu ids in the order in which the threads should be placed on them.
+  std::vector<unsigned> Order(Placement placement) const;
+
+  // Builds the topology from the description of the cpus. Used by Get() and by tests.
+  explicit CpuTopology(std::vector<Cpu> cpus);
+
+ private:
+  std::vector<Cpu> cpus_;
+  unsigned num_nodes_ = 1;
+};
+
+// Returns false if the parsing failed.
+bool ParsePlacement(const char* str, CpuTopology::Placement* placement);
+
+// Restricts the thread to run on the cpus. Returns 0 or the error code of
+// pthread_setaffinity_np.
+int SetThreadAffinity(pthread_t tid, const std::vector<unsigned>& cpus);
+
+}  // namespace base
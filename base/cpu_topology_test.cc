@@ -0,0 +1,61 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/cpu_topology.h"
+
+#include "base/gtest.h"
+
+namespace base {
+
+class CpuTopologyTest : public testing::Test {
+ protected:
+  // 2 nodes, 2 cores per node, 2 hardware threads per core.
+  // The siblings of cores 0, 1, 2, 3 are cpus 4, 5, 6, 7.
+  static CpuTopology DualSocket() {
+    std::vector<CpuTopology::Cpu> cpus;
+    for (unsigned id = 0; id < 8; ++id) {
+      unsigned core = id % 4;
+      cpus.push_back(CpuTopology::Cpu{id, core, core / 2, 0});
+    }
+    return CpuTopology(std::move(cpus));
+  }
+};
+
+using Order = std::vector<unsigned>;
+
+TEST_F(CpuTopologyTest, Order) {
+  CpuTopology topology = DualSocket();
+  EXPECT_EQ(2u, topology.num_nodes());
+  EXPECT_EQ(1u, topology.cpus()[4].smt_rank);
+  EXPECT_EQ(1, topology.NodeOf(6));
+  EXPECT_EQ(-1, topology.NodeOf(8));
+  EXPECT_EQ(Order({2, 3, 6, 7}), topology.NodeCpus(1));
+
+  EXPECT_EQ(Order({0, 1, 2, 3, 4, 5, 6, 7}), topology.Order(CpuTopology::LINEAR));
+  EXPECT_EQ(Order({0, 1, 2, 3, 4, 5, 6, 7}), topology.Order(CpuTopology::CORES));
+  EXPECT_EQ(Order({0, 2, 1, 3, 4, 6, 5, 7}), topology.Order(CpuTopology::NODES));
+}
+
+TEST_F(CpuTopologyTest, AdjacentSiblings) {
+  // Siblings are numbered next to each other: cpus 0 and 1 share core 0.
+  std::vector<CpuTopology::Cpu> cpus;
+  for (unsigned id = 0; id < 4; ++id) {
+    cpus.push_back(CpuTopology::Cpu{id, id / 2, 0, 0});
+  }
+  CpuTopology topology(std::move(cpus));
+
+  EXPECT_EQ(Order({0, 2, 1, 3}), topology.Order(CpuTopology::CORES));
+}
+
+TEST_F(CpuTopologyTest, Get) {
+  const CpuTopology& topology = CpuTopology::Get();
+  ASSERT_FALSE(topology.cpus().empty());
+  EXPECT_EQ(topology.cpus().size(), topology.Order(CpuTopology::NODES).size());
+
+  CpuTopology::Placement placement;
+  EXPECT_TRUE(ParsePlacement("cores", &placement));
+  EXPECT_EQ(CpuTopology::CORES, placement);
+  EXPECT_FALSE(ParsePlacement("none", &placement));
+}
+
+}  // namespace base
@@ -14,6 +14,10 @@ namespace crc32c {
 // crc32c of a stream of data.
 extern uint32_t Extend(uint32_t init_crc, const uint8_t* data, size_t n);
 
+// The portable table-driven implementation that Extend falls back to on cpus without
+// crc32 instructions. For tests and benchmarks.
+uint32_t ExtendSoftware(uint32_t init_crc, const uint8_t* data, size_t n);
+
 // Return the crc32c of data[0,n-1]
 inline uint32_t Value(const uint8_t* data, size_t n) {
   return Extend(0, data, n);
@@ -4,9 +4,11 @@
 
 #include "base/crc32c.h"
 
+#include <vector>
+
+#include "base/gtest.h"
 #include "base/integral_types.h"
 #include "strings/stringpiece.h"
-#include <gtest/gtest.h>
 
 namespace crc32c {
 
@@ -62,6 +64,40 @@ TEST(CRC, Extend) {
             Extend(Value("hello "), reinterpret_cast<const uint8*>("world"), 5));
 }
 
+// Bitwise crc32c, the reference for the optimized implementations.
+static uint32_t SlowValue(const uint8* data, size_t n) {
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < n; ++i) {
+    crc ^= data[i];
+    for (unsigned j = 0; j < 8; ++j) {
+      crc = (crc >> 1) ^ (0x82f63b78u & (0 - (crc & 1)));
+    }
+  }
+  return crc ^ 0xffffffffu;
+}
+
+TEST(CRC, Long) {
+  std::vector<uint8> buf(20000);
+  for (size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = (i * 2654435761u) >> 13;
+  }
+
+  // Covers unaligned starts and all of the tails around the block sizes.
+  for (size_t offs = 0; offs < 9; ++offs) {
+    for (size_t len : {0, 1, 7, 8, 15, 100, 767, 768, 769, 1600, 3071, 3072, 3073, 6150,
+                       12288, 12289, 19000}) {
+      const uint8* ptr = buf.data() + offs;
+      uint32_t expected = SlowValue(ptr, len);
+      ASSERT_EQ(expected, Value(ptr, len)) << offs << " " << len;
+
+      ASSERT_EQ(expected, ExtendSoftware(0, ptr, len)) << offs << " " << len;
+
+      size_t half = len / 3;
+      ASSERT_EQ(expected, Extend(Value(ptr, half), ptr + half, len - half)) << offs << " " << len;
+    }
+  }
+}
+
 TEST(CRC, Mask) {
   uint32_t crc = Value("foo");
   ASSERT_NE(crc, Mask(crc));
@@ -70,4 +106,26 @@ TEST(CRC, Mask) {
   ASSERT_EQ(crc, Unmask(Unmask(Mask(Mask(crc)))));
 }
 
+static void BM_Extend(benchmark::State& state) {
+  std::vector<uint8> buf(state.range(0), 'a');
+  uint32_t crc = 0;
+  while (state.KeepRunning()) {
+    crc = Extend(crc, buf.data(), buf.size());
+  }
+  base::sink_result(crc);
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_Extend)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
+static void BM_ExtendSoftware(benchmark::State& state) {
+  std::vector<uint8> buf(state.range(0), 'a');
+  uint32_t crc = 0;
+  while (state.KeepRunning()) {
+    crc = ExtendSoftware(crc, buf.data(), buf.size());
+  }
+  base::sink_result(crc);
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_ExtendSoftware)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
 }  // namespace crc32c
\ No newline at end of file
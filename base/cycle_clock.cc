@@ -0,0 +1,173 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/cycle_clock.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace base {
+
+namespace {
+
+constexpr int64_t kCalibrationNanos = 1000000;
+constexpr int64_t kCorrectionMicros = 1000000;
+
+// The startup calibration point.
+uint64_t start_cycles = 0;
+int64_t start_nanos = 0;
+
+uint64_t ReadTsc() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+bool KernelUsesTsc() {
+#if defined(__x86_64__)
+  unsigned eax, ebx, ecx, edx;
+
+  // The invariant TSC bit.
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1U << 8)) == 0)
+    return false;
+
+  FILE* f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+  if (!f)
+    return false;
+  char buf[32] = {0};
+  bool res = fgets(buf, sizeof(buf), f) && strncmp(buf, "tsc\n", 4) == 0;
+  fclose(f);
+  return res;
+#else
+  return false;
+#endif
+}
+
+// Reads the TSC and CLOCK_MONOTONIC at the same moment. Takes the tightest of a few tries,
+// since the thread may be preempted between the reads.
+void ReadBoth(uint64_t* cycles, int64_t* nanos) {
+  uint64_t best = ~0ULL;
+  for (unsigned i = 0; i < 3; ++i) {
+    uint64_t before = ReadTsc();
+    int64_t ns = GetClockNanos<CLOCK_MONOTONIC>();
+    uint64_t after = ReadTsc();
+    if (after - before < best) {
+      best = after - before;
+      *cycles = before + best / 2;
+      *nanos = ns;
+    }
+  }
+}
+
+}  // namespace
+
+bool CycleClock::is_tsc_ = false;
+std::atomic<uint64_t> CycleClock::nanos_mult_{1ULL << kNanosShift};
+std::atomic<uint32_t> CycleClock::seq_{0};
+std::atomic<uint64_t> CycleClock::base_cycles_{0}, CycleClock::base_micros_{0},
+    CycleClock::micros_mult_{0};
+uint64_t CycleClock::period_cycles_ = 0;
+
+// Runs before the other static initializers, so they may already use CycleClock.
+struct CycleClockInit {
+  CycleClockInit() { CycleClock::Init(); }
+};
+
+CycleClockInit cycle_clock_init __attribute__((init_priority(101)));
+
+void CycleClock::Init() {
+  if (!KernelUsesTsc())
+    return;
+
+  uint64_t cycles;
+  int64_t nanos;
+  ReadBoth(&start_cycles, &start_nanos);
+  do {
+    ReadBoth(&cycles, &nanos);
+  } while (nanos - start_nanos < kCalibrationNanos);
+
+  double cycles_per_nano = double(cycles - start_cycles) / (nanos - start_nanos);
+  if (cycles_per_nano < 0.1 || cycles_per_nano > 100)  // Do not trust virtualized counters.
+    return;
+
+  nanos_mult_.store((1ULL << kNanosShift) / cycles_per_nano);
+  micros_mult_.store((1ULL << kMicrosShift) / 1000 / cycles_per_nano);
+  base_cycles_.store(cycles);
+  base_micros_.store(nanos / 1000);
+  period_cycles_ = cycles_per_nano * kCorrectionMicros * 1000;
+  is_tsc_ = true;
+}
+
+uint64_t CycleClock::MonotonicMicros() {
+  if (!is_tsc_)
+    return GetMonotonicMicros();
+
+  uint64_t since, res;
+  uint32_t seq;
+  do {
+    seq = seq_.load(std::memory_order_acquire);
+    uint64_t base = base_cycles_.load(std::memory_order_relaxed);
+
+    // The TSCs of different cpus may differ by a few cycles.
+    since = std::max<int64_t>(0, int64_t(ReadTsc() - base));
+    res = base_micros_.load(std::memory_order_relaxed) +
+          Scale<kMicrosShift>(since, micros_mult_.load(std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || seq != seq_.load(std::memory_order_relaxed));
+
+  if (since > period_cycles_)
+    Recalibrate(base_cycles_.load(std::memory_order_relaxed));
+  return res;
+}
+
+// Continues the clock from its current value with the rate that converges it to
+// CLOCK_MONOTONIC by the next correction. Only one of the racing threads applies it.
+void CycleClock::Recalibrate(uint64_t base_cycles) {
+  uint64_t cycles;
+  int64_t nanos;
+  ReadBoth(&cycles, &nanos);
+
+  uint32_t seq = seq_.load(std::memory_order_relaxed);
+  if ((seq & 1) || !seq_.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed))
+    return;
+  std::atomic_thread_fence(std::memory_order_release);
+  if (base_cycles_.load(std::memory_order_relaxed) != base_cycles || cycles < base_cycles) {
+    seq_.store(seq, std::memory_order_release);
+    return;
+  }
+
+  // The new params start at a TSC read after the readers of the old params returned, hence
+  // the clock does not go back.
+  uint64_t now = ReadTsc();
+  uint64_t base_micros = base_micros_.load(std::memory_order_relaxed);
+  uint64_t mult = micros_mult_.load(std::memory_order_relaxed);
+  uint64_t micros = base_micros + Scale<kMicrosShift>(now - base_cycles, mult);
+  int64_t error = nanos / 1000 - int64_t(base_micros);
+  error -= Scale<kMicrosShift>(cycles - base_cycles, mult);
+
+  // The long term rate, which is also more precise than the startup one.
+  double cycles_per_nano = double(cycles - start_cycles) / (nanos - start_nanos);
+
+  if (error > kCorrectionMicros / 2) {
+    micros += error;  // jumps forward, e.g. after the machine was suspended.
+    error = 0;
+  }
+  error = std::max(error, -kCorrectionMicros / 2);
+
+  double micros_per_cycle = 1e-3 / cycles_per_nano * (kCorrectionMicros + error) /
+                            kCorrectionMicros;
+  base_cycles_.store(now, std::memory_order_relaxed);
+  base_micros_.store(micros, std::memory_order_relaxed);
+  micros_mult_.store((1ULL << kMicrosShift) * micros_per_cycle, std::memory_order_relaxed);
+  nanos_mult_.store((1ULL << kNanosShift) / cycles_per_nano, std::memory_order_relaxed);
+  seq_.store(seq + 2, std::memory_order_release);
+}
+
+}  // namespace base
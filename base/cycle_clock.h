@@ -0,0 +1,94 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "base/histogram.h"
+#include "base/walltime.h"
+
+namespace base {
+
+// Cycle counter for timing the per-record code paths. On x86 it reads the invariant TSC, but
+// only if the kernel uses the TSC as its clocksource, i.e. it verified that the TSCs of all the
+// cpus are synchronized and tick at a constant rate. Otherwise the cycles are the nanoseconds of
+// CLOCK_MONOTONIC, so the code that uses CycleClock works the same everywhere.
+// The TSC rate is calibrated at startup against CLOCK_MONOTONIC and MonotonicMicros() corrects
+// its drift once a second, so MonotonicMicros() follows CLOCK_MONOTONIC and never goes back.
+// All the methods are thread-safe.
+class CycleClock {
+ public:
+  static uint64_t Now() {
+#if defined(__x86_64__)
+    if (is_tsc_)
+      return __rdtsc();
+#endif
+    return GetClockNanos<CLOCK_MONOTONIC>();
+  }
+
+  // Whether Now() reads the TSC.
+  static bool IsTsc() { return is_tsc_; }
+
+  // Converts a difference of Now() values.
+  static uint64_t ToNanos(uint64_t cycles) {
+    return Scale<kNanosShift>(cycles, nanos_mult_.load(std::memory_order_relaxed));
+  }
+
+  static double CyclesPerMicro() {
+    return double(1ULL << kNanosShift) * 1000 / nanos_mult_.load();
+  }
+
+  // CLOCK_MONOTONIC microseconds, at the cost of a cycle counter read.
+  static uint64_t MonotonicMicros();
+
+ private:
+  friend struct CycleClockInit;
+
+  // The fixed point shifts of the multipliers. A cycle is well below a microsecond.
+  static constexpr unsigned kNanosShift = 32, kMicrosShift = 44;
+
+  template <unsigned Shift> static uint64_t Scale(uint64_t cycles, uint64_t mult) {
+    return (unsigned __int128)cycles * mult >> Shift;
+  }
+
+  static void Init();
+  static void Recalibrate(uint64_t base_cycles);
+
+  static bool is_tsc_;
+
+  // Nanoseconds per cycle in fixed point.
+  static std::atomic<uint64_t> nanos_mult_;
+
+  // MonotonicMicros() is base_micros_ + (Now() - base_cycles_) * micros_mult_. The params
+  // are guarded by the seqlock seq_, which is odd while they change.
+  static std::atomic<uint32_t> seq_;
+  static std::atomic<uint64_t> base_cycles_, base_micros_, micros_mult_;
+  static uint64_t period_cycles_;  // between the drift corrections.
+};
+
+// Adds the duration of its scope in nanoseconds to hist, unless hist is null. Costs two reads of
+// the cycle counter, which does not skew the per-record timings as clock_gettime calls would.
+class ScopedCycleTimer {
+ public:
+  explicit ScopedCycleTimer(Histogram* hist) : hist_(hist), start_(hist ? CycleClock::Now() : 0) {}
+
+  ~ScopedCycleTimer() {
+    if (hist_)
+      hist_->Add(CycleClock::ToNanos(CycleClock::Now() - start_));
+  }
+
+ private:
+  ScopedCycleTimer(const ScopedCycleTimer&) = delete;
+  void operator=(const ScopedCycleTimer&) = delete;
+
+  Histogram* hist_;
+  uint64_t start_;
+};
+
+}  // namespace base
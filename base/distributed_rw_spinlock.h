@@ -0,0 +1,163 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <sched.h>
+
+#include <atomic>
+
+#include "base/port.h"
+
+namespace base {
+
+/*
+  Reader-writer spinlock for read-mostly data, e.g. configuration or routing tables that are
+  read on every request and updated rarely. Unlike folly::RWSpinLock, which counts readers in
+  a single word, readers increment a counter of their own slot, so concurrent readers on
+  different cores do not bounce a cache line. Writers set the writer flag and wait until all
+  the slots drain, hence lock() is O(kNumSlots) and the lock takes kNumSlots cache lines.
+
+  Slots are assigned to threads round-robin on their first use rather than by cpu, so a
+  thread that migrates keeps its slot and a reader may unlock from a different cpu.
+  Writers are preferred: once the flag is set new readers back off until unlock().
+  Supports the SharedMutex interface and the ReadHolder/WriteHolder guards of
+  folly::RWSpinLock, but not the upgrade mode.
+*/
+class DistributedRWSpinLock {
+ public:
+  static constexpr unsigned kNumSlots = 64;
+
+  DistributedRWSpinLock() = default;
+  DistributedRWSpinLock(const DistributedRWSpinLock&) = delete;
+  void operator=(const DistributedRWSpinLock&) = delete;
+
+  void lock() {
+    int count = 0;
+    while (!PREDICT_TRUE(TryLockWriterFlag())) {
+      if (++count > 1000) sched_yield();
+    }
+
+    // New readers back off now, wait for the current ones.
+    for (const Slot& slot : slots_) {
+      while (slot.readers.load(std::memory_order_seq_cst) != 0) {
+        if (++count > 1000) sched_yield();
+      }
+    }
+  }
+
+  bool try_lock() {
+    if (!TryLockWriterFlag())
+      return false;
+
+    for (const Slot& slot : slots_) {
+      if (slot.readers.load(std::memory_order_seq_cst) != 0) {
+        writer_.store(false, std::memory_order_release);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void unlock() { writer_.store(false, std::memory_order_release); }
+
+  void lock_shared() {
+    int count = 0;
+    while (!PREDICT_TRUE(try_lock_shared())) {
+      if (++count > 1000) sched_yield();
+    }
+  }
+
+  bool try_lock_shared() {
+    std::atomic<int64_t>& readers = slots_[ThreadSlot()].readers;
+
+    // Pairs with the flag store and the slot loads of the writer: either the writer sees
+    // this reader or the reader sees the writer.
+    readers.fetch_add(1, std::memory_order_seq_cst);
+    if (PREDICT_FALSE(writer_.load(std::memory_order_seq_cst))) {
+      readers.fetch_sub(1, std::memory_order_release);
+      return false;
+    }
+    return true;
+  }
+
+  void unlock_shared() { slots_[ThreadSlot()].readers.fetch_sub(1, std::memory_order_release); }
+
+  // Downgrades the lock from writer status to reader status.
+  void unlock_and_lock_shared() {
+    slots_[ThreadSlot()].readers.fetch_add(1, std::memory_order_relaxed);
+    writer_.store(false, std::memory_order_release);
+  }
+
+  class WriteHolder;
+
+  class ReadHolder {
+   public:
+    explicit ReadHolder(DistributedRWSpinLock* lock = nullptr) : lock_(lock) {
+      if (lock_) lock_->lock_shared();
+    }
+
+    explicit ReadHolder(DistributedRWSpinLock& lock) : lock_(&lock) { lock_->lock_shared(); }
+
+    ReadHolder(ReadHolder&& other) : lock_(other.lock_) { other.lock_ = nullptr; }
+
+    // down-grade
+    explicit ReadHolder(WriteHolder&& writer) : lock_(writer.lock_) {
+      writer.lock_ = nullptr;
+      if (lock_) lock_->unlock_and_lock_shared();
+    }
+
+    ReadHolder(const ReadHolder&) = delete;
+    void operator=(const ReadHolder&) = delete;
+
+    ~ReadHolder() {
+      if (lock_) lock_->unlock_shared();
+    }
+
+   private:
+    DistributedRWSpinLock* lock_;
+  };
+
+  class WriteHolder {
+   public:
+    explicit WriteHolder(DistributedRWSpinLock* lock = nullptr) : lock_(lock) {
+      if (lock_) lock_->lock();
+    }
+
+    explicit WriteHolder(DistributedRWSpinLock& lock) : lock_(&lock) { lock_->lock(); }
+
+    WriteHolder(WriteHolder&& other) : lock_(other.lock_) { other.lock_ = nullptr; }
+
+    WriteHolder(const WriteHolder&) = delete;
+    void operator=(const WriteHolder&) = delete;
+
+    ~WriteHolder() {
+      if (lock_) lock_->unlock();
+    }
+
+   private:
+    friend class ReadHolder;
+    DistributedRWSpinLock* lock_;
+  };
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<int64_t> readers{0};
+  };
+
+  bool TryLockWriterFlag() {
+    bool expected = false;
+    return writer_.compare_exchange_strong(expected, true, std::memory_order_seq_cst);
+  }
+
+  static unsigned ThreadSlot() {
+    static std::atomic<unsigned> next{0};
+    thread_local unsigned slot = next.fetch_add(1, std::memory_order_relaxed) % kNumSlots;
+    return slot;
+  }
+
+  alignas(64) std::atomic<bool> writer_{false};
+  Slot slots_[kNumSlots];
+};
+
+}  // namespace base
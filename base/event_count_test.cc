@@ -16,12 +16,15 @@
 
 #include "base/event_count.h"
 
+#include <unistd.h>
+
 #include <algorithm>
 #include <atomic>
 #include <random>
 #include <thread>
 #include <vector>
 
+#include "base/event_fd_count.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "base/walltime.h"
@@ -204,3 +207,88 @@ TEST_F(EventCountTest, Futex) {
   EXPECT_LT(end - start, 6000);
 }
 
+
+TEST_F(EventCountTest, PingPong) {
+  // Quick handoffs between two threads, served mostly by the spinning waiters.
+  static constexpr int kRounds = 100000;
+  EventCount ping_ec, pong_ec;
+  std::atomic<int> ping{0}, pong{0};
+
+  t1_.reset(new std::thread([&] {
+    for (int i = 1; i <= kRounds; ++i) {
+      ping_ec.await([&] { return ping.load(std::memory_order_acquire) == i; });
+      pong.store(i, std::memory_order_release);
+      pong_ec.notify();
+    }
+  }));
+
+  MicrosecondsInt64 start = GetMonotonicMicros();
+  for (int i = 1; i <= kRounds; ++i) {
+    ping.store(i, std::memory_order_release);
+    ping_ec.notify();
+    pong_ec.await([&] { return pong.load(std::memory_order_acquire) == i; });
+  }
+  t1_->join();
+  LOG(INFO) << "Round trip took " << (GetMonotonicMicros() - start) * 1000 / kRounds << "ns";
+  EXPECT_EQ(kRounds, pong.load());
+}
+
+TEST_F(EventCountTest, EventFd) {
+  base::EventFdCount ec;
+  ASSERT_FALSE(ec.notify());
+
+  base::EventFdCount::Key key = ec.prepareWait();
+  MicrosecondsInt64 start = GetMonotonicMicros();
+  ASSERT_FALSE(ec.wait(key, 5));
+  EXPECT_GE(GetMonotonicMicros() - start, 5000);
+
+  // A notification of a cancelled wait does not satisfy the next one.
+  key = ec.prepareWait();
+  ASSERT_TRUE(ec.notify());
+  ec.cancelWait();
+  key = ec.prepareWait();
+  ASSERT_FALSE(ec.wait(key, 1));
+
+  std::atomic<int> val{0};
+  t1_.reset(new std::thread([&] {
+    for (int i = 1; i <= 1000; ++i) {
+      val.store(i, std::memory_order_release);
+      ec.notify();
+      if (i % 100 == 0)
+        SleepForMilliseconds(1);
+    }
+  }));
+  ec.await([&] { return val.load(std::memory_order_acquire) == 1000; });
+  t1_->join();
+}
+
+TEST_F(EventCountTest, EventFdWaitAny) {
+  base::EventFdCount ec1, ec2;
+  base::EventFdCount* events[] = {&ec1, &ec2};
+  int pipe_fds[2];
+  ASSERT_EQ(0, pipe(pipe_fds));
+  pollfd pfd{pipe_fds[0], POLLIN, 0};
+
+  base::EventFdCount::Key keys[] = {ec1.prepareWait(), ec2.prepareWait()};
+  EXPECT_EQ(0, base::EventFdCount::WaitAny(events, keys, 2, &pfd, 1, 2));
+
+  t1_.reset(new std::thread([&] {
+    SleepForMilliseconds(2);
+    ec2.notify();
+  }));
+  keys[0] = ec1.prepareWait();
+  keys[1] = ec2.prepareWait();
+  EXPECT_EQ(1, base::EventFdCount::WaitAny(events, keys, 2, &pfd, 1));
+  EXPECT_EQ(0, pfd.revents);
+  EXPECT_FALSE(ec1.finishWait(ec1.prepareWait()));
+  t1_->join();
+
+  ASSERT_EQ(1, write(pipe_fds[1], "x", 1));
+  keys[0] = ec1.prepareWait();
+  keys[1] = ec2.prepareWait();
+  EXPECT_EQ(1, base::EventFdCount::WaitAny(events, keys, 2, &pfd, 1));
+  EXPECT_EQ(POLLIN, pfd.revents);
+
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
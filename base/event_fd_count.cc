@@ -0,0 +1,121 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/event_fd_count.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "base/walltime.h"
+
+namespace base {
+
+EventFdCount::EventFdCount() {
+  fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  CHECK_GE(fd_, 0) << "eventfd failed " << errno;
+}
+
+EventFdCount::~EventFdCount() {
+  DCHECK_EQ(0, val_.load() & kWaiterMask);
+  close(fd_);
+}
+
+bool EventFdCount::notify() noexcept {
+  uint64_t prev = val_.fetch_add(kAddEpoch, std::memory_order_acq_rel);
+  if ((prev & kWaiterMask) == 0)
+    return false;
+
+  uint64_t one = 1;
+  ssize_t res = write(fd_, &one, sizeof(one));
+
+  // EAGAIN means that the counter is full, hence it's readable anyway.
+  DCHECK(res == sizeof(one) || errno == EAGAIN);
+  (void)res;
+  return true;
+}
+
+EventFdCount::Key EventFdCount::prepareWait() noexcept {
+  uint64_t prev = val_.fetch_add(kAddWaiter, std::memory_order_acq_rel);
+  DCHECK_EQ(0, prev & kWaiterMask) << "EventFdCount has a single consumer";
+  return Key(prev >> kEpochShift);
+}
+
+void EventFdCount::cancelWait() noexcept {
+  // The notifications that came after prepareWait() leave the eventfd readable.
+  // The next wait drains it.
+  val_.fetch_sub(kAddWaiter, std::memory_order_seq_cst);
+}
+
+void EventFdCount::wait(Key key) noexcept { wait(key, -1); }
+
+bool EventFdCount::wait(Key key, int timeout_ms) noexcept {
+  EventFdCount* me = this;
+  return WaitAny(&me, &key, 1, nullptr, 0, timeout_ms) > 0;
+}
+
+bool EventFdCount::finishWait(Key key) noexcept {
+  Drain();
+  cancelWait();
+  return notified(key);
+}
+
+void EventFdCount::Drain() noexcept {
+  uint64_t cnt;
+  while (read(fd_, &cnt, sizeof(cnt)) < 0 && errno == EINTR) {
+  }
+}
+
+unsigned EventFdCount::WaitAny(EventFdCount* const events[], const Key keys[], unsigned n,
+                               pollfd* fds, unsigned nfds, int timeout_ms) {
+  CHECK_LE(n + nfds, kMaxWaitAny);
+
+  pollfd pfds[kMaxWaitAny];
+  for (unsigned i = 0; i < n; ++i) {
+    pfds[i] = pollfd{events[i]->fd_, POLLIN, 0};
+  }
+  for (unsigned i = 0; i < nfds; ++i) {
+    pfds[n + i] = fds[i];
+    pfds[n + i].revents = 0;
+  }
+
+  const int64_t deadline = timeout_ms < 0 ? -1 : GetMonotonicMicros() + timeout_ms * 1000LL;
+  unsigned ready_events = 0, ready_fds = 0;
+  for (;;) {
+    for (unsigned i = 0; i < n; ++i) {
+      ready_events += events[i]->notified(keys[i]);
+    }
+    if (ready_events || ready_fds)
+      break;
+
+    // A stale wakeup that was left in an eventfd by a cancelled wait polls again.
+    int wait_ms = -1;
+    if (deadline >= 0) {
+      wait_ms = std::max<int64_t>(0, (deadline - GetMonotonicMicros() + 999) / 1000);
+    }
+    int res = poll(pfds, n + nfds, wait_ms);
+    if (res < 0 && errno == EINTR)
+      continue;
+    CHECK_GE(res, 0) << "poll failed " << errno;
+    if (res == 0)
+      break;
+
+    for (unsigned i = 0; i < n; ++i) {
+      if (pfds[i].revents)
+        events[i]->Drain();
+    }
+    for (unsigned i = 0; i < nfds; ++i) {
+      fds[i].revents = pfds[n + i].revents;
+      ready_fds += fds[i].revents != 0;
+    }
+  }
+
+  for (unsigned i = 0; i < n; ++i) {
+    events[i]->cancelWait();
+  }
+  return ready_events + ready_fds;
+}
+
+}  // namespace base
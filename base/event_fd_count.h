@@ -0,0 +1,115 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <poll.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace base {
+
+// A variant of folly::EventCount that sleeps on an eventfd instead of a futex, so the consumer
+// can wait for it together with other file descriptors: sockets, other EventFdCounts (WaitAny)
+// or the reactor of an IO loop (util::EventFdWaiter). The notifiers write to the eventfd only
+// when the consumer waits, so notify() of an EventFdCount without waiters costs one atomic
+// increment, like EventCount::notify().
+// Single consumer: at most one thread or fiber may wait at a time, which lets the waiter drain
+// the eventfd without losing a wakeup of another waiter. notify() is thread-safe.
+//
+// Consumer:
+//   ec.await([&] { return queue.try_dequeue(&item); });
+//
+// Or together with a socket:
+//   EventFdCount* events[] = {&ec};
+//   pollfd pfd{sock_fd, POLLIN, 0};
+//   while (!stop) {
+//     EventFdCount::Key key = ec.prepareWait();
+//     if (!queue.empty()) {
+//       ec.cancelWait();
+//     } else {
+//       EventFdCount::WaitAny(events, &key, 1, &pfd, 1);
+//     }
+//     ... handles the queue and the socket ...
+//   }
+class EventFdCount {
+ public:
+  EventFdCount();
+  ~EventFdCount();
+
+  class Key {
+    friend class EventFdCount;
+    explicit Key(uint32_t e) noexcept : epoch_(e) {}
+    uint32_t epoch_;
+
+   public:
+    Key() noexcept : epoch_(0) {}
+  };
+
+  // Readable after a notify() that found the consumer waiting.
+  int fd() const { return fd_; }
+
+  // Returns true if the consumer was woken.
+  bool notify() noexcept;
+
+  Key prepareWait() noexcept;
+  void cancelWait() noexcept;
+
+  // Blocks until notify() is called after prepareWait() returned key.
+  void wait(Key key) noexcept;
+
+  // Returns false if timeout_ms passed first, -1 waits without a timeout.
+  bool wait(Key key, int timeout_ms) noexcept;
+
+  template <class Condition> void await(Condition condition);
+
+  // Concludes a wait that did not block in wait(), e.g. when the consumer polled fd() itself.
+  // Returns true if the event was notified after prepareWait() returned key.
+  bool finishWait(Key key) noexcept;
+
+  // Waits for several event counts at once, each with the key of its prepareWait(), and for
+  // the extra fds. Returns when one of the events is notified, one of the fds has its
+  // events, as reported in its revents field, or timeout_ms passes. The waits of all the events
+  // are concluded either way. Returns the number of the notified events and ready fds,
+  // 0 on timeout.
+  static unsigned WaitAny(EventFdCount* const events[], const Key keys[], unsigned n,
+                          pollfd* fds = nullptr, unsigned nfds = 0, int timeout_ms = -1);
+
+  static constexpr unsigned kMaxWaitAny = 32;
+
+ private:
+  bool notified(Key key) const noexcept {
+    return (val_.load(std::memory_order_acquire) >> kEpochShift) != key.epoch_;
+  }
+
+  void Drain() noexcept;
+
+  EventFdCount(const EventFdCount&) = delete;
+  EventFdCount& operator=(const EventFdCount&) = delete;
+
+  static constexpr uint64_t kAddWaiter = uint64_t(1);
+  static constexpr size_t kEpochShift = 32;
+  static constexpr uint64_t kAddEpoch = uint64_t(1) << kEpochShift;
+  static constexpr uint64_t kWaiterMask = kAddEpoch - 1;
+
+  // The epoch in the most significant 32 bits and the waiter count in the least significant.
+  std::atomic<uint64_t> val_{0};
+  int fd_;
+};
+
+template <class Condition> void EventFdCount::await(Condition condition) {
+  if (condition())
+    return;
+
+  for (;;) {
+    Key key = prepareWait();
+    if (condition()) {
+      cancelWait();
+      break;
+    }
+    wait(key);
+  }
+}
+
+}  // namespace base
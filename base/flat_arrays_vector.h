@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <cassert>
 #include <vector>
 #include "base/integral_types.h"
 
@@ -118,7 +118,7 @@ inline unsigned Parse64Fast(const uint8_t* src, uint64_t* v) {
 #else
   ++index;
 
-  val &= ((1ULL << index * 8) - 1);
+  val &= (~0ULL >> (64 - index * 8));  // index is in [1, 8], 1ULL << 64 is undefined.
 #endif
 
   *v = val >> index;
@@ -148,8 +148,8 @@ inline unsigned Parse64Safe(const uint8_t* begin, const uint8_t* end, uint64_t*
     return 0;
 
   // Smart compiler knows how to optimize memcpy to small cnt values.
-  memcpy(v, begin, index & 7);
-  *v &= ((1ULL << index * 8) - 1);
+  *v = 0;
+  memcpy(v, begin, index);
   *v >>= index;
 
   return index;
@@ -205,13 +205,55 @@ template<typename T> unsigned ParseT(const uint8_t* src, T* dest) {
   uint32_t index = base::FindLsbNotZero<uint32_t>(val);
 
   ++index;
-  val &= ((1ULL << index * 8) - 1);
+  val &= (~0ULL >> (64 - index * 8));  // index is in [1, 8].
 
   *dest = val >> index;
 
   return index;
 }
 
+// Decodes count values from [begin, end) into dest. Never reads at or beyond end.
+// Returns the pointer past the last parsed value or nullptr if the range is too short.
+// Runs of single byte values, the common case for lengths and small deltas, are decoded
+// 8 values per word.
+template<typename T> const uint8_t* ParseArrayT(const uint8_t* begin, const uint8_t* end,
+                                                T* dest, size_t count) {
+  constexpr uint64_t kLowBits = 0x0101010101010101ULL;
+
+  size_t i = 0;
+  while (i < count) {
+    if (count - i >= 8 && end - begin >= 8) {
+      uint64_t word;
+      std::memcpy(&word, begin, sizeof(word));
+      if ((word & kLowBits) == kLowBits) {
+        for (unsigned k = 0; k < 8; ++k)
+          dest[i + k] = begin[k] >> 1;
+        i += 8;
+        begin += 8;
+        continue;
+      }
+    }
+
+    // ParseT reads sizeof(T) + 1 bytes at most.
+    if (size_t(end - begin) > sizeof(T)) {
+      begin += ParseT(begin, dest + i++);
+      continue;
+    }
+
+    if (begin >= end)
+      return nullptr;
+    unsigned len = ParseLengthT<T>(begin);
+    if (len > size_t(end - begin))
+      return nullptr;
+
+    uint8_t tmp[sizeof(T) + 1] = {0};
+    std::memcpy(tmp, begin, len);
+    ParseT(tmp, dest + i++);
+    begin += len;
+  }
+  return begin;
+}
+
 template<typename T> uint32_t Length(T v) {
   return 1 + base::FindMsbNotZero(v | 1) / 7;
 }
@@ -133,6 +133,87 @@ TEST_F(FlitTest, Flit) {
   TEST_CONST(85039090594426347ULL, 9);
 }
 
+static std::mt19937_64 rnd_engine;
+
+uint64_t RandUint64() {
+  unsigned bit_len = (rnd_engine() % 64) + 1;
+  return rnd_engine() & ((1ULL << bit_len) - 1);
+}
+
+// Mostly small values with runs of single byte ones.
+template <typename T> static std::vector<T> RandValues(unsigned num) {
+  std::vector<T> res(num);
+  for (unsigned i = 0; i < num; ++i) {
+    res[i] = (i / 32) % 2 ? rnd_engine() % 100 : T(RandUint64());
+  }
+  return res;
+}
+
+TEST_F(FlitTest, ParseArray) {
+  std::vector<uint64_t> vals = RandValues<uint64_t>(1001);
+  vals.push_back(1ULL << 63);
+  std::vector<uint8_t> buf(vals.size() * 9 + 8);
+  uint8_t* next = buf.data();
+  for (uint64_t v : vals)
+    next += flit::Encode64(v, next);
+
+  // end is exact, so the tail is parsed without reading past it.
+  std::vector<uint8_t> input(buf.data(), next);
+  std::vector<uint64_t> res(vals.size());
+  const uint8_t* end = input.data() + input.size();
+  EXPECT_EQ(end, flit::ParseArrayT(input.data(), end, res.data(), res.size()));
+  EXPECT_EQ(vals, res);
+
+  EXPECT_EQ(nullptr, flit::ParseArrayT(input.data(), end - 1, res.data(), res.size()));
+}
+
+TEST(VarintTest, ParseArray) {
+  std::vector<uint32_t> vals = RandValues<uint32_t>(1000);
+  vals.push_back(kuint32max);
+  std::string buf;
+  for (uint32_t v : vals)
+    Varint::Append32(&buf, v);
+
+  const uint8* begin = reinterpret_cast<const uint8*>(buf.data());
+  const uint8* end = begin + buf.size();
+  std::vector<uint32_t> res(vals.size());
+  EXPECT_EQ(end, Varint::ParseArray32(begin, end, res.size(), res.data()));
+  EXPECT_EQ(vals, res);
+  EXPECT_EQ(nullptr, Varint::ParseArray32(begin, end - 1, res.size(), res.data()));
+
+  // Unterminated varint.
+  std::string bad(32, '\xff');
+  EXPECT_EQ(nullptr, Varint::ParseArray32(reinterpret_cast<const uint8*>(bad.data()),
+                                          reinterpret_cast<const uint8*>(bad.data()) + bad.size(),
+                                          4, res.data()));
+
+  std::vector<uint64_t> vals64 = RandValues<uint64_t>(1000);
+  buf.clear();
+  for (uint64_t v : vals64)
+    Varint::Append64(&buf, v);
+  begin = reinterpret_cast<const uint8*>(buf.data());
+  end = begin + buf.size();
+  std::vector<uint64_t> res64(vals64.size());
+  EXPECT_EQ(end, Varint::ParseArray64(begin, end, res64.size(), res64.data()));
+  EXPECT_EQ(vals64, res64);
+  EXPECT_EQ(nullptr, Varint::ParseArray64(begin, end - 1, res64.size(), res64.data()));
+}
+
+TEST(VarintTest, Group) {
+  std::vector<uint32_t> vals = RandValues<uint32_t>(1002);
+  vals.push_back(kuint32max);
+  std::vector<uint8> buf(Varint::MaxGroupSize32(vals.size()));
+  uint8* end = Varint::EncodeGroup32(vals.data(), vals.size(), buf.data());
+  ASSERT_LE(end - buf.data(), buf.size());
+
+  std::vector<uint32_t> res(vals.size());
+  EXPECT_EQ(end, Varint::ParseGroup32(buf.data(), end, res.size(), res.data()));
+  EXPECT_EQ(vals, res);
+  EXPECT_EQ(nullptr, Varint::ParseGroup32(buf.data(), end - 1, res.size(), res.data()));
+
+  EXPECT_EQ(buf.data(), Varint::EncodeGroup32(vals.data(), 0, buf.data()));
+}
+
 #if 0
 TEST_F(FlitTest, Bug1) {
   std::vector<uint64_t> vec = ReadIds();
@@ -154,13 +235,6 @@ TEST_F(FlitTest, Bug1) {
 }
 #endif
 
-static std::mt19937_64 rnd_engine;
-
-uint64_t RandUint64() {
-  unsigned bit_len = (rnd_engine() % 64) + 1;
-  return rnd_engine() & ((1ULL << bit_len) - 1);
-}
-
 static void FillEncoded(uint8_t* buf, unsigned num) {
   for (unsigned i = 0; i < num; ++i) {
     volatile uint64_t val = RandUint64();
@@ -262,4 +336,62 @@ static void BM_VarintEncode(benchmark::State& state) {
 }
 BENCHMARK(BM_VarintEncode);
 
+static void BM_VarintDecode32(benchmark::State& state) {
+  std::vector<uint32_t> input = RandValues<uint32_t>(kBatchLen);
+  std::string buf;
+  for (uint32_t v : input)
+    Varint::Append32(&buf, v);
+  const uint8* end = reinterpret_cast<const uint8*>(buf.data()) + buf.size();
+  uint32_t res[kBatchLen];
+
+  while (state.KeepRunning()) {
+    const uint8* rn = reinterpret_cast<const uint8*>(buf.data());
+    for (unsigned i = 0; i < kBatchLen; ++i) {
+      rn = Varint::Parse32WithLimit(rn, end, res + i);
+    }
+    sink_result(res[kBatchLen - 1]);
+  }
+}
+BENCHMARK(BM_VarintDecode32);
+
+static void BM_VarintDecodeArray32(benchmark::State& state) {
+  std::vector<uint32_t> input = RandValues<uint32_t>(kBatchLen);
+  std::string buf;
+  for (uint32_t v : input)
+    Varint::Append32(&buf, v);
+  const uint8* begin = reinterpret_cast<const uint8*>(buf.data());
+  uint32_t res[kBatchLen];
+
+  while (state.KeepRunning()) {
+    sink_result(Varint::ParseArray32(begin, begin + buf.size(), kBatchLen, res));
+  }
+}
+BENCHMARK(BM_VarintDecodeArray32);
+
+static void BM_GroupVarintDecode32(benchmark::State& state) {
+  std::vector<uint32_t> input = RandValues<uint32_t>(kBatchLen);
+  std::vector<uint8> buf(Varint::MaxGroupSize32(kBatchLen));
+  uint8* end = Varint::EncodeGroup32(input.data(), kBatchLen, buf.data());
+  uint32_t res[kBatchLen];
+
+  while (state.KeepRunning()) {
+    sink_result(Varint::ParseGroup32(buf.data(), end, kBatchLen, res));
+  }
+}
+BENCHMARK(BM_GroupVarintDecode32);
+
+static void BM_FlitDecodeArray(benchmark::State& state) {
+  std::vector<uint64_t> input = RandValues<uint64_t>(kBatchLen);
+  uint8_t buf[kBatchLen * 9];
+  uint8_t* end = buf;
+  for (uint64_t v : input)
+    end += flit::Encode64(v, end);
+  uint64_t res[kBatchLen];
+
+  while (state.KeepRunning()) {
+    sink_result(flit::ParseArrayT(buf, end, res, kBatchLen));
+  }
+}
+BENCHMARK(BM_FlitDecodeArray);
+
 }  // namespace util
@@ -0,0 +1,68 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/frozen_arrays.h"
+
+namespace base {
+namespace detail {
+
+char* InitFrozenBuffer(FrozenHeader::Kind kind, size_t elem_size, uint64_t num_arrays,
+                       uint64_t num_items, std::string* buf, uint64_t** offsets) {
+  size_t offsets_size = kind == FrozenHeader::ARRAYS ? (num_arrays + 1) * sizeof(uint64_t) : 0;
+  size_t data_offset =
+      (sizeof(FrozenHeader) + offsets_size + kFrozenAlign - 1) & ~(kFrozenAlign - 1);
+  buf->assign(data_offset + num_items * elem_size, '\0');
+
+  FrozenHeader header;
+  memcpy(header.magic, kFrozenMagic, sizeof(header.magic));
+  header.version = ToLittleEndian(kFrozenVersion);
+  header.kind = kind;
+  header.elem_size = elem_size;
+  header.num_arrays = ToLittleEndian(num_arrays);
+  header.num_items = ToLittleEndian(num_items);
+  header.data_offset = ToLittleEndian<uint64_t>(data_offset);
+  memcpy(&(*buf)[0], &header, sizeof(header));
+
+  if (offsets)
+    *offsets = reinterpret_cast<uint64_t*>(&(*buf)[sizeof(FrozenHeader)]);
+  return &(*buf)[data_offset];
+}
+
+const FrozenHeader* ParseFrozenBuffer(FrozenHeader::Kind kind, size_t elem_size,
+                                      size_t elem_align, const void* buf, size_t size) {
+#ifndef IS_LITTLE_ENDIAN
+  return nullptr;  // the buffers can not be used in place.
+#endif
+  uintptr_t start = reinterpret_cast<uintptr_t>(buf);
+  if (size < sizeof(FrozenHeader) || start % alignof(FrozenHeader))
+    return nullptr;
+
+  const FrozenHeader* header = reinterpret_cast<const FrozenHeader*>(buf);
+  if (memcmp(header->magic, kFrozenMagic, sizeof(header->magic)) ||
+      header->version != kFrozenVersion || header->kind != kind ||
+      header->elem_size != elem_size) {
+    return nullptr;
+  }
+
+  uint64_t data_offset = header->data_offset;
+  if (data_offset % kFrozenAlign || data_offset > size || (start + data_offset) % elem_align ||
+      (size - data_offset) / elem_size < header->num_items) {
+    return nullptr;
+  }
+
+  if (kind == FrozenHeader::ARRAYS) {
+    uint64_t num_arrays = header->num_arrays;
+    if (num_arrays > kuint32max ||
+        sizeof(FrozenHeader) + (num_arrays + 1) * sizeof(uint64_t) > data_offset) {
+      return nullptr;
+    }
+    const uint64_t* offsets = reinterpret_cast<const uint64_t*>(header + 1);
+    if (offsets[0] != 0 || offsets[num_arrays] != header->num_items)
+      return nullptr;
+  }
+
+  return header;
+}
+
+}  // namespace detail
+}  // namespace base
@@ -0,0 +1,244 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "base/chunked_array.h"
+#include "base/flat_arrays_vector.h"
+#include "base/logging.h"
+#include "base/port.h"
+#include "base/simd.h"
+
+namespace base {
+
+/*
+  Read-only layouts of ChunkedArray and FlatArraysVec that are used in place, e.g. from a file
+  mapped with file::ReadonlyFile::Options::use_mmap, so large lookup tables are shared between
+  processes and are ready as soon as they are mapped:
+
+    FrozenHeader (32 bytes)
+    uint64 offsets[num_arrays + 1]   -- for the FlatArraysVec layout only, offsets[0] = 0.
+    T data[num_items]                -- at data_offset, aligned to kFrozenAlign.
+
+  data_offset is relative to the header and the offsets count items. All the fields are
+  little-endian and T must be arithmetic, so the format does not depend on the host. Views accept the buffers on
+  little-endian hosts only, where they need no conversion.
+
+  The builders lay the buffer out upfront, so that the arrays can be filled by several
+  threads. SerializeFrozen() of a container is a builder fed by a single thread.
+*/
+struct FrozenHeader {
+  enum Kind : uint8_t { ARRAY = 1, ARRAYS = 2 };
+
+  char magic[4];
+  uint16_t version;
+  uint8_t kind;
+  uint8_t elem_size;
+  uint64_t num_arrays;
+  uint64_t num_items;
+  uint64_t data_offset;
+};
+
+static_assert(sizeof(FrozenHeader) == 32, "");
+
+constexpr size_t kFrozenAlign = 64;
+
+namespace detail {
+
+constexpr char kFrozenMagic[4] = {'G', 'F', 'R', 'Z'};
+constexpr uint16_t kFrozenVersion = 1;
+
+template <typename T> T ToLittleEndian(T val) {
+#ifdef IS_LITTLE_ENDIAN
+  return val;
+#else
+  char* p = reinterpret_cast<char*>(&val);
+  std::reverse(p, p + sizeof(T));
+  return val;
+#endif
+}
+
+// Lays out the zeroed buffer and writes the header. Returns the pointer to the data and sets
+// offsets for the ARRAYS kind.
+char* InitFrozenBuffer(FrozenHeader::Kind kind, size_t elem_size, uint64_t num_arrays,
+                       uint64_t num_items, std::string* buf, uint64_t** offsets);
+
+// Returns the header if buf holds a valid layout of the kind and the element, null otherwise.
+const FrozenHeader* ParseFrozenBuffer(FrozenHeader::Kind kind, size_t elem_size,
+                                      size_t elem_align, const void* buf, size_t size);
+
+}  // namespace detail
+
+// Read-only view of a serialized ChunkedArray. Does not own the buffer.
+template <typename T> class FrozenArrayView {
+  static_assert(std::is_arithmetic<T>::value, "");
+
+ public:
+  // Returns false if [buf, buf + size) is not a valid layout of an array of T.
+  bool Open(const void* buf, size_t size) {
+    const FrozenHeader* header =
+        detail::ParseFrozenBuffer(FrozenHeader::ARRAY, sizeof(T), alignof(T), buf, size);
+    if (!header)
+      return false;
+    data_ = reinterpret_cast<const T*>(reinterpret_cast<const char*>(buf) + header->data_offset);
+    size_ = header->num_items;
+    return true;
+  }
+
+  const T& operator[](size_t i) const { return data_[i]; }
+
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+
+ private:
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Read-only view of a serialized FlatArraysVec with the same interface.
+template <typename T> class FrozenArraysView {
+  static_assert(std::is_arithmetic<T>::value, "");
+
+ public:
+  using RangeWrapper = typename FlatArraysVec<T>::RangeWrapper;
+
+  // Validates the header and the last offset only, so it takes O(1).
+  bool Open(const void* buf, size_t size) {
+    const FrozenHeader* header =
+        detail::ParseFrozenBuffer(FrozenHeader::ARRAYS, sizeof(T), alignof(T), buf, size);
+    if (!header)
+      return false;
+    offsets_ = reinterpret_cast<const uint64_t*>(header + 1);
+    data_ = reinterpret_cast<const T*>(reinterpret_cast<const char*>(buf) + header->data_offset);
+    size_ = header->num_arrays;
+    return true;
+  }
+
+  RangeWrapper range(uint32 index) const {
+    DCHECK_LT(index, size_);
+    uint64_t start = offsets_[index];
+    return RangeWrapper(data_ + start, offsets_[index + 1] - start);
+  }
+
+  // Returns number of arrays in flat array.
+  uint32 size() const { return size_; }
+
+ private:
+  const uint64_t* offsets_ = nullptr;
+  const T* data_ = nullptr;
+  uint32 size_ = 0;
+};
+
+// Builds the layout of FrozenArrayView with count items, data() may be filled concurrently.
+template <typename T> class FrozenArrayBuilder {
+  static_assert(std::is_arithmetic<T>::value, "");
+
+ public:
+  explicit FrozenArrayBuilder(size_t count) : count_(count) {
+    data_ = reinterpret_cast<T*>(
+        detail::InitFrozenBuffer(FrozenHeader::ARRAY, sizeof(T), 0, count, &buf_, nullptr));
+  }
+
+  T* data() { return data_; }
+
+  // Returns the serialized array. The builder must not be used afterwards.
+  std::string Finish() {
+    for (size_t i = 0; i < count_; ++i)
+      data_[i] = detail::ToLittleEndian(data_[i]);
+    return std::move(buf_);
+  }
+
+ private:
+  size_t count_;
+  std::string buf_;
+  T* data_;
+};
+
+/*
+  Builds the layout of FrozenArraysView in two phases: the lengths of all the arrays are set,
+  Allocate() lays the buffer out and then the arrays are filled. Both set_length() and
+  mutable_range() may be called concurrently for different indices, e.g.
+
+    FrozenArraysBuilder<uint32_t> builder(num_ids);
+    // parallel: builder.set_length(id, neighbors(id).size());
+    builder.Allocate();
+    // parallel: std::copy(neighbors(id).begin(), neighbors(id).end(), builder.mutable_range(id));
+    file->Write(builder.Finish());
+*/
+template <typename T> class FrozenArraysBuilder {
+  static_assert(std::is_arithmetic<T>::value, "");
+
+ public:
+  explicit FrozenArraysBuilder(size_t num_arrays) : lens_(num_arrays) {}
+
+  void set_length(size_t index, size_t len) { lens_[index] = len; }
+
+  void Allocate() {
+    uint64_t num_items = 0;
+    for (uint64_t len : lens_)
+      num_items += len;
+
+    data_ = reinterpret_cast<T*>(detail::InitFrozenBuffer(
+        FrozenHeader::ARRAYS, sizeof(T), lens_.size(), num_items, &buf_, &offsets_));
+    std::copy(lens_.begin(), lens_.end(), offsets_ + 1);
+    ComputePrefixSumInplace(offsets_ + 1, lens_.size(), 0);
+
+    num_arrays_ = lens_.size();
+    std::vector<uint64_t>().swap(lens_);
+  }
+
+  // Returns the storage of the array, of the length that was set for it.
+  T* mutable_range(size_t index) { return data_ + offsets_[index]; }
+
+  // Returns the serialized arrays. The builder must not be used afterwards.
+  std::string Finish() {
+    uint64_t num_items = offsets_[num_arrays_];
+    for (uint64_t i = 0; i < num_items; ++i)
+      data_[i] = detail::ToLittleEndian(data_[i]);
+    for (uint64_t i = 0; i <= num_arrays_; ++i)
+      offsets_[i] = detail::ToLittleEndian(offsets_[i]);
+    return std::move(buf_);
+  }
+
+ private:
+  std::vector<uint64_t> lens_;
+  size_t num_arrays_ = 0;
+  std::string buf_;
+  uint64_t* offsets_ = nullptr;
+  T* data_ = nullptr;
+};
+
+template <typename T, size_t CHUNK_SIZE>
+std::string SerializeFrozen(const ChunkedArray<T, CHUNK_SIZE>& arr) {
+  FrozenArrayBuilder<T> builder(arr.size());
+  T* dest = builder.data();
+  for (size_t i = 0; i < arr.size(); ++i)
+    dest[i] = arr[i];
+  return builder.Finish();
+}
+
+template <typename T> std::string SerializeFrozen(const FlatArraysVec<T>& vec) {
+  FrozenArraysBuilder<T> builder(vec.size());
+  for (uint32 i = 0; i < vec.size(); ++i) {
+    auto range = vec.range(i);
+    builder.set_length(i, range.end() - range.begin());
+  }
+  builder.Allocate();
+  for (uint32 i = 0; i < vec.size(); ++i) {
+    auto range = vec.range(i);
+    std::copy(range.begin(), range.end(), builder.mutable_range(i));
+  }
+  return builder.Finish();
+}
+
+}  // namespace base
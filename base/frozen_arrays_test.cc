@@ -0,0 +1,115 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/frozen_arrays.h"
+
+#include <thread>
+
+#include "base/gtest.h"
+
+namespace base {
+
+using std::string;
+using std::vector;
+
+class FrozenArraysTest : public testing::Test {
+ protected:
+  static vector<uint32_t> Items(uint32_t index) {
+    return vector<uint32_t>(index % 7, index);
+  }
+};
+
+TEST_F(FrozenArraysTest, ChunkedArray) {
+  ChunkedArray<int64_t, 16> arr;
+  for (int64_t i = 0; i < 100; ++i)
+    arr.emplace_back(i * i - 50);
+
+  string buf = SerializeFrozen(arr);
+  EXPECT_EQ(0, buf.size() % sizeof(int64_t));
+
+  FrozenArrayView<int64_t> view;
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  ASSERT_EQ(100, view.size());
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(view.data()) % alignof(int64_t));
+  for (int64_t i = 0; i < 100; ++i) {
+    EXPECT_EQ(i * i - 50, view[i]);
+  }
+
+  FrozenArrayView<uint32_t> wrong_type;
+  EXPECT_FALSE(wrong_type.Open(buf.data(), buf.size()));
+  EXPECT_FALSE(view.Open(buf.data(), buf.size() - 1));
+
+  FrozenArraysView<int64_t> wrong_kind;
+  EXPECT_FALSE(wrong_kind.Open(buf.data(), buf.size()));
+}
+
+TEST_F(FrozenArraysTest, FlatArraysVec) {
+  FlatArraysVec<uint32_t> vec;
+  for (uint32_t i = 0; i < 1000; ++i)
+    vec.Add(Items(i));
+
+  string buf = SerializeFrozen(vec);
+  FrozenArraysView<uint32_t> view;
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  ASSERT_EQ(vec.size(), view.size());
+  for (uint32_t i = 0; i < vec.size(); ++i) {
+    auto expected = vec.range(i);
+    auto actual = view.range(i);
+    ASSERT_EQ(expected.end() - expected.begin(), actual.end() - actual.begin()) << i;
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), actual.begin()));
+  }
+
+  string corrupted = buf;
+  corrupted[0] = 'X';
+  EXPECT_FALSE(view.Open(corrupted.data(), corrupted.size()));
+  EXPECT_FALSE(view.Open(buf.data(), sizeof(FrozenHeader) - 1));
+}
+
+TEST_F(FrozenArraysTest, ParallelBuilder) {
+  constexpr uint32_t kNumArrays = 10000;
+  constexpr unsigned kNumThreads = 4;
+
+  FrozenArraysBuilder<uint32_t> builder(kNumArrays);
+  auto run = [&](auto cb) {
+    vector<std::thread> threads;
+    for (unsigned t = 0; t < kNumThreads; ++t) {
+      threads.emplace_back([&, t] {
+        for (uint32_t i = t; i < kNumArrays; i += kNumThreads)
+          cb(i);
+      });
+    }
+    for (auto& th : threads)
+      th.join();
+  };
+
+  run([&](uint32_t i) { builder.set_length(i, Items(i).size()); });
+  builder.Allocate();
+  run([&](uint32_t i) {
+    vector<uint32_t> items = Items(i);
+    std::copy(items.begin(), items.end(), builder.mutable_range(i));
+  });
+  string buf = builder.Finish();
+
+  FrozenArraysView<uint32_t> view;
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  ASSERT_EQ(kNumArrays, view.size());
+  for (uint32_t i = 0; i < kNumArrays; ++i) {
+    vector<uint32_t> items = Items(i);
+    auto range = view.range(i);
+    ASSERT_EQ(items, vector<uint32_t>(range.begin(), range.end())) << i;
+  }
+}
+
+TEST_F(FrozenArraysTest, Empty) {
+  string buf = SerializeFrozen(FlatArraysVec<float>{});
+  FrozenArraysView<float> view;
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  EXPECT_EQ(0, view.size());
+
+  buf = SerializeFrozen(ChunkedArray<double>{});
+  FrozenArrayView<double> arr;
+  ASSERT_TRUE(arr.Open(buf.data(), buf.size()));
+  EXPECT_EQ(0, arr.size());
+}
+
+}  // namespace base
@@ -7,8 +7,11 @@
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include <string.h>
+#include <x86intrin.h>
 #include <xxhash.h>
 
+#include "base/simd.h"
+
 namespace {
 
 inline uint32_t fmix(uint32_t h) {
@@ -25,6 +28,95 @@ inline uint32_t rotl32(uint32_t x, int8_t r) {
     return (x << r) | (x >> (32 - r));
 }
 
+// wyhash primes.
+constexpr uint64_t kWyP0 = 0xa0761d6478bd642fULL, kWyP1 = 0xe7037ed1a0b428dbULL,
+                   kWyP2 = 0x8ebc6af09c88c6e3ULL, kWyP3 = 0x589965cc75374cc3ULL;
+
+// Multiplies and folds the 128 bit product.
+inline uint64_t WyMix(uint64_t a, uint64_t b) {
+  __uint128_t r = __uint128_t(a) * b;
+  return uint64_t(r) ^ uint64_t(r >> 64);
+}
+
+inline uint64_t Read8(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t Read4(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint64_t WyHash(const uint8_t* p, size_t len, uint64_t seed) {
+  seed ^= kWyP0;
+  uint64_t a, b;
+
+  if (ABSL_PREDICT_TRUE(len <= 16)) {
+    if (len >= 4) {
+      // Two possibly overlapping pairs of 4 byte reads cover [4, 16] bytes.
+      size_t mid = (len >> 3) << 2;
+      a = (Read4(p) << 32) | Read4(p + mid);
+      b = (Read4(p + len - 4) << 32) | Read4(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = (uint64_t(p[0]) << 16) | (uint64_t(p[len >> 1]) << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (ABSL_PREDICT_FALSE(i > 48)) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = WyMix(Read8(p) ^ kWyP1, Read8(p + 8) ^ seed);
+        see1 = WyMix(Read8(p + 16) ^ kWyP2, Read8(p + 24) ^ see1);
+        see2 = WyMix(Read8(p + 32) ^ kWyP3, Read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (ABSL_PREDICT_TRUE(i > 48));
+      seed ^= see1 ^ see2;
+    }
+    while (ABSL_PREDICT_FALSE(i > 16)) {
+      seed = WyMix(Read8(p) ^ kWyP1, Read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = Read8(p + i - 16);
+    b = Read8(p + i - 8);
+  }
+
+  return WyMix(kWyP1 ^ len, WyMix(a ^ kWyP1, b ^ seed));
+}
+
+// AVX2 has no 64 bit multiplication, its emulation with 32 bit ones is not faster than
+// the scalar code. AVX-512DQ has it.
+// GCC 12 reports the _mm512_undefined_* values inside the intrinsics as uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f,avx512dq"))) size_t Hash64BatchAvx512(const uint64_t* keys,
+                                                                     size_t n, uint64_t seed,
+                                                                     uint64_t* dest) {
+  const __m512i vseed = _mm512_set1_epi64(seed);
+  const __m512i c1 = _mm512_set1_epi64(0xff51afd7ed558ccdULL);
+  const __m512i c2 = _mm512_set1_epi64(0xc4ceb9fe1a85ec53ULL);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i k = _mm512_xor_si512(_mm512_loadu_si512(keys + i), vseed);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+    k = _mm512_mullo_epi64(k, c1);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+    k = _mm512_mullo_epi64(k, c2);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+    _mm512_storeu_si512(dest + i, k);
+  }
+  return i;
+}
+#pragma GCC diagnostic pop
+
 }  // namespace
 
 
@@ -83,6 +175,29 @@ uint32_t MurmurHash3_x86_32(const uint8_t* data, uint32_t len, uint32_t seed) {
   return h1;
 }
 
+uint64_t Hash64(const void* data, size_t len, uint64_t seed) {
+  return WyHash(reinterpret_cast<const uint8_t*>(data), len, seed);
+}
+
+void Hash64Batch(const uint64_t* keys, size_t n, uint64_t seed, uint64_t* dest) {
+  static const bool has_dq = __builtin_cpu_supports("avx512dq");
+
+  size_t i = 0;
+  if (GetSimdLevel() == SIMD_AVX512 && has_dq) {
+    i = Hash64BatchAvx512(keys, n, seed, dest);
+  }
+  for (; i < n; ++i) {
+    dest[i] = Hash64(keys[i], seed);
+  }
+}
+
+void Hash64Batch(const char* const* data, const size_t* lens, size_t n, uint64_t seed,
+                 uint64_t* dest) {
+  for (size_t i = 0; i < n; ++i) {
+    dest[i] = WyHash(reinterpret_cast<const uint8_t*>(data[i]), lens[i], seed);
+  }
+}
+
 uint64_t Fingerprint(const char* str, uint32_t len) {
   uint64_t res = XXH64(str, len, 24061983);
   if (ABSL_PREDICT_TRUE(res > 1))
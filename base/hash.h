@@ -4,6 +4,7 @@
 #ifndef BASE_HASH_H
 #define BASE_HASH_H
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
 
@@ -33,6 +34,34 @@ inline uint32_t Fingerprint32(const std::string& str) {
   return uint32_t(res >> 32) ^ uint32_t(res);
 }
 
+// Fast 64 bit hash of wyhash design: a few 64x64->128 bit multiplications per 16 bytes and
+// branch-light handling of short keys. Prefer it over Murmur/Fingerprint for sharding and
+// hash maps. The values are stable across processes and machines, unlike absl::Hash.
+uint64_t Hash64(const void* data, size_t len, uint64_t seed = 0);
+
+inline uint64_t Hash64(const std::string& str, uint64_t seed = 0) {
+  return Hash64(str.data(), str.size(), seed);
+}
+
+// Hash of integral keys, a bijective mixer of key ^ seed.
+inline uint64_t Hash64(uint64_t key, uint64_t seed = 0) {
+  key ^= seed;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+// dest[i] = Hash64(keys[i], seed), with SIMD on AVX-512 cpus. keys and dest may alias.
+void Hash64Batch(const uint64_t* keys, size_t n, uint64_t seed, uint64_t* dest);
+
+// dest[i] = Hash64(data[i], lens[i], seed). The keys are independent, hence the cpu overlaps
+// their multiplications.
+void Hash64Batch(const char* const* data, const size_t* lens, size_t n, uint64_t seed,
+                 uint64_t* dest);
+
 }  // namespace base
 
 #endif  // BASE_HASH_H
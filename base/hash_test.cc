@@ -3,8 +3,11 @@
 //
 #include "base/hash.h"
 
+#include <numeric>
+
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "base/simd.h"
 #include "file/filesource.h"
 #include "strings/strip.h"
 
@@ -34,6 +37,64 @@ TEST_F(HashTest, Basic) {
   ASSERT_GT(ids.size(), 10);
 }
 
+TEST_F(HashTest, Hash64) {
+  // Every length of the short and the long paths must depend on all of its bytes.
+  std::string buf(200, 'a');
+  for (size_t len = 0; len < buf.size(); ++len) {
+    uint64_t h = Hash64(buf.data(), len);
+    EXPECT_EQ(h, Hash64(buf.substr(0, len)));
+    EXPECT_NE(h, Hash64(buf.data(), len, 1)) << len;
+    EXPECT_NE(h, Hash64(buf.data(), len + 1)) << len;
+    for (size_t i = 0; i < len; ++i) {
+      std::string s = buf.substr(0, len);
+      s[i] = 'b';
+      ASSERT_NE(h, Hash64(s)) << len << " " << i;
+    }
+  }
+}
+
+TEST_F(HashTest, Batch) {
+  std::vector<uint64_t> keys(1003), dest(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = i * 0x9e3779b97f4a7c15ULL;
+  }
+
+  for (int l = SIMD_SSE; l <= CpuSimdLevel(); ++l) {
+    SetSimdLevel(SimdLevel(l));
+    Hash64Batch(keys.data(), keys.size(), 7, dest.data());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      ASSERT_EQ(Hash64(keys[i], 7), dest[i]) << l << " " << i;
+    }
+  }
+  SetSimdLevel(CpuSimdLevel());
+
+  auto ids = ReadIds();
+  std::vector<const char*> data;
+  std::vector<size_t> lens;
+  for (const auto& s : ids) {
+    data.push_back(s.data());
+    lens.push_back(s.size());
+  }
+  dest.resize(ids.size());
+  Hash64Batch(data.data(), lens.data(), ids.size(), 0, dest.data());
+  for (size_t i = 0; i < ids.size(); ++i) {
+    ASSERT_EQ(Hash64(ids[i]), dest[i]);
+  }
+}
+
+TEST_F(HashTest, Shards) {
+  // The ids spread evenly over the shards.
+  auto ids = ReadIds();
+  constexpr unsigned kShards = 10;
+  std::vector<unsigned> counts(kShards);
+  for (const auto& s : ids) {
+    ++counts[Hash64(s) % kShards];
+  }
+  for (unsigned c : counts) {
+    EXPECT_GT(c, ids.size() / kShards / 2);
+  }
+}
+
 static void BM_MurMur(benchmark::State& state) {
   auto ids = ReadIds();
   uint32 i = 0;
@@ -45,4 +106,37 @@ static void BM_MurMur(benchmark::State& state) {
 }
 BENCHMARK(BM_MurMur);
 
+static void BM_Fingerprint(benchmark::State& state) {
+  auto ids = ReadIds();
+  uint32 i = 0;
+  while (state.KeepRunning()) {
+    const auto& id = ids[i++ % ids.size()];
+    sink_result(base::Fingerprint(id.data(), id.size()));
+  }
+}
+BENCHMARK(BM_Fingerprint);
+
+static void BM_Hash64(benchmark::State& state) {
+  auto ids = ReadIds();
+  uint32 i = 0;
+  while (state.KeepRunning()) {
+    sink_result(base::Hash64(ids[i++ % ids.size()]));
+  }
+}
+BENCHMARK(BM_Hash64);
+
+// Arg is the simd level.
+static void BM_Hash64Batch(benchmark::State& state) {
+  SetSimdLevel(SimdLevel(state.range(0)));
+  std::vector<uint64_t> keys(1024), dest(1024);
+  std::iota(keys.begin(), keys.end(), 0);
+  while (state.KeepRunning()) {
+    Hash64Batch(keys.data(), keys.size(), 0, dest.data());
+    sink_result(dest[0]);
+  }
+  SetSimdLevel(CpuSimdLevel());
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_Hash64Batch)->DenseRange(SIMD_SSE, SIMD_AVX512);
+
 }  // namespace base
@@ -0,0 +1,176 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/hdr_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "base/varint.h"
+
+namespace base {
+
+uint64 HdrHistogram::LowerBound(unsigned index) {
+  unsigned bucket = index >> kSubBucketBits;
+  uint64 sub = index & kSubBucketMask;
+  if (bucket == 0)
+    return sub;
+  return ((1ULL << kSubBucketBits) + sub) << (bucket - 1);
+}
+
+void HdrHistogram::AddToBucket(unsigned index, uint64 count) {
+  if (index >= counts_.size())
+    counts_.resize(index + 1);
+  counts_[index] += count;
+  count_ += count;
+}
+
+void HdrHistogram::Add(uint64 value, uint64 count) {
+  if (count == 0)
+    return;
+  AddToBucket(Index(value), count);
+  sum_ += value * count;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+}
+
+void HdrHistogram::Merge(const HdrHistogram& other) {
+  if (other.counts_.size() > counts_.size())
+    counts_.resize(other.counts_.size());
+  for (size_t i = 0; i < other.counts_.size(); ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+}
+
+void HdrHistogram::Clear() {
+  counts_.clear();
+  count_ = sum_ = max_ = 0;
+  min_ = kuint64max;
+}
+
+uint64 HdrHistogram::Percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  uint64 rank = std::ceil(std::min(std::max(p, 0.0), 100.0) / 100 * count_);
+  rank = std::max<uint64>(rank, 1);
+  if (rank == count_)
+    return max_;
+
+  uint64 cumulative = 0;
+  for (unsigned i = 0; i < counts_.size(); ++i) {
+    cumulative += counts_[i];
+    if (cumulative >= rank) {
+      // The middle of the bucket halves the error.
+      uint64 val = LowerBound(i) + Width(i) / 2;
+      return std::min(std::max(val, min_), max_);
+    }
+  }
+  return max_;
+}
+
+uint64 HdrHistogram::CountBelow(uint64 limit) const {
+  unsigned end = std::min<size_t>(Index(limit), counts_.size());
+  uint64 res = 0;
+  for (unsigned i = 0; i < end; ++i) {
+    res += counts_[i];
+  }
+  return res;
+}
+
+void HdrHistogram::Serialize(std::string* dest) const {
+  Varint::Append64(dest, kSubBucketBits);
+  Varint::Append64(dest, count_);
+  Varint::Append64(dest, sum_);
+  Varint::Append64(dest, min());
+  Varint::Append64(dest, max_);
+
+  // Pairs of the distance from the previous non-empty bucket and the bucket count.
+  unsigned next = 0;
+  for (unsigned i = 0; i < counts_.size(); ++i) {
+    if (counts_[i]) {
+      Varint::Append64(dest, i - next);
+      Varint::Append64(dest, counts_[i]);
+      next = i + 1;
+    }
+  }
+}
+
+bool HdrHistogram::Parse(const char* data, size_t size) {
+  Clear();
+
+  const uint8* ptr = reinterpret_cast<const uint8*>(data);
+  const uint8* end = ptr + size;
+  auto next_val = [&](uint64* val) {
+    ptr = ptr ? Varint::Parse64WithLimit(ptr, end, val) : nullptr;
+    return ptr != nullptr;
+  };
+
+  uint64 bits, count, sum, min, max;
+  if (!next_val(&bits) || bits != kSubBucketBits || !next_val(&count) || !next_val(&sum) ||
+      !next_val(&min) || !next_val(&max)) {
+    Clear();
+    return false;
+  }
+
+  uint64 index = 0;
+  while (ptr < end) {
+    uint64 gap, bucket_count;
+    if (!next_val(&gap) || !next_val(&bucket_count) || gap >= kNumCounts - index ||
+        bucket_count == 0) {
+      Clear();
+      return false;
+    }
+    index += gap;
+    AddToBucket(index, bucket_count);
+    ++index;
+  }
+
+  if (count_ != count) {
+    Clear();
+    return false;
+  }
+  sum_ = sum;
+  if (count_) {
+    min_ = min;
+    max_ = max;
+  }
+  return true;
+}
+
+std::string HdrHistogram::ToString() const {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "Count: %llu  Average: %.4f  Min: %llu  Max: %llu\n"
+           "p50: %llu  p90: %llu  p99: %llu  p99.9: %llu\n",
+           (unsigned long long)count_, Average(), (unsigned long long)min(),
+           (unsigned long long)max_, (unsigned long long)Percentile(50),
+           (unsigned long long)Percentile(90), (unsigned long long)Percentile(99),
+           (unsigned long long)Percentile(99.9));
+  return buf;
+}
+
+HdrRecorder::HdrRecorder() : counts_(new std::atomic<uint64>[HdrHistogram::kNumCounts]) {
+  for (unsigned i = 0; i < HdrHistogram::kNumCounts; ++i) {
+    counts_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void HdrRecorder::MergeInto(HdrHistogram* dest) const {
+  // The counts are derived from the buckets, so that they match each other.
+  for (unsigned i = 0; i < HdrHistogram::kNumCounts; ++i) {
+    uint64 cnt = counts_[i].load(std::memory_order_relaxed);
+    if (cnt)
+      dest->AddToBucket(i, cnt);
+  }
+  dest->sum_ += sum_.load(std::memory_order_relaxed);
+  dest->min_ = std::min(dest->min_, min_.load(std::memory_order_relaxed));
+  dest->max_ = std::max(dest->max_, max_.load(std::memory_order_relaxed));
+}
+
+}  // namespace base
@@ -0,0 +1,128 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/integral_types.h"
+
+namespace base {
+
+class HdrRecorder;
+
+/*
+  High dynamic range histogram of non-negative integers, e.g. latencies in microseconds.
+  Every power of 2 is split into 64 linear sub-buckets, hence Add() is a few integer
+  instructions and the percentiles are within 1/128 of the recorded values. Values of 2^48
+  and larger are counted in the last bucket. The buckets are allocated up to the largest
+  value recorded, which makes the microsecond latencies below a second take about 8KB.
+  Not thread-safe, see HdrRecorder for recording from multiple threads.
+*/
+class HdrHistogram {
+  friend class HdrRecorder;
+
+ public:
+  static constexpr unsigned kSubBucketBits = 6;
+  static constexpr unsigned kMaxValueBits = 48;
+  static constexpr unsigned kNumCounts = (kMaxValueBits - kSubBucketBits + 1) << kSubBucketBits;
+
+  void Add(uint64 value) { Add(value, 1); }
+  void Add(uint64 value, uint64 count);
+
+  void Merge(const HdrHistogram& other);
+  void Clear();
+
+  uint64 count() const { return count_; }
+  uint64 sum() const { return sum_; }
+  uint64 min() const { return count_ ? min_ : 0; }
+  uint64 max() const { return max_; }
+  double Average() const { return count_ ? double(sum_) / count_ : 0; }
+
+  // p in [0, 100], the 100th percentile is the exact max. Returns 0 for an empty histogram.
+  uint64 Percentile(double p) const;
+
+  // Returns the number of the values that are less than limit. Exact when limit is a bucket
+  // boundary, e.g. any power of 2 or any value below 64.
+  uint64 CountBelow(uint64 limit) const;
+
+  // Appends the compact encoding of the histogram: varints of its totals and of its
+  // non-empty buckets.
+  void Serialize(std::string* dest) const;
+
+  // Replaces the histogram with the one encoded by Serialize. Returns false if the encoding
+  // is malformed, in that case the histogram is cleared.
+  bool Parse(const char* data, size_t size);
+  bool Parse(const std::string& src) { return Parse(src.data(), src.size()); }
+
+  std::string ToString() const;
+
+  // Returns the bucket that counts value.
+  static unsigned Index(uint64 value) {
+    if (value < (1ULL << kSubBucketBits))
+      return value;
+    if (value >> kMaxValueBits)
+      return kNumCounts - 1;
+
+    unsigned exp = 63 ^ __builtin_clzll(value);  // >= kSubBucketBits
+    unsigned shift = exp - kSubBucketBits;
+    return ((shift + 1) << kSubBucketBits) + ((value >> shift) & kSubBucketMask);
+  }
+
+  // The smallest value counted by the bucket and the bucket width.
+  static uint64 LowerBound(unsigned index);
+  static uint64 Width(unsigned index) {
+    unsigned bucket = index >> kSubBucketBits;
+    return bucket ? 1ULL << (bucket - 1) : 1;
+  }
+
+ private:
+  static constexpr uint64 kSubBucketMask = (1ULL << kSubBucketBits) - 1;
+
+  void AddToBucket(unsigned index, uint64 count);
+
+  std::vector<uint64> counts_;
+  uint64 count_ = 0;
+  uint64 sum_ = 0;
+  uint64 min_ = kuint64max;
+  uint64 max_ = 0;
+};
+
+/*
+  Records values from a single thread without locks or atomic read-modify-write operations,
+  while other threads merge them into HdrHistograms, e.g. one recorder per IO thread.
+  MergeInto adds all the values recorded so far, the values that are being added
+  concurrently may be partially merged. Allocates all the buckets upfront, about 22KB.
+*/
+class HdrRecorder {
+ public:
+  HdrRecorder();
+
+  // Must be called by a single thread.
+  void Add(uint64 value) {
+    Bump(&counts_[HdrHistogram::Index(value)], 1);
+    Bump(&sum_, value);
+    if (value > max_.load(std::memory_order_relaxed))
+      max_.store(value, std::memory_order_relaxed);
+    if (value < min_.load(std::memory_order_relaxed))
+      min_.store(value, std::memory_order_relaxed);
+  }
+
+  // Thread-safe.
+  void MergeInto(HdrHistogram* dest) const;
+
+ private:
+  static void Bump(std::atomic<uint64>* val, uint64 delta) {
+    val->store(val->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  std::unique_ptr<std::atomic<uint64>[]> counts_;
+  std::atomic<uint64> sum_{0};
+  std::atomic<uint64> min_{kuint64max};
+  std::atomic<uint64> max_{0};
+};
+
+}  // namespace base
@@ -0,0 +1,121 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/hdr_histogram.h"
+
+#include <random>
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace base {
+
+class HdrHistogramTest : public testing::Test {};
+
+TEST_F(HdrHistogramTest, Index) {
+  for (uint64 v = 0; v < 64; ++v) {
+    EXPECT_EQ(v, HdrHistogram::Index(v));
+  }
+
+  // The buckets are contiguous and each one covers its values.
+  unsigned prev = HdrHistogram::Index(63);
+  for (uint64 v = 64; v < (1 << 20); ++v) {
+    unsigned index = HdrHistogram::Index(v);
+    ASSERT_LE(index, prev + 1) << v;
+    ASSERT_LE(HdrHistogram::LowerBound(index), v);
+    ASSERT_LT(v, HdrHistogram::LowerBound(index) + HdrHistogram::Width(index));
+    prev = index;
+  }
+  EXPECT_EQ(HdrHistogram::kNumCounts - 1, HdrHistogram::Index(kuint64max));
+  EXPECT_EQ(HdrHistogram::kNumCounts - 1, HdrHistogram::Index((1ULL << 48) - 1));
+}
+
+TEST_F(HdrHistogramTest, Percentiles) {
+  HdrHistogram hist;
+  EXPECT_EQ(0, hist.Percentile(50));
+
+  for (uint64 v = 1; v <= 100000; ++v) {
+    hist.Add(v);
+  }
+  EXPECT_EQ(100000, hist.count());
+  EXPECT_EQ(1, hist.min());
+  EXPECT_EQ(100000, hist.max());
+  EXPECT_EQ(5000050000ULL, hist.sum());
+
+  for (double p : {1.0, 10.0, 50.0, 90.0, 99.0, 99.9}) {
+    double expected = p * 1000;
+    EXPECT_NEAR(expected, hist.Percentile(p), expected / 128) << p;
+  }
+  EXPECT_EQ(100000, hist.Percentile(100));
+  EXPECT_EQ(1, hist.Percentile(0));
+  EXPECT_EQ(1023, hist.CountBelow(1024));
+}
+
+TEST_F(HdrHistogramTest, MergeAndSerialize) {
+  std::mt19937_64 rnd(10);
+  std::lognormal_distribution<double> dist(8, 2);
+
+  HdrHistogram a, b, all;
+  for (unsigned i = 0; i < 10000; ++i) {
+    uint64 v = dist(rnd);
+    (i % 2 ? a : b).Add(v);
+    all.Add(v);
+  }
+  a.Merge(b);
+  EXPECT_EQ(all.count(), a.count());
+  EXPECT_EQ(all.sum(), a.sum());
+  EXPECT_EQ(all.Percentile(99), a.Percentile(99));
+
+  std::string buf;
+  a.Serialize(&buf);
+  EXPECT_LT(buf.size(), 2000);
+
+  HdrHistogram parsed;
+  ASSERT_TRUE(parsed.Parse(buf));
+  EXPECT_EQ(a.ToString(), parsed.ToString());
+  EXPECT_EQ(a.CountBelow(4096), parsed.CountBelow(4096));
+
+  EXPECT_FALSE(parsed.Parse(buf.substr(0, buf.size() - 1)));
+  EXPECT_EQ(0, parsed.count());
+  EXPECT_FALSE(parsed.Parse("\x07"));
+
+  HdrHistogram empty;
+  buf.clear();
+  empty.Serialize(&buf);
+  ASSERT_TRUE(parsed.Parse(buf));
+  EXPECT_EQ(0, parsed.count());
+}
+
+TEST_F(HdrHistogramTest, Recorder) {
+  constexpr unsigned kThreads = 4;
+  std::vector<std::unique_ptr<HdrRecorder>> recorders;
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < kThreads; ++i) {
+    recorders.emplace_back(new HdrRecorder);
+    threads.emplace_back([rec = recorders.back().get(), i] {
+      for (uint64 v = 1; v <= 10000; ++v) {
+        rec->Add(v * (i + 1));
+      }
+    });
+  }
+
+  // Merging concurrently with the recording is allowed.
+  HdrHistogram partial;
+  recorders[0]->MergeInto(&partial);
+  EXPECT_LE(partial.count(), 10000);
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  HdrHistogram hist;
+  for (const auto& rec : recorders) {
+    rec->MergeInto(&hist);
+  }
+  EXPECT_EQ(kThreads * 10000, hist.count());
+  EXPECT_EQ(1, hist.min());
+  EXPECT_EQ(kThreads * 10000, hist.max());
+}
+
+}  // namespace base
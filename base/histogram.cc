@@ -105,6 +105,14 @@ double Histogram::Percentile(double p) const {
   return max_;
 }
 
+unsigned long Histogram::CountBelow(double limit) const {
+  ulong res = 0;
+  for (unsigned b = 0; b < buckets_.size() && kBucketLimit[b] <= limit; ++b) {
+    res += buckets_[b];
+  }
+  return res;
+}
+
 double Histogram::Average() const {
   if (num_ == 0) return 0;
   return sum_ / num_;
@@ -36,6 +36,11 @@ class Histogram {
   double StdDev() const;
   double max() const { return max_;}
   double min() const { return min_;}
+  double sum() const { return sum_;}
+
+  // Returns the number of the values that are less than limit. Exact only when limit is
+  // one of the bucket limits, e.g. 1, 2 or 5 times a power of 10.
+  unsigned long CountBelow(double limit) const;
 
   // trim_low_percentile, trim_high_percentile in [0, 100].
   // Returns truncated mean according to http://en.wikipedia.org/wiki/Truncated_mean
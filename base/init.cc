@@ -4,13 +4,20 @@
 
 #include "base/init.h"
 
+#include <cstdio>
+#include <mutex>
+
 #include "absl/debugging/failure_signal_handler.h"
 #include "absl/debugging/symbolize.h"
+#include "base/async_logger.h"
+#include "base/flags.h"
 #include "base/logging.h"
 #include "base/walltime.h"
 
 // #include <gperftools/malloc_extension.h>
 
+DECLARE_bool(log_async);
+
 namespace __internal__ {
 
 ModuleInitializer::ModuleInitializer(VoidFunction ftor, bool is_ctor)
@@ -34,16 +41,78 @@ void ModuleInitializer::RunFtors(bool is_ctor) {
 
 }  // namespace __internal__
 
+namespace base {
+
+namespace {
+
+struct Timeline {
+  std::mutex mu;
+  uint64_t last = 0;  // the micros of the last mark.
+  std::vector<std::pair<std::string, uint64_t>> phases;
+};
+
+Timeline& GetTimeline() {
+  static Timeline timeline;
+  return timeline;
+}
+
+// Starts the first phase.
+void StartTimeline() {
+  Timeline& tl = GetTimeline();
+  std::lock_guard<std::mutex> lk(tl.mu);
+  tl.last = GetMonotonicMicros();
+}
+
+}  // namespace
+
+void StartupTimeline::Mark(const char* phase) {
+  uint64_t now = GetMonotonicMicros();
+  Timeline& tl = GetTimeline();
+
+  std::lock_guard<std::mutex> lk(tl.mu);
+  if (tl.last == 0)
+    tl.last = now;
+  tl.phases.emplace_back(phase, now - tl.last);
+  tl.last = now;
+}
+
+std::vector<std::pair<std::string, uint64_t>> StartupTimeline::Phases() {
+  Timeline& tl = GetTimeline();
+  std::lock_guard<std::mutex> lk(tl.mu);
+  return tl.phases;
+}
+
+std::string StartupTimeline::ToString() {
+  std::string res;
+  uint64_t total = 0;
+  char buf[32];
+  for (const auto& k_v : Phases()) {
+    snprintf(buf, sizeof(buf), ": %.2fms, ", k_v.second / 1000.0);
+    res.append(k_v.first).append(buf);
+    total += k_v.second;
+  }
+  snprintf(buf, sizeof(buf), "total: %.2fms", total / 1000.0);
+  return res.append(buf);
+}
+
+}  // namespace base
+
 #undef MainInitGuard
 
 MainInitGuard::MainInitGuard(int* argc, char*** argv) {
+  base::StartTimeline();
+
   // MallocExtension::Initialize();
   google::ParseCommandLineFlags(argc, argv, true);
   google::InitGoogleLogging((*argv)[0]);
+  if (FLAGS_log_async)
+    base::StartAsyncLogging();
+  base::StartupTimeline::Mark("flags_and_logging");
 
   absl::InitializeSymbolizer((*argv)[0]);
   absl::FailureSignalHandlerOptions options;
   absl::InstallFailureSignalHandler(options);
+  base::StartupTimeline::Mark("symbolizer");
 
   base::kProgramName = (*argv)[0];
 
@@ -54,10 +123,12 @@ MainInitGuard::MainInitGuard(int* argc, char*** argv) {
 #endif
   base::SetupJiffiesTimer();
   __internal__::ModuleInitializer::RunFtors(true);
+  base::StartupTimeline::Mark("module_init");
 }
 
 MainInitGuard::~MainInitGuard() {
   __internal__::ModuleInitializer::RunFtors(false);
   base::DestroyJiffiesTimer();
+  base::StopAsyncLogging();
   google::ShutdownGoogleLogging();
 }
@@ -3,6 +3,10 @@
 //
 #pragma once
 
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "base/flags.h"
 #include "base/logging.h"
 
@@ -48,6 +52,25 @@ class ModuleInitializer {
         google_destruct_module_##name, false);               \
   }
 
+namespace base {
+
+// Timeline of the process startup, which attributes the init time of short jobs to the
+// subsystems. Each Mark() ends the phase that started with the previous mark, the first phase
+// starts when MainInitGuard is constructed. The subsystems that start lazily mark their init
+// when it happens. Thread-safe.
+class StartupTimeline {
+ public:
+  static void Mark(const char* phase);
+
+  // Pairs of the phase name and its duration in microseconds, in the order of the marks.
+  static std::vector<std::pair<std::string, uint64_t>> Phases();
+
+  // E.g. "flags: 0.12ms, io_pool: 1.50ms, total: 1.62ms".
+  static std::string ToString();
+};
+
+}  // namespace base
+
 class MainInitGuard {
  public:
    MainInitGuard(int* argc, char*** argv);
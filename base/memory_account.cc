@@ -0,0 +1,37 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/memory_account.h"
+
+#include <cstring>
+#include <mutex>
+
+namespace base {
+
+namespace {
+
+std::mutex accounts_mu;
+MemoryAccount* accounts_head = nullptr;  // guarded by accounts_mu.
+
+}  // namespace
+
+MemoryAccount* MemoryAccount::Get(const char* name) {
+  std::lock_guard<std::mutex> lk(accounts_mu);
+
+  MemoryAccount** next = &accounts_head;
+  for (; *next; next = &(*next)->next_) {
+    if (!strcmp((*next)->name_, name))
+      return *next;
+  }
+  *next = new MemoryAccount(name);  // never destroyed.
+  return *next;
+}
+
+void MemoryAccount::ForEach(const std::function<void(const MemoryAccount&)>& cb) {
+  std::lock_guard<std::mutex> lk(accounts_mu);
+  for (const MemoryAccount* acc = accounts_head; acc; acc = acc->next_) {
+    cb(*acc);
+  }
+}
+
+}  // namespace base
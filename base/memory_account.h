@@ -0,0 +1,117 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace base {
+
+/*
+  Live bytes and the high-water mark of the memory held by a subsystem, e.g. the buffers of
+  the mapreduce outputs. The owners charge the account when they allocate and release it
+  when they free, the accounts are listed by the "memory" varz.
+
+  Accounts are registered for the process lifetime and are never destroyed, hence they are
+  created once on the heap, see MemoryAccount::Get.
+*/
+class MemoryAccount {
+ public:
+  MemoryAccount(const MemoryAccount&) = delete;
+  void operator=(const MemoryAccount&) = delete;
+
+  // Returns the account of the subsystem, creates it on the first call. name must be a
+  // literal. Callers keep the pointer in a function static to avoid the lookup.
+  static MemoryAccount* Get(const char* name);
+
+  // Thread-safe.
+  void Charge(size_t bytes) {
+    size_t live = live_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t peak = peak_.load(std::memory_order_relaxed);
+    while (live > peak && !peak_.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+  }
+
+  void Release(size_t bytes) { live_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+  const char* name() const { return name_; }
+  size_t live() const { return live_.load(std::memory_order_relaxed); }
+  size_t peak() const { return peak_.load(std::memory_order_relaxed); }
+
+  // Calls cb for every account in the order of Get.
+  static void ForEach(const std::function<void(const MemoryAccount&)>& cb);
+
+ private:
+  explicit MemoryAccount(const char* name) : name_(name) {}
+
+  const char* name_;
+  std::atomic<size_t> live_{0}, peak_{0};
+  MemoryAccount* next_ = nullptr;
+};
+
+/*
+  The bytes that an object holds in an account. Set() charges or releases the difference from
+  the previous value, the destructor releases all of them. Not thread-safe.
+*/
+class MemoryCharge {
+ public:
+  explicit MemoryCharge(MemoryAccount* account) : account_(account) {}
+  MemoryCharge(const MemoryCharge&) = delete;
+  ~MemoryCharge() { Set(0); }
+
+  void operator=(const MemoryCharge&) = delete;
+
+  void Set(size_t bytes) {
+    if (bytes > bytes_)
+      account_->Charge(bytes - bytes_);
+    else
+      account_->Release(bytes_ - bytes);
+    bytes_ = bytes;
+  }
+
+  size_t bytes() const { return bytes_; }
+
+ private:
+  MemoryAccount* account_;
+  size_t bytes_ = 0;
+};
+
+/*
+  Stateless allocator that charges the allocations of a container to the account returned by
+  Tag::account(), e.g.
+
+    struct FreqMapTag { static MemoryAccount* account(); };
+    absl::flat_hash_map<K, V, Hash, Eq, accounted_allocator<std::pair<const K, V>, FreqMapTag>>
+*/
+template <typename T, typename Tag> class accounted_allocator {
+ public:
+  using value_type = T;
+
+  template <typename U> struct rebind { using other = accounted_allocator<U, Tag>; };
+
+  accounted_allocator() noexcept {}
+  template <typename U> accounted_allocator(const accounted_allocator<U, Tag>&) noexcept {}
+
+  T* allocate(size_t n) {
+    T* res = std::allocator<T>().allocate(n);
+    Tag::account()->Charge(n * sizeof(T));
+    return res;
+  }
+
+  void deallocate(T* p, size_t n) {
+    Tag::account()->Release(n * sizeof(T));
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U> bool operator==(const accounted_allocator<U, Tag>&) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const accounted_allocator<U, Tag>&) const {
+    return false;
+  }
+};
+
+}  // namespace base
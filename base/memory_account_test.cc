@@ -0,0 +1,57 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/memory_account.h"
+
+#include <vector>
+
+#include "base/gtest.h"
+
+namespace base {
+
+class MemoryAccountTest : public testing::Test {};
+
+struct TestTag {
+  static MemoryAccount* account() {
+    static MemoryAccount* res = MemoryAccount::Get("test.vector");
+    return res;
+  }
+};
+
+TEST_F(MemoryAccountTest, Charge) {
+  MemoryAccount* acc = MemoryAccount::Get("test.charge");
+  EXPECT_EQ(acc, MemoryAccount::Get("test.charge"));
+
+  acc->Charge(100);
+  acc->Charge(50);
+  acc->Release(120);
+  EXPECT_EQ(30, acc->live());
+  EXPECT_EQ(150, acc->peak());
+
+  {
+    MemoryCharge charge(acc);
+    charge.Set(200);
+    charge.Set(70);
+    EXPECT_EQ(100, acc->live());
+    EXPECT_EQ(230, acc->peak());
+  }
+  EXPECT_EQ(30, acc->live());
+
+  bool found = false;
+  MemoryAccount::ForEach([&](const MemoryAccount& a) { found |= (&a == acc); });
+  EXPECT_TRUE(found);
+}
+
+TEST_F(MemoryAccountTest, Allocator) {
+  MemoryAccount* acc = TestTag::account();
+  {
+    std::vector<int, accounted_allocator<int, TestTag>> vec(1000);
+    EXPECT_EQ(1000 * sizeof(int), acc->live());
+    vec.resize(3000);
+    EXPECT_EQ(3000 * sizeof(int), acc->live());
+  }
+  EXPECT_EQ(0, acc->live());
+  EXPECT_EQ(4000 * sizeof(int), acc->peak());  // both buffers during the resize.
+}
+
+}  // namespace base
@@ -0,0 +1,45 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/mpmc_unbounded_queue.h"
+
+#include "base/logging.h"
+
+namespace base {
+namespace detail {
+
+namespace {
+
+std::mutex slots_mu;
+bool slots_used[kMaxHazardThreads] = {false};  // guarded by slots_mu.
+
+struct ThreadSlot {
+  unsigned index = kMaxHazardThreads;
+
+  ThreadSlot() {
+    std::lock_guard<std::mutex> lk(slots_mu);
+    for (unsigned i = 0; i < kMaxHazardThreads; ++i) {
+      if (!slots_used[i]) {
+        slots_used[i] = true;
+        index = i;
+        return;
+      }
+    }
+  }
+
+  ~ThreadSlot() {
+    std::lock_guard<std::mutex> lk(slots_mu);
+    slots_used[index] = false;
+  }
+};
+
+}  // namespace
+
+unsigned HazardSlot() {
+  static thread_local ThreadSlot slot;
+  CHECK_LT(slot.index, kMaxHazardThreads) << "Too many threads use mpmc_unbounded_queue";
+  return slot.index;
+}
+
+}  // namespace detail
+}  // namespace base
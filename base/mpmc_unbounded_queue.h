@@ -0,0 +1,276 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace base {
+
+namespace detail {
+
+constexpr unsigned kMaxHazardThreads = 256;
+
+// Index of the calling thread in [0, kMaxHazardThreads), reused after the thread exits.
+unsigned HazardSlot();
+
+}  // namespace detail
+
+/*
+  Unbounded lock-free MPMC queue: a linked list of segments with kSegmentSize cells each,
+  based on the FAA array queue of Ramalhete and Correia. Producers and consumers claim cells
+  with fetch_add on the indices of the tail and the head segments, a new segment is linked when
+  the tail one is full. Drained segments are reclaimed with hazard pointers, so at most
+  kMaxHazardThreads threads may use the queue concurrently.
+
+  Unlike mpmc_bounded_queue, enqueue never fails, the memory grows with the backlog and shrinks
+  when it is consumed.
+*/
+template <typename T, size_t kSegmentSize = 1024> class mpmc_unbounded_queue {
+ public:
+  using item_type = T;
+
+  mpmc_unbounded_queue() {
+    Segment* seg = new Segment;
+    head_.store(seg, std::memory_order_relaxed);
+    tail_.store(seg, std::memory_order_relaxed);
+  }
+
+  mpmc_unbounded_queue(mpmc_unbounded_queue const&) = delete;
+  mpmc_unbounded_queue& operator=(mpmc_unbounded_queue const&) = delete;
+
+  ~mpmc_unbounded_queue() {
+    for (Segment* seg = head_.load(std::memory_order_relaxed); seg;) {
+      Segment* next = seg->next.load(std::memory_order_relaxed);
+      delete seg;
+      seg = next;
+    }
+    for (Segment* seg : retired_)
+      delete seg;
+  }
+
+  // Moves or copies data into the queue. Like mpmc_bounded_queue::try_enqueue, data is left
+  // intact until the cell that stores it is claimed.
+  template <typename U> void enqueue(U&& data) {
+    HazardGuard guard(this);
+    while (true) {
+      Segment* tail = guard.Protect(tail_);
+      size_t idx = tail->enq_idx.fetch_add(1, std::memory_order_relaxed);
+      if (idx < kSegmentSize) {
+        if (tail->cells[idx].Store(std::forward<U>(data)))
+          return;
+        continue;  // a consumer gave up on the cell.
+      }
+      AdvanceTail(tail);
+    }
+  }
+
+  // Enqueues [first, first + n) in order of a single producer, claims up to n cells at once.
+  template <typename It> void enqueue_bulk(It first, size_t n) {
+    HazardGuard guard(this);
+    while (n) {
+      Segment* tail = guard.Protect(tail_);
+      size_t idx = tail->enq_idx.fetch_add(n, std::memory_order_relaxed);
+      if (idx >= kSegmentSize) {
+        AdvanceTail(tail);
+        continue;
+      }
+
+      size_t end = std::min(idx + n, kSegmentSize);
+      for (; idx < end; ++idx) {
+        if (tail->cells[idx].Store(std::move(*first))) {
+          ++first;
+          --n;
+        }
+      }
+    }
+  }
+
+  bool try_dequeue(T& data) {
+    HazardGuard guard(this);
+    while (true) {
+      Segment* head = guard.Protect(head_);
+      if (IsDrained(head))
+        return false;
+
+      size_t idx = head->deq_idx.fetch_add(1, std::memory_order_relaxed);
+      if (idx < kSegmentSize) {
+        if (head->cells[idx].Take(&data))
+          return true;
+        continue;  // the producer did not reach the cell yet, it will use another one.
+      }
+      if (!AdvanceHead(head))
+        return false;
+    }
+  }
+
+  // Dequeues up to max items into dest, returns their number. Claims the cells that are
+  // available in the head segment at once.
+  size_t try_dequeue_bulk(T* dest, size_t max) {
+    HazardGuard guard(this);
+    size_t res = 0;
+    while (res < max) {
+      Segment* head = guard.Protect(head_);
+      if (IsDrained(head))
+        break;
+
+      size_t deq = head->deq_idx.load(std::memory_order_relaxed);
+      size_t enq = std::min(head->enq_idx.load(std::memory_order_acquire), kSegmentSize);
+      size_t cnt = enq > deq ? std::min(enq - deq, max - res) : 1;
+
+      size_t idx = head->deq_idx.fetch_add(cnt, std::memory_order_relaxed);
+      if (idx >= kSegmentSize) {
+        if (!AdvanceHead(head))
+          break;
+        continue;
+      }
+
+      size_t end = std::min(idx + cnt, kSegmentSize);
+      for (; idx < end; ++idx) {
+        if (head->cells[idx].Take(dest + res))
+          ++res;
+      }
+    }
+    return res;
+  }
+
+ private:
+  enum CellState : uint8_t { EMPTY, WRITING, FULL, TAKEN };
+
+  struct Cell {
+    std::atomic<uint8_t> state{EMPTY};
+    std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+
+    T* ptr() { return reinterpret_cast<T*>(&storage); }
+
+    template <typename U> bool Store(U&& data) {
+      uint8_t expected = EMPTY;
+      if (!state.compare_exchange_strong(expected, WRITING, std::memory_order_acquire))
+        return false;
+      new (&storage) T(std::forward<U>(data));
+      state.store(FULL, std::memory_order_release);
+      return true;
+    }
+
+    // Returns false if the cell was abandoned before its producer claimed it.
+    bool Take(T* dest) {
+      uint8_t expected = EMPTY;
+      if (state.compare_exchange_strong(expected, TAKEN, std::memory_order_acquire))
+        return false;
+
+      // The producer claimed the cell, WRITING lasts for the construction of the item only.
+      while (state.load(std::memory_order_acquire) != FULL) {
+      }
+      *dest = std::move(*ptr());
+      ptr()->~T();
+      state.store(TAKEN, std::memory_order_relaxed);
+      return true;
+    }
+  };
+
+  struct Segment {
+    alignas(64) std::atomic<size_t> enq_idx{0};
+    alignas(64) std::atomic<size_t> deq_idx{0};
+    alignas(64) std::atomic<Segment*> next{nullptr};
+    Cell cells[kSegmentSize];
+
+    ~Segment() {
+      for (Cell& c : cells) {
+        if (c.state.load(std::memory_order_relaxed) == FULL)
+          c.ptr()->~T();
+      }
+    }
+  };
+
+  struct alignas(64) Hazard {
+    std::atomic<Segment*> ptr{nullptr};
+  };
+
+  class HazardGuard {
+   public:
+    explicit HazardGuard(mpmc_unbounded_queue* q) : hazard_(q->hazards_[detail::HazardSlot()]) {}
+    ~HazardGuard() { hazard_.ptr.store(nullptr, std::memory_order_release); }
+
+    Segment* Protect(const std::atomic<Segment*>& src) {
+      Segment* seg = src.load(std::memory_order_acquire);
+      while (true) {
+        hazard_.ptr.store(seg, std::memory_order_seq_cst);
+        Segment* cur = src.load(std::memory_order_seq_cst);
+        if (cur == seg)
+          return seg;
+        seg = cur;
+      }
+    }
+
+   private:
+    Hazard& hazard_;
+  };
+
+  bool IsDrained(Segment* seg) const {
+    return seg->deq_idx.load(std::memory_order_relaxed) >=
+               seg->enq_idx.load(std::memory_order_relaxed) &&
+           seg->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+  // Links a new segment after the full tail or helps to advance tail_ to the linked one.
+  void AdvanceTail(Segment* tail) {
+    Segment* next = tail->next.load(std::memory_order_acquire);
+    if (!next) {
+      Segment* seg = new Segment;
+      if (tail->next.compare_exchange_strong(next, seg, std::memory_order_acq_rel)) {
+        next = seg;
+      } else {
+        delete seg;  // another producer linked its segment first.
+      }
+    }
+    tail_.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
+  }
+
+  // Unlinks the drained head, returns false if it is the last segment.
+  bool AdvanceHead(Segment* head) {
+    Segment* next = head->next.load(std::memory_order_acquire);
+    if (!next)
+      return false;
+
+    // head_ must not pass tail_, otherwise producers could protect a retired segment.
+    Segment* tail = head;
+    tail_.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
+    if (head_.compare_exchange_strong(head, next, std::memory_order_acq_rel))
+      Retire(head);
+    return true;
+  }
+
+  // Frees the retired segments that are not protected by any thread.
+  void Retire(Segment* seg) {
+    std::lock_guard<std::mutex> lk(retire_mu_);
+    retired_.push_back(seg);
+
+    std::vector<Segment*> protected_segs;
+    for (const Hazard& h : hazards_) {
+      if (Segment* p = h.ptr.load(std::memory_order_seq_cst))
+        protected_segs.push_back(p);
+    }
+    std::sort(protected_segs.begin(), protected_segs.end());
+
+    auto it = std::partition(retired_.begin(), retired_.end(), [&](Segment* s) {
+      return std::binary_search(protected_segs.begin(), protected_segs.end(), s);
+    });
+    for (auto del = it; del != retired_.end(); ++del)
+      delete *del;
+    retired_.erase(it, retired_.end());
+  }
+
+  alignas(64) std::atomic<Segment*> head_;
+  alignas(64) std::atomic<Segment*> tail_;
+
+  Hazard hazards_[detail::kMaxHazardThreads];
+
+  std::mutex retire_mu_;
+  std::vector<Segment*> retired_;  // guarded by retire_mu_.
+};
+
+}  // namespace base
@@ -0,0 +1,128 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/mpmc_unbounded_queue.h"
+
+#include <memory>
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace base {
+
+class MPMCUnboundedTest : public testing::Test {};
+
+struct B {
+  static int ref;
+
+  B() { ++ref; }
+  B(const B&) { ++ref; }
+  B(B&&) { ++ref; }
+  B& operator=(B&&) = default;
+
+  ~B() { --ref; }
+};
+
+int B::ref = 0;
+
+TEST_F(MPMCUnboundedTest, Basic) {
+  mpmc_unbounded_queue<int, 4> q;
+  int tmp = 0;
+  ASSERT_FALSE(q.try_dequeue(tmp));
+
+  // Spans several segments.
+  for (int i = 0; i < 10; ++i) {
+    q.enqueue(i);
+  }
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(q.try_dequeue(tmp));
+    EXPECT_EQ(i, tmp);
+  }
+  ASSERT_FALSE(q.try_dequeue(tmp));
+
+  mpmc_unbounded_queue<std::unique_ptr<int>> ptr_q;
+  auto ptr = std::make_unique<int>(3);
+  ptr_q.enqueue(std::move(ptr));
+  ASSERT_FALSE(ptr);
+  ASSERT_TRUE(ptr_q.try_dequeue(ptr));
+  EXPECT_EQ(3, *ptr);
+}
+
+TEST_F(MPMCUnboundedTest, Bulk) {
+  mpmc_unbounded_queue<int, 8> q;
+  vector<int> src(21);
+  for (int i = 0; i < 21; ++i)
+    src[i] = i;
+  q.enqueue_bulk(src.begin(), src.size());
+
+  int dest[32];
+  size_t cnt = 0;
+  while (size_t n = q.try_dequeue_bulk(dest + cnt, 5)) {
+    ASSERT_LE(n, 5);
+    cnt += n;
+  }
+  ASSERT_EQ(21, cnt);
+  for (int i = 0; i < 21; ++i) {
+    EXPECT_EQ(i, dest[i]);
+  }
+}
+
+TEST_F(MPMCUnboundedTest, Dtor) {
+  {
+    mpmc_unbounded_queue<B, 4> q;
+    for (unsigned j = 0; j < 10; ++j) {
+      q.enqueue(B{});
+    }
+    EXPECT_EQ(10, B::ref);
+
+    B b;
+    ASSERT_TRUE(q.try_dequeue(b));
+    EXPECT_EQ(10, B::ref);
+  }
+  EXPECT_EQ(0, B::ref);
+}
+
+TEST_F(MPMCUnboundedTest, Threads) {
+  constexpr unsigned kProducers = 4, kConsumers = 4, kItems = 100000;
+  mpmc_unbounded_queue<uint64_t, 64> q;
+  atomic<uint64_t> sum{0}, count{0};
+
+  vector<thread> threads;
+  for (unsigned p = 0; p < kProducers; ++p) {
+    threads.emplace_back([&, p] {
+      uint64_t batch[7];
+      for (unsigned i = 0; i < kItems;) {
+        if (i % 3 == 0 && i + 7 <= kItems) {
+          for (unsigned j = 0; j < 7; ++j)
+            batch[j] = p * kItems + i + j;
+          q.enqueue_bulk(batch, 7);
+          i += 7;
+        } else {
+          q.enqueue(p * kItems + i++);
+        }
+      }
+    });
+  }
+  for (unsigned c = 0; c < kConsumers; ++c) {
+    threads.emplace_back([&, c] {
+      uint64_t buf[16];
+      while (count.load() < kProducers * kItems) {
+        size_t n = (c % 2) ? q.try_dequeue_bulk(buf, 16) : q.try_dequeue(buf[0]);
+        for (size_t i = 0; i < n; ++i)
+          sum += buf[i];
+        count += n;
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  uint64_t total = kProducers * kItems;
+  EXPECT_EQ(total, count);
+  EXPECT_EQ(total * (total - 1) / 2, sum);
+}
+
+}  // namespace base
@@ -3,8 +3,12 @@
 //
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <memory>
+#include <utility>
+
+#include "base/mpmc_bounded_queue.h"
 
 namespace base {
 
@@ -135,4 +139,155 @@ template <typename T> class ScopeGuard {
   T* obj_;
 };
 
+/*
+  Process-wide pool of T shared by all the threads, for objects that are acquired by one owner
+  and released by another or that would peak per owner in ObjectPool, e.g. per connection.
+  Two levels, like the magazines of the Bonwick slab allocator:
+
+  * Each thread caches up to two magazines of kMagazineSize objects, so Get() and Release()
+    touch only the thread-local state in the common case.
+  * When both of them are full or empty, the thread exchanges a whole magazine with the depot,
+    a bounded lock-free queue of full magazines.
+
+  The depot holds at most kMaxIdle objects (rounded up to whole magazines), a thread spilling into
+  the full depot deletes the objects of its magazine, hence the idle memory is capped at
+  kMaxIdle + 2 * kMagazineSize objects per thread. Trim() releases the depot to the system,
+  the cache of an exiting thread spills to the depot.
+
+  Like ObjectPool, the released objects are reused as is, without being reset.
+  T must be default constructible. Different T, kMaxIdle or kMagazineSize make different pools.
+*/
+template <typename T, size_t kMaxIdle = 4096, unsigned kMagazineSize = 32>
+class SharedObjectPool {
+  static_assert(kMagazineSize > 0, "");
+
+ public:
+  struct Deleter {
+    void operator()(T* t) const { Release(t); }
+  };
+  using unique_ptr = std::unique_ptr<T, Deleter>;
+
+  SharedObjectPool() = delete;
+
+  static T* Get() {
+    ThreadCache& cache = thread_cache();
+    if (cache.loaded->count == 0) {
+      if (cache.previous->count) {
+        std::swap(cache.loaded, cache.previous);
+      } else {
+        Magazine* full;
+        if (!depot().full.try_dequeue(full)) {
+          live_.fetch_add(1, std::memory_order_relaxed);
+          return new T();
+        }
+        PutEmpty(cache.previous);
+        cache.previous = cache.loaded;
+        cache.loaded = full;
+      }
+    }
+    return cache.loaded->objs[--cache.loaded->count];
+  }
+
+  static unique_ptr make_unique() { return unique_ptr(Get()); }
+
+  // t may come from Get() of any thread.
+  static void Release(T* t) {
+    ThreadCache& cache = thread_cache();
+    if (cache.loaded->count == kMagazineSize) {
+      if (cache.previous->count == kMagazineSize) {
+        if (depot().full.try_enqueue(cache.previous)) {
+          cache.previous = TakeEmpty();
+        } else {
+          DeleteObjects(cache.previous);  // the depot is at capacity.
+        }
+      }
+      std::swap(cache.loaded, cache.previous);
+    }
+    cache.loaded->objs[cache.loaded->count++] = t;
+  }
+
+  // Deletes the idle objects in the depot. The objects cached by threads are left intact.
+  static void Trim() {
+    Magazine* m;
+    while (depot().full.try_dequeue(m)) {
+      DeleteObjects(m);
+      PutEmpty(m);
+    }
+  }
+
+  // Returns the number of objects allocated by the pool and not deleted yet, both idle and in use.
+  static size_t live() { return live_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Magazine {
+    unsigned count = 0;
+    T* objs[kMagazineSize];
+  };
+
+  static constexpr size_t DepotCapacity() {
+    size_t magazines = (kMaxIdle + kMagazineSize - 1) / kMagazineSize;
+    size_t res = 2;  // the minimum of mpmc_bounded_queue.
+    while (res < magazines)
+      res *= 2;
+    return res;
+  }
+
+  struct Depot {
+    mpmc_bounded_queue<Magazine*> full{DepotCapacity()};
+    mpmc_bounded_queue<Magazine*> empty{DepotCapacity()};
+  };
+
+  struct ThreadCache {
+    Magazine* loaded = new Magazine;
+    Magazine* previous = new Magazine;
+
+    ~ThreadCache() {
+      Spill(loaded);
+      Spill(previous);
+    }
+
+    static void Spill(Magazine* m) {
+      if (m->count == 0) {
+        PutEmpty(m);
+      } else if (!depot().full.try_enqueue(m)) {
+        DeleteObjects(m);
+        PutEmpty(m);
+      }
+    }
+  };
+
+  // Never destroyed, so that the caches of the threads that exit late can still spill into it.
+  static Depot& depot() {
+    static Depot* depot = new Depot;
+    return *depot;
+  }
+
+  static ThreadCache& thread_cache() {
+    thread_local ThreadCache cache;
+    return cache;
+  }
+
+  static Magazine* TakeEmpty() {
+    Magazine* m;
+    return depot().empty.try_dequeue(m) ? m : new Magazine;
+  }
+
+  static void PutEmpty(Magazine* m) {
+    if (!depot().empty.try_enqueue(m))
+      delete m;
+  }
+
+  static void DeleteObjects(Magazine* m) {
+    for (unsigned i = 0; i < m->count; ++i)
+      delete m->objs[i];
+    live_.fetch_sub(m->count, std::memory_order_relaxed);
+    m->count = 0;
+  }
+
+  static std::atomic<size_t> live_;
+};
+
+template <typename T, size_t kMaxIdle, unsigned kMagazineSize>
+std::atomic<size_t> SharedObjectPool<T, kMaxIdle, kMagazineSize>::live_{0};
+
 }  // namespace base
@@ -0,0 +1,125 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/object_pool.h"
+
+#include <thread>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace base {
+
+class SharedObjectPoolTest : public testing::Test {};
+
+template <int kTag> struct Obj {
+  int val = 0;
+};
+
+TEST_F(SharedObjectPoolTest, Reuse) {
+  using Pool = SharedObjectPool<Obj<0>>;
+
+  Obj<0>* a = Pool::Get();
+  a->val = 5;
+  Pool::Release(a);
+  EXPECT_EQ(a, Pool::Get());
+  EXPECT_EQ(5, a->val);  // reused as is.
+  Pool::Release(a);
+
+  {
+    Pool::unique_ptr ptr = Pool::make_unique();
+    EXPECT_EQ(a, ptr.get());
+  }
+  EXPECT_EQ(1, Pool::live());
+}
+
+TEST_F(SharedObjectPoolTest, Cap) {
+  // 2 magazines in the depot, 2 in the thread cache.
+  using Pool = SharedObjectPool<Obj<1>, 8, 4>;
+
+  vector<Obj<1>*> objs;
+  for (int i = 0; i < 100; ++i)
+    objs.push_back(Pool::Get());
+  EXPECT_EQ(100, Pool::live());
+
+  for (auto* o : objs)
+    Pool::Release(o);
+  EXPECT_EQ(16, Pool::live());
+
+  Pool::Trim();
+  EXPECT_EQ(8, Pool::live());
+
+  // The cached objects are reused first, then the pool allocates.
+  objs.clear();
+  for (int i = 0; i < 10; ++i)
+    objs.push_back(Pool::Get());
+  EXPECT_EQ(10, Pool::live());
+  for (auto* o : objs)
+    Pool::Release(o);
+}
+
+TEST_F(SharedObjectPoolTest, CrossThread) {
+  using Pool = SharedObjectPool<Obj<2>, 64, 4>;
+
+  vector<Obj<2>*> objs;
+  for (int i = 0; i < 40; ++i)
+    objs.push_back(Pool::Get());
+
+  // The cache of the exiting thread spills into the depot.
+  thread([&] {
+    for (auto* o : objs)
+      Pool::Release(o);
+  }).join();
+  EXPECT_EQ(40, Pool::live());
+
+  objs.clear();
+  for (int i = 0; i < 40; ++i)
+    objs.push_back(Pool::Get());
+  EXPECT_EQ(40, Pool::live());
+  for (auto* o : objs)
+    Pool::Release(o);
+}
+
+struct Busy {
+  std::atomic_bool in_use{false};
+};
+
+TEST_F(SharedObjectPoolTest, Concurrent) {
+  using Pool = SharedObjectPool<Busy, 32, 4>;
+  constexpr int kThreads = 4;
+
+  // The threads pass the objects to each other through the queue.
+  mpmc_bounded_queue<Busy*> handoff(1024);
+  vector<thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 20000; ++i) {
+        Busy* b = Pool::Get();
+        ASSERT_FALSE(b->in_use.exchange(true));
+        if (!handoff.try_enqueue(b)) {
+          b->in_use = false;
+          Pool::Release(b);
+        }
+        if (i % 2 && handoff.try_dequeue(b)) {
+          b->in_use = false;
+          Pool::Release(b);
+        }
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  Busy* b;
+  while (handoff.try_dequeue(b)) {
+    b->in_use = false;
+    Pool::Release(b);
+  }
+  Pool::Trim();
+  EXPECT_LE(Pool::live(), 8);  // the cache of this thread.
+}
+
+}  // namespace base
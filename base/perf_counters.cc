@@ -0,0 +1,81 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/perf_counters.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace base {
+
+namespace {
+
+constexpr uint64_t kConfig[PerfCounters::NUM_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES};
+
+int OpenEvent(uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group_fd < 0;  // the group starts with its leader.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+
+  // This thread on any cpu.
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+}  // namespace
+
+PerfCounters::PerfCounters() {
+  fds_[CYCLES] = OpenEvent(kConfig[CYCLES], -1);
+  for (unsigned i = 1; i < NUM_EVENTS; ++i) {
+    fds_[i] = valid() ? OpenEvent(kConfig[i], fds_[CYCLES]) : -1;
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds_) {
+    if (fd >= 0)
+      close(fd);
+  }
+}
+
+void PerfCounters::Start() {
+  if (!valid())
+    return;
+  ioctl(fds_[CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds_[CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void PerfCounters::Stop() {
+  if (!valid())
+    return;
+  ioctl(fds_[CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  // The number of the events followed by their values in the order they joined the group.
+  uint64_t buf[1 + NUM_EVENTS] = {0};
+  if (read(fds_[CYCLES], buf, sizeof(buf)) <= 0)
+    return;
+
+  unsigned next = 1;
+  for (unsigned i = 0; i < NUM_EVENTS; ++i) {
+    values_[i] = (fds_[i] >= 0 && next <= buf[0]) ? buf[next++] : 0;
+  }
+}
+
+const char* PerfCounters::Name(Event e) {
+  static const char* const kNames[NUM_EVENTS] = {"cycles", "instructions", "cache-misses",
+                                                 "branch-misses"};
+  return kNames[e];
+}
+
+}  // namespace base
@@ -0,0 +1,43 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstdint>
+
+namespace base {
+
+/*
+  Counts the hardware events of the calling thread in the user space with perf_event_open(2),
+  e.g. around a benchmark loop. The events are read as a single group, so that they cover
+  the same instructions. Many VMs and containers do not allow the counters, in that case
+  valid() is false and the values are 0; the events that the cpu does not have are 0 as well.
+*/
+class PerfCounters {
+ public:
+  enum Event { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, NUM_EVENTS };
+
+  PerfCounters();
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters&) = delete;
+  void operator=(const PerfCounters&) = delete;
+
+  bool valid() const { return fds_[CYCLES] >= 0; }
+
+  // Resets the counters and starts counting.
+  void Start();
+
+  // Stops counting and reads the counters.
+  void Stop();
+
+  uint64_t value(Event e) const { return values_[e]; }
+
+  static const char* Name(Event e);
+
+ private:
+  int fds_[NUM_EVENTS];
+  uint64_t values_[NUM_EVENTS] = {0};
+};
+
+}  // namespace base
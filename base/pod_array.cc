@@ -0,0 +1,44 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "base/pod_array.h"
+
+#include <sys/mman.h>
+
+#include <new>
+
+namespace base {
+namespace detail {
+
+namespace {
+
+// Best effort: the kernel backs the 2MB aligned ranges of the mapping by huge pages, so the
+// mapping itself does not have to be aligned.
+inline void AdviseHugePages(void* ptr, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+  madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+}
+
+}  // namespace
+
+void* PODArrayMmap(size_t bytes) {
+  void* res = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (res == MAP_FAILED)
+    throw std::bad_alloc();
+  AdviseHugePages(res, bytes);
+  return res;
+}
+
+void* PODArrayMremap(void* ptr, size_t old_bytes, size_t new_bytes) {
+  void* res = mremap(ptr, old_bytes, new_bytes, MREMAP_MAYMOVE);
+  if (res == MAP_FAILED)
+    throw std::bad_alloc();
+  AdviseHugePages(res, new_bytes);
+  return res;
+}
+
+void PODArrayMunmap(void* ptr, size_t bytes) { munmap(ptr, bytes); }
+
+}  // namespace detail
+}  // namespace base
@@ -14,6 +14,20 @@
 
 namespace base {
 
+namespace detail {
+
+// Arrays of the default resource get their storage directly from mmap starting from this size,
+// so they grow with mremap without copying.
+constexpr size_t kPODArrayMmapThreshold = 32 << 20;
+
+// Allocate the mappings and advise the kernel to back them by transparent huge pages.
+// Throw std::bad_alloc on failure.
+void* PODArrayMmap(size_t bytes);
+void* PODArrayMremap(void* ptr, size_t old_bytes, size_t new_bytes);
+void PODArrayMunmap(void* ptr, size_t bytes);
+
+}  // namespace detail
+
 /**
   * Default c'tor does not allocate. On the first allocation it allocates at least INITIAL_SIZE bytes.
   *
@@ -22,6 +36,10 @@ namespace base {
   * Please note that for ALIGNMENT > 16 needs to be supported by memory_resource.
   * The default memory resource provides only 16 bytes alignment. For larger alignments use
   * custom memory resource, for example, one that wraps tcmalloc directly.
+  *
+  * Arrays of pmr::new_delete_resource() of at least kPODArrayMmapThreshold bytes are mapped
+  * directly and grow in place with mremap, which moves the pages instead of copying them.
+  * InlinedPODArray keeps its first elements in the object itself.
   */
 
 template<size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
@@ -31,19 +49,44 @@ template<size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
   char * c_end_       = nullptr;
   char * c_end_of_storage_ = nullptr; /// Не включает в себя pad_right.
   pmr::memory_resource* mr_;
+  char* inline_buf_ = nullptr;
 
   PODArrayBase(pmr::memory_resource* mr) : mr_(mr ? mr : pmr::get_default_resource()) {}
 
+  // The storage starts at [inline_buf, inline_buf + inline_size) that is owned by the caller.
+  PODArrayBase(char* inline_buf, size_t inline_size, pmr::memory_resource* mr)
+      : PODArrayBase(mr) {
+    c_start_ = c_end_ = inline_buf_ = inline_buf;
+    c_end_of_storage_ = inline_buf + inline_size;
+  }
+
+  bool is_inline() const { return inline_buf_ && c_start_ == inline_buf_; }
+
+  // Whether the storage of that size is mapped directly, see kPODArrayMmapThreshold.
+  bool is_mapped(size_t bytes) const {
+    return ALIGNMENT <= 4096 && bytes >= detail::kPODArrayMmapThreshold &&
+           mr_ == pmr::new_delete_resource();
+  }
+
+  char* allocate(size_t bytes) {
+    if (is_mapped(bytes))
+      return reinterpret_cast<char*>(detail::PODArrayMmap(bytes));
+    return reinterpret_cast<char *>(mr_->allocate(bytes, ALIGNMENT));
+  }
+
   void alloc(size_t bytes) {
     bytes = Bits::RoundUp64(bytes);
-    c_start_ = c_end_ = reinterpret_cast<char *>(mr_->allocate(bytes, ALIGNMENT));
+    c_start_ = c_end_ = allocate(bytes);
     c_end_of_storage_ = c_start_ + bytes;
   }
 
   void dealloc() {
-    if (c_start_ == nullptr)
+    if (c_start_ == nullptr || is_inline())
       return;
-    mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
+    if (is_mapped(allocated_size()))
+      detail::PODArrayMunmap(c_start_, allocated_size());
+    else
+      mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
   }
 
   /// Количество памяти, занимаемое num_elements элементов.
@@ -65,11 +108,17 @@ template<size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
     if (c_start_ == nullptr)
       return alloc(bytes);
     bytes = Bits::RoundUp64(bytes);
-    char* new_start = reinterpret_cast<char *>(mr_->allocate(bytes, ALIGNMENT));
     ptrdiff_t sz = c_end_ - c_start_;
-    memcpy(new_start, c_start_, sz);
+    char* new_start;
+    if (is_mapped(allocated_size()) && !is_inline()) {
+      new_start = reinterpret_cast<char*>(
+          detail::PODArrayMremap(c_start_, allocated_size(), bytes));
+    } else {
+      new_start = allocate(bytes);
+      memcpy(new_start, c_start_, sz);
+      dealloc();
+    }
 
-    mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
     c_end_ = new_start + sz;
     c_start_ = new_start;
     c_end_of_storage_ = c_start_ + bytes;
@@ -111,6 +160,12 @@ template<size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
 
   void swap(PODArrayBase& other) {
     // must be allocated from the same memory resource.
+    // The inline buffers stay with their arrays, so their elements move to the heap first.
+    if (is_inline())
+      realloc(allocated_size());
+    if (other.is_inline())
+      other.realloc(other.allocated_size());
+
     std::swap(c_start_, other.c_start_);
     std::swap(c_end_, other.c_end_);
     std::swap(c_end_of_storage_, other.c_end_of_storage_);
@@ -325,6 +380,10 @@ public:
   bool operator!= (const PODArray & other) const {
     return !operator==(other);
   }
+
+ protected:
+  PODArray(char* inline_buf, size_t inline_size, ::pmr::memory_resource* mr)
+      : ParentClass(inline_buf, inline_size, mr) {}
 };
 
 template <typename T, size_t pad_right_>
@@ -332,4 +391,26 @@ void swap(PODArray<T, pad_right_> & lhs, PODArray<T, pad_right_> & rhs) {
   lhs.swap(rhs);
 }
 
+// PODArray that keeps up to N elements in the object and allocates only when it grows beyond
+// them, e.g. for small per-call buffers. Moving or swapping arrays that are still inline
+// copies their elements to the heap.
+template <typename T, size_t N, size_t ALIGNMENT = 16>
+class InlinedPODArray : public PODArray<T, ALIGNMENT> {
+  static_assert(N > 0, "");
+
+ public:
+  explicit InlinedPODArray(::pmr::memory_resource* mr = nullptr)
+      : PODArray<T, ALIGNMENT>(inline_, sizeof(inline_), mr) {}
+
+  InlinedPODArray(InlinedPODArray&& other) : InlinedPODArray(other.mr()) { this->swap(other); }
+
+  InlinedPODArray& operator=(InlinedPODArray&& other) {
+    this->swap(other);
+    return *this;
+  }
+
+ private:
+  alignas(ALIGNMENT) char inline_[N * sizeof(T)];
+};
+
 }
@@ -32,4 +32,52 @@ TEST(BitsTest, Padded) {
   EXPECT_EQ(2048, arr.capacity());
 }
 
+TEST(PODArrayTest, Inlined) {
+  InlinedPODArray<uint32_t, 8> arr;
+  const uint32_t* inline_start = arr.data();
+  EXPECT_EQ(8, arr.capacity());
+  EXPECT_EQ(0, (ptrdiff_t)arr.data() % arr.alignment_v);
+
+  for (unsigned i = 0; i < 8; ++i)
+    arr.push_back(i);
+  EXPECT_EQ(inline_start, arr.data());
+
+  arr.push_back(8);
+  EXPECT_NE(inline_start, arr.data());
+  EXPECT_EQ(16, arr.capacity());
+  for (unsigned i = 0; i < 9; ++i) {
+    ASSERT_EQ(i, arr[i]);
+  }
+
+  InlinedPODArray<uint32_t, 8> small;
+  small.push_back(5);
+  PODArray<uint32_t> heap(std::move(small));
+  ASSERT_EQ(1, heap.size());
+  EXPECT_EQ(5, heap[0]);
+  EXPECT_EQ(0, small.size());
+
+  InlinedPODArray<uint32_t, 8> moved(std::move(arr));
+  ASSERT_EQ(9, moved.size());
+  EXPECT_EQ(8, moved.back());
+}
+
+TEST(PODArrayTest, Mapped) {
+  constexpr size_t kNum = detail::kPODArrayMmapThreshold / sizeof(uint64_t);
+
+  PODArray<uint64_t> arr(pmr::new_delete_resource());
+  arr.resize(kNum);
+  for (size_t i = 0; i < kNum; i += 4096)
+    arr[i] = i;
+  arr.push_back(kNum);  // grows with mremap.
+
+  EXPECT_EQ(2 * kNum, arr.capacity());
+  for (size_t i = 0; i < kNum; i += 4096) {
+    ASSERT_EQ(i, arr[i]);
+  }
+  EXPECT_EQ(kNum, arr.back());
+
+  arr.resize(4 * kNum - 1);
+  EXPECT_EQ(kNum, arr[kNum]);
+}
+
 }  // namespace base
@@ -7,17 +7,223 @@
 
 #include <x86intrin.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+// Every kernel is compiled for its level regardless of -march and is called only if
+// the cpu supports it.
+#define SSE_TARGET __attribute__((target("sse4.2,popcnt")))
+#define AVX2_TARGET __attribute__((target("avx2,bmi,popcnt")))
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw,avx2,bmi,popcnt")))
+
 namespace base {
 
+namespace {
+
+std::atomic<int>& CurrentLevel() {
+  static std::atomic<int> level{CpuSimdLevel()};
+  return level;
+}
+
+// Byte classes are padded to 4 values by repeating the first one.
+void MakeClass(const char* vals, unsigned num_vals, uint8_t cls[4]) {
+  DCHECK(num_vals > 0 && num_vals <= 4) << num_vals;
+  for (unsigned i = 0; i < 4; ++i) {
+    cls[i] = vals[i < num_vals ? i : 0];
+  }
+}
+
+inline bool InClass(uint8_t c, const uint8_t cls[4]) {
+  return c == cls[0] || c == cls[1] || c == cls[2] || c == cls[3];
+}
+
+size_t FindInClass(const uint8_t* ptr, size_t i, size_t len, const uint8_t cls[4]) {
+  for (; i < len; ++i) {
+    if (InClass(ptr[i], cls))
+      return i;
+  }
+  return len;
+}
+
+uint64_t MatchClassTail(const uint8_t* ptr, size_t len, const uint8_t cls[4]) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < len; ++i) {
+    mask |= uint64_t(InClass(ptr[i], cls)) << i;
+  }
+  return mask;
+}
+
+template <CmpOp op, typename T> inline bool Compare(T x, T val) {
+  switch (op) {
+    case CMP_EQ:
+      return x == val;
+    case CMP_LT:
+      return x < val;
+    case CMP_LE:
+      return x <= val;
+    case CMP_GT:
+      return x > val;
+    case CMP_GE:
+      return x >= val;
+  }
+  return false;
+}
+
+template <CmpOp op, typename T> uint64_t CompareTail(const T* ptr, size_t len, T val) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < len; ++i) {
+    mask |= uint64_t(Compare<op>(ptr[i], val)) << i;
+  }
+  return mask;
+}
+
+// The error classes of the UTF-8 lookup tables, see Keiser and Lemire. The bits of the tables
+// of the previous byte and of the current one are and-ed, so a set bit is an error.
+constexpr uint8_t kTooShort = 1 << 0;      // a lead byte followed by a lead or ASCII byte.
+constexpr uint8_t kTooLong = 1 << 1;       // ASCII followed by a continuation byte.
+constexpr uint8_t kOverlong3 = 1 << 2;     // E0 80..9F.
+constexpr uint8_t kTooLarge = 1 << 3;      // F4 90..BF or F5..FF 90..BF.
+constexpr uint8_t kSurrogate = 1 << 4;     // ED A0..BF.
+constexpr uint8_t kOverlong2 = 1 << 5;     // C0 or C1.
+constexpr uint8_t kTooLarge1000 = 1 << 6;  // F5..FF 80..8F.
+constexpr uint8_t kOverlong4 = 1 << 6;     // F0 80..8F.
+constexpr uint8_t kTwoConts = 1 << 7;      // two continuation bytes, checked with must23.
+constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+// Indexed by the high nibble of the previous byte.
+alignas(16) constexpr uint8_t kUtf8Byte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2,
+    kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4};
+
+// Indexed by the low nibble of the previous byte.
+alignas(16) constexpr uint8_t kUtf8Byte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000};
+
+// Indexed by the high nibble of the current byte.
+alignas(16) constexpr uint8_t kUtf8Byte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort};
+
+// Decodes the sequence at p, n > 0. Returns its length or 0 if it is not valid UTF-8.
+inline unsigned DecodeUtf8(const uint8_t* p, size_t n, uint32_t* cp) {
+  uint8_t c = p[0];
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+
+  unsigned len;
+  uint32_t min;
+  if (c < 0xC2) {
+    return 0;
+  } else if (c < 0xE0) {
+    len = 2;
+    min = 0x80;
+    *cp = c & 0x1F;
+  } else if (c < 0xF0) {
+    len = 3;
+    min = 0x800;
+    *cp = c & 0x0F;
+  } else if (c < 0xF5) {
+    len = 4;
+    min = 0x10000;
+    *cp = c & 0x07;
+  } else {
+    return 0;
+  }
+
+  if (n < len)
+    return 0;
+  for (unsigned j = 1; j < len; ++j) {
+    if ((p[j] & 0xC0) != 0x80)
+      return 0;
+    *cp = (*cp << 6) | (p[j] & 0x3F);
+  }
+  if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp < 0xE000))
+    return 0;
+  return len;
+}
+
+// Transcodes the code points that start in [i, end) of src, returns the index after the last
+// one. The last code point may end past end.
+size_t Utf8ToUtf16Tail(const uint8_t* src, size_t i, size_t end, size_t len, uint16_t** dest) {
+  while (i < end) {
+    uint32_t cp;
+    unsigned n = DecodeUtf8(src + i, len - i, &cp);
+    if (n == 0) {
+      cp = 0xFFFD;
+      n = 1;
+    }
+    if (cp < 0x10000) {
+      *(*dest)++ = cp;
+    } else {
+      cp -= 0x10000;
+      *(*dest)++ = 0xD800 + (cp >> 10);
+      *(*dest)++ = 0xDC00 + (cp & 0x3FF);
+    }
+    i += n;
+  }
+  return i;
+}
+
+size_t Utf8ToUtf32Tail(const uint8_t* src, size_t i, size_t end, size_t len, uint32_t** dest) {
+  while (i < end) {
+    uint32_t cp;
+    unsigned n = DecodeUtf8(src + i, len - i, &cp);
+    if (n == 0) {
+      cp = 0xFFFD;
+      n = 1;
+    }
+    *(*dest)++ = cp;
+    i += n;
+  }
+  return i;
+}
+
+/***********************************************************************
+ SSE4.2
+************************************************************************/
+
 // Returns 16bit mask saying which byte in p equals to the appropriate byte in cx16.
 // p points to 16 byte region that is compared to cx16.
-inline uint16_t EqualChar16(const void* p, __m128i cx16) {
+SSE_TARGET inline uint16_t EqualChar16(const void* p, __m128i cx16) {
   return _mm_movemask_epi8(_mm_cmpeq_epi8(cx16, *(const __m128i*)p));
 }
 
+SSE_TARGET inline unsigned ClassMask16(const uint8_t* p, const __m128i c[4]) {
+  __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(d, c[0]), _mm_cmpeq_epi8(d, c[1])),
+                           _mm_or_si128(_mm_cmpeq_epi8(d, c[2]), _mm_cmpeq_epi8(d, c[3])));
+  return uint16_t(_mm_movemask_epi8(m));
+}
 
 // Based on https://mischasan.wordpress.com/2011/11/09/the-generic-sse2-loop/
-size_t CountVal8(const uint8_t* ptr, size_t len, char c) {
+SSE_TARGET size_t CountVal8Sse(const uint8_t* ptr, size_t len, char c) {
   size_t res = 0;
   size_t i;
 
@@ -47,9 +253,1115 @@ size_t CountVal8(const uint8_t* ptr, size_t len, char c) {
   len &= 15;
 
   CNT_LOOP(len);
+#undef CNT_LOOP
+
+  return res;
+}
+
+SSE_TARGET size_t FindAnyOf8Sse(const uint8_t* ptr, size_t len, const uint8_t cls[4]) {
+  const __m128i c[4] = {_mm_set1_epi8(cls[0]), _mm_set1_epi8(cls[1]), _mm_set1_epi8(cls[2]),
+                        _mm_set1_epi8(cls[3])};
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    unsigned m = ClassMask16(ptr + i, c);
+    if (m)
+      return i + Bits::FindLSBSetNonZero(m);
+  }
+  return FindInClass(ptr, i, len, cls);
+}
+
+SSE_TARGET void MatchAnyOf8Sse(const uint8_t* ptr, size_t words, const uint8_t cls[4],
+                               uint64_t* dest) {
+  const __m128i c[4] = {_mm_set1_epi8(cls[0]), _mm_set1_epi8(cls[1]), _mm_set1_epi8(cls[2]),
+                        _mm_set1_epi8(cls[3])};
+  for (size_t i = 0; i < words; ++i, ptr += 64) {
+    uint64_t res = 0;
+    for (unsigned j = 0; j < 4; ++j) {
+      res |= uint64_t(ClassMask16(ptr + j * 16, c)) << (j * 16);
+    }
+    dest[i] = res;
+  }
+}
+
+SSE_TARGET void PrefixSum16Sse(uint16_t* buffer, size_t length, uint16_t starting_point) {
+  __m128i carry = _mm_set1_epi16(starting_point);
+  __m128i* buf16 = reinterpret_cast<__m128i*>(buffer);
+  size_t i = 0;
+
+  for (; i < length / 8; ++i) {
+    __m128i x = _mm_loadu_si128(buf16 + i);
+
+    // In-register scan: adds the element 1, 2 and 4 places to the left.
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi16(x, carry);
+    _mm_storeu_si128(buf16 + i, x);
+
+    // Replicates the last sum into all the elements.
+    carry = _mm_shufflehi_epi16(x, 0xFF);
+    carry = _mm_unpackhi_epi64(carry, carry);
+  }
+
+  uint16_t sum = _mm_extract_epi16(carry, 0);
+  for (i = 8 * i; i < length; ++i) {
+    sum += buffer[i];
+    buffer[i] = sum;
+  }
+}
+
+SSE_TARGET void PrefixSum32Sse(uint32_t* buffer, size_t length, uint32_t starting_point) {
+  __m128i carry = _mm_set1_epi32(starting_point);
+  __m128i* buf16 = reinterpret_cast<__m128i*>(buffer);
+  size_t i = 0;
+
+  for (; i < length / 4; ++i) {
+    __m128i x = _mm_loadu_si128(buf16 + i);
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi32(x, carry);
+    _mm_storeu_si128(buf16 + i, x);
+    carry = _mm_shuffle_epi32(x, 0xFF);
+  }
+
+  uint32_t sum = _mm_cvtsi128_si32(carry);
+  for (i = 4 * i; i < length; ++i) {
+    sum += buffer[i];
+    buffer[i] = sum;
+  }
+}
+
+SSE_TARGET void PrefixSum64Sse(uint64_t* buffer, size_t length, uint64_t starting_point) {
+  __m128i carry = _mm_set1_epi64x(starting_point);
+  __m128i* buf16 = reinterpret_cast<__m128i*>(buffer);
+  size_t i = 0;
+
+  for (; i < length / 2; ++i) {
+    __m128i x = _mm_loadu_si128(buf16 + i);
+    x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi64(x, carry);
+    _mm_storeu_si128(buf16 + i, x);
+    carry = _mm_unpackhi_epi64(x, x);
+  }
+
+  uint64_t sum = _mm_cvtsi128_si64(carry);
+  for (i = 2 * i; i < length; ++i) {
+    sum += buffer[i];
+    buffer[i] = sum;
+  }
+}
+
+// Unsigned 64 bit comparison: a > b.
+SSE_TARGET inline __m128i Greater64(__m128i a, __m128i b) {
+  const __m128i sign = _mm_set1_epi64x(int64_t(1ULL << 63));
+  return _mm_cmpgt_epi64(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+}
+
+SSE_TARGET void MinMax32Sse(const uint32_t* ptr, size_t len, uint32_t* min, uint32_t* max) {
+  __m128i vmin = _mm_set1_epi32(ptr[0]), vmax = vmin;
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+    vmin = _mm_min_epu32(vmin, x);
+    vmax = _mm_max_epu32(vmax, x);
+  }
+
+  uint32_t lo[4], hi[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lo), vmin);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(hi), vmax);
+  *min = *std::min_element(lo, lo + 4);
+  *max = *std::max_element(hi, hi + 4);
+  for (; i < len; ++i) {
+    *min = std::min(*min, ptr[i]);
+    *max = std::max(*max, ptr[i]);
+  }
+}
+
+SSE_TARGET void MinMax64Sse(const uint64_t* ptr, size_t len, uint64_t* min, uint64_t* max) {
+  __m128i vmin = _mm_set1_epi64x(ptr[0]), vmax = vmin;
+  size_t i = 0;
+  for (; i + 2 <= len; i += 2) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+    vmin = _mm_blendv_epi8(vmin, x, Greater64(vmin, x));
+    vmax = _mm_blendv_epi8(vmax, x, Greater64(x, vmax));
+  }
+
+  uint64_t lo[2], hi[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lo), vmin);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(hi), vmax);
+  *min = std::min(lo[0], lo[1]);
+  *max = std::max(hi[0], hi[1]);
+  for (; i < len; ++i) {
+    *min = std::min(*min, ptr[i]);
+    *max = std::max(*max, ptr[i]);
+  }
+}
+
+SSE_TARGET uint64_t Sum32Sse(const uint32_t* ptr, size_t len) {
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+    acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(x));
+    acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(_mm_srli_si128(x, 8)));
+  }
+
+  uint64_t res = _mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1);
+  for (; i < len; ++i) {
+    res += ptr[i];
+  }
   return res;
 }
 
+SSE_TARGET uint64_t Sum64Sse(const uint64_t* ptr, size_t len) {
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 2 <= len; i += 2) {
+    acc = _mm_add_epi64(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i)));
+  }
+
+  uint64_t res = _mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1);
+  for (; i < len; ++i) {
+    res += ptr[i];
+  }
+  return res;
+}
+
+// Compares whole words of 64 values. LE and GE of the integers are the negated GT and LT.
+template <CmpOp op>
+SSE_TARGET void CompareInt64Sse(const int64_t* ptr, size_t words, int64_t val, uint64_t* dest) {
+  const __m128i v = _mm_set1_epi64x(val);
+  for (size_t w = 0; w < words; ++w, ptr += 64) {
+    uint64_t mask = 0;
+    for (unsigned j = 0; j < 64; j += 2) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + j));
+      __m128i m = op == CMP_EQ ? _mm_cmpeq_epi64(x, v)
+                               : (op == CMP_LT || op == CMP_GE) ? _mm_cmpgt_epi64(v, x)
+                                                                : _mm_cmpgt_epi64(x, v);
+      mask |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(m))) << j;
+    }
+    dest[w] = (op == CMP_LE || op == CMP_GE) ? ~mask : mask;
+  }
+}
+
+template <CmpOp op>
+SSE_TARGET void CompareDoubleSse(const double* ptr, size_t words, double val, uint64_t* dest) {
+  const __m128d v = _mm_set1_pd(val);
+  for (size_t w = 0; w < words; ++w, ptr += 64) {
+    uint64_t mask = 0;
+    for (unsigned j = 0; j < 64; j += 2) {
+      __m128d x = _mm_loadu_pd(ptr + j);
+      __m128d m;
+      switch (op) {
+        case CMP_EQ:
+          m = _mm_cmpeq_pd(x, v);
+          break;
+        case CMP_LT:
+          m = _mm_cmplt_pd(x, v);
+          break;
+        case CMP_LE:
+          m = _mm_cmple_pd(x, v);
+          break;
+        case CMP_GT:
+          m = _mm_cmpgt_pd(x, v);
+          break;
+        case CMP_GE:
+          m = _mm_cmpge_pd(x, v);
+          break;
+      }
+      mask |= uint64_t(_mm_movemask_pd(m)) << j;
+    }
+    dest[w] = mask;
+  }
+}
+
+// The errors of the 16 bytes of input given the block before it, see Keiser and Lemire.
+SSE_TARGET inline __m128i Utf8Errors16(__m128i input, __m128i prev_input) {
+  const __m128i low4 = _mm_set1_epi8(0x0F);
+  __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+  __m128i b1h = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(kUtf8Byte1High)),
+                                 _mm_and_si128(_mm_srli_epi16(prev1, 4), low4));
+  __m128i b1l = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(kUtf8Byte1Low)),
+                                 _mm_and_si128(prev1, low4));
+  __m128i b2h = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(kUtf8Byte2High)),
+                                 _mm_and_si128(_mm_srli_epi16(input, 4), low4));
+  __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+  // The third and the fourth bytes of the sequences must be continuations, the two
+  // continuations that are not flagged here are errors.
+  __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+  __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+  __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(char(0xE0 - 0x80))),
+                                _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xF0 - 0x80))));
+  return _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8(char(0x80))), special);
+}
+
+// Non-zero if the last 3 bytes of input start a sequence that continues in the next block.
+SSE_TARGET inline __m128i Utf8Incomplete16(__m128i input) {
+  const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                    char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+  return _mm_subs_epu8(input, max);
+}
+
+SSE_TARGET inline void CheckUtf8Block16(__m128i input, __m128i* prev_input,
+                                        __m128i* prev_incomplete, __m128i* error) {
+  if (_mm_movemask_epi8(input) == 0) {
+    *error = _mm_or_si128(*error, *prev_incomplete);
+    *prev_incomplete = _mm_setzero_si128();
+  } else {
+    *error = _mm_or_si128(*error, Utf8Errors16(input, *prev_input));
+    *prev_incomplete = Utf8Incomplete16(input);
+  }
+  *prev_input = input;
+}
+
+SSE_TARGET bool ValidateUtf8Sse(const uint8_t* ptr, size_t len) {
+  __m128i error = _mm_setzero_si128(), prev_input = error, prev_incomplete = error;
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m128i v[4];
+    for (unsigned j = 0; j < 4; ++j)
+      v[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i + j * 16));
+
+    __m128i any = _mm_or_si128(_mm_or_si128(v[0], v[1]), _mm_or_si128(v[2], v[3]));
+    if (_mm_movemask_epi8(any) == 0) {
+      error = _mm_or_si128(error, prev_incomplete);
+      prev_incomplete = _mm_setzero_si128();
+      prev_input = v[3];
+      continue;
+    }
+    for (unsigned j = 0; j < 4; ++j)
+      CheckUtf8Block16(v[j], &prev_input, &prev_incomplete, &error);
+  }
+
+  for (; i + 16 <= len; i += 16) {
+    CheckUtf8Block16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i)), &prev_input,
+                     &prev_incomplete, &error);
+  }
+
+  // The zero padding is ASCII, hence it catches the truncated sequences as well.
+  if (i < len) {
+    alignas(16) uint8_t buf[16] = {0};
+    memcpy(buf, ptr + i, len - i);
+    CheckUtf8Block16(_mm_load_si128(reinterpret_cast<const __m128i*>(buf)), &prev_input,
+                     &prev_incomplete, &error);
+  }
+  error = _mm_or_si128(error, prev_incomplete);
+  return _mm_testz_si128(error, error);
+}
+
+SSE_TARGET size_t Utf8ToUtf16Sse(const uint8_t* src, size_t len, uint16_t* dest) {
+  uint16_t* const start = dest;
+  size_t i = 0;
+  while (i + 16 <= len) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    if (_mm_movemask_epi8(v) == 0) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_cvtepu8_epi16(v));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8),
+                       _mm_cvtepu8_epi16(_mm_srli_si128(v, 8)));
+      dest += 16;
+      i += 16;
+    } else {
+      i = Utf8ToUtf16Tail(src, i, i + 16, len, &dest);
+    }
+  }
+  Utf8ToUtf16Tail(src, i, len, len, &dest);
+  return dest - start;
+}
+
+SSE_TARGET size_t Utf8ToUtf32Sse(const uint8_t* src, size_t len, uint32_t* dest) {
+  uint32_t* const start = dest;
+  size_t i = 0;
+  while (i + 16 <= len) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    if (_mm_movemask_epi8(v) == 0) {
+      __m128i* d = reinterpret_cast<__m128i*>(dest);
+      _mm_storeu_si128(d, _mm_cvtepu8_epi32(v));
+      _mm_storeu_si128(d + 1, _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)));
+      _mm_storeu_si128(d + 2, _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+      _mm_storeu_si128(d + 3, _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)));
+      dest += 16;
+      i += 16;
+    } else {
+      i = Utf8ToUtf32Tail(src, i, i + 16, len, &dest);
+    }
+  }
+  Utf8ToUtf32Tail(src, i, len, len, &dest);
+  return dest - start;
+}
+
+// Unpacks count values that start at bit start_bit of src. Reads only the bytes it needs.
+void UnpackBitsScalar(const uint8_t* src, unsigned bit_width, size_t start_bit, size_t count,
+                      uint32_t* dest) {
+  if (bit_width == 0) {
+    std::fill(dest, dest + count, 0);
+    return;
+  }
+
+  const uint8_t* next = src + start_bit / 8;
+  uint64_t acc = 0;
+  unsigned acc_bits = 0;  // at most bit_width + 7.
+  if (count && (start_bit & 7)) {
+    acc = *next++ >> (start_bit & 7);
+    acc_bits = 8 - (start_bit & 7);
+  }
+
+  const uint64_t mask = (uint64_t(1) << bit_width) - 1;
+  for (size_t i = 0; i < count; ++i) {
+    while (acc_bits < bit_width) {
+      acc |= uint64_t(*next++) << acc_bits;
+      acc_bits += 8;
+    }
+    dest[i] = acc & mask;
+    acc >>= bit_width;
+    acc_bits -= bit_width;
+  }
+}
+
+// The gather kernels load 4 bytes at the byte of every value, hence they handle values of
+// up to 25 bits (7 bits of the offset + 25 bits) and stop while the loads are inside src.
+// Returns the number of values that can be gathered with lanes values per step.
+inline size_t GatherLimit(unsigned bit_width, size_t count, unsigned lanes) {
+  if (bit_width == 0 || bit_width > 25)
+    return 0;
+
+  size_t packed = (count * bit_width + 7) / 8;
+  size_t res = 0;
+  while (res + lanes <= count && (res + lanes - 1) * bit_width / 8 + 4 <= packed &&
+         (res + lanes) * bit_width < (1ULL << 31)) {
+    res += lanes;
+  }
+  return res;
+}
+
+/***********************************************************************
+ AVX2
+************************************************************************/
+
+AVX2_TARGET inline uint32_t ClassMask32(const uint8_t* p, const __m256i c[4]) {
+  __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  __m256i m =
+      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(d, c[0]), _mm256_cmpeq_epi8(d, c[1])),
+                      _mm256_or_si256(_mm256_cmpeq_epi8(d, c[2]), _mm256_cmpeq_epi8(d, c[3])));
+  return _mm256_movemask_epi8(m);
+}
+
+AVX2_TARGET size_t CountVal8Avx2(const uint8_t* ptr, size_t len, char c) {
+  __m256i cx32 = _mm256_set1_epi8(c);
+  size_t res = 0, i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+    res += _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(cx32, d)));
+  }
+  for (; i < len; ++i) {
+    res += (ptr[i] == uint8_t(c));
+  }
+  return res;
+}
+
+AVX2_TARGET size_t FindAnyOf8Avx2(const uint8_t* ptr, size_t len, const uint8_t cls[4]) {
+  const __m256i c[4] = {_mm256_set1_epi8(cls[0]), _mm256_set1_epi8(cls[1]),
+                        _mm256_set1_epi8(cls[2]), _mm256_set1_epi8(cls[3])};
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    uint32_t m = ClassMask32(ptr + i, c);
+    if (m)
+      return i + Bits::FindLSBSetNonZero(m);
+  }
+  return FindInClass(ptr, i, len, cls);
+}
+
+AVX2_TARGET void MatchAnyOf8Avx2(const uint8_t* ptr, size_t words, const uint8_t cls[4],
+                                 uint64_t* dest) {
+  const __m256i c[4] = {_mm256_set1_epi8(cls[0]), _mm256_set1_epi8(cls[1]),
+                        _mm256_set1_epi8(cls[2]), _mm256_set1_epi8(cls[3])};
+  for (size_t i = 0; i < words; ++i, ptr += 64) {
+    dest[i] = (uint64_t(ClassMask32(ptr + 32, c)) << 32) | ClassMask32(ptr, c);
+  }
+}
+
+AVX2_TARGET void PrefixSum32Avx2(uint32_t* buffer, size_t length, uint32_t starting_point) {
+  __m256i carry = _mm256_set1_epi32(starting_point);
+  const __m256i last = _mm256_set1_epi32(7);
+  __m256i* buf32 = reinterpret_cast<__m256i*>(buffer);
+  size_t i = 0;
+
+  for (; i < length / 8; ++i) {
+    __m256i x = _mm256_loadu_si256(buf32 + i);
+
+    // Scans both the 128 bit lanes, then adds the sum of the low lane to the high one.
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i low_sum = _mm256_shuffle_epi32(x, 0xFF);
+    x = _mm256_add_epi32(x, _mm256_permute2x128_si256(low_sum, low_sum, 0x08));
+    x = _mm256_add_epi32(x, carry);
+    _mm256_storeu_si256(buf32 + i, x);
+    carry = _mm256_permutevar8x32_epi32(x, last);
+  }
+
+  uint32_t sum = _mm256_cvtsi256_si32(carry);
+  for (i = 8 * i; i < length; ++i) {
+    sum += buffer[i];
+    buffer[i] = sum;
+  }
+}
+
+AVX2_TARGET void PrefixSum64Avx2(uint64_t* buffer, size_t length, uint64_t starting_point) {
+  __m256i carry = _mm256_set1_epi64x(starting_point);
+  __m256i* buf32 = reinterpret_cast<__m256i*>(buffer);
+  size_t i = 0;
+
+  for (; i < length / 4; ++i) {
+    __m256i x = _mm256_loadu_si256(buf32 + i);
+    x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+    __m256i low_sum = _mm256_unpackhi_epi64(x, x);
+    x = _mm256_add_epi64(x, _mm256_permute2x128_si256(low_sum, low_sum, 0x08));
+    x = _mm256_add_epi64(x, carry);
+    _mm256_storeu_si256(buf32 + i, x);
+    carry = _mm256_permute4x64_epi64(x, 0xFF);
+  }
+
+  uint64_t sum = _mm_cvtsi128_si64(_mm256_castsi256_si128(carry));
+  for (i = 4 * i; i < length; ++i) {
+    sum += buffer[i];
+    buffer[i] = sum;
+  }
+}
+
+AVX2_TARGET inline __m256i Greater64x4(__m256i a, __m256i b) {
+  const __m256i sign = _mm256_set1_epi64x(int64_t(1ULL << 63));
+  return _mm256_cmpgt_epi64(_mm256_xor_si256(a, sign), _mm256_xor_si256(b, sign));
+}
+
+AVX2_TARGET void MinMax32Avx2(const uint32_t* ptr, size_t len, uint32_t* min, uint32_t* max) {
+  __m256i vmin = _mm256_set1_epi32(ptr[0]), vmax = vmin;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+    vmin = _mm256_min_epu32(vmin, x);
+    vmax = _mm256_max_epu32(vmax, x);
+  }
+
+  uint32_t lo[8], hi[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lo), vmin);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(hi), vmax);
+  *min = *std::min_element(lo, lo + 8);
+  *max = *std::max_element(hi, hi + 8);
+  for (; i < len; ++i) {
+    *min = std::min(*min, ptr[i]);
+    *max = std::max(*max, ptr[i]);
+  }
+}
+
+AVX2_TARGET void MinMax64Avx2(const uint64_t* ptr, size_t len, uint64_t* min, uint64_t* max) {
+  __m256i vmin = _mm256_set1_epi64x(ptr[0]), vmax = vmin;
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+    vmin = _mm256_blendv_epi8(vmin, x, Greater64x4(vmin, x));
+    vmax = _mm256_blendv_epi8(vmax, x, Greater64x4(x, vmax));
+  }
+
+  uint64_t lo[4], hi[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lo), vmin);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(hi), vmax);
+  *min = *std::min_element(lo, lo + 4);
+  *max = *std::max_element(hi, hi + 4);
+  for (; i < len; ++i) {
+    *min = std::min(*min, ptr[i]);
+    *max = std::max(*max, ptr[i]);
+  }
+}
+
+AVX2_TARGET uint64_t Sum32Avx2(const uint32_t* ptr, size_t len) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(x)));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(x, 1)));
+  }
+
+  uint64_t parts[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(parts), acc);
+  uint64_t res = parts[0] + parts[1] + parts[2] + parts[3];
+  for (; i < len; ++i) {
+    res += ptr[i];
+  }
+  return res;
+}
+
+AVX2_TARGET uint64_t Sum64Avx2(const uint64_t* ptr, size_t len) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i)));
+  }
+
+  uint64_t parts[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(parts), acc);
+  uint64_t res = parts[0] + parts[1] + parts[2] + parts[3];
+  for (; i < len; ++i) {
+    res += ptr[i];
+  }
+  return res;
+}
+
+template <CmpOp op>
+AVX2_TARGET void CompareInt64Avx2(const int64_t* ptr, size_t words, int64_t val,
+                                  uint64_t* dest) {
+  const __m256i v = _mm256_set1_epi64x(val);
+  for (size_t w = 0; w < words; ++w, ptr += 64) {
+    uint64_t mask = 0;
+    for (unsigned j = 0; j < 64; j += 4) {
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + j));
+      __m256i m = op == CMP_EQ ? _mm256_cmpeq_epi64(x, v)
+                               : (op == CMP_LT || op == CMP_GE) ? _mm256_cmpgt_epi64(v, x)
+                                                                : _mm256_cmpgt_epi64(x, v);
+      mask |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(m))) << j;
+    }
+    dest[w] = (op == CMP_LE || op == CMP_GE) ? ~mask : mask;
+  }
+}
+
+// The ordered predicates, i.e. false for NaN.
+constexpr int kCmpPredicate[] = {_CMP_EQ_OQ, _CMP_LT_OQ, _CMP_LE_OQ, _CMP_GT_OQ, _CMP_GE_OQ};
+
+template <CmpOp op>
+AVX2_TARGET void CompareDoubleAvx2(const double* ptr, size_t words, double val,
+                                   uint64_t* dest) {
+  const __m256d v = _mm256_set1_pd(val);
+  for (size_t w = 0; w < words; ++w, ptr += 64) {
+    uint64_t mask = 0;
+    for (unsigned j = 0; j < 64; j += 4) {
+      __m256d m = _mm256_cmp_pd(_mm256_loadu_pd(ptr + j), v, kCmpPredicate[op]);
+      mask |= uint64_t(_mm256_movemask_pd(m)) << j;
+    }
+    dest[w] = mask;
+  }
+}
+
+AVX2_TARGET void UnpackBitsAvx2(const uint8_t* src, unsigned bit_width, size_t count,
+                                uint32_t* dest) {
+  size_t limit = GatherLimit(bit_width, count, 8);
+  const __m256i lane_bits =
+      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(bit_width));
+  const __m256i mask = _mm256_set1_epi32((uint64_t(1) << bit_width) - 1);
+  const __m256i seven = _mm256_set1_epi32(7);
+
+  for (size_t i = 0; i < limit; i += 8) {
+    __m256i bit_pos = _mm256_add_epi32(_mm256_set1_epi32(i * bit_width), lane_bits);
+    __m256i v = _mm256_i32gather_epi32(reinterpret_cast<const int*>(src),
+                                       _mm256_srli_epi32(bit_pos, 3), 1);
+    v = _mm256_srlv_epi32(v, _mm256_and_si256(bit_pos, seven));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), _mm256_and_si256(v, mask));
+  }
+  UnpackBitsScalar(src, bit_width, limit * bit_width, count - limit, dest + limit);
+}
+
+AVX2_TARGET inline __m256i Utf8Lookup32(const uint8_t table[16], __m256i index) {
+  __m256i t = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table)));
+  return _mm256_shuffle_epi8(t, index);
+}
+
+// The 32 byte variant of Utf8Errors16.
+AVX2_TARGET inline __m256i Utf8Errors32(__m256i input, __m256i prev_input) {
+  const __m256i low4 = _mm256_set1_epi8(0x0F);
+
+  // The last 16 bytes of prev_input and the first 16 bytes of input.
+  __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+  __m256i b1h = Utf8Lookup32(kUtf8Byte1High, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low4));
+  __m256i b1l = Utf8Lookup32(kUtf8Byte1Low, _mm256_and_si256(prev1, low4));
+  __m256i b2h = Utf8Lookup32(kUtf8Byte2High, _mm256_and_si256(_mm256_srli_epi16(input, 4), low4));
+  __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+  __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+  __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+  __m256i must23 =
+      _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80))),
+                      _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80))));
+  return _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8(char(0x80))), special);
+}
+
+AVX2_TARGET inline __m256i Utf8Incomplete32(__m256i input) {
+  const __m256i max = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+  return _mm256_subs_epu8(input, max);
+}
+
+AVX2_TARGET inline void CheckUtf8Block32(__m256i input, __m256i* prev_input,
+                                         __m256i* prev_incomplete, __m256i* error) {
+  if (_mm256_movemask_epi8(input) == 0) {
+    *error = _mm256_or_si256(*error, *prev_incomplete);
+    *prev_incomplete = _mm256_setzero_si256();
+  } else {
+    *error = _mm256_or_si256(*error, Utf8Errors32(input, *prev_input));
+    *prev_incomplete = Utf8Incomplete32(input);
+  }
+  *prev_input = input;
+}
+
+AVX2_TARGET bool ValidateUtf8Avx2(const uint8_t* ptr, size_t len) {
+  __m256i error = _mm256_setzero_si256(), prev_input = error, prev_incomplete = error;
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+    __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i + 32));
+    if (_mm256_movemask_epi8(_mm256_or_si256(v0, v1)) == 0) {
+      error = _mm256_or_si256(error, prev_incomplete);
+      prev_incomplete = _mm256_setzero_si256();
+      prev_input = v1;
+      continue;
+    }
+    CheckUtf8Block32(v0, &prev_input, &prev_incomplete, &error);
+    CheckUtf8Block32(v1, &prev_input, &prev_incomplete, &error);
+  }
+
+  if (i < len) {
+    alignas(32) uint8_t buf[64] = {0};
+    memcpy(buf, ptr + i, len - i);
+    CheckUtf8Block32(_mm256_load_si256(reinterpret_cast<const __m256i*>(buf)), &prev_input,
+                     &prev_incomplete, &error);
+    CheckUtf8Block32(_mm256_load_si256(reinterpret_cast<const __m256i*>(buf + 32)), &prev_input,
+                     &prev_incomplete, &error);
+  }
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
+}
+
+AVX2_TARGET size_t Utf8ToUtf16Avx2(const uint8_t* src, size_t len, uint16_t* dest) {
+  uint16_t* const start = dest;
+  size_t i = 0;
+  while (i + 32 <= len) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    if (_mm256_movemask_epi8(v) == 0) {
+      __m256i* d = reinterpret_cast<__m256i*>(dest);
+      _mm256_storeu_si256(d, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+      _mm256_storeu_si256(d + 1, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+      dest += 32;
+      i += 32;
+    } else {
+      i = Utf8ToUtf16Tail(src, i, i + 32, len, &dest);
+    }
+  }
+  Utf8ToUtf16Tail(src, i, len, len, &dest);
+  return dest - start;
+}
+
+AVX2_TARGET size_t Utf8ToUtf32Avx2(const uint8_t* src, size_t len, uint32_t* dest) {
+  uint32_t* const start = dest;
+  size_t i = 0;
+  while (i + 32 <= len) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    if (_mm256_movemask_epi8(v) == 0) {
+      __m256i* d = reinterpret_cast<__m256i*>(dest);
+      for (unsigned j = 0; j < 4; ++j) {
+        __m128i q = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i + j * 8));
+        _mm256_storeu_si256(d + j, _mm256_cvtepu8_epi32(q));
+      }
+      dest += 32;
+      i += 32;
+    } else {
+      i = Utf8ToUtf32Tail(src, i, i + 32, len, &dest);
+    }
+  }
+  Utf8ToUtf32Tail(src, i, len, len, &dest);
+  return dest - start;
+}
+
+/***********************************************************************
+ AVX-512
+************************************************************************/
+
+// GCC 12 reports the _mm512_undefined_* values inside the intrinsics as uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+AVX512_TARGET inline uint64_t ClassMask64(const uint8_t* p, const __m512i c[4]) {
+  __m512i d = _mm512_loadu_si512(p);
+  return _mm512_cmpeq_epi8_mask(d, c[0]) | _mm512_cmpeq_epi8_mask(d, c[1]) |
+         _mm512_cmpeq_epi8_mask(d, c[2]) | _mm512_cmpeq_epi8_mask(d, c[3]);
+}
+
+AVX512_TARGET size_t CountVal8Avx512(const uint8_t* ptr, size_t len, char c) {
+  __m512i cx64 = _mm512_set1_epi8(c);
+  size_t res = 0, i = 0;
+  for (; i + 64 <= len; i += 64) {
+    res += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(cx64, _mm512_loadu_si512(ptr + i)));
+  }
+  for (; i < len; ++i) {
+    res += (ptr[i] == uint8_t(c));
+  }
+  return res;
+}
+
+AVX512_TARGET size_t FindAnyOf8Avx512(const uint8_t* ptr, size_t len, const uint8_t cls[4]) {
+  const __m512i c[4] = {_mm512_set1_epi8(cls[0]), _mm512_set1_epi8(cls[1]),
+                        _mm512_set1_epi8(cls[2]), _mm512_set1_epi8(cls[3])};
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    uint64_t m = ClassMask64(ptr + i, c);
+    if (m)
+      return i + Bits::FindLSBSetNonZero64(m);
+  }
+  return FindInClass(ptr, i, len, cls);
+}
+
+AVX512_TARGET void MatchAnyOf8Avx512(const uint8_t* ptr, size_t words, const uint8_t cls[4],
+                                     uint64_t* dest) {
+  const __m512i c[4] = {_mm512_set1_epi8(cls[0]), _mm512_set1_epi8(cls[1]),
+                        _mm512_set1_epi8(cls[2]), _mm512_set1_epi8(cls[3])};
+  for (size_t i = 0; i < words; ++i) {
+    dest[i] = ClassMask64(ptr + i * 64, c);
+  }
+}
+
+AVX512_TARGET void MinMax32Avx512(const uint32_t* ptr, size_t len, uint32_t* min,
+                                  uint32_t* max) {
+  __m512i vmin = _mm512_set1_epi32(ptr[0]), vmax = vmin;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m512i x = _mm512_loadu_si512(ptr + i);
+    vmin = _mm512_min_epu32(vmin, x);
+    vmax = _mm512_max_epu32(vmax, x);
+  }
+
+  *min = _mm512_reduce_min_epu32(vmin);
+  *max = _mm512_reduce_max_epu32(vmax);
+  for (; i < len; ++i) {
+    *min = std::min(*min, ptr[i]);
+    *max = std::max(*max, ptr[i]);
+  }
+}
+
+AVX512_TARGET void MinMax64Avx512(const uint64_t* ptr, size_t len, uint64_t* min,
+                                  uint64_t* max) {
+  __m512i vmin = _mm512_set1_epi64(ptr[0]), vmax = vmin;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m512i x = _mm512_loadu_si512(ptr + i);
+    vmin = _mm512_min_epu64(vmin, x);
+    vmax = _mm512_max_epu64(vmax, x);
+  }
+
+  *min = _mm512_reduce_min_epu64(vmin);
+  *max = _mm512_reduce_max_epu64(vmax);
+  for (; i < len; ++i) {
+    *min = std::min(*min, ptr[i]);
+    *max = std::max(*max, ptr[i]);
+  }
+}
+
+AVX512_TARGET uint64_t Sum32Avx512(const uint32_t* ptr, size_t len) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m512i x = _mm512_loadu_si512(ptr + i);
+    acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(_mm512_castsi512_si256(x)));
+    acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(x, 1)));
+  }
+
+  uint64_t res = _mm512_reduce_add_epi64(acc);
+  for (; i < len; ++i) {
+    res += ptr[i];
+  }
+  return res;
+}
+
+AVX512_TARGET uint64_t Sum64Avx512(const uint64_t* ptr, size_t len) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    acc = _mm512_add_epi64(acc, _mm512_loadu_si512(ptr + i));
+  }
+
+  uint64_t res = _mm512_reduce_add_epi64(acc);
+  for (; i < len; ++i) {
+    res += ptr[i];
+  }
+  return res;
+}
+
+constexpr int kCmpInt[] = {_MM_CMPINT_EQ, _MM_CMPINT_LT, _MM_CMPINT_LE, _MM_CMPINT_NLE,
+                           _MM_CMPINT_NLT};
+
+template <CmpOp op>
+AVX512_TARGET void CompareInt64Avx512(const int64_t* ptr, size_t words, int64_t val,
+                                      uint64_t* dest) {
+  const __m512i v = _mm512_set1_epi64(val);
+  for (size_t w = 0; w < words; ++w, ptr += 64) {
+    uint64_t mask = 0;
+    for (unsigned j = 0; j < 64; j += 8) {
+      __mmask8 m = _mm512_cmp_epi64_mask(_mm512_loadu_si512(ptr + j), v, kCmpInt[op]);
+      mask |= uint64_t(m) << j;
+    }
+    dest[w] = mask;
+  }
+}
+
+template <CmpOp op>
+AVX512_TARGET void CompareDoubleAvx512(const double* ptr, size_t words, double val,
+                                       uint64_t* dest) {
+  const __m512d v = _mm512_set1_pd(val);
+  for (size_t w = 0; w < words; ++w, ptr += 64) {
+    uint64_t mask = 0;
+    for (unsigned j = 0; j < 64; j += 8) {
+      __mmask8 m = _mm512_cmp_pd_mask(_mm512_loadu_pd(ptr + j), v, kCmpPredicate[op]);
+      mask |= uint64_t(m) << j;
+    }
+    dest[w] = mask;
+  }
+}
+
+AVX512_TARGET void UnpackBitsAvx512(const uint8_t* src, unsigned bit_width, size_t count,
+                                    uint32_t* dest) {
+  size_t limit = GatherLimit(bit_width, count, 16);
+  const __m512i lane_bits = _mm512_mullo_epi32(
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+      _mm512_set1_epi32(bit_width));
+  const __m512i mask = _mm512_set1_epi32((uint64_t(1) << bit_width) - 1);
+  const __m512i seven = _mm512_set1_epi32(7);
+
+  for (size_t i = 0; i < limit; i += 16) {
+    __m512i bit_pos = _mm512_add_epi32(_mm512_set1_epi32(i * bit_width), lane_bits);
+    __m512i v = _mm512_i32gather_epi32(_mm512_srli_epi32(bit_pos, 3), src, 1);
+    v = _mm512_srlv_epi32(v, _mm512_and_si512(bit_pos, seven));
+    _mm512_storeu_si512(dest + i, _mm512_and_si512(v, mask));
+  }
+  UnpackBitsScalar(src, bit_width, limit * bit_width, count - limit, dest + limit);
+}
+
+#pragma GCC diagnostic pop
+
+}  // namespace
+
+SimdLevel CpuSimdLevel() {
+  static SimdLevel level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+      return SIMD_AVX512;
+    return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE;
+  }();
+  return level;
+}
+
+SimdLevel GetSimdLevel() {
+  return SimdLevel(CurrentLevel().load(std::memory_order_relaxed));
+}
+
+void SetSimdLevel(SimdLevel level) {
+  CurrentLevel().store(std::min(level, CpuSimdLevel()), std::memory_order_relaxed);
+}
+
+size_t CountVal8(const uint8_t* ptr, size_t len, char val) {
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return CountVal8Avx512(ptr, len, val);
+    case SIMD_AVX2:
+      return CountVal8Avx2(ptr, len, val);
+    default:
+      return CountVal8Sse(ptr, len, val);
+  }
+}
+
+void MatchVal8(const uint8_t* ptr, size_t len, char val, uint64_t* dest) {
+  MatchAnyOf8(ptr, len, &val, 1, dest);
+}
+
+void MatchAnyOf8(const uint8_t* ptr, size_t len, const char* vals, unsigned num_vals,
+                 uint64_t* dest) {
+  uint8_t cls[4];
+  MakeClass(vals, num_vals, cls);
+
+  size_t words = len / 64;
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      MatchAnyOf8Avx512(ptr, words, cls, dest);
+      break;
+    case SIMD_AVX2:
+      MatchAnyOf8Avx2(ptr, words, cls, dest);
+      break;
+    default:
+      MatchAnyOf8Sse(ptr, words, cls, dest);
+  }
+
+  len &= 63;
+  if (len) {
+    dest[words] = MatchClassTail(ptr + words * 64, len, cls);
+  }
+}
+
+size_t FindAnyOf8(const uint8_t* ptr, size_t len, const char* vals, unsigned num_vals) {
+  uint8_t cls[4];
+  MakeClass(vals, num_vals, cls);
+
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return FindAnyOf8Avx512(ptr, len, cls);
+    case SIMD_AVX2:
+      return FindAnyOf8Avx2(ptr, len, cls);
+    default:
+      return FindAnyOf8Sse(ptr, len, cls);
+  }
+}
+
+// u16 sums are short enough for the 128 bit scan on all the levels.
+void ComputePrefixSumInplace(uint16_t* buffer, size_t length, uint16_t starting_point) {
+  PrefixSum16Sse(buffer, length, starting_point);
+}
+
+// AVX-512 does not help the scans, its lane crossing is as slow as AVX2's.
+void ComputePrefixSumInplace(uint32_t* buffer, size_t length, uint32_t starting_point) {
+  if (GetSimdLevel() >= SIMD_AVX2)
+    PrefixSum32Avx2(buffer, length, starting_point);
+  else
+    PrefixSum32Sse(buffer, length, starting_point);
+}
+
+void ComputePrefixSumInplace(uint64_t* buffer, size_t length, uint64_t starting_point) {
+  if (GetSimdLevel() >= SIMD_AVX2)
+    PrefixSum64Avx2(buffer, length, starting_point);
+  else
+    PrefixSum64Sse(buffer, length, starting_point);
+}
+
+void MinMax(const uint32_t* ptr, size_t len, uint32_t* min, uint32_t* max) {
+  DCHECK_GT(len, 0);
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return MinMax32Avx512(ptr, len, min, max);
+    case SIMD_AVX2:
+      return MinMax32Avx2(ptr, len, min, max);
+    default:
+      return MinMax32Sse(ptr, len, min, max);
+  }
+}
+
+void MinMax(const uint64_t* ptr, size_t len, uint64_t* min, uint64_t* max) {
+  DCHECK_GT(len, 0);
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return MinMax64Avx512(ptr, len, min, max);
+    case SIMD_AVX2:
+      return MinMax64Avx2(ptr, len, min, max);
+    default:
+      return MinMax64Sse(ptr, len, min, max);
+  }
+}
+
+uint64_t Sum(const uint32_t* ptr, size_t len) {
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return Sum32Avx512(ptr, len);
+    case SIMD_AVX2:
+      return Sum32Avx2(ptr, len);
+    default:
+      return Sum32Sse(ptr, len);
+  }
+}
+
+uint64_t Sum(const uint64_t* ptr, size_t len) {
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return Sum64Avx512(ptr, len);
+    case SIMD_AVX2:
+      return Sum64Avx2(ptr, len);
+    default:
+      return Sum64Sse(ptr, len);
+  }
+}
+
+template <CmpOp op, typename T>
+void CompareDispatch(const T* ptr, size_t len, T val, uint64_t* dest) {
+  size_t words = len / 64;
+  if constexpr (std::is_same<T, int64_t>::value) {
+    switch (GetSimdLevel()) {
+      case SIMD_AVX512:
+        CompareInt64Avx512<op>(ptr, words, val, dest);
+        break;
+      case SIMD_AVX2:
+        CompareInt64Avx2<op>(ptr, words, val, dest);
+        break;
+      default:
+        CompareInt64Sse<op>(ptr, words, val, dest);
+    }
+  } else {
+    switch (GetSimdLevel()) {
+      case SIMD_AVX512:
+        CompareDoubleAvx512<op>(ptr, words, val, dest);
+        break;
+      case SIMD_AVX2:
+        CompareDoubleAvx2<op>(ptr, words, val, dest);
+        break;
+      default:
+        CompareDoubleSse<op>(ptr, words, val, dest);
+    }
+  }
+
+  len &= 63;
+  if (len) {
+    dest[words] = CompareTail<op>(ptr + words * 64, len, val);
+  }
+}
+
+template <typename T>
+void CompareImpl(const T* ptr, size_t len, T val, CmpOp op, uint64_t* dest) {
+  switch (op) {
+    case CMP_EQ:
+      return CompareDispatch<CMP_EQ>(ptr, len, val, dest);
+    case CMP_LT:
+      return CompareDispatch<CMP_LT>(ptr, len, val, dest);
+    case CMP_LE:
+      return CompareDispatch<CMP_LE>(ptr, len, val, dest);
+    case CMP_GT:
+      return CompareDispatch<CMP_GT>(ptr, len, val, dest);
+    case CMP_GE:
+      return CompareDispatch<CMP_GE>(ptr, len, val, dest);
+  }
+}
+
+void CompareInt64(const int64_t* ptr, size_t len, int64_t val, CmpOp op, uint64_t* dest) {
+  CompareImpl(ptr, len, val, op, dest);
+}
+
+void CompareDouble(const double* ptr, size_t len, double val, CmpOp op, uint64_t* dest) {
+  CompareImpl(ptr, len, val, op, dest);
+}
+
+void UnpackBits(const uint8_t* src, unsigned bit_width, size_t count, uint32_t* dest) {
+  DCHECK_LE(bit_width, 32);
+  switch (GetSimdLevel()) {
+    case SIMD_AVX512:
+      return UnpackBitsAvx512(src, bit_width, count, dest);
+    case SIMD_AVX2:
+      return UnpackBitsAvx2(src, bit_width, count, dest);
+    default:
+      return UnpackBitsScalar(src, bit_width, 0, count, dest);
+  }
+}
+
+// There are no AVX-512 variants, the lookups are per 128 bit lane anyway.
+bool ValidateUtf8(const uint8_t* ptr, size_t len) {
+  if (GetSimdLevel() >= SIMD_AVX2)
+    return ValidateUtf8Avx2(ptr, len);
+  return ValidateUtf8Sse(ptr, len);
+}
+
+size_t Utf8ToUtf16(const uint8_t* src, size_t len, uint16_t* dest) {
+  if (GetSimdLevel() >= SIMD_AVX2)
+    return Utf8ToUtf16Avx2(src, len, dest);
+  return Utf8ToUtf16Sse(src, len, dest);
+}
+
+size_t Utf8ToUtf32(const uint8_t* src, size_t len, uint32_t* dest) {
+  if (GetSimdLevel() >= SIMD_AVX2)
+    return Utf8ToUtf32Avx2(src, len, dest);
+  return Utf8ToUtf32Sse(src, len, dest);
+}
+
 #ifdef __SSE4_1__
 
 // taken from: https://github.com/lemire/FastDifferentialCoding/blob/master/src/fastdelta.c
@@ -82,7 +1394,7 @@ void ComputeDeltasInplace(uint32_t* buffer, size_t length, uint32_t starting_poi
 }
 
 void ComputeDeltasInplace(uint16_t* buffer, size_t length, uint16_t starting_point) {
-  __m128i prev = _mm_set1_epi32(starting_point); // starting_point replicated 4 times.
+  __m128i prev = _mm_set1_epi16(starting_point); // starting_point replicated 8 times.
   size_t i = 0;
   __m128i* buf16 = (__m128i*)buffer;
 
@@ -109,6 +1421,30 @@ void ComputeDeltasInplace(uint16_t* buffer, size_t length, uint16_t starting_poi
   }
 }
 
+void ComputeDeltasInplace(uint64_t* buffer, size_t length, uint64_t starting_point) {
+  __m128i prev = _mm_set1_epi64x(starting_point);
+  size_t i = 0;
+  __m128i* buf16 = (__m128i*)buffer;
+
+  for(; i  < length/2; i++) {
+    __m128i curr =  _mm_lddqu_si128 (buf16 + i);
+
+    // cur[0], prev[1].
+    __m128i val = _mm_or_si128(_mm_slli_si128(curr, 8), _mm_srli_si128(prev, 8));
+    __m128i delta = _mm_sub_epi64(curr, val);
+
+    _mm_storeu_si128(buf16 + i, delta);
+    prev = curr;
+  }
+
+  uint64_t lastprev = _mm_extract_epi64(prev, 1);
+  for(i = 2 * i; i < length; ++i) {
+    uint64_t curr = buffer[i];
+    buffer[i] = curr - lastprev;
+    lastprev = curr;
+  }
+}
+
 #endif
 
 }  // namespace base
@@ -8,14 +8,88 @@
 
 namespace base {
 
+// The instruction sets of the kernels below. Every kernel has SSE4.2 code and wider variants
+// for some of the levels, the best level supported by the cpu is chosen at runtime.
+enum SimdLevel { SIMD_SSE = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
+
+// The best level of the cpu, based on CPUID. AVX512 requires avx512f and avx512bw.
+SimdLevel CpuSimdLevel();
+
+// The level the kernels dispatch to. CpuSimdLevel() by default.
+SimdLevel GetSimdLevel();
+
+// Caps the level of the kernels, for tests and benchmarks. Clamped to CpuSimdLevel().
+void SetSimdLevel(SimdLevel level);
+
 // [ptr, ptr+len) should be inside memory range with alignment at least 16, i.e. in some cases
 // it will access memory before ptr and after ptr + len.
 // Returns how many times val appeared in the range.
 size_t CountVal8(const uint8_t* ptr, size_t len, char val);
 
+// Sets bit i of the mask if ptr[i] == val, i.e. bit i % 64 of dest[i / 64].
+// dest must have (len + 63) / 64 words. The bits past len are cleared.
+void MatchVal8(const uint8_t* ptr, size_t len, char val, uint64_t* dest);
+
+// Like MatchVal8 but matches any of vals[0, num_vals), e.g. delimiters, quotes and newlines.
+// num_vals must be in [1, 4].
+void MatchAnyOf8(const uint8_t* ptr, size_t len, const char* vals, unsigned num_vals,
+                 uint64_t* dest);
+
+// Returns the index of the first byte in [ptr, ptr+len) that is one of vals[0, num_vals)
+// or len if there is none. num_vals must be in [1, 4]. Does not read past ptr + len.
+size_t FindAnyOf8(const uint8_t* ptr, size_t len, const char* vals, unsigned num_vals);
+
+inline size_t FindVal8(const uint8_t* ptr, size_t len, char val) {
+  return FindAnyOf8(ptr, len, &val, 1);
+}
+
 // Writes to buffer the successive differences of buffer
 // (buffer[0]-starting_point, buffer[1]-buffer[2], ...)
 void ComputeDeltasInplace(uint32_t * buffer, size_t length, uint32_t starting_point);
 void ComputeDeltasInplace(uint16_t * buffer, size_t length, uint16_t starting_point);
+void ComputeDeltasInplace(uint64_t * buffer, size_t length, uint64_t starting_point);
+
+// The inverse of ComputeDeltasInplace, i.e. delta decoding: replaces buffer with its
+// prefix sums starting_point + buffer[0], starting_point + buffer[0] + buffer[1], ...
+// The sums wrap around.
+void ComputePrefixSumInplace(uint16_t* buffer, size_t length, uint16_t starting_point);
+void ComputePrefixSumInplace(uint32_t* buffer, size_t length, uint32_t starting_point);
+void ComputePrefixSumInplace(uint64_t* buffer, size_t length, uint64_t starting_point);
+
+// Sets the minimal and the maximal values of [ptr, ptr+len). len must be positive.
+void MinMax(const uint32_t* ptr, size_t len, uint32_t* min, uint32_t* max);
+void MinMax(const uint64_t* ptr, size_t len, uint64_t* min, uint64_t* max);
+
+// Sum of [ptr, ptr+len), wraps around for uint64_t.
+uint64_t Sum(const uint32_t* ptr, size_t len);
+uint64_t Sum(const uint64_t* ptr, size_t len);
+
+// The comparisons of CompareInt64 and CompareDouble, ptr[i] is the left operand.
+enum CmpOp { CMP_EQ, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+// Sets bit i of dest if ptr[i] op val, i.e. bit i % 64 of dest[i / 64], like MatchVal8.
+// dest must have (len + 63) / 64 words. The bits past len are cleared.
+void CompareInt64(const int64_t* ptr, size_t len, int64_t val, CmpOp op, uint64_t* dest);
+
+// NaNs are not equal, less or greater than any value.
+void CompareDouble(const double* ptr, size_t len, double val, CmpOp op, uint64_t* dest);
+
+// Returns true if [ptr, ptr+len) is valid UTF-8, i.e. has no overlong encodings, surrogates,
+// code points above U+10FFFF or truncated sequences. ASCII blocks take a fast path, the rest
+// is checked with the lookup tables of Keiser and Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte". Does not read past ptr + len.
+bool ValidateUtf8(const uint8_t* ptr, size_t len);
+
+// Transcode UTF-8 [src, src+len) into dest, which must have room for len units. Every byte
+// that does not start a valid sequence is replaced with U+FFFD. Returns the number of units
+// written. The ASCII blocks are widened with SIMD, the others are decoded one code point at
+// a time.
+size_t Utf8ToUtf16(const uint8_t* src, size_t len, uint16_t* dest);
+size_t Utf8ToUtf32(const uint8_t* src, size_t len, uint32_t* dest);
+
+// Unpacks count values of bit_width bits each from src into dest. The values are packed
+// from the least significant bit of src[0] upwards, bit_width must be in [0, 32] and src must
+// have (count * bit_width + 7) / 8 bytes. Does not read past them.
+void UnpackBits(const uint8_t* src, unsigned bit_width, size_t count, uint32_t* dest);
 
 }  // namespace base
@@ -4,6 +4,8 @@
 #include "base/simd.h"
 
 #include <memory>
+#include <numeric>
+#include <random>
 #include <gmock/gmock.h>
 
 #include "base/integral_types.h"
@@ -19,6 +21,16 @@ class SimdTest {
 
 };
 
+// Runs cb on all the levels supported by the cpu.
+template <typename Cb> void ForEachLevel(Cb&& cb) {
+  for (int l = SIMD_SSE; l <= CpuSimdLevel(); ++l) {
+    SetSimdLevel(SimdLevel(l));
+    ASSERT_EQ(l, GetSimdLevel());
+    cb();
+  }
+  SetSimdLevel(CpuSimdLevel());
+}
+
 TEST(SimdTest, Basic) {
   constexpr size_t kBufSize = 1 << 16;
   std::unique_ptr<uint8[]> buf(new uint8[kBufSize]);
@@ -73,6 +85,301 @@ TEST(SimdTest, OverFlow) {
   EXPECT_EQ(30, CountVal8(buf.get() + 2, 30, 1));
 }
 
+TEST(SimdTest, Levels) {
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[1000]);
+  for (unsigned i = 0; i < 1000; ++i) {
+    buf[i] = i % 5;
+  }
+  ForEachLevel([&] {
+    for (unsigned start : {0, 3, 61}) {
+      ASSERT_EQ(std::count(buf.get() + start, buf.get() + 1000, 2),
+                CountVal8(buf.get() + start, 1000 - start, 2));
+    }
+  });
+}
+
+TEST(SimdTest, FindAnyOf8) {
+  constexpr size_t kBufSize = 300;
+  std::string buf(kBufSize, 'a');
+  ForEachLevel([&] {
+    EXPECT_EQ(kBufSize, FindAnyOf8(reinterpret_cast<const uint8_t*>(buf.data()), kBufSize,
+                                   ",\"\n", 3));
+    for (size_t pos : {0, 1, 31, 32, 63, 64, 100, 299}) {
+      for (char c : {',', '"', '\n'}) {
+        std::string s = buf;
+        s[kBufSize - 1] = ',';
+        s[pos] = c;
+        const uint8_t* ptr = reinterpret_cast<const uint8_t*>(s.data());
+        ASSERT_EQ(pos, FindAnyOf8(ptr, kBufSize, ",\"\n", 3)) << pos << c;
+        if (c == '\n')
+          ASSERT_EQ(pos, FindVal8(ptr, kBufSize, '\n'));
+      }
+    }
+  });
+}
+
+TEST(SimdTest, MatchAnyOf8) {
+  constexpr size_t kBufSize = 1000;
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[kBufSize]);
+  for (unsigned i = 0; i < kBufSize; ++i) {
+    buf[i] = "a,b\"c\nd\r"[i % 8];
+  }
+
+  uint64_t mask[kBufSize / 64 + 1];
+  ForEachLevel([&] {
+    for (size_t len : {size_t(5), size_t(64), size_t(130), kBufSize}) {
+      MatchAnyOf8(buf.get(), len, ",\"\r\n", 4, mask);
+      for (size_t i = 0; i < len; ++i) {
+        bool expected = strchr(",\"\r\n", buf[i]) != nullptr;
+        ASSERT_EQ(expected, (mask[i / 64] >> (i % 64)) & 1) << len << " " << i;
+      }
+    }
+  });
+}
+
+TEST(SimdTest, PrefixSum) {
+  constexpr size_t kLen = 103;
+  ForEachLevel([&] {
+    uint16_t v16[kLen];
+    uint32_t v32[kLen];
+    uint64_t v64[kLen];
+    for (unsigned i = 0; i < kLen; ++i) {
+      v16[i] = i * 7;
+      v32[i] = i * 1000003;
+      v64[i] = i * (1ULL << 40);
+    }
+    ComputeDeltasInplace(v16, kLen, 5);
+    ComputeDeltasInplace(v32, kLen, 5);
+    ComputeDeltasInplace(v64, kLen, 5);
+    EXPECT_EQ(uint64_t(1ULL << 40), v64[1]);
+
+    ComputePrefixSumInplace(v16, kLen, 5);
+    ComputePrefixSumInplace(v32, kLen, 5);
+    ComputePrefixSumInplace(v64, kLen, 5);
+    for (unsigned i = 0; i < kLen; ++i) {
+      ASSERT_EQ(uint16_t(i * 7), v16[i]) << i;
+      ASSERT_EQ(uint32_t(i * 1000003), v32[i]) << i;
+      ASSERT_EQ(i * (1ULL << 40), v64[i]) << i;
+    }
+  });
+}
+
+TEST(SimdTest, Reductions) {
+  std::default_random_engine rand(17);
+  std::vector<uint32_t> v32(1001);
+  std::vector<uint64_t> v64(1001);
+  for (unsigned i = 0; i < v32.size(); ++i) {
+    v32[i] = rand();
+    v64[i] = (uint64_t(rand()) << 40) ^ rand();
+  }
+  v64[500] = ~0ULL;
+
+  ForEachLevel([&] {
+    for (size_t len : {1, 7, 33, 1001}) {
+      uint32_t min32, max32;
+      MinMax(v32.data(), len, &min32, &max32);
+      EXPECT_EQ(*std::min_element(v32.begin(), v32.begin() + len), min32);
+      EXPECT_EQ(*std::max_element(v32.begin(), v32.begin() + len), max32);
+
+      uint64_t min64, max64;
+      MinMax(v64.data(), len, &min64, &max64);
+      EXPECT_EQ(*std::min_element(v64.begin(), v64.begin() + len), min64);
+      EXPECT_EQ(*std::max_element(v64.begin(), v64.begin() + len), max64);
+
+      EXPECT_EQ(std::accumulate(v32.begin(), v32.begin() + len, uint64_t(0)),
+                Sum(v32.data(), len));
+      EXPECT_EQ(std::accumulate(v64.begin(), v64.begin() + len, uint64_t(0)),
+                Sum(v64.data(), len));
+    }
+  });
+}
+
+TEST(SimdTest, UnpackBits) {
+  constexpr size_t kCount = 301;
+  std::default_random_engine rand(5);
+
+  ForEachLevel([&] {
+    for (unsigned width = 0; width <= 32; ++width) {
+      uint64_t mask = (1ULL << width) - 1;
+      std::vector<uint32_t> vals(kCount);
+
+      // Packed exactly to (kCount * width + 7) / 8 bytes to catch reads past the end.
+      std::unique_ptr<uint8_t[]> packed(new uint8_t[(kCount * width + 7) / 8]());
+      for (size_t i = 0; i < kCount; ++i) {
+        vals[i] = rand() & mask;
+        for (unsigned b = 0; b < width; ++b) {
+          size_t bit = i * width + b;
+          packed[bit / 8] |= ((vals[i] >> b) & 1) << (bit % 8);
+        }
+      }
+
+      std::vector<uint32_t> dest(kCount, 1);
+      UnpackBits(packed.get(), width, kCount, dest.data());
+      ASSERT_EQ(vals, dest) << width;
+    }
+  });
+}
+
+TEST(SimdTest, MatchVal8) {
+  constexpr size_t kBufSize = 1000;
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[kBufSize]);
+  for (unsigned i = 0; i < kBufSize; ++i) {
+    buf[i] = (i % 3 == 0 || i % 7 == 0) ? '\n' : 'a';
+  }
+
+  uint64_t mask[kBufSize / 64 + 1];
+  for (unsigned start : {0, 1, 13, 64}) {
+    for (size_t len : {size_t(0), size_t(5), size_t(64), size_t(130), kBufSize - start}) {
+      std::fill(mask, mask + sizeof(mask) / 8, ~0ULL);
+      MatchVal8(buf.get() + start, len, '\n', mask);
+      for (size_t i = 0; i < (len + 63) / 64 * 64; ++i) {
+        bool expected = i < len && buf[start + i] == '\n';
+        ASSERT_EQ(expected, (mask[i / 64] >> (i % 64)) & 1) << start << " " << len << " " << i;
+      }
+    }
+  }
+}
+
+TEST(SimdTest, Compare) {
+  constexpr size_t kLen = 300;
+  std::mt19937_64 rnd(10);
+  std::vector<int64_t> ints(kLen);
+  std::vector<double> dbls(kLen);
+  for (size_t i = 0; i < kLen; ++i) {
+    ints[i] = int64_t(rnd() % 7) - 3;
+    dbls[i] = i % 13 == 0 ? NAN : ints[i] / 2.0;
+  }
+  ints[5] = kint64min;
+  ints[6] = kint64max;
+
+  auto expected = [](auto x, auto v, CmpOp op) {
+    switch (op) {
+      case CMP_EQ: return x == v;
+      case CMP_LT: return x < v;
+      case CMP_LE: return x <= v;
+      case CMP_GT: return x > v;
+      case CMP_GE: return x >= v;
+    }
+    return false;
+  };
+
+  uint64_t mask[kLen / 64 + 1];
+  ForEachLevel([&] {
+    for (CmpOp op : {CMP_EQ, CMP_LT, CMP_LE, CMP_GT, CMP_GE}) {
+      for (size_t len : {size_t(0), size_t(3), size_t(64), size_t(129), kLen}) {
+        std::fill(mask, mask + sizeof(mask) / 8, ~0ULL);
+        CompareInt64(ints.data(), len, 1, op, mask);
+        for (size_t i = 0; i < (len + 63) / 64 * 64; ++i) {
+          bool bit = (mask[i / 64] >> (i % 64)) & 1;
+          ASSERT_EQ(i < len && expected(ints[i], int64_t(1), op), bit) << op << " " << i;
+        }
+
+        std::fill(mask, mask + sizeof(mask) / 8, ~0ULL);
+        CompareDouble(dbls.data(), len, 0.5, op, mask);
+        for (size_t i = 0; i < (len + 63) / 64 * 64; ++i) {
+          bool bit = (mask[i / 64] >> (i % 64)) & 1;
+          ASSERT_EQ(i < len && expected(dbls[i], 0.5, op), bit) << op << " " << i;
+        }
+      }
+    }
+  });
+}
+
+// The reference decoder, returns the code points or false if s is not valid UTF-8.
+static bool DecodeUtf8Ref(const std::string& s, std::vector<uint32_t>* cps) {
+  for (size_t i = 0; i < s.size();) {
+    uint8_t c = s[i];
+    unsigned len = c < 0x80 ? 1 : c < 0xC0 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF8 ? 4 : 0;
+    if (len == 0 || i + len > s.size())
+      return false;
+    uint32_t cp = len == 1 ? c : c & (0x7F >> len);
+    for (unsigned j = 1; j < len; ++j) {
+      if ((uint8_t(s[i + j]) & 0xC0) != 0x80)
+        return false;
+      cp = (cp << 6) | (s[i + j] & 0x3F);
+    }
+    const uint32_t kMin[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (cp < kMin[len] || cp > 0x10FFFF || (cp >= 0xD800 && cp < 0xE000))
+      return false;
+    cps->push_back(cp);
+    i += len;
+  }
+  return true;
+}
+
+TEST(SimdTest, Utf8) {
+  const char* kValid[] = {"", "abc", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+                          "\xed\x9f\xbf", "\xf4\x8f\xbf\xbf", "\xef\xbb\xbf"};
+  const char* kInvalid[] = {"\x80", "\xc3", "\xc0\xaf", "\xc1\xbf", "\xe0\x9f\xbf",
+                            "\xed\xa0\x80", "\xf0\x8f\xbf\xbf", "\xf4\x90\x80\x80",
+                            "\xf5\x80\x80\x80", "\xff", "\xe2\x82", "\xc3\xa9\xa9"};
+  std::mt19937 rnd(7);
+  ForEachLevel([&] {
+    // Every sequence at all the offsets of the 64 byte blocks.
+    for (unsigned pos = 0; pos < 70; ++pos) {
+      for (const char* v : kValid) {
+        std::string s = std::string(pos, 'a') + v + "bcd";
+        ASSERT_TRUE(ValidateUtf8(reinterpret_cast<const uint8_t*>(s.data()), s.size())) << pos;
+      }
+      for (const char* v : kInvalid) {
+        std::string s = std::string(pos, 'a') + v;
+        ASSERT_FALSE(ValidateUtf8(reinterpret_cast<const uint8_t*>(s.data()), s.size()))
+            << pos << " " << v;
+        s += "bcd";
+        ASSERT_FALSE(ValidateUtf8(reinterpret_cast<const uint8_t*>(s.data()), s.size()))
+            << pos << " " << v;
+      }
+    }
+
+    // Random mixes of valid and invalid sequences against the reference.
+    for (unsigned iter = 0; iter < 2000; ++iter) {
+      std::string s;
+      unsigned num = rnd() % 40;
+      for (unsigned j = 0; j < num; ++j) {
+        unsigned r = rnd() % 100;
+        if (r < 50) {
+          s.push_back('a' + r % 26);
+        } else if (r < 97) {
+          s += kValid[1 + r % 7];
+        } else {
+          s += kInvalid[r % 12];
+        }
+      }
+
+      std::vector<uint32_t> cps;
+      bool valid = DecodeUtf8Ref(s, &cps);
+      const uint8_t* src = reinterpret_cast<const uint8_t*>(s.data());
+      ASSERT_EQ(valid, ValidateUtf8(src, s.size())) << iter;
+      if (!valid)
+        continue;
+
+      std::vector<uint32_t> u32(s.size());
+      u32.resize(Utf8ToUtf32(src, s.size(), u32.data()));
+      ASSERT_EQ(cps, u32);
+
+      std::vector<uint16_t> u16(s.size()), expected;
+      for (uint32_t cp : cps) {
+        if (cp < 0x10000) {
+          expected.push_back(cp);
+        } else {
+          expected.push_back(0xD800 + ((cp - 0x10000) >> 10));
+          expected.push_back(0xDC00 + ((cp - 0x10000) & 0x3FF));
+        }
+      }
+      u16.resize(Utf8ToUtf16(src, s.size(), u16.data()));
+      ASSERT_EQ(expected, u16);
+    }
+  });
+
+  std::string s = std::string(40, 'a') + "\xc3\xa9\xff" + std::string(40, 'b');
+  std::vector<uint32_t> u32(s.size());
+  u32.resize(Utf8ToUtf32(reinterpret_cast<const uint8_t*>(s.data()), s.size(), u32.data()));
+  ASSERT_EQ(82, u32.size());
+  EXPECT_EQ(0xE9, u32[40]);
+  EXPECT_EQ(0xFFFD, u32[41]);
+  EXPECT_EQ('b', u32[42]);
+}
+
 using benchmark::DoNotOptimize;
 
 static void BM_Simd(benchmark::State& state) {
@@ -91,4 +398,75 @@ static void BM_Plain(benchmark::State& state) {
 }
 BENCHMARK(BM_Plain)->Range(8, 1 << 16);
 
+static void BM_MatchVal8(benchmark::State& state) {
+  std::unique_ptr<uint8[]> buf(new uint8[state.range(0) + 20]);
+  std::unique_ptr<uint64_t[]> mask(new uint64_t[state.range(0) / 64 + 1]);
+  while (state.KeepRunning()) {
+    MatchVal8(buf.get() + 13, state.range(0), 1, mask.get());
+    DoNotOptimize(mask[0]);
+  }
+}
+BENCHMARK(BM_MatchVal8)->Range(8, 1 << 16);
+
+// Arg is the level.
+static void BM_CompareInt64(benchmark::State& state) {
+  SetSimdLevel(SimdLevel(state.range(0)));
+  std::vector<int64_t> buf(1 << 12, 1);
+  std::vector<uint64_t> mask(buf.size() / 64);
+  while (state.KeepRunning()) {
+    CompareInt64(buf.data(), buf.size(), 2, CMP_LT, mask.data());
+    DoNotOptimize(mask[0]);
+  }
+  SetSimdLevel(CpuSimdLevel());
+}
+BENCHMARK(BM_CompareInt64)->DenseRange(SIMD_SSE, SIMD_AVX512);
+
+// Arg is the level.
+static void BM_FindAnyOf8(benchmark::State& state) {
+  SetSimdLevel(SimdLevel(state.range(0)));
+  std::vector<uint8_t> buf(1 << 16, 'a');
+  while (state.KeepRunning()) {
+    DoNotOptimize(FindAnyOf8(buf.data(), buf.size(), ",\"\n", 3));
+  }
+  SetSimdLevel(CpuSimdLevel());
+}
+BENCHMARK(BM_FindAnyOf8)->DenseRange(SIMD_SSE, SIMD_AVX512);
+
+static void BM_PrefixSum32(benchmark::State& state) {
+  SetSimdLevel(SimdLevel(state.range(0)));
+  std::vector<uint32_t> buf(1 << 12, 1);
+  while (state.KeepRunning()) {
+    ComputePrefixSumInplace(buf.data(), buf.size(), 0);
+    DoNotOptimize(buf.back());
+  }
+  SetSimdLevel(CpuSimdLevel());
+}
+BENCHMARK(BM_PrefixSum32)->DenseRange(SIMD_SSE, SIMD_AVX512);
+
+static void BM_UnpackBits(benchmark::State& state) {
+  SetSimdLevel(SimdLevel(state.range(0)));
+  constexpr size_t kCount = 1 << 12;
+  std::vector<uint8_t> packed(kCount * 2);
+  std::vector<uint32_t> dest(kCount);
+  while (state.KeepRunning()) {
+    UnpackBits(packed.data(), 13, kCount, dest.data());
+    DoNotOptimize(dest[0]);
+  }
+  SetSimdLevel(CpuSimdLevel());
+}
+BENCHMARK(BM_UnpackBits)->DenseRange(SIMD_SSE, SIMD_AVX512);
+
+// Arg is the level.
+static void BM_ValidateUtf8(benchmark::State& state) {
+  SetSimdLevel(SimdLevel(state.range(0)));
+  std::string buf;
+  while (buf.size() < (1 << 16))
+    buf += "some ascii text, \xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d and \xe2\x82\xac. ";
+  while (state.KeepRunning()) {
+    DoNotOptimize(ValidateUtf8(reinterpret_cast<const uint8_t*>(buf.data()), buf.size()));
+  }
+  SetSimdLevel(CpuSimdLevel());
+}
+BENCHMARK(BM_ValidateUtf8)->DenseRange(SIMD_SSE, SIMD_AVX512);
+
 }  // namespace base
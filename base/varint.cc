@@ -3,14 +3,113 @@
 // Modified by: Roman Gershman (romange@gmail.com)
 //
 
+#include <cstring>
 #include <string>
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 #include "base/varint.h"
 
 constexpr int Varint::kMax32;
 constexpr int Varint::kMax64;
 using std::string;
 
+namespace {
+
+#ifdef __SSSE3__
+
+// Shuffles the varints that start in the first 12 bytes of a 16 byte block into 32 bit lanes,
+// indexed by the continuation bits of the 12 bytes. count is the number of complete varints
+// of upto 4 bytes taken from the block start, at most 4. It is 0 if the first varint is
+// 5 bytes long.
+struct MaskedVarintTable {
+  struct Entry {
+    uint8 shuffle[16];
+    uint8 consumed;
+    uint8 count;
+  };
+
+  Entry entries[1 << 12];
+
+  MaskedVarintTable() {
+    for (unsigned mask = 0; mask < (1 << 12); ++mask) {
+      Entry& e = entries[mask];
+      memset(e.shuffle, 0x80, sizeof(e.shuffle));
+      unsigned pos = 0, count = 0;
+      while (count < 4) {
+        unsigned end = pos;
+        while (end < 12 && (mask & (1 << end)))
+          ++end;
+        if (end == 12 || end - pos >= 4)
+          break;
+        for (unsigned k = pos; k <= end; ++k)
+          e.shuffle[count * 4 + k - pos] = k;
+        ++count;
+        pos = end + 1;
+      }
+      e.consumed = pos;
+      e.count = count;
+    }
+  }
+};
+
+// Shuffles the 4 values of a group into 32 bit lanes, indexed by the tag.
+struct GroupVarintTable {
+  struct Entry {
+    uint8 shuffle[16];
+    uint8 length;
+  };
+
+  Entry entries[256];
+
+  GroupVarintTable() {
+    for (unsigned tag = 0; tag < 256; ++tag) {
+      Entry& e = entries[tag];
+      memset(e.shuffle, 0x80, sizeof(e.shuffle));
+      unsigned pos = 0;
+      for (unsigned i = 0; i < 4; ++i) {
+        unsigned len = ((tag >> (2 * i)) & 3) + 1;
+        for (unsigned k = 0; k < len; ++k)
+          e.shuffle[i * 4 + k] = pos++;
+      }
+      e.length = pos;
+    }
+  }
+};
+
+const MaskedVarintTable masked_varint_table;
+const GroupVarintTable group_varint_table;
+
+// Stores the zero-extended 16 bytes of x in dest[0, 16).
+inline void Widen16(__m128i x, uint32* dest) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_unpacklo_epi8(x, zero), hi = _mm_unpackhi_epi8(x, zero);
+  __m128i* out = reinterpret_cast<__m128i*>(dest);
+  _mm_storeu_si128(out, _mm_unpacklo_epi16(lo, zero));
+  _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+  _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+  _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+}
+
+#endif
+
+inline const uint8* ParseGroupScalar(const uint8* ptr, uint32* dest) {
+  uint32 tag = *ptr++;
+  for (unsigned i = 0; i < 4; ++i) {
+    unsigned len = (tag & 3) + 1;
+    uint32 val = 0;
+    memcpy(&val, ptr, len);
+    dest[i] = val;
+    ptr += len;
+    tag >>= 2;
+  }
+  return ptr;
+}
+
+}  // namespace
+
 uint8* Varint::Encode32(uint8* sptr, uint32 v) {
   return Encode32Inline(sptr, v);
 }
@@ -257,3 +356,125 @@ int Varint::Length64(uint64 v) {
   }
   return nb + Varint::Length32(tmp);
 }
+
+const uint8* Varint::ParseArray32(const uint8* ptr, const uint8* limit, size_t count,
+                                  uint32* OUTPUT) {
+  size_t i = 0;
+#ifdef __SSSE3__
+  while (count - i >= 4 && limit - ptr >= 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+    unsigned mask = _mm_movemask_epi8(x);
+
+    if (mask == 0 && count - i >= 16) {
+      Widen16(x, OUTPUT + i);
+      i += 16;
+      ptr += 16;
+      continue;
+    }
+
+    const MaskedVarintTable::Entry& e = masked_varint_table.entries[mask & 0xFFF];
+    if (e.count == 0) {
+      ptr = Parse32WithLimit(ptr, limit, OUTPUT + i);
+      if (!ptr)
+        return NULL;
+      ++i;
+      continue;
+    }
+
+    // Gathers 7 bits of every byte in a lane.
+    __m128i y = _mm_shuffle_epi8(x, _mm_loadu_si128(reinterpret_cast<const __m128i*>(e.shuffle)));
+    __m128i v = _mm_and_si128(y, _mm_set1_epi32(0x7F));
+    v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(y, 1), _mm_set1_epi32(0x7F << 7)));
+    v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(y, 2), _mm_set1_epi32(0x7F << 14)));
+    v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(y, 3), _mm_set1_epi32(0x7F << 21)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(OUTPUT + i), v);
+
+    i += e.count;
+    ptr += e.consumed;
+  }
+#endif
+
+  for (; i < count; ++i) {
+    ptr = Parse32WithLimit(ptr, limit, OUTPUT + i);
+    if (!ptr)
+      return NULL;
+  }
+  return ptr;
+}
+
+const uint8* Varint::ParseArray64(const uint8* ptr, const uint8* limit, size_t count,
+                                  uint64* OUTPUT) {
+  constexpr uint64 kHighBits = 0x8080808080808080ULL;
+
+  size_t i = 0;
+  while (i < count) {
+    // Fast path for runs of single byte values.
+    if (count - i >= 8 && limit - ptr >= 8) {
+      uint64 word;
+      memcpy(&word, ptr, sizeof(word));
+      if ((word & kHighBits) == 0) {
+        for (unsigned k = 0; k < 8; ++k)
+          OUTPUT[i + k] = ptr[k];
+        i += 8;
+        ptr += 8;
+        continue;
+      }
+    }
+
+    ptr = Parse64WithLimit(ptr, limit, OUTPUT + i);
+    if (!ptr)
+      return NULL;
+    ++i;
+  }
+  return ptr;
+}
+
+uint8* Varint::EncodeGroup32(const uint32* src, size_t count, uint8* ptr) {
+  for (size_t i = 0; i < count; i += 4) {
+    uint8* tag = ptr++;
+    *tag = 0;
+    for (unsigned k = 0; k < 4; ++k) {
+      uint32 val = i + k < count ? src[i + k] : 0;
+      unsigned len = val < (1u << 8) ? 1 : val < (1u << 16) ? 2 : val < (1u << 24) ? 3 : 4;
+      memcpy(ptr, &val, len);
+      ptr += len;
+      *tag |= (len - 1) << (2 * k);
+    }
+  }
+  return ptr;
+}
+
+const uint8* Varint::ParseGroup32(const uint8* ptr, const uint8* limit, size_t count,
+                                  uint32* OUTPUT) {
+  size_t i = 0;
+
+#ifdef __SSSE3__
+  // The group is read as 16 bytes after its tag.
+  while (count - i >= 4 && limit - ptr >= 17) {
+    const GroupVarintTable::Entry& e = group_varint_table.entries[*ptr];
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 1));
+    x = _mm_shuffle_epi8(x, _mm_loadu_si128(reinterpret_cast<const __m128i*>(e.shuffle)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(OUTPUT + i), x);
+    ptr += 1 + e.length;
+    i += 4;
+  }
+#endif
+
+  uint32 group[4];
+  for (; i < count; i += 4) {
+    if (ptr >= limit)
+      return NULL;
+    uint32 tag = *ptr;
+    unsigned length = 1 + 4 + (tag & 3) + ((tag >> 2) & 3) + ((tag >> 4) & 3) + (tag >> 6);
+    if (size_t(limit - ptr) < length)
+      return NULL;
+
+    if (count - i >= 4) {
+      ptr = ParseGroupScalar(ptr, OUTPUT + i);
+    } else {
+      ptr = ParseGroupScalar(ptr, group);
+      memcpy(OUTPUT + i, group, (count - i) * sizeof(uint32));
+    }
+  }
+  return ptr;
+}
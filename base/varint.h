@@ -13,6 +13,9 @@
 //      vi_encode32_unchecked
 //      vi_encode64_unchecked
 //
+// ParseArray32/64 decode runs of varints in bulk, ParseGroup32 decodes the group varint format
+// that is faster to decode and should be preferred by new formats.
+//
 // Modified by: Roman Gershman (romange@gmail.com)
 #ifndef _CODING_VARINT_H
 #define _CODING_VARINT_H
@@ -75,6 +78,32 @@ class Varint {
   static const uint8* Parse64WithLimit(const uint8* ptr, const uint8* limit,
                                       uint64* OUTPUT);
 
+  // Parses count consecutive varints from [ptr,limit-1] into OUTPUT[0, count). Never reads
+  // at or beyond limit. Returns a pointer just past the last varint or NULL if the range
+  // does not hold count valid varints, in which case OUTPUT is partially written.
+  // ParseArray32 decodes several varints per SSSE3 shuffle, similarly to Masked VByte.
+  static const uint8* ParseArray32(const uint8* ptr, const uint8* limit, size_t count,
+                                   uint32* OUTPUT);
+  static const uint8* ParseArray64(const uint8* ptr, const uint8* limit, size_t count,
+                                   uint64* OUTPUT);
+
+  // Group varint encoding of uint32 arrays. Every 4 values are encoded as a tag byte followed
+  // by their little-endian bytes without leading zeros. Bits 2i, 2i+1 of the tag hold the
+  // number of bytes of value i minus 1. The last group is padded with zeros.
+  // The compression ratio is close to varint while a group is decoded with a single shuffle.
+  static constexpr size_t MaxGroupSize32(size_t count) { return (count + 3) / 4 * 17; }
+
+  // REQUIRES   "ptr" points to a buffer of length at least MaxGroupSize32(count).
+  // EFFECTS    Encodes src[0, count) into "ptr" and returns a pointer to the
+  //            byte just past the last encoded byte.
+  static uint8* EncodeGroup32(const uint32* src, size_t count, uint8* ptr);
+
+  // EFFECTS    Decodes count values encoded by EncodeGroup32 from [ptr,limit-1] into
+  //            OUTPUT[0, count). Returns a pointer just past the last group or NULL if
+  //            the range is too short.
+  static const uint8* ParseGroup32(const uint8* ptr, const uint8* limit, size_t count,
+                                   uint32* OUTPUT);
+
   // REQUIRES   "ptr" points to the first byte of a varint-encoded value.
   // EFFECTS     Scans until the end of the varint and returns a pointer just
   //             past the last byte. Returns NULL if "ptr" does not point to
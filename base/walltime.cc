@@ -7,6 +7,7 @@
 #include <atomic>
 #include <csignal>
 #include "base/walltime.h"
+#include "base/cycle_clock.h"
 #include "base/logging.h"
 #include "base/pthread_utils.h"
 
@@ -159,6 +160,8 @@ uint64 GetMonotonicJiffies() {
 }
 
 uint64 GetMonotonicMicrosFast() {
+  if (CycleClock::IsTsc())
+    return CycleClock::MonotonicMicros();
   return ms_long_counter.load(std::memory_order_acquire) * 100;
 }
 
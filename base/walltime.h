@@ -31,6 +31,12 @@ template<clockid_t cid> inline MicrosecondsInt64 GetClockMicros() {
   return ToMicros(ts);
 }
 
+template<clockid_t cid> inline int64 GetClockNanos() {
+  timespec ts;
+  clock_gettime(cid, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 inline MicrosecondsInt64 GetThreadTime() {
   return base::GetClockMicros<CLOCK_THREAD_CPUTIME_ID>();
 }
@@ -108,6 +114,7 @@ constexpr uint32 kJiffiesToMs = 10;
 
 uint64 GetMonotonicJiffies();
 
+// CycleClock::MonotonicMicros() if the cpu has a usable TSC, otherwise the jiffies clock above.
 uint64 GetMonotonicMicrosFast();
 
 }  // namespace base
@@ -14,6 +14,7 @@
 #include <mutex>
 #include <thread>
 
+#include "base/cycle_clock.h"
 #include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -120,6 +121,42 @@ TEST_F(WalltimeTest, ThreadTime) {
   t1.join();
 }
 
+TEST_F(WalltimeTest, CycleClock) {
+  LOG(INFO) << "TSC: " << CycleClock::IsTsc() << ", cycles per micro "
+            << CycleClock::CyclesPerMicro();
+
+  uint64_t start = CycleClock::Now();
+  MicrosecondsInt64 wall_start = GetMonotonicMicros();
+  SleepForMilliseconds(10);
+  uint64_t nanos = CycleClock::ToNanos(CycleClock::Now() - start);
+  MicrosecondsInt64 wall = GetMonotonicMicros() - wall_start;
+  EXPECT_NEAR(wall, nanos / 1000, 100);
+
+  Histogram hist;
+  {
+    ScopedCycleTimer timer(&hist);
+    SleepMicros(100);
+  }
+  { ScopedCycleTimer timer(nullptr); }
+  ASSERT_EQ(1, hist.count());
+  EXPECT_GE(hist.max(), 100000);
+}
+
+// Crosses the drift corrections of MonotonicMicros().
+TEST_F(WalltimeTest, CycleClockMonotonic) {
+  uint64_t prev = CycleClock::MonotonicMicros();
+  MicrosecondsInt64 end = GetMonotonicMicros() + 2500 * kNumMicrosPerMilli;
+  while (GetMonotonicMicros() < end) {
+    for (unsigned i = 0; i < 1000; ++i) {
+      uint64_t now = CycleClock::MonotonicMicros();
+      ASSERT_GE(now, prev);
+      prev = now;
+    }
+    EXPECT_NEAR(GetMonotonicMicros(), CycleClock::MonotonicMicros(), 200);
+    SleepMicros(500);
+  }
+}
+
 using benchmark::DoNotOptimize;
 
 static void BM_TimeX4(benchmark::State& state) {
@@ -193,6 +230,13 @@ static void BM_MonotonicMicrosFast(benchmark::State& state) {
 }
 BENCHMARK(BM_MonotonicMicrosFast)->ThreadRange(1, 8);
 
+static void BM_CycleClock(benchmark::State& state) {
+  while (state.KeepRunning()) {
+    DoNotOptimize(CycleClock::Now());
+  }
+}
+BENCHMARK(BM_CycleClock);
+
 static void BM_ReadLock(benchmark::State& state) {
   pthread_rwlock_t lock;
   CHECK_EQ(0, pthread_rwlock_init(&lock, nullptr));
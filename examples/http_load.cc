@@ -0,0 +1,265 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+// Open-loop HTTP load generator. Unlike a closed-loop client, it does not wait for the responses
+// before sending the next request: the requests arrive at a fixed or Poisson rate and queue up
+// for a free connection when the server falls behind. The latency of a request is measured from
+// the time it was supposed to be sent, hence a stalled server is charged for all the requests
+// that arrived during the stall (no coordinated omission).
+//
+// Usage: http_load --connect=host:port --rate=5000 --connections=64 --duration=30
+//                  [--poisson] [--mix_file=mix.txt]
+// Every line of the mix file is "weight method path [body]", e.g. "9 GET /search?q=foo".
+// Lines that start with '#' are ignored.
+
+#include <iostream>
+#include <random>
+
+#include <boost/beast/http/verb.hpp>
+#include <boost/fiber/operations.hpp>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "base/hdr_histogram.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "file/file_util.h"
+#include "strings/stringpiece.h"
+#include "util/asio/io_context_pool.h"
+#include "util/fibers/simple_channel.h"
+#include "util/http/http_client.h"
+
+using namespace util;
+using namespace std;
+
+DEFINE_string(connect, "localhost:8080", "Server host:port");
+DEFINE_double(rate, 1000, "Total number of requests per second");
+DEFINE_bool(poisson, false, "Exponential inter-arrival times instead of the fixed ones");
+DEFINE_uint32(duration, 10, "Duration of the run in seconds");
+DEFINE_uint32(connections, 16, "Total number of connections");
+DEFINE_uint32(io_threads, 0, "Number of IO threads, 0 for the number of cpus");
+DEFINE_string(path, "/", "The path of the GET requests when mix_file is not set");
+DEFINE_string(mix_file, "", "File with the weighted requests, see the header of http_load.cc");
+
+namespace {
+
+using Clock = chrono::steady_clock;
+using http::Client;
+
+struct Request {
+  Client::Verb verb;
+  string path;
+  string body;
+};
+
+struct Mix {
+  vector<Request> requests;
+  vector<double> weights;
+};
+
+// Requests that arrived, but were not sent yet.
+struct Arrival {
+  Clock::time_point intended;
+  const Request* request;
+};
+
+struct ThreadStats {
+  base::HdrHistogram latency;  // Since the intended send time, usec.
+  base::HdrHistogram service;  // Since the actual send time, usec.
+  uint64 sent = 0, errors = 0, non_2xx = 0, connect_errors = 0;
+
+  void Merge(const ThreadStats& o) {
+    latency.Merge(o.latency);
+    service.Merge(o.service);
+    sent += o.sent;
+    errors += o.errors;
+    non_2xx += o.non_2xx;
+    connect_errors += o.connect_errors;
+  }
+};
+
+Mix ParseMix(const string& file_name) {
+  Mix mix;
+  if (file_name.empty()) {
+    mix.requests.push_back(Request{Client::Verb::get, FLAGS_path, string{}});
+    mix.weights.push_back(1);
+    return mix;
+  }
+
+  string contents;
+  file_util::ReadFileToStringOrDie(file_name, &contents);
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    line = absl::StripAsciiWhitespace(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+    vector<absl::string_view> parts =
+        absl::StrSplit(line, absl::MaxSplits(' ', 3), absl::SkipEmpty());
+    CHECK_GE(parts.size(), 3) << "Bad mix line: " << line;
+
+    double weight = 0;
+    CHECK(absl::SimpleAtod(parts[0], &weight) && weight > 0) << "Bad weight: " << line;
+    Client::Verb verb =
+        boost::beast::http::string_to_verb(boost::string_view(parts[1].data(), parts[1].size()));
+    CHECK(verb != Client::Verb::unknown) << "Bad method: " << line;
+
+    Request req{verb, string(parts[2]), parts.size() > 3 ? string(parts[3]) : string{}};
+    mix.requests.push_back(std::move(req));
+    mix.weights.push_back(weight);
+  }
+  CHECK(!mix.requests.empty()) << "No requests in " << file_name;
+
+  return mix;
+}
+
+class LoadThread {
+ public:
+  LoadThread(IoContext* cntx, const Mix& mix, double rate, unsigned connections)
+      : cntx_(*cntx), mix_(mix), rate_(rate), connections_(connections), channel_(1 << 16) {}
+
+  // Blocks until the run finishes and all the arrived requests are served.
+  void Run(StringPiece host, StringPiece port, Clock::time_point start, Clock::time_point end);
+
+  const ThreadStats& stats() const { return stats_; }
+
+ private:
+  void Schedule(Clock::time_point start, Clock::time_point end);
+  void Connection(StringPiece host, StringPiece port);
+
+  IoContext& cntx_;
+  const Mix& mix_;
+  const double rate_;
+  const unsigned connections_;
+
+  fibers_ext::SimpleChannel<Arrival> channel_;
+  ThreadStats stats_;
+};
+
+void LoadThread::Run(StringPiece host, StringPiece port, Clock::time_point start,
+                     Clock::time_point end) {
+  vector<::boost::fibers::fiber> fibers;
+  for (unsigned i = 0; i < connections_; ++i) {
+    fibers.push_back(cntx_.LaunchFiber(&LoadThread::Connection, this, host, port));
+  }
+
+  Schedule(start, end);
+  channel_.StartClosing();
+
+  for (auto& f : fibers)
+    f.join();
+}
+
+// The arrival times depend only on the start time and on the rate, so that a server that
+// does not keep up delays the sending of the requests, but not their intended times.
+void LoadThread::Schedule(Clock::time_point start, Clock::time_point end) {
+  std::mt19937_64 rnd(std::random_device{}());
+  std::exponential_distribution<double> exp_dist(rate_);
+  std::discrete_distribution<size_t> pick(mix_.weights.begin(), mix_.weights.end());
+
+  double offset_sec = 0;
+  while (true) {
+    offset_sec += FLAGS_poisson ? exp_dist(rnd) : 1.0 / rate_;
+    Clock::time_point intended =
+        start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(offset_sec));
+    if (intended >= end)
+      break;
+
+    ::boost::this_fiber::sleep_until(intended);
+    channel_.Push(Arrival{intended, &mix_.requests[pick(rnd)]});
+  }
+}
+
+void LoadThread::Connection(StringPiece host, StringPiece port) {
+  Client client(&cntx_);
+  Arrival arrival;
+
+  while (channel_.Pop(arrival)) {
+    if (!client.IsReusable()) {
+      client.Shutdown();
+      auto ec = client.Connect(host, port);
+      if (ec) {
+        VLOG(1) << "Could not connect: " << ec.message();
+        ++stats_.connect_errors;
+        ++stats_.errors;
+        continue;
+      }
+    }
+
+    const Request& req = *arrival.request;
+    Client::Response resp;
+    Clock::time_point send_time = Clock::now();
+    auto ec = client.Send(req.verb, req.path, req.body, &resp);
+    Clock::time_point now = Clock::now();
+    ++stats_.sent;
+
+    if (ec) {
+      VLOG(1) << "Error sending " << req.path << ": " << ec.message();
+      ++stats_.errors;
+      continue;
+    }
+    if (resp.result_int() / 100 != 2)
+      ++stats_.non_2xx;
+
+    using chrono::microseconds;
+    stats_.latency.Add(chrono::duration_cast<microseconds>(now - arrival.intended).count());
+    stats_.service.Add(chrono::duration_cast<microseconds>(now - send_time).count());
+  }
+}
+
+void PrintHistogram(const char* name, const base::HdrHistogram& hist) {
+  cout << name << " usec: avg " << uint64(hist.Average()) << ", p50 " << hist.Percentile(50)
+       << ", p90 " << hist.Percentile(90) << ", p99 " << hist.Percentile(99) << ", p99.9 "
+       << hist.Percentile(99.9) << ", max " << hist.max() << endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  MainInitGuard guard(&argc, &argv);
+
+  vector<string> parts = absl::StrSplit(FLAGS_connect, ':');
+  CHECK_EQ(2, parts.size()) << "--connect must be host:port";
+  CHECK_GT(FLAGS_rate, 0);
+  CHECK_GT(FLAGS_connections, 0);
+
+  Mix mix = ParseMix(FLAGS_mix_file);
+
+  IoContextPool pool(FLAGS_io_threads);
+  pool.Run();
+
+  // Every thread runs its part of the connections and of the rate.
+  unsigned num_threads = std::min<unsigned>(pool.size(), FLAGS_connections);
+  vector<unique_ptr<LoadThread>> threads(pool.size());
+  for (unsigned i = 0; i < num_threads; ++i) {
+    unsigned connections = FLAGS_connections / num_threads + (i < FLAGS_connections % num_threads);
+    threads[i].reset(new LoadThread(&pool[i], mix, FLAGS_rate / num_threads, connections));
+  }
+
+  Clock::time_point start = Clock::now() + chrono::milliseconds(100);
+  Clock::time_point end = start + chrono::seconds(FLAGS_duration);
+
+  pool.AwaitFiberOnAll([&](IoContext& cntx) {
+    unsigned index = &cntx - &pool[0];
+    if (threads[index])
+      threads[index]->Run(parts[0], parts[1], start, end);
+  });
+  double elapsed_sec = chrono::duration<double>(Clock::now() - start).count();
+  pool.Stop();
+
+  ThreadStats total;
+  for (const auto& t : threads) {
+    if (t)
+      total.Merge(t->stats());
+  }
+
+  cout << "Sent " << total.sent << " requests in " << elapsed_sec << " sec, "
+       << total.latency.count() / elapsed_sec << " responses/sec, target "
+       << FLAGS_rate << " requests/sec" << endl;
+  cout << "Errors: " << total.errors << " (connect " << total.connect_errors << "), non-2xx "
+       << total.non_2xx << endl;
+  PrintHistogram("Latency", total.latency);
+  PrintHistogram("Service time", total.service);
+
+  return 0;
+}
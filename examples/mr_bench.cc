@@ -0,0 +1,550 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+// End-to-end benchmark of the mr3 framework. Generates a reproducible synthetic dataset,
+// runs the standard pipelines over it with the local runner and writes a JSON report with
+// the throughput, the cpu time and the peak RSS of every operator, e.g.:
+//
+//   mr_bench --dataset_format=json --dataset_records=10000000 --dataset_skew=1.1 \
+//            --report_file=report.json
+//
+// The dataset is kept under --dest_dir/data and is reused by the runs with the same dataset
+// flags, so that they measure the pipelines only.
+//
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "base/hash.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "file/file_util.h"
+#include "file/list_file.h"
+#include "mr/group_table.h"
+#include "mr/local_runner.h"
+#include "mr/mr_main.h"
+
+using namespace mr3;
+using namespace util;
+using namespace std;
+namespace rj = rapidjson;
+
+DEFINE_string(dest_dir, "~/mr_bench", "Working dir that holds the datasets and the outputs");
+DEFINE_string(dataset_format, "txt", "Format of the dataset: txt, lst or json");
+DEFINE_uint64(dataset_records, 1000000, "Number of the records in the dataset");
+DEFINE_uint32(dataset_keys, 100000, "Number of the distinct keys");
+DEFINE_double(dataset_skew, 0, "Zipf exponent of the key frequencies, 0 for uniform keys");
+DEFINE_uint32(dataset_value_size, 64, "Payload bytes of every record");
+DEFINE_uint32(dataset_files, 8, "Number of the input files");
+DEFINE_uint32(dataset_seed, 1, "Seed of the dataset generator");
+DEFINE_bool(regenerate_dataset, false, "Generates the dataset even if it already exists");
+DEFINE_string(pipelines, "map,reshard,group,join",
+              "Comma separated pipelines to run. group and join consume the output of reshard");
+DEFINE_uint32(num_shards, 16, "Number of the output shards");
+DEFINE_string(compress, "", "can be '', 'gzip' or 'zstd'");
+DEFINE_string(report_file, "", "Writes the JSON report into this file, to stdout if empty");
+
+namespace {
+
+constexpr char kSuccessFile[] = "_SUCCESS";
+
+struct BenchRecord {
+  string key;
+  int64_t val = 0;
+  string payload;
+};
+
+struct DimRecord {
+  string key;
+  string attr;
+};
+
+// Splits "key\tval\tpayload" lines, the format of txt and lst datasets.
+bool ParseTabs(absl::string_view line, BenchRecord* res) {
+  vector<absl::string_view> cols = absl::StrSplit(line, absl::MaxSplits('\t', 2));
+  if (cols.size() != 3 || !absl::SimpleAtoi(cols[1], &res->val))
+    return false;
+  res->key = string(cols[0]);
+  res->payload = string(cols[2]);
+  return true;
+}
+
+bool ParseJson(string* line, BenchRecord* res) {
+  if (line->empty())
+    return false;
+
+  rj::Document doc;
+  if (doc.ParseInsitu(&line->front()).HasParseError() || !doc.IsObject())
+    return false;
+  auto key = doc.FindMember("key"), val = doc.FindMember("val"), pl = doc.FindMember("payload");
+  if (key == doc.MemberEnd() || val == doc.MemberEnd() || pl == doc.MemberEnd() ||
+      !key->value.IsString() || !val->value.IsInt64() || !pl->value.IsString())
+    return false;
+
+  res->key.assign(key->value.GetString(), key->value.GetStringLength());
+  res->val = val->value.GetInt64();
+  res->payload.assign(pl->value.GetString(), pl->value.GetStringLength());
+  return true;
+}
+
+// Samples the key ranks, rank 0 is the most frequent one.
+class KeySampler {
+ public:
+  KeySampler(unsigned keys, double skew);
+
+  unsigned Next(mt19937_64* rng) const;
+
+ private:
+  unsigned keys_;
+  vector<double> cdf_;  // empty for the uniform keys.
+};
+
+KeySampler::KeySampler(unsigned keys, double skew) : keys_(max(1u, keys)) {
+  if (skew <= 0)
+    return;
+  cdf_.resize(keys_);
+  double sum = 0;
+  for (unsigned i = 0; i < keys_; ++i) {
+    sum += 1.0 / pow(i + 1, skew);
+    cdf_[i] = sum;
+  }
+}
+
+unsigned KeySampler::Next(mt19937_64* rng) const {
+  if (cdf_.empty())
+    return (*rng)() % keys_;
+
+  double u = uniform_real_distribution<double>(0, cdf_.back())(*rng);
+  return min<size_t>(lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin(), keys_ - 1);
+}
+
+inline string KeyName(unsigned rank) { return absl::StrCat("key", rank); }
+
+string FormatRecord(const BenchRecord& rec, bool json) {
+  if (json) {
+    return absl::StrCat(R"({"key":")", rec.key, R"(","val":)", rec.val, R"(,"payload":")",
+                        rec.payload, "\"}");
+  }
+  return absl::StrCat(rec.key, "\t", rec.val, "\t", rec.payload);
+}
+
+// Writes the records of a text file in large chunks.
+class TextWriter {
+ public:
+  explicit TextWriter(const string& path) : file_(file_util::OpenOrDie(path)) {}
+
+  void Add(const string& line) {
+    absl::StrAppend(&buf_, line, "\n");
+    if (buf_.size() >= kFlushSize)
+      Flush();
+  }
+
+  void Close() {
+    Flush();
+    CHECK(file_->Close());
+  }
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 20;
+
+  void Flush() {
+    CHECK_STATUS(file_->Write(buf_));
+    buf_.clear();
+  }
+
+  file::WriteFile* file_;
+  string buf_;
+};
+
+// Every file has its own generator, hence the dataset does not depend on the thread timing.
+size_t GenerateFile(const string& path, unsigned index, uint64_t records,
+                    const KeySampler& sampler) {
+  mt19937_64 rng(uint64_t(FLAGS_dataset_seed) * 1000003 + index);
+  bool is_lst = FLAGS_dataset_format == "lst", is_json = FLAGS_dataset_format == "json";
+
+  unique_ptr<file::ListWriter> lst;
+  unique_ptr<TextWriter> txt;
+  if (is_lst) {
+    lst.reset(new file::ListWriter(path));
+    CHECK_STATUS(lst->Init());
+  } else {
+    txt.reset(new TextWriter(path));
+  }
+
+  BenchRecord rec;
+  rec.payload.resize(FLAGS_dataset_value_size);
+  for (uint64_t i = 0; i < records; ++i) {
+    rec.key = KeyName(sampler.Next(&rng));
+    rec.val = rng() >> 1;
+    for (char& c : rec.payload) {
+      c = 'a' + rng() % 26;
+    }
+
+    string line = FormatRecord(rec, is_json);
+    if (lst) {
+      CHECK_STATUS(lst->AddRecord(line));
+    } else {
+      txt->Add(line);
+    }
+  }
+
+  if (lst) {
+    CHECK_STATUS(lst->Flush());
+  } else {
+    txt->Close();
+  }
+  return file_util::LocalFileSize(path);
+}
+
+struct Dataset {
+  string fact_glob, dim_glob;
+  size_t bytes = 0;
+  double generate_sec = 0;  // 0 if the dataset was reused.
+};
+
+Dataset PrepareDataset() {
+  string name = absl::StrFormat("%s-%u-%u-%g-%u-%u-%u", FLAGS_dataset_format,
+                                FLAGS_dataset_records, FLAGS_dataset_keys, FLAGS_dataset_skew,
+                                FLAGS_dataset_value_size, FLAGS_dataset_files, FLAGS_dataset_seed);
+  string dir = file_util::JoinPath(file_util::ExpandPath(FLAGS_dest_dir), "data/" + name);
+  string success = file_util::JoinPath(dir, kSuccessFile);
+
+  Dataset res;
+  res.fact_glob = file_util::JoinPath(dir, "part-*");
+  res.dim_glob = file_util::JoinPath(dir, "dim-*");
+
+  if (!FLAGS_regenerate_dataset && file_util::LocalFileSize(success) >= 0) {
+    for (const auto& st : file_util::StatFiles(res.fact_glob)) {
+      res.bytes += st.size;
+    }
+    LOG(INFO) << "Reusing dataset " << dir << " of " << res.bytes << " bytes";
+    return res;
+  }
+
+  file_util::DeleteRecursively(dir);
+  CHECK(file_util::RecursivelyCreateDir(dir, 0750)) << dir;
+  LOG(INFO) << "Generating dataset " << dir;
+
+  uint64_t start = GetMonotonicMicros();
+  KeySampler sampler(FLAGS_dataset_keys, FLAGS_dataset_skew);
+  unsigned files = max(1u, FLAGS_dataset_files);
+  vector<size_t> sizes(files);
+  vector<thread> threads;
+
+  for (unsigned i = 0; i < files; ++i) {
+    uint64_t records = FLAGS_dataset_records / files + (i < FLAGS_dataset_records % files);
+    string path = file_util::JoinPath(dir, absl::StrFormat("part-%04d", i));
+    threads.emplace_back(
+        [&, i, records, path] { sizes[i] = GenerateFile(path, i, records, sampler); });
+  }
+
+  // The dimension table of the join has one record per key.
+  for (unsigned i = 0; i < files; ++i) {
+    TextWriter dim(file_util::JoinPath(dir, absl::StrFormat("dim-%04d", i)));
+    for (unsigned k = i; k < max(1u, FLAGS_dataset_keys); k += files) {
+      dim.Add(absl::StrCat(KeyName(k), "\tattr", k % 1000));
+    }
+    dim.Close();
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (size_t sz : sizes) {
+    res.bytes += sz;
+  }
+  res.generate_sec = (GetMonotonicMicros() - start) * 1e-6;
+  file_util::WriteStringToFileOrDie(absl::StrCat(res.bytes), success);
+  LOG(INFO) << "Generated " << res.bytes << " bytes in " << res.generate_sec << " sec";
+
+  return res;
+}
+
+}  // namespace
+
+namespace mr3 {
+
+template <> class RecordTraits<BenchRecord> {
+ public:
+  static std::string Serialize(bool is_binary, const BenchRecord& rec) {
+    return FormatRecord(rec, false);
+  }
+
+  bool Parse(bool is_binary, std::string&& tmp, BenchRecord* res) { return ParseTabs(tmp, res); }
+};
+
+template <> class RecordTraits<DimRecord> {
+ public:
+  static std::string Serialize(bool is_binary, const DimRecord& rec) {
+    return absl::StrCat(rec.key, "\t", rec.attr);
+  }
+
+  bool Parse(bool is_binary, std::string&& tmp, DimRecord* res) {
+    vector<string> cols = absl::StrSplit(tmp, absl::MaxSplits('\t', 1));
+    if (cols.size() != 2)
+      return false;
+    res->key = std::move(cols[0]);
+    res->attr = std::move(cols[1]);
+    return true;
+  }
+};
+
+}  // namespace mr3
+
+namespace {
+
+// Parses the dataset records.
+class ParseMapper {
+ public:
+  void Do(string line, DoContext<BenchRecord>* cntx) {
+    BenchRecord rec;
+    bool ok = is_json_ ? ParseJson(&line, &rec) : ParseTabs(line, &rec);
+    if (ok) {
+      cntx->Write(std::move(rec));
+    } else {
+      cntx->raw()->Inc("parse-error");
+    }
+  }
+
+ private:
+  bool is_json_ = FLAGS_dataset_format == "json";
+};
+
+// The map-only pipeline: parses, filters and projects the records.
+class FilterMapper {
+ public:
+  void Do(string line, DoContext<BenchRecord>* cntx) {
+    BenchRecord rec;
+    bool ok = is_json_ ? ParseJson(&line, &rec) : ParseTabs(line, &rec);
+    if (ok && rec.val % 2 == 0) {
+      rec.payload.resize(min<size_t>(rec.payload.size(), 8));
+      cntx->Write(std::move(rec));
+    }
+  }
+
+ private:
+  bool is_json_ = FLAGS_dataset_format == "json";
+};
+
+class DimMapper {
+ public:
+  void Do(string line, DoContext<DimRecord>* cntx) {
+    DimRecord rec;
+    if (parser_.Parse(false, std::move(line), &rec)) {
+      cntx->Write(std::move(rec));
+    }
+  }
+
+ private:
+  RecordTraits<DimRecord> parser_;
+};
+
+class KeyGrouper {
+ public:
+  void Add(BenchRecord rec, DoContext<string>* cntx) {
+    auto& k_v = groups_[rec.key];
+    ++k_v.first;
+    k_v.second += rec.val % 1000;
+  }
+
+  void OnShardFinish(DoContext<string>* cntx) {
+    groups_.ForEach([cntx](absl::string_view key, pair<uint64_t, int64_t>& k_v) {
+      cntx->Write(absl::StrCat(key, "\t", k_v.first, "\t", k_v.second));
+    });
+    groups_.Reset();
+  }
+
+ private:
+  GroupTable<pair<uint64_t, int64_t>> groups_;  // key -> (count, sum)
+};
+
+// Enriches the records with the attributes of their keys. The dimension shard is loaded first.
+class DimJoiner {
+ public:
+  void OnDim(DimRecord dim, DoContext<BenchRecord>* cntx) {
+    attrs_[dim.key] = std::move(dim.attr);
+  }
+
+  void OnFact(BenchRecord rec, DoContext<BenchRecord>* cntx) {
+    const string* attr = attrs_.Find(rec.key);
+    if (!attr) {
+      cntx->raw()->Inc("join-miss");
+      return;
+    }
+    rec.payload = *attr;
+    cntx->Write(std::move(rec));
+  }
+
+  void OnShardFinish(DoContext<BenchRecord>* cntx) { attrs_.Reset(); }
+
+ private:
+  GroupTable<string> attrs_;
+};
+
+template <typename T> void ConfigureOutput(Output<T>* out) {
+  if (FLAGS_compress == "gzip") {
+    out->AndCompress(pb::Output::GZIP);
+  } else if (FLAGS_compress == "zstd") {
+    out->AndCompress(pb::Output::ZSTD);
+  } else {
+    CHECK(FLAGS_compress.empty()) << "Unknown compress argument " << FLAGS_compress;
+  }
+}
+
+inline unsigned KeyShard(const string& key) { return base::Fingerprint32(key); }
+
+uint64_t ProcessCpuMicros() {
+  rusage ru;
+  CHECK_EQ(0, getrusage(RUSAGE_SELF, &ru));
+  auto micros = [](const timeval& tv) { return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec; };
+  return micros(ru.ru_utime) + micros(ru.ru_stime);
+}
+
+string Report(const Dataset& ds, const vector<string>& pipelines, unsigned io_threads,
+              double wall_sec, double cpu_sec, const string& progress) {
+  rj::StringBuffer sb;
+  rj::Writer<rj::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.Key("dataset");
+  writer.StartObject();
+  writer.Key("format");
+  writer.String(FLAGS_dataset_format.c_str());
+  writer.Key("records");
+  writer.Uint64(FLAGS_dataset_records);
+  writer.Key("keys");
+  writer.Uint(FLAGS_dataset_keys);
+  writer.Key("skew");
+  writer.Double(FLAGS_dataset_skew);
+  writer.Key("value_size");
+  writer.Uint(FLAGS_dataset_value_size);
+  writer.Key("files");
+  writer.Uint(FLAGS_dataset_files);
+  writer.Key("seed");
+  writer.Uint(FLAGS_dataset_seed);
+  writer.Key("bytes");
+  writer.Uint64(ds.bytes);
+  writer.Key("generate_sec");
+  writer.Double(ds.generate_sec);
+  writer.EndObject();
+
+  writer.Key("pipelines");
+  writer.StartArray();
+  for (const string& p : pipelines) {
+    writer.String(p.c_str());
+  }
+  writer.EndArray();
+  writer.Key("num_shards");
+  writer.Uint(FLAGS_num_shards);
+  writer.Key("compress");
+  writer.String(FLAGS_compress.c_str());
+  writer.Key("io_threads");
+  writer.Uint(io_threads);
+  writer.Key("wall_sec");
+  writer.Double(wall_sec);
+  writer.Key("cpu_sec");
+  writer.Double(cpu_sec);
+
+  // Per operator throughput, cpu and peak RSS, see PipelineProgress::ToJson.
+  writer.Key("progress");
+  writer.RawValue(progress.data(), progress.size(), rj::kObjectType);
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  PipelineMain pm(&argc, &argv);
+
+  CHECK(FLAGS_dataset_format == "txt" || FLAGS_dataset_format == "lst" ||
+        FLAGS_dataset_format == "json")
+      << "Unknown dataset format " << FLAGS_dataset_format;
+  CHECK_GT(FLAGS_num_shards, 0);
+
+  vector<string> pipelines = absl::StrSplit(FLAGS_pipelines, ',', absl::SkipEmpty());
+  auto has = [&](const char* name) {
+    return std::find(pipelines.begin(), pipelines.end(), name) != pipelines.end();
+  };
+  for (const string& p : pipelines) {
+    CHECK(p == "map" || p == "reshard" || p == "group" || p == "join") << "Unknown pipeline " << p;
+  }
+  CHECK(!pipelines.empty());
+  if ((has("group") || has("join")) && !has("reshard")) {
+    LOG(INFO) << "Adding reshard, group and join consume its output";
+    pipelines.push_back("reshard");
+  }
+
+  Dataset ds = PrepareDataset();
+
+  Pipeline* pipeline = pm.pipeline();
+  StringTable input = FLAGS_dataset_format == "lst" ? pipeline->ReadLst("read", ds.fact_glob)
+                                                    : pipeline->ReadText("read", ds.fact_glob);
+  const unsigned shards = FLAGS_num_shards;
+
+  if (has("map")) {
+    PTable<BenchRecord> mapped = input.Map<FilterMapper>("map");
+    ConfigureOutput(&mapped.Write("map_out", pb::WireFormat::TXT)
+                         .WithModNSharding(shards, [](const BenchRecord& r) { return r.val; }));
+  }
+
+  PTable<BenchRecord> resharded;
+  if (has("reshard")) {
+    resharded = input.Map<ParseMapper>("reshard");
+    ConfigureOutput(&resharded.Write("reshard_out", pb::WireFormat::TXT)
+                         .WithModNSharding(shards, [](const BenchRecord& r) {
+                           return KeyShard(r.key);
+                         }));
+  }
+
+  if (has("group")) {
+    StringTable grouped =
+        pipeline->Join<KeyGrouper>("group", {resharded.BindWith(&KeyGrouper::Add)});
+    ConfigureOutput(&grouped.Write("group_out", pb::WireFormat::TXT)
+                         .WithModNSharding(shards, [](const string& s) { return KeyShard(s); }));
+  }
+
+  if (has("join")) {
+    PTable<DimRecord> dim = pipeline->ReadText("read_dim", ds.dim_glob).Map<DimMapper>("dim");
+    ConfigureOutput(&dim.Write("dim_out", pb::WireFormat::TXT)
+                         .WithModNSharding(shards, [](const DimRecord& r) {
+                           return KeyShard(r.key);
+                         }));
+
+    PTable<BenchRecord> joined = pipeline->Join<DimJoiner>(
+        "join", {dim.BindWith(&DimJoiner::OnDim), resharded.BindWith(&DimJoiner::OnFact)});
+    ConfigureOutput(&joined.Write("join_out", pb::WireFormat::TXT)
+                         .WithModNSharding(shards, [](const BenchRecord& r) { return r.val; }));
+  }
+
+  LocalRunner* runner = pm.StartLocalRunner(
+      file_util::JoinPath(file_util::ExpandPath(FLAGS_dest_dir), "output"));
+
+  uint64_t start = GetMonotonicMicros(), start_cpu = ProcessCpuMicros();
+  pipeline->Run(runner);
+  double wall_sec = (GetMonotonicMicros() - start) * 1e-6;
+  double cpu_sec = (ProcessCpuMicros() - start_cpu) * 1e-6;
+
+  string report = Report(ds, pipelines, pm.pool()->size(), wall_sec, cpu_sec, pipeline->progress().ToJson());
+  if (FLAGS_report_file.empty()) {
+    std::cout << report << std::endl;
+  } else {
+    file_util::WriteStringToFileOrDie(report, FLAGS_report_file);
+    LOG(INFO) << "Wrote the report to " << FLAGS_report_file;
+  }
+
+  return 0;
+}
@@ -4,9 +4,13 @@
 
 #include "file/compressors.h"
 
+#include <zdict.h>
 #include <zlib.h>
+#include <zstd.h>
 #include <lz4.h>
 
+#include <memory>
+
 #include "base/logging.h"
 
 using util::Status;
@@ -114,9 +118,113 @@ Status CompressLZ4(int level, const void* src, size_t len, void* dest,
   return Status::OK;
 }
 
+size_t BoundFunctionZstd(size_t len) {
+  return ZSTD_compressBound(len);
+}
+
+inline Status ZstdStatus(size_t res) {
+  return Status(StatusCode::INTERNAL_ERROR, ZSTD_getErrorName(res));
+}
+
+// Compression contexts are not thread-safe, hence each function object has its own.
+// The dictionaries are read-only and are shared by the copies of the function objects.
+struct ZstdCompressor {
+  ZSTD_CCtx* cctx = nullptr;
+  ZSTD_CDict* cdict = nullptr;
+
+  ZstdCompressor() : cctx(ZSTD_createCCtx()) {}
+  ~ZstdCompressor() {
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeCCtx(cctx);
+  }
+};
+
+struct ZstdDict {
+  ZSTD_DDict* ddict = nullptr;
+
+  ~ZstdDict() { ZSTD_freeDDict(ddict); }
+};
+
+// Decompression may run concurrently in multiple threads, see ListReader::SetReadAhead.
+ZSTD_DCtx* ThreadDCtx() {
+  struct Deleter {
+    void operator()(ZSTD_DCtx* dctx) const { ZSTD_freeDCtx(dctx); }
+  };
+  static thread_local std::unique_ptr<ZSTD_DCtx, Deleter> dctx(ZSTD_createDCtx());
+  return dctx.get();
+}
+
+Status UncompressZstd(const void* src, size_t len, void* dest, size_t* uncompress_size) {
+  size_t res = ZSTD_decompressDCtx(ThreadDCtx(), dest, *uncompress_size, src, len);
+  if (ZSTD_isError(res))
+    return ZstdStatus(res);
+  *uncompress_size = res;
+  return Status::OK;
+}
+
 }  // namespace
 
+CompressFunction GetZstdCompress(StringPiece dict, int level) {
+  std::shared_ptr<ZstdCompressor> compressor = std::make_shared<ZstdCompressor>();
+  if (!dict.empty()) {
+    compressor->cdict = ZSTD_createCDict(dict.data(), dict.size(), level);
+    CHECK(compressor->cdict) << "Could not load zstd dictionary";
+  }
 
+  return [compressor](int level, const void* src, size_t len, void* dest, size_t* compress_size) {
+    size_t res = compressor->cdict
+                     ? ZSTD_compress_usingCDict(compressor->cctx, dest, *compress_size, src, len,
+                                                compressor->cdict)
+                     : ZSTD_compressCCtx(compressor->cctx, dest, *compress_size, src, len, level);
+    if (ZSTD_isError(res))
+      return ZstdStatus(res);
+    *compress_size = res;
+    return Status::OK;
+  };
+}
+
+UncompressFunction GetZstdUncompress(StringPiece dict) {
+  if (dict.empty())
+    return UncompressZstd;
+
+  std::shared_ptr<ZstdDict> zdict = std::make_shared<ZstdDict>();
+  zdict->ddict = ZSTD_createDDict(dict.data(), dict.size());
+  if (!zdict->ddict) {
+    LOG(ERROR) << "Could not load zstd dictionary";
+    return nullptr;
+  }
+
+  return [zdict](const void* src, size_t len, void* dest, size_t* uncompress_size) {
+    size_t res = ZSTD_decompress_usingDDict(ThreadDCtx(), dest, *uncompress_size, src, len,
+                                            zdict->ddict);
+    if (ZSTD_isError(res))
+      return ZstdStatus(res);
+    *uncompress_size = res;
+    return Status::OK;
+  };
+}
+
+Status TrainZstdDictionary(const std::vector<std::string>& samples, size_t dict_size,
+                           std::string* dict) {
+  std::string buf;
+  std::vector<size_t> sizes;
+  sizes.reserve(samples.size());
+  for (const auto& s : samples) {
+    buf.append(s);
+    sizes.push_back(s.size());
+  }
+
+  dict->resize(dict_size);
+  size_t res = ZDICT_trainFromBuffer(&dict->front(), dict_size, buf.data(), sizes.data(),
+                                     sizes.size());
+  if (ZDICT_isError(res)) {
+    dict->clear();
+    return Status(StatusCode::INVALID_ARGUMENT, ZDICT_getErrorName(res));
+  }
+  dict->resize(res);
+
+  return Status::OK;
+}
 
 UncompressFunction GetUncompress(CompressMethod m) {
   switch (m) {
@@ -126,6 +234,9 @@ UncompressFunction GetUncompress(CompressMethod m) {
     case CompressMethod::kCompressionLZ4:
       return UncompressZ4;
     break;
+    case CompressMethod::kCompressionZstd:
+      return UncompressZstd;
+    break;
     default:;
   }
   return nullptr;
@@ -139,6 +250,9 @@ CompressFunction GetCompress(CompressMethod m) {
     case CompressMethod::kCompressionLZ4:
       return CompressLZ4;
     break;
+    case CompressMethod::kCompressionZstd:
+      return GetZstdCompress(StringPiece(), 0);
+    break;
     default:;
   }
   return nullptr;
@@ -152,6 +266,9 @@ CompressBoundFunction GetCompressBound(list_file::CompressMethod m) {
     case CompressMethod::kCompressionLZ4:
       return BoundFunctionLZ4;
     break;
+    case CompressMethod::kCompressionZstd:
+      return BoundFunctionZstd;
+    break;
     default:;
   }
   return nullptr;
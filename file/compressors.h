@@ -6,6 +6,8 @@
 #include "util/status.h"
 #include "file/list_file_format.h"
 #include <functional>
+#include <string>
+#include <vector>
 
 namespace file {
 
@@ -22,4 +24,15 @@ CompressFunction GetCompress(list_file::CompressMethod m);
 
 CompressBoundFunction GetCompressBound(list_file::CompressMethod method);
 
+// Zstd functions that use the dictionary dict, which may be empty. The compress function
+// compresses with the level passed here. Returns null uncompress function if dict
+// is not a valid dictionary.
+CompressFunction GetZstdCompress(StringPiece dict, int level);
+UncompressFunction GetZstdUncompress(StringPiece dict);
+
+// Trains a zstd dictionary of at most dict_size bytes from sample records.
+// Zstd needs at least several hundreds of samples, ideally totalling about 100x dict_size.
+util::Status TrainZstdDictionary(const std::vector<std::string>& samples, size_t dict_size,
+                                 std::string* dict);
+
 }  // namespace file
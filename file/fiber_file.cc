@@ -3,13 +3,25 @@
 //
 #include "file/fiber_file.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 #include <atomic>
+#include <boost/fiber/condition_variable.hpp>
+#include <deque>
 
+#include "absl/strings/match.h"
+#include "absl/strings/str_split.h"
 #include "base/hash.h"
 #include "base/histogram.h"
 #include "base/logging.h"
+#include "base/memory_account.h"
 #include "base/walltime.h"
+#include "util/asio/io_uring.h"
 
 namespace file {
 using namespace util;
@@ -47,6 +59,11 @@ ssize_t read_all(int fd, const iovec* iov, int iovcnt, size_t offset) {
   return completed;
 }
 
+base::MemoryAccount* PrefetchAccount() {
+  static base::MemoryAccount* res = base::MemoryAccount::Get("file.prefetch_buffers");
+  return res;
+}
+
 class FiberReadFile : public ReadonlyFile {
  public:
   FiberReadFile(const FiberReadOptions& opts, ReadonlyFile* next,
@@ -65,6 +82,8 @@ class FiberReadFile : public ReadonlyFile {
 
   int Handle() const final { return next_->Handle(); }
 
+  const uint8* mapped_data() const final { return next_->mapped_data(); }
+
  private:
   StatusObject<size_t> ReadAndPrefetch(size_t offset, const strings::MutableByteRange& range);
 
@@ -73,10 +92,15 @@ class FiberReadFile : public ReadonlyFile {
 
   void HandleActivePrefetch();
 
+  // Called before filling buf_ when the reader is at offset. Resizes buf_ so that the half of it
+  // that remains when the next prefetch is issued lasts for the latency of that prefetch.
+  void AdaptWindow(size_t offset);
+
   strings::MutableByteRange prefetch_;
   size_t file_prefetch_offset_ = -1;
   std::unique_ptr<uint8_t[]> buf_;
   size_t buf_size_ = 0;
+  base::MemoryCharge buf_charge_{PrefetchAccount()};
   std::unique_ptr<ReadonlyFile> next_;
 
   fibers_ext::FiberQueueThreadPool* tp_;
@@ -85,10 +109,27 @@ class FiberReadFile : public ReadonlyFile {
   base::Histogram tp_wait_hist_;
 
   std::atomic<ssize_t> prefetch_res_{0};
+  std::atomic<int64_t> prefetch_end_ts_{0};
   uint8_t* prefetch_ptr_ = nullptr;
   int64_t prefetch_start_ts_ = 0;
+
+  size_t min_buf_size_ = 0, max_buf_size_ = 0;
+  int64_t prefetch_latency_ = 0;  // of the last completed prefetch, in usec.
+  int64_t adapt_ts_ = 0;
+  size_t adapt_offset_ = 0;
 };
 
+// Returns true if the file is on a network filesystem.
+bool IsRemoteFs(int fd) {
+  constexpr long kNfsMagic = 0x6969, kSmbMagic = 0x517B, kCifsMagic = 0xFF534D42,
+                 kFuseMagic = 0x65735546;
+  struct statfs sfs;
+  if (fd < 0 || fstatfs(fd, &sfs) != 0)
+    return false;
+  long type = sfs.f_type;
+  return type == kNfsMagic || type == kSmbMagic || type == kCifsMagic || type == kFuseMagic;
+}
+
 class WriteFileImpl : public WriteFile {
  public:
   WriteFileImpl(WriteFile* real, ssize_t hash, util::fibers_ext::FiberQueueThreadPool* tp)
@@ -109,13 +150,69 @@ class WriteFileImpl : public WriteFile {
   ssize_t hash_;
 };
 
+Status UringError(ssize_t res) {
+  char buf[1024];
+  return Status(StatusCode::IO_ERROR, strerror_r(-res, buf, sizeof(buf)));
+}
+
+class UringReadFile : public ReadonlyFile {
+ public:
+  UringReadFile(const FiberReadOptions& opts, ReadonlyFile* next, IoUring* ring)
+      : next_(next), ring_(ring), stats_(opts.stats) {}
+
+  StatusObject<size_t> Read(size_t offset,
+                            const strings::MutableByteRange& range) final MUST_USE_RESULT;
+
+  Status Close() final { return next_->Close(); }
+
+  size_t Size() const final { return next_->Size(); }
+
+  int Handle() const final { return next_->Handle(); }
+
+  const uint8* mapped_data() const final { return next_->mapped_data(); }
+
+ private:
+  std::unique_ptr<ReadonlyFile> next_;
+  IoUring* ring_;
+  FiberReadOptions::Stats* stats_;
+};
+
+class UringWriteFile : public WriteFile {
+ public:
+  UringWriteFile(StringPiece name, int flags, IoUring* ring)
+      : WriteFile(name), flags_(flags), ring_(ring) {}
+
+  bool Open() final;
+
+  bool Close() final;
+
+  Status Write(const uint8* buffer, uint64 length) final;
+
+ private:
+  virtual ~UringWriteFile() {}
+
+  int fd_ = -1;
+  int flags_;
+  size_t offset_ = 0;
+  IoUring* ring_;
+};
+
 FiberReadFile::FiberReadFile(const FiberReadOptions& opts, ReadonlyFile* next,
                              util::fibers_ext::FiberQueueThreadPool* tp)
     : next_(next), tp_(tp) {
-  buf_size_ = opts.prefetch_size;
+  // Mapped files are read directly from the page cache, prefetching them into buf_ would
+  // just add a copy.
+  buf_size_ = next->mapped_data() ? 0 : opts.prefetch_size;
   if (buf_size_) {
     buf_.reset(new uint8_t[buf_size_]);
+    buf_charge_.Set(buf_size_);
     prefetch_.reset(buf_.get(), 0);
+
+    min_buf_size_ = max_buf_size_ = buf_size_;
+    size_t cap = opts.max_prefetch_size;
+    if (opts.max_remote_prefetch_size > buf_size_ && IsRemoteFs(next->Handle()))
+      cap = opts.max_remote_prefetch_size;
+    max_buf_size_ = std::max(cap, buf_size_);
   }
   stats_ = opts.stats;
 }
@@ -148,12 +245,13 @@ StatusObject<size_t> FiberReadFile::ReadAndPrefetch(size_t offset,
 
   // At this point prefetch_ must point at buf_ and might still contained prefetched slice.
   prefetch_.reset(buf_.get(), prefetch_.size());
+  AdaptWindow(offset);
 
   iovec io[2] = {{range.data() + copied, range.size() - copied},
                  {buf_.get() + prefetch_.size(), buf_size_ - prefetch_.size()}};
 
   if (copied < range.size()) {  // We need to issue request to fill this read.
-    int64_t start = base::GetMonotonicMicrosFast();
+    int64_t start = GetMonotonicMicros();
 
     DCHECK(prefetch_.empty());
 
@@ -165,8 +263,9 @@ StatusObject<size_t> FiberReadFile::ReadAndPrefetch(size_t offset,
       done_.Notify();
     });
     done_.Wait(AND_RESET);
+    prefetch_latency_ = GetMonotonicMicros() - start;
     if (VLOG_IS_ON(1)) {
-      tp_wait_hist_.Add(base::GetMonotonicMicrosFast() - start);
+      tp_wait_hist_.Add(prefetch_latency_);
     }
 
     if (stats_) {
@@ -198,10 +297,11 @@ StatusObject<size_t> FiberReadFile::ReadAndPrefetch(size_t offset,
 
   // we filled range but we want to issue a readahead fetch.
   // We must keep reference to done_ in pending because of the shutdown flow.
-  prefetch_start_ts_ = base::GetMonotonicMicrosFast();
+  prefetch_start_ts_ = GetMonotonicMicros();
   tp_->Add([this, pending = std::move(pending)]() mutable {
-    prefetch_res_.store(read_all(next_->Handle(), &pending.io, 1, pending.offs),
-                        std::memory_order_release);
+    ssize_t res = read_all(next_->Handle(), &pending.io, 1, pending.offs);
+    prefetch_end_ts_.store(GetMonotonicMicros(), std::memory_order_relaxed);
+    prefetch_res_.store(res, std::memory_order_release);
     done_.Notify();
   });
 
@@ -212,8 +312,9 @@ StatusObject<size_t> FiberReadFile::ReadAndPrefetch(size_t offset,
 // this read.
 std::pair<size_t, bool> FiberReadFile::ReadFromCache(size_t offset,
                                                      const strings::MutableByteRange& range) {
+  // Non-sequential reads must wait only if a prefetch request is active.
   bool should_prefetch =
-      (range.size() > prefetch_.size() && prefetch_ptr_) || (offset != file_prefetch_offset_);
+      prefetch_ptr_ && (range.size() > prefetch_.size() || offset != file_prefetch_offset_);
   if (should_prefetch) {
     HandleActivePrefetch();
   }
@@ -247,6 +348,7 @@ std::pair<size_t, bool> FiberReadFile::ReadFromCache(size_t offset,
 void FiberReadFile::HandleActivePrefetch() {
   bool preempt = done_.Wait(AND_RESET);  // wait for the active prefetch to finish.
   size_t prefetch_res = prefetch_res_.load(std::memory_order_acquire);
+  prefetch_latency_ = prefetch_end_ts_.load(std::memory_order_relaxed) - prefetch_start_ts_;
 
   if (prefetch_res > 0) {
     if (prefetch_.empty()) {
@@ -259,7 +361,7 @@ void FiberReadFile::HandleActivePrefetch() {
     if (stats_) {
       if (preempt) {
         if (VLOG_IS_ON(1)) {
-          auto delta = base::GetMonotonicMicrosFast() - prefetch_start_ts_;
+          auto delta = GetMonotonicMicros() - prefetch_start_ts_;
           tp_wait_hist_.Add(delta);
         }
         ++stats_->preempt_cnt;
@@ -275,6 +377,46 @@ void FiberReadFile::HandleActivePrefetch() {
   prefetch_ptr_ = nullptr;
 }
 
+void FiberReadFile::AdaptWindow(size_t offset) {
+  if (max_buf_size_ == min_buf_size_)
+    return;
+
+  int64_t now = GetMonotonicMicros();
+  int64_t interval = now - adapt_ts_;
+  bool sequential = adapt_ts_ && offset > adapt_offset_;
+  size_t consumed = offset - adapt_offset_;
+  adapt_ts_ = now;
+  adapt_offset_ = offset;
+
+  if (!sequential || interval <= 0 || prefetch_latency_ < 0)
+    return;
+
+  // The bytes the reader consumes while the next prefetch runs, the window should be twice as
+  // big since the prefetch is issued when half of it is left. Halving at quarter of the window
+  // leaves a margin against a resize on every call.
+  double needed = 2.0 * consumed * prefetch_latency_ / interval;
+  size_t new_size = buf_size_;
+  if (needed > buf_size_) {
+    new_size = std::min(buf_size_ * 2, max_buf_size_);
+  } else if (needed < buf_size_ / 4) {
+    new_size = std::max(buf_size_ / 2, min_buf_size_);
+  }
+  if (new_size == buf_size_)
+    return;
+
+  // The prefetched data is less than half of the window, hence it fits into the halved one.
+  DCHECK_LE(prefetch_.size(), new_size);
+  VLOG(1) << "Prefetch window " << buf_size_ << " -> " << new_size << ", latency "
+          << prefetch_latency_ << "us";
+
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[new_size]);
+  memcpy(buf.get(), prefetch_.data(), prefetch_.size());
+  prefetch_.reset(buf.get(), prefetch_.size());
+  buf_.swap(buf);
+  buf_size_ = new_size;
+  buf_charge_.Set(buf_size_);
+}
+
 StatusObject<size_t> FiberReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
   StatusObject<size_t> res;
   if (buf_) {  // prefetch enabled.
@@ -288,6 +430,10 @@ StatusObject<size_t> FiberReadFile::Read(size_t offset, const strings::MutableBy
     done_.Notify();
   });
   done_.Wait(AND_RESET);
+  if (stats_ && res.ok()) {
+    ++stats_->preempt_cnt;
+    stats_->disk_bytes += res.obj;
+  }
   VLOG(1) << "Read " << offset << "/" << res.obj;
   return res;
 }
@@ -316,6 +462,322 @@ Status WriteFileImpl::Write(const uint8* buffer, uint64 length) {
 
 }  // namespace
 
+StatusObject<size_t> UringReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
+  if (range.empty())
+    return 0;
+
+  if (offset > Size()) {
+    return Status(StatusCode::RUNTIME_ERROR, "Invalid read range");
+  }
+
+  size_t total = 0;
+  if (next_->mapped_data()) {
+    auto res = next_->Read(offset, range);
+    if (!res.ok())
+      return res;
+    total = res.obj;
+  } else {
+    while (total < range.size()) {
+      iovec io{range.data() + total, range.size() - total};
+      ssize_t res = ring_->ReadV(next_->Handle(), &io, 1, offset + total);
+      if (res < 0)
+        return UringError(res);
+      if (res == 0)  // EOF
+        break;
+      total += res;
+    }
+  }
+
+  if (stats_) {
+    ++stats_->preempt_cnt;
+    stats_->disk_bytes += total;
+  }
+  VLOG(2) << "Read " << offset << "/" << total;
+
+  return total;
+}
+
+bool UringWriteFile::Open() {
+  fd_ = open(create_file_name_.c_str(), flags_, 0644);
+  if (fd_ < 0) {
+    LOG(ERROR) << "Could not open file " << strerror(errno) << " file " << create_file_name_;
+    return false;
+  }
+
+  // We write at explicit offsets, therefore appending starts at the end of the file.
+  if (flags_ & O_APPEND) {
+    struct stat sb;
+    if (fstat(fd_, &sb) < 0) {
+      LOG(ERROR) << "Could not stat file " << strerror(errno) << " file " << create_file_name_;
+      return false;
+    }
+    offset_ = sb.st_size;
+  }
+  return true;
+}
+
+bool UringWriteFile::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  delete this;
+  return true;
+}
+
+Status UringWriteFile::Write(const uint8* buffer, uint64 length) {
+  while (length > 0) {
+    iovec io{const_cast<uint8*>(buffer), length};
+    ssize_t res = ring_->WriteV(fd_, &io, 1, offset_);
+    if (res < 0)
+      return UringError(res);
+    buffer += res;
+    length -= res;
+    offset_ += res;
+  }
+
+  return Status::OK;
+}
+
+namespace {
+
+inline bool IsGlobstar(StringPiece comp) { return comp == "**"; }
+
+inline bool IsLiteral(StringPiece comp) {
+  return comp.find_first_of("*?[") == StringPiece::npos;
+}
+
+// Expands the glob component by component. Directory reads and stat batches are work items
+// that are processed by fibers of the calling thread, each of them blocks while its syscalls
+// run in tp. The matching itself runs in the calling thread.
+class GlobWalker {
+ public:
+  using Cb = std::function<void(file_util::StatShort&&)>;
+
+  GlobWalker(std::vector<std::string> comps, fibers_ext::FiberQueueThreadPool* tp, Cb cb)
+      : comps_(std::move(comps)), tp_(tp), cb_(std::move(cb)) {}
+
+  void Run(const std::string& root, unsigned parallelism);
+
+ private:
+  // path matched the components before index, the rest are matched against its descendants.
+  struct Entry {
+    std::string path;
+    size_t index;
+  };
+
+  struct Item {
+    std::vector<Entry> stats;  // if not empty, the entries to stat.
+    std::string dir;           // otherwise, the directory to read for comps_[index].
+    size_t index = 0;
+  };
+
+  static constexpr size_t kStatBatch = 128;
+
+  void Work();
+
+  void ReadDir(const Item& item);
+  void Stat(std::vector<Entry> stats);
+
+  // Matches path against the components from index.
+  void Expand(std::string path, size_t index);
+
+  void AddStat(std::string path, size_t index);
+  void FlushStats();
+  void Push(Item item);
+
+  const std::vector<std::string> comps_;
+  fibers_ext::FiberQueueThreadPool* tp_;
+  Cb cb_;
+
+  std::vector<Entry> pending_stats_;
+
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;
+  std::deque<Item> queue_;
+  unsigned active_ = 0;
+};
+
+void GlobWalker::Run(const std::string& root, unsigned parallelism) {
+  Expand(root, 0);
+  FlushStats();
+
+  std::vector<::boost::fibers::fiber> fibers;
+  for (unsigned i = 1; i < parallelism; ++i) {
+    fibers.emplace_back([this] { Work(); });
+  }
+  Work();
+  for (auto& fb : fibers) {
+    fb.join();
+  }
+}
+
+void GlobWalker::Work() {
+  std::unique_lock<::boost::fibers::mutex> lk(mu_);
+  while (true) {
+    cv_.wait(lk, [this] { return !queue_.empty() || active_ == 0; });
+    if (queue_.empty())
+      break;
+
+    Item item = std::move(queue_.front());
+    queue_.pop_front();
+    ++active_;
+    lk.unlock();
+
+    if (!item.stats.empty()) {
+      Stat(std::move(item.stats));
+    } else {
+      ReadDir(item);
+    }
+    FlushStats();
+
+    lk.lock();
+    if (--active_ == 0 && queue_.empty())
+      cv_.notify_all();
+  }
+}
+
+void GlobWalker::Push(Item item) {
+  std::lock_guard<::boost::fibers::mutex> lk(mu_);
+  queue_.push_back(std::move(item));
+  cv_.notify_one();
+}
+
+void GlobWalker::AddStat(std::string path, size_t index) {
+  pending_stats_.push_back(Entry{std::move(path), index});
+  if (pending_stats_.size() >= kStatBatch)
+    FlushStats();
+}
+
+void GlobWalker::FlushStats() {
+  if (pending_stats_.empty())
+    return;
+  Item item;
+  item.stats = std::move(pending_stats_);
+  pending_stats_.clear();
+  Push(std::move(item));
+}
+
+void GlobWalker::Expand(std::string path, size_t index) {
+  while (index < comps_.size() && !IsGlobstar(comps_[index]) && IsLiteral(comps_[index])) {
+    path = file_util::JoinPath(path, comps_[index++]);
+  }
+  if (index == comps_.size()) {
+    AddStat(std::move(path), index);
+    return;
+  }
+
+  // "**" matches no directories as well, unless it is the last component that matches
+  // the files only.
+  if (IsGlobstar(comps_[index]) && index + 1 < comps_.size()) {
+    Expand(path, index + 1);
+  }
+
+  Item item;
+  item.dir = std::move(path);
+  item.index = index;
+  Push(std::move(item));
+}
+
+void GlobWalker::ReadDir(const Item& item) {
+  using DirEntry = std::pair<std::string, unsigned char>;  // name, d_type
+
+  std::vector<DirEntry> entries = tp_->Await([&item] {
+    std::vector<DirEntry> res;
+    DIR* dir = opendir(item.dir.empty() ? "." : item.dir.c_str());
+    if (!dir) {
+      if (errno != ENOENT && errno != ENOTDIR)
+        LOG(WARNING) << "Could not open " << item.dir << ": " << strerror(errno);
+      return res;
+    }
+    while (struct dirent* de = readdir(dir)) {
+      StringPiece name(de->d_name);
+      if (name != "." && name != "..")
+        res.emplace_back(std::string(name), de->d_type);
+    }
+    closedir(dir);
+    return res;
+  });
+
+  const std::string& comp = comps_[item.index];
+  bool globstar = IsGlobstar(comp);
+  bool last = item.index + 1 == comps_.size();
+  for (auto& de : entries) {
+    // Like glob(3), the wildcards do not match the leading dot.
+    if (globstar ? de.first[0] == '.' : fnmatch(comp.c_str(), de.first.c_str(), FNM_PERIOD) != 0)
+      continue;
+
+    std::string path = file_util::JoinPath(item.dir, de.first);
+    bool maybe_dir = de.second == DT_UNKNOWN || de.second == DT_LNK;
+
+    if (globstar) {
+      if (de.second == DT_DIR) {
+        Expand(std::move(path), item.index);
+      } else if (last) {
+        AddStat(std::move(path), comps_.size());
+      } else if (maybe_dir) {
+        AddStat(std::move(path), item.index);
+      }
+    } else if (last) {
+      AddStat(std::move(path), comps_.size());
+    } else if (de.second == DT_DIR) {
+      Expand(std::move(path), item.index + 1);
+    } else if (maybe_dir) {
+      AddStat(std::move(path), item.index + 1);
+    }
+  }
+}
+
+void GlobWalker::Stat(std::vector<Entry> stats) {
+  using StatResult = std::pair<bool, struct stat>;
+
+  std::vector<StatResult> results = tp_->Await([&stats] {
+    std::vector<StatResult> res(stats.size());
+    for (size_t i = 0; i < stats.size(); ++i) {
+      res[i].first = stat(stats[i].path.c_str(), &res[i].second) == 0;
+    }
+    return res;
+  });
+
+  for (size_t i = 0; i < stats.size(); ++i) {
+    if (!results[i].first)
+      continue;  // literal components that do not exist.
+
+    const struct stat& st = results[i].second;
+    Entry& e = stats[i];
+    bool is_dir = S_ISDIR(st.st_mode);
+
+    if (is_dir && (e.index < comps_.size() || IsGlobstar(comps_.back()))) {
+      // Directories are not matched by the trailing "**", their files are.
+      Expand(std::move(e.path), std::min(e.index, comps_.size() - 1));
+    } else if (e.index == comps_.size()) {
+      cb_(file_util::StatShort{std::move(e.path), st.st_mtime, st.st_size, st.st_mode});
+    }
+  }
+}
+
+}  // namespace
+
+void StatFilesParallel(StringPiece glob, util::fibers_ext::FiberQueueThreadPool* tp,
+                       unsigned parallelism, std::function<void(file_util::StatShort&&)> cb) {
+  std::string root;
+  if (absl::StartsWith(glob, "~")) {
+    size_t pos = glob.find('/');
+    root = file_util::ExpandPath(glob.substr(0, pos));
+    glob = pos == StringPiece::npos ? StringPiece{} : glob.substr(pos);
+  }
+  if (absl::StartsWith(glob, "/")) {
+    root += "/";
+  }
+
+  std::vector<std::string> comps = absl::StrSplit(glob, '/', absl::SkipEmpty());
+  if (comps.empty()) {
+    comps.push_back(".");
+  }
+
+  GlobWalker walker(std::move(comps), tp, std::move(cb));
+  walker.Run(root, std::max(1u, parallelism));
+}
+
 StatusObject<ReadonlyFile*> OpenFiberReadFile(StringPiece name,
                                               util::fibers_ext::FiberQueueThreadPool* tp,
                                               const FiberReadOptions& opts) {
@@ -336,4 +798,34 @@ WriteFile* OpenFiberWriteFile(StringPiece name, util::fibers_ext::FiberQueueThre
   return new WriteFileImpl(wf, hash, tp);
 }
 
+StatusObject<ReadonlyFile*> OpenUringReadFile(StringPiece name, IoUring* ring,
+                                              const FiberReadOptions& opts) {
+  StatusObject<ReadonlyFile*> res = ReadonlyFile::Open(name, opts);
+  if (!res.ok())
+    return res;
+  return new UringReadFile(opts, res.obj, ring);
+}
+
+WriteFile* OpenUringWriteFile(StringPiece name, IoUring* ring, const OpenOptions& opts) {
+  int flags = O_CREAT | O_WRONLY | O_CLOEXEC | (opts.append ? O_APPEND : O_TRUNC);
+  WriteFile* wf = new UringWriteFile(name, flags, ring);
+  if (wf->Open())
+    return wf;
+  wf->Close();  // to delete the object.
+  return nullptr;
+}
+
+ListReader::BlockExecutor FiberBlockExecutor(util::fibers_ext::FiberQueueThreadPool* tp) {
+  return [tp](unsigned count, std::function<void(unsigned)> fn) {
+    fibers_ext::BlockingCounter bc(count);
+    for (unsigned i = 0; i < count; ++i) {
+      tp->Add([&fn, bc, i]() mutable {
+        fn(i);
+        bc.Dec();
+      });
+    }
+    bc.Wait();
+  };
+}
+
 }  // namespace file
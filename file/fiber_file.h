@@ -1,10 +1,17 @@
 // Copyright 2019, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
+#pragma once
 
 #include "file/file.h"
+#include "file/file_util.h"
+#include "file/list_file_reader.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 
+namespace util {
+class IoUring;
+}  // namespace util
+
 namespace file {
 
 // Fiber-friendly file handler. Returns ReadonlyFile* instance that does not block the current
@@ -19,6 +26,13 @@ struct FiberReadOptions : public ReadonlyFile::Options {
   };
 
   size_t prefetch_size = 0;
+
+  // If greater than prefetch_size, the prefetch window adapts between prefetch_size and
+  // these caps to the latency of the reads and to the rate the reader consumes the data.
+  // Files on network filesystems (NFS, CIFS, FUSE) are capped by max_remote_prefetch_size.
+  size_t max_prefetch_size = 0;
+  size_t max_remote_prefetch_size = 0;
+
   Stats* stats = nullptr;
 };
 
@@ -33,4 +47,27 @@ struct FiberWriteOptions : public OpenOptions {
 WriteFile* OpenFiberWriteFile(StringPiece name, util::fibers_ext::FiberQueueThreadPool* tp,
                               const FiberWriteOptions& opts = FiberWriteOptions()) MUST_USE_RESULT;
 
+// io_uring based files. The IO is submitted from the calling fiber into the ring, which resumes
+// the fiber once it completes, without going through a thread pool. The files must be used only
+// by the fibers of the ring's IoContext thread. prefetch_size is ignored, mapped files are read
+// directly.
+util::StatusObject<ReadonlyFile*> OpenUringReadFile(
+    StringPiece name, util::IoUring* ring,
+    const FiberReadOptions& opts = FiberReadOptions{}) MUST_USE_RESULT;
+
+WriteFile* OpenUringWriteFile(StringPiece name, util::IoUring* ring,
+                              const OpenOptions& opts = OpenOptions()) MUST_USE_RESULT;
+
+// Calls cb for every path that matches the glob, like file_util::StatFiles does, but reads
+// the directories and stats the matched paths concurrently in tp, with up to parallelism calls
+// in flight. Every path component may hold glob(3) wildcards and "**" components match any
+// number of directories, hence "dir/**" matches all the files under dir recursively.
+// cb is called from fibers of the calling thread in no particular order.
+void StatFilesParallel(StringPiece glob, util::fibers_ext::FiberQueueThreadPool* tp,
+                       unsigned parallelism, std::function<void(file_util::StatShort&&)> cb);
+
+// Runs the block tasks of ListReader::SetReadAhead on tp and suspends the calling fiber
+// until they finish.
+ListReader::BlockExecutor FiberBlockExecutor(util::fibers_ext::FiberQueueThreadPool* tp);
+
 }  // namespace file
@@ -18,9 +18,14 @@
 #include "file/file.h"
 
 #include <fcntl.h>
+#include <linux/aio_abi.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <cstring>
 #include <memory>
 
 #include "base/logging.h"
@@ -140,6 +145,170 @@ Status LocalFileImpl::Write(const uint8* buffer, uint64 length) {
   return Status::OK;
 }
 
+// ----------------- DirectWriteFile ------------------------------------------
+// O_DIRECT writer. The data is staged in two aligned buffers: while one is written with
+// Linux AIO, the caller fills the other one. The last, partial, block is padded to the
+// alignment and the file is truncated to its real size on Close().
+class DirectWriteFile : public WriteFile {
+ public:
+  static constexpr size_t kBufSize = 1 << 20;
+  static constexpr size_t kAlignment = 4096;
+
+  DirectWriteFile(StringPiece file_name, int flags) : WriteFile(file_name), flags_(flags) {}
+
+  DirectWriteFile(const DirectWriteFile&) = delete;
+
+  bool Open() final;
+  bool Close() final;
+
+  Status Write(const uint8* buffer, uint64 length) final;
+
+ private:
+  virtual ~DirectWriteFile();
+
+  // Waits for the write in flight and submits the filled part of the current buffer.
+  Status SubmitCurrent();
+  Status WaitInflight();
+
+  int fd_ = -1;
+  int flags_;
+  aio_context_t aio_ctx_ = 0;
+  iocb cb_;
+
+  uint8* buf_[2] = {nullptr, nullptr};
+  unsigned cur_ = 0;          // the buffer being filled.
+  size_t cur_size_ = 0;
+  size_t offset_ = 0;         // file offset of the current buffer.
+  size_t inflight_size_ = 0;  // 0 if no write is in flight.
+};
+
+DirectWriteFile::~DirectWriteFile() {
+  if (aio_ctx_)
+    syscall(__NR_io_destroy, aio_ctx_);
+  free(buf_[0]);
+  free(buf_[1]);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool DirectWriteFile::Open() {
+  fd_ = open(create_file_name_.c_str(), flags_ | O_DIRECT, 0644);
+  if (fd_ < 0) {
+    // EINVAL means that the filesystem does not support O_DIRECT, the caller falls back.
+    LOG_IF(ERROR, errno != EINVAL) << "Could not open file " << strerror(errno) << " file "
+                                   << create_file_name_;
+    return false;
+  }
+
+  if (syscall(__NR_io_setup, 1, &aio_ctx_) < 0) {
+    LOG(ERROR) << "Could not setup aio context " << strerror(errno);
+    aio_ctx_ = 0;
+    return false;
+  }
+
+  for (auto& buf : buf_) {
+    if (posix_memalign(reinterpret_cast<void**>(&buf), kAlignment, kBufSize))
+      return false;
+  }
+  return true;
+}
+
+Status DirectWriteFile::Write(const uint8* buffer, uint64 length) {
+  DCHECK(buffer);
+  DCHECK(!IsUInt64ANegativeInt64(length));
+
+  while (length > 0) {
+    size_t sz = std::min<size_t>(length, kBufSize - cur_size_);
+    memcpy(buf_[cur_] + cur_size_, buffer, sz);
+    cur_size_ += sz;
+    buffer += sz;
+    length -= sz;
+
+    if (cur_size_ == kBufSize) {
+      RETURN_IF_ERROR(SubmitCurrent());
+    }
+  }
+  return Status::OK;
+}
+
+Status DirectWriteFile::SubmitCurrent() {
+  RETURN_IF_ERROR(WaitInflight());
+
+  memset(&cb_, 0, sizeof(cb_));
+  cb_.aio_fildes = fd_;
+  cb_.aio_lio_opcode = IOCB_CMD_PWRITE;
+  cb_.aio_buf = reinterpret_cast<uint64>(buf_[cur_]);
+  cb_.aio_nbytes = cur_size_;
+  cb_.aio_offset = offset_;
+
+  iocb* cbs[1] = {&cb_};
+  if (syscall(__NR_io_submit, aio_ctx_, 1, cbs) != 1) {
+    return StatusFileError();
+  }
+  inflight_size_ = cur_size_;
+  offset_ += cur_size_;
+  cur_ ^= 1;
+  cur_size_ = 0;
+
+  return Status::OK;
+}
+
+Status DirectWriteFile::WaitInflight() {
+  if (!inflight_size_)
+    return Status::OK;
+
+  io_event event;
+  long res;
+  while ((res = syscall(__NR_io_getevents, aio_ctx_, 1, 1, &event, nullptr)) < 0 &&
+         errno == EINTR) {
+  }
+  if (res < 0)
+    return StatusFileError();
+
+  size_t expected = inflight_size_;
+  inflight_size_ = 0;
+  if (event.res < 0) {
+    errno = -event.res;
+    return StatusFileError();
+  }
+
+  if (size_t(event.res) != expected)
+    return Status(StatusCode::IO_ERROR, "Partial direct write");
+  return Status::OK;
+}
+
+bool DirectWriteFile::Close() {
+  if (fd_ < 0) {  // Open() failed.
+    delete this;
+    return false;
+  }
+
+  size_t file_size = offset_ + cur_size_;
+  bool res = true;
+
+  if (cur_size_) {
+    size_t padded = (cur_size_ + kAlignment - 1) & ~(kAlignment - 1);
+    memset(buf_[cur_] + cur_size_, 0, padded - cur_size_);
+    cur_size_ = padded;
+
+    Status st = SubmitCurrent();
+    LOG_IF(ERROR, !st.ok()) << "Error writing " << create_file_name_ << ": " << st;
+    res &= st.ok();
+  }
+
+  Status st = WaitInflight();
+  LOG_IF(ERROR, !st.ok()) << "Error writing " << create_file_name_ << ": " << st;
+  res &= st.ok();
+
+  if (res && ftruncate(fd_, file_size) < 0) {
+    LOG(ERROR) << "Could not truncate " << create_file_name_ << ": " << strerror(errno);
+    res = false;
+  }
+
+  delete this;
+  return res;
+}
+
 }  // namespace
 
 WriteFile::WriteFile(StringPiece name)
@@ -151,6 +320,18 @@ WriteFile::~WriteFile() { }
 
 WriteFile* Open(StringPiece file_name, OpenOptions opts) {
   int flags = O_CREAT | O_WRONLY | O_CLOEXEC;
+
+  if (opts.direct) {
+    CHECK(!opts.append) << "Direct writes can not append to " << file_name;
+
+    WriteFile* ptr = new DirectWriteFile(file_name, flags | O_TRUNC);
+    if (ptr->Open())
+      return ptr;
+    ptr->Close();
+    LOG_FIRST_N(WARNING, 1) << "Could not open " << file_name
+                            << " with O_DIRECT, falling back to buffered writes";
+  }
+
   if (opts.append)
     flags |= O_APPEND;
   else
@@ -223,6 +404,107 @@ class PosixReadFile final: public ReadonlyFile {
   int Handle() const final { return fd_; };
 };
 
+// mmap() based access.
+class MmapReadFile final: public ReadonlyFile {
+  int fd_;
+  const size_t file_size_;
+  bool drop_cache_;
+  uint8* data_ = nullptr;
+
+ public:
+  MmapReadFile(int fd, size_t sz, bool drop) : fd_(fd), file_size_(sz), drop_cache_(drop) {}
+
+  virtual ~MmapReadFile() {
+    Close();
+  }
+
+  Status Map(bool sequential);
+
+  Status Close() override {
+    if (data_) {
+      munmap(data_, file_size_);
+      data_ = nullptr;
+    }
+    if (fd_) {
+      if (drop_cache_)
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd_);
+      fd_ = 0;
+    }
+    return Status::OK;
+  }
+
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range) override {
+    if (range.empty())
+      return 0;
+
+    if (offset > file_size_) {
+      return Status(StatusCode::RUNTIME_ERROR, "Invalid read range");
+    }
+    size_t sz = std::min(range.size(), file_size_ - offset);
+    memcpy(range.begin(), data_ + offset, sz);
+    return sz;
+  }
+
+  size_t Size() const final { return file_size_; }
+
+  int Handle() const final { return fd_; };
+
+  const uint8* mapped_data() const final { return data_; }
+};
+
+// Maps files larger than a huge page at a huge page aligned address so that the kernel can
+// back them with transparent huge pages, if it supports them for the file's filesystem.
+Status MmapReadFile::Map(bool sequential) {
+  constexpr size_t kHugePageSize = 1 << 21;
+  constexpr size_t kWillNeedSize = 1 << 23;
+
+  if (file_size_ == 0)
+    return Status::OK;
+
+  void* addr = MAP_FAILED;
+  if (file_size_ >= kHugePageSize) {
+    // Reserve an address range large enough to contain an aligned mapping and map the file
+    // over it. The unused parts of the reservation are released.
+    size_t reserve_size = file_size_ + kHugePageSize;
+    void* reserve = mmap(nullptr, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserve != MAP_FAILED) {
+      uintptr_t start = reinterpret_cast<uintptr_t>(reserve);
+      uintptr_t aligned = (start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+      addr = mmap(reinterpret_cast<void*>(aligned), file_size_, PROT_READ,
+                  MAP_PRIVATE | MAP_FIXED, fd_, 0);
+      if (addr == MAP_FAILED) {
+        munmap(reserve, reserve_size);
+      } else {
+        const uintptr_t page_size = getpagesize();
+        uintptr_t map_end = (aligned + file_size_ + page_size - 1) & ~(page_size - 1);
+        if (aligned > start)
+          munmap(reserve, aligned - start);
+        if (start + reserve_size > map_end)
+          munmap(reinterpret_cast<void*>(map_end), start + reserve_size - map_end);
+#ifdef MADV_HUGEPAGE
+        madvise(addr, file_size_, MADV_HUGEPAGE);  // best effort.
+#endif
+      }
+    }
+  }
+
+  if (addr == MAP_FAILED) {
+    addr = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr == MAP_FAILED)
+      return StatusFileError();
+  }
+  data_ = reinterpret_cast<uint8*>(addr);
+
+  madvise(addr, file_size_, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+
+  // Start reading the beginning of the file asynchronously, the kernel read-ahead
+  // takes over once the reader faults in the first pages.
+  madvise(addr, std::min(file_size_, kWillNeedSize), MADV_WILLNEED);
+
+  return Status::OK;
+}
+
 StatusObject<ReadonlyFile*> ReadonlyFile::Open(StringPiece name, const Options& opts) {
   int fd = open(name.data(), O_RDONLY);
   if (fd < 0) {
@@ -234,6 +516,16 @@ StatusObject<ReadonlyFile*> ReadonlyFile::Open(StringPiece name, const Options&
     return StatusFileError();
   }
 
+  if (opts.use_mmap) {
+    MmapReadFile* file = new MmapReadFile(fd, sb.st_size, opts.drop_cache_on_close);
+    Status st = file->Map(opts.sequential);
+    if (!st.ok()) {
+      delete file;
+      return st;
+    }
+    return file;
+  }
+
   int advice = opts.sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL;
   return new PosixReadFile(fd, sb.st_size, advice, opts.drop_cache_on_close);
 }
@@ -26,6 +26,11 @@ class ReadonlyFile {
   struct Options {
     bool sequential = true;
     bool drop_cache_on_close = true;
+
+    // Maps the file into memory instead of reading it with pread(). Reads become memcpy from
+    // the page cache and mapped_data() exposes the contents without copying.
+    // The file must not be truncated while it is mapped.
+    bool use_mmap = false;
     Options()  {}
   };
 
@@ -42,6 +47,10 @@ class ReadonlyFile {
 
   virtual size_t Size() const = 0;
 
+  // Returns the contents of the file if it is mapped into memory, null otherwise.
+  // The data is valid until Close() is called.
+  virtual const uint8* mapped_data() const { return nullptr; }
+
   // Factory function that creates the ReadonlyFile object.
   // The ownership is passed to the caller.
   static util::StatusObject<ReadonlyFile*>
@@ -84,6 +93,11 @@ class WriteFile {
 
 struct OpenOptions {
   bool append = false;
+
+  // Writes with O_DIRECT, bypassing the page cache. The data is staged in two aligned buffers,
+  // one is filled while the other is written asynchronously. Can not be combined with append.
+  // Falls back to the buffered writes if the filesystem does not support O_DIRECT.
+  bool direct = false;
 };
 
 // Factory method to create a new writable file object. Calls Open on the
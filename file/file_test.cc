@@ -3,11 +3,17 @@
 //
 #include "file/file.h"
 
+#include <zlib.h>
+
 #include <memory>
+#include <thread>
 #include <gmock/gmock.h>
 
+#include "base/endian.h"
 #include "file/file_util.h"
+#include "file/filesource.h"
 #include "file/gzip_file.h"
+#include "file/gzip_index.h"
 #include "file/lz4_file.h"
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -118,6 +124,349 @@ TEST_F(FileTest, UniquePtr) {
   std::unique_ptr<WriteFile> file(Open(base::GetTestTempPath("foo.txt")));
 }
 
+TEST_F(FileTest, DirectWriteFile) {
+  string file_path = base::GetTestTempPath("direct.txt");
+  OpenOptions opts;
+  opts.direct = true;
+
+  // Spans several staging buffers and ends with a partial block.
+  string data = base::RandStr((5 << 19) + 123);
+  for (size_t len : {data.size(), size_t(10), size_t(0)}) {
+    WriteFile* file = Open(file_path, opts);
+    ASSERT_TRUE(file != nullptr);
+    for (size_t offs = 0; offs < len; offs += 100000) {
+      auto status = file->Write(StringPiece(data).substr(offs, std::min<size_t>(100000, len - offs)));
+      ASSERT_TRUE(status.ok()) << status;
+    }
+    ASSERT_TRUE(file->Close());
+
+    string contents;
+    file_util::ReadFileToStringOrDie(file_path, &contents);
+    EXPECT_EQ(data.substr(0, len), contents);
+  }
+}
+
+TEST_F(FileTest, MmapReadFile) {
+  string file_path = base::GetTestTempPath("mmap.txt");
+  string data = base::RandStr(3 << 20);  // large enough for the huge page alignment.
+  file_util::WriteStringToFileOrDie(data, file_path);
+
+  ReadonlyFile::Options opts;
+  opts.use_mmap = true;
+  auto res = ReadonlyFile::Open(file_path, opts);
+  ASSERT_TRUE(res.ok()) << res.status;
+  std::unique_ptr<ReadonlyFile> file(res.obj);
+  ASSERT_EQ(data.size(), file->Size());
+  ASSERT_TRUE(file->mapped_data() != nullptr);
+  EXPECT_EQ(0, memcmp(data.data(), file->mapped_data(), data.size()));
+
+  string buf(100, '\0');
+  strings::MutableByteRange range(reinterpret_cast<uint8*>(&buf[0]), buf.size());
+  auto read_res = file->Read(1000, range);
+  ASSERT_TRUE(read_res.ok());
+  EXPECT_EQ(100, read_res.obj);
+  EXPECT_EQ(data.substr(1000, 100), buf);
+
+  read_res = file->Read(data.size() - 10, range);
+  ASSERT_TRUE(read_res.ok());
+  EXPECT_EQ(10, read_res.obj);
+  EXPECT_FALSE(file->Read(data.size() + 1, range).ok());
+  EXPECT_TRUE(file->Close().ok());
+  EXPECT_TRUE(file->mapped_data() == nullptr);
+
+  file_util::WriteStringToFileOrDie("", file_path);
+  res = ReadonlyFile::Open(file_path, opts);
+  ASSERT_TRUE(res.ok()) << res.status;
+  file.reset(res.obj);
+  EXPECT_EQ(0, file->Size());
+  EXPECT_EQ(0, file->Read(0, range).obj);
+}
+
+static string ReadSource(util::Source* src) {
+  string res, buf(1 << 15, '\0');
+  strings::MutableByteRange range(reinterpret_cast<uint8*>(&buf[0]), buf.size());
+  while (true) {
+    auto res_read = src->Read(range);
+    CHECK_STATUS(res_read.status);
+    if (res_read.obj == 0)
+      break;
+    res.append(buf, 0, res_read.obj);
+  }
+  return res;
+}
+
+TEST_F(FileTest, LineReader) {
+  std::vector<string> lines;
+  string input;
+  for (unsigned i = 0; i < 3000; ++i) {
+    lines.push_back(string(i % 13 == 0 ? i * 7 : i % 100, 'a' + i % 26));
+    input.append(lines.back()).append(i % 5 == 0 ? "\r\n" : "\n");
+  }
+  lines.push_back("no eol");
+  input.append(lines.back());
+
+  for (uint32 block_size : {100U, 4096U, kuint32max}) {
+    util::StringSource* src = new util::StringSource(input, block_size);
+    LineReader lr(src, TAKE_OWNERSHIP, 11);  // lines cross the 2KB buffers.
+
+    StringPiece line;
+    string scratch;
+    for (unsigned i = 0; i < lines.size(); ++i) {
+      ASSERT_TRUE(lr.Next(&line, &scratch)) << i;
+      ASSERT_EQ(lines[i], line) << i;
+    }
+    EXPECT_FALSE(lr.Next(&line, &scratch));
+    EXPECT_EQ(lines.size(), lr.line_num());
+    EXPECT_EQ(input.size(), lr.consumed_bytes());
+  }
+}
+
+TEST_F(FileTest, GzipMembers) {
+  string file_path = base::GetTestTempPath("members.txt.gz");
+  string data;
+  for (unsigned i = 0; i < 100000; ++i) {
+    data.append(std::to_string(i)).append(i % 7, 'a').push_back('\n');
+  }
+
+  // The last member is larger than the batch of the reader.
+  string compressed;
+  ASSERT_TRUE(util::GzipMemberCompress(strings::ToByteRange(data.substr(0, 1000)), 1,
+                                       &compressed).ok());
+  ASSERT_TRUE(util::GzipMemberCompress(strings::ToByteRange(data.substr(1000, 200000)), 1,
+                                       &compressed).ok());
+  string tail = data.substr(201000) + base::RandStr(5 << 20);
+  ASSERT_TRUE(util::GzipMemberCompress(strings::ToByteRange(tail), 1, &compressed).ok());
+  data = data.substr(0, 201000) + tail;
+  file_util::WriteStringToFileOrDie(compressed, file_path);
+
+  BlockExecutor thread_executor = [](unsigned count, std::function<void(unsigned)> fn) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < count; ++i)
+      threads.emplace_back(fn, i);
+    for (auto& t : threads)
+      t.join();
+  };
+
+  for (unsigned read_ahead : {1, 2, 8}) {
+    auto res = ReadonlyFile::Open(file_path);
+    ASSERT_TRUE(res.ok()) << res.status;
+    ASSERT_TRUE(GzipMemberSource::HasMemberHeader(res.obj));
+
+    std::unique_ptr<util::Source> src(Source::Uncompressed(res.obj, read_ahead, thread_executor));
+    ASSERT_TRUE(dynamic_cast<GzipMemberSource*>(src.get()) != nullptr);
+    EXPECT_EQ(data, ReadSource(src.get())) << read_ahead;
+  }
+
+  // Regular gzip readers see the concatenated members.
+  auto res = ReadonlyFile::Open(file_path);
+  ASSERT_TRUE(res.ok()) << res.status;
+  util::ZlibSource zsrc(new Source(res.obj));
+  EXPECT_EQ(data, ReadSource(&zsrc));
+}
+
+TEST_F(FileTest, LZ4Blocks) {
+  string data;
+  for (unsigned i = 0; i < 300000; ++i) {
+    data.append(std::to_string(i)).append(i % 7, 'a').push_back('\n');
+  }
+  data.append(base::RandStr(100000));  // incompressible blocks are stored uncompressed.
+
+  BlockExecutor thread_executor = [](unsigned count, std::function<void(unsigned)> fn) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < count; ++i)
+      threads.emplace_back(fn, i);
+    for (auto& t : threads)
+      t.join();
+  };
+
+  auto write_file = [&](const string& path, const LZ4File::Options& opts) {
+    WriteFile* file = LZ4File::Create(path, opts);
+    ASSERT_TRUE(file->Open());
+    for (size_t i = 0; i < data.size(); i += 1000) {
+      ASSERT_TRUE(file->Write(StringPiece(data).substr(i, 1000)).ok());
+    }
+    ASSERT_TRUE(file->Close());
+  };
+
+  LZ4File::Options indep_opts;
+  indep_opts.independent_blocks = indep_opts.block_index = true;
+  LZ4File::Options linked_opts;
+  linked_opts.level = 9;
+  linked_opts.block_log = 18;
+
+  for (const LZ4File::Options& opts : {indep_opts, linked_opts}) {
+    string file_path = base::GetTestTempPath("blocks.txt.lz4");
+    write_file(file_path, opts);
+
+    for (unsigned read_ahead : {1, 2, 8}) {
+      auto res = ReadonlyFile::Open(file_path);
+      ASSERT_TRUE(res.ok()) << res.status;
+      ASSERT_TRUE(LZ4BlockSource::HasFrameHeader(res.obj));
+
+      std::unique_ptr<util::Source> src(Source::Uncompressed(res.obj, read_ahead, thread_executor));
+      ASSERT_TRUE(dynamic_cast<LZ4BlockSource*>(src.get()) != nullptr);
+      EXPECT_EQ(data, ReadSource(src.get())) << read_ahead;
+    }
+
+    auto res = ReadonlyFile::Open(file_path);
+    ASSERT_TRUE(res.ok()) << res.status;
+    std::unique_ptr<ReadonlyFile> file(res.obj);
+    std::vector<uint64> offsets;
+    EXPECT_EQ(opts.block_index, ReadLZ4BlockIndex(file.get(), &offsets));
+    if (opts.block_index) {
+      EXPECT_EQ((data.size() + (1 << 16) - 1) >> 16, offsets.size());
+    }
+    EXPECT_TRUE(file->Close().ok());
+  }
+}
+
+// Compresses src into a BGZF block, see SAMv1.pdf.
+static void AppendBgzfBlock(StringPiece src, string* dest) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  CHECK_EQ(Z_OK, deflateInit2(&zs, 6, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY));
+
+  uint8 extra[6] = {'B', 'C', 2, 0, 0, 0};
+  gz_header header;
+  memset(&header, 0, sizeof(header));
+  header.extra = extra;
+  header.extra_len = sizeof(extra);
+  header.os = 3;
+  CHECK_EQ(Z_OK, deflateSetHeader(&zs, &header));
+
+  size_t start = dest->size();
+  size_t bound = deflateBound(&zs, src.size()) + 64;
+  dest->resize(start + bound);
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src.data()));
+  zs.avail_in = src.size();
+  zs.next_out = reinterpret_cast<Bytef*>(&(*dest)[start]);
+  zs.avail_out = bound;
+  CHECK_EQ(Z_STREAM_END, deflate(&zs, Z_FINISH));
+  size_t size = zs.total_out;
+  deflateEnd(&zs);
+
+  dest->resize(start + size);
+  LittleEndian::Store16(&(*dest)[start + 16], size - 1);  // BSIZE
+}
+
+static string TextData() {
+  string data;
+  for (unsigned i = 0; i < 200000; ++i) {
+    data.append(std::to_string(i)).append(i % 11, 'b').push_back('\n');
+  }
+  data.append(base::RandStr(100000));
+  return data;
+}
+
+TEST_F(FileTest, GzipIndex) {
+  string data = TextData();
+
+  // Two regular gzip members.
+  string compressed, part_path = base::GetTestTempPath("index_part.gz");
+  for (StringPiece part : {StringPiece(data).substr(0, 500000), StringPiece(data).substr(500000)}) {
+    WriteFile* file = GzipFile::Create(part_path, 6);
+    ASSERT_TRUE(file->Open());
+    ASSERT_TRUE(file->Write(part).ok());
+    ASSERT_TRUE(file->Close());
+
+    string member;
+    file_util::ReadFileToStringOrDie(part_path, &member);
+    compressed.append(member);
+  }
+  string file_path = base::GetTestTempPath("index.txt.gz");
+  file_util::WriteStringToFileOrDie(compressed, file_path);
+
+  auto open = [&] {
+    auto res = ReadonlyFile::Open(file_path);
+    CHECK_STATUS(res.status);
+    return res.obj;
+  };
+
+  std::unique_ptr<ReadonlyFile> file(open());
+  ASSERT_TRUE(IsGzipFile(file.get()));
+  GzipIndex index;
+  EXPECT_FALSE(index.BuildFromMembers(file.get()).ok());
+  ASSERT_TRUE(index.Build(file.get(), 1 << 16).ok());
+  EXPECT_TRUE(file->Close().ok());
+  EXPECT_FALSE(index.members());
+  EXPECT_EQ(compressed.size(), index.file_size());
+  EXPECT_GT(index.points().size(), 10);
+  EXPECT_EQ(0, index.OutOffset(0));
+  EXPECT_EQ(kuint64max, index.OutOffset(compressed.size()));
+
+  string serialized;
+  index.Serialize(&serialized);
+  GzipIndex parsed;
+  EXPECT_FALSE(parsed.Parse(StringPiece(serialized).substr(0, serialized.size() - 1)).ok());
+  ASSERT_TRUE(parsed.Parse(serialized).ok());
+  ASSERT_EQ(index.points().size(), parsed.points().size());
+
+  std::vector<uint64> offsets{0, 1, 70000, 499999, 500000, 654321, data.size()};
+  for (const GzipIndex::Point& p : parsed.points()) {
+    offsets.push_back(p.out_offset);
+  }
+  for (uint64 out_offset : offsets) {
+    auto res = parsed.Open(open(), out_offset);
+    ASSERT_TRUE(res.ok()) << res.status;
+    std::unique_ptr<util::Source> src(res.obj);
+    ASSERT_EQ(data.substr(out_offset), ReadSource(src.get())) << out_offset;
+  }
+
+  EXPECT_EQ("/tmp/dir/.index.txt.gz.gzidx", GzipIndexPath("/tmp/dir/index.txt.gz"));
+  EXPECT_EQ(".index.txt.gz.gzidx", GzipIndexPath("index.txt.gz"));
+}
+
+TEST_F(FileTest, GzipIndexMembers) {
+  string data = TextData();
+  constexpr size_t kMemberSize = 50000;
+
+  string members, bgzf;
+  for (size_t i = 0; i < data.size(); i += kMemberSize) {
+    StringPiece part = StringPiece(data).substr(i, kMemberSize);
+    ASSERT_TRUE(util::GzipMemberCompress(strings::ToByteRange(part), 1, &members).ok());
+    AppendBgzfBlock(part, &bgzf);
+  }
+  AppendBgzfBlock(StringPiece(), &bgzf);  // the end of file marker.
+
+  BlockExecutor thread_executor = [](unsigned count, std::function<void(unsigned)> fn) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < count; ++i)
+      threads.emplace_back(fn, i);
+    for (auto& t : threads)
+      t.join();
+  };
+
+  string file_path = base::GetTestTempPath("index_members.txt.gz");
+  for (const string* compressed : {&members, &bgzf}) {
+    file_util::WriteStringToFileOrDie(*compressed, file_path);
+    auto open = [&] {
+      auto res = ReadonlyFile::Open(file_path);
+      CHECK_STATUS(res.status);
+      return res.obj;
+    };
+
+    std::unique_ptr<util::Source> src(Source::Uncompressed(open(), 4, thread_executor));
+    ASSERT_TRUE(dynamic_cast<GzipMemberSource*>(src.get()) != nullptr);
+    EXPECT_EQ(data, ReadSource(src.get()));
+
+    std::unique_ptr<ReadonlyFile> file(open());
+    GzipIndex index;
+    ASSERT_TRUE(index.BuildFromMembers(file.get()).ok());
+    EXPECT_TRUE(file->Close().ok());
+    EXPECT_TRUE(index.members());
+
+    size_t num_members = (data.size() + kMemberSize - 1) / kMemberSize;
+    ASSERT_EQ(num_members + (compressed == &bgzf), index.points().size());
+    EXPECT_EQ(kMemberSize * 3, index.points()[3].out_offset);
+
+    for (uint64 out_offset : {0UL, 1UL, kMemberSize * 2, kMemberSize * 5 + 17, data.size()}) {
+      auto res = index.Open(open(), out_offset, 2, thread_executor);
+      ASSERT_TRUE(res.ok()) << res.status;
+      src.reset(res.obj);
+      ASSERT_EQ(data.substr(out_offset), ReadSource(src.get())) << out_offset;
+    }
+  }
+}
 
 constexpr size_t kStrLen = 1 << 17;
 
@@ -4,9 +4,16 @@
 
 #include "file/filesource.h"
 
+#include <lz4.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "base/bits.h"
+#include "base/endian.h"
 #include "base/logging.h"
+#include "base/simd.h"
 #include "file/file.h"
-#include "strings/split.h"
 #include "strings/strip.h"
 #include "util/bzip_source.h"
 #include "util/zlib_source.h"
@@ -18,8 +25,8 @@ using util::Status;
 using util::StatusObject;
 using namespace std;
 
-Source::Source(ReadonlyFile* file)
- : file_(file) {
+Source::Source(ReadonlyFile* file, uint64 offset)
+ : file_(file), offset_(offset) {
 }
 
 Source::~Source() {
@@ -36,18 +43,321 @@ util::StatusObject<size_t> Source::ReadInternal(const strings::MutableByteRange&
 }
 
 
-util::Source* Source::Uncompressed(ReadonlyFile* file) {
+util::Source* Source::Uncompressed(ReadonlyFile* file, unsigned read_ahead,
+                                   BlockExecutor executor) {
+  if (GzipMemberSource::HasMemberHeader(file))
+    return new GzipMemberSource(file, read_ahead, std::move(executor));
+  if (LZ4BlockSource::HasFrameHeader(file))
+    return new LZ4BlockSource(file, read_ahead, std::move(executor));
+
   Source* first = new Source(file);
   if (util::ZStdSource::HasValidHeader(first))
     return new util::ZStdSource(first);
 
-  if (util::BzipSource::IsBzipSource(first))
+  if (util::BzipSource::IsBzipSource(first)) {
+    if (executor)
+      return new util::BzipSource(first, read_ahead, std::move(executor));
     return new util::BzipSource(first);
+  }
   if (util::ZlibSource::IsZlibSource(first))
     return new util::ZlibSource(first);
   return first;
 }
 
+// Members of the batch are read with a single request of this size, unless they are larger.
+constexpr size_t kMemberBatchSize = 1 << 22;
+
+GzipMemberSource::GzipMemberSource(ReadonlyFile* file, unsigned read_ahead,
+                                   BlockExecutor executor, uint64 offset)
+    : file_(file), read_ahead_(std::max(1U, read_ahead)), executor_(std::move(executor)),
+      offset_(offset) {}
+
+GzipMemberSource::~GzipMemberSource() {
+  CHECK_STATUS(file_->Close());
+}
+
+bool GzipMemberSource::HasMemberHeader(ReadonlyFile* file) {
+  uint8 header[util::kGzipMemberHeaderSize];
+  auto res = file->Read(0, strings::MutableByteRange(header, sizeof(header)));
+  uint32_t member_size, raw_size;
+
+  return res.ok() && util::ParseGzipMemberHeader(strings::ByteRange(header, res.obj),
+                                                 &member_size, &raw_size);
+}
+
+util::Status GzipMemberSource::ReadBatch() {
+  const size_t file_size = file_->Size();
+  num_members_ = cur_member_ = 0;
+  cur_pos_ = 0;
+  if (offset_ >= file_size)
+    return Status::OK;
+
+  buf_.resize(std::min<size_t>(kMemberBatchSize, file_size - offset_));
+  auto res = file_->Read(offset_, strings::MutableByteRange(
+                                      reinterpret_cast<uint8*>(&buf_[0]), buf_.size()));
+  if (!res.ok())
+    return res.status;
+  buf_.resize(res.obj);
+
+  if (members_.size() < read_ahead_)
+    members_.resize(read_ahead_);
+
+  // Splits the buffer into whole members.
+  size_t pos = 0;
+  while (num_members_ < read_ahead_) {
+    uint32_t member_size, raw_size;
+    strings::ByteRange header(reinterpret_cast<const uint8*>(buf_.data()) + pos,
+                              buf_.size() - pos);
+    if (header.size() < util::kGzipMemberHeaderSize)
+      break;
+
+    if (!util::ParseGzipMemberHeader(header, &member_size, &raw_size))
+      return Status(util::StatusCode::IO_ERROR, "Invalid gzip member header");
+
+    if (member_size > header.size()) {
+      if (num_members_ > 0 || offset_ + member_size > file_size)
+        break;
+
+      // A member that is larger than the batch.
+      buf_.resize(member_size);
+      res = file_->Read(offset_, strings::MutableByteRange(
+                                     reinterpret_cast<uint8*>(&buf_[0]), member_size));
+      if (!res.ok())
+        return res.status;
+      header.reset(reinterpret_cast<const uint8*>(buf_.data()), res.obj);
+      if (res.obj < member_size)
+        break;
+    }
+    members_[num_members_++].compressed = strings::ByteRange(header.data(), member_size);
+    pos += member_size;
+  }
+
+  if (num_members_ == 0)
+    return Status(util::StatusCode::IO_ERROR, "Truncated gzip member");
+  offset_ += pos;
+
+  auto inflate = [this](unsigned i) {
+    Member& m = members_[i];
+    m.data.clear();
+    m.status = util::GzipMemberUncompress(m.compressed, &m.data);
+  };
+
+  if (executor_ && num_members_ > 1) {
+    executor_(num_members_, inflate);
+  } else {
+    for (unsigned i = 0; i < num_members_; ++i)
+      inflate(i);
+  }
+
+  for (unsigned i = 0; i < num_members_; ++i) {
+    if (!members_[i].status.ok())
+      return members_[i].status;
+  }
+  return Status::OK;
+}
+
+util::StatusObject<size_t> GzipMemberSource::ReadInternal(const strings::MutableByteRange& range) {
+  size_t copied = 0;
+  while (copied < range.size()) {
+    if (cur_member_ == num_members_) {
+      RETURN_IF_ERROR(ReadBatch());
+      if (num_members_ == 0)  // EOF
+        break;
+    }
+
+    const std::string& data = members_[cur_member_].data;
+    size_t sz = std::min(range.size() - copied, data.size() - cur_pos_);
+    memcpy(range.begin() + copied, data.data() + cur_pos_, sz);
+    copied += sz;
+    cur_pos_ += sz;
+    if (cur_pos_ == data.size()) {
+      ++cur_member_;
+      cur_pos_ = 0;
+    }
+  }
+  return copied;
+}
+
+// See lz4_Frame_format.md of lz4.
+constexpr uint32 kLZ4FrameMagic = 0x184D2204;
+constexpr uint32 kLZ4SkippableMagic = 0x184D2A50;  // the low 4 bits are user defined.
+constexpr size_t kLZ4MaxHeaderSize = 19;
+constexpr size_t kLZ4DictSize = 1 << 16;
+
+// The blocks of the batch are read with a single request of this size, unless they are larger.
+constexpr size_t kBlockBatchSize = 1 << 22;
+
+LZ4BlockSource::LZ4BlockSource(ReadonlyFile* file, unsigned read_ahead, BlockExecutor executor)
+    : file_(file), read_ahead_(std::max(1U, read_ahead)), executor_(std::move(executor)) {}
+
+LZ4BlockSource::~LZ4BlockSource() {
+  CHECK_STATUS(file_->Close());
+}
+
+bool LZ4BlockSource::HasFrameHeader(ReadonlyFile* file) {
+  uint8 magic[4];
+  auto res = file->Read(0, strings::MutableByteRange(magic, sizeof(magic)));
+  return res.ok() && res.obj == sizeof(magic) && LittleEndian::Load32(magic) == kLZ4FrameMagic;
+}
+
+Status LZ4BlockSource::ReadFrameHeader() {
+  const size_t file_size = file_->Size();
+  while (offset_ < file_size) {
+    uint8 header[kLZ4MaxHeaderSize];
+    auto res = file_->Read(offset_, strings::MutableByteRange(header, sizeof(header)));
+    if (!res.ok())
+      return res.status;
+    if (res.obj < 8)
+      return Status(util::StatusCode::IO_ERROR, "Truncated lz4 frame");
+
+    uint32 magic = LittleEndian::Load32(header);
+    if ((magic & ~0xFU) == kLZ4SkippableMagic) {
+      offset_ += 8 + LittleEndian::Load32(header + 4);
+      continue;
+    }
+    if (magic != kLZ4FrameMagic)
+      return Status(util::StatusCode::IO_ERROR, "Invalid lz4 frame");
+
+    uint8 flg = header[4], bd = header[5];
+    if ((flg >> 6) != 1 || (flg & 1))
+      return Status(util::StatusCode::IO_ERROR, "Unsupported lz4 frame version or dictionary");
+
+    unsigned block_size_id = (bd >> 4) & 7;
+    if (block_size_id < 4)
+      return Status(util::StatusCode::IO_ERROR, "Invalid lz4 block size");
+
+    independent_ = flg & 0x20;
+    block_checksum_ = flg & 0x10;
+    content_checksum_ = flg & 0x04;
+    max_block_size_ = size_t(1) << (8 + 2 * block_size_id);
+
+    // magic, flg, bd, optional content size and the header checksum.
+    size_t header_size = (flg & 0x08) ? 15 : 7;
+    if (res.obj < header_size)
+      return Status(util::StatusCode::IO_ERROR, "Truncated lz4 frame");
+    offset_ += header_size;
+    in_frame_ = true;
+    dict_.clear();
+    break;
+  }
+  return Status::OK;
+}
+
+Status LZ4BlockSource::ReadBatch() {
+  const size_t file_size = file_->Size();
+  num_blocks_ = cur_block_ = 0;
+  cur_pos_ = 0;
+
+  // Loops over the frames that end without blocks.
+  while (num_blocks_ == 0) {
+    if (!in_frame_) {
+      RETURN_IF_ERROR(ReadFrameHeader());
+      if (!in_frame_)  // EOF
+        return Status::OK;
+    }
+
+    if (offset_ >= file_size)
+      return Status(util::StatusCode::IO_ERROR, "Truncated lz4 frame");
+    size_t batch_size = std::max(kBlockBatchSize, max_block_size_ + 8);
+    buf_.resize(std::min<size_t>(batch_size, file_size - offset_));
+    auto res = file_->Read(offset_, strings::MutableByteRange(
+                                        reinterpret_cast<uint8*>(&buf_[0]), buf_.size()));
+    if (!res.ok())
+      return res.status;
+    buf_.resize(res.obj);
+
+    if (blocks_.size() < read_ahead_)
+      blocks_.resize(read_ahead_);
+
+    // Splits the buffer into whole blocks.
+    const uint8* p = reinterpret_cast<const uint8*>(buf_.data());
+    size_t pos = 0;
+    while (num_blocks_ < read_ahead_ && buf_.size() - pos >= 4) {
+      uint32 block_header = LittleEndian::Load32(p + pos);
+      if (block_header == 0) {  // EndMark
+        pos += content_checksum_ ? 8 : 4;
+        in_frame_ = false;
+        break;
+      }
+
+      size_t size = block_header & 0x7FFFFFFF;
+      if (size > max_block_size_)
+        return Status(util::StatusCode::IO_ERROR, "Invalid lz4 block");
+      size_t total = 4 + size + (block_checksum_ ? 4 : 0);
+      if (buf_.size() - pos < total)
+        break;
+
+      Block& b = blocks_[num_blocks_++];
+      b.compressed = strings::ByteRange(p + pos + 4, size);
+      b.raw = block_header >> 31;
+      pos += total;
+    }
+
+    if (pos == 0)
+      return Status(util::StatusCode::IO_ERROR, "Truncated lz4 frame");
+    offset_ += pos;
+  }
+
+  auto decompress = [this](unsigned i) {
+    Block& b = blocks_[i];
+    const char* src = reinterpret_cast<const char*>(b.compressed.data());
+    if (b.raw) {
+      b.data.assign(src, b.compressed.size());
+      b.ok = true;
+    } else {
+      b.data.resize(max_block_size_);
+      int res = independent_ ? LZ4_decompress_safe(src, &b.data[0], b.compressed.size(),
+                                                   b.data.size())
+                             : LZ4_decompress_safe_usingDict(src, &b.data[0],
+                                                             b.compressed.size(), b.data.size(),
+                                                             dict_.data(), dict_.size());
+      b.ok = res >= 0;
+      b.data.resize(std::max(0, res));
+    }
+
+    if (!independent_) {
+      dict_.append(b.data);
+      if (dict_.size() > kLZ4DictSize)
+        dict_.erase(0, dict_.size() - kLZ4DictSize);
+    }
+  };
+
+  if (executor_ && independent_ && num_blocks_ > 1) {
+    executor_(num_blocks_, decompress);
+  } else {
+    for (unsigned i = 0; i < num_blocks_; ++i)
+      decompress(i);
+  }
+
+  for (unsigned i = 0; i < num_blocks_; ++i) {
+    if (!blocks_[i].ok)
+      return Status(util::StatusCode::IO_ERROR, "Corrupted lz4 block");
+  }
+  return Status::OK;
+}
+
+util::StatusObject<size_t> LZ4BlockSource::ReadInternal(const strings::MutableByteRange& range) {
+  size_t copied = 0;
+  while (copied < range.size()) {
+    if (cur_block_ == num_blocks_) {
+      RETURN_IF_ERROR(ReadBatch());
+      if (num_blocks_ == 0)  // EOF
+        break;
+    }
+
+    const std::string& data = blocks_[cur_block_].data;
+    size_t sz = std::min(range.size() - copied, data.size() - cur_pos_);
+    memcpy(range.begin() + copied, data.data() + cur_pos_, sz);
+    copied += sz;
+    cur_pos_ += sz;
+    if (cur_pos_ == data.size()) {
+      ++cur_block_;
+      cur_pos_ = 0;
+    }
+  }
+  return copied;
+}
+
 Sink::~Sink() {
   if (ownership_ == TAKE_OWNERSHIP)
     CHECK(file_->Close());
@@ -63,8 +373,8 @@ void LineReader::Init(uint32_t buf_log) {
   page_size_ = 1 << buf_log;
 
   buf_.reset(new char[page_size_]);
+  eol_mask_.reset(new uint64_t[page_size_ / 64]);
   next_ = end_ = buf_.get();
-  *next_ = '\n';
 }
 
 LineReader::LineReader(const std::string& fl) : ownership_(TAKE_OWNERSHIP) {
@@ -82,15 +392,28 @@ LineReader::~LineReader() {
   }
 }
 
+char* LineReader::FindEol(char* ptr) const {
+  size_t pos = ptr - buf_.get();
+  size_t len = end_ - buf_.get();
+  if (pos >= len)
+    return end_;
+
+  size_t word = pos / 64;
+  uint64_t bits = eol_mask_[word] & (~0ULL << (pos % 64));
+  while (bits == 0) {
+    if (++word * 64 >= len)
+      return end_;
+    bits = eol_mask_[word];
+  }
+  return buf_.get() + word * 64 + Bits::FindLSBSetNonZero64(bits);
+}
+
 bool LineReader::Next(StringPiece* result, std::string* scratch) {
   bool use_scratch = false;
 
-  const char* const eof_page = buf_.get() + page_size_ - 1;
   while (true) {
     // Common case: search of EOL.
-    char* ptr = next_;
-    while (*ptr != '\n')
-      ++ptr;
+    char* ptr = FindEol(next_);
 
     if (ptr < end_) {  // Found EOL.
       ++line_num_;
@@ -99,6 +422,8 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
       if (ptr > next_ && ptr[-1] == '\r') {
         --ptr;
         delta = 2;
+      } else if (ptr == next_ && use_scratch && !scratch->empty() && scratch->back() == '\r') {
+        scratch->pop_back();  // \r\n crosses the buffers.
       }
       *ptr = '\0';
 
@@ -108,6 +433,7 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
       } else {
         *result = StringPiece(next_, ptr - next_);
       }
+      consumed_bytes_ += ptr + delta - next_;
       next_ = ptr + delta;
 
       return true;
@@ -125,13 +451,13 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
       } else {
         scratch->append(next_, end_);
       }
+      consumed_bytes_ += end_ - next_;
       next_ = end_;
-      if (end_ != eof_page)
-        break;
     }
 
-    strings::MutableByteRange range{reinterpret_cast<uint8_t*>(buf_.get()),
-                                    /* -1 to allow sentinel */ page_size_ - 1};
+    // Sources may return less than requested before their end, hence we read until
+    // we get nothing.
+    strings::MutableByteRange range{reinterpret_cast<uint8_t*>(buf_.get()), page_size_};
     auto s = source_->Read(range);
     if (!s.ok()) {
       return false;
@@ -142,7 +468,7 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
 
     next_ = buf_.get();
     end_ = next_ + s.obj;
-    *end_ = '\n';  // sentinel.
+    base::MatchVal8(reinterpret_cast<const uint8_t*>(next_), s.obj, '\n', eol_mask_.get());
   }
 
   if (use_scratch) {
@@ -153,37 +479,40 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
   return false;
 }
 
+constexpr size_t kCsvBufSize = 1 << 17;
+
 CsvReader::CsvReader(const std::string& filename,
                      std::function<void(const std::vector<StringPiece>&)> row_cb)
-    : reader_(filename), row_cb_(row_cb) {
+    : row_cb_(row_cb), buf_(new char[kCsvBufSize]) {
+  auto res = ReadonlyFile::Open(filename);
+  CHECK(res.ok()) << filename << res.status;
+
+  source_.reset(Source::Uncompressed(res.obj));
 }
 
 void CsvReader::SkipHeader(unsigned rows) {
-  string tmp;
-  StringPiece tmp2;
+  vector<StringPiece> tmp;
   for (unsigned i = 0; i < rows; ++i) {
-    if (!reader_.Next(&tmp2, &tmp))
+    if (!Next(&tmp))
       return;
   }
 }
 
 bool CsvReader::Next(std::vector<StringPiece>* result) {
-  StringPiece line;
-
-  while (true) {
-    if (!reader_.Next(&line, &scratch_))
+  while (!tokenizer_.Next(result)) {
+    if (eof_)
       return false;
-    line = absl::StripAsciiWhitespace(line);
-    if (line.empty())
-      continue;
-    char* ptr = const_cast<char*>(line.data());
-    parts_.clear();
-    SplitCSVLineWithDelimiter(ptr, ',',  &parts_);
-    result->assign(parts_.begin(), parts_.end());
 
-    return true;
+    strings::MutableByteRange range{reinterpret_cast<uint8_t*>(buf_.get()), kCsvBufSize};
+    auto res = source_->Read(range);
+    if (!res.ok()) {
+      LOG(ERROR) << "Error reading csv " << res.status;
+      return false;
+    }
+    eof_ = res.obj == 0;
+    tokenizer_.Feed(StringPiece(buf_.get(), res.obj), eof_);
   }
-  return false;
+  return true;
 }
 
 void CsvReader::Run() {
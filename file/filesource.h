@@ -6,8 +6,11 @@
 
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "base/integral_types.h"
+#include "strings/delimited_tokenizer.h"
 #include "strings/stringpiece.h"
 #include "util/sinksource.h"
 
@@ -15,21 +18,114 @@ namespace file {
 class ReadonlyFile;
 class WriteFile;
 
+// Runs fn(i) for every i in [0, count) and returns once all the calls finished.
+// Compatible with ListReader::BlockExecutor.
+typedef std::function<void(unsigned count, std::function<void(unsigned)> fn)> BlockExecutor;
+
 class Source : public util::Source {
  public:
   // File must be open for reading. Source takes ownership over it.
-  Source(ReadonlyFile* file);
+  // Starts reading the file at the specified offset.
+  Source(ReadonlyFile* file, uint64 offset = 0);
   ~Source();
 
 
   // Returns the source wrapping the file. If the file is compressed, than the stream
   // automatically inflates the compressed data. The returned source owns the file object.
-  static util::Source* Uncompressed(ReadonlyFile* file);
+  // Gzip files that consist of members written by util::GzipMemberCompress are inflated
+  // read_ahead members at a time, concurrently if executor is set. The same goes for the
+  // blocks of lz4 files with independent blocks, see LZ4BlockSource, and for the blocks of
+  // bzip2 files if executor is set.
+  static util::Source* Uncompressed(ReadonlyFile* file, unsigned read_ahead = 1,
+                                    BlockExecutor executor = BlockExecutor());
+ private:
+  util::StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) override;
+
+  std::unique_ptr<ReadonlyFile> file_;
+  uint64 offset_ = 0;
+};
+
+// Inflates gzip files that consist of members written by util::GzipMemberCompress or of BGZF
+// blocks. Since the members carry their sizes, up to read_ahead of them are read at once and
+// inflated concurrently by executor. The data is returned in the file order.
+class GzipMemberSource : public util::Source {
+ public:
+  // Takes ownership over file. offset must be the start of a member.
+  GzipMemberSource(ReadonlyFile* file, unsigned read_ahead, BlockExecutor executor,
+                   uint64 offset = 0);
+  ~GzipMemberSource();
+
+  // Returns true if the file starts with a member written by util::GzipMemberCompress.
+  static bool HasMemberHeader(ReadonlyFile* file);
+
+ private:
+  util::StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) override;
+
+  // Reads and inflates the next batch of members.
+  util::Status ReadBatch();
+
+  struct Member {
+    strings::ByteRange compressed;
+    std::string data;
+    util::Status status;
+  };
+
+  std::unique_ptr<ReadonlyFile> file_;
+  unsigned read_ahead_;
+  BlockExecutor executor_;
+
+  uint64 offset_ = 0;
+  std::string buf_;  // compressed members of the current batch.
+  std::vector<Member> members_;
+  unsigned num_members_ = 0, cur_member_ = 0;
+  size_t cur_pos_ = 0;  // position in the data of the current member.
+};
+
+// Decompresses lz4 files, e.g. of LZ4File. The blocks carry their sizes, so up to read_ahead
+// of them are read at once. Independent blocks (LZ4File::Options::independent_blocks) are
+// decompressed concurrently by executor, the linked ones in order. Handles concatenated and
+// skippable frames but does not verify the checksums.
+class LZ4BlockSource : public util::Source {
+ public:
+  // Takes ownership over file.
+  LZ4BlockSource(ReadonlyFile* file, unsigned read_ahead, BlockExecutor executor);
+  ~LZ4BlockSource();
+
+  // Returns true if the file starts with a lz4 frame.
+  static bool HasFrameHeader(ReadonlyFile* file);
+
  private:
   util::StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) override;
 
+  // Parses the header of the next frame at offset_, skips the skippable frames.
+  util::Status ReadFrameHeader();
+
+  // Reads and decompresses the next batch of blocks.
+  util::Status ReadBatch();
+
+  struct Block {
+    strings::ByteRange compressed;
+    bool raw;
+    std::string data;
+    bool ok;
+  };
+
   std::unique_ptr<ReadonlyFile> file_;
+  unsigned read_ahead_;
+  BlockExecutor executor_;
+
   uint64 offset_ = 0;
+  bool in_frame_ = false;
+
+  // The flags of the current frame.
+  bool independent_ = false, block_checksum_ = false, content_checksum_ = false;
+  size_t max_block_size_ = 0;
+
+  std::string buf_;   // compressed blocks of the current batch.
+  std::string dict_;  // the last 64KB of the output, the dictionary of the linked blocks.
+  std::vector<Block> blocks_;
+  unsigned num_blocks_ = 0, cur_block_ = 0;
+  size_t cur_pos_ = 0;  // position in the data of the current block.
 };
 
 class Sink : public util::Sink {
@@ -46,6 +142,8 @@ private:
 
 // Assumes that source provides stream of text characters.
 // Will break the stream into lines ending with EOL (either \r\n\ or \n).
+// The EOLs of each buffer read from the source are located at once with SIMD
+// (see base::MatchVal8), lines inside the buffer are returned without copying.
 class LineReader {
 public:
   enum {DEFAULT_BUF_LOG = 17};
@@ -61,6 +159,10 @@ public:
 
   uint64 line_num() const { return line_num_;}
 
+  // Number of bytes of the stream, including EOL characters, consumed by the lines
+  // returned so far.
+  uint64 consumed_bytes() const { return consumed_bytes_; }
+
   // Sets the result to point to null-terminated line.
   // Empty lines are also returned.
   // Returns true if new line was found or false if end of stream was reached.
@@ -69,18 +171,25 @@ public:
 private:
   void Init(uint32_t buf_log);
 
+  // Returns the first EOL at or after ptr or end_ if the rest of the buffer has no EOLs.
+  char* FindEol(char* ptr) const;
+
   util::Source* source_;
   Ownership ownership_;
   uint64 line_num_ = 0;
+  uint64 consumed_bytes_ = 0;
   std::unique_ptr<char[]> buf_;
+  std::unique_ptr<uint64_t[]> eol_mask_;  // bit i is set if buf_[i] is '\n'.
   char* next_, *end_;
 
   uint32_t page_size_;
   std::string scratch_;
 };
 
+// Reads the records of a CSV file with strings::DelimitedTokenizer, the quoted fields may
+// span lines.
 class CsvReader {
-  LineReader reader_;
+  std::unique_ptr<util::Source> source_;
   std::function<void(const std::vector<StringPiece>&)> row_cb_;
 public:
   explicit CsvReader(const std::string& filename,
@@ -91,8 +200,9 @@ public:
   bool Next(std::vector<StringPiece>* result);
 
  private:
-  std::string scratch_;
-  std::vector<char*> parts_;
+  std::unique_ptr<char[]> buf_;
+  strings::DelimitedTokenizer tokenizer_;
+  bool eof_ = false;
 };
 
 }  // namespace file
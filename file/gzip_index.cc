@@ -0,0 +1,403 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/gzip_index.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "absl/strings/str_cat.h"
+#include "base/endian.h"
+#include "base/logging.h"
+#include "file/file.h"
+#include "util/zlib_source.h"
+
+namespace file {
+
+using util::Status;
+using util::StatusCode;
+using util::StatusObject;
+
+namespace {
+
+constexpr size_t kWindowSize = 1 << 15;  // the largest deflate distance.
+constexpr size_t kInputSize = 1 << 16;
+constexpr size_t kChunkSize = 1 << 16;
+
+constexpr char kIndexMagic[4] = {'G', 'Z', 'I', 'X'};
+constexpr uint32 kIndexVersion = 1;
+constexpr size_t kIndexHeaderSize = 4 + 4 + 1 + 8 + 4;
+constexpr size_t kPointHeaderSize = 8 + 8 + 1 + 4;
+
+Status ZlibStatus(int zerror, const char* msg) {
+  return Status(StatusCode::IO_ERROR, absl::StrCat("zlib error ", zerror, ": ",
+                                                   msg ? msg : "truncated gzip stream"));
+}
+
+// Reads the small pieces of the file, like the headers of the members, through a buffer.
+class ChunkReader {
+ public:
+  explicit ChunkReader(ReadonlyFile* file) : file_(file) {}
+
+  // Returns the data at [pos, pos + len), which is shorter at the end of the file.
+  StatusObject<strings::ByteRange> Read(uint64 pos, size_t len) {
+    if (pos < offset_ || pos + len > offset_ + buf_.size()) {
+      buf_.resize(std::max(len, kChunkSize));
+      auto res = file_->Read(pos, strings::MutableByteRange(buf_.data(), buf_.size()));
+      if (!res.ok())
+        return res.status;
+      buf_.resize(res.obj);
+      offset_ = pos;
+    }
+    size_t start = pos - offset_;
+    return strings::ByteRange(buf_.data() + start, std::min(len, buf_.size() - start));
+  }
+
+ private:
+  ReadonlyFile* file_;
+  uint64 offset_ = 0;
+  std::vector<uint8> buf_;
+};
+
+// Inflates the gzip file from an access point with a window. The point is inside a deflate
+// stream, which is inflated raw, while the following members are inflated with their header.
+class PointSource : public util::Source {
+ public:
+  explicit PointSource(ReadonlyFile* file) : file_(file), buf_(new uint8[kInputSize]) {
+    memset(&zs_, 0, sizeof(zs_));
+    CHECK_EQ(Z_OK, inflateInit2(&zs_, -MAX_WBITS));
+  }
+
+  ~PointSource() {
+    inflateEnd(&zs_);
+    CHECK_STATUS(file_->Close());
+  }
+
+  Status Init(const GzipIndex::Point& point);
+
+ private:
+  StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) override;
+
+  std::unique_ptr<ReadonlyFile> file_;
+  std::unique_ptr<uint8[]> buf_;
+  z_stream zs_;
+  uint64 in_offset_ = 0;  // of the next read.
+
+  bool raw_ = true;         // inflates the deflate stream of the point.
+  bool member_end_ = false;  // the last member ended, the file may end here.
+  unsigned skip_ = 0;        // of the trailer of the raw stream.
+};
+
+Status PointSource::Init(const GzipIndex::Point& point) {
+  in_offset_ = point.in_offset;
+  if (point.bits) {
+    uint8 byte;
+    auto res = file_->Read(in_offset_ - 1, strings::MutableByteRange(&byte, 1));
+    if (!res.ok())
+      return res.status;
+    if (res.obj != 1)
+      return Status(StatusCode::IO_ERROR, "Truncated gzip file");
+    CHECK_EQ(Z_OK, inflatePrime(&zs_, point.bits, byte >> (8 - point.bits)));
+  }
+  if (!point.window.empty()) {
+    CHECK_EQ(Z_OK, inflateSetDictionary(&zs_, reinterpret_cast<const Bytef*>(point.window.data()),
+                                        point.window.size()));
+  }
+  return Status::OK;
+}
+
+StatusObject<size_t> PointSource::ReadInternal(const strings::MutableByteRange& range) {
+  zs_.next_out = range.begin();
+  zs_.avail_out = range.size();
+
+  while (zs_.avail_out) {
+    if (zs_.avail_in == 0) {
+      auto res = file_->Read(in_offset_, strings::MutableByteRange(buf_.get(), kInputSize));
+      if (!res.ok())
+        return res.status;
+      if (res.obj == 0) {
+        if (member_end_)
+          break;
+        return Status(StatusCode::IO_ERROR, "Truncated gzip file");
+      }
+      in_offset_ += res.obj;
+      zs_.next_in = buf_.get();
+      zs_.avail_in = res.obj;
+    }
+
+    if (skip_) {
+      unsigned sz = std::min(skip_, zs_.avail_in);
+      zs_.next_in += sz;
+      zs_.avail_in -= sz;
+      skip_ -= sz;
+      if (skip_ == 0) {
+        // The next member, if any, starts with its header.
+        CHECK_EQ(Z_OK, inflateReset2(&zs_, MAX_WBITS + 16));
+        raw_ = false;
+        member_end_ = true;
+      }
+      continue;
+    }
+
+    member_end_ = false;
+    int zerror = inflate(&zs_, Z_NO_FLUSH);
+    if (zerror == Z_STREAM_END) {
+      if (raw_) {
+        skip_ = 8;  // CRC32 and ISIZE.
+      } else {
+        CHECK_EQ(Z_OK, inflateReset(&zs_));
+        member_end_ = true;
+      }
+    } else if (zerror != Z_OK && zerror != Z_BUF_ERROR) {
+      return ZlibStatus(zerror, zs_.msg);
+    }
+  }
+
+  return range.size() - zs_.avail_out;
+}
+
+}  // namespace
+
+Status GzipIndex::BuildFromMembers(ReadonlyFile* file) {
+  members_ = true;
+  file_size_ = file->Size();
+  points_.clear();
+
+  ChunkReader reader(file);
+  uint64 in = 0, out = 0;
+  while (in < file_size_) {
+    auto res = reader.Read(in, util::kGzipMemberHeaderSize);
+    if (!res.ok())
+      return res.status;
+
+    uint32_t member_size, raw_size;
+    if (!util::ParseGzipMemberHeader(res.obj, &member_size, &raw_size))
+      return Status(StatusCode::IO_ERROR, "Invalid gzip member header");
+    if (in + member_size > file_size_)
+      return Status(StatusCode::IO_ERROR, "Truncated gzip member");
+
+    if (raw_size == 0) {  // ISIZE of the trailer.
+      res = reader.Read(in + member_size - 4, 4);
+      if (!res.ok())
+        return res.status;
+      if (res.obj.size() != 4)
+        return Status(StatusCode::IO_ERROR, "Truncated gzip member");
+      raw_size = LittleEndian::Load32(res.obj.data());
+    }
+
+    Point point;
+    point.in_offset = in;
+    point.out_offset = out;
+    points_.push_back(std::move(point));
+    in += member_size;
+    out += raw_size;
+  }
+  return Status::OK;
+}
+
+Status GzipIndex::Build(ReadonlyFile* file, size_t span) {
+  members_ = false;
+  file_size_ = file->Size();
+  points_.clear();
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+
+  // Parses the gzip headers.
+  CHECK_EQ(Z_OK, inflateInit2(&zs, MAX_WBITS + 16));
+
+  std::unique_ptr<uint8[]> input(new uint8[kInputSize]), window(new uint8[kWindowSize]);
+  uint64 offset = 0, total_in = 0, total_out = 0, last = 0;
+  int zerror = Z_OK;
+  Status st;
+
+  while (true) {
+    if (zs.avail_in == 0) {
+      auto res = file->Read(offset, strings::MutableByteRange(input.get(), kInputSize));
+      if (!res.ok()) {
+        st = res.status;
+        break;
+      }
+      if (res.obj == 0) {
+        if (zerror != Z_STREAM_END)
+          st = ZlibStatus(zerror, nullptr);
+        break;
+      }
+      offset += res.obj;
+      zs.next_in = input.get();
+      zs.avail_in = res.obj;
+    }
+    if (zerror == Z_STREAM_END)  // the next member.
+      CHECK_EQ(Z_OK, inflateReset(&zs));
+
+    // The window is cyclic.
+    if (zs.avail_out == 0) {
+      zs.next_out = window.get();
+      zs.avail_out = kWindowSize;
+    }
+
+    total_in += zs.avail_in;
+    total_out += zs.avail_out;
+    zerror = inflate(&zs, Z_BLOCK);
+    total_in -= zs.avail_in;
+    total_out -= zs.avail_out;
+
+    if (zerror == Z_NEED_DICT)
+      zerror = Z_DATA_ERROR;
+    if (zerror != Z_OK && zerror != Z_STREAM_END && zerror != Z_BUF_ERROR) {
+      st = ZlibStatus(zerror, zs.msg);
+      break;
+    }
+
+    // At the end of a deflate block that is not the last one, or of the first gzip header.
+    bool block_end = (zs.data_type & 128) && !(zs.data_type & 64);
+    if (zerror != Z_STREAM_END && block_end && (points_.empty() || total_out - last > span)) {
+      Point point;
+      point.in_offset = total_in;
+      point.out_offset = total_out;
+      point.bits = zs.data_type & 7;
+
+      size_t have = std::min<uint64>(total_out, kWindowSize);
+      size_t pos = kWindowSize - zs.avail_out;
+      const char* wnd = reinterpret_cast<const char*>(window.get());
+      if (have > pos) {
+        point.window.assign(wnd + kWindowSize - (have - pos), have - pos);
+        point.window.append(wnd, pos);
+      } else {
+        point.window.assign(wnd + pos - have, have);
+      }
+      points_.push_back(std::move(point));
+      last = total_out;
+    }
+  }
+  inflateEnd(&zs);
+
+  if (!st.ok())
+    points_.clear();
+  return st;
+}
+
+uint64 GzipIndex::OutOffset(uint64 in_offset) const {
+  auto it = std::lower_bound(points_.begin(), points_.end(), in_offset,
+                             [](const Point& p, uint64 val) { return p.in_offset < val; });
+  return it == points_.end() ? kuint64max : it->out_offset;
+}
+
+StatusObject<util::Source*> GzipIndex::Open(ReadonlyFile* file, uint64 out_offset,
+                                            unsigned read_ahead, BlockExecutor executor) const {
+  std::unique_ptr<ReadonlyFile> fl(file);
+  if (points_.empty())
+    return Status(StatusCode::IO_ERROR, "Empty gzip index");
+
+  // The last point at or before out_offset.
+  auto it = std::upper_bound(points_.begin(), points_.end(), out_offset,
+                             [](uint64 val, const Point& p) { return val < p.out_offset; });
+  if (it != points_.begin())
+    --it;
+
+  std::unique_ptr<util::Source> src;
+  if (members_) {
+    src.reset(new GzipMemberSource(fl.release(), read_ahead, std::move(executor), it->in_offset));
+  } else {
+    PointSource* point_src = new PointSource(fl.release());
+    src.reset(point_src);
+    RETURN_IF_ERROR(point_src->Init(*it));
+  }
+
+  // Inflates the data up to out_offset.
+  uint64 skip = std::max(out_offset, it->out_offset) - it->out_offset;
+  std::unique_ptr<uint8[]> scratch(new uint8[kInputSize]);
+  while (skip) {
+    auto res = src->Read(strings::MutableByteRange(scratch.get(), std::min<uint64>(skip,
+                                                                                  kInputSize)));
+    if (!res.ok())
+      return res.status;
+    if (res.obj == 0)
+      break;
+    skip -= res.obj;
+  }
+  return src.release();
+}
+
+void GzipIndex::Serialize(std::string* dest) const {
+  size_t start = dest->size();
+  size_t size = kIndexHeaderSize;
+  for (const Point& p : points_) {
+    size += kPointHeaderSize + p.window.size();
+  }
+  dest->resize(start + size);
+
+  uint8* next = reinterpret_cast<uint8*>(&(*dest)[start]);
+  memcpy(next, kIndexMagic, 4);
+  LittleEndian::Store32(next + 4, kIndexVersion);
+  next[8] = members_;
+  LittleEndian::Store64(next + 9, file_size_);
+  LittleEndian::Store32(next + 17, points_.size());
+  next += kIndexHeaderSize;
+
+  for (const Point& p : points_) {
+    LittleEndian::Store64(next, p.in_offset);
+    LittleEndian::Store64(next + 8, p.out_offset);
+    next[16] = p.bits;
+    LittleEndian::Store32(next + 17, p.window.size());
+    next += kPointHeaderSize;
+    memcpy(next, p.window.data(), p.window.size());
+    next += p.window.size();
+  }
+}
+
+Status GzipIndex::Parse(StringPiece src) {
+  points_.clear();
+  const uint8* next = reinterpret_cast<const uint8*>(src.data());
+  const uint8* end = next + src.size();
+
+  if (src.size() < kIndexHeaderSize || memcmp(next, kIndexMagic, 4) != 0 ||
+      LittleEndian::Load32(next + 4) != kIndexVersion) {
+    return Status(StatusCode::PARSE_ERROR, "Invalid gzip index header");
+  }
+  members_ = next[8];
+  file_size_ = LittleEndian::Load64(next + 9);
+  uint32 count = LittleEndian::Load32(next + 17);
+  next += kIndexHeaderSize;
+
+  points_.reserve(std::min<size_t>(count, src.size() / kPointHeaderSize));
+  for (uint32 i = 0; i < count; ++i) {
+    if (end - next < ptrdiff_t(kPointHeaderSize))
+      break;
+    Point p;
+    p.in_offset = LittleEndian::Load64(next);
+    p.out_offset = LittleEndian::Load64(next + 8);
+    p.bits = next[16];
+    uint32 window_size = LittleEndian::Load32(next + 17);
+    next += kPointHeaderSize;
+    if (p.bits > 7 || window_size > kWindowSize || end - next < ptrdiff_t(window_size))
+      break;
+    p.window.assign(reinterpret_cast<const char*>(next), window_size);
+    next += window_size;
+    points_.push_back(std::move(p));
+  }
+
+  if (points_.size() != count || next != end) {
+    points_.clear();
+    return Status(StatusCode::PARSE_ERROR, "Corrupted gzip index");
+  }
+  return Status::OK;
+}
+
+std::string GzipIndexPath(StringPiece gzip_path) {
+  size_t pos = gzip_path.rfind('/');
+  pos = pos == StringPiece::npos ? 0 : pos + 1;
+  return absl::StrCat(gzip_path.substr(0, pos), ".", gzip_path.substr(pos), ".gzidx");
+}
+
+bool IsGzipFile(ReadonlyFile* file) {
+  uint8 magic[3];
+  auto res = file->Read(0, strings::MutableByteRange(magic, sizeof(magic)));
+  return res.ok() && res.obj == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b &&
+         magic[2] == Z_DEFLATED;
+}
+
+}  // namespace file
@@ -0,0 +1,76 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "file/filesource.h"
+#include "strings/stringpiece.h"
+#include "util/status.h"
+
+namespace file {
+
+// Access points of a gzip file, from which its data can be inflated without inflating the data
+// before them, hence the ranges between the points can be inflated concurrently.
+// The index of a file made of members with their sizes in the header (util::GzipMemberCompress,
+// BGZF) has a point per member and is built from the member headers, without inflating them.
+// Other gzip files are indexed by inflating them once, like zran.c of zlib does: a point is kept
+// at a deflate block boundary every span bytes of data, with the 32KB of the data before it that
+// the following blocks may refer to. Such indices are worth storing, see GzipIndexPath().
+class GzipIndex {
+ public:
+  struct Point {
+    uint64 in_offset = 0;   // of the compressed data.
+    uint64 out_offset = 0;  // of the uncompressed data.
+
+    // The number of the bits of the byte before in_offset that belong to the point.
+    uint8 bits = 0;
+
+    std::string window;  // the data before the point, empty for the member points.
+  };
+
+  // Builds the index of a file that consists of members of util::GzipMemberCompress or of
+  // BGZF blocks. Fails if the file has another format.
+  util::Status BuildFromMembers(ReadonlyFile* file);
+
+  // Inflates the whole gzip file and adds a point every span bytes of data.
+  util::Status Build(ReadonlyFile* file, size_t span);
+
+  // Whether the points start the gzip members.
+  bool members() const { return members_; }
+
+  // The size of the indexed file.
+  uint64 file_size() const { return file_size_; }
+
+  const std::vector<Point>& points() const { return points_; }
+
+  // Returns the uncompressed offset of the first point at or after in_offset or kuint64max
+  // if there is none. The data between the points over a byte range of the compressed file
+  // can be inflated by a single source.
+  uint64 OutOffset(uint64 in_offset) const;
+
+  // Returns the source that inflates the file from out_offset of the uncompressed data.
+  // The source owns the file, but not the index that must outlive it.
+  util::StatusObject<util::Source*> Open(ReadonlyFile* file, uint64 out_offset,
+                                         unsigned read_ahead = 1,
+                                         BlockExecutor executor = BlockExecutor()) const;
+
+  void Serialize(std::string* dest) const;
+  util::Status Parse(StringPiece src);
+
+ private:
+  bool members_ = false;
+  uint64 file_size_ = 0;
+  std::vector<Point> points_;
+};
+
+// The path of the sidecar of the index of the local gzip file "dir/name": "dir/.name.gzidx".
+// The sidecar is a dot file so that the input globs do not match it.
+std::string GzipIndexPath(StringPiece gzip_path);
+
+// Returns true if the file starts with a gzip header.
+bool IsGzipFile(ReadonlyFile* file);
+
+}  // namespace file
@@ -6,7 +6,14 @@
 
 #include <crc32c/crc32c.h>
 
+#include <algorithm>
+#include <deque>
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
 #include "base/fixed.h"
+#include "base/hash.h"
 #include "file/compressors.h"
 #include "file/file_util.h"
 #include "file/filesource.h"
@@ -26,6 +33,104 @@ namespace file {
 namespace list_file {
 
 const char kMagicString[] = "LST1";
+const char kIndexMagic[] = "LSTIDX1";
+const char kIndexMetaKey[] = "__lst_index__";
+const char kZstdDictKey[] = "__zstd_dict__";
+
+static_assert(sizeof(kIndexMagic) == 8, "");
+
+void BlockIndex::EncodeTo(std::string* dest) const {
+  // Format: varint64 num_records, varint32 entry count,
+  // (varint64 block delta, varint64 first record delta, varint32 key size, key data)+,
+  // optional (varint32 key filter size, key filter data).
+  size_t start = dest->size();
+  Varint::Append64(dest, num_records);
+  Varint::Append32(dest, entries.size());
+
+  uint64 prev_block = 0, prev_record = 0;
+  for (const auto& e : entries) {
+    Varint::Append64(dest, e.block - prev_block);
+    Varint::Append64(dest, e.first_record - prev_record);
+    Varint::Append32(dest, e.first_key.size());
+    dest->append(e.first_key);
+    prev_block = e.block;
+    prev_record = e.first_record;
+  }
+  if (!key_filter.empty()) {
+    Varint::Append32(dest, key_filter.size());
+    dest->append(key_filter);
+  }
+
+  uint32 length = dest->size() - start;
+  uint8 trailer[kIndexTrailerSize];
+  uint32 crc = Mask(crc32c::Crc32c(dest->data() + start, length));
+  coding::EncodeFixed32(crc, trailer);
+  coding::EncodeFixed32(length, trailer + 4);
+  memcpy(trailer + 8, kIndexMagic, sizeof(kIndexMagic));
+  dest->append(strings::charptr(trailer), sizeof(trailer));
+}
+
+namespace {
+
+constexpr unsigned kFilterBlockBits = 512;
+
+// Maps the high half of the hash to [0, num_blocks).
+inline size_t FilterBlock(uint64 hash, size_t num_blocks) {
+  return ((hash >> 32) * num_blocks) >> 32;
+}
+
+}  // namespace
+
+uint64 KeyFilterHash(StringPiece key) {
+  return base::Fingerprint(key.data(), key.size());
+}
+
+void BuildKeyFilter(const std::vector<uint64>& hashes, unsigned bits_per_key, std::string* dest) {
+  CHECK_GT(bits_per_key, 0);
+
+  // ln(2) * bits_per_key probes minimize the false positive rate.
+  unsigned probes = std::max(1U, std::min(16U, bits_per_key * 69 / 100));
+  size_t num_blocks = std::max<size_t>(1, (hashes.size() * bits_per_key + kFilterBlockBits - 1) /
+                                              kFilterBlockBits);
+  CHECK_LT(num_blocks, 1ULL << 32);
+
+  size_t start = dest->size();
+  dest->push_back(probes);
+  dest->resize(start + 1 + num_blocks * kFilterBlockBits / 8);
+  uint8* blocks = reinterpret_cast<uint8*>(&(*dest)[start + 1]);
+
+  for (uint64 hash : hashes) {
+    uint8* block = blocks + FilterBlock(hash, num_blocks) * kFilterBlockBits / 8;
+
+    // Double hashing over the low half, similarly to leveldb.
+    uint32 h = hash;
+    const uint32 delta = (h >> 17) | (h << 15);
+    for (unsigned i = 0; i < probes; ++i) {
+      unsigned bit = h % kFilterBlockBits;
+      block[bit / 8] |= (1 << (bit % 8));
+      h += delta;
+    }
+  }
+}
+
+bool KeyFilterMayMatch(uint64 hash, StringPiece filter) {
+  if (filter.size() < 1 + kFilterBlockBits / 8 || (filter.size() - 1) % (kFilterBlockBits / 8))
+    return true;  // Malformed filters match everything.
+
+  unsigned probes = uint8(filter[0]);
+  size_t num_blocks = (filter.size() - 1) / (kFilterBlockBits / 8);
+  const uint8* block = u8ptr(filter) + 1 + FilterBlock(hash, num_blocks) * kFilterBlockBits / 8;
+
+  uint32 h = hash;
+  const uint32 delta = (h >> 17) | (h << 15);
+  for (unsigned i = 0; i < probes; ++i) {
+    unsigned bit = h % kFilterBlockBits;
+    if ((block[bit / 8] & (1 << (bit % 8))) == 0)
+      return false;
+    h += delta;
+  }
+  return true;
+}
 
 class BlockHeader {
   uint8 buf_[kBlockHeaderSize];
@@ -129,12 +234,16 @@ class Lst1Impl : public ListWriter::WriterImpl {
   ~Lst1Impl();
 
   Status Init(const std::map<string, string>& meta) final;
-  Status AddRecord(StringPiece slice) final;
+  Status AddRecord(StringPiece slice) final { return AddKeyedRecord(slice, StringPiece()); }
+  Status AddKeyedRecord(StringPiece slice, StringPiece key) final;
   Status Flush() final;
 
  private:
   util::Status EmitPhysicalRecord(list_file::RecordType type, const uint8* ptr, size_t length);
 
+  // Called when the current record starts in the current block.
+  void IndexRecord(StringPiece key);
+
   uint32 block_leftover() const { return block_leftover_; }
 
   void AddRecordToArray(StringPiece size_enc, StringPiece record);
@@ -154,6 +263,12 @@ class Lst1Impl : public ListWriter::WriterImpl {
   size_t compress_buf_size_ = 0;
 
   CompressFunction compress_func_;
+
+  // Set when write_index is on.
+  std::unique_ptr<BlockIndex> index_;
+  std::vector<uint64> key_hashes_;  // for the key filter.
+  uint64 block_num_ = 0;
+  bool index_written_ = false;
 };
 
 Lst1Impl::Lst1Impl(util::Sink* sink, const ListWriter::Options& opts)
@@ -164,7 +279,12 @@ Lst1Impl::Lst1Impl(util::Sink* sink, const ListWriter::Options& opts)
 
   if (opts.use_compression) {
     CompressBoundFunction bound_f = GetCompressBound(opts.compress_method);
-    compress_func_ = GetCompress(opts.compress_method);
+    if (opts.compress_method == kCompressionZstd) {
+      compress_func_ = GetZstdCompress(opts.compress_dict, opts.compress_level);
+    } else {
+      CHECK(opts.compress_dict.empty()) << "Dictionaries are supported only by zstd";
+      compress_func_ = GetCompress(opts.compress_method);
+    }
     CHECK(bound_f && compress_func_);
     compress_buf_size_ = bound_f(block_size_);
 
@@ -172,8 +292,14 @@ Lst1Impl::Lst1Impl(util::Sink* sink, const ListWriter::Options& opts)
   }
 
   if (opts.append) {
+    CHECK(!opts.write_index) << "Can not append to indexed lists";
     block_leftover_ = block_size_ - (opts.internal_append_offset % block_size_);
   }
+
+  if (opts.write_index) {
+    index_.reset(new BlockIndex);
+  }
+  CHECK(!opts.key_filter_bits || opts.write_index) << "Key filter requires write_index";
 }
 
 Lst1Impl::~Lst1Impl() {
@@ -185,7 +311,16 @@ Status Lst1Impl::Init(const std::map<string, string>& meta) {
   if (!options_.append) {
     CHECK_GT(options_.block_size_multiplier, 0);
     CHECK(!init_called_);
-    FileHeader header(options_.block_size_multiplier, meta);
+    std::map<string, string> ext_meta;
+    bool has_ext = index_ || !options_.compress_dict.empty();
+    if (has_ext) {
+      ext_meta = meta;
+      if (index_)
+        ext_meta[kIndexMetaKey] = "1";
+      if (!options_.compress_dict.empty())
+        ext_meta[kZstdDictKey] = options_.compress_dict;
+    }
+    FileHeader header(options_.block_size_multiplier, has_ext ? ext_meta : meta);
 
     RETURN_IF_ERROR(header.Write(dest_.get()));
     init_called_ = true;
@@ -217,8 +352,24 @@ inline Status Lst1Impl::FlushArray() {
   return st;
 }
 
-Status Lst1Impl::AddRecord(StringPiece record) {
+inline void Lst1Impl::IndexRecord(StringPiece key) {
+  if (!index_ || (!index_->entries.empty() && index_->entries.back().block == block_num_))
+    return;
+
+  index_->entries.emplace_back();
+  BlockIndex::Entry& e = index_->entries.back();
+  e.block = block_num_;
+  e.first_record = records_added_ - 1;
+  e.first_key = AsString(key);
+}
+
+Status Lst1Impl::AddKeyedRecord(StringPiece record, StringPiece key) {
   CHECK_GT(block_size_, 0) << "ListWriter::Init was not called.";
+  CHECK(!index_written_) << "Records can not be added after Flush of an indexed list";
+
+  if (options_.key_filter_bits && !key.empty()) {
+    key_hashes_.push_back(KeyFilterHash(key));
+  }
 
   Varint32Encoder record_size_encoded(record.size());
   const uint32 record_size_total = record_size_encoded.size() + record.size();
@@ -229,6 +380,7 @@ Status Lst1Impl::AddRecord(StringPiece record) {
   while (true) {
     if (array_records_ > 0) {
       if (array_next_ + record_size_total <= array_end_) {
+        IndexRecord(key);
         AddRecordToArray(record_size_encoded.slice(), record);
         return Status::OK;
       }
@@ -241,6 +393,7 @@ Status Lst1Impl::AddRecord(StringPiece record) {
       RETURN_IF_ERROR(dest_->Append(ByteRange(kBlockFilling, block_leftover())));
       block_offset_ = 0;
       block_leftover_ = block_size_;
+      ++block_num_;
     }
 
     if (fragmenting) {
@@ -261,15 +414,18 @@ Status Lst1Impl::AddRecord(StringPiece record) {
       // We leave space at the beginning to prepend the header at the end.
       array_next_ = array_store_.get() + kArrayRecordMaxHeaderSize;
       array_end_ = array_store_.get() + block_leftover();
+      IndexRecord(key);
       AddRecordToArray(record_size_encoded.slice(), record);
       return Status::OK;
     }
     if (kBlockHeaderSize + record.size() <= block_leftover()) {
       // We have space for one record in this block but not for the array.
+      IndexRecord(key);
       return EmitPhysicalRecord(kFullType, u8ptr(record), record.size());
     }
     // We must fragment.
     fragmenting = true;
+    IndexRecord(key);
     const size_t fragment_length = block_leftover() - kBlockHeaderSize;
     RETURN_IF_ERROR(EmitPhysicalRecord(kFirstType, u8ptr(record), fragment_length));
     record.remove_prefix(fragment_length);
@@ -277,7 +433,27 @@ Status Lst1Impl::AddRecord(StringPiece record) {
   return Status(StatusCode::INTERNAL_ERROR, "Should not reach here");
 }
 
-Status Lst1Impl::Flush() { return FlushArray(); }
+Status Lst1Impl::Flush() {
+  if (index_written_)
+    return Status::OK;
+
+  RETURN_IF_ERROR(FlushArray());
+  if (!index_)
+    return Status::OK;
+
+  index_->num_records = records_added_;
+  if (!key_hashes_.empty()) {
+    BuildKeyFilter(key_hashes_, options_.key_filter_bits, &index_->key_filter);
+    key_hashes_ = std::vector<uint64>();
+  }
+
+  string buf;
+  index_->EncodeTo(&buf);
+  RETURN_IF_ERROR(dest_->Append(strings::ToByteRange(buf)));
+  index_written_ = true;
+
+  return Status::OK;
+}
 
 Status Lst1Impl::EmitPhysicalRecord(RecordType type, const uint8* ptr, size_t length) {
   DCHECK_LE(kBlockHeaderSize + length, block_leftover());
@@ -313,6 +489,141 @@ Status Lst1Impl::EmitPhysicalRecord(RecordType type, const uint8* ptr, size_t le
   block_leftover_ = block_size_ - block_offset_;
   return Status::OK;
 }
+
+// Buffers the records into batches of a block size and hands them to the wrapped writer in
+// async_executor. Batches are written in order, by a single task at a time.
+class AsyncImpl : public ListWriter::WriterImpl {
+ public:
+  AsyncImpl(ListWriter::WriterImpl* next, const ListWriter::Options& opts);
+  ~AsyncImpl();
+
+  Status Init(const std::map<string, string>& meta) final;
+  Status AddRecord(StringPiece slice) final { return AddKeyedRecord(slice, StringPiece()); }
+  Status AddKeyedRecord(StringPiece slice, StringPiece key) final;
+  Status Flush() final;
+
+ private:
+  struct Batch {
+    string buf;                                    // records followed by their keys.
+    std::vector<std::pair<uint32, uint32>> sizes;  // record and key sizes.
+  };
+
+  // Queues cur_, waits if async_blocks batches are already queued.
+  Status Submit();
+
+  // Runs in async_executor.
+  void Drain();
+
+  std::unique_ptr<ListWriter::WriterImpl> next_;
+  size_t batch_size_;
+  Batch cur_;
+
+  // Fiber primitives so that waiting callers in IO threads do not block other fibers.
+  boost::fibers::mutex mu_;
+  boost::fibers::condition_variable cv_;
+
+  // Guarded by mu_. The front batch is being written while draining_ is set.
+  std::deque<Batch> pending_;
+  bool draining_ = false;
+  Status status_;  // the first error of next_.
+};
+
+AsyncImpl::AsyncImpl(ListWriter::WriterImpl* next, const ListWriter::Options& opts)
+    : WriterImpl(nullptr, opts), next_(next) {
+  CHECK(opts.async_executor) << "async_blocks requires async_executor";
+  batch_size_ = kBlockSizeFactor * opts.block_size_multiplier;
+}
+
+AsyncImpl::~AsyncImpl() {
+  Status st = Flush();
+  LOG_IF(ERROR, !st.ok()) << "Could not flush the list: " << st;
+
+  // next_ must not be destroyed while Drain runs, even if Flush failed.
+  std::unique_lock<boost::fibers::mutex> lk(mu_);
+  cv_.wait(lk, [this] { return !draining_; });
+}
+
+Status AsyncImpl::Init(const std::map<string, string>& meta) {
+  Status st = next_->Init(meta);
+  init_called_ = next_->init_called();
+  return st;
+}
+
+Status AsyncImpl::AddKeyedRecord(StringPiece slice, StringPiece key) {
+  ++records_added_;
+  cur_.buf.append(slice.data(), slice.size()).append(key.data(), key.size());
+  cur_.sizes.emplace_back(slice.size(), key.size());
+
+  if (cur_.buf.size() >= batch_size_)
+    return Submit();
+  return Status::OK;
+}
+
+Status AsyncImpl::Submit() {
+  std::unique_lock<boost::fibers::mutex> lk(mu_);
+  cv_.wait(lk, [this] { return pending_.size() < options_.async_blocks; });
+  if (!status_.ok())
+    return status_;
+
+  pending_.push_back(std::move(cur_));
+  cur_ = Batch{};
+  cur_.buf.reserve(batch_size_);
+
+  bool start = !draining_;
+  draining_ = true;
+  lk.unlock();
+
+  if (start) {
+    options_.async_executor([this] { Drain(); });
+  }
+  return Status::OK;
+}
+
+void AsyncImpl::Drain() {
+  std::unique_lock<boost::fibers::mutex> lk(mu_);
+
+  while (!pending_.empty()) {
+    const Batch& batch = pending_.front();  // Submit does not invalidate the references.
+    lk.unlock();
+
+    Status st;
+    const char* ptr = batch.buf.data();
+    for (const auto& sz : batch.sizes) {
+      StringPiece record(ptr, sz.first), key(ptr + sz.first, sz.second);
+      st = next_->AddKeyedRecord(record, key);
+      if (!st.ok())
+        break;
+      ptr += sz.first + sz.second;
+    }
+
+    lk.lock();
+    if (!st.ok() && status_.ok())
+      status_ = st;
+    pending_.pop_front();
+    cv_.notify_all();
+  }
+  draining_ = false;
+  cv_.notify_all();
+}
+
+Status AsyncImpl::Flush() {
+  if (!cur_.sizes.empty()) {
+    RETURN_IF_ERROR(Submit());
+  }
+
+  {
+    std::unique_lock<boost::fibers::mutex> lk(mu_);
+    cv_.wait(lk, [this] { return !draining_; });
+    if (!status_.ok())
+      return status_;
+  }
+
+  Status st = next_->Flush();
+  bytes_added_ = next_->bytes_added();
+  compression_savings_ = next_->compression_savings();
+  return st;
+}
+
 }  // namespace
 
 ListWriter::ListWriter(StringPiece filename, const Options& options) {
@@ -326,7 +637,15 @@ ListWriter::ListWriter(StringPiece filename, const Options& options) {
       HeaderParser parser;
       std::map<string, string> meta;
       if (parser.Parse(status_obj.obj, &meta).ok()) {
+        CHECK_EQ(0, meta.count(kIndexMetaKey)) << "Can not append to indexed list " << filename;
         opts.block_size_multiplier = parser.block_multiplier();
+
+        // Appended records must use the dictionary of the file.
+        auto it = meta.find(kZstdDictKey);
+        if (it != meta.end()) {
+          opts.compress_dict = it->second;
+          opts.compress_method = kCompressionZstd;
+        }
         header_offset = parser.offset();
         file_offset = status_obj.obj->Size();
 
@@ -344,14 +663,21 @@ ListWriter::ListWriter(StringPiece filename, const Options& options) {
   WriteFile* file = file::Open(filename, open_options);
 
   impl_.reset(new Lst1Impl(new Sink(file, TAKE_OWNERSHIP), opts));
+  if (opts.async_blocks) {
+    impl_.reset(new AsyncImpl(impl_.release(), opts));
+  }
 }
 
 ListWriter::ListWriter(util::Sink* dest, const Options& options) {
   if (options.v2) {
+    CHECK(!options.write_index) << "Block index is supported only by LST1 lists";
     impl_.reset(new lst2::Lst2Impl(dest, options));
   } else {
     impl_.reset(new Lst1Impl(dest, options));
   }
+  if (options.async_blocks) {
+    impl_.reset(new AsyncImpl(impl_.release(), options));
+  }
 }
 
 // Adds user provided meta information about the file. Must be called before Init.
@@ -22,9 +22,32 @@ class ListWriter {
     bool use_compression = true;
     list_file::CompressMethod compress_method = list_file::kCompressionLZ4;
     uint8 compress_level = 1;
+
+    // Dictionary for kCompressionZstd, see file::TrainZstdDictionary. It is stored in the meta
+    // map of the list.
+    std::string compress_dict;
     bool append = false;
     bool v2 = false;
 
+    // Writes the block index at the end of the list, see ListReader::Seek.
+    // Flush finalizes indexed lists, records can not be added after it.
+    bool write_index = false;
+
+    // When positive, the block index also stores a Bloom filter with this number of bits per
+    // key over the keys of AddRecord(slice, key), see ListReader::MayContainKey.
+    // Requires write_index.
+    uint8 key_filter_bits = 0;
+
+    // When positive, AddRecord only buffers the records and every block worth of them is
+    // compressed and written by a task of async_executor while the caller fills the next one.
+    // At most async_blocks blocks are in flight, AddRecord waits for them beyond that.
+    // bytes_added() and compression_savings() are updated by Flush.
+    unsigned async_blocks = 0;
+
+    // Runs the task, possibly in another thread. The writer runs a single task at a time.
+    // The task must not run in a thread that waits for the writer.
+    std::function<void(std::function<void()>)> async_executor;
+
     Options() {}
 
     size_t internal_append_offset = 0;
@@ -43,6 +66,13 @@ class ListWriter {
 
   util::Status AddRecord(StringPiece slice) { return impl_->AddRecord(slice); }
 
+  // Records the key of the first record that starts in each block in the block index.
+  // The records must be added in key order for ListReader::SeekKey to work.
+  // The key filter, if enabled, does not depend on the order.
+  util::Status AddRecord(StringPiece slice, StringPiece key) {
+    return impl_->AddKeyedRecord(slice, key);
+  }
+
   util::Status Flush() { return impl_->Flush(); }
 
   uint32 records_added() const { return impl_->records_added(); }
@@ -59,6 +89,10 @@ class ListWriter {
     virtual util::Status AddRecord(StringPiece slice) = 0;
     virtual util::Status Flush() = 0;
 
+    virtual util::Status AddKeyedRecord(StringPiece slice, StringPiece key) {
+      return AddRecord(slice);
+    }
+
     uint32 records_added() const { return records_added_; }
     uint64 bytes_added() const { return bytes_added_; }
     uint64 compression_savings() const { return compression_savings_; }
@@ -9,6 +9,9 @@
 #define _LIST_FILE_FORMAT_H_
 
 #include <map>
+#include <string>
+#include <vector>
+
 #include "base/integral_types.h"
 #include "file/file.h"
 #include "util/status.h"
@@ -36,9 +39,13 @@ constexpr uint8 kCompressedMask = 0x10;
 enum CompressMethod : uint8_t {
   kCompressionNone = 0,
   kCompressionZlib = 2,
-  kCompressionLZ4 = 3
+  kCompressionLZ4 = 3,
+  kCompressionZstd = 4
 };
 
+// Meta key of the zstd dictionary that is used by all the zstd compressed records of the list.
+extern const char kZstdDictKey[];
+
 // The file header is:
 //    magic string "LST1\0",
 //    uint8 block_size_multiplier;
@@ -63,6 +70,50 @@ constexpr uint32 kArrayRecordMaxHeaderSize = 5 /*Varint::kMax32*/ + kBlockHeader
 
 extern const char kMagicString[];
 
+// Lists written with ListWriter::Options::write_index end with a block index followed by
+// the index trailer: masked crc32 of the index (Fixed32), index length (Fixed32) and
+// kIndexMagic. The meta map of such lists contains kIndexMetaKey so that readers know
+// where the records end without probing the end of every file.
+constexpr uint32 kIndexTrailerSize = 4 + 4 + 8;
+extern const char kIndexMagic[];  // 8 bytes including the terminating zero.
+extern const char kIndexMetaKey[];
+
+// Maps the blocks of the list to the ordinal and the optional key of the first record that
+// starts in them. Blocks that are covered by the middle of a fragmented record are not indexed.
+// Block numbers are relative to the end of the file header.
+struct BlockIndex {
+  struct Entry {
+    uint64 block = 0;
+    uint64 first_record = 0;
+    std::string first_key;
+  };
+
+  uint64 num_records = 0;
+  std::vector<Entry> entries;
+
+  // Bloom filter over the record keys, empty if the list was written without it.
+  // See KeyFilterMayMatch.
+  std::string key_filter;
+
+  // Encodes the index and its trailer and appends them to dest.
+  void EncodeTo(std::string* dest) const;
+
+  // Decodes the index, input must not include the trailer.
+  util::Status DecodeFrom(StringPiece input);
+};
+
+// Blocked Bloom filter. Each key sets its bits inside a single 64-byte block that is chosen by
+// the key hash, hence a lookup touches a single cache line. The filter is the number of probes
+// (1 byte) followed by the blocks.
+uint64 KeyFilterHash(StringPiece key);
+
+// Builds the filter over the key hashes with bits_per_key bits per key and appends it to dest.
+// 10 bits per key give about 1% false positives.
+void BuildKeyFilter(const std::vector<uint64>& hashes, unsigned bits_per_key, std::string* dest);
+
+// Returns false if the key with this hash was not added to the filter.
+bool KeyFilterMayMatch(uint64 hash, StringPiece filter);
+
 class HeaderParser {
   unsigned offset_ = 0;
   unsigned block_multiplier_ = 0;
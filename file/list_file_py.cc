@@ -8,11 +8,23 @@
    a = list_file_py.Reader('secret.lst')
    for str in a:
      print str
+
+   # Many records per call, the file is read and decompressed without holding the GIL.
+   for batch in iter(lambda: a.read_batch(4096), []):
+     for str in batch:
+       print str
+
+   # The records of a batch in a single buffer, e.g. for numpy.
+   data, ends = a.read_block(4096)
+   ends = numpy.frombuffer(ends, dtype=numpy.uint64)
 */
 //
+#define PY_SSIZE_T_CLEAN  // the lengths of "s#" are Py_ssize_t.
 #include <Python.h>
 #include <structmember.h>
 
+#include <vector>
+
 #include "file/file.h"
 #include "file/list_file.h"
 
@@ -35,8 +47,33 @@ typedef struct {
     PyObject_HEAD
     int number;
     file::ListReader* reader;
+    bool busy;  // set while a batch is read without the GIL.
 } Reader;
 
+// Reads up to max_records records into data, record i ends at (*ends)[i].
+// Releases the GIL, hence the records are copied into data before the next ReadRecord.
+static void ReadBatch(Reader* self, unsigned max_records, string* data,
+                      std::vector<uint64_t>* ends) {
+  self->busy = true;
+  Py_BEGIN_ALLOW_THREADS
+  std::string record_buf;
+  strings::Slice record;
+  while (ends->size() < max_records && self->reader->ReadRecord(&record, &record_buf)) {
+    data->append(record.data(), record.size());
+    ends->push_back(data->size());
+  }
+  Py_END_ALLOW_THREADS
+  self->busy = false;
+}
+
+static bool CheckIdle(Reader* self) {
+  if (self->busy) {
+    PyErr_SetString(list_exception, "Reader is used by another thread");
+    return false;
+  }
+  return true;
+}
+
 static void Reader_dealloc(Reader* self) {
   delete self->reader;
   self->ob_type->tp_free((PyObject*)self);
@@ -48,6 +85,7 @@ static PyObject* Reader_new(PyTypeObject* type, PyObject *args, PyObject *kwds)
     return NULL;
 
   self->reader = NULL;
+  self->busy = false;
 
   return (PyObject *)self;
 }
@@ -71,6 +109,8 @@ static PyObject* Reader_next(PyObject* obj) {
   Reader* self = (Reader*)obj;
   CHECK_NOTNULL(self);
   CHECK_NOTNULL(self->reader);
+  if (!CheckIdle(self))
+    return NULL;
 
   PyObject* res = NULL;
   std::string record_buf;
@@ -84,7 +124,56 @@ static PyObject* Reader_next(PyObject* obj) {
   return res;
 }
 
+// Returns a list of up to max_records records, empty at the end of the file.
+static PyObject* Reader_read_batch(Reader* self, PyObject* args) {
+  unsigned max_records = 1024;
+  if (!PyArg_ParseTuple(args, "|I", &max_records) || !CheckIdle(self))
+    return NULL;
+
+  string data;
+  std::vector<uint64_t> ends;
+  ReadBatch(self, max_records, &data, &ends);
+
+  PyObject* res = PyList_New(ends.size());
+  if (res == NULL)
+    return NULL;
+
+  uint64_t start = 0;
+  for (size_t i = 0; i < ends.size(); ++i) {
+    PyObject* item = PyBytes_FromStringAndSize(data.data() + start, ends[i] - start);
+    if (item == NULL) {
+      Py_DECREF(res);
+      return NULL;
+    }
+    PyList_SET_ITEM(res, i, item);  // steals the reference.
+    start = ends[i];
+  }
+  return res;
+}
+
+// Returns (data, ends): the records of the batch concatenated in a single bytes object and
+// the end offsets of the records as native uint64 values in another. Both support the buffer
+// protocol, hence they are read by numpy.frombuffer or memoryview without copying.
+static PyObject* Reader_read_block(Reader* self, PyObject* args) {
+  unsigned max_records = 1024;
+  if (!PyArg_ParseTuple(args, "|I", &max_records) || !CheckIdle(self))
+    return NULL;
+
+  string data;
+  std::vector<uint64_t> ends;
+  ReadBatch(self, max_records, &data, &ends);
+
+  return Py_BuildValue("(s#s#)", data.data(), Py_ssize_t(data.size()),
+                       reinterpret_cast<const char*>(ends.data()),
+                       Py_ssize_t(ends.size() * sizeof(uint64_t)));
+}
+
 static PyMethodDef reader_methods[] = {
+    {"read_batch", (PyCFunction)Reader_read_batch, METH_VARARGS,
+     "read_batch(max_records=1024) -> list of up to max_records records, empty at the end"},
+    {"read_block", (PyCFunction)Reader_read_block, METH_VARARGS,
+     "read_block(max_records=1024) -> (data, ends) with the records concatenated in data "
+     "and their end offsets as uint64 values in ends"},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
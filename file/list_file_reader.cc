@@ -4,7 +4,9 @@
 // Based on LevelDB implementation.
 #include "file/list_file_reader.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <limits>
 
 #include "base/flags.h"
 #include "base/varint.h"
@@ -36,14 +38,48 @@ class Lst1Impl : public ListReader::FormatImpl {
 
   bool ReadRecord(StringPiece* record, std::string* scratch) final;
 
+  bool SetRange(size_t offset, size_t length) final;
+
+  void SetReadAhead(unsigned num_blocks, ListReader::BlockExecutor executor) final;
+
+  const list_file::BlockIndex* index() const final { return index_.get(); }
+  void SeekBlock(uint64 block) final;
+
  private:
+  // Reads the block index at the end of the file and sets data_end_ to its start.
+  Status ReadIndex();
+
+  // Physical record of a block that was read from the file.
+  struct PhysicalRecord {
+    unsigned type = 0;           // RecordType or one of the special values below.
+    bool uncompressed = false;   // whether the data is in Block::uncompressed.
+    uint32 offset = 0, length = 0;
+
+    // Corruption to report when the record is consumed.
+    const char* error = nullptr;
+    size_t drop_size = 0;
+  };
+
+  struct Block {
+    size_t offset = 0;  // file offset of the block.
+    strings::ByteRange data;
+    std::vector<PhysicalRecord> records;
+    std::string uncompressed;
+    size_t header_bytes = 0;
+  };
+
   // Return type, or one of the preceding special values
-  unsigned int ReadPhysicalRecord(StringPiece* result);
+  unsigned int ReadPhysicalRecord(bool in_fragmented_record, StringPiece* result);
+
+  // Reads the next batch of blocks and parses them. Returns false if nothing was read.
+  bool ReadBlocks();
+
+  void DecodeBlock(Block* block) const;
 
   // 'size' is size of the compressed blob.
-  // Returns true if succeeded. In that case uncompress_buf_ will contain the uncompressed data
-  // and size will be updated to the uncompressed size.
-  bool Uncompress(const uint8* data_ptr, uint32* size);
+  // Returns true if succeeded. In that case the uncompressed data is appended to dest
+  // and size is updated to the uncompressed size.
+  bool Uncompress(const uint8* data_ptr, uint32* size, std::string* dest) const;
 
   // Extend record types with the following special values
   enum {
@@ -55,6 +91,24 @@ class Lst1Impl : public ListReader::FormatImpl {
     // * The record is below constructor's initial_offset (No drop is reported)
     kBadRecord = list_file::kMaxRecordType + 2
   };
+
+  size_t header_end_ = 0;
+  size_t block_start_ = 0;  // file offset of the current block.
+  size_t range_end_ = std::numeric_limits<size_t>::max();
+  size_t data_end_ = 0;  // file offset of the end of records.
+
+  std::unique_ptr<list_file::BlockIndex> index_;
+
+  std::vector<Block> blocks_;  // the last batch, we keep the vector to reuse its buffers.
+  unsigned num_blocks_ = 0, cur_block_ = 0, cur_record_ = 0;
+
+  unsigned read_ahead_ = 0;
+  ListReader::BlockExecutor executor_;
+
+  UncompressFunction zstd_uncompress_;  // uses the dictionary of the list if it has one.
+
+  // True if we started in the middle of the file and have not reached the first record yet.
+  bool skip_partial_ = false;
 };
 
 bool Lst1Impl::ReadHeader(std::map<std::string, std::string>* dest) {
@@ -66,13 +120,28 @@ bool Lst1Impl::ReadHeader(std::map<std::string, std::string>* dest) {
     return false;
   }
 
-  file_offset_ = wrapper_->read_header_bytes = parser.offset();
+  header_end_ = file_offset_ = wrapper_->read_header_bytes = parser.offset();
   wrapper_->block_size = parser.block_multiplier() * list_file::kBlockSizeFactor;
 
   CHECK_GT(wrapper_->block_size, 0);
   backing_store_.reset(new uint8[wrapper_->block_size]);
-  uncompress_buf_.reset(new uint8[wrapper_->block_size]);
-  if (file_offset_ >= wrapper_->file->Size()) {
+
+  auto it = dest->find(list_file::kZstdDictKey);
+  zstd_uncompress_ = GetZstdUncompress(it == dest->end() ? StringPiece() : it->second);
+  if (!zstd_uncompress_) {
+    wrapper_->BadHeader(Status(StatusCode::PARSE_ERROR, "Bad zstd dictionary"));
+    return false;
+  }
+
+  data_end_ = wrapper_->file->Size();
+  if (dest->count(list_file::kIndexMetaKey)) {
+    status = ReadIndex();
+    if (!status.ok()) {
+      wrapper_->ReportDrop(0, status);
+    }
+  }
+
+  if (file_offset_ >= data_end_) {
     wrapper_->eof = true;
   }
   return true;
@@ -105,7 +174,25 @@ bool Lst1Impl::ReadRecord(StringPiece* record, std::string* scratch) {
         return true;
       }
     }
-    const unsigned int record_type = ReadPhysicalRecord(&fragment);
+    const unsigned int record_type = ReadPhysicalRecord(in_fragmented_record, &fragment);
+    if (skip_partial_) {
+      // Skip the tail of the record that started before our range.
+      // It is read by the reader of the previous range.
+      if (record_type == kMiddleType || record_type == kLastType) {
+        skip_partial_ = record_type == kMiddleType;
+        continue;
+      }
+      skip_partial_ = false;
+    }
+
+    // A record that starts in a block beyond the range belongs to the next range.
+    if (block_start_ >= range_end_ && (record_type == kFullType || record_type == kFirstType ||
+                                       record_type == kArrayType)) {
+      wrapper_->eof = true;
+      block_buffer_.clear();
+      return false;
+    }
+
     switch (record_type) {
       case kFullType:
         if (in_fragmented_record) {
@@ -187,61 +274,218 @@ bool Lst1Impl::ReadRecord(StringPiece* record, std::string* scratch) {
   return true;
 }
 
-unsigned int Lst1Impl::ReadPhysicalRecord(StringPiece* result) {
-  using list_file::kBlockHeaderSize;
+bool Lst1Impl::SetRange(size_t offset, size_t length) {
+  const size_t bs = wrapper_->block_size;
+  size_t start = header_end_;
+
+  // Blocks are aligned relative to the end of the header. We start at the first block
+  // that begins inside the range.
+  if (offset > start) {
+    start += (offset - start + bs - 1) / bs * bs;
+    skip_partial_ = true;
+  }
+  file_offset_ = start;
+  range_end_ = offset + length;
+
+  if (file_offset_ >= range_end_ || file_offset_ >= data_end_) {
+    wrapper_->eof = true;
+  }
+  return true;
+}
+
+void Lst1Impl::SetReadAhead(unsigned num_blocks, ListReader::BlockExecutor executor) {
+  read_ahead_ = num_blocks;
+  executor_ = std::move(executor);
+  backing_store_.reset(new uint8[size_t(wrapper_->block_size) * std::max(1U, num_blocks)]);
+}
+
+void Lst1Impl::SeekBlock(uint64 block) {
+  file_offset_ = header_end_ + block * wrapper_->block_size;
+  skip_partial_ = block > 0;
+  range_end_ = std::numeric_limits<size_t>::max();
+  array_records_ = 0;
+  num_blocks_ = cur_block_ = cur_record_ = 0;
+  wrapper_->eof = file_offset_ >= data_end_;
+}
+
+Status Lst1Impl::ReadIndex() {
+  using list_file::kIndexTrailerSize;
+
+  size_t fsize = wrapper_->file->Size();
+  if (fsize < header_end_ + kIndexTrailerSize)
+    return Status(StatusCode::IO_ERROR, "Missing block index");
+
+  uint8 trailer[kIndexTrailerSize];
+  auto res = wrapper_->file->Read(fsize - kIndexTrailerSize,
+                                  strings::MutableByteRange(trailer, sizeof(trailer)));
+  if (!res.ok())
+    return res.status;
+
+  uint32 crc = list_file::Unmask(coding::DecodeFixed32(trailer));
+  uint32 length = coding::DecodeFixed32(trailer + 4);
+  if (memcmp(trailer + 8, list_file::kIndexMagic, 8) != 0 ||
+      fsize < header_end_ + kIndexTrailerSize + length) {
+    return Status(StatusCode::IO_ERROR, "Bad block index trailer");
+  }
+
+  size_t index_start = fsize - kIndexTrailerSize - length;
+  std::unique_ptr<uint8[]> buf(new uint8[length]);
+  res = wrapper_->file->Read(index_start, strings::MutableByteRange(buf.get(), length));
+  if (!res.ok())
+    return res.status;
+
+  if (res.obj != length || crc32c::Value(buf.get(), length) != crc)
+    return Status(StatusCode::IO_ERROR, "Bad block index crc");
+
+  // The records end where the index starts even if the index itself is bad.
+  data_end_ = index_start;
+
+  std::unique_ptr<list_file::BlockIndex> index(new list_file::BlockIndex);
+  RETURN_IF_ERROR(index->DecodeFrom(FromBuf(buf.get(), length)));
+  index_ = std::move(index);
+
+  return Status::OK;
+}
+
+unsigned int Lst1Impl::ReadPhysicalRecord(bool in_fragmented_record, StringPiece* result) {
   while (true) {
-    if (block_buffer_.size() <= kBlockHeaderSize) {
-      if (!wrapper_->eof) {
-        size_t fsize = wrapper_->file->Size();
-        strings::MutableByteRange mbr(backing_store_.get(), wrapper_->block_size);
-        auto res = wrapper_->file->Read(file_offset_, mbr);
-        VLOG(2) << "read_size: " << res.obj << ", status: " << res.status;
-        if (!res.ok()) {
-          wrapper_->ReportDrop(res.obj, res.status);
-          wrapper_->eof = true;
-          return kEof;
-        }
-        block_buffer_.reset(backing_store_.get(), res.obj);
-        file_offset_ += block_buffer_.size();
-        if (file_offset_ >= fsize) {
-          wrapper_->eof = true;
-        }
+    if (cur_block_ < num_blocks_) {
+      const Block& block = blocks_[cur_block_];
+      if (cur_record_ == block.records.size()) {
+        ++cur_block_;
+        cur_record_ = 0;
         continue;
-      } else if (block_buffer_.empty()) {
-        // End of file
-        return kEof;
-      } else {
-        size_t drop_size = block_buffer_.size();
-        block_buffer_.clear();
-        wrapper_->ReportCorruption(drop_size, "truncated record at end of file");
-        return kEof;
       }
+
+      const PhysicalRecord& pr = block.records[cur_record_++];
+      block_start_ = block.offset;
+      if (pr.error) {
+        wrapper_->ReportCorruption(pr.drop_size, pr.error);
+      }
+      const uint8* base = pr.uncompressed ? u8ptr(block.uncompressed) : block.data.data();
+      *result = FromBuf(base + pr.offset, pr.length);
+
+      return pr.type;
+    }
+
+    // Blocks that start beyond the range belong to the next range, unless we need them
+    // to complete the current record.
+    if (file_offset_ >= range_end_ && !in_fragmented_record) {
+      wrapper_->eof = true;
+    }
+
+    if (wrapper_->eof || !ReadBlocks()) {
+      return kEof;
+    }
+  }
+}
+
+bool Lst1Impl::ReadBlocks() {
+  const size_t bs = wrapper_->block_size;
+
+  // Do not read ahead beyond the range. If we are past it, we complete the current record
+  // block by block.
+  size_t count = std::max(1U, read_ahead_);
+  if (file_offset_ < range_end_) {
+    count = std::min<size_t>(count, (range_end_ - file_offset_ - 1) / bs + 1);
+  } else {
+    count = 1;
+  }
+
+  size_t read_size = std::min<size_t>(count * bs, data_end_ - file_offset_);
+  const uint8* src = wrapper_->file->mapped_data();
+
+  // Mapped files are decoded in place, without copying the blocks into backing_store_.
+  if (src) {
+    src += file_offset_;
+  } else {
+    auto res = wrapper_->file->Read(file_offset_,
+                                    strings::MutableByteRange(backing_store_.get(), read_size));
+    VLOG(2) << "read_size: " << res.obj << ", status: " << res.status;
+    if (!res.ok()) {
+      wrapper_->ReportDrop(res.obj, res.status);
+      wrapper_->eof = true;
+      return false;
+    }
+    read_size = res.obj;
+    src = backing_store_.get();
+  }
+
+  if (read_size == 0) {
+    wrapper_->eof = true;
+    return false;
+  }
+
+  num_blocks_ = (read_size + bs - 1) / bs;
+  if (blocks_.size() < num_blocks_)
+    blocks_.resize(num_blocks_);
+
+  for (unsigned i = 0; i < num_blocks_; ++i) {
+    Block& block = blocks_[i];
+    size_t start = i * bs;
+    block.offset = file_offset_ + start;
+    block.data.reset(src + start, std::min<size_t>(bs, read_size - start));
+  }
+  cur_block_ = cur_record_ = 0;
+
+  file_offset_ += read_size;
+  if (file_offset_ >= data_end_) {
+    wrapper_->eof = true;
+  }
+
+  if (executor_ && num_blocks_ > 1) {
+    executor_(num_blocks_, [this](unsigned i) { DecodeBlock(&blocks_[i]); });
+  } else {
+    for (unsigned i = 0; i < num_blocks_; ++i) {
+      DecodeBlock(&blocks_[i]);
     }
+  }
+
+  for (unsigned i = 0; i < num_blocks_; ++i) {
+    wrapper_->read_header_bytes += blocks_[i].header_bytes;
+  }
+  return true;
+}
+
+// Must not change the state of the reader since it may run concurrently for several blocks.
+// Errors are recorded in the block and are reported when its records are consumed.
+void Lst1Impl::DecodeBlock(Block* block) const {
+  using list_file::kBlockHeaderSize;
+
+  block->records.clear();
+  block->uncompressed.clear();
+  block->header_bytes = 0;
+
+  strings::ByteRange buf = block->data;
+  auto add_record = [block](unsigned type) -> PhysicalRecord& {
+    block->records.emplace_back();
+    block->records.back().type = type;
+    return block->records.back();
+  };
 
+  while (buf.size() > kBlockHeaderSize) {
     // Parse the header
-    const uint8* header = block_buffer_.data();
+    const uint8* header = buf.data();
     const uint8 type = header[8];
     uint32 length = coding::DecodeFixed32(header + 4);
-    wrapper_->read_header_bytes += kBlockHeaderSize;
+    block->header_bytes += kBlockHeaderSize;
 
     if (length == 0 && type == list_file::kZeroType) {
-      size_t bs = block_buffer_.size();
-      block_buffer_.clear();
       // Handle the case of when mistakenly written last kBlockHeaderSize bytes as empty record.
-      if (bs != kBlockHeaderSize) {
-        LOG(ERROR) << "Bug reading list file " << bs;
-        return kBadRecord;
+      if (buf.size() != kBlockHeaderSize) {
+        LOG(ERROR) << "Bug reading list file " << buf.size();
+        add_record(kBadRecord);
       }
-      continue;
+      return;
     }
 
-    if (length + kBlockHeaderSize > block_buffer_.size()) {
-      VLOG(1) << "Invalid length " << length << " file offset " << file_offset_
-              << " block size " << block_buffer_.size() << " type " << int(type);
-      size_t drop_size = block_buffer_.size();
-      block_buffer_.clear();
-      wrapper_->ReportCorruption(drop_size, "bad record length or truncated record at eof.");
-      return kBadRecord;
+    if (length + kBlockHeaderSize > buf.size()) {
+      VLOG(1) << "Invalid length " << length << " file offset " << block->offset
+              << " block size " << buf.size() << " type " << int(type);
+      PhysicalRecord& pr = add_record(kBadRecord);
+      pr.drop_size = buf.size();
+      pr.error = "bad record length or truncated record at eof.";
+      return;
     }
 
     const uint8* data_ptr = header + kBlockHeaderSize;
@@ -255,46 +499,69 @@ unsigned int Lst1Impl::ReadPhysicalRecord(StringPiece* result) {
         // been corrupted and if we trust it, we could find some
         // fragment of a real log record that just happens to look
         // like a valid log record.
-        size_t drop_size = block_buffer_.size();
-        block_buffer_.clear();
-        wrapper_->ReportCorruption(drop_size, "checksum mismatch");
-        return kBadRecord;
+        PhysicalRecord& pr = add_record(kBadRecord);
+        pr.drop_size = buf.size();
+        pr.error = "checksum mismatch";
+        return;
       }
     }
     uint32 record_size = length + kBlockHeaderSize;
-    block_buffer_.advance(record_size);
+    buf.advance(record_size);
 
     if (type & list_file::kCompressedMask) {
-      if (!Uncompress(data_ptr, &length)) {
-        wrapper_->ReportCorruption(record_size, "Uncompress failed.");
-        return kBadRecord;
+      size_t offset = block->uncompressed.size();
+      if (!Uncompress(data_ptr, &length, &block->uncompressed)) {
+        PhysicalRecord& pr = add_record(kBadRecord);
+        pr.drop_size = record_size;
+        pr.error = "Uncompress failed.";
+        continue;
       }
-      data_ptr = uncompress_buf_.get();
+      PhysicalRecord& pr = add_record(type & 0xF);
+      pr.uncompressed = true;
+      pr.offset = offset;
+      pr.length = length;
+    } else {
+      PhysicalRecord& pr = add_record(type & 0xF);
+      pr.offset = data_ptr - block->data.data();
+      pr.length = length;
     }
+  }
 
-    *result = FromBuf(data_ptr, length);
-    return type & 0xF;
+  if (!buf.empty() && block->offset + block->data.size() >= data_end_) {
+    PhysicalRecord& pr = add_record(kEof);
+    pr.drop_size = buf.size();
+    pr.error = "truncated record at end of file";
   }
 }
 
-bool Lst1Impl::Uncompress(const uint8* data_ptr, uint32* size) {
+bool Lst1Impl::Uncompress(const uint8* data_ptr, uint32* size, string* dest) const {
+  if (*size == 0)
+    return false;
+
   uint8 method = *data_ptr++;
   VLOG(2) << "Uncompress " << int(method) << " with size " << *size;
 
   uint32 inp_sz = *size - 1;
 
-  UncompressFunction uncompr_func = GetUncompress(list_file::CompressMethod(method));
+  UncompressFunction uncompr_func = method == list_file::kCompressionZstd
+                                         ? zstd_uncompress_
+                                         : GetUncompress(list_file::CompressMethod(method));
 
   if (!uncompr_func) {
     LOG(ERROR) << "Could not find uncompress method " << int(method);
     return false;
   }
+  size_t offset = dest->size();
   size_t uncompress_size = wrapper_->block_size;
-  Status status = uncompr_func(data_ptr, inp_sz, uncompress_buf_.get(), &uncompress_size);
+  dest->resize(offset + uncompress_size);
+
+  Status status = uncompr_func(data_ptr, inp_sz, &(*dest)[offset], &uncompress_size);
   if (!status.ok()) {
     VLOG(1) << "Uncompress error: " << status;
+    dest->resize(offset);
     return false;
   }
+  dest->resize(offset + uncompress_size);
 
   *size = uncompress_size;
   return true;
@@ -370,19 +637,99 @@ bool ListReader::ReadHeader() {
 
   const auto read_buf = strings::FromBuf(buf, sizeof(buf));
   const StringPiece kLst1Magic(list_file::kMagicString, list_file::kMagicStringSize);
+  const StringPiece kLst2Magic(lst2::kMagicString, lst2::kMagicStringSize);
+
   if (read_buf == kLst1Magic) {
     impl_.reset(new Lst1Impl(wrapper_.get()));
-    return impl_->ReadHeader(&meta_);
+  } else if (read_buf == kLst2Magic) {
+    impl_.reset(new lst2::ReaderImpl(wrapper_.get()));
+  } else {
+    wrapper_->BadHeader(Status(StatusCode::PARSE_ERROR, "Invalid header"));
+    return false;
   }
 
-  const StringPiece kLst2Magic(lst2::kMagicString, lst2::kMagicStringSize);
-  if (read_buf == kLst2Magic) {
-    impl_.reset(new lst2::ReaderImpl(wrapper_.get()));
-    return impl_->ReadHeader(&meta_);
+  if (!impl_->ReadHeader(&meta_))
+    return false;
+
+  if (has_range_ && !impl_->SetRange(range_offset_, range_length_)) {
+    skip_all_ = range_offset_ > 0;
+  }
+
+  if (read_ahead_) {
+    impl_->SetReadAhead(read_ahead_, read_ahead_executor_);
+  }
+  return true;
+}
+
+void ListReader::SetRange(size_t offset, size_t length) {
+  CHECK(!impl_) << "SetRange must be called before reading";
+
+  has_range_ = true;
+  range_offset_ = offset;
+  range_length_ = length;
+}
+
+const list_file::BlockIndex* ListReader::block_index() {
+  if (!ReadHeader())
+    return nullptr;
+  return impl_->index();
+}
+
+bool ListReader::MayContainKey(StringPiece key) {
+  const list_file::BlockIndex* index = block_index();
+  if (!index || index->key_filter.empty())
+    return true;
+
+  return list_file::KeyFilterMayMatch(list_file::KeyFilterHash(key), index->key_filter);
+}
+
+bool ListReader::Seek(uint64 record_index) {
+  const list_file::BlockIndex* index = block_index();
+  if (!index || record_index >= index->num_records)
+    return false;
+
+  const auto& entries = index->entries;
+  auto it = std::upper_bound(
+      entries.begin(), entries.end(), record_index,
+      [](uint64 val, const list_file::BlockIndex::Entry& e) { return val < e.first_record; });
+  CHECK(it != entries.begin());
+  --it;
+
+  impl_->SeekBlock(it->block);
+  skip_all_ = false;
+
+  string scratch;
+  StringPiece record;
+  for (uint64 i = it->first_record; i < record_index; ++i) {
+    if (!impl_->ReadRecord(&record, &scratch))
+      return false;
   }
+  return true;
+}
+
+bool ListReader::SeekKey(StringPiece key) {
+  const list_file::BlockIndex* index = block_index();
+  if (!index)
+    return false;
+
+  // The last block that starts with a smaller key. Records with keys not less than key can not
+  // precede it.
+  const auto& entries = index->entries;
+  auto it = std::lower_bound(
+      entries.begin(), entries.end(), key,
+      [](const list_file::BlockIndex::Entry& e, StringPiece val) { return e.first_key < val; });
 
-  wrapper_->BadHeader(Status(StatusCode::PARSE_ERROR, "Invalid header"));
-  return false;
+  impl_->SeekBlock(it == entries.begin() ? 0 : std::prev(it)->block);
+  skip_all_ = false;
+
+  return true;
+}
+
+void ListReader::SetReadAhead(unsigned num_blocks, BlockExecutor executor) {
+  CHECK(!impl_) << "SetReadAhead must be called before reading";
+
+  read_ahead_ = num_blocks;
+  read_ahead_executor_ = std::move(executor);
 }
 
 bool ListReader::GetMetaData(std::map<std::string, std::string>* meta) {
@@ -393,7 +740,7 @@ bool ListReader::GetMetaData(std::map<std::string, std::string>* meta) {
 }
 
 bool ListReader::ReadRecord(StringPiece* record, std::string* scratch) {
-  if (!ReadHeader())
+  if (!ReadHeader() || skip_all_)
     return false;
 
   return impl_->ReadRecord(record, scratch);
@@ -404,6 +751,53 @@ void ListReader::Reset() {
   wrapper_->Reset();
 }
 
+Status list_file::BlockIndex::DecodeFrom(StringPiece input) {
+  const uint8 *ptr = u8ptr(input), *end = ptr + input.size();
+  uint32 count = 0;
+  if ((ptr = Varint::Parse64WithLimit(ptr, end, &num_records)) == nullptr ||
+      (ptr = Varint::Parse32WithLimit(ptr, end, &count)) == nullptr) {
+    return Status("Bad block index");
+  }
+
+  entries.clear();
+  entries.reserve(std::min<size_t>(count, input.size()));
+
+  uint64 block = 0, first_record = 0;
+  for (uint32 i = 0; i < count; ++i) {
+    uint64 block_delta = 0, record_delta = 0;
+    uint32 key_size = 0;
+    if ((ptr = Varint::Parse64WithLimit(ptr, end, &block_delta)) == nullptr ||
+        (ptr = Varint::Parse64WithLimit(ptr, end, &record_delta)) == nullptr ||
+        (ptr = Varint::Parse32WithLimit(ptr, end, &key_size)) == nullptr ||
+        key_size > end - ptr) {
+      return Status("Bad block index");
+    }
+
+    block += block_delta;
+    first_record += record_delta;
+    entries.emplace_back();
+    entries.back().block = block;
+    entries.back().first_record = first_record;
+    entries.back().first_key.assign(strings::charptr(ptr), key_size);
+    ptr += key_size;
+  }
+
+  if (num_records > 0 && (entries.empty() || entries.front().first_record != 0))
+    return Status("Bad block index");
+
+  key_filter.clear();
+  if (ptr < end) {
+    uint32 filter_size = 0;
+    if ((ptr = Varint::Parse32WithLimit(ptr, end, &filter_size)) == nullptr ||
+        filter_size > end - ptr) {
+      return Status("Bad block index");
+    }
+    key_filter.assign(strings::charptr(ptr), filter_size);
+  }
+
+  return Status::OK;
+}
+
 Status list_file::HeaderParser::Parse(file::ReadonlyFile* file,
                                       std::map<std::string, std::string>* meta) {
   uint8 buf[2];
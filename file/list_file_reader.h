@@ -54,6 +54,42 @@ class ListReader {
   // will notify reporter about the corruption.
   bool ReadRecord(StringPiece* record, std::string* scratch);
 
+  // Restricts the reader to records that start in blocks beginning inside
+  // [offset, offset + length) of the file. A record that crosses the end of the range is read
+  // till its end, so adjacent ranges partition the file without overlaps.
+  // Must be called before the first ReadRecord. Formats that do not support ranges return all
+  // the records for the range that starts at offset 0 and nothing for the others.
+  void SetRange(size_t offset, size_t length);
+
+  // Runs fn(0), ..., fn(count - 1), possibly concurrently, and returns when all of them finish.
+  typedef std::function<void(unsigned count, std::function<void(unsigned)> fn)> BlockExecutor;
+
+  // Reads num_blocks blocks at once and verifies and decompresses them with executor.
+  // Records are still returned in order. Without the executor the blocks are processed in
+  // the calling thread. Must be called before the first ReadRecord.
+  // See file::FiberBlockExecutor for running them on a FiberQueueThreadPool.
+  void SetReadAhead(unsigned num_blocks, BlockExecutor executor = nullptr);
+
+  // Random access for lists written with ListWriter::Options::write_index.
+  // Positions the reader so that the next ReadRecord returns the record with ordinal
+  // record_index (0-based). Reads the records that precede it in its block.
+  // Returns false if the list has no index or there is no such record.
+  // Cancels the range set by SetRange.
+  bool Seek(uint64 record_index);
+
+  // Positions the reader at the block from which the scan finds the first record whose key
+  // is not less than key. Requires that the records were added in key order.
+  // Returns false if the list has no index.
+  bool SeekKey(StringPiece key);
+
+  // Tests whether the list may contain a record with key without reading the data blocks.
+  // Returns false only if the list was written with ListWriter::Options::key_filter_bits and
+  // none of its records was added with key.
+  bool MayContainKey(StringPiece key);
+
+  // Returns null if the list has no block index.
+  const list_file::BlockIndex* block_index();
+
   void Reset();
 
   uint32_t read_header_bytes() const { return wrapper_->read_header_bytes; }
@@ -98,6 +134,18 @@ class ListReader {
     virtual bool ReadHeader(std::map<std::string, std::string>* dest) = 0;
     virtual bool ReadRecord(StringPiece* record, std::string* scratch) = 0;
 
+    // Called after ReadHeader. Returns false if the format does not support ranges.
+    virtual bool SetRange(size_t offset, size_t length) { return false; }
+
+    // Called after ReadHeader, null if the format or the file do not have the block index.
+    virtual const list_file::BlockIndex* index() const { return nullptr; }
+
+    // Continues reading from the first record that starts in the block.
+    virtual void SeekBlock(uint64 block) {}
+
+    // Called after ReadHeader.
+    virtual void SetReadAhead(unsigned num_blocks, BlockExecutor executor) {}
+
    protected:
     size_t file_offset_ = 0;
     uint32_t array_records_ = 0;
@@ -115,6 +163,13 @@ class ListReader {
 
   std::map<std::string, std::string> meta_;
 
+  bool has_range_ = false;
+  bool skip_all_ = false;
+  size_t range_offset_ = 0, range_length_ = 0;
+
+  unsigned read_ahead_ = 0;
+  BlockExecutor read_ahead_executor_;
+
   std::unique_ptr<ReaderWrapper> wrapper_;
   std::unique_ptr<FormatImpl> impl_;
 };
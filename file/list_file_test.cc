@@ -5,19 +5,23 @@
 #include "file/list_file.h"
 
 #include <random>
+#include <thread>
 
 #include <gmock/gmock.h>
 #include "base/gtest.h"
 
+#include "file/compressors.h"
 #include "file/test_util.h"
 #include "file/file_util.h"
 #include "base/fixed.h"
 #include "base/crc32c.h"
 #include "absl/strings/match.h"
+#include "strings/stringprintf.h"
 
 namespace file {
 
 DEFINE_bool(v2, false, "");
+DEFINE_uint32(read_ahead, 0, "");
 
 using namespace list_file;
 
@@ -129,6 +133,7 @@ protected:
       source_.set_contents(dest_->contents());
       reader_.reset(new ListReader(&source_, DO_NOT_TAKE_OWNERSHIP,
                                    true/*checksum*/, reporter_func()));
+      reader_->SetReadAhead(FLAGS_read_ahead);
     }
 
     std::string scratch;
@@ -512,6 +517,102 @@ TEST_F(LogTest, Zlib) {
   ASSERT_EQ(BigString("foo", 1000), Read());
 }
 
+TEST_F(LogTest, AsyncCompression) {
+  ListWriter::Options options;
+  options.compress_method = list_file::kCompressionZlib;
+  options.write_index = true;
+
+  vector<string> expected;
+  for (int i = 0; i < 3000; i++) {
+    expected.push_back(RandomSkewedString(i));
+  }
+
+  auto write_all = [&](ListWriter* writer) {
+    CHECK(writer->Init().ok());
+    for (size_t i = 0; i < expected.size(); i++) {
+      CHECK(writer->AddRecord(expected[i], std::to_string(10000 + i)).ok());
+    }
+    CHECK(writer->Flush().ok());
+  };
+
+  util::StringSink* sync_sink = new util::StringSink;
+  ListWriter sync_writer(sync_sink, options);
+  write_all(&sync_writer);
+
+  std::vector<std::thread> threads;
+  options.async_blocks = 2;
+  options.async_executor = [&threads](std::function<void()> task) {
+    threads.emplace_back(std::move(task));
+  };
+  SetupWriter(options, false);
+  write_all(writer_.get());
+  writer_flushed_ = true;
+
+  for (auto& t : threads)
+    t.join();
+  EXPECT_GT(threads.size(), 1);
+
+  // The layout does not depend on the mode.
+  EXPECT_EQ(sync_sink->contents(), dest_->contents());
+  EXPECT_EQ(sync_writer.bytes_added(), writer_->bytes_added());
+  EXPECT_GT(writer_->compression_savings(), 0);
+
+  for (const string& rec : expected) {
+    ASSERT_EQ(rec, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, ZstdDictionary) {
+  // Records with the same structure, the kind of data that benefits from dictionaries.
+  // The dictionary helps when there is not enough data in a block to learn from.
+  vector<string> records;
+  for (int i = 0; i < 5000; ++i) {
+    records.push_back(StringPrintf("id:%d country:%s device:%s version:3.%d clicks:%d", i * 7919,
+                                   i % 3 ? "US" : "DE", i % 2 ? "android" : "ios", i % 13,
+                                   i % 101));
+  }
+  vector<string> samples(records.begin(), records.begin() + 4000);
+  records.erase(records.begin(), records.begin() + 4950);
+  string dict;
+  ASSERT_TRUE(TrainZstdDictionary(samples, 4096, &dict).ok());
+  ASSERT_FALSE(dict.empty());
+
+  ListWriter::Options options;
+  options.use_compression = true;
+  options.compress_method = kCompressionZstd;
+
+  uint64 plain_bytes = 0;
+  {
+    ListWriter plain_writer(new util::StringSink, options);
+    ASSERT_TRUE(plain_writer.Init().ok());
+    for (const auto& rec : records) {
+      ASSERT_TRUE(plain_writer.AddRecord(rec).ok());
+    }
+    ASSERT_TRUE(plain_writer.Flush().ok());
+    plain_bytes = plain_writer.bytes_added();
+  }
+
+  options.compress_dict = dict;
+  SetupWriter(options);
+  for (const auto& rec : records) {
+    Write(rec);
+  }
+  FlushWriter();
+  EXPECT_LT(writer_->bytes_added(), plain_bytes);
+
+  for (const auto& rec : records) {
+    ASSERT_EQ(rec, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(0, DroppedBytes());
+
+  std::map<string, string> meta;
+  ASSERT_TRUE(reader_->GetMetaData(&meta));
+  EXPECT_EQ(dict, meta[kZstdDictKey]);
+}
+
 TEST_F(LogTest, MetaData) {
   SetupWriter(ListWriter::Options(), false);
   string kMetaVal1 = "data1";
@@ -584,6 +685,217 @@ TEST_F(LogTest, Append) {
   EXPECT_THAT(results, ElementsAre("Foo", "Bar", "Roman", "R1"));
 }
 
+TEST_F(LogTest, Range) {
+  vector<string> expected;
+  for (int i = 0; i < 2000; i++) {
+    expected.push_back(RandomSkewedString(i));
+    Write(expected.back());
+  }
+  FlushWriter();
+  source_.set_contents(dest_->contents());
+
+  const size_t file_size = dest_->contents().size();
+  for (size_t range_size : {size_t(block_size_ / 3), size_t(block_size_), size_t(block_size_ * 3)}) {
+    vector<string> results;
+    for (size_t offset = 0; offset < file_size; offset += range_size) {
+      ListReader reader(&source_, DO_NOT_TAKE_OWNERSHIP, true, reporter_func());
+      reader.SetRange(offset, range_size);
+
+      string scratch;
+      StringPiece record;
+      while (reader.ReadRecord(&record, &scratch)) {
+        results.push_back(AsString(record));
+      }
+    }
+    EXPECT_EQ(expected, results) << range_size;
+  }
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, MappedFile) {
+  SetupWriter(ListWriter::Options{});
+  vector<string> expected;
+  for (int i = 0; i < 1000; i++) {
+    expected.push_back(RandomSkewedString(i));
+    Write(expected.back());
+  }
+  FlushWriter();
+
+  string file_path = base::GetTestTempPath("mapped.lst");
+  file_util::WriteStringToFileOrDie(dest_->contents(), file_path);
+
+  ReadonlyFile::Options opts;
+  opts.use_mmap = true;
+  auto res = ReadonlyFile::Open(file_path, opts);
+  ASSERT_TRUE(res.ok()) << res.status;
+  const uint8* mapped = res.obj->mapped_data();
+  ASSERT_TRUE(mapped != nullptr);
+
+  ListReader reader(res.obj, TAKE_OWNERSHIP, true, reporter_func());
+  vector<string> results;
+  string scratch;
+  StringPiece record;
+  bool zero_copy = false;
+  while (reader.ReadRecord(&record, &scratch)) {
+    const uint8* ptr = reinterpret_cast<const uint8*>(record.data());
+    zero_copy |= (ptr >= mapped && ptr < mapped + dest_->contents().size());
+    results.push_back(AsString(record));
+  }
+  EXPECT_EQ(expected, results);
+  EXPECT_TRUE(zero_copy);
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, ReadAhead) {
+  ListWriter::Options options;
+  options.use_compression = true;
+  options.compress_method = kCompressionZlib;
+  SetupWriter(options);
+
+  vector<string> expected;
+  for (int i = 0; i < 3000; i++) {
+    expected.push_back(RandomSkewedString(i));
+    Write(expected.back());
+  }
+  FlushWriter();
+  source_.set_contents(dest_->contents());
+  EXPECT_GT(writer_->compression_savings(), 0);
+
+  std::atomic_uint tasks{0};
+  auto executor = [&](unsigned count, std::function<void(unsigned)> fn) {
+    vector<std::thread> threads;
+    for (unsigned i = 0; i < count; ++i) {
+      threads.emplace_back(fn, i);
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    tasks += count;
+  };
+
+  const size_t file_size = dest_->contents().size();
+  for (size_t range_size : {size_t(block_size_ * 3), file_size}) {
+    vector<string> results;
+    for (size_t offset = 0; offset < file_size; offset += range_size) {
+      ListReader reader(&source_, DO_NOT_TAKE_OWNERSHIP, true, reporter_func());
+      reader.SetRange(offset, range_size);
+      reader.SetReadAhead(4, executor);
+
+      string scratch;
+      StringPiece record;
+      while (reader.ReadRecord(&record, &scratch)) {
+        results.push_back(AsString(record));
+      }
+    }
+    EXPECT_EQ(expected, results) << range_size;
+  }
+  EXPECT_GT(tasks, 0);
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, BlockIndex) {
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.write_index = true;
+  SetupWriter(options);
+
+  vector<string> expected;
+  for (int i = 0; i < 2000; i++) {
+    expected.push_back(RandomSkewedString(i));
+    ASSERT_TRUE(writer_->AddRecord(expected.back(), std::to_string(10000 + i)).ok());
+  }
+  ASSERT_EQ(2000, writer_->records_added());
+
+  // Sequential reads stop at the index.
+  for (const string& rec : expected) {
+    ASSERT_EQ(rec, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(0, DroppedBytes());
+
+  const BlockIndex* index = reader_->block_index();
+  ASSERT_TRUE(index != nullptr);
+  EXPECT_EQ(2000, index->num_records);
+  EXPECT_GT(index->entries.size(), 10);
+
+  for (uint64 i : {0, 1, 13, 500, 1234, 1999}) {
+    ASSERT_TRUE(reader_->Seek(i));
+    EXPECT_EQ(expected[i], Read()) << i;
+  }
+  EXPECT_FALSE(reader_->Seek(2000));
+
+  ASSERT_TRUE(reader_->SeekKey("10777"));
+  string record;
+  do {
+    record = Read();
+  } while (record != "EOF" && record != expected[777]);
+  EXPECT_EQ(expected[777], record);
+  EXPECT_EQ(0, DroppedBytes());
+
+  // Lists without the index can not seek.
+  util::StringSink* sink = new util::StringSink;
+  ListWriter plain_writer(sink);
+  ASSERT_TRUE(plain_writer.Init().ok());
+  ASSERT_TRUE(plain_writer.AddRecord("foo", "key").ok());
+  ASSERT_TRUE(plain_writer.Flush().ok());
+
+  ReadonlyStringFile plain_source;
+  plain_source.set_contents(sink->contents());
+  ListReader plain(&plain_source, DO_NOT_TAKE_OWNERSHIP);
+  EXPECT_TRUE(plain.block_index() == nullptr);
+  EXPECT_FALSE(plain.Seek(0));
+}
+
+TEST_F(LogTest, KeyFilter) {
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.write_index = true;
+  options.key_filter_bits = 10;
+  SetupWriter(options);
+
+  // Keys are not sorted.
+  vector<string> expected;
+  for (int i = 0; i < 5000; i++) {
+    expected.push_back(RandomSkewedString(i));
+    ASSERT_TRUE(writer_->AddRecord(expected.back(), std::to_string(i * 7919 % 5000)).ok());
+  }
+  for (const string& rec : expected) {
+    ASSERT_EQ(rec, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(0, DroppedBytes());
+
+  const BlockIndex* index = reader_->block_index();
+  ASSERT_TRUE(index != nullptr);
+  EXPECT_FALSE(index->key_filter.empty());
+
+  for (int i = 0; i < 5000; i++) {
+    ASSERT_TRUE(reader_->MayContainKey(std::to_string(i))) << i;
+  }
+
+  unsigned false_positives = 0;
+  for (int i = 5000; i < 15000; i++) {
+    false_positives += reader_->MayContainKey(std::to_string(i));
+  }
+  EXPECT_LT(false_positives, 300);
+
+  // Lists without the filter may contain any key.
+  util::StringSink* sink = new util::StringSink;
+  ListWriter::Options index_options;
+  index_options.write_index = true;
+  ListWriter plain_writer(sink, index_options);
+  ASSERT_TRUE(plain_writer.Init().ok());
+  ASSERT_TRUE(plain_writer.AddRecord("foo", "key").ok());
+  ASSERT_TRUE(plain_writer.Flush().ok());
+
+  ReadonlyStringFile plain_source;
+  plain_source.set_contents(sink->contents());
+  ListReader plain(&plain_source, DO_NOT_TAKE_OWNERSHIP);
+  ASSERT_TRUE(plain.block_index() != nullptr);
+  EXPECT_TRUE(plain.block_index()->key_filter.empty());
+  EXPECT_TRUE(plain.MayContainKey("bar"));
+}
+
 /*TEST_F(LogTest, ReadStart) {
   CheckInitialOffsetRecord(0, 0);
 }
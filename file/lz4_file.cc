@@ -3,18 +3,32 @@
 //
 #include "file/lz4_file.h"
 
+#include "base/endian.h"
 #include "base/logging.h"
 #include <lz4frame.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 using util::Status;
 using util::StatusCode;
 
-constexpr size_t kInputBatchSize = 1 << 16;
-
 namespace file {
 
-LZ4File::LZ4File(StringPiece file_name, unsigned level) : WriteFile(file_name), level_(level) {
+namespace {
+
+// The index is a skippable frame of the lz4 frame format:
+//   uint32 kIndexFrameMagic, uint32 frame size, uint64 offsets[n], uint32 n, uint32 kIndexTag.
+// It ends with n and the tag, so the readers find it from the end of the file.
+constexpr uint32 kIndexFrameMagic = 0x184D2A5A;
+constexpr uint32 kIndexTag = 0x5849344C;  // "L4IX"
+
+}  // namespace
+
+LZ4File::LZ4File(StringPiece file_name, const Options& opts)
+    : WriteFile(file_name), opts_(opts) {
+  CHECK(opts.block_log >= 16 && opts.block_log <= 22 && opts.block_log % 2 == 0)
+      << opts.block_log;
+  CHECK(!opts.block_index || opts.independent_blocks);
 }
 
 LZ4File::~LZ4File() {
@@ -37,42 +51,67 @@ bool LZ4File::Open() {
   /* Init */
   memset(&prefs, 0, sizeof(prefs));
 
+  // Every block is flushed since CompressBlock() passes the whole blocks.
   prefs.autoFlush = 1;
-  prefs.compressionLevel = level_;
-  prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+  prefs.compressionLevel = opts_.level;
+  prefs.frameInfo.blockSizeID = LZ4F_blockSizeID_t(LZ4F_max64KB + (opts_.block_log - 16) / 2);
+  prefs.frameInfo.blockMode = opts_.independent_blocks ? LZ4F_blockIndependent : LZ4F_blockLinked;
   char dst_buf[32];
 
   size_t header_size = LZ4F_compressBegin(context_, dst_buf, sizeof(dst_buf), &prefs);
   CHECK(!LZ4F_isError(header_size)) << LZ4F_getErrorName(header_size);
 
-  ssize_t sz = write(fd_, dst_buf, header_size);
-  if (sz < 0) {
-    LOG(ERROR) << "Could not open file " << strerror(errno);
+  Status st = WriteOut(reinterpret_cast<uint8*>(dst_buf), header_size);
+  if (!st.ok()) {
+    LOG(ERROR) << "Could not open file " << st;
     LZ4F_freeCompressionContext(context_);
     close(fd_);
     fd_ = 0;
     return false;
   }
 
-  CHECK_EQ(header_size, sz);
-  buf_size_ = LZ4F_compressBound(kInputBatchSize, &prefs);
-
+  const size_t block_size = size_t(1) << opts_.block_log;
+  buf_size_ = LZ4F_compressBound(block_size, &prefs);
   buf_ = new uint8[buf_size_];
+  input_.reset(new uint8[block_size]);
   return true;
 }
 
 bool LZ4File::Close() {
   if (fd_ == 0) return true;
 
+  Status st = CompressBlock();
+  if (!st.ok()) {
+    LOG(ERROR) << "Error closing file " << st;
+    return false;
+  }
+
   size_t header_size = LZ4F_compressEnd(context_, buf_, buf_size_, NULL);
   if (LZ4F_isError(header_size)) {
     LOG(ERROR) << "Error closing file " << LZ4F_getErrorName(header_size);
     return false;
   }
+  st = WriteOut(buf_, header_size);
+
+  if (st.ok() && opts_.block_index) {
+    const uint32 n = block_offsets_.size();
+    std::string index(16 + n * 8, '\0');
+    uint8* next = reinterpret_cast<uint8*>(&index[0]);
+
+    LittleEndian::Store32(next, kIndexFrameMagic);
+    LittleEndian::Store32(next + 4, index.size() - 8);
+    next += 8;
+    for (uint64 offset : block_offsets_) {
+      LittleEndian::Store64(next, offset);
+      next += 8;
+    }
+    LittleEndian::Store32(next, n);
+    LittleEndian::Store32(next + 4, kIndexTag);
+    st = WriteOut(reinterpret_cast<const uint8*>(index.data()), index.size());
+  }
 
-  ssize_t sz = write(fd_, buf_, header_size);
-  if (sz < 0) {
-    LOG(ERROR) << "Error closing file " << strerror(errno);
+  if (!st.ok()) {
+    LOG(ERROR) << "Error closing file " << st;
     return false;
   }
   close(fd_);
@@ -84,23 +123,79 @@ bool LZ4File::Close() {
 }
 
 Status LZ4File::Write(const uint8* buffer, uint64 length) {
-  do {
-    size_t bl = std::min(length, kInputBatchSize);
-    size_t written = LZ4F_compressUpdate(context_, buf_, buf_size_, buffer, bl, NULL);
-    if (LZ4F_isError(written)) {
-      return Status(LZ4F_getErrorName(written));
-    }
+  const size_t block_size = size_t(1) << opts_.block_log;
+  while (length) {
+    size_t bl = std::min<uint64>(length, block_size - input_size_);
+    memcpy(input_.get() + input_size_, buffer, bl);
+    input_size_ += bl;
     buffer += bl;
     length -= bl;
-    if (written) {
-      ssize_t sz = write(fd_, buf_, written);
-      if (sz < 0) {
-        return StatusFileError();
-      }
+
+    if (input_size_ == block_size) {
+      RETURN_IF_ERROR(CompressBlock());
     }
+  }
+  return Status::OK;
+}
+
+Status LZ4File::CompressBlock() {
+  if (input_size_ == 0)
+    return Status::OK;
+
+  size_t written = LZ4F_compressUpdate(context_, buf_, buf_size_, input_.get(), input_size_, NULL);
+  if (LZ4F_isError(written)) {
+    return Status(LZ4F_getErrorName(written));
+  }
+  input_size_ = 0;
+
+  // With autoFlush a single block is emitted for the input of at most the block size.
+  block_offsets_.push_back(file_size_);
+  return WriteOut(buf_, written);
+}
 
-  } while (length);
+Status LZ4File::WriteOut(const uint8* buffer, size_t length) {
+  file_size_ += length;
+  while (length) {
+    ssize_t sz = write(fd_, buffer, length);
+    if (sz < 0) {
+      return StatusFileError();
+    }
+    buffer += sz;
+    length -= sz;
+  }
   return Status::OK;
 }
 
+bool ReadLZ4BlockIndex(ReadonlyFile* file, std::vector<uint64>* offsets) {
+  const size_t file_size = file->Size();
+  uint8 footer[8];
+  if (file_size < 16)
+    return false;
+
+  auto res = file->Read(file_size - 8, strings::MutableByteRange(footer, 8));
+  if (!res.ok() || res.obj != 8 || LittleEndian::Load32(footer + 4) != kIndexTag)
+    return false;
+
+  const uint64 n = LittleEndian::Load32(footer);
+  const uint64 index_size = 16 + n * 8;
+  if (file_size < index_size)
+    return false;
+
+  std::unique_ptr<uint8[]> index(new uint8[index_size]);
+  res = file->Read(file_size - index_size, strings::MutableByteRange(index.get(), index_size));
+  if (!res.ok() || res.obj != index_size || LittleEndian::Load32(index.get()) != kIndexFrameMagic ||
+      LittleEndian::Load32(index.get() + 4) != index_size - 8) {
+    return false;
+  }
+
+  offsets->resize(n);
+  for (uint64 i = 0; i < n; ++i) {
+    uint64 offset = LittleEndian::Load64(index.get() + 8 + i * 8);
+    if (offset >= file_size - index_size || (i > 0 && offset <= (*offsets)[i - 1]))
+      return false;
+    (*offsets)[i] = offset;
+  }
+  return true;
+}
+
 }  // namespace file
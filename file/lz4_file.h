@@ -3,33 +3,74 @@
 //
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "file/file.h"
 
 struct LZ4F_cctx_s;
 
 namespace file {
 
+class ReadonlyFile;
+
 // Creates a lz4-compressed file for writing.
 class LZ4File : public WriteFile {
-  LZ4F_cctx_s* context_ = nullptr;
-  uint8* buf_ = nullptr;
-  size_t buf_size_ = 0;
+ public:
+  struct Options {
+    unsigned level = 2;
 
-  uint8 level_ = 0;
-  int fd_ = 0;
+    // Each block is compressed without referring to the previous ones, so LZ4BlockSource
+    // decompresses them in parallel. Costs some compression ratio for the small blocks.
+    bool independent_blocks = false;
+
+    // Appends the offsets of the blocks as a skippable frame, see ReadLZ4BlockIndex.
+    // Requires independent_blocks.
+    bool block_index = false;
+
+    // log2 of the block size, one of 16 (64KB), 18, 20 or 22 (4MB).
+    unsigned block_log = 16;
+  };
 
-  LZ4File(StringPiece file_name, unsigned level);
-  ~LZ4File();
-public:
   static LZ4File* Create(StringPiece file_name, unsigned level = 2) {
-    return new LZ4File(file_name, level);
+    Options opts;
+    opts.level = level;
+    return new LZ4File(file_name, opts);
+  }
+
+  static LZ4File* Create(StringPiece file_name, const Options& opts) {
+    return new LZ4File(file_name, opts);
   }
 
   bool Open() override;
   bool Close() override;
 
   util::Status Write(const uint8* buffer, uint64 length) override;
+
+ private:
+  LZ4File(StringPiece file_name, const Options& opts);
+  ~LZ4File();
+
+  // Compresses the pending input into a single block.
+  util::Status CompressBlock();
+  util::Status WriteOut(const uint8* buffer, size_t length);
+
+  LZ4F_cctx_s* context_ = nullptr;
+  uint8* buf_ = nullptr;
+  size_t buf_size_ = 0;
+
+  Options opts_;
+  int fd_ = 0;
+
+  std::unique_ptr<uint8[]> input_;
+  size_t input_size_ = 0;
+  uint64 file_size_ = 0;
+  std::vector<uint64> block_offsets_;
 };
 
+// Reads the block index that LZ4File appends with Options::block_index. offsets are set to
+// the file offsets of the blocks of the frame, which start with the 4 byte block size.
+// Returns false if the file has no index.
+bool ReadLZ4BlockIndex(ReadonlyFile* file, std::vector<uint64>* offsets);
 
 }  // namespace file
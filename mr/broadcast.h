@@ -0,0 +1,51 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+
+namespace mr3 {
+
+namespace detail {
+
+class BroadcastBase {
+ public:
+  virtual ~BroadcastBase() {}
+};
+
+}  // namespace detail
+
+/** Immutable in-memory table of records keyed by string, loaded once per process by
+ *  Pipeline::Broadcast and shared by all the IO threads. See DoContext::Broadcast.
+ */
+template <typename T> class BroadcastTable : public detail::BroadcastBase {
+ public:
+  //! Returns null if there is no record with this key.
+  const T* Find(absl::string_view key) const {
+    auto it = map_.find(key);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+
+  size_t size() const { return map_.size(); }
+
+  //! Used while loading the table. Keeps the first record of each key and returns the number
+  //! of the dropped duplicates.
+  size_t Insert(std::vector<std::pair<std::string, T>>* items) {
+    size_t dups = 0;
+    for (auto& key_val : *items) {
+      dups += !map_.emplace(std::move(key_val.first), std::move(key_val.second)).second;
+    }
+    items->clear();
+    return dups;
+  }
+
+ private:
+  absl::flat_hash_map<std::string, T> map_;
+};
+
+}  // namespace mr3
@@ -0,0 +1,185 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "mr/do_context.h"
+#include "strings/delimited_tokenizer.h"
+#include "strings/numbers.h"
+
+namespace mr3 {
+
+namespace detail {
+
+inline bool ParseDelimitedField(absl::string_view f, int32_t* res) { return ParseDecimal(f, res); }
+inline bool ParseDelimitedField(absl::string_view f, uint32_t* res) { return ParseDecimal(f, res); }
+inline bool ParseDelimitedField(absl::string_view f, int64_t* res) { return ParseDecimal(f, res); }
+inline bool ParseDelimitedField(absl::string_view f, uint64_t* res) { return ParseDecimal(f, res); }
+inline bool ParseDelimitedField(absl::string_view f, double* res) { return ParseDouble(f, res); }
+
+inline bool ParseDelimitedField(absl::string_view f, float* res) {
+  double d;
+  if (!ParseDouble(f, &d))
+    return false;
+  *res = d;
+  return true;
+}
+
+inline bool ParseDelimitedField(absl::string_view f, bool* res) {
+  if (f == "1" || f == "true") {
+    *res = true;
+  } else if (f == "0" || f == "false") {
+    *res = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline bool ParseDelimitedField(absl::string_view f, absl::string_view* res) {
+  *res = f;
+  return true;
+}
+
+inline bool ParseDelimitedField(absl::string_view f, std::string* res) {
+  res->assign(f.data(), f.size());
+  return true;
+}
+
+//! An empty field is nullopt.
+template <typename U> bool ParseDelimitedField(absl::string_view f, absl::optional<U>* res) {
+  if (f.empty()) {
+    res->reset();
+    return true;
+  }
+  return ParseDelimitedField(f, &res->emplace());
+}
+
+//! Quotes f if it has the special characters.
+inline void AppendQuotedField(absl::string_view f, char delim, char quote, std::string* dest) {
+  const char special[] = {delim, quote, '\n', '\r'};
+  if (!quote || f.find_first_of(absl::string_view(special, 4)) == absl::string_view::npos) {
+    dest->append(f.data(), f.size());
+    return;
+  }
+
+  dest->push_back(quote);
+  for (char c : f) {
+    dest->push_back(c);
+    if (c == quote)
+      dest->push_back(quote);
+  }
+  dest->push_back(quote);
+}
+
+inline void AppendDelimitedField(absl::string_view f, char delim, char quote, std::string* dest) {
+  AppendQuotedField(f, delim, quote, dest);
+}
+
+inline void AppendDelimitedField(const std::string& f, char delim, char quote, std::string* dest) {
+  AppendQuotedField(f, delim, quote, dest);
+}
+
+inline void AppendDelimitedField(bool f, char, char, std::string* dest) {
+  dest->push_back(f ? '1' : '0');
+}
+
+template <typename U>
+void AppendDelimitedField(const U& f, char, char, std::string* dest) {
+  absl::StrAppend(dest, f);
+}
+
+template <typename U>
+void AppendDelimitedField(const absl::optional<U>& f, char delim, char quote, std::string* dest) {
+  if (f)
+    AppendDelimitedField(*f, delim, quote, dest);
+}
+
+}  // namespace detail
+
+/*! Traits of the records of delimited text, e.g. CSV or TSV lines, whose columns are parsed
+ *  into the members of T. Members lists the pointers to the members of T in the column order,
+ *  nullptr skips a column. The columns after the last member are ignored.
+ *
+ *  Supported member types are the integers, float, double, bool (1/0/true/false),
+ *  absl::string_view, std::string and absl::optional of those, which is empty for the empty
+ *  fields. Quoted fields are unquoted unless Delim is '\t'.
+ *
+ *  The records are split with strings::DelimitedTokenizer and the numbers are parsed with
+ *  ParseDecimal/ParseDouble, so parsing does not allocate except for the std::string members.
+ *  string_view members point into the record or into the buffers of the traits and are valid
+ *  only until the following Parse call. The header lines are skipped with
+ *  PInput::set_skip_header.
+ *
+ *  Usage:
+ *    struct Movie {
+ *      int64_t id;
+ *      absl::string_view title;
+ *      bool is_adult;
+ *    };
+ *
+ *    template <> class RecordTraits<Movie>
+ *        : public DelimitedTraits<Movie, ',', &Movie::id, nullptr, &Movie::title,
+ *                                 &Movie::is_adult> {};
+ *
+ *    PTable<Movie> movies = pipeline->ReadText("movies", glob).set_skip_header(1).As<Movie>();
+ */
+template <typename T, char Delim, auto... Members> class DelimitedTraits {
+  static_assert(sizeof...(Members) > 0, "Please specify the columns");
+  static constexpr char kQuote = Delim == '\t' ? '\0' : '"';
+
+ public:
+  DelimitedTraits() : tokenizer_(Delim, kQuote) {}
+  DelimitedTraits(const DelimitedTraits&) : DelimitedTraits() {}  // temporaries are not copied.
+
+  bool Parse(bool is_binary, absl::string_view rv, T* res) {
+    tokenizer_.SplitRecord(rv, &fields_, &scratch_);
+    if (fields_.size() < sizeof...(Members))
+      return false;
+    return ParseColumns(res, std::make_index_sequence<sizeof...(Members)>{});
+  }
+
+  bool Parse(bool is_binary, std::string&& tmp, T* res) {
+    tmp_ = std::move(tmp);
+    return Parse(is_binary, absl::string_view(tmp_), res);
+  }
+
+  //! The skipped columns are written empty.
+  std::string Serialize(bool is_binary, const T& t) {
+    std::string res;
+    unsigned col = 0;
+    (((col++ ? res.push_back(Delim) : void()), SerializeColumn(t, Members, &res)), ...);
+    return res;
+  }
+
+ private:
+  template <size_t... I> bool ParseColumns(T* res, std::index_sequence<I...>) {
+    return (ParseColumn(fields_[I], Members, res) && ...);
+  }
+
+  static bool ParseColumn(absl::string_view, std::nullptr_t, T*) { return true; }
+
+  template <typename M> static bool ParseColumn(absl::string_view f, M T::*member, T* res) {
+    return detail::ParseDelimitedField(f, &(res->*member));
+  }
+
+  static void SerializeColumn(const T&, std::nullptr_t, std::string*) {}
+
+  template <typename M> static void SerializeColumn(const T& t, M T::*member, std::string* dest) {
+    detail::AppendDelimitedField(t.*member, Delim, kQuote, dest);
+  }
+
+  strings::DelimitedTokenizer tokenizer_;
+  std::vector<absl::string_view> fields_;
+  std::string scratch_, tmp_;
+};
+
+}  // namespace mr3
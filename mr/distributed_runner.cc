@@ -0,0 +1,347 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/distributed_runner.h"
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <boost/fiber/operations.hpp>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/numbers.h"
+#include "base/logging.h"
+
+#include "mr/local_runner.h"
+
+#include "util/asio/accept_server.h"
+#include "util/asio/io_context_pool.h"
+#include "util/rpc/channel.h"
+#include "util/rpc/rpc_connection.h"
+
+namespace mr3 {
+
+DEFINE_uint32(mr_coordinator_connect_ms, 30000,
+              "How long workers wait for the coordinator to come up");
+DEFINE_uint32(mr_coordinator_deadline_ms, 10000, "Deadline for coordinator calls");
+DEFINE_uint32(mr_barrier_poll_ms, 200,
+              "How often workers that finished an operator check whether the others finished");
+DECLARE_uint32(local_runner_memory_shuffle_mb);
+
+using namespace util;
+using namespace boost;
+using namespace std;
+
+namespace {
+
+using Shard = pb::OperatorCheckpoint::Shard;
+
+void ToPb(const ShardId& sid, const string& glob, Shard* dest) {
+  if (absl::holds_alternative<uint32_t>(sid)) {
+    dest->set_shard_id(absl::get<uint32_t>(sid));
+  } else {
+    dest->set_custom_shard_id(absl::get<string>(sid));
+  }
+  dest->set_url_glob(glob);
+}
+
+ShardId FromPb(const Shard& shard) {
+  if (shard.has_shard_id())
+    return ShardId{shard.shard_id()};
+  return ShardId{shard.custom_shard_id()};
+}
+
+template <typename Msg> void ToLetter(const Msg& msg, rpc::Envelope* env) {
+  env->letter.resize(msg.ByteSizeLong());
+  CHECK(msg.SerializeToArray(env->letter.data(), env->letter.size()));
+}
+
+template <typename Msg> bool FromLetter(const rpc::Envelope& env, Msg* msg) {
+  return msg->ParseFromArray(env.letter.data(), env.letter.size());
+}
+
+constexpr char kErrorHeader[] = "error";
+
+}  // namespace
+
+namespace detail {
+
+// Hands out the tasks of each operator and serves as a barrier at its end.
+class Coordinator : public rpc::ServiceInterface {
+ public:
+  explicit Coordinator(uint32_t num_workers) : num_workers_(num_workers) {}
+
+  // Called from connection fibers.
+  pb::CoordinatorResponse Handle(const pb::CoordinatorRequest& req);
+
+  // Blocks until all the workers report they are done.
+  void WaitDone();
+
+ protected:
+  rpc::ConnectionBridge* CreateConnectionBridge() final;
+
+ private:
+  struct OperatorState {
+    bool has_tasks = false;
+    uint64_t num_tasks = 0;
+    uint64_t next_task = 0;
+
+    absl::flat_hash_set<uint32_t> ended;
+    ShardFileMap shards;
+  };
+
+  const uint32_t num_workers_;
+
+  fibers::mutex mu_;
+  fibers::condition_variable done_cv_;
+  absl::flat_hash_map<uint32_t, OperatorState> ops_;  // by op_seq.
+  absl::flat_hash_set<uint32_t> done_;
+};
+
+namespace {
+
+class CoordinatorBridge final : public rpc::ConnectionBridge {
+ public:
+  explicit CoordinatorBridge(Coordinator* owner) : owner_(owner) {}
+
+  void HandleEnvelope(uint64_t rpc_id, rpc::Envelope* input, EnvelopeWriter writer) final {
+    pb::CoordinatorRequest req;
+    rpc::Envelope env;
+
+    if (FromLetter(*input, &req)) {
+      ToLetter(owner_->Handle(req), &env);
+    } else {
+      LOG(ERROR) << "Could not parse coordinator request " << rpc_id;
+      env.header.resize(sizeof(kErrorHeader) - 1);
+      std::copy(kErrorHeader, kErrorHeader + env.header.size(), env.header.begin());
+    }
+    writer(std::move(env));
+  }
+
+ private:
+  Coordinator* owner_;
+};
+
+}  // namespace
+
+rpc::ConnectionBridge* Coordinator::CreateConnectionBridge() {
+  return new CoordinatorBridge(this);
+}
+
+pb::CoordinatorResponse Coordinator::Handle(const pb::CoordinatorRequest& req) {
+  CHECK_LT(req.worker_index(), num_workers_);
+
+  pb::CoordinatorResponse resp;
+  std::lock_guard<fibers::mutex> lk(mu_);
+
+  switch (req.type()) {
+    case pb::CoordinatorRequest::NEXT_TASK: {
+      OperatorState& st = ops_[req.op_seq()];
+      if (!st.has_tasks) {
+        st.has_tasks = true;
+        st.num_tasks = req.num_tasks();
+      }
+      CHECK_EQ(st.num_tasks, req.num_tasks())
+          << "Workers disagree on the tasks of " << req.op_name();
+
+      if (st.next_task < st.num_tasks) {
+        resp.set_task(st.next_task++);
+      }
+      break;
+    }
+    case pb::CoordinatorRequest::OPERATOR_END: {
+      OperatorState& st = ops_[req.op_seq()];
+      if (st.ended.insert(req.worker_index()).second) {
+        VLOG(1) << "Worker " << req.worker_index() << " finished " << req.op_name();
+        for (const auto& shard : req.shard()) {
+          st.shards.emplace(FromPb(shard), shard.url_glob());
+        }
+      }
+
+      if (st.ended.size() == num_workers_) {
+        resp.set_ready(true);
+        for (const auto& k_v : st.shards) {
+          ToPb(k_v.first, k_v.second, resp.add_shard());
+        }
+      }
+      break;
+    }
+    case pb::CoordinatorRequest::DONE:
+      done_.insert(req.worker_index());
+      done_cv_.notify_all();
+      break;
+  }
+
+  return resp;
+}
+
+void Coordinator::WaitDone() {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  done_cv_.wait(lk, [this] { return done_.size() == num_workers_; });
+}
+
+}  // namespace detail
+
+DistributedRunner::DistributedRunner(IoContextPool* pool, const std::string& data_dir,
+                                     const Options& opts)
+    : pool_(pool), opts_(opts), local_(new LocalRunner(pool, data_dir)) {
+  CHECK_LT(opts_.worker_index, opts_.num_workers);
+  local_->set_worker_index(opts_.worker_index);
+}
+
+DistributedRunner::~DistributedRunner() {}
+
+void DistributedRunner::Init() {
+  local_->Init();
+  if (channel_)
+    return;
+
+  // Other workers can not read the shards kept in memory.
+  CHECK_EQ(0, FLAGS_local_runner_memory_shuffle_mb)
+      << "In-memory shuffle is not supported by DistributedRunner";
+
+  size_t pos = opts_.coordinator.rfind(':');
+  CHECK(pos != string::npos) << "Bad coordinator address " << opts_.coordinator;
+  string host = opts_.coordinator.substr(0, pos);
+  uint32_t port = 0;
+  CHECK(absl::SimpleAtoi(opts_.coordinator.substr(pos + 1), &port) && port <= kuint16max)
+      << "Bad coordinator address " << opts_.coordinator;
+
+  if (opts_.worker_index == 0) {
+    coordinator_.reset(new detail::Coordinator(opts_.num_workers));
+    server_.reset(new AcceptServer(pool_));
+    port = server_->AddListener(port, coordinator_.get());
+    server_->Run();
+    coordinator_port_ = port;
+  }
+
+  channel_.reset(new rpc::Channel(host, std::to_string(port), &pool_->GetNextContext()));
+  auto ec = channel_->Connect(FLAGS_mr_coordinator_connect_ms);
+  CHECK(!ec) << "Could not connect to coordinator " << host << ":" << port << ", "
+             << ec.message();
+  LOG(INFO) << "Worker " << opts_.worker_index << " out of " << opts_.num_workers
+            << " connected to coordinator " << host << ":" << port;
+}
+
+void DistributedRunner::Shutdown() {
+  local_->Shutdown();
+  if (!channel_)
+    return;
+
+  Call(NewRequest(pb::CoordinatorRequest::DONE));
+  channel_.reset();
+
+  // The coordinator must stay up until everyone has passed the last barrier.
+  if (coordinator_) {
+    coordinator_->WaitDone();
+    server_->Stop(true);
+    server_.reset();
+    coordinator_.reset();
+  }
+}
+
+void DistributedRunner::OperatorStart(const pb::Operator* op) {
+  current_op_ = op;
+  ++op_seq_;
+  local_->OperatorStart(op);
+}
+
+RawContext* DistributedRunner::CreateContext() { return local_->CreateContext(); }
+
+void DistributedRunner::OperatorEnd(ShardFileMap* out_files) {
+  ShardFileMap local_files;
+  local_->OperatorEnd(&local_files);
+
+  pb::CoordinatorRequest req = NewRequest(pb::CoordinatorRequest::OPERATOR_END);
+  for (const auto& k_v : local_files) {
+    ToPb(k_v.first, k_v.second, req.add_shard());
+  }
+
+  pb::CoordinatorResponse resp = Call(req);
+  while (!resp.ready()) {
+    this_fiber::sleep_for(chrono::milliseconds(FLAGS_mr_barrier_poll_ms));
+    resp = Call(req);
+  }
+
+  for (const auto& shard : resp.shard()) {
+    out_files->emplace(FromPb(shard), shard.url_glob());
+  }
+  current_op_ = nullptr;
+}
+
+bool DistributedRunner::NextTask(size_t num_tasks, size_t claimed, size_t* task) {
+  if (num_tasks == 0)
+    return false;
+
+  pb::CoordinatorRequest req = NewRequest(pb::CoordinatorRequest::NEXT_TASK);
+  req.set_num_tasks(num_tasks);
+
+  pb::CoordinatorResponse resp = Call(req);
+  if (!resp.has_task())
+    return false;
+
+  *task = resp.task();
+  return true;
+}
+
+void DistributedRunner::ExpandGlob(const std::string& glob, ExpandCb cb) {
+  local_->ExpandGlob(glob, std::move(cb));
+}
+
+size_t DistributedRunner::ProcessInputFile(const std::string& filename,
+                                           const pb::WireFormat& wf, RawSinkCb cb) {
+  return local_->ProcessInputFile(filename, wf, std::move(cb));
+}
+
+bool DistributedRunner::IsSplittable(const std::string& filename, const pb::WireFormat& wf) {
+  return local_->IsSplittable(filename, wf);
+}
+
+size_t DistributedRunner::ProcessInputRange(const std::string& filename,
+                                            const pb::WireFormat& wf, size_t offset,
+                                            size_t length, RawSinkCb cb) {
+  return local_->ProcessInputRange(filename, wf, offset, length, std::move(cb));
+}
+
+size_t DistributedRunner::ProcessInputBatches(const std::string& filename,
+                                              const pb::WireFormat& wf, size_t offset,
+                                              size_t length, RawBatchSinkCb cb) {
+  return local_->ProcessInputBatches(filename, wf, offset, length, std::move(cb));
+}
+
+Runner::ReadStats DistributedRunner::GetReadStats() { return local_->GetReadStats(); }
+
+std::vector<std::pair<ShardId, size_t>> DistributedRunner::GetOutputShardBytes() {
+  return local_->GetOutputShardBytes();
+}
+
+void DistributedRunner::Stop() { local_->Stop(); }
+
+pb::CoordinatorRequest DistributedRunner::NewRequest(pb::CoordinatorRequest::Type type) const {
+  pb::CoordinatorRequest req;
+  req.set_type(type);
+  req.set_worker_index(opts_.worker_index);
+  req.set_op_seq(op_seq_);
+  if (current_op_) {
+    req.set_op_name(current_op_->op_name());
+  }
+  return req;
+}
+
+pb::CoordinatorResponse DistributedRunner::Call(const pb::CoordinatorRequest& req) {
+  CHECK(channel_) << "DistributedRunner is not initialized";
+
+  rpc::Envelope env;
+  ToLetter(req, &env);
+
+  auto ec = channel_->SendSync(FLAGS_mr_coordinator_deadline_ms, &env);
+  CHECK(!ec) << "Coordinator call failed: " << ec.message();
+  CHECK(env.header.empty()) << "Coordinator could not handle " << req.ShortDebugString();
+
+  pb::CoordinatorResponse resp;
+  CHECK(FromLetter(env, &resp));
+
+  return resp;
+}
+
+}  // namespace mr3
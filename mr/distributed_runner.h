@@ -0,0 +1,104 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include "mr/runner.h"
+
+namespace util {
+class AcceptServer;
+class IoContextPool;
+
+namespace rpc {
+class Channel;
+}  // namespace rpc
+
+}  // namespace util
+
+namespace mr3 {
+
+class LocalRunner;
+
+namespace detail {
+class Coordinator;
+}  // namespace detail
+
+/*! \class mr3::DistributedRunner
+    \brief Runs the pipeline on several processes, possibly on different machines.
+
+    All the workers run the same binary with the same pipeline. The worker with index 0 also
+    hosts the coordinator, which hands out the input files of mappers and the shards of joiners
+    to the workers as they ask for more work. Each worker writes its own files of the output
+    shards and at the end of each operator the coordinator merges the shards of all workers.
+    Therefore data_dir must be shared by all the workers, i.e. reside on GCS or on a network
+    file system. Frequency maps stay local to the worker that computed them.
+*/
+class DistributedRunner : public Runner {
+ public:
+  struct Options {
+    uint32_t num_workers = 1;
+    uint32_t worker_index = 0;
+
+    // host:port of the coordinator. The worker with index 0 listens on that port,
+    // port 0 chooses any free port.
+    std::string coordinator;
+  };
+
+  DistributedRunner(util::IoContextPool* pool, const std::string& data_dir, const Options& opts);
+  ~DistributedRunner();
+
+  // Starts the coordinator and connects to it. Can be called more than once.
+  void Init() final;
+
+  // Blocks until all the workers finish the pipeline.
+  void Shutdown() final;
+
+  void OperatorStart(const pb::Operator* op) final;
+
+  RawContext* CreateContext() final;
+
+  // Blocks until all the workers finish the operator and returns the shards of all of them.
+  void OperatorEnd(ShardFileMap* out_files) final;
+
+  bool NextTask(size_t num_tasks, size_t claimed, size_t* task) final;
+
+  void ExpandGlob(const std::string& glob, ExpandCb cb) final;
+
+  size_t ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
+                          RawSinkCb cb) final;
+
+  bool IsSplittable(const std::string& filename, const pb::WireFormat& wf) final;
+
+  size_t ProcessInputRange(const std::string& filename, const pb::WireFormat& wf, size_t offset,
+                           size_t length, RawSinkCb cb) final;
+
+  size_t ProcessInputBatches(const std::string& filename, const pb::WireFormat& wf,
+                             size_t offset, size_t length, RawBatchSinkCb cb) final;
+
+  ReadStats GetReadStats() final;
+
+  std::vector<std::pair<ShardId, size_t>> GetOutputShardBytes() final;
+
+  void Stop();
+
+  // The port the coordinator listens on. Valid only for the worker 0 after Init().
+  unsigned short coordinator_port() const { return coordinator_port_; }
+
+ private:
+  pb::CoordinatorRequest NewRequest(pb::CoordinatorRequest::Type type) const;
+  pb::CoordinatorResponse Call(const pb::CoordinatorRequest& req);
+
+  util::IoContextPool* pool_;
+  Options opts_;
+  std::unique_ptr<LocalRunner> local_;
+
+  std::unique_ptr<detail::Coordinator> coordinator_;
+  std::unique_ptr<util::AcceptServer> server_;
+  unsigned short coordinator_port_ = 0;
+  std::unique_ptr<util::rpc::Channel> channel_;
+
+  const pb::Operator* current_op_ = nullptr;
+  uint32_t op_seq_ = 0;
+};
+
+}  // namespace mr3
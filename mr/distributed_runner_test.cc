@@ -0,0 +1,134 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#include "mr/distributed_runner.h"
+
+#include <thread>
+
+#include <gmock/gmock.h>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "file/file_util.h"
+#include "mr/pipeline.h"
+#include "util/asio/io_context_pool.h"
+
+namespace mr3 {
+
+using namespace util;
+using namespace std;
+
+using testing::UnorderedElementsAreArray;
+
+class CountJoiner {
+  absl::flat_hash_map<string, int> counts_;
+
+ public:
+  void On(string&& val, DoContext<string>* out) { counts_[val]++; }
+
+  void OnShardFinish(DoContext<string>* cntx) {
+    for (const auto& k_v : counts_) {
+      cntx->Write(absl::StrCat(k_v.first, ":", k_v.second));
+    }
+    counts_.clear();
+  }
+};
+
+class DistributedRunnerTest : public testing::Test {
+ protected:
+  static constexpr unsigned kNumWorkers = 2;
+
+  void SetUp() final {
+    data_dir_ = base::GetTestTempPath("dist");
+    for (auto& pool : pools_) {
+      pool.reset(new IoContextPool{1});
+      pool->Run();
+    }
+  }
+
+  void TearDown() final {
+    for (auto& pool : pools_) {
+      pool.reset();
+    }
+  }
+
+  // Every worker defines the same pipeline.
+  static void RunPipeline(IoContextPool* pool, const string& glob, Runner* runner) {
+    Pipeline pipeline(pool);
+    StringTable lines = pipeline.ReadText("read", glob);
+    lines.Write("sharded", pb::WireFormat::TXT).WithModNSharding(3, [](const string& s) {
+      uint32_t val = 0;
+      CHECK(absl::SimpleAtoi(s, &val)) << s;
+      return val;
+    });
+
+    PTable<string> res = pipeline.Join("count", {lines.BindWith(&CountJoiner::On)});
+    res.Write("counts", pb::WireFormat::TXT);
+    pipeline.Run(runner);
+  }
+
+  vector<string> ReadLines(const string& glob) {
+    vector<string> res;
+    for (const auto& st : file_util::StatFiles(glob)) {
+      string contents;
+      CHECK(file_util::ReadFileToString(st.name, &contents));
+      for (absl::string_view line : absl::StrSplit(contents, '\n', absl::SkipEmpty())) {
+        res.emplace_back(line);
+      }
+    }
+    return res;
+  }
+
+  string data_dir_;
+  std::unique_ptr<IoContextPool> pools_[kNumWorkers];
+};
+
+TEST_F(DistributedRunnerTest, Basic) {
+  string input_dir = file_util::JoinPath(data_dir_, "input");
+  ASSERT_TRUE(file_util::RecursivelyCreateDir(input_dir, 0750));
+
+  vector<string> expected;
+  for (unsigned i = 0; i < 6; ++i) {
+    string contents;
+    for (unsigned j = 0; j < 10; ++j) {
+      absl::StrAppend(&contents, i * 10 + j, "\n");
+      expected.push_back(absl::StrCat(i * 10 + j, ":1"));
+    }
+    file_util::WriteStringToFileOrDie(contents,
+                                      file_util::JoinPath(input_dir, absl::StrCat(i, ".txt")));
+  }
+
+  DistributedRunner::Options opts;
+  opts.num_workers = kNumWorkers;
+  opts.coordinator = "localhost:0";
+
+  std::unique_ptr<DistributedRunner> runners[kNumWorkers];
+  runners[0].reset(new DistributedRunner(pools_[0].get(), data_dir_, opts));
+  runners[0]->Init();
+
+  opts.coordinator = absl::StrCat("localhost:", runners[0]->coordinator_port());
+  for (unsigned i = 1; i < kNumWorkers; ++i) {
+    opts.worker_index = i;
+    runners[i].reset(new DistributedRunner(pools_[i].get(), data_dir_, opts));
+  }
+
+  string glob = file_util::JoinPath(input_dir, "*.txt");
+  vector<std::thread> workers;
+  for (unsigned i = 0; i < kNumWorkers; ++i) {
+    workers.emplace_back(&RunPipeline, pools_[i].get(), glob, runners[i].get());
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  // Each shard is processed exactly once and sees the files of all the workers.
+  EXPECT_EQ(60, ReadLines(file_util::JoinPath(data_dir_, "sharded/*.txt")).size());
+  EXPECT_THAT(ReadLines(file_util::JoinPath(data_dir_, "counts/*.txt")),
+              UnorderedElementsAreArray(expected));
+}
+
+}  // namespace mr3
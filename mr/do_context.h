@@ -3,13 +3,19 @@
 //
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include "absl/container/flat_hash_map.h"
+#include "base/cycle_clock.h"
 
+#include "mr/broadcast.h"
+#include "mr/impl/skew_plan.h"
 #include "mr/mr_types.h"
 #include "mr/output.h"
-#include "strings/unique_strings.h"
+#include "mr/pod_traits.h"
+#include "mr/sketches.h"
+#include "strings/string_flat_map.h"
 
 namespace mr3 {
 
@@ -18,6 +24,9 @@ class OperatorExecutor;
 
 namespace detail {
 template <typename Handler, typename ToType> class HandlerWrapper;
+template <typename T, typename Parser> class IdentityHandlerWrapper;
+template <typename FromType, typename ToType> class FusedHandlerWrapper;
+class ProfileSampler;
 
 void VerifyUnspecifiedSharding(const pb::Output& outp);
 
@@ -41,7 +50,29 @@ template <> struct RecordTraits<std::string> {
   }
 };
 
-template<typename T> using FrequencyMap = absl::flat_hash_map<T, size_t>;
+// Trivially copyable records and the tuples of them are serialized in their binary layout,
+// see mr/pod_traits.h.
+template <typename T>
+struct RecordTraits<T, std::enable_if_t<detail::IsPodRecord<T>::value>> : public PodTraits<T> {};
+
+template <typename T>
+struct RecordTraits<T, std::enable_if_t<detail::IsPodTuple<T>::value &&
+                                        !detail::IsPodRecord<T>::value>>
+    : public PodTupleTraits<T> {};
+
+//! Time spent by the operator code of a context. Parse, DoFn and write times are measured on
+//! a sample of the records and extrapolated. DoFn time does not include the writes.
+struct OperatorProfile {
+  uint64_t parse_ns = 0, do_fn_ns = 0, write_ns = 0;
+  uint64_t write_bytes = 0;
+
+  void Merge(const OperatorProfile& o) {
+    parse_ns += o.parse_ns;
+    do_fn_ns += o.do_fn_ns;
+    write_ns += o.write_ns;
+    write_bytes += o.write_bytes;
+  }
+};
 
 /** RawContext and its wrapper DoContext<T> provide bidirectional interface from user classes
  *  to the framework.
@@ -51,10 +82,14 @@ template<typename T> using FrequencyMap = absl::flat_hash_map<T, size_t>;
 class RawContext {
   template <typename T> friend class DoContext;
   friend class OperatorExecutor;
+  friend class detail::ProfileSampler;
  public:
   //! std/absl monostate is an empty class that gives variant optional semantics.
   using InputMetaData = absl::variant<absl::monostate, int64_t, std::string>;
   using FreqMapRegistry = absl::flat_hash_map<std::string, std::unique_ptr<FrequencyMap<uint32_t>>>;
+  using SketchRegistry = absl::flat_hash_map<std::string, std::unique_ptr<Sketch>>;
+  using BroadcastRegistry =
+      absl::flat_hash_map<std::string, std::unique_ptr<detail::BroadcastBase>>;
 
   RawContext();
 
@@ -68,13 +103,17 @@ class RawContext {
   //! MR metrics - are used for monitoring, exposing statistics via http
   void IncBy(StringPiece name, long delta) { metric_map_[name] += delta; }
   void Inc(StringPiece name) { IncBy(name, 1); }
-  // const StringPieceDenseMap<long>& metric_map() const { return metric_map_; }
+  // const strings::StringFlatMap<long>& metric_map() const { return metric_map_; }
 
   // Used only in tests.
   void TEST_Write(const ShardId& shard_id, std::string&& record) {
     Write(shard_id, std::move(record));
   }
 
+  void TEST_WriteSorted(const ShardId& shard_id, std::string&& key, std::string&& record) {
+    WriteSorted(shard_id, std::move(key), std::move(record));
+  }
+
   void EmitParseError() { ++parse_errors_; }
 
   size_t parse_errors() const { return parse_errors_;}
@@ -95,18 +134,49 @@ class RawContext {
   // Finds the map produced by operators in the previous steps
   const FrequencyMap<uint32_t>* FindMaterializedFreqMapStatistic(const std::string& map_id) const;
 
+  //! Returns the sketch of type S (HyperLogLog, CountMinSketch, QuantileSketch) created with args
+  //! upon the first call. The sketches of all the contexts are merged when the operator finishes,
+  //! hence args must be the same in all of them. sketch_id must be unique across the pipeline run.
+  template <typename S, typename... Args> S& GetSketch(const std::string& sketch_id,
+                                                       Args&&... args);
+
+  // Finds the sketch produced by operators in the previous steps.
+  template <typename S> const S* FindMaterializedSketch(const std::string& sketch_id) const;
+
+  //! Returns the table loaded by Pipeline::Broadcast(name, ...). It must have been loaded
+  //! before the operator started.
+  template <typename T> const BroadcastTable<T>& GetBroadcast(const std::string& name) const;
+
   const ShardId& current_shard() const { return current_shard_;}
 
+  //! The bytes of the state that a join handler holds for the current shard, see
+  //! DoContext::ReportStateBytes. Reset when the shard starts.
+  void set_state_bytes(size_t bytes) { state_bytes_ = bytes; }
+  size_t state_bytes() const { return state_bytes_; }
+
+  const OperatorProfile& profile() const { return profile_; }
+
  private:
   void Write(const ShardId& shard_id, std::string&& record) {
     ++item_writes_;
+    profile_.write_bytes += record.size();
     WriteInternal(shard_id, std::move(record));
   }
 
+  void WriteSorted(const ShardId& shard_id, std::string&& key, std::string&& record) {
+    ++item_writes_;
+    profile_.write_bytes += record.size();
+    WriteSortedInternal(shard_id, std::move(key), std::move(record));
+  }
+
   // To allow testing we mark this function as public.
   virtual void WriteInternal(const ShardId& shard_id, std::string&& record) = 0;
 
-  StringPieceDenseMap<long> metric_map_;
+  // Writes the record into a sorted output, see Output<T>::AndSort. Fails by default.
+  virtual void WriteSortedInternal(const ShardId& shard_id, std::string&& key,
+                                   std::string&& record);
+
+  strings::StringFlatMap<long> metric_map_;
   size_t parse_errors_ = 0, item_writes_ = 0;
   std::string file_name_;
   ShardId current_shard_;
@@ -116,45 +186,211 @@ class RawContext {
 
   FreqMapRegistry freq_maps_;
   const FreqMapRegistry* finalized_maps_ = nullptr;
+  SketchRegistry sketches_;
+  const SketchRegistry* finalized_sketches_ = nullptr;
+  const BroadcastRegistry* broadcasts_ = nullptr;
   size_t input_pos_ = 0;
+  size_t state_bytes_ = 0;
+
+  OperatorProfile profile_;
+  uint32_t sample_cnt_ = 0;
+  uint32_t sampling_ = 0;  // The sample rate during sampled DoFn calls, 0 otherwise.
 };
 
+template <typename S, typename... Args>
+S& RawContext::GetSketch(const std::string& sketch_id, Args&&... args) {
+  static_assert(std::is_base_of<Sketch, S>::value, "S must be derived from mr3::Sketch");
+
+  auto res = sketches_.emplace(sketch_id, nullptr);
+  if (res.second) {
+    res.first->second.reset(new S(std::forward<Args>(args)...));
+  }
+  S* sketch = dynamic_cast<S*>(res.first->second.get());
+  CHECK(sketch) << "Sketch " << sketch_id << " was created with a different type";
+  return *sketch;
+}
+
+template <typename S>
+const S* RawContext::FindMaterializedSketch(const std::string& sketch_id) const {
+  auto it = CHECK_NOTNULL(finalized_sketches_)->find(sketch_id);
+  if (it == finalized_sketches_->end())
+    return nullptr;
+
+  const S* sketch = dynamic_cast<const S*>(it->second.get());
+  CHECK(sketch) << "Sketch " << sketch_id << " was created with a different type";
+  return sketch;
+}
+
+template <typename T>
+const BroadcastTable<T>& RawContext::GetBroadcast(const std::string& name) const {
+  auto it = CHECK_NOTNULL(broadcasts_)->find(name);
+  CHECK(it != broadcasts_->end()) << "Broadcast table " << name << " was not loaded. "
+                                  << "Is it used before the operators that produce it?";
+
+  const BroadcastTable<T>* table = dynamic_cast<const BroadcastTable<T>*>(it->second.get());
+  CHECK(table) << "Broadcast table " << name << " was loaded with a different type";
+  return *table;
+}
+
 // This class is created per MapFiber in SetupDoFn and it wraps RawContext.
 // It's thread-local.
 template <typename T> class DoContext {
   template <typename Handler, typename ToType> friend class detail::HandlerWrapper;
+  template <typename U, typename Parser> friend class detail::IdentityHandlerWrapper;
+  template <typename From, typename To> friend class detail::FusedHandlerWrapper;
 
  public:
   DoContext(const Output<T>& out, RawContext* context) : out_(out), context_(context) {}
 
   template<typename U> void Write(const ShardId& shard_id, U&& u) {
-    context_->Write(shard_id, rt_.Serialize(out_.is_binary(), std::forward<U>(u)));
+    WriteDispatch(shard_id, std::forward<U>(u), std::is_same<std::decay_t<U>, T>{});
   }
 
   void Write(T& t) {
-    ShardId shard_id = out_.Shard(t);
+    if (fused_sink_) {
+      fused_sink_(T(t));
+      return;
+    }
+    ShardId shard_id = Shard(t);
     Write(shard_id, t);
   }
 
   void Write(T&& t) {
-    ShardId shard_id = out_.Shard(t);
+    if (fused_sink_) {
+      fused_sink_(std::move(t));
+      return;
+    }
+    ShardId shard_id = Shard(t);
     Write(shard_id, std::move(t));
   }
 
   RawContext* raw() { return context_; }
 
+  //! Join handlers that keep large per-shard state report its size, so that the joiner
+  //! admits the other shards within --join_memory_budget_mb. The shard inputs are taken as
+  //! the estimate otherwise.
+  void ReportStateBytes(size_t bytes) { context_->set_state_bytes(bytes); }
+
+  //! Shortcut for RawContext::GetBroadcast.
+  template <typename U> const BroadcastTable<U>& Broadcast(const std::string& name) const {
+    return context_->GetBroadcast<U>(name);
+  }
+
   //
   void SetOutputShard(ShardId sid) {
     detail::VerifyUnspecifiedSharding(out_.msg());
     out_.SetConstantShard(std::move(sid));
   }
 
-  void CloseShard(const ShardId& sid) { raw()->CloseShard(sid); }
+  void CloseShard(const ShardId& sid) {
+    FlushCombined(sid);
+    raw()->CloseShard(sid);
+  }
 
  private:
+  using CombineMap = absl::flat_hash_map<std::string, T>;
+
+  ShardId Shard(const T& t) {
+    if (!out_.is_skewed())
+      return out_.Shard(t);
+
+    if (!skew_plan_) {
+      const pb::ShardSpec& spec = out_.msg().shard_spec();
+      const FrequencyMap<uint32_t>* freq_map =
+          context_->FindMaterializedFreqMapStatistic(spec.freq_map_id());
+      CHECK(freq_map) << "Frequency map " << spec.freq_map_id() << " for output "
+                      << out_.msg().name() << " must be produced by previous operators";
+      skew_plan_.reset(new detail::SkewPlan(*freq_map, spec.modn(), spec.max_splits()));
+    }
+    return skew_plan_->Shard(out_.ShardKey(t));
+  }
+
+  template <typename U> void WriteDispatch(const ShardId& shard_id, U&& u, std::true_type) {
+    if (fused_sink_) {
+      fused_sink_(T(std::forward<U>(u)));
+      return;
+    }
+
+    if (!out_.has_combiner()) {
+      WriteRaw(shard_id, std::forward<U>(u));
+      return;
+    }
+
+    T val(std::forward<U>(u));
+    CombineMap& cmap = combined_[shard_id];
+    std::string key = out_.CombineKey(val);
+    auto it = cmap.find(key);
+    if (it != cmap.end()) {
+      out_.Combine(&it->second, std::move(val));
+      return;
+    }
+
+    cmap.emplace(std::move(key), std::move(val));
+    if (++combined_keys_ > out_.combine_max_keys()) {
+      FlushCombined();
+    }
+  }
+
+  template <typename U> void WriteDispatch(const ShardId& shard_id, U&& u, std::false_type) {
+    CHECK(!fused_sink_) << "Output " << out_.msg().name() << " can not be fused";
+    WriteRaw(shard_id, std::forward<U>(u));
+  }
+
+  template <typename U> void WriteRaw(const ShardId& shard_id, U&& u) {
+    if (!context_->sampling_) {
+      WriteSerialized(shard_id, std::forward<U>(u));
+      return;
+    }
+    uint64_t start = base::CycleClock::Now();
+    WriteSerialized(shard_id, std::forward<U>(u));
+    context_->profile_.write_ns +=
+        base::CycleClock::ToNanos(base::CycleClock::Now() - start) * context_->sampling_;
+  }
+
+  template <typename U> void WriteSerialized(const ShardId& shard_id, U&& u) {
+    if (!out_.has_sort_key()) {
+      context_->Write(shard_id, rt_.Serialize(out_.is_binary(), std::forward<U>(u)));
+      return;
+    }
+    std::string key = out_.SortKey(u);
+    context_->WriteSorted(shard_id, std::move(key),
+                          rt_.Serialize(out_.is_binary(), std::forward<U>(u)));
+  }
+
+  // Writes all the records buffered by the combiner.
+  void FlushCombined() {
+    for (auto& k_v : combined_) {
+      for (auto& key_val : k_v.second) {
+        WriteRaw(k_v.first, std::move(key_val.second));
+      }
+    }
+    combined_.clear();
+    combined_keys_ = 0;
+  }
+
+  void FlushCombined(const ShardId& sid) {
+    auto it = combined_.find(sid);
+    if (it == combined_.end())
+      return;
+    combined_keys_ -= it->second.size();
+    for (auto& key_val : it->second) {
+      WriteRaw(sid, std::move(key_val.second));
+    }
+    combined_.erase(it);
+  }
+
   Output<T> out_;
   RawContext* context_;
   RecordTraits<T> rt_;
+
+  absl::flat_hash_map<ShardId, CombineMap> combined_;
+  size_t combined_keys_ = 0;
+
+  std::unique_ptr<detail::SkewPlan> skew_plan_;  // Built lazily for SKEWED_MODN outputs.
+
+  // Set when the output is fused into the consuming map. Records are passed to it
+  // directly, without sharding, combining or serialization.
+  std::function<void(T&&)> fused_sink_;
 };
 
 }  // namespace mr3
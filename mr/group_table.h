@@ -0,0 +1,211 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "base/arena.h"
+#include "base/hash.h"
+#include "base/logging.h"
+
+namespace mr3 {
+
+/** Groups the records of a joiner shard by their string keys.
+ *  The keys and the values are allocated in an arena and looked up with open addressing over
+ *  an array of (hash, entry) slots, hence an insertion costs a single arena allocation and a probe
+ *  rarely touches the entry of another key. Reset() destroys all the groups at once and keeps
+ *  the memory for the next shard, so that a handler does not reallocate it per shard:
+ *
+ *    void Add(Rec rec, DoContext<string>* cntx) { groups_[rec.key] += rec.val; }
+ *    void OnShardFinish(DoContext<string>* cntx) {
+ *      groups_.ForEach([&](absl::string_view key, int64_t& sum) { cntx->Write(...); });
+ *      groups_.Reset();
+ *    }
+ *
+ *  A table with a spill limit passes its groups to the spill callback and resets itself when
+ *  the memory it uses reaches the limit, which suits the aggregations that can be combined later,
+ *  like counts. Values of V may own heap memory, but it is not accounted by the limit.
+ *  Not thread-safe, a handler instance is used by a single fiber.
+ */
+template <typename V> class GroupTable {
+ public:
+  using SpillCb = std::function<void(absl::string_view key, V& value)>;
+
+  explicit GroupTable(size_t block_size = 1 << 16) : arena_(block_size) {}
+  ~GroupTable() { Destroy(); }
+
+  GroupTable(const GroupTable&) = delete;
+  void operator=(const GroupTable&) = delete;
+
+  // Returns the value of key, value-initialized if key was not in the table.
+  V& operator[](absl::string_view key);
+
+  // Returns nullptr if key is not in the table.
+  V* Find(absl::string_view key);
+  const V* Find(absl::string_view key) const {
+    return const_cast<GroupTable*>(this)->Find(key);
+  }
+
+  // Calls f(absl::string_view key, V& value) for every group in an unspecified order.
+  template <typename F> void ForEach(F&& f);
+
+  // Destroys all the groups and keeps the memory of the table.
+  void Reset();
+
+  // Spills the groups into cb once the table uses max_bytes or more.
+  void SetSpill(size_t max_bytes, SpillCb cb) {
+    spill_bytes_ = max_bytes;
+    spill_cb_ = std::move(cb);
+  }
+
+  // Passes all the groups to the spill callback and resets the table.
+  void Spill();
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // The number of times the table spilled.
+  unsigned spills() const { return spills_; }
+
+  size_t MemoryUsage() const {
+    return arena_.MemoryUsage() + slots_.capacity() * sizeof(Slot);
+  }
+
+ private:
+  // Followed by key_size bytes of the key.
+  struct Entry {
+    V value;
+    uint32_t key_size;
+
+    absl::string_view key() const {
+      return absl::string_view(reinterpret_cast<const char*>(this + 1), key_size);
+    }
+  };
+
+  struct Slot {
+    uint64_t hash;
+    Entry* entry;
+  };
+
+  enum { kMinCapacity = 64 };
+
+  static uint64_t Hash(absl::string_view key) { return base::Hash64(key.data(), key.size()); }
+
+  // Returns the slot of key or the empty slot where it belongs.
+  Slot* Probe(absl::string_view key, uint64_t hash);
+
+  void Grow();
+  void Destroy();
+
+  base::Arena arena_;
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+
+  size_t spill_bytes_ = 0;
+  SpillCb spill_cb_;
+  unsigned spills_ = 0;
+};
+
+template <typename V> V& GroupTable<V>::operator[](absl::string_view key) {
+  uint64_t hash = Hash(key);
+  if (!slots_.empty()) {
+    Slot* slot = Probe(key, hash);
+    if (slot->entry)
+      return slot->entry->value;
+  }
+
+  if (spill_cb_ && size_ > 0 && MemoryUsage() >= spill_bytes_)
+    Spill();
+
+  // Keeps the load factor below 3/4.
+  if ((size_ + 1) * 4 > slots_.size() * 3)
+    Grow();
+
+  Slot* slot = Probe(key, hash);
+  DCHECK(slot->entry == nullptr);
+
+  char* ptr = arena_.AllocateAligned(sizeof(Entry) + key.size(), alignof(Entry));
+  Entry* entry = reinterpret_cast<Entry*>(ptr);
+  new (&entry->value) V();
+  entry->key_size = key.size();
+  if (!key.empty())
+    memcpy(ptr + sizeof(Entry), key.data(), key.size());
+
+  slot->hash = hash;
+  slot->entry = entry;
+  ++size_;
+
+  return entry->value;
+}
+
+template <typename V> V* GroupTable<V>::Find(absl::string_view key) {
+  if (size_ == 0)
+    return nullptr;
+  Slot* slot = Probe(key, Hash(key));
+  return slot->entry ? &slot->entry->value : nullptr;
+}
+
+template <typename V> template <typename F> void GroupTable<V>::ForEach(F&& f) {
+  for (Slot& slot : slots_) {
+    if (slot.entry)
+      f(slot.entry->key(), slot.entry->value);
+  }
+}
+
+template <typename V> void GroupTable<V>::Reset() {
+  Destroy();
+  std::fill(slots_.begin(), slots_.end(), Slot{0, nullptr});
+  arena_.Reset();
+  size_ = 0;
+}
+
+template <typename V> void GroupTable<V>::Spill() {
+  CHECK(spill_cb_);
+  ForEach(spill_cb_);
+  Reset();
+  ++spills_;
+}
+
+template <typename V>
+auto GroupTable<V>::Probe(absl::string_view key, uint64_t hash) -> Slot* {
+  size_t mask = slots_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    Slot* slot = &slots_[i];
+    if (!slot->entry || (slot->hash == hash && slot->entry->key() == key))
+      return slot;
+  }
+}
+
+template <typename V> void GroupTable<V>::Grow() {
+  std::vector<Slot> old(std::max<size_t>(slots_.size() * 2, kMinCapacity), Slot{0, nullptr});
+  old.swap(slots_);
+
+  // The hashes are kept in the slots, hence rehashing does not touch the entries.
+  size_t mask = slots_.size() - 1;
+  for (const Slot& src : old) {
+    if (!src.entry)
+      continue;
+    size_t i = src.hash & mask;
+    while (slots_[i].entry)
+      i = (i + 1) & mask;
+    slots_[i] = src;
+  }
+}
+
+template <typename V> void GroupTable<V>::Destroy() {
+  if (std::is_trivially_destructible<V>::value || size_ == 0)
+    return;
+  for (Slot& slot : slots_) {
+    if (slot.entry)
+      slot.entry->value.~V();
+  }
+}
+
+}  // namespace mr3
@@ -0,0 +1,102 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#include "mr/group_table.h"
+
+#include <map>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace mr3 {
+
+using namespace std;
+
+class GroupTableTest : public testing::Test {
+ protected:
+};
+
+TEST_F(GroupTableTest, Basic) {
+  GroupTable<uint64_t> table;
+  EXPECT_TRUE(table.empty());
+  EXPECT_TRUE(table.Find("a") == nullptr);
+
+  ++table["a"];
+  ++table["b"];
+  ++table["a"];
+  table[""] = 5;
+
+  EXPECT_EQ(3, table.size());
+  ASSERT_TRUE(table.Find("a") != nullptr);
+  EXPECT_EQ(2, *table.Find("a"));
+  EXPECT_EQ(1, *table.Find("b"));
+  EXPECT_EQ(5, *table.Find(""));
+  EXPECT_TRUE(table.Find("c") == nullptr);
+}
+
+TEST_F(GroupTableTest, Grow) {
+  GroupTable<uint64_t> table(256);
+  for (unsigned j = 0; j < 2; ++j) {
+    for (unsigned i = 0; i < 100000; ++i) {
+      table[absl::StrCat("key", i)] += i;
+    }
+  }
+  EXPECT_EQ(100000, table.size());
+
+  uint64_t sum = 0;
+  unsigned count = 0;
+  table.ForEach([&](absl::string_view key, uint64_t& val) {
+    EXPECT_EQ(absl::StrCat("key", val / 2), key);
+    sum += val;
+    ++count;
+  });
+  EXPECT_EQ(100000, count);
+  EXPECT_EQ(uint64_t(99999) * 100000, sum);
+}
+
+TEST_F(GroupTableTest, Reset) {
+  GroupTable<string> table;
+  size_t usage = 0;
+
+  // The shards after the first one reuse its memory.
+  for (unsigned shard = 0; shard < 3; ++shard) {
+    table.Reset();
+    EXPECT_TRUE(table.empty());
+    EXPECT_TRUE(table.Find("key1") == nullptr);
+
+    for (unsigned i = 0; i < 1000; ++i) {
+      table[absl::StrCat("key", i, "-", shard)] = string(100, 'a' + shard);
+    }
+    EXPECT_EQ(1000, table.size());
+    EXPECT_EQ(string(100, 'a' + shard), *table.Find(absl::StrCat("key5-", shard)));
+    if (shard == 1)
+      usage = table.MemoryUsage();
+  }
+  EXPECT_EQ(usage, table.MemoryUsage());
+}
+
+TEST_F(GroupTableTest, Spill) {
+  GroupTable<uint64_t> table(1024);
+  map<string, uint64_t> spilled;
+  table.SetSpill(1 << 14, [&](absl::string_view key, uint64_t& val) {
+    spilled[string(key)] += val;
+  });
+
+  for (unsigned i = 0; i < 10000; ++i) {
+    ++table[absl::StrCat("key", i % 2000)];
+  }
+  EXPECT_GT(table.spills(), 0);
+  EXPECT_LT(table.size(), 2000);
+
+  table.Spill();
+  EXPECT_TRUE(table.empty());
+  ASSERT_EQ(2000, spilled.size());
+  for (const auto& k_v : spilled) {
+    EXPECT_EQ(5, k_v.second) << k_v.first;
+  }
+}
+
+}  // namespace mr3
@@ -0,0 +1,618 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/columnar_format.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "base/endian.h"
+#include "base/logging.h"
+#include "base/varint.h"
+#include "util/coding/double_compressor.h"
+#include "util/coding/set_encoder.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+namespace gpb = google::protobuf;
+using FD = gpb::FieldDescriptor;
+
+/* Block layout, all the integers are varints unless said otherwise:
+     num_rows, num_columns, column*
+   Column:
+     field_number, name_size, name, type (1 byte), encoding (1 byte), payload_size, payload
+   Payload:
+     value count of each row (num_rows times), num_values, values in the column encoding.
+*/
+namespace {
+
+enum Encoding : uint8_t {
+  kVarint = 0,  // num_values varints.
+  kDict = 1,    // alphabet_size, alphabet as fixed64, num_values varint ids.
+  kDouble = 2,  // DoubleCompressor blocks.
+  kBytes = 3,   // raw_size, compressed_size (0 if not compressed), data.
+                // The raw data holds num_values varint sizes followed by the values.
+};
+
+enum ValueKind { kIntKind, kDoubleKind, kBytesKind };
+
+constexpr size_t kMinDictValues = 16;
+
+// DoubleCompressor stores the block size in 16 bits, therefore an uncompressible block of
+// BLOCK_MAX_LEN doubles would overflow it.
+constexpr size_t kDoubleChunk = util::DoubleCompressor::BLOCK_MAX_LEN / 2;
+constexpr size_t kMinCompressSize = 64;
+
+ValueKind KindOf(FD::CppType cpp_type) {
+  switch (cpp_type) {
+    case FD::CPPTYPE_DOUBLE:
+    case FD::CPPTYPE_FLOAT:
+      return kDoubleKind;
+    case FD::CPPTYPE_STRING:
+    case FD::CPPTYPE_MESSAGE:
+      return kBytesKind;
+    default:
+      return kIntKind;
+  }
+}
+
+// Signed values are kept zigzag-encoded to keep negative numbers short.
+bool IsSigned(FD::Type type) {
+  switch (type) {
+    case FD::TYPE_INT32:
+    case FD::TYPE_INT64:
+    case FD::TYPE_SINT32:
+    case FD::TYPE_SINT64:
+    case FD::TYPE_SFIXED32:
+    case FD::TYPE_SFIXED64:
+    case FD::TYPE_ENUM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline uint64_t ZigZag(int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+inline int64_t UnZigZag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+void AppendVarint(uint64_t v, string* dest) {
+  uint8_t buf[Varint::kMax64];
+  uint8_t* end = Varint::Encode64(buf, v);
+  dest->append(reinterpret_cast<const char*>(buf), end - buf);
+}
+
+void AppendFixed32(uint32_t v, string* dest) {
+  char buf[4];
+  LittleEndian::Store32(buf, v);
+  dest->append(buf, 4);
+}
+
+void AppendFixed64(uint64_t v, string* dest) {
+  char buf[8];
+  LittleEndian::Store64(buf, v);
+  dest->append(buf, 8);
+}
+
+void AppendTag(uint32_t field_number, uint32_t wire_type, string* dest) {
+  AppendVarint((uint64_t(field_number) << 3) | wire_type, dest);
+}
+
+// Consumes bytes from the front of the view. All functions return false on truncated input.
+class ViewParser {
+ public:
+  explicit ViewParser(absl::string_view src) : src_(src) {}
+
+  bool ReadVarint(uint64_t* val) {
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(src_.data());
+    const uint8_t* next = Varint::Parse64WithLimit(begin, begin + src_.size(), val);
+    if (!next)
+      return false;
+    src_.remove_prefix(next - begin);
+    return true;
+  }
+
+  template <typename T> bool ReadVarint(T* val) {
+    uint64_t tmp;
+    if (!ReadVarint(&tmp) || tmp > std::numeric_limits<T>::max())
+      return false;
+    *val = tmp;
+    return true;
+  }
+
+  bool ReadBytes(size_t sz, absl::string_view* dest) {
+    if (sz > src_.size())
+      return false;
+    *dest = src_.substr(0, sz);
+    src_.remove_prefix(sz);
+    return true;
+  }
+
+  absl::string_view left() const { return src_; }
+
+ private:
+  absl::string_view src_;
+};
+
+}  // namespace
+
+struct ColumnarWriter::Column {
+  const FD* fd;
+  ValueKind kind;
+
+  vector<uint32_t> counts;
+  vector<uint64_t> ints;
+  vector<double> dbls;
+  vector<uint32_t> sizes;
+  string bytes;
+
+  explicit Column(const FD* f) : fd(f), kind(KindOf(f->cpp_type())) {}
+
+  size_t num_values() const { return ints.size() + dbls.size() + sizes.size(); }
+
+  void Clear() {
+    counts.clear();
+    ints.clear();
+    dbls.clear();
+    sizes.clear();
+    bytes.clear();
+  }
+
+  void Add(const gpb::Message& msg);
+
+  // Encode* functions append the values to dest and return their encoding.
+  Encoding EncodeInts(string* dest) const;
+  Encoding EncodeDoubles(util::DoubleCompressor* compressor, string* dest) const;
+  Encoding EncodeBytes(string* dest) const;
+};
+
+#define GET_VALUE(Type) \
+  (is_repeated ? refl->GetRepeated##Type(msg, fd, i) : refl->Get##Type(msg, fd))
+
+void ColumnarWriter::Column::Add(const gpb::Message& msg) {
+  const gpb::Reflection* refl = msg.GetReflection();
+  const bool is_repeated = fd->is_repeated();
+  int count = is_repeated ? refl->FieldSize(msg, fd) : int(refl->HasField(msg, fd));
+
+  counts.push_back(count);
+  string scratch;
+  for (int i = 0; i < count; ++i) {
+    switch (fd->cpp_type()) {
+      case FD::CPPTYPE_INT32:
+        ints.push_back(ZigZag(GET_VALUE(Int32)));
+        break;
+      case FD::CPPTYPE_INT64:
+        ints.push_back(ZigZag(GET_VALUE(Int64)));
+        break;
+      case FD::CPPTYPE_ENUM:
+        ints.push_back(ZigZag(GET_VALUE(EnumValue)));
+        break;
+      case FD::CPPTYPE_UINT32:
+        ints.push_back(GET_VALUE(UInt32));
+        break;
+      case FD::CPPTYPE_UINT64:
+        ints.push_back(GET_VALUE(UInt64));
+        break;
+      case FD::CPPTYPE_BOOL:
+        ints.push_back(GET_VALUE(Bool));
+        break;
+      case FD::CPPTYPE_FLOAT:
+        dbls.push_back(GET_VALUE(Float));
+        break;
+      case FD::CPPTYPE_DOUBLE:
+        dbls.push_back(GET_VALUE(Double));
+        break;
+      case FD::CPPTYPE_STRING: {
+        const string& str = is_repeated ? refl->GetRepeatedStringReference(msg, fd, i, &scratch)
+                                        : refl->GetStringReference(msg, fd, &scratch);
+        sizes.push_back(str.size());
+        bytes.append(str);
+        break;
+      }
+      case FD::CPPTYPE_MESSAGE: {
+        size_t start = bytes.size();
+        CHECK(GET_VALUE(Message).AppendPartialToString(&bytes));
+        sizes.push_back(bytes.size() - start);
+        break;
+      }
+    }
+  }
+}
+
+#undef GET_VALUE
+
+Encoding ColumnarWriter::Column::EncodeInts(string* dest) const {
+  util::LiteralDict<uint64_t> dict;
+  size_t plain_cost = 0;
+  for (uint64_t v : ints) {
+    plain_cost += Varint::Length64(v);
+    dict.Add(v);
+  }
+
+  bool use_dict = ints.size() >= kMinDictValues &&
+                  dict.dict_size() <= util::LiteralDictBase::kMaxAlphabetSize;
+  if (use_dict) {
+    dict.Build();
+    size_t dict_cost = Varint::Length64(dict.alphabet_size()) + dict.GetMaxSerializedSize();
+    for (uint64_t v : ints) {
+      dict_cost += Varint::Length32(dict.Resolve(v));
+    }
+    use_dict = dict_cost < plain_cost;
+  }
+
+  if (!use_dict) {
+    for (uint64_t v : ints) {
+      AppendVarint(v, dest);
+    }
+    return kVarint;
+  }
+
+  AppendVarint(dict.alphabet_size(), dest);
+  size_t pos = dest->size();
+  dest->resize(pos + dict.GetMaxSerializedSize());
+  size_t sz = dict.SerializeTo(reinterpret_cast<uint8_t*>(&(*dest)[pos]));
+  dest->resize(pos + sz);
+  for (uint64_t v : ints) {
+    AppendVarint(dict.Resolve(v), dest);
+  }
+  return kDict;
+}
+
+Encoding ColumnarWriter::Column::EncodeDoubles(util::DoubleCompressor* compressor,
+                                               string* dest) const {
+  using util::DoubleCompressor;
+
+  for (size_t i = 0; i < dbls.size(); i += kDoubleChunk) {
+    uint32_t sz = std::min(kDoubleChunk, dbls.size() - i);
+    size_t pos = dest->size();
+    dest->resize(pos + DoubleCompressor::CommitMaxSize(sz));
+    uint32_t written =
+        compressor->Commit(dbls.data() + i, sz, reinterpret_cast<uint8_t*>(&(*dest)[pos]));
+    dest->resize(pos + written);
+  }
+  return kDouble;
+}
+
+Encoding ColumnarWriter::Column::EncodeBytes(string* dest) const {
+  string raw;
+  raw.reserve(bytes.size() + sizes.size());
+  for (uint32_t sz : sizes) {
+    AppendVarint(sz, &raw);
+  }
+  raw.append(bytes);
+
+  AppendVarint(raw.size(), dest);
+
+  if (raw.size() >= kMinCompressSize) {
+    string compressed(ZSTD_compressBound(raw.size()), '\0');
+    size_t res = ZSTD_compress(&compressed.front(), compressed.size(), raw.data(), raw.size(), 1);
+    CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
+    if (res < raw.size()) {
+      AppendVarint(res, dest);
+      dest->append(compressed.data(), res);
+      return kBytes;
+    }
+  }
+  AppendVarint(0, dest);
+  dest->append(raw);
+  return kBytes;
+}
+
+ColumnarWriter::ColumnarWriter(const gpb::Descriptor* descr)
+    : scratch_(gpb::MessageFactory::generated_factory()->GetPrototype(descr)->New()) {
+  for (int i = 0; i < descr->field_count(); ++i) {
+    const FD* fd = descr->field(i);
+    CHECK_NE(FD::TYPE_GROUP, fd->type())
+        << "Groups are not supported by the columnar format: " << fd->full_name();
+    columns_.emplace_back(fd);
+  }
+}
+
+ColumnarWriter::~ColumnarWriter() {}
+
+void ColumnarWriter::Add(const gpb::Message& msg) {
+  DCHECK(msg.GetDescriptor() == scratch_->GetDescriptor());
+
+  for (auto& col : columns_) {
+    col.Add(msg);
+  }
+  ++num_rows_;
+}
+
+bool ColumnarWriter::Add(absl::string_view record) {
+  if (!scratch_->ParseFromArray(record.data(), record.size()))
+    return false;
+  Add(*scratch_);
+  return true;
+}
+
+void ColumnarWriter::SerializeBlock(std::string* dest) {
+  dest->clear();
+
+  size_t num_columns = 0;
+  for (const auto& col : columns_) {
+    num_columns += col.num_values() > 0;
+  }
+  AppendVarint(num_rows_, dest);
+  AppendVarint(num_columns, dest);
+
+  string payload;
+  for (auto& col : columns_) {
+    if (col.num_values() == 0) {  // Columns without values are not written at all.
+      col.Clear();
+      continue;
+    }
+
+    const FD* fd = col.fd;
+    AppendVarint(fd->number(), dest);
+    AppendVarint(fd->name().size(), dest);
+    dest->append(fd->name());
+    dest->push_back(fd->type());
+
+    payload.clear();
+    for (uint32_t cnt : col.counts) {
+      AppendVarint(cnt, &payload);
+    }
+    AppendVarint(col.num_values(), &payload);
+
+    Encoding encoding = kVarint;
+    switch (col.kind) {
+      case kIntKind:
+        encoding = col.EncodeInts(&payload);
+        break;
+      case kDoubleKind:
+        if (!dbl_compressor_)
+          dbl_compressor_.reset(new util::DoubleCompressor);
+        encoding = col.EncodeDoubles(dbl_compressor_.get(), &payload);
+        break;
+      case kBytesKind:
+        encoding = col.EncodeBytes(&payload);
+        break;
+    }
+
+    dest->push_back(encoding);
+    AppendVarint(payload.size(), dest);
+    dest->append(payload);
+
+    col.Clear();
+  }
+  num_rows_ = 0;
+}
+
+struct ColumnarReader::Column {
+  uint32_t field_number = 0;
+  FD::Type type = FD::TYPE_INT64;
+  uint8_t encoding = kVarint;
+  absl::string_view payload;
+
+  vector<uint32_t> counts;
+  vector<uint64_t> ints;
+  vector<double> dbls;
+  vector<absl::string_view> strs;
+  string buf;  // Holds decompressed bytes referenced by strs.
+
+  size_t next = 0;
+
+  void AppendNext(string* dest);
+};
+
+void ColumnarReader::Column::AppendNext(string* dest) {
+  switch (type) {
+    case FD::TYPE_DOUBLE: {
+      uint64_t bits;
+      double val = dbls[next];
+      memcpy(&bits, &val, sizeof(bits));
+      AppendTag(field_number, 1, dest);
+      AppendFixed64(bits, dest);
+      break;
+    }
+    case FD::TYPE_FLOAT: {
+      uint32_t bits;
+      float val = dbls[next];
+      memcpy(&bits, &val, sizeof(bits));
+      AppendTag(field_number, 5, dest);
+      AppendFixed32(bits, dest);
+      break;
+    }
+    case FD::TYPE_FIXED64:
+    case FD::TYPE_SFIXED64:
+      AppendTag(field_number, 1, dest);
+      AppendFixed64(type == FD::TYPE_SFIXED64 ? UnZigZag(ints[next]) : ints[next], dest);
+      break;
+    case FD::TYPE_FIXED32:
+    case FD::TYPE_SFIXED32:
+      AppendTag(field_number, 5, dest);
+      AppendFixed32(type == FD::TYPE_SFIXED32 ? UnZigZag(ints[next]) : ints[next], dest);
+      break;
+    case FD::TYPE_STRING:
+    case FD::TYPE_BYTES:
+    case FD::TYPE_MESSAGE:
+      AppendTag(field_number, 2, dest);
+      AppendVarint(strs[next].size(), dest);
+      dest->append(strs[next].data(), strs[next].size());
+      break;
+    case FD::TYPE_SINT32:
+    case FD::TYPE_SINT64:
+      // zigzag encoding is the wire format of sint fields.
+      AppendTag(field_number, 0, dest);
+      AppendVarint(ints[next], dest);
+      break;
+    default:
+      AppendTag(field_number, 0, dest);
+      AppendVarint(IsSigned(type) ? UnZigZag(ints[next]) : ints[next], dest);
+  }
+  ++next;
+}
+
+ColumnarReader::ColumnarReader(const std::vector<std::string>& fields) : fields_(fields) {}
+
+ColumnarReader::~ColumnarReader() {}
+
+int64_t ColumnarReader::ParseBlock(absl::string_view block, RecordCb cb) {
+  ViewParser parser(block);
+  size_t num_rows, num_columns;
+  if (!parser.ReadVarint(&num_rows) || !parser.ReadVarint(&num_columns))
+    return -1;
+
+  size_t used = 0;
+  for (size_t i = 0; i < num_columns; ++i) {
+    uint32_t field_number;
+    size_t name_size, payload_size;
+    absl::string_view name, meta;
+
+    if (!parser.ReadVarint(&field_number) || !parser.ReadVarint(&name_size) ||
+        !parser.ReadBytes(name_size, &name) || !parser.ReadBytes(2, &meta) ||
+        !parser.ReadVarint(&payload_size)) {
+      return -1;
+    }
+
+    absl::string_view payload;
+    if (!parser.ReadBytes(payload_size, &payload))
+      return -1;
+
+    if (!fields_.empty() && std::find(fields_.begin(), fields_.end(), name) == fields_.end())
+      continue;
+
+    if (used == columns_.size())
+      columns_.emplace_back();
+    Column& col = columns_[used++];
+    col.field_number = field_number;
+    col.type = FD::Type(uint8_t(meta[0]));
+    col.encoding = meta[1];
+    col.payload = payload;
+    col.counts.resize(num_rows);
+    if (col.type < 1 || col.type > FD::MAX_TYPE || !ParseColumn(&col))
+      return -1;
+  }
+
+  for (size_t row = 0; row < num_rows; ++row) {
+    record_.clear();
+    for (size_t i = 0; i < used; ++i) {
+      Column& col = columns_[i];
+      for (uint32_t j = 0; j < col.counts[row]; ++j) {
+        col.AppendNext(&record_);
+      }
+    }
+    cb(record_);
+  }
+
+  return num_rows;
+}
+
+bool ColumnarReader::ParseColumn(Column* col) {
+  ViewParser parser(col->payload);
+
+  size_t expected = 0;
+  for (auto& cnt : col->counts) {
+    if (!parser.ReadVarint(&cnt))
+      return false;
+    expected += cnt;
+  }
+
+  size_t num_values;
+  if (!parser.ReadVarint(&num_values) || num_values != expected)
+    return false;
+
+  col->next = 0;
+  col->ints.clear();
+  col->dbls.clear();
+  col->strs.clear();
+
+  switch (col->encoding) {
+    case kVarint:
+      col->ints.resize(num_values);
+      for (auto& v : col->ints) {
+        if (!parser.ReadVarint(&v))
+          return false;
+      }
+      break;
+    case kDict: {
+      size_t alphabet_size;
+      absl::string_view alphabet;
+      if (!parser.ReadVarint(&alphabet_size) ||
+          alphabet_size > util::LiteralDictBase::kMaxAlphabetSize ||
+          !parser.ReadBytes(alphabet_size * sizeof(uint64_t), &alphabet)) {
+        return false;
+      }
+
+      col->ints.resize(num_values);
+      for (auto& v : col->ints) {
+        uint32_t id;
+        if (!parser.ReadVarint(&id) || id >= alphabet_size)
+          return false;
+        v = LittleEndian::Load64(alphabet.data() + id * sizeof(uint64_t));
+      }
+      break;
+    }
+    case kDouble: {
+      using util::DoubleDecompressor;
+      if (!dbl_decompressor_) {
+        dbl_decompressor_.reset(new DoubleDecompressor);
+        dbl_buf_.reset(new double[DoubleDecompressor::BLOCK_MAX_LEN]);
+      }
+
+      absl::string_view src = parser.left();
+      while (col->dbls.size() < num_values) {
+        const uint8_t* ptr = reinterpret_cast<const uint8_t*>(src.data());
+        if (src.size() < 3 || DoubleDecompressor::BlockSize(ptr) > src.size())
+          return false;
+
+        uint32_t block_size = DoubleDecompressor::BlockSize(ptr);
+        int32_t res = dbl_decompressor_->Decompress(ptr, block_size, dbl_buf_.get());
+        if (res < 0)
+          return false;
+        col->dbls.insert(col->dbls.end(), dbl_buf_.get(), dbl_buf_.get() + res);
+        src.remove_prefix(block_size);
+      }
+      if (col->dbls.size() != num_values)
+        return false;
+      break;
+    }
+    case kBytes: {
+      size_t raw_size, compressed_size;
+      if (!parser.ReadVarint(&raw_size) || !parser.ReadVarint(&compressed_size))
+        return false;
+
+      absl::string_view data;
+      if (compressed_size) {
+        absl::string_view src;
+        if (!parser.ReadBytes(compressed_size, &src))
+          return false;
+        col->buf.resize(raw_size);
+        size_t res = ZSTD_decompress(&col->buf.front(), raw_size, src.data(), src.size());
+        if (ZSTD_isError(res) || res != raw_size)
+          return false;
+        data = col->buf;
+      } else if (!parser.ReadBytes(raw_size, &data)) {
+        return false;
+      }
+
+      ViewParser data_parser(data);
+      vector<uint32_t> sizes(num_values);
+      for (auto& sz : sizes) {
+        if (!data_parser.ReadVarint(&sz))
+          return false;
+      }
+      for (uint32_t sz : sizes) {
+        col->strs.emplace_back();
+        if (!data_parser.ReadBytes(sz, &col->strs.back()))
+          return false;
+      }
+      break;
+    }
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+}  // namespace detail
+}  // namespace mr3
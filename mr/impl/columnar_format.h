@@ -0,0 +1,93 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace google {
+namespace protobuf {
+class Descriptor;
+class Message;
+}  // namespace protobuf
+}  // namespace google
+
+namespace util {
+class DoubleCompressor;
+class DoubleDecompressor;
+}  // namespace util
+
+namespace mr3 {
+namespace detail {
+
+/*! \brief Encodes protobuf records column by column.
+
+    Each top-level field of the record type becomes a column of the block. Integer columns are
+    dictionary encoded when their values repeat enough, floating point columns are compressed
+    with DoubleCompressor and string/bytes/message columns are zstd-compressed.
+    Unknown fields and extensions are dropped. Groups are not supported.
+
+    A block is self-describing, i.e. ColumnarReader does not need the record type to
+    decode it.
+*/
+class ColumnarWriter {
+ public:
+  explicit ColumnarWriter(const google::protobuf::Descriptor* descr);
+  ~ColumnarWriter();
+
+  void Add(const google::protobuf::Message& msg);
+
+  // Parses record in protobuf wire format. Returns false if it could not be parsed.
+  bool Add(absl::string_view record);
+
+  size_t num_rows() const { return num_rows_; }
+
+  // Encodes the records added since the last call into dest.
+  void SerializeBlock(std::string* dest);
+
+ private:
+  struct Column;
+
+  std::vector<Column> columns_;
+  std::unique_ptr<google::protobuf::Message> scratch_;
+  std::unique_ptr<util::DoubleCompressor> dbl_compressor_;
+  size_t num_rows_ = 0;
+};
+
+/*! \brief Decodes blocks written by ColumnarWriter.
+
+    Materializes only the requested top-level fields, the columns of other fields are skipped
+    without decoding them.
+*/
+class ColumnarReader {
+ public:
+  using RecordCb = std::function<void(absl::string_view)>;
+
+  // fields - names of the fields to materialize, all of them if empty.
+  explicit ColumnarReader(const std::vector<std::string>& fields);
+  ~ColumnarReader();
+
+  // Calls cb for each record of the block serialized in protobuf wire format.
+  // Returns the number of records or -1 if the block is corrupted.
+  int64_t ParseBlock(absl::string_view block, RecordCb cb);
+
+ private:
+  struct Column;
+
+  bool ParseColumn(Column* col);
+
+  std::vector<std::string> fields_;
+  std::vector<Column> columns_;
+  std::string record_;
+
+  std::unique_ptr<util::DoubleDecompressor> dbl_decompressor_;
+  std::unique_ptr<double[]> dbl_buf_;
+};
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,62 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/dedup_filter.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace mr3 {
+namespace detail {
+
+namespace {
+
+constexpr unsigned kBlockWords = 8;  // 512 bits.
+constexpr unsigned kBitsPerKey = 10;
+constexpr unsigned kProbes = 7;  // ln(2) * kBitsPerKey.
+
+}  // namespace
+
+DedupBloomFilter::DedupBloomFilter(size_t capacity) : capacity_(capacity) {
+  CHECK_GT(capacity, 0);
+
+  num_blocks_ = std::max<size_t>(1, capacity * kBitsPerKey / (kBlockWords * 64));
+  words_.reset(new std::atomic<uint64_t>[num_blocks_ * kBlockWords]);
+  Clear();
+}
+
+bool DedupBloomFilter::TestAndAdd(uint64_t hash) {
+  // The high half selects the block and the low half the bits, by double hashing.
+  std::atomic<uint64_t>* block = &words_[((hash >> 32) * num_blocks_ >> 32) * kBlockWords];
+  uint32_t h = hash;
+  const uint32_t delta = (h >> 17) | (h << 15);
+
+  bool found = true;
+  for (unsigned i = 0; i < kProbes; ++i) {
+    unsigned bit = h % (kBlockWords * 64);
+    uint64_t mask = uint64_t(1) << (bit % 64);
+    std::atomic<uint64_t>& word = block[bit / 64];
+
+    if ((word.load(std::memory_order_relaxed) & mask) == 0) {
+      found = false;
+      word.fetch_or(mask, std::memory_order_relaxed);
+    }
+    h += delta;
+  }
+
+  if (!found && count_.fetch_add(1, std::memory_order_relaxed) + 1 >= capacity_) {
+    // Concurrent insertions may be lost, which only lets a few duplicates through.
+    Clear();
+  }
+  return found;
+}
+
+void DedupBloomFilter::Clear() {
+  for (size_t i = 0; i < num_blocks_ * kBlockWords; ++i)
+    words_[i].store(0, std::memory_order_relaxed);
+  count_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace detail
+}  // namespace mr3
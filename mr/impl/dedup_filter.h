@@ -0,0 +1,108 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_set.h"
+#include "base/hash.h"
+#include "mr/do_context.h"
+
+namespace mr3 {
+namespace detail {
+
+/*! Blocked Bloom filter over 64 bit key hashes that supports insertion as the keys arrive.
+ *  Every key sets its bits in a single 512 bit block, so a lookup touches one cache line.
+ *  The bits are atomic, hence a filter may be shared by the mappers of all the IO threads;
+ *  concurrent updates may only miss a few insertions. Once it holds its capacity of keys the
+ *  filter is cleared to keep its false positive rate under about 1%.
+ */
+class DedupBloomFilter {
+ public:
+  explicit DedupBloomFilter(size_t capacity);
+
+  //! Adds the hash and returns true if it may have been added before.
+  bool TestAndAdd(uint64_t hash);
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  void Clear();
+
+  const size_t capacity_;
+  size_t num_blocks_;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+  std::atomic<size_t> count_{0};
+};
+
+//! Parameters of PTable::Distinct shared by its mappers and joiners.
+template <typename T> struct DedupSpec {
+  std::function<std::string(const T&)> key;
+
+  // The filter of all the mappers if set, otherwise each mapper has its own.
+  std::shared_ptr<DedupBloomFilter> shared_filter;
+};
+
+/*! Drops the records whose keys this mapper has already written, before they are shuffled.
+ *  The keys are checked against the Bloom filter first, and the keys it may contain against
+ *  the exact set of the recently written keys. Only the latter drops records, so a false
+ *  positive of the filter costs a lookup and never loses a unique key. The set is cleared once
+ *  it holds too many keys, then older duplicates are written again and DedupMerger drops them.
+ */
+template <typename T> class DedupMapper {
+ public:
+  static constexpr size_t kMaxKeys = OutputBase::kDefaultCombineKeys;
+
+  explicit DedupMapper(std::shared_ptr<const DedupSpec<T>> spec) : spec_(std::move(spec)) {
+    filter_ = spec_->shared_filter.get();
+    if (!filter_) {
+      own_filter_.reset(new DedupBloomFilter(kMaxKeys * 16));
+      filter_ = own_filter_.get();
+    }
+  }
+
+  void Do(T val, DoContext<T>* cntx) {
+    std::string key = spec_->key(val);
+    if (filter_->TestAndAdd(base::Hash64(key.data(), key.size()))) {
+      if (recent_.contains(key))
+        return;
+    }
+
+    if (recent_.size() >= kMaxKeys)
+      recent_.clear();
+    recent_.insert(std::move(key));
+    cntx->Write(std::move(val));
+  }
+
+ private:
+  std::shared_ptr<const DedupSpec<T>> spec_;
+  std::unique_ptr<DedupBloomFilter> own_filter_;
+  DedupBloomFilter* filter_;
+  absl::flat_hash_set<std::string> recent_;
+};
+
+//! Writes the first record of every key in each shard.
+template <typename T> class DedupMerger {
+ public:
+  explicit DedupMerger(std::shared_ptr<const DedupSpec<T>> spec) : spec_(std::move(spec)) {}
+
+  void On(T&& val, DoContext<T>* cntx) {
+    if (seen_.insert(spec_->key(val)).second)
+      cntx->Write(std::move(val));
+  }
+
+  void OnShardFinish(DoContext<T>* cntx) { seen_.clear(); }
+
+ private:
+  std::shared_ptr<const DedupSpec<T>> spec_;
+  absl::flat_hash_set<std::string> seen_;
+};
+
+}  // namespace detail
+}  // namespace mr3
@@ -2,18 +2,32 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 #include <google/protobuf/descriptor.h>
+#include <sys/stat.h>
+
+#include <deque>
+#include <shared_mutex>
 
 #include "mr/impl/dest_file_set.h"
 
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "base/hash.h"
 #include "base/logging.h"
+#include "base/memory_account.h"
+#include "base/varint.h"
+#include "base/walltime.h"
 
 #include "file/file_util.h"
 #include "file/filesource.h"
 #include "file/gzip_file.h"
 #include "file/proto_writer.h"
 
+#include "mr/impl/columnar_format.h"
+#include "mr/impl/external_sorter.h"
+#include "mr/impl/memory_shard_store.h"
+#include "mr/output.h"
+#include "mr/pod_traits.h"
+
 #include "util/asio/io_context_pool.h"
 #include "util/gce/gcs.h"
 #include "util/zlib_source.h"
@@ -22,6 +36,10 @@
 namespace mr3 {
 
 DEFINE_uint32(gcs_connect_deadline_ms, 2000, "Deadline in milliseconds when connecting to GCS");
+DEFINE_uint32(gcs_compose_part_mb, 0,
+              "If positive, GCS outputs are uploaded as parts of this size over several "
+              "connections and the parts are composed into the output file on close");
+DEFINE_uint32(gcs_compose_parallel, 4, "Number of parts of a GCS output that are uploaded at once");
 
 namespace detail {
 
@@ -32,17 +50,54 @@ namespace detail {
 // TODO: to implement compress directly using zlib interface an not using zlibsink/stringsink
 // abstractions.
 DEFINE_bool(dest_file_force_gzfile, true, "");
+DEFINE_uint32(columnar_block_rows, 8192, "Number of records in each block of COLUMNAR outputs");
+DEFINE_uint32(sort_output_buffer_mb, 512,
+              "Memory budget for buffering the records of sorted outputs in each process. "
+              "Once passed, the largest shards are spilled as sorted runs into sort_spill_dir.");
+DEFINE_string(sort_spill_dir, "/tmp", "Local directory for the sorted runs of sorted outputs.");
+DEFINE_uint32(lst_output_async_blocks, 4,
+              "Number of blocks of each LST output that are compressed and written in the file "
+              "thread pool while the next one is filled. 0 writes them in the calling thread");
+DEFINE_bool(dest_file_fast_intermediate, false,
+            "Writes the outputs consumed by the following operators uncompressed, ignoring "
+            "their compression settings. They are read once, hence compressing them mostly "
+            "wastes CPU. LocalRunner reads such local files with mmap");
+DEFINE_uint32(dest_close_fibers, 16,
+              "Number of fibers in each IO thread that close the output shards when "
+              "the operator ends");
 
 using namespace boost;
 using namespace std;
 using namespace util;
+using fibers_ext::SharedMutex;
 
 namespace {
 
 constexpr size_t kBufLimit = 1 << 16;
 
-string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard) {
+// Number of gzip members of each handle that may be compressed concurrently.
+constexpr size_t kMaxPendingMembers = 8;
+
+// LST meta key of the schema of PodTraits records.
+constexpr char kPodTypeKey[] = "__pod_type__";
+
+// The sort buffers and the compressed blocks that are queued for writing.
+base::MemoryAccount* DestAccount() {
+  static base::MemoryAccount* res = base::MemoryAccount::Get("mr.dest_files");
+  return res;
+}
+
+string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard, int32 worker) {
   string res(base);
+  if (worker >= 0) {
+    CHECK_LT(worker, 1000);
+    if (sub_shard >= 0) {
+      absl::StrAppend(&res, "-w", absl::Dec(worker, absl::kZeroPad3));
+    } else {
+      absl::StrAppend(&res, "-w[0-9][0-9][0-9]");
+    }
+  }
+
   if (pb_out.shard_spec().has_max_raw_size_mb()) {
     if (sub_shard >= 0) {
       absl::StrAppend(&res, "-", absl::Dec(sub_shard, absl::kZeroPad3));
@@ -53,7 +108,7 @@ string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard) {
 
   if (pb_out.format().type() == pb::WireFormat::TXT) {
     absl::StrAppend(&res, ".txt");
-    if (pb_out.has_compress()) {
+    if (pb_out.has_compress() && !IsFastIntermediate(pb_out)) {
       switch (pb_out.compress().type()) {
         case pb::Output::GZIP:
           absl::StrAppend(&res, ".gz");
@@ -68,6 +123,9 @@ string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard) {
   } else if (pb_out.format().type() == pb::WireFormat::LST) {
     CHECK(!pb_out.has_compress()) << "Can not set compression on LST files";
     absl::StrAppend(&res, ".lst");
+  } else if (pb_out.format().type() == pb::WireFormat::COLUMNAR) {
+    CHECK(!pb_out.has_compress()) << "Can not set compression on COLUMNAR files";
+    absl::StrAppend(&res, ".col");
   } else {
     LOG(FATAL) << "Unsupported format for " << pb_out.ShortDebugString();
   }
@@ -75,48 +133,151 @@ string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard) {
   return res;
 }
 
+bool DecodeSortKey(absl::string_view rec, absl::string_view* key, absl::string_view* value) {
+  const uint8* ptr = reinterpret_cast<const uint8*>(rec.data());
+  const uint8* end = ptr + rec.size();
+  uint32_t key_size = 0;
+
+  ptr = Varint::Parse32WithLimit(ptr, end, &key_size);
+  if (!ptr || size_t(end - ptr) < key_size)
+    return false;
+
+  const char* cptr = reinterpret_cast<const char*>(ptr);
+  *key = absl::string_view(cptr, key_size);
+  *value = absl::string_view(cptr + key_size, end - ptr - key_size);
+  return true;
+}
+
+file::WriteFile* OpenLocalFile(const pb::Output& output, const std::string& path) {
+  file::OpenOptions opts;
+  opts.direct = output.direct_io();
+  return file::Open(path, opts);
+}
+
 inline auto WriteCb(std::string&& s, file::WriteFile* wf) {
+  DestAccount()->Charge(s.size());
   return [b = std::move(s), wf] {
     auto status = wf->Write(b);
     CHECK_STATUS(status);
+    DestAccount()->Release(b.size());
   };
 }
 
+/*! Uploads a GCS object from a fiber of an IO thread while its handle produces the bytes, so
+ *  that the upload overlaps with the computation and Close only sends the last chunk.
+ *  GCS::Write sends every 2^gcs_upload_buf_log_size bytes as a chunk of a resumable upload,
+ *  unless gcs_compose_part_mb uploads the object as composed parts.
+ */
+class GcsUploader : public util::Sink {
+ public:
+  GcsUploader(DestFileSet* owner, const string& path, uint32_t queue_index);
+
+  //! Thread-safe. Queues str for the upload, the order of the calls is preserved.
+  void Push(string&& str);
+
+  //! Buffers the slice and pushes the buffer once it reaches kBufLimit. Not thread-safe.
+  Status Append(const strings::ByteRange& slice) final;
+
+  //! Uploads the rest and finalizes the object. Drops the upload if abort_write is true.
+  void Close(bool abort_write);
+
+  //! The size of the object, valid after Close.
+  size_t uploaded_bytes() const { return uploaded_bytes_; }
+
+ private:
+  string buf_;
+  size_t uploaded_bytes_ = 0;  // updated by the write fiber.
+  unique_ptr<fibers_ext::FiberQueue> out_queue_;
+  GcsPool::Handle gcs_;
+  unique_ptr<GcsComposeWriter> compose_writer_;  // replaces gcs_ in compose mode.
+  fibers::fiber write_fiber_;
+};
+
+// Uncompressed text outputs on GCS. Records are coalesced into kBufLimit buffers.
+class GcsHandle final : public DestHandle {
+ public:
+  using DestHandle::DestHandle;
+
+  void Write(RecordBatch&& batch) final;
+  void Close(bool abort_write) final;
+
+ private:
+  void Open() final;
+
+  unique_ptr<GcsUploader> uploader_;
+  fibers::mutex mu_;
+};
+
 class CompressHandle : public DestHandle {
  public:
   CompressHandle(DestFileSet* owner, const ShardId& sid);
 
-  void Write(StringGenCb str) override;
+  void Write(RecordBatch&& batch) override;
   void Close(bool abort_write) override;
 
  private:
+  // Independent gzip member that is compressed in the file thread pool.
+  struct Member {
+    string data;
+    fibers_ext::Done done;
+  };
+
   void Open() override;
-  void GcsWriteFiber();
+
+  // Writes str into the destination file.
+  void PushOut(string&& str);
+
+  // Compresses raw as a new member. Called under zmu_ to preserve the order of members.
+  void AddMember(string&& raw);
+
+  // Writes the compressed members in order until at most max_pending of them remain.
+  void FlushMembers(size_t max_pending);
 
   size_t start_delta_ = 0;
   util::StringSink* compress_out_buf_ = nullptr;
   unique_ptr<util::Sink> compress_sink_;
 
+  size_t member_size_ = 0;  // non-zero if the output is written as independent gzip members.
+  string member_raw_;
+  std::deque<std::shared_ptr<Member>> pending_members_;
+
   fibers::mutex zmu_;
-  unique_ptr<fibers_ext::FiberQueue> out_queue_;
-  unique_ptr<GCS> gcs_;
-  fibers::fiber write_fiber_;
+  fibers::mutex member_mu_;  // serializes FlushMembers.
+  unique_ptr<GcsUploader> uploader_;
 };
 
 class LstHandle : public DestHandle {
  public:
   LstHandle(DestFileSet* owner, const ShardId& sid);
 
-  void Write(StringGenCb cb) final;
+  void Write(RecordBatch&& batch) override;
   void Close(bool abort_write) override;
 
- private:
+ protected:
   void Open() override;
 
   std::unique_ptr<file::ListWriter> lst_writer_;
+  GcsUploader* uploader_ = nullptr;  // the sink of lst_writer_ on GCS, owned by it.
   boost::fibers::mutex mu_;
 };
 
+// Buffers the records and writes each block of columnar_block_rows records as a single
+// list record.
+class ColumnarHandle final : public LstHandle {
+ public:
+  using LstHandle::LstHandle;
+
+  void Write(RecordBatch&& batch) final;
+  void Close(bool abort_write) final;
+
+ private:
+  void Open() final;
+  void FlushBlock();
+
+  std::unique_ptr<ColumnarWriter> writer_;
+  std::string block_;
+};
+
 CompressHandle::CompressHandle(DestFileSet* owner, const ShardId& sid)
     : DestHandle(owner, sid), compress_out_buf_(new StringSink) {
   static std::default_random_engine rnd;
@@ -124,99 +285,217 @@ CompressHandle::CompressHandle(DestFileSet* owner, const ShardId& sid)
   // Randomize when we flush first for each handle. That should define uniform flushing cycle
   // for all handles.
   start_delta_ = rnd() % (kBufLimit - 1);
-  auto level = owner->output().compress().level();
-  if (owner->output().compress().type() == pb::Output::GZIP) {
+  const pb::Output::Compress& compress = owner->output().compress();
+  auto level = compress.level();
+  if (compress.member_size_kb()) {
+    CHECK_EQ(pb::Output::GZIP, compress.type());
+    member_size_ = size_t(compress.member_size_kb()) << 10;
+    member_raw_.reserve(member_size_);
+  } else if (compress.type() == pb::Output::GZIP) {
     compress_sink_.reset(new ZlibSink(compress_out_buf_, level));
-  } else if (owner->output().compress().type() == pb::Output::ZSTD) {
+  } else if (compress.type() == pb::Output::ZSTD) {
+    ZStdSink::Options opts;
+    opts.level = level;
+    opts.workers = compress.zstd_workers();
+    opts.long_distance = compress.zstd_long_distance();
+    opts.window_log = compress.zstd_window_log();
+    opts.seekable_frame_size = size_t(compress.zstd_seekable_frame_kb()) << 10;
+
     std::unique_ptr<ZStdSink> zsink{new ZStdSink(compress_out_buf_)};
-    CHECK_STATUS(zsink->Init(level));
+    CHECK_STATUS(zsink->Init(opts));
     compress_sink_ = std::move(zsink);
   }
 }
 
-void CompressHandle::Open() {
-  if (owner_->is_gcs_dest()) {
-    size_t index = queue_index_ % owner_->io_pool()->size();
-    absl::string_view bucket, path;
-    CHECK(GCS::SplitToBucketPath(full_path_, &bucket, &path));
+GcsUploader::GcsUploader(DestFileSet* owner, const string& full_path, uint32_t queue_index) {
+  absl::string_view bucket, path;
+  CHECK(GCS::SplitToBucketPath(full_path, &bucket, &path));
 
-    IoContext& io_context = owner_->io_pool()->at(index);
-    gcs_.reset(new util::GCS(*owner_->gce(), &io_context));
+  IoContext& io_context = owner->io_pool()->at(queue_index % owner->io_pool()->size());
+  if (FLAGS_gcs_compose_part_mb) {
+    GcsComposeWriter::Options opts;
+    opts.part_size = size_t(FLAGS_gcs_compose_part_mb) << 20;
+    opts.max_parallel = FLAGS_gcs_compose_parallel;
+    compose_writer_.reset(new GcsComposeWriter(owner->gcs_pool(), bucket, path, opts));
+  } else {
     io_context.AwaitSafe([&] {
-      CHECK_STATUS(gcs_->Connect(FLAGS_gcs_connect_deadline_ms));
+      auto res = owner->gcs_pool()->Get();
+      CHECK_STATUS(res.status);
+      gcs_ = std::move(res.obj);
       CHECK_STATUS(gcs_->OpenForWrite(bucket, path));
     });
+  }
 
-    out_queue_.reset(new fibers_ext::FiberQueue(32));
-    write_fiber_ = io_context.LaunchFiber([this] { GcsWriteFiber(); });
-  } else {
-    write_file_ = Await([&] { return file::Open(full_path_); });
-    CHECK(write_file_);
+  out_queue_.reset(new fibers_ext::FiberQueue(32));
+  write_fiber_ = io_context.LaunchFiber([this] {
+    // We want write fiber to have higher priority and initiate write as fast as possible.
+    this_fiber::properties<IoFiberProperties>().SetNiceLevel(1);
+
+    out_queue_->Run();
+  });
+}
+
+void GcsUploader::Push(string&& str) {
+  DestAccount()->Charge(str.size());
+  out_queue_->Add([this, str = std::move(str)] {
+    if (compose_writer_) {
+      CHECK_STATUS(compose_writer_->Write(strings::ToByteRange(str)));
+    } else {
+      CHECK_STATUS(gcs_->Write(strings::ToByteRange(str)));
+    }
+    uploaded_bytes_ += str.size();
+    DestAccount()->Release(str.size());
+  });
+}
+
+Status GcsUploader::Append(const strings::ByteRange& slice) {
+  buf_.append(reinterpret_cast<const char*>(slice.data()), slice.size());
+  if (buf_.size() >= kBufLimit) {
+    Push(std::move(buf_));
+    buf_.clear();
   }
+  return Status::OK;
+}
+
+void GcsUploader::Close(bool abort_write) {
+  if (!abort_write && !buf_.empty()) {
+    Push(std::move(buf_));
+  }
+
+  out_queue_->Await([this, abort_write] {
+    if (compose_writer_) {
+      CHECK_STATUS(compose_writer_->Close(abort_write));
+      compose_writer_.reset();
+    } else {
+      CHECK_STATUS(gcs_->CloseWrite(abort_write));
+      gcs_.reset();
+    }
+  });
+  out_queue_->Shutdown();
+  write_fiber_.join();
 }
 
-void CompressHandle::GcsWriteFiber() {
-  // We want write fiber to have higher priority and initiate write as fast as possible.
-  this_fiber::properties<IoFiberProperties>().SetNiceLevel(1);
+void GcsHandle::Open() { uploader_.reset(new GcsUploader(owner_, full_path_, queue_index_)); }
 
-  out_queue_->Run();
+void GcsHandle::Write(RecordBatch&& batch) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  batch.ForEach([this](absl::string_view record) {
+    CHECK_STATUS(uploader_->Append(strings::ToByteRange(record)));
+  });
 }
 
-// CompressHandle::Write runs in "other" threads, no necessarily where we write the data into.
-void CompressHandle::Write(StringGenCb cb) {
-  absl::optional<string> tmp_str;
-  while (true) {
-    tmp_str = cb();
-    if (!tmp_str)
-      break;
+void GcsHandle::Close(bool abort_write) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  uploader_->Close(abort_write);
+  AddFiles(1, uploader_->uploaded_bytes());
+}
+
+void CompressHandle::Open() {
+  if (owner_->is_gcs_dest()) {
+    uploader_.reset(new GcsUploader(owner_, full_path_, queue_index_));
+  } else {
+    write_file_ = Await([&] { return OpenLocalFile(owner_->output(), full_path_); });
+    CHECK(write_file_);
+  }
+}
 
+// CompressHandle::Write runs in "other" threads, no necessarily where we write the data into.
+void CompressHandle::Write(RecordBatch&& batch) {
+  for (size_t i = 0; i < batch.size(); ++i) {
+    absl::string_view record = batch[i];
     std::unique_lock<fibers::mutex> lk(zmu_);
 
-    strings::ByteRange br = strings::ToByteRange(*tmp_str);
+    if (member_size_) {
+      member_raw_.append(record.data(), record.size());
+      if (member_raw_.size() >= member_size_) {
+        AddMember(std::move(member_raw_));
+        member_raw_.clear();
+        member_raw_.reserve(member_size_);
+        lk.unlock();
+
+        FlushMembers(kMaxPendingMembers);
+      }
+      continue;
+    }
+
+    strings::ByteRange br = strings::ToByteRange(record);
     CHECK_STATUS(compress_sink_->Append(br));
     if (compress_out_buf_->contents().size() >= kBufLimit - start_delta_) {
-      tmp_str->clear();
-      tmp_str->swap(compress_out_buf_->contents());
+      string out;
+      out.swap(compress_out_buf_->contents());
 
       lk.unlock();
 
-      if (out_queue_) {
-        out_queue_->Add([this, str = std::move(*tmp_str)] {
-          CHECK_STATUS(gcs_->Write(strings::ToByteRange(str)));
-        });
-      } else {
-        // TODO: To support io_context based write-files like with GCS.
-        owner_->pool()->Add(queue_index_, WriteCb(std::move(*tmp_str), write_file_));
-      }
+      PushOut(std::move(out));
       start_delta_ = 0;
     }
   }
 }
 
+void CompressHandle::PushOut(string&& str) {
+  if (uploader_) {  // GCS flow.
+    uploader_->Push(std::move(str));
+  } else {
+    // TODO: To support io_context based write-files like with GCS.
+    owner_->pool()->Add(queue_index_, WriteCb(std::move(str), write_file_));
+  }
+}
+
+void CompressHandle::AddMember(string&& raw) {
+  auto member = std::make_shared<Member>();
+  pending_members_.push_back(member);
+
+  unsigned level = owner_->output().compress().level();
+
+  // Write runs in IO threads, hence adding to the file pool can not deadlock its workers.
+  owner_->pool()->Add([member, level, raw = std::move(raw)] {
+    CHECK_STATUS(GzipMemberCompress(strings::ToByteRange(raw), level, &member->data));
+    member->done.Notify();
+  });
+}
+
+void CompressHandle::FlushMembers(size_t max_pending) {
+  std::lock_guard<fibers::mutex> lk(member_mu_);
+
+  while (true) {
+    std::shared_ptr<Member> member;
+    {
+      std::lock_guard<fibers::mutex> zlk(zmu_);
+      if (pending_members_.size() <= max_pending)
+        break;
+      member = std::move(pending_members_.front());
+      pending_members_.pop_front();
+    }
+    member->done.Wait();
+    PushOut(std::move(member->data));
+  }
+}
+
 void CompressHandle::Close(bool abort_write) {
-  if (!abort_write) {
+  if (member_size_) {
+    if (abort_write) {
+      // The compression tasks own their members, no need to wait for them.
+      std::lock_guard<fibers::mutex> lk(zmu_);
+      pending_members_.clear();
+    } else {
+      if (!member_raw_.empty()) {
+        std::lock_guard<fibers::mutex> lk(zmu_);
+        AddMember(std::move(member_raw_));
+      }
+      FlushMembers(0);
+    }
+  } else if (!abort_write) {
     CHECK_STATUS(compress_sink_->Flush());
 
     auto& buf = compress_out_buf_->contents();
     if (!buf.empty()) {
-      if (out_queue_) {  // GCS flow.
-        out_queue_->Add([this, str = std::move(buf)] {
-          CHECK_STATUS(gcs_->Write(strings::ToByteRange(str)));
-        });
-      } else {
-        owner_->pool()->Add(queue_index_,
-                          WriteCb(std::move(buf), write_file_));
-      }
+      PushOut(std::move(buf));
     }
   }
 
-  if (out_queue_) {
-    out_queue_->Await([this, abort_write] {
-      CHECK_STATUS(gcs_->CloseWrite(abort_write));
-      gcs_.reset();
-    });
-    out_queue_->Shutdown();
-    write_fiber_.join();
+  if (uploader_) {
+    uploader_->Close(abort_write);
+    AddFiles(1, uploader_->uploaded_bytes());
   } else {
     DestHandle::Close(abort_write);
   }
@@ -225,31 +504,43 @@ void CompressHandle::Close(bool abort_write) {
 LstHandle::LstHandle(DestFileSet* owner, const ShardId& sid) : DestHandle(owner, sid) {}
 
 // TODO: Support lst writing via thread_pool to avoit locks on disk I/O.
-// Instead of StringGenCb we could support vector<string> and with text case it will be 1-cell
-// vector.
-void LstHandle::Write(StringGenCb cb) {
-  absl::optional<string> tmp_str;
+void LstHandle::Write(RecordBatch&& batch) {
   std::unique_lock<fibers::mutex> lk(mu_);
-  while (true) {
-    tmp_str = cb();
-    if (!tmp_str)
-      break;
-    CHECK_STATUS(lst_writer_->AddRecord(*tmp_str));
-  }
+  batch.ForEach([this](absl::string_view record) {
+    CHECK_STATUS(lst_writer_->AddRecord(record));
+  });
 }
 
 void LstHandle::Open() {
   CHECK(!owner_->output().has_compress());
-  DestHandle::Open();
   namespace gpb = google::protobuf;
 
-  util::Sink* fs = new file::Sink{write_file_, DO_NOT_TAKE_OWNERSHIP};
-  lst_writer_.reset(new file::ListWriter{fs});
-  if (!owner_->output().type_name().empty()) {
-    lst_writer_->AddMeta(file::kProtoTypeKey, owner_->output().type_name());
+  util::Sink* fs;
+  if (owner_->is_gcs_dest()) {
+    uploader_ = new GcsUploader(owner_, full_path_, queue_index_);
+    fs = uploader_;
+  } else {
+    DestHandle::Open();
+    fs = new file::Sink{write_file_, DO_NOT_TAKE_OWNERSHIP};
+  }
+  file::ListWriter::Options opts;
+  opts.use_compression = !IsFastIntermediate(owner_->output());
+  if (FLAGS_lst_output_async_blocks) {
+    // Write runs in IO threads, hence the writer does not wait for the pool from its threads.
+    opts.async_blocks = FLAGS_lst_output_async_blocks;
+    opts.async_executor = [pool = owner_->pool(), index = queue_index_](std::function<void()> f) {
+      pool->Add(index, std::move(f));
+    };
+  }
+  lst_writer_.reset(new file::ListWriter{fs, opts});
+  const string& type_name = owner_->output().type_name();
+  if (absl::StartsWith(type_name, kPodTypePrefix)) {
+    lst_writer_->AddMeta(kPodTypeKey, type_name);
+  } else if (!type_name.empty()) {
+    lst_writer_->AddMeta(file::kProtoTypeKey, type_name);
 
     const gpb::DescriptorPool* gen_pool = gpb::DescriptorPool::generated_pool();
-    const gpb::Descriptor* descr = gen_pool->FindMessageTypeByName(owner_->output().type_name());
+    const gpb::Descriptor* descr = gen_pool->FindMessageTypeByName(type_name);
 
     CHECK(descr);  // TODO: should we support more cases besides pb?
     lst_writer_->AddMeta(file::kProtoSetKey, file::GenerateSerializedFdSet(descr));
@@ -261,11 +552,193 @@ void LstHandle::Open() {
 void LstHandle::Close(bool abort_write) {
   CHECK_STATUS(lst_writer_->Flush());
 
-  DestHandle::Close(abort_write);
+  if (uploader_) {
+    uploader_->Close(abort_write);
+    AddFiles(1, uploader_->uploaded_bytes());
+  } else {
+    DestHandle::Close(abort_write);
+  }
+}
+
+void ColumnarHandle::Open() {
+  const string& type_name = owner_->output().type_name();
+  CHECK(!type_name.empty()) << "COLUMNAR format requires protobuf records";
+
+  const auto* descr =
+      google::protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(type_name);
+  CHECK(descr) << type_name;
+  writer_.reset(new ColumnarWriter{descr});
+
+  LstHandle::Open();
+}
+
+void ColumnarHandle::Write(RecordBatch&& batch) {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  batch.ForEach([this](absl::string_view record) {
+    CHECK(writer_->Add(record)) << "Could not parse " << owner_->output().type_name();
+    if (writer_->num_rows() >= FLAGS_columnar_block_rows) {
+      FlushBlock();
+    }
+  });
 }
 
-bool AllowCompressHandle(const pb::Output::Compress& pb_cmpr) {
-  return !(FLAGS_dest_file_force_gzfile && pb_cmpr.type() == pb::Output::GZIP);
+void ColumnarHandle::Close(bool abort_write) {
+  if (!abort_write && writer_->num_rows()) {
+    FlushBlock();
+  }
+  LstHandle::Close(abort_write);
+}
+
+void ColumnarHandle::FlushBlock() {
+  writer_->SerializeBlock(&block_);
+  CHECK_STATUS(lst_writer_->AddRecord(block_));
+}
+
+// Keeps the records of the shard in MemoryShardStore. When the store runs out of budget,
+// the rest of the records are forwarded to a regular file handle.
+class MemoryHandle : public DestHandle {
+ public:
+  MemoryHandle(DestFileSet* owner, const ShardId& sid, MemoryShardStore* store,
+               MemoryShard* shard)
+      : DestHandle(owner, sid), store_(store), shard_(shard) {}
+
+  void Write(RecordBatch&& batch) final;
+  void Close(bool abort_write) final;
+
+ private:
+  void Open() final {}
+
+  MemoryShardStore* store_;
+  MemoryShard* shard_;
+  std::unique_ptr<DestHandle> spill_;
+  boost::fibers::mutex mu_;
+};
+
+void MemoryHandle::Write(RecordBatch&& batch) {
+  size_t index = 0;
+
+  std::unique_lock<fibers::mutex> lk(mu_);
+  for (; !spill_ && index < batch.size(); ++index) {
+    absl::string_view record = batch[index];
+    if (store_->TryReserve(record.size())) {
+      shard_->Append(record);
+      continue;
+    }
+
+    LOG(INFO) << "Memory budget of " << store_->budget() << " bytes is exhausted, spilling "
+              << owner_->ShardFilePath(sid_, -1);
+    spill_ = owner_->CreateFileHandle(sid_);
+    shard_->set_spilled();
+    break;
+  }
+  if (!spill_)
+    return;
+  lk.unlock();
+
+  batch.EraseFront(index);
+  spill_->Write(std::move(batch));
+}
+
+void MemoryHandle::Close(bool abort_write) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  if (spill_) {
+    spill_->Close(abort_write);
+    AddClosedStats(*spill_);
+  }
+}
+
+// Sorts the records of the shard by the key they were written with. Keyed records are buffered
+// by ExternalSorter and are merged into the wrapped handle when the shard is closed.
+class SortedHandle final : public DestHandle {
+ public:
+  SortedHandle(DestFileSet* owner, const ShardId& sid, std::unique_ptr<DestHandle> dest)
+      : DestHandle(owner, sid), dest_(std::move(dest)),
+        sorter_(size_t(FLAGS_sort_output_buffer_mb) << 20, FLAGS_sort_spill_dir) {}
+
+  void Write(RecordBatch&& batch) final;
+  void Close(bool abort_write) final;
+
+ private:
+  void Open() final {}
+
+  // Writes the sorted records into dest_.
+  void MergeInto();
+
+  // Spilling small buffers of many shards would produce lots of tiny runs.
+  static constexpr size_t kMinSpillBytes = 1 << 20;
+
+  std::unique_ptr<DestHandle> dest_;
+  ExternalSorter sorter_;
+  size_t accounted_ = 0;  // buffered bytes accounted in DestFileSet.
+  boost::fibers::mutex mu_;
+};
+
+void SortedHandle::Write(RecordBatch&& batch) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  batch.ForEach([this](absl::string_view record) {
+    absl::string_view key, value;
+    CHECK(DecodeSortKey(record, &key, &value)) << "Bad sorted record for " << full_path_;
+    sorter_.Add(key, 0, value);
+  });
+
+  size_t buffered = sorter_.buffered_bytes();
+  int64_t total = owner_->AddSortBytes(int64_t(buffered) - int64_t(accounted_));
+  accounted_ = buffered;
+
+  if (total > int64_t(FLAGS_sort_output_buffer_mb) << 20 && buffered >= kMinSpillBytes) {
+    VLOG(1) << "Spilling " << buffered << " bytes of " << full_path_;
+    sorter_.Spill();
+    owner_->AddSortBytes(-int64_t(accounted_));
+    accounted_ = 0;
+  }
+}
+
+void SortedHandle::Close(bool abort_write) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  if (!abort_write) {
+    MergeInto();
+  }
+  owner_->AddSortBytes(-int64_t(accounted_));
+  accounted_ = 0;
+
+  dest_->Close(abort_write);
+  AddClosedStats(*dest_);
+}
+
+void SortedHandle::MergeInto() {
+  constexpr size_t kFlushLimit = 1 << 16;
+  const bool is_binary = IsBinary(owner_->output().format().type());
+
+  // Records are passed to dest_ in batches and in their sorted order.
+  RecordBatch batch(is_binary);
+  size_t batch_size = 0;
+
+  auto flush = [&] {
+    dest_->Write(std::move(batch));
+    batch = RecordBatch(is_binary);
+    batch.Reserve(kFlushLimit);
+    batch_size = 0;
+  };
+
+  VLOG(1) << "Merging " << sorter_.num_runs() << " runs into " << dest_->full_path();
+  sorter_.Merge([&](absl::string_view key, uint32_t tag, absl::string_view value) {
+    batch.Add(value);
+    batch_size += value.size() + 1;
+    if (batch_size >= kFlushLimit)
+      flush();
+  });
+  if (batch_size)
+    flush();
+}
+
+bool AllowCompressHandle(const pb::Output& pb_out) {
+  // GzipFile writes through the buffered file of zlib, hence direct outputs are compressed
+  // in memory unless they are split into sub-shards, which CompressHandle does not support.
+  // The same goes for parallel compression.
+  if ((pb_out.direct_io() || pb_out.compress().member_size_kb()) &&
+      !pb_out.shard_spec().has_max_raw_size_mb())
+    return true;
+  return !(FLAGS_dest_file_force_gzfile && pb_out.compress().type() == pb::Output::GZIP);
 }
 
 }  // namespace
@@ -278,92 +751,251 @@ DestFileSet::DestFileSet(const std::string& root_dir, const pb::Output& out,
 
 DestFileSet::~DestFileSet() {}
 
+DestHandle* DestFileSet::HandleSlot::Wait() {
+  DestHandle* dh = handle.load(std::memory_order_acquire);
+  if (!dh) {
+    ready_ec.await([&] { return (dh = handle.load(std::memory_order_acquire)) != nullptr; });
+  }
+  return dh;
+}
+
 // DestHandle is cached in each of the calling IO threads and the only contention happens
-// when a new handle shard is created.
+// when a new handle shard is created. The creation opens files or GCS connections,
+// hence it runs outside of the map lock and the other writers of the same shard wait for it.
 DestHandle* DestFileSet::GetOrCreate(const ShardId& sid) {
-  std::lock_guard<fibers::mutex> lk(mu_);
-  auto it = dest_files_.find(sid);
-  if (it == dest_files_.end()) {
-    std::unique_ptr<DestHandle> dh;
-
-    bool is_local_fs = !is_gcs_dest_;
-    if (is_local_fs) {
-      string shard_name = sid.ToString(absl::string_view{});
-      absl::string_view dir_name = file_util::DirName(shard_name);
-      if (dir_name.size() != shard_name.size()) {
-        string sub_dir = file_util::JoinPath(root_dir_, dir_name);
-        CHECK_STATUS(file_util::CreateSubDirIfNeeded(sub_dir)) << sub_dir;
-      }
-    }
-    if (pb_out_.format().type() == pb::WireFormat::LST) {
-      dh.reset(new LstHandle{this, sid});
-    } else if (pb_out_.has_compress() && pb_out_.format().type() == pb::WireFormat::TXT &&
-               (is_gcs_dest_ || AllowCompressHandle(pb_out_.compress()))) {
-      dh.reset(new CompressHandle{this, sid});
-    } else {
-      dh.reset(new DestHandle{this, sid});
-    }
-    if (pb_out_.shard_spec().has_max_raw_size_mb()) {
-      dh->set_raw_limit(size_t(1U << 20) * pb_out_.shard_spec().max_raw_size_mb());
+  MapShard& ms = map_shard(sid);
+  HandleSlot* slot = nullptr;
+  {
+    std::shared_lock<SharedMutex> lk(ms.mu);
+    auto it = ms.handles.find(sid);
+    if (it != ms.handles.end())
+      slot = it->second.get();
+  }
+  if (slot)
+    return slot->Wait();
+
+  bool created = false;
+  {
+    std::lock_guard<SharedMutex> lk(ms.mu);
+    auto res = ms.handles.emplace(sid, nullptr);
+    if (res.second) {
+      res.first->second.reset(new HandleSlot);
+      created = true;
     }
+    slot = res.first->second.get();
+  }
+  if (!created)  // Another fiber creates the handle.
+    return slot->Wait();
+
+  slot->owner = CreateHandle(sid);
+  DestHandle* dh = slot->owner.get();
+  slot->handle.store(dh, std::memory_order_release);
+  slot->ready_ec.notifyAll();
+
+  return dh;
+}
 
-    dh->Open();
-    VLOG(1) << "Open destination shard " << dh->full_path();
+std::unique_ptr<DestHandle> DestFileSet::CreateHandle(const ShardId& sid) {
+  std::unique_ptr<DestHandle> dh;
 
-    auto res = dest_files_.emplace(sid, std::move(dh));
-    CHECK(res.second);
-    it = res.first;
+  // The decision is taken lazily because pb_out_ may change after DestFileSet is created.
+  MemoryShardStore* store = nullptr;
+  if (pb_out_.intermediate()) {
+    store = pb_out_.cached() && cache_store_ ? cache_store_ : mem_store_;
+  }
+  if (store) {
+    bool is_binary = IsBinary(pb_out_.format().type());
+    MemoryShard* shard = store->GetOrCreate(ShardFilePath(sid, -1), is_binary);
+    dh.reset(new MemoryHandle{this, sid, store, shard});
+    VLOG(1) << "Open memory shard " << ShardFilePath(sid, -1);
+  } else {
+    dh = CreateFileHandle(sid);
   }
+  if (pb_out_.sorted()) {
+    dh.reset(new SortedHandle{this, sid, std::move(dh)});
+  }
+  return dh;
+}
 
-  return it->second.get();
+std::unique_ptr<DestHandle> DestFileSet::CreateFileHandle(const ShardId& sid) {
+  std::unique_ptr<DestHandle> dh;
+
+  bool is_local_fs = !is_gcs_dest_;
+  if (is_local_fs) {
+    string shard_name = sid.ToString(absl::string_view{});
+    absl::string_view dir_name = file_util::DirName(shard_name);
+    if (dir_name.size() != shard_name.size()) {
+      string sub_dir = file_util::JoinPath(root_dir_, dir_name);
+      CHECK_STATUS(file_util::CreateSubDirIfNeeded(sub_dir)) << sub_dir;
+    }
+  }
+  if (pb_out_.format().type() == pb::WireFormat::LST) {
+    dh.reset(new LstHandle{this, sid});
+  } else if (pb_out_.format().type() == pb::WireFormat::COLUMNAR) {
+    dh.reset(new ColumnarHandle{this, sid});
+  } else if (pb_out_.has_compress() && !IsFastIntermediate(pb_out_) &&
+             pb_out_.format().type() == pb::WireFormat::TXT &&
+             (is_gcs_dest_ || AllowCompressHandle(pb_out_))) {
+    dh.reset(new CompressHandle{this, sid});
+  } else if (is_gcs_dest_) {
+    dh.reset(new GcsHandle{this, sid});
+  } else {
+    dh.reset(new DestHandle{this, sid});
+  }
+  if (pb_out_.shard_spec().has_max_raw_size_mb()) {
+    const pb::ShardSpec& spec = pb_out_.shard_spec();
+    dh->set_raw_limit(size_t(1U << 20) * spec.max_raw_size_mb(),
+                      size_t(1U << 20) * spec.min_raw_size_mb());
+  }
+
+  dh->Open();
+  VLOG(1) << "Open destination shard " << dh->full_path();
+
+  return dh;
 }
 
-void DestFileSet::CloseAllHandles(bool abort_write) {
-  std::lock_guard<fibers::mutex> lk(mu_);
+void DestFileSet::CloseAllHandles(bool abort_write,
+                                  std::function<void(const ShardId&)> on_close) {
+  // All the callers lock the map shards in the same order.
+  for (auto& ms : map_shards_)
+    ms.mu.lock();
+
+  std::vector<std::pair<const ShardId*, DestHandle*>> handles;
+  for (auto& ms : map_shards_) {
+    for (auto& k_v : ms.handles) {
+      handles.emplace_back(&k_v.first, k_v.second->Wait());
+    }
+  }
+
+  // Closing a handle mostly waits for its flushes on the FiberQueueThreadPool, hence
+  // many handles are closed at once. Sorted shards are merged in parallel by IO threads.
+  std::atomic<size_t> next{0};
+  io_pool_.AwaitFiberOnAll([&](IoContext&) {
+    std::vector<fibers::fiber> closers;
+    for (unsigned i = 0; i < FLAGS_dest_close_fibers; ++i) {
+      closers.emplace_back([&] {
+        for (size_t index = next++; index < handles.size(); index = next++) {
+          DestHandle* dh = handles[index].second;
+          uint64_t start = base::GetMonotonicMicrosFast();
+          dh->Close(abort_write);
+          dh->AddWriteTime(base::GetMonotonicMicrosFast() - start);
+          if (on_close)
+            on_close(*handles[index].first);
+        }
+      });
+    }
+    for (auto& fb : closers) {
+      fb.join();
+    }
+  });
+  closed_stats_.resize(handles.size());
+  for (size_t i = 0; i < handles.size(); ++i) {
+    closed_stats_[i].first = *handles[i].first;
+    handles[i].second->GetStats(&closed_stats_[i].second);
+  }
 
-  for (auto& k_v : dest_files_) {
-    k_v.second->Close(abort_write);
+  for (auto& ms : map_shards_) {
+    ms.handles.clear();
+    ms.mu.unlock();
   }
-  dest_files_.clear();
 }
 
 std::string DestFileSet::ShardFilePath(const ShardId& key, int32 sub_shard) const {
   string shard_name = key.ToString(absl::StrCat(pb_out_.name(), "-", "shard"));
-  string file_name = FileName(shard_name, pb_out_, sub_shard);
+  string file_name = FileName(shard_name, pb_out_, sub_shard, worker_index_);
 
   return file_util::JoinPath(root_dir_, file_name);
 }
 
 void DestFileSet::CloseHandle(const ShardId& sid) {
-  DestHandle* dh = nullptr;
-
-  std::unique_lock<fibers::mutex> lk(mu_);
-  auto it = dest_files_.find(sid);
-  CHECK(it != dest_files_.end());
-  dh = it->second.get();
-  lk.unlock();
+  MapShard& ms = map_shard(sid);
+  HandleSlot* slot = nullptr;
+  {
+    std::shared_lock<SharedMutex> lk(ms.mu);
+    auto it = ms.handles.find(sid);
+    CHECK(it != ms.handles.end());
+    slot = it->second.get();
+  }
   VLOG(1) << "Closing handle " << ShardFilePath(sid, -1);
 
+  DestHandle* dh = slot->Wait();
+  uint64_t start = base::GetMonotonicMicrosFast();
   dh->Close(false);
+  dh->AddWriteTime(base::GetMonotonicMicrosFast() - start);
 }
 
 std::vector<ShardId> DestFileSet::GetShards() const {
   std::vector<ShardId> res;
-  res.reserve(dest_files_.size());
 
-  std::unique_lock<fibers::mutex> lk(mu_);
-  transform(begin(dest_files_), end(dest_files_), back_inserter(res),
-            [](const auto& pair) { return pair.first; });
+  for (const auto& ms : map_shards_) {
+    std::shared_lock<SharedMutex> lk(ms.mu);
+    transform(begin(ms.handles), end(ms.handles), back_inserter(res),
+              [](const auto& pair) { return pair.first; });
+  }
 
   return res;
 }
 
+int64_t DestFileSet::AddSortBytes(int64_t delta) {
+  if (delta > 0)
+    DestAccount()->Charge(delta);
+  else
+    DestAccount()->Release(-delta);
+  return sort_bytes_.fetch_add(delta, std::memory_order_relaxed) + delta;
+}
+
 size_t DestFileSet::HandleCount() const {
-  std::unique_lock<fibers::mutex> lk(mu_);
+  size_t res = 0;
+  for (const auto& ms : map_shards_) {
+    std::shared_lock<SharedMutex> lk(ms.mu);
+    res += ms.handles.size();
+  }
+  return res;
+}
 
-  return dest_files_.size();
+std::vector<std::pair<ShardId, size_t>> DestFileSet::GetShardBytes() const {
+  std::vector<std::pair<ShardId, size_t>> res;
+
+  for (const auto& ms : map_shards_) {
+    std::shared_lock<SharedMutex> lk(ms.mu);
+    for (const auto& k_v : ms.handles) {
+      // Handles that are still being opened have not written anything yet.
+      const DestHandle* dh = k_v.second->handle.load(std::memory_order_acquire);
+      res.emplace_back(k_v.first, dh ? dh->raw_bytes() : 0);
+    }
+  }
+  return res;
 }
 
+ShardStatsList DestFileSet::GetShardStats() const {
+  ShardStatsList res;
+
+  for (const auto& ms : map_shards_) {
+    std::shared_lock<SharedMutex> lk(ms.mu);
+    for (const auto& k_v : ms.handles) {
+      res.emplace_back(k_v.first, pb::ShardStats{});
+      if (const DestHandle* dh = k_v.second->handle.load(std::memory_order_acquire))
+        dh->GetStats(&res.back().second);
+    }
+  }
+  return res;
+}
+
+void RecordBatch::EraseFront(size_t count) {
+  if (count == 0)
+    return;
+  DCHECK_LE(count, size());
+  if (!is_binary_) {
+    data_.clear();
+    return;
+  }
+
+  uint32_t start = ends_[count - 1];
+  data_.erase(0, start);
+  ends_.erase(ends_.begin(), ends_.begin() + count);
+  for (auto& end : ends_)
+    end -= start;
+}
 
 DestHandle::DestHandle(DestFileSet* owner, const ShardId& sid) : owner_(owner), sid_(sid) {
   CHECK(owner_);
@@ -372,24 +1004,84 @@ DestHandle::DestHandle(DestFileSet* owner, const ShardId& sid) : owner_(owner),
   queue_index_ = base::Murmur32(full_path_, 120577U);
 }
 
-void DestHandle::AppendThreadLocal(const std::string& str) {
-  auto status = write_file_->Write(str);
-  CHECK_STATUS(status);
+void EncodeSortKey(absl::string_view key, absl::string_view record, std::string* dest) {
+  dest->clear();
+  Varint::Append32(dest, key.size());
+  dest->append(key.data(), key.size()).append(record.data(), record.size());
+}
+
+double ShardSkew(const ShardStatsList& stats) {
+  uint64_t total = 0, max_bytes = 0;
+  for (const auto& k_v : stats) {
+    total += k_v.second.raw_bytes();
+    max_bytes = std::max<uint64_t>(max_bytes, k_v.second.raw_bytes());
+  }
+  return total ? double(max_bytes) * stats.size() / total : 0;
+}
+
+std::string ShardSkewSummary(unsigned top_n, ShardStatsList* stats) {
+  uint64_t raw_bytes = 0, file_bytes = 0, records = 0;
+  for (const auto& k_v : *stats) {
+    raw_bytes += k_v.second.raw_bytes();
+    file_bytes += k_v.second.file_bytes();
+    records += k_v.second.records();
+  }
+
+  string res = absl::StrCat(stats->size(), " shards, ", raw_bytes, " raw bytes, ", file_bytes,
+                            " file bytes, ", records, " records, max/avg ",
+                            absl::SixDigits(ShardSkew(*stats)));
+  if (stats->empty())
+    return res;
+
+  size_t top = std::min<size_t>(top_n, stats->size());
+  std::partial_sort(stats->begin(), stats->begin() + top, stats->end(),
+                    [](const auto& l, const auto& r) {
+                      return l.second.raw_bytes() > r.second.raw_bytes();
+                    });
+  absl::StrAppend(&res, ", top:");
+  for (size_t i = 0; i < top; ++i) {
+    const pb::ShardStats& ss = (*stats)[i].second;
+    absl::StrAppend(&res, " ", (*stats)[i].first.ToString("shard"), " (", ss.raw_bytes(),
+                    " bytes, ", ss.records(), " records, ", ss.files(), " files, ",
+                    ss.write_usec() / 1000, "ms)");
+  }
+  return res;
+}
 
-  if (raw_limit_ < kuint64max) {
+bool IsFastIntermediate(const pb::Output& out) {
+  return FLAGS_dest_file_fast_intermediate && out.intermediate();
+}
+
+// Runs in the pool thread of queue_index_, hence the calls are serialized.
+void DestHandle::AppendThreadLocal(absl::string_view str) {
+  if (raw_size_ < raw_limit_) {
     raw_size_ += str.size();
-    if (raw_size_ >= raw_limit_) {
-      CHECK(write_file_->Close());
-      ++sub_shard_;
-      raw_size_ = 0;
-      full_path_ = owner_->ShardFilePath(sid_, sub_shard_);
-      write_file_ = OpenThreadLocal(owner_->output(), full_path_);
-    }
+    CHECK_STATUS(write_file_->Write(str));
+    return;
   }
+
+  // The current sub-shard is full. The next one is opened once it has enough data,
+  // otherwise the tail is appended to the current sub-shard by Close().
+  if (tail_.size() + str.size() < min_tail_) {
+    tail_.append(str.data(), str.size());
+    return;
+  }
+
+  CHECK(write_file_->Close());
+  ++sub_shard_;
+  full_path_ = owner_->ShardFilePath(sid_, sub_shard_);
+  write_file_ = OpenThreadLocal(owner_->output(), full_path_);
+
+  raw_size_ = tail_.size() + str.size();
+  if (!tail_.empty()) {
+    CHECK_STATUS(write_file_->Write(tail_));
+    tail_.clear();
+  }
+  CHECK_STATUS(write_file_->Write(str));
 }
 
 ::file::WriteFile* DestHandle::OpenThreadLocal(const pb::Output& output, const std::string& path) {
-  if (output.has_compress()) {
+  if (output.has_compress() && !IsFastIntermediate(output)) {
     if (output.compress().type() == pb::Output::GZIP) {
       CHECK(!util::IsGcsPath(path));
 
@@ -400,20 +1092,18 @@ void DestHandle::AppendThreadLocal(const std::string& str) {
     LOG(FATAL) << "Not supported " << output.compress().ShortDebugString();
   }
 
-  auto* wf = file::Open(path);
+  auto* wf = OpenLocalFile(output, path);
   CHECK(wf);
   return wf;
 }
 
-void DestHandle::Write(StringGenCb cb) {
-  absl::optional<string> tmp_str;
-  while (true) {
-    tmp_str = cb();
-    if (!tmp_str)
-      break;
-    owner_->pool()->Add(queue_index_,
-                        [this, str = std::move(*tmp_str)] { AppendThreadLocal(str); });
-  }
+void DestHandle::Write(RecordBatch&& batch) {
+  // The whole batch is written by a single task of the file thread.
+  owner_->pool()->Add(queue_index_, [this, batch = std::move(batch)] {
+    uint64_t start = base::GetMonotonicMicrosFast();
+    batch.ForEach([this](absl::string_view record) { AppendThreadLocal(record); });
+    AddWriteTime(base::GetMonotonicMicrosFast() - start);
+  });
 }
 
 void DestHandle::Open() {
@@ -433,11 +1123,40 @@ void DestHandle::Close(bool abort_write) {
     return;
 
   bool res = Await([this] {
+    if (!tail_.empty()) {
+      VLOG(1) << "Coalescing " << tail_.size() << " bytes into " << full_path_;
+      CHECK_STATUS(write_file_->Write(tail_));
+      tail_.clear();
+    }
     VLOG(1) << "Closing file " << write_file_->create_file_name();
     return write_file_->Close();
   });
   CHECK(res);
   write_file_ = nullptr;
+  if (abort_write)
+    return;
+
+  size_t bytes = 0;
+  for (uint32_t i = 0; i <= sub_shard_; ++i) {
+    struct stat st;
+    if (stat(owner_->ShardFilePath(sid_, i).c_str(), &st) == 0)
+      bytes += st.st_size;
+  }
+  AddFiles(sub_shard_ + 1, bytes);
+}
+
+void DestHandle::GetStats(pb::ShardStats* stats) const {
+  stats->set_raw_bytes(raw_bytes());
+  stats->set_records(records_.load(std::memory_order_relaxed));
+  stats->set_file_bytes(file_bytes_.load(std::memory_order_relaxed));
+  stats->set_files(files_.load(std::memory_order_relaxed));
+  stats->set_write_usec(write_usec_.load(std::memory_order_relaxed));
+}
+
+void DestHandle::AddClosedStats(const DestHandle& dh) {
+  AddFiles(dh.files_.load(std::memory_order_relaxed),
+           dh.file_bytes_.load(std::memory_order_relaxed));
+  AddWriteTime(dh.write_usec_.load(std::memory_order_relaxed));
 }
 
 }  // namespace detail
@@ -4,24 +4,33 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+
 #include "absl/container/flat_hash_map.h"
-#include "absl/types/optional.h"
+#include "absl/strings/string_view.h"
 #include "mr/mr3.pb.h"
 
+#include "base/logging.h"
 #include "file/file.h"
 #include "file/list_file.h"
 #include "mr/mr_types.h"
+#include "util/fibers/event_count.h"
 #include "util/fibers/fiberqueue_threadpool.h"
+#include "util/fibers/shared_mutex.h"
 
 namespace util {
 class IoContextPool;
-class GCE;
+class GcsPool;
 }  // namespace util
 
 namespace mr3 {
 namespace detail {
 
 class DestHandle;
+class MemoryShardStore;
+
+typedef std::vector<std::pair<ShardId, pb::ShardStats>> ShardStatsList;
 
 /*! Designed to be process-central data structure holding all the destination handles during
  *  the operator execution.
@@ -38,7 +47,11 @@ class DestFileSet {
   //! Closes and deletes all the handles. If abort_write is true, the manager may
   //! delete or drop output files without finalizing them properly.
   //! Useful when we break in the middle of the run.
-  void CloseAllHandles(bool abort_write);
+  //! The handles are closed concurrently by fibers of all IO threads. on_close, if set, is
+  //! called with every shard once its handle is closed.
+  //! The stats of the closed shards are kept, see closed_stats().
+  void CloseAllHandles(bool abort_write,
+                       std::function<void(const ShardId&)> on_close = nullptr);
 
   /// Returns full file path of the shard.
   /// if sub_shard is < 0, returns the glob of all files corresponding to this shard.
@@ -54,25 +67,85 @@ class DestFileSet {
 
   size_t HandleCount() const;
 
+  //! Returns raw bytes written into each shard so far.
+  std::vector<std::pair<ShardId, size_t>> GetShardBytes() const;
+
+  //! Returns what was written into each shard so far. The file sizes are known only for the
+  //! shards that were closed.
+  ShardStatsList GetShardStats() const;
+
+  //! The stats of all the shards, set by CloseAllHandles.
+  const ShardStatsList& closed_stats() const { return closed_stats_; }
+
   // Closes the handle but leaves it in the map.
   // GatherAll will still return it.
   void CloseHandle(const ShardId& key);
 
   const pb::Output& output() const { return pb_out_; }
 
-  void set_gce(const util::GCE* gce) { gce_ = gce;}
-  const util::GCE* gce() const { return gce_;}
+  //! GCS destinations are written over the handles of the pool.
+  void set_gcs_pool(util::GcsPool* pool) { gcs_pool_ = pool; }
+  util::GcsPool* gcs_pool() const { return gcs_pool_; }
 
   bool is_gcs_dest() const { return is_gcs_dest_; }
 
   util::IoContextPool* io_pool() { return &io_pool_;}
 
+  //! If set, intermediate outputs are kept in mem_store instead of being written to disk.
+  void set_memory_store(MemoryShardStore* mem_store) { mem_store_ = mem_store; }
+  MemoryShardStore* memory_store() { return mem_store_; }
+
+  //! If set, intermediate outputs marked with Output<T>::AndCache are kept in cache_store,
+  //! whether mem_store is set or not.
+  void set_cache_store(MemoryShardStore* cache_store) { cache_store_ = cache_store; }
+
+  //! If set, tags the shard files with the worker index. Used when several processes write
+  //! into the same shards. The globs returned by ShardFilePath cover the files of all workers.
+  void set_worker_index(int32_t index) { worker_index_ = index; }
+
+  //! Creates and opens a handle that writes into the shard files on disk or GCS.
+  std::unique_ptr<DestHandle> CreateFileHandle(const ShardId& key);
+
+  //! Thread-safe. Accounts the memory buffered by the handles of sorted outputs and returns
+  //! the total after the change. The bytes are also charged to the mr.dest_files account.
+  int64_t AddSortBytes(int64_t delta);
+
  private:
-  typedef absl::flat_hash_map<ShardId, std::unique_ptr<DestHandle>> HandleMap;
-  HandleMap dest_files_;
-  mutable ::boost::fibers::mutex mu_;
+  // The map entry of a shard. handle is published once its creator opened it, so the handle
+  // is created without holding the lock of its map shard.
+  struct HandleSlot {
+    std::unique_ptr<DestHandle> owner;
+    std::atomic<DestHandle*> handle{nullptr};
+    util::fibers_ext::EventCount ready_ec;
+
+    DestHandle* Wait();
+  };
+
+  typedef absl::flat_hash_map<ShardId, std::unique_ptr<HandleSlot>> HandleMap;
+
+  // The handles are split by the hash of their shard, hence threads that write into different
+  // shards rarely contend and the lock is held only for the lookup or the insertion.
+  struct alignas(base::CACHE_LINE_SIZE) MapShard {
+    HandleMap handles;
+    mutable util::fibers_ext::SharedMutex mu;  // readers look up the existing handles.
+  };
 
-  const util::GCE* gce_ = nullptr;
+  static constexpr unsigned kMapShards = 32;
+
+  MapShard& map_shard(const ShardId& sid) {
+    return map_shards_[absl::Hash<ShardId>{}(sid) % kMapShards];
+  }
+
+  std::unique_ptr<DestHandle> CreateHandle(const ShardId& sid);
+
+  MapShard map_shards_[kMapShards];
+
+  util::GcsPool* gcs_pool_ = nullptr;
+  MemoryShardStore* mem_store_ = nullptr;
+  MemoryShardStore* cache_store_ = nullptr;
+  int32_t worker_index_ = -1;
+  std::atomic<int64_t> sort_bytes_{0};
+  ShardStatsList closed_stats_;
 
   util::IoContextPool& io_pool_;
   util::fibers_ext::FiberQueueThreadPool& fq_;
@@ -80,6 +153,75 @@ class DestFileSet {
 };
 
 
+//! Records of sorted outputs are passed to DestHandle prefixed with their sort key.
+void EncodeSortKey(absl::string_view key, absl::string_view record, std::string* dest);
+
+//! Describes how the shards are skewed: the totals, the ratio of the largest shard to the
+//! average one and the top_n largest shards by their raw size. Sorts the stats.
+std::string ShardSkewSummary(unsigned top_n, ShardStatsList* stats);
+
+//! The ratio of the largest raw shard size to the average one, 0 if nothing was written.
+double ShardSkew(const ShardStatsList& stats);
+
+//! True if the output is consumed by the following operators and dest_file_fast_intermediate
+//! is set. Such outputs are written without compression, LST blocks included.
+bool IsFastIntermediate(const pb::Output& out);
+
+/*! \class mr3::detail::RecordBatch
+    \brief Records that are handed over to DestHandle at once, together with their memory.
+
+    Text records are concatenated into a single buffer, each followed by '\n', which the
+    handles consume as one slice. Binary records are appended into a single arena with their
+    end offsets, hence neither the writers nor the handles allocate per record.
+*/
+class RecordBatch {
+ public:
+  explicit RecordBatch(bool is_binary = false) : is_binary_(is_binary) {}
+
+  void Add(absl::string_view record) {
+    data_.append(record.data(), record.size());
+    if (is_binary_) {
+      DCHECK_LE(data_.size(), kuint32max);
+      ends_.push_back(data_.size());
+    } else {
+      data_.push_back('\n');
+    }
+  }
+
+  void Reserve(size_t bytes) { data_.reserve(bytes); }
+
+  bool is_binary() const { return is_binary_; }
+  bool empty() const { return size() == 0; }
+
+  //! The number of slices: the records of a binary batch or the single text slice.
+  size_t size() const { return is_binary_ ? ends_.size() : !data_.empty(); }
+
+  absl::string_view operator[](size_t i) const {
+    if (!is_binary_)
+      return data_;
+    size_t start = i ? ends_[i - 1] : 0;
+    return absl::string_view{data_.data() + start, ends_[i] - start};
+  }
+
+  template <typename Func> void ForEach(Func&& f) const {
+    for (size_t i = 0; i < size(); ++i)
+      f((*this)[i]);
+  }
+
+  //! Drops the first count slices.
+  void EraseFront(size_t count);
+
+  void Clear() {
+    data_.clear();
+    ends_.clear();
+  }
+
+ private:
+  bool is_binary_;
+  std::string data_;
+  std::vector<uint32_t> ends_;
+};
+
 /*! \class mr3::detail::DestHandle
     \brief Thread-safe handle that abstracts away compression/file formats and disk systems.
 
@@ -90,7 +232,7 @@ class DestFileSet {
 class DestHandle {
   friend class DestFileSet;
 
-  void AppendThreadLocal(const std::string& val);
+  void AppendThreadLocal(absl::string_view val);
 
   static ::file::WriteFile* OpenThreadLocal(const pb::Output& output, const std::string& path);
 
@@ -98,19 +240,33 @@ class DestHandle {
   virtual ~DestHandle() {}
 
   //! Thread-safe. Called from multiple threads/do_contexts.
-  //! Implements string generator that allows the writing thread to pull few strings at once.
-  using StringGenCb = std::function<absl::optional<std::string>()>;
-
-  //! Writes 0 or many string records according to what cb returns.
-  //! When cb is out of records, it will returns absl::nullopt.
-  virtual void Write(StringGenCb cb);
+  //! Writes the records of the batch, which the handle may keep until they are written.
+  virtual void Write(RecordBatch&& batch);
 
   // Thread-safe. Called from multiple threads/do_contexts.
   virtual void Close(bool abort_write);
 
-  void set_raw_limit(size_t raw_limit) { raw_limit_ = raw_limit; }
+  //! Starts a new sub-shard file once raw_limit bytes were written into the current one,
+  //! provided at least min_tail bytes are pending for the new file.
+  void set_raw_limit(size_t raw_limit, size_t min_tail = 0) {
+    raw_limit_ = raw_limit;
+    min_tail_ = min_tail;
+  }
   const std::string full_path() const { return full_path_;}
 
+  //! Thread-safe. Accounts raw bytes written into the shard before compression.
+  void AddRawBytes(size_t sz, size_t records) {
+    raw_bytes_.fetch_add(sz, std::memory_order_relaxed);
+    records_.fetch_add(records, std::memory_order_relaxed);
+  }
+  size_t raw_bytes() const { return raw_bytes_.load(std::memory_order_relaxed); }
+
+  //! Thread-safe. Accounts the time spent writing into the shard.
+  void AddWriteTime(uint64_t usec) { write_usec_.fetch_add(usec, std::memory_order_relaxed); }
+
+  //! Thread-safe. The file sizes are filled once the handle is closed.
+  void GetStats(pb::ShardStats* stats) const;
+
  protected:
   template <typename Func> auto Await(Func&& f) {
     return owner_->pool()->Await(queue_index_, std::forward<Func>(f));
@@ -121,6 +277,15 @@ class DestHandle {
 
   virtual void Open();
 
+  //! Accounts the files of the shard, called when they are closed.
+  void AddFiles(size_t count, size_t bytes) {
+    files_.fetch_add(count, std::memory_order_relaxed);
+    file_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  //! Accounts the files and the write time of the handle that wrote for this one.
+  void AddClosedStats(const DestHandle& dh);
+
   DestFileSet* owner_;
   ShardId sid_;
 
@@ -129,6 +294,11 @@ class DestHandle {
 
   size_t raw_size_ = 0;
   size_t raw_limit_ = kuint64max;
+  size_t min_tail_ = 0;
+  std::string tail_;  // Pending records of the next sub-shard.
+  std::atomic<size_t> raw_bytes_{0}, records_{0}, file_bytes_{0};
+  std::atomic<uint32_t> files_{0};
+  std::atomic<uint64_t> write_usec_{0};
   uint32_t sub_shard_ = 0;
   uint32_t queue_index_;
 };
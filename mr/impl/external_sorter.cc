@@ -0,0 +1,177 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/external_sorter.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <queue>
+
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "base/varint.h"
+#include "file/file.h"
+#include "file/list_file.h"
+#include "file/list_file_reader.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+
+namespace {
+
+std::atomic<uint64_t> run_seq{0};
+
+bool DecodeEntry(StringPiece rec, absl::string_view* key, uint32_t* tag, absl::string_view* val) {
+  const uint8* ptr = reinterpret_cast<const uint8*>(rec.data());
+  const uint8* end = ptr + rec.size();
+  uint32_t key_size = 0;
+
+  ptr = Varint::Parse32WithLimit(ptr, end, &key_size);
+  if (!ptr)
+    return false;
+  ptr = Varint::Parse32WithLimit(ptr, end, tag);
+  if (!ptr || size_t(end - ptr) < key_size)
+    return false;
+
+  const char* cptr = reinterpret_cast<const char*>(ptr);
+  *key = absl::string_view(cptr, key_size);
+  *val = absl::string_view(cptr + key_size, end - ptr - key_size);
+  return true;
+}
+
+// Head of a single sorted run during the merge.
+struct RunCursor {
+  std::unique_ptr<file::ListReader> reader;
+  std::string scratch;
+  absl::string_view key, value;
+  uint32_t tag = 0;
+
+  bool Next() {
+    StringPiece rec;
+    while (reader->ReadRecord(&rec, &scratch)) {
+      if (DecodeEntry(rec, &key, &tag, &value))
+        return true;
+      LOG(ERROR) << "Corrupted spill record of size " << rec.size();
+    }
+    return false;
+  }
+};
+
+}  // namespace
+
+ExternalSorter::ExternalSorter(size_t budget_bytes, std::string spill_dir)
+    : budget_(budget_bytes), spill_dir_(std::move(spill_dir)) {}
+
+ExternalSorter::~ExternalSorter() { Reset(); }
+
+void ExternalSorter::Add(absl::string_view key, uint32_t tag, absl::string_view value) {
+  if (!entries_.empty() && buffered_bytes() >= budget_) {
+    SpillBuffer();
+  }
+
+  entries_.push_back(Entry{buf_.size(), uint32_t(key.size()), uint32_t(value.size()), tag});
+  buf_.append(key.data(), key.size());
+  buf_.append(value.data(), value.size());
+}
+
+void ExternalSorter::Spill() {
+  if (!entries_.empty())
+    SpillBuffer();
+}
+
+void ExternalSorter::SortBuffer() {
+  // stable_sort preserves insertion order for entries with equal (key, tag).
+  std::stable_sort(entries_.begin(), entries_.end(), [this](const Entry& a, const Entry& b) {
+    int res = key(a).compare(key(b));
+    return res < 0 || (res == 0 && a.tag < b.tag);
+  });
+}
+
+void ExternalSorter::SpillBuffer() {
+  SortBuffer();
+
+  string fname = absl::StrCat(spill_dir_, "/sort-", getpid(), "-", run_seq.fetch_add(1), ".lst");
+  VLOG(1) << "Spilling " << entries_.size() << " entries into " << fname;
+
+  {
+    file::ListWriter writer(fname);
+    CHECK_STATUS(writer.Init());
+
+    string rec;
+    for (const Entry& e : entries_) {
+      rec.clear();
+      Varint::Append32(&rec, e.key_size);
+      Varint::Append32(&rec, e.tag);
+      rec.append(buf_, e.offset, e.key_size + e.value_size);
+      CHECK_STATUS(writer.AddRecord(rec));
+    }
+    CHECK_STATUS(writer.Flush());
+  }
+  run_files_.push_back(std::move(fname));
+
+  entries_.clear();
+  buf_.clear();
+}
+
+void ExternalSorter::Merge(const EntryCb& cb) {
+  if (run_files_.empty()) {
+    SortBuffer();
+    for (const Entry& e : entries_) {
+      cb(key(e), e.tag, value(e));
+    }
+  } else {
+    if (!entries_.empty())
+      SpillBuffer();
+    MergeRuns(cb);
+  }
+  Reset();
+}
+
+void ExternalSorter::MergeRuns(const EntryCb& cb) {
+  std::vector<RunCursor> cursors(run_files_.size());
+
+  // Runs were spilled in insertion order, hence run index breaks the ties.
+  auto greater = [&cursors](unsigned a, unsigned b) {
+    const RunCursor& ca = cursors[a];
+    const RunCursor& cb = cursors[b];
+    int res = ca.key.compare(cb.key);
+    if (res != 0)
+      return res > 0;
+    if (ca.tag != cb.tag)
+      return ca.tag > cb.tag;
+    return a > b;
+  };
+  std::priority_queue<unsigned, std::vector<unsigned>, decltype(greater)> heap(greater);
+
+  for (unsigned i = 0; i < cursors.size(); ++i) {
+    cursors[i].reader.reset(new file::ListReader(run_files_[i]));
+    if (cursors[i].Next())
+      heap.push(i);
+  }
+
+  while (!heap.empty()) {
+    unsigned i = heap.top();
+    heap.pop();
+
+    RunCursor& cur = cursors[i];
+    cb(cur.key, cur.tag, cur.value);
+    if (cur.Next())
+      heap.push(i);
+  }
+}
+
+void ExternalSorter::Reset() {
+  for (const string& fname : run_files_) {
+    LOG_IF(WARNING, !file::Delete(fname)) << "Could not delete " << fname;
+  }
+  run_files_.clear();
+  entries_.clear();
+  buf_.clear();
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,75 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace mr3 {
+namespace detail {
+
+/*! Sorts (key, tag, value) entries by key with bounded memory.
+ *  Entries are buffered in RAM until the buffer reaches its budget, then the buffer is sorted
+ *  and spilled as a run into a local LST file. Merge() k-way merges the runs.
+ *  Entries with equal keys are ordered by tag and then by their insertion order.
+ *  Not thread-safe.
+ */
+class ExternalSorter {
+ public:
+  using EntryCb = std::function<void(absl::string_view key, uint32_t tag, absl::string_view value)>;
+
+  ExternalSorter(size_t budget_bytes, std::string spill_dir);
+
+  // Deletes the spill files.
+  ~ExternalSorter();
+
+  void Add(absl::string_view key, uint32_t tag, absl::string_view value);
+
+  //! Calls cb for every added entry in sorted order and resets the sorter.
+  void Merge(const EntryCb& cb);
+
+  //! Spills the buffered entries as a sorted run, if there are any.
+  void Spill();
+
+  //! Memory used by the entries buffered so far.
+  size_t buffered_bytes() const { return buf_.size() + entries_.size() * kEntryOverhead; }
+
+  size_t num_runs() const { return run_files_.size(); }
+
+ private:
+  static constexpr size_t kEntryOverhead = sizeof(uint64_t) * 3;
+
+  struct Entry {
+    size_t offset;
+    uint32_t key_size, value_size;
+    uint32_t tag;
+  };
+
+  absl::string_view key(const Entry& e) const {
+    return absl::string_view(buf_.data() + e.offset, e.key_size);
+  }
+
+  absl::string_view value(const Entry& e) const {
+    return absl::string_view(buf_.data() + e.offset + e.key_size, e.value_size);
+  }
+
+  void SortBuffer();
+  void SpillBuffer();
+  void MergeRuns(const EntryCb& cb);
+  void Reset();
+
+  const size_t budget_;
+  const std::string spill_dir_;
+
+  std::string buf_;
+  std::vector<Entry> entries_;
+  std::vector<std::string> run_files_;
+};
+
+}  // namespace detail
+}  // namespace mr3
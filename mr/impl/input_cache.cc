@@ -0,0 +1,252 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/input_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "base/hash.h"
+#include "base/logging.h"
+#include "file/fiber_file.h"
+#include "file/file_util.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace boost;
+using namespace std;
+using util::Status;
+using util::StatusObject;
+
+constexpr char kTmpSuffix[] = ".tmp";
+
+// Writes the data that the reader consumes in order into a temporary file, which becomes
+// the cache entry once the end of the object is reached. Reads that skip forward stop the
+// filling since the gap would not be written.
+class InputCache::FillFile : public file::ReadonlyFile {
+ public:
+  FillFile(InputCache* cache, uint64_t fp, file::ReadonlyFile* remote)
+      : cache_(cache), fp_(fp), remote_(remote) {}
+
+  ~FillFile() { Abandon(); }
+
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range) final;
+
+  Status Close() final {
+    Abandon();
+    return remote_->Close();
+  }
+
+  size_t Size() const final { return remote_->Size(); }
+
+  int Handle() const final { return -1; }
+
+ private:
+  void Append(size_t offset, strings::ByteRange data);
+  void Abandon();
+
+  InputCache* cache_;
+  uint64_t fp_;
+  std::unique_ptr<file::ReadonlyFile> remote_;
+
+  string tmp_path_;
+  file::WriteFile* writer_ = nullptr;
+  size_t written_ = 0;
+  bool started_ = false;
+};
+
+StatusObject<size_t> InputCache::FillFile::Read(size_t offset,
+                                                const strings::MutableByteRange& range) {
+  auto res = remote_->Read(offset, range);
+  if (res.ok() && res.obj > 0) {
+    Append(offset, strings::ByteRange(range.data(), res.obj));
+  }
+  return res;
+}
+
+void InputCache::FillFile::Append(size_t offset, strings::ByteRange data) {
+  if (!started_) {
+    started_ = true;
+    if (offset != 0)
+      return;
+
+    tmp_path_ = absl::StrCat(cache_->EntryPath(fp_), ".", cache_->tmp_seq_.fetch_add(1),
+                             kTmpSuffix);
+    writer_ = file::OpenFiberWriteFile(tmp_path_, cache_->fq_pool_);
+    if (!writer_) {
+      LOG(WARNING) << "Could not create " << tmp_path_;
+      return;
+    }
+  }
+
+  if (!writer_ || offset + data.size() <= written_)
+    return;
+
+  if (offset > written_) {
+    VLOG(1) << "Not caching " << tmp_path_ << " that is read out of order";
+    Abandon();
+    return;
+  }
+
+  data.advance(written_ - offset);
+  Status st = writer_->Write(data.data(), data.size());
+  if (!st.ok()) {
+    LOG(WARNING) << "Error writing " << tmp_path_ << ": " << st;
+    Abandon();
+    return;
+  }
+  written_ += data.size();
+
+  if (written_ == Size()) {
+    bool closed = writer_->Close();
+    writer_ = nullptr;
+    if (closed) {
+      cache_->Commit(fp_, written_, tmp_path_);
+    } else {
+      cache_->fq_pool_->Await([this] { return file::Delete(tmp_path_); });
+    }
+  }
+}
+
+void InputCache::FillFile::Abandon() {
+  if (!writer_)
+    return;
+  writer_->Close();
+  writer_ = nullptr;
+  cache_->fq_pool_->Await([this] { return file::Delete(tmp_path_); });
+}
+
+InputCache::InputCache(const string& dir, size_t budget_bytes,
+                       util::fibers_ext::FiberQueueThreadPool* fq_pool)
+    : dir_(dir), budget_(budget_bytes), fq_pool_(fq_pool) {}
+
+void InputCache::Init() {
+  CHECK(file_util::RecursivelyCreateDir(dir_, 0750)) << dir_;
+
+  vector<file_util::StatShort> files = file_util::StatFiles(file_util::JoinPath(dir_, "*"));
+  std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) {
+    return a.last_modified > b.last_modified;
+  });
+
+  std::lock_guard<fibers::mutex> lk(mu_);
+  for (const auto& f : files) {
+    string name(file_util::GetNameFromPath(f.name));
+
+    // Leftovers of the fills that were interrupted.
+    if (absl::EndsWith(name, kTmpSuffix)) {
+      file::Delete(f.name);
+      continue;
+    }
+    char* end = nullptr;
+    uint64_t fp = strtoull(name.c_str(), &end, 16);
+    if (name.size() != 16 || *end != '\0') {
+      LOG(WARNING) << "Skipping unexpected file " << f.name;
+      continue;
+    }
+    // The files are visited from the most recent, hence they are appended to the back.
+    lru_.push_back(Entry{fp, size_t(f.size)});
+    index_.emplace(fp, std::prev(lru_.end()));
+    used_.fetch_add(f.size, std::memory_order_relaxed);
+  }
+  while (used_ > budget_ && !lru_.empty()) {
+    const Entry& e = lru_.back();
+    file::Delete(EntryPath(e.fp));
+    used_ -= e.size;
+    index_.erase(e.fp);
+    lru_.pop_back();
+  }
+
+  LOG(INFO) << "Input cache " << dir_ << " holds " << lru_.size() << " objects of "
+            << used_ << " bytes";
+}
+
+string InputCache::EntryPath(uint64_t fp) const {
+  return file_util::JoinPath(dir_, absl::StrCat(absl::Hex(fp, absl::kZeroPad16)));
+}
+
+file::ReadonlyFile* InputCache::Open(const string& key, const file::FiberReadOptions& opts) {
+  uint64_t fp = base::Fingerprint(key);
+  {
+    std::lock_guard<fibers::mutex> lk(mu_);
+    auto it = index_.find(fp);
+    if (it == index_.end())
+      return nullptr;
+    lru_.splice(lru_.begin(), lru_, it->second);
+  }
+
+  auto res = file::OpenFiberReadFile(EntryPath(fp), fq_pool_, opts);
+  if (!res.ok()) {
+    // Should not happen unless the directory is shared with another cache.
+    LOG(WARNING) << "Could not open the cached " << key << ": " << res.status;
+
+    std::lock_guard<fibers::mutex> lk(mu_);
+    auto it = index_.find(fp);
+    if (it != index_.end()) {
+      used_ -= it->second->size;
+      lru_.erase(it->second);
+      index_.erase(it);
+    }
+    return nullptr;
+  }
+  VLOG(1) << "Reading " << key << " from the cache";
+
+  return res.obj;
+}
+
+file::ReadonlyFile* InputCache::Fill(const string& key, file::ReadonlyFile* remote) {
+  size_t sz = remote->Size();
+  if (sz == 0 || sz > budget_)
+    return remote;
+
+  return new FillFile(this, base::Fingerprint(key), remote);
+}
+
+void InputCache::Commit(uint64_t fp, size_t size, const string& tmp_path) {
+  string path = EntryPath(fp);
+  int res = fq_pool_->Await([&] { return rename(tmp_path.c_str(), path.c_str()); });
+  if (res != 0) {
+    LOG(WARNING) << "Could not rename " << tmp_path << " to " << path;
+    fq_pool_->Await([&] { return file::Delete(tmp_path); });
+    return;
+  }
+
+  vector<uint64_t> evicted;
+  {
+    std::lock_guard<fibers::mutex> lk(mu_);
+    InsertLocked(fp, size, &evicted);
+  }
+
+  // Readers that have the evicted files open keep reading them until they close them.
+  for (uint64_t victim : evicted) {
+    string victim_path = EntryPath(victim);
+    fq_pool_->Await([&] { return file::Delete(victim_path); });
+  }
+}
+
+void InputCache::InsertLocked(uint64_t fp, size_t size, vector<uint64_t>* evicted) {
+  auto it = index_.find(fp);
+  if (it != index_.end()) {
+    // Another reader has filled the same entry concurrently and the rename replaced its file.
+    used_ -= it->second->size;
+    lru_.erase(it->second);
+    index_.erase(it);
+  }
+
+  lru_.push_front(Entry{fp, size});
+  index_.emplace(fp, lru_.begin());
+  used_ += size;
+
+  while (used_ > budget_ && lru_.size() > 1) {
+    const Entry& e = lru_.back();
+    evicted->push_back(e.fp);
+    used_ -= e.size;
+    index_.erase(e.fp);
+    lru_.pop_back();
+  }
+}
+
+}  // namespace detail
+}  // namespace mr3
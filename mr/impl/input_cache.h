@@ -0,0 +1,79 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <boost/fiber/mutex.hpp>
+#include <list>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "file/file.h"
+
+namespace file {
+struct FiberReadOptions;
+}  // namespace file
+
+namespace util {
+namespace fibers_ext {
+class FiberQueueThreadPool;
+}  // namespace fibers_ext
+}  // namespace util
+
+namespace mr3 {
+namespace detail {
+
+/*! Local disk cache of remote input objects, bounded by budget_bytes and evicted in LRU order.
+ *  Entries are keyed by strings that must change whenever the contents of the object change,
+ *  for example bucket/path/generation. Every entry is a file in dir named by the fingerprint of
+ *  its key, hence the cache survives restarts of the process.
+ *  Entries are filled as a side effect of reading the remote objects, see Fill().
+ *  All the methods are thread-safe.
+ */
+class InputCache {
+ public:
+  InputCache(const std::string& dir, size_t budget_bytes,
+             util::fibers_ext::FiberQueueThreadPool* fq_pool);
+
+  //! Loads the entries of the previous runs from dir. Must be called before the cache is used.
+  void Init();
+
+  //! Returns the local copy of the key or nullptr if it is not cached.
+  file::ReadonlyFile* Open(const std::string& key, const file::FiberReadOptions& opts);
+
+  //! Wraps remote into a file that writes the data it reads into the cache. The entry of key
+  //! is added once the whole object has been read in order. Takes ownership of remote.
+  file::ReadonlyFile* Fill(const std::string& key, file::ReadonlyFile* remote);
+
+  size_t used_bytes() const { return used_.load(std::memory_order_relaxed); }
+
+ private:
+  class FillFile;
+
+  struct Entry {
+    uint64_t fp;
+    size_t size;
+  };
+
+  std::string EntryPath(uint64_t fp) const;
+
+  // Links the written tmp_path as the entry of fp and evicts the entries above the budget.
+  void Commit(uint64_t fp, size_t size, const std::string& tmp_path);
+
+  // Must be called under mu_. Moves the victims into evicted.
+  void InsertLocked(uint64_t fp, size_t size, std::vector<uint64_t>* evicted);
+
+  const std::string dir_;
+  const size_t budget_;
+  util::fibers_ext::FiberQueueThreadPool* fq_pool_;
+  std::atomic<size_t> used_{0};
+  std::atomic<unsigned> tmp_seq_{0};
+
+  ::boost::fibers::mutex mu_;
+  std::list<Entry> lru_;  // the most recently used entries are at the front.
+  absl::flat_hash_map<uint64_t, std::list<Entry>::iterator> index_;
+};
+
+}  // namespace detail
+}  // namespace mr3
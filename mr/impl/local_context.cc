@@ -4,12 +4,24 @@
 
 #include "mr/impl/local_context.h"
 
+#include "base/memory_account.h"
+#include "base/walltime.h"
+
 namespace mr3 {
 
 using namespace std;
 
 namespace detail {
 
+namespace {
+
+base::MemoryAccount* WriterAccount() {
+  static base::MemoryAccount* res = base::MemoryAccount::Get("mr.buffered_writers");
+  return res;
+}
+
+}  // namespace
+
 /// Thread-local buffered writer, owned by LocalContext.
 class BufferedWriter {
   DestHandle* dh_;
@@ -26,36 +38,28 @@ class BufferedWriter {
   void Write(string&& val);
 
  private:
-  static constexpr size_t kFlushLimit = 1 << 13;
+  // The flush limit doubles with every full batch up to kMaxFlushLimit, hence hot shards
+  // pass their records in large batches while the many cold shards keep small buffers.
+  static constexpr size_t kMinFlushLimit = 1 << 13;
+  static constexpr size_t kMaxFlushLimit = 1 << 17;
+
+  // The account is updated in steps to keep the shared counters off the per-record path.
+  static constexpr size_t kChargeStep = 1 << 10;
 
   void operator=(const BufferedWriter&) = delete;
 
-  bool is_binary_;
+  // Hands the batch over to dh_.
+  void WriteBatch();
 
-  string buffer_;
-  vector<string> items_;
-  size_t buffered_size_ = 0;
+  RecordBatch batch_;
+  size_t buffered_size_ = 0, buffered_records_ = 0;
+  size_t flush_limit_ = kMinFlushLimit;
 
   size_t writes_ = 0, flushes_ = 0;
-  DestHandle::StringGenCb str_cb_;
+  base::MemoryCharge charge_{WriterAccount()};
 };
 
-BufferedWriter::BufferedWriter(DestHandle* dh, bool is_binary) : dh_(dh), is_binary_(is_binary) {
-  if (is_binary) {
-    str_cb_ = [this]() -> absl::optional<std::string> {
-      if (items_.empty()) {
-        return absl::nullopt;
-      }
-      string val = std::move(items_.back());
-      items_.pop_back();
-      return val;
-    };
-  } else {
-    str_cb_ = [this]() -> absl::optional<std::string> {
-      return buffer_.empty() ? absl::nullopt : absl::optional<std::string>{std::move(buffer_)};
-    };
-  }
-}
+BufferedWriter::BufferedWriter(DestHandle* dh, bool is_binary) : dh_(dh), batch_(is_binary) {}
 
 BufferedWriter::~BufferedWriter() {
   CHECK_EQ(0, buffered_size_);
@@ -63,40 +67,68 @@ BufferedWriter::~BufferedWriter() {
 
 void BufferedWriter::Flush() {
   if (buffered_size_) {
-    dh_->Write(str_cb_);
-    buffered_size_ = 0;
+    WriteBatch();
   }
 }
 
+void BufferedWriter::WriteBatch() {
+  bool is_binary = batch_.is_binary();
+
+  dh_->AddRawBytes(buffered_size_, buffered_records_);
+
+  // Includes the compression of the handles that compress in the calling thread.
+  uint64_t start = base::GetMonotonicMicrosFast();
+  dh_->Write(std::move(batch_));
+  dh_->AddWriteTime(base::GetMonotonicMicrosFast() - start);
+
+  batch_ = RecordBatch(is_binary);
+  buffered_size_ = buffered_records_ = 0;
+  charge_.Set(0);
+}
+
 void BufferedWriter::Write(string&& val) {
   buffered_size_ += (val.size() + 1);
-  if (is_binary_) {
-    items_.push_back(std::move(val));
-  } else {
-    buffer_.append(val).append("\n");
-  }
+  ++buffered_records_;
+  batch_.Add(val);
 
   VLOG_IF(2, ++writes_ % 1000 == 0) << "BufferedWrite " << writes_;
-  if (buffered_size_ >= kFlushLimit) {
-    VLOG(2) << "Flush " << ++flushes_;
-
-    dh_->Write(str_cb_);
-    buffered_size_ = 0;
+  if (buffered_size_ >= flush_limit_) {
+    VLOG(2) << "Flush " << ++flushes_ << " of " << buffered_size_ << " bytes";
+
+    WriteBatch();
+    flush_limit_ = std::min(flush_limit_ * 2, kMaxFlushLimit);
+    batch_.Reserve(flush_limit_);  // the shard is hot.
+  } else if (buffered_size_ >= charge_.bytes() + kChargeStep) {
+    charge_.Set(buffered_size_);
   }
 }
 
 LocalContext::LocalContext(DestFileSet* mgr) : mgr_(mgr) { CHECK(mgr_); }
 
-void LocalContext::WriteInternal(const ShardId& shard_id, std::string&& record) {
+BufferedWriter* LocalContext::GetWriter(const ShardId& shard_id) {
   DCHECK(shard_id.is_defined()) << "Undefined shard id";
 
   auto it = custom_shard_files_.find(shard_id);
   if (it == custom_shard_files_.end()) {
     DestHandle* res = mgr_->GetOrCreate(shard_id);
-    bool is_binary = mgr_->output().format().type() == pb::WireFormat::LST;
+
+    // The keyed records of sorted outputs are passed one by one, even for text formats.
+    bool is_binary = IsBinary(mgr_->output().format().type()) || mgr_->output().sorted();
     it = custom_shard_files_.emplace(shard_id, new BufferedWriter{res, is_binary}).first;
   }
-  it->second->Write(std::move(record));
+  return it->second;
+}
+
+void LocalContext::WriteInternal(const ShardId& shard_id, std::string&& record) {
+  GetWriter(shard_id)->Write(std::move(record));
+}
+
+void LocalContext::WriteSortedInternal(const ShardId& shard_id, std::string&& key,
+                                       std::string&& record) {
+  DCHECK(mgr_->output().sorted());
+  string keyed;
+  EncodeSortKey(key, record, &keyed);
+  GetWriter(shard_id)->Write(std::move(keyed));
 }
 
 void LocalContext::Flush() {
@@ -23,6 +23,10 @@ class LocalContext : public RawContext {
 
  private:
   void WriteInternal(const ShardId& shard_id, std::string&& record) final;
+  void WriteSortedInternal(const ShardId& shard_id, std::string&& key,
+                           std::string&& record) final;
+
+  BufferedWriter* GetWriter(const ShardId& shard_id);
 
   absl::flat_hash_map<ShardId, BufferedWriter*> custom_shard_files_;
 
@@ -0,0 +1,59 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/memory_budget.h"
+
+#include "base/logging.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace boost;
+
+void MemoryBudget::Acquire(size_t bytes) {
+  if (limit_ == 0)
+    return;
+
+  std::unique_lock<fibers::mutex> lk(mu_);
+  cv_.wait(lk, [&] { return used_ == 0 || used_ + bytes <= limit_; });
+  used_ += bytes;
+}
+
+bool MemoryBudget::TryAcquire(size_t bytes) {
+  if (limit_ == 0)
+    return true;
+
+  std::lock_guard<fibers::mutex> lk(mu_);
+  if (used_ > 0 && used_ + bytes > limit_)
+    return false;
+  used_ += bytes;
+  return true;
+}
+
+void MemoryBudget::Grow(size_t bytes) {
+  if (limit_ == 0)
+    return;
+
+  std::lock_guard<fibers::mutex> lk(mu_);
+  used_ += bytes;
+}
+
+void MemoryBudget::Release(size_t bytes) {
+  if (limit_ == 0)
+    return;
+
+  {
+    std::lock_guard<fibers::mutex> lk(mu_);
+    DCHECK_GE(used_, bytes);
+    used_ -= bytes;
+  }
+  cv_.notify_all();
+}
+
+size_t MemoryBudget::used() const {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  return used_;
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,47 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
+#include <cstddef>
+
+namespace mr3 {
+namespace detail {
+
+/*! Admits work items, e.g. the shards of a join, while the memory they hold fits into the
+ *  budget. An item that does not fit waits until the others release their memory. An item is
+ *  always admitted when nothing else holds the budget, hence the items larger than the budget
+ *  run alone instead of blocking forever. Thread-safe and fiber-friendly.
+ */
+class MemoryBudget {
+ public:
+  //! limit == 0 disables the budget, i.e. everything is admitted immediately.
+  explicit MemoryBudget(size_t limit) : limit_(limit) {}
+
+  //! Blocks until bytes fit into the budget and reserves them.
+  void Acquire(size_t bytes);
+
+  //! Reserves bytes if they fit into the budget now.
+  bool TryAcquire(size_t bytes);
+
+  //! Reserves bytes without blocking, e.g. when an admitted item grows past its estimate.
+  //! The budget may be over-committed then and the following items wait longer.
+  void Grow(size_t bytes);
+
+  void Release(size_t bytes);
+
+  size_t limit() const { return limit_; }
+  size_t used() const;
+
+ private:
+  const size_t limit_;
+  mutable ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;
+  size_t used_ = 0;
+};
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,75 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/memory_shard_store.h"
+
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace boost;
+using namespace std;
+
+void MemoryShard::Append(StringPiece val) {
+  if (val.empty())
+    return;
+
+  char* dest = arena_.Allocate(val.size());
+  memcpy(dest, val.data(), val.size());
+  blobs_.emplace_back(dest, val.size());
+  raw_size_ += val.size();
+}
+
+MemoryShard* MemoryShardStore::GetOrCreate(const std::string& glob, bool is_binary) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  auto& res = shards_[glob];
+  if (!res) {
+    res.reset(new MemoryShard(is_binary));
+  }
+  CHECK_EQ(is_binary, res->is_binary());
+
+  return res.get();
+}
+
+const MemoryShard* MemoryShardStore::Find(const std::string& glob) const {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  auto it = shards_.find(glob);
+
+  return it == shards_.end() ? nullptr : it->second.get();
+}
+
+bool MemoryShardStore::TryReserve(size_t sz) {
+  size_t current = used_.load(std::memory_order_relaxed);
+  do {
+    if (current + sz > budget_)
+      return false;
+  } while (!used_.compare_exchange_weak(current, current + sz, std::memory_order_relaxed));
+
+  return true;
+}
+
+void MemoryShardStore::EraseDir(const std::string& dir) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  for (auto it = shards_.begin(); it != shards_.end();) {
+    const string& glob = it->first;
+    if (glob.size() > dir.size() && glob.compare(0, dir.size(), dir) == 0 &&
+        glob[dir.size()] == '/') {
+      used_.fetch_sub(it->second->raw_size(), std::memory_order_relaxed);
+      shards_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void MemoryShardStore::Clear() {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  shards_.clear();
+  used_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace detail
+}  // namespace mr3
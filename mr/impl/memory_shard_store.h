@@ -0,0 +1,107 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <boost/fiber/mutex.hpp>
+
+#include "absl/container/flat_hash_map.h"
+#include "base/arena.h"
+#include "strings/stringpiece.h"
+
+namespace mr3 {
+namespace detail {
+
+/*! Records of a single intermediate shard that are held in RAM instead of being written to disk.
+ *  For text outputs each blob holds one or more newline-terminated records,
+ *  for binary outputs each blob is exactly one record.
+ *  Once the memory budget is exhausted, the rest of the shard is spilled into the regular
+ *  shard files that are matched by the shard glob.
+ */
+class MemoryShard {
+ public:
+  explicit MemoryShard(bool is_binary) : is_binary_(is_binary) {}
+
+  // Not thread-safe. Copies val into the internal arena.
+  void Append(StringPiece val);
+
+  void set_spilled() { spilled_ = true; }
+  bool spilled() const { return spilled_; }
+
+  bool is_binary() const { return is_binary_; }
+
+  size_t raw_size() const { return raw_size_; }
+
+  // Calls cb for each record stored in memory.
+  template <typename Cb> size_t ForEach(Cb&& cb) const;
+
+ private:
+  bool is_binary_;
+  base::Arena arena_;
+  std::vector<StringPiece> blobs_;
+  size_t raw_size_ = 0;
+  bool spilled_ = false;
+};
+
+/*! Process-wide registry of in-memory shards, keyed by shard glob as returned by
+ *  DestFileSet::ShardFilePath(sid, -1). Shards stay alive until the store is cleared,
+ *  so they can be consumed by any number of following operators.
+ */
+class MemoryShardStore {
+ public:
+  explicit MemoryShardStore(size_t budget_bytes) : budget_(budget_bytes) {}
+
+  // Thread-safe. Creates a new shard or returns the existing one.
+  MemoryShard* GetOrCreate(const std::string& glob, bool is_binary);
+
+  // Thread-safe. Returns nullptr if no such shard exists.
+  const MemoryShard* Find(const std::string& glob) const;
+
+  //! Thread-safe. Reserves sz bytes of the memory budget. Returns false if the budget is
+  //! exhausted.
+  bool TryReserve(size_t sz);
+
+  //! Thread-safe. Deletes the shards under dir and releases their memory, e.g. before
+  //! the output is written again.
+  void EraseDir(const std::string& dir);
+
+  size_t used_bytes() const { return used_.load(std::memory_order_relaxed); }
+  size_t budget() const { return budget_; }
+
+  void Clear();
+
+ private:
+  const size_t budget_;
+  std::atomic<size_t> used_{0};
+
+  mutable ::boost::fibers::mutex mu_;
+  absl::flat_hash_map<std::string, std::unique_ptr<MemoryShard>> shards_;
+};
+
+template <typename Cb> size_t MemoryShard::ForEach(Cb&& cb) const {
+  size_t cnt = 0;
+
+  for (StringPiece blob : blobs_) {
+    if (is_binary_) {
+      cb(blob);
+      ++cnt;
+      continue;
+    }
+
+    while (!blob.empty()) {
+      size_t pos = blob.find('\n');
+      StringPiece line = blob.substr(0, pos);
+      cb(line);
+      ++cnt;
+      if (pos == StringPiece::npos)
+        break;
+      blob.remove_prefix(pos + 1);
+    }
+  }
+
+  return cnt;
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,361 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/record_filter.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <cstring>
+#include <sstream>
+
+#include "absl/strings/str_split.h"
+#include "base/logging.h"
+#include "util/plang/plang_parser.hh"
+#include "util/plang/plang_scanner.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+namespace gpb = google::protobuf;
+using gpb::internal::WireFormatLite;
+using gpb::FieldDescriptor;
+using plang::ExprValue;
+
+namespace {
+
+ExprValue DefaultValue(const FieldDescriptor* fd) {
+  switch (fd->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      return ExprValue::fromInt(fd->default_value_int32());
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return ExprValue::fromUInt(fd->default_value_uint32());
+    case FieldDescriptor::CPPTYPE_INT64:
+      return ExprValue::fromInt(fd->default_value_int64());
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return ExprValue::fromUInt(fd->default_value_uint64());
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return ExprValue::fromDouble(fd->default_value_float());
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return ExprValue::fromDouble(fd->default_value_double());
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return ExprValue::fromInt(fd->default_value_bool());
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return ExprValue(fd->default_value_enum());
+    case FieldDescriptor::CPPTYPE_STRING:
+      return ExprValue(::StringPiece(fd->default_value_string()));
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      break;
+  }
+  LOG(FATAL) << "Unsupported field " << fd->full_name();
+  return ExprValue{};
+}
+
+// Decodes the value the same way plang reads it via reflection.
+bool ReadValue(const FieldDescriptor* fd, const char* base, gpb::io::CodedInputStream* is,
+               ExprValue* res) {
+  uint32 u32;
+  uint64 u64;
+
+  switch (fd->type()) {
+    case FieldDescriptor::TYPE_INT32:
+      if (!is->ReadVarint64(&u64))
+        return false;
+      *res = ExprValue::fromInt(int32(u64));
+      break;
+    case FieldDescriptor::TYPE_INT64:
+      if (!is->ReadVarint64(&u64))
+        return false;
+      *res = ExprValue::fromInt(int64(u64));
+      break;
+    case FieldDescriptor::TYPE_UINT32:
+      if (!is->ReadVarint32(&u32))
+        return false;
+      *res = ExprValue::fromUInt(u32);
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+      if (!is->ReadVarint64(&u64))
+        return false;
+      *res = ExprValue::fromUInt(u64);
+      break;
+    case FieldDescriptor::TYPE_SINT32:
+      if (!is->ReadVarint32(&u32))
+        return false;
+      *res = ExprValue::fromInt(WireFormatLite::ZigZagDecode32(u32));
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      if (!is->ReadVarint64(&u64))
+        return false;
+      *res = ExprValue::fromInt(WireFormatLite::ZigZagDecode64(u64));
+      break;
+    case FieldDescriptor::TYPE_FIXED32:
+      if (!is->ReadLittleEndian32(&u32))
+        return false;
+      *res = ExprValue::fromUInt(u32);
+      break;
+    case FieldDescriptor::TYPE_SFIXED32:
+      if (!is->ReadLittleEndian32(&u32))
+        return false;
+      *res = ExprValue::fromInt(int32(u32));
+      break;
+    case FieldDescriptor::TYPE_FIXED64:
+      if (!is->ReadLittleEndian64(&u64))
+        return false;
+      *res = ExprValue::fromUInt(u64);
+      break;
+    case FieldDescriptor::TYPE_SFIXED64:
+      if (!is->ReadLittleEndian64(&u64))
+        return false;
+      *res = ExprValue::fromInt(int64(u64));
+      break;
+    case FieldDescriptor::TYPE_FLOAT: {
+      if (!is->ReadLittleEndian32(&u32))
+        return false;
+      float f;
+      memcpy(&f, &u32, sizeof(f));
+      *res = ExprValue::fromDouble(f);
+      break;
+    }
+    case FieldDescriptor::TYPE_DOUBLE: {
+      if (!is->ReadLittleEndian64(&u64))
+        return false;
+      double d;
+      memcpy(&d, &u64, sizeof(d));
+      *res = ExprValue::fromDouble(d);
+      break;
+    }
+    case FieldDescriptor::TYPE_BOOL:
+      if (!is->ReadVarint64(&u64))
+        return false;
+      *res = ExprValue::fromInt(u64 != 0);
+      break;
+    case FieldDescriptor::TYPE_ENUM: {
+      if (!is->ReadVarint64(&u64))
+        return false;
+
+      // Like with reflection, unknown values read as the default.
+      const gpb::EnumValueDescriptor* ev = fd->enum_type()->FindValueByNumber(int32(u64));
+      if (ev)
+        *res = ExprValue(ev);
+      break;
+    }
+    case FieldDescriptor::TYPE_STRING:
+    case FieldDescriptor::TYPE_BYTES: {
+      if (!is->ReadVarint32(&u32))
+        return false;
+      const char* start = base + is->CurrentPosition();
+      if (!is->Skip(u32))
+        return false;
+      *res = ExprValue(::StringPiece(start, u32));
+      break;
+    }
+    default:
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+RecordFilter::RecordFilter(const std::string& expr, const gpb::Descriptor* descr)
+    : descr_(descr) {
+  CHECK(descr);
+
+  std::istringstream istr(expr);
+  plang::Scanner scanner(&istr);
+  plang::Parser parser(&scanner, &expr_);
+  CHECK_EQ(0, parser.parse()) << "Could not parse " << expr;
+  CHECK(expr_) << "Empty filter expression";
+  Validate(*expr_);
+
+  msg_.reset(gpb::MessageFactory::generated_factory()->GetPrototype(descr)->New());
+  compiled_.reset(new plang::CompiledExpr(*expr_, descr));
+
+  if (Compile(*expr_) < 0) {
+    nodes_.clear();
+    VLOG(1) << "Filter " << expr << " is evaluated on parsed messages";
+  }
+  values_.resize(fields_.size());
+}
+
+RecordFilter::~RecordFilter() {}
+
+void RecordFilter::Validate(const plang::Expr& e) const {
+  string path;
+  if (const auto* bin_op = dynamic_cast<const plang::BinOp*>(&e)) {
+    Validate(bin_op->left());
+    if (bin_op->type() != plang::BinOp::NOT)
+      Validate(bin_op->right());
+    return;
+  } else if (const auto* term = dynamic_cast<const plang::StringTerm*>(&e)) {
+    if (term->type() == plang::StringTerm::CONST)
+      return;
+    path = term->val();
+  } else if (const auto* def = dynamic_cast<const plang::IsDefFun*>(&e)) {
+    path = def->name();
+  } else {
+    return;
+  }
+
+  const gpb::Descriptor* cur = descr_;
+  vector<absl::string_view> parts = absl::StrSplit(path, '.');
+  for (size_t i = 0; i < parts.size(); ++i) {
+    const FieldDescriptor* fd = cur->FindFieldByName(string(parts[i]));
+    CHECK(fd) << "Could not find field " << parts[i] << " of " << path << " in "
+              << cur->full_name();
+    if (i + 1 < parts.size()) {
+      CHECK_EQ(FieldDescriptor::CPPTYPE_MESSAGE, fd->cpp_type())
+          << parts[i] << " is not a message";
+      cur = fd->message_type();
+    }
+  }
+}
+
+int RecordFilter::Compile(const plang::Expr& e) {
+  const auto* bin_op = dynamic_cast<const plang::BinOp*>(&e);
+  if (!bin_op)
+    return -1;
+
+  Node node;
+  switch (bin_op->type()) {
+    case plang::BinOp::AND:
+    case plang::BinOp::OR:
+      node.kind = bin_op->type() == plang::BinOp::AND ? Node::AND : Node::OR;
+      node.left = Compile(bin_op->left());
+      node.right = Compile(bin_op->right());
+      if (node.left < 0 || node.right < 0)
+        return -1;
+      break;
+    case plang::BinOp::NOT:
+      node.kind = Node::NOT;
+      node.left = Compile(bin_op->left());
+      if (node.left < 0)
+        return -1;
+      break;
+    default:
+      return CompileCmp(*bin_op);
+  }
+
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+// Compiles comparisons of a field with a constant.
+int RecordFilter::CompileCmp(const plang::BinOp& bin_op) {
+  auto as_field = [this](const plang::Expr& e) -> const FieldDescriptor* {
+    const auto* term = dynamic_cast<const plang::StringTerm*>(&e);
+    if (!term || term->type() != plang::StringTerm::VARIABLE)
+      return nullptr;
+    const FieldDescriptor* fd = descr_->FindFieldByName(term->val());
+    if (!fd || fd->is_repeated() || fd->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
+      return nullptr;
+    return fd;
+  };
+
+  auto is_const = [](const plang::Expr& e) {
+    if (dynamic_cast<const plang::NumericLiteral*>(&e))
+      return true;
+    const auto* term = dynamic_cast<const plang::StringTerm*>(&e);
+    return term && term->type() == plang::StringTerm::CONST;
+  };
+
+  Node node;
+  node.kind = Node::CMP;
+  node.op = bin_op.type();
+
+  const FieldDescriptor* fd = as_field(bin_op.left());
+  const plang::Expr* other = &bin_op.right();
+  if (!fd) {
+    fd = as_field(bin_op.right());
+    other = &bin_op.left();
+    node.field_on_left = false;
+  }
+  if (!fd || !is_const(*other))
+    return -1;
+
+  // Constants do not depend on the message.
+  other->eval(*msg_, [&](const ExprValue& val) {
+    node.constant = val;
+    return false;
+  });
+
+  auto res = slot_by_number_.emplace(fd->number(), fields_.size());
+  if (res.second) {
+    fields_.push_back(fd);
+    defaults_.push_back(DefaultValue(fd));
+  }
+  node.slot = res.first->second;
+
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+bool RecordFilter::Eval(int index) const {
+  const Node& node = nodes_[index];
+  switch (node.kind) {
+    case Node::AND:
+      return Eval(node.left) && Eval(node.right);
+    case Node::OR:
+      return Eval(node.left) || Eval(node.right);
+    case Node::NOT:
+      return !Eval(node.left);
+    case Node::CMP:
+      break;
+  }
+
+  const ExprValue& field = values_[node.slot];
+  const ExprValue& l = node.field_on_left ? field : node.constant;
+  const ExprValue& r = node.field_on_left ? node.constant : field;
+  switch (node.op) {
+    case plang::BinOp::EQ:
+      return l.Equal(r);
+    case plang::BinOp::LT:
+      return l.Less(r);
+    case plang::BinOp::LE:
+      return l.Less(r) || l.Equal(r);
+    case plang::BinOp::RLIKE:
+      return l.RLike(r);
+    default:
+      LOG(FATAL) << "Unexpected op " << node.op;
+  }
+  return false;
+}
+
+bool RecordFilter::DecodeFields(absl::string_view record) {
+  std::copy(defaults_.begin(), defaults_.end(), values_.begin());
+
+  gpb::io::CodedInputStream is(reinterpret_cast<const uint8*>(record.data()), record.size());
+  while (uint32 tag = is.ReadTag()) {
+    auto it = slot_by_number_.find(WireFormatLite::GetTagFieldNumber(tag));
+    if (it == slot_by_number_.end()) {
+      if (!WireFormatLite::SkipField(&is, tag))
+        return false;
+      continue;
+    }
+
+    const FieldDescriptor* fd = fields_[it->second];
+    if (WireFormatLite::GetTagWireType(tag) !=
+        WireFormatLite::WireTypeForFieldType(WireFormatLite::FieldType(fd->type())))
+      return false;
+
+    // The last value of a non-repeated field wins.
+    if (!ReadValue(fd, record.data(), &is, &values_[it->second]))
+      return false;
+  }
+  return is.ConsumedEntireMessage();
+}
+
+bool RecordFilter::Pass(absl::string_view record) {
+  if (is_raw() && DecodeFields(record))
+    return Eval(nodes_.size() - 1);
+
+  if (!msg_->ParseFromArray(record.data(), record.size()))
+    return true;
+  return compiled_->EvaluateBool(*msg_);
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,77 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "util/plang/plang.h"
+
+namespace google {
+namespace protobuf {
+class Descriptor;
+class FieldDescriptor;
+}  // namespace protobuf
+}  // namespace google
+
+namespace mr3 {
+namespace detail {
+
+/*! Evaluates a plang expression over serialized protobuf messages.
+ *  Expressions that combine comparisons of top-level non-repeated scalar fields with constants
+ *  are evaluated directly on the wire format: the referenced fields are decoded and the rest
+ *  of the record is skipped. Other expressions parse the whole message.
+ *  Not thread-safe, each reader fiber should have its own instance.
+ */
+class RecordFilter {
+ public:
+  //! Dies if expr can not be parsed or references fields that descr does not have.
+  RecordFilter(const std::string& expr, const google::protobuf::Descriptor* descr);
+  ~RecordFilter();
+
+  //! Returns true if the record passes the filter. Records that can not be parsed are passed
+  //! so that their consumers report them.
+  bool Pass(absl::string_view record);
+
+  //! True if the expression is evaluated without parsing the messages.
+  bool is_raw() const { return !nodes_.empty(); }
+
+ private:
+  struct Node {
+    enum Kind { AND, OR, NOT, CMP } kind;
+    plang::BinOp::Type op = plang::BinOp::EQ;
+    int left = -1, right = -1;  // child nodes.
+    unsigned slot = 0;          // field slot of CMP.
+    bool field_on_left = true;
+    plang::ExprValue constant;
+  };
+
+  void Validate(const plang::Expr& e) const;
+
+  // Returns the index of the compiled node or -1 if the expression can not be evaluated raw.
+  int Compile(const plang::Expr& e);
+  int CompileCmp(const plang::BinOp& bin_op);
+  bool Eval(int index) const;
+
+  // Fills values_ with the fields of the record, returns false if it could not decode them.
+  bool DecodeFields(absl::string_view record);
+
+  std::unique_ptr<plang::Expr> expr_;
+  const google::protobuf::Descriptor* descr_;
+
+  // For the non-raw evaluation.
+  std::unique_ptr<google::protobuf::Message> msg_;
+  std::unique_ptr<plang::CompiledExpr> compiled_;
+
+  std::vector<Node> nodes_;  // the root is the last node.
+  std::vector<const google::protobuf::FieldDescriptor*> fields_;
+  std::vector<plang::ExprValue> defaults_, values_;
+  absl::flat_hash_map<int, unsigned> slot_by_number_;
+};
+
+}  // namespace detail
+}  // namespace mr3
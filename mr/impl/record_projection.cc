@@ -0,0 +1,122 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/record_projection.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "absl/strings/str_split.h"
+#include "base/logging.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+namespace gpb = google::protobuf;
+using gpb::internal::WireFormatLite;
+using gpb::FieldDescriptor;
+
+RecordProjection::RecordProjection(const vector<string>& fields, const gpb::Descriptor* descr) {
+  CHECK(descr);
+  AddLevel(descr);
+
+  for (const string& path : fields) {
+    const gpb::Descriptor* cur = descr;
+    unsigned level = 0;
+    vector<absl::string_view> parts = absl::StrSplit(path, '.');
+    for (size_t i = 0; i < parts.size(); ++i) {
+      const FieldDescriptor* fd = cur->FindFieldByName(string(parts[i]));
+      CHECK(fd) << "Could not find field " << parts[i] << " of " << path << " in "
+                << cur->full_name();
+      if (i + 1 == parts.size()) {
+        levels_[level][fd->number()] = kWhole;
+        break;
+      }
+      CHECK_EQ(FieldDescriptor::CPPTYPE_MESSAGE, fd->cpp_type()) << parts[i] << " is not a message";
+      CHECK_EQ(FieldDescriptor::TYPE_MESSAGE, fd->type()) << "Groups are not supported";
+
+      auto it = levels_[level].find(fd->number());
+      if (it != levels_[level].end() && it->second == kWhole)
+        break;  // the whole sub-message is kept anyway.
+
+      cur = fd->message_type();
+      if (it == levels_[level].end()) {
+        unsigned next = AddLevel(cur);  // invalidates it.
+        levels_[level][fd->number()] = next;
+        level = next;
+      } else {
+        level = it->second;
+      }
+    }
+  }
+  scratch_.resize(levels_.size());
+}
+
+unsigned RecordProjection::AddLevel(const gpb::Descriptor* descr) {
+  unsigned index = levels_.size();
+  levels_.emplace_back();
+  for (int i = 0; i < descr->field_count(); ++i) {
+    const FieldDescriptor* fd = descr->field(i);
+    if (fd->is_required())
+      levels_[index][fd->number()] = kWhole;
+  }
+  return index;
+}
+
+bool RecordProjection::Apply(absl::string_view record, string* dest) {
+  return ApplyLevel(0, record, dest);
+}
+
+bool RecordProjection::ApplyLevel(unsigned level, absl::string_view record, string* dest) {
+  const Level& fields = levels_[level];
+  gpb::io::CodedInputStream is(reinterpret_cast<const uint8*>(record.data()), record.size());
+
+  while (true) {
+    const int start = is.CurrentPosition();
+    uint32 tag = is.ReadTag();
+    if (!tag)
+      break;
+
+    auto it = fields.find(WireFormatLite::GetTagFieldNumber(tag));
+    if (it == fields.end()) {
+      if (!WireFormatLite::SkipField(&is, tag))
+        return false;
+      continue;
+    }
+
+    if (it->second == kWhole) {
+      if (!WireFormatLite::SkipField(&is, tag))
+        return false;
+      dest->append(record.data() + start, is.CurrentPosition() - start);
+      continue;
+    }
+
+    // A sub-message with selected fields, its length changes.
+    const int tag_end = is.CurrentPosition();
+    uint32 length;
+    if (WireFormatLite::GetTagWireType(tag) != WireFormatLite::WIRETYPE_LENGTH_DELIMITED ||
+        !is.ReadVarint32(&length))
+      return false;
+
+    const int pos = is.CurrentPosition();
+    if (!is.Skip(length))
+      return false;
+
+    string& sub = scratch_[it->second];
+    sub.clear();
+    if (!ApplyLevel(it->second, record.substr(pos, length), &sub))
+      return false;
+
+    uint8 buf[5];  // the max varint32 length.
+    uint8* end = gpb::io::CodedOutputStream::WriteVarint32ToArray(sub.size(), buf);
+    dest->append(record.data() + start, tag_end - start);
+    dest->append(reinterpret_cast<const char*>(buf), end - buf);
+    dest->append(sub);
+  }
+  return is.ConsumedEntireMessage();
+}
+
+}  // namespace detail
+}  // namespace mr3
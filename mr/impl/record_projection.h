@@ -0,0 +1,55 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+
+namespace google {
+namespace protobuf {
+class Descriptor;
+}  // namespace protobuf
+}  // namespace google
+
+namespace mr3 {
+namespace detail {
+
+/*! Drops the fields that the consumers do not read from serialized protobuf messages, so that
+ *  the mappers parse only the selected fields.
+ *  Fields are given by their names, nested ones by dotted paths like "account.bank".
+ *  The bytes of the selected fields are copied as is, the sub-messages with selected
+ *  sub-fields are projected recursively. Required fields are always kept so that the
+ *  projected records still parse. Not thread-safe, each reader fiber should have its own
+ *  instance.
+ */
+class RecordProjection {
+ public:
+  //! Dies if fields references fields that descr does not have.
+  RecordProjection(const std::vector<std::string>& fields,
+                   const google::protobuf::Descriptor* descr);
+
+  //! Appends the projection of record to dest. Returns false if record could not be decoded,
+  //! dest is undefined then.
+  bool Apply(absl::string_view record, std::string* dest);
+
+ private:
+  // Maps field numbers to the levels of their sub-messages or to kWhole.
+  using Level = absl::flat_hash_map<int, int>;
+  static constexpr int kWhole = -1;
+
+  unsigned AddLevel(const google::protobuf::Descriptor* descr);
+  bool ApplyLevel(unsigned level, absl::string_view record, std::string* dest);
+
+  std::vector<Level> levels_;  // the root is the first level.
+
+  // The projected sub-messages per level. The levels form a tree, so a level appears at most
+  // once on the path of the recursion.
+  std::vector<std::string> scratch_;
+};
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,60 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/shard_gate.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace boost;
+
+void ShardGate::Add(const std::string& glob) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  open_.insert(glob);
+}
+
+void ShardGate::Close(const std::string& glob) {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  if (open_.erase(glob) == 0)
+    return;
+  closed_.push_back(glob);
+  lk.unlock();
+  cv_.notify_all();
+}
+
+void ShardGate::CloseAll() {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  for (const auto& glob : open_) {
+    closed_.push_back(glob);
+  }
+  open_.clear();
+  lk.unlock();
+  cv_.notify_all();
+}
+
+void ShardGate::Wait() {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  cv_.wait(lk, [this] { return open_.empty(); });
+}
+
+absl::flat_hash_set<std::string> ShardGate::Subscribe() {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  closed_.clear();
+  return open_;
+}
+
+bool ShardGate::Next(bool block, std::string* glob) {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  if (block) {
+    cv_.wait(lk, [this] { return !closed_.empty() || open_.empty(); });
+  }
+  if (closed_.empty())
+    return false;
+
+  *glob = std::move(closed_.front());
+  closed_.pop_front();
+  return true;
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,50 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
+#include <deque>
+#include <string>
+
+#include "absl/container/flat_hash_set.h"
+
+namespace mr3 {
+namespace detail {
+
+/*! Tracks the output shards of an operator that are closed in the background, so that the
+ *  next operator starts on the shards that are complete while the others are still being
+ *  flushed. Shards are identified by their file globs. Thread-safe and fiber-friendly.
+ */
+class ShardGate {
+ public:
+  //! Called by the writer before the shard is closed.
+  void Add(const std::string& glob);
+
+  //! Called by the writer once all the files of the shard are complete.
+  void Close(const std::string& glob);
+
+  //! Closes all the remaining shards.
+  void CloseAll();
+
+  //! Blocks until all the shards are closed.
+  void Wait();
+
+  //! Returns the shards that are still open. Next reports only the shards closed after that.
+  absl::flat_hash_set<std::string> Subscribe();
+
+  //! Sets glob to the next closed shard. If block is true, waits for one unless all the
+  //! shards were reported. Returns false if there is none.
+  bool Next(bool block, std::string* glob);
+
+ private:
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;
+  absl::flat_hash_set<std::string> open_;
+  std::deque<std::string> closed_;
+};
+
+}  // namespace detail
+}  // namespace mr3
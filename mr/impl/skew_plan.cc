@@ -0,0 +1,91 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/skew_plan.h"
+
+#include <algorithm>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "base/logging.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+
+namespace {
+
+constexpr char kSubShardPrefix[] = "shard-";
+constexpr char kSubShardSep[] = "-s";
+
+}  // namespace
+
+SkewPlan::SkewPlan(const FrequencyMap<uint32_t>& freq_map, unsigned modn,
+                   unsigned max_splits)
+    : modn_(modn) {
+  CHECK_GT(modn, 0);
+
+  size_t total = 0;
+  for (const auto& k_v : freq_map) {
+    total += k_v.second;
+  }
+
+  size_t avg_shard = std::max<size_t>(1, total / modn);
+  for (const auto& k_v : freq_map) {
+    if (k_v.second <= avg_shard)
+      continue;
+    size_t splits = std::min<size_t>(max_splits, (k_v.second + avg_shard - 1) / avg_shard);
+    if (splits > 1) {
+      hot_keys_[k_v.first].splits = splits;
+      VLOG(1) << "Splitting key " << k_v.first << " with " << k_v.second << " records into "
+              << splits << " shards";
+    }
+  }
+}
+
+ShardId SkewPlan::Shard(uint32_t key) {
+  uint32_t shard = key % modn_;
+  auto it = hot_keys_.find(key);
+  if (it == hot_keys_.end())
+    return ShardId{shard};
+
+  HotKey& hk = it->second;
+  unsigned index = hk.next;
+  hk.next = (hk.next + 1) % hk.splits;
+
+  return SubShard(shard, index);
+}
+
+unsigned SkewPlan::splits(uint32_t key) const {
+  auto it = hot_keys_.find(key);
+  return it == hot_keys_.end() ? 1 : it->second.splits;
+}
+
+ShardId SkewPlan::SubShard(uint32_t shard, unsigned index) {
+  if (index == 0)
+    return ShardId{shard};
+  return ShardId{absl::StrCat(kSubShardPrefix, absl::Dec(shard, absl::kZeroPad4), kSubShardSep,
+                              index)};
+}
+
+bool SkewPlan::ParseSubShard(const ShardId& sid, uint32_t* base) {
+  if (!absl::holds_alternative<string>(sid))
+    return false;
+
+  absl::string_view str = absl::get<string>(sid);
+  if (!absl::ConsumePrefix(&str, kSubShardPrefix))
+    return false;
+
+  size_t pos = str.find(kSubShardSep);
+  unsigned index = 0;
+  if (pos == absl::string_view::npos ||
+      !absl::SimpleAtoi(str.substr(pos + sizeof(kSubShardSep) - 1), &index) || index == 0) {
+    return false;
+  }
+  return absl::SimpleAtoi(str.substr(0, pos), base);
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,47 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include "absl/container/flat_hash_map.h"
+#include "mr/mr_types.h"
+
+namespace mr3 {
+namespace detail {
+
+/*! Shard-to-key plan for SKEWED_MODN outputs.
+ *  Keys are sharded by key % modn, like with MODN sharding. Hot keys, i.e. keys whose
+ *  frequency is larger than the average shard size, are salted: their records are spread
+ *  round-robin between the base shard and up to max_splits - 1 sub-shards of it.
+ *  The joiner un-salts sub-shards by grouping them under their base shard.
+ */
+class SkewPlan {
+ public:
+  SkewPlan(const FrequencyMap<uint32_t>& freq_map, unsigned modn,
+           unsigned max_splits);
+
+  //! Returns the shard for the next record of the key.
+  ShardId Shard(uint32_t key);
+
+  //! Returns number of shards the key is split into, 1 for regular keys.
+  unsigned splits(uint32_t key) const;
+
+  size_t num_hot_keys() const { return hot_keys_.size(); }
+
+  static ShardId SubShard(uint32_t shard, unsigned index);
+
+  //! Returns true if sid was returned by SubShard with index > 0 and sets its base shard.
+  static bool ParseSubShard(const ShardId& sid, uint32_t* base);
+
+ private:
+  struct HotKey {
+    unsigned splits;
+    unsigned next = 0;
+  };
+
+  unsigned modn_;
+  absl::flat_hash_map<uint32_t, HotKey> hot_keys_;
+};
+
+}  // namespace detail
+}  // namespace mr3
@@ -5,6 +5,8 @@
 
 #include <functional>
 
+#include "absl/types/optional.h"
+#include "base/cycle_clock.h"
 #include "base/type_traits.h"
 #include "mr/do_context.h"
 
@@ -57,6 +59,15 @@ base::void_t<decltype(&Handler::OnShardStart)> NotifyShardStartMaybe(Handler* h,
 
 template <typename Handler> void NotifyShardStartMaybe(Handler*, const ShardId&, char) {}
 
+template <typename Handler, typename ToType>
+base::void_t<decltype(&Handler::OnKeyFinish)> KeyFinishCallMaybe(Handler* h, absl::string_view key,
+                                                                 DoContext<ToType>* cntx, int) {
+  h->OnKeyFinish(key, cntx);
+}
+
+template <typename Handler, typename ToType>
+void KeyFinishCallMaybe(Handler*, absl::string_view, DoContext<ToType>*, char) {}
+
 /// Optionally set type_name if RecordTraits<OutType>::TypeName() exists.
 template <typename OutType>
 base::void_t<decltype(&RecordTraits<OutType>::TypeName)> WriteTypeNameMaybe(pb::Output* outp, int) {
@@ -64,25 +75,81 @@ base::void_t<decltype(&RecordTraits<OutType>::TypeName)> WriteTypeNameMaybe(pb::
 }
 template <typename OutType> void WriteTypeNameMaybe(pb::Output* outp, char) {}
 
+//! Extracts the sort key from a raw record. Returns false if the record can not be parsed.
+using RawKeyCb = std::function<bool(bool is_binary, absl::string_view rv, std::string* key)>;
+
 class HandlerWrapperBase {
  public:
   virtual ~HandlerWrapperBase() {}
 
   RawSinkCb Get(size_t index) const { return raw_fn_vec_[index]; }
 
+  //! Same as Get() but consumes record views. Parses the views directly when RecordTraits
+  //! support it, thus avoiding materializing RawRecord for each record.
+  RawViewSinkCb GetView(size_t index) const { return view_fn_vec_[index]; }
+
   size_t Size() const { return raw_fn_vec_.size(); }
 
+  //! True if the inputs must be delivered sorted by key, see HandlerBinding::Create.
+  bool IsSortMerge() const { return !key_fn_vec_.empty(); }
+  const RawKeyCb& GetKeyFn(size_t index) const { return key_fn_vec_[index]; }
+
   // Called by joiner_executor, or sometimes by handler via DoContext.
   virtual void SetGroupingShard(const ShardId& sid) = 0;
   virtual void OnShardFinish() {}
 
+  // Called by joiner_executor in sort-merge mode after all the records of the key were passed.
+  virtual void OnKeyFinish(absl::string_view key) {}
+
  protected:
-  template <typename F> void AddFn(F&& f) { raw_fn_vec_.emplace_back(std::forward<F>(f)); }
+  //! f must accept both RawRecord&& and absl::string_view.
+  template <typename F> void AddFn(F&& f) {
+    view_fn_vec_.emplace_back(f);
+    raw_fn_vec_.emplace_back(std::forward<F>(f));
+  }
+
+  void AddSinks(RawSinks sinks) {
+    raw_fn_vec_.push_back(std::move(sinks.raw));
+    view_fn_vec_.push_back(std::move(sinks.view));
+  }
+
+  // Either all sinks have key functions or none.
+  void AddKeyFn(RawKeyCb key_fn) {
+    CHECK_EQ(key_fn_vec_.size() + 1, raw_fn_vec_.size());
+    key_fn_vec_.push_back(std::move(key_fn));
+  }
 
  private:
   std::vector<RawSinkCb> raw_fn_vec_;
+  std::vector<RawViewSinkCb> view_fn_vec_;
+  std::vector<RawKeyCb> key_fn_vec_;
 };
 
+/// Calls RecordTraits<T>::Parse with the record view if it has such overload.
+template <typename RT, typename T>
+auto TraitsParse(RT* rt, bool is_binary, absl::string_view rv, T* res, int)
+    -> decltype(rt->Parse(is_binary, rv, res)) {
+  return rt->Parse(is_binary, rv, res);
+}
+
+template <typename RT, typename T>
+bool TraitsParse(RT* rt, bool is_binary, absl::string_view rv, T* res, char) {
+  return rt->Parse(is_binary, RawRecord(rv), res);
+}
+
+/// Passes the record to the parser as is if the parser accepts it,
+/// otherwise materializes RawRecord from the view.
+template <typename Parser, typename R, typename T>
+auto CallParser(Parser* parser, bool is_binary, R&& rr, T* res, int)
+    -> decltype((*parser)(is_binary, std::forward<R>(rr), res)) {
+  return (*parser)(is_binary, std::forward<R>(rr), res);
+}
+
+template <typename Parser, typename T>
+bool CallParser(Parser* parser, bool is_binary, absl::string_view rv, T* res, char) {
+  return (*parser)(is_binary, RawRecord(rv), res);
+}
+
 template <typename T> class DefaultParser {
   RecordTraits<T> rt_;
   static_assert(std::is_copy_constructible<RecordTraits<T>>::value,
@@ -94,13 +161,82 @@ template <typename T> class DefaultParser {
   bool operator()(bool is_binary, RawRecord&& rr, T* res) {
     return rt_.Parse(is_binary, std::move(rr), res);
   }
+
+  bool operator()(bool is_binary, absl::string_view rv, T* res) {
+    return TraitsParse(&rt_, is_binary, rv, res, 0);
+  }
+
+  //! Exists if RecordTraits<T> can view the records in place, see PodTraits.
+  template <typename RT = RecordTraits<T>>
+  auto View(bool is_binary, absl::string_view rv)
+      -> decltype(std::declval<RT&>().View(is_binary, rv)) {
+    return rt_.View(is_binary, rv);
+  }
+};
+
+/// Returns the record viewed in place by the parser, or nullptr if the parser can not view it.
+template <typename T, typename Parser>
+auto ParserView(Parser* parser, bool is_binary, absl::string_view rv, int)
+    -> decltype(parser->View(is_binary, rv)) {
+  return parser->View(is_binary, rv);
+}
+
+template <typename T, typename Parser>
+const T* ParserView(Parser* parser, bool is_binary, absl::string_view rv, char) {
+  return nullptr;
+}
+
+/*! Measures parse and DoFn times of every kRate-th record into RawContext::profile().
+ *  Writes done by the sampled DoFn are timed by DoContext and are subtracted from DoFn time.
+ */
+class ProfileSampler {
+ public:
+  static constexpr unsigned kRate = 32;
+
+  explicit ProfileSampler(RawContext* ctx) {
+    if (++ctx->sample_cnt_ % kRate == 0) {
+      ctx_ = ctx;
+      start_ = Now();
+    }
+  }
+
+  ~ProfileSampler() {
+    if (!ctx_)
+      return;
+    ctx_->sampling_ = 0;
+    uint64_t delta = base::CycleClock::ToNanos(Now() - start_) * kRate;
+    uint64_t writes = ctx_->profile_.write_ns - write_start_;
+    if (delta > writes)
+      ctx_->profile_.do_fn_ns += delta - writes;
+  }
+
+  //! Called after the record is parsed and before it's passed to DoFn.
+  void OnParsed() {
+    if (!ctx_)
+      return;
+    uint64_t now = Now();
+    ctx_->profile_.parse_ns += base::CycleClock::ToNanos(now - start_) * kRate;
+    start_ = now;
+    write_start_ = ctx_->profile_.write_ns;
+    ctx_->sampling_ = kRate;
+  }
+
+ private:
+  static uint64_t Now() { return base::CycleClock::Now(); }
+
+  RawContext* ctx_ = nullptr;
+  uint64_t start_ = 0;
+  uint64_t write_start_ = 0;
 };
 
-template <typename FromType, typename Parser, typename DoFn, typename ToType>
-void ParseAndDo(Parser* parser, DoContext<ToType>* context, DoFn&& do_fn, RawRecord&& rr) {
+// R is either RawRecord or absl::string_view.
+template <typename FromType, typename Parser, typename DoFn, typename ToType, typename R>
+void ParseAndDo(Parser* parser, DoContext<ToType>* context, DoFn&& do_fn, R&& rr) {
   FromType tmp_rec;
+  ProfileSampler sampler(context->raw());
   bool is_binary = context->raw()->is_binary();
-  bool parse_ok = (*parser)(is_binary, std::move(rr), &tmp_rec);
+  bool parse_ok = CallParser(parser, is_binary, std::forward<R>(rr), &tmp_rec, 0);
+  sampler.OnParsed();
 
   if (parse_ok) {
     do_fn(std::move(tmp_rec), context);
@@ -109,7 +245,59 @@ void ParseAndDo(Parser* parser, DoContext<ToType>* context, DoFn&& do_fn, RawRec
   }
 }
 
-template <typename Handler, typename ToType> class HandlerWrapper : public HandlerWrapperBase {
+/*! Provides the records parsed for handlers that take them by const reference.
+ *  The record returned by New() is valid until the following Done().
+ *  Specialized in mr/mr_pb.h to allocate protobuf messages on an arena.
+ */
+template <typename T, typename = void> class RecordAllocator {
+ public:
+  T* New() {
+    val_.emplace();
+    return &*val_;
+  }
+
+  void Done() { val_.reset(); }
+
+ private:
+  absl::optional<T> val_;
+};
+
+// Same as ParseAndDo but passes to do_fn a reference to the record provided by alloc.
+template <typename FromType, typename Parser, typename Alloc, typename DoFn, typename ToType,
+          typename R>
+void ParseAndDoRef(Parser* parser, Alloc* alloc, DoContext<ToType>* context, DoFn&& do_fn,
+                   R&& rr) {
+  bool is_binary = context->raw()->is_binary();
+  if (const FromType* view = ParserView<FromType>(parser, is_binary, absl::string_view(rr), 0)) {
+    ProfileSampler sampler(context->raw());
+    sampler.OnParsed();
+    do_fn(*view, context);
+    return;
+  }
+
+  FromType* rec = alloc->New();
+  {
+    ProfileSampler sampler(context->raw());
+    bool parse_ok = CallParser(parser, is_binary, std::forward<R>(rr), rec, 0);
+    sampler.OnParsed();
+
+    if (parse_ok) {
+      do_fn(*rec, context);
+    } else {
+      context->raw()->EmitParseError();
+    }
+  }
+  alloc->Done();
+}
+
+//! Handler wrapper that outputs records of type T.
+template <typename T> class TypedHandlerWrapper : public HandlerWrapperBase {
+ public:
+  virtual DoContext<T>* do_context() = 0;
+};
+
+template <typename Handler, typename ToType>
+class HandlerWrapper : public TypedHandlerWrapper<ToType> {
   Handler h_;
   DoContext<ToType> do_ctx_;
 
@@ -118,6 +306,8 @@ template <typename Handler, typename ToType> class HandlerWrapper : public Handl
   HandlerWrapper(const Output<ToType>& out, RawContext* raw_context, Args&&... args)
       : h_(std::forward<Args>(args)...), do_ctx_(out, raw_context) {}
 
+  DoContext<ToType>* do_context() final { return &do_ctx_; }
+
   void SetGroupingShard(const ShardId& sid) final {
     if (!do_ctx_.out_.msg().has_shard_spec()) {
       do_ctx_.out_.SetConstantShard(sid);
@@ -126,23 +316,90 @@ template <typename Handler, typename ToType> class HandlerWrapper : public Handl
   }
 
   // We pass 0 into 3rd argument so compiler will prefer 'int' resolution if possible.
-  void OnShardFinish() final { FinishCallMaybe(&h_, &do_ctx_, 0); }
+  void OnShardFinish() final {
+    FinishCallMaybe(&h_, &do_ctx_, 0);
+    do_ctx_.FlushCombined();
+  }
+
+  void OnKeyFinish(absl::string_view key) final { KeyFinishCallMaybe(&h_, key, &do_ctx_, 0); }
 
   /// Add DoFn into processing pipeline. This DoFn may accept any free FnInputType instead of
   /// FromType as long as FromType can be moved into it. We create a wrapping handler
   /// that can accept RawRecord, parse it and apply the supplied DoFn.
   template <typename FromType, typename FnInputType>
   void Add(void (Handler::*ptr)(FnInputType, DoContext<ToType>*)) {
-    AddFn([this, ptr, parser = DefaultParser<FromType>{}](RawRecord&& rr) mutable {
+    AddDispatch<FromType>(ptr, std::is_same<FnInputType, const FromType&>{});
+  }
+
+  //! Returns the sink that passes already parsed records to DoFn.
+  template <typename FromType, typename FnInputType>
+  std::function<void(FromType&&)> BindDo(void (Handler::*ptr)(FnInputType, DoContext<ToType>*)) {
+    return [this, ptr](FromType&& val) { (h_.*ptr)(std::move(val), &do_ctx_); };
+  }
+
+  void AddFromFactory(const RawSinkMethodFactory<Handler, ToType>& f, const RawKeyCb& key_fn) {
+    this->AddSinks(f(&h_, &do_ctx_));
+    if (key_fn)
+      this->AddKeyFn(key_fn);
+  }
+
+ private:
+  template <typename FromType, typename FnInputType>
+  void AddDispatch(void (Handler::*ptr)(FnInputType, DoContext<ToType>*), std::false_type) {
+    this->AddFn([this, ptr, parser = DefaultParser<FromType>{}](auto&& rr) mutable {
       ParseAndDo<FromType>(&parser, &do_ctx_,
                            [this, ptr](FromType&& val, DoContext<ToType>* cntx) {
                              return (h_.*ptr)(std::move(val), cntx);
                            },
-                           std::move(rr));
+                           std::forward<decltype(rr)>(rr));
+    });
+  }
+
+  // DoFn accepts const FromType&, hence the records can be reused after the call.
+  // Both sinks share the allocator since they are called from the same fiber.
+  template <typename FromType, typename FnInputType>
+  void AddDispatch(void (Handler::*ptr)(FnInputType, DoContext<ToType>*), std::true_type) {
+    auto alloc = std::make_shared<RecordAllocator<FromType>>();
+    this->AddFn([this, ptr, alloc, parser = DefaultParser<FromType>{}](auto&& rr) mutable {
+      ParseAndDoRef<FromType>(&parser, alloc.get(), &do_ctx_,
+                              [this, ptr](const FromType& val, DoContext<ToType>* cntx) {
+                                return (h_.*ptr)(val, cntx);
+                              },
+                              std::forward<decltype(rr)>(rr));
     });
   }
+};
+
+/*! Runs two chained map handlers as one. Consumes the input records of the upstream handler
+ *  and passes its outputs to the downstream handler as typed records.
+ */
+template <typename FromType, typename ToType>
+class FusedHandlerWrapper : public TypedHandlerWrapper<ToType> {
+  std::unique_ptr<TypedHandlerWrapper<FromType>> up_;
+  std::unique_ptr<TypedHandlerWrapper<ToType>> down_;
+
+ public:
+  FusedHandlerWrapper(TypedHandlerWrapper<FromType>* up, TypedHandlerWrapper<ToType>* down,
+                      std::function<void(FromType&&)> down_sink)
+      : up_(up), down_(down) {
+    up_->do_context()->fused_sink_ = std::move(down_sink);
+    for (size_t i = 0; i < up_->Size(); ++i) {
+      this->AddSinks(RawSinks{up_->Get(i), up_->GetView(i)});
+    }
+  }
 
-  void AddFromFactory(const RawSinkMethodFactory<Handler, ToType>& f) { AddFn(f(&h_, &do_ctx_)); }
+  DoContext<ToType>* do_context() final { return down_->do_context(); }
+
+  void SetGroupingShard(const ShardId& sid) final {
+    up_->SetGroupingShard(sid);
+    down_->SetGroupingShard(sid);
+  }
+
+  // Upstream handler may output records when it finishes the shard.
+  void OnShardFinish() final {
+    up_->OnShardFinish();
+    down_->OnShardFinish();
+  }
 };
 
 template <typename T, typename Parser = DefaultParser<T>>
@@ -153,9 +410,13 @@ class IdentityHandlerWrapper : public HandlerWrapperBase {
  public:
   IdentityHandlerWrapper(const Output<T>& out, Parser parser, RawContext* raw_context)
       : do_ctx_(out, raw_context), parser_(std::move(parser)) {
-    AddFn([this](RawRecord&& rr) {
+    AddFn([this](auto&& rr) {
       T val;
-      if (parser_(do_ctx_.raw()->is_binary(), std::move(rr), &val)) {
+      ProfileSampler sampler(do_ctx_.raw());
+      bool parse_ok = CallParser(&parser_, do_ctx_.raw()->is_binary(),
+                                 std::forward<decltype(rr)>(rr), &val, 0);
+      sampler.OnParsed();
+      if (parse_ok) {
         do_ctx_.Write(std::move(val));
       } else {
         do_ctx_.raw()->EmitParseError();
@@ -164,6 +425,8 @@ class IdentityHandlerWrapper : public HandlerWrapperBase {
   }
 
   void SetGroupingShard(const ShardId& sid) final {}
+
+  void OnShardFinish() final { do_ctx_.FlushCombined(); }
 };
 
 class TableBase : public std::enable_shared_from_this<TableBase> {
@@ -182,6 +445,18 @@ class TableBase : public std::enable_shared_from_this<TableBase> {
 
   HandlerWrapperBase* CreateHandler(RawContext* context);
 
+  //! Non-null for maps that can be fused with the map table they consume.
+  TableBase* fuse_source() const { return fuse_source_; }
+
+  //! True if the table was fused into its consumer and should not run on its own.
+  bool is_fused() const { return is_fused_; }
+
+  //! Makes this table consume the inputs of fuse_source() and run its handler in-process.
+  void FuseWithSource();
+
+  //! Names of the inputs that hold the records of this table.
+  std::vector<std::string> SourceInputs() const;
+
  protected:
   TableBase(pb::Operator op, Pipeline* owner) : op_(std::move(op)), pipeline_(owner) {}
   virtual ~TableBase() = 0;
@@ -194,6 +469,13 @@ class TableBase : public std::enable_shared_from_this<TableBase> {
     is_identity_ = true;
   }
 
+  template <typename F> void SetFusedFactory(TableBase* source, F&& f) {
+    fuse_source_ = source;
+    fused_factory_ = std::forward<F>(f);
+  }
+
+  bool is_identity() const { return is_identity_; }
+
   void CheckFailIdentity() const;
   static void ValidateGroupInputOrDie(const TableBase* other);
 
@@ -205,7 +487,6 @@ class TableBase : public std::enable_shared_from_this<TableBase> {
 
   pb::Operator GetDependeeOp() const;
 
-  bool is_identity() const { return is_identity_; }
   bool defined() const { return bool(handler_factory_); }
 
   pb::Operator op_;
@@ -213,6 +494,10 @@ class TableBase : public std::enable_shared_from_this<TableBase> {
 
   std::function<HandlerWrapperBase*(RawContext* context)> handler_factory_;
   bool is_identity_ = true;
+
+  TableBase* fuse_source_ = nullptr;
+  std::function<HandlerWrapperBase*(RawContext* context)> fused_factory_;
+  bool is_fused_ = false;
 };
 
 // I need TableImplT because I bind TableBase functions to output object contained in the class.
@@ -246,6 +531,15 @@ template <typename OutT> class TableImplT : public TableBase {
       return ptr;
     });
 
+    if (ptr->op().type() == pb::Operator::MAP && !ptr->is_identity()) {
+      result->SetFusedFactory(ptr, [ptr, &out = result->output_, args...](RawContext* raw_ctxt) {
+        auto* up = static_cast<TypedHandlerWrapper<FromType>*>(ptr->CreateHandler(raw_ctxt));
+        auto* down = new HandlerWrapper<MapType, OutT>(out, raw_ctxt, args...);
+        auto down_sink = down->template BindDo<FromType>(&MapType::Do);
+        return new FusedHandlerWrapper<FromType, OutT>(up, down, std::move(down_sink));
+      });
+    }
+
     return result;
   }
 
@@ -267,31 +561,45 @@ template <typename OutT> class TableImplT : public TableBase {
     return HandlerBinding<Handler, ToType>::template Create<OutT>(this, ptr);
   }
 
-  template <typename GrouperType>
+  template <typename Handler, typename ToType, typename U, typename KeyFn>
+  HandlerBinding<Handler, ToType> BindWith(EmitMemberFn<U, Handler, ToType> ptr,
+                                           KeyFn&& key_fn) const {
+    return HandlerBinding<Handler, ToType>::template Create<OutT>(this, ptr,
+                                                                  std::forward<KeyFn>(key_fn));
+  }
+
+  //! handler_args are passed to the constructor of every GrouperType instance.
+  template <typename GrouperType, typename... Args>
   static std::shared_ptr<TableImplT<OutT>> AsGroup(
       const std::string& name,
-      std::initializer_list<detail::HandlerBinding<GrouperType, OutT>> args, Pipeline* owner) {
+      std::initializer_list<detail::HandlerBinding<GrouperType, OutT>> args, Pipeline* owner,
+      Args&&... handler_args) {
     pb::Operator op;
     op.set_op_name(name);
     op.set_type(pb::Operator::GROUP);
 
     std::vector<RawSinkMethodFactory<GrouperType, OutT>> factories;
+    std::vector<RawKeyCb> key_fns;
 
     for (auto& arg : args) {
       ValidateGroupInputOrDie(arg.tbase());
       op.add_input_name(arg.tbase()->op().output().name());
       factories.push_back(arg.factory());
+      key_fns.push_back(arg.key_fn());
+      CHECK_EQ(bool(key_fns.front()), bool(key_fns.back()))
+          << "Either all or none of the inputs of " << name << " must have a key extractor";
     }
 
     auto result = std::make_shared<TableImplT<OutT>>(std::move(op), owner);
-    result->SetHandlerFactory(
-        [& out = result->output_, factories = std::move(factories)](RawContext* raw_ctxt) {
-          auto* ptr = new HandlerWrapper<GrouperType, OutT>(out, raw_ctxt);
-          for (const auto& m : factories) {
-            ptr->AddFromFactory(m);
-          }
-          return ptr;
-        });
+    result->SetHandlerFactory([& out = result->output_, factories = std::move(factories),
+                               key_fns = std::move(key_fns),
+                               handler_args...](RawContext* raw_ctxt) {
+      auto* ptr = new HandlerWrapper<GrouperType, OutT>(out, raw_ctxt, handler_args...);
+      for (size_t i = 0; i < factories.size(); ++i) {
+        ptr->AddFromFactory(factories[i], key_fns[i]);
+      }
+      return ptr;
+    });
     return result;
   }
 
@@ -312,19 +620,43 @@ template <typename Handler, typename ToType> class HandlerBinding {
       auto do_fn = [handler, ptr](FromType&& val, DoContext<ToType>* cntx) {
         return (handler->*ptr)(std::move(val), cntx);
       };
-      return [do_fn, context, parser = DefaultParser<FromType>{}](RawRecord&& rr) mutable {
-        ParseAndDo<FromType>(&parser, context, std::move(do_fn), std::move(rr));
+      auto sink = [do_fn, context, parser = DefaultParser<FromType>{}](auto&& rr) mutable {
+        ParseAndDo<FromType>(&parser, context, do_fn, std::forward<decltype(rr)>(rr));
       };
+      return RawSinks{sink, sink};
+    };
+    return res;
+  }
+
+  /// Binds the input in sort-merge mode. key_fn(const FromType&) returns the sort key of a record.
+  /// The joiner sorts the shard inputs by key using local disk and passes the records
+  /// grouped by key, calling Handler::OnKeyFinish(absl::string_view, DoContext*), if exists,
+  /// after each group.
+  template <typename FromType, typename U, typename KeyFn>
+  static HandlerBinding<Handler, ToType> Create(const TableBase* from,
+                                                EmitMemberFn<U, Handler, ToType> ptr,
+                                                KeyFn key_fn) {
+    HandlerBinding<Handler, ToType> res = Create<FromType>(from, ptr);
+    res.key_fn_ = [key_fn = std::move(key_fn), parser = DefaultParser<FromType>{}](
+                      bool is_binary, absl::string_view rv, std::string* key) mutable {
+      FromType tmp_rec;
+      if (!CallParser(&parser, is_binary, rv, &tmp_rec, 0))
+        return false;
+      const auto& k = key_fn(tmp_rec);
+      key->assign(k.data(), k.size());
+      return true;
     };
     return res;
   }
 
   const TableBase* tbase() const { return tbase_; }
   RawSinkMethodFactory<Handler, ToType> factory() const { return setup_func_; }
+  RawKeyCb key_fn() const { return key_fn_; }
 
  private:
   const TableBase* tbase_;
   RawSinkMethodFactory<Handler, ToType> setup_func_;
+  RawKeyCb key_fn_;
 };
 
 }  // namespace detail
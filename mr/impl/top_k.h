@@ -0,0 +1,184 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "mr/do_context.h"
+
+namespace mr3 {
+namespace detail {
+
+//! A record with the score that orders it in PTable::TopK and PTable::Sample.
+template <typename T> struct Scored {
+  double score = 0;
+  T val;
+};
+
+//! Parameters of PTable::TopK and PTable::Sample shared by their mappers and joiners.
+template <typename T> struct TopKSpec {
+  size_t k = 0;
+
+  // The score of TopK or the weight of Sample, which is 1 if not set.
+  std::function<double(const T&)> score;
+  bool sample = false;
+
+  // Selects k records per key if set.
+  std::function<std::string(const T&)> key;
+
+  //! Sampling scores are the keys of Efraimidis-Spirakis weighted reservoir sampling:
+  //! log(u) / weight for uniform u in (0, 1], i.e. the log of u^(1/weight). Returns false for
+  //! the records of non-positive weights, which are never sampled.
+  bool Score(const T& val, std::mt19937_64* rng, double* res) const {
+    if (!sample) {
+      *res = score(val);
+      return true;
+    }
+
+    double weight = score ? score(val) : 1.0;
+    if (!(weight > 0))
+      return false;
+    double u = (((*rng)() >> 11) + 1) * 0x1.0p-53;
+    *res = std::log(u) / weight;
+    return true;
+  }
+};
+
+//! Keeps the k items with the highest scores. A min-heap, so that the lowest score is replaced.
+template <typename T> class TopKHeap {
+ public:
+  bool Accepts(double score, size_t k) const {
+    return items_.size() < k || score > items_.front().score;
+  }
+
+  //! item must be accepted. Returns true if the heap has grown.
+  bool Push(Scored<T>&& item, size_t k) {
+    if (items_.size() < k) {
+      items_.push_back(std::move(item));
+      std::push_heap(items_.begin(), items_.end(), &Greater);
+      return true;
+    }
+    std::pop_heap(items_.begin(), items_.end(), &Greater);
+    items_.back() = std::move(item);
+    std::push_heap(items_.begin(), items_.end(), &Greater);
+    return false;
+  }
+
+  //! Returns the items sorted by descending score and clears the heap.
+  std::vector<Scored<T>> Take() {
+    std::sort_heap(items_.begin(), items_.end(), &Greater);
+    return std::move(items_);
+  }
+
+ private:
+  static bool Greater(const Scored<T>& a, const Scored<T>& b) { return a.score > b.score; }
+
+  std::vector<Scored<T>> items_;
+};
+
+/*! Computes the top k records of its input and writes them with their scores when it finishes.
+ *  Per-key heaps are flushed once they hold too many records in total, which is still correct
+ *  since TopKMerger merges the partial results of all the mappers anyway.
+ */
+template <typename T> class TopKMapper {
+ public:
+  static constexpr size_t kMaxEntries = OutputBase::kDefaultCombineKeys;
+
+  explicit TopKMapper(std::shared_ptr<const TopKSpec<T>> spec)
+      : spec_(std::move(spec)), rng_(std::random_device{}()) {}
+
+  void Do(T val, DoContext<Scored<T>>* cntx) {
+    double score;
+    if (!spec_->Score(val, &rng_, &score))
+      return;
+
+    TopKHeap<T>& heap = heaps_[spec_->key ? spec_->key(val) : std::string{}];
+    if (!heap.Accepts(score, spec_->k))
+      return;
+
+    entries_ += heap.Push(Scored<T>{score, std::move(val)}, spec_->k);
+    if (entries_ > std::max(kMaxEntries, spec_->k))
+      Flush(cntx);
+  }
+
+  void OnShardFinish(DoContext<Scored<T>>* cntx) { Flush(cntx); }
+
+ private:
+  void Flush(DoContext<Scored<T>>* cntx) {
+    for (auto& k_v : heaps_) {
+      for (auto& item : k_v.second.Take())
+        cntx->Write(std::move(item));
+    }
+    heaps_.clear();
+    entries_ = 0;
+  }
+
+  std::shared_ptr<const TopKSpec<T>> spec_;
+  std::mt19937_64 rng_;
+  absl::flat_hash_map<std::string, TopKHeap<T>> heaps_;
+  size_t entries_ = 0;
+};
+
+//! Merges the partial results of TopKMapper in each shard and writes the records of every key
+//! by descending score.
+template <typename T> class TopKMerger {
+ public:
+  explicit TopKMerger(std::shared_ptr<const TopKSpec<T>> spec) : spec_(std::move(spec)) {}
+
+  void On(Scored<T>&& item, DoContext<T>* cntx) {
+    TopKHeap<T>& heap = heaps_[spec_->key ? spec_->key(item.val) : std::string{}];
+    if (heap.Accepts(item.score, spec_->k))
+      heap.Push(std::move(item), spec_->k);
+  }
+
+  void OnShardFinish(DoContext<T>* cntx) {
+    for (auto& k_v : heaps_) {
+      for (auto& item : k_v.second.Take())
+        cntx->Write(std::move(item.val));
+    }
+    heaps_.clear();
+  }
+
+ private:
+  std::shared_ptr<const TopKSpec<T>> spec_;
+  absl::flat_hash_map<std::string, TopKHeap<T>> heaps_;
+};
+
+// Has its own RecordTraits below.
+template <typename T> struct IsPodRecord<Scored<T>> : std::false_type {};
+
+}  // namespace detail
+
+//! The score is appended to the binary serialization of the record.
+template <typename T> class RecordTraits<detail::Scored<T>> {
+  RecordTraits<T> rt_;
+
+ public:
+  std::string Serialize(bool is_binary, detail::Scored<T>&& item) {
+    std::string res = rt_.Serialize(true, std::move(item.val));
+    char buf[sizeof(double)];
+    memcpy(buf, &item.score, sizeof(double));
+    res.append(buf, sizeof(double));
+    return res;
+  }
+
+  bool Parse(bool is_binary, std::string&& tmp, detail::Scored<T>* res) {
+    if (tmp.size() < sizeof(double))
+      return false;
+    size_t sz = tmp.size() - sizeof(double);
+    memcpy(&res->score, tmp.data() + sz, sizeof(double));
+    tmp.resize(sz);
+    return rt_.Parse(true, std::move(tmp), &res->val);
+  }
+};
+
+}  // namespace mr3
@@ -3,12 +3,32 @@
 //
 #include "mr/joiner_executor.h"
 
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <queue>
+
+#include <boost/fiber/buffered_channel.hpp>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "base/logging.h"
+#include "mr/impl/shard_gate.h"
 #include "mr/impl/table_impl.h"
 #include "mr/pipeline.h"
 #include "mr/runner.h"
 #include "util/asio/io_context_pool.h"
 
+DEFINE_uint32(join_sort_buffer_mb, 256,
+              "Per-fiber memory budget for sorting a shard in sort-merge joins. "
+              "Once passed, sorted runs are spilled into join_spill_dir.");
+DEFINE_string(join_spill_dir, "/tmp", "Local directory for sort-merge join spill files.");
+DEFINE_uint32(join_memory_budget_mb, 0,
+              "Process-wide memory budget for the state of the shards that are joined "
+              "concurrently. Shards that do not fit let the smaller ones run first. "
+              "The state is estimated by the size of the shard files unless the handlers "
+              "report it. 0 disables the budget.");
+
 namespace mr3 {
 
 using namespace boost;
@@ -24,8 +44,69 @@ ShardId GetShard(const pb::Input::FileSpec& fspec) {
   return ShardId{fspec.custom_shard_id()};
 }
 
+// A sorted shard file of a join input during the merge. Its records are read by a separate
+// fiber and passed in batches.
+struct SortedStream {
+  uint32_t tag;
+  std::string file_name;
+  fibers::buffered_channel<RawRecordBatch> q{2};
+  fibers::fiber reader;
+  uint64_t cnt = 0;
+
+  RawRecordBatch batch;
+  size_t pos = 0;
+  std::string key, scratch;
+
+  SortedStream(uint32_t t, const std::string& fn) : tag(t), file_name(fn) {}
+
+  absl::string_view value() const { return batch[pos]; }
+
+  // Moves to the next record whose key can be extracted. Returns false at the end of the file.
+  bool Next(const detail::RawKeyCb& key_fn, bool is_binary, RawContext* context);
+};
+
+bool SortedStream::Next(const detail::RawKeyCb& key_fn, bool is_binary, RawContext* context) {
+  while (true) {
+    if (pos + 1 < batch.size()) {
+      ++pos;
+    } else {
+      pos = 0;
+      do {
+        if (q.pop(batch) != channel_op_status::success)
+          return false;
+      } while (batch.empty());
+    }
+
+    if (key_fn(is_binary, batch[pos], &scratch))
+      break;
+    context->EmitParseError();
+  }
+
+  CHECK(scratch >= key) << file_name << " is not sorted by the join key";
+  key.swap(scratch);
+  return true;
+}
+
 }  // namespace
 
+// A batch of a shard input that was read ahead.
+struct JoinerExecutor::InputChunk {
+  uint32_t tag;  // the position of the input in the shard.
+  std::string file_name;
+  RawRecordBatch batch;
+};
+
+struct JoinerExecutor::ShardTask {
+  // Bounds the read-ahead to 15 batches.
+  static constexpr unsigned kChunkQSize = 16;
+
+  ShardInput input;
+  fibers::buffered_channel<InputChunk> chunks{kChunkQSize};
+  uint64_t cnt = 0;
+
+  explicit ShardTask(ShardInput&& si) : input(std::move(si)) {}
+};
+
 struct JoinerExecutor::PerIoStruct {
   unsigned index;
   ::boost::fibers::fiber process_fd;
@@ -35,7 +116,6 @@ struct JoinerExecutor::PerIoStruct {
   PerIoStruct(unsigned i) : index(i) {}
 };
 
-thread_local std::unique_ptr<JoinerExecutor::PerIoStruct> JoinerExecutor::per_io_;
 
 void JoinerExecutor::PerIoStruct::Shutdown() { process_fd.join(); }
 
@@ -54,36 +134,152 @@ void JoinerExecutor::Run(const std::vector<const InputBase*>& inputs, detail::Ta
 
   CheckInputs(inputs);
 
+  budget_.reset(new detail::MemoryBudget(size_t(FLAGS_join_memory_budget_mb) << 20));
+
   // ProcessInputQ uses runner_ immediately when starts.
   runner_->OperatorStart(&tb->op());
 
+  per_io_.resize(pool_->size());
   pool_->AwaitOnAll([&](unsigned index, IoContext&) {
-    per_io_.reset(new PerIoStruct(index));
+    per_io_[index].reset(new PerIoStruct(index));
 
-    per_io_->process_fd = fibers::fiber{&JoinerExecutor::ProcessInputQ, this, tb};
+    per_io_[index]->process_fd = fibers::fiber{&JoinerExecutor::ProcessInputQ, this, tb};
   });
 
+  // Sub-shards of hot keys are un-salted: each one is grouped as its base shard and gets
+  // the base shard files of the other inputs.
+  std::map<uint32_t, std::vector<ShardId>> sub_shards;
+  for (const InputBase* input : inputs) {
+    for (const auto& fspec : input->msg().file_spec()) {
+      if (fspec.has_base_shard_id())
+        sub_shards[fspec.base_shard_id()].push_back(GetShard(fspec));
+    }
+  }
+
   std::map<ShardId, std::vector<IndexedInput>> shard_inputs;
   for (uint32_t i = 0; i < inputs.size(); ++i) {
     const pb::Input& input = inputs[i]->msg();
+    bool skewed = IsSkewed(*inputs[i]);
+    bool sorted = inputs[i]->linked_outp() && inputs[i]->linked_outp()->sorted();
+
     for (const auto& fspec : input.file_spec()) {
       ShardId sid = GetShard(fspec);
-      shard_inputs[sid].emplace_back(IndexedInput{i, &fspec, &input.format()});
+      IndexedInput ii{i, &fspec, &input.format(), sorted};
+      shard_inputs[sid].push_back(ii);
+
+      auto it = skewed || !fspec.has_shard_id() ? sub_shards.end()
+                                                 : sub_shards.find(fspec.shard_id());
+      if (it != sub_shards.end()) {
+        for (const ShardId& sub : it->second)
+          shard_inputs[sub].push_back(ii);
+      }
     }
   }
 
+  std::vector<ShardInput> shards;
   for (auto& k_v : shard_inputs) {
-    VLOG(1) << "Pushing shard " << k_v.first;
+    ShardInput si{k_v.first, k_v.first, std::move(k_v.second)};
+    for (const IndexedInput& ii : si.inputs) {
+      if (ii.fspec->has_base_shard_id()) {
+        si.grouping_shard = ShardId{ii.fspec->base_shard_id()};
+        break;
+      }
+    }
+    shards.push_back(std::move(si));
+  }
+
+  progress_->AddTasks(shards.size(), 0);
+
+  // With shards that are still being closed, the others are claimed first and the rest once
+  // their files are complete. The runner that closes the shards in the background runs all
+  // the tasks in this process. open_inputs counts the open input files of each shard.
+  absl::flat_hash_set<string> open_globs;
+  if (input_gate_)
+    open_globs = input_gate_->Subscribe();
+
+  std::vector<unsigned> open_inputs(shards.size(), 0);
+  absl::flat_hash_map<string, std::vector<size_t>> shards_of_glob;
+  std::deque<size_t> closed_shards;
+  if (!open_globs.empty()) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+      for (const IndexedInput& ii : shards[i].inputs) {
+        if (open_globs.contains(ii.fspec->url_glob())) {
+          ++open_inputs[i];
+          shards_of_glob[ii.fspec->url_glob()].push_back(i);
+        }
+      }
+      if (!open_inputs[i])
+        closed_shards.push_back(i);
+    }
+  } else {
+    // The biggest shards are processed first so that the operator does not end with a big
+    // shard running alone. The sizes are listed like in MapperExecutor::ExpandInput and the
+    // order is stable, so all the processes of the operator claim the shards in the same order.
+    pool_->GetNextContext().AwaitSafe([&] {
+      for (ShardInput& si : shards)
+        si.cost = ShardBytes(si);
+    });
+    std::stable_sort(shards.begin(), shards.end(),
+                     [](const ShardInput& a, const ShardInput& b) { return a.cost > b.cost; });
+  }
+
+  size_t index = 0, claimed = 0;
+  auto next_task = [&](bool block) {
+    if (open_globs.empty())
+      return runner_->NextTask(shards.size(), claimed, &index);
+
+    string glob;
+    while (closed_shards.empty() && input_gate_->Next(block, &glob)) {
+      for (size_t i : shards_of_glob[glob]) {
+        if (--open_inputs[i] == 0)
+          closed_shards.push_back(i);
+      }
+    }
+    if (closed_shards.empty())
+      return false;
+
+    index = closed_shards.front();
+    closed_shards.pop_front();
+    pool_->GetNextContext().AwaitSafe([&] { shards[index].cost = ShardBytes(shards[index]); });
+    return true;
+  };
+
+  // With a budget, the claimed shards wait until they fit into it: the biggest one that fits
+  // is pushed, or the smallest one once the budget is drained. One shard is claimed at a time
+  // otherwise.
+  const size_t window = budget_->limit() > 0 ? pool_->size() : 1;
+  std::multimap<size_t, size_t> pending;  // cost -> index of the shard.
+  while (true) {
+    // Waits for the shards that are being closed only if there is nothing else to push.
+    while (pending.size() < window && next_task(pending.empty())) {
+      ++claimed;
+      pending.emplace(shards[index].cost, index);
+    }
+    if (pending.empty())
+      break;
+
+    auto it = pending.end();
+    while (it != pending.begin()) {
+      --it;
+      if (budget_->TryAcquire(it->first))
+        break;
+      if (it == pending.begin())
+        budget_->Acquire(it->first);
+    }
+    index = it->second;
+    pending.erase(it);
+    VLOG(1) << "Pushing shard " << shards[index].shard << " of " << shards[index].cost
+            << " bytes, budget used " << budget_->used();
 
-    ShardInput si{k_v.first, std::move(k_v.second)};
-    channel_op_status st = input_q_.push(std::move(si));
+    channel_op_status st = input_q_.push(std::move(shards[index]));
     CHECK_EQ(channel_op_status::success, st);
   }
   input_q_.close();
 
   pool_->AwaitFiberOnAll([&](IoContext&) {
-    per_io_->Shutdown();
-    per_io_.reset();
+    std::unique_ptr<PerIoStruct>& aux_local = per_io_[IoIndex()];
+    aux_local->Shutdown();
+    aux_local.reset();
   });
 
   const string& op_name = tb->op().op_name();
@@ -92,17 +288,32 @@ void JoinerExecutor::Run(const std::vector<const InputBase*>& inputs, detail::Ta
     LOG(INFO) << op_name << "-" << k_v.first << ": " << k_v.second;
   }
 
-  runner_->OperatorEnd(out_files);
+  EndOperator(out_files);
+}
+
+bool JoinerExecutor::IsSkewed(const InputBase& input) {
+  const pb::Output* linked_outp = input.linked_outp();
+  return linked_outp && linked_outp->shard_spec().type() == pb::ShardSpec::SKEWED_MODN;
+}
+
+bool JoinerExecutor::IsPresorted(const std::vector<IndexedInput>& inputs) {
+  return std::all_of(inputs.begin(), inputs.end(),
+                     [](const IndexedInput& ii) { return ii.sorted; });
 }
 
 void JoinerExecutor::CheckInputs(const std::vector<const InputBase*>& inputs) {
   uint32_t modn = 0;
+  unsigned num_skewed = 0;
   for (const auto& input : inputs) {
     const pb::Output* linked_outp = input->linked_outp();
     CHECK(linked_outp) << input->msg().DebugString();
 
     if (linked_outp->has_shard_spec()) {
-      CHECK_EQ(linked_outp->shard_spec().type(), pb::ShardSpec::MODN);
+      if (IsSkewed(*input)) {
+        ++num_skewed;
+      } else {
+        CHECK_EQ(linked_outp->shard_spec().type(), pb::ShardSpec::MODN);
+      }
       if (!modn) {
         modn = linked_outp->shard_spec().modn();
       } else {
@@ -114,6 +325,7 @@ void JoinerExecutor::CheckInputs(const std::vector<const InputBase*>& inputs) {
       CHECK_GT(fspec.shard_id_ref_case(), 0);  // all inputs have sharding info.
     }
   }
+  CHECK_LE(num_skewed, 1) << "Only one join input can split its hot keys";
 }
 
 // Stops the executor in the middle.
@@ -123,7 +335,6 @@ void JoinerExecutor::JoinerFiber() {}
 
 void JoinerExecutor::ProcessInputQ(detail::TableBase* tb) {
   // PerIoStruct* trd_local = per_io_.get();
-  ShardInput shard_input;
   uint64_t cnt = 0;
 
   std::unique_ptr<RawContext> raw_context(runner_->CreateContext());
@@ -131,31 +342,286 @@ void JoinerExecutor::ProcessInputQ(detail::TableBase* tb) {
 
   std::unique_ptr<detail::HandlerWrapperBase> handler_wrapper{tb->CreateHandler(raw_context.get())};
 
+  // Holds the shard that is read ahead while the current one is processed.
+  TaskQueue tasks(2);
+  fibers::fiber prefetch_fd(&JoinerExecutor::PrefetchFiber, this, handler_wrapper->IsSortMerge(),
+                            &tasks);
+
+  std::unique_ptr<ShardTask> task;
+  while (true) {
+    channel_op_status st = tasks.pop(task);
+    if (st == channel_op_status::closed)
+      break;
+
+    CHECK_EQ(channel_op_status::success, st);
+    const ShardInput& shard_input = task->input;
+    SetCurrentShard(shard_input.grouping_shard, raw_context.get());
+    handler_wrapper->SetGroupingShard(shard_input.grouping_shard);
+
+    VLOG(1) << "Processing shard " << shard_input.shard;
+    size_t reserved = shard_input.cost;
+    raw_context->set_state_bytes(0);
+
+    if (handler_wrapper->IsSortMerge()) {
+      // The sorter holds up to its buffer.
+      size_t sort_bytes = std::min<size_t>(reserved, size_t(FLAGS_join_sort_buffer_mb) << 20);
+      budget_->Release(reserved - sort_bytes);
+      reserved = sort_bytes;
+
+      cnt += ProcessSortedShard(task.get(), handler_wrapper.get(), raw_context.get());
+      handler_wrapper->OnShardFinish();
+      budget_->Release(reserved);
+      progress_->TaskDone();
+      continue;
+    }
+
+    uint32_t cur_tag = kuint32max;
+    RawViewSinkCb emit_cb;
+
+    // The joiner parses records in the reading fiber, hence it can consume them directly
+    // from the batch buffer.
+    ConsumeShard(task.get(), raw_context.get(), [&](uint32_t tag, RawRecordBatch&& batch) {
+      if (tag != cur_tag) {
+        const IndexedInput& ii = shard_input.inputs[tag];
+        CHECK_LT(ii.index, handler_wrapper->Size());
+        emit_cb = handler_wrapper->GetView(ii.index);
+        cur_tag = tag;
+      }
+      for (size_t i = 0; i < batch.size(); ++i) {
+        emit_cb(batch[i]);
+      }
+      GrowReservation(*raw_context, &reserved);
+    });
+    cnt += task->cnt;
+
+    handler_wrapper->OnShardFinish();
+    budget_->Release(reserved);
+    progress_->TaskDone();
+  }
+  prefetch_fd.join();
+  VLOG(1) << "ProcessInputQ finished after processing " << cnt << " items";
+
+  FinalizeContext(cnt, raw_context.get());
+}
+
+void JoinerExecutor::PrefetchFiber(bool sort_merge, TaskQueue* tasks) {
+  ShardInput shard_input;
   while (true) {
     channel_op_status st = input_q_.pop(shard_input);
     if (st == channel_op_status::closed)
       break;
 
     CHECK_EQ(channel_op_status::success, st);
-    SetCurrentShard(shard_input.first, raw_context.get());
-    handler_wrapper->SetGroupingShard(shard_input.first);
 
-    VLOG(1) << "Processing shard " << shard_input.first;
+    // MergeSortedFiles reads the presorted shards by itself, a file per fiber.
+    bool read_ahead = !sort_merge || !IsPresorted(shard_input.inputs);
+    std::unique_ptr<ShardTask> task(new ShardTask(std::move(shard_input)));
+    ShardTask* ptr = task.get();
+
+    // Blocks while the handler processes the previous shard. The task stays alive until its
+    // chunks are closed since the consumer drains them.
+    st = tasks->push(std::move(task));
+    CHECK_EQ(channel_op_status::success, st);
+
+    if (read_ahead) {
+      for (uint32_t tag = 0; tag < ptr->input.inputs.size(); ++tag) {
+        ptr->cnt += ReadShardFiles(tag, ptr->input.inputs[tag], ptr);
+      }
+    }
+    ptr->chunks.close();
+  }
+  tasks->close();
+}
+
+void JoinerExecutor::ConsumeShard(ShardTask* task, RawContext* raw_context,
+                                  const std::function<void(uint32_t, RawRecordBatch&&)>& cb) {
+  uint32_t cur_tag = kuint32max;
+  const string* cur_file = nullptr;
+  InputChunk chunk;
+
+  while (task->chunks.pop(chunk) == channel_op_status::success) {
+    const IndexedInput& ii = task->input.inputs[chunk.tag];
+    if (chunk.tag != cur_tag) {
+      SetMetaData(*ii.fspec, raw_context);
+      cur_tag = chunk.tag;
+      cur_file = nullptr;
+    }
+    if (!cur_file || *cur_file != chunk.file_name) {
+      SetFileName(detail::IsBinary(ii.wf->type()), chunk.file_name, raw_context);
+      cur_file = &raw_context->input_file_name();
+    }
+    cb(chunk.tag, std::move(chunk.batch));
+  }
+}
+
+size_t JoinerExecutor::ShardBytes(const ShardInput& shard_input) {
+  size_t res = 0;
+  for (const IndexedInput& ii : shard_input.inputs) {
+    // The producer of the shard may have recorded the sizes of its files, which saves listing
+    // them. Shards that were kept in memory have no files.
+    if (ii.fspec->stats().file_bytes()) {
+      res += ii.fspec->stats().file_bytes();
+      continue;
+    }
+    runner_->ExpandGlob(ii.fspec->url_glob(), [&](size_t sz, const string&) { res += sz; });
+  }
+  return res;
+}
+
+void JoinerExecutor::GrowReservation(const RawContext& raw_context, size_t* reserved) {
+  size_t state = raw_context.state_bytes();
+  if (state > *reserved) {
+    budget_->Grow(state - *reserved);
+    *reserved = state;
+  }
+}
+
+uint64_t JoinerExecutor::ReadShardFiles(uint32_t tag, const IndexedInput& ii, ShardTask* task) {
+  uint64_t cnt = 0;
+
+  runner_->ExpandGlob(ii.fspec->url_glob(), [&](size_t sz, const string& file_name) {
+    size_t records = runner_->ProcessInputBatches(
+        file_name, *ii.wf, 0, kuint64max, [&](RawRecordBatch&& batch) {
+          channel_op_status st = task->chunks.push(InputChunk{tag, file_name, std::move(batch)});
+          CHECK_EQ(channel_op_status::success, st);
+        });
+    progress_->AddRecords(records);
+    progress_->AddBytes(sz);
+    cnt += records;
+  });
 
-    for (const IndexedInput& ii : shard_input.second) {
+  return cnt;
+}
+
+uint64_t JoinerExecutor::ProcessSortedShard(ShardTask* task,
+                                            detail::HandlerWrapperBase* handler_wrapper,
+                                            RawContext* raw_context) {
+  const std::vector<IndexedInput>& inputs = task->input.inputs;
+  RawViewSinkCb emit_cb;
+  uint32_t cur_tag = kuint32max;
+  bool has_key = false;
+  string key;
+
+  auto entry_cb = [&](absl::string_view k, uint32_t tag, absl::string_view val) {
+    if (!has_key || k != key) {
+      if (has_key)
+        handler_wrapper->OnKeyFinish(key);
+      key.assign(k.data(), k.size());
+      has_key = true;
+    }
+
+    if (tag != cur_tag) {
+      const IndexedInput& ii = inputs[tag];
+      SetFileName(detail::IsBinary(ii.wf->type()), ii.fspec->url_glob(), raw_context);
+      SetMetaData(*ii.fspec, raw_context);
+      emit_cb = handler_wrapper->GetView(ii.index);
+      cur_tag = tag;
+    }
+    emit_cb(val);
+  };
+
+  uint64_t cnt = 0;
+  if (IsPresorted(inputs)) {
+    InputChunk chunk;
+    CHECK(task->chunks.pop(chunk) == channel_op_status::closed);  // not read ahead.
+    cnt = MergeSortedFiles(inputs, handler_wrapper, raw_context, entry_cb);
+  } else {
+    detail::ExternalSorter sorter(size_t(FLAGS_join_sort_buffer_mb) << 20, FLAGS_join_spill_dir);
+    string scratch;
+
+    // Entries are tagged with the position of their input, so records of the same key are
+    // passed in the order of the join inputs.
+    ConsumeShard(task, raw_context, [&](uint32_t tag, RawRecordBatch&& batch) {
+      const IndexedInput& ii = inputs[tag];
       CHECK_LT(ii.index, handler_wrapper->Size());
-      auto emit_cb = handler_wrapper->Get(ii.index);
+
+      const detail::RawKeyCb& key_fn = handler_wrapper->GetKeyFn(ii.index);
       bool is_binary = detail::IsBinary(ii.wf->type());
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (key_fn(is_binary, batch[i], &scratch)) {
+          sorter.Add(scratch, tag, batch[i]);
+        } else {
+          raw_context->EmitParseError();
+        }
+      }
+    });
+    cnt = task->cnt;
+    VLOG(1) << "Merging shard " << task->input.shard << " from " << sorter.num_runs() << " runs";
+    sorter.Merge(entry_cb);
+  }
+
+  if (has_key)
+    handler_wrapper->OnKeyFinish(key);
+
+  return cnt;
+}
 
-      SetFileName(is_binary, ii.fspec->url_glob(), raw_context.get());
-      SetMetaData(*ii.fspec, raw_context.get());
-      cnt += runner_->ProcessInputFile(ii.fspec->url_glob(), ii.wf->type(), emit_cb);
+uint64_t JoinerExecutor::MergeSortedFiles(const std::vector<IndexedInput>& inputs,
+                                          detail::HandlerWrapperBase* handler_wrapper,
+                                          RawContext* raw_context,
+                                          const detail::ExternalSorter::EntryCb& cb) {
+  std::vector<std::unique_ptr<SortedStream>> streams;
+  for (uint32_t tag = 0; tag < inputs.size(); ++tag) {
+    const IndexedInput& ii = inputs[tag];
+    CHECK_LT(ii.index, handler_wrapper->Size());
+
+    runner_->ExpandGlob(ii.fspec->url_glob(), [&](size_t sz, const string& file_name) {
+      streams.emplace_back(new SortedStream{tag, file_name});
+      SortedStream* stream = streams.back().get();
+      const pb::WireFormat* wf = ii.wf;
+
+      stream->reader = fibers::fiber([this, stream, wf, sz] {
+        stream->cnt = runner_->ProcessInputBatches(
+            stream->file_name, *wf, 0, kuint64max,
+            [stream](RawRecordBatch&& batch) { stream->q.push(std::move(batch)); });
+        stream->q.close();
+        progress_->AddRecords(stream->cnt);
+        progress_->AddBytes(sz);
+      });
+    });
+  }
+  VLOG(1) << "Merging " << streams.size() << " sorted files";
+
+  // Ties are broken like in ExternalSorter: by input and then by the order of the files.
+  auto greater = [&streams](unsigned a, unsigned b) {
+    const SortedStream& sa = *streams[a];
+    const SortedStream& sb = *streams[b];
+    int res = sa.key.compare(sb.key);
+    if (res != 0)
+      return res > 0;
+    if (sa.tag != sb.tag)
+      return sa.tag > sb.tag;
+    return a > b;
+  };
+  std::priority_queue<unsigned, std::vector<unsigned>, decltype(greater)> heap(greater);
+
+  auto next = [&](unsigned i) {
+    const IndexedInput& ii = inputs[streams[i]->tag];
+    if (streams[i]->Next(handler_wrapper->GetKeyFn(ii.index), detail::IsBinary(ii.wf->type()),
+                         raw_context)) {
+      heap.push(i);
     }
-    handler_wrapper->OnShardFinish();
+  };
+
+  for (unsigned i = 0; i < streams.size(); ++i) {
+    next(i);
   }
-  VLOG(1) << "ProcessInputQ finished after processing " << cnt << " items";
 
-  FinalizeContext(cnt, raw_context.get());
+  while (!heap.empty()) {
+    unsigned i = heap.top();
+    heap.pop();
+
+    const SortedStream& stream = *streams[i];
+    cb(stream.key, stream.tag, stream.value());
+    next(i);
+  }
+
+  uint64_t cnt = 0;
+  for (auto& stream : streams) {
+    stream->reader.join();
+    cnt += stream->cnt;
+  }
+  return cnt;
 }
 
 }  // namespace mr3
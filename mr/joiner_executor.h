@@ -4,8 +4,11 @@
 
 #pragma once
 
+#include <boost/fiber/buffered_channel.hpp>
 #include <boost/fiber/unbuffered_channel.hpp>
 
+#include "mr/impl/external_sorter.h"
+#include "mr/impl/memory_budget.h"
 #include "mr/operator_executor.h"
 
 namespace mr3 {
@@ -17,9 +20,20 @@ class JoinerExecutor : public OperatorExecutor {
     uint32_t index;
     const pb::Input::FileSpec* fspec;
     const pb::WireFormat* wf;
+    bool sorted;  // The shard files are sorted, see Output<T>::AndSort.
   };
 
-  using ShardInput = std::pair<ShardId, std::vector<IndexedInput>>;
+  struct ShardInput {
+    ShardId shard;
+    ShardId grouping_shard;  // Differs from shard for sub-shards of hot keys.
+    std::vector<IndexedInput> inputs;
+    size_t cost = 0;  // The total size of the shard files, reserved in budget_.
+  };
+
+  struct InputChunk;
+  struct ShardTask;
+  using TaskQueue = ::boost::fibers::buffered_channel<std::unique_ptr<ShardTask>>;
+
  public:
   JoinerExecutor(util::IoContextPool* pool, Runner* runner);
   ~JoinerExecutor();
@@ -30,17 +44,56 @@ class JoinerExecutor : public OperatorExecutor {
   // Stops the executor in the middle.
   void Stop() final;
 
+  // If set, the inputs of gate are still being closed by the previous operator. The shards
+  // are claimed once their files are complete instead of in the order of their sizes.
+  void set_input_gate(std::shared_ptr<detail::ShardGate> gate) { input_gate_ = std::move(gate); }
+
  private:
   void InitInternal() final;
   void CheckInputs(const std::vector<const InputBase*>& inputs);
+  static bool IsSkewed(const InputBase& input);
+  static bool IsPresorted(const std::vector<IndexedInput>& inputs);
 
   void ProcessInputQ(detail::TableBase* tb);
 
+  // Pops the shards of input_q_ and reads their inputs ahead into the chunks of their tasks,
+  // so that the next shard is read while the handler processes the current one.
+  void PrefetchFiber(bool sort_merge, TaskQueue* tasks);
+
+  // Passes the read-ahead batches of the shard to cb with the position of their input and
+  // sets the file names and the metadata of raw_context.
+  void ConsumeShard(ShardTask* task, RawContext* raw_context,
+                    const std::function<void(uint32_t, RawRecordBatch&&)>& cb);
+
+  // The total size of the shard files, the estimate of the shard state.
+  size_t ShardBytes(const ShardInput& shard_input);
+
+  // Grows the reservation of the current shard to the state that its handler reported.
+  void GrowReservation(const RawContext& raw_context, size_t* reserved);
+
+  // Sorts the shard inputs by key and passes them to the handler grouped by key.
+  // Returns number of records read.
+  uint64_t ProcessSortedShard(ShardTask* task, detail::HandlerWrapperBase* handler_wrapper,
+                              RawContext* raw_context);
+
+  // Merges the shard files of the inputs that are already sorted by key. Each file is read
+  // by a separate fiber. Returns number of records read.
+  uint64_t MergeSortedFiles(const std::vector<IndexedInput>& inputs,
+                            detail::HandlerWrapperBase* handler_wrapper, RawContext* raw_context,
+                            const detail::ExternalSorter::EntryCb& cb);
+
+  // Reads all the files of the shard input into the chunks of task, since a shard may consist
+  // of several files. tag is the position of the input in the shard. Returns number of
+  // records read.
+  uint64_t ReadShardFiles(uint32_t tag, const IndexedInput& ii, ShardTask* task);
+
   void JoinerFiber();
 
   ::boost::fibers::unbuffered_channel<ShardInput> input_q_;
+  std::unique_ptr<detail::MemoryBudget> budget_;
+  std::shared_ptr<detail::ShardGate> input_gate_;
 
-  static thread_local std::unique_ptr<PerIoStruct> per_io_;
+  std::vector<std::unique_ptr<PerIoStruct>> per_io_;  // indexed by IO thread.
 };
 
 }  // namespace mr3
@@ -3,22 +3,37 @@
 //
 #include "mr/local_runner.h"
 
+#include <fnmatch.h>
+#include <cstring>
+
+#include <map>
+#include <thread>
+
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "base/cycle_clock.h"
 #include "base/histogram.h"
+#include "base/init.h"
 #include "base/logging.h"
 #include "base/walltime.h"
 
 #include "file/fiber_file.h"
 #include "file/file_util.h"
 #include "file/filesource.h"
+#include "file/gzip_index.h"
 #include "file/list_file_reader.h"
 
 #include "mr/do_context.h"
+#include "mr/impl/columnar_format.h"
+#include "mr/impl/input_cache.h"
 #include "mr/impl/local_context.h"
+#include "mr/impl/memory_shard_store.h"
+#include "mr/impl/shard_gate.h"
 
 #include "util/asio/io_context_pool.h"
+#include "util/asio/io_uring.h"
+#include "util/aws/s3.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 #include "util/gce/gcs.h"
 #include "util/stats/varz_stats.h"
@@ -26,18 +41,129 @@
 
 namespace mr3 {
 
-DEFINE_uint32(local_runner_prefetch_size, 1 << 16, "File input prefetch size");
+DEFINE_uint32(local_runner_prefetch_size, 1 << 16,
+              "File input prefetch size. It is the initial and the minimal size of the prefetch "
+              "window if the window is adaptive");
+DEFINE_uint32(local_runner_max_prefetch_size, 1 << 20,
+              "Maximal prefetch window of local disk inputs, the window grows up to it when "
+              "the reads can not keep up with the reader. 0 keeps the window fixed");
+DEFINE_uint32(local_runner_max_remote_prefetch_size, 1 << 24,
+              "Maximal prefetch window of inputs on network filesystems like NFS");
+DEFINE_uint32(local_runner_lst_read_ahead, 4,
+              "Number of list file blocks that are read at once and decompressed in parallel. "
+              "0 disables read-ahead");
+DEFINE_bool(local_runner_mmap_inputs, false,
+            "Map local input files into memory instead of reading them with pread");
+DEFINE_bool(local_runner_io_uring, false,
+            "Read local input files with io_uring from the IO threads instead of the file "
+            "thread pool. Falls back to the thread pool if the kernel does not support it");
+DEFINE_uint32(local_runner_gzip_read_ahead, 8,
+              "Number of gzip members, lz4 or bzip2 blocks of parallel compressed text inputs "
+              "that are read at once and decompressed in parallel");
+DEFINE_uint32(local_runner_gzip_index_span_mb, 0,
+              "If positive, the regular gzip inputs are indexed with a point every this many "
+              "MB of their data, so that map_split_size_mb splits them too. The index is built "
+              "by reading the file once and is stored next to it for the next runs");
+DEFINE_uint32(local_runner_glob_parallel, 16,
+              "Number of concurrent readdir and stat calls that expand a local glob. "
+              "0 expands it with glob(3) in the calling thread");
+DEFINE_uint32(local_runner_gcs_read_window, 0,
+              "Number of ranges of a GCS input that are downloaded concurrently, each over its own "
+              "connection. 0 streams the inputs over a single connection");
+DEFINE_uint32(local_runner_gcs_range_mb, 16, "Size of the ranges of GCS inputs in MB");
+DEFINE_uint32(local_runner_gcs_list_parallel, 8,
+              "Number of connections that list the key ranges of a GCS glob concurrently");
+DEFINE_uint32(local_runner_gcs_list_cache_sec, 0,
+              "If positive, GCS glob expansions are cached for this many seconds. Expansions "
+              "under the output directory of an operator are dropped when it starts");
+DEFINE_uint32(local_runner_gcs_idle_sec, 60,
+              "Pooled GCS connections that are idle for longer than this are closed");
+DEFINE_uint32(local_runner_s3_read_ahead, 4,
+              "Number of ranges of an S3 input that are downloaded concurrently, each over its own "
+              "connection");
+DEFINE_uint32(local_runner_s3_range_mb, 8, "Size of the ranges of S3 inputs in MB");
+DEFINE_string(local_runner_input_cache_dir, "",
+              "If set, GCS inputs are cached in this local directory and the following reads of "
+              "the same object generation are served from it");
+DEFINE_uint32(local_runner_input_cache_mb, 10240,
+              "Size budget of --local_runner_input_cache_dir in MB. The least recently read "
+              "objects are evicted first");
+DEFINE_uint32(local_runner_memory_shuffle_mb, 0,
+              "Memory budget in MB for keeping intermediate outputs in RAM. "
+              "0 disables in-memory shuffle");
+DEFINE_uint32(local_runner_cache_mb, 4096,
+              "Memory budget in MB for keeping the intermediate outputs marked with "
+              "Output::AndCache() in RAM, in addition to local_runner_memory_shuffle_mb");
 DECLARE_uint32(gcs_connect_deadline_ms);
 
 using namespace util;
 using namespace boost;
 using namespace std;
 using detail::DestFileSet;
+using detail::MemoryShard;
 
 namespace {
 
 using namespace intrusive;
 
+constexpr size_t kTopShardsVarz = 10;
+constexpr char kCheckpointFile[] = "_checkpoint.pb";
+constexpr char kManifestFile[] = "_manifest.pb";
+constexpr char kPrevDirSuffix[] = ".prev";
+
+// Writes into a temporary file first so that a crash won't leave a truncated file.
+bool WriteFileAtomically(const string& path, absl::string_view data) {
+  string tmp_path = path + ".tmp";
+  file::WriteFile* wf = file::Open(tmp_path);
+  if (!wf) {
+    LOG(ERROR) << "Could not open " << tmp_path;
+    return false;
+  }
+  util::Status st = wf->Write(data);
+  bool closed = wf->Close();
+  if (!st.ok() || !closed || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Could not write " << path << ": " << st;
+    file::Delete(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+bool WriteMessageFile(const string& path, const google::protobuf::Message& msg) {
+  return WriteFileAtomically(path, msg.SerializeAsString());
+}
+
+bool ReadMessageFile(const string& path, google::protobuf::Message* msg) {
+  string contents;
+  if (!file::Exists(path) || !file_util::ReadFileToString(path, &contents))
+    return false;
+
+  if (!msg->ParseFromString(contents)) {
+    LOG(WARNING) << "Corrupted " << path;
+    return false;
+  }
+  return true;
+}
+
+// Object stores list the objects by prefix, hence the wildcards of the file names are matched
+// by us. Strips the glob path to the listed prefix and returns the pattern to match the object
+// names with or an empty string if all of them match. "**" suffix lists recursively.
+string SplitObjectGlob(absl::string_view* path, bool* recursive) {
+  *recursive = absl::EndsWith(*path, "**");
+  if (*recursive) {
+    path->remove_suffix(2);
+    return string{};
+  }
+
+  size_t wildcard_pos = path->find_first_of("*?[");
+  if (wildcard_pos == absl::string_view::npos)
+    return string{};
+
+  string pattern(*path);
+  *path = path->substr(0, wildcard_pos);
+  return pattern;
+}
+
 }  // namespace
 
 struct LocalRunner::Impl {
@@ -47,8 +173,41 @@ struct LocalRunner::Impl {
       varz_stats_("local-runner", [this] { return GetStats();}) {
   }
 
-  uint64_t ProcessText(file::ReadonlyFile* fd, RawSinkCb cb);
-  uint64_t ProcessLst(file::ReadonlyFile* fd, RawSinkCb cb);
+  // Process records that start inside [offset, offset + length) of the file.
+  // length == kuint64max means the whole file.
+  // Records are passed as views into the reader buffers.
+  // The ranges of gzip files are read with their gz_index. Such a range holds the data
+  // between the index points inside it.
+  uint64_t ProcessText(file::ReadonlyFile* fd, size_t offset, size_t length,
+                       const file::GzipIndex* gz_index, RawViewSinkCb cb);
+  uint64_t ProcessLst(file::ReadonlyFile* fd, size_t offset, size_t length, RawViewSinkCb cb);
+  uint64_t ProcessColumnar(file::ReadonlyFile* fd, size_t offset, size_t length,
+                           const pb::WireFormat& wf, RawViewSinkCb cb);
+  uint64_t ProcessMemory(const MemoryShard& shard, RawViewSinkCb cb);
+
+  // Splits the lines of an uncompressed text file mapped into memory. The records point into
+  // the mapping.
+  uint64_t ProcessMappedText(const file::ReadonlyFile& fd, size_t offset, size_t length,
+                             RawViewSinkCb cb);
+
+  // Remembers the directory of the output if it is written in the fast intermediate format.
+  // Called before its files are read.
+  void AddFastDir(const pb::Output& out);
+
+  // Whether the file belongs to an output of the fast intermediate format.
+  bool IsFastFile(absl::string_view filename);
+
+  // Returns the shard of the glob if it is kept in memory, null otherwise.
+  const MemoryShard* FindMemoryShard(const std::string& glob) const;
+
+  // Returns the index of the gzip file fd, which does not take ownership over fd, or null if
+  // the file can not be indexed. The files of gzip members are indexed by their headers, the
+  // other ones by their sidecar, see --local_runner_gzip_index_span_mb.
+  std::shared_ptr<const file::GzipIndex> GetGzipIndex(const string& filename,
+                                                      file::ReadonlyFile* fd);
+
+  // Returns the index that GetGzipIndex returned for the file, null if there was none.
+  std::shared_ptr<const file::GzipIndex> FindGzipIndex(const string& filename);
 
   /// Called from the main thread orchestrating the pipeline run.
   void Start(const pb::Operator* op);
@@ -56,46 +215,88 @@ struct LocalRunner::Impl {
   /// Called from the main thread orchestrating the pipeline run.
   void End(ShardFileMap* out_files);
 
+  /// Closes the handles in closer while the next operator runs.
+  void EndAsync(ShardFileMap* out_files, std::shared_ptr<detail::ShardGate> gate);
+  void JoinCloser();
+
   /// The functions below are called from IO threads.
   void ExpandGCS(absl::string_view glob, ExpandCb cb);
+  void ExpandS3(absl::string_view glob, ExpandCb cb);
+
+  // (size, full path) pairs of the objects that match the glob, in the order of their names.
+  using GcsListing = std::vector<std::pair<size_t, std::string>>;
+
+  // Lists the key ranges of the prefix concurrently, each over its own connection.
+  GcsListing ListGCS(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
+                     const string& pattern);
   util::StatusObject<file::ReadonlyFile*> OpenReadFile(const std::string& filename,
                                                        file::FiberReadOptions::Stats* stats);
+
+  // The stats of a file are accounted to the calling thread between StartRead and EndRead
+  // and are added to its totals by EndRead.
+  void StartRead(const file::FiberReadOptions::Stats* stats);
+  void EndRead(const file::FiberReadOptions::Stats* stats);
+  Runner::ReadStats GetReadStats() const;
+
   void ShutDown();
 
   // TODO: to make members below private.
   // private:
 
   void LazyGcsInit();
+  void LazyS3Init();
+
+  string CheckpointPath(const pb::Operator& op) const {
+    return file_util::JoinPath(file_util::JoinPath(data_dir, op.output().name()), kCheckpointFile);
+  }
 
   IoContextPool* io_pool_;
   string data_dir;
   std::unique_ptr<DestFileSet> dest_mgr;
+  fibers::mutex dest_mu;  // guards dest_mgr resets against GetOutputShardBytes.
+  detail::ShardStatsList closed_stats;  // guarded by dest_mu, see GetClosedShardStats.
+  std::thread closer;     // closes the output of the previous operator, see EndAsync.
+  std::unique_ptr<detail::MemoryShardStore> mem_store;
+  std::unique_ptr<detail::MemoryShardStore> cache_store;  // see Output::AndCache().
+  std::unique_ptr<detail::InputCache> input_cache;
   fibers_ext::FiberQueueThreadPool fq_pool;
   std::atomic_bool stop_signal_{false};
   std::atomic_ulong file_cache_hit_bytes{0};
   const pb::Operator* current_op = nullptr;
+  int32_t worker_index = -1;
 
   fibers::mutex gce_mu;
   std::unique_ptr<GCE> gce_handle;
+  std::unique_ptr<GcsPool> gcs_pool;  // shared by inputs, listings and outputs.
+
+  struct CachedListing {
+    uint64_t expire_usec;
+    std::shared_ptr<const GcsListing> listing;
+  };
+  fibers::mutex aws_mu;
+  std::unique_ptr<AWS> aws_handle;
+  std::unique_ptr<S3Pool> s3_pool;
+
+  fibers::mutex list_cache_mu;
+  std::map<string, CachedListing> list_cache;  // keyed by glob.
+
+  fibers::mutex fast_mu;
+  std::vector<string> fast_dirs;  // see AddFastDir.
+
+  fibers::mutex gzip_index_mu;
+  std::map<string, std::shared_ptr<const file::GzipIndex>> gzip_indices;  // keyed by file name.
 
  private:
   util::VarzValue::Map GetStats() const;
 
   struct PerThread {
-    vector<unique_ptr<GCS>> gcs_handles;
-
     base::Histogram record_fetch_hist;
-  };
-
-  struct handle_keeper {
-    PerThread* per_thread;
 
-    handle_keeper(PerThread* pt) : per_thread(pt) {}
-
-    void operator()(GCS* gcs) { per_thread->gcs_handles.emplace_back(gcs); }
+    Runner::ReadStats read_totals;
+    vector<const file::FiberReadOptions::Stats*> active_reads;
   };
 
-  unique_ptr<GCS, handle_keeper> GetGcsHandle();
+  GcsPool::Handle GetGcsHandle();
 
   static thread_local std::unique_ptr<PerThread> per_thread_;
   util::VarzFunction varz_stats_;
@@ -104,65 +305,104 @@ struct LocalRunner::Impl {
 
 thread_local std::unique_ptr<LocalRunner::Impl::PerThread> LocalRunner::Impl::per_thread_;
 
-auto LocalRunner::Impl::GetGcsHandle() -> unique_ptr<GCS, handle_keeper> {
-  auto* pt = per_thread_.get();
-  CHECK(pt);
-  VLOG(1) << "GetGcsHandle: " << pt->gcs_handles.size();
-
-  for (auto it = pt->gcs_handles.begin(); it != pt->gcs_handles.end(); ++it) {
-    if ((*it)->IsBusy()) {
-      continue;
-    }
-
-    auto res = std::move(*it);
-    it->swap(pt->gcs_handles.back());
-    pt->gcs_handles.pop_back();
-
-    return unique_ptr<GCS, handle_keeper>(res.release(), pt);
-  }
-
-  IoContext* io_context = io_pool_->GetThisContext();
-  CHECK(io_context) << "Must run from IO context thread";
+GcsPool::Handle LocalRunner::Impl::GetGcsHandle() {
+  VLOG(1) << "GetGcsHandle: " << gcs_pool->IdleCount();
 
-  GCS* gcs = new GCS(*gce_handle, io_context);
-  CHECK_STATUS(gcs->Connect(FLAGS_gcs_connect_deadline_ms));
+  auto res = gcs_pool->Get();
+  CHECK_STATUS(res.status);
 
-  return unique_ptr<GCS, handle_keeper>(gcs, pt);
+  return std::move(res.obj);
 }
 
 VarzValue::Map LocalRunner::Impl::GetStats() const {
   VarzValue::Map map;
-  std::atomic<uint32_t> input_gcs_conn{0};
-
   auto start = base::GetMonotonicMicrosFast();
-  io_pool_->AwaitOnAll([&](IoContext&) {
-    auto* pt = per_thread_.get();
-    if (pt) {
-      input_gcs_conn += pt->gcs_handles.size();
-    }
-  });
 
-  map.emplace_back("input-gcs-connections", VarzValue::FromInt(input_gcs_conn.load()));
-  map.emplace_back("output-gcs-connections", VarzValue::FromInt(dest_mgr->HandleCount()));
+  if (input_cache) {
+    map.emplace_back("input-cache-bytes", VarzValue::FromInt(input_cache->used_bytes()));
+  }
+  if (gcs_pool) {
+    map.emplace_back("idle-gcs-connections", VarzValue::FromInt(gcs_pool->IdleCount()));
+  }
+  if (dest_mgr) {
+    map.emplace_back("output-gcs-connections", VarzValue::FromInt(dest_mgr->HandleCount()));
+
+    // Largest output shards of the current operator.
+    auto shard_stats = dest_mgr->GetShardStats();
+    size_t total_bytes = 0, total_records = 0;
+    for (const auto& k_v : shard_stats) {
+      total_bytes += k_v.second.raw_bytes();
+      total_records += k_v.second.records();
+    }
+    double skew = detail::ShardSkew(shard_stats);
+    size_t top = std::min<size_t>(kTopShardsVarz, shard_stats.size());
+    std::partial_sort(shard_stats.begin(), shard_stats.begin() + top, shard_stats.end(),
+                      [](const auto& l, const auto& r) {
+                        return l.second.raw_bytes() > r.second.raw_bytes();
+                      });
+    VarzValue::Map top_shards;
+    for (size_t i = 0; i < top; ++i) {
+      top_shards.emplace_back(shard_stats[i].first.ToString("shard"),
+                              VarzValue::FromInt(shard_stats[i].second.raw_bytes()));
+    }
+    map.emplace_back("output-bytes", VarzValue::FromInt(total_bytes));
+    map.emplace_back("output-records", VarzValue::FromInt(total_records));
+    map.emplace_back("output-shard-skew", VarzValue::FromDouble(skew));
+    map.emplace_back("output-top-shard-bytes", VarzValue{std::move(top_shards)});
+  }
   map.emplace_back("stats-latency", VarzValue::FromInt(base::GetMonotonicMicrosFast() - start));
 
   return map;
 }
 
-uint64_t LocalRunner::Impl::ProcessText(file::ReadonlyFile* fd, RawSinkCb cb) {
-  std::unique_ptr<util::Source> src(file::Source::Uncompressed(fd));
+uint64_t LocalRunner::Impl::ProcessText(file::ReadonlyFile* fd, size_t offset, size_t length,
+                                        const file::GzipIndex* gz_index, RawViewSinkCb cb) {
+  std::unique_ptr<util::Source> src;
+  unsigned read_ahead = std::max(1U, FLAGS_local_runner_gzip_read_ahead);
+  uint64_t range_end = length > kuint64max - offset ? kuint64max : offset + length;
+
+  // The range of a gzip file continues in its data from the first point inside the range.
+  if (gz_index) {
+    uint64_t out_offset = gz_index->OutOffset(offset);
+    range_end = range_end == kuint64max ? kuint64max : gz_index->OutOffset(range_end);
+    if (out_offset >= range_end) {
+      CHECK_STATUS(fd->Close());
+      delete fd;
+      return 0;
+    }
+    offset = out_offset;
+  }
+
+  // Ranges are supported only for uncompressed and indexed files. We start one byte before
+  // the range so that a line that starts exactly at offset is not lost.
+  uint64_t src_offset = offset > 0 ? offset - 1 : 0;
+  if (gz_index) {
+    auto res = gz_index->Open(fd, src_offset, read_ahead, file::FiberBlockExecutor(&fq_pool));
+    CHECK_STATUS(res.status);
+    src.reset(res.obj);
+  } else if (offset > 0) {
+    src.reset(new file::Source(fd, src_offset));
+  } else {
+    src.reset(
+        file::Source::Uncompressed(fd, read_ahead, file::FiberBlockExecutor(&fq_pool)));
+  }
 
   file::LineReader lr(src.release(), TAKE_OWNERSHIP);
   StringPiece result;
   string scratch;
 
+  // The tail of the first line belongs to the previous range.
+  if (offset > 0 && !lr.Next(&result, &scratch)) {
+    return 0;
+  }
+
   uint64_t cnt = 0;
-  uint64_t start = base::GetMonotonicMicrosFast();
-  while (!stop_signal_.load(std::memory_order_relaxed) && lr.Next(&result, &scratch)) {
-    string tmp{result};
+  uint64_t start = base::CycleClock::Now();
+  while (!stop_signal_.load(std::memory_order_relaxed) &&
+         src_offset + lr.consumed_bytes() < range_end && lr.Next(&result, &scratch)) {
     ++cnt;
     if (VLOG_IS_ON(1)) {
-      int64_t delta = base::GetMonotonicMicrosFast() - start;
+      uint64_t delta = base::CycleClock::ToNanos(base::CycleClock::Now() - start) / 1000;
       if (delta > 5)  // Filter out uninteresting fast Next calls.
         per_thread_->record_fetch_hist.Add(delta);
     }
@@ -170,25 +410,33 @@ uint64_t LocalRunner::Impl::ProcessText(file::ReadonlyFile* fd, RawSinkCb cb) {
     if (cnt % 1000 == 0) {
       this_fiber::yield();
     }
-    cb(std::move(tmp));
-    start = base::GetMonotonicMicrosFast();
+    cb(result);
+    start = base::CycleClock::Now();
   }
   VLOG(1) << "ProcessText Read " << cnt << " items";
 
   return cnt;
 }
 
-uint64_t LocalRunner::Impl::ProcessLst(file::ReadonlyFile* fd, RawSinkCb cb) {
+uint64_t LocalRunner::Impl::ProcessLst(file::ReadonlyFile* fd, size_t offset, size_t length,
+                                       RawViewSinkCb cb) {
   file::ListReader::CorruptionReporter error_fn = [](size_t bytes, const util::Status& status) {
     LOG(FATAL) << "Lost " << bytes << " bytes, status: " << status;
   };
 
   file::ListReader list_reader(fd, TAKE_OWNERSHIP, true, error_fn);
+  if (length != kuint64max) {
+    list_reader.SetRange(offset, length);
+  }
+  if (FLAGS_local_runner_lst_read_ahead) {
+    list_reader.SetReadAhead(FLAGS_local_runner_lst_read_ahead,
+                             file::FiberBlockExecutor(&fq_pool));
+  }
   string scratch;
   StringPiece record;
   uint64_t cnt = 0;
   while (list_reader.ReadRecord(&record, &scratch)) {
-    cb(string(record));
+    cb(record);
     ++cnt;
     if (cnt % 1000 == 0) {
       this_fiber::yield();
@@ -200,32 +448,244 @@ uint64_t LocalRunner::Impl::ProcessLst(file::ReadonlyFile* fd, RawSinkCb cb) {
   return cnt;
 }
 
+// Each list record is a block of records stored column by column.
+uint64_t LocalRunner::Impl::ProcessColumnar(file::ReadonlyFile* fd, size_t offset, size_t length,
+                                            const pb::WireFormat& wf, RawViewSinkCb cb) {
+  file::ListReader::CorruptionReporter error_fn = [](size_t bytes, const util::Status& status) {
+    LOG(FATAL) << "Lost " << bytes << " bytes, status: " << status;
+  };
+
+  file::ListReader list_reader(fd, TAKE_OWNERSHIP, true, error_fn);
+  if (length != kuint64max) {
+    list_reader.SetRange(offset, length);
+  }
+  if (FLAGS_local_runner_lst_read_ahead) {
+    list_reader.SetReadAhead(FLAGS_local_runner_lst_read_ahead,
+                             file::FiberBlockExecutor(&fq_pool));
+  }
+
+  detail::ColumnarReader reader({wf.field().begin(), wf.field().end()});
+  string scratch;
+  StringPiece block;
+  uint64_t cnt = 0;
+  while (list_reader.ReadRecord(&block, &scratch)) {
+    int64_t res = reader.ParseBlock(block, cb);
+    CHECK_GE(res, 0) << "Corrupted columnar block";
+    cnt += res;
+
+    this_fiber::yield();
+    if (stop_signal_.load(std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  return cnt;
+}
+
+uint64_t LocalRunner::Impl::ProcessMappedText(const file::ReadonlyFile& fd, size_t offset,
+                                              size_t length, RawViewSinkCb cb) {
+  const char* data = reinterpret_cast<const char*>(fd.mapped_data());
+  const size_t size = fd.Size();
+  const size_t range_end = length > size - std::min(offset, size) ? size : offset + length;
+
+  // Like in ProcessText, the line that crosses offset belongs to the previous range.
+  size_t pos = std::min(offset, size);
+  if (pos > 0 && data[pos - 1] != '\n') {
+    const char* eol = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+    pos = eol ? eol - data + 1 : size;
+  }
+
+  uint64_t cnt = 0;
+  while (pos < range_end && !stop_signal_.load(std::memory_order_relaxed)) {
+    const char* eol = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+    size_t end = eol ? eol - data : size;
+    size_t next = eol ? end + 1 : size;
+    if (end > pos && data[end - 1] == '\r')
+      --end;
+
+    cb(absl::string_view(data + pos, end - pos));
+    pos = next;
+    if (++cnt % 1000 == 0) {
+      this_fiber::yield();
+    }
+  }
+  VLOG(1) << "ProcessMappedText Read " << cnt << " items";
+
+  return cnt;
+}
+
+const MemoryShard* LocalRunner::Impl::FindMemoryShard(const std::string& glob) const {
+  const MemoryShard* shard = cache_store ? cache_store->Find(glob) : nullptr;
+  if (!shard && mem_store)
+    shard = mem_store->Find(glob);
+  return shard;
+}
+
+void LocalRunner::Impl::AddFastDir(const pb::Output& out) {
+  if (!detail::IsFastIntermediate(out) || util::IsGcsPath(data_dir))
+    return;
+
+  string dir = file_util::JoinPath(data_dir, out.name());
+  std::lock_guard<fibers::mutex> lk(fast_mu);
+  if (std::find(fast_dirs.begin(), fast_dirs.end(), dir) == fast_dirs.end())
+    fast_dirs.push_back(std::move(dir));
+}
+
+auto LocalRunner::Impl::GetGzipIndex(const string& filename, file::ReadonlyFile* fd)
+    -> std::shared_ptr<const file::GzipIndex> {
+  if (auto index = FindGzipIndex(filename))
+    return index;
+
+  auto index = std::make_shared<file::GzipIndex>();
+  if (!file::GzipMemberSource::HasMemberHeader(fd) || !index->BuildFromMembers(fd).ok()) {
+    string path = file::GzipIndexPath(filename), data;
+    if (file::Exists(path) && file_util::ReadFileToString(path, &data) &&
+        index->Parse(data).ok() && index->file_size() == fd->Size()) {
+      VLOG(1) << "Loaded the gzip index " << path;
+    } else if (FLAGS_local_runner_gzip_index_span_mb) {
+      LOG(INFO) << "Indexing " << filename;
+      util::Status st = index->Build(fd, size_t(FLAGS_local_runner_gzip_index_span_mb) << 20);
+      if (!st.ok()) {
+        LOG(WARNING) << "Could not index " << filename << ": " << st;
+        return nullptr;
+      }
+      data.clear();
+      index->Serialize(&data);
+      WriteFileAtomically(path, data);  // the index is used even if it can not be stored.
+    } else {
+      return nullptr;
+    }
+  }
+
+  std::lock_guard<fibers::mutex> lk(gzip_index_mu);
+  return gzip_indices.emplace(filename, std::move(index)).first->second;
+}
+
+auto LocalRunner::Impl::FindGzipIndex(const string& filename)
+    -> std::shared_ptr<const file::GzipIndex> {
+  std::lock_guard<fibers::mutex> lk(gzip_index_mu);
+  auto it = gzip_indices.find(filename);
+  return it == gzip_indices.end() ? nullptr : it->second;
+}
+
+bool LocalRunner::Impl::IsFastFile(absl::string_view filename) {
+  std::lock_guard<fibers::mutex> lk(fast_mu);
+  for (const string& dir : fast_dirs) {
+    if (filename.size() > dir.size() && absl::StartsWith(filename, dir) &&
+        filename[dir.size()] == '/')
+      return true;
+  }
+  return false;
+}
+
+uint64_t LocalRunner::Impl::ProcessMemory(const MemoryShard& shard, RawViewSinkCb cb) {
+  uint64_t cnt = 0;
+
+  shard.ForEach([&](StringPiece record) {
+    if (stop_signal_.load(std::memory_order_relaxed))
+      return;
+    cb(record);
+    if (++cnt % 1000 == 0) {
+      this_fiber::yield();
+    }
+  });
+
+  return cnt;
+}
+
 void LocalRunner::Impl::Start(const pb::Operator* op) {
   CHECK(!dest_mgr);
   current_op = op;
   string out_dir = file_util::JoinPath(data_dir, op->output().name());
   if (util::IsGcsPath(out_dir)) {
     LazyGcsInit();  // Initializes gce handle.
+
+    std::lock_guard<fibers::mutex> lk(list_cache_mu);
+    for (auto it = list_cache.begin(); it != list_cache.end();) {
+      if (absl::StartsWith(it->first, out_dir)) {
+        it = list_cache.erase(it);
+      } else {
+        ++it;
+      }
+    }
   } else if (!file::Exists(out_dir)) {
     CHECK(file_util::RecursivelyCreateDir(out_dir, 0750)) << "Could not create dir " << out_dir;
   }
+  // The outputs are about to be overwritten, hence the previous checkpoint is not valid anymore.
+  if (!util::IsGcsPath(out_dir)) {
+    string cp_path = CheckpointPath(*op);
+    if (file::Exists(cp_path)) {
+      CHECK(file::Delete(cp_path)) << "Could not delete " << cp_path;
+    }
+  }
+  // The shards kept in memory by the previous runs are overwritten as well.
+  for (detail::MemoryShardStore* store : {mem_store.get(), cache_store.get()}) {
+    if (store)
+      store->EraseDir(out_dir);
+  }
+
+  std::lock_guard<fibers::mutex> lk(dest_mu);
   dest_mgr.reset(new DestFileSet(out_dir, op->output(), io_pool_, &fq_pool));
+  dest_mgr->set_memory_store(mem_store.get());
+  dest_mgr->set_cache_store(cache_store.get());
+  dest_mgr->set_worker_index(worker_index);
 
   if (util::IsGcsPath(out_dir)) {
-    dest_mgr->set_gce(gce_handle.get());
+    dest_mgr->set_gcs_pool(gcs_pool.get());
   }
 }
 
 void LocalRunner::Impl::End(ShardFileMap* out_files) {
+  AddFastDir(dest_mgr->output());
   auto shards = dest_mgr->GetShards();
   for (const ShardId& sid : shards) {
     out_files->emplace(sid, dest_mgr->ShardFilePath(sid, -1));
   }
   dest_mgr->CloseAllHandles(stop_signal_.load(std::memory_order_acquire));
+
+  detail::ShardStatsList stats = dest_mgr->closed_stats();
+  LOG(INFO) << dest_mgr->output().name() << " output: "
+            << detail::ShardSkewSummary(kTopShardsVarz, &stats);
+
+  std::lock_guard<fibers::mutex> lk(dest_mu);
+  closed_stats = std::move(stats);
   dest_mgr.reset();
   current_op = nullptr;
 }
 
+void LocalRunner::Impl::EndAsync(ShardFileMap* out_files,
+                                 std::shared_ptr<detail::ShardGate> gate) {
+  AddFastDir(dest_mgr->output());
+  auto shards = dest_mgr->GetShards();
+  for (const ShardId& sid : shards) {
+    string glob = dest_mgr->ShardFilePath(sid, -1);
+    gate->Add(glob);
+    out_files->emplace(sid, std::move(glob));
+  }
+
+  JoinCloser();
+  std::unique_lock<fibers::mutex> lk(dest_mu);
+  std::unique_ptr<DestFileSet> dm = std::move(dest_mgr);
+  closed_stats.clear();
+  lk.unlock();
+
+  bool abort_write = stop_signal_.load(std::memory_order_acquire);
+  closer = std::thread([dm = std::move(dm), gate = std::move(gate), abort_write] {
+    dm->CloseAllHandles(abort_write, [&](const ShardId& sid) {
+      gate->Close(dm->ShardFilePath(sid, -1));
+    });
+    gate->CloseAll();
+
+    detail::ShardStatsList stats = dm->closed_stats();
+    LOG(INFO) << dm->output().name() << " output: "
+              << detail::ShardSkewSummary(kTopShardsVarz, &stats);
+  });
+}
+
+void LocalRunner::Impl::JoinCloser() {
+  if (closer.joinable())
+    closer.join();
+}
+
 void LocalRunner::Impl::ExpandGCS(absl::string_view glob, ExpandCb cb) {
   absl::string_view bucket, path;
   CHECK(GCS::SplitToBucketPath(glob, &bucket, &path));
@@ -233,17 +693,110 @@ void LocalRunner::Impl::ExpandGCS(absl::string_view glob, ExpandCb cb) {
   // Lazy init of gce_handle.
   LazyGcsInit();
 
-  auto cb2 = [cb = std::move(cb), bucket](size_t sz, absl::string_view s) {
-    cb(sz, GCS::ToGcsPath(bucket, s));
+  uint64_t now = base::GetMonotonicMicrosFast();
+  std::shared_ptr<const GcsListing> listing;
+  if (FLAGS_local_runner_gcs_list_cache_sec) {
+    std::lock_guard<fibers::mutex> lk(list_cache_mu);
+    auto it = list_cache.find(string(glob));
+    if (it != list_cache.end() && it->second.expire_usec > now) {
+      VLOG(1) << "Using cached listing of " << glob;
+      listing = it->second.listing;
+    }
+  }
+
+  if (!listing) {
+    bool recursive;
+    string pattern = SplitObjectGlob(&path, &recursive);
+    listing = std::make_shared<GcsListing>(ListGCS(bucket, path, !recursive, pattern));
+
+    if (FLAGS_local_runner_gcs_list_cache_sec) {
+      uint64_t expire = now + uint64_t(FLAGS_local_runner_gcs_list_cache_sec) * 1000000;
+      std::lock_guard<fibers::mutex> lk(list_cache_mu);
+      list_cache[string(glob)] = CachedListing{expire, listing};
+    }
+  }
+
+  for (const auto& sz_name : *listing) {
+    cb(sz_name.first, sz_name.second);
+  }
+}
+
+void LocalRunner::Impl::ExpandS3(absl::string_view glob, ExpandCb cb) {
+  absl::string_view bucket, path;
+  CHECK(S3::SplitToBucketPath(glob, &bucket, &path));
+  LazyS3Init();
+
+  bool recursive;
+  string pattern = SplitObjectGlob(&path, &recursive);
+
+  auto res = s3_pool->Get();
+  CHECK_STATUS(res.status);
+  auto s3_cb = [&](size_t sz, absl::string_view s) {
+    if (!pattern.empty() && fnmatch(pattern.c_str(), string(s).c_str(), FNM_PATHNAME) != 0)
+      return;
+    cb(sz, S3::ToS3Path(bucket, s));
   };
-  bool recursive = absl::EndsWith(glob, "**");
-  if (recursive) {
-    path.remove_suffix(2);
+  CHECK_STATUS(res.obj->List(bucket, path, !recursive, s3_cb));
+}
+
+auto LocalRunner::Impl::ListGCS(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
+                                const string& pattern) -> GcsListing {
+  // Range i covers the names in [bounds[i - 1], bounds[i]), the first and the last ranges are
+  // unbounded from below and above. Object names are mostly numbered, hence the digits are
+  // split finer than the letters.
+  constexpr char kBoundChars[] = "123456789ANagnu";
+
+  vector<string> bounds;
+  if (FLAGS_local_runner_gcs_list_parallel > 1) {
+    for (const char* c = kBoundChars; *c; ++c) {
+      bounds.push_back(absl::StrCat(prefix, absl::string_view(c, 1)));
+    }
+  }
+
+  vector<GcsListing> ranges(bounds.size() + 1);
+  size_t next_range = 0;
+
+  // The fibers run in the calling thread, hence they share next_range without locking.
+  auto list_ranges = [&] {
+    auto gcs = GetGcsHandle();
+
+    while (next_range < ranges.size()) {
+      size_t i = next_range++;
+      absl::string_view start, end;
+      if (i > 0)
+        start = bounds[i - 1];
+      if (i < bounds.size())
+        end = bounds[i];
+
+      GcsListing* dest = &ranges[i];
+      auto cb = [&, dest](size_t sz, absl::string_view s) {
+        if (!pattern.empty() && fnmatch(pattern.c_str(), string(s).c_str(), FNM_PATHNAME) != 0)
+          return;
+        dest->emplace_back(sz, GCS::ToGcsPath(bucket, s));
+      };
+      CHECK_STATUS(gcs->ListRange(bucket, prefix, fs_mode, start, end, cb));
+    }
+  };
+
+  size_t num_fibers = std::min<size_t>(FLAGS_local_runner_gcs_list_parallel, ranges.size());
+  vector<fibers::fiber> fibers;
+  for (size_t i = 1; i < num_fibers; ++i) {
+    fibers.emplace_back(list_ranges);
+  }
+  list_ranges();
+  for (auto& fb : fibers) {
+    fb.join();
+  }
+
+  GcsListing res = std::move(ranges[0]);
+  for (size_t i = 1; i < ranges.size(); ++i) {
+    res.insert(res.end(), std::make_move_iterator(ranges[i].begin()),
+               std::make_move_iterator(ranges[i].end()));
   }
-  auto gcs = GetGcsHandle();
-  bool fs_mode = !recursive;
-  auto status = gcs->List(bucket, path, fs_mode, cb2);
-  CHECK_STATUS(status);
+  VLOG(1) << "Listed " << res.size() << " objects of " << prefix << " in " << ranges.size()
+          << " ranges";
+
+  return res;
 }
 
 util::StatusObject<file::ReadonlyFile*> LocalRunner::Impl::OpenReadFile(
@@ -252,20 +805,96 @@ util::StatusObject<file::ReadonlyFile*> LocalRunner::Impl::OpenReadFile(
     per_thread_.reset(new PerThread);
   }
 
+  file::FiberReadOptions opts;
+  opts.prefetch_size = FLAGS_local_runner_prefetch_size;
+  if (FLAGS_local_runner_max_prefetch_size) {
+    opts.max_prefetch_size = FLAGS_local_runner_max_prefetch_size;
+    opts.max_remote_prefetch_size = FLAGS_local_runner_max_remote_prefetch_size;
+  }
+  opts.use_mmap = FLAGS_local_runner_mmap_inputs || IsFastFile(filename);
+  opts.stats = stats;
+
   if (util::IsGcsPath(filename)) {
     LazyGcsInit();
 
-    auto gcs = GetGcsHandle();
-    return gcs->OpenGcsFile(filename);
+    // The generation is a part of the key, hence overwritten objects are downloaded again.
+    string cache_key;
+    size_t cache_size = 0;
+    if (input_cache) {
+      absl::string_view bucket, obj_path;
+      CHECK(GCS::SplitToBucketPath(filename, &bucket, &obj_path));
+      GET_UNLESS_ERROR(meta, GetGcsHandle()->ReadMetadata(bucket, obj_path));
+
+      cache_key = absl::StrCat(filename, "#", meta.generation);
+      cache_size = meta.size;
+      file::ReadonlyFile* cached = input_cache->Open(cache_key, opts);
+      if (cached)
+        return cached;
+    }
+
+    StatusObject<file::ReadonlyFile*> res;
+    if (FLAGS_local_runner_gcs_read_window > 1) {
+      GcsRangeReadOptions range_opts;
+      range_opts.range_size = size_t(FLAGS_local_runner_gcs_range_mb) << 20;
+      range_opts.window = FLAGS_local_runner_gcs_read_window;
+      res = OpenGcsRangeFile(filename, gcs_pool.get(), range_opts);
+    } else {
+      res = OpenGcsFile(filename, gcs_pool.get());
+    }
+
+    // A different size means the object was overwritten after its metadata was read.
+    if (res.ok() && input_cache && res.obj->Size() == cache_size) {
+      res.obj = input_cache->Fill(cache_key, res.obj);
+    }
+    return res;
   }
 
-  file::FiberReadOptions opts;
-  opts.prefetch_size = FLAGS_local_runner_prefetch_size;
-  opts.stats = stats;
+  if (util::IsS3Path(filename)) {
+    LazyS3Init();
+
+    S3ReadOptions s3_opts;
+    s3_opts.range_size = size_t(FLAGS_local_runner_s3_range_mb) << 20;
+    s3_opts.read_ahead = std::max(1u, FLAGS_local_runner_s3_read_ahead);
+    return OpenS3ReadFile(filename, s3_pool.get(), s3_opts);
+  }
+
+  if (FLAGS_local_runner_io_uring) {
+    IoContext* cntx = io_pool_->GetThisContext();
+    IoUring* ring = cntx ? IoUring::ForThisThread(cntx) : nullptr;
+    if (ring)
+      return file::OpenUringReadFile(filename, ring, opts);
+  }
 
   return file::OpenFiberReadFile(filename, &fq_pool, opts);
 }
 
+void LocalRunner::Impl::StartRead(const file::FiberReadOptions::Stats* stats) {
+  per_thread_->active_reads.push_back(stats);
+}
+
+void LocalRunner::Impl::EndRead(const file::FiberReadOptions::Stats* stats) {
+  auto& reads = per_thread_->active_reads;
+  reads.erase(std::find(reads.begin(), reads.end(), stats));
+
+  Runner::ReadStats& totals = per_thread_->read_totals;
+  totals.cache_bytes += stats->cache_bytes;
+  totals.disk_bytes += stats->disk_bytes;
+  totals.preempt_cnt += stats->preempt_cnt;
+}
+
+Runner::ReadStats LocalRunner::Impl::GetReadStats() const {
+  if (!per_thread_)
+    return Runner::ReadStats{};
+
+  Runner::ReadStats res = per_thread_->read_totals;
+  for (const auto* stats : per_thread_->active_reads) {
+    res.cache_bytes += stats->cache_bytes;
+    res.disk_bytes += stats->disk_bytes;
+    res.preempt_cnt += stats->preempt_cnt;
+  }
+  return res;
+}
+
 void LocalRunner::Impl::LazyGcsInit() {
   if (!per_thread_) {
     per_thread_.reset(new PerThread);
@@ -275,15 +904,39 @@ void LocalRunner::Impl::LazyGcsInit() {
     if (!gce_handle) {
       gce_handle.reset(new GCE);
       CHECK_STATUS(gce_handle->Init());
+      gce_handle->StartTokenRefresher(&io_pool_->GetNextContext());
+
+      GcsPool::Options opts;
+      opts.connect_msec = FLAGS_gcs_connect_deadline_ms;
+      opts.idle_evict_sec = FLAGS_local_runner_gcs_idle_sec;
+      gcs_pool.reset(new GcsPool(*gce_handle, io_pool_, opts));
+      base::StartupTimeline::Mark("gcs_init");
     }
   }
 }
 
+void LocalRunner::Impl::LazyS3Init() {
+  std::lock_guard<fibers::mutex> lk(aws_mu);
+  if (!aws_handle) {
+    aws_handle.reset(new AWS);
+    CHECK_STATUS(aws_handle->Init());
+
+    S3Pool::Options opts;
+    opts.connect_msec = FLAGS_gcs_connect_deadline_ms;
+    opts.idle_evict_sec = FLAGS_local_runner_gcs_idle_sec;
+    s3_pool.reset(new S3Pool(*aws_handle, io_pool_, opts));
+  }
+}
+
 void LocalRunner::Impl::ShutDown() {
   if (per_thread_) {
     VLOG(1) << "Histogram Latency: " << per_thread_->record_fetch_hist.ToString();
-
-    per_thread_->gcs_handles.clear();
+  }
+  if (gcs_pool) {
+    gcs_pool->ClearThisContext();
+  }
+  if (s3_pool) {
+    s3_pool->ClearThisContext();
   }
 }
 
@@ -296,21 +949,55 @@ LocalRunner::LocalRunner(IoContextPool* pool, const std::string& data_dir)
 LocalRunner::~LocalRunner() {}
 
 void LocalRunner::Init() {
+  if (FLAGS_local_runner_memory_shuffle_mb) {
+    impl_->mem_store.reset(
+        new detail::MemoryShardStore(size_t(FLAGS_local_runner_memory_shuffle_mb) << 20));
+  }
+  if (FLAGS_local_runner_cache_mb) {
+    impl_->cache_store.reset(
+        new detail::MemoryShardStore(size_t(FLAGS_local_runner_cache_mb) << 20));
+  }
+
+  if (!FLAGS_local_runner_input_cache_dir.empty()) {
+    impl_->input_cache.reset(new detail::InputCache(
+        FLAGS_local_runner_input_cache_dir, size_t(FLAGS_local_runner_input_cache_mb) << 20,
+        &impl_->fq_pool));
+    impl_->input_cache->Init();
+  }
+
   if (!util::IsGcsPath(impl_->data_dir)) {
     file_util::RecursivelyCreateDir(impl_->data_dir, 0750);
   }
+  base::StartupTimeline::Mark("local_runner_init");
 }
 
 void LocalRunner::Shutdown() {
+  impl_->JoinCloser();
+
   // TODO: to move it to Impl.
   impl_->fq_pool.Shutdown();
   impl_->io_pool_->AwaitFiberOnAll([this](IoContext&) { impl_->ShutDown(); });
+  if (impl_->gce_handle) {
+    impl_->gce_handle->StopTokenRefresher();
+  }
 
   LOG(INFO) << "File cached hit bytes " << impl_->file_cache_hit_bytes.load();
+
+  if (impl_->mem_store) {
+    LOG(INFO) << "In-memory shuffle used " << impl_->mem_store->used_bytes() << " bytes";
+    impl_->mem_store->Clear();
+  }
+  if (impl_->cache_store) {
+    LOG_IF(INFO, impl_->cache_store->used_bytes())
+        << "Table cache used " << impl_->cache_store->used_bytes() << " bytes";
+    impl_->cache_store->Clear();
+  }
 }
 
 void LocalRunner::OperatorStart(const pb::Operator* op) { impl_->Start(op); }
 
+void LocalRunner::set_worker_index(int32_t index) { impl_->worker_index = index; }
+
 RawContext* LocalRunner::CreateContext() {
   CHECK_NOTNULL(impl_->current_op);
 
@@ -322,13 +1009,109 @@ void LocalRunner::OperatorEnd(ShardFileMap* out_files) {
   impl_->End(out_files);
 }
 
+void LocalRunner::OperatorEndAsync(ShardFileMap* out_files,
+                                   std::shared_ptr<detail::ShardGate> gate) {
+  VLOG(1) << "LocalRunner::OperatorEndAsync";
+  impl_->EndAsync(out_files, std::move(gate));
+}
+
+void LocalRunner::SaveCheckpoint(const pb::Operator& op, const pb::OperatorCheckpoint& cp) {
+  if (util::IsGcsPath(impl_->data_dir)) {
+    VLOG(1) << "Checkpoints are not supported for " << impl_->data_dir;
+    return;
+  }
+
+  WriteMessageFile(impl_->CheckpointPath(op), cp);
+}
+
+bool LocalRunner::LoadCheckpoint(const pb::Operator& op, pb::OperatorCheckpoint* cp) {
+  if (util::IsGcsPath(impl_->data_dir))
+    return false;
+
+  return ReadMessageFile(impl_->CheckpointPath(op), cp);
+}
+
+bool LocalRunner::LoadManifest(const pb::Operator& op, pb::IncrementalManifest* manifest) {
+  if (util::IsGcsPath(impl_->data_dir)) {
+    VLOG(1) << "Incremental runs are not supported for " << impl_->data_dir;
+    return false;
+  }
+
+  string out_dir = file_util::JoinPath(impl_->data_dir, op.output().name());
+  string prev_dir = out_dir + kPrevDirSuffix;
+
+  // The manifest stays in prev_dir if the last run failed after moving the files there.
+  if (file::Exists(file_util::JoinPath(out_dir, kManifestFile))) {
+    if (file::Exists(prev_dir)) {
+      file_util::DeleteRecursively(prev_dir);
+    }
+    CHECK_EQ(0, rename(out_dir.c_str(), prev_dir.c_str()))
+        << "Could not move " << out_dir << ": " << strerror(errno);
+  }
+
+  if (!ReadMessageFile(file_util::JoinPath(prev_dir, kManifestFile), manifest))
+    return false;
+
+  auto relocate = [&](const string& name) {
+    CHECK(absl::StartsWith(name, out_dir)) << name << " is not in " << out_dir;
+    return absl::StrCat(prev_dir, absl::string_view(name).substr(out_dir.size()));
+  };
+
+  for (auto& shard : *manifest->mutable_shard()) {
+    shard.set_url_glob(relocate(shard.url_glob()));
+    for (auto& file : *shard.mutable_file()) {
+      file.set_name(relocate(file.name()));
+    }
+  }
+  return true;
+}
+
+void LocalRunner::SaveManifest(const pb::Operator& op, const pb::IncrementalManifest& manifest) {
+  if (util::IsGcsPath(impl_->data_dir))
+    return;
+
+  string out_dir = file_util::JoinPath(impl_->data_dir, op.output().name());
+  if (!WriteMessageFile(file_util::JoinPath(out_dir, kManifestFile), manifest))
+    return;
+
+  string prev_dir = out_dir + kPrevDirSuffix;
+  if (file::Exists(prev_dir)) {
+    file_util::DeleteRecursively(prev_dir);
+  }
+}
+
 void LocalRunner::ExpandGlob(const std::string& glob, ExpandCb cb) {
+  if (const MemoryShard* shard = impl_->FindMemoryShard(glob)) {
+    // The spilled files are handled by ProcessInputFile together with the memory shard.
+    cb(shard->raw_size(), glob);
+    return;
+  }
+
   if (util::IsGcsPath(glob)) {
     impl_->ExpandGCS(glob, cb);
     return;
   }
 
-  std::vector<file_util::StatShort> paths = file_util::StatFiles(glob);
+  if (util::IsS3Path(glob)) {
+    impl_->ExpandS3(glob, cb);
+    return;
+  }
+
+  std::vector<file_util::StatShort> paths;
+  if (FLAGS_local_runner_glob_parallel) {
+    file::StatFilesParallel(glob, &impl_->fq_pool, FLAGS_local_runner_glob_parallel,
+                            [&](file_util::StatShort&& v) { paths.push_back(std::move(v)); });
+
+    // The files are reported in the order of glob(3), the operators split their inputs by it.
+    std::sort(paths.begin(), paths.end(),
+              [](const auto& l, const auto& r) { return l.name < r.name; });
+    paths.erase(std::unique(paths.begin(), paths.end(),
+                            [](const auto& l, const auto& r) { return l.name == r.name; }),
+                paths.end());
+  } else {
+    paths = file_util::StatFiles(glob);
+  }
+
   for (const auto& v : paths) {
     if (v.st_mode & S_IFREG) {
       cb(v.size, v.name);
@@ -343,8 +1126,87 @@ ostream& operator<<(ostream& os, const file::FiberReadOptions::Stats& stats) {
 }
 
 // Read file and fill queue. This function must be fiber-friendly.
-size_t LocalRunner::ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+size_t LocalRunner::ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                                      RawSinkCb cb) {
+  return ProcessAny(filename, wf, 0, kuint64max,
+                    [&cb](absl::string_view record) { cb(string(record)); });
+}
+
+size_t LocalRunner::ProcessInputBatches(const std::string& filename, const pb::WireFormat& wf,
+                                        size_t offset, size_t length, RawBatchSinkCb cb) {
+  RawRecordBatch batch;
+  size_t cnt = ProcessAny(filename, wf, offset, length, [&](absl::string_view record) {
+    batch.Add(record);
+    if (batch.full()) {
+      cb(std::move(batch));
+      batch.Clear();
+    }
+  });
+
+  if (!batch.empty()) {
+    cb(std::move(batch));
+  }
+  return cnt;
+}
+
+size_t LocalRunner::ProcessAny(const std::string& filename, const pb::WireFormat& wf,
+                               size_t offset, size_t length, RawViewSinkCb cb) {
+  const MemoryShard* shard = impl_->FindMemoryShard(filename);
+  if (shard) {
+    CHECK_EQ(shard->is_binary(), detail::IsBinary(wf.type())) << filename;
+
+    // Memory shards keep whole records, so they are passed as is even for COLUMNAR inputs.
+    LOG(INFO) << "Processing memory shard " << filename;
+    size_t cnt = impl_->ProcessMemory(*shard, cb);
+    if (shard->spilled()) {
+      std::vector<file_util::StatShort> paths = file_util::StatFiles(filename);
+      for (const auto& v : paths) {
+        if (v.st_mode & S_IFREG) {
+          cnt += ProcessFile(v.name, wf, 0, kuint64max, cb);
+        }
+      }
+    }
+    return cnt;
+  }
+
+  return ProcessFile(filename, wf, offset, length, cb);
+}
+
+bool LocalRunner::IsSplittable(const std::string& filename, const pb::WireFormat& wf) {
+  if (util::IsGcsPath(filename) || util::IsS3Path(filename) ||
+      impl_->FindMemoryShard(filename))
+    return false;
+
+  if (wf.type() == pb::WireFormat::LST || wf.type() == pb::WireFormat::COLUMNAR)
+    return true;
+
+  if (wf.type() != pb::WireFormat::TXT)
+    return false;
+
+  auto fl_res = impl_->OpenReadFile(filename, nullptr);
+  if (!fl_res.ok())
+    return false;
+
+  if (file::IsGzipFile(fl_res.obj)) {
+    std::unique_ptr<file::ReadonlyFile> fl(fl_res.obj);
+    bool res = impl_->GetGzipIndex(filename, fl.get()) != nullptr;
+    CHECK_STATUS(fl->Close());
+    return res;
+  }
+
+  // Source::Uncompressed returns the plain file source if no compression was detected.
+  std::unique_ptr<util::Source> src(file::Source::Uncompressed(fl_res.obj));
+  return dynamic_cast<file::Source*>(src.get()) != nullptr;
+}
+
+size_t LocalRunner::ProcessInputRange(const std::string& filename, const pb::WireFormat& wf,
+                                      size_t offset, size_t length, RawSinkCb cb) {
+  return ProcessAny(filename, wf, offset, length,
+                    [&cb](absl::string_view record) { cb(string(record)); });
+}
+
+size_t LocalRunner::ProcessFile(const std::string& filename, const pb::WireFormat& wf,
+                                size_t offset, size_t length, RawViewSinkCb cb) {
   file::FiberReadOptions::Stats stats;
   auto fl_res = impl_->OpenReadFile(filename, &stats);
   if (!fl_res.ok()) {
@@ -352,27 +1214,58 @@ size_t LocalRunner::ProcessInputFile(const std::string& filename, pb::WireFormat
     return 0;
   }
 
-  LOG(INFO) << "Processing file " << filename;
+  if (length == kuint64max) {
+    LOG(INFO) << "Processing file " << filename;
+  } else {
+    LOG(INFO) << "Processing file " << filename << " range [" << offset << ", " << offset + length
+              << ")";
+  }
   std::unique_ptr<file::ReadonlyFile> read_file(fl_res.obj);
   size_t cnt = 0;
-  switch (type) {
+  impl_->StartRead(&stats);
+  switch (wf.type()) {
     case pb::WireFormat::TXT:
-      cnt = impl_->ProcessText(read_file.release(), cb);
+      // Fast intermediate files are not compressed, hence their mapped lines are passed as is.
+      if (read_file->mapped_data() && impl_->IsFastFile(filename)) {
+        cnt = impl_->ProcessMappedText(*read_file, offset, length, cb);
+      } else {
+        std::shared_ptr<const file::GzipIndex> gz_index;
+        if (offset > 0 || length != kuint64max)
+          gz_index = impl_->FindGzipIndex(filename);
+        cnt = impl_->ProcessText(read_file.release(), offset, length, gz_index.get(), cb);
+      }
       break;
     case pb::WireFormat::LST:
-      cnt = impl_->ProcessLst(read_file.release(), cb);
+      cnt = impl_->ProcessLst(read_file.release(), offset, length, cb);
+      break;
+    case pb::WireFormat::COLUMNAR:
+      cnt = impl_->ProcessColumnar(read_file.release(), offset, length, wf, cb);
       break;
     default:
-      LOG(FATAL) << "Not implemented " << pb::WireFormat::Type_Name(type);
+      LOG(FATAL) << "Not implemented " << pb::WireFormat::Type_Name(wf.type());
       break;
   }
 
+  impl_->EndRead(&stats);
   VLOG(1) << "Read Stats (disk read/cached/read_cnt/preempts): " << stats;
   impl_->file_cache_hit_bytes.fetch_add(stats.cache_bytes, std::memory_order_relaxed);
 
   return cnt;
 }
 
+Runner::ReadStats LocalRunner::GetReadStats() { return impl_->GetReadStats(); }
+
+std::vector<std::pair<ShardId, size_t>> LocalRunner::GetOutputShardBytes() {
+  std::lock_guard<fibers::mutex> lk(impl_->dest_mu);
+  return impl_->dest_mgr ? impl_->dest_mgr->GetShardBytes()
+                         : std::vector<std::pair<ShardId, size_t>>{};
+}
+
+std::vector<std::pair<ShardId, pb::ShardStats>> LocalRunner::GetClosedShardStats() {
+  std::lock_guard<fibers::mutex> lk(impl_->dest_mu);
+  return impl_->closed_stats;
+}
+
 void LocalRunner::Stop() {
   CHECK_NOTNULL(impl_)->stop_signal_.store(true, std::memory_order_seq_cst);
 }
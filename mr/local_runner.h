@@ -31,16 +31,54 @@ class LocalRunner : public Runner {
 
   void OperatorEnd(ShardFileMap* out_files) final;
 
+  // The output is closed by a background thread that reports the closed shards to gate.
+  void OperatorEndAsync(ShardFileMap* out_files, std::shared_ptr<detail::ShardGate> gate) final;
+
+  // Checkpoints are stored in the output directory of the operator.
+  // Not supported for GCS destinations.
+  void SaveCheckpoint(const pb::Operator& op, const pb::OperatorCheckpoint& cp) final;
+  bool LoadCheckpoint(const pb::Operator& op, pb::OperatorCheckpoint* cp) final;
+
+  // Manifests are stored in the output directory of the operator as well. The previous
+  // results are kept by renaming the directory. Not supported for GCS destinations.
+  bool LoadManifest(const pb::Operator& op, pb::IncrementalManifest* manifest) final;
+  void SaveManifest(const pb::Operator& op, const pb::IncrementalManifest& manifest) final;
+
   // For GCS, if glob ends with "**", expands it recursively.
   void ExpandGlob(const std::string& glob, ExpandCb cb) final;
 
   // Read file and fill queue. This function must be fiber-friendly.
-  size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+  size_t ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                           RawSinkCb cb) final;
 
+  // Uncompressed local text files and LST files are splittable.
+  bool IsSplittable(const std::string& filename, const pb::WireFormat& wf) final;
+
+  size_t ProcessInputRange(const std::string& filename, const pb::WireFormat& wf, size_t offset,
+                           size_t length, RawSinkCb cb) final;
+
+  size_t ProcessInputBatches(const std::string& filename, const pb::WireFormat& wf,
+                             size_t offset, size_t length, RawBatchSinkCb cb) final;
+
+  ReadStats GetReadStats() final;
+
+  std::vector<std::pair<ShardId, size_t>> GetOutputShardBytes() final;
+
+  std::vector<std::pair<ShardId, pb::ShardStats>> GetClosedShardStats() final;
+
   void Stop();
 
+  // Tags the names of the output files with the worker index, so that several processes can
+  // write into the same output directory. The output globs cover the files of all workers.
+  void set_worker_index(int32_t index);
+
  private:
+  // Handles both memory shards and files.
+  size_t ProcessAny(const std::string& filename, const pb::WireFormat& wf, size_t offset,
+                    size_t length, RawViewSinkCb cb);
+  size_t ProcessFile(const std::string& filename, const pb::WireFormat& wf, size_t offset,
+                     size_t length, RawViewSinkCb cb);
+
   struct Impl;
   std::unique_ptr<Impl> impl_;
 };
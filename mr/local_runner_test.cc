@@ -8,11 +8,27 @@
 #include "base/logging.h"
 #include "mr/do_context.h"
 
+#include "absl/strings/str_cat.h"
+#include "file/fiber_file.h"
 #include "file/file_util.h"
+#include "file/filesource.h"
+#include "file/gzip_index.h"
+#include "mr/impl/input_cache.h"
 #include "util/asio/io_context_pool.h"
 #include "util/plang/addressbook.pb.h"
+#include "util/zlib_source.h"
 
 namespace mr3 {
+
+DECLARE_uint32(local_runner_memory_shuffle_mb);
+DECLARE_uint32(local_runner_glob_parallel);
+DECLARE_uint32(local_runner_gzip_index_span_mb);
+
+namespace detail {
+DECLARE_uint32(sort_output_buffer_mb);
+DECLARE_bool(dest_file_fast_intermediate);
+}  // namespace detail
+
 using namespace util;
 using namespace std;
 
@@ -43,6 +59,29 @@ class LocalRunnerTest : public testing::Test {
     runner_->OperatorStart(&op_);
   }
 
+  // Recreates the runner with in-memory shuffle enabled.
+  void EnableMemoryShuffle(unsigned budget_mb) {
+    runner_->Shutdown();
+    FLAGS_local_runner_memory_shuffle_mb = budget_mb;
+    runner_.reset(new LocalRunner{pool_.get(), base::GetTestTempDir()});
+    runner_->Init();
+    FLAGS_local_runner_memory_shuffle_mb = 0;
+  }
+
+  static pb::WireFormat Format(pb::WireFormat::Type type) {
+    pb::WireFormat wf;
+    wf.set_type(type);
+    return wf;
+  }
+
+  size_t ReadShard(const string& glob, const pb::WireFormat& wf, vector<string>* res) {
+    return pool_->GetNextContext().AwaitSafe([&] {
+      return runner_->ProcessInputFile(glob, wf, [res](string&& s) {
+        res->push_back(std::move(s));
+      });
+    });
+  }
+
   auto MatchShard(ShardId shard_id, string glob) { return Pair(shard_id, EndsWith(glob)); }
 
   pb::Operator op_;
@@ -69,6 +108,63 @@ TEST_F(LocalRunnerTest, Basic) {
   EXPECT_EQ("foo\n", contents);
 }
 
+TEST_F(LocalRunnerTest, DirectIO) {
+  for (bool compress : {false, true}) {
+    ShardFileMap out_files;
+    if (compress) {
+      op_.mutable_output()->mutable_compress()->set_type(pb::Output::GZIP);
+    }
+    op_.mutable_output()->set_direct_io(true);
+    Start(pb::WireFormat::TXT);
+
+    std::unique_ptr<RawContext> context{runner_->CreateContext()};
+    vector<string> expected;
+    for (unsigned i = 0; i < 30000; ++i) {
+      string rec = absl::StrCat("record", i, string(i % 100, 'a'));
+      expected.push_back(rec);
+      context->TEST_Write(kShard0, std::move(rec));
+    }
+    context->Flush();
+    runner_->OperatorEnd(&out_files);
+    ASSERT_EQ(1, out_files.size());
+
+    vector<string> res;
+    ReadShard(out_files.begin()->second, Format(pb::WireFormat::TXT), &res);
+    EXPECT_EQ(expected, res) << compress;
+  }
+}
+
+TEST_F(LocalRunnerTest, ParallelCompress) {
+  auto* compress = op_.mutable_output()->mutable_compress();
+  compress->set_type(pb::Output::GZIP);
+  compress->set_member_size_kb(16);
+  Start(pb::WireFormat::TXT);
+
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  vector<string> expected;
+  for (unsigned i = 0; i < 30000; ++i) {
+    string rec = absl::StrCat("record", i, string(i % 100, 'a'));
+    expected.push_back(rec);
+    context->TEST_Write(kShard0, std::move(rec));
+  }
+  context->Flush();
+
+  ShardFileMap out_files;
+  runner_->OperatorEnd(&out_files);
+  ASSERT_EQ(1, out_files.size());
+
+  // Checks that the records were written as gzip members.
+  const string& path = out_files.begin()->second;
+  auto res = file::ReadonlyFile::Open(path);
+  ASSERT_TRUE(res.ok()) << res.status;
+  std::unique_ptr<file::ReadonlyFile> fl(res.obj);
+  ASSERT_TRUE(file::GzipMemberSource::HasMemberHeader(fl.get()));
+
+  vector<string> res_recs;
+  ReadShard(path, Format(pb::WireFormat::TXT), &res_recs);
+  EXPECT_EQ(expected, res_recs);
+}
+
 TEST_F(LocalRunnerTest, MaxShardSize) {
   Start(pb::WireFormat::TXT);
   op_.mutable_output()->mutable_compress()->set_type(pb::Output::GZIP);
@@ -91,6 +187,70 @@ TEST_F(LocalRunnerTest, MaxShardSize) {
                                              EndsWith("shard-0000-001.txt.gz")));
 }
 
+TEST_F(LocalRunnerTest, ShardStats) {
+  Start(pb::WireFormat::TXT);
+  op_.mutable_output()->mutable_compress()->set_type(pb::Output::GZIP);
+  op_.mutable_output()->mutable_shard_spec()->set_max_raw_size_mb(1);
+
+  const ShardId kShard1{1};
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  for (unsigned i = 0; i < 2000; ++i) {
+    context->TEST_Write(kShard0, string(1000, 'a'));
+  }
+  context->TEST_Write(kShard1, "foo");
+  context->Flush();
+
+  ShardFileMap out_files;
+  runner_->OperatorEnd(&out_files);
+
+  auto stats = runner_->GetClosedShardStats();
+  ASSERT_EQ(2, stats.size());
+  std::sort(stats.begin(), stats.end(),
+            [](const auto& l, const auto& r) { return l.second.records() > r.second.records(); });
+
+  const pb::ShardStats& big = stats[0].second;
+  EXPECT_EQ(kShard0, stats[0].first);
+  EXPECT_EQ(2000, big.records());
+  EXPECT_EQ(2000 * 1001, big.raw_bytes());
+  EXPECT_EQ(2, big.files());
+
+  size_t file_bytes = 0;
+  runner_->ExpandGlob(out_files[kShard0], [&](size_t sz, auto&) { file_bytes += sz; });
+  EXPECT_EQ(file_bytes, big.file_bytes());
+  EXPECT_LT(big.file_bytes(), big.raw_bytes());
+
+  EXPECT_EQ(kShard1, stats[1].first);
+  EXPECT_EQ(1, stats[1].second.records());
+  EXPECT_EQ(4, stats[1].second.raw_bytes());
+  EXPECT_EQ(1, stats[1].second.files());
+}
+
+TEST_F(LocalRunnerTest, CoalesceSubShards) {
+  Start(pb::WireFormat::TXT);
+  op_.mutable_output()->mutable_shard_spec()->set_max_raw_size_mb(1);
+  op_.mutable_output()->mutable_shard_spec()->set_min_raw_size_mb(1);
+
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  for (unsigned i = 0; i < 2500; ++i) {
+    context->TEST_Write(kShard0, string(1000, 'a'));
+  }
+  context->Flush();
+
+  ShardFileMap out_files;
+  runner_->OperatorEnd(&out_files);
+  ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(kShard0, "shard-0000-*.txt")));
+
+  // The tail of 0.4MB is appended to the second sub-shard.
+  vector<string> expanded, res;
+  runner_->ExpandGlob(out_files.begin()->second, [&](size_t sz, auto& s) {
+    expanded.push_back(s);
+    ReadShard(s, Format(pb::WireFormat::TXT), &res);
+  });
+  EXPECT_THAT(expanded, UnorderedElementsAre(EndsWith("shard-0000-000.txt"),
+                                             EndsWith("shard-0000-001.txt")));
+  EXPECT_EQ(2500, res.size());
+}
+
 TEST_F(LocalRunnerTest, Lst) {
   ShardFileMap out_files;
   Start(pb::WireFormat::LST);
@@ -107,6 +267,69 @@ TEST_F(LocalRunnerTest, Lst) {
 }
 
 
+TEST_F(LocalRunnerTest, ReadStats) {
+  ShardFileMap out_files;
+  Start(pb::WireFormat::TXT);
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  for (unsigned i = 0; i < 1000; ++i) {
+    context->TEST_Write(kShard0, string(100, 'a'));
+  }
+  context->Flush();
+  runner_->OperatorEnd(&out_files);
+
+  string shard_name = base::GetTestTempPath("w1/w1-shard-0000.txt");
+  Runner::ReadStats before, after;
+  vector<string> res;
+  pool_->GetNextContext().AwaitSafe([&] {
+    before = runner_->GetReadStats();
+    runner_->ProcessInputFile(shard_name, Format(pb::WireFormat::TXT),
+                              [&](string&& s) { res.push_back(std::move(s)); });
+    after = runner_->GetReadStats();
+  });
+
+  EXPECT_EQ(1000, res.size());
+  // Requested lengths are accounted, hence the totals may exceed the file size.
+  EXPECT_GE((after.disk_bytes + after.cache_bytes) - (before.disk_bytes + before.cache_bytes),
+            101000);
+  EXPECT_GT(after.preempt_cnt, before.preempt_cnt);
+}
+
+TEST_F(LocalRunnerTest, Sorted) {
+  ShardFileMap out_files;
+  Start(pb::WireFormat::TXT);
+  op_.mutable_output()->set_sorted(true);
+  op_.mutable_output()->mutable_shard_spec()->set_max_raw_size_mb(1);
+
+  // Spills every record in order to check the merge of the runs.
+  detail::FLAGS_sort_output_buffer_mb = 0;
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  for (unsigned i = 0; i < 300; ++i) {
+    string key = absl::StrCat(999 - i % 100);
+    context->TEST_WriteSorted(kShard0, std::move(key), absl::StrCat(i, "-", string(5000, 'a')));
+  }
+  context->Flush();
+  runner_->OperatorEnd(&out_files);
+  detail::FLAGS_sort_output_buffer_mb = 512;
+
+  ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(kShard0, "shard-0000-*.txt")));
+  vector<string> files, res;
+  runner_->ExpandGlob(out_files.begin()->second,
+                      [&](size_t sz, const string& fname) { files.push_back(fname); });
+  EXPECT_EQ(2, files.size());
+
+  std::sort(files.begin(), files.end());
+  for (const string& fname : files) {
+    ReadShard(fname, Format(pb::WireFormat::TXT), &res);
+  }
+
+  ASSERT_EQ(300, res.size());
+  for (unsigned i = 0; i < res.size(); ++i) {
+    // Keys descend with i, records with equal keys keep their order.
+    unsigned expected = 99 - i / 3 + (i % 3) * 100;
+    EXPECT_EQ(absl::StrCat(expected, "-"), res[i].substr(0, res[i].find('-') + 1)) << i;
+  }
+}
+
 TEST_F(LocalRunnerTest, Subdir) {
   ShardFileMap out_files;
   Start(pb::WireFormat::TXT);
@@ -120,4 +343,398 @@ TEST_F(LocalRunnerTest, Subdir) {
   ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(subdir_shard, "w1/foo/bar/zed.txt")));
 }
 
+TEST_F(LocalRunnerTest, TextRange) {
+  string contents;
+  vector<string> expected;
+  for (unsigned i = 0; i < 1000; ++i) {
+    expected.push_back(string(i % 37, 'a' + i % 26));
+    absl::StrAppend(&contents, expected.back(), i % 3 ? "\n" : "\r\n");
+  }
+  string file_name = base::GetTestTempPath("range.txt");
+  file_util::WriteStringToFileOrDie(contents, file_name);
+  const pb::WireFormat txt = Format(pb::WireFormat::TXT);
+
+  ASSERT_TRUE(pool_->GetNextContext().AwaitSafe(
+      [&] { return runner_->IsSplittable(file_name, txt); }));
+
+  for (size_t range_size : {1, 7, 100, 4096}) {
+    vector<string> records;
+    for (size_t offset = 0; offset < contents.size(); offset += range_size) {
+      pool_->GetNextContext().AwaitSafe([&] {
+        runner_->ProcessInputRange(file_name, txt, offset, range_size,
+                                   [&](string&& s) { records.push_back(std::move(s)); });
+      });
+    }
+    EXPECT_EQ(expected, records) << range_size;
+  }
+
+  vector<string> records;
+  unsigned batches = 0;
+  pool_->GetNextContext().AwaitSafe([&] {
+    runner_->ProcessInputBatches(file_name, txt, 0, kuint64max,
+                                 [&](RawRecordBatch&& batch) {
+                                   ++batches;
+                                   for (size_t i = 0; i < batch.size(); ++i)
+                                     records.emplace_back(batch[i]);
+                                 });
+  });
+  EXPECT_EQ(expected, records);
+  EXPECT_EQ(2, batches);
+
+  file_util::CompressToGzip(file_name);
+  EXPECT_FALSE(pool_->GetNextContext().AwaitSafe(
+      [&] { return runner_->IsSplittable(file_name + ".gz", txt); }));
+}
+
+TEST_F(LocalRunnerTest, GzipRange) {
+  string contents;
+  vector<string> expected;
+  for (unsigned i = 0; i < 200000; ++i) {
+    expected.push_back(absl::StrCat(i, string(i % 37, 'a' + i % 26)));
+    absl::StrAppend(&contents, expected.back(), "\n");
+  }
+  string file_name = base::GetTestTempPath("range_gz.txt");
+  file_util::WriteStringToFileOrDie(contents, file_name);
+  file_util::CompressToGzip(file_name);
+
+  string members;
+  for (size_t i = 0; i < contents.size(); i += 100000) {
+    auto member = strings::ToByteRange(absl::string_view(contents).substr(i, 100000));
+    ASSERT_TRUE(util::GzipMemberCompress(member, 1, &members).ok());
+  }
+  string members_name = base::GetTestTempPath("range_members.txt.gz");
+  file_util::WriteStringToFileOrDie(members, members_name);
+
+  const pb::WireFormat txt = Format(pb::WireFormat::TXT);
+  FLAGS_local_runner_gzip_index_span_mb = 1;
+  for (const string& name : {file_name + ".gz", members_name}) {
+    ASSERT_TRUE(pool_->GetNextContext().AwaitSafe(
+        [&] { return runner_->IsSplittable(name, txt); })) << name;
+
+    size_t file_size = file_util::LocalFileSize(name);
+    for (size_t range_size : {file_size / 5 + 1, size_t(1 << 16)}) {
+      vector<string> records;
+      for (size_t offset = 0; offset < file_size; offset += range_size) {
+        pool_->GetNextContext().AwaitSafe([&] {
+          runner_->ProcessInputRange(name, txt, offset, range_size,
+                                     [&](string&& s) { records.push_back(std::move(s)); });
+        });
+      }
+      EXPECT_EQ(expected, records) << name << " " << range_size;
+    }
+  }
+  FLAGS_local_runner_gzip_index_span_mb = 0;
+
+  // The index of the regular gzip file is stored for the next runs.
+  EXPECT_TRUE(file::Exists(file::GzipIndexPath(file_name + ".gz")));
+  EXPECT_FALSE(file::Exists(file::GzipIndexPath(members_name)));
+}
+
+TEST_F(LocalRunnerTest, MemoryShuffle) {
+  EnableMemoryShuffle(16);
+
+  ShardFileMap out_files;
+  Start(pb::WireFormat::TXT);
+  op_.mutable_output()->set_name("mem");
+  op_.mutable_output()->set_intermediate(true);
+
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  context->TEST_Write(kShard0, "foo");
+  context->TEST_Write(kShard0, "bar");
+
+  context->Flush();
+  runner_->OperatorEnd(&out_files);
+
+  ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(kShard0, "mem-shard-0000.txt")));
+  EXPECT_FALSE(file::Exists(out_files.begin()->second));
+
+  std::vector<string> expanded;
+  runner_->ExpandGlob(out_files.begin()->second,
+                      [&](size_t sz, auto& s) { expanded.push_back(s); });
+  EXPECT_THAT(expanded, UnorderedElementsAre(out_files.begin()->second));
+
+  vector<string> records;
+  EXPECT_EQ(2, ReadShard(out_files.begin()->second, Format(pb::WireFormat::TXT), &records));
+  EXPECT_THAT(records, UnorderedElementsAre("foo", "bar"));
+}
+
+TEST_F(LocalRunnerTest, FastIntermediate) {
+  detail::FLAGS_dest_file_fast_intermediate = true;
+  vector<string> expected;
+  for (unsigned i = 0; i < 1000; ++i) {
+    expected.push_back(string(i % 37, 'a' + i % 26));
+  }
+
+  for (auto type : {pb::WireFormat::TXT, pb::WireFormat::LST}) {
+    ShardFileMap out_files;
+    op_.Clear();
+    if (type == pb::WireFormat::TXT)
+      op_.mutable_output()->mutable_compress()->set_type(pb::Output::GZIP);
+    Start(type);
+    op_.mutable_output()->set_name("fast");
+    op_.mutable_output()->set_intermediate(true);
+
+    std::unique_ptr<RawContext> context{runner_->CreateContext()};
+    for (const string& s : expected) {
+      context->TEST_Write(kShard0, string(s));
+    }
+    context->Flush();
+    runner_->OperatorEnd(&out_files);
+
+    const string& shard = out_files.begin()->second;
+    const pb::WireFormat wf = Format(type);
+    vector<string> records;
+    EXPECT_EQ(expected.size(), ReadShard(shard, wf, &records));
+    EXPECT_EQ(expected, records);
+
+    if (type == pb::WireFormat::TXT) {
+      EXPECT_THAT(shard, EndsWith("fast-shard-0000.txt"));
+      string contents;
+      ASSERT_TRUE(file_util::ReadFileToString(shard, &contents));
+      EXPECT_EQ(absl::StrCat(expected[0], "\n", expected[1], "\n"), contents.substr(0, 3));
+
+      records.clear();
+      for (size_t offset = 0; offset < contents.size(); offset += 100) {
+        pool_->GetNextContext().AwaitSafe([&] {
+          runner_->ProcessInputRange(shard, wf, offset, 100,
+                                     [&](string&& s) { records.push_back(std::move(s)); });
+        });
+      }
+      EXPECT_EQ(expected, records);
+    }
+  }
+  detail::FLAGS_dest_file_fast_intermediate = false;
+}
+
+TEST_F(LocalRunnerTest, CachedOutput) {
+  for (const char* rec : {"foo", "bar"}) {
+    ShardFileMap out_files;
+    Start(pb::WireFormat::LST);
+    op_.mutable_output()->set_name("cached");
+    op_.mutable_output()->set_intermediate(true);
+    op_.mutable_output()->set_cached(true);
+
+    std::unique_ptr<RawContext> context{runner_->CreateContext()};
+    context->TEST_Write(kShard0, rec);
+    context->TEST_Write(kShard0, rec);
+
+    context->Flush();
+    runner_->OperatorEnd(&out_files);
+
+    ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(kShard0, "cached-shard-0000.lst")));
+    EXPECT_FALSE(file::Exists(out_files.begin()->second));
+
+    // Every consumer is served from memory, the shards of the previous run are replaced.
+    for (unsigned i = 0; i < 2; ++i) {
+      vector<string> records;
+      EXPECT_EQ(2, ReadShard(out_files.begin()->second, Format(pb::WireFormat::LST), &records));
+      EXPECT_THAT(records, UnorderedElementsAre(rec, rec));
+    }
+  }
+}
+
+TEST_F(LocalRunnerTest, MemoryShuffleSpill) {
+  EnableMemoryShuffle(1);
+
+  ShardFileMap out_files;
+  Start(pb::WireFormat::LST);
+  op_.mutable_output()->set_name("spill");
+  op_.mutable_output()->set_intermediate(true);
+
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  for (unsigned i = 0; i < 2000; ++i) {
+    context->TEST_Write(kShard0, string(1000, 'a'));
+  }
+
+  context->Flush();
+  runner_->OperatorEnd(&out_files);
+
+  ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(kShard0, "spill-shard-0000.lst")));
+  EXPECT_TRUE(file::Exists(out_files.begin()->second));
+
+  vector<string> records;
+  EXPECT_EQ(2000, ReadShard(out_files.begin()->second, Format(pb::WireFormat::LST), &records));
+  ASSERT_EQ(2000, records.size());
+  EXPECT_EQ(string(1000, 'a'), records.front());
+}
+
+TEST_F(LocalRunnerTest, Columnar) {
+  ShardFileMap out_files;
+  Start(pb::WireFormat::COLUMNAR);
+  op_.mutable_output()->set_type_name("tutorial.Person");
+
+  // Spans few blocks.
+  constexpr unsigned kNumRecords = 20000;
+  vector<string> expected, projected;
+  std::unique_ptr<RawContext> context{runner_->CreateContext()};
+  for (unsigned i = 0; i < kNumRecords; ++i) {
+    tutorial::Person person;
+    person.set_name(absl::StrCat("person", i % 10));
+    person.set_id(int64_t(i) - 100);
+    person.set_dval(i * 0.25);
+    if (i % 2) {
+      person.set_email("foo@bar.com");
+      person.add_tag("a");
+      person.add_tag(absl::StrCat("b", i));
+      person.add_phone()->set_number("123");
+    }
+    expected.push_back(person.SerializeAsString());
+    context->TEST_Write(kShard0, string(expected.back()));
+
+    tutorial::Person projection;
+    projection.set_id(person.id());
+    *projection.mutable_tag() = person.tag();
+    projected.push_back(projection.SerializePartialAsString());
+  }
+
+  context->Flush();
+  runner_->OperatorEnd(&out_files);
+  ASSERT_THAT(out_files, UnorderedElementsAre(MatchShard(kShard0, "w1/w1-shard-0000.col")));
+
+  const string& file_name = out_files.begin()->second;
+  vector<string> records;
+  pb::WireFormat wf = Format(pb::WireFormat::COLUMNAR);
+  std::sort(expected.begin(), expected.end());
+  std::sort(projected.begin(), projected.end());
+
+  EXPECT_EQ(kNumRecords, ReadShard(file_name, wf, &records));
+  std::sort(records.begin(), records.end());
+  EXPECT_EQ(expected, records);
+
+  records.clear();
+  wf.add_field("id");
+  wf.add_field("tag");
+  EXPECT_EQ(kNumRecords, ReadShard(file_name, wf, &records));
+  std::sort(records.begin(), records.end());
+  EXPECT_EQ(projected, records);
+}
+
+TEST_F(LocalRunnerTest, Checkpoint) {
+  ShardFileMap out_files;
+  Start(pb::WireFormat::TXT);
+
+  pb::OperatorCheckpoint cp;
+  EXPECT_FALSE(runner_->LoadCheckpoint(op_, &cp));
+
+  cp.set_fingerprint(42);
+  auto* shard = cp.add_shard();
+  shard->set_shard_id(0);
+  shard->set_url_glob("w1-shard-0000.txt");
+  runner_->OperatorEnd(&out_files);
+  runner_->SaveCheckpoint(op_, cp);
+
+  pb::OperatorCheckpoint loaded;
+  ASSERT_TRUE(runner_->LoadCheckpoint(op_, &loaded));
+  EXPECT_EQ(42, loaded.fingerprint());
+  ASSERT_EQ(1, loaded.shard_size());
+  EXPECT_EQ("w1-shard-0000.txt", loaded.shard(0).url_glob());
+
+  // Rerunning the operator invalidates its checkpoint.
+  runner_->OperatorStart(&op_);
+  EXPECT_FALSE(runner_->LoadCheckpoint(op_, &loaded));
+  runner_->OperatorEnd(&out_files);
+}
+
+TEST_F(LocalRunnerTest, ExpandGlob) {
+  string dir = file_util::JoinPath(base::GetTestTempDir(), "glob");
+  file_util::DeleteRecursively(dir);
+  for (const char* name : {"a/x1.txt", "a/x2.log", "a/sub/y.txt", "b/x3.txt", ".hidden/x4.txt",
+                           "a/.z.txt"}) {
+    string path = file_util::JoinPath(dir, name);
+    ASSERT_TRUE(file_util::RecursivelyCreateDir(string(file_util::DirName(path)), 0750));
+    file_util::WriteStringToFileOrDie("foo", path);
+  }
+
+  auto expand = [&](const string& glob) {
+    vector<string> res;
+    runner_->ExpandGlob(file_util::JoinPath(dir, glob), [&](size_t sz, auto& s) {
+      EXPECT_EQ(3, sz);
+      res.push_back(s.substr(dir.size() + 1));
+    });
+    return res;
+  };
+
+  EXPECT_THAT(expand("*/x*.txt"), testing::ElementsAre("a/x1.txt", "b/x3.txt"));
+  EXPECT_THAT(expand("a/x1.txt"), testing::ElementsAre("a/x1.txt"));
+  EXPECT_THAT(expand("a/missing*"), testing::ElementsAre());
+  EXPECT_THAT(expand("**"),
+              testing::ElementsAre("a/sub/y.txt", "a/x1.txt", "a/x2.log", "b/x3.txt"));
+  EXPECT_THAT(expand("**/*.txt"), testing::ElementsAre("a/sub/y.txt", "a/x1.txt", "b/x3.txt"));
+
+  // The results match glob(3).
+  vector<string> parallel = expand("*/*");
+  FLAGS_local_runner_glob_parallel = 0;
+  EXPECT_EQ(expand("*/*"), parallel);
+  FLAGS_local_runner_glob_parallel = 16;
+}
+
+// Reads the file in chunks of chunk bytes starting at offset and closes it.
+static string ReadAll(file::ReadonlyFile* fl, size_t offset = 0, size_t chunk = 600) {
+  std::unique_ptr<file::ReadonlyFile> ptr(fl);
+  string res;
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[chunk]);
+  while (offset < fl->Size()) {
+    auto st = fl->Read(offset, strings::MutableByteRange(buf.get(), chunk));
+    CHECK_STATUS(st.status);
+    res.append(reinterpret_cast<const char*>(buf.get()), st.obj);
+    offset += st.obj;
+  }
+  CHECK_STATUS(fl->Close());
+  return res;
+}
+
+TEST(InputCacheTest, FillAndEvict) {
+  string src = file_util::JoinPath(base::GetTestTempDir(), "cache_src.txt");
+  string dir = file_util::JoinPath(base::GetTestTempDir(), "input_cache");
+  string contents(1000, 'a');
+  for (size_t i = 0; i < contents.size(); i += 7)
+    contents[i] = 'b';
+  file_util::WriteStringToFileOrDie(contents, src);
+  file_util::DeleteRecursively(dir);
+
+  fibers_ext::FiberQueueThreadPool fq_pool(1);
+  auto open_src = [&] {
+    auto res = file::ReadonlyFile::Open(src);
+    CHECK_STATUS(res.status);
+    return res.obj;
+  };
+
+  {
+    detail::InputCache cache(dir, 2500, &fq_pool);
+    cache.Init();
+    file::FiberReadOptions opts;
+    EXPECT_TRUE(cache.Open("k1", opts) == nullptr);
+
+    EXPECT_EQ(contents, ReadAll(cache.Fill("k1", open_src())));
+    EXPECT_EQ(1000, cache.used_bytes());
+
+    file::ReadonlyFile* cached = cache.Open("k1", opts);
+    ASSERT_TRUE(cached);
+    EXPECT_EQ(contents, ReadAll(cached));
+
+    // Reads that skip the beginning do not fill the cache.
+    EXPECT_EQ(contents.substr(500), ReadAll(cache.Fill("k4", open_src()), 500));
+    EXPECT_TRUE(cache.Open("k4", opts) == nullptr);
+
+    // k1 is the least recently used entry when k3 exceeds the budget.
+    ReadAll(cache.Fill("k2", open_src()));
+    ReadAll(cache.Fill("k3", open_src()));
+    EXPECT_EQ(2000, cache.used_bytes());
+    EXPECT_TRUE(cache.Open("k1", opts) == nullptr);
+
+    cached = cache.Open("k2", opts);
+    ASSERT_TRUE(cached);
+    EXPECT_EQ(contents, ReadAll(cached));
+  }
+
+  // The entries are kept between the runs.
+  detail::InputCache cache(dir, 2500, &fq_pool);
+  cache.Init();
+  EXPECT_EQ(2000, cache.used_bytes());
+  file::ReadonlyFile* cached = cache.Open("k3", file::FiberReadOptions{});
+  ASSERT_TRUE(cached);
+  EXPECT_EQ(contents, ReadAll(cached));
+  fq_pool.Shutdown();
+}
+
 }  // namespace mr3
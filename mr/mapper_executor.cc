@@ -3,31 +3,78 @@
 //
 #include "mr/mapper_executor.h"
 
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <google/protobuf/descriptor.h>
+
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/str_cat.h"
 #include "base/logging.h"
+#include "base/walltime.h"
+#include "mr/impl/record_filter.h"
+#include "mr/impl/record_projection.h"
 #include "mr/impl/table_impl.h"
 #include "mr/ptable.h"
 
 #include "util/asio/io_context_pool.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/fibers_ext.h"
+#include "util/fibers/stack_pool.h"
 #include "util/stats/varz_stats.h"
+#include "util/trace/trace.h"
 
 namespace mr3 {
 
 DEFINE_uint32(map_limit, 0, "");
-DEFINE_uint32(map_io_read_factor, 2, "");
+DEFINE_uint32(map_io_read_factor, 2, "Initial number of IO read fibers per IO thread");
+DEFINE_uint32(map_io_read_min, 1, "Minimal number of IO read fibers per IO thread");
+DEFINE_uint32(map_io_read_max, 8, "Maximal number of IO read fibers per IO thread");
+DEFINE_uint32(map_io_tune_ms, 500,
+              "How often the number of IO read fibers is adjusted. 0 keeps map_io_read_factor "
+              "fibers per IO thread");
+DEFINE_uint32(map_split_size_mb, 0,
+              "If positive, splittable input files larger than this size are processed "
+              "in ranges of this size by all IO threads in parallel");
 
 using namespace std;
 using namespace boost;
 using namespace util;
+namespace gpb = google::protobuf;
 
 using fibers::channel_op_status;
 
+namespace {
+
+constexpr size_t kRecordQCapacity = 16;
+
+// Record queue occupancy below which the mappers are considered starving
+// and above which the readers are considered ahead of the mappers.
+constexpr double kLowOccupancy = 0.25;
+constexpr double kHighOccupancy = 0.75;
+
+}  // namespace
+
 struct MapperExecutor::PerIoStruct {
   unsigned index;
   std::vector<::boost::fibers::fiber> process_fd;
   std::unique_ptr<RawContext> raw_context;
   size_t records_read = 0;
+  size_t records_filtered = 0;  // Records dropped by PInput::Where.
+  uint64_t read_ns = 0;  // Time spent reading the input, excluding waits on record queues.
+
+  // Record queues of IOReadFibers of this thread.
+  std::vector<RecordQueue*> record_qs;
+
+  // The contexts of IOReadFibers whose DoFns run on the compute pool.
+  std::vector<RawContext*> compute_contexts;
+
+  unsigned active_readers = 0;
+  unsigned retire_readers = 0;  // how many readers should exit after their current file.
+  Runner::ReadStats last_read_stats;
+
+  ::boost::fibers::fiber tune_fd;
+  ::boost::fibers::mutex mu;
+  ::boost::fibers::condition_variable readers_cv;
 
   bool stop_early = false;
 
@@ -38,10 +85,12 @@ struct MapperExecutor::PerIoStruct {
 
 MapperExecutor::PerIoStruct::PerIoStruct(unsigned i) : index(i) {}
 
-thread_local std::unique_ptr<MapperExecutor::PerIoStruct> MapperExecutor::per_io_;
-
 void MapperExecutor::PerIoStruct::Shutdown() {
   VLOG(1) << "PerIoStruct::ShutdownStart";
+
+  // No readers are added after the tuning fiber exits.
+  if (tune_fd.joinable())
+    tune_fd.join();
   for (auto& f : process_fd)
     f.join();
   VLOG(1) << "PerIoStruct::ShutdownEnd";
@@ -60,9 +109,10 @@ void MapperExecutor::Stop() {
   // small race condition at the end, not important since this function called only on SIGTERM
   if (file_name_q_) {
     file_name_q_->close();
-    pool_->AwaitOnAll([&](IoContext&) {
-      if (per_io_) {  // "file_name_q_->close();"" might cause per_io be already freed.
-        per_io_->stop_early = true;
+    pool_->AwaitOnAll([&](unsigned index, IoContext&) {
+      // "file_name_q_->close();"" might cause per_io be already freed.
+      if (index < per_io_.size() && per_io_[index]) {
+        per_io_[index]->stop_early = true;
       }
       VLOG(1) << "StopEarly";
     });
@@ -75,13 +125,77 @@ void MapperExecutor::SetupPerIoThread(unsigned index, detail::TableBase* tb) {
   ptr->raw_context.reset(runner_->CreateContext());
   RegisterContext(ptr->raw_context.get());
 
-  per_io_.reset(ptr);
+  per_io_[index].reset(ptr);
 
-  CHECK_GT(FLAGS_map_io_read_factor, 0);
-  per_io_->process_fd.resize(FLAGS_map_io_read_factor);
+  CHECK_GT(FLAGS_map_io_read_min, 0);
+  CHECK_LE(FLAGS_map_io_read_min, FLAGS_map_io_read_max);
+  unsigned num_readers = std::min(std::max(FLAGS_map_io_read_factor, FLAGS_map_io_read_min),
+                                  FLAGS_map_io_read_max);
+  for (unsigned i = 0; i < num_readers; ++i) {
+    AddReader(tb);
+  }
 
-  for (auto& fbr : per_io_->process_fd) {
-    fbr = fibers::fiber{&MapperExecutor::IOReadFiber, this, tb};
+  if (FLAGS_map_io_tune_ms && FLAGS_map_io_read_min < FLAGS_map_io_read_max) {
+    ptr->last_read_stats = runner_->GetReadStats();
+    ptr->tune_fd = fibers::fiber{&MapperExecutor::TuneFiber, this, tb};
+  }
+}
+
+void MapperExecutor::AddReader(detail::TableBase* tb) {
+  ++PerIo()->active_readers;
+  PerIo()->process_fd.emplace_back(std::allocator_arg, fibers_ext::PooledStack(),
+                                   &MapperExecutor::IOReadFiber, this, tb);
+}
+
+void MapperExecutor::TuneFiber(detail::TableBase* tb) {
+  this_fiber::properties<IoFiberProperties>().set_name("TuneFiber");
+  PerIoStruct* aux_local = PerIo();
+  auto period = chrono::milliseconds(FLAGS_map_io_tune_ms);
+
+  while (true) {
+    {
+      std::unique_lock<fibers::mutex> lk(aux_local->mu);
+      bool done = aux_local->readers_cv.wait_for(lk, period, [aux_local] {
+        return aux_local->active_readers == 0 || aux_local->stop_early;
+      });
+      if (done)
+        break;
+    }
+    TuneReaders(tb);
+  }
+}
+
+void MapperExecutor::TuneReaders(detail::TableBase* tb) {
+  PerIoStruct* aux_local = PerIo();
+
+  size_t items = 0;
+  for (const RecordQueue* q : aux_local->record_qs) {
+    items += q->SizeGuess();
+  }
+  double occupancy = aux_local->record_qs.empty()
+                         ? 0
+                         : double(items) / (aux_local->record_qs.size() * kRecordQCapacity);
+
+  Runner::ReadStats stats = runner_->GetReadStats();
+  const Runner::ReadStats& last = aux_local->last_read_stats;
+  size_t disk_bytes = stats.disk_bytes - last.disk_bytes;
+  size_t cache_bytes = stats.cache_bytes - last.cache_bytes;
+  size_t preempt_cnt = stats.preempt_cnt - last.preempt_cnt;
+  aux_local->last_read_stats = stats;
+
+  // Remote files do not report their reads and are bound by the network latency.
+  bool io_bound =
+      (disk_bytes + cache_bytes == 0) || (preempt_cnt > 0 && disk_bytes >= cache_bytes);
+  unsigned readers = aux_local->active_readers - aux_local->retire_readers;
+
+  if (occupancy < kLowOccupancy && io_bound && pending_files_ > 0 &&
+      readers < FLAGS_map_io_read_max) {
+    VLOG(1) << "Adding IO reader " << readers + 1 << ", occupancy " << occupancy << ", disk/cache "
+            << disk_bytes << "/" << cache_bytes << ", preempts " << preempt_cnt;
+    AddReader(tb);
+  } else if (occupancy > kHighOccupancy && readers > FLAGS_map_io_read_min) {
+    VLOG(1) << "Retiring IO reader " << readers << ", occupancy " << occupancy;
+    ++aux_local->retire_readers;
   }
 }
 
@@ -89,40 +203,60 @@ void MapperExecutor::Run(const std::vector<const InputBase*>& inputs, detail::Ta
                          ShardFileMap* out_files) {
   const string& op_name = tb->op().op_name();
 
+  start_micros_ = GetMonotonicMicros();
+  pending_files_ = 0;
+  file_name_q_.reset(new FileNameQueue{16});
   util::VarzFunction varz_func("mapper-executor", [this] { return GetStats(); });
 
-  file_name_q_.reset(new FileNameQueue{16});
   runner_->OperatorStart(&tb->op());
 
+  // The tasks are whole batches and every MapFiber waits for its own, hence the pool queues
+  // hold at most one task per IOReadFiber.
+  if (tb->op().has_compute_threads()) {
+    compute_pool_.reset(new fibers_ext::FiberQueueThreadPool(tb->op().compute_threads()));
+    LOG(INFO) << op_name << " runs its DoFns on compute threads";
+  }
+
   // As long as we do not block in the function we can use AwaitOnAll.
+  per_io_.resize(pool_->size());
   pool_->AwaitOnAll([&](unsigned index, IoContext&) { SetupPerIoThread(index, tb); });
 
+  vector<FileInput> files;
   for (const auto& input : inputs) {
-    PushInput(input);
+    ExpandInput(input, &files);
+  }
 
-    if (file_name_q_->is_closed())
-      break;
+  size_t total_bytes = 0;
+  for (const auto& fi : files) {
+    total_bytes += fi.file_size;
   }
+  progress_->AddTasks(files.size(), total_bytes);
+  PushFiles(files);
 
   file_name_q_->close();
 
   // Use AwaitFiberOnAll because Shutdown() blocks the callback.
   pool_->AwaitFiberOnAll([&](IoContext&) {
-    per_io_->Shutdown();
-    FinalizeContext(per_io_->records_read, per_io_->raw_context.get());
-    per_io_.reset();
+    std::unique_ptr<PerIoStruct>& aux_local = per_io_[IoIndex()];
+    aux_local->Shutdown();
+    if (aux_local->records_filtered) {
+      aux_local->raw_context->IncBy("where-filtered", aux_local->records_filtered);
+    }
+    FinalizeContext(aux_local->records_read, aux_local->raw_context.get());
+    aux_local.reset();
   });
+  compute_pool_.reset();
 
   LOG_IF(WARNING, parse_errors_ > 0) << op_name << " had " << parse_errors_.load() << " errors";
   for (const auto& k_v : metric_map_) {
     LOG(INFO) << op_name << "-" << k_v.first << ": " << k_v.second;
   }
 
-  runner_->OperatorEnd(out_files);
+  EndOperator(out_files);
   file_name_q_.reset();
 }
 
-void MapperExecutor::PushInput(const InputBase* input) {
+void MapperExecutor::ExpandInput(const InputBase* input, std::vector<FileInput>* dest) {
   CHECK(input && input->msg().file_spec_size() > 0);
   CHECK(input->msg().has_format());
 
@@ -135,61 +269,203 @@ void MapperExecutor::PushInput(const InputBase* input) {
         files.push_back(FileInput{pb_input, size_t(i), sz, str});
       });
     }
+
+    if (pb_input->incremental()) {
+      FilterPinnedFiles(*pb_input, &files);
+    }
+
+    if (FLAGS_map_split_size_mb) {
+      SplitLargeFiles(size_t(FLAGS_map_split_size_mb) << 20, &files);
+    }
   });
 
   // Sort - bigger sizes first to reduce the variance of the reading phase.
-  std::sort(files.begin(), files.end(),
-            [](const auto& l, auto& r) { return l.file_size > r.file_size; });
+  // The order must be the same in all the processes running the operator.
+  std::stable_sort(files.begin(), files.end(),
+                   [](const auto& l, auto& r) { return l.file_size > r.file_size; });
 
   LOG(INFO) << "Running on input " << input->msg().name() << " with " << files.size() << " files";
-  for (const auto& fl_name : files) {
-    channel_op_status st = file_name_q_->push(fl_name);
-    if (st != channel_op_status::closed) {
-      CHECK_EQ(channel_op_status::success, st);
+  dest->insert(dest->end(), files.begin(), files.end());
+}
+
+void MapperExecutor::PushFiles(const std::vector<FileInput>& files) {
+  size_t index = 0, claimed = 0;
+
+  while (runner_->NextTask(files.size(), claimed, &index)) {
+    ++claimed;
+    ++pending_files_;
+    channel_op_status st = file_name_q_->push(files[index]);
+    if (st == channel_op_status::closed) {
+      --pending_files_;
+      break;
+    }
+    CHECK_EQ(channel_op_status::success, st);
+  }
+  VLOG(1) << "Claimed " << claimed << " out of " << files.size() << " files";
+}
+
+void MapperExecutor::FilterPinnedFiles(const pb::Input& input, std::vector<FileInput>* files) {
+  absl::flat_hash_map<string, size_t> pinned;
+  for (const auto& file : input.pinned_file()) {
+    pinned.emplace(file.name(), file.size());
+  }
+
+  size_t orig_size = files->size();
+  auto it = std::remove_if(files->begin(), files->end(), [&](const FileInput& fi) {
+    auto pit = pinned.find(fi.file_name);
+    return pit == pinned.end() || pit->second != fi.file_size;
+  });
+  files->erase(it, files->end());
+  LOG(INFO) << "Skipping " << orig_size - files->size() << " processed files of " << input.name();
+}
+
+void MapperExecutor::SplitLargeFiles(size_t split_size, std::vector<FileInput>* files) {
+  size_t orig_size = files->size();
+  for (size_t i = 0; i < orig_size; ++i) {
+    FileInput& fi = (*files)[i];
+    if (fi.file_size <= split_size ||
+        !runner_->IsSplittable(fi.file_name, fi.input->format())) {
+      continue;
     }
+
+    VLOG(1) << "Splitting " << fi.file_name << " of size " << fi.file_size;
+    for (size_t offset = split_size; offset < fi.file_size; offset += split_size) {
+      FileInput range = fi;
+      range.range_offset = offset;
+      range.range_length = std::min(split_size, fi.file_size - offset);
+      range.file_size = range.range_length;
+      files->push_back(std::move(range));
+    }
+
+    // files may have been reallocated.
+    FileInput& first = (*files)[i];
+    first.range_length = first.file_size = split_size;
   }
 }
 
 void MapperExecutor::IOReadFiber(detail::TableBase* tb) {
   this_fiber::properties<IoFiberProperties>().set_name("IOReadFiber");
 
-  PerIoStruct* aux_local = per_io_.get();
+  PerIoStruct* aux_local = PerIo();
   FileInput file_input;
   uint64_t cnt = 0;
 
-  std::unique_ptr<detail::HandlerWrapperBase> handler{
-      tb->CreateHandler(aux_local->raw_context.get())};
+  // The filter and the projection of the current input, if it has them.
+  std::unique_ptr<detail::RecordFilter> filter;
+  std::unique_ptr<detail::RecordProjection> projection;
+  const pb::Input* filter_input = nullptr;
+  std::string projected;
+
+  RawContext* raw_context = aux_local->raw_context.get();
+  std::unique_ptr<RawContext> compute_context;
+  if (compute_pool_) {
+    compute_context.reset(runner_->CreateContext());
+    RegisterContext(compute_context.get());
+    raw_context = compute_context.get();
+    aux_local->compute_contexts.push_back(raw_context);
+  }
+
+  std::unique_ptr<detail::HandlerWrapperBase> handler{tb->CreateHandler(raw_context)};
   CHECK_EQ(1, handler->Size());
 
   // contains items pushed from the IORead fiber but not yet processed by MapFiber.
-  RecordQueue record_q(256);
+  // Records are passed in batches, so that MapFiber processes a whole batch per wake-up.
+  RecordQueue record_q(kRecordQCapacity);
+  aux_local->record_qs.push_back(&record_q);
 
-  fibers::fiber map_fd(&MapperExecutor::MapFiber, &record_q, handler.get());
+  fibers::fiber map_fd(std::allocator_arg, fibers_ext::PooledStack(), &MapperExecutor::MapFiber,
+                       this, raw_context, &record_q, handler.get());
 
   VLOG(1) << "Starting MapFiber on " << tb->op().output().DebugString();
 
   while (!aux_local->stop_early) {
+    if (aux_local->retire_readers) {
+      --aux_local->retire_readers;
+      break;
+    }
+
     channel_op_status st = file_name_q_->pop(file_input);
     if (st == channel_op_status::closed)
       break;
 
     CHECK_EQ(channel_op_status::success, st);
+    --pending_files_;
+
     const pb::Input* pb_input = file_input.input;
     bool is_binary = detail::IsBinary(pb_input->format().type());
     Record::Operand op = is_binary ? Record::BINARY_FORMAT : Record::TEXT_FORMAT;
-    record_q.Push(op, 0, file_input.file_name);
-    record_q.Push(Record::METADATA, &pb_input->file_spec(file_input.spec_index));
+    Record header[2] = {Record(op, 0, file_input.file_name),
+                        Record(Record::METADATA, &pb_input->file_spec(file_input.spec_index))};
+    record_q.PushBulk(header, 2);
+
+    if (filter_input != pb_input) {
+      filter_input = pb_input;
+      filter.reset();
+      projection.reset();
+      if (pb_input->has_where() || pb_input->select_size()) {
+        const gpb::Descriptor* descr =
+            gpb::DescriptorPool::generated_pool()->FindMessageTypeByName(pb_input->where_type());
+        CHECK(descr) << "Unknown type " << pb_input->where_type();
+        if (pb_input->has_where())
+          filter.reset(new detail::RecordFilter(pb_input->where(), descr));
+        if (pb_input->select_size()) {
+          std::vector<std::string> fields(pb_input->select().begin(), pb_input->select().end());
+          projection.reset(new detail::RecordProjection(fields, descr));
+        }
+      }
+    }
 
-    auto cb = [&, skip = pb_input->skip_header(),
-               file_record_cnt = uint64_t{0}](string&& s) mutable {
-      if (file_record_cnt++ < skip)
+    // Only the first range of the file contains the header.
+    uint64_t push_ns = 0;
+    auto cb = [&, skip = uint64_t(file_input.range_offset ? 0 : pb_input->skip_header()),
+               file_record_cnt = uint64_t{0}](RawRecordBatch&& batch) mutable {
+      size_t from = 0;
+      if (file_record_cnt < skip) {
+        from = std::min<uint64_t>(skip - file_record_cnt, batch.size());
+      }
+      file_record_cnt += batch.size();
+      if (from == batch.size())
         return;
-      record_q.Push(Record::RECORD, aux_local->records_read, std::move(s));
-      ++aux_local->records_read;
+
+      if (filter || projection) {
+        RawRecordBatch passed;
+        for (size_t i = from; i < batch.size(); ++i) {
+          if (filter && !filter->Pass(batch[i]))
+            continue;
+
+          // Records that can not be projected are passed as is so that their consumers report
+          // them.
+          projected.clear();
+          if (projection && projection->Apply(batch[i], &projected))
+            passed.Add(projected);
+          else
+            passed.Add(batch[i]);
+        }
+        aux_local->records_filtered += batch.size() - from - passed.size();
+        if (passed.empty())
+          return;
+        batch = std::move(passed);
+        from = 0;
+      }
+
+      size_t pos = aux_local->records_read;
+      aux_local->records_read += batch.size() - from;
+      progress_->AddRecords(batch.size() - from);
+
+      int64_t push_start = base::GetClockNanos<CLOCK_MONOTONIC>();
+      record_q.Push(pos, from, std::move(batch));
+      push_ns += base::GetClockNanos<CLOCK_MONOTONIC>() - push_start;
     };
 
-    cnt +=
-        runner_->ProcessInputFile(file_input.file_name, pb_input->format().type(), std::move(cb));
+    // Every file may start a trace, of which the file reads are the children.
+    trace::ScopedSpan span("mr.read_file", trace::NewTrace());
+    size_t length = file_input.range_length ? file_input.range_length : kuint64max;
+    int64_t read_start = base::GetClockNanos<CLOCK_MONOTONIC>();
+    cnt += runner_->ProcessInputBatches(file_input.file_name, pb_input->format(),
+                                        file_input.range_offset, length, std::move(cb));
+    aux_local->read_ns += base::GetClockNanos<CLOCK_MONOTONIC>() - read_start - push_ns;
+    progress_->AddBytes(file_input.file_size);
+    progress_->TaskDone();
   }
   VLOG(1) << "IOReadFiber closing after processing " << cnt << " items";
 
@@ -198,26 +474,36 @@ void MapperExecutor::IOReadFiber(detail::TableBase* tb) {
   record_q.StartClosing();
 
   map_fd.join();
-  handler->OnShardFinish();
+  if (compute_pool_) {
+    compute_pool_->Await([&] { handler->OnShardFinish(); });
+  } else {
+    handler->OnShardFinish();
+  }
+
+  auto& qs = aux_local->record_qs;
+  qs.erase(std::find(qs.begin(), qs.end(), &record_q));
+
+  if (compute_context) {
+    auto& contexts = aux_local->compute_contexts;
+    contexts.erase(std::find(contexts.begin(), contexts.end(), raw_context));
+    FinalizeContext(0, raw_context);
+  }
+
+  --aux_local->active_readers;
+  aux_local->readers_cv.notify_all();
 
   VLOG(1) << "IOReadFiber after OnShardFinish";
 }
 
-void MapperExecutor::MapFiber(RecordQueue* record_q, detail::HandlerWrapperBase* handler_wrapper) {
+void MapperExecutor::MapFiber(RawContext* raw_context, RecordQueue* record_q,
+                              detail::HandlerWrapperBase* handler_wrapper) {
   this_fiber::properties<IoFiberProperties>().set_name("MapFiber");
-  PerIoStruct* aux_local = per_io_.get();
-  RawContext* raw_context = aux_local->raw_context.get();
   CHECK(raw_context);
 
-  Record record;
   uint64_t record_num = 0;
-  auto cb = handler_wrapper->Get(0);
-  while (true) {
-    bool is_open = record_q->Pop(record);
-    if (!is_open)
-      break;
-
-    if (record.op != Record::RECORD) {
+  auto cb = handler_wrapper->GetView(0);
+  auto process = [&](const Record& record) {
+    if (record.op != Record::BATCH) {
       switch (record.op) {
         case Record::BINARY_FORMAT:
           SetFileName(true, absl::get<pair<size_t, string>>(record.payload).second, raw_context);
@@ -229,28 +515,47 @@ void MapperExecutor::MapFiber(RecordQueue* record_q, detail::HandlerWrapperBase*
           SetMetaData(*absl::get<const pb::Input::FileSpec*>(record.payload), raw_context);
           break;
 
-        case Record::RECORD:;
+        case Record::BATCH:;
       }
 
-      continue;
+      return;
     }
 
-    ++record_num;
-
-    // TODO: to pass it as argument to Runner::ProcessInputFile.
-    if (FLAGS_map_limit && record_num > FLAGS_map_limit) {
-      continue;
-    }
+    const RecordBatch& rb = absl::get<RecordBatch>(record.payload);
+    for (size_t i = rb.from; i < rb.records.size(); ++i) {
+      // TODO: to pass it as argument to Runner::ProcessInputFile.
+      if (FLAGS_map_limit && record_num >= FLAGS_map_limit) {
+        break;
+      }
 
-    VLOG_IF(1, record_num % 1000 == 0) << "Num maps " << record_num;
+      ++record_num;
+      VLOG_IF(1, record_num % 1000 == 0) << "Num maps " << record_num;
 
-    auto& pp = absl::get<pair<size_t, string>>(record.payload);
-    SetPosition(pp.first, raw_context);
+      SetPosition(rb.pos + i - rb.from, raw_context);
+      cb(rb.records[i]);
 
-    cb(std::move(pp.second));
+      if (record_num % 1000 == 0) {
+        this_fiber::yield();
+      }
+    }
+  };
+
+  // Popping several records at once wakes the reader fiber once per batch.
+  constexpr size_t kPopBatch = 8;
+  Record records[kPopBatch];
+  while (size_t count = record_q->PopBulk(records, kPopBatch)) {
+    auto process_all = [&] {
+      for (size_t j = 0; j < count; ++j) {
+        process(records[j]);
+        records[j] = Record();  // releases the batch.
+      }
+    };
 
-    if (++record_num % 1000 == 0) {
-      this_fiber::yield();
+    // The fiber waits for the compute thread, so that the IO thread keeps reading meanwhile.
+    if (compute_pool_) {
+      compute_pool_->Await(process_all);
+    } else {
+      process_all();
     }
   }
   VLOG(1) << "MapFiber finished " << record_num;
@@ -258,17 +563,61 @@ void MapperExecutor::MapFiber(RecordQueue* record_q, detail::HandlerWrapperBase*
 
 util::VarzValue::Map MapperExecutor::GetStats() const {
   util::VarzValue::Map res;
-  atomic<size_t> parse_errors{0}, record_read{0};
+  atomic<size_t> parse_errors{0}, record_read{0}, record_written{0}, record_q_items{0};
+  atomic<size_t> io_readers{0}, record_filtered{0};
+  atomic<uint64_t> read_ns{0};
 
-  pool_->AwaitOnAll([&](IoContext& io) {
-    PerIoStruct* aux_local = per_io_.get();
+  std::vector<OperatorProfile> profiles(pool_->size());
+
+  pool_->AwaitOnAll([&](unsigned index, IoContext& io) {
+    PerIoStruct* aux_local = index < per_io_.size() ? per_io_[index].get() : nullptr;
+    if (!aux_local)
+      return;
     record_read.fetch_add(aux_local->records_read, memory_order_relaxed);
+    record_filtered.fetch_add(aux_local->records_filtered, memory_order_relaxed);
+    read_ns.fetch_add(aux_local->read_ns, memory_order_relaxed);
+    io_readers.fetch_add(aux_local->active_readers, memory_order_relaxed);
+    for (const RecordQueue* q : aux_local->record_qs) {
+      record_q_items.fetch_add(q->SizeGuess(), memory_order_relaxed);
+    }
+
     if (aux_local->raw_context) {
-      parse_errors.fetch_add(aux_local->raw_context->parse_errors(), memory_order_relaxed);
+      const RawContext& ctx = *aux_local->raw_context;
+      parse_errors.fetch_add(ctx.parse_errors(), memory_order_relaxed);
+      record_written.fetch_add(ctx.item_writes(), memory_order_relaxed);
+      profiles[index] = ctx.profile();
+    }
+
+    // Updated by the compute threads meanwhile, hence the values are approximate.
+    for (const RawContext* ctx : aux_local->compute_contexts) {
+      parse_errors.fetch_add(ctx->parse_errors(), memory_order_relaxed);
+      record_written.fetch_add(ctx->item_writes(), memory_order_relaxed);
+      profiles[index].Merge(ctx->profile());
     }
   });
+
+  OperatorProfile profile;
+  for (const auto& p : profiles) {
+    profile.Merge(p);
+  }
+
+  double elapsed_sec = std::max<int64>(1, GetMonotonicMicros() - start_micros_) * 1e-6;
+  auto to_ms = [](uint64_t ns) { return util::VarzValue::FromInt(ns / 1000000); };
+
   res.emplace_back("parse_errors", util::VarzValue::FromInt(parse_errors.load()));
   res.emplace_back("records_read", util::VarzValue::FromInt(record_read.load()));
+  res.emplace_back("records_filtered", util::VarzValue::FromInt(record_filtered.load()));
+  res.emplace_back("records_written", util::VarzValue::FromInt(record_written.load()));
+  res.emplace_back("read_rps", util::VarzValue::FromDouble(record_read.load() / elapsed_sec));
+  res.emplace_back("write_rps", util::VarzValue::FromDouble(record_written.load() / elapsed_sec));
+  res.emplace_back("read_ms", to_ms(read_ns.load()));
+  res.emplace_back("parse_ms", to_ms(profile.parse_ns));
+  res.emplace_back("do_fn_ms", to_ms(profile.do_fn_ns));
+  res.emplace_back("write_ms", to_ms(profile.write_ns));
+  res.emplace_back("write_bytes", util::VarzValue::FromInt(profile.write_bytes));
+  res.emplace_back("file_queue_items", util::VarzValue::FromInt(pending_files_.load()));
+  res.emplace_back("record_queue_items", util::VarzValue::FromInt(record_q_items.load()));
+  res.emplace_back("io_read_fibers", util::VarzValue::FromInt(io_readers.load()));
   return res;
 }
 
@@ -4,12 +4,19 @@
 #pragma once
 
 #include <boost/fiber/buffered_channel.hpp>
+#include <atomic>
 #include <functional>
 
 #include "mr/operator_executor.h"
 #include "util/fibers/simple_channel.h"
 #include "util/stats/varz_value.h"
 
+namespace util {
+namespace fibers_ext {
+class FiberQueueThreadPool;
+}  // namespace fibers_ext
+}  // namespace util
+
 namespace mr3 {
 
 class MapperExecutor : public OperatorExecutor {
@@ -18,14 +25,25 @@ class MapperExecutor : public OperatorExecutor {
     size_t spec_index;
     size_t file_size;
     ::std::string file_name;
+
+    // Byte range of the file to process. length == 0 means the whole file.
+    size_t range_offset = 0;
+    size_t range_length = 0;
   };
   using FileNameQueue = ::boost::fibers::buffered_channel<FileInput>;
 
+  struct RecordBatch {
+    size_t pos;  // position of the first processed record.
+    size_t from;  // records before this index are skipped.
+    RawRecordBatch records;
+  };
+
   struct Record {
-    enum Operand { BINARY_FORMAT, TEXT_FORMAT, METADATA, RECORD} op;
+    enum Operand { BINARY_FORMAT, TEXT_FORMAT, METADATA, BATCH} op;
 
-    // either file spec or <pos,record> pair.
-    absl::variant<const pb::Input::FileSpec*, ::std::pair<size_t, ::std::string>> payload;
+    // either file spec, <pos,file name> pair or a batch of records.
+    absl::variant<const pb::Input::FileSpec*, ::std::pair<size_t, ::std::string>, RecordBatch>
+        payload;
 
     Record() = default;
 
@@ -34,6 +52,9 @@ class MapperExecutor : public OperatorExecutor {
 
     Record(Operand op2, const pb::Input::FileSpec* fspec)
       : op(op2), payload(fspec) {}
+
+    Record(size_t pos, size_t from, RawRecordBatch&& batch)
+      : op(BATCH), payload(RecordBatch{pos, from, ::std::move(batch)}) {}
   };
 
   using RecordQueue = util::fibers_ext::SimpleChannel<Record>;
@@ -53,21 +74,52 @@ class MapperExecutor : public OperatorExecutor {
  private:
   void InitInternal() final;
 
-  void PushInput(const InputBase*);
+  // Appends the files of the input to files, bigger files first.
+  void ExpandInput(const InputBase* input, std::vector<FileInput>* files);
+
+  // Pushes the files claimed by this process into file_name_q_.
+  void PushFiles(const std::vector<FileInput>& files);
+
+  // Replaces splittable files larger than split_size with ranges of split_size bytes.
+  void SplitLargeFiles(size_t split_size, std::vector<FileInput>* files);
+
+  // Keeps only the pinned files of the incremental input.
+  static void FilterPinnedFiles(const pb::Input& input, std::vector<FileInput>* files);
 
   // Input managing fiber that reads files from disk and pumps data into record_q.
-  // One per IO thread.
+  // There are several of them per IO thread, see TuneFiber.
+  // With a compute pool, each of them has its own context, since their DoFns run concurrently.
   void IOReadFiber(detail::TableBase* tb);
 
+  void AddReader(detail::TableBase* tb);
+
+  // Adjusts periodically the number of IOReadFibers of the IO thread. Adds readers when
+  // the mappers starve and the reads wait for the IO, retires readers when the record
+  // queues are mostly full.
+  void TuneFiber(detail::TableBase* tb);
+  void TuneReaders(detail::TableBase* tb);
+
   // index - io thread index.
   void SetupPerIoThread(unsigned index, detail::TableBase* tb);
 
-  static void MapFiber(RecordQueue* record_q, detail::HandlerWrapperBase* hwb);
+  // Runs the DoFns of the records of record_q, on compute_pool_ if it's set.
+  void MapFiber(RawContext* raw_context, RecordQueue* record_q,
+                detail::HandlerWrapperBase* hwb);
   util::VarzValue::Map GetStats() const;
 
   std::unique_ptr<FileNameQueue> file_name_q_;
 
-  static thread_local std::unique_ptr<PerIoStruct> per_io_;
+  // Set if the operator runs its DoFns on compute threads, see pb::Operator::compute_threads.
+  std::unique_ptr<util::fibers_ext::FiberQueueThreadPool> compute_pool_;
+  std::atomic<size_t> pending_files_{0};  // number of items in file_name_q_.
+  uint64_t start_micros_ = 0;
+
+  // The state of the operator in the calling IO thread.
+  PerIoStruct* PerIo() { return per_io_[IoIndex()].get(); }
+
+  // Indexed by IO thread. Kept by the executor rather than thread_local, so that executors of
+  // pipelines that run concurrently on the same pool do not share it.
+  std::vector<std::unique_ptr<PerIoStruct>> per_io_;
 };
 
 }  // namespace mr3
@@ -15,6 +15,11 @@ using namespace boost;
 using namespace std;
 
 namespace mr3 {
+
+DEFINE_uint32(map_json_pool_kb, 64,
+              "The size of the memory block that is reused by JSON documents passed to handlers "
+              "by const reference");
+
 namespace rj = rapidjson;
 
 namespace detail {
@@ -62,12 +67,33 @@ pb::Operator TableBase::GetDependeeOp() const {
   return res;
 }
 
+std::vector<std::string> TableBase::SourceInputs() const {
+  if (!is_identity_)
+    ValidateGroupInputOrDie(this);
+
+  pb::Operator op = GetDependeeOp();
+  return std::vector<std::string>(op.input_name().begin(), op.input_name().end());
+}
+
 HandlerWrapperBase* TableBase::CreateHandler(RawContext* context) {
   CHECK(defined()) << op_.DebugString();
 
   return handler_factory_(context);
 }
 
+void TableBase::FuseWithSource() {
+  CHECK(fuse_source_ && fused_factory_) << op_.op_name();
+  const pb::Operator& src_op = fuse_source_->op_;
+  VLOG(1) << "Fusing " << src_op.op_name() << " into " << op_.op_name();
+
+  op_.mutable_input_name()->CopyFrom(src_op.input_name());
+  if (src_op.has_compute_threads() && !op_.has_compute_threads()) {
+    op_.set_compute_threads(src_op.compute_threads());
+  }
+  handler_factory_ = std::move(fused_factory_);
+  fuse_source_->is_fused_ = true;
+}
+
 void TableBase::CheckFailIdentity() const { CHECK(defined() && is_identity_); }
 
 void TableBase::ValidateGroupInputOrDie(const TableBase* other) {
@@ -96,10 +122,20 @@ struct ShardVisitor {
 
 }  // namespace
 
-RawContext::RawContext() { metric_map_.set_empty_key(StringPiece{}); }
+RawContext::RawContext() {}
 
 RawContext::~RawContext() {}
 
+void RawContext::WriteSortedInternal(const ShardId& shard_id, std::string&& key,
+                                     std::string&& record) {
+  LOG(FATAL) << "Sorted outputs are not supported by this runner";
+}
+
+base::MemoryAccount* detail::FreqMapAccount::account() {
+  static base::MemoryAccount* res = base::MemoryAccount::Get("mr.freq_maps");
+  return res;
+}
+
 FrequencyMap<uint32_t>& RawContext::GetFreqMapStatistic(const std::string& map_id) {
   auto res = freq_maps_.emplace(map_id, nullptr);
   if (res.second) {
@@ -129,16 +165,29 @@ void OutputBase::SetCompress(pb::Output::CompressType ct, unsigned level) {
   }
 }
 
+pb::Output::Compress* OutputBase::ZstdCompress() {
+  CHECK(out_->has_compress() && out_->compress().type() == pb::Output::ZSTD)
+      << "zstd options require ZSTD outputs";
+  return out_->mutable_compress();
+}
+
 void OutputBase::SetShardSpec(pb::ShardSpec::Type st, unsigned modn) {
   CHECK(!out_->has_shard_spec()) << "Must be defined only once. \n" << out_->ShortDebugString();
 
   out_->mutable_shard_spec()->set_type(st);
-  if (st == pb::ShardSpec::MODN) {
+  if (st == pb::ShardSpec::MODN || st == pb::ShardSpec::SKEWED_MODN) {
     CHECK_GT(modn, 0);
     out_->mutable_shard_spec()->set_modn(modn);
   }
 }
 
+void OutputBase::SetSkewSpec(const std::string& freq_map_id, unsigned max_splits) {
+  CHECK_GT(max_splits, 0);
+  auto* spec = out_->mutable_shard_spec();
+  spec->set_freq_map_id(freq_map_id);
+  spec->set_max_splits(max_splits);
+}
+
 void OutputBase::FailUndefinedShard() const {
   LOG(FATAL) << "Sharding function for output " << out_->ShortDebugString() << " is not defined.\n"
              << "Did you forget to call .With<Some>Sharding()?";
@@ -154,15 +203,41 @@ std::string RecordTraits<rj::Document>::Serialize(bool is_binary, const rj::Docu
 
 bool RecordTraits<rj::Document>::Parse(bool is_binary, std::string&& tmp, rj::Document* res) {
   tmp_ = std::move(tmp);
+  return ParseInsitu(res);
+}
 
+bool RecordTraits<rj::Document>::Parse(bool is_binary, absl::string_view rv, rj::Document* res) {
+  tmp_.assign(rv.data(), rv.size());
+  return ParseInsitu(res);
+}
+
+bool RecordTraits<rj::Document>::ParseInsitu(rj::Document* res) {
   constexpr unsigned kFlags = rj::kParseTrailingCommasFlag | rj::kParseCommentsFlag;
-  res->ParseInsitu<kFlags>(&tmp_.front());
+  res->ParseInsitu<kFlags>(&tmp_[0]);
 
   bool has_error = res->HasParseError();
   LOG_IF(INFO, has_error) << rj::GetParseError_En(res->GetParseError()) << " for string " << tmp_;
   return !has_error;
 }
 
+namespace detail {
+
+// Chunks allocated beyond the initial block are freed by Reset, the initial block is reused.
+JsonPool::JsonPool() {
+  size_t block_size = size_t(FLAGS_map_json_pool_kb) << 10;
+  initial_block_.reset(new char[block_size]);
+  alloc_.reset(new rj::MemoryPoolAllocator<>(initial_block_.get(), block_size, block_size));
+}
+
+JsonPool::~JsonPool() {}
+
+void JsonPool::Reset() {
+  alloc_->Clear();
+  records_ = 0;
+}
+
+}  // namespace detail
+
 }  // namespace mr3
 
 ostream& operator<<(ostream& os, const mr3::ShardId& sid) {
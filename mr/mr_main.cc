@@ -8,6 +8,7 @@
 
 #include "file/file_util.h"
 
+#include "mr/distributed_runner.h"
 #include "mr/local_runner.h"
 #include "util/asio/accept_server.h"
 #include "util/asio/io_context_pool.h"
@@ -15,32 +16,80 @@
 namespace mr3 {
 
 DEFINE_int32(http_port, 8080, "Port number.");
+DEFINE_uint32(mr_num_workers, 1, "Number of worker processes running the pipeline");
+DEFINE_uint32(mr_worker_index, 0, "Index of this worker, the worker 0 hosts the coordinator");
+DEFINE_string(mr_coordinator, "localhost:9070", "host:port of the coordinator");
 
 using namespace util;
+namespace h2 = boost::beast::http;
 
 PipelineMain::PipelineMain(int* argc, char*** argv)
-    : guard_(new MainInitGuard{argc, argv}), pool_(new IoContextPool) {
+    : guard_(new MainInitGuard{argc, argv}), pool_(new IoContextPool),
+      startup_varz_("startup-timeline", [] {
+        VarzValue::Map map;
+        for (const auto& k_v : base::StartupTimeline::Phases()) {
+          map.emplace_back(k_v.first + "-usec", VarzValue::FromInt(k_v.second));
+        }
+        return map;
+      }) {
   pool_->Run();
+  base::StartupTimeline::Mark("io_pool");
+
   pipeline_.reset(new Pipeline(pool_.get()));
 
+  // Shows the progress of the running pipeline, as JSON with format=json.
+  auto progress_cb = [this](const http::QueryArgs& args, http::HttpHandler::SendFunction* send) {
+    bool json = false;
+    for (const auto& k_v : args) {
+      if (k_v.first == "format" && k_v.second == "json")
+        json = true;
+    }
+
+    http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+    const PipelineProgress& progress = pipeline_->progress();
+    resp.body() = json ? progress.ToJson() : progress.ToHtml();
+    http::SetMime(json ? http::kJsonMime : http::kHtmlMime, &resp);
+    return send->Invoke(std::move(resp));
+  };
+  http_listener_.RegisterCb("/pipelinez", false, progress_cb);
+
+  http_starter_ = std::thread([this] { StartHttpServer(); });
+  base::StartupTimeline::Mark("pipeline");
+}
+
+PipelineMain::~PipelineMain() {
+  WaitHttpServer();
+  acc_server_->Stop(true);
+  pool_->Stop();
+}
+
+void PipelineMain::StartHttpServer() {
   acc_server_.reset(new AcceptServer(pool_.get()));
   if (FLAGS_http_port >= 0) {
     uint16_t port = acc_server_->AddListener(FLAGS_http_port, &http_listener_);
     LOG(INFO) << "Started http server on port " << port;
   }
   acc_server_->Run();
+  base::StartupTimeline::Mark("http_server");
 }
 
-PipelineMain::~PipelineMain() {
-  acc_server_->Stop(true);
-  pool_->Stop();
+void PipelineMain::WaitHttpServer() {
+  if (http_starter_.joinable()) {
+    http_starter_.join();
+    LOG(INFO) << "Startup timeline: " << base::StartupTimeline::ToString();
+  }
+}
+
+AcceptServer* PipelineMain::accept_server() {
+  WaitHttpServer();
+  return acc_server_.get();
 }
 
 LocalRunner* PipelineMain::StartLocalRunner(const std::string& root_dir, bool stop_on_break) {
   CHECK(!runner_);
   runner_.reset(new LocalRunner(pool_.get(), file_util::ExpandPath(root_dir)));
   if (stop_on_break) {
-    acc_server_->TriggerOnBreakSignal([this] {
+    accept_server()->TriggerOnBreakSignal([this] {
       pipeline_->Stop();
       runner_->Stop();
     });
@@ -48,4 +97,22 @@ LocalRunner* PipelineMain::StartLocalRunner(const std::string& root_dir, bool st
   return runner_.get();
 }
 
+DistributedRunner* PipelineMain::StartDistributedRunner(const std::string& root_dir,
+                                                        bool stop_on_break) {
+  CHECK(!runner_ && !dist_runner_);
+  DistributedRunner::Options opts;
+  opts.num_workers = FLAGS_mr_num_workers;
+  opts.worker_index = FLAGS_mr_worker_index;
+  opts.coordinator = FLAGS_mr_coordinator;
+
+  dist_runner_.reset(new DistributedRunner(pool_.get(), file_util::ExpandPath(root_dir), opts));
+  if (stop_on_break) {
+    accept_server()->TriggerOnBreakSignal([this] {
+      pipeline_->Stop();
+      dist_runner_->Stop();
+    });
+  }
+  return dist_runner_.get();
+}
+
 }  // namespace mr3
@@ -3,8 +3,11 @@
 //
 #pragma once
 
+#include <thread>
+
 #include "mr/pipeline.h"
 #include "util/http/http_conn_handler.h"
+#include "util/stats/varz_stats.h"
 
 class MainInitGuard;
 
@@ -14,6 +17,7 @@ class AcceptServer;
 
 namespace mr3 {
 
+class DistributedRunner;
 class LocalRunner;
 
 class PipelineMain {
@@ -23,17 +27,29 @@ public:
 
   util::IoContextPool* pool() { return pool_.get(); }
   Pipeline* pipeline() { return pipeline_.get(); }
-  util::AcceptServer* accept_server() { return acc_server_.get(); }
+  util::AcceptServer* accept_server();
 
   LocalRunner* StartLocalRunner(const std::string& root_dir, bool stop_on_break = true);
 
+  // Configured by --mr_num_workers, --mr_worker_index and --mr_coordinator flags.
+  DistributedRunner* StartDistributedRunner(const std::string& root_dir,
+                                            bool stop_on_break = true);
+
 private:
+  // The status server starts in the background, off the startup path of the pipeline.
+  // The methods that use the server wait for it. Not thread-safe.
+  void StartHttpServer();
+  void WaitHttpServer();
+
   std::unique_ptr<MainInitGuard> guard_;
   std::unique_ptr<util::IoContextPool> pool_;
   std::unique_ptr<Pipeline> pipeline_;
   std::unique_ptr<util::AcceptServer> acc_server_;
   util::http::Listener<> http_listener_;
   std::unique_ptr<LocalRunner> runner_;
+  std::unique_ptr<DistributedRunner> dist_runner_;
+  std::thread http_starter_;
+  util::VarzFunction startup_varz_;
 };
 
 }  // namespace mr3
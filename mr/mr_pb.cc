@@ -7,6 +7,13 @@
 
 namespace mr3 {
 
+DEFINE_bool(map_pb_arena, true,
+            "If true, protobuf records passed to handlers by const reference are parsed on "
+            "an arena that is reused across the records");
+DEFINE_uint32(map_pb_arena_block_kb, 64, "The size of the arena block that is kept across resets");
+DEFINE_bool(map_validate_utf8, true,
+            "If true, json records that are not valid UTF-8 are reported as parse errors");
+
 std::string PB_Serializer::To(bool is_binary, const Message* msg) {
   if (is_binary)
     return msg->SerializeAsString();
@@ -18,10 +25,45 @@ bool PB_Serializer::From(bool is_binary, std::string tmp, Message* res) {
     return res->ParseFromString(tmp);
   }
 
-  util::Status status = util::Json2Pb(std::move(tmp), res);
+  util::Json2PbOptions opts;
+  opts.validate_utf8 = FLAGS_map_validate_utf8;
+  util::Status status = util::Json2Pb(std::move(tmp), res, opts);
   DVLOG(1) << "Status: " << status;
 
   return status.ok();
 }
 
+bool PB_Serializer::From(bool is_binary, absl::string_view rv, Message* res) {
+  if (is_binary) {
+    return res->ParseFromArray(rv.data(), rv.size());
+  }
+
+  return From(false, std::string(rv), res);
+}
+
+namespace detail {
+
+PB_Arena::PB_Arena() {
+  if (!FLAGS_map_pb_arena)
+    return;
+
+  // The initial block is not freed by Reset, therefore the arena does not allocate
+  // as long as the records of kResetRecords fit into it.
+  google::protobuf::ArenaOptions opts;
+  opts.initial_block_size = size_t(FLAGS_map_pb_arena_block_kb) << 10;
+  initial_block_.reset(new char[opts.initial_block_size]);
+  opts.initial_block = initial_block_.get();
+  opts.start_block_size = opts.initial_block_size;
+  arena_.reset(new google::protobuf::Arena(opts));
+}
+
+PB_Arena::~PB_Arena() {}
+
+void PB_Arena::Reset() {
+  arena_->Reset();
+  records_ = 0;
+}
+
+}  // namespace detail
+
 }  // namespace mr3
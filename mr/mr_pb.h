@@ -4,9 +4,11 @@
 
 #pragma once
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/message.h>
 
 #include "mr/do_context.h"
+#include "mr/impl/table_impl.h"
 
 namespace mr3 {
 
@@ -17,6 +19,9 @@ struct PB_Serializer {
 
   // Need std::string on stack because of json2pb which requires mutable string for insitu parsing.
   static bool From(bool is_binary, std::string tmp, Message* res);
+
+  // Binary records are parsed directly from the view.
+  static bool From(bool is_binary, absl::string_view rv, Message* res);
 };
 
 template <typename PB>
@@ -31,9 +36,74 @@ class RecordTraits<PB, std::enable_if_t<std::is_base_of<google::protobuf::Messag
     return PB_Serializer::From(is_binary, std::move(tmp), res);
   }
 
+  static bool Parse(bool is_binary, absl::string_view rv, PB* res) {
+    return PB_Serializer::From(is_binary, rv, res);
+  }
+
   static std::string TypeName() {
     PB msg;
     return msg.GetTypeName();
   }
 };
+
+namespace detail {
+
+//! Arena that is reset every few records, see --map_pb_arena.
+class PB_Arena {
+ public:
+  PB_Arena();
+  ~PB_Arena();
+
+  // nullptr if the arena is disabled.
+  google::protobuf::Arena* arena() { return arena_.get(); }
+
+  // Called after each record.
+  void Done() {
+    if (arena_ && ++records_ >= kResetRecords) {
+      Reset();
+    }
+  }
+
+ private:
+  static constexpr unsigned kResetRecords = 128;
+
+  void Reset();
+
+  std::unique_ptr<char[]> initial_block_;
+  std::unique_ptr<google::protobuf::Arena> arena_;
+  unsigned records_ = 0;
+};
+
+//! Parses protobuf messages of handlers that take them by const reference on an arena,
+//! which removes the allocations of their sub-messages, strings and repeated fields.
+template <typename PB>
+class RecordAllocator<PB, std::enable_if_t<std::is_base_of<google::protobuf::Message, PB>::value>> {
+ public:
+  PB* New() {
+    if (pb_arena_.arena())
+      return Create(pb_arena_.arena(), google::protobuf::Arena::is_arena_constructable<PB>{});
+    val_.emplace();
+    return &*val_;
+  }
+
+  void Done() {
+    pb_arena_.Done();
+    val_.reset();
+  }
+
+ private:
+  // Sub-messages are allocated on the arena only if the proto file enables arenas.
+  static PB* Create(google::protobuf::Arena* arena, std::true_type) {
+    return google::protobuf::Arena::CreateMessage<PB>(arena);
+  }
+
+  static PB* Create(google::protobuf::Arena* arena, std::false_type) {
+    return google::protobuf::Arena::Create<PB>(arena);
+  }
+
+  PB_Arena pb_arena_;
+  absl::optional<PB> val_;
+};
+
+}  // namespace detail
 }  // namespace mr3
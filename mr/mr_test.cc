@@ -6,8 +6,13 @@
 #include <rapidjson/error/en.h>
 #include <rapidjson/writer.h>
 
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_split.h"
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "mr/delimited_traits.h"
+#include "mr/impl/memory_budget.h"
+#include "mr/impl/shard_gate.h"
 #include "mr/mr_pb.h"
 #include "mr/pipeline.h"
 #include "mr/test_utils.h"
@@ -18,8 +23,18 @@
 
 using namespace std;
 
+DECLARE_uint32(join_sort_buffer_mb);
+DECLARE_string(join_spill_dir);
+DECLARE_uint32(join_memory_budget_mb);
+DECLARE_bool(pipeline_fuse_maps);
+DECLARE_bool(pipeline_resume);
+DECLARE_bool(pipeline_overlap_stages);
+
 namespace mr3 {
 
+DECLARE_uint32(map_io_read_factor);
+DECLARE_uint32(map_io_tune_ms);
+
 using namespace util;
 using namespace boost;
 using other::StrVal;
@@ -72,6 +87,16 @@ template <> class RecordTraits<IntVal> {
   }
 };
 
+struct MovieVal {
+  int64_t id;
+  absl::string_view title;
+  absl::optional<double> rating;
+};
+
+template <> class RecordTraits<MovieVal>
+    : public DelimitedTraits<MovieVal, ',', &MovieVal::id, nullptr, &MovieVal::title,
+                             &MovieVal::rating> {};
+
 class MrTest : public testing::Test {
  protected:
   void SetUp() final {
@@ -121,6 +146,49 @@ TEST_F(MrTest, Basic) {
   EXPECT_THAT(runner_.Table("new_table"), ElementsAre(MatchShard("shard1", elements)));
 }
 
+TEST_F(MrTest, Progress) {
+  StringTable str1 = pipeline_->ReadText("read_bar", "bar.txt");
+  str1.Write("new_table", pb::WireFormat::TXT)
+      .WithCustomSharding([](const std::string& rec) { return "shard1"; });
+
+  runner_.AddInputRecords("bar.txt", {"1", "2", "3", "4"});
+  pipeline_->Run(&runner_);
+
+  rj::Document doc;
+  string json = pipeline_->progress().ToJson();
+  ASSERT_FALSE(doc.Parse(json.c_str()).HasParseError()) << json;
+
+  const auto& ops = doc["operators"];
+  ASSERT_EQ(1u, ops.Size());
+  EXPECT_STREQ("read_bar", ops[0]["name"].GetString());
+  EXPECT_STREQ("DONE", ops[0]["state"].GetString());
+  EXPECT_EQ(1u, ops[0]["tasks_total"].GetUint64());
+  EXPECT_EQ(1u, ops[0]["tasks_done"].GetUint64());
+  EXPECT_EQ(4u, ops[0]["records"].GetUint64());
+  EXPECT_FALSE(ops[0].HasMember("eta_sec"));
+  EXPECT_GE(ops[0]["cpu_sec"].GetDouble(), 0);
+  EXPECT_GT(ops[0]["peak_rss_bytes"].GetUint64(), 0u);
+
+  EXPECT_THAT(pipeline_->progress().ToHtml(), testing::HasSubstr("read_bar"));
+}
+
+TEST_F(MrTest, SkipHeader) {
+  StringTable str1 = pipeline_->ReadText("read_bar", "bar.txt").set_skip_header(2);
+  str1.Write("new_table", pb::WireFormat::TXT)
+      .WithCustomSharding([](const std::string& rec) { return "shard1"; });
+
+  vector<string> elements;
+  for (unsigned i = 0; i < 1000; ++i) {
+    elements.push_back(absl::StrCat(i));
+  }
+
+  runner_.AddInputRecords("bar.txt", elements);
+  pipeline_->Run(&runner_);
+
+  elements.erase(elements.begin(), elements.begin() + 2);
+  EXPECT_THAT(runner_.Table("new_table"), ElementsAre(MatchShard("shard1", elements)));
+}
+
 TEST_F(MrTest, Json) {
   PTable<rapidjson::Document> json_table = pipeline_->ReadText("read_bar", "bar.txt").AsJson();
   auto json_shard_func = [](const rapidjson::Document& doc) {
@@ -144,6 +212,29 @@ TEST_F(MrTest, Json) {
       UnorderedElementsAre(MatchShard("shard0", {kJson3, kJson1}), MatchShard("shard1", {kJson2})));
 }
 
+class JsonMapper {
+ public:
+  void Do(const rapidjson::Document& doc, DoContext<string>* cntx) {
+    cntx->Write(doc.HasMember("foo") ? "foo" : "other");
+  }
+};
+
+TEST_F(MrTest, JsonConstRef) {
+  vector<string> elements;
+  for (unsigned i = 0; i < 300; ++i) {
+    elements.push_back(i % 3 ? absl::StrCat(R"({"id":)", i, "}") : R"({"foo":"bar"})");
+  }
+  runner_.AddInputRecords("bar.txt", elements);
+
+  PTable<string> res = pipeline_->ReadText("read_bar", "bar.txt").AsJson().Map<JsonMapper>("map");
+  res.Write("res", pb::WireFormat::TXT).WithCustomSharding([](const string& s) { return s; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_THAT(runner_.Table("res"),
+              UnorderedElementsAre(MatchShard("foo", vector<string>(100, "foo")),
+                                   MatchShard("other", vector<string>(200, "other"))));
+}
+
 TEST_F(MrTest, InvalidJson) {
   char str[] = R"({"roman":"��i���u�.nW��'$��uٿ�����d�ݹ��5�"} )";
 
@@ -167,6 +258,44 @@ TEST_F(MrTest, ParseError) {
   EXPECT_EQ(4, runner_.parse_errors);
 }
 
+TEST_F(MrTest, DelimitedRecords) {
+  runner_.AddInputRecords("bar.txt", {"id,year,title,rating", "1,1999,Matrix,8.7",
+                                      R"(2,2001,"Monsters, Inc.",)", R"(3,1984,"The ""Thing""",8)",
+                                      "x,2000,Bad,1", "4,2000"});
+  PTable<MovieVal> movies =
+      pipeline_->ReadText("read_bar", "bar.txt").set_skip_header(1).As<MovieVal>();
+  movies.Write("table", pb::WireFormat::TXT).WithCustomSharding([](const MovieVal& m) {
+    return m.rating ? "rated" : "unrated";
+  });
+  pipeline_->Run(&runner_);
+
+  EXPECT_EQ(2, runner_.parse_errors);
+  EXPECT_THAT(runner_.Table("table"),
+              UnorderedElementsAre(MatchShard("rated", {"1,,Matrix,8.7", R"(3,,"The ""Thing""",8)"}),
+                                   MatchShard("unrated", {R"(2,,"Monsters, Inc.",)"})));
+}
+
+TEST_F(MrTest, HashSharding) {
+  vector<string> elements{"a", "b", "c", "d", "e", "f"};
+  runner_.AddInputRecords("bar.txt", elements);
+
+  StringTable str1 = pipeline_->ReadText("read_bar", "bar.txt");
+  str1.Write("table", pb::WireFormat::TXT).WithHashSharding(3, [](const string& s) {
+    return s;
+  });
+  pipeline_->Run(&runner_);
+
+  std::map<unsigned, vector<string>> expected;
+  for (const auto& e : elements) {
+    expected[detail::ShardHash(e) % 3].push_back(e);
+  }
+  std::vector<decltype(MatchShard(0u, {}))> matchers;
+  for (const auto& k_v : expected) {
+    matchers.push_back(MatchShard(k_v.first, k_v.second));
+  }
+  EXPECT_THAT(runner_.Table("table"), UnorderedElementsAreArray(matchers));
+}
+
 TEST_F(MrTest, Map) {
   pb::Input::FileSpec fspec;
   fspec.set_url_glob("bar.txt");
@@ -239,6 +368,352 @@ TEST_F(MrTest, MapAB) {
   EXPECT_THAT(*int_map, UnorderedElementsAre(Pair(1, 1), Pair(2, 1), Pair(3, 1), Pair(4, 1)));
 }
 
+class SketchMapper {
+ public:
+  void Do(IntVal iv, mr3::DoContext<IntVal>* cntx) {
+    cntx->raw()->GetSketch<HyperLogLog>("distinct").Add(uint64_t(iv.val));
+    cntx->raw()->GetSketch<QuantileSketch>("values", 50).Add(iv.val);
+    cntx->Write(iv);
+  }
+};
+
+class SketchReader {
+ public:
+  void Do(IntVal iv, mr3::DoContext<IntVal>* cntx) {
+    const QuantileSketch* values = cntx->raw()->FindMaterializedSketch<QuantileSketch>("values");
+    CHECK(values);
+    if (iv.val >= values->Quantile(0.5))
+      cntx->Write(iv);
+  }
+};
+
+TEST_F(MrTest, Sketches) {
+  vector<string> elements;
+  for (unsigned i = 1; i <= 100; ++i) {
+    elements.push_back(absl::StrCat(i));
+    elements.push_back(absl::StrCat(i));
+  }
+
+  runner_.AddInputRecords("bar.txt", elements);
+  PTable<IntVal> itable = pipeline_->ReadText("read_bar", "bar.txt").As<IntVal>();
+  PTable<IntVal> sketched = itable.Map<SketchMapper>("Sketch");
+  sketched.Write("sketched", pb::WireFormat::TXT).WithModNSharding(1, [](const IntVal&) {
+    return 0;
+  });
+
+  PTable<IntVal> upper = sketched.Map<SketchReader>("Upper");
+  upper.Write("upper", pb::WireFormat::TXT).WithModNSharding(1, [](const IntVal&) { return 0; });
+  pipeline_->Run(&runner_);
+
+  const HyperLogLog* distinct = pipeline_->GetSketch<HyperLogLog>("distinct");
+  ASSERT_TRUE(distinct);
+  EXPECT_NEAR(100, distinct->Estimate(), 3);
+
+  const QuantileSketch* values = pipeline_->GetSketch<QuantileSketch>("values");
+  ASSERT_TRUE(values);
+  EXPECT_EQ(200, values->count());
+  EXPECT_NEAR(50, values->Quantile(0.5), 5);
+  EXPECT_FALSE(pipeline_->GetSketch<HyperLogLog>("missing"));
+
+  EXPECT_NEAR(100, runner_.Table("upper").begin()->second.size(), 10);
+}
+
+TEST_F(MrTest, RunConcurrently) {
+  vector<string> elements;
+  for (unsigned i = 0; i < 1000; ++i) {
+    elements.push_back(absl::StrCat(i));
+  }
+
+  // Both mappers run on the single IO thread of the pool.
+  Pipeline other(pool_.get());
+  TestRunner other_runner;
+  runner_.AddInputRecords("bar.txt", elements);
+  other_runner.AddInputRecords("foo.txt", {"a", "b"});
+
+  auto shard_fn = [](const string& s) { return 0; };
+  pipeline_->ReadText("read_bar", "bar.txt")
+      .Write("bar_out", pb::WireFormat::TXT)
+      .WithModNSharding(1, shard_fn);
+  other.ReadText("read_foo", "foo.txt")
+      .Write("foo_out", pb::WireFormat::TXT)
+      .WithModNSharding(1, shard_fn);
+  Pipeline::RunConcurrently({{pipeline_.get(), &runner_}, {&other, &other_runner}});
+
+  EXPECT_THAT(runner_.Table("bar_out"), ElementsAre(MatchShard(0, elements)));
+  EXPECT_THAT(other_runner.Table("foo_out"), ElementsAre(MatchShard(0, {"a", "b"})));
+}
+
+TEST_F(MrTest, TopK) {
+  vector<string> elements;
+  for (unsigned i = 1; i <= 100; ++i) {
+    elements.push_back(absl::StrCat(i));
+  }
+  runner_.AddInputRecords("bar.txt", elements);
+
+  PTable<IntVal> itable = pipeline_->ReadText("read_bar", "bar.txt").As<IntVal>();
+  auto val_fn = [](const IntVal& iv) { return iv.val; };
+  auto parity_fn = [](const IntVal& iv) { return absl::StrCat(iv.val % 2); };
+  auto mod3_fn = [](const IntVal& iv) { return absl::StrCat(iv.val % 3); };
+
+  itable.TopK("top", 3, val_fn).Write("topw", pb::WireFormat::TXT);
+  itable.TopKPerKey("bottom", 2, parity_fn, [](const IntVal& iv) { return -iv.val; }, 3)
+      .Write("bottomw", pb::WireFormat::TXT);
+  itable.Sample("sample", 10).Write("samplew", pb::WireFormat::TXT);
+  itable.Sample("sample_all", 200).Write("sample_allw", pb::WireFormat::TXT);
+  itable.Sample("sample_even", 10, [](const IntVal& iv) { return 1 - iv.val % 2; })
+      .Write("sample_evenw", pb::WireFormat::TXT);
+  itable.SamplePerKey("sample_mod3", 5, mod3_fn).Write("sample_mod3w", pb::WireFormat::TXT);
+  pipeline_->Run(&runner_);
+
+  auto records = [this](const string& name) {
+    vector<string> res;
+    for (const auto& k_v : runner_.Table(name)) {
+      res.insert(res.end(), k_v.second.begin(), k_v.second.end());
+    }
+    return res;
+  };
+
+  EXPECT_THAT(runner_.Table("topw"), ElementsAre(Pair(ShardId{0}, ElementsAre("100", "99", "98"))));
+  EXPECT_THAT(records("bottomw"), UnorderedElementsAre("1", "3", "2", "4"));
+  EXPECT_THAT(records("sample_allw"), UnorderedElementsAreArray(elements));
+
+  vector<string> sample = records("samplew");
+  EXPECT_EQ(10, sample.size());
+  EXPECT_EQ(10, absl::flat_hash_set<string>(sample.begin(), sample.end()).size());
+
+  sample = records("sample_evenw");
+  EXPECT_EQ(10, sample.size());
+  for (const string& s : sample) {
+    EXPECT_EQ(0, stoi(s) % 2) << s;
+  }
+
+  unsigned per_key[3] = {0};
+  for (const string& s : records("sample_mod3w")) {
+    ++per_key[stoi(s) % 3];
+  }
+  EXPECT_THAT(per_key, ElementsAre(5, 5, 5));
+}
+
+TEST_F(MrTest, Distinct) {
+  vector<string> elements, expected;
+  for (unsigned i = 0; i < 300; ++i) {
+    elements.push_back(absl::StrCat(i % 100));
+  }
+  for (unsigned i = 0; i < 100; ++i) {
+    expected.push_back(absl::StrCat(i));
+  }
+  runner_.AddInputRecords("bar.txt", elements);
+
+  StringTable itable = pipeline_->ReadText("read_bar", "bar.txt");
+  auto key_fn = [](const string& s) { return s; };
+  itable.Distinct("distinct", key_fn, 4).Write("distinctw", pb::WireFormat::TXT);
+  itable.Distinct("distinct_shared", key_fn, 4, true).Write("sharedw", pb::WireFormat::TXT);
+  pipeline_->Run(&runner_);
+
+  for (const char* name : {"distinctw", "sharedw"}) {
+    vector<string> res;
+    for (const auto& k_v : runner_.Table(name)) {
+      res.insert(res.end(), k_v.second.begin(), k_v.second.end());
+    }
+    EXPECT_THAT(res, UnorderedElementsAreArray(expected)) << name;
+  }
+
+  // The mapper has dropped the duplicates before the shuffle.
+  size_t partial = 0;
+  for (const auto& k_v : runner_.Table("distinct_partial")) {
+    partial += k_v.second.size();
+  }
+  EXPECT_EQ(100, partial);
+
+  detail::DedupBloomFilter filter(1000);
+  unsigned false_positives = 0;
+  for (uint64_t i = 0; i < 500; ++i) {
+    false_positives += filter.TestAndAdd(base::Hash64(&i, sizeof(i)));
+  }
+  EXPECT_LT(false_positives, 25);
+  for (uint64_t i = 0; i < 500; ++i) {
+    EXPECT_TRUE(filter.TestAndAdd(base::Hash64(&i, sizeof(i))));
+  }
+}
+
+class BroadcastMapper {
+ public:
+  void Do(IntVal iv, mr3::DoContext<std::string>* cntx) {
+    const std::string* name = cntx->Broadcast<std::string>("names").Find(absl::StrCat(iv.val));
+    cntx->Write(absl::StrCat(iv.val, ":", name ? *name : "none"));
+  }
+};
+
+TEST_F(MrTest, BroadcastJoin) {
+  runner_.AddInputRecords("names.txt", {"1 one", "2 two", "2 deux", "3 three"});
+  runner_.AddInputRecords("bar.txt", {"1", "2", "4", "1"});
+
+  StringTable names = pipeline_->ReadText("read_names", "names.txt");
+  pipeline_->Broadcast("names", names, [](const std::string& line) {
+    return line.substr(0, line.find(' '));
+  });
+
+  PTable<IntVal> itable = pipeline_->ReadText("read_bar", "bar.txt").As<IntVal>();
+  PTable<std::string> joined = itable.Map<BroadcastMapper>("Enrich");
+  joined.Write("joined", pb::WireFormat::TXT).WithModNSharding(1, [](const std::string&) {
+    return 0;
+  });
+  pipeline_->Run(&runner_);
+
+  // The first record of a key wins.
+  EXPECT_THAT(runner_.Table("joined"),
+              ElementsAre(MatchShard(0, {"1:1 one", "2:2 two", "4:none", "1:1 one"})));
+}
+
+TEST_F(MrTest, FuseMaps) {
+  vector<string> elements{"1", "2", "3", "4"};
+
+  runner_.AddInputRecords("bar.txt", elements);
+  PTable<IntVal> itable = pipeline_->ReadText("read_bar", "bar.txt").As<IntVal>();
+
+  MetaCheck meta_check;
+  PTable<StrVal> atable = itable.Map<StrValMapper>("Map1", &meta_check);
+  atable.Write("table", pb::WireFormat::TXT).WithModNSharding(10, [](const StrVal&) { return 11; });
+
+  PTable<IntVal> final_table = atable.Map<IntMapper>("IntMap");
+  final_table.Write("final_table", pb::WireFormat::TXT).WithModNSharding(7, [](const IntVal&) {
+    return 10;
+  });
+
+  FLAGS_pipeline_fuse_maps = true;
+  pipeline_->Run(&runner_);
+  FLAGS_pipeline_fuse_maps = false;
+
+  // Only the records of final_table are written.
+  EXPECT_EQ(4, runner_.write_calls);
+  EXPECT_THAT(meta_check.input_files, UnorderedElementsAre("bar.txt"));
+  EXPECT_THAT(runner_.Table("final_table"), ElementsAre(MatchShard(3, elements)));
+
+  auto* int_map = pipeline_->GetFreqMap("int_map");
+  ASSERT_TRUE(int_map);
+  EXPECT_EQ(4, int_map->size());
+}
+
+// Gives the readers time to fill the record queues.
+class SlowMapper {
+ public:
+  void Do(string val, DoContext<string>* cntx) {
+    this_fiber::sleep_for(chrono::microseconds(100));
+    cntx->Write(val + "a");
+  }
+};
+
+TEST_F(MrTest, TuneReaders) {
+  std::vector<pb::Input::FileSpec> specs;
+  vector<string> expected;
+  for (unsigned i = 0; i < 100; ++i) {
+    string name = absl::StrCat("file", i, ".txt");
+    vector<string> elements;
+    for (unsigned j = 0; j < 10; ++j) {
+      elements.push_back(absl::StrCat(i * 10 + j));
+      expected.push_back(elements.back() + "a");
+    }
+    runner_.AddInputRecords(name, elements);
+    specs.emplace_back();
+    specs.back().set_url_glob(name);
+  }
+
+  StringTable str1 = pipeline_->ReadText("read", specs);
+  PTable<string> str2 = str1.Map<SlowMapper>("Map1");
+  str2.Write("table", pb::WireFormat::TXT).WithModNSharding(10, [](const string&) { return 1; });
+
+  // Readers are added and retired while the files are processed.
+  FLAGS_map_io_read_factor = 4;
+  FLAGS_map_io_tune_ms = 1;
+  pipeline_->Run(&runner_);
+  FLAGS_map_io_read_factor = 2;
+  FLAGS_map_io_tune_ms = 500;
+
+  EXPECT_THAT(runner_.Table("table"), ElementsAre(MatchShard(1, expected)));
+}
+
+// Counts the DoFn calls that run on the IO threads.
+class ComputeMapper {
+  IoContextPool* pool_;
+  std::atomic<unsigned>* io_calls_;
+
+ public:
+  ComputeMapper(IoContextPool* pool, std::atomic<unsigned>* io_calls)
+      : pool_(pool), io_calls_(io_calls) {}
+
+  void Do(string val, DoContext<string>* cntx) {
+    if (pool_->GetThisContext())
+      ++*io_calls_;
+    cntx->Write(val + "a");
+  }
+};
+
+TEST_F(MrTest, ComputePool) {
+  std::vector<pb::Input::FileSpec> specs;
+  vector<string> expected;
+  for (unsigned i = 0; i < 20; ++i) {
+    string name = absl::StrCat("file", i, ".txt");
+    vector<string> elements;
+    for (unsigned j = 0; j < 100; ++j) {
+      elements.push_back(absl::StrCat(i * 100 + j));
+      expected.push_back(elements.back() + "a");
+    }
+    runner_.AddInputRecords(name, elements);
+    specs.emplace_back();
+    specs.back().set_url_glob(name);
+  }
+
+  std::atomic<unsigned> io_calls{0};
+  PTable<string> res = pipeline_->ReadText("read", specs)
+                           .Map<ComputeMapper>("compute", pool_.get(), &io_calls)
+                           .WithComputePool(2);
+  res.Write("res", pb::WireFormat::TXT).WithModNSharding(1, [](const string&) { return 0; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_EQ(0, io_calls);
+  EXPECT_THAT(runner_.Table("res"), ElementsAre(MatchShard(0, expected)));
+}
+
+TEST_F(MrTest, Resume) {
+  vector<string> elements{"1", "2", "3", "4"};
+  runner_.AddInputRecords("bar.txt", elements);
+
+  auto run = [&](MetaCheck* meta_check) {
+    pipeline_.reset(new Pipeline(pool_.get()));
+    PTable<StrVal> atable =
+        pipeline_->ReadText("read_bar", "bar.txt").As<IntVal>().Map<StrValMapper>("Map1",
+                                                                                  meta_check);
+    atable.Write("table", pb::WireFormat::TXT).WithModNSharding(10, [](const StrVal&) {
+      return 11;
+    });
+
+    // Produces a frequency map, hence is never skipped.
+    PTable<IntVal> final_table = atable.Map<IntMapper>("IntMap");
+    final_table.Write("final_table", pb::WireFormat::TXT).WithModNSharding(7, [](const IntVal&) {
+      return 10;
+    });
+    pipeline_->Run(&runner_);
+  };
+
+  FLAGS_pipeline_resume = true;
+  MetaCheck first, second, third;
+  run(&first);
+  EXPECT_EQ(8, runner_.write_calls);
+
+  // Map1 is resumed from its checkpoint and IntMap reads its outputs.
+  run(&second);
+  EXPECT_TRUE(second.input_files.empty());
+  EXPECT_EQ(12, runner_.write_calls);
+
+  // The input has changed.
+  runner_.AddInputRecords("bar.txt", {"5"});
+  run(&third);
+  FLAGS_pipeline_resume = false;
+
+  EXPECT_THAT(third.input_files, UnorderedElementsAre("bar.txt"));
+  EXPECT_EQ(22, runner_.write_calls);
+}
+
 class StrJoiner {
   absl::flat_hash_map<int, int> counts_;
 
@@ -282,6 +757,370 @@ TEST_F(MrTest, Join) {
                                    MatchShard(2, {"2:11"})));
 }
 
+// read2 is closed while join_tables runs, read1 before that.
+TEST_F(MrTest, OverlapStages) {
+  runner_.AddInputRecords("stream1.txt", {"1", "2", "3", "4"});
+  runner_.AddInputRecords("stream2.txt", {"2", "3"});
+
+  PTable<IntVal> itable1 = pipeline_->ReadText("read1", "stream1.txt").As<IntVal>();
+  PTable<IntVal> itable2 = pipeline_->ReadText("read2", "stream2.txt").As<IntVal>();
+  itable1.Write("ss1", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+    return iv.val;
+  });
+  itable2.Write("ss2", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+    return iv.val;
+  });
+
+  PTable<string> res = pipeline_->Join(
+      "join_tables", {itable1.BindWith(&StrJoiner::On1), itable2.BindWith(&StrJoiner::On2)});
+  res.Write("joinw", pb::WireFormat::TXT);
+
+  FLAGS_pipeline_overlap_stages = true;
+  pipeline_->Run(&runner_);
+  FLAGS_pipeline_overlap_stages = false;
+
+  EXPECT_THAT(runner_.Table("joinw"),
+              UnorderedElementsAre(MatchShard(0, {"3:11"}), MatchShard(1, {"1:1", "4:1"}),
+                                   MatchShard(2, {"2:11"})));
+}
+
+TEST_F(MrTest, ShardGate) {
+  detail::ShardGate gate;
+  gate.Add("a");
+  gate.Add("b");
+  gate.Add("c");
+  gate.Close("a");
+
+  EXPECT_THAT(gate.Subscribe(), UnorderedElementsAre("b", "c"));
+  string glob;
+  EXPECT_FALSE(gate.Next(false, &glob));
+
+  fibers::fiber closer([&] {
+    gate.Close("c");
+    gate.CloseAll();
+  });
+  ASSERT_TRUE(gate.Next(true, &glob));
+  EXPECT_EQ("c", glob);
+  ASSERT_TRUE(gate.Next(true, &glob));
+  EXPECT_EQ("b", glob);
+  EXPECT_FALSE(gate.Next(true, &glob));
+  gate.Wait();
+  closer.join();
+}
+
+class CountMerger {
+  absl::flat_hash_map<int, int> counts_;
+
+ public:
+  void OnDelta(IntVal&& iv, DoContext<string>* out) { counts_[iv.val]++; }
+
+  void OnPrev(string&& total, DoContext<string>* out) {
+    std::pair<string, string> kv = absl::StrSplit(total, ':');
+    int key, count;
+    CHECK(safe_strto32(kv.first, &key) && safe_strto32(kv.second, &count)) << total;
+    counts_[key] += count;
+  }
+
+  void OnShardFinish(DoContext<string>* cntx) {
+    for (const auto& k_v : counts_) {
+      cntx->Write(absl::StrCat(k_v.first, ":", k_v.second));
+    }
+    counts_.clear();
+  }
+};
+
+TEST_F(MrTest, Incremental) {
+  runner_.AddInputRecords("day1.txt", {"1", "2", "3"});
+  runner_.AddInputRecords("day2.txt", {"2", "3", "4"});
+
+  auto run = [&](const vector<string>& files) {
+    pipeline_.reset(new Pipeline(pool_.get()));
+    PTable<IntVal> delta = pipeline_->ReadText("logs", files).set_incremental().As<IntVal>();
+    delta.Write("delta", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+      return iv.val;
+    });
+
+    PTable<string> totals = pipeline_->MergeIncremental(
+        "merge_totals", delta.BindWith(&CountMerger::OnDelta), &CountMerger::OnPrev);
+    totals.Write("totals", pb::WireFormat::TXT).WithModNSharding(3, [](const string& s) {
+      return stoi(s);
+    });
+    pipeline_->Run(&runner_);
+  };
+
+  run({"day1.txt"});
+  EXPECT_THAT(runner_.Table("totals"),
+              UnorderedElementsAre(MatchShard(0, {"3:1"}), MatchShard(1, {"1:1"}),
+                                   MatchShard(2, {"2:1"})));
+
+  // day1.txt is not processed again, its counts come from the previous totals.
+  run({"day1.txt", "day2.txt"});
+  EXPECT_THAT(runner_.Table("totals"),
+              UnorderedElementsAre(MatchShard(0, {"3:2"}), MatchShard(1, {"1:1", "4:1"}),
+                                   MatchShard(2, {"2:2"})));
+}
+
+// Reports 1MB of state per key.
+class StateJoiner {
+  absl::flat_hash_map<int, int> counts_;
+
+ public:
+  void On1(IntVal&& iv, DoContext<string>* out) {
+    counts_[iv.val]++;
+    out->ReportStateBytes(counts_.size() << 20);
+  }
+
+  void On2(IntVal&& iv, DoContext<string>* out) { counts_[iv.val] += 10; }
+
+  void OnShardFinish(DoContext<string>* cntx) {
+    for (const auto& k_v : counts_) {
+      cntx->Write(absl::StrCat(k_v.first, ":", k_v.second));
+    }
+    counts_.clear();
+  }
+};
+
+TEST_F(MrTest, MemoryBudget) {
+  detail::MemoryBudget budget(100);
+  budget.Acquire(60);
+  budget.Acquire(40);
+
+  bool admitted = false;
+  fibers::fiber waiter([&] {
+    budget.Acquire(30);
+    admitted = true;
+  });
+  this_fiber::yield();
+  EXPECT_FALSE(admitted);
+  budget.Release(40);
+  waiter.join();
+  EXPECT_TRUE(admitted);
+  EXPECT_EQ(90, budget.used());
+  EXPECT_FALSE(budget.TryAcquire(20));
+  EXPECT_TRUE(budget.TryAcquire(10));
+  budget.Release(10);
+
+  // Larger than the budget, hence admitted once nothing else holds it.
+  budget.Release(90);
+  budget.Acquire(500);
+  EXPECT_EQ(500, budget.used());
+  budget.Grow(10);
+  budget.Release(510);
+  EXPECT_EQ(0, budget.used());
+
+  vector<string> stream1{"1", "2", "3", "4", "7"}, stream2{"2", "3"};
+  runner_.AddInputRecords("stream1.txt", stream1);
+  runner_.AddInputRecords("stream2.txt", stream2);
+
+  PTable<IntVal> itable1 = pipeline_->ReadText("read1", "stream1.txt").As<IntVal>();
+  PTable<IntVal> itable2 = pipeline_->ReadText("read2", "stream2.txt").As<IntVal>();
+  auto shard_fn = [](const IntVal& iv) { return iv.val; };
+  itable1.Write("ss1", pb::WireFormat::TXT).WithModNSharding(3, shard_fn);
+  itable2.Write("ss2", pb::WireFormat::TXT).WithModNSharding(3, shard_fn);
+
+  PTable<string> res = pipeline_->Join(
+      "join_tables", {itable1.BindWith(&StateJoiner::On1), JoinInput(itable2, &StateJoiner::On2)});
+  res.Write("joinw", pb::WireFormat::TXT);
+
+  // The reported state does not fit, so the shards are joined one at a time.
+  FLAGS_join_memory_budget_mb = 1;
+  pipeline_->Run(&runner_);
+  FLAGS_join_memory_budget_mb = 0;
+
+  EXPECT_THAT(runner_.Table("joinw"),
+              UnorderedElementsAre(MatchShard(0, {"3:11"}), MatchShard(1, {"1:1", "4:1", "7:1"}),
+                                   MatchShard(2, {"2:11"})));
+}
+
+// Relies on the records being grouped by key, hence does not keep per-key state.
+class SortedJoiner {
+  int count_ = 0;
+  string last_key_;
+
+ public:
+  void On1(IntVal&& iv, DoContext<string>* out) { count_ += 1; }
+
+  void On2(IntVal&& iv, DoContext<string>* out) {
+    EXPECT_GT(count_ % 10, 0);  // The records of the first input come first.
+    count_ += 10;
+  }
+
+  void OnKeyFinish(absl::string_view key, DoContext<string>* cntx) {
+    EXPECT_LT(last_key_, key);
+    last_key_ = string(key);
+
+    cntx->Write(absl::StrCat(key, ":", count_));
+    count_ = 0;
+  }
+
+  void OnShardFinish(DoContext<string>* cntx) { last_key_.clear(); }
+};
+
+TEST_F(MrTest, SortMergeJoin) {
+  vector<string> stream1, stream2;
+  for (unsigned i = 0; i < 300; ++i) {
+    stream1.push_back(absl::StrCat(i % 50));
+    if (i % 3 == 0)
+      stream2.push_back(absl::StrCat(i % 50));
+  }
+
+  runner_.AddInputRecords("stream1.txt", stream1);
+  runner_.AddInputRecords("stream2.txt", stream2);
+
+  PTable<IntVal> itable1 = pipeline_->ReadText("read1", "stream1.txt").As<IntVal>();
+  PTable<IntVal> itable2 = pipeline_->ReadText("read2", "stream2.txt").As<IntVal>();
+  itable1.Write("ss1", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+    return iv.val;
+  });
+  itable2.Write("ss2", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+    return iv.val;
+  });
+
+  auto key_fn = [](const IntVal& iv) { return absl::StrCat(iv.val); };
+  PTable<string> res = pipeline_->Join(
+      "join_tables", {itable1.BindWith(&SortedJoiner::On1, key_fn),
+                      JoinInput(itable2, &SortedJoiner::On2, key_fn)});
+  res.Write("joinw", pb::WireFormat::TXT);
+
+  // Spill every record in order to check the merge of the runs.
+  FLAGS_join_sort_buffer_mb = 0;
+  pipeline_->Run(&runner_);
+  FLAGS_join_sort_buffer_mb = 256;
+
+  vector<string> expected[3];
+  for (unsigned i = 0; i < 50; ++i) {
+    expected[i % 3].push_back(absl::StrCat(i, ":26"));
+  }
+  EXPECT_THAT(runner_.Table("joinw"),
+              UnorderedElementsAre(MatchShard(0, expected[0]), MatchShard(1, expected[1]),
+                                   MatchShard(2, expected[2])));
+}
+
+TEST_F(MrTest, PresortedJoin) {
+  vector<string> stream1, stream2;
+  for (unsigned i = 0; i < 300; ++i) {
+    stream1.push_back(absl::StrCat(i % 50));
+    if (i % 3 == 0)
+      stream2.push_back(absl::StrCat(i % 50));
+  }
+
+  runner_.AddInputRecords("stream1.txt", stream1);
+  runner_.AddInputRecords("stream2.txt", stream2);
+
+  auto key_fn = [](const IntVal& iv) { return absl::StrCat(iv.val); };
+  auto shard_fn = [](const IntVal& iv) { return iv.val; };
+
+  PTable<IntVal> itable1 = pipeline_->ReadText("read1", "stream1.txt").As<IntVal>();
+  PTable<IntVal> itable2 = pipeline_->ReadText("read2", "stream2.txt").As<IntVal>();
+  itable1.Write("ss1", pb::WireFormat::TXT).WithModNSharding(3, shard_fn).AndSort(key_fn);
+  itable2.Write("ss2", pb::WireFormat::TXT).WithModNSharding(3, shard_fn).AndSort(key_fn);
+
+  PTable<string> res = pipeline_->Join(
+      "join_tables", {itable1.BindWith(&SortedJoiner::On1, key_fn),
+                      JoinInput(itable2, &SortedJoiner::On2, key_fn)});
+  res.Write("joinw", pb::WireFormat::TXT);
+
+  // The sorted inputs are merged without spilling.
+  FLAGS_join_sort_buffer_mb = 0;
+  FLAGS_join_spill_dir = "/nonexistent";
+  pipeline_->Run(&runner_);
+  FLAGS_join_sort_buffer_mb = 256;
+  FLAGS_join_spill_dir = "/tmp";
+
+  for (const auto& k_v : runner_.Table("ss1")) {
+    EXPECT_TRUE(std::is_sorted(k_v.second.begin(), k_v.second.end()));
+  }
+
+  vector<string> expected[3];
+  for (unsigned i = 0; i < 50; ++i) {
+    expected[i % 3].push_back(absl::StrCat(i, ":26"));
+  }
+  EXPECT_THAT(runner_.Table("joinw"),
+              UnorderedElementsAre(MatchShard(0, expected[0]), MatchShard(1, expected[1]),
+                                   MatchShard(2, expected[2])));
+}
+
+class CountKeysMapper {
+ public:
+  void Do(IntVal iv, DoContext<IntVal>* cntx) {
+    ++cntx->raw()->GetFreqMapStatistic("keys")[iv.val];
+    cntx->Write(iv);
+  }
+};
+
+class IntIdentityMapper {
+ public:
+  void Do(IntVal iv, DoContext<IntVal>* cntx) { cntx->Write(iv); }
+};
+
+class SkewJoiner {
+  absl::flat_hash_map<int, int> counts_;
+  absl::flat_hash_set<int> dims_;
+
+ public:
+  void OnFact(IntVal&& iv, DoContext<string>* out) { counts_[iv.val]++; }
+  void OnDim(IntVal&& iv, DoContext<string>* out) { dims_.insert(iv.val); }
+
+  void OnShardFinish(DoContext<string>* cntx) {
+    for (const auto& k_v : counts_) {
+      cntx->Write(absl::StrCat(k_v.first, ":", k_v.second, ":", dims_.count(k_v.first)));
+    }
+    counts_.clear();
+    dims_.clear();
+  }
+};
+
+TEST_F(MrTest, SkewedJoin) {
+  vector<string> facts, dims;
+  for (unsigned i = 0; i < 300; ++i) {
+    facts.push_back(i % 4 ? "7" : absl::StrCat(i % 30));
+  }
+  for (unsigned i = 0; i < 30; ++i) {
+    dims.push_back(absl::StrCat(i));
+  }
+  runner_.AddInputRecords("facts.txt", facts);
+  runner_.AddInputRecords("dims.txt", dims);
+
+  PTable<IntVal> counted =
+      pipeline_->ReadText("read1", "facts.txt").As<IntVal>().Map<CountKeysMapper>("count");
+  counted.Write("counted", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+    return iv.val;
+  });
+
+  PTable<IntVal> salted = counted.Map<IntIdentityMapper>("salt");
+  salted.Write("salted", pb::WireFormat::TXT)
+      .WithSkewedModNSharding(3, "keys", 4, [](const IntVal& iv) { return iv.val; });
+
+  PTable<IntVal> dim_table = pipeline_->ReadText("read2", "dims.txt").As<IntVal>();
+  dim_table.Write("dims", pb::WireFormat::TXT).WithModNSharding(3, [](const IntVal& iv) {
+    return iv.val;
+  });
+
+  PTable<string> res = pipeline_->Join(
+      "join", {salted.BindWith(&SkewJoiner::OnFact), dim_table.BindWith(&SkewJoiner::OnDim)});
+  res.Write("joinw", pb::WireFormat::TXT);
+  pipeline_->Run(&runner_);
+
+  // Key 7 holds 225 of 300 records, i.e. more than twice the average shard of 100 records.
+  EXPECT_EQ(5, runner_.Table("salted").size());
+
+  // Sub-shards are un-salted into shard 1 and each one of them sees the dimension of key 7.
+  const ShardedOutput& joined = runner_.Table("joinw");
+  ASSERT_EQ(3, joined.size());
+  int hot_parts = 0, hot_count = 0;
+  for (const string& rec : joined.at(ShardId{1})) {
+    vector<string> parts = absl::StrSplit(rec, ':');
+    ASSERT_EQ(3, parts.size());
+    EXPECT_EQ("1", parts[2]) << rec;
+    if (parts[0] == "7") {
+      ++hot_parts;
+      hot_count += std::stoi(parts[1]);
+    }
+  }
+  EXPECT_EQ(3, hot_parts);
+  EXPECT_EQ(225, hot_count);
+}
+
 class GroupByInt {
   absl::flat_hash_map<int, int> counts_;
 
@@ -317,6 +1156,62 @@ TEST_F(MrTest, JoinAndReshard) {
               UnorderedElementsAre(MatchShard(0, {"2"}), MatchShard(1, {"5", "1", "1"})));
 }
 
+struct WordCount {
+  string word;
+  int count = 0;
+};
+
+template <> class RecordTraits<WordCount> {
+ public:
+  static std::string Serialize(bool is_binary, const WordCount& wc) {
+    return absl::StrCat(wc.word, ":", wc.count);
+  }
+
+  bool Parse(bool is_binary, std::string&& tmp, WordCount* res) { return false; }
+};
+
+class WordCountMapper {
+ public:
+  void Do(string str, DoContext<WordCount>* out) {
+    WordCount wc;
+    wc.word = std::move(str);
+    wc.count = 1;
+    out->Write(std::move(wc));
+  }
+};
+
+TEST_F(MrTest, Combine) {
+  vector<string> stream{"a", "b", "a", "c", "a", "b"};
+  runner_.AddInputRecords("stream1.txt", stream);
+
+  PTable<WordCount> wc = pipeline_->ReadText("read1", "stream1.txt").Map<WordCountMapper>("wc");
+  wc.Write("w1", pb::WireFormat::TXT)
+      .WithModNSharding(2, [](const WordCount& wc) { return wc.word == "b" ? 1 : 0; })
+      .AndCombine([](const WordCount& wc) { return wc.word; },
+                  [](WordCount* dest, WordCount&& src) { dest->count += src.count; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_THAT(runner_.Table("w1"),
+              UnorderedElementsAre(MatchShard(0, {"a:3", "c:1"}), MatchShard(1, {"b:2"})));
+  EXPECT_EQ(3, runner_.write_calls);
+}
+
+TEST_F(MrTest, CombineLimit) {
+  vector<string> stream{"a", "b", "a", "b"};
+  runner_.AddInputRecords("stream1.txt", stream);
+
+  PTable<WordCount> wc = pipeline_->ReadText("read1", "stream1.txt").Map<WordCountMapper>("wc");
+  wc.Write("w1", pb::WireFormat::TXT)
+      .WithModNSharding(1, [](const WordCount& wc) { return 0; })
+      .AndCombine([](const WordCount& wc) { return wc.word; },
+                  [](WordCount* dest, WordCount&& src) { dest->count += src.count; }, 1);
+  pipeline_->Run(&runner_);
+
+  // With max_keys=1 the combiner flushes whenever the second distinct key arrives.
+  EXPECT_THAT(runner_.Table("w1"),
+              UnorderedElementsAre(MatchShard(0, {"a:1", "b:1", "a:1", "b:1"})));
+}
+
 class AddressMapper {
  public:
   void Do(string str, DoContext<tutorial::Address>* out) {
@@ -362,6 +1257,190 @@ TEST_F(MrTest, PbLst) {
   EXPECT_THAT(runner_.Table("w1"), UnorderedElementsAre(MatchShard("shard", expected)));
 }
 
+class PersonMapper {
+  unsigned* on_arena_;
+
+ public:
+  PersonMapper(unsigned* on_arena) : on_arena_(on_arena) {}
+
+  void Do(const tutorial::Person& person, DoContext<string>* out) {
+    *on_arena_ += (person.GetArena() != nullptr);
+    out->Write(absl::StrCat(person.name(), ":", person.phone_size()));
+  }
+};
+
+TEST_F(MrTest, PbArena) {
+  vector<string> records, expected;
+  for (unsigned i = 0; i < 300; ++i) {
+    tutorial::Person person;
+    person.set_name(absl::StrCat("person", i));
+    person.set_id(i);
+    person.set_dval(i);
+    for (unsigned j = 0; j < i % 4; ++j) {
+      person.add_phone()->set_number(absl::StrCat(j));
+    }
+    records.push_back(person.SerializeAsString());
+    expected.push_back(absl::StrCat(person.name(), ":", i % 4));
+  }
+  records.push_back("\xff\xff");  // bad record.
+
+  runner_.AddInputRecords("persons.lst", records);
+  unsigned on_arena = 0;
+  PTable<string> names = pipeline_->ReadLst("read", "persons.lst")
+                             .As<tutorial::Person>()
+                             .Map<PersonMapper>("names", &on_arena);
+  names.Write("names", pb::WireFormat::TXT).WithModNSharding(1, [](const string&) { return 0; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_EQ(1, runner_.parse_errors);
+  EXPECT_EQ(300, on_arena);
+  EXPECT_THAT(runner_.Table("names"), ElementsAre(MatchShard(0, expected)));
+}
+
+struct PodVal {
+  int64_t id;
+  double score;
+
+  string ToString() const { return string(reinterpret_cast<const char*>(this), sizeof(PodVal)); }
+};
+
+// Takes the records by const reference, hence views them in place when they are aligned.
+class PodMapper {
+ public:
+  void Do(const PodVal& val, DoContext<PodVal>* cntx) {
+    cntx->Write(PodVal{val.id, val.score * 2});
+  }
+};
+
+TEST_F(MrTest, PodLst) {
+  vector<string> records, expected;
+  for (int64_t i = 0; i < 300; ++i) {
+    records.push_back(PodVal{i, double(i)}.ToString());
+    expected.push_back(PodVal{i, double(i) * 2}.ToString());
+  }
+  records.push_back("bad");
+
+  runner_.AddInputRecords("vals.lst", records);
+  PTable<PodVal> res =
+      pipeline_->ReadLst("read", "vals.lst").As<PodVal>().Map<PodMapper>("double");
+  res.Write("res", pb::WireFormat::LST).WithModNSharding(1, [](const PodVal&) { return 0; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_EQ(1, runner_.parse_errors);
+  EXPECT_THAT(runner_.Table("res"), ElementsAre(MatchShard(0, expected)));
+}
+
+TEST_F(MrTest, Where) {
+  vector<string> records, expected;
+  for (unsigned i = 0; i < 300; ++i) {
+    tutorial::Person person;
+    person.set_name(absl::StrCat("person", i));
+    person.set_id(i);
+    person.set_dval(i);
+    if (i % 2 == 0)
+      person.set_email(absl::StrCat("e", i));
+    for (unsigned j = 0; j < i % 4; ++j) {
+      person.add_phone()->set_number(absl::StrCat(j));
+    }
+    records.push_back(person.SerializeAsString());
+    if ((i < 10 || i >= 295) && i != 3)
+      expected.push_back(absl::StrCat(person.name(), ":", i % 4));
+  }
+  records.push_back("\xff\xff");  // bad records are passed to the parser.
+
+  runner_.AddInputRecords("persons.lst", records);
+  unsigned on_arena = 0;
+  const char kWhere[] = "(id < 10 or dval >= 295) and name != 'person3'";
+  PTable<string> names = pipeline_->ReadLst("read", "persons.lst")
+                             .Where<tutorial::Person>(kWhere)
+                             .As<tutorial::Person>()
+                             .Map<PersonMapper>("names", &on_arena);
+  names.Write("names", pb::WireFormat::TXT).WithModNSharding(1, [](const string&) { return 0; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_EQ(1, runner_.parse_errors);
+  EXPECT_THAT(runner_.Table("names"), ElementsAre(MatchShard(0, expected)));
+
+  // Unset fields compare by their defaults, like with reflection.
+  const auto* descr = tutorial::Person::descriptor();
+  detail::RecordFilter raw("email = '' and 5 < id", descr);
+  EXPECT_TRUE(raw.is_raw());
+  detail::RecordFilter nested("phone.number = '2'", descr);
+  EXPECT_FALSE(nested.is_raw());
+
+  unsigned raw_cnt = 0, nested_cnt = 0;
+  for (unsigned i = 0; i < 300; ++i) {
+    raw_cnt += raw.Pass(records[i]);
+    nested_cnt += nested.Pass(records[i]);
+  }
+  EXPECT_EQ(147, raw_cnt);
+  EXPECT_EQ(75, nested_cnt);
+
+  EXPECT_DEATH(detail::RecordFilter("account.bank = 'x'", descr), "Could not find field bank");
+}
+
+class EmailMapper {
+ public:
+  void Do(const tutorial::Person& person, DoContext<string>* out) {
+    out->Write(absl::StrCat(person.name(), ":", person.email(), ":", person.phone_size(), ":",
+                            person.account().bank_name()));
+  }
+};
+
+TEST_F(MrTest, Select) {
+  vector<string> records, expected;
+  for (unsigned i = 0; i < 100; ++i) {
+    tutorial::Person person;
+    person.set_name(absl::StrCat("person", i));
+    person.set_id(i);
+    person.set_dval(i);
+    person.set_email(absl::StrCat("e", i));
+    person.add_phone()->set_number(absl::StrCat(i));
+    person.mutable_account()->set_bank_name(absl::StrCat("bank", i));
+    person.mutable_account()->mutable_address()->set_street("s");
+    records.push_back(person.SerializeAsString());
+    if (i >= 90)
+      expected.push_back(absl::StrCat(person.name(), ":e", i, ":0:bank", i));
+  }
+
+  runner_.AddInputRecords("persons.lst", records);
+  PTable<string> names = pipeline_->ReadLst("read", "persons.lst")
+                             .Where<tutorial::Person>("id >= 90")
+                             .Select<tutorial::Person>({"email", "account.bank_name"})
+                             .As<tutorial::Person>()
+                             .Map<EmailMapper>("names");
+  names.Write("names", pb::WireFormat::TXT).WithModNSharding(1, [](const string&) { return 0; });
+  pipeline_->Run(&runner_);
+
+  EXPECT_EQ(0, runner_.parse_errors);
+  EXPECT_THAT(runner_.Table("names"), ElementsAre(MatchShard(0, expected)));
+
+  detail::RecordProjection projection({"account.bank_name", "tag"}, tutorial::Person::descriptor());
+  tutorial::Person person;
+  person.set_name("a");
+  person.set_id(1);
+  person.set_dval(2);
+  person.set_email("e");
+  person.add_tag("t1");
+  person.add_tag("t2");
+  person.mutable_account()->set_bank_name("b");
+  person.mutable_account()->mutable_address()->set_street("s");
+
+  string projected;
+  ASSERT_TRUE(projection.Apply(person.SerializeAsString(), &projected));
+  tutorial::Person parsed;
+  ASSERT_TRUE(parsed.ParseFromString(projected));
+
+  person.clear_email();
+  person.mutable_account()->clear_address();
+  EXPECT_EQ(person.DebugString(), parsed.DebugString());
+
+  projected.clear();
+  EXPECT_FALSE(projection.Apply("\xff\xff", &projected));
+  EXPECT_DEATH(detail::RecordProjection({"account.bank"}, tutorial::Person::descriptor()),
+               "Could not find field bank");
+}
+
 TEST_F(MrTest, Scope) {
   vector<string> stream1{"1", "2", "3", "4"};
   runner_.AddInputRecords("stream1.txt", stream1);
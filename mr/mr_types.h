@@ -5,9 +5,12 @@
 
 #include <functional>
 #include <string>
+#include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/variant.h"
+#include "base/memory_account.h"
 
 namespace mr3 {
 
@@ -20,8 +23,73 @@ using RawRecord = ::std::string;
 
 typedef std::function<void(RawRecord&& record)> RawSinkCb;
 
+/** A block of raw records that share a single buffer.
+ *  Records are exposed as views that stay valid as long as the batch is not modified.
+ *  Allows passing records from the runner to the handlers without allocating each of them.
+ */
+class RawRecordBatch {
+ public:
+  //! Flush thresholds for producers. The bytes limit adapts the number of records in a batch
+  //! to the record size.
+  static constexpr size_t kMaxRecords = 512;
+  static constexpr size_t kMaxBytes = 1 << 16;
+
+  void Add(absl::string_view record) {
+    buf_.append(record.data(), record.size());
+    ends_.push_back(buf_.size());
+  }
+
+  absl::string_view operator[](size_t index) const {
+    size_t start = index ? ends_[index - 1] : 0;
+    return absl::string_view(buf_.data() + start, ends_[index] - start);
+  }
+
+  size_t size() const { return ends_.size(); }
+  bool empty() const { return ends_.empty(); }
+  size_t bytes() const { return buf_.size(); }
+
+  bool full() const { return ends_.size() >= kMaxRecords || buf_.size() >= kMaxBytes; }
+
+  //! Keeps the allocated capacity so the batch can be refilled without allocations.
+  void Clear() {
+    buf_.clear();
+    ends_.clear();
+  }
+
+ private:
+  std::string buf_;
+  std::vector<size_t> ends_;
+};
+
+//! The callee may keep the batch by moving it out.
+typedef std::function<void(RawRecordBatch&& batch)> RawBatchSinkCb;
+
+//! Consumes a raw record without taking ownership over it.
+typedef std::function<void(absl::string_view record)> RawViewSinkCb;
+
+//! Both sinks consume the same records, either owning them or as views.
+struct RawSinks {
+  RawSinkCb raw;
+  RawViewSinkCb view;
+};
+
+namespace detail {
+
+struct FreqMapAccount {
+  static base::MemoryAccount* account();  // "mr.freq_maps"
+};
+
+}  // namespace detail
+
+template <typename T>
+using FrequencyMap =
+    absl::flat_hash_map<T, size_t, absl::Hash<T>, std::equal_to<T>,
+                        base::accounted_allocator<std::pair<const T, size_t>,
+                                                  detail::FreqMapAccount>>;
+
 template <typename Handler, typename ToType>
-using RawSinkMethodFactory = std::function<RawSinkCb(Handler* handler, DoContext<ToType>* context)>;
+using RawSinkMethodFactory = std::function<RawSinks(Handler* handler, DoContext<ToType>* context)>;
+
 
 struct ShardId : public absl::variant<absl::monostate, uint32_t, std::string> {
   using Parent = absl::variant<absl::monostate, uint32_t, std::string>;
@@ -4,13 +4,22 @@
 #include "mr/operator_executor.h"
 
 #include "base/logging.h"
+#include "util/asio/io_context_pool.h"
 
 namespace mr3 {
 using namespace boost;
 using namespace std;
 
+unsigned OperatorExecutor::IoIndex() {
+  util::IoContext* cntx = pool_->GetThisContext();
+  CHECK(cntx);
+  return cntx - &pool_->at(0);
+}
+
 void OperatorExecutor::RegisterContext(RawContext* context) {
   context->finalized_maps_ = finalized_maps_;
+  context->finalized_sketches_ = finalized_sketches_;
+  context->broadcasts_ = broadcasts_;
 }
 
 void OperatorExecutor::FinalizeContext(long items_cnt, RawContext* raw_context) {
@@ -24,6 +33,12 @@ void OperatorExecutor::FinalizeContext(long items_cnt, RawContext* raw_context)
   metric_map_["fn-calls"] += items_cnt;
   metric_map_["fn-writes"] += raw_context->item_writes();
 
+  const OperatorProfile& profile = raw_context->profile();
+  metric_map_["parse-ms"] += profile.parse_ns / 1000000;
+  metric_map_["do-fn-ms"] += profile.do_fn_ns / 1000000;
+  metric_map_["write-ms"] += profile.write_ns / 1000000;
+  metric_map_["write-bytes"] += profile.write_bytes;
+
   // Merge frequency maps. We aggregate counters for all the contexts.
   for (auto& k_v : raw_context->freq_maps_) {
     auto& uptr = freq_maps_[k_v.first];
@@ -36,6 +51,24 @@ void OperatorExecutor::FinalizeContext(long items_cnt, RawContext* raw_context)
       uptr.swap(k_v.second);  // steal the map.
     }
   }
+
+  for (auto& k_v : raw_context->sketches_) {
+    auto& uptr = sketches_[k_v.first];
+    if (uptr) {
+      uptr->Merge(*k_v.second);
+    } else {
+      uptr.swap(k_v.second);
+    }
+  }
+}
+
+void OperatorExecutor::EndOperator(ShardFileMap* out_files) {
+  progress_->SetFinalShards(runner_->GetOutputShardBytes());
+  if (output_gate_) {
+    runner_->OperatorEndAsync(out_files, output_gate_);
+  } else {
+    runner_->OperatorEnd(out_files);
+  }
 }
 
 void OperatorExecutor::ExtractFreqMap(function<void(string, FrequencyMap<uint32_t>*)> cb) {
@@ -45,8 +78,19 @@ void OperatorExecutor::ExtractFreqMap(function<void(string, FrequencyMap<uint32_
   freq_maps_.clear();
 }
 
-void OperatorExecutor::Init(const RawContext::FreqMapRegistry& prev_maps) {
+void OperatorExecutor::ExtractSketches(function<void(string, Sketch*)> cb) {
+  for (auto& k_v : sketches_) {
+    cb(k_v.first, k_v.second.release());
+  }
+  sketches_.clear();
+}
+
+void OperatorExecutor::Init(const RawContext::FreqMapRegistry& prev_maps,
+                            const RawContext::SketchRegistry& prev_sketches,
+                            const RawContext::BroadcastRegistry& broadcasts) {
   finalized_maps_ = &prev_maps;
+  finalized_sketches_ = &prev_sketches;
+  broadcasts_ = &broadcasts;
   InitInternal();
 }
 
@@ -6,6 +6,7 @@
 #include <boost/fiber/mutex.hpp>
 
 #include "mr/impl/table_impl.h"
+#include "mr/pipeline_progress.h"
 #include "mr/runner.h"
 
 namespace util {
@@ -22,7 +23,9 @@ class OperatorExecutor {
 
   virtual ~OperatorExecutor() {}
 
-  void Init(const RawContext::FreqMapRegistry& prev_maps);
+  void Init(const RawContext::FreqMapRegistry& prev_maps,
+            const RawContext::SketchRegistry& prev_sketches,
+            const RawContext::BroadcastRegistry& broadcasts);
 
   virtual void Run(const std::vector<const InputBase*>& inputs,
                    detail::TableBase* ss, ShardFileMap* out_files) = 0;
@@ -30,7 +33,14 @@ class OperatorExecutor {
   // Stops the executor in the middle.
   virtual void Stop() = 0;
 
+  // The executor reports its tasks, bytes and records into progress. Must be set before Run.
+  void set_progress(OperatorProgress* progress) { progress_ = progress; }
+
+  // If set, the output shards are closed in the background and reported to gate.
+  void set_output_gate(std::shared_ptr<detail::ShardGate> gate) { output_gate_ = std::move(gate); }
+
   void ExtractFreqMap(std::function<void(std::string, FrequencyMap<uint32_t>*)> cb);
+  void ExtractSketches(std::function<void(std::string, Sketch*)> cb);
  protected:
   void RegisterContext(RawContext* context);
 
@@ -44,6 +54,9 @@ class OperatorExecutor {
 
   static void SetMetaData(const pb::Input::FileSpec& fs, RawContext* context);
 
+  // Keeps the output shard sizes in progress_ and ends the operator in the runner.
+  void EndOperator(ShardFileMap* out_files);
+
   static void SetPosition(size_t pos, RawContext* context) {
     context->input_pos_ = pos;
   }
@@ -54,8 +67,13 @@ class OperatorExecutor {
 
   virtual void InitInternal() = 0;
 
+  //! The index of the calling IO thread in pool_.
+  unsigned IoIndex();
+
   util::IoContextPool* pool_;
   Runner* runner_;
+  OperatorProgress* progress_ = nullptr;
+  std::shared_ptr<detail::ShardGate> output_gate_;
 
   ::boost::fibers::mutex mu_;
 
@@ -66,6 +84,10 @@ class OperatorExecutor {
 
   RawContext::FreqMapRegistry freq_maps_;
   const RawContext::FreqMapRegistry* finalized_maps_;
+
+  RawContext::SketchRegistry sketches_;
+  const RawContext::SketchRegistry* finalized_sketches_;
+  const RawContext::BroadcastRegistry* broadcasts_;
 };
 
 }  // namespace mr3
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include "base/hash.h"
+#include "base/logging.h"
 #include "base/type_traits.h"
 
 #include "mr/mr3.pb.h"
@@ -13,11 +15,26 @@ namespace mr3 {
 
 namespace detail {
   template <typename OutT> class TableImplT;
-  inline bool IsBinary(pb::WireFormat::Type tp) { return tp == pb::WireFormat::LST; }
+  inline bool IsBinary(pb::WireFormat::Type tp) {
+    return tp == pb::WireFormat::LST || tp == pb::WireFormat::COLUMNAR;
+  }
+
+  // Shard hashes of Output<T>::WithHashSharding.
+  inline unsigned ShardHash(absl::string_view key) {
+    uint64_t h = base::Hash64(key.data(), key.size());
+    return unsigned(h >> 32) ^ unsigned(h);
+  }
+
+  inline unsigned ShardHash(uint64_t key) {
+    uint64_t h = base::Hash64(key);
+    return unsigned(h >> 32) ^ unsigned(h);
+  }
 }
 
 class OutputBase {
  public:
+  static constexpr size_t kDefaultCombineKeys = 1 << 16;
+
   pb::Output* mutable_msg() { return out_; }
   const pb::Output& msg() const { return *out_; }
 
@@ -29,7 +46,12 @@ class OutputBase {
   OutputBase(pb::Output* out) : out_(out) {}
 
   void SetCompress(pb::Output::CompressType ct, unsigned level);
+
+  // Returns the compression of ZSTD outputs, fails for the others.
+  pb::Output::Compress* ZstdCompress();
+
   void SetShardSpec(pb::ShardSpec::Type st, unsigned modn = 0);
+  void SetSkewSpec(const std::string& freq_map_id, unsigned max_splits);
   void FailUndefinedShard() const;
 };
 
@@ -38,10 +60,19 @@ template <typename T> class Output : public OutputBase {
 
   using CustomShardingFunc = std::function<std::string(const T&)>;
   using ModNShardingFunc = std::function<unsigned(const T&)>;
+  using CombineKeyFunc = std::function<std::string(const T&)>;
+  using CombineFunc = std::function<void(T* dest, T&& src)>;
+  using SortKeyFunc = std::function<std::string(const T&)>;
 
   absl::variant<absl::monostate, ShardId, ModNShardingFunc, CustomShardingFunc> shard_op_;
   unsigned modn_ = 0;
 
+  CombineKeyFunc combine_key_;
+  CombineFunc combine_;
+  size_t combine_max_keys_ = 0;
+
+  SortKeyFunc sort_key_;
+
   struct Visitor {
     const T& t_;
     unsigned modn_;
@@ -77,8 +108,143 @@ template <typename T> class Output : public OutputBase {
     return *this;
   }
 
+  /** MODN sharding by base::Hash64 of key_func(const T&), which returns a string or an integer.
+   *  Saves the users from hashing the keys themselves, usually with the slower Murmur32.
+   */
+  template <typename U> Output& WithHashSharding(unsigned modn, U&& key_func) {
+    return WithModNSharding(modn, [f = std::forward<U>(key_func)](const T& t) {
+      return detail::ShardHash(f(t));
+    });
+  }
+
+  /** Same as WithModNSharding but splits hot keys across multiple sub-shards.
+   *  func returns the key of the record, whose frequencies were counted by previous operators
+   *  in the frequency map freq_map_id. Keys that are more frequent than the average shard size
+   *  are spread over at most max_splits shards. Joiners that consume this output un-salt
+   *  the sub-shards: they are processed in parallel but each one is handled as its base shard,
+   *  and other join inputs of the base shard are passed to each one of its sub-shards.
+   */
+  template <typename U>
+  Output& WithSkewedModNSharding(unsigned modn, const std::string& freq_map_id,
+                                 unsigned max_splits, U&& func) {
+    static_assert(base::is_invocable_r<unsigned, U, const T&>::value, "");
+    shard_op_ = ModNShardingFunc(std::forward<U>(func));
+    SetShardSpec(pb::ShardSpec::SKEWED_MODN, modn);
+    SetSkewSpec(freq_map_id, max_splits);
+    modn_ = modn;
+
+    return *this;
+  }
+
+  bool is_skewed() const {
+    return out_ && out_->shard_spec().type() == pb::ShardSpec::SKEWED_MODN;
+  }
+
+  // Returns the unsharded key of the record for SKEWED_MODN outputs.
+  unsigned ShardKey(const T& t) const { return absl::get<ModNShardingFunc>(shard_op_)(t); }
+
   Output& AndCompress(pb::Output::CompressType ct, unsigned level = 0);
 
+  /** Splits GZIP outputs into independent gzip members of member_kb uncompressed KB that
+   *  are compressed concurrently on the file thread pool. The files remain regular gzip files,
+   *  and LocalRunner inflates their members in parallel when reading them.
+   *  Must follow AndCompress(pb::Output::GZIP).
+   */
+  Output& AndParallelCompress(unsigned member_kb = 1024) {
+    CHECK(out_->has_compress() && out_->compress().type() == pb::Output::GZIP)
+        << "Parallel compression requires GZIP outputs";
+    CHECK_GT(member_kb, 0);
+    out_->mutable_compress()->set_member_size_kb(member_kb);
+    return *this;
+  }
+
+  /** Compresses each shard of ZSTD outputs with zstd worker threads, which takes the
+   *  compression off the operator threads for level 3 and above.
+   *  Must follow AndCompress(pb::Output::ZSTD).
+   */
+  Output& AndZstdWorkers(unsigned workers) {
+    ZstdCompress()->set_zstd_workers(workers);
+    return *this;
+  }
+
+  /** Enables long distance matching of zstd, optionally with a larger window.
+   *  Must follow AndCompress(pb::Output::ZSTD).
+   */
+  Output& AndZstdLongDistance(unsigned window_log = 0) {
+    pb::Output::Compress* compress = ZstdCompress();
+    compress->set_zstd_long_distance(true);
+    compress->set_zstd_window_log(window_log);
+    return *this;
+  }
+
+  /** Writes ZSTD outputs in the zstd seekable format with frames of frame_kb uncompressed KB,
+   *  so the shards can be decompressed in parallel (see util::ParseZStdSeekTable).
+   *  Must follow AndCompress(pb::Output::ZSTD).
+   */
+  Output& AndZstdSeekable(unsigned frame_kb = 1024) {
+    CHECK_GT(frame_kb, 0);
+    ZstdCompress()->set_zstd_seekable_frame_kb(frame_kb);
+    return *this;
+  }
+
+  /** Writes the local shard files with O_DIRECT so that large outputs do not fill the page
+   *  cache with data that is not read again. Has no effect on GCS outputs.
+   */
+  Output& AndDirectIO() {
+    out_->set_direct_io(true);
+    return *this;
+  }
+
+  /** Keeps the shards in memory when the output is read by the following operators of the
+   *  pipeline, so that the tables that several operators consume, or that iterative jobs read
+   *  over and over, are not re-read from disk. The shards that do not fit into the cache
+   *  budget of the runner are spilled into the regular shard files. Outputs that no operator
+   *  reads are written as usual.
+   */
+  Output& AndCache() {
+    out_->set_cached(true);
+    return *this;
+  }
+
+  /** Enables map-side combining for this output. Records with the same shard and the same key
+   *  are merged in memory using combine_func(T* dest, T&& src) before they are serialized.
+   *  Combined records are flushed when the handler finishes its shard, when the shard is closed
+   *  or when more than max_keys distinct keys are buffered by the calling handler.
+   */
+  template <typename K, typename C>
+  Output& AndCombine(K&& key_func, C&& combine_func, size_t max_keys = kDefaultCombineKeys) {
+    static_assert(base::is_invocable_r<std::string, K, const T&>::value, "");
+    static_assert(base::is_invocable_r<void, C, T*, T&&>::value, "");
+    CHECK_GT(max_keys, 0);
+
+    combine_key_ = std::forward<K>(key_func);
+    combine_ = std::forward<C>(combine_func);
+    combine_max_keys_ = max_keys;
+
+    return *this;
+  }
+
+  bool has_combiner() const { return bool(combine_); }
+  std::string CombineKey(const T& t) const { return combine_key_(t); }
+  void Combine(T* dest, T&& src) const { combine_(dest, std::move(src)); }
+  size_t combine_max_keys() const { return combine_max_keys_; }
+
+  /** Sorts the records of each shard file by key_func(const T&), compared as byte strings.
+   *  Records with equal keys keep the order they were written in by each context.
+   *  Sort-merge joiners whose inputs are all sorted by their join keys stream-merge the shard
+   *  files instead of sorting them again.
+   */
+  template <typename K> Output& AndSort(K&& key_func) {
+    static_assert(base::is_invocable_r<std::string, K, const T&>::value, "");
+    sort_key_ = std::forward<K>(key_func);
+    out_->set_sorted(true);
+
+    return *this;
+  }
+
+  bool has_sort_key() const { return bool(sort_key_); }
+  std::string SortKey(const T& t) const { return sort_key_(t); }
+
   ShardId Shard(const T& t) const {
     auto res = absl::visit(Visitor{t, modn_}, shard_op_);
     if (absl::holds_alternative<absl::monostate>(res)) {
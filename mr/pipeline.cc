@@ -5,7 +5,30 @@
 #include "mr/joiner_executor.h"
 #include "mr/mapper_executor.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
+#include "base/hash.h"
 #include "base/logging.h"
+#include "mr/impl/shard_gate.h"
+#include "util/asio/io_context_pool.h"
+
+DEFINE_bool(pipeline_fuse_maps, false,
+            "If true, a map whose output is consumed only by another map runs in the same fiber "
+            "with its consumer and its output is not materialized. Fused maps can not read "
+            "frequency maps produced by each other.");
+DEFINE_bool(pipeline_resume, false,
+            "If true, operators that were completed by a previous run with the same operator "
+            "definitions and inputs are skipped and their checkpointed outputs are used instead. "
+            "Changes in the handler code are not detected.");
+DEFINE_bool(pipeline_overlap_stages, false,
+            "If true, an operator whose output is consumed only by the join that follows it "
+            "closes its shards in the background and the join starts on the shards that are "
+            "complete. Requires a runner that supports Runner::OperatorEndAsync.");
 
 namespace mr3 {
 using namespace boost;
@@ -47,11 +70,21 @@ PInput<std::string> Pipeline::Read(const std::string& name, pb::WireFormat::Type
 
   using StringImpl = detail::TableImplT<string>;
 
-  shared_ptr<StringImpl> ptr = StringImpl::AsRead(std::move(op), this);
+  std::shared_ptr<StringImpl> ptr = StringImpl::AsRead(std::move(op), this);
 
   return PInput<std::string>(std::move(ptr), inp_ptr.get());
 }
 
+PInput<std::string> Pipeline::ReadColumnar(const std::string& name, const InputSpec& input_spec,
+                                           const std::vector<std::string>& fields) {
+  PInput<std::string> res = Read(name, pb::WireFormat::COLUMNAR, input_spec);
+  pb::WireFormat* wf = mutable_input(name)->mutable_format();
+  for (const auto& field : fields) {
+    wf->add_field(field);
+  }
+  return res;
+}
+
 void Pipeline::Stop() {
   stopped_ = true;
   LOG(INFO) << "Breaking the run";
@@ -65,11 +98,65 @@ void Pipeline::Stop() {
 void Pipeline::Run(Runner* runner) {
   CHECK(!tables_.empty());
 
+  absl::flat_hash_map<string, unsigned> consumed;
+  for (const auto& sptr : tables_) {
+    for (const auto& input_name : sptr->op().input_name()) {
+      ++consumed[input_name];
+    }
+  }
+
+  // The inputs of broadcast tables must be materialized, hence they are never fused.
+  for (const auto& spec : pending_broadcasts_) {
+    for (const auto& input_name : spec.inputs) {
+      ++consumed[input_name];
+    }
+  }
+
   for (const auto& sptr : tables_) {
+    if (consumed.contains(sptr->op().output().name())) {
+      sptr->mutable_op()->mutable_output()->set_intermediate(true);
+    }
+  }
+
+  // Tables are ordered by their creation, hence a chain of maps is fused from its head.
+  if (FLAGS_pipeline_fuse_maps) {
+    for (const auto& sptr : tables_) {
+      detail::TableBase* src = sptr->fuse_source();
+      if (src && consumed[src->op().output().name()] == 1) {
+        sptr->FuseWithSource();
+      }
+    }
+  }
+
+  std::vector<const pb::Operator*> ops;
+  for (const auto& sptr : tables_) {
+    ops.push_back(&sptr->op());
+  }
+  progress_.Reset(ops, runner);
+
+  if (incremental_) {
+    PrepareIncremental(runner);
+  } else {
+    for (const auto& k_v : inputs_) {
+      CHECK(!k_v.second->msg().incremental())
+          << "Incremental input " << k_v.first << " requires MergeIncremental";
+    }
+  }
+
+  for (size_t i = 0; i < tables_.size(); ++i) {
+    const auto& sptr = tables_[i];
     const pb::Operator& op = sptr->op();
+    OperatorProgress* op_progress = progress_.op(i);
+
+    if (sptr->is_fused()) {
+      LOG(INFO) << op.op_name() << " is fused into its consumer";
+      progress_.SetState(op_progress, OperatorProgress::FUSED);
+      continue;
+    }
 
     if (op.input_name_size() == 0) {
       LOG(INFO) << "No inputs for " << op.op_name() << ", skipping";
+      progress_.SetState(op_progress, OperatorProgress::SKIPPED);
       continue;
     }
 
@@ -77,26 +164,91 @@ void Pipeline::Run(Runner* runner) {
       break;
     }
 
+    LoadBroadcasts(runner);
+    uint64_t fp = OperatorFingerprint(runner, sptr.get());
+    if (FLAGS_pipeline_resume && ResumeFromCheckpoint(runner, op, fp)) {
+      output_fp_[op.output().name()] = fp;
+      progress_.SetState(op_progress, OperatorProgress::RESUMED);
+      continue;
+    }
+
+    // The output of the operator is closed while the next one runs if only that join reads it.
+    std::shared_ptr<detail::ShardGate> out_gate;
+    if (FLAGS_pipeline_overlap_stages && i + 1 < tables_.size() && sptr != incremental_ &&
+        consumed[op.output().name()] == 1) {
+      const pb::Operator& next = tables_[i + 1]->op();
+      if (next.type() == pb::Operator::GROUP &&
+          std::find(next.input_name().begin(), next.input_name().end(), op.output().name()) !=
+              next.input_name().end()) {
+        out_gate = std::make_shared<detail::ShardGate>();
+      }
+    }
+
     // We lock due to protect again Stop() breaks.
     std::unique_lock<fibers::mutex> lk(mu_);
     switch (op.type()) {
-      case pb::Operator::GROUP:
-        executor_.reset(new JoinerExecutor{pool_, runner});
-        break;
+      case pb::Operator::GROUP: {
+        JoinerExecutor* joiner = new JoinerExecutor{pool_, runner};
+        joiner->set_input_gate(closing_gate_);
+        executor_.reset(joiner);
+      } break;
       default:
         executor_.reset(new MapperExecutor{pool_, runner});
     }
 
-    executor_->Init(freq_maps_);
+    executor_->Init(freq_maps_, sketches_, broadcasts_);
+    executor_->set_progress(op_progress);
+    executor_->set_output_gate(out_gate);
     lk.unlock();
-    ProcessTable(sptr.get());
+
+    progress_.SetState(op_progress, OperatorProgress::RUNNING);
+    ProcessTable(runner, sptr.get(), fp, out_gate != nullptr);
+    progress_.SetState(op_progress, stopped_ ? OperatorProgress::STOPPED : OperatorProgress::DONE);
+
+    // The previous output was consumed, the current one is closed until the next operator ends.
+    WaitForClosing();
+    closing_gate_ = std::move(out_gate);
+  }
+  WaitForClosing();
+
+  for (const auto& spec : pending_broadcasts_) {
+    LOG(WARNING) << "Broadcast table " << spec.name << " was not loaded";
   }
 
   VLOG(1) << "Before Runner::Shutdown";
   runner->Shutdown();
 }
 
-void Pipeline::ProcessTable(detail::TableBase* tbl) {
+void Pipeline::RunConcurrently(const std::vector<std::pair<Pipeline*, Runner*>>& runs) {
+  // Runners keep the state of the running operator, hence they are not shared.
+  absl::flat_hash_set<Runner*> runners;
+  for (const auto& p_r : runs) {
+    CHECK(runners.insert(p_r.second).second) << "Pipelines must run with different runners";
+  }
+
+  std::vector<std::thread> threads;
+  for (const auto& p_r : runs) {
+    threads.emplace_back([p_r] { p_r.first->Run(p_r.second); });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void Pipeline::WaitForClosing() {
+  if (!closing_gate_)
+    return;
+
+  closing_gate_->Wait();
+  closing_gate_.reset();
+  if (on_closed_) {
+    on_closed_();
+    on_closed_ = nullptr;
+  }
+}
+
+void Pipeline::ProcessTable(Runner* runner, detail::TableBase* tbl, uint64_t fp,
+                            bool closes_async) {
   const pb::Operator& op = tbl->op();
   std::vector<const InputBase*> inputs;
   string input_names;
@@ -108,20 +260,72 @@ void Pipeline::ProcessTable(detail::TableBase* tbl) {
   }
   input_names.pop_back();
 
-  // TODO: To allow skipping of the pipeline - i.e. partial dry run mode. For that we need to
-  // scan output directory of each operator for shard files and populate shards from there.
-  // In addition we must save freq maps on disk to allow loading them during dry run.
   LOG(INFO) << op.op_name() << " started on inputs [" << input_names << "]";
   ShardFileMap out_files;
   executor_->Run(inputs, tbl, &out_files);
 
   LOG(INFO) << op.op_name() << " finished run with " << out_files.size() << " output files";
+  output_fp_[op.output().name()] = fp;
+
+  // The shards that are closed in the background are consumed while they are being closed.
+  if (closes_async) {
+    SetOutputFiles(op, out_files);
+  } else {
+    SetOutputFiles(op, out_files, runner->GetClosedShardStats());
+  }
+
+  if (tbl == incremental_.get() && !stopped_) {
+    SaveManifest(runner, op, out_files);
+  }
 
+  unsigned num_maps = 0;
+  auto cb = [&](string k, FrequencyMap<uint32_t>* ptr) {
+    auto res = freq_maps_.emplace(std::move(k), ptr);
+    CHECK(res.second) << "Frequency map " << k
+                      << " was created more than once across the pipeline run.";
+    ++num_maps;
+  };
+
+  executor_->ExtractFreqMap(cb);
+  executor_->ExtractSketches([&](string k, Sketch* ptr) {
+    auto res = sketches_.emplace(std::move(k), ptr);
+    CHECK(res.second) << "Sketch " << res.first->first
+                      << " was created more than once across the pipeline run.";
+    ++num_maps;
+  });
+
+  // Frequency maps and sketches are not persisted, hence such operators must always run.
+  if (num_maps) {
+    VLOG(1) << op.op_name() << " produced frequency maps or sketches, skipping its checkpoint";
+    return;
+  }
+
+  if (stopped_)
+    return;
+
+  // The checkpoint lists the output files, hence it waits until they are closed.
+  if (closes_async) {
+    on_closed_ = [this, runner, &op, fp, out_files] { SaveCheckpoint(runner, op, fp, out_files); };
+  } else {
+    SaveCheckpoint(runner, op, fp, out_files);
+  }
+}
+
+void Pipeline::SetOutputFiles(const pb::Operator& op, const ShardFileMap& out_files,
+                              const std::vector<std::pair<ShardId, pb::ShardStats>>& shard_stats) {
   // Fill the corresponsing input with sharded files.
   auto it = inputs_.find(op.output().name());
   CHECK(it != inputs_.end());
   auto& inp_ptr = it->second;
 
+  absl::flat_hash_map<ShardId, const pb::ShardStats*> stats_of;
+  for (const auto& k_v : shard_stats) {
+    stats_of.emplace(k_v.first, &k_v.second);
+  }
+
+  bool skewed = op.output().shard_spec().type() == pb::ShardSpec::SKEWED_MODN;
+  unsigned num_splits = 0;
+
   for (const auto& k_v : out_files) {
     auto* fs = inp_ptr->mutable_msg()->add_file_spec();
     fs->set_url_glob(k_v.second);
@@ -130,15 +334,294 @@ void Pipeline::ProcessTable(detail::TableBase* tbl) {
     } else {
       fs->set_custom_shard_id(absl::get<string>(k_v.first));
     }
+    auto stats_it = stats_of.find(k_v.first);
+    if (stats_it != stats_of.end()) {
+      *fs->mutable_stats() = *stats_it->second;
+    }
+
+    uint32_t base_shard;
+    if (skewed && detail::SkewPlan::ParseSubShard(k_v.first, &base_shard)) {
+      fs->set_base_shard_id(base_shard);
+      ++num_splits;
+    }
   }
+  LOG_IF(INFO, num_splits) << op.op_name() << " split hot keys into " << num_splits
+                           << " additional shards";
+}
 
-  auto cb = [this](string k, FrequencyMap<uint32_t>* ptr) {
-    auto res = freq_maps_.emplace(std::move(k), ptr);
-    CHECK(res.second) << "Frequency map " << k
-                      << " was created more than once across the pipeline run.";
+uint64_t Pipeline::OperatorFingerprint(Runner* runner, const detail::TableBase* tbl) const {
+  // Whether the output is intermediate depends on its consumers and not on the operator itself,
+  // the compute threads do not change the output either.
+  pb::Operator op = tbl->op();
+  op.mutable_output()->clear_intermediate();
+  op.clear_compute_threads();
+  string buf = op.SerializeAsString();
+
+  for (const detail::TableBase* src = tbl->fuse_source(); src && src->is_fused();
+       src = src->fuse_source()) {
+    absl::StrAppend(&buf, src->op().SerializeAsString());
+  }
+
+  for (const auto& input_name : op.input_name()) {
+    AppendInputFingerprint(runner, input_name, &buf);
+  }
+
+  // Handlers may read any of the broadcast tables loaded so far.
+  buf.append(broadcast_fp_);
+
+  return base::Fingerprint(buf);
+}
+
+void Pipeline::AppendInputFingerprint(Runner* runner, const std::string& input_name,
+                                      std::string* buf) const {
+  auto it = output_fp_.find(input_name);
+  if (it != output_fp_.end()) {
+    // The format may restrict the fields that are read.
+    absl::StrAppend(buf, input_name, ":", it->second, ";",
+                    CheckedInput(input_name)->msg().format().SerializeAsString());
+    return;
+  }
+
+  // For inputs that were not produced by the pipeline we cover their files and sizes.
+  const pb::Input& input = CheckedInput(input_name)->msg();
+  absl::StrAppend(buf, input.SerializeAsString());
+  pool_->GetNextContext().AwaitSafe([&] {
+    for (const auto& fs : input.file_spec()) {
+      runner->ExpandGlob(fs.url_glob(), [&](size_t sz, const string& name) {
+        absl::StrAppend(buf, name, ":", sz, ";");
+      });
+    }
+  });
+}
+
+void Pipeline::LoadBroadcasts(Runner* runner) {
+  auto is_ready = [this](const string& input_name) {
+    const InputBase* input = CheckedInput(input_name);
+    return !input->linked_outp() || output_fp_.contains(input_name);
   };
 
-  executor_->ExtractFreqMap(cb);
+  auto it = pending_broadcasts_.begin();
+  while (it != pending_broadcasts_.end()) {
+    if (!std::all_of(it->inputs.begin(), it->inputs.end(), is_ready)) {
+      ++it;
+      continue;
+    }
+
+    // Operators that read the table may run before it, e.g. if the table is read by
+    // the first map of the pipeline.
+    runner->Init();
+
+    detail::BroadcastBase* table = it->load(runner);
+    auto res = broadcasts_.emplace(it->name, table);
+    CHECK(res.second) << "Broadcast table " << it->name << " was defined more than once";
+    LOG(INFO) << "Loaded broadcast table " << it->name;
+
+    absl::StrAppend(&broadcast_fp_, it->name, "=");
+    for (const auto& input_name : it->inputs) {
+      AppendInputFingerprint(runner, input_name, &broadcast_fp_);
+    }
+    it = pending_broadcasts_.erase(it);
+  }
+}
+
+void Pipeline::ReadInputs(Runner* runner, const std::vector<std::string>& input_names,
+                          BroadcastSinkCb cb) {
+  struct FileInput {
+    const pb::Input* input;
+    string file_name;
+  };
+  std::vector<FileInput> files;
+
+  pool_->GetNextContext().AwaitSafe([&] {
+    for (const auto& input_name : input_names) {
+      const pb::Input& input = CheckedInput(input_name)->msg();
+      for (const auto& fs : input.file_spec()) {
+        runner->ExpandGlob(fs.url_glob(), [&](size_t sz, const string& name) {
+          files.push_back(FileInput{&input, name});
+        });
+      }
+    }
+  });
+
+  std::atomic<size_t> next{0};
+  pool_->AwaitFiberOnAll([&](IoContext&) {
+    for (size_t index = next++; index < files.size(); index = next++) {
+      const pb::Input& input = *files[index].input;
+      bool is_binary = detail::IsBinary(input.format().type());
+      uint64_t skip = input.skip_header(), file_record_cnt = 0;
+
+      runner->ProcessInputBatches(
+          files[index].file_name, input.format(), 0, kuint64max, [&](RawRecordBatch&& batch) {
+            size_t from = 0;
+            if (file_record_cnt < skip) {
+              from = std::min<uint64_t>(skip - file_record_cnt, batch.size());
+            }
+            file_record_cnt += batch.size();
+            if (from == batch.size())
+              return;
+
+            if (from) {
+              RawRecordBatch rest;
+              for (size_t i = from; i < batch.size(); ++i) {
+                rest.Add(batch[i]);
+              }
+              batch = std::move(rest);
+            }
+            cb(is_binary, std::move(batch));
+          });
+    }
+  });
+}
+
+void Pipeline::SaveCheckpoint(Runner* runner, const pb::Operator& op, uint64_t fp,
+                              const ShardFileMap& out_files) {
+  pb::OperatorCheckpoint cp;
+  cp.set_fingerprint(fp);
+  ListShards(runner, out_files, cp.mutable_shard());
+
+  runner->SaveCheckpoint(op, cp);
+}
+
+void Pipeline::ListShards(
+    Runner* runner, const ShardFileMap& out_files,
+    google::protobuf::RepeatedPtrField<pb::OperatorCheckpoint::Shard>* shards) {
+  pool_->GetNextContext().AwaitSafe([&] {
+    for (const auto& k_v : out_files) {
+      auto* shard = shards->Add();
+      if (absl::holds_alternative<uint32_t>(k_v.first)) {
+        shard->set_shard_id(absl::get<uint32_t>(k_v.first));
+      } else {
+        shard->set_custom_shard_id(absl::get<string>(k_v.first));
+      }
+      shard->set_url_glob(k_v.second);
+      runner->ExpandGlob(k_v.second, [shard](size_t sz, const string& name) {
+        auto* file = shard->add_file();
+        file->set_name(name);
+        file->set_size(sz);
+      });
+    }
+  });
+}
+
+void Pipeline::PrepareIncremental(Runner* runner) {
+  const pb::Operator& op = incremental_->op();
+  CHECK(op.has_output()) << "Did you forget to call .Write(..) on " << op.op_name() << "?";
+
+  pb::IncrementalManifest prev;
+  bool has_prev = runner->LoadManifest(op, &prev);
+
+  // The previous results are sharded like the output that produced them.
+  const string& prev_name = incremental_prev_->op().output().name();
+  std::unique_ptr<InputBase> prev_input(
+      new InputBase(prev_name, op.output().format().type(), &op.output()));
+  pb::Input* prev_msg = prev_input->mutable_msg();
+  prev_msg->mutable_format()->CopyFrom(op.output().format());
+  for (const auto& shard : prev.shard()) {
+    auto* fs = prev_msg->add_file_spec();
+    fs->set_url_glob(shard.url_glob());
+    if (shard.has_shard_id()) {
+      fs->set_shard_id(shard.shard_id());
+    } else {
+      fs->set_custom_shard_id(shard.custom_shard_id());
+    }
+  }
+  inputs_[prev_name] = std::move(prev_input);  // replaces the input of the former run.
+
+  absl::flat_hash_map<std::pair<string, string>, uint64_t> processed;
+  for (const auto& input_file : prev.input_file()) {
+    processed.emplace(std::make_pair(input_file.input(), input_file.file().name()),
+                      input_file.file().size());
+  }
+
+  // The manifest of this run lists the current files, so the deleted ones are forgotten.
+  manifest_.Clear();
+  for (auto& k_v : inputs_) {
+    pb::Input* input = k_v.second->mutable_msg();
+    if (!input->incremental())
+      continue;
+
+    input->clear_pinned_file();
+    pool_->GetNextContext().AwaitSafe([&] {
+      for (const auto& fs : input->file_spec()) {
+        runner->ExpandGlob(fs.url_glob(), [&](size_t sz, const string& name) {
+          auto* input_file = manifest_.add_input_file();
+          input_file->set_input(k_v.first);
+          input_file->mutable_file()->set_name(name);
+          input_file->mutable_file()->set_size(sz);
+
+          auto it = processed.find(std::make_pair(k_v.first, name));
+          if (it == processed.end() || it->second != sz) {
+            input->add_pinned_file()->CopyFrom(input_file->file());
+          }
+        });
+      }
+    });
+    LOG(INFO) << "Incremental input " << k_v.first << " has " << input->pinned_file_size()
+              << " new files";
+  }
+  LOG_IF(INFO, has_prev) << op.op_name() << " merges the previous results of "
+                         << prev.shard_size() << " shards";
+}
+
+void Pipeline::SaveManifest(Runner* runner, const pb::Operator& op,
+                            const ShardFileMap& out_files) {
+  pb::IncrementalManifest manifest = manifest_;
+  ListShards(runner, out_files, manifest.mutable_shard());
+  runner->SaveManifest(op, manifest);
+}
+
+bool Pipeline::ResumeFromCheckpoint(Runner* runner, const pb::Operator& op, uint64_t fp) {
+  pb::OperatorCheckpoint cp;
+  if (!runner->LoadCheckpoint(op, &cp)) {
+    return false;
+  }
+
+  if (cp.fingerprint() != fp) {
+    LOG(INFO) << op.op_name() << " has changed since its checkpoint, rerunning it";
+    return false;
+  }
+
+  using FileInfo = std::pair<string, size_t>;
+  ShardFileMap out_files;
+  bool valid = true;
+
+  pool_->GetNextContext().AwaitSafe([&] {
+    for (const auto& shard : cp.shard()) {
+      std::vector<FileInfo> expected, actual;
+      for (const auto& file : shard.file()) {
+        expected.emplace_back(file.name(), file.size());
+      }
+      runner->ExpandGlob(shard.url_glob(), [&](size_t sz, const string& name) {
+        actual.emplace_back(name, sz);
+      });
+      std::sort(expected.begin(), expected.end());
+      std::sort(actual.begin(), actual.end());
+
+      if (expected != actual) {
+        LOG(INFO) << "Output files " << shard.url_glob() << " of " << op.op_name()
+                  << " do not match its checkpoint";
+        valid = false;
+        break;
+      }
+
+      ShardId sid;
+      if (shard.has_shard_id()) {
+        sid = ShardId{shard.shard_id()};
+      } else {
+        sid = ShardId{shard.custom_shard_id()};
+      }
+      out_files.emplace(std::move(sid), shard.url_glob());
+    }
+  });
+
+  if (!valid)
+    return false;
+
+  LOG(INFO) << op.op_name() << " resumed from checkpoint with " << out_files.size()
+            << " output files";
+  SetOutputFiles(op, out_files);
+
+  return true;
 }
 
 pb::Input* Pipeline::mutable_input(const std::string& name) {
@@ -157,4 +640,41 @@ const FrequencyMap<uint32_t>* Pipeline::GetFreqMap(const std::string& map_id) co
 
 Runner::~Runner() {}
 
+void Runner::OperatorEndAsync(ShardFileMap* out_files, std::shared_ptr<detail::ShardGate> gate) {
+  OperatorEnd(out_files);
+  gate->CloseAll();
+}
+
+bool Runner::NextTask(size_t num_tasks, size_t claimed, size_t* task) {
+  if (claimed >= num_tasks)
+    return false;
+  *task = claimed;
+  return true;
+}
+
+size_t Runner::ProcessInputRange(const std::string& filename, const pb::WireFormat& wf,
+                                 size_t offset, size_t length, RawSinkCb cb) {
+  LOG(FATAL) << "Range reads are not supported for " << filename;
+  return 0;
+}
+
+size_t Runner::ProcessInputBatches(const std::string& filename, const pb::WireFormat& wf,
+                                   size_t offset, size_t length, RawBatchSinkCb cb) {
+  RawRecordBatch batch;
+  auto pack_cb = [&](RawRecord&& rr) {
+    batch.Add(rr);
+    if (batch.full()) {
+      cb(std::move(batch));
+      batch.Clear();
+    }
+  };
+
+  size_t cnt = length == kuint64max ? ProcessInputFile(filename, wf, pack_cb)
+                                    : ProcessInputRange(filename, wf, offset, length, pack_cb);
+  if (!batch.empty()) {
+    cb(std::move(batch));
+  }
+  return cnt;
+}
+
 }  // namespace mr3
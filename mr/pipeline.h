@@ -4,7 +4,11 @@
 #pragma once
 
 #include <boost/fiber/mutex.hpp>
+#include "mr/impl/record_filter.h"
+#include "mr/impl/record_projection.h"
+#include "mr/pipeline_progress.h"
 #include "mr/ptable.h"
+#include "mr/runner.h"
 
 #include "absl/container/flat_hash_map.h"
 
@@ -28,7 +32,57 @@ template <typename T> class PInput : public PTable<T> {
     return *this;
   }
 
+  /** Marks an append-only input whose files are processed once across the pipeline runs:
+   *  the mappers read only the files that the previous runs have not, and
+   *  Pipeline::MergeIncremental merges their results with the previous ones. Files are
+   *  identified by their names and sizes, hence a file that changes is processed again.
+   */
+  PInput<T>& set_incremental() {
+    input_->mutable_msg()->set_incremental(true);
+    return *this;
+  }
+
+  /** Drops the records that do not satisfy the plang expression, e.g. "id < 100 and
+   *  country = 'US'", in the IO fibers before they are queued for the mappers. The records
+   *  must be serialized Proto messages. Comparisons of top-level scalar fields with constants
+   *  are evaluated on the wire format, other expressions parse the messages.
+   */
+  template <typename Proto> PInput<T>& Where(const std::string& expr) {
+    static_assert(std::is_base_of<::google::protobuf::Message, Proto>::value,
+                  "Where requires a protobuf type");
+    CHECK(detail::IsBinary(input_->msg().format().type())) << "Where requires binary input";
+
+    detail::RecordFilter verify(expr, Proto::descriptor());  // Dies on bad expressions.
+    SetRecordType(Proto::descriptor()->full_name());
+    input_->mutable_msg()->set_where(expr);
+    return *this;
+  }
+
+  /** Declares the fields of Proto that the consumers of the input read, e.g.
+   *  {"name", "account.bank_name"}. The IO fibers strip the other fields from the records, so the
+   *  mappers parse only the selected ones. Required fields are always kept. Where is evaluated
+   *  on the full records. The records must be serialized Proto messages.
+   */
+  template <typename Proto> PInput<T>& Select(const std::vector<std::string>& fields) {
+    static_assert(std::is_base_of<::google::protobuf::Message, Proto>::value,
+                  "Select requires a protobuf type");
+    CHECK(detail::IsBinary(input_->msg().format().type())) << "Select requires binary input";
+
+    detail::RecordProjection verify(fields, Proto::descriptor());  // Dies on bad fields.
+    SetRecordType(Proto::descriptor()->full_name());
+    for (const auto& f : fields)
+      input_->mutable_msg()->add_select(f);
+    return *this;
+  }
+
  private:
+  void SetRecordType(const std::string& type) {
+    auto* msg = input_->mutable_msg();
+    CHECK(!msg->has_where_type() || msg->where_type() == type)
+        << "Conflicting record types " << msg->where_type() << " and " << type;
+    msg->set_where_type(type);
+  }
+
   InputBase* input_;
 };
 
@@ -79,23 +133,103 @@ class Pipeline {
     return ReadLst(name, std::vector<std::string>{glob});
   }
 
+  // Materializes only the given top-level fields of the records, all of them if fields is empty.
+  PInput<std::string> ReadColumnar(const std::string& name, const InputSpec& input_spec,
+                                   const std::vector<std::string>& fields = {});
+
   void Run(Runner* runner);
 
+  /** Runs the pipelines concurrently, each with its own runner, and waits for all of them.
+   *  Operators of different pipelines share the IO threads of the pool, so the small
+   *  pipelines fill the capacity that the large ones leave idle. Independent branches of a
+   *  job can be split into separate pipelines to run them side by side.
+   */
+  static void RunConcurrently(const std::vector<std::pair<Pipeline*, Runner*>>& runs);
+
   // Stops/breaks the run.
   void Stop();
 
+  // Progress of the operators of the current or the last run. Thread-safe.
+  const PipelineProgress& progress() const { return progress_; }
+
   template <typename GrouperType, typename Out> PTable<Out> Join(const std::string& name,
                    std::initializer_list<detail::HandlerBinding<GrouperType, Out>> args);
 
+  /** Joins delta, the results of the new files of the incremental inputs, with the results
+   *  of the previous run of this operator, which are passed to prev_fn. E.g. merges the
+   *  daily counts into the totals. The output must be written with the sharding of delta.
+   *  Once the operator finishes, the runner saves the manifest of the processed input files
+   *  with its output. The first run has no previous results. One operator per pipeline.
+   */
+  template <typename Merger, typename Out, typename S>
+  PTable<Out> MergeIncremental(const std::string& name, detail::HandlerBinding<Merger, Out> delta,
+                               EmitMemberFn<S, Merger, Out> prev_fn);
+
   pb::Input* mutable_input(const std::string&);
 
   const FrequencyMap<uint32_t>* GetFreqMap(const std::string& map_id) const;
+
+  // Returns the sketch produced by the operators that have run or null if there is none.
+  template <typename S> const S* GetSketch(const std::string& sketch_id) const;
+
+  /** Loads the records of tbl into an immutable hash table keyed by key_fn(const T&) and
+   *  shared by all the IO threads of the process. The table is loaded once the operators that
+   *  produce tbl have run, and the operators that run after that access it with
+   *  DoContext::Broadcast<T>(name). Suits small tables that are joined with big ones by key,
+   *  since the big table is processed by a map without re-sharding it.
+   */
+  template <typename T, typename KeyFn>
+  void Broadcast(const std::string& name, const PTable<T>& tbl, KeyFn&& key_fn);
+
  private:
+  using BroadcastSinkCb = std::function<void(bool is_binary, RawRecordBatch&& batch)>;
+
+  struct BroadcastSpec {
+    std::string name;
+    std::vector<std::string> inputs;
+    std::function<detail::BroadcastBase*(Runner* runner)> load;
+  };
+
   PInput<std::string> Read(const std::string& name, pb::WireFormat::Type format,
                            const InputSpec& globs);
 
   const InputBase* CheckedInput(const std::string& name) const;
-  void ProcessTable(detail::TableBase* tbl);
+
+  // Sets the files of the previous results and the new files of the incremental inputs.
+  void PrepareIncremental(Runner* runner);
+  void SaveManifest(Runner* runner, const pb::Operator& op, const ShardFileMap& out_files);
+
+  // Lists the files of out_files into shards.
+  void ListShards(Runner* runner, const ShardFileMap& out_files,
+                  google::protobuf::RepeatedPtrField<pb::OperatorCheckpoint::Shard>* shards);
+  // closes_async is set if the output of tbl is closed in the background.
+  void ProcessTable(Runner* runner, detail::TableBase* tbl, uint64_t fp, bool closes_async);
+
+  // Waits until the output of the previous operator is closed.
+  void WaitForClosing();
+
+  // Adds the output files of op to the input bearing the name of its output, together with
+  // the stats of the shards that are listed in shard_stats.
+  void SetOutputFiles(const pb::Operator& op, const ShardFileMap& out_files,
+                      const std::vector<std::pair<ShardId, pb::ShardStats>>& shard_stats = {});
+
+  // Loads the pending broadcast tables whose inputs were produced.
+  void LoadBroadcasts(Runner* runner);
+
+  // Reads all the records of the inputs with fibers of all IO threads.
+  void ReadInputs(Runner* runner, const std::vector<std::string>& input_names,
+                  BroadcastSinkCb cb);
+
+  // Covers the definition of the operator and the contents of its inputs.
+  uint64_t OperatorFingerprint(Runner* runner, const detail::TableBase* tbl) const;
+  void AppendInputFingerprint(Runner* runner, const std::string& input_name,
+                              std::string* buf) const;
+  void SaveCheckpoint(Runner* runner, const pb::Operator& op, uint64_t fp,
+                      const ShardFileMap& out_files);
+
+  // Returns true if op has a valid checkpoint with fingerprint fp. In that case fills its
+  // output from the checkpoint.
+  bool ResumeFromCheckpoint(Runner* runner, const pb::Operator& op, uint64_t fp);
 
   util::IoContextPool* pool_;
   absl::flat_hash_map<std::string, std::unique_ptr<InputBase>> inputs_;
@@ -105,7 +239,26 @@ class Pipeline {
   std::unique_ptr<OperatorExecutor> executor_;  // guarded by mu_
   std::atomic_bool stopped_{false};
 
+  // The output of the last operator that is being closed and what runs once it is.
+  std::shared_ptr<detail::ShardGate> closing_gate_;
+  std::function<void()> on_closed_;
+
   RawContext::FreqMapRegistry freq_maps_;
+  RawContext::SketchRegistry sketches_;
+
+  std::vector<BroadcastSpec> pending_broadcasts_;
+  RawContext::BroadcastRegistry broadcasts_;
+  std::string broadcast_fp_;  // Covers the inputs of the loaded broadcast tables.
+
+  // Fingerprints of the outputs produced or resumed during the run.
+  absl::flat_hash_map<std::string, uint64_t> output_fp_;
+
+  PipelineProgress progress_;
+
+  // The operator of MergeIncremental and the table of its previous results, which is bound
+  // to the operator but is not run.
+  std::shared_ptr<detail::TableBase> incremental_, incremental_prev_;
+  pb::IncrementalManifest manifest_;  // lists the files of the incremental inputs.
 };
 
 template <typename GrouperType, typename OutT>
@@ -115,10 +268,90 @@ PTable<OutT> Pipeline::Join(const std::string& name,
   return PTable<OutT>{res};
 }
 
+template <typename Merger, typename Out, typename S>
+PTable<Out> Pipeline::MergeIncremental(const std::string& name,
+                                       detail::HandlerBinding<Merger, Out> delta,
+                                       EmitMemberFn<S, Merger, Out> prev_fn) {
+  CHECK(!incremental_) << "Only one incremental operator per pipeline is supported";
+
+  pb::Operator prev_op;
+  prev_op.set_op_name(name + "_prev");
+  prev_op.mutable_output()->set_name(name + "_prev");
+  auto prev = std::make_shared<detail::TableImplT<Out>>(std::move(prev_op), this);
+  auto prev_binding =
+      detail::HandlerBinding<Merger, Out>::template Create<Out>(prev.get(), prev_fn);
+
+  auto res = detail::TableImplT<Out>::template AsGroup<Merger>(name, {delta, prev_binding}, this);
+  incremental_ = res;
+  incremental_prev_ = std::move(prev);
+  return PTable<Out>{res};
+}
+
+template <typename S> const S* Pipeline::GetSketch(const std::string& sketch_id) const {
+  auto it = sketches_.find(sketch_id);
+  if (it == sketches_.end())
+    return nullptr;
+
+  const S* sketch = dynamic_cast<const S*>(it->second.get());
+  CHECK(sketch) << "Sketch " << sketch_id << " was created with a different type";
+  return sketch;
+}
+
+template <typename T, typename KeyFn>
+void Pipeline::Broadcast(const std::string& name, const PTable<T>& tbl, KeyFn&& key_fn) {
+  static_assert(base::is_invocable_r<std::string, KeyFn, const T&>::value, "");
+
+  BroadcastSpec spec;
+  spec.name = name;
+  spec.inputs = tbl.impl_->SourceInputs();
+  spec.load = [this, name, inputs = spec.inputs,
+               key_fn = std::forward<KeyFn>(key_fn)](Runner* runner) {
+    std::unique_ptr<BroadcastTable<T>> table(new BroadcastTable<T>);
+    ::boost::fibers::mutex mu;
+    size_t parse_errors = 0, dups = 0;
+
+    // Records are parsed in parallel and are inserted into the table batch by batch.
+    ReadInputs(runner, inputs, [&](bool is_binary, RawRecordBatch&& batch) {
+      detail::DefaultParser<T> parser;
+      std::vector<std::pair<std::string, T>> items;
+      items.reserve(batch.size());
+      size_t errors = 0;
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        T val;
+        if (detail::CallParser(&parser, is_binary, batch[i], &val, 0)) {
+          std::string key = key_fn(val);
+          items.emplace_back(std::move(key), std::move(val));
+        } else {
+          ++errors;
+        }
+      }
+
+      std::lock_guard<::boost::fibers::mutex> lk(mu);
+      parse_errors += errors;
+      dups += table->Insert(&items);
+    });
+
+    LOG_IF(WARNING, parse_errors) << "Broadcast table " << name << " had " << parse_errors
+                                  << " parse errors";
+    LOG_IF(WARNING, dups) << "Broadcast table " << name << " dropped " << dups
+                          << " records with duplicate keys";
+    return table.release();
+  };
+
+  pending_broadcasts_.push_back(std::move(spec));
+}
+
 template <typename U, typename Joiner, typename Out, typename S>
 detail::HandlerBinding<Joiner, Out> JoinInput(const PTable<U>& tbl,
                                               EmitMemberFn<S, Joiner, Out> ptr) {
   return tbl.BindWith(ptr);
 }
 
+template <typename U, typename Joiner, typename Out, typename S, typename KeyFn>
+detail::HandlerBinding<Joiner, Out> JoinInput(const PTable<U>& tbl,
+                                              EmitMemberFn<S, Joiner, Out> ptr, KeyFn&& key_fn) {
+  return tbl.BindWith(ptr, std::forward<KeyFn>(key_fn));
+}
+
 }  // namespace mr3
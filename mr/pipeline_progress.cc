@@ -0,0 +1,339 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/pipeline_progress.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "base/walltime.h"
+#include "mr/runner.h"
+#include "util/html/sorted_table.h"
+
+namespace mr3 {
+
+using namespace std;
+namespace rj = rapidjson;
+
+namespace {
+
+// The shard table lists the largest shards only.
+constexpr size_t kMaxShardRows = 100;
+
+string FormatBytes(double bytes) {
+  const char* kUnits[] = {"B", "KB", "MB", "GB", "TB"};
+  unsigned i = 0;
+  while (bytes >= 1024 && i + 1 < sizeof(kUnits) / sizeof(kUnits[0])) {
+    bytes /= 1024;
+    ++i;
+  }
+  return absl::StrFormat("%.1f%s", bytes, kUnits[i]);
+}
+
+string FormatSeconds(double sec) {
+  if (sec < 0)
+    return "-";
+  uint64_t s = sec;
+  return absl::StrFormat("%02d:%02d:%02d", s / 3600, (s / 60) % 60, s % 60);
+}
+
+uint64_t ProcessCpuMicros() {
+  rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+  auto micros = [](const timeval& tv) { return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec; };
+  return micros(ru.ru_utime) + micros(ru.ru_stime);
+}
+
+// Resets VmHWM to the current RSS, see proc(5). Fails on the kernels before 4.0.
+void ResetPeakRss() {
+  FILE* f = fopen("/proc/self/clear_refs", "w");
+  if (f) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+size_t PeakRss() {
+  size_t kb = 0;
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      if (!strncmp(line, "VmHWM:", 6)) {
+        kb = strtoull(line + 6, nullptr, 10);
+        break;
+      }
+    }
+    fclose(f);
+  }
+  if (!kb) {
+    rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+      kb = ru.ru_maxrss;
+  }
+  return kb * 1024;
+}
+
+}  // namespace
+
+struct PipelineProgress::Row {
+  string name;
+  pb::Operator::Type type;
+  OperatorProgress::State state;
+  double elapsed_sec = 0, cpu_sec = 0;
+  size_t peak_rss = 0;
+  size_t tasks_total, tasks_done, bytes_total, bytes_done, records;
+  size_t output_bytes = 0, output_shards = 0;
+
+  double eta_sec = -1;  // negative if unknown.
+
+  double Rate(size_t val) const { return elapsed_sec > 0 ? val / elapsed_sec : 0; }
+};
+
+OperatorProgress::OperatorProgress(const pb::Operator& op)
+    : name_(op.op_name()), type_(op.type()) {}
+
+void OperatorProgress::SetFinalShards(std::vector<std::pair<ShardId, size_t>> shard_bytes) {
+  std::lock_guard<std::mutex> lk(shards_mu_);
+  final_shards_ = std::move(shard_bytes);
+}
+
+void PipelineProgress::Reset(const std::vector<const pb::Operator*>& ops, Runner* runner) {
+  std::lock_guard<std::mutex> lk(mu_);
+  ops_.clear();
+  for (const pb::Operator* op : ops) {
+    ops_.emplace_back(new OperatorProgress(*op));
+  }
+  runner_ = runner;
+  start_micros_ = GetMonotonicMicros();
+}
+
+void PipelineProgress::SetState(OperatorProgress* op, OperatorProgress::State state) {
+  uint64_t now = GetMonotonicMicros();
+  uint64_t cpu = ProcessCpuMicros();
+  if (state == OperatorProgress::RUNNING) {
+    ResetPeakRss();
+    op->start_cpu_micros_.store(cpu, memory_order_relaxed);
+    op->start_micros_.store(now, memory_order_relaxed);
+  } else if (op->start_micros_.load(memory_order_relaxed)) {
+    op->peak_rss_.store(PeakRss(), memory_order_relaxed);
+    op->end_cpu_micros_.store(cpu, memory_order_relaxed);
+    op->end_micros_.store(now, memory_order_relaxed);
+  }
+  op->state_.store(state, memory_order_release);
+}
+
+const char* PipelineProgress::StateName(OperatorProgress::State state) {
+  switch (state) {
+    case OperatorProgress::PENDING:
+      return "PENDING";
+    case OperatorProgress::RUNNING:
+      return "RUNNING";
+    case OperatorProgress::DONE:
+      return "DONE";
+    case OperatorProgress::RESUMED:
+      return "RESUMED";
+    case OperatorProgress::FUSED:
+      return "FUSED";
+    case OperatorProgress::SKIPPED:
+      return "SKIPPED";
+    case OperatorProgress::STOPPED:
+      return "STOPPED";
+  }
+  return "UNKNOWN";
+}
+
+auto PipelineProgress::Snapshot(std::vector<std::pair<ShardId, size_t>>* shards) const
+    -> std::vector<Row> {
+  std::vector<Row> res;
+  Runner* runner = nullptr;
+  size_t running = kuint64max, last_done = kuint64max;
+  uint64_t now = GetMonotonicMicros(), now_cpu = ProcessCpuMicros();
+
+  std::unique_lock<std::mutex> lk(mu_);
+  for (size_t i = 0; i < ops_.size(); ++i) {
+    OperatorProgress* op = ops_[i].get();
+    Row row;
+    row.name = op->name_;
+    row.type = op->type_;
+    row.state = op->state();
+
+    uint64_t start = op->start_micros_.load(memory_order_relaxed);
+    uint64_t end = op->end_micros_.load(memory_order_relaxed);
+    if (start) {
+      row.elapsed_sec = ((end ? end : now) - start) * 1e-6;
+
+      uint64_t start_cpu = op->start_cpu_micros_.load(memory_order_relaxed);
+      uint64_t end_cpu = end ? op->end_cpu_micros_.load(memory_order_relaxed) : now_cpu;
+      row.cpu_sec = end_cpu > start_cpu ? (end_cpu - start_cpu) * 1e-6 : 0;
+      row.peak_rss = op->peak_rss_.load(memory_order_relaxed);
+    }
+    row.tasks_total = op->tasks_total_.load(memory_order_relaxed);
+    row.tasks_done = op->tasks_done_.load(memory_order_relaxed);
+    row.bytes_total = op->bytes_total_.load(memory_order_relaxed);
+    row.bytes_done = op->bytes_done_.load(memory_order_relaxed);
+    row.records = op->records_.load(memory_order_relaxed);
+
+    if (row.state == OperatorProgress::RUNNING) {
+      running = i;
+
+      // Bytes are more precise than tasks, since the tasks differ in size.
+      double fraction = 0;
+      if (row.bytes_total) {
+        fraction = std::min(1.0, double(row.bytes_done) / row.bytes_total);
+      } else if (row.tasks_total) {
+        fraction = std::min(1.0, double(row.tasks_done) / row.tasks_total);
+      }
+      if (fraction > 0) {
+        row.eta_sec = row.elapsed_sec * (1 - fraction) / fraction;
+      }
+    } else {
+      std::lock_guard<std::mutex> shards_lk(op->shards_mu_);
+      if (!op->final_shards_.empty()) {
+        last_done = i;
+        row.output_shards = op->final_shards_.size();
+        for (const auto& k_v : op->final_shards_) {
+          row.output_bytes += k_v.second;
+        }
+      }
+    }
+    res.push_back(std::move(row));
+  }
+
+  if (running != kuint64max) {
+    runner = runner_;
+  } else if (last_done != kuint64max) {
+    std::lock_guard<std::mutex> shards_lk(ops_[last_done]->shards_mu_);
+    *shards = ops_[last_done]->final_shards_;
+  }
+  lk.unlock();
+
+  // The runner may block the calling fiber, hence it's called without holding mu_.
+  if (runner) {
+    *shards = runner->GetOutputShardBytes();
+    Row& row = res[running];
+    row.output_shards = shards->size();
+    for (const auto& k_v : *shards) {
+      row.output_bytes += k_v.second;
+    }
+  }
+
+  std::sort(shards->begin(), shards->end(),
+            [](const auto& l, const auto& r) { return l.second > r.second; });
+  return res;
+}
+
+string PipelineProgress::ToJson() const {
+  std::vector<std::pair<ShardId, size_t>> shards;
+  std::vector<Row> rows = Snapshot(&shards);
+
+  rj::StringBuffer sb;
+  rj::Writer<rj::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.Key("operators");
+  writer.StartArray();
+  for (const Row& row : rows) {
+    writer.StartObject();
+    writer.Key("name");
+    writer.String(row.name.c_str());
+    writer.Key("type");
+    writer.String(pb::Operator::Type_Name(row.type).c_str());
+    writer.Key("state");
+    writer.String(StateName(row.state));
+    writer.Key("elapsed_sec");
+    writer.Double(row.elapsed_sec);
+    writer.Key("cpu_sec");
+    writer.Double(row.cpu_sec);
+    writer.Key("peak_rss_bytes");
+    writer.Uint64(row.peak_rss);
+    writer.Key("tasks_total");
+    writer.Uint64(row.tasks_total);
+    writer.Key("tasks_done");
+    writer.Uint64(row.tasks_done);
+    writer.Key("bytes_total");
+    writer.Uint64(row.bytes_total);
+    writer.Key("bytes_done");
+    writer.Uint64(row.bytes_done);
+    writer.Key("records");
+    writer.Uint64(row.records);
+    writer.Key("bytes_per_sec");
+    writer.Double(row.Rate(row.bytes_done));
+    writer.Key("records_per_sec");
+    writer.Double(row.Rate(row.records));
+    writer.Key("output_bytes");
+    writer.Uint64(row.output_bytes);
+    writer.Key("output_shards");
+    writer.Uint64(row.output_shards);
+    if (row.eta_sec >= 0) {
+      writer.Key("eta_sec");
+      writer.Double(row.eta_sec);
+    }
+    writer.EndObject();
+  }
+  writer.EndArray();
+
+  writer.Key("shards");
+  writer.StartObject();
+  for (size_t i = 0; i < std::min(kMaxShardRows, shards.size()); ++i) {
+    writer.Key(shards[i].first.ToString("shard").c_str());
+    writer.Uint64(shards[i].second);
+  }
+  writer.EndObject();
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+string PipelineProgress::ToHtml() const {
+  using util::html::SortedTable;
+
+  std::vector<std::pair<ShardId, size_t>> shards;
+  std::vector<Row> rows = Snapshot(&shards);
+
+  string res = SortedTable::HtmlStart();
+  absl::StrAppend(&res, "<body>\n<h3>Pipeline, running for ",
+                  FormatSeconds((GetMonotonicMicros() - start_micros_) * 1e-6), "</h3>\n");
+
+  SortedTable::StartTable({"Operator", "Type", "State", "Elapsed", "CPU", "Peak RSS", "Tasks",
+                           "Input", "Records", "Input/s", "Records/s", "Output", "Shards", "ETA"},
+                          &res);
+  for (const Row& row : rows) {
+    string tasks = absl::StrCat(row.tasks_done, "/", row.tasks_total);
+    string input = row.bytes_total
+                       ? absl::StrCat(FormatBytes(row.bytes_done), "/", FormatBytes(row.bytes_total))
+                       : FormatBytes(row.bytes_done);
+    SortedTable::Row({row.name, pb::Operator::Type_Name(row.type), StateName(row.state),
+                      FormatSeconds(row.elapsed_sec), FormatSeconds(row.cpu_sec),
+                      row.peak_rss ? FormatBytes(row.peak_rss) : "-", tasks, input,
+                      absl::StrCat(row.records),
+                      FormatBytes(row.Rate(row.bytes_done)),
+                      absl::StrFormat("%.0f", row.Rate(row.records)),
+                      FormatBytes(row.output_bytes), absl::StrCat(row.output_shards),
+                      FormatSeconds(row.eta_sec)},
+                     &res);
+  }
+  SortedTable::EndTable(&res);
+
+  if (!shards.empty()) {
+    absl::StrAppend(&res, "<h4>Largest output shards</h4>\n");
+    SortedTable::StartTable({"Shard", "Bytes"}, &res);
+    for (size_t i = 0; i < std::min(kMaxShardRows, shards.size()); ++i) {
+      SortedTable::Row({shards[i].first.ToString("shard"), FormatBytes(shards[i].second)}, &res);
+    }
+    SortedTable::EndTable(&res);
+  }
+  res.append("</body></html>\n");
+
+  return res;
+}
+
+}  // namespace mr3
@@ -0,0 +1,102 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "mr/mr3.pb.h"
+#include "mr/mr_types.h"
+
+namespace mr3 {
+
+class Runner;
+
+/*
+  Progress of an operator during the pipeline run. The tasks are the input files of mappers
+  and the shards of joiners. The counters are updated by the executors from all IO threads.
+  In distributed runs the tasks of all the workers are counted, but only the tasks of this
+  process are done, hence its ETA is an upper bound. The operators run one at a time, so the
+  cpu time and the peak RSS of the process while it runs are attributed to the operator.
+*/
+class OperatorProgress {
+ public:
+  enum State { PENDING, RUNNING, DONE, RESUMED, FUSED, SKIPPED, STOPPED };
+
+  explicit OperatorProgress(const pb::Operator& op);
+
+  // Thread-safe. bytes is 0 if the task sizes are not known upfront.
+  void AddTasks(size_t count, size_t bytes) {
+    tasks_total_.fetch_add(count, std::memory_order_relaxed);
+    bytes_total_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  void TaskDone() { tasks_done_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Input bytes and records processed.
+  void AddBytes(size_t bytes) { bytes_done_.fetch_add(bytes, std::memory_order_relaxed); }
+  void AddRecords(size_t count) { records_.fetch_add(count, std::memory_order_relaxed); }
+
+  // Keeps the output shard sizes when the operator ends, see Runner::GetOutputShardBytes.
+  void SetFinalShards(std::vector<std::pair<ShardId, size_t>> shard_bytes);
+
+  const std::string& name() const { return name_; }
+  State state() const { return state_.load(std::memory_order_acquire); }
+
+ private:
+  friend class PipelineProgress;
+
+  std::string name_;
+  pb::Operator::Type type_;
+
+  std::atomic<State> state_{PENDING};
+  std::atomic<uint64_t> start_micros_{0}, end_micros_{0};
+  std::atomic<uint64_t> start_cpu_micros_{0}, end_cpu_micros_{0};
+  std::atomic<size_t> peak_rss_{0};  // set when the operator ends.
+
+  std::atomic<size_t> tasks_total_{0}, tasks_done_{0};
+  std::atomic<size_t> bytes_total_{0}, bytes_done_{0};
+  std::atomic<size_t> records_{0};
+
+  std::mutex shards_mu_;
+  std::vector<std::pair<ShardId, size_t>> final_shards_;
+};
+
+/*
+  Tracks the operators of a pipeline run for the /pipelinez page of PipelineMain. Operators
+  and rates are rendered from any thread while the pipeline runs.
+*/
+class PipelineProgress {
+ public:
+  // Starts tracking a new run. The runner must outlive the rendering calls.
+  void Reset(const std::vector<const pb::Operator*>& ops, Runner* runner);
+
+  // Returns the progress of the i-th operator passed to Reset.
+  OperatorProgress* op(size_t i) { return ops_[i].get(); }
+
+  // Called from the main thread, records the start and the end times of the operator.
+  void SetState(OperatorProgress* op, OperatorProgress::State state);
+
+  std::string ToJson() const;
+  std::string ToHtml() const;
+
+  static const char* StateName(OperatorProgress::State state);
+
+ private:
+  struct Row;
+
+  // Returns a snapshot of each operator and the output shards of the running one or the shards
+  // of the last finished operator.
+  std::vector<Row> Snapshot(std::vector<std::pair<ShardId, size_t>>* shards) const;
+
+  mutable std::mutex mu_;  // guards ops_ and runner_ against Reset.
+  std::vector<std::unique_ptr<OperatorProgress>> ops_;
+  Runner* runner_ = nullptr;
+  uint64_t start_micros_ = 0;
+};
+
+}  // namespace mr3
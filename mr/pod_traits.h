@@ -0,0 +1,140 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "base/hash.h"
+#include "base/logging.h"
+
+namespace mr3 {
+
+//! The prefix of pb::Output::type_name of the tables of PodTraits and PodTupleTraits records.
+constexpr char kPodTypePrefix[] = "pod:";
+
+namespace detail {
+
+//! Selects PodTraits for T. Pointers and string views are trivially copyable, but their copies
+//! do not outlive the process, hence their records must specify RecordTraits.
+//! Types that have partially specialized RecordTraits specialize it to false_type.
+template <typename T>
+struct IsPodRecord
+    : std::integral_constant<bool, std::is_trivially_copyable<T>::value &&
+                                       !std::is_pointer<T>::value &&
+                                       !std::is_same<T, absl::string_view>::value> {};
+
+template <typename... Ts> struct AllPodRecords : std::true_type {};
+template <typename T, typename... Ts>
+struct AllPodRecords<T, Ts...>
+    : std::integral_constant<bool, IsPodRecord<T>::value && AllPodRecords<Ts...>::value> {};
+
+//! Selects PodTupleTraits for the tuples and pairs of PodTraits records.
+template <typename T> struct IsPodTuple : std::false_type {};
+template <typename... Ts> struct IsPodTuple<std::tuple<Ts...>> : AllPodRecords<Ts...> {};
+template <typename A, typename B> struct IsPodTuple<std::pair<A, B>> : AllPodRecords<A, B> {};
+
+//! The schema of the record: its size and the mangled name of its type.
+template <typename T> std::string PodTypeName(size_t size) {
+  const char* name = typeid(T).name();
+  return absl::StrCat(kPodTypePrefix, size, ":", absl::Hex(base::Hash64(name, strlen(name))));
+}
+
+}  // namespace detail
+
+/*! Serializes trivially copyable records, e.g. structs of numbers or std::array of them,
+ *  as their object representation, which makes both Serialize and Parse a single memcpy.
+ *  RecordTraits<T> derives from PodTraits<T> unless T specifies its own traits.
+ *
+ *  The layout is the one of the compiler that built the pipeline, hence the records should be
+ *  read by a binary built by the same toolchain for the same architecture. TypeName() puts
+ *  the size and a hash of the type name into pb::Output::type_name and into the meta of
+ *  the LST files, which identifies the schema of the table. The records are binary and require
+ *  binary outputs, i.e. LST.
+ *
+ *  Handlers that take const T& view the records in place when they are aligned for T in
+ *  the input buffer, without copying them.
+ */
+template <typename T> class PodTraits {
+ public:
+  static std::string Serialize(bool is_binary, const T& t) {
+    CHECK(is_binary) << TypeName() << " records require a binary output format";
+    return std::string(reinterpret_cast<const char*>(&t), sizeof(T));
+  }
+
+  static bool Parse(bool is_binary, absl::string_view rv, T* res) {
+    if (!is_binary || rv.size() != sizeof(T))
+      return false;
+    memcpy(res, rv.data(), sizeof(T));
+    return true;
+  }
+
+  static bool Parse(bool is_binary, std::string&& tmp, T* res) {
+    return Parse(is_binary, absl::string_view(tmp), res);
+  }
+
+  //! Returns the record in rv or nullptr if rv is not aligned for T or does not hold T.
+  //! The record is valid as long as rv.
+  static const T* View(bool is_binary, absl::string_view rv) {
+    if (!is_binary || rv.size() != sizeof(T) ||
+        reinterpret_cast<uintptr_t>(rv.data()) % alignof(T) != 0)
+      return nullptr;
+    return reinterpret_cast<const T*>(rv.data());
+  }
+
+  static std::string TypeName() { return detail::PodTypeName<T>(sizeof(T)); }
+};
+
+/*! Serializes std::tuple and std::pair of PodTraits records as the concatenation of
+ *  the elements, without the padding between them.
+ */
+template <typename Tuple> class PodTupleTraits {
+  template <size_t... I> static constexpr size_t SizeOf(std::index_sequence<I...>) {
+    return (sizeof(std::tuple_element_t<I, Tuple>) + ... + 0);
+  }
+
+  using Indices = std::make_index_sequence<std::tuple_size<Tuple>::value>;
+
+ public:
+  static constexpr size_t kSize = SizeOf(Indices{});
+
+  static std::string Serialize(bool is_binary, const Tuple& t) {
+    CHECK(is_binary) << TypeName() << " records require a binary output format";
+    std::string res(kSize, '\0');
+    Copy(t, &res[0], Indices{});
+    return res;
+  }
+
+  static bool Parse(bool is_binary, absl::string_view rv, Tuple* res) {
+    if (!is_binary || rv.size() != kSize)
+      return false;
+    Copy(rv.data(), res, Indices{});
+    return true;
+  }
+
+  static bool Parse(bool is_binary, std::string&& tmp, Tuple* res) {
+    return Parse(is_binary, absl::string_view(tmp), res);
+  }
+
+  static std::string TypeName() { return detail::PodTypeName<Tuple>(kSize); }
+
+ private:
+  template <size_t... I> static void Copy(const Tuple& t, char* dest, std::index_sequence<I...>) {
+    ((memcpy(dest, &std::get<I>(t), sizeof(std::get<I>(t))), dest += sizeof(std::get<I>(t))),
+     ...);
+  }
+
+  template <size_t... I> static void Copy(const char* src, Tuple* t, std::index_sequence<I...>) {
+    ((memcpy(&std::get<I>(*t), src, sizeof(std::get<I>(*t))), src += sizeof(std::get<I>(*t))),
+     ...);
+  }
+};
+
+}  // namespace mr3
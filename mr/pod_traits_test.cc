@@ -0,0 +1,90 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#include "mr/pod_traits.h"
+
+#include <array>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace mr3 {
+
+using namespace std;
+
+struct Point {
+  int32_t x;
+  double y;
+};
+
+struct Other {
+  int32_t x;
+  double y;
+};
+
+static_assert(detail::IsPodRecord<Point>::value, "");
+static_assert(detail::IsPodRecord<array<Point, 3>>::value, "");
+static_assert(!detail::IsPodRecord<string>::value, "");
+static_assert(!detail::IsPodRecord<absl::string_view>::value, "");
+static_assert(!detail::IsPodRecord<const char*>::value, "");
+static_assert(detail::IsPodTuple<tuple<int64_t, Point>>::value, "");
+static_assert(detail::IsPodTuple<pair<int64_t, double>>::value, "");
+static_assert(!detail::IsPodTuple<pair<int64_t, string>>::value, "");
+
+class PodTraitsTest : public testing::Test {
+ protected:
+};
+
+TEST_F(PodTraitsTest, Struct) {
+  using RT = PodTraits<Point>;
+
+  string rec = RT::Serialize(true, Point{5, 1.5});
+  ASSERT_EQ(sizeof(Point), rec.size());
+
+  Point p{0, 0};
+  ASSERT_TRUE(RT::Parse(true, absl::string_view(rec), &p));
+  EXPECT_EQ(5, p.x);
+  EXPECT_EQ(1.5, p.y);
+  EXPECT_FALSE(RT::Parse(true, absl::string_view(rec).substr(1), &p));
+  EXPECT_FALSE(RT::Parse(false, absl::string_view(rec), &p));
+
+  // std::string buffers are aligned by the allocator.
+  const Point* view = RT::View(true, rec);
+  ASSERT_TRUE(view != nullptr);
+  EXPECT_EQ(rec.data(), reinterpret_cast<const char*>(view));
+  EXPECT_EQ(5, view->x);
+
+  string unaligned = "a" + rec;
+  EXPECT_TRUE(RT::View(true, absl::string_view(unaligned).substr(1)) == nullptr);
+  ASSERT_TRUE(RT::Parse(true, absl::string_view(unaligned).substr(1), &p));
+  EXPECT_EQ(1.5, p.y);
+}
+
+TEST_F(PodTraitsTest, Tuple) {
+  using Tuple = tuple<int64_t, Point, uint8_t>;
+  using RT = PodTupleTraits<Tuple>;
+
+  // The elements are packed.
+  string rec = RT::Serialize(true, Tuple{7, Point{1, 2}, 3});
+  EXPECT_EQ(sizeof(int64_t) + sizeof(Point) + 1, rec.size());
+
+  Tuple t;
+  ASSERT_TRUE(RT::Parse(true, std::move(rec), &t));
+  EXPECT_EQ(7, get<0>(t));
+  EXPECT_EQ(2, get<1>(t).y);
+  EXPECT_EQ(3, get<2>(t));
+  EXPECT_FALSE(RT::Parse(true, absl::string_view("abc"), &t));
+}
+
+TEST_F(PodTraitsTest, TypeName) {
+  string name = PodTraits<Point>::TypeName();
+  EXPECT_EQ(0, name.find(kPodTypePrefix)) << name;
+  EXPECT_EQ(name, PodTraits<Point>::TypeName());
+
+  // Same layout, different types.
+  EXPECT_NE(name, PodTraits<Other>::TypeName());
+  EXPECT_NE(PodTraits<int32_t>::TypeName(), PodTraits<uint32_t>::TypeName());
+}
+
+}  // namespace mr3
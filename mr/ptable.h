@@ -13,7 +13,9 @@
 
 #include "base/type_traits.h"
 #include "mr/do_context.h"
+#include "mr/impl/dedup_filter.h"
 #include "mr/impl/table_impl.h"
+#include "mr/impl/top_k.h"
 #include "mr/mr_types.h"
 #include "mr/output.h"
 
@@ -81,8 +83,79 @@ template <typename OutT> class PTable {
     return impl_->BindWith(ptr);
   }
 
+  //! Binds the table in sort-merge mode: key_fn(const OutT&) extracts the key the shard
+  //! records are sorted by before they are passed to the handler.
+  template <typename Handler, typename ToType, typename U, typename KeyFn>
+  detail::HandlerBinding<Handler, ToType> BindWith(EmitMemberFn<U, Handler, ToType> ptr,
+                                                   KeyFn&& key_fn) const {
+    return impl_->BindWith(ptr, std::forward<KeyFn>(key_fn));
+  }
+
+  /** Selects the k records of the highest score_fn(const OutT&), which returns a double.
+   *  Every mapper keeps its own top k records and only those are merged, in a single shard,
+   *  hence the input is not re-sharded. The records are written by descending score.
+   */
+  template <typename ScoreFn>
+  PTable<OutT> TopK(const std::string& name, size_t k, ScoreFn&& score_fn) const {
+    return SelectTopK(name, k, std::forward<ScoreFn>(score_fn), false, nullptr, 1);
+  }
+
+  /** Same as TopK for each key_fn(const OutT&), which returns a string. The partial results
+   *  are sharded by key into modn shards.
+   */
+  template <typename KeyFn, typename ScoreFn>
+  PTable<OutT> TopKPerKey(const std::string& name, size_t k, KeyFn&& key_fn, ScoreFn&& score_fn,
+                          unsigned modn = 16) const {
+    return SelectTopK(name, k, std::forward<ScoreFn>(score_fn), false,
+                      std::forward<KeyFn>(key_fn), modn);
+  }
+
+  /** Selects a uniform sample of k records without replacement, or all the records if there
+   *  are fewer. Like TopK, the mappers sample their inputs and the samples are merged.
+   */
+  PTable<OutT> Sample(const std::string& name, size_t k) const {
+    return SelectTopK(name, k, nullptr, true, nullptr, 1);
+  }
+
+  /** Weighted sample of k records without replacement: a record is more likely to be selected
+   *  in proportion to weight_fn(const OutT&). Records of non-positive weights are skipped.
+   */
+  template <typename WeightFn>
+  PTable<OutT> Sample(const std::string& name, size_t k, WeightFn&& weight_fn) const {
+    return SelectTopK(name, k, std::forward<WeightFn>(weight_fn), true, nullptr, 1);
+  }
+
+  //! Uniform sample of k records for each key_fn(const OutT&), see TopKPerKey.
+  template <typename KeyFn>
+  PTable<OutT> SamplePerKey(const std::string& name, size_t k, KeyFn&& key_fn,
+                            unsigned modn = 16) const {
+    return SelectTopK(name, k, nullptr, true, std::forward<KeyFn>(key_fn), modn);
+  }
+
+  /** Keeps a single record for each key_fn(const OutT&), which returns a string, sharded by
+   *  key into modn shards. The mappers drop the duplicates they have seen recently before the
+   *  shuffle, filtering the keys with a Bloom filter first, and the survivors are deduplicated
+   *  exactly when they are merged. With shared_filter the mappers of all the IO threads share
+   *  a single, larger filter instead of their own ones.
+   */
+  template <typename KeyFn>
+  PTable<OutT> Distinct(const std::string& name, KeyFn&& key_fn, unsigned modn = 16,
+                        bool shared_filter = false) const {
+    return SelectDistinct(name, std::forward<KeyFn>(key_fn), modn, shared_filter);
+  }
+
   template <typename U> PTable<U> As() const { return PTable<U>{impl_->template Rebind<U>()}; }
 
+  /** Runs the DoFns of the map that produces the table on num_threads compute threads,
+   *  by default one per cpu, instead of the IO threads that read its input. Suits CPU-heavy
+   *  mappers, which otherwise delay the reads and the other fibers of the IO threads.
+   */
+  PTable<OutT>& WithComputePool(unsigned num_threads = 0) {
+    CHECK(impl_->op().type() == pb::Operator::MAP) << "Only the map operators use compute pools";
+    impl_->mutable_op()->set_compute_threads(num_threads);
+    return *this;
+  }
+
   PTable<rapidjson::Document> AsJson() const { return As<rapidjson::Document>(); }
 
  protected:
@@ -90,6 +163,17 @@ template <typename OutT> class PTable {
 
   explicit PTable(std::shared_ptr<TableImpl> impl) : impl_(std::move(impl)) {}
 
+  // Maps the input into the partial top k records of every mapper, written with their scores
+  // as name_partial, and merges them with a join.
+  PTable<OutT> SelectTopK(const std::string& name, size_t k,
+                          std::function<double(const OutT&)> score, bool sample,
+                          std::function<std::string(const OutT&)> key, unsigned modn) const;
+
+  // Maps the input into its records of the keys not seen recently, written as name_partial,
+  // and drops the remaining duplicates with a join.
+  PTable<OutT> SelectDistinct(const std::string& name, std::function<std::string(const OutT&)> key,
+                              unsigned modn, bool shared_filter) const;
+
   std::shared_ptr<TableImpl> impl_;
 };
 
@@ -111,16 +195,126 @@ PTable<typename detail::MapperTraits<MapType>::OutputType> PTable<OutT>::Map(
   return PTable<NewOutType>{std::move(res)};
 }
 
+template <typename OutT>
+PTable<OutT> PTable<OutT>::SelectTopK(const std::string& name, size_t k,
+                                      std::function<double(const OutT&)> score, bool sample,
+                                      std::function<std::string(const OutT&)> key,
+                                      unsigned modn) const {
+  using Partial = detail::Scored<OutT>;
+  CHECK_GT(k, 0);
+
+  auto spec = std::make_shared<detail::TopKSpec<OutT>>();
+  spec->k = k;
+  spec->score = std::move(score);
+  spec->sample = sample;
+  spec->key = std::move(key);
+  std::shared_ptr<const detail::TopKSpec<OutT>> cspec = spec;
+
+  const std::string partial_name = name + "_partial";
+  PTable<Partial> partial = Map<detail::TopKMapper<OutT>>(partial_name, cspec);
+  Output<Partial>& out = partial.Write(partial_name, pb::WireFormat::LST);
+  if (cspec->key) {
+    out.WithHashSharding(modn, [cspec](const Partial& p) { return cspec->key(p.val); });
+  } else {
+    out.WithModNSharding(1, [](const Partial&) { return 0; });
+  }
+
+  using Merger = detail::TopKMerger<OutT>;
+  auto res = detail::TableImplT<OutT>::template AsGroup<Merger>(
+      name, {partial.BindWith(&Merger::On)}, impl_->pipeline(), cspec);
+  return PTable<OutT>{std::move(res)};
+}
+
+template <typename OutT>
+PTable<OutT> PTable<OutT>::SelectDistinct(const std::string& name,
+                                          std::function<std::string(const OutT&)> key,
+                                          unsigned modn, bool shared_filter) const {
+  auto spec = std::make_shared<detail::DedupSpec<OutT>>();
+  spec->key = std::move(key);
+  if (shared_filter) {
+    spec->shared_filter =
+        std::make_shared<detail::DedupBloomFilter>(OutputBase::kDefaultCombineKeys * 256);
+  }
+  std::shared_ptr<const detail::DedupSpec<OutT>> cspec = spec;
+
+  const std::string partial_name = name + "_partial";
+  PTable<OutT> partial = Map<detail::DedupMapper<OutT>>(partial_name, cspec);
+  partial.Write(partial_name, pb::WireFormat::LST)
+      .WithHashSharding(modn, [cspec](const OutT& val) { return cspec->key(val); });
+
+  using Merger = detail::DedupMerger<OutT>;
+  auto res = detail::TableImplT<OutT>::template AsGroup<Merger>(
+      name, {partial.BindWith(&Merger::On)}, impl_->pipeline(), cspec);
+  return PTable<OutT>{std::move(res)};
+}
+
+/*! Documents are parsed in-situ, i.e. their strings point into the buffer of the traits.
+ *  Hence a parsed document is valid only until the following Parse call.
+ */
 template <> class RecordTraits<rapidjson::Document> {
   std::string tmp_;
   rapidjson::StringBuffer sb_;  // Used by serialize.
 
+  bool ParseInsitu(rapidjson::Document* res);
+
  public:
   RecordTraits(const RecordTraits& r) {}  // we do not copy temporary fields.
   RecordTraits() {}
 
   std::string Serialize(bool is_binary, const rapidjson::Document& doc);
   bool Parse(bool is_binary, std::string&& tmp, rapidjson::Document* res);
+
+  // Copies the record into the buffer that is reused across the records.
+  bool Parse(bool is_binary, absl::string_view rv, rapidjson::Document* res);
 };
 
+namespace detail {
+
+//! Memory pool of rapidjson documents that is cleared every few records,
+//! see --map_json_pool_kb.
+class JsonPool {
+ public:
+  JsonPool();
+  ~JsonPool();
+
+  rapidjson::MemoryPoolAllocator<>* allocator() { return alloc_.get(); }
+
+  // Called after each record.
+  void Done() {
+    if (++records_ >= kResetRecords) {
+      Reset();
+    }
+  }
+
+ private:
+  static constexpr unsigned kResetRecords = 128;
+
+  void Reset();
+
+  std::unique_ptr<char[]> initial_block_;
+  std::unique_ptr<rapidjson::MemoryPoolAllocator<>> alloc_;
+  unsigned records_ = 0;
+};
+
+//! Parses documents of handlers that take them by const reference on a pool shared by the
+//! records. Otherwise each document allocates its own allocator and its first memory chunk.
+template <> class RecordAllocator<rapidjson::Document> {
+ public:
+  rapidjson::Document* New() {
+    doc_.emplace(pool_.allocator());
+    return &*doc_;
+  }
+
+  void Done() {
+    doc_.reset();
+    pool_.Done();
+  }
+
+ private:
+  JsonPool pool_;
+  absl::optional<rapidjson::Document> doc_;
+};
+
+}  // namespace detail
+
 }  // namespace mr3
@@ -3,7 +3,10 @@
 //
 #pragma once
 
+#include <memory>
+
 #include "absl/container/flat_hash_map.h"
+#include "base/integral_types.h"
 #include "mr/mr3.pb.h"
 #include "mr/mr_types.h"
 
@@ -16,8 +19,19 @@ using ShardFileMap = absl::flat_hash_map<ShardId, std::string>;
 
 class RawContext;
 
+namespace detail {
+class ShardGate;
+}  // namespace detail
+
 class Runner {
  public:
+  // Read statistics of the input files, see file::FiberReadOptions::Stats.
+  struct ReadStats {
+    size_t cache_bytes = 0;  // served from the prefetched data without waiting.
+    size_t disk_bytes = 0;   // read while the reading fiber waited for the disk.
+    size_t preempt_cnt = 0;  // how many times the reading fiber waited for the disk.
+  };
+
   virtual ~Runner();
 
   virtual void Init() = 0;
@@ -32,14 +46,82 @@ class Runner {
 
   virtual void OperatorEnd(ShardFileMap* out_files) = 0;
 
+  // Like OperatorEnd, but may close the output shards in the background. out_files is filled
+  // before returning, and every shard glob is reported to gate once its files are complete.
+  // Only runners whose single process writes the shards may support it. The default
+  // implementation calls OperatorEnd and then closes the gate.
+  virtual void OperatorEndAsync(ShardFileMap* out_files, std::shared_ptr<detail::ShardGate> gate);
+
+  // The tasks of an operator - its input files for mappers or its shards for joiners - are
+  // indexed [0, num_tasks) in the same order by every process running the pipeline.
+  // Sets *task to the next task this process should run and returns true, or returns false
+  // if no tasks are left. claimed is the number of tasks this process has claimed so far in
+  // the current operator. Called from the main thread between OperatorStart and OperatorEnd.
+  // The default implementation runs all the tasks in this process.
+  virtual bool NextTask(size_t num_tasks, size_t claimed, size_t* task);
+
+  // Persists the checkpoint of an operator that has just finished. Called from the main thread
+  // after OperatorEnd. The default implementation does not support checkpoints.
+  virtual void SaveCheckpoint(const pb::Operator& op, const pb::OperatorCheckpoint& cp) {}
+
+  // Loads the checkpoint saved by a previous run of op. Returns false if there is none.
+  // Called from the main thread before OperatorStart.
+  virtual bool LoadCheckpoint(const pb::Operator& op, pb::OperatorCheckpoint* cp) {
+    return false;
+  }
+
+  // Loads the manifest saved by the previous run of the incremental operator op, see
+  // Pipeline::MergeIncremental, and keeps the output files of that run aside, so that op can
+  // read them while it rewrites its output. The shards of the manifest point to the kept files.
+  // Returns false if there is none. Called from the main thread before the operators start.
+  // The default implementation does not support incremental runs.
+  virtual bool LoadManifest(const pb::Operator& op, pb::IncrementalManifest* manifest) {
+    return false;
+  }
+
+  // Persists the manifest of op once it has finished. The files kept by LoadManifest may be
+  // deleted then.
+  virtual void SaveManifest(const pb::Operator& op, const pb::IncrementalManifest& manifest) {}
+
   using ExpandCb = std::function<void(size_t file_size, const std::string&)>;
 
   virtual void ExpandGlob(const std::string& glob, ExpandCb cb) = 0;
 
   // Read file and fill queue. This function must be fiber-friendly.
   // Returns number of records processed.
-  virtual size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+  virtual size_t ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                                   RawSinkCb cb) = 0;
+
+  // Returns true if the file can be processed in parallel by calling ProcessInputRange
+  // on disjoint byte ranges. Must be fiber-friendly.
+  virtual bool IsSplittable(const std::string& filename, const pb::WireFormat& wf) {
+    return false;
+  }
+
+  // Processes records that start inside [offset, offset + length) of the file.
+  // Called only for splittable files. Returns number of records processed.
+  virtual size_t ProcessInputRange(const std::string& filename, const pb::WireFormat& wf,
+                                   size_t offset, size_t length, RawSinkCb cb);
+
+  // Processes the records of the file in batches that share one buffer per batch. Avoids
+  // allocating each record separately. Processes the whole file if length is kuint64max and
+  // the range [offset, offset + length) otherwise.
+  // The default implementation packs the records of ProcessInputFile/ProcessInputRange.
+  virtual size_t ProcessInputBatches(const std::string& filename, const pb::WireFormat& wf,
+                                     size_t offset, size_t length, RawBatchSinkCb cb);
+
+  // Returns the totals of the files read so far by the calling thread, including the files
+  // that are being read. Remote files and runners that do not track reads report zeroes.
+  virtual ReadStats GetReadStats() { return ReadStats{}; }
+
+  // Returns the raw bytes written into each output shard of the current operator so far.
+  // Thread-safe, may block the calling fiber. Runners that do not track writes return none.
+  virtual std::vector<std::pair<ShardId, size_t>> GetOutputShardBytes() { return {}; }
+
+  // Returns what was written into the output shards of the last operator that OperatorEnd
+  // closed, file sizes included. Empty if its output was closed by OperatorEndAsync, and for
+  // runners whose shards are written by other processes too.
+  virtual std::vector<std::pair<ShardId, pb::ShardStats>> GetClosedShardStats() { return {}; }
 };
 
 }  // namespace mr3
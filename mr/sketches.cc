@@ -0,0 +1,244 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/sketches.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "base/hash.h"
+#include "base/integral_types.h"
+#include "base/logging.h"
+
+namespace mr3 {
+
+using namespace std;
+
+namespace {
+
+// Finalizer of splitmix64, spreads integer keys over all the bits.
+inline uint64_t Mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+inline uint64_t HashKey(absl::string_view key) {
+  return base::Fingerprint(key.data(), key.size());
+}
+
+template <typename S> const S& CheckedCast(const Sketch& other) {
+  const S* res = dynamic_cast<const S*>(&other);
+  CHECK(res) << "Can not merge sketches of different types";
+  return *res;
+}
+
+}  // namespace
+
+/* HyperLogLog
+********************************************/
+
+HyperLogLog::HyperLogLog(unsigned precision) : precision_(precision) {
+  CHECK(precision >= 4 && precision <= 18) << precision;
+  registers_.resize(1U << precision);
+}
+
+void HyperLogLog::Add(absl::string_view key) { AddHash(HashKey(key)); }
+
+void HyperLogLog::Add(uint64_t key) { AddHash(Mix64(key)); }
+
+void HyperLogLog::AddHash(uint64_t hash) {
+  uint64_t index = hash >> (64 - precision_);
+  uint64_t rest = hash << precision_;
+
+  // The position of the first set bit in the rest of the hash.
+  uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - precision_ + 1;
+  registers_[index] = std::max(registers_[index], rank);
+}
+
+double HyperLogLog::Estimate() const {
+  const double m = registers_.size();
+  double sum = 0;
+  unsigned zeros = 0;
+  for (uint8_t reg : registers_) {
+    sum += std::ldexp(1.0, -reg);
+    zeros += (reg == 0);
+  }
+
+  double alpha = 0.7213 / (1 + 1.079 / m);
+  double res = alpha * m * m / sum;
+
+  // Linear counting is more precise for small cardinalities.
+  if (res <= 2.5 * m && zeros) {
+    res = m * std::log(m / zeros);
+  }
+  return res;
+}
+
+void HyperLogLog::Merge(const Sketch& other) {
+  const HyperLogLog& o = CheckedCast<HyperLogLog>(other);
+  CHECK_EQ(precision_, o.precision_);
+
+  for (size_t i = 0; i < registers_.size(); ++i) {
+    registers_[i] = std::max(registers_[i], o.registers_[i]);
+  }
+}
+
+/* CountMinSketch
+********************************************/
+
+CountMinSketch::CountMinSketch(unsigned width, unsigned depth) : width_(width), depth_(depth) {
+  CHECK_GT(width, 0);
+  CHECK_GT(depth, 0);
+  counters_.resize(size_t(width) * depth);
+}
+
+void CountMinSketch::Add(absl::string_view key, uint64_t count) { AddHash(HashKey(key), count); }
+
+void CountMinSketch::Add(uint64_t key, uint64_t count) { AddHash(Mix64(key), count); }
+
+uint64_t CountMinSketch::Estimate(absl::string_view key) const {
+  return EstimateHash(HashKey(key));
+}
+
+uint64_t CountMinSketch::Estimate(uint64_t key) const { return EstimateHash(Mix64(key)); }
+
+// The rows use hashes h1 + i * h2 derived from the single key hash.
+void CountMinSketch::AddHash(uint64_t hash, uint64_t count) {
+  uint64_t h1 = uint32_t(hash), h2 = (hash >> 32) | 1;
+  for (unsigned i = 0; i < depth_; ++i) {
+    counters_[size_t(i) * width_ + (h1 + i * h2) % width_] += count;
+  }
+  total_ += count;
+}
+
+uint64_t CountMinSketch::EstimateHash(uint64_t hash) const {
+  uint64_t h1 = uint32_t(hash), h2 = (hash >> 32) | 1;
+  uint64_t res = kuint64max;
+  for (unsigned i = 0; i < depth_; ++i) {
+    res = std::min(res, counters_[size_t(i) * width_ + (h1 + i * h2) % width_]);
+  }
+  return res;
+}
+
+void CountMinSketch::Merge(const Sketch& other) {
+  const CountMinSketch& o = CheckedCast<CountMinSketch>(other);
+  CHECK_EQ(width_, o.width_);
+  CHECK_EQ(depth_, o.depth_);
+
+  for (size_t i = 0; i < counters_.size(); ++i) {
+    counters_[i] += o.counters_[i];
+  }
+  total_ += o.total_;
+}
+
+/* QuantileSketch
+********************************************/
+
+QuantileSketch::QuantileSketch(unsigned k) : k_(k) {
+  CHECK_GE(k, 2);
+  Grow();
+}
+
+size_t QuantileSketch::Capacity(unsigned level) const {
+  unsigned depth = compactors_.size() - level - 1;
+  return std::max<size_t>(2, std::ceil(k_ * std::pow(2.0 / 3, depth)));
+}
+
+void QuantileSketch::Grow() {
+  compactors_.emplace_back();
+  max_size_ = 0;
+  for (unsigned h = 0; h < compactors_.size(); ++h) {
+    max_size_ += Capacity(h);
+  }
+}
+
+void QuantileSketch::Add(double val) {
+  compactors_[0].push_back(val);
+  ++count_;
+  if (++size_ >= max_size_)
+    Compress();
+}
+
+// Compacts the levels that reached their capacity: sorts the values and promotes either the odd
+// or the even ones to the next level, where each of them represents twice as many values.
+void QuantileSketch::Compress() {
+  for (unsigned h = 0; h < compactors_.size(); ++h) {
+    if (compactors_[h].size() < Capacity(h))
+      continue;
+
+    if (h + 1 == compactors_.size())
+      Grow();
+
+    vector<double>& level = compactors_[h];
+    std::sort(level.begin(), level.end());
+
+    // An odd value out stays in this level to keep the total weight.
+    bool odd = level.size() % 2;
+    double last = odd ? level.back() : 0;
+    if (odd)
+      level.pop_back();
+
+    coin_ ^= coin_ << 13;
+    coin_ ^= coin_ >> 17;
+    coin_ ^= coin_ << 5;
+
+    vector<double>& next = compactors_[h + 1];
+    for (size_t i = coin_ & 1; i < level.size(); i += 2) {
+      next.push_back(level[i]);
+    }
+    size_ -= level.size() / 2;
+    level.clear();
+    if (odd)
+      level.push_back(last);
+
+    if (size_ < max_size_)
+      break;
+  }
+}
+
+double QuantileSketch::Quantile(double q) const {
+  CHECK_GT(count_, 0);
+
+  vector<pair<double, uint64_t>> weighted;
+  weighted.reserve(size_);
+  for (unsigned h = 0; h < compactors_.size(); ++h) {
+    for (double val : compactors_[h]) {
+      weighted.emplace_back(val, uint64_t(1) << h);
+    }
+  }
+  std::sort(weighted.begin(), weighted.end());
+
+  double target = std::min(std::max(q, 0.0), 1.0) * count_;
+  uint64_t rank = 0;
+  for (const auto& val_weight : weighted) {
+    rank += val_weight.second;
+    if (rank >= target)
+      return val_weight.first;
+  }
+  return weighted.back().first;
+}
+
+void QuantileSketch::Merge(const Sketch& other) {
+  const QuantileSketch& o = CheckedCast<QuantileSketch>(other);
+  CHECK_EQ(k_, o.k_);
+
+  while (compactors_.size() < o.compactors_.size()) {
+    Grow();
+  }
+
+  for (unsigned h = 0; h < o.compactors_.size(); ++h) {
+    compactors_[h].insert(compactors_[h].end(), o.compactors_[h].begin(), o.compactors_[h].end());
+  }
+  count_ += o.count_;
+  size_ += o.size_;
+
+  while (size_ >= max_size_) {
+    Compress();
+  }
+}
+
+}  // namespace mr3
@@ -0,0 +1,106 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace mr3 {
+
+/** Approximate statistics that are computed by each IO thread separately and merged at the end
+ *  of the operator. Unlike frequency maps, their size does not depend on the number of keys.
+ *  See RawContext::GetSketch.
+ */
+class Sketch {
+ public:
+  virtual ~Sketch() {}
+
+  // other must be of the same type and must have been created with the same parameters.
+  virtual void Merge(const Sketch& other) = 0;
+};
+
+// Estimates the number of distinct keys.
+class HyperLogLog : public Sketch {
+ public:
+  // Uses 2^precision registers of 1 byte. The standard error of the estimate is about
+  // 1.04 / sqrt(2^precision), i.e. 0.8% for the default precision.
+  explicit HyperLogLog(unsigned precision = 14);
+
+  void Add(absl::string_view key);
+  void Add(uint64_t key);
+
+  double Estimate() const;
+
+  void Merge(const Sketch& other) final;
+
+  unsigned precision() const { return precision_; }
+
+ private:
+  void AddHash(uint64_t hash);
+
+  unsigned precision_;
+  std::vector<uint8_t> registers_;
+};
+
+// Estimates the counts of keys. The estimate is never below the real count and exceeds it
+// by at most e * total() / width with the probability of 1 - exp(-depth).
+class CountMinSketch : public Sketch {
+ public:
+  explicit CountMinSketch(unsigned width = 1 << 14, unsigned depth = 4);
+
+  void Add(absl::string_view key, uint64_t count = 1);
+  void Add(uint64_t key, uint64_t count = 1);
+
+  uint64_t Estimate(absl::string_view key) const;
+  uint64_t Estimate(uint64_t key) const;
+
+  // The sum of all the added counts.
+  uint64_t total() const { return total_; }
+
+  void Merge(const Sketch& other) final;
+
+ private:
+  void AddHash(uint64_t hash, uint64_t count);
+  uint64_t EstimateHash(uint64_t hash) const;
+
+  unsigned width_, depth_;
+  uint64_t total_ = 0;
+  std::vector<uint64_t> counters_;  // depth_ rows of width_ counters.
+};
+
+// Estimates the quantiles of a stream of values using KLL sketch. Keeps O(k) values,
+// the rank error of the estimates is below 1% with high probability for the default k.
+class QuantileSketch : public Sketch {
+ public:
+  explicit QuantileSketch(unsigned k = 200);
+
+  void Add(double val);
+
+  // Returns the value whose rank is closest to q * count(), q in [0, 1].
+  // Must not be called on an empty sketch.
+  double Quantile(double q) const;
+
+  uint64_t count() const { return count_; }
+
+  void Merge(const Sketch& other) final;
+
+ private:
+  // The capacity of the compactor at level.
+  size_t Capacity(unsigned level) const;
+  void Grow();
+  void Compress();
+
+  unsigned k_;
+  uint64_t count_ = 0;
+  size_t size_ = 0;  // number of values kept in all the compactors.
+  size_t max_size_ = 0;
+  uint32_t coin_ = 0x9E3779B9;  // xorshift state that chooses which half is compacted.
+
+  // The values at level i represent 2^i values each.
+  std::vector<std::vector<double>> compactors_;
+};
+
+}  // namespace mr3
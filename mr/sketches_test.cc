@@ -0,0 +1,98 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#include "mr/sketches.h"
+
+#include <algorithm>
+#include <random>
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace mr3 {
+
+using namespace std;
+
+class SketchesTest : public testing::Test {
+ protected:
+};
+
+TEST_F(SketchesTest, HyperLogLog) {
+  HyperLogLog hll1, hll2;
+  EXPECT_EQ(0, hll1.Estimate());
+
+  for (unsigned i = 0; i < 100000; ++i) {
+    hll1.Add(absl::StrCat("key", i));
+    hll1.Add(absl::StrCat("key", i));  // duplicates do not count.
+    hll2.Add(absl::StrCat("key", i + 50000));
+  }
+  EXPECT_NEAR(100000, hll1.Estimate(), 3000);
+
+  hll1.Merge(hll2);
+  EXPECT_NEAR(150000, hll1.Estimate(), 4500);
+
+  HyperLogLog small;
+  for (uint64_t i = 0; i < 100; ++i) {
+    small.Add(i);
+  }
+  EXPECT_NEAR(100, small.Estimate(), 3);
+}
+
+TEST_F(SketchesTest, CountMin) {
+  CountMinSketch cms1(1024, 4), cms2(1024, 4);
+  for (unsigned i = 0; i < 10000; ++i) {
+    cms1.Add(absl::StrCat("key", i % 1000));
+  }
+  cms2.Add("hot", 5000);
+  cms2.Add(uint64_t(42), 7);
+
+  cms1.Merge(cms2);
+  EXPECT_EQ(15007, cms1.total());
+  EXPECT_GE(cms1.Estimate("hot"), 5000);
+  EXPECT_LE(cms1.Estimate("hot"), 5000 + 2.72 * 15007 / 1024);
+  EXPECT_GE(cms1.Estimate(uint64_t(42)), 7);
+
+  for (unsigned i = 0; i < 1000; ++i) {
+    uint64_t est = cms1.Estimate(absl::StrCat("key", i));
+    EXPECT_GE(est, 10);
+    EXPECT_LE(est, 10 + 2.72 * 15007 / 1024);
+  }
+}
+
+TEST_F(SketchesTest, Quantiles) {
+  std::mt19937_64 rnd(10);
+  vector<double> values(200000);
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = i;
+  }
+  std::shuffle(values.begin(), values.end(), rnd);
+
+  QuantileSketch q1, q2;
+  for (size_t i = 0; i < values.size(); ++i) {
+    (i % 3 ? q1 : q2).Add(values[i]);
+  }
+  q1.Merge(q2);
+  EXPECT_EQ(values.size(), q1.count());
+
+  // The ranks of the estimates are within 1% of the requested ones.
+  const double kMaxErr = values.size() * 0.01;
+  for (double q : {0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99}) {
+    EXPECT_NEAR(q * values.size(), q1.Quantile(q), kMaxErr) << q;
+  }
+  EXPECT_NEAR(0, q1.Quantile(0), kMaxErr);
+  EXPECT_NEAR(values.size(), q1.Quantile(1), kMaxErr);
+
+  QuantileSketch single;
+  single.Add(5);
+  EXPECT_EQ(5, single.Quantile(0.5));
+}
+
+TEST_F(SketchesTest, MergeTypeMismatch) {
+  HyperLogLog hll;
+  CountMinSketch cms;
+  EXPECT_DEATH(hll.Merge(cms), "different types");
+}
+
+}  // namespace mr3
@@ -2,7 +2,11 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 #include "mr/test_utils.h"
+
+#include <algorithm>
+
 #include "base/logging.h"
+#include "mr/impl/shard_gate.h"
 
 namespace mr3 {
 using namespace std;
@@ -22,6 +26,12 @@ void TestContext::WriteInternal(const ShardId& shard_id, string&& record) {
   outp_ss_.s_out[shard_id].push_back(record);
 }
 
+void TestContext::WriteSortedInternal(const ShardId& shard_id, string&& key, string&& record) {
+  lock_guard<fibers::mutex> lk(outp_ss_.mu);
+  CHECK(!outp_ss_.is_finished);
+  outp_ss_.sorted_out[shard_id].emplace_back(std::move(key), std::move(record));
+}
+
  void TestContext::Flush() {
    runner_->parse_errors += parse_errors();
    runner_->write_calls += item_writes();
@@ -29,7 +39,10 @@ void TestContext::WriteInternal(const ShardId& shard_id, string&& record) {
 
 void TestRunner::Init() {}
 
-void TestRunner::Shutdown() {}
+void TestRunner::Shutdown() {
+  if (closer_.joinable())
+    closer_.join();
+}
 
 RawContext* TestRunner::CreateContext() {
   CHECK(!op_->output().name().empty());
@@ -41,6 +54,16 @@ RawContext* TestRunner::CreateContext() {
   return new TestContext(this, res.get());
 }
 
+void TestRunner::OperatorStart(const pb::Operator* op) {
+  op_ = op;
+
+  // The output is rewritten by a rerun of the pipeline.
+  auto it = out_fs_.find(op->output().name());
+  if (it != out_fs_.end() && it->second->is_finished) {
+    out_fs_.erase(it);
+  }
+}
+
 void TestRunner::ExpandGlob(const string& glob, ExpandCb cb) {
   auto it = input_fs_.find(glob);
   CHECK(it != input_fs_.end()) << "Missing test file " << glob;
@@ -55,6 +78,18 @@ void TestRunner::OperatorEnd(ShardFileMap* out_files) {
   CHECK(it != out_fs_.end());
   it->second->is_finished = true;
 
+  for (auto& k_v : it->second->sorted_out) {
+    auto& records = k_v.second;
+    std::stable_sort(records.begin(), records.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    auto& dest = it->second->s_out[k_v.first];
+    for (auto& key_val : records) {
+      dest.push_back(std::move(key_val.second));
+    }
+  }
+  it->second->sorted_out.clear();
+
   for (const auto& k_v : it->second->s_out) {
     string name = last_out_name_ + "/" + k_v.first.ToString("shard");
     out_files->emplace(k_v.first, name);
@@ -63,8 +98,43 @@ void TestRunner::OperatorEnd(ShardFileMap* out_files) {
   op_ = nullptr;
 }
 
+void TestRunner::OperatorEndAsync(ShardFileMap* out_files,
+                                  std::shared_ptr<detail::ShardGate> gate) {
+  OperatorEnd(out_files);
+
+  std::vector<string> globs;
+  for (const auto& k_v : *out_files) {
+    gate->Add(k_v.second);
+    globs.push_back(k_v.second);
+  }
+  if (closer_.joinable())
+    closer_.join();
+  closer_ = std::thread([gate = std::move(gate), globs = std::move(globs)] {
+    for (const auto& glob : globs) {
+      gate->Close(glob);
+    }
+  });
+}
+
+bool TestRunner::LoadCheckpoint(const pb::Operator& op, pb::OperatorCheckpoint* cp) {
+  auto it = checkpoints_.find(op.output().name());
+  if (it == checkpoints_.end())
+    return false;
+  *cp = it->second;
+  return true;
+}
+
+// The output files of the previous run are kept in input_fs_ until OperatorEnd rewrites them.
+bool TestRunner::LoadManifest(const pb::Operator& op, pb::IncrementalManifest* manifest) {
+  auto it = manifests_.find(op.output().name());
+  if (it == manifests_.end())
+    return false;
+  *manifest = it->second;
+  return true;
+}
+
 // Read file and fill queue. This function must be fiber-friendly.
-size_t TestRunner::ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+size_t TestRunner::ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                                     RawSinkCb cb) {
   auto it = input_fs_.find(filename);
   CHECK(it != input_fs_.end());
@@ -82,7 +152,7 @@ const ShardedOutput& TestRunner::Table(const std::string& tb_name) const {
   return it->second->s_out;
 }
 
-size_t EmptyRunner::ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+size_t EmptyRunner::ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                                      RawSinkCb cb) {
   CHECK(gen_fn);
   string val;
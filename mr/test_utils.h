@@ -4,6 +4,7 @@
 #pragma once
 
 #include <string>
+#include <thread>
 
 #include <boost/fiber/mutex.hpp>
 
@@ -39,6 +40,9 @@ class TestRunner;
 
 struct OutputShardSet {
   ShardedOutput s_out;
+
+  // Keyed records of sorted outputs. Sorted into s_out when the operator ends.
+  std::unordered_map<ShardId, std::vector<std::pair<std::string, std::string>>> sorted_out;
   bool is_finished = false;
   ::boost::fibers::mutex mu;
 };
@@ -51,6 +55,8 @@ class TestContext : public RawContext {
   TestContext(TestRunner* runner, OutputShardSet* outp) : runner_(runner), outp_ss_(*outp) {}
 
   void WriteInternal(const ShardId& shard_id, std::string&& record);
+  void WriteSortedInternal(const ShardId& shard_id, std::string&& key,
+                           std::string&& record) final;
   void Flush() final;
   void CloseShard(const ShardId& sid) {}
 };
@@ -66,12 +72,27 @@ class TestRunner : public Runner {
   void ExpandGlob(const std::string& glob, ExpandCb cb) final;
 
   // Read file and fill queue. This function must be fiber-friendly.
-  size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+  size_t ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                           RawSinkCb cb) final;
 
-  void OperatorStart(const pb::Operator* op) final { op_ = op; }
+  void OperatorStart(const pb::Operator* op) final;
   void OperatorEnd(ShardFileMap* out_files) final;
 
+  // Reports the shards to gate one by one from another thread.
+  void OperatorEndAsync(ShardFileMap* out_files, std::shared_ptr<detail::ShardGate> gate) final;
+
+  void SaveCheckpoint(const pb::Operator& op, const pb::OperatorCheckpoint& cp) final {
+    checkpoints_[op.output().name()] = cp;
+  }
+
+  bool LoadCheckpoint(const pb::Operator& op, pb::OperatorCheckpoint* cp) final;
+
+  void SaveManifest(const pb::Operator& op, const pb::IncrementalManifest& manifest) final {
+    manifests_[op.output().name()] = manifest;
+  }
+
+  bool LoadManifest(const pb::Operator& op, pb::IncrementalManifest* manifest) final;
+
   void AddInputRecords(const std::string& fl, const std::vector<std::string>& records) {
     std::copy(records.begin(), records.end(), std::back_inserter(input_fs_[fl]));
   }
@@ -84,7 +105,10 @@ class TestRunner : public Runner {
   const pb::Operator* op_ = nullptr;
   absl::flat_hash_map<std::string, std::vector<std::string>> input_fs_;
   absl::flat_hash_map<std::string, std::unique_ptr<OutputShardSet>> out_fs_;
+  absl::flat_hash_map<std::string, pb::OperatorCheckpoint> checkpoints_;
+  absl::flat_hash_map<std::string, pb::IncrementalManifest> manifests_;
   std::string last_out_name_;
+  std::thread closer_;
 };
 
 class EmptyRunner : public Runner {
@@ -94,6 +118,7 @@ class EmptyRunner : public Runner {
   class Context : public RawContext {
     public:
     void WriteInternal(const ShardId& shard_id, std::string&& record) {}
+    void WriteSortedInternal(const ShardId& shard_id, std::string&& key, std::string&& record) {}
     void CloseShard(const ShardId& sid) {}
   };
 
@@ -110,7 +135,7 @@ class EmptyRunner : public Runner {
   void OperatorStart(const pb::Operator* op) final {}
   void OperatorEnd(ShardFileMap* out_files) final  {}
 
-  size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
+  size_t ProcessInputFile(const std::string& filename, const pb::WireFormat& wf,
                           RawSinkCb cb) final;
 };
 
@@ -0,0 +1,230 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "strings/delimited_tokenizer.h"
+
+#include <cstring>
+
+#include "base/logging.h"
+#include "base/simd.h"
+
+namespace strings {
+
+namespace {
+
+// Bit i of the result is the xor of the bits [0, i] of x, i.e. it is set inside the quotes
+// if x marks the quotes.
+inline uint64_t PrefixXor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+inline bool IsBlank(const char* begin, const char* end) {
+  return begin == end || (end == begin + 1 && *begin == '\r');
+}
+
+}  // namespace
+
+DelimitedTokenizer::DelimitedTokenizer(char delimiter, char quote)
+    : delimiter_(delimiter), quote_(quote) {
+  CHECK(delimiter != '\n' && delimiter != '\r' && delimiter != quote);
+}
+
+void DelimitedTokenizer::ComputeMask(const char* data, size_t size, bool* in_quote,
+                                     std::vector<uint64_t>* mask) {
+  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
+  const size_t words = (size + 63) / 64;
+  const char seps[2] = {delimiter_, '\n'};
+
+  mask->resize(words);
+  base::MatchAnyOf8(ptr, size, seps, 2, mask->data());
+  if (!quote_)
+    return;
+
+  quote_bits_.resize(words);
+  base::MatchVal8(ptr, size, quote_, quote_bits_.data());
+
+  // The escaped quotes ("") toggle the state twice, so they keep the field quoted.
+  uint64_t carry = *in_quote ? ~0ULL : 0;
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t inside = PrefixXor(quote_bits_[i]) ^ carry;
+    (*mask)[i] &= ~inside;
+    carry = uint64_t(int64_t(inside) >> 63);
+  }
+  *in_quote = carry != 0;
+}
+
+size_t DelimitedTokenizer::NextSeparator() {
+  const size_t size = chunk_.size();
+  if (pos_ >= size)
+    return size;
+
+  size_t word = pos_ / 64;
+  uint64_t bits = mask_[word] & (~0ULL << (pos_ % 64));
+  while (bits == 0) {
+    if (++word == mask_.size())
+      return size;
+    bits = mask_[word];
+  }
+  return word * 64 + __builtin_ctzll(bits);
+}
+
+StringPiece DelimitedTokenizer::MakeField(const char* begin, const char* end,
+                                          bool last_in_record) {
+  if (last_in_record && end > begin && end[-1] == '\r')
+    --end;
+  if (!quote_ || begin == end || *begin != quote_)
+    return StringPiece(begin, end - begin);
+
+  // Whatever follows the closing quote is kept.
+  ++begin;
+  if (end > begin && end[-1] == quote_)
+    --end;
+  if (!memchr(begin, quote_, end - begin))
+    return StringPiece(begin, end - begin);
+
+  unescaped_.emplace_back();
+  std::string& res = unescaped_.back();
+  res.reserve(end - begin);
+  for (const char* p = begin; p < end; ++p) {
+    res.push_back(*p);
+    if (*p == quote_ && p + 1 < end && p[1] == quote_)
+      ++p;
+  }
+  return res;
+}
+
+void DelimitedTokenizer::SplitCarry(std::vector<StringPiece>* fields) {
+  bool in_quote = false;
+  ComputeMask(carry_.data(), carry_.size(), &in_quote, &carry_mask_);
+
+  // The carried record has no EOL, hence the bits are the delimiters.
+  const char* data = carry_.data();
+  size_t start = 0;
+  for (size_t i = 0; i < carry_mask_.size(); ++i) {
+    for (uint64_t bits = carry_mask_[i]; bits; bits &= bits - 1) {
+      size_t sep = i * 64 + __builtin_ctzll(bits);
+      fields->push_back(MakeField(data + start, data + sep, false));
+      start = sep + 1;
+    }
+  }
+  fields->push_back(MakeField(data + start, data + carry_.size(), true));
+}
+
+void DelimitedTokenizer::ReleaseCarry() {
+  if (carry_returned_) {
+    carry_.clear();
+    carry_returned_ = false;
+  }
+}
+
+void DelimitedTokenizer::Feed(StringPiece chunk, bool last) {
+  ReleaseCarry();
+  chunk_ = chunk;
+  last_ = last;
+  pos_ = 0;
+
+  bool continued = !carry_.empty();
+  ComputeMask(chunk.data(), chunk.size(), &in_quote_, &mask_);
+  if (!continued)
+    return;
+
+  // Completes the carried record with the chunk prefix until the first unquoted EOL.
+  size_t sep;
+  while ((sep = NextSeparator()) < chunk.size() && chunk[sep] != '\n')
+    pos_ = sep + 1;
+
+  if (sep < chunk.size()) {
+    carry_.append(chunk.data(), sep);
+    pos_ = sep + 1;
+    carry_ready_ = true;
+  } else {
+    carry_.append(chunk.data(), chunk.size());
+    pos_ = chunk.size();
+    carry_ready_ = last;
+  }
+}
+
+bool DelimitedTokenizer::Next(std::vector<StringPiece>* fields) {
+  unescaped_.clear();
+  ReleaseCarry();
+
+  while (true) {
+    fields->clear();
+    if (carry_ready_) {
+      carry_ready_ = false;
+      if (IsBlank(carry_.data(), carry_.data() + carry_.size())) {
+        carry_.clear();
+        continue;
+      }
+      SplitCarry(fields);
+      carry_returned_ = true;  // the fields point into carry_.
+      ++record_num_;
+      return true;
+    }
+
+    const size_t size = chunk_.size();
+    if (pos_ >= size)
+      return false;
+
+    const char* data = chunk_.data();
+    const size_t start = pos_;
+    size_t end;
+    while (true) {
+      size_t sep = NextSeparator();
+      if (sep == size) {
+        if (!last_) {
+          carry_.assign(data + start, size - start);
+          pos_ = size;
+          fields->clear();
+          return false;
+        }
+        fields->push_back(MakeField(data + pos_, data + size, true));
+        pos_ = end = size;
+        break;
+      }
+
+      bool eol = data[sep] == '\n';
+      fields->push_back(MakeField(data + pos_, data + sep, eol));
+      pos_ = sep + 1;
+      if (eol) {
+        end = sep;
+        break;
+      }
+    }
+
+    if (IsBlank(data + start, data + end))
+      continue;
+    ++record_num_;
+    return true;
+  }
+}
+
+void DelimitedTokenizer::SplitRecord(StringPiece record, std::vector<StringPiece>* fields,
+                                     std::string* scratch) {
+  carry_.clear();
+  carry_ready_ = carry_returned_ = false;
+  in_quote_ = false;
+  Feed(record, true);
+
+  if (!Next(fields) || unescaped_.empty())
+    return;
+
+  // The unescaped fields are shorter than the record, so scratch is not reallocated.
+  scratch->clear();
+  scratch->reserve(record.size());
+  for (StringPiece& field : *fields) {
+    if (field.data() >= record.data() && field.data() <= record.data() + record.size())
+      continue;
+    size_t offset = scratch->size();
+    scratch->append(field.data(), field.size());
+    field = StringPiece(scratch->data() + offset, field.size());
+  }
+}
+
+}  // namespace strings
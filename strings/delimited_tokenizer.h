@@ -0,0 +1,92 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "strings/stringpiece.h"
+
+namespace strings {
+
+/*
+  Splits delimited text, e.g. CSV or TSV, into records of fields. Unlike
+  SplitCSVLineWithDelimiter it works on whole buffers and does not modify them.
+
+  The delimiters, quotes and EOLs of every buffer are located at once with SIMD
+  (see base::MatchAnyOf8), and the quoted ranges are masked out with a prefix xor of the quote
+  bits, like simdcsv does. Then the records are split by iterating over the bits that are left.
+
+  Follows RFC 4180: quoted fields may contain delimiters, EOLs and escaped ("") quotes.
+  The fields are not trimmed, "\r\n" EOLs are recognized and empty lines are skipped.
+  Fields point into the fed buffer, except for the quoted fields with escaped quotes and the
+  records that cross the buffers, which are copied.
+
+  Usage:
+    DelimitedTokenizer tokenizer;
+    std::vector<StringPiece> fields;
+    while (read the next chunk) {
+      tokenizer.Feed(chunk, is_last);
+      while (tokenizer.Next(&fields)) {
+        ...
+      }
+      // The chunk buffer can be reused here.
+    }
+*/
+class DelimitedTokenizer {
+ public:
+  // quote == '\0' disables quoting, e.g. for TSV.
+  explicit DelimitedTokenizer(char delimiter = ',', char quote = '"');
+
+  // Sets the next chunk of the input. Should be called once Next() returned false.
+  // last must be set for the last chunk, then its unterminated record is returned as well.
+  void Feed(StringPiece chunk, bool last = false);
+
+  // Returns false if the chunk has no more complete records. The unfinished record is kept
+  // internally and the chunk buffer is not accessed anymore.
+  // The fields are valid until the next call to Next() or Feed().
+  bool Next(std::vector<StringPiece>* fields);
+
+  // The number of the records returned so far.
+  uint64_t record_num() const { return record_num_; }
+
+  // Splits a single record, e.g. a line of a text input, and resets the state of the chunks.
+  // The fields point into record or into scratch, which holds the unescaped fields.
+  void SplitRecord(StringPiece record, std::vector<StringPiece>* fields, std::string* scratch);
+
+ private:
+  // Sets mask bit i if data[i] is an unquoted delimiter or EOL. in_quote is the quoting state
+  // at the beginning and is updated to the state at the end.
+  void ComputeMask(const char* data, size_t size, bool* in_quote, std::vector<uint64_t>* mask);
+
+  // Returns the next unquoted delimiter or EOL of the chunk at or after pos_ or the chunk size.
+  size_t NextSeparator();
+
+  // The unescaped field of [begin, end).
+  StringPiece MakeField(const char* begin, const char* end, bool last_in_record);
+
+  // Splits the record that crossed the chunks.
+  void SplitCarry(std::vector<StringPiece>* fields);
+
+  // Clears carry_ if its record was returned.
+  void ReleaseCarry();
+
+  char delimiter_, quote_;
+
+  StringPiece chunk_;
+  bool last_ = false;
+  bool in_quote_ = false;  // the quoting state at the end of the last chunk.
+  std::vector<uint64_t> mask_, quote_bits_;
+  size_t pos_ = 0;  // the next byte of the chunk.
+
+  std::string carry_;  // the beginning of the record that crosses the chunks.
+  bool carry_ready_ = false, carry_returned_ = false;
+  std::vector<uint64_t> carry_mask_;
+
+  std::deque<std::string> unescaped_;  // keeps the addresses of the fields.
+  uint64_t record_num_ = 0;
+};
+
+}  // namespace strings
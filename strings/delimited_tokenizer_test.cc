@@ -0,0 +1,184 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "strings/delimited_tokenizer.h"
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/simd.h"
+#include "strings/split.h"
+
+namespace strings {
+
+using std::string;
+using std::vector;
+
+typedef vector<vector<string>> Records;
+
+static Records Tokenize(const string& input, size_t chunk_size, char delimiter = ',',
+                        char quote = '"') {
+  DelimitedTokenizer tokenizer(delimiter, quote);
+  Records res;
+  vector<StringPiece> fields;
+  for (size_t pos = 0;;) {
+    size_t len = std::min(chunk_size, input.size() - pos);
+
+    // A copy that is overwritten afterwards checks that the chunk is not accessed later.
+    string chunk = input.substr(pos, len);
+    pos += len;
+    tokenizer.Feed(chunk, pos == input.size());
+    while (tokenizer.Next(&fields)) {
+      res.emplace_back(fields.begin(), fields.end());
+    }
+    chunk.assign(chunk.size(), '#');
+    if (pos == input.size())
+      break;
+  }
+  EXPECT_EQ(res.size(), tokenizer.record_num());
+  return res;
+}
+
+class DelimitedTokenizerTest : public testing::Test {
+};
+
+TEST_F(DelimitedTokenizerTest, Basic) {
+  string input = "a,b,c\n"
+                 "1,,3\r\n"
+                 "\n"
+                 "\"quoted, \"\"field\"\"\",x\n"
+                 "\"multi\nline\",\"\"\n"
+                 ",\n"
+                 "last";
+  Records expected{{"a", "b", "c"},
+                   {"1", "", "3"},
+                   {"quoted, \"field\"", "x"},
+                   {"multi\nline", ""},
+                   {"", ""},
+                   {"last"}};
+
+  for (size_t chunk_size : {1, 2, 3, 7, 64, 1000}) {
+    EXPECT_EQ(expected, Tokenize(input, chunk_size)) << chunk_size;
+  }
+
+  EXPECT_EQ((Records{{"a", "b\""}, {"c"}}), Tokenize("a\tb\"\nc\n", 4, '\t', '\0'));
+  EXPECT_TRUE(Tokenize("", 10).empty());
+}
+
+TEST_F(DelimitedTokenizerTest, SplitRecord) {
+  DelimitedTokenizer tokenizer;
+  vector<StringPiece> fields;
+  string scratch;
+  string line = "1,\"a \"\"b\"\"\",\"c\",\"\"\"\"";
+  tokenizer.SplitRecord(line, &fields, &scratch);
+  EXPECT_EQ((vector<StringPiece>{"1", "a \"b\"", "c", "\""}), fields);
+  EXPECT_EQ(line.data(), fields[0].data());
+  EXPECT_EQ(line.data() + 13, fields[2].data());
+
+  tokenizer.SplitRecord("x,y", &fields, &scratch);
+  EXPECT_EQ((vector<StringPiece>{"x", "y"}), fields);
+}
+
+TEST_F(DelimitedTokenizerTest, Random) {
+  std::mt19937 rand(10);
+  const char kChars[] = "ab,\"\n\r ";
+
+  for (unsigned iter = 0; iter < 200; ++iter) {
+    Records expected;
+    string input;
+    unsigned num_records = 1 + rand() % 50;
+    for (unsigned i = 0; i < num_records; ++i) {
+      vector<string> record;
+      unsigned num_fields = 1 + rand() % 8;
+      for (unsigned j = 0; j < num_fields; ++j) {
+        string field;
+        unsigned len = rand() % 100;
+        for (unsigned k = 0; k < len; ++k)
+          field.push_back(kChars[rand() % (sizeof(kChars) - 1)]);
+
+        bool quoted = field.find_first_of(",\"\n\r") != string::npos || (j == 0 && field.empty());
+        if (quoted) {
+          input.push_back('"');
+          for (char c : field) {
+            input.push_back(c);
+            if (c == '"')
+              input.push_back('"');
+          }
+          input.push_back('"');
+        } else {
+          input.append(field);
+        }
+        input.push_back(j + 1 == num_fields ? '\n' : ',');
+        record.push_back(field);
+      }
+      expected.push_back(record);
+    }
+
+    for (base::SimdLevel level : {base::SIMD_SSE, base::SIMD_AVX2, base::SIMD_AVX512}) {
+      base::SetSimdLevel(level);
+      for (size_t chunk_size : {13, 64, 4096}) {
+        ASSERT_EQ(expected, Tokenize(input, chunk_size)) << iter << " " << chunk_size;
+      }
+    }
+  }
+  base::SetSimdLevel(base::CpuSimdLevel());
+}
+
+static void BM_Tokenize(benchmark::State& state) {
+  std::mt19937 rand(10);
+  string input;
+  while (input.size() < (1 << 20)) {
+    for (unsigned j = 0; j < 10; ++j) {
+      if (j == 3)
+        input.append("\"some, quoted text\"");
+      else
+        input.append(std::to_string(rand() % 100000));
+      input.push_back(j == 9 ? '\n' : ',');
+    }
+  }
+
+  DelimitedTokenizer tokenizer;
+  vector<StringPiece> fields;
+  size_t num_fields = 0;
+  while (state.KeepRunning()) {
+    tokenizer.Feed(input, true);
+    while (tokenizer.Next(&fields))
+      num_fields += fields.size();
+  }
+  benchmark::DoNotOptimize(num_fields);
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_Tokenize);
+
+static void BM_SplitCSVLine(benchmark::State& state) {
+  std::mt19937 rand(10);
+  vector<string> lines;
+  size_t size = 0;
+  while (size < (1 << 20)) {
+    string line;
+    for (unsigned j = 0; j < 10; ++j) {
+      if (j == 3)
+        line.append("\"some, quoted text\"");
+      else
+        line.append(std::to_string(rand() % 100000));
+      if (j < 9)
+        line.push_back(',');
+    }
+    size += line.size() + 1;
+    lines.push_back(line);
+  }
+
+  vector<char*> cols;
+  string tmp;
+  while (state.KeepRunning()) {
+    for (const string& line : lines) {
+      tmp = line;
+      cols.clear();
+      SplitCSVLineWithDelimiter(&tmp.front(), ',', &cols);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_SplitCSVLine);
+
+}  // namespace strings
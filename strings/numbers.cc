@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <float.h>          // for DBL_DIG and FLT_DIG
 #include <math.h>           // for HUGE_VAL
+#include <cmath>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,7 @@
 #include "strings/stringprintf.h"
 
 #include "absl/strings/ascii.h"
+#include "absl/strings/charconv.h"
 
 using absl::ascii_isspace;
 using absl::ascii_toupper;
@@ -420,6 +422,145 @@ bool safe_strtod(StringPiece str, double* value) {
   return !str.empty() && endptr == str.end();
 }
 
+namespace {
+
+// Parses 8 digits at p into *value, returns false if one of them is not a digit.
+// See Lemire, "Fast numerical parsing", the word holds the digits in little-endian order.
+inline bool ParseEightDigits(const char* p, uint32* value) {
+  uint64 val;
+  memcpy(&val, p, sizeof(val));
+
+  // Every byte is in ['0', '9'] iff its high nibble is 3 and it stays so after adding 6.
+  if ((((val & 0xF0F0F0F0F0F0F0F0ULL) |
+        (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+       0x3333333333333333ULL)) {
+    return false;
+  }
+
+  val -= 0x3030303030303030ULL;
+  val = (val * 10) + (val >> 8);  // pairs of digits in the even bytes.
+  val = (((val & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((val >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  *value = uint32(val);
+  return true;
+}
+
+// Parses the digits of [p, end), which must not be empty.
+bool ParseDigits(const char* p, const char* end, uint64* value) {
+  if (p == end)
+    return false;
+
+  // The leading zeros do not overflow.
+  while (end - p > 1 && *p == '0')
+    ++p;
+  if (end - p > 20)  // 2^64 has 20 digits.
+    return false;
+
+  uint64 res = 0;
+  uint32 eight;
+  while (end - p >= 8) {
+    if (!ParseEightDigits(p, &eight))
+      return false;
+    res = res * 100000000 + eight;  // at most 16 digits, does not overflow.
+    p += 8;
+  }
+
+  for (; p < end; ++p) {
+    uint32 digit = uint8(*p) - '0';
+    if (digit > 9 || __builtin_mul_overflow(res, 10, &res) ||
+        __builtin_add_overflow(res, digit, &res)) {
+      return false;
+    }
+  }
+  *value = res;
+  return true;
+}
+
+template <typename T> bool ParseSigned(StringPiece str, T* value) {
+  bool negative = !str.empty() && str[0] == '-';
+  uint64 abs;
+  if (!ParseDigits(str.data() + negative, str.data() + str.size(), &abs))
+    return false;
+
+  uint64 limit = uint64(numeric_limits<T>::max()) + negative;
+  if (abs > limit)
+    return false;
+  *value = negative ? T(0 - abs) : T(abs);
+  return true;
+}
+
+inline bool ParseField(StringPiece str, int64* value) {
+  return ParseDecimal(str, value);
+}
+
+inline bool ParseField(StringPiece str, double* value) {
+  return ParseDouble(str, value);
+}
+
+template <typename T>
+int ParseDelimitedT(StringPiece str, char delim, T* dest, unsigned max_fields) {
+  const char* p = str.data();
+  const char* end = p + str.size();
+  unsigned num = 0;
+
+  while (true) {
+    const char* next = p < end ? static_cast<const char*>(memchr(p, delim, end - p)) : nullptr;
+    const char* field_end = next ? next : end;
+    if (num == max_fields || !ParseField(StringPiece(p, field_end - p), dest + num))
+      return -1;
+    ++num;
+    if (!next)
+      break;
+    p = next + 1;
+  }
+  return num;
+}
+
+}  // namespace
+
+bool ParseDecimal(StringPiece str, uint64* value) {
+  return ParseDigits(str.data(), str.data() + str.size(), value);
+}
+
+bool ParseDecimal(StringPiece str, int64* value) {
+  return ParseSigned(str, value);
+}
+
+bool ParseDecimal(StringPiece str, uint32* value) {
+  uint64 res;
+  if (!ParseDigits(str.data(), str.data() + str.size(), &res) || res > kuint32max)
+    return false;
+  *value = res;
+  return true;
+}
+
+bool ParseDecimal(StringPiece str, int32* value) {
+  return ParseSigned(str, value);
+}
+
+bool ParseDouble(StringPiece str, double* value) {
+  const char* end = str.data() + str.size();
+  absl::from_chars_result res = absl::from_chars(str.data(), end, *value);
+  if (res.ptr != end || str.empty())
+    return false;
+
+  // Like strtod, overflows to infinity while from_chars stops at the max value.
+  if (res.ec == std::errc::result_out_of_range) {
+    if (std::isinf(*value * 2))
+      *value = std::copysign(HUGE_VAL, *value);
+    return true;
+  }
+  return res.ec == std::errc();
+}
+
+int ParseDelimited(StringPiece str, char delim, int64* dest, unsigned max_fields) {
+  return ParseDelimitedT(str, delim, dest, max_fields);
+}
+
+int ParseDelimited(StringPiece str, char delim, double* dest, unsigned max_fields) {
+  return ParseDelimitedT(str, delim, dest, max_fields);
+}
+
 
 // ----------------------------------------------------------------------
 // SimpleDtoa()
@@ -48,6 +48,24 @@ inline bool safe_strtou64(StringPiece str, uint64* value) {
 bool safe_strtof(StringPiece str, float* value);
 bool safe_strtod(StringPiece str, double* value);
 
+// Strict and fast decimal parsers for text pipelines: an optional '-' for signed types
+// followed by digits only, no spaces or '+'. 8 digits are parsed at once in a 64 bit word.
+// Returns false on errors (including overflow/underflow).
+bool ParseDecimal(StringPiece str, uint64* value);
+bool ParseDecimal(StringPiece str, int64* value);
+bool ParseDecimal(StringPiece str, uint32* value);
+bool ParseDecimal(StringPiece str, int32* value);
+
+// Like safe_strtod but does not allow the spaces and does not read past str.
+bool ParseDouble(StringPiece str, double* value);
+
+// Parses the fields of str separated by delim, e.g. a TSV line, into dest.
+// Integers are parsed with ParseDecimal, doubles with ParseDouble. An empty str has a single empty field, which does not parse.
+// Returns the number of fields or -1 if there are more than max_fields of them or some field
+// does not parse, in which case dest is partially written.
+int ParseDelimited(StringPiece str, char delim, int64* dest, unsigned max_fields);
+int ParseDelimited(StringPiece str, char delim, double* dest, unsigned max_fields);
+
 
 char* FastHex64ToBuffer(uint64 i, char* buffer);
 
@@ -0,0 +1,82 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "strings/numbers.h"
+
+#include <random>
+
+#include "base/gtest.h"
+
+class NumbersTest : public testing::Test {
+};
+
+TEST_F(NumbersTest, ParseDecimal) {
+  uint64 u64;
+  EXPECT_TRUE(ParseDecimal("0", &u64));
+  EXPECT_EQ(0, u64);
+  EXPECT_TRUE(ParseDecimal("18446744073709551615", &u64));
+  EXPECT_EQ(kuint64max, u64);
+  EXPECT_TRUE(ParseDecimal("0000000000000000000000012345678901234", &u64));
+  EXPECT_EQ(12345678901234ULL, u64);
+  EXPECT_FALSE(ParseDecimal("18446744073709551616", &u64));
+  EXPECT_FALSE(ParseDecimal("99999999999999999999", &u64));
+  EXPECT_FALSE(ParseDecimal("100000000000000000000", &u64));
+
+  for (const char* bad : {"", "-", "-1", "+1", " 1", "1 ", "12345678a", "1234567:", "1234/678",
+                          "12345678901234567.", "0x10"}) {
+    EXPECT_FALSE(ParseDecimal(bad, &u64)) << bad;
+  }
+
+  int64 i64;
+  EXPECT_TRUE(ParseDecimal("-9223372036854775808", &i64));
+  EXPECT_EQ(kint64min, i64);
+  EXPECT_TRUE(ParseDecimal("9223372036854775807", &i64));
+  EXPECT_EQ(kint64max, i64);
+  EXPECT_FALSE(ParseDecimal("9223372036854775808", &i64));
+  EXPECT_FALSE(ParseDecimal("-9223372036854775809", &i64));
+  EXPECT_FALSE(ParseDecimal("--1", &i64));
+
+  uint32 u32;
+  EXPECT_TRUE(ParseDecimal("4294967295", &u32));
+  EXPECT_EQ(kuint32max, u32);
+  EXPECT_FALSE(ParseDecimal("4294967296", &u32));
+
+  int32 i32;
+  EXPECT_TRUE(ParseDecimal("-2147483648", &i32));
+  EXPECT_EQ(kint32min, i32);
+  EXPECT_FALSE(ParseDecimal("2147483648", &i32));
+
+  std::mt19937_64 rnd(10);
+  for (unsigned i = 0; i < 10000; ++i) {
+    int64 val = int64(rnd()) >> (rnd() % 64);
+    std::string str = std::to_string(val);
+    ASSERT_TRUE(ParseDecimal(str, &i64)) << str;
+    ASSERT_EQ(val, i64);
+  }
+}
+
+TEST_F(NumbersTest, ParseDelimited) {
+  int64 ints[4];
+  ASSERT_EQ(3, ParseDelimited("12\t-7\t123456789012", '\t', ints, 4));
+  EXPECT_EQ(12, ints[0]);
+  EXPECT_EQ(-7, ints[1]);
+  EXPECT_EQ(123456789012, ints[2]);
+
+  EXPECT_EQ(-1, ParseDelimited("1\t2\t3\t4\t5", '\t', ints, 4));
+  EXPECT_EQ(-1, ParseDelimited("1\t\t3", '\t', ints, 4));
+  EXPECT_EQ(-1, ParseDelimited("1\t2\t", '\t', ints, 4));
+  EXPECT_EQ(-1, ParseDelimited("", '\t', ints, 4));
+
+  // Does not read past the piece.
+  StringPiece line("5,6,7");
+  ASSERT_EQ(2, ParseDelimited(line.substr(0, 3), ',', ints, 4));
+  EXPECT_EQ(6, ints[1]);
+
+  double vals[3];
+  ASSERT_EQ(3, ParseDelimited("1.5,-2e-3,1e400", ',', vals, 3));
+  EXPECT_EQ(1.5, vals[0]);
+  EXPECT_EQ(-2e-3, vals[1]);
+  EXPECT_EQ(std::numeric_limits<double>::infinity(), vals[2]);
+  EXPECT_EQ(-1, ParseDelimited("1.5, 2", ',', vals, 3));
+  EXPECT_EQ(-1, ParseDelimited("1.5,2x", ',', vals, 3));
+}
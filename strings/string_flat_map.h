@@ -0,0 +1,579 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "base/arena.h"
+#include "base/hash.h"
+#include "base/logging.h"
+#include "base/port.h"
+#include "strings/stringpiece.h"
+
+namespace strings {
+
+namespace detail {
+
+/*
+  Key of the flat string tables: 16 bytes with the length and either the key bytes (if
+  kInline and the key is at most kInlineLen long) or the first 4 bytes of the key followed by
+  the pointer to its copy in the arena. Mismatches are mostly rejected by the length and the
+  prefix without touching the arena.
+*/
+template <bool kInline> class FlatStringKey {
+ public:
+  static constexpr size_t kInlineLen = 12;
+  static constexpr size_t kPrefixLen = 4;
+
+  // stored is the arena copy of src or null if src is stored inline.
+  FlatStringKey(StringPiece src, const char* stored) : len_(src.size()) {
+    if (stored) {
+      memcpy(bytes_, src.data(), std::min<size_t>(len_, kPrefixLen));
+      memcpy(bytes_ + kPrefixLen, &stored, sizeof(stored));
+    } else if (len_) {
+      memcpy(bytes_, src.data(), len_);
+    }
+  }
+
+  static bool IsInline(size_t len) { return kInline ? len <= kInlineLen : len == 0; }
+
+  StringPiece view() const {
+    if (IsInline(len_))
+      return StringPiece(bytes_, len_);
+    const char* ptr;
+    memcpy(&ptr, bytes_ + kPrefixLen, sizeof(ptr));
+    return StringPiece(ptr, len_);
+  }
+
+  bool Equals(StringPiece key) const {
+    if (len_ != key.size())
+      return false;
+    if (IsInline(len_))
+      return memcmp(bytes_, key.data(), len_) == 0;
+    return memcmp(bytes_, key.data(), std::min<size_t>(len_, kPrefixLen)) == 0 &&
+           memcmp(view().data(), key.data(), len_) == 0;
+  }
+
+ private:
+  uint32_t len_;
+  char bytes_[kInlineLen];
+};
+
+template <typename T> struct FlatMapSlot {
+  FlatStringKey<true> key;
+  T value;
+};
+
+struct FlatSetSlot {
+  FlatStringKey<false> key;
+};
+
+// Control byte of every slot: kEmpty or the 7 low bits of the key hash.
+constexpr int8_t kEmptyCtrl = -128;
+
+// 16 control bytes; the full slots have the top bit cleared.
+class CtrlGroup {
+ public:
+  static constexpr unsigned kWidth = 16;
+
+#ifdef __SSE2__
+  explicit CtrlGroup(const int8_t* ctrl)
+      : ctrl_(_mm_load_si128(reinterpret_cast<const __m128i*>(ctrl))) {}
+
+  // Returns the bitmask of the slots with the tag.
+  uint32_t Match(int8_t tag) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl_));
+  }
+
+  uint32_t MatchEmpty() const { return _mm_movemask_epi8(ctrl_); }
+
+ private:
+  __m128i ctrl_;
+#else
+  explicit CtrlGroup(const int8_t* ctrl) : ctrl_(ctrl) {}
+
+  uint32_t Match(int8_t tag) const {
+    uint32_t res = 0;
+    for (unsigned i = 0; i < kWidth; ++i)
+      res |= uint32_t(ctrl_[i] == tag) << i;
+    return res;
+  }
+
+  uint32_t MatchEmpty() const { return Match(kEmptyCtrl); }
+
+ private:
+  const int8_t* ctrl_;
+#endif
+};
+
+alignas(16) inline const int8_t kEmptyGroup[CtrlGroup::kWidth] = {
+    kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl,
+    kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl,
+    kEmptyCtrl, kEmptyCtrl, kEmptyCtrl, kEmptyCtrl};
+
+/*
+  Open-addressing table of Swiss-table design shared by StringFlatMap and StringFlatSet.
+  The slots are split into groups of 16 with an array of control bytes, a lookup compares
+  all the control bytes of a group with the tag of the hash at once and checks the keys of
+  the matching slots only. The groups are probed quadratically, the table grows twice when
+  it is 7/8 full. Entries are never erased, hence there are no tombstones.
+*/
+template <typename Slot> class FlatStringTable {
+  static constexpr bool kInline = !std::is_same<Slot, FlatSetSlot>::value;
+  using Key = FlatStringKey<kInline>;
+
+ public:
+  FlatStringTable() = default;
+  FlatStringTable(const FlatStringTable&) = delete;
+  void operator=(const FlatStringTable&) = delete;
+
+  ~FlatStringTable() { Destroy(); }
+
+  static uint64_t Hash(StringPiece key) { return base::Hash64(key.data(), key.size()); }
+
+  Slot* Find(StringPiece key, uint64_t hash) const {
+    int8_t tag = hash & 0x7f;
+    size_t group = (hash >> 7) & group_mask_;
+    for (size_t step = 1;; ++step) {
+      size_t base = group * CtrlGroup::kWidth;
+      CtrlGroup g(ctrl_ + base);
+      for (uint32_t mask = g.Match(tag); mask; mask &= mask - 1) {
+        Slot* slot = slots_ + base + __builtin_ctz(mask);
+        if (PREDICT_TRUE(slot->key.Equals(key)))
+          return slot;
+      }
+      if (g.MatchEmpty())
+        return nullptr;
+      group = (group + step) & group_mask_;
+    }
+  }
+
+  // Returns the slot of the key and whether it was inserted. The new slot is constructed
+  // from the key and args.
+  template <typename... Args>
+  std::pair<Slot*, bool> TryEmplace(StringPiece key, uint64_t hash, Args&&... args) {
+    Slot* slot = Find(key, hash);
+    if (slot)
+      return std::make_pair(slot, false);
+
+    CHECK(!frozen_) << "Insertion into a frozen table";
+    if (PREDICT_FALSE(growth_left_ == 0))
+      Rehash(std::max<size_t>(capacity_ * 2, CtrlGroup::kWidth));
+
+    const char* stored = nullptr;
+    if (!Key::IsInline(key.size())) {
+      char* str = arena_.Allocate(key.size());
+      memcpy(str, key.data(), key.size());
+      stored = str;
+    }
+
+    size_t pos = FindEmpty(hash);
+    ctrl_[pos] = hash & 0x7f;
+    slot = new (slots_ + pos) Slot{Key(key, stored), std::forward<Args>(args)...};
+    ++size_;
+    --growth_left_;
+
+    return std::make_pair(slot, true);
+  }
+
+  // Calls cb(i, slot, inserted) for every key in [keys, keys + n). The hashes of a batch are
+  // computed together and their groups are prefetched before the probing.
+  template <typename F> void EmplaceBulk(const StringPiece* keys, size_t n, F&& cb) {
+    constexpr size_t kBatch = 16;
+    const char* data[kBatch];
+    size_t lens[kBatch];
+    uint64_t hashes[kBatch];
+
+    for (size_t start = 0; start < n; start += kBatch) {
+      size_t cnt = std::min(kBatch, n - start);
+
+      // No rehash within the batch, so the prefetched lines stay valid.
+      if (!frozen_)
+        Reserve(size_ + cnt);
+      HashBatch(keys + start, cnt, data, lens, hashes);
+      for (size_t i = 0; i < cnt; ++i) {
+        auto res = TryEmplace(keys[start + i], hashes[i]);
+        cb(start + i, res.first, res.second);
+      }
+    }
+  }
+
+  // dest[i] is the slot of keys[i] or null.
+  void FindBulk(const StringPiece* keys, size_t n, Slot** dest) const {
+    constexpr size_t kBatch = 16;
+    const char* data[kBatch];
+    size_t lens[kBatch];
+    uint64_t hashes[kBatch];
+
+    for (size_t start = 0; start < n; start += kBatch) {
+      size_t cnt = std::min(kBatch, n - start);
+      HashBatch(keys + start, cnt, data, lens, hashes);
+      for (size_t i = 0; i < cnt; ++i)
+        dest[start + i] = Find(keys[start + i], hashes[i]);
+    }
+  }
+
+  // Grows the table to hold n entries without rehashing.
+  void Reserve(size_t n) {
+    if (n <= size_ + growth_left_)
+      return;
+    CHECK(!frozen_);
+    Rehash(CapacityFor(n));
+  }
+
+  // Shrinks the table to the smallest capacity that holds its entries and forbids the
+  // insertions until Clear(). A frozen table is read-only, so any number of threads may
+  // look it up.
+  void Freeze() {
+    size_t cap = CapacityFor(size_);
+    if (cap < capacity_)
+      Rehash(cap);
+    frozen_ = true;
+  }
+
+  bool frozen() const { return frozen_; }
+
+  void Clear() {
+    Destroy();
+    ctrl_ = const_cast<int8_t*>(kEmptyGroup);
+    slots_ = nullptr;
+    capacity_ = size_ = growth_left_ = group_mask_ = 0;
+    frozen_ = false;
+    base::Arena().Swap(arena_);
+  }
+
+  void Swap(FlatStringTable& other) {
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(growth_left_, other.growth_left_);
+    std::swap(group_mask_, other.group_mask_);
+    std::swap(frozen_, other.frozen_);
+    arena_.Swap(other.arena_);
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+  size_t MemoryUsage() const {
+    return arena_.MemoryUsage() + capacity_ * (sizeof(Slot) + 1);
+  }
+
+  // Iteration over the slots in [0, capacity()).
+  const int8_t* ctrl() const { return ctrl_; }
+  Slot* slots() const { return slots_; }
+
+ private:
+  static size_t CapacityFor(size_t n) {
+    size_t cap = CtrlGroup::kWidth;
+    while (cap - cap / 8 < n)
+      cap *= 2;
+    return cap;
+  }
+
+  // Computes the hashes of the keys and prefetches the control bytes and the first slots of
+  // their groups.
+  void HashBatch(const StringPiece* keys, size_t n, const char** data, size_t* lens,
+                 uint64_t* hashes) const {
+    for (size_t i = 0; i < n; ++i) {
+      data[i] = keys[i].data();
+      lens[i] = keys[i].size();
+    }
+    base::Hash64Batch(data, lens, n, 0, hashes);
+    if (!capacity_)
+      return;
+    for (size_t i = 0; i < n; ++i) {
+      size_t base = ((hashes[i] >> 7) & group_mask_) * CtrlGroup::kWidth;
+      __builtin_prefetch(ctrl_ + base);
+      __builtin_prefetch(slots_ + base);
+    }
+  }
+
+  size_t FindEmpty(uint64_t hash) const {
+    size_t group = (hash >> 7) & group_mask_;
+    for (size_t step = 1;; ++step) {
+      size_t base = group * CtrlGroup::kWidth;
+      uint32_t mask = CtrlGroup(ctrl_ + base).MatchEmpty();
+      if (mask)
+        return base + __builtin_ctz(mask);
+      group = (group + step) & group_mask_;
+    }
+  }
+
+  // cap must be a power of 2, at least kWidth and hold all the entries.
+  void Rehash(size_t cap) {
+    static_assert(CtrlGroup::kWidth % alignof(Slot) == 0, "");
+
+    int8_t* old_ctrl = ctrl_;
+    Slot* old_slots = slots_;
+    size_t old_cap = capacity_;
+
+    void* mem = ::operator new(cap * (sizeof(Slot) + 1), std::align_val_t(CtrlGroup::kWidth));
+    ctrl_ = reinterpret_cast<int8_t*>(mem);
+    slots_ = reinterpret_cast<Slot*>(ctrl_ + cap);
+    memset(ctrl_, kEmptyCtrl, cap);
+    capacity_ = cap;
+    group_mask_ = cap / CtrlGroup::kWidth - 1;
+    growth_left_ = cap - cap / 8 - size_;
+
+    for (size_t i = 0; i < old_cap; ++i) {
+      if (old_ctrl[i] < 0)
+        continue;
+      Slot& src = old_slots[i];
+      uint64_t hash = Hash(src.key.view());
+      size_t pos = FindEmpty(hash);
+      ctrl_[pos] = old_ctrl[i];
+      new (slots_ + pos) Slot(std::move(src));
+      src.~Slot();
+    }
+    if (old_cap)
+      ::operator delete(old_ctrl, std::align_val_t(CtrlGroup::kWidth));
+  }
+
+  void Destroy() {
+    if (!capacity_)
+      return;
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0)
+        slots_[i].~Slot();
+    }
+    ::operator delete(ctrl_, std::align_val_t(CtrlGroup::kWidth));
+  }
+
+  int8_t* ctrl_ = const_cast<int8_t*>(kEmptyGroup);  // never written while capacity_ == 0.
+  Slot* slots_ = nullptr;
+  size_t capacity_ = 0, size_ = 0, growth_left_ = 0;
+  size_t group_mask_ = 0;
+  bool frozen_ = false;
+  base::Arena arena_;
+};
+
+// Walks the full slots of the table.
+template <typename Slot, typename Deref> class FlatStringIterator {
+ public:
+  using value_type = typename Deref::value_type;
+  using reference = value_type;
+  using iterator_category = std::forward_iterator_tag;
+  using difference_type = ptrdiff_t;
+
+  struct pointer {
+    value_type val;
+    const value_type* operator->() const { return &val; }
+  };
+
+  FlatStringIterator() = default;
+  FlatStringIterator(const int8_t* ctrl, Slot* slot, Slot* end)
+      : ctrl_(ctrl), slot_(slot), end_(end) {
+    SkipEmpty();
+  }
+
+  template <typename D2>
+  FlatStringIterator(const FlatStringIterator<Slot, D2>& other)
+      : ctrl_(other.ctrl_), slot_(other.slot_), end_(other.end_) {}
+
+  reference operator*() const { return Deref::Get(*slot_); }
+  pointer operator->() const { return pointer{Deref::Get(*slot_)}; }
+
+  FlatStringIterator& operator++() {
+    ++ctrl_;
+    ++slot_;
+    SkipEmpty();
+    return *this;
+  }
+
+  FlatStringIterator operator++(int) {
+    FlatStringIterator res = *this;
+    ++*this;
+    return res;
+  }
+
+  template <typename D2> bool operator==(const FlatStringIterator<Slot, D2>& o) const {
+    return slot_ == o.slot_;
+  }
+  template <typename D2> bool operator!=(const FlatStringIterator<Slot, D2>& o) const {
+    return slot_ != o.slot_;
+  }
+
+ private:
+  template <typename S, typename D2> friend class FlatStringIterator;
+
+  void SkipEmpty() {
+    while (slot_ != end_ && *ctrl_ < 0) {
+      ++ctrl_;
+      ++slot_;
+    }
+  }
+
+  const int8_t* ctrl_ = nullptr;
+  Slot* slot_ = nullptr;
+  Slot* end_ = nullptr;
+};
+
+}  // namespace detail
+
+/*
+  Hash map from strings to T for dictionaries and counters with many lookups, e.g. the
+  metrics of RawContext. Has the interface of StringPieceDenseMap without the empty key:
+  keys of up to 12 bytes are kept in the table, the longer ones are copied into the arena of
+  the map. Iterators dereference to std::pair<StringPiece, T&> by value.
+  Unlike StringPieceDenseMap, any insertion invalidates the iterators and the StringPieces of
+  the short keys.
+*/
+template <typename T> class StringFlatMap {
+  using Slot = detail::FlatMapSlot<T>;
+  using Table = detail::FlatStringTable<Slot>;
+
+  template <typename V> struct Deref {
+    using value_type = std::pair<StringPiece, V&>;
+    static value_type Get(Slot& slot) { return value_type(slot.key.view(), slot.value); }
+  };
+
+ public:
+  using key_type = StringPiece;
+  using mapped_type = T;
+  using value_type = std::pair<StringPiece, T>;
+  using iterator = detail::FlatStringIterator<Slot, Deref<T>>;
+  using const_iterator = detail::FlatStringIterator<Slot, Deref<const T>>;
+
+  iterator begin() { return iterator(table_.ctrl(), table_.slots(), end_slot()); }
+  const_iterator begin() const { return const_iterator(table_.ctrl(), table_.slots(), end_slot()); }
+
+  iterator end() { return iterator(nullptr, end_slot(), end_slot()); }
+  const_iterator end() const { return const_iterator(nullptr, end_slot(), end_slot()); }
+
+  iterator find(StringPiece key) { return MakeIterator(table_.Find(key, Table::Hash(key))); }
+  const_iterator find(StringPiece key) const {
+    return MakeIterator(table_.Find(key, Table::Hash(key)));
+  }
+
+  std::pair<iterator, bool> insert(const value_type& val) { return emplace(val.first, val.second); }
+
+  template <typename... Args> std::pair<iterator, bool> emplace(StringPiece key, Args&&... args) {
+    auto res = table_.TryEmplace(key, Table::Hash(key), std::forward<Args>(args)...);
+    return std::make_pair(MakeIterator(res.first), res.second);
+  }
+
+  T& operator[](StringPiece key) { return table_.TryEmplace(key, Table::Hash(key)).first->value; }
+
+  // Calls cb(i, T& value, bool inserted) for every key in [keys, keys + n), inserts the
+  // missing ones with T(). Faster than a loop of emplace() because the hashing and the memory
+  // accesses of the keys are overlapped, e.g. for building a dictionary:
+  //   dict.InsertBulk(keys, n, [&](size_t i, uint32_t& id, bool inserted) {
+  //     if (inserted) id = next_id++;
+  //     ids[i] = id;
+  //   });
+  template <typename F> void InsertBulk(const StringPiece* keys, size_t n, F&& cb) {
+    table_.EmplaceBulk(keys, n,
+                       [&](size_t i, Slot* slot, bool inserted) { cb(i, slot->value, inserted); });
+  }
+
+  // dest[i] points to the value of keys[i] or is null if it is missing.
+  void FindBulk(const StringPiece* keys, size_t n, const T** dest) const {
+    constexpr size_t kBatch = 64;
+    Slot* slots[kBatch];
+    for (size_t start = 0; start < n; start += kBatch) {
+      size_t cnt = std::min(kBatch, n - start);
+      table_.FindBulk(keys + start, cnt, slots);
+      for (size_t i = 0; i < cnt; ++i)
+        dest[start + i] = slots[i] ? &slots[i]->value : nullptr;
+    }
+  }
+
+  void reserve(size_t n) { table_.Reserve(n); }
+
+  // See FlatStringTable::Freeze.
+  void Freeze() { table_.Freeze(); }
+  bool frozen() const { return table_.frozen(); }
+
+  void swap(StringFlatMap& other) { table_.Swap(other.table_); }
+
+  size_t size() const { return table_.size(); }
+  bool empty() const { return table_.size() == 0; }
+
+  void clear() { table_.Clear(); }
+
+  size_t MemoryUsage() const { return table_.MemoryUsage(); }
+
+ private:
+  Slot* end_slot() const { return table_.slots() + table_.capacity(); }
+
+  iterator MakeIterator(Slot* slot) {
+    if (!slot)
+      return end();
+    return iterator(table_.ctrl() + (slot - table_.slots()), slot, end_slot());
+  }
+
+  const_iterator MakeIterator(Slot* slot) const {
+    if (!slot)
+      return end();
+    return const_iterator(table_.ctrl() + (slot - table_.slots()), slot, end_slot());
+  }
+
+  Table table_;
+};
+
+/*
+  Pool of unique strings with the table of StringFlatMap. All the non-empty strings are
+  copied into the arena, so the returned StringPieces stay valid until Clear().
+*/
+class StringFlatSet {
+  using Slot = detail::FlatSetSlot;
+  using Table = detail::FlatStringTable<Slot>;
+
+  struct Deref {
+    using value_type = StringPiece;
+    static value_type Get(const Slot& slot) { return slot.key.view(); }
+  };
+
+ public:
+  using const_iterator = detail::FlatStringIterator<Slot, Deref>;
+
+  StringPiece Get(StringPiece source) { return Insert(source).first; }
+
+  // Returns the string from the set and true if the insertion took place.
+  std::pair<StringPiece, bool> Insert(StringPiece source) {
+    auto res = table_.TryEmplace(source, Table::Hash(source));
+    return std::make_pair(res.first->key.view(), res.second);
+  }
+
+  // dest[i] = Get(src[i]); src and dest may alias.
+  void GetBulk(const StringPiece* src, size_t n, StringPiece* dest) {
+    table_.EmplaceBulk(src, n, [&](size_t i, Slot* slot, bool) { dest[i] = slot->key.view(); });
+  }
+
+  bool contains(StringPiece str) const { return table_.Find(str, Table::Hash(str)) != nullptr; }
+
+  void reserve(size_t n) { table_.Reserve(n); }
+
+  // See FlatStringTable::Freeze.
+  void Freeze() { table_.Freeze(); }
+
+  size_t size() const { return table_.size(); }
+  bool empty() const { return table_.size() == 0; }
+
+  void clear() { table_.Clear(); }
+
+  size_t MemoryUsage() const { return table_.MemoryUsage(); }
+
+  const_iterator begin() const { return const_iterator(table_.ctrl(), table_.slots(), end_slot()); }
+  const_iterator end() const { return const_iterator(nullptr, end_slot(), end_slot()); }
+
+ private:
+  Slot* end_slot() const { return table_.slots() + table_.capacity(); }
+
+  Table table_;
+};
+
+}  // namespace strings
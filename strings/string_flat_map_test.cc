@@ -0,0 +1,165 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "strings/string_flat_map.h"
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace strings {
+
+using std::string;
+using std::vector;
+
+class StringFlatMapTest : public testing::Test {
+ protected:
+  static vector<string> MakeKeys(unsigned num) {
+    vector<string> res;
+    for (unsigned i = 0; i < num; ++i) {
+      // Both inline and arena keys.
+      res.push_back(i % 2 ? std::to_string(i) : "a_long_key_of_the_arena_" + std::to_string(i));
+    }
+    return res;
+  }
+};
+
+TEST_F(StringFlatMapTest, Basic) {
+  StringFlatMap<int> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find("r1") == map.end());
+  EXPECT_TRUE(map.begin() == map.end());
+
+  map["r1"] = 1;
+  map["r2"] = 2;
+  EXPECT_TRUE(map.insert(StringFlatMap<int>::value_type("r3", 3)).second);
+  EXPECT_FALSE(map.insert(StringFlatMap<int>::value_type("r3", 4)).second);
+  EXPECT_FALSE(map.emplace("r3", 5).second);
+
+  auto it = map.find("r1");
+  ASSERT_TRUE(it != map.end());
+  EXPECT_EQ("r1", it->first);
+  EXPECT_EQ(1, it->second);
+
+  it->second++;
+  EXPECT_EQ(2, map["r1"]);
+  EXPECT_EQ(3, map["r3"]);
+  EXPECT_EQ(3, map.size());
+
+  map[""] = 7;
+  EXPECT_EQ(7, map.find("")->second);
+  EXPECT_EQ(4, map.size());
+}
+
+TEST_F(StringFlatMapTest, Grow) {
+  vector<string> keys = MakeKeys(10000);
+  StringFlatMap<unsigned> map;
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    EXPECT_TRUE(map.emplace(keys[i], i).second);
+  }
+  ASSERT_EQ(keys.size(), map.size());
+
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    auto it = map.find(keys[i]);
+    ASSERT_TRUE(it != map.end()) << keys[i];
+    EXPECT_EQ(i, it->second);
+  }
+  EXPECT_TRUE(map.find("missing") == map.end());
+
+  std::map<string, unsigned> sorted;
+  for (const auto& k_v : map) {
+    sorted.emplace(string(k_v.first), k_v.second);
+  }
+  ASSERT_EQ(keys.size(), sorted.size());
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(i, sorted[keys[i]]);
+  }
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find(keys[0]) == map.end());
+}
+
+TEST_F(StringFlatMapTest, Bulk) {
+  vector<string> keys = MakeKeys(1000);
+  vector<StringPiece> pieces;
+  for (unsigned i = 0; i < 3; ++i) {
+    pieces.insert(pieces.end(), keys.begin(), keys.end());
+  }
+
+  StringFlatMap<unsigned> dict;
+  unsigned next_id = 0;
+  vector<unsigned> ids(pieces.size());
+  dict.InsertBulk(pieces.data(), pieces.size(), [&](size_t i, unsigned& id, bool inserted) {
+    if (inserted)
+      id = next_id++;
+    ids[i] = id;
+  });
+
+  EXPECT_EQ(keys.size(), next_id);
+  EXPECT_EQ(keys.size(), dict.size());
+  for (unsigned i = 0; i < pieces.size(); ++i) {
+    EXPECT_EQ(i % keys.size(), ids[i]);
+  }
+
+  pieces.push_back("missing");
+  vector<const unsigned*> found(pieces.size());
+  dict.FindBulk(pieces.data(), pieces.size(), found.data());
+  for (unsigned i = 0; i + 1 < pieces.size(); ++i) {
+    ASSERT_TRUE(found[i]);
+    EXPECT_EQ(ids[i], *found[i]);
+  }
+  EXPECT_TRUE(found.back() == nullptr);
+}
+
+TEST_F(StringFlatMapTest, Freeze) {
+  vector<string> keys = MakeKeys(100);
+  StringFlatMap<unsigned> map;
+  map.reserve(10000);
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    map[keys[i]] = i;
+  }
+  size_t mem = map.MemoryUsage();
+  map.Freeze();
+  EXPECT_TRUE(map.frozen());
+  EXPECT_LT(map.MemoryUsage(), mem);
+
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(i, map.find(keys[i])->second);
+  }
+  EXPECT_EQ(6, ++map[keys[5]]);  // existing keys are still writable.
+  EXPECT_DEATH(map["missing"], "frozen");
+}
+
+TEST_F(StringFlatMapTest, Set) {
+  StringFlatSet set;
+  StringPiece foo1 = set.Get("foo");
+  string str("foo");
+  StringPiece foo2 = set.Get(str);
+  EXPECT_EQ(foo1, foo2);
+  EXPECT_EQ(foo1.data(), foo2.data());
+  EXPECT_NE(str.data(), foo2.data());
+
+  // The strings stay valid when the set grows.
+  vector<string> keys = MakeKeys(5000);
+  vector<StringPiece> pieces(keys.begin(), keys.end());
+  set.GetBulk(pieces.data(), pieces.size(), pieces.data());
+  EXPECT_EQ(foo1.data(), set.Get("foo").data());
+  EXPECT_EQ(keys.size() + 1, set.size());
+
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(keys[i], pieces[i]);
+    EXPECT_EQ(pieces[i].data(), set.Get(keys[i]).data());
+  }
+
+  size_t cnt = 0;
+  for (StringPiece s : set) {
+    EXPECT_TRUE(set.contains(s));
+    ++cnt;
+  }
+  EXPECT_EQ(set.size(), cnt);
+}
+
+}  // namespace strings
@@ -5,45 +5,48 @@
 #define UNIQUE_STRINGS_H
 
 #include <unordered_map>
-#include <unordered_set>
 
 #include <sparsehash/dense_hash_map>
 
 #include "base/arena.h"
-#include "base/counting_allocator.h"
-#include "strings/stringpiece.h"
 #include "strings/hash.h"
+#include "strings/string_flat_map.h"
+#include "strings/stringpiece.h"
 
 
+// Interns strings, see strings::StringFlatSet.
 class UniqueStrings {
 public:
-  typedef std::unordered_set<
-      StringPiece, std::hash<StringPiece>,
-      std::equal_to<StringPiece>, base::counting_allocator<StringPiece>> SSet;
+  typedef strings::StringFlatSet SSet;
   typedef SSet::const_iterator const_iterator;
 
   StringPiece Get(StringPiece source) {
-    return Insert(source).first;
+    return db_.Get(source);
   }
 
   // returns true if insert took place or false if source was already present.
   // In any case returns the StringPiece from the set.
-  std::pair<StringPiece, bool> Insert(StringPiece source);
+  std::pair<StringPiece, bool> Insert(StringPiece source) {
+    return db_.Insert(source);
+  }
+
+  // dest[i] = Get(src[i]), src and dest may alias.
+  void GetBulk(const StringPiece* src, size_t n, StringPiece* dest) {
+    db_.GetBulk(src, n, dest);
+  }
 
   size_t MemoryUsage() const {
-    return arena_.MemoryUsage() +  db_.get_allocator().bytes_allocated(); // db_.size()*sizeof(StringPiece);
+    return db_.MemoryUsage();
   }
 
   void Clear() {
     db_.clear();
-    base::Arena().Swap(arena_);
   }
 
   const_iterator begin() { return db_.begin(); }
   const_iterator end() { return db_.end(); }
 
 private:
-  base::Arena arena_;
   SSet db_;
 };
 
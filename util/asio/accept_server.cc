@@ -3,7 +3,11 @@
 //
 #include "util/asio/accept_server.h"
 
+#include <unistd.h>
+
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/fiber/mutex.hpp>
+#include <thread>
 
 #include "base/logging.h"
 #include "util/asio/io_context_pool.h"
@@ -21,6 +25,41 @@ AcceptServer::ListenerWrapper::ListenerWrapper(const endpoint& ep, IoContext* io
   port = acceptor.local_endpoint().port();
 }
 
+AcceptServer::ListenerWrapper::ListenerWrapper(const endpoint& ep, IoContext* io_context,
+                                               ListenerInterface* si,
+                                               std::shared_ptr<ListenerGroup> grp, int cpu)
+    : io_context(*io_context), acceptor(io_context->raw_context()), listener(si),
+      group(std::move(grp)) {
+  using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+  using incoming_cpu = asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU>;
+
+  acceptor.open(ep.protocol());
+  acceptor.set_option(acceptor::reuse_address(true));
+  acceptor.set_option(reuse_port(true));
+  if (cpu >= 0) {
+    system::error_code ec;
+    acceptor.set_option(incoming_cpu(cpu), ec);
+    LOG_IF(WARNING, ec) << "Could not set SO_INCOMING_CPU: " << ec.message();
+  }
+  acceptor.bind(ep);
+  acceptor.listen();
+  port = acceptor.local_endpoint().port();
+}
+
+AcceptServer::ListenerWrapper::ListenerWrapper(const std::string& path, IoContext* io_context,
+                                               ListenerInterface* si)
+    : io_context(*io_context), acceptor(io_context->raw_context()), listener(si), port(0),
+      unix_path(path) {
+  using local_proto = asio::local::stream_protocol;
+
+  unlink(path.c_str());
+  local_proto::acceptor local(io_context->raw_context(), local_proto::endpoint(path));
+
+  // The tcp acceptor accepts the unix domain connections just as well, so the rest of
+  // the server does not distinguish between them.
+  acceptor.assign(tcp::v4(), local.release());
+}
+
 AcceptServer::AcceptServer(IoContextPool* pool)
     : pool_(pool), signals_(pool->GetNextContext().raw_context(), SIGINT, SIGTERM), ref_bc_(1) {
 
@@ -71,6 +110,42 @@ unsigned short AcceptServer::AddListener(unsigned short port, ListenerInterface*
   return listener.port;
 }
 
+void AcceptServer::AddUnixListener(const std::string& path, ListenerInterface* si) {
+  CHECK(si);
+  CHECK(!was_run_);
+
+  si->RegisterPool(pool_);
+  listeners_.emplace_back(path, &pool_->GetNextContext(), si);
+
+  LOG(INFO) << "AcceptServer - listening on " << path;
+}
+
+unsigned short AcceptServer::AddReusePortListener(unsigned short port, ListenerInterface* si,
+                                                  bool steer_by_cpu) {
+  CHECK(si);
+  CHECK(!was_run_);
+
+  si->RegisterPool(pool_);
+
+  auto group = std::make_shared<ListenerGroup>(pool_->size());
+  listeners_.reserve(listeners_.size() + pool_->size());
+
+  for (unsigned i = 0; i < pool_->size(); ++i) {
+    // Unpinned threads do not steer the connections.
+    int cpu = steer_by_cpu ? pool_->at(i).cpu() : -1;
+
+    // Port 0 is resolved by the first bind, the rest of the listeners join its port.
+    tcp::endpoint endpoint(tcp::v4(), port);
+    listeners_.emplace_back(endpoint, &pool_->at(i), si, group, cpu);
+    port = listeners_.back().port;
+  }
+
+  LOG(INFO) << "AcceptServer - listening on port " << port << " in " << pool_->size()
+            << " threads";
+
+  return port;
+}
+
 void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
   CHECK(wrapper->io_context.InContextThread());
 
@@ -84,6 +159,10 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
     void wait(std::unique_lock<fibers::mutex>& lk) {
       clist_empty_cnd.wait(lk, [&] { return clist.empty(); });
     }
+
+    bool wait_for(std::unique_lock<fibers::mutex>& lk, std::chrono::milliseconds timeout) {
+      return clist_empty_cnd.wait_for(lk, timeout, [&] { return clist.empty(); });
+    }
   };
 
   std::shared_ptr<SharedCList> clist_ptr = std::make_shared<SharedCList>();
@@ -125,8 +204,9 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
 
         // handler->context() does not necessary equals to wrapper->io_context
         // and we possibly launching the connection in a different thread.
+        // Connection fibers come and go, hence they reuse the stacks of the closed ones.
         handler->context().AsyncFiber(
-            [&](ConnectionHandler::ptr_t conn_ptr) {
+            fibers_ext::PooledStack(), [&](ConnectionHandler::ptr_t conn_ptr) {
               conn_ptr->RunInIOThread();
               clean_cb(std::move(conn_ptr));  // signal our thread that we want to dispose it.
             }, handler);
@@ -136,7 +216,27 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
     LOG(WARNING) << ": caught exception : " << ex.what();
   }
 
-  wrapper->listener->PreShutdown();
+  // Listener groups shut down their ListenerInterface once.
+  ListenerGroup* group = wrapper->group.get();
+  if (!group || group->stopped.fetch_add(1) == 0)
+    wrapper->listener->PreShutdown();
+
+  if (!clist_ptr->clist.empty() && drain_timeout_.count() > 0) {
+    VLOG(1) << "Starting draining connections";
+    unsigned cnt = 0;
+
+    std::unique_lock<fibers::mutex> lk(clist_ptr->mu);
+
+    // Drain() does not wait for the connection to finish, so the connections drain in parallel.
+    for (auto it = clist_ptr->clist.begin(); it != clist_ptr->clist.end(); ++it, ++cnt) {
+      ConnectionHandler::ptr_t guard(&*it);  // it->Drain() is interruptable as well.
+      it->Drain();
+    }
+
+    bool drained = clist_ptr->wait_for(lk, drain_timeout_);
+    LOG_IF(INFO, !drained) << "Could not drain all " << cnt << " connections for port "
+                           << wrapper->port << " in " << drain_timeout_.count() << "ms";
+  }
 
   if (!clist_ptr->clist.empty()) {
     VLOG(1) << "Starting closing connections";
@@ -166,9 +266,15 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
     clist_ptr->wait(lk);
   }
 
-  wrapper->listener->PostShutdown();
+  if (!group || group->finished.fetch_add(1) + 1 == group->size)
+    wrapper->listener->PostShutdown();
 
-  LOG(INFO) << "Accept server stopped for port " << wrapper->port;
+  if (wrapper->unix_path.empty()) {
+    LOG(INFO) << "Accept server stopped for port " << wrapper->port;
+  } else {
+    unlink(wrapper->unix_path.c_str());
+    LOG(INFO) << "Accept server stopped for " << wrapper->unix_path;
+  }
 
   // Notify that AcceptThread is about to exit.
   ref_bc_.Dec();
@@ -176,7 +282,7 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
 }
 
 auto AcceptServer::AcceptConnection(ListenerWrapper* wrapper) -> AcceptResult {
-  IoContext& io_cntx = pool_->GetNextContext();
+  IoContext& io_cntx = wrapper->group ? wrapper->io_context : pool_->GetNextContext();
 
   system::error_code ec;
   tcp::socket sock(io_cntx.raw_context());
@@ -187,9 +293,11 @@ auto AcceptServer::AcceptConnection(ListenerWrapper* wrapper) -> AcceptResult {
   if (ec)
     return AcceptResult(nullptr, ec);
   DCHECK(sock.is_open()) << sock.native_handle();
-  VLOG(1) << "Accepted socket " << sock.remote_endpoint() << "/" << sock.native_handle();
+  VLOG(1) << "Accepted socket " << sock.remote_endpoint(ec) << "/" << sock.native_handle();
+  ec.clear();  // the unix domain sockets have no tcp endpoints.
 
   ConnectionHandler* conn = wrapper->listener->NewConnection(io_cntx);
+  conn->listener_ = wrapper->listener;
   conn->Init(std::move(sock));
 
   return AcceptResult(conn, ec);
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
 #include <tuple>
 
 #include <boost/asio/ip/tcp.hpp>
@@ -41,8 +45,26 @@ class AcceptServer {
   // Returns the port number to which the listener was bound.
   unsigned short AddListener(unsigned short port, ListenerInterface* cf);
 
+  // Opens a SO_REUSEPORT listener in every IO thread of the pool, so that the kernel spreads
+  // the connections between the threads and every thread serves the connections it accepted.
+  // If steer_by_cpu is true, every listener also prefers the connections whose packets are
+  // processed by the cpu of its thread (SO_INCOMING_CPU).
+  // Returns the port number to which the listeners were bound.
+  unsigned short AddReusePortListener(unsigned short port, ListenerInterface* cf,
+                                      bool steer_by_cpu = false);
+
+  // Listens on the unix domain socket at path, replacing the stale socket file if any.
+  // The clients connect to it with the "unix:<path>" host name, see FiberSyncSocket.
+  // The connections look like tcp sockets to cf, but they have no tcp options or endpoints.
+  void AddUnixListener(const std::string& path, ListenerInterface* cf);
+
   void TriggerOnBreakSignal(std::function<void()> f) { on_break_hook_ = std::move(f); }
 
+  // When stopped, the server drains its connections for up to timeout before closing
+  // the remaining ones: it stops accepting, signals the clients to go away and lets the requests
+  // in flight finish. 0 (the default) closes the connections right away.
+  void set_drain_timeout(std::chrono::milliseconds timeout) { drain_timeout_ = timeout; }
+
  private:
   using acceptor = ::boost::asio::ip::tcp::acceptor;
   using endpoint = ::boost::asio::ip::tcp::endpoint;
@@ -59,14 +81,33 @@ class AcceptServer {
 
   IoContextPool* pool_;
 
+  // Listeners of the same ListenerInterface that accept on the same port.
+  struct ListenerGroup {
+    unsigned size;
+    std::atomic_uint stopped{0}, finished{0};
+
+    explicit ListenerGroup(unsigned sz) : size(sz) {}
+  };
+
   struct ListenerWrapper {
     IoContext& io_context;
     ::boost::asio::ip::tcp::acceptor acceptor;
     ListenerInterface* listener;
     unsigned short port;
+    std::string unix_path;  // of the unix domain socket listeners, which have no port.
+
+    // Set for SO_REUSEPORT listeners, which serve their connections in io_context.
+    std::shared_ptr<ListenerGroup> group;
 
     ListenerWrapper(const endpoint& ep, IoContext* io_context,
                     ListenerInterface* si);
+
+    // Creates a SO_REUSEPORT listener. cpu is SO_INCOMING_CPU of the socket if not negative.
+    ListenerWrapper(const endpoint& ep, IoContext* io_context, ListenerInterface* si,
+                    std::shared_ptr<ListenerGroup> group, int cpu);
+
+    // Creates a unix domain socket listener.
+    ListenerWrapper(const std::string& path, IoContext* io_context, ListenerInterface* si);
   };
 
   ::boost::asio::signal_set signals_;
@@ -75,6 +116,7 @@ class AcceptServer {
 
   // Called if a termination signal has been caught (SIGTERM/SIGINT).
   std::function<void()> on_break_hook_;
+  std::chrono::milliseconds drain_timeout_{0};
   bool was_run_ = false;
 };
 
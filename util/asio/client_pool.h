@@ -0,0 +1,197 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "util/asio/io_context_pool.h"
+#include "util/fibers/event_count.h"
+#include "util/status.h"
+
+namespace util {
+
+// Pool of connected clients that is shared by the users of a process. Clients are kept per
+// IoContext of io_pool because they may be used only by the fibers of their thread.
+// Idle clients that failed or were not used for idle_evict_sec are closed instead of being
+// reused. If max_active is set, Get waits while that many clients of the IoContext are in use.
+// Client must provide "Status Connect(unsigned msec)" and "bool IsHealthy() const".
+// Get and the handle destruction must run in the IoContext thread that the handle belongs to.
+template <typename Client> class ClientPool {
+ public:
+  struct Options {
+    unsigned connect_msec = 2000;
+    unsigned idle_evict_sec = 60;
+    unsigned max_idle = 32;  // Maximal number of idle clients per IoContext.
+    unsigned max_active = 0;  // Maximal number of used clients per IoContext, 0 - unlimited.
+  };
+
+  // Returns the client into the pool of its IoContext.
+  class Returner {
+   public:
+    Returner(ClientPool* pool = nullptr, unsigned index = 0) : pool_(pool), index_(index) {}
+
+    void operator()(Client* client) const {
+      if (pool_) {
+        pool_->Return(index_, client);
+      } else {
+        delete client;
+      }
+    }
+
+   private:
+    ClientPool* pool_;
+    unsigned index_;
+  };
+
+  using Handle = std::unique_ptr<Client, Returner>;
+
+  // Creates a disconnected client for the IoContext.
+  using Factory = std::function<Client*(IoContext*)>;
+
+  ClientPool(IoContextPool* io_pool, Factory factory, const Options& opts)
+      : io_pool_(io_pool), factory_(std::move(factory)), opts_(opts), idle_(io_pool->size()),
+        active_(new Active[io_pool->size()]) {}
+
+  ~ClientPool() {
+    LOG_IF(WARNING, IdleCount() > 0) << IdleCount() << " idle clients were not cleared";
+  }
+
+  // Returns an idle connected client of the calling IoContext or connects a new one.
+  // Blocks the calling fiber while max_active clients are in use, hence a fiber that uses
+  // a client should not wait for another one.
+  StatusObject<Handle> Get();
+
+  // Closes the idle clients of the calling IoContext. Must be called from every IoContext
+  // thread before the pool is destroyed.
+  void ClearThisContext();
+
+  // Number of idle clients in all the IoContexts.
+  size_t IdleCount() const { return idle_count_.load(std::memory_order_relaxed); }
+
+  // Number of the clients of the calling IoContext that are in use.
+  unsigned ActiveCount() const {
+    return active_[ThisIndex()].count.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Idle {
+    std::unique_ptr<Client> client;
+    uint64_t since_usec;
+  };
+
+  // The clients may be returned from a foreign thread, hence the counter is atomic.
+  struct Active {
+    std::atomic<unsigned> count{0};
+    fibers_ext::EventCount ec;
+  };
+
+  unsigned ThisIndex() const {
+    IoContext* cntx = io_pool_->GetThisContext();
+    CHECK(cntx) << "Must run from IoContext thread";
+    return cntx - &io_pool_->at(0);
+  }
+
+  void Return(unsigned index, Client* client);
+  void Release(unsigned index);
+
+  // Drops the clients of the list that are idle for too long.
+  void Evict(uint64_t now, std::vector<Idle>* list);
+
+  IoContextPool* io_pool_;
+  Factory factory_;
+  Options opts_;
+
+  // Indexed by IoContext, each list is accessed only from its thread.
+  std::vector<std::vector<Idle>> idle_;
+  std::atomic<size_t> idle_count_{0};
+  std::unique_ptr<Active[]> active_;  // Indexed by IoContext.
+};
+
+template <typename Client> auto ClientPool<Client>::Get() -> StatusObject<Handle> {
+  unsigned index = ThisIndex();
+  Active& active = active_[index];
+  if (opts_.max_active) {
+    active.ec.await(
+        [&] { return active.count.load(std::memory_order_acquire) < opts_.max_active; });
+  }
+  // No preemption between the check above and the increment within the same thread.
+  active.count.fetch_add(1, std::memory_order_relaxed);
+
+  auto& list = idle_[index];
+  Evict(base::GetMonotonicMicrosFast(), &list);
+
+  // Prefer the most recently used clients, their connections are the least likely to be
+  // closed by the server.
+  while (!list.empty()) {
+    std::unique_ptr<Client> client = std::move(list.back().client);
+    list.pop_back();
+    idle_count_.fetch_sub(1, std::memory_order_relaxed);
+
+    if (client->IsHealthy()) {
+      return Handle(client.release(), Returner(this, index));
+    }
+    VLOG(1) << "Dropping unhealthy client";
+  }
+
+  std::unique_ptr<Client> client(factory_(&io_pool_->at(index)));
+  Status st = client->Connect(opts_.connect_msec);
+  if (!st.ok()) {
+    Release(index);
+    return st;
+  }
+
+  return Handle(client.release(), Returner(this, index));
+}
+
+template <typename Client> void ClientPool<Client>::Return(unsigned index, Client* client) {
+  std::unique_ptr<Client> ptr(client);
+
+  // Clients that are destroyed outside of their thread can not be reused.
+  if (io_pool_->at(index).InContextThread() && client->IsHealthy()) {
+    auto& list = idle_[index];
+    uint64_t now = base::GetMonotonicMicrosFast();
+    Evict(now, &list);
+    if (list.size() < opts_.max_idle) {
+      list.push_back(Idle{std::move(ptr), now});
+      idle_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  Release(index);
+}
+
+template <typename Client> void ClientPool<Client>::Release(unsigned index) {
+  Active& active = active_[index];
+  active.count.fetch_sub(1, std::memory_order_release);
+  if (opts_.max_active)
+    active.ec.notify();
+}
+
+template <typename Client>
+void ClientPool<Client>::Evict(uint64_t now, std::vector<Idle>* list) {
+  uint64_t limit = uint64_t(opts_.idle_evict_sec) * 1000000;
+
+  // The list is ordered by the time the clients were returned.
+  auto it = list->begin();
+  while (it != list->end() && now - it->since_usec > limit)
+    ++it;
+
+  size_t evicted = it - list->begin();
+  if (evicted) {
+    list->erase(list->begin(), it);
+    idle_count_.fetch_sub(evicted, std::memory_order_relaxed);
+  }
+}
+
+template <typename Client> void ClientPool<Client>::ClearThisContext() {
+  auto& list = idle_[ThisIndex()];
+  idle_count_.fetch_sub(list.size(), std::memory_order_relaxed);
+  list.clear();
+}
+
+}  // namespace util
@@ -6,9 +6,11 @@
 
 #include <boost/asio/dispatch.hpp>
 #include <boost/asio/write.hpp>
+#include <boost/fiber/fiber.hpp>
 
 #include "base/logging.h"
 #include "util/asio/io_context.h"
+#include "util/asio/io_uring.h"
 #include "util/stats/varz_stats.h"
 
 using namespace boost;
@@ -16,7 +18,23 @@ using namespace boost::asio;
 
 using namespace std;
 
-DEFINE_VARZ(VarzCount, connections);
+DEFINE_bool(conn_use_uring, false,
+            "Serve the accepted connections through io_uring of their IO threads when the kernel "
+            "supports it");
+
+DEFINE_bool(conn_coalesce_writes, false,
+            "Send the writes of the connection fibers that write in the same IO loop iteration "
+            "with a single syscall");
+
+DEFINE_uint32(conn_idle_timeout_ms, 0,
+              "Shuts down the connections whose requests did not complete for that long, "
+              "0 disables the timeout");
+
+DEFINE_VARZ(VarzShardedCount, connections);
+DEFINE_VARZ(VarzCount, idle_timeouts);
+DEFINE_VARZ(VarzShardedCount, throttled_reads);
+DEFINE_VARZ(VarzShardedCount, throttled_usec);
+DEFINE_VARZ(VarzCount, drained_connections);
 
 namespace util {
 
@@ -30,6 +48,11 @@ ConnectionHandler::ConnectionHandler(IoContext* context) noexcept : io_context_(
 }
 
 ConnectionHandler::~ConnectionHandler() {
+  // Releases what the connection still holds from the totals of the listener.
+  if (listener_) {
+    listener_->inflight_.fetch_sub(inflight_, std::memory_order_relaxed);
+    listener_->queued_bytes_.fetch_sub(queued_bytes_, std::memory_order_relaxed);
+  }
 }
 
 void ConnectionHandler::Init(asio::ip::tcp::socket&& sock) {
@@ -37,7 +60,7 @@ void ConnectionHandler::Init(asio::ip::tcp::socket&& sock) {
   ip::tcp::no_delay nd(true);
   system::error_code ec;
   sock.set_option(nd, ec);
-  if (ec)
+  if (ec && ec != system::errc::operation_not_supported)  // unix domain sockets do not nodelay.
     LOG(ERROR) << "Could not set socket option " << ec.message() << " " << ec;
 
   sock.non_blocking(true, ec);
@@ -57,13 +80,38 @@ void ConnectionHandler::RunInIOThread() {
   connections.Inc();
 
   CHECK(socket_);
+  if (FLAGS_conn_use_uring) {
+    IoUring* ring = IoUring::ForThisThread(&io_context_);
+    if (ring)
+      socket_->set_uring(ring);
+  }
+  socket_->set_write_coalescing(FLAGS_conn_coalesce_writes);
   OnOpenSocket();
 
   VLOG(1) << "ConnectionHandler::RunInIOThread: " << socket_->native_handle();
   system::error_code ec;
 
+  // The timer runs Close() in a separate fiber because its callback can not block.
+  // The fiber holds a reference so that this outlives it.
+  TimerService::Timer idle_timer(&io_context_.timers(), [this] {
+    VLOG(1) << "Idle timeout " << socket_->native_handle();
+    idle_timeouts.Inc();
+    fibers::fiber([guard = ptr_t(this)] { guard->Close(); }).detach();
+  });
+  const auto idle_timeout = std::chrono::milliseconds(FLAGS_conn_idle_timeout_ms);
+
   try {
     while (socket_->is_open()) {
+      // Throttled connections are not idle.
+      if (!Admitted()) {
+        idle_timer.Cancel();
+        WaitForAdmission();
+        continue;  // the socket could be closed meanwhile.
+      }
+
+      // Rescheduling is cheap, so we do it for every request.
+      if (FLAGS_conn_idle_timeout_ms)
+        idle_timer.Arm(idle_timeout);
       ec = HandleRequest();
       if (ec) {
         if (!IsExpectedFinish(ec)) {
@@ -79,7 +127,10 @@ void ConnectionHandler::RunInIOThread() {
     LOG(ERROR) << str;
   }
 
+  idle_timer.Cancel();
   Close();
+  if (drain_fiber_.joinable())
+    drain_fiber_.join();
 
   connections.IncBy(-1);
 
@@ -97,6 +148,7 @@ void ConnectionHandler::Close() {
     VLOG(1) << "Before shutdown " << socket_->native_handle();
     socket_->Shutdown(ec);
     VLOG(1) << "After shutdown: " << ec << " " << ec.message();
+    admission_ec_.notifyAll();  // the waiters recheck is_open().
     // socket::close() closes the underlying socket and cancels the pending operations.
     // HOWEVER the problem is that those operations return with ec = ok()
     // so the flow  is not aware that the socket is closed.
@@ -106,6 +158,97 @@ void ConnectionHandler::Close() {
   });
 }
 
+void ConnectionHandler::Drain() {
+  // Run the hook in the connection thread. RunInIOThread() joins the fiber, which is not
+  // started once the socket is closed. We start it before OnDrain() because the hook may block.
+  io_context_.AwaitSafe([this] {
+    if (draining_ || !socket_->is_open())
+      return;
+
+    VLOG(1) << "Draining " << socket_->native_handle() << ", inflight/queued: " << inflight_
+            << "/" << queued_bytes_;
+    draining_ = true;
+    drain_fiber_ = fibers::fiber(&ConnectionHandler::DrainInThread, this);
+    OnDrain();
+  });
+}
+
+void ConnectionHandler::DrainInThread() {
+  // Requests may still come until the client handles the signal, they are served as well.
+  admission_ec_.await([this] {
+    return !socket_->is_open() || (inflight_ == 0 && queued_bytes_ == 0);
+  });
+  drained_connections.Inc();
+  Close();
+}
+
+void ConnectionHandler::RequestStarted() {
+  ++inflight_;
+  if (listener_)
+    listener_->inflight_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ConnectionHandler::RequestFinished() {
+  DCHECK_GT(inflight_, 0);
+  --inflight_;
+  if (listener_)
+    listener_->inflight_.fetch_sub(1, std::memory_order_relaxed);
+  if (throttled_ || draining_)
+    admission_ec_.notifyAll();
+}
+
+void ConnectionHandler::AddQueuedBytes(int64_t delta) {
+  queued_bytes_ += delta;
+  if (listener_)
+    listener_->queued_bytes_.fetch_add(delta, std::memory_order_relaxed);
+  if (delta < 0 && (throttled_ || draining_))
+    admission_ec_.notifyAll();
+}
+
+bool ConnectionHandler::Admitted() const {
+  if (!listener_ || !listener_->has_limits_)
+    return true;
+
+  auto below = [](uint64_t val, uint64_t limit) { return limit == 0 || val < limit; };
+  const AdmissionLimits& conn = listener_->conn_limits_;
+  const AdmissionLimits& total = listener_->listener_limits_;
+
+  return below(inflight_, conn.max_inflight) && below(queued_bytes_, conn.max_queued_bytes) &&
+         below(listener_->inflight_.load(std::memory_order_relaxed), total.max_inflight) &&
+         below(listener_->queued_bytes_.load(std::memory_order_relaxed), total.max_queued_bytes);
+}
+
+void ConnectionHandler::WaitForAdmission() {
+  // The connection itself wakes us when its limits allow, but the totals of the listener
+  // change in other threads, hence we also recheck them periodically.
+  constexpr auto kListenerPollPeriod = std::chrono::milliseconds(1);
+
+  VLOG(1) << "Throttling " << socket_->native_handle() << ", inflight/queued: " << inflight_
+          << "/" << queued_bytes_;
+  throttled_reads.Inc();
+  throttled_ = true;
+  auto start = std::chrono::steady_clock::now();
+  auto pred = [this] { return !socket_->is_open() || Admitted(); };
+
+  while (!pred()) {
+    io_context_.timers().AwaitFor(&admission_ec_, pred, kListenerPollPeriod);
+  }
+  throttled_ = false;
+
+  auto delta = std::chrono::steady_clock::now() - start;
+  throttled_usec.IncBy(std::chrono::duration_cast<std::chrono::microseconds>(delta).count());
+}
+
+void ListenerInterface::set_connection_limits(const AdmissionLimits& limits) {
+  conn_limits_ = limits;
+  has_limits_ = true;
+}
+
+void ListenerInterface::set_listener_limits(const AdmissionLimits& limits) {
+  listener_limits_ = limits;
+  has_limits_ = true;
+}
+
 void ListenerInterface::RegisterPool(IoContextPool* pool) {
   // In tests we might relaunch AcceptServer with the same listener, so we allow
   // reassigning the same pool.
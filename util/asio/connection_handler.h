@@ -6,17 +6,29 @@
 #include <absl/types/optional.h>
 
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/fiber.hpp>
 #include <boost/intrusive/list.hpp>
 #include <boost/intrusive/slist_hook.hpp>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 
 #include "util/asio/fiber_socket.h"
+#include "util/fibers/event_count.h"
 
 namespace util {
 
 class IoContextPool;
 class IoContext;
 class AcceptServer;
+class ListenerInterface;
+
+// Limits of the requests that connections run and of the bytes they queue for sending,
+// 0 means unlimited. When a limit is exceeded, the connections stop reading requests until
+// their requests finish or their queues drain. The handlers that run the requests
+// synchronously and write the responses directly have a single request in flight.
+struct AdmissionLimits {
+  uint32_t max_inflight = 0;
+  uint64_t max_queued_bytes = 0;
+};
 
 namespace detail {
 using namespace ::boost::intrusive;
@@ -53,6 +65,11 @@ class ConnectionHandler {
 
   void Close();
 
+  // Stops the connection gracefully: signals the client that the connection goes away,
+  // lets the requests in flight finish and closes the connection once their responses
+  // are sent. Does not wait for that, Close() still closes the connection right away.
+  void Drain();
+
   IoContext& context() { return io_context_; }
 
   friend void intrusive_ptr_add_ref(ConnectionHandler* ctx) noexcept {
@@ -85,9 +102,22 @@ class ConnectionHandler {
   // before the object is destroyed. Will run in io context thread of the socket.
   virtual void OnCloseSocket() {}
 
+  // Called once when the connection starts draining, see Drain(). Derived handlers signal
+  // their clients here to stop sending requests. Will run in io context thread of the socket.
+  virtual void OnDrain() {}
+
   // Should not block the thread. Can fiber-block (fiber friendly).
   virtual boost::system::error_code HandleRequest() = 0;
 
+  // The derived handlers report the requests they run and the responses they queue, so that
+  // the connection stops reading requests when it exceeds the limits of its listener.
+  // Must be called from the thread of the connection.
+  void RequestStarted();
+  void RequestFinished();
+  void AddQueuedBytes(int64_t delta);
+
+  bool draining() const { return draining_; }
+
   absl::optional<FiberSyncSocket> socket_;
 
   IoContext& io_context_;
@@ -95,7 +125,20 @@ class ConnectionHandler {
  private:
   void RunInIOThread();
 
+  bool Admitted() const;
+  void WaitForAdmission();
+  void DrainInThread();
+
   std::atomic<std::uint32_t> use_count_{0};
+
+  ListenerInterface* listener_ = nullptr;  // set by AcceptServer.
+  uint32_t inflight_ = 0;
+  uint64_t queued_bytes_ = 0;
+  bool throttled_ = false, draining_ = false;
+
+  // Notified when a throttled connection may proceed and when a draining one becomes idle.
+  fibers_ext::EventCount admission_ec_;
+  ::boost::fibers::fiber drain_fiber_;  // waits for the draining connection to become idle.
 };
 
 // Abstracts away connections implementation and their life-cycle.
@@ -114,11 +157,24 @@ class ListenerInterface {
   // Called by AcceptServer when shutting down finalized and after all connections are closed.
   virtual void PostShutdown() {}
 
+  // The limits of every connection and of all the connections of the listener together.
+  // Must be set before the connections are accepted.
+  void set_connection_limits(const AdmissionLimits& limits);
+  void set_listener_limits(const AdmissionLimits& limits);
+
  protected:
   IoContextPool* pool() { return pool_; }
 
  private:
+  friend class ConnectionHandler;
+
   IoContextPool* pool_ = nullptr;
+
+  AdmissionLimits conn_limits_, listener_limits_;
+  bool has_limits_ = false;
+
+  // The totals of the connections of the listener, updated from their threads.
+  std::atomic<uint64_t> inflight_{0}, queued_bytes_{0};
 };
 
 }  // namespace util
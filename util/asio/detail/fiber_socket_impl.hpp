@@ -3,15 +3,35 @@
 //
 #pragma once
 
+#include <sys/uio.h>
+
 #include <boost/asio/ip/tcp.hpp>
+#include <deque>
 
 #include "util/asio/yield.h"
 
 namespace util {
 class IoContext;
+class IoUring;
 
 namespace detail {
 
+// The host names of the unix domain sockets, see FiberSyncSocket.
+constexpr char kUnixPrefix[] = "unix:";
+
+// Fills dest with up to max non-empty buffers of bufs. Returns the number of filled entries.
+template <typename BS> unsigned FillIovec(const BS& bufs, iovec* dest, unsigned max) {
+  unsigned cnt = 0;
+  for (auto it = ::boost::asio::buffer_sequence_begin(bufs);
+       it != ::boost::asio::buffer_sequence_end(bufs) && cnt < max; ++it) {
+    auto buf = *it;
+    if (buf.size()) {
+      dest[cnt++] = iovec{const_cast<void*>(buf.data()), buf.size()};
+    }
+  }
+  return cnt;
+}
+
 class FiberSocketImpl {
  public:
   using error_code = ::boost::system::error_code;
@@ -68,7 +88,37 @@ class FiberSocketImpl {
   bool keep_alive() const { return keep_alive_;}
   void set_keep_alive(bool flag) { keep_alive_ = flag;}
 
+  void set_uring(IoUring* ring);
+
+  void set_write_coalescing(bool flag) { coalesce_writes_ = flag; }
+
+  // Writes all the buffers. Returns the number of bytes written.
+  size_t WriteV(const iovec* iov, unsigned iovcnt, error_code& ec);
+
+  // Sends len bytes of file fd from offset. Returns the number of bytes sent.
+  size_t SendFile(int fd, off_t offset, size_t len, error_code& ec);
+
  private:
+  struct PendingWrite;
+
+  // Maximal number of buffers of a single write.
+  static constexpr unsigned kMaxIovec = 16;
+
+  // Sends at least one byte of the buffers. Returns the number of bytes sent.
+  size_t SendIovec(const iovec* iov, unsigned iovcnt, error_code& ec);
+
+  // Queues the buffers to be sent together with the buffers of the other fibers that write
+  // to the socket in the same loop iteration. Writes all the buffers and advances iov.
+  size_t CoalescedWrite(iovec* iov, unsigned iovcnt, error_code& ec);
+
+  // Sends the buffers of the pending writes with a single call and completes the writes
+  // that were sent.
+  void FlushWrites();
+
+  // io_uring transport of read_some/write_some.
+  size_t UringReadSome(const iovec* iov, unsigned iovcnt, error_code& ec);
+  size_t UringWriteSome(const iovec* iov, unsigned iovcnt, error_code& ec);
+
   // Asynchronous function that make this socket a client socket and initiates client-flow
   // connection process. Should be called only once. Can be called from any thread.
   void InitiateConnection();
@@ -77,6 +127,7 @@ class FiberSocketImpl {
 
   void WakeWorker();
   error_code Reconnect(const std::string& hname, const std::string& service);
+  error_code ReconnectUnix(const std::string& path);
   void SetStatus(const error_code& ec, const char* where);
 
   error_code status_;
@@ -93,6 +144,10 @@ class FiberSocketImpl {
 
   std::string hname_, port_;
   IoContext* io_cntx_ = nullptr;
+  IoUring* uring_ = nullptr;
+
+  bool coalesce_writes_ = false, flushing_writes_ = false;
+  std::deque<PendingWrite*> pending_writes_;
 
   // Stuff related to client sockets.
   struct ClientData;
@@ -122,7 +177,13 @@ template <typename MBS> size_t FiberSocketImpl::read_some(const MBS& bufs, error
   size_t user_size = asio::buffer_size(bufs);
   auto new_seq = make_buffer_seq(bufs, asio::mutable_buffer(rbuf_.get(), rbuf_size_));
 
-  size_t read_size = sock_.read_some(new_seq, ec);
+  size_t read_size;
+  if (uring_) {
+    iovec iov[kMaxIovec];
+    read_size = UringReadSome(iov, FillIovec(new_seq, iov, kMaxIovec), ec);
+  } else {
+    read_size = sock_.read_some(new_seq, ec);
+  }
   if (ec == asio::error::would_block) {
     read_state_ = READ_ACTIVE;
     read_size = sock_.async_read_some(new_seq, fibers_ext::yield[ec]);
@@ -142,6 +203,15 @@ template <typename MBS> size_t FiberSocketImpl::read_some(const MBS& bufs, error
 }
 
 template <typename BS> size_t FiberSocketImpl::write_some(const BS& bufs, error_code& ec) {
+  if (coalesce_writes_) {
+    iovec iov[kMaxIovec];
+    return CoalescedWrite(iov, FillIovec(bufs, iov, kMaxIovec), ec);
+  }
+  if (uring_) {
+    iovec iov[kMaxIovec];
+    return UringWriteSome(iov, FillIovec(bufs, iov, kMaxIovec), ec);
+  }
+
   size_t res = sock_.write_some(bufs, ec);
   if (ec == ::boost::asio::error::would_block) {
     return sock_.async_write_some(bufs, fibers_ext::yield[ec]);
@@ -18,6 +18,8 @@
 
 #include <mutex>  // std::unique_lock
 
+#include "util/asio/handler_allocator.h"
+
 namespace util {
 namespace fibers_ext {
 namespace detail {
@@ -77,6 +79,10 @@ struct yield_completion {
 // should be instantiated only once.
 class yield_handler_base {
  public:
+  // asio allocates the state of the async operation with the associated allocator
+  // of its handler.
+  using allocator_type = RecyclingAllocator<void>;
+
   yield_handler_base(yield_t const& y)
       :  // capture the context* associated with the running fiber
         ctx_{fbs::context::active()},
@@ -112,6 +118,8 @@ class yield_handler_base {
     }
   }
 
+  allocator_type get_allocator() const noexcept { return allocator_type{}; }
+
   void bind(yield_completion::ptr_t ptr, boost::system::error_code* ec) {
     // if yield_t didn't bind an error_code, make yield_handler_base's
     // error_code* point to an error_code local to this object so
@@ -0,0 +1,186 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/dns_cache.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "util/asio/io_context.h"
+#include "util/asio/yield.h"
+#include "util/stats/varz_stats.h"
+
+DEFINE_uint32(dns_cache_ttl_sec, 60,
+              "For how long the resolved addresses of the client sockets are used before "
+              "they are refreshed in the background");
+DEFINE_uint32(dns_cache_stale_sec, 600,
+              "For how long the expired addresses are still used while their refresh fails");
+
+DEFINE_VARZ(VarzShardedMapCount, dns_cache);
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+using asio::ip::tcp;
+
+namespace {
+
+// The pause between the background refreshes of the name that fails to resolve.
+constexpr auto kRetryPeriod = chrono::seconds(1);
+
+}  // namespace
+
+DnsCache::DnsCache() {}
+
+DnsCache::~DnsCache() {
+  std::unique_lock<fibers::mutex> lk(mu_);
+  cv_.wait(lk, [this] { return refreshes_ == 0; });
+}
+
+DnsCache& DnsCache::Default() {
+  static DnsCache* cache = new DnsCache;  // never destroyed since the sockets may outlive it.
+  return *cache;
+}
+
+auto DnsCache::Lookup(const string& host, const string& service, IoContext* cntx,
+                      endpoint_t* ep) -> error_code {
+  const auto ttl = chrono::seconds(FLAGS_dns_cache_ttl_sec);
+  const auto stale = chrono::seconds(FLAGS_dns_cache_stale_sec);
+
+  std::unique_lock<fibers::mutex> lk(mu_);
+  Entry& e = entries_[Key(host, service)];
+  auto pick = [&] {
+    // The addresses that failed earlier come later, the first one wins the ties.
+    auto it = std::min_element(e.addrs.begin(), e.addrs.end(),
+                               [](const Address& a, const Address& b) {
+                                 return a.failed_at < b.failed_at;
+                               });
+    *ep = it->ep;
+    return error_code{};
+  };
+
+  while (true) {
+    auto now = clock_t::now();
+    auto age = now - e.resolved_at;
+    if (!e.addrs.empty() && (e.pinned || age <= ttl + stale)) {
+      if (!e.pinned && age > ttl && !e.resolving && now >= e.retry_at) {
+        e.resolving = true;
+        ++refreshes_;
+        cntx->AsyncFiber(&DnsCache::Refresh, this, host, service, cntx);
+      }
+      dns_cache.Inc("hit");
+      return pick();
+    }
+
+    if (!e.resolving) {
+      // Fails fast instead of resolving again right after the resolve failed.
+      if (e.last_error && now < e.retry_at)
+        return e.last_error;
+      break;
+    }
+    cv_.wait(lk);  // another fiber resolves the name.
+  }
+
+  dns_cache.Inc("miss");
+  e.resolving = true;
+  lk.unlock();
+
+  vector<endpoint_t> addrs;
+  error_code ec = Resolve(host, service, cntx, &addrs);
+
+  lk.lock();
+  FinishResolve(ec, std::move(addrs), &e);
+  if (ec)
+    return ec;
+  if (e.addrs.empty())  // invalidated or set to nothing meanwhile.
+    return asio::error::host_not_found;
+  return pick();
+}
+
+void DnsCache::ReportFailure(const string& host, const string& service, const endpoint_t& ep) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  auto it = entries_.find(Key(host, service));
+  if (it == entries_.end())
+    return;
+  for (Address& addr : it->second.addrs) {
+    if (addr.ep == ep)
+      addr.failed_at = clock_t::now();
+  }
+}
+
+void DnsCache::Set(const string& host, const string& service, vector<endpoint_t> addrs) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  Entry& e = entries_[Key(host, service)];
+  e.addrs.clear();
+  for (const endpoint_t& ep : addrs)
+    e.addrs.push_back(Address{ep, clock_t::time_point{}});
+  e.pinned = true;
+}
+
+void DnsCache::Invalidate(const string& host, const string& service) {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  auto it = entries_.find(Key(host, service));
+  if (it != entries_.end()) {
+    it->second.addrs.clear();
+    it->second.pinned = false;
+  }
+}
+
+auto DnsCache::Resolve(const string& host, const string& service, IoContext* cntx,
+                       vector<endpoint_t>* res) -> error_code {
+  DCHECK(cntx->InContextThread());
+
+  error_code ec;
+  tcp::resolver resolver(cntx->raw_context());
+  auto results = resolver.async_resolve(tcp::v4(), host, service, fibers_ext::yield[ec]);
+  if (ec) {
+    VLOG(1) << "Resolver error for " << host << ":" << service << " " << ec;
+    return ec;
+  }
+
+  for (const auto& entry : results) {
+    res->push_back(entry.endpoint());
+  }
+  DVLOG(1) << "Resolved " << host << ":" << service << " to " << res->size() << " addresses";
+  return ec;
+}
+
+void DnsCache::FinishResolve(const error_code& ec, vector<endpoint_t> addrs, Entry* e) {
+  e->resolving = false;
+  e->last_error = ec;
+  cv_.notify_all();
+
+  if (ec) {
+    dns_cache.Inc("error");
+    e->retry_at = clock_t::now() + kRetryPeriod;
+    return;
+  }
+
+  // The pinned addresses take precedence over the resolved ones.
+  if (e->pinned)
+    return;
+
+  // Keeps the failure history of the addresses that are still there.
+  vector<Address> next;
+  for (const endpoint_t& ep : addrs) {
+    auto it = std::find_if(e->addrs.begin(), e->addrs.end(),
+                           [&](const Address& a) { return a.ep == ep; });
+    next.push_back(Address{ep, it == e->addrs.end() ? clock_t::time_point{} : it->failed_at});
+  }
+  e->addrs.swap(next);
+  e->resolved_at = clock_t::now();
+}
+
+void DnsCache::Refresh(string host, string service, IoContext* cntx) {
+  vector<endpoint_t> addrs;
+  error_code ec = Resolve(host, service, cntx, &addrs);
+  LOG_IF(WARNING, ec) << "Could not refresh " << host << ":" << service << ", " << ec.message();
+
+  std::lock_guard<fibers::mutex> lk(mu_);
+  dns_cache.Inc("refresh");
+  --refreshes_;  // FinishResolve notifies the destructor as well.
+  FinishResolve(ec, std::move(addrs), &entries_[Key(host, service)]);
+}
+
+}  // namespace util
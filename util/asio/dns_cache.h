@@ -0,0 +1,87 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace util {
+
+class IoContext;
+
+// Cache of the resolved addresses of (host, service) pairs used by the client sockets.
+// The addresses are fresh for --dns_cache_ttl_sec. The lookups of the expired addresses still
+// return them but refresh them in the background, for up to --dns_cache_stale_sec more.
+// Afterwards the lookups resolve the name again (and wait for it). The concurrent lookups of
+// the same name share a single resolve, so DNS latency does not multiply into resolve storms.
+// Lookup also picks the address to connect to: the addresses that failed to connect recently
+// are tried after the others.
+// Thread-safe and fiber-friendly.
+class DnsCache {
+ public:
+  using error_code = ::boost::system::error_code;
+  using endpoint_t = ::boost::asio::ip::tcp::endpoint;
+  using clock_t = std::chrono::steady_clock;
+
+  DnsCache();
+  ~DnsCache();
+
+  // The cache of FiberSyncSocket clients.
+  static DnsCache& Default();
+
+  // Returns the address of host:service to connect to. Resolves the name in cntx if needed,
+  // hence must be called from a fiber that runs in the thread of cntx.
+  error_code Lookup(const std::string& host, const std::string& service, IoContext* cntx,
+                    endpoint_t* ep);
+
+  // Deprioritizes ep in the next lookups of host:service.
+  void ReportFailure(const std::string& host, const std::string& service, const endpoint_t& ep);
+
+  // Sets the addresses of host:service. Unlike the resolved addresses they do not expire.
+  void Set(const std::string& host, const std::string& service, std::vector<endpoint_t> addrs);
+
+  // The next lookup of host:service resolves the name.
+  void Invalidate(const std::string& host, const std::string& service);
+
+ private:
+  struct Address {
+    endpoint_t ep;
+    clock_t::time_point failed_at;  // the epoch if it did not fail.
+  };
+
+  struct Entry {
+    std::vector<Address> addrs;
+    clock_t::time_point resolved_at, retry_at;
+    error_code last_error;  // of the last resolve.
+    bool pinned = false;     // set by Set().
+    bool resolving = false;  // a resolve is in flight.
+  };
+
+  static std::string Key(const std::string& host, const std::string& service) {
+    return host + ':' + service;
+  }
+
+  // Must be called in the thread of cntx.
+  static error_code Resolve(const std::string& host, const std::string& service, IoContext* cntx,
+                            std::vector<endpoint_t>* res);
+
+  // Updates e with the result of its resolve. Called under mu_.
+  void FinishResolve(const error_code& ec, std::vector<endpoint_t> addrs, Entry* e);
+
+  void Refresh(std::string host, std::string service, IoContext* cntx);
+
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable cv_;  // notified when the resolves finish.
+
+  // The references to the entries stay valid because we never erase them.
+  std::unordered_map<std::string, Entry> entries_;
+  unsigned refreshes_ = 0;  // the number of the background refreshes in flight.
+};
+
+}  // namespace util
@@ -0,0 +1,19 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/event_fd_waiter.h"
+
+#include <unistd.h>
+
+#include "base/logging.h"
+
+namespace util {
+
+EventFdWaiter::EventFdWaiter(IoContext& cntx, base::EventFdCount* ec)
+    : ec_(ec), sd_(cntx.raw_context()) {
+  int fd = dup(ec->fd());
+  CHECK_GE(fd, 0) << "dup failed " << errno;
+  sd_.assign(fd);
+}
+
+}  // namespace util
@@ -0,0 +1,53 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include "base/event_fd_count.h"
+#include "util/asio/io_context.h"
+#include "util/asio/yield.h"
+
+namespace util {
+
+// Waits for a base::EventFdCount from the fibers of an IoContext. The eventfd is registered with
+// the reactor of the context, so the notifiers in the other threads wake the IO loop directly
+// instead of posting a handler into it, and the threads that are not IO threads can wait for
+// the same event count with EventFdCount::WaitAny. Must be used only from the thread of cntx.
+class EventFdWaiter {
+ public:
+  using error_code = ::boost::system::error_code;
+
+  EventFdWaiter(IoContext& cntx, base::EventFdCount* ec);
+
+  // Fiber-blocks until condition() is true. Returns operation_aborted if Cancel() was called.
+  template <typename Condition> error_code Await(Condition condition);
+
+  // Aborts the pending Await.
+  void Cancel() { sd_.cancel(); }
+
+ private:
+  base::EventFdCount* ec_;
+  ::boost::asio::posix::stream_descriptor sd_;  // owns a duplicate of the eventfd.
+};
+
+template <typename Condition> auto EventFdWaiter::Await(Condition condition) -> error_code {
+  error_code ec;
+  while (!condition()) {
+    base::EventFdCount::Key key = ec_->prepareWait();
+    if (condition()) {
+      ec_->cancelWait();
+      break;
+    }
+
+    // A stale wakeup of a cancelled wait returns at once, then we check the condition again.
+    sd_.async_wait(::boost::asio::posix::stream_descriptor::wait_read, fibers_ext::yield[ec]);
+    ec_->finishWait(key);
+    if (ec)
+      break;
+  }
+  return ec;
+}
+
+}  // namespace util
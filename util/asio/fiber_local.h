@@ -0,0 +1,65 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/fiber/context.hpp>
+
+#include "base/logging.h"
+#include "util/asio/io_context.h"
+
+namespace util {
+
+/*
+  Per-fiber variable of the fibers that run in IoContext threads. The values are stored
+  directly in IoFiberProperties, so accessing them costs a few loads, unlike
+  boost::fibers::fiber_specific_ptr that looks them up in a map. The value of a fiber is
+  destroyed when the fiber exits. Use it for the state that thread_local can not express
+  because the fibers of the thread would share it, i.e. per-fiber arenas or tracing context:
+
+    static FiberLocal<Arena> arena;
+    if (!arena.get())
+      arena.reset(new Arena);
+
+  At most IoFiberProperties::NUM_LOCAL_SLOTS variables may exist in the process, hence
+  FiberLocal should be a static or a long-lived global object.
+*/
+template <typename T> class FiberLocal {
+ public:
+  FiberLocal() : slot_(detail::AllocateFiberLocalSlot(&Delete)) {}
+  FiberLocal(const FiberLocal&) = delete;
+  void operator=(const FiberLocal&) = delete;
+
+  // Returns the value of the calling fiber or null if it was not set or if the fiber does not
+  // run in IoContext thread.
+  T* get() const {
+    IoFiberProperties* props = properties();
+    return props ? static_cast<T*>(props->local(slot_)) : nullptr;
+  }
+
+  T* operator->() const { return get(); }
+  T& operator*() const { return *get(); }
+
+  // Takes ownership over t and destroys the previous value of the calling fiber.
+  void reset(T* t = nullptr) { delete release(t); }
+
+  // Releases the ownership over the value of the fiber and sets it to t.
+  T* release(T* t = nullptr) {
+    IoFiberProperties* props = properties();
+    CHECK(props) << "FiberLocal is used outside of IoContext fibers";
+    return static_cast<T*>(props->exchange_local(slot_, t));
+  }
+
+ private:
+  static void Delete(void* ptr) { delete static_cast<T*>(ptr); }
+
+  // The properties of the fibers of IoContext threads are always IoFiberProperties,
+  // hence we skip dynamic_cast of boost::this_fiber::properties.
+  static IoFiberProperties* properties() {
+    return static_cast<IoFiberProperties*>(::boost::fibers::context::active()->get_properties());
+  }
+
+  unsigned slot_;
+};
+
+}  // namespace util
@@ -3,11 +3,20 @@
 //
 #include "util/asio/fiber_socket.h"
 
-#include <boost/asio/connect.hpp>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/post.hpp>
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 
 #include "base/logging.h"
+#include "util/asio/dns_cache.h"
 #include "util/asio/io_context.h"
+#include "util/asio/io_uring.h"
 
 namespace util {
 
@@ -18,6 +27,34 @@ namespace detail {
 
 using socket_t = FiberSocketImpl::next_layer_type;
 
+namespace {
+
+// Skips the first n bytes of the buffers.
+void AdvanceIovec(size_t n, iovec** iov, unsigned* iovcnt) {
+  while (*iovcnt && n >= (*iov)->iov_len) {
+    n -= (*iov)->iov_len;
+    ++*iov;
+    --*iovcnt;
+  }
+  if (n) {
+    DCHECK(*iovcnt);
+    (*iov)->iov_base = static_cast<char*>((*iov)->iov_base) + n;
+    (*iov)->iov_len -= n;
+  }
+}
+
+}  // namespace
+
+struct FiberSocketImpl::PendingWrite {
+  iovec* iov;
+  unsigned iovcnt;
+  size_t written = 0;
+  error_code ec;
+  fibers_ext::Done done;
+
+  PendingWrite(iovec* v, unsigned cnt) : iov(v), iovcnt(cnt) {}
+};
+
 struct FiberSocketImpl::ClientData {
   ::boost::fibers::fiber worker;
   fibers_ext::condition_variable_any cv_st, worker_cv;
@@ -88,6 +125,203 @@ void FiberSocketImpl::SetStatus(const error_code& ec, const char* where) {
   }
 }
 
+void FiberSocketImpl::set_uring(IoUring* ring) {
+  // Client sockets are read by their worker fibers through asio reactor.
+  CHECK(!clientsock_data_);
+  uring_ = ring;
+}
+
+// The socket stays in non-blocking mode for asio, hence older kernels return EAGAIN instead of
+// parking the requests until the socket is ready. Then we wait for the readiness through the
+// ring as well, so that the wait is submitted in the same batch as the requests of the other
+// fibers.
+size_t FiberSocketImpl::UringReadSome(const iovec* iov, unsigned iovcnt, error_code& ec) {
+  if (iovcnt == 0)
+    return 0;
+
+  while (true) {
+    ssize_t res = uring_->RecvMsg(sock_.native_handle(), iov, iovcnt);
+    if (res > 0)
+      return res;
+    if (res == 0) {
+      ec = asio::error::eof;
+      return 0;
+    }
+    if (res == -EAGAIN && is_open_) {
+      // Shutdown() wakes the poll since it shuts down the socket.
+      int pres = uring_->Poll(sock_.native_handle(), POLLIN);
+      if (pres >= 0 || pres == -EINTR)
+        continue;
+      res = pres;
+    } else if (res == -EINTR) {
+      continue;
+    }
+    ec = is_open_ ? error_code(-res, system::system_category()) : asio::error::operation_aborted;
+    return 0;
+  }
+}
+
+size_t FiberSocketImpl::UringWriteSome(const iovec* iov, unsigned iovcnt, error_code& ec) {
+  if (iovcnt == 0)
+    return 0;
+
+  while (true) {
+    ssize_t res = uring_->SendMsg(sock_.native_handle(), iov, iovcnt);
+    if (res >= 0)
+      return res;
+    if (res == -EAGAIN && is_open_) {
+      int pres = uring_->Poll(sock_.native_handle(), POLLOUT);
+      if (pres >= 0 || pres == -EINTR)
+        continue;
+      res = pres;
+    } else if (res == -EINTR) {
+      continue;
+    }
+    ec = is_open_ ? error_code(-res, system::system_category()) : asio::error::operation_aborted;
+    return 0;
+  }
+}
+
+size_t FiberSocketImpl::SendIovec(const iovec* iov, unsigned iovcnt, error_code& ec) {
+  if (uring_)
+    return UringWriteSome(iov, iovcnt, ec);
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec*>(iov);
+  msg.msg_iovlen = iovcnt;
+
+  while (true) {
+    ssize_t res = sendmsg(sock_.native_handle(), &msg, MSG_NOSIGNAL);
+    if (res >= 0)
+      return res;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      sock_.async_wait(socket_t::wait_write, fibers_ext::yield[ec]);
+      if (ec)
+        return 0;
+    } else if (errno != EINTR) {
+      ec = error_code(errno, system::system_category());
+      return 0;
+    }
+  }
+}
+
+size_t FiberSocketImpl::WriteV(const iovec* iov, unsigned iovcnt, error_code& ec) {
+  size_t total = 0;
+  iovec chunk[kMaxIovec];
+
+  while (iovcnt) {
+    unsigned cnt = std::min(iovcnt, kMaxIovec);
+    std::copy(iov, iov + cnt, chunk);
+    iov += cnt;
+    iovcnt -= cnt;
+
+    if (coalesce_writes_) {
+      total += CoalescedWrite(chunk, cnt, ec);
+      if (ec)
+        return total;
+      continue;
+    }
+
+    iovec* next = chunk;
+    while (cnt) {
+      size_t sent = SendIovec(next, cnt, ec);
+      if (ec)
+        return total;
+      total += sent;
+      AdvanceIovec(sent, &next, &cnt);
+    }
+  }
+  return total;
+}
+
+size_t FiberSocketImpl::SendFile(int fd, off_t offset, size_t len, error_code& ec) {
+  size_t total = 0;
+
+  while (total < len) {
+    ssize_t res = sendfile(sock_.native_handle(), fd, &offset, len - total);
+    if (res > 0) {
+      total += res;
+    } else if (res == 0) {
+      // The file was truncated meanwhile.
+      ec = asio::error::eof;
+      break;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      sock_.async_wait(socket_t::wait_write, fibers_ext::yield[ec]);
+      if (ec)
+        break;
+    } else if (errno != EINTR) {
+      ec = error_code(errno, system::system_category());
+      break;
+    }
+  }
+  return total;
+}
+
+size_t FiberSocketImpl::CoalescedWrite(iovec* iov, unsigned iovcnt, error_code& ec) {
+  if (iovcnt == 0)
+    return 0;
+
+  PendingWrite pw(iov, iovcnt);
+  pending_writes_.push_back(&pw);
+
+  if (pending_writes_.size() > 1 || flushing_writes_) {
+    pw.done.Wait();
+  } else {
+    // The first writer lets the rest of the ready fibers run till the end of the loop
+    // iteration and then sends their buffers together with its own.
+    fibers_ext::Done tick;
+    asio::post(sock_.get_executor(), [&tick] { tick.Notify(); });
+    tick.Wait();
+
+    flushing_writes_ = true;
+    while (!pending_writes_.empty()) {
+      FlushWrites();
+    }
+    flushing_writes_ = false;
+  }
+
+  ec = pw.ec;
+  return pw.written;
+}
+
+void FiberSocketImpl::FlushWrites() {
+  constexpr unsigned kMaxBatch = 64;
+  iovec batch[kMaxBatch];
+  unsigned cnt = 0;
+
+  for (PendingWrite* pw : pending_writes_) {
+    unsigned n = std::min(pw->iovcnt, kMaxBatch - cnt);
+    std::copy(pw->iov, pw->iov + n, batch + cnt);
+    cnt += n;
+    if (cnt == kMaxBatch)
+      break;
+  }
+
+  error_code ec;
+  size_t sent = SendIovec(batch, cnt, ec);
+  VLOG(2) << "Sent " << sent << " bytes of " << pending_writes_.size() << " writes";
+
+  while (!pending_writes_.empty()) {
+    PendingWrite* pw = pending_writes_.front();
+    size_t pw_size = 0;
+    for (unsigned i = 0; i < pw->iovcnt; ++i)
+      pw_size += pw->iov[i].iov_len;
+
+    size_t consumed = std::min(sent, pw_size);
+    AdvanceIovec(consumed, &pw->iov, &pw->iovcnt);
+    pw->written += consumed;
+    sent -= consumed;
+
+    // On error, all the pending writes fail.
+    if (pw->iovcnt && !ec)
+      break;
+    pw->ec = ec;
+    pending_writes_.pop_front();
+    pw->done.Notify();
+  }
+}
+
 void FiberSocketImpl::WakeWorker() { clientsock_data_->worker_cv.notify_one(); }
 
 void FiberSocketImpl::InitiateConnection() {
@@ -121,7 +355,7 @@ void FiberSocketImpl::ClientWorker() {
       VLOG(1) << "After  Reconnect: " << ec << "/" << ec.message() << " is_open: " << is_open_
               << ", " << native_handle();
       if (ec && is_open_) {  // Only sleep for open socket for the next reconnect.
-        this_fiber::sleep_for(10ms);
+        FiberSleepFor(10ms);
       }
       continue;
     }
@@ -171,9 +405,30 @@ system::error_code FiberSocketImpl::Reconnect(const std::string& hname,
 
   auto& asio_io_cntx = clientsock_data_->io_cntx->raw_context();
 
-  tcp::resolver resolver(asio_io_cntx);
+  if (hname.compare(0, sizeof(kUnixPrefix) - 1, kUnixPrefix) == 0)
+    return ReconnectUnix(hname.substr(sizeof(kUnixPrefix) - 1));
 
-  system::error_code ec;
+  // The cache resolves the name once for all the sockets and refreshes it in the background,
+  // so that a reconnect does not wait for DNS. Every reconnect tries a single address, the ones
+  // that failed are retried last.
+  DnsCache& dns = DnsCache::Default();
+  tcp::endpoint ep;
+
+  VLOG(1) << "Before Lookup for socket " << sock_.native_handle();
+  system::error_code ec = dns.Lookup(hname, service, clientsock_data_->io_cntx, &ep);
+  if (ec) {
+    VLOG(1) << "Resolver error " << ec;
+    return ec;
+  }
+  DVLOG(1) << "After Lookup " << ep;
+
+  // The previous connect could fail, so we start with a fresh socket.
+  sock_.close(ec);
+  sock_.open(ep.protocol(), ec);
+  if (ec) {
+    SetStatus(ec, "open");
+    return ec;
+  }
 
   socket_t::reuse_address opt(true);
   sock_.set_option(opt, ec);
@@ -181,16 +436,6 @@ system::error_code FiberSocketImpl::Reconnect(const std::string& hname,
   socket_t::keep_alive opt2(keep_alive_);
   sock_.set_option(opt2, ec);
 
-  VLOG(1) << "Before AsyncResolve for socket " << sock_.native_handle();
-
-  // It seems that resolver waits for 10s and ignores cancel command.
-  auto results = resolver.async_resolve(tcp::v4(), hname, service, fibers_ext::yield[ec]);
-  if (ec) {
-    VLOG(1) << "Resolver error " << ec;
-    return ec;
-  }
-  DVLOG(1) << "After AsyncResolve";
-
   asio::steady_timer timer(asio_io_cntx, clientsock_data_->connect_duration);
   timer.async_wait([&](const system::error_code& ec) {
     if (!ec) {  // Successfully expired.
@@ -199,10 +444,11 @@ system::error_code FiberSocketImpl::Reconnect(const std::string& hname,
     }
   });
 
-  asio::async_connect(sock_, results, fibers_ext::yield[ec]);
+  sock_.async_connect(ep, fibers_ext::yield[ec]);
   VLOG(1) << "After async_connect " << ec << "/" << sock_.native_handle();
 
   if (ec) {
+    dns.ReportFailure(hname, service, ep);
     SetStatus(ec, "reconnect");
   } else {
     sock_.non_blocking(true);  // For some reason async_connect clears this option.
@@ -218,6 +464,40 @@ system::error_code FiberSocketImpl::Reconnect(const std::string& hname,
   return status_;
 }
 
+system::error_code FiberSocketImpl::ReconnectUnix(const std::string& path) {
+  using local_proto = asio::local::stream_protocol;
+
+  local_proto::socket sock(clientsock_data_->io_cntx->raw_context());
+  asio::steady_timer timer(sock.get_executor(), clientsock_data_->connect_duration);
+  timer.async_wait([&](const system::error_code& ec) {
+    if (!ec)
+      sock.cancel();
+  });
+
+  system::error_code ec;
+  sock.async_connect(local_proto::endpoint(path), fibers_ext::yield[ec]);
+  timer.cancel();
+  VLOG(1) << "After unix connect to " << path << ": " << ec;
+  if (ec) {
+    SetStatus(ec, "reconnect");
+    return status_;
+  }
+
+  // The tcp socket reads and writes the unix domain connection just as well.
+  sock_.close(ec);
+  sock_.assign(asio::ip::tcp::v4(), sock.release(), ec);
+  if (ec) {
+    SetStatus(ec, "assign");
+    return status_;
+  }
+  sock_.non_blocking(true);
+
+  std::lock_guard<fibers::mutex> lock(clientsock_data_->connect_mu);
+  status_.clear();
+  clientsock_data_->cv_st.notify_one();
+  return status_;
+}
+
 IoContext& FiberSocketImpl::context() {
   CHECK(clientsock_data_);
   return *clientsock_data_->io_cntx;
@@ -11,6 +11,7 @@
 namespace util {
 
 class IoContext;
+class IoUring;
 
 class FiberSyncSocket {
  public:
@@ -22,7 +23,8 @@ class FiberSyncSocket {
   FiberSyncSocket(next_layer_type&& sock, size_t rbuf_size = 1 << 12)
       : impl_(new detail::FiberSocketImpl{std::move(sock), rbuf_size}) {}
 
-  //! Client socket constructor.
+  //! Client socket constructor. The host name "unix:<path>" connects to the unix domain
+  //! socket at path instead and ignores port. The connection then has no tcp endpoints.
   FiberSyncSocket(const std::string& hname, const std::string& port, IoContext* cntx,
                   size_t rbuf_size = 1 << 12)
       : impl_(new detail::FiberSocketImpl{hname, port, cntx, rbuf_size}) {}
@@ -59,6 +61,19 @@ class FiberSyncSocket {
   // implementing it.
   template <typename BS> size_t write_some(const BS& bufs);
 
+  // Writes all the buffers with as few sendmsg calls as the socket allows.
+  // Returns the number of bytes written.
+  size_t WriteV(const iovec* iov, unsigned iovcnt, error_code& ec) {
+    return impl_->WriteV(iov, iovcnt, ec);
+  }
+
+  // Sends len bytes of the file fd starting at offset with sendfile, hence the data is not
+  // copied through user space. Must not run concurrently with the other writes.
+  // Returns the number of bytes sent.
+  size_t SendFile(int fd, off_t offset, size_t len, error_code& ec) {
+    return impl_->SendFile(fd, offset, len, ec);
+  }
+
   auto native_handle() { return impl_->native_handle(); }
 
   bool is_open() const { return impl_ && impl_->is_open(); }
@@ -86,6 +101,16 @@ class FiberSyncSocket {
   bool keep_alive() const { return impl_->keep_alive(); }
   void set_keep_alive(bool flag) { impl_->set_keep_alive(flag); }
 
+  // Transfers the data through ring instead of asio reactor, which saves the readiness
+  // notifications and batches the syscalls of all the sockets of the thread.
+  // Must be called from the socket thread before it's read. Not supported for client sockets.
+  void set_uring(IoUring* ring) { impl_->set_uring(ring); }
+
+  // If set, the writes of the fibers that write to the socket in the same IO loop iteration
+  // are sent with a single sendmsg once the iteration ends. Every write then returns after
+  // all its buffers were sent. Adds the latency of a loop iteration to every write.
+  void set_write_coalescing(bool flag) { impl_->set_write_coalescing(flag); }
+
  private:
   std::unique_ptr<detail::FiberSocketImpl> impl_;
 };
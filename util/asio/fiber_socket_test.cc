@@ -12,8 +12,12 @@
 #include "base/logging.h"
 
 #include "util/asio/asio_utils.h"
+#include "util/asio/dns_cache.h"
 #include "util/http/http_testing.h"
 
+DECLARE_bool(conn_use_uring);
+DECLARE_bool(conn_coalesce_writes);
+
 namespace util {
 
 using namespace boost;
@@ -108,6 +112,70 @@ TEST_F(SocketTest, StarvedRead) {
   LOG(INFO) << "After fb.join";
 }
 
+TEST_F(SocketTest, Uring) {
+  FLAGS_conn_use_uring = true;
+  FiberSyncSocket sock("localhost", std::to_string(port_), &pool_->GetNextContext());
+  ASSERT_FALSE(sock.ClientWaitToConnect(1000));
+
+  // The server reads the requests and writes the responses through io_uring.
+  h2::request<h2::string_body> req{h2::verb::get, "/", 11};
+  for (unsigned i = 0; i < 3; ++i) {
+    sock.context().AwaitSafe([&] {
+      system::error_code ec;
+      EXPECT_GT(h2::write(sock, req, ec), 0);
+      EXPECT_FALSE(ec);
+
+      beast::flat_buffer buffer;
+      h2::response<h2::dynamic_body> resp;
+      EXPECT_GT(h2::read(sock, buffer, resp, ec), 0);
+      EXPECT_FALSE(ec) << ec.message();
+      EXPECT_EQ(h2::status::ok, resp.result());
+    });
+  }
+  FLAGS_conn_use_uring = false;
+}
+
+TEST_F(SocketTest, CoalescedWrites) {
+  FLAGS_conn_coalesce_writes = true;
+  FiberSyncSocket sock("localhost", std::to_string(port_), &pool_->GetNextContext());
+  ASSERT_FALSE(sock.ClientWaitToConnect(1000));
+
+  auto read_resp = [&] {
+    system::error_code ec;
+    beast::flat_buffer buffer;
+    h2::response<h2::dynamic_body> resp;
+    EXPECT_GT(h2::read(sock, buffer, resp, ec), 0);
+    EXPECT_FALSE(ec) << ec.message();
+    EXPECT_EQ(h2::status::ok, resp.result());
+  };
+  string line = "GET / HTTP/1.1\r\n", end = "\r\n";
+
+  sock.context().AwaitSafe([&] {
+    sock.set_write_coalescing(true);
+
+    // The fibers write the parts of the request in the same loop iteration.
+    fibers::fiber fbs[2];
+    string* parts[2] = {&line, &end};
+    for (unsigned i = 0; i < 2; ++i) {
+      fbs[i] = fibers::fiber([&, i] {
+        system::error_code ec;
+        EXPECT_EQ(parts[i]->size(), sock.write_some(asio::buffer(*parts[i]), ec));
+        EXPECT_FALSE(ec);
+      });
+    }
+    for (auto& fb : fbs)
+      fb.join();
+    read_resp();
+
+    iovec iov[2] = {{&line[0], line.size()}, {&end[0], end.size()}};
+    system::error_code ec;
+    EXPECT_EQ(line.size() + end.size(), sock.WriteV(iov, 2, ec));
+    EXPECT_FALSE(ec);
+    read_resp();
+  });
+  FLAGS_conn_coalesce_writes = false;
+}
+
 TEST_F(SocketTest, Reconnect) {
   server_.reset();
   this_fiber::sleep_for(5ms);
@@ -141,4 +209,33 @@ TEST_F(SocketTest, Reconnect) {
   });
 }
 
+TEST_F(SocketTest, DnsCache) {
+  DnsCache& dns = DnsCache::Default();
+  IoContext& cntx = pool_->GetNextContext();
+  string port = std::to_string(port_);
+
+  cntx.AwaitSafe([&] {
+    tcp::endpoint ep1, ep2;
+    EXPECT_FALSE(dns.Lookup("localhost", port, &cntx, &ep1));
+    EXPECT_EQ(port_, ep1.port());
+    EXPECT_FALSE(dns.Lookup("localhost", port, &cntx, &ep2));
+    EXPECT_EQ(ep1, ep2);
+  });
+
+  // The first address refuses the connections, hence the socket fails over to the second one.
+  tcp::endpoint bad(address_v4::loopback(), 1), good(address_v4::loopback(), port_);
+  dns.Set("fake.host", port, {bad, good});
+
+  FiberSyncSocket fss("fake.host", port, &cntx);
+  system::error_code ec = fss.ClientWaitToConnect(1000);
+  EXPECT_FALSE(ec) << ec.message();
+
+  cntx.AwaitSafe([&] {
+    tcp::endpoint ep;
+    EXPECT_FALSE(dns.Lookup("fake.host", port, &cntx, &ep));
+    EXPECT_EQ(good, ep);
+  });
+  dns.Invalidate("fake.host", port);
+}
+
 }  // namespace util
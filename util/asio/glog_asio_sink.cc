@@ -46,9 +46,8 @@ void GlogAsioSink::send(google::LogSeverity severity, const char* full_filename,
     return;
 
   // string creation might have potential performance impact.
-  channel_op_status st = msg_q_.push_wait_for(
-      Item{full_filename, base_filename, severity, line, *tm_time, string{message, message_len}},
-      100us);
+  channel_op_status st = msg_q_.try_push(
+      Item{full_filename, base_filename, severity, line, *tm_time, string{message, message_len}});
 
   if (st != channel_op_status::success) {
     ++lost_messages_;
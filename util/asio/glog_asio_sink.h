@@ -5,6 +5,8 @@
 #pragma once
 
 #include <glog/logging.h>
+
+#include <atomic>
 #include <boost/fiber/buffered_channel.hpp>
 
 #include "util/asio/io_context.h"
@@ -30,7 +32,8 @@ class GlogAsioSink : public IoContext::Cancellable, ::google::LogSink {
   };
   ::boost::fibers::buffered_channel<Item> msg_q_;
 
-  unsigned lost_messages_ = 0;
+  // The messages that did not fit msg_q_, the logging threads never wait for it.
+  std::atomic<unsigned> lost_messages_{0};
 
   virtual bool ShouldIgnore(google::LogSeverity severity, const char* full_filename, int line) {
     return false;
@@ -0,0 +1,80 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/handler_allocator.h"
+
+#include <new>
+
+namespace util {
+namespace detail {
+
+namespace {
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+// Trivially destructible, hence they stay valid until the thread exits even after
+// the drainer below has been destroyed.
+thread_local FreeBlock* free_blocks[HandlerMemory::kNumSizes] = {nullptr};
+thread_local unsigned num_cached[HandlerMemory::kNumSizes] = {0};
+thread_local bool cache_drained = false;
+
+// Returns the cached blocks of the thread to the heap when it exits.
+struct CacheDrainer {
+  ~CacheDrainer() {
+    for (unsigned i = 0; i < HandlerMemory::kNumSizes; ++i) {
+      while (FreeBlock* b = free_blocks[i]) {
+        free_blocks[i] = b->next;
+        ::operator delete(b);
+      }
+      num_cached[i] = 0;
+    }
+    cache_drained = true;
+  }
+};
+
+thread_local CacheDrainer cache_drainer;
+
+inline unsigned SizeIndex(size_t size) {
+  return (size + HandlerMemory::kBlockGranularity - 1) / HandlerMemory::kBlockGranularity - 1;
+}
+
+}  // namespace
+
+void* HandlerMemory::Allocate(size_t size) {
+  unsigned index = SizeIndex(size);
+  if (size == 0 || index >= kNumSizes)
+    return ::operator new(size);
+
+  if (FreeBlock* b = free_blocks[index]) {
+    free_blocks[index] = b->next;
+    --num_cached[index];
+    return b;
+  }
+  return ::operator new((index + 1) * kBlockGranularity);
+}
+
+void HandlerMemory::Deallocate(void* ptr, size_t size) {
+  unsigned index = SizeIndex(size);
+  if (size == 0 || index >= kNumSizes || num_cached[index] >= kMaxCached || cache_drained) {
+    ::operator delete(ptr);
+    return;
+  }
+
+  (void)&cache_drainer;  // the first caching registers the drainer of the thread.
+  FreeBlock* b = static_cast<FreeBlock*>(ptr);
+  b->next = free_blocks[index];
+  free_blocks[index] = b;
+  ++num_cached[index];
+}
+
+unsigned HandlerMemory::CachedBlocks() {
+  unsigned res = 0;
+  for (unsigned i = 0; i < kNumSizes; ++i)
+    res += num_cached[i];
+  return res;
+}
+
+}  // namespace detail
+}  // namespace util
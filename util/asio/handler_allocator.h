@@ -0,0 +1,61 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstddef>
+
+namespace util {
+namespace detail {
+
+// Recycles the memory blocks of the asio operations so that the IO loop does not hit the heap
+// on every async call. The blocks are rounded up to kBlockGranularity and up to kMaxCached
+// blocks of every size are kept in a free list of the calling thread. Since every IoContext
+// runs a single thread, each IoContext effectively has its own cache. A block freed by
+// another thread just moves to the cache of that thread.
+// Larger blocks go to the heap directly.
+class HandlerMemory {
+ public:
+  static constexpr size_t kBlockGranularity = 64;
+  static constexpr unsigned kNumSizes = 8;  // caches the blocks of up to 512 bytes.
+  static constexpr unsigned kMaxCached = 64;
+
+  static void* Allocate(size_t size);
+  static void Deallocate(void* ptr, size_t size);
+
+  // The number of the blocks cached by the calling thread.
+  static unsigned CachedBlocks();
+};
+
+}  // namespace detail
+
+// Allocator of the asio handlers that recycles their memory via detail::HandlerMemory.
+// Handlers expose it with get_allocator() and asio picks it up as their associated allocator.
+template <typename T>
+class RecyclingAllocator {
+ public:
+  using value_type = T;
+
+  RecyclingAllocator() noexcept = default;
+
+  template <typename U>
+  RecyclingAllocator(const RecyclingAllocator<U>&) noexcept {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(detail::HandlerMemory::Allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T* p, size_t n) { detail::HandlerMemory::Deallocate(p, sizeof(T) * n); }
+
+  template <typename U>
+  bool operator==(const RecyclingAllocator<U>&) const noexcept {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const RecyclingAllocator<U>&) const noexcept {
+    return false;
+  }
+};
+
+}  // namespace util
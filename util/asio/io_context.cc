@@ -3,15 +3,26 @@
 //
 
 #include <boost/asio/steady_timer.hpp>
+#include <boost/fiber/detail/context_spinlock_queue.hpp>
 #include <boost/fiber/mutex.hpp>
 #include <boost/fiber/operations.hpp>
 #include <boost/fiber/scheduler.hpp>
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 #include "base/logging.h"
 #include <glog/raw_logging.h>
 
 #include "base/walltime.h"
 #include "util/asio/io_context.h"
+#include "util/asio/stall_detector.h"
+#include "util/stats/varz_stats.h"
+
+DEFINE_bool(fiber_stats, false,
+            "Collect cpu time, switches and scheduling latency of the IO fibers by their names");
 
 namespace util {
 
@@ -19,7 +30,152 @@ using fibers_ext::BlockingCounter;
 using namespace boost;
 using namespace std;
 
+namespace detail {
+
+struct FiberStealGroup::Slot {
+  fibers::detail::context_spinlock_queue queue{256};
+  std::atomic<size_t> size{0};   // not smaller than the size of queue.
+  std::atomic_bool idle{false};  // the IO loop is blocked waiting for events.
+  asio::io_context* io_context = nullptr;
+};
+
+FiberStealGroup::FiberStealGroup(unsigned size) : size_(size), slots_(new Slot[size]) {}
+
+FiberStealGroup::~FiberStealGroup() {}
+
+auto FiberStealGroup::slot(unsigned i) -> Slot* { return slots_.get() + i; }
+
+// Aggregates the stats of the fibers of a single IO thread. The thread updates them under
+// an uncontended lock, while GetFiberStats() reads them from other threads.
+class FiberStatsRecorder {
+ public:
+  FiberStatsRecorder();
+  ~FiberStatsRecorder();
+
+  void OnReady(IoFiberProperties* props) {
+    props->ready_ns_ = base::GetClockNanos<CLOCK_MONOTONIC>();
+  }
+
+  // prev stops running and next is resumed. Both can be null.
+  void OnSwitch(IoFiberProperties* prev, IoFiberProperties* next);
+
+  using StatsMap = std::map<std::string, FiberStats>;
+  void MergeInto(StatsMap* dest) const;
+
+  // All the recorders of the process and the stats of the exited threads.
+  struct Registry {
+    std::mutex mu;
+    std::vector<const FiberStatsRecorder*> recorders;
+    StatsMap exited;
+  };
+  static Registry& registry();
+
+ private:
+  mutable std::mutex mu_;
+  std::unordered_map<std::string, FiberStats> stats_;
+};
+
+FiberStatsRecorder::FiberStatsRecorder() {
+  Registry& reg = registry();
+  std::lock_guard<std::mutex> lk(reg.mu);
+  reg.recorders.push_back(this);
+}
+
+FiberStatsRecorder::~FiberStatsRecorder() {
+  Registry& reg = registry();
+  std::lock_guard<std::mutex> lk(reg.mu);
+  MergeInto(&reg.exited);
+  reg.recorders.erase(std::find(reg.recorders.begin(), reg.recorders.end(), this));
+}
+
+auto FiberStatsRecorder::registry() -> Registry& {
+  static Registry* reg = new Registry;  // never destroyed since threads may outlive statics.
+  return *reg;
+}
+
+void FiberStatsRecorder::OnSwitch(IoFiberProperties* prev, IoFiberProperties* next) {
+  uint64_t now = base::GetClockNanos<CLOCK_MONOTONIC>();
+
+  std::lock_guard<std::mutex> lk(mu_);
+  if (prev && prev->run_ns_) {
+    stats_[prev->name_].cpu_nanos += now - prev->run_ns_;
+    prev->run_ns_ = 0;
+  }
+  if (next) {
+    FiberStats& st = stats_[next->name_];
+    ++st.switches;
+
+    // ready_ns_ is not set if the stats were enabled while the fiber was ready.
+    if (next->ready_ns_) {
+      st.ready_micros.Add((now - next->ready_ns_) / 1000.0);
+      next->ready_ns_ = 0;
+    }
+    next->run_ns_ = now;
+  }
+}
+
+void FiberStatsRecorder::MergeInto(StatsMap* dest) const {
+  std::lock_guard<std::mutex> lk(mu_);
+  for (const auto& k_v : stats_) {
+    (*dest)[k_v.first].Merge(k_v.second);
+  }
+}
+
+// Limits the number of tasks a drain handler runs so that a flood of tasks does not starve
+// the IO events and the fibers.
+constexpr unsigned kDrainBatch = 128;
+
+TaskQueue::TaskQueue(asio::io_context* cntx, unsigned capacity) : cntx_(cntx), tasks_(capacity) {}
+
+void TaskQueue::Drain() {
+  while (!Run(kDrainBatch)) {
+  }
+}
+
+bool TaskQueue::Run(unsigned limit) {
+  fibers_ext::InlineTask task;
+  for (unsigned i = 0; i < limit; ++i) {
+    if (!tasks_.try_dequeue(task))
+      return true;
+    task();
+    task.Reset();  // releases the captured state right away.
+  }
+  return false;
+}
+
+void TaskQueue::PostDrain() {
+  asio::post(*cntx_, [this] {
+    // Resetting the flag before running the tasks guarantees that the tasks that are added
+    // after this point are either run by this handler or by the next one.
+    // acq_rel synchronizes with the exchange in Add() and makes its queued task visible.
+    drain_posted_.exchange(false, std::memory_order_acq_rel);
+
+    if (!Run(kDrainBatch) && !drain_posted_.exchange(true, std::memory_order_acq_rel))
+      PostDrain();
+  });
+}
+
+}  // namespace detail
+
 namespace {
+
+unique_ptr<VarzFunction> fiber_varz;
+once_flag fiber_varz_flag;
+
+VarzValue::Map GetFiberVarz() {
+  VarzValue::Map res;
+  for (const auto& k_v : GetFiberStats()) {
+    const FiberStats& st = k_v.second;
+    VarzValue::Map fiber;
+    fiber.emplace_back("cpu-ms", VarzValue::FromInt(st.cpu_nanos / 1000000));
+    fiber.emplace_back("switches", VarzValue::FromInt(st.switches));
+    fiber.emplace_back("ready-p99-us", VarzValue::FromDouble(st.ready_micros.Percentile(99)));
+    fiber.emplace_back("ready-max-us", VarzValue::FromDouble(st.ready_micros.max()));
+    res.emplace_back(k_v.first.empty() ? "unnamed" : k_v.first, std::move(fiber));
+  }
+  return res;
+}
+
 constexpr unsigned MAIN_NICE_LEVEL = 0;
 constexpr unsigned DISPATCH_LEVEL = IoFiberProperties::NUM_NICE_LEVELS;
 
@@ -50,13 +206,36 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
   fibers::context* main_loop_ctx_ = nullptr;
   chrono::steady_clock::time_point suspend_tp_ = STEADY_PT_MAX;
 
+  // Set when the main loop is resumed before the dispatcher armed suspend_timer_.
+  bool main_woken_early_ = false;
+
+  // Work stealing of migratable fibers, slot_ is null if the pool does not steal.
+  detail::FiberStealGroup* steal_group_;
+  detail::FiberStealGroup::Slot* slot_ = nullptr;
+  unsigned steal_index_, steal_start_ = 0;
+  uint64_t steal_cnt_ = 0;
+
+  detail::FiberStatsRecorder stats_recorder_;
+  detail::LoopHeartbeat heartbeat_;
+
   enum : uint8_t { LOOP_RUN_ONE = 1, MAIN_LOOP_SUSPEND = 2, MAIN_LOOP_FINISHED = 4 };
   uint8_t mask_ = 0;
 
  public:
   //[asio_rr_ctor
-  AsioScheduler(const std::shared_ptr<asio::io_context>& io_svc)
-      : io_context_(io_svc), suspend_timer_(new asio::steady_timer(*io_svc)) {}
+  AsioScheduler(const std::shared_ptr<asio::io_context>& io_svc,
+                detail::FiberStealGroup* steal_group, unsigned steal_index)
+      : io_context_(io_svc), suspend_timer_(new asio::steady_timer(*io_svc)),
+        steal_group_(steal_group), steal_index_(steal_index) {
+    if (steal_group_) {
+      slot_ = steal_group_->slot(steal_index_);
+      slot_->io_context = io_svc.get();
+    }
+    if (FLAGS_fiber_stats) {
+      std::call_once(fiber_varz_flag,
+                     [] { fiber_varz.reset(new VarzFunction("fibers", &GetFiberVarz)); });
+    }
+  }
 
   ~AsioScheduler();
 
@@ -90,7 +269,9 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
     awakened(ctx, props);
   }
 
-  bool has_ready_fibers() const noexcept final { return 0 < ready_cnt_; }
+  bool has_ready_fibers() const noexcept final {
+    return 0 < ready_cnt_ || (slot_ && HasMigratable());
+  }
 
   // suspend_until halts the thread in case there are no active fibers to run on it.
   // This is done by dispatcher fiber.
@@ -137,6 +318,7 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
               << ", abstime: " << abs_time.time_since_epoch().count();
     }
     CHECK_EQ(0, mask_ & LOOP_RUN_ONE) << "Deadlock detected";
+    main_woken_early_ = false;
 
     // Awake main_loop_ctx_ in WaitTillFibersSuspend().
     main_loop_ctx_->get_scheduler()->schedule(main_loop_ctx_);
@@ -164,6 +346,20 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
     }
   }
   void WaitTillFibersSuspend();
+  void WakeMainLoopIfStarved(unsigned nice);
+  fibers::context* PickNextInternal() noexcept;
+
+  IoFiberProperties* props(fibers::context* ctx) noexcept {
+    if (!ctx || ctx->is_context(fibers::type::dispatcher_context))
+      return nullptr;
+    return static_cast<IoFiberProperties*>(get_properties(ctx));
+  }
+
+  // The migratable fibers of this thread or, unless we shut down, of the other threads.
+  bool HasMigratable() const noexcept;
+  void PushMigratable(fibers::context* ctx);
+  fibers::context* PopMigratable();
+  void WakeIdlePeer();
 };
 
 AsioScheduler::~AsioScheduler() {}
@@ -173,6 +369,9 @@ void AsioScheduler::MainLoop() {
   main_loop_ctx_ = fibers::context::active();
 
   while (!io_cntx->stopped()) {
+    if (heartbeat_.enabled())
+      heartbeat_.Beat();
+
     if (has_ready_fibers()) {
       while (io_cntx->poll())
         ;
@@ -182,16 +381,35 @@ void AsioScheduler::MainLoop() {
       continue;
     }
 
+    // Gives a chance to the dispatcher to arm suspend_timer_ before we block in run_one.
+    if (main_woken_early_) {
+      WaitTillFibersSuspend();
+      continue;
+    }
+
+    // The busy threads wake us if they have fibers to steal. We check them again after
+    // setting idle flag to not miss the fibers they pushed before seeing it.
+    if (slot_) {
+      slot_->idle.store(true);
+      if (HasMigratable()) {
+        slot_->idle.store(false);
+        continue;
+      }
+    }
+
     // run one handler inside io_context
     // if no handler available, blocks this thread
     DVLOG(2) << "MainLoop::RunOneStart";
     mask_ |= LOOP_RUN_ONE;
-    if (!io_cntx->run_one()) {
-      mask_ &= ~LOOP_RUN_ONE;
+    if (heartbeat_.enabled())
+      heartbeat_.Idle();
+    bool ran = io_cntx->run_one();
+    mask_ &= ~LOOP_RUN_ONE;
+    if (slot_)
+      slot_->idle.store(false);
+    if (!ran)
       break;
-    }
     DVLOG(2) << "MainLoop::RunOneEnd";
-    mask_ &= ~LOOP_RUN_ONE;
   }
 
   VLOG(1) << "MainLoop exited";
@@ -214,7 +432,8 @@ void AsioScheduler::MainLoop() {
   }
   suspend_timer_.reset();  // now we can free suspend_timer_.
 
-  VLOG(1) << "MainLoopWakes/NotifyCnt: " << main_loop_wakes_ << "/" << notify_cnt_;
+  VLOG(1) << "MainLoopWakes/NotifyCnt: " << main_loop_wakes_ << "/" << notify_cnt_
+          << ", stolen fibers: " << steal_cnt_;
 }
 
 void AsioScheduler::WaitTillFibersSuspend() {
@@ -233,6 +452,10 @@ void AsioScheduler::WaitTillFibersSuspend() {
 void AsioScheduler::awakened(fibers::context* ctx, IoFiberProperties& props) noexcept {
   DCHECK(!ctx->ready_is_linked());
 
+  if (FLAGS_fiber_stats) {
+    stats_recorder_.OnReady(&props);
+  }
+
   ready_queue_type* rq;
   if (ctx->is_context(fibers::type::dispatcher_context)) {
     rq = rqueue_arr_ + DISPATCH_LEVEL;
@@ -241,29 +464,22 @@ void AsioScheduler::awakened(fibers::context* ctx, IoFiberProperties& props) noe
   } else {
     unsigned nice = props.nice_level();
     DCHECK_LT(nice, IoFiberProperties::NUM_NICE_LEVELS);
+
+    // Migratable fibers are detached from this thread and wait in the shared queue, where
+    // the idle threads can steal them.
+    if (slot_ && props.migratable() && !ctx->is_context(fibers::type::pinned_context)) {
+      WakeMainLoopIfStarved(nice);
+      PushMigratable(ctx);
+      DVLOG(2) << "Ready migratable: " << fibers_ext::short_id(ctx) << "/" << props.name();
+      return;
+    }
+
     rq = rqueue_arr_ + nice;
     ++ready_cnt_;
     if (last_nice_level_ > nice)
       last_nice_level_ = nice;
 
-    // In addition, we wake main_loop_ctx_ is too many switches ocurred
-    // while it was suspended.
-    // It's a convenient place to wake because we are sure there is a least
-    // one ready worker in addition to main_loop_ctx_ and it won't stuck in
-    // run_one().
-    // * main_loop_ctx_->ready_is_linked() could be linked already in the previous invocations
-    // of awakened before pick_next resumed it.
-    if (nice > MAIN_NICE_LEVEL && switch_cnt_ > MAIN_SWITCH_LIMIT &&
-        !main_loop_ctx_->ready_is_linked()) {
-      DVLOG(2) << "Wake MAIN_LOOP_SUSPEND " << fibers_ext::short_id(main_loop_ctx_)
-               << ", r/s: " << ready_cnt_ << "/" << switch_cnt_;
-
-      switch_cnt_ = 0;
-      ++ready_cnt_;
-      main_loop_ctx_->ready_link(rqueue_arr_[MAIN_NICE_LEVEL]);
-      last_nice_level_ = MAIN_NICE_LEVEL;
-      ++main_loop_wakes_;
-    }
+    WakeMainLoopIfStarved(nice);
 
     DVLOG(2) << "Ready: " << fibers_ext::short_id(ctx) << "/" << props.name()
              << ", nice/rdc: " << nice << "/" << ready_cnt_;
@@ -272,7 +488,119 @@ void AsioScheduler::awakened(fibers::context* ctx, IoFiberProperties& props) noe
   ctx->ready_link(*rq); /*< fiber, enqueue on ready queue >*/
 }
 
+void AsioScheduler::WakeMainLoopIfStarved(unsigned nice) {
+  // In addition, we wake main_loop_ctx_ is too many switches ocurred
+  // while it was suspended.
+  // It's a convenient place to wake because we are sure there is a least
+  // one ready worker in addition to main_loop_ctx_ and it won't stuck in
+  // run_one(). Migratable workers may be stolen before the main loop runs, hence
+  // main_woken_early_ makes sure the loop does not block before the dispatcher runs.
+  // * main_loop_ctx_->ready_is_linked() could be linked already in the previous invocations
+  // of awakened before pick_next resumed it.
+  if (nice > MAIN_NICE_LEVEL && switch_cnt_ > MAIN_SWITCH_LIMIT &&
+      !main_loop_ctx_->ready_is_linked()) {
+    DVLOG(2) << "Wake MAIN_LOOP_SUSPEND " << fibers_ext::short_id(main_loop_ctx_)
+             << ", r/s: " << ready_cnt_ << "/" << switch_cnt_;
+
+    switch_cnt_ = 0;
+    ++ready_cnt_;
+    main_loop_ctx_->ready_link(rqueue_arr_[MAIN_NICE_LEVEL]);
+    last_nice_level_ = MAIN_NICE_LEVEL;
+    main_woken_early_ = true;
+    ++main_loop_wakes_;
+  }
+}
+
+bool AsioScheduler::HasMigratable() const noexcept {
+  if (slot_->size.load(std::memory_order_acquire) > 0)
+    return true;
+  if (mask_ & MAIN_LOOP_FINISHED)
+    return false;
+
+  for (unsigned i = 0; i < steal_group_->size(); ++i) {
+    if (steal_group_->slot(i)->size.load(std::memory_order_acquire) > 0)
+      return true;
+  }
+  return false;
+}
+
+void AsioScheduler::PushMigratable(fibers::context* ctx) {
+  ctx->detach();
+
+  // If this thread has other fibers to run, ctx would wait for them, so we let an idle
+  // thread take it.
+  bool busy = ready_cnt_ > 0 || slot_->size.load(std::memory_order_relaxed) > 0;
+
+  // size is increased first so it never falls below the queue size.
+  slot_->size.fetch_add(1, std::memory_order_acq_rel);
+  slot_->queue.push(ctx);
+
+  if (busy)
+    WakeIdlePeer();
+}
+
+fibers::context* AsioScheduler::PopMigratable() {
+  fibers::context* ctx = slot_->queue.pop();
+  if (ctx) {
+    slot_->size.fetch_sub(1, std::memory_order_acq_rel);
+  } else if ((mask_ & MAIN_LOOP_FINISHED) == 0) {
+    unsigned sz = steal_group_->size();
+    for (unsigned i = 1; i < sz && !ctx; ++i) {
+      auto* victim = steal_group_->slot((steal_index_ + steal_start_ + i) % sz);
+      if (victim == slot_ || victim->size.load(std::memory_order_relaxed) == 0)
+        continue;
+      ctx = victim->queue.steal();
+      if (ctx) {
+        victim->size.fetch_sub(1, std::memory_order_acq_rel);
+        ++steal_cnt_;
+      }
+    }
+    ++steal_start_;
+  }
+
+  if (ctx) {
+    fibers::context::active()->attach(ctx);
+  }
+  return ctx;
+}
+
+void AsioScheduler::WakeIdlePeer() {
+  unsigned sz = steal_group_->size();
+  for (unsigned i = 1; i < sz; ++i) {
+    auto* peer = steal_group_->slot((steal_index_ + i) % sz);
+    bool expected = true;
+
+    // Only one thread wakes the idle peer.
+    if (peer->idle.load(std::memory_order_relaxed) &&
+        peer->idle.compare_exchange_strong(expected, false)) {
+      asio::post(*peer->io_context, [] { this_fiber::yield(); });
+      return;
+    }
+  }
+}
+
 fibers::context* AsioScheduler::pick_next() noexcept {
+  fibers::context* ctx = PickNextInternal();
+
+  if (heartbeat_.enabled()) {
+    // The main loop that resumes inside run_one() goes back to wait for IO events.
+    if (ctx == main_loop_ctx_ && (mask_ & LOOP_RUN_ONE))
+      heartbeat_.Idle();
+    else
+      heartbeat_.Beat();
+  }
+
+  // pick_next is called by the fiber that is about to be suspended.
+  if (FLAGS_fiber_stats) {
+    IoFiberProperties* prev = props(fibers::context::active());
+    IoFiberProperties* next = props(ctx);
+    if (prev || next)
+      stats_recorder_.OnSwitch(prev, next);
+  }
+  return ctx;
+}
+
+fibers::context* AsioScheduler::PickNextInternal() noexcept {
   fibers::context* ctx(nullptr);
   using fibers_ext::short_id;
 
@@ -314,6 +642,16 @@ fibers::context* AsioScheduler::pick_next() noexcept {
 
   DCHECK_EQ(0, ready_cnt_);
 
+  if (slot_) {
+    ctx = PopMigratable();
+    if (ctx) {
+      if (mask_ & MAIN_LOOP_SUSPEND)
+        ++switch_cnt_;
+      DVLOG(3) << "pick_next migratable: " << short_id(ctx);
+      return ctx;
+    }
+  }
+
   auto& dispatch_q = rqueue_arr_[DISPATCH_LEVEL];
   if (!dispatch_q.empty()) {
     fibers::context* ctx = &dispatch_q.front();
@@ -359,6 +697,52 @@ void AsioScheduler::notify() noexcept {
 
 constexpr unsigned IoFiberProperties::MAX_NICE_LEVEL;
 constexpr unsigned IoFiberProperties::NUM_NICE_LEVELS;
+constexpr unsigned IoFiberProperties::NUM_LOCAL_SLOTS;
+
+namespace detail {
+
+namespace {
+
+std::atomic_uint num_local_slots{0};
+void (*local_deleters[IoFiberProperties::NUM_LOCAL_SLOTS])(void*);
+
+}  // namespace
+
+unsigned AllocateFiberLocalSlot(void (*deleter)(void*)) {
+  unsigned slot = num_local_slots.fetch_add(1, std::memory_order_relaxed);
+  CHECK_LT(slot, IoFiberProperties::NUM_LOCAL_SLOTS) << "Too many FiberLocal variables";
+  local_deleters[slot] = deleter;
+  return slot;
+}
+
+}  // namespace detail
+
+IoFiberProperties::~IoFiberProperties() {
+  for (unsigned i = 0; i < NUM_LOCAL_SLOTS; ++i) {
+    if (locals_[i])
+      detail::local_deleters[i](locals_[i]);
+  }
+}
+
+void FiberStats::Merge(const FiberStats& other) {
+  cpu_nanos += other.cpu_nanos;
+  switches += other.switches;
+  ready_micros.Merge(other.ready_micros);
+}
+
+std::vector<std::pair<std::string, FiberStats>> GetFiberStats() {
+  using detail::FiberStatsRecorder;
+  FiberStatsRecorder::StatsMap stats;
+  auto& reg = FiberStatsRecorder::registry();
+  {
+    std::lock_guard<std::mutex> lk(reg.mu);
+    stats = reg.exited;
+    for (const FiberStatsRecorder* recorder : reg.recorders) {
+      recorder->MergeInto(&stats);
+    }
+  }
+  return std::vector<std::pair<std::string, FiberStats>>(stats.begin(), stats.end());
+}
 
 void IoFiberProperties::SetNiceLevel(unsigned p) {
   // Of course, it's only worth reshuffling the queue and all if we're
@@ -373,13 +757,15 @@ void IoFiberProperties::SetNiceLevel(unsigned p) {
 void IoContext::StartLoop(BlockingCounter* bc) {
   // I do not use use_scheduling_algorithm because I want to retain access to the scheduler.
   // fibers::use_scheduling_algorithm<AsioScheduler>(io_ptr);
-  AsioScheduler* scheduler = new AsioScheduler(context_ptr_);
+  AsioScheduler* scheduler = new AsioScheduler(context_ptr_, steal_group_, steal_index_);
   fibers::context::active()->get_scheduler()->set_algo(scheduler);
   this_fiber::properties<IoFiberProperties>().set_name("io_loop");
   this_fiber::properties<IoFiberProperties>().SetNiceLevel(MAIN_NICE_LEVEL);
   CHECK(fibers::context::active()->is_context(fibers::type::main_context));
 
   thread_id_ = this_thread::get_id();
+  task_queue_.reset(new detail::TaskQueue(context_ptr_.get(), kTaskQueueSize));
+  timer_service_.reset(new TimerService(context_ptr_.get()));
 
   io_context& io_cntx = *context_ptr_;
 
@@ -387,7 +773,8 @@ void IoContext::StartLoop(BlockingCounter* bc) {
   // The reason for this is that io_context::running_in_this_thread() is deduced based on the
   // call-stack. GAIA code should use InContextThread() to check whether the code runs in the
   // context's thread.
-  Async([scheduler, bc] {
+  // The callback must be the handler that run_one() below runs, hence it bypasses task_queue_.
+  asio_ext::Async(io_cntx, [scheduler, bc] {
     bc->Dec();
     scheduler->MainLoop();
   });
@@ -7,18 +7,36 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/post.hpp>
 
+#include <memory>
 #include <thread>
+#include <utility>
 
+#include "base/histogram.h"
+#include "base/mpmc_bounded_queue.h"
 #include "util/fibers/fibers_ext.h"
+#include "util/fibers/inline_task.h"
+#include "util/asio/timer_service.h"
+#include "util/fibers/stack_pool.h"
 
 namespace util {
 
+namespace detail {
+class FiberStatsRecorder;
+
+// Reserves a fiber-local slot whose values are destroyed by deleter, see FiberLocal.
+unsigned AllocateFiberLocalSlot(void (*deleter)(void*));
+}  // namespace detail
+
 class IoFiberProperties : public boost::fibers::fiber_properties {
  public:
   constexpr static unsigned MAX_NICE_LEVEL = 4;
   constexpr static unsigned NUM_NICE_LEVELS = MAX_NICE_LEVEL + 1;
 
+  // The number of different FiberLocal variables in the process.
+  constexpr static unsigned NUM_LOCAL_SLOTS = 8;
+
   IoFiberProperties(::boost::fibers::context* ctx) : fiber_properties(ctx), nice_(2) {}
+  ~IoFiberProperties();
 
   unsigned nice_level() const { return nice_; }
 
@@ -29,15 +47,119 @@ class IoFiberProperties : public boost::fibers::fiber_properties {
   // Values higher than MAX_NICE_LEVEL will be set to MAX_NICE_LEVEL.
   void SetNiceLevel(unsigned p);
 
+  // The runtime stats of the fibers are aggregated by their names, see GetFiberStats().
   void set_name(std::string nm) { name_ = std::move(nm); }
 
   const std::string& name() const { return name_; }
 
+  // Migratable fibers can be resumed by any IO thread of a pool with work stealing,
+  // see IoContextPool::EnableWorkStealing. Such fibers must not rely on the thread they run on:
+  // thread-locals, InContextThread() or asio objects of a specific IoContext.
+  // Takes effect the next time the fiber becomes ready.
+  void set_migratable(bool m) { migratable_ = m; }
+
+  bool migratable() const { return migratable_; }
+
+  // Fiber-local values, see FiberLocal. Destroyed together with the fiber.
+  void* local(unsigned slot) const { return locals_[slot]; }
+  void* exchange_local(unsigned slot, void* ptr) { return std::exchange(locals_[slot], ptr); }
+
  private:
+  friend class detail::FiberStatsRecorder;
+
+  void* locals_[NUM_LOCAL_SLOTS] = {};
+
   std::string name_;
   unsigned nice_;
+  bool migratable_ = false;
+
+  // Monotonic nanos when the fiber became ready and when it was resumed, 0 if unknown.
+  uint64_t ready_ns_ = 0, run_ns_ = 0;
+};
+
+// Runtime stats of the fibers that share the same name. Collected by the IO threads when
+// --fiber_stats is set.
+struct FiberStats {
+  uint64_t cpu_nanos = 0;  // the time the fibers were running.
+  uint64_t switches = 0;   // the number of times they were resumed.
+  base::Histogram ready_micros;  // the time from becoming ready until running.
+
+  void Merge(const FiberStats& other);
+};
+
+// Returns the stats of the fibers of all the IO threads in the process, sorted by name.
+// Includes the threads that have exited.
+std::vector<std::pair<std::string, FiberStats>> GetFiberStats();
+
+namespace detail {
+
+// Queues of the ready migratable fibers of every IoContext in a pool, from which the idle
+// IoContexts steal.
+class FiberStealGroup {
+ public:
+  struct Slot;
+
+  explicit FiberStealGroup(unsigned size);
+  ~FiberStealGroup();
+
+  unsigned size() const { return size_; }
+  Slot* slot(unsigned i);
+
+ private:
+  unsigned size_;
+  std::unique_ptr<Slot[]> slots_;
+};
+
+// Lock-free queue of the tasks submitted by IoContext::Async. The IO loop runs the queued tasks
+// in batches from a single asio handler, which is posted only when the queue becomes non-empty.
+// Therefore the submitting threads neither contend on the mutex of asio queue nor allocate
+// handlers, unless the task does not fit into InlineTask. The tasks submitted by a thread run
+// in the order of their submission.
+class TaskQueue {
+ public:
+  TaskQueue(::boost::asio::io_context* cntx, unsigned capacity);
+
+  template <typename Func> void Add(Func&& f);
+
+  // Runs the queued tasks in IO thread until the queue is empty.
+  void Drain();
+
+ private:
+  // Runs up to limit tasks. Returns false if the queue is still not empty.
+  bool Run(unsigned limit);
+  void PostDrain();
+
+  ::boost::asio::io_context* cntx_;
+  base::mpmc_bounded_queue<fibers_ext::InlineTask> tasks_;
+
+  // True if the drain handler is posted and has not started yet.
+  std::atomic_bool drain_posted_{false};
+
+  // The number of tasks that were posted to asio queue directly because the queue was full.
+  // Until they run, the new tasks are posted to asio as well to preserve their order.
+  std::atomic_uint overflown_{0};
 };
 
+template <typename Func> void TaskQueue::Add(Func&& f) {
+  if (overflown_.load(std::memory_order_acquire) == 0 &&
+      tasks_.try_enqueue(std::forward<Func>(f))) {
+    if (!drain_posted_.exchange(true, std::memory_order_acq_rel))
+      PostDrain();
+    return;
+  }
+
+  overflown_.fetch_add(1, std::memory_order_acq_rel);
+
+  // The queued tasks were submitted before this one, hence we run them first.
+  ::boost::asio::post(*cntx_, [this, f = std::forward<Func>(f)]() mutable {
+    Drain();
+    f();
+    overflown_.fetch_sub(1, std::memory_order_acq_rel);
+  });
+}
+
+}  // namespace detail
+
 namespace asio_ext {
 // Runs `f` asynchronously in io-context fiber. `f` should not block, lock on mutexes or Await.
 // Spinlocks are ok but might cause performance degradation.
@@ -89,9 +211,9 @@ class IoContext {
 
   io_context& raw_context() { return *context_ptr_; }
 
-  template <typename Func> void Async(Func&& f) {
-    asio_ext::Async(*context_ptr_, std::forward<Func>(f));
-  }
+  // Runs `f` asynchronously in IO loop, see asio_ext::Async.
+  // Unlike asio_ext::Async, the calls from different threads are batched via lock-free queue.
+  template <typename Func> void Async(Func&& f) { task_queue_->Add(std::forward<Func>(f)); }
 
   template <typename Func, typename... Args> void AsyncFiber(Func&& f, Args&&... args) {
     // Ideally we want to forward args into lambda but it's too complicated before C++20.
@@ -102,13 +224,30 @@ class IoContext {
     });
   }
 
+  // Launches the fiber with a stack from the pool of the stacks of the exited fibers.
+  template <typename Func, typename... Args>
+  void AsyncFiber(fibers_ext::PooledStack stack, Func&& f, Args&&... args) {
+    AsyncFiber(std::allocator_arg, stack, std::forward<Func>(f), std::forward<Args>(args)...);
+  }
+
   // Similar to asio_ext::Await(), but if we call Await from the context thread,
   // runs `f` directly (minor optimization).
   template <typename Func> auto Await(Func&& f) -> decltype(f()) {
     if (InContextThread()) {
       return f();
     }
-    return asio_ext::Await(*context_ptr_, std::forward<Func>(f));
+
+    fibers_ext::Done done;
+    using ResultType = decltype(f());
+    detail::ResultMover<ResultType> mover;
+
+    Async([&, f = std::forward<Func>(f), done]() mutable {
+      mover.Apply(f);
+      done.Notify();
+    });
+
+    done.Wait();
+    return std::move(mover).get();
   }
 
   // Please note that this function uses Await, therefore can not be used inside Ring0
@@ -120,6 +259,14 @@ class IoContext {
     return fb;
   }
 
+  // Launches the fiber with a pooled stack, e.g. LaunchFiber(PooledStack(32 << 10), func).
+  // The connection-per-fiber code should prefer it because fibers reuse their stacks instead
+  // of mapping and unmapping them.
+  template <typename... Args>
+  boost::fibers::fiber LaunchFiber(fibers_ext::PooledStack stack, Args&&... args) {
+    return LaunchFiber(std::allocator_arg, stack, std::forward<Args>(args)...);
+  }
+
   // Runs possibly awating function 'f' safely in ContextThread and waits for it to finish,
   // If we are in the context thread already, runs 'f' directly, otherwise
   // runs it wrapped in a fiber. Should be used instead of 'Await' when 'f' itself
@@ -142,13 +289,24 @@ class IoContext {
 
   bool InContextThread() const { return std::this_thread::get_id() == thread_id_; }
 
+  // The cpu the IO thread is pinned to and its NUMA node, -1 if the thread is not pinned.
+  // Set by IoContextPool::Run(). Use them to co-locate the data and the helper threads
+  // (i.e. FiberQueueThreadPool) of the context on the same node.
+  int cpu() const { return cpu_; }
+  int numa_node() const { return numa_node_; }
+
+  // The timers of the context, see TimerService. Can be used only from the context thread,
+  // after the context started running.
+  TimerService& timers() { return *timer_service_; }
+
   // Attaches user processes that should live along IoContext. IoContext will shut them down via
   // Cancel() call right before closing its IO loop.
   // Takes ownership over Cancellable runner. Runs it in a dedicated fiber in IoContext thread.
   // During the shutdown process signals the object to cancel by running Cancellable::Cancel()
   // method.
-  void AttachCancellable(Cancellable* obj) {
-    auto fb = LaunchFiber([obj] { obj->Run(); });
+  void AttachCancellable(Cancellable* obj,
+                         fibers_ext::PooledStack stack = fibers_ext::PooledStack()) {
+    auto fb = LaunchFiber(stack, [obj] { obj->Run(); });
     cancellable_arr_.emplace_back(
         CancellablePair{std::unique_ptr<Cancellable>(obj), std::move(fb)});
   }
@@ -158,8 +316,17 @@ class IoContext {
 
   using CancellablePair = std::pair<std::unique_ptr<Cancellable>, ::boost::fibers::fiber>;
 
+  static constexpr unsigned kTaskQueueSize = 1024;
+
   ptr_t context_ptr_;
+  std::unique_ptr<TimerService> timer_service_;  // created by the IO thread.
+
+  // Allocated by the IO thread, so that its memory is local to the NUMA node of the thread.
+  std::unique_ptr<detail::TaskQueue> task_queue_;
   std::thread::id thread_id_;
+  int cpu_ = -1, numa_node_ = -1;
+  detail::FiberStealGroup* steal_group_ = nullptr;  // set by the pool if it steals fibers.
+  unsigned steal_index_ = 0;
   std::vector<CancellablePair> cancellable_arr_;
 };
 
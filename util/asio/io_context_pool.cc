@@ -5,20 +5,132 @@
 #include "util/asio/io_context_pool.h"
 
 #include <sched.h>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
 #include <boost/asio/steady_timer.hpp>
 #include <boost/fiber/mutex.hpp>
 #include <boost/fiber/scheduler.hpp>
 
+#include "base/cpu_topology.h"
 #include "base/logging.h"
 #include "base/pthread_utils.h"
+#include "base/walltime.h"
+#include "util/proc_stats.h"
+#include "util/stats/varz_stats.h"
 
 using namespace boost;
 using std::thread;
 
 DEFINE_uint32(io_context_threads, 0, "Number of io threads in the pool");
+DEFINE_string(io_context_affinity, "linear",
+              "Pinning of io threads to cpus: none, linear (by cpu id), cores (physical cores "
+              "before their SMT siblings) or nodes (like cores, round-robin over NUMA nodes)");
+DEFINE_uint32(thread_stats_period_ms, 0,
+              "How often the cpu time, the context switches and the IO of the process threads "
+              "are sampled into the threads varz. 0 disables the sampling");
 
 namespace util {
 
+namespace {
+
+// Samples the threads of the process, so that the varz tell whether the IO threads are
+// starved of cpu or preempted on the busy hosts. The threads are labeled by their names,
+// e.g. IoPool<context index> or fq_pool<worker index>, the rates are over the last period.
+class ThreadSampler {
+ public:
+  static void Start() {
+    static ThreadSampler* sampler = new ThreadSampler;  // its thread never exits.
+    (void)sampler;
+  }
+
+ private:
+  ThreadSampler();
+
+  void Run();
+  void Sample();
+
+  VarzValue::Map GetVarz() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return varz_;
+  }
+
+  std::vector<ThreadStats> last_;  // accessed only by the sampler thread.
+  uint64_t last_ns_ = 0;
+
+  std::mutex mu_;
+  VarzValue::Map varz_;
+  VarzFunction varz_func_;
+};
+
+ThreadSampler::ThreadSampler() : varz_func_("threads", [this] { return GetVarz(); }) {
+  pthread_t tid = base::StartThread("thread_stats", [this] { Run(); });
+  PTHREAD_CHECK(detach(tid));
+}
+
+void ThreadSampler::Run() {
+  const auto period = std::chrono::milliseconds(FLAGS_thread_stats_period_ms);
+  while (true) {
+    Sample();
+    std::this_thread::sleep_for(period);
+  }
+}
+
+void ThreadSampler::Sample() {
+  std::vector<ThreadStats> current = ThreadStats::ReadAll();
+  uint64_t now = base::GetClockNanos<CLOCK_MONOTONIC>();
+  double period_ms = (now - last_ns_) / 1e6;
+
+  std::unordered_map<pid_t, const ThreadStats*> prev;
+  for (const ThreadStats& st : last_) {
+    prev.emplace(st.tid, &st);
+  }
+  std::unordered_map<std::string, unsigned> name_count;
+  for (const ThreadStats& st : current) {
+    ++name_count[st.name];
+  }
+
+  VarzValue::Map res;
+  for (const ThreadStats& st : current) {
+    VarzValue::Map thread;
+    thread.emplace_back("cpu-ms", VarzValue::FromInt(st.user_ms + st.system_ms));
+    thread.emplace_back("system-ms", VarzValue::FromInt(st.system_ms));
+    thread.emplace_back("vol-switches", VarzValue::FromInt(st.voluntary_switches));
+    thread.emplace_back("invol-switches", VarzValue::FromInt(st.involuntary_switches));
+    thread.emplace_back("read-bytes", VarzValue::FromInt(st.read_bytes));
+    thread.emplace_back("write-bytes", VarzValue::FromInt(st.write_bytes));
+
+    auto it = prev.find(st.tid);
+    if (it != prev.end() && period_ms > 0) {
+      const ThreadStats& p = *it->second;
+      double cpu_ms = (st.user_ms + st.system_ms) - (p.user_ms + p.system_ms);
+      double wait_ms = (st.runq_wait_ns - p.runq_wait_ns) / 1e6;
+      double invol = st.involuntary_switches - p.involuntary_switches;
+      thread.emplace_back("cpu-pct", VarzValue::FromDouble(cpu_ms * 100 / period_ms));
+      thread.emplace_back("runq-wait-pct", VarzValue::FromDouble(wait_ms * 100 / period_ms));
+      thread.emplace_back("invol-switches-ps", VarzValue::FromDouble(invol * 1000 / period_ms));
+    }
+
+    // The threads with the same name, e.g. the unnamed ones, are told apart by their ids.
+    std::string label = st.name;
+    if (name_count[st.name] > 1)
+      label += "-" + std::to_string(st.tid);
+    res.emplace_back(std::move(label), std::move(thread));
+  }
+  std::sort(res.begin(), res.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  last_ = std::move(current);
+  last_ns_ = now;
+
+  std::lock_guard<std::mutex> lk(mu_);
+  varz_.swap(res);
+}
+
+}  // namespace
+
 thread_local size_t IoContextPool::context_indx_ = 0;
 
 IoContextPool::IoContextPool(size_t pool_size) {
@@ -38,14 +150,49 @@ void IoContextPool::WrapLoop(size_t index, fibers_ext::BlockingCounter* bc) {
   auto& context = context_arr_[index];
   VLOG(1) << "Starting io thread " << index;
 
+  // The thread pins itself before it allocates anything, so that the memory of IoContext
+  // and of its fibers is allocated on the NUMA node of the thread.
+  if (context.cpu_ >= 0) {
+    int rc = base::SetThreadAffinity(pthread_self(), {unsigned(context.cpu_)});
+    LOG_IF(WARNING, rc) << "Error calling pthread_setaffinity_np: " << strerror(rc);
+  }
+
   context.StartLoop(bc);
 
   VLOG(1) << "Finished io thread " << index;
 }
 
+void IoContextPool::EnableWorkStealing() {
+  CHECK_EQ(STOPPED, state_);
+  work_stealing_ = true;
+}
+
 void IoContextPool::Run() {
   CHECK_EQ(STOPPED, state_);
 
+  if (work_stealing_ && context_arr_.size() > 1) {
+    steal_group_.reset(new detail::FiberStealGroup(context_arr_.size()));
+    for (size_t i = 0; i < context_arr_.size(); ++i) {
+      context_arr_[i].steal_group_ = steal_group_.get();
+      context_arr_[i].steal_index_ = i;
+    }
+  }
+
+  const base::CpuTopology& topology = base::CpuTopology::Get();
+  std::vector<unsigned> cpus;
+  if (FLAGS_io_context_affinity != "none") {
+    base::CpuTopology::Placement placement;
+    CHECK(base::ParsePlacement(FLAGS_io_context_affinity.c_str(), &placement))
+        << "Unknown --io_context_affinity " << FLAGS_io_context_affinity;
+    cpus = topology.Order(placement);
+  }
+
+  for (size_t i = 0; i < context_arr_.size() && !cpus.empty(); ++i) {
+    unsigned cpu = cpus[i % cpus.size()];
+    context_arr_[i].cpu_ = cpu;
+    context_arr_[i].numa_node_ = topology.NodeOf(cpu);
+  }
+
   fibers_ext::BlockingCounter bc(thread_arr_.size());
   char buf[32];
 
@@ -54,12 +201,6 @@ void IoContextPool::Run() {
     snprintf(buf, sizeof(buf), "IoPool%lu", i);
     thread_arr_[i].tid =
         base::StartThread(buf, [this, i, bc]() mutable { this->WrapLoop(i, &bc); });
-    cpu_set_t cps;
-    CPU_ZERO(&cps);
-    CPU_SET(i % thread::hardware_concurrency(), &cps);
-
-    int rc = pthread_setaffinity_np(thread_arr_[i].tid, sizeof(cpu_set_t), &cps);
-    LOG_IF(WARNING, rc) << "Error calling pthread_setaffinity_np: " << strerror(rc) << "\n";
   }
 
   // We can not use Await() here yet because StartLoop might not run yet and its implementation
@@ -67,7 +208,11 @@ void IoContextPool::Run() {
   // Therefore we use BlockingCounter to wait for all the IO loops to start running.
   bc.Wait();
 
-  LOG(INFO) << "Running " << thread_arr_.size() << " io threads";
+  if (FLAGS_thread_stats_period_ms)
+    ThreadSampler::Start();
+
+  LOG(INFO) << "Running " << thread_arr_.size() << " io threads on " << topology.num_nodes()
+            << " NUMA nodes";
   state_ = RUN;
 }
 
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -35,9 +36,20 @@ class IoContextPool {
   explicit IoContextPool(std::size_t pool_size = 0);
   ~IoContextPool();
 
-  /// Runs all io_context objects in the pool and exits.
+  /*! @brief Runs all io_context objects in the pool and exits.
+   *
+   *  The threads are pinned to cpus according to --io_context_affinity. Afterwards
+   *  IoContext::cpu() and IoContext::numa_node() tell where every context runs.
+   */
   void Run();
 
+  /*! @brief Lets the idle IO threads run the ready fibers of the busy ones.
+   *
+   *  Only the fibers that are marked with IoFiberProperties::set_migratable are moved between
+   *  the threads. Must be called before Run().
+   */
+  void EnableWorkStealing();
+
   /*! @brief Stops all io_context objects in the pool.
    *
    *  Waits for all the threads to finish. Requires that Run has been called.
@@ -134,6 +146,8 @@ class IoContextPool {
   };
 
   std::vector<TInfo> thread_arr_;
+  bool work_stealing_ = false;
+  std::unique_ptr<detail::FiberStealGroup> steal_group_;
 
   /// The next io_context to use for a connection.
   std::atomic_uint_fast32_t next_io_context_{0};
@@ -1,20 +1,39 @@
 // Copyright 2018, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <boost/asio.hpp>
 #include <chrono>
+#include <numeric>
 
+#include "base/cpu_topology.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "base/walltime.h"
+#include "util/asio/event_fd_waiter.h"
+#include "util/asio/fiber_local.h"
 #include "util/asio/glog_asio_sink.h"
+#include "util/asio/handler_allocator.h"
 #include "util/asio/io_context_pool.h"
+#include "util/asio/io_uring.h"
+#include "util/asio/shm_ring.h"
+#include "util/asio/stall_detector.h"
+#include "util/asio/yield.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 
 using namespace std::chrono;
 using namespace boost;
 using namespace asio;
 using namespace std::chrono_literals;
 
+DECLARE_bool(fiber_stats);
+DECLARE_uint32(io_stall_threshold_ms);
+
 namespace util {
 
 using fibers_ext::short_id;
@@ -311,6 +330,149 @@ TEST_F(IoContextTest, AwaitOnAll) {
   }
 }
 
+TEST_F(IoContextTest, NumaNode) {
+  IoContext& cntx = pool_->at(0);
+  ASSERT_GE(cntx.cpu(), 0);
+  EXPECT_EQ(base::CpuTopology::Get().NodeOf(cntx.cpu()), cntx.numa_node());
+  EXPECT_EQ(cntx.cpu(), cntx.Await([] { return sched_getcpu(); }));
+
+  // The workers run on the node of the context.
+  fibers_ext::FiberQueueThreadPool fq_pool(1, 16, cntx.numa_node());
+  int cpu = fq_pool.Await([] { return sched_getcpu(); });
+  EXPECT_EQ(cntx.numa_node(), base::CpuTopology::Get().NodeOf(cpu));
+}
+
+TEST_F(IoContextTest, FiberLocal) {
+  static FiberLocal<std::string> local;
+  std::shared_ptr<int> counter = std::make_shared<int>(0);
+  static FiberLocal<std::shared_ptr<int>> ref;
+
+  EXPECT_EQ(nullptr, local.get());  // the main thread does not run in IoContext.
+
+  pool_->at(0).AwaitSafe([&] {
+    auto cb = [&](std::string val) {
+      local.reset(new std::string(val));
+      ref.reset(new std::shared_ptr<int>(counter));
+      this_fiber::yield();
+      EXPECT_EQ(val, *local);
+    };
+    fibers::fiber f1(cb, "a"), f2(cb, "b");
+    f1.join();
+    f2.join();
+    EXPECT_EQ(nullptr, local.get());
+  });
+
+  // The values are destroyed with their fibers.
+  std::this_thread::sleep_for(10ms);
+  EXPECT_EQ(1, counter.use_count());
+}
+
+TEST_F(IoContextTest, Timers) {
+  IoContext& cntx = pool_->at(0);
+
+  cntx.AwaitSafe([&] {
+    TimerService& timers = cntx.timers();
+    auto start = steady_clock::now();
+    timers.SleepFor(5ms);
+    EXPECT_GE(steady_clock::now() - start, 5ms);
+
+    unsigned fired = 0;
+    TimerService::Timer t1(&timers, [&] { ++fired; }), t2(&timers, [&] { fired += 10; });
+    t1.Arm(10ms);
+    t2.Arm(1h);
+    t1.Arm(2ms);  // rescheduled earlier.
+    t2.Cancel();
+    EXPECT_FALSE(t2.armed());
+    timers.SleepFor(20ms);
+    EXPECT_EQ(1u, fired);
+    EXPECT_FALSE(t1.armed());
+
+    fibers_ext::EventCount ec;
+    bool ready = false;
+    EXPECT_FALSE(timers.AwaitFor(&ec, [&] { return ready; }, 2ms));
+
+    fibers::fiber notifier([&] {
+      timers.SleepFor(1ms);
+      ready = true;
+      ec.notify();
+    });
+    EXPECT_TRUE(timers.AwaitFor(&ec, [&] { return ready; }, 1h));
+    notifier.join();
+
+    EXPECT_EQ(&timers, TimerService::ThisThread());
+    start = steady_clock::now();
+    FiberSleepFor(3ms);
+    FiberSleepFor(100us);  // shorter than a tick.
+    EXPECT_GE(steady_clock::now() - start, 3100us);
+  });
+
+  EXPECT_EQ(nullptr, TimerService::ThisThread());
+  auto start = steady_clock::now();
+  FiberSleepFor(2ms);
+  EXPECT_GE(steady_clock::now() - start, 2ms);
+}
+
+TEST_F(IoContextTest, EventFdWaiter) {
+  IoContext& cntx = pool_->at(0);
+  base::EventFdCount ec;
+  std::atomic<unsigned> val{0};
+  constexpr unsigned kRounds = 1000;
+
+  std::thread notifier([&] {
+    for (unsigned i = 1; i <= kRounds; ++i) {
+      val.store(i, std::memory_order_release);
+      ec.notify();
+      if (i % 100 == 0)
+        std::this_thread::sleep_for(1ms);
+    }
+  });
+
+  cntx.AwaitSafe([&] {
+    EventFdWaiter waiter(cntx, &ec);
+    EXPECT_FALSE(waiter.Await([&] { return val.load(std::memory_order_acquire) == kRounds; }));
+
+    fibers::fiber canceller([&] {
+      cntx.timers().SleepFor(1ms);
+      waiter.Cancel();
+    });
+    EXPECT_EQ(asio::error::operation_aborted, waiter.Await([] { return false; }));
+    canceller.join();
+  });
+  notifier.join();
+}
+
+TEST_F(IoContextTest, AsyncOrder) {
+  IoContext& cntx = pool_->GetNextContext();
+  constexpr unsigned kThreads = 4, kTasks = 5000;  // overflows the task queue.
+
+  // Modified only by IO thread.
+  std::vector<unsigned> seq[kThreads];
+  std::thread ts[kThreads];
+  for (unsigned i = 0; i < kThreads; ++i) {
+    ts[i] = std::thread([&, i] {
+      char big[256] = {0};  // does not fit into InlineTask.
+      for (unsigned j = 0; j < kTasks; ++j) {
+        if (j % 100 == 0) {
+          cntx.Async([&, i, j, big] { seq[i].push_back(j + big[0]); });
+        } else {
+          cntx.Async([&, i, j] { seq[i].push_back(j); });
+        }
+      }
+    });
+  }
+  for (unsigned i = 0; i < kThreads; ++i) {
+    ts[i].join();
+  }
+  cntx.Await([] {});
+
+  for (unsigned i = 0; i < kThreads; ++i) {
+    ASSERT_EQ(kTasks, seq[i].size());
+    for (unsigned j = 0; j < kTasks; ++j) {
+      ASSERT_EQ(j, seq[i][j]);
+    }
+  }
+}
+
 TEST_F(IoContextTest, PlainFiberYield) {
   fibers::use_scheduling_algorithm<RRAlgo>();
   bool stop = false;
@@ -396,6 +558,232 @@ TEST_F(IoContextTest, ThreadsNotify) {
   }
 }
 
+TEST_F(IoContextTest, IoUring) {
+  IoContext& cntx = pool_->GetNextContext();
+  std::string path = base::GetTestTempPath("io_uring.bin");
+  int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+
+  constexpr unsigned kFibers = 8;
+  constexpr size_t kChunk = 1 << 16;
+  cntx.AwaitSafe([&] {
+    IoUring* ring = IoUring::ForThisThread(&cntx);
+    if (!ring) {
+      LOG(WARNING) << "Skipping, io_uring is not supported";
+      return;
+    }
+    EXPECT_EQ(ring, IoUring::ForThisThread(&cntx));
+
+    // Fibers write and read their chunks concurrently through the same ring.
+    fibers::fiber fbs[kFibers];
+    for (unsigned i = 0; i < kFibers; ++i) {
+      fbs[i] = fibers::fiber([&, i] {
+        std::string src(kChunk, 'a' + i), dest(kChunk, '\0');
+        iovec io{&src[0], src.size()};
+        EXPECT_EQ(kChunk, ring->WriteV(fd, &io, 1, i * kChunk));
+
+        io = iovec{&dest[0], dest.size()};
+        EXPECT_EQ(kChunk, ring->ReadV(fd, &io, 1, i * kChunk));
+        EXPECT_EQ(src, dest);
+      });
+    }
+    for (auto& fb : fbs)
+      fb.join();
+
+    EXPECT_EQ(0, ring->Fsync(fd));
+
+    char buf[16];
+    iovec io{buf, sizeof(buf)};
+    EXPECT_EQ(0, ring->ReadV(fd, &io, 1, kFibers * kChunk));  // EOF
+    EXPECT_EQ(-EBADF, ring->ReadV(-1, &io, 1, 0));
+
+    io = iovec{buf, sizeof(buf)};
+    ASSERT_EQ(0, ring->RegisterBuffers(&io, 1));
+    EXPECT_EQ(8, ring->ReadFixed(fd, buf + 4, 8, kChunk, 0));
+    EXPECT_EQ(std::string(8, 'b'), std::string(buf + 4, 8));
+  });
+  close(fd);
+}
+
+TEST_F(IoContextTest, IoUringSocket) {
+  IoContext& cntx = pool_->GetNextContext();
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+  cntx.AwaitSafe([&] {
+    IoUring* ring = IoUring::ForThisThread(&cntx);
+    if (!ring) {
+      LOG(WARNING) << "Skipping, io_uring is not supported";
+      return;
+    }
+
+    char buf[16];
+    iovec rio{buf, sizeof(buf)};
+    fibers::fiber reader([&] {
+      // Older kernels do not wait for the data of non-blocking sockets.
+      ssize_t res;
+      while ((res = ring->RecvMsg(fds[0], &rio, 1)) == -EAGAIN) {
+        EXPECT_LT(0, ring->Poll(fds[0], POLLIN));
+      }
+      EXPECT_EQ(5, res);
+    });
+
+    char src[] = "hello";
+    iovec wio{src, 5};
+    EXPECT_EQ(5, ring->SendMsg(fds[1], &wio, 1));
+    reader.join();
+    EXPECT_EQ("hello", std::string(buf, 5));
+  });
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(IoContextTest, WorkStealing) {
+  IoContextPool pool(2);
+  pool.EnableWorkStealing();
+  pool.Run();
+
+  std::thread::id thread1 = pool[1].Await([] { return std::this_thread::get_id(); });
+  auto spin = [] {
+    auto start = steady_clock::now();
+    while (steady_clock::now() - start < 200us) {
+    }
+  };
+
+  // All the fibers start on the first thread, the migratable ones should spread over both.
+  constexpr unsigned kSz = 8;
+  std::mutex mu;
+  unsigned on_thread1 = 0;
+  fibers::fiber fbs[kSz], pinned;
+  for (unsigned i = 0; i < kSz; ++i) {
+    fbs[i] = pool[0].LaunchFiber([&] {
+      this_fiber::properties<IoFiberProperties>().set_migratable(true);
+      for (unsigned j = 0; j < 20; ++j) {
+        this_fiber::yield();
+        spin();
+        if (j % 5 == 0)
+          this_fiber::sleep_for(1ms);
+        std::lock_guard<std::mutex> lk(mu);
+        on_thread1 += (std::this_thread::get_id() == thread1);
+      }
+    });
+  }
+  pinned = pool[0].LaunchFiber([&] {
+    for (unsigned j = 0; j < 50; ++j) {
+      this_fiber::yield();
+      spin();
+      EXPECT_TRUE(pool[0].InContextThread());
+    }
+  });
+
+  for (auto& fb : fbs)
+    fb.join();
+  pinned.join();
+  EXPECT_GT(on_thread1, 0);
+}
+
+TEST_F(IoContextTest, FiberStats) {
+  FLAGS_fiber_stats = true;
+  IoContextPool pool(1);
+  pool.Run();
+
+  auto fb = pool[0].LaunchFiber([] {
+    this_fiber::properties<IoFiberProperties>().set_name("StatsTest");
+    for (unsigned i = 0; i < 10; ++i) {
+      this_fiber::yield();
+      auto start = steady_clock::now();
+      while (steady_clock::now() - start < 100us) {
+      }
+    }
+  });
+  fb.join();
+  pool.Stop();
+  FLAGS_fiber_stats = false;
+
+  auto stats = GetFiberStats();
+  auto it = std::find_if(stats.begin(), stats.end(),
+                         [](const auto& k_v) { return k_v.first == "StatsTest"; });
+  ASSERT_TRUE(it != stats.end());
+  EXPECT_GE(it->second.switches, 10);
+  EXPECT_GE(it->second.cpu_nanos, 1000000);
+  EXPECT_GE(it->second.ready_micros.count(), 10);
+}
+
+TEST_F(IoContextTest, StallDetector) {
+  FLAGS_io_stall_threshold_ms = 20;
+  IoContextPool pool(1);
+  pool.Run();
+
+  pool[0].AwaitSafe([] {
+    this_fiber::properties<IoFiberProperties>().set_name("Staller");
+    std::this_thread::sleep_for(100ms);  // blocks the IO thread.
+  });
+
+  // Gives the watchdog a chance to sample the idle thread as well.
+  std::this_thread::sleep_for(50ms);
+  pool.Stop();
+  FLAGS_io_stall_threshold_ms = 0;
+
+  auto stalls = GetIoStalls();
+  ASSERT_EQ(1u, stalls.size());
+  EXPECT_EQ("Staller", stalls[0].fiber);
+  EXPECT_GE(stalls[0].stuck_ms, 20u);
+  EXPECT_FALSE(stalls[0].stack.empty());
+}
+
+TEST_F(IoContextTest, HandlerAllocator) {
+  IoContext& cntx = (*pool_)[0];
+  unsigned cached = cntx.AwaitSafe([&] {
+    steady_timer timer(cntx.raw_context());
+    system::error_code ec;
+    for (unsigned i = 0; i < 10; ++i) {
+      timer.expires_after(1ms);
+      timer.async_wait(fibers_ext::yield[ec]);
+      EXPECT_FALSE(ec);
+    }
+    return util::detail::HandlerMemory::CachedBlocks();
+  });
+
+  // All the waits reused the single block of the first one.
+  EXPECT_EQ(1u, cached);
+}
+
+TEST_F(IoContextTest, ShmRing) {
+  IoContext& cntx = (*pool_)[0];
+  cntx.AwaitSafe([&] {
+    ShmRing writer(&cntx), reader(&cntx);
+    ASSERT_FALSE(writer.Create(4096));
+
+    // A peer process would receive the fds over a unix domain socket.
+    ShmRing::Fds fds = writer.fds();
+    for (int& fd : fds)
+      fd = dup(fd);
+    ASSERT_FALSE(reader.Attach(fds));
+    EXPECT_EQ(4096, reader.capacity());
+
+    // Much larger than the ring, so that both sides wait for each other.
+    std::vector<uint32_t> src(1 << 16), dest(src.size());
+    std::iota(src.begin(), src.end(), 0);
+
+    fibers::fiber write_fb([&] {
+      system::error_code ec;
+      asio::write(writer, asio::buffer(src), ec);
+      EXPECT_FALSE(ec) << ec.message();
+      writer.Close();
+    });
+
+    system::error_code ec;
+    asio::read(reader, asio::buffer(dest), ec);
+    EXPECT_FALSE(ec) << ec.message();
+    EXPECT_TRUE(src == dest);
+
+    uint8_t c;
+    reader.read_some(asio::buffer(&c, 1), ec);
+    EXPECT_EQ(asio::error::eof, ec);
+    write_fb.join();
+  });
+}
+
 static void BM_RunOneNoLock(benchmark::State& state) {
   io_context cntx(1);  // no locking
 
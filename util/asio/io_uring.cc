@@ -0,0 +1,320 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/io_uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace util {
+
+using namespace boost;
+
+namespace {
+
+constexpr unsigned kRingEntries = 256;
+
+inline int sys_io_uring_setup(unsigned entries, io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+inline int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template <typename T> T* RingPtr(void* ring, uint32_t offset) {
+  return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(ring) + offset);
+}
+
+thread_local std::unique_ptr<IoUring> this_ring;
+thread_local bool this_ring_failed = false;
+
+}  // namespace
+
+struct IoUring::Request {
+  fibers_ext::Done done;
+  int32_t res = 0;
+};
+
+IoUring* IoUring::ForThisThread(IoContext* cntx) {
+  CHECK(cntx->InContextThread());
+
+  if (!this_ring && !this_ring_failed) {
+    std::unique_ptr<IoUring> ring(new IoUring(cntx));
+    if (ring->Init(kRingEntries)) {
+      this_ring = std::move(ring);
+    } else {
+      this_ring_failed = true;
+    }
+  }
+  return this_ring.get();
+}
+
+IoUring::~IoUring() {
+  // Closes the eventfd and cancels the pending wait. Its handler does not access this.
+  event_sd_.reset();
+
+  if (sqes_)
+    munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+  if (cq_ring_ && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_)
+    munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0)
+    close(ring_fd_);
+}
+
+bool IoUring::Init(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring_fd_ = sys_io_uring_setup(entries, &params);
+  if (ring_fd_ < 0) {
+    LOG(WARNING) << "io_uring is not supported: " << strerror(errno);
+    return false;
+  }
+
+  sq_entries_ = params.sq_entries;
+  cq_entries_ = params.cq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+
+  constexpr int kProt = PROT_READ | PROT_WRITE;
+  constexpr int kFlags = MAP_SHARED | MAP_POPULATE;
+
+  void* ptr = mmap(nullptr, sq_ring_size_, kProt, kFlags, ring_fd_, IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED) {
+    LOG(ERROR) << "Could not map io_uring: " << strerror(errno);
+    return false;
+  }
+  sq_ring_ = ptr;
+
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    ptr = mmap(nullptr, cq_ring_size_, kProt, kFlags, ring_fd_, IORING_OFF_CQ_RING);
+    if (ptr == MAP_FAILED) {
+      LOG(ERROR) << "Could not map io_uring: " << strerror(errno);
+      return false;
+    }
+    cq_ring_ = ptr;
+  }
+
+  ptr = mmap(nullptr, sq_entries_ * sizeof(io_uring_sqe), kProt, kFlags, ring_fd_,
+             IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) {
+    LOG(ERROR) << "Could not map io_uring: " << strerror(errno);
+    return false;
+  }
+  sqes_ = reinterpret_cast<io_uring_sqe*>(ptr);
+
+  sq_tail_ = RingPtr<uint32_t>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = RingPtr<uint32_t>(sq_ring_, params.sq_off.ring_mask);
+  sq_array_ = RingPtr<uint32_t>(sq_ring_, params.sq_off.array);
+  cq_head_ = RingPtr<uint32_t>(cq_ring_, params.cq_off.head);
+  cq_tail_ = RingPtr<uint32_t>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = RingPtr<uint32_t>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = RingPtr<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+  int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    LOG(ERROR) << "Could not create eventfd: " << strerror(errno);
+    return false;
+  }
+
+  // stream_descriptor owns the eventfd.
+  event_sd_.reset(new asio::posix::stream_descriptor(cntx_->raw_context(), event_fd));
+  if (sys_io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+    LOG(ERROR) << "Could not register eventfd: " << strerror(errno);
+    return false;
+  }
+
+  ArmCompletions();
+  VLOG(1) << "Created io_uring with " << sq_entries_ << "/" << cq_entries_ << " entries";
+
+  return true;
+}
+
+ssize_t IoUring::ReadV(int fd, const iovec* iov, unsigned iovcnt, uint64_t offset) {
+  return Submit(IORING_OP_READV, fd, iov, iovcnt, offset);
+}
+
+ssize_t IoUring::WriteV(int fd, const iovec* iov, unsigned iovcnt, uint64_t offset) {
+  return Submit(IORING_OP_WRITEV, fd, iov, iovcnt, offset);
+}
+
+int IoUring::Fsync(int fd) {
+  return Submit(IORING_OP_FSYNC, fd, nullptr, 0, 0);
+}
+
+ssize_t IoUring::RecvMsg(int fd, const iovec* iov, unsigned iovcnt) {
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec*>(iov);
+  msg.msg_iovlen = iovcnt;
+
+  // msg is valid until the request completes since we wait for it in Submit.
+  return Submit(IORING_OP_RECVMSG, fd, &msg, 1, 0);
+}
+
+ssize_t IoUring::SendMsg(int fd, const iovec* iov, unsigned iovcnt) {
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec*>(iov);
+  msg.msg_iovlen = iovcnt;
+
+  return Submit(IORING_OP_SENDMSG, fd, &msg, 1, 0, MSG_NOSIGNAL);
+}
+
+int IoUring::Poll(int fd, short events) {
+  return Submit(IORING_OP_POLL_ADD, fd, nullptr, 0, 0, uint16_t(events));
+}
+
+int IoUring::RegisterBuffers(const iovec* iov, unsigned nr) {
+  CHECK(cntx_->InContextThread());
+
+  if (has_buffers_) {
+    sys_io_uring_register(ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    has_buffers_ = false;
+  }
+  if (sys_io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, iov, nr) < 0)
+    return -errno;
+
+  has_buffers_ = true;
+  return 0;
+}
+
+ssize_t IoUring::ReadFixed(int fd, void* buf, unsigned len, uint64_t offset,
+                           unsigned buf_index) {
+  DCHECK(has_buffers_);
+  return Submit(IORING_OP_READ_FIXED, fd, buf, len, offset, 0, buf_index);
+}
+
+ssize_t IoUring::WriteFixed(int fd, const void* buf, unsigned len, uint64_t offset,
+                            unsigned buf_index) {
+  DCHECK(has_buffers_);
+  return Submit(IORING_OP_WRITE_FIXED, fd, buf, len, offset, 0, buf_index);
+}
+
+int IoUring::Submit(uint8_t opcode, int fd, const void* addr, unsigned len, uint64_t offset,
+                    uint32_t op_flags, uint16_t buf_index) {
+  CHECK(cntx_->InContextThread());
+
+  // Completion queue must be able to hold all the in-flight requests and the submission queue
+  // all the queued ones.
+  inflight_ec_.await([this] { return inflight_ < cq_entries_ && unsubmitted_ < sq_entries_; });
+
+  Request req;
+
+  uint32_t tail = *sq_tail_;
+  uint32_t index = tail & *sq_mask_;
+  io_uring_sqe* sqe = sqes_ + index;
+  memset(sqe, 0, sizeof(io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(addr);
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->rw_flags = op_flags;  // shares the union with msg_flags and poll events.
+  sqe->buf_index = buf_index;
+  sqe->user_data = reinterpret_cast<uint64_t>(&req);
+
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++inflight_;
+  ++unsubmitted_;
+
+  // Other fibers of the thread may queue their requests until the loop runs the flush.
+  if (!flush_posted_) {
+    flush_posted_ = true;
+    asio::post(cntx_->raw_context(), [this] { Flush(); });
+  }
+
+  req.done.Wait();
+
+  return req.res;
+}
+
+void IoUring::Flush() {
+  flush_posted_ = false;
+
+  while (unsubmitted_) {
+    int res = sys_io_uring_enter(ring_fd_, unsubmitted_, 0, 0);
+    if (res > 0) {
+      unsubmitted_ -= std::min<unsigned>(res, unsubmitted_);
+      continue;
+    }
+    if (res < 0 && errno == EINTR)
+      continue;
+    CHECK(res == 0 || errno == EAGAIN || errno == EBUSY)
+        << "io_uring_enter failed: " << strerror(errno);
+
+    // The kernel is short of resources, retry after the loop reaps the completions.
+    flush_posted_ = true;
+    asio::post(cntx_->raw_context(), [this] { Flush(); });
+    break;
+  }
+  VLOG(2) << "Flushed io_uring, " << unsubmitted_ << " requests are left";
+
+  // Wakes the fibers that wait for the room in the submission queue.
+  inflight_ec_.notifyAll();
+}
+
+void IoUring::ArmCompletions() {
+  using sd_t = asio::posix::stream_descriptor;
+
+  event_sd_->async_wait(sd_t::wait_read, [this](const system::error_code& ec) {
+    if (ec)  // the ring is being destroyed.
+      return;
+
+    uint64_t val;
+    ssize_t res = read(event_sd_->native_handle(), &val, sizeof(val));
+    (void)res;
+
+    ReapCompletions();
+    ArmCompletions();
+  });
+}
+
+// Runs in IO loop.
+void IoUring::ReapCompletions() {
+  uint32_t head = *cq_head_;
+  unsigned reaped = 0;
+
+  while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+    Request* req = reinterpret_cast<Request*>(cqe.user_data);
+
+    // req is valid until its fiber runs, which happens after we return.
+    req->res = cqe.res;
+    req->done.Notify();
+    ++head;
+    ++reaped;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+  if (reaped) {
+    inflight_ -= reaped;
+    inflight_ec_.notifyAll();
+  }
+}
+
+}  // namespace util
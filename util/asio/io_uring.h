@@ -0,0 +1,101 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <sys/uio.h>
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <memory>
+
+#include "util/asio/io_context.h"
+#include "util/fibers/event_count.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace util {
+
+// io_uring instance of an IoContext thread. Fibers of the thread submit file and socket IO into
+// the ring and are suspended until it completes. The requests are not submitted right away:
+// the IO loop of the context submits all the requests that its fibers queued with a single
+// io_uring_enter call once they suspend. The kernel signals completions via eventfd that is
+// polled by the IO loop, which resumes the waiting fibers. No helper threads are involved.
+// Not thread-safe: the ring may be used only by the fibers of its IoContext thread.
+class IoUring {
+ public:
+  // Returns the ring of the calling thread, creating it on the first call. Must be called from
+  // cntx thread. Returns null if the kernel does not support io_uring.
+  static IoUring* ForThisThread(IoContext* cntx);
+
+  ~IoUring();
+
+  // Same as preadv(2)/pwritev(2) but suspend only the calling fiber.
+  // Return the number of bytes transferred or -errno.
+  ssize_t ReadV(int fd, const iovec* iov, unsigned iovcnt, uint64_t offset);
+  ssize_t WriteV(int fd, const iovec* iov, unsigned iovcnt, uint64_t offset);
+
+  // Returns 0 or -errno.
+  int Fsync(int fd);
+
+  // Same as recvmsg(2)/sendmsg(2) on sockets but suspend only the calling fiber. Older kernels
+  // return -EAGAIN for sockets in non-blocking mode instead of waiting for them, see Poll().
+  // SendMsg does not raise SIGPIPE.
+  ssize_t RecvMsg(int fd, const iovec* iov, unsigned iovcnt);
+  ssize_t SendMsg(int fd, const iovec* iov, unsigned iovcnt);
+
+  // Waits until fd has any of the poll(2) events. Returns the ready events or -errno.
+  int Poll(int fd, short events);
+
+  // Registers the buffers with the kernel once so that the fixed reads and writes need not map
+  // them on every request. Replaces the previously registered buffers, the ring must be idle.
+  // Returns 0 or -errno.
+  int RegisterBuffers(const iovec* iov, unsigned nr);
+
+  // Same as ReadV/WriteV into the range [buf, buf + len) of the registered buffer buf_index.
+  ssize_t ReadFixed(int fd, void* buf, unsigned len, uint64_t offset, unsigned buf_index);
+  ssize_t WriteFixed(int fd, const void* buf, unsigned len, uint64_t offset, unsigned buf_index);
+
+  // Maximal number of in-flight requests. Fibers that submit more wait for completions.
+  unsigned capacity() const { return cq_entries_; }
+
+ private:
+  struct Request;
+
+  explicit IoUring(IoContext* cntx) : cntx_(cntx) {}
+
+  bool Init(unsigned entries);
+
+  // op_flags are the flags of the opcode, e.g. msg_flags or poll events.
+  int Submit(uint8_t opcode, int fd, const void* addr, unsigned len, uint64_t offset,
+             uint32_t op_flags = 0, uint16_t buf_index = 0);
+
+  // Passes the queued requests to the kernel. Runs in IO loop.
+  void Flush();
+
+  // Waits asynchronously for the eventfd notifications of the kernel.
+  void ArmCompletions();
+  void ReapCompletions();
+
+  IoContext* cntx_;
+  int ring_fd_ = -1;
+  std::unique_ptr<::boost::asio::posix::stream_descriptor> event_sd_;
+
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0, cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  unsigned sq_entries_ = 0, cq_entries_ = 0;
+
+  uint32_t *sq_tail_ = nullptr, *sq_mask_ = nullptr, *sq_array_ = nullptr;
+  uint32_t *cq_head_ = nullptr, *cq_tail_ = nullptr, *cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+
+  unsigned inflight_ = 0;
+  unsigned unsubmitted_ = 0;  // requests queued since the last Flush().
+  bool flush_posted_ = false;
+  bool has_buffers_ = false;
+  fibers_ext::EventCount inflight_ec_;  // notified when requests complete.
+};
+
+}  // namespace util
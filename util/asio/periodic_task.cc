@@ -4,7 +4,6 @@
 #include "util/asio/periodic_task.h"
 
 #include "base/logging.h"
-#include "util/asio/yield.h"
 #include "util/stats/varz_stats.h"
 
 
@@ -13,24 +12,33 @@ namespace util {
 DEFINE_VARZ(VarzCount, task_hang_times);
 
 void PeriodicTask::Cancel() {
-  if ((state_ & ALARMED) == 0)
+  if (!event_)
     return;
   VLOG(1) << "Cancel";
-  state_ |= SHUTDOWN;
-  timer_.expires_after(duration_t(0));
-  error_code ec;
-  while (state_ & ALARMED) {
-    timer_.async_wait(fibers_ext::yield[ec]);
-  }
-  state_ &= ~uint8_t(SHUTDOWN);
+  cntx_.Await([this] { event_->cancel(); });
+  event_.reset();
   VLOG(1) << "Cancel Finish";
 }
 
-void PeriodicTask::Alarm() {
-  CHECK_EQ(0, state_ & ALARMED) << "Can not Start on already alarmed timer, run Cancel first";
-  last_ = timer_t::clock_type::now();
-  timer_.expires_at(last_ + d_);
-  state_ |= ALARMED;
+void PeriodicTask::Alarm(std::unique_ptr<base::TimerEventInterface> event) {
+  CHECK(!event_) << "Can not Start on already alarmed timer, run Cancel first";
+  event_ = std::move(event);
+  cntx_.Await([this] {
+    last_ = clock_t::now();
+    cntx_.timers().ScheduleAt(event_.get(), last_ + d_);
+  });
+}
+
+int PeriodicTask::Rearm() {
+  duration_t real_d = clock_t::now() - last_;
+
+  // for each function invocation we pass at least 1 tick.
+  int ticks = std::max<int>(1, real_d / d_);
+  last_ += d_ * ticks;
+
+  // due to max() rounding, last_ will self balance itself to be close to clock_t::now().
+  cntx_.timers().ScheduleAt(event_.get(), last_ + d_);
+  return ticks;
 }
 
 void PeriodicWorkerTask::ResetErrorState() {
@@ -4,7 +4,6 @@
 #pragma once
 
 #include <thread>
-#include <boost/asio/steady_timer.hpp>
 #include <boost/fiber/condition_variable.hpp>
 #include "util/asio/io_context.h"
 
@@ -12,16 +11,15 @@ namespace util {
 
 // Single threaded but fiber friendly PeriodicTask. Runs directly from IO fiber therefore
 // should run only cpu, non-blocking tasks which should not block the calling fiber.
+// The task is an event of the TimerService of its IoContext, hence it fires on the 1ms ticks
+// of the service and the periods shorter than a tick are batched into the 'ticks' argument.
 // 'Cancel' may block the calling fiber until the scheduled callback finished running.
 class PeriodicTask {
-  enum {ALARMED = 0x1, SHUTDOWN = 0x2};
-
  public:
-  using timer_t = ::boost::asio::steady_timer;
-  using duration_t = timer_t::duration;
-  using error_code = boost::system::error_code;
+  using clock_t = TimerService::clock_t;
+  using duration_t = TimerService::duration_t;
 
-  PeriodicTask(IoContext& cntx, duration_t d) : timer_(cntx.raw_context()), d_(d), state_(0) {}
+  PeriodicTask(IoContext& cntx, duration_t d) : cntx_(cntx), d_(d) {}
   PeriodicTask(PeriodicTask&&) = default;
 
   ~PeriodicTask() { Cancel(); }
@@ -33,44 +31,34 @@ class PeriodicTask {
   // "n+1" seconds, then f(2) will be called. The system is self-balancing so for next invocation
   // at (n+2) seconds, we will pass f(1) again.
   template<typename Func> void Start(Func&& f) {
-    Alarm();
-    RunInternal(std::forward<Func>(f));
+    Alarm(std::make_unique<Event<std::decay_t<Func>>>(this, std::forward<Func>(f)));
   }
 
   // Cancels the task and blocks until all the callbacks finished to run.
-  // Since it blocks - it should not run from IO fiber.
+  // The callbacks run in the IO thread, hence none runs once Cancel returns.
   void Cancel();
 
  private:
-  void Alarm();
+  template <typename Func> class Event : public base::TimerEventInterface {
+   public:
+    template <typename U> Event(PeriodicTask* task, U&& f) : task_(task), f_(std::forward<U>(f)) {}
 
-  template<typename Func> void RunInternal(Func&& f) {
-    timer_.async_wait([this, f = std::forward<Func>(f)] (const error_code& ec) mutable {
-      if (ec == boost::asio::error::operation_aborted || (state_ & SHUTDOWN)) {
-        Disalarm();
-        return;
-      }
-      duration_t real_d = timer_t::clock_type::now() - last_;
+   private:
+    void execute() final { f_(task_->Rearm()); }
 
-      // for each function invocation we pass at least 1 tick.
-      int ticks = std::max<int>(1, real_d / d_);
-      f(ticks);
-      last_ += d_ * ticks;
+    PeriodicTask* task_;
+    Func f_;
+  };
 
-      // due to max() rounding, last_ will self balance itself to be close to clock_type::now().
-      timer_.expires_at(last_ + d_);
-      RunInternal(std::forward<Func>(f));
-    });
-  }
+  void Alarm(std::unique_ptr<base::TimerEventInterface> event);
 
-  void Disalarm() {
-    state_ &= ~uint8_t(ALARMED);
-  }
+  // Reschedules the event and returns the ticks of the current invocation.
+  int Rearm();
 
-  timer_t timer_;
+  IoContext& cntx_;
   duration_t d_;
-  timer_t::time_point last_;
-  uint8_t state_ ;
+  clock_t::time_point last_;
+  std::unique_ptr<base::TimerEventInterface> event_;  // set while the task runs.
 };
 
 
@@ -0,0 +1,192 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/shm_ring.h"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "base/logging.h"
+#include "util/asio/io_context.h"
+#include "util/asio/yield.h"
+
+namespace util {
+
+using namespace boost;
+
+namespace {
+
+constexpr size_t kPageSize = 4096;
+static_assert(sizeof(ShmRing::Fds) == 3 * sizeof(int), "");
+
+inline system::error_code LastError() {
+  return system::error_code(errno, system::system_category());
+}
+
+}  // namespace
+
+ShmRing::ShmRing(IoContext* cntx) : data_ev_(cntx->raw_context()), space_ev_(cntx->raw_context()) {
+  static_assert(sizeof(Header) <= kPageSize, "");
+}
+
+ShmRing::~ShmRing() {
+  if (header_)
+    munmap(header_, map_size_);
+  if (memfd_ >= 0)
+    close(memfd_);
+}
+
+auto ShmRing::Create(size_t capacity) -> error_code {
+  CHECK(!header_);
+
+  // A power of 2, so that the positions wrap around with a mask.
+  capacity = std::max(capacity, kPageSize);
+  capacity_ = size_t(1) << (64 - __builtin_clzll(capacity - 1));
+  int memfd = memfd_create("shm_ring", MFD_CLOEXEC);
+  if (memfd < 0)
+    return LastError();
+  if (ftruncate(memfd, kPageSize + capacity_) < 0) {
+    error_code ec = LastError();
+    close(memfd);
+    return ec;
+  }
+
+  error_code ec = Map(memfd);
+  if (ec)
+    return ec;
+  new (header_) Header{};
+  header_->capacity = capacity_;
+
+  for (auto* ev : {&data_ev_, &space_ev_}) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+      return LastError();
+    ev->assign(fd);
+  }
+  return error_code{};
+}
+
+auto ShmRing::Attach(const Fds& fds) -> error_code {
+  CHECK(!header_);
+
+  // Owns the fds from now on, even if it fails.
+  data_ev_.assign(fds[1]);
+  space_ev_.assign(fds[2]);
+
+  struct stat st;
+  if (fstat(fds[0], &st) < 0) {
+    close(fds[0]);
+    return LastError();
+  }
+  if (size_t(st.st_size) <= kPageSize) {
+    close(fds[0]);
+    return asio::error::invalid_argument;
+  }
+  capacity_ = st.st_size - kPageSize;
+
+  error_code ec = Map(fds[0]);
+  if (!ec && header_->capacity != capacity_)
+    ec = asio::error::invalid_argument;
+  return ec;
+}
+
+auto ShmRing::Map(int memfd) -> error_code {
+  memfd_ = memfd;
+  map_size_ = kPageSize + capacity_;
+  void* ptr = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (ptr == MAP_FAILED)
+    return LastError();
+  header_ = reinterpret_cast<Header*>(ptr);
+  data_ = reinterpret_cast<uint8_t*>(ptr) + kPageSize;
+  return error_code{};
+}
+
+auto ShmRing::fds() const -> Fds {
+  // The descriptors are not modified, native_handle() is just not const.
+  auto& self = const_cast<ShmRing&>(*this);
+  return Fds{memfd_, self.data_ev_.native_handle(), self.space_ev_.native_handle()};
+}
+
+void ShmRing::Close() {
+  header_->closed.store(1, std::memory_order_release);
+
+  // Wakes up both sides regardless of whether they wait.
+  uint64_t one = 1;
+  for (auto* ev : {&data_ev_, &space_ev_}) {
+    ssize_t res = write(ev->native_handle(), &one, sizeof(one));
+    (void)res;
+  }
+}
+
+size_t ShmRing::WriteSpace() const {
+  uint64_t head = header_->head.load(std::memory_order_relaxed);
+  return capacity_ - (head - header_->tail.load(std::memory_order_acquire));
+}
+
+size_t ShmRing::ReadSpace() const {
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  return header_->head.load(std::memory_order_acquire) - tail;
+}
+
+size_t ShmRing::Put(const void* src, size_t len) {
+  uint64_t head = header_->head.load(std::memory_order_relaxed);
+  len = std::min(len, WriteSpace());
+
+  size_t pos = head & (capacity_ - 1);
+  size_t first = std::min(len, capacity_ - pos);
+  memcpy(data_ + pos, src, first);
+  memcpy(data_, static_cast<const uint8_t*>(src) + first, len - first);
+
+  header_->head.store(head + len, std::memory_order_release);
+  return len;
+}
+
+size_t ShmRing::Get(void* dest, size_t len) {
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  len = std::min(len, ReadSpace());
+
+  size_t pos = tail & (capacity_ - 1);
+  size_t first = std::min(len, capacity_ - pos);
+  memcpy(dest, data_ + pos, first);
+  memcpy(static_cast<uint8_t*>(dest) + first, data_, len - first);
+
+  header_->tail.store(tail + len, std::memory_order_release);
+  return len;
+}
+
+auto ShmRing::Wait(std::atomic<uint32_t>* waiting, asio::posix::stream_descriptor* efd,
+                   size_t (ShmRing::*space)() const) -> error_code {
+  error_code ec;
+  while ((this->*space)() == 0 && !header_->closed.load(std::memory_order_acquire)) {
+    // Pairs with the fence in Notify: either the peer sees waiting or we see its progress.
+    waiting->store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ((this->*space)() == 0 && !header_->closed.load(std::memory_order_acquire)) {
+      efd->async_wait(asio::posix::stream_descriptor::wait_read, fibers_ext::yield[ec]);
+      if (ec) {
+        waiting->store(0, std::memory_order_relaxed);
+        break;
+      }
+      uint64_t val;
+      ssize_t res = read(efd->native_handle(), &val, sizeof(val));  // resets the eventfd.
+      (void)res;
+    }
+    waiting->store(0, std::memory_order_relaxed);
+  }
+  return ec;
+}
+
+void ShmRing::Notify(std::atomic<uint32_t>* waiting, asio::posix::stream_descriptor* efd) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting->load(std::memory_order_relaxed)) {
+    uint64_t one = 1;
+    ssize_t res = write(efd->native_handle(), &one, sizeof(one));
+    (void)res;
+  }
+}
+
+}  // namespace util
@@ -0,0 +1,141 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <array>
+#include <atomic>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+namespace util {
+
+class IoContext;
+
+// A single-producer single-consumer byte stream through shared memory, for the large
+// transfers between the processes of the same host. The bytes are copied once into the ring
+// and once out of it, without passing through the kernel.
+// The ring lives in a memfd and the peers wake each other up via two eventfds, which
+// the waiting fiber watches in the IoContext loop. The creator passes fds() to the peer
+// process, usually with SCM_RIGHTS over a unix domain socket, and the peer attaches to them.
+// Every side may both write and read but only one fiber may write and one fiber may read.
+// Must be used from the thread of its IoContext.
+class ShmRing {
+ public:
+  using error_code = ::boost::system::error_code;
+  using Fds = std::array<int, 3>;  // the memfd and the eventfds of the data and of the space.
+
+  explicit ShmRing(IoContext* cntx);
+  ~ShmRing();
+
+  ShmRing(const ShmRing&) = delete;
+  void operator=(const ShmRing&) = delete;
+
+  // Creates a new ring of at least capacity bytes.
+  error_code Create(size_t capacity);
+
+  // Attaches to the ring of fds and takes their ownership.
+  error_code Attach(const Fds& fds);
+
+  // The fds of the ring, which stay owned by the ring.
+  Fds fds() const;
+
+  // SyncWriteStream. Blocks the calling fiber while the ring is full.
+  // Fails with broken_pipe once the ring is closed.
+  template <typename BS> size_t write_some(const BS& bufs, error_code& ec);
+
+  // SyncReadStream. Blocks the calling fiber while the ring is empty.
+  // Returns eof once the ring is closed and drained.
+  template <typename MBS> size_t read_some(const MBS& bufs, error_code& ec);
+
+  // Closes the ring for both sides and wakes them up.
+  void Close();
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  struct Header;
+
+  error_code Map(int memfd);
+
+  // Returns the number of bytes that the writer may write or that the reader may read.
+  size_t WriteSpace() const;
+  size_t ReadSpace() const;
+
+  // Copies up to len bytes into the ring or out of it, returns how many were copied.
+  size_t Put(const void* src, size_t len);
+  size_t Get(void* dest, size_t len);
+
+  // Blocks until (this->*space)() is positive or the ring is closed.
+  // waiting asks the peer to signal efd.
+  error_code Wait(std::atomic<uint32_t>* waiting, ::boost::asio::posix::stream_descriptor* efd,
+                  size_t (ShmRing::*space)() const);
+  void Notify(std::atomic<uint32_t>* waiting, ::boost::asio::posix::stream_descriptor* efd);
+
+  Header* header_ = nullptr;
+  uint8_t* data_ = nullptr;
+  size_t capacity_ = 0, map_size_ = 0;
+  int memfd_ = -1;
+
+  ::boost::asio::posix::stream_descriptor data_ev_, space_ev_;
+};
+
+struct ShmRing::Header {
+  alignas(64) std::atomic<uint64_t> head;  // the bytes written, advanced by the writer.
+  alignas(64) std::atomic<uint64_t> tail;  // the bytes read, advanced by the reader.
+  alignas(64) std::atomic<uint32_t> reader_waiting, writer_waiting, closed;
+  uint64_t capacity;
+};
+
+template <typename BS> size_t ShmRing::write_some(const BS& bufs, error_code& ec) {
+  ec.clear();
+  if (::boost::asio::buffer_size(bufs) == 0)
+    return 0;
+  ec = Wait(&header_->writer_waiting, &space_ev_, &ShmRing::WriteSpace);
+  if (ec)
+    return 0;
+  if (header_->closed.load(std::memory_order_acquire)) {
+    ec = ::boost::asio::error::broken_pipe;
+    return 0;
+  }
+
+  size_t res = 0;
+  for (auto it = ::boost::asio::buffer_sequence_begin(bufs);
+       it != ::boost::asio::buffer_sequence_end(bufs); ++it) {
+    ::boost::asio::const_buffer buf = *it;
+    size_t n = Put(buf.data(), buf.size());
+    res += n;
+    if (n < buf.size())
+      break;
+  }
+  Notify(&header_->reader_waiting, &data_ev_);
+  return res;
+}
+
+template <typename MBS> size_t ShmRing::read_some(const MBS& bufs, error_code& ec) {
+  ec.clear();
+  if (::boost::asio::buffer_size(bufs) == 0)
+    return 0;
+  ec = Wait(&header_->reader_waiting, &data_ev_, &ShmRing::ReadSpace);
+  if (ec)
+    return 0;
+  if (ReadSpace() == 0) {  // closed.
+    ec = ::boost::asio::error::eof;
+    return 0;
+  }
+
+  size_t res = 0;
+  for (auto it = ::boost::asio::buffer_sequence_begin(bufs);
+       it != ::boost::asio::buffer_sequence_end(bufs); ++it) {
+    ::boost::asio::mutable_buffer buf = *it;
+    size_t n = Get(buf.data(), buf.size());
+    res += n;
+    if (n < buf.size())
+      break;
+  }
+  Notify(&header_->writer_waiting, &space_ev_);
+  return res;
+}
+
+}  // namespace util
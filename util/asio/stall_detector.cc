@@ -0,0 +1,226 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/stall_detector.h"
+
+#include <signal.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "absl/debugging/stacktrace.h"
+#include "absl/debugging/symbolize.h"
+#include "absl/strings/str_format.h"
+#include "base/logging.h"
+#include "base/pthread_utils.h"
+#include "util/asio/io_context.h"
+#include "util/stats/varz_stats.h"
+
+DEFINE_uint32(io_stall_threshold_ms, 0,
+              "Samples the running fiber and its stack when an IO thread does not switch fibers "
+              "for that long, see the status page. 0 disables the watchdog");
+
+DEFINE_VARZ(VarzCount, io_stalls);
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+
+namespace detail {
+
+namespace {
+
+constexpr unsigned kMaxFrames = 32;
+constexpr unsigned kRingSize = 32;
+
+// A stall sampled by the signal handler. version is odd while the handler writes it.
+struct Sample {
+  std::atomic<uint32_t> version{0};
+  char thread[16];
+  char fiber[32];
+  time_t at;
+  unsigned stuck_ms;
+  int depth;
+  void* frames[kMaxFrames];
+};
+
+Sample stall_ring[kRingSize];
+std::atomic<uint32_t> stall_ring_next{0};
+
+thread_local LoopHeartbeat* this_heartbeat = nullptr;
+
+// SIGRTMIN drives the millisecond timer of base/walltime.
+inline int StallSignal() { return SIGRTMIN + 1; }
+
+void CopyName(const char* src, char* dest, size_t size) {
+  strncpy(dest, src, size - 1);
+  dest[size - 1] = '\0';
+}
+
+}  // namespace
+
+class StallWatchdog {
+ public:
+  static StallWatchdog& Get() {
+    static StallWatchdog* watchdog = new StallWatchdog;  // its thread never exits.
+    return *watchdog;
+  }
+
+  void Add(LoopHeartbeat* hb) {
+    std::lock_guard<std::mutex> lk(mu_);
+    beats_.push_back(hb);
+  }
+
+  // Once Remove() returns, the thread of hb is not signalled anymore.
+  void Remove(LoopHeartbeat* hb) {
+    std::lock_guard<std::mutex> lk(mu_);
+    beats_.erase(std::find(beats_.begin(), beats_.end(), hb));
+  }
+
+ private:
+  StallWatchdog();
+
+  void Run();
+
+  // Runs in the stuck thread, therefore must be async-signal-safe.
+  static void OnSignal(int sig, siginfo_t* info, void* ucontext);
+
+  std::mutex mu_;
+  std::vector<LoopHeartbeat*> beats_;
+};
+
+StallWatchdog::StallWatchdog() {
+  // The first unwinding may allocate, so we do not do it from the signal handler.
+  void* frames[kMaxFrames];
+  absl::GetStackTrace(frames, kMaxFrames, 0);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sa.sa_sigaction = &StallWatchdog::OnSignal;
+  sigemptyset(&sa.sa_mask);
+  CHECK_EQ(0, sigaction(StallSignal(), &sa, NULL));
+
+  pthread_t tid = base::StartThread("stall_watchdog", [this] { Run(); });
+  PTHREAD_CHECK(detach(tid));
+}
+
+void StallWatchdog::Run() {
+  const uint64_t threshold_ns = uint64_t(FLAGS_io_stall_threshold_ms) * 1000000;
+  const auto period = chrono::microseconds(std::max<uint64_t>(threshold_ns / 4000, 1000));
+
+  while (true) {
+    this_thread::sleep_for(period);
+    uint64_t now = base::GetClockNanos<CLOCK_MONOTONIC>();
+
+    std::lock_guard<std::mutex> lk(mu_);
+    for (LoopHeartbeat* hb : beats_) {
+      uint64_t beat = hb->beat_ns_.load(std::memory_order_relaxed);
+      if (beat == 0 || beat == hb->sampled_ns_ || now < beat + threshold_ns)
+        continue;
+
+      // Every stall is sampled once.
+      hb->sampled_ns_ = beat;
+      io_stalls.Inc();
+      pthread_kill(hb->thread_, StallSignal());
+    }
+  }
+}
+
+void StallWatchdog::OnSignal(int sig, siginfo_t* info, void* ucontext) {
+  LoopHeartbeat* hb = this_heartbeat;
+  if (!hb)
+    return;
+  uint64_t beat = hb->beat_ns_.load(std::memory_order_relaxed);
+  if (beat == 0)  // the thread went idle meanwhile.
+    return;
+
+  int saved_errno = errno;
+  Sample& s = stall_ring[stall_ring_next.fetch_add(1, std::memory_order_relaxed) % kRingSize];
+  uint32_t version = s.version.load(std::memory_order_relaxed);
+  s.version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s.at = ts.tv_sec;
+  s.stuck_ms = (base::GetClockNanos<CLOCK_MONOTONIC>() - beat) / 1000000;
+  CopyName(hb->thread_name_, s.thread, sizeof(s.thread));
+
+  const char* fiber = "dispatcher";
+  fibers::context* ctx = fibers::context::active();
+  if (!ctx->is_context(fibers::type::dispatcher_context)) {
+    auto* props = static_cast<IoFiberProperties*>(ctx->get_properties());
+    fiber = !props ? "unknown" : props->name().empty() ? "unnamed" : props->name().c_str();
+  }
+  CopyName(fiber, s.fiber, sizeof(s.fiber));
+
+  // Skips the frame of the handler.
+  s.depth = absl::GetStackTraceWithContext(s.frames, kMaxFrames, 1, ucontext, nullptr);
+
+  s.version.store(version + 2, std::memory_order_release);
+  errno = saved_errno;
+}
+
+LoopHeartbeat::LoopHeartbeat() : enabled_(FLAGS_io_stall_threshold_ms > 0) {
+  if (!enabled_)
+    return;
+  thread_ = pthread_self();
+  pthread_getname_np(thread_, thread_name_, sizeof(thread_name_));
+  this_heartbeat = this;
+  StallWatchdog::Get().Add(this);
+}
+
+LoopHeartbeat::~LoopHeartbeat() {
+  if (!enabled_)
+    return;
+  StallWatchdog::Get().Remove(this);
+  this_heartbeat = nullptr;
+}
+
+}  // namespace detail
+
+std::vector<IoStall> GetIoStalls() {
+  using detail::stall_ring;
+
+  std::vector<IoStall> res;
+  uint32_t next = detail::stall_ring_next.load(std::memory_order_relaxed);
+  for (unsigned i = 1; i <= detail::kRingSize && i <= next; ++i) {
+    const detail::Sample& s = stall_ring[(next - i) % detail::kRingSize];
+
+    // Reads the sample as a seqlock and skips it if the handler has been writing it.
+    uint32_t version = s.version.load(std::memory_order_acquire);
+    if (version == 0 || (version & 1))
+      continue;
+    IoStall stall;
+    stall.thread = s.thread;
+    stall.fiber = s.fiber;
+    stall.at = s.at;
+    stall.stuck_ms = s.stuck_ms;
+    int depth = std::min<int>(s.depth, detail::kMaxFrames);
+    void* frames[detail::kMaxFrames];
+    std::copy(s.frames, s.frames + depth, frames);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.version.load(std::memory_order_relaxed) != version)
+      continue;
+
+    char buf[1024];
+    for (int j = 0; j < depth; ++j) {
+      // The outer frames are return addresses, which may point past their call.
+      char* pc = reinterpret_cast<char*>(frames[j]) - (j > 0);
+      if (absl::Symbolize(pc, buf, sizeof(buf))) {
+        stall.stack.push_back(buf);
+      } else {
+        stall.stack.push_back(absl::StrFormat("%p", frames[j]));
+      }
+    }
+    res.push_back(std::move(stall));
+  }
+  return res;
+}
+
+}  // namespace util
@@ -0,0 +1,66 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <pthread.h>
+
+#include <atomic>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "base/walltime.h"
+
+namespace util {
+
+// A sample of an IO thread that did not switch fibers for longer than --io_stall_threshold_ms.
+// Usually it means that the running fiber called a blocking function.
+struct IoStall {
+  std::string thread, fiber;  // the names of the thread and of the running fiber.
+  time_t at = 0;              // when the stall was sampled.
+  unsigned stuck_ms = 0;      // for how long the thread was stuck when it was sampled.
+  std::vector<std::string> stack;  // symbolized, the innermost frame first.
+};
+
+// Returns the recently sampled stalls of the IO threads of the process, the newest first.
+std::vector<IoStall> GetIoStalls();
+
+namespace detail {
+
+// The heartbeat of a single IO thread, watched by a process-wide watchdog thread.
+// The scheduler of the thread beats whenever it switches fibers or iterates its IO loop.
+// When the beats stop for longer than the threshold, the watchdog signals the thread,
+// which samples the running fiber and its stack from the signal handler.
+// Must be created and destroyed in the thread it watches.
+class LoopHeartbeat {
+ public:
+  LoopHeartbeat();
+  ~LoopHeartbeat();
+
+  // Whether --io_stall_threshold_ms enabled the watchdog when the heartbeat was created.
+  bool enabled() const { return enabled_; }
+
+  void Beat() {
+    beat_ns_.store(base::GetClockNanos<CLOCK_MONOTONIC>(), std::memory_order_relaxed);
+  }
+
+  // The thread waits for IO events, hence it can not stall until the next beat.
+  void Idle() { beat_ns_.store(0, std::memory_order_relaxed); }
+
+ private:
+  friend class StallWatchdog;
+
+  // Monotonic nanos of the last beat, 0 while idle.
+  std::atomic<uint64_t> beat_ns_{0};
+
+  // The beat that the watchdog sampled already, so that every stall is sampled once.
+  uint64_t sampled_ns_ = 0;
+
+  pthread_t thread_;
+  char thread_name_[16] = {0};
+  bool enabled_;
+};
+
+}  // namespace detail
+}  // namespace util
@@ -0,0 +1,110 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/timer_service.h"
+
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/operations.hpp>
+#include <boost/fiber/scheduler.hpp>
+
+#include "base/logging.h"
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+
+namespace {
+
+constexpr base::Tick kNotArmed = base::Tick(-1);
+using tick_duration = chrono::milliseconds;
+
+thread_local TimerService* this_thread_service = nullptr;
+
+}  // namespace
+
+TimerService::TimerService(asio::io_context* cntx)
+    : timer_(*cntx), start_(clock_t::now()), thread_id_(this_thread::get_id()) {
+  this_thread_service = this;
+}
+
+// The IoContext may be destroyed by another thread after its IO thread exited.
+TimerService::~TimerService() {
+  if (this_thread_service == this)
+    this_thread_service = nullptr;
+}
+
+TimerService* TimerService::ThisThread() { return this_thread_service; }
+
+base::Tick TimerService::TickOf(time_point tp) const {
+  if (tp <= start_)
+    return 0;
+  auto d = tp - start_;
+  auto res = chrono::duration_cast<tick_duration>(d);
+  return res.count() + (res < d);
+}
+
+void TimerService::ScheduleAt(base::TimerEventInterface* ev, time_point tp) {
+  DCHECK(this_thread::get_id() == thread_id_);
+
+  base::Tick at = TickOf(tp), now = wheel_.now();
+
+  // The wheel is advanced lazily, hence its time may lag behind the clock.
+  // Either way the event fires on the first advance past "at".
+  if (at <= now)
+    at = now + 1;
+  wheel_.schedule(ev, at - now);
+  MaybeArm(at);
+}
+
+void TimerService::SleepUntil(time_point tp) {
+  fibers::context* active = fibers::context::active();
+  auto cb = [active] { active->get_scheduler()->schedule(active); };
+  base::TimerEvent<decltype(cb)> ev(std::move(cb));
+
+  ScheduleAt(&ev, tp);
+  active->suspend();
+}
+
+void TimerService::MaybeArm(base::Tick at) {
+  if (at >= armed_at_)
+    return;
+
+  // Re-arming aborts the previous wait, so we do it only if the new deadline is earlier.
+  armed_at_ = at;
+  timer_.expires_at(start_ + tick_duration(at));
+  timer_.async_wait([this](const system::error_code& ec) {
+    // The aborted handlers can run after the service is destroyed.
+    if (ec)
+      return;
+    OnTimer();
+  });
+}
+
+void TimerService::OnTimer() {
+  armed_at_ = kNotArmed;
+
+  base::Tick now = chrono::duration_cast<tick_duration>(clock_t::now() - start_).count();
+  if (now > wheel_.now()) {
+    wheel_.advance(now - wheel_.now());
+  }
+
+  // ticks_to_next_event returns its argument if no events are scheduled.
+  // Otherwise it may underestimate the time for the events of the outer wheels, but then
+  // we just advance more than once.
+  base::Tick next = wheel_.ticks_to_next_event(kNotArmed);
+  if (next != kNotArmed) {
+    MaybeArm(wheel_.now() + std::max<base::Tick>(next, 1));
+  }
+}
+
+void FiberSleepUntil(TimerService::time_point tp) {
+  TimerService* service = this_thread_service;
+  if (service && tp - TimerService::clock_t::now() >= tick_duration(1)) {
+    service->SleepUntil(tp);
+  } else {
+    this_fiber::sleep_until(tp);
+  }
+}
+
+}  // namespace util
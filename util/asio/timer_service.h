@@ -0,0 +1,109 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include "base/wheel_timer.h"
+#include "util/fibers/event_count.h"
+
+namespace util {
+
+// Timers of a single IoContext, backed by base::TimerWheel with 1ms ticks.
+// Scheduling, rescheduling and cancelling an event is O(1) and does not allocate, and all
+// the events of the thread share a single asio timer. Therefore it suits the timeouts that are
+// rescheduled often and rarely fire, like idle timeouts of connections.
+// Not thread-safe: must be used only from the thread of its IoContext. The event callbacks run
+// directly from the IO loop and must not block.
+class TimerService {
+ public:
+  using clock_t = std::chrono::steady_clock;
+  using duration_t = clock_t::duration;
+  using time_point = clock_t::time_point;
+
+  // Rescheduleable event that runs cb when it fires. Cancelled when destroyed.
+  class Timer : public base::TimerEventInterface {
+   public:
+    Timer(TimerService* service, std::function<void()> cb)
+        : service_(service), cb_(std::move(cb)) {}
+
+    // (Re)schedules the timer. The previous schedule is cancelled.
+    void ArmAt(time_point tp) { service_->ScheduleAt(this, tp); }
+    void Arm(duration_t d) { ArmAt(clock_t::now() + d); }
+
+    void Cancel() { cancel(); }
+    bool armed() const { return active(); }
+
+   private:
+    void execute() final { cb_(); }
+
+    TimerService* service_;
+    std::function<void()> cb_;
+  };
+
+  // Must be created in the IO thread of cntx.
+  explicit TimerService(::boost::asio::io_context* cntx);
+  ~TimerService();
+
+  // The service of the calling IO thread, or null in the other threads.
+  static TimerService* ThisThread();
+
+  // Schedules ev to execute at tp or right after it. Reschedules ev if it's active.
+  void ScheduleAt(base::TimerEventInterface* ev, time_point tp);
+  void Schedule(base::TimerEventInterface* ev, duration_t d) {
+    ScheduleAt(ev, clock_t::now() + d);
+  }
+
+  // Suspends the calling fiber until tp. The fiber must run in the IO thread of the service.
+  void SleepUntil(time_point tp);
+  void SleepFor(duration_t d) { SleepUntil(clock_t::now() + d); }
+
+  // Fiber-blocks until pred() is true or tp passes. Returns pred(). The notifiers of pred
+  // must notify ec.
+  template <typename Pred> bool AwaitUntil(fibers_ext::EventCount* ec, Pred&& pred, time_point tp);
+
+  template <typename Pred> bool AwaitFor(fibers_ext::EventCount* ec, Pred&& pred, duration_t d) {
+    return AwaitUntil(ec, std::forward<Pred>(pred), clock_t::now() + d);
+  }
+
+ private:
+  base::Tick TickOf(time_point tp) const;  // rounds up.
+  void MaybeArm(base::Tick at);
+  void OnTimer();
+
+  ::boost::asio::steady_timer timer_;
+  base::TimerWheel wheel_;
+  time_point start_;
+  base::Tick armed_at_ = base::Tick(-1);  // the tick timer_ expires at.
+  std::thread::id thread_id_;
+};
+
+template <typename Pred>
+bool TimerService::AwaitUntil(fibers_ext::EventCount* ec, Pred&& pred, time_point tp) {
+  bool timed_out = false;
+  auto cb = [&] {
+    timed_out = true;
+    ec->notifyAll();
+  };
+  base::TimerEvent<decltype(cb)> ev(std::move(cb));
+  ScheduleAt(&ev, tp);
+
+  ec->await([&] { return timed_out || pred(); });
+  return !timed_out || pred();
+}
+
+// Drop-in replacements of boost::this_fiber::sleep_until/sleep_for for the fibers that sleep
+// for milliseconds or longer, like the retry and polling loops. In IO threads the fiber sleeps on
+// the TimerService of the thread. The sleeps shorter than a tick and the sleeps outside IO
+// threads go to the sleep queue of boost.fiber, which is exact but costs O(log n) per sleep.
+void FiberSleepUntil(TimerService::time_point tp);
+
+inline void FiberSleepFor(TimerService::duration_t d) {
+  FiberSleepUntil(TimerService::clock_t::now() + d);
+}
+
+}  // namespace util
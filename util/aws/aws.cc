@@ -0,0 +1,212 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/aws/aws.h"
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "base/logging.h"
+#include "file/file_util.h"
+#include "util/gce/gce.h"
+
+namespace util {
+
+using namespace std;
+using namespace boost;
+namespace h2 = beast::http;
+
+namespace {
+
+constexpr char kUnsignedPayload[] = "UNSIGNED-PAYLOAD";
+
+inline absl::string_view absl_sv(beast::string_view s) {
+  return absl::string_view{s.data(), s.size()};
+}
+
+const char* GetEnv(const char* name) {
+  const char* res = getenv(name);
+  return res && *res ? res : nullptr;
+}
+
+string Hmac(absl::string_view key, absl::string_view data) {
+  uint8_t buf[EVP_MAX_MD_SIZE];
+  unsigned len = 0;
+  HMAC(EVP_sha256(), key.data(), key.size(), reinterpret_cast<const uint8_t*>(data.data()),
+       data.size(), buf, &len);
+  return string(reinterpret_cast<const char*>(buf), len);
+}
+
+string HexSha256(absl::string_view data) {
+  uint8_t buf[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(), buf);
+  return absl::BytesToHexString(
+      absl::string_view(reinterpret_cast<const char*>(buf), sizeof(buf)));
+}
+
+}  // namespace
+
+Status AWS::Init() {
+  auto ctx_res = SslClientContext();
+  if (!ctx_res.ok())
+    return ctx_res.status;
+  ssl_ctx_ = std::move(ctx_res.obj);
+
+  const char* access_key = GetEnv("AWS_ACCESS_KEY_ID");
+  const char* secret_key = GetEnv("AWS_SECRET_ACCESS_KEY");
+  if (access_key && secret_key) {
+    access_key_ = access_key;
+    secret_key_ = secret_key;
+    const char* token = GetEnv("AWS_SESSION_TOKEN");
+    session_token_ = token ? token : "";
+  } else {
+    RETURN_IF_ERROR(ReadCredentialsFile());
+  }
+
+  const char* region = GetEnv("AWS_REGION");
+  if (!region)
+    region = GetEnv("AWS_DEFAULT_REGION");
+  region_ = region ? region : "us-east-1";
+
+  const char* endpoint = GetEnv("AWS_S3_ENDPOINT");
+  s3_endpoint_ = endpoint ? string(endpoint) : absl::StrCat("s3.", region_, ".amazonaws.com");
+
+  VLOG(1) << "AWS region " << region_ << ", s3 endpoint " << s3_endpoint_;
+
+  return Status::OK;
+}
+
+Status AWS::ReadCredentialsFile() {
+  string path = file_util::ExpandPath("~/.aws/credentials");
+  string contents;
+  if (!file_util::ReadFileToString(path, &contents)) {
+    return Status("Could not find AWS credentials");
+  }
+
+  bool in_default = false;
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    line = absl::StripAsciiWhitespace(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+    if (line[0] == '[') {
+      in_default = (line == "[default]");
+      continue;
+    }
+    if (!in_default)
+      continue;
+
+    vector<absl::string_view> vals = absl::StrSplit(line, absl::MaxSplits('=', 1));
+    if (vals.size() != 2)
+      continue;
+    absl::string_view key = absl::StripAsciiWhitespace(vals[0]);
+    string val(absl::StripAsciiWhitespace(vals[1]));
+
+    if (key == "aws_access_key_id") {
+      access_key_ = std::move(val);
+    } else if (key == "aws_secret_access_key") {
+      secret_key_ = std::move(val);
+    } else if (key == "aws_session_token") {
+      session_token_ = std::move(val);
+    }
+  }
+
+  if (access_key_.empty() || secret_key_.empty()) {
+    return Status("Could not find the keys of the default profile in " + path);
+  }
+  return Status::OK;
+}
+
+void AWS::Sign(absl::string_view service, RequestHeader* req) const {
+  time_t now = time(nullptr);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  char amz_date[32];
+  strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+  absl::string_view date(amz_date, 8);
+
+  req->set("x-amz-content-sha256", kUnsignedPayload);
+  req->set("x-amz-date", amz_date);
+  if (!session_token_.empty()) {
+    req->set("x-amz-security-token", session_token_);
+  }
+
+  absl::string_view target = absl_sv(req->target());
+  absl::string_view path = target, query;
+  size_t pos = target.find('?');
+  if (pos != absl::string_view::npos) {
+    path = target.substr(0, pos);
+    query = target.substr(pos + 1);
+  }
+
+  // Canonical query string is sorted by the parameter names and then by their values.
+  vector<pair<absl::string_view, absl::string_view>> params;
+  for (absl::string_view param : absl::StrSplit(query, '&', absl::SkipEmpty())) {
+    pos = param.find('=');
+    if (pos == absl::string_view::npos) {
+      params.emplace_back(param, absl::string_view{});
+    } else {
+      params.emplace_back(param.substr(0, pos), param.substr(pos + 1));
+    }
+  }
+  std::sort(params.begin(), params.end());
+
+  string canonical = absl::StrCat(absl_sv(req->method_string()), "\n", path, "\n");
+  for (size_t i = 0; i < params.size(); ++i) {
+    absl::StrAppend(&canonical, i ? "&" : "", params[i].first, "=", params[i].second);
+  }
+  canonical.push_back('\n');
+
+  // Signed headers must be sorted.
+  vector<absl::string_view> headers{"host", "x-amz-content-sha256", "x-amz-date"};
+  if (!session_token_.empty()) {
+    headers.push_back("x-amz-security-token");
+  }
+  for (absl::string_view hdr : headers) {
+    beast::string_view name{hdr.data(), hdr.size()};
+    absl::StrAppend(&canonical, hdr, ":", absl::StripAsciiWhitespace(absl_sv((*req)[name])), "\n");
+  }
+  string signed_headers = absl::StrJoin(headers, ";");
+  absl::StrAppend(&canonical, "\n", signed_headers, "\n", kUnsignedPayload);
+
+  string scope = absl::StrCat(date, "/", region_, "/", service, "/aws4_request");
+  string to_sign =
+      absl::StrCat("AWS4-HMAC-SHA256\n", amz_date, "\n", scope, "\n", HexSha256(canonical));
+
+  string key = Hmac(absl::StrCat("AWS4", secret_key_), date);
+  key = Hmac(key, region_);
+  key = Hmac(key, service);
+  key = Hmac(key, "aws4_request");
+  string signature = absl::BytesToHexString(Hmac(key, to_sign));
+
+  req->set(h2::field::authorization,
+           absl::StrCat("AWS4-HMAC-SHA256 Credential=", access_key_, "/", scope,
+                        ", SignedHeaders=", signed_headers, ", Signature=", signature));
+}
+
+void AwsUriEncode(absl::string_view src, bool encode_slash, string* dest) {
+  static constexpr char kHex[] = "0123456789ABCDEF";
+
+  for (char c : src) {
+    if (absl::ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+        (c == '/' && !encode_slash)) {
+      dest->push_back(c);
+    } else {
+      uint8_t u = c;
+      dest->push_back('%');
+      dest->push_back(kHex[u >> 4]);
+      dest->push_back(kHex[u & 0xF]);
+    }
+  }
+}
+
+}  // namespace util
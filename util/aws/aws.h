@@ -0,0 +1,52 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/http/message.hpp>
+#include <memory>
+
+#include "absl/strings/string_view.h"
+#include "util/status.h"
+
+namespace util {
+
+// Credentials of AWS account and the signing of its requests.
+class AWS {
+ public:
+  using SslContext = ::boost::asio::ssl::context;
+  using RequestHeader = ::boost::beast::http::request_header<>;
+
+  AWS() = default;
+
+  // Reads the credentials from AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN
+  // environment variables or from the default profile of ~/.aws/credentials.
+  // The region is taken from AWS_REGION (us-east-1 by default) and S3 endpoint can be
+  // overridden with AWS_S3_ENDPOINT.
+  Status Init();
+
+  const std::string& region() const { return region_; }
+  const std::string& s3_endpoint() const { return s3_endpoint_; }
+
+  SslContext& ssl_context() const { return *ssl_ctx_; }
+
+  // Signs the request with AWS Signature Version 4. The request target must be URI encoded
+  // with AwsUriEncode and host header must be set. The payload is not signed since
+  // the requests are sent over TLS.
+  void Sign(absl::string_view service, RequestHeader* req) const;
+
+ private:
+  Status ReadCredentialsFile();
+
+  std::string access_key_, secret_key_, session_token_;
+  std::string region_, s3_endpoint_;
+
+  std::shared_ptr<SslContext> ssl_ctx_;  // see SslClientContext.
+};
+
+// Appends src to dest, percent-encoding all the characters besides the unreserved ones and,
+// unless encode_slash is true, the slashes.
+void AwsUriEncode(absl::string_view src, bool encode_slash, std::string* dest);
+
+}  // namespace util
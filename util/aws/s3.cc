@@ -0,0 +1,605 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/aws/s3.h"
+
+#include <boost/beast/http/buffer_body.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/fiber/fiber.hpp>
+#include <deque>
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "base/logging.h"
+#include "util/asio/io_context.h"
+#include "util/gce/gcs.h"
+
+namespace util {
+
+using namespace std;
+using namespace boost;
+namespace h2 = beast::http;
+
+namespace {
+
+constexpr char kS3Url[] = "s3://";
+
+inline absl::string_view absl_sv(beast::string_view s) {
+  return absl::string_view{s.data(), s.size()};
+}
+
+inline Status ToStatus(const system::error_code& ec) {
+  return ec ? Status(StatusCode::IO_ERROR, absl::StrCat(ec.value(), ": ", ec.message()))
+            : Status::OK;
+}
+
+template <typename Body> inline Status HttpError(const h2::response<Body>& resp) {
+  return Status(StatusCode::IO_ERROR,
+                absl::StrCat("Http error: ", resp.result_int(), " ", absl_sv(resp.reason())));
+}
+
+// Finds the next <tag> element of xml at or after *pos, sets val to its contents and moves
+// *pos past it. S3 responses are flat enough for not parsing them properly.
+bool NextXmlElement(absl::string_view xml, absl::string_view tag, size_t* pos,
+                    absl::string_view* val) {
+  string open = absl::StrCat("<", tag, ">"), close = absl::StrCat("</", tag, ">");
+  size_t start = xml.find(open, *pos);
+  if (start == absl::string_view::npos)
+    return false;
+  start += open.size();
+
+  size_t end = xml.find(close, start);
+  if (end == absl::string_view::npos)
+    return false;
+
+  *val = xml.substr(start, end - start);
+  *pos = end + close.size();
+  return true;
+}
+
+string XmlUnescape(absl::string_view src) {
+  static const pair<absl::string_view, char> kEntities[] = {
+      {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}};
+
+  string res;
+  res.reserve(src.size());
+  while (!src.empty()) {
+    bool replaced = false;
+    if (src[0] == '&') {
+      for (const auto& e : kEntities) {
+        if (absl::ConsumePrefix(&src, e.first)) {
+          res.push_back(e.second);
+          replaced = true;
+          break;
+        }
+      }
+    }
+    if (!replaced) {
+      res.push_back(src[0]);
+      src.remove_prefix(1);
+    }
+  }
+  return res;
+}
+
+// Sequential file that keeps up to read_ahead ranges in flight. See GcsRangeFile.
+class S3ReadFile : public file::ReadonlyFile {
+ public:
+  S3ReadFile(absl::string_view bucket, absl::string_view key, size_t sz, S3Pool::Handle s3,
+             S3Pool* pool, const S3ReadOptions& opts);
+  ~S3ReadFile();
+
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range) final;
+
+  Status Close() final;
+
+  size_t Size() const final { return size_; }
+
+  int Handle() const final { return -1; }
+
+ private:
+  struct Range {
+    size_t offset = 0, len = 0, consumed = 0;
+    unique_ptr<uint8_t[]> buf;
+    Status status;
+    fibers::fiber fb;
+  };
+
+  void FillWindow();
+  void Fetch(unsigned index, Range* range);
+
+  S3Pool* pool_;
+  string bucket_, key_;
+  size_t size_;
+  S3ReadOptions opts_;
+
+  vector<S3Pool::Handle> conns_;  // lazily taken from the pool, one per window slot.
+  std::deque<Range> window_;      // deque keeps the ranges in place for their fibers.
+  size_t offs_ = 0, fetch_offs_ = 0;
+  unsigned next_conn_ = 0;
+  bool closed_ = false;
+};
+
+S3ReadFile::S3ReadFile(absl::string_view bucket, absl::string_view key, size_t sz,
+                       S3Pool::Handle s3, S3Pool* pool, const S3ReadOptions& opts)
+    : pool_(pool), bucket_(bucket), key_(key), size_(sz), opts_(opts) {
+  CHECK_GT(opts_.range_size, 0);
+
+  size_t num_ranges = (size_ + opts_.range_size - 1) / opts_.range_size;
+  conns_.resize(std::max<size_t>(1, std::min<size_t>(opts_.read_ahead, num_ranges)));
+  conns_[0] = std::move(s3);
+}
+
+StatusObject<size_t> S3ReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
+  if (offset != offs_) {
+    return Status(StatusCode::INVALID_ARGUMENT, "Only sequential access supported");
+  }
+
+  size_t read = 0;
+  while (read < range.size() && offs_ < size_) {
+    FillWindow();
+
+    Range& front = window_.front();
+    if (front.fb.joinable())
+      front.fb.join();
+    if (!front.status.ok())
+      return front.status;
+
+    size_t sz = std::min(front.len - front.consumed, range.size() - read);
+    memcpy(range.data() + read, front.buf.get() + front.consumed, sz);
+    front.consumed += sz;
+    read += sz;
+    offs_ += sz;
+
+    if (front.consumed == front.len) {
+      window_.pop_front();
+    }
+  }
+
+  return read;
+}
+
+void S3ReadFile::FillWindow() {
+  while (window_.size() < conns_.size() && fetch_offs_ < size_) {
+    window_.emplace_back();
+    Range& r = window_.back();
+    r.offset = fetch_offs_;
+    r.len = std::min(opts_.range_size, size_ - fetch_offs_);
+    r.buf.reset(new uint8_t[r.len]);
+    fetch_offs_ += r.len;
+
+    unsigned index = next_conn_++ % conns_.size();
+    r.fb = fibers::fiber([this, index, &r] { Fetch(index, &r); });
+  }
+}
+
+void S3ReadFile::Fetch(unsigned index, Range* range) {
+  S3Pool::Handle& s3 = conns_[index];
+  if (!s3) {
+    auto res = pool_->Get();
+    if (!res.ok()) {
+      range->status = res.status;
+      return;
+    }
+    s3 = std::move(res.obj);
+  }
+
+  auto res = s3->Read(bucket_, key_, range->offset,
+                      strings::MutableByteRange(range->buf.get(), range->len));
+  if (!res.ok()) {
+    range->status = res.status;
+  } else if (res.obj != range->len) {
+    range->status =
+        Status(StatusCode::IO_ERROR, absl::StrCat("Short read at ", range->offset, " of ", key_));
+  }
+}
+
+Status S3ReadFile::Close() {
+  for (auto& r : window_) {
+    if (r.fb.joinable())
+      r.fb.join();
+  }
+  window_.clear();
+  conns_.clear();
+  closed_ = true;
+
+  return Status::OK;
+}
+
+S3ReadFile::~S3ReadFile() {
+  if (!closed_) {
+    LOG(WARNING) << "Close was not called";
+    Close();
+  }
+}
+
+}  // namespace
+
+S3::S3(const AWS& aws, IoContext* context)
+    : aws_(aws), io_context_(*context),
+      https_client_(new HttpsClient(aws.s3_endpoint(), context, &aws.ssl_context())) {}
+
+S3::~S3() {}
+
+Status S3::Connect(unsigned msec) {
+  CHECK(io_context_.InContextThread());
+
+  return ToStatus(https_client_->Connect(msec));
+}
+
+bool S3::IsHealthy() const { return https_client_->IsHealthy(); }
+
+template <typename Req, typename Resp> Status S3::Send(Req* req, Resp* resp) {
+  req->set(h2::field::host, aws_.s3_endpoint());
+  req->keep_alive(true);
+  aws_.Sign("s3", req);
+
+  // Keeps the body for the retry, buffer bodies point to the memory of the caller.
+  auto body = resp->body();
+
+  for (unsigned i = 0; i < 2; ++i) {
+    VLOG(1) << "S3Req" << i << ": " << req->method_string() << " " << req->target();
+
+    system::error_code ec = https_client_->Send(*req, resp);
+    if (!ec) {
+      VLOG(1) << "S3Resp" << i << ": " << resp->result_int();
+      if (!resp->keep_alive())
+        https_client_->schedule_reconnect();
+      return Status::OK;
+    }
+
+    // HttpsClient reconnects during the next request.
+    VLOG(1) << "S3 error " << ec << "/" << ec.message();
+    if (i > 0)
+      return ToStatus(ec);
+
+    *resp = Resp{};
+    resp->body() = body;
+  }
+  return Status::OK;
+}
+
+string S3::ObjectUrl(absl::string_view bucket, absl::string_view key) const {
+  string url = absl::StrCat("/", bucket, "/");
+  AwsUriEncode(key, false, &url);
+  return url;
+}
+
+Status S3::List(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
+                ListObjectCb cb) {
+  CHECK(!bucket.empty());
+
+  string base_url = absl::StrCat("/", bucket, "?list-type=2&prefix=");
+  AwsUriEncode(prefix, true, &base_url);
+  if (fs_mode) {
+    absl::StrAppend(&base_url, "&delimiter=%2F");
+  }
+
+  string token;
+  while (true) {
+    string url = base_url;
+    if (!token.empty()) {
+      absl::StrAppend(&url, "&continuation-token=");
+      AwsUriEncode(token, true, &url);
+    }
+
+    h2::request<h2::empty_body> req(h2::verb::get, url, 11);
+    h2::response<h2::string_body> resp;
+    RETURN_IF_ERROR(Send(&req, &resp));
+    if (resp.result() != h2::status::ok) {
+      return HttpError(resp);
+    }
+
+    absl::string_view xml = resp.body();
+    absl::string_view contents;
+    size_t pos = 0;
+    while (NextXmlElement(xml, "Contents", &pos, &contents)) {
+      absl::string_view key, size_str;
+      size_t key_pos = 0, size_pos = 0, item_size = 0;
+      if (!NextXmlElement(contents, "Key", &key_pos, &key) ||
+          !NextXmlElement(contents, "Size", &size_pos, &size_str) ||
+          !absl::SimpleAtoi(size_str, &item_size)) {
+        return Status(StatusCode::PARSE_ERROR, "Could not parse list response");
+      }
+      cb(item_size, XmlUnescape(key));
+    }
+
+    absl::string_view next;
+    pos = 0;
+    if (!NextXmlElement(xml, "NextContinuationToken", &pos, &next))
+      break;
+    token = XmlUnescape(next);
+  }
+  return Status::OK;
+}
+
+StatusObject<size_t> S3::Size(absl::string_view bucket, absl::string_view key) {
+  // HEAD responses can not be read as messages, hence we read the first byte and take
+  // the size from the Content-Range header.
+  h2::request<h2::empty_body> req(h2::verb::get, ObjectUrl(bucket, key), 11);
+  req.set(h2::field::range, "bytes=0-0");
+
+  h2::response<h2::string_body> resp;
+  RETURN_IF_ERROR(Send(&req, &resp));
+
+  // Empty objects can not satisfy any range.
+  if (resp.result() == h2::status::range_not_satisfiable)
+    return 0;
+  if (resp.result() != h2::status::partial_content) {
+    return HttpError(resp);
+  }
+
+  absl::string_view range = absl_sv(resp[h2::field::content_range]);
+  size_t pos = range.rfind('/');
+  size_t res = 0;
+  if (pos == absl::string_view::npos || !absl::SimpleAtoi(range.substr(pos + 1), &res)) {
+    return Status(StatusCode::PARSE_ERROR, "Could not parse content range");
+  }
+  return res;
+}
+
+StatusObject<size_t> S3::Read(absl::string_view bucket, absl::string_view key, size_t ofs,
+                              const strings::MutableByteRange& range) {
+  CHECK(!range.empty());
+
+  h2::request<h2::empty_body> req(h2::verb::get, ObjectUrl(bucket, key), 11);
+  req.set(h2::field::range, absl::StrCat("bytes=", ofs, "-", ofs + range.size() - 1));
+
+  h2::response<h2::buffer_body> resp;
+  auto& body = resp.body();
+  body.data = range.data();
+  body.size = range.size();
+  body.more = false;
+
+  RETURN_IF_ERROR(Send(&req, &resp));
+  if (resp.result() != h2::status::partial_content && resp.result() != h2::status::ok) {
+    return HttpError(resp);
+  }
+
+  return range.size() - resp.body().size;
+}
+
+Status S3::Put(absl::string_view bucket, absl::string_view key, strings::ByteRange data) {
+  h2::request<h2::buffer_body> req(h2::verb::put, ObjectUrl(bucket, key), 11);
+  req.body().data = const_cast<uint8_t*>(data.data());
+  req.body().size = data.size();
+  req.body().more = false;
+  req.content_length(data.size());
+
+  h2::response<h2::string_body> resp;
+  RETURN_IF_ERROR(Send(&req, &resp));
+  if (resp.result() != h2::status::ok) {
+    return HttpError(resp);
+  }
+  return Status::OK;
+}
+
+StatusObject<string> S3::InitUpload(absl::string_view bucket, absl::string_view key) {
+  h2::request<h2::empty_body> req(h2::verb::post, ObjectUrl(bucket, key) + "?uploads", 11);
+  req.content_length(0);
+
+  h2::response<h2::string_body> resp;
+  RETURN_IF_ERROR(Send(&req, &resp));
+  if (resp.result() != h2::status::ok) {
+    return HttpError(resp);
+  }
+
+  absl::string_view upload_id;
+  size_t pos = 0;
+  if (!NextXmlElement(resp.body(), "UploadId", &pos, &upload_id)) {
+    return Status(StatusCode::PARSE_ERROR, "Can not find upload id");
+  }
+  return XmlUnescape(upload_id);
+}
+
+StatusObject<string> S3::UploadPart(absl::string_view bucket, absl::string_view key,
+                                    absl::string_view upload_id, unsigned part_num,
+                                    strings::ByteRange data) {
+  string url = absl::StrCat(ObjectUrl(bucket, key), "?partNumber=", part_num, "&uploadId=");
+  AwsUriEncode(upload_id, true, &url);
+
+  h2::request<h2::buffer_body> req(h2::verb::put, url, 11);
+  req.body().data = const_cast<uint8_t*>(data.data());
+  req.body().size = data.size();
+  req.body().more = false;
+  req.content_length(data.size());
+
+  h2::response<h2::string_body> resp;
+  RETURN_IF_ERROR(Send(&req, &resp));
+  if (resp.result() != h2::status::ok) {
+    return HttpError(resp);
+  }
+
+  auto it = resp.find(h2::field::etag);
+  if (it == resp.end()) {
+    return Status(StatusCode::PARSE_ERROR, "Can not find etag header");
+  }
+  return string(absl_sv(it->value()));
+}
+
+Status S3::CompleteUpload(absl::string_view bucket, absl::string_view key,
+                          absl::string_view upload_id, const vector<string>& etags) {
+  string url = absl::StrCat(ObjectUrl(bucket, key), "?uploadId=");
+  AwsUriEncode(upload_id, true, &url);
+
+  h2::request<h2::string_body> req(h2::verb::post, url, 11);
+  string& body = req.body();
+  body = "<CompleteMultipartUpload>";
+  for (size_t i = 0; i < etags.size(); ++i) {
+    absl::StrAppend(&body, "<Part><PartNumber>", i + 1, "</PartNumber><ETag>", etags[i],
+                    "</ETag></Part>");
+  }
+  body.append("</CompleteMultipartUpload>");
+  req.prepare_payload();
+
+  h2::response<h2::string_body> resp;
+  RETURN_IF_ERROR(Send(&req, &resp));
+
+  // The completion may fail after the response status was sent.
+  if (resp.result() != h2::status::ok || absl::StrContains(resp.body(), "<Error>")) {
+    VLOG(1) << "CompleteUpload failed: " << resp.body();
+    return HttpError(resp);
+  }
+  return Status::OK;
+}
+
+Status S3::AbortUpload(absl::string_view bucket, absl::string_view key,
+                       absl::string_view upload_id) {
+  string url = absl::StrCat(ObjectUrl(bucket, key), "?uploadId=");
+  AwsUriEncode(upload_id, true, &url);
+
+  h2::request<h2::empty_body> req(h2::verb::delete_, url, 11);
+  h2::response<h2::string_body> resp;
+  RETURN_IF_ERROR(Send(&req, &resp));
+  if (resp.result() != h2::status::no_content) {
+    return HttpError(resp);
+  }
+  return Status::OK;
+}
+
+bool S3::SplitToBucketPath(absl::string_view input, absl::string_view* bucket,
+                           absl::string_view* key) {
+  if (!absl::ConsumePrefix(&input, kS3Url))
+    return false;
+
+  auto pos = input.find('/');
+  *bucket = input.substr(0, pos);
+  *key = (pos == absl::string_view::npos) ? absl::string_view{} : input.substr(pos + 1);
+  return true;
+}
+
+string S3::ToS3Path(absl::string_view bucket, absl::string_view key) {
+  return absl::StrCat(kS3Url, bucket, "/", key);
+}
+
+bool IsS3Path(absl::string_view path) { return absl::StartsWith(path, kS3Url); }
+
+S3Pool::S3Pool(const AWS& aws, IoContextPool* io_pool, const Options& opts)
+    : ClientPool(
+          io_pool, [&aws](IoContext* cntx) { return new S3(aws, cntx); }, opts) {}
+
+StatusObject<file::ReadonlyFile*> OpenS3ReadFile(absl::string_view full_path, S3Pool* pool,
+                                                 const S3ReadOptions& opts) {
+  absl::string_view bucket, key;
+  CHECK(S3::SplitToBucketPath(full_path, &bucket, &key));
+
+  GET_UNLESS_ERROR(s3, pool->Get());
+  GET_UNLESS_ERROR(obj_size, s3->Size(bucket, key));
+
+  VLOG(1) << "Opened " << full_path << " of size " << obj_size;
+
+  return new S3ReadFile{bucket, key, obj_size, std::move(s3), pool, opts};
+}
+
+struct S3MultipartWriter::Part {
+  string data;
+  string etag;
+  Status status;
+  fibers::fiber fb;
+};
+
+S3MultipartWriter::S3MultipartWriter(S3Pool* pool, absl::string_view bucket,
+                                     absl::string_view key, const Options& opts)
+    : pool_(pool), bucket_(bucket), key_(key), opts_(opts) {
+  CHECK_GE(opts_.part_size, 5U << 20) << "S3 parts must be at least 5MB";
+  CHECK_GT(opts_.max_parallel, 0);
+}
+
+S3MultipartWriter::~S3MultipartWriter() {
+  if (!closed_) {
+    LOG(WARNING) << "Close was not called";
+    Close(true);
+  }
+}
+
+Status S3MultipartWriter::Write(strings::ByteRange src) {
+  while (!src.empty()) {
+    RETURN_IF_ERROR(status_);
+
+    size_t sz = std::min(src.size(), opts_.part_size - buf_.size());
+    buf_.append(reinterpret_cast<const char*>(src.data()), sz);
+    src.remove_prefix(sz);
+
+    if (buf_.size() == opts_.part_size) {
+      RETURN_IF_ERROR(WaitParts(opts_.max_parallel - 1));
+      StartPart();
+    }
+  }
+  return Status::OK;
+}
+
+void S3MultipartWriter::StartPart() {
+  if (upload_id_.empty()) {
+    auto s3 = pool_->Get();
+    auto res = s3.ok() ? s3.obj->InitUpload(bucket_, key_) : StatusObject<string>(s3.status);
+    if (!res.ok()) {
+      status_ = res.status;
+      return;
+    }
+    upload_id_ = std::move(res.obj);
+  }
+
+  unique_ptr<Part> part(new Part);
+  part->data.swap(buf_);
+  unsigned part_num = parts_.size() + 1;
+
+  Part* ptr = part.get();
+  ptr->fb = fibers::fiber([this, ptr, part_num] {
+    auto s3 = pool_->Get();
+    auto res = s3.ok() ? s3.obj->UploadPart(bucket_, key_, upload_id_, part_num,
+                                            strings::ToByteRange(ptr->data))
+                       : StatusObject<string>(s3.status);
+    ptr->status = res.status;
+    ptr->etag = std::move(res.obj);
+    string().swap(ptr->data);
+  });
+  parts_.push_back(std::move(part));
+}
+
+Status S3MultipartWriter::WaitParts(size_t max_inflight) {
+  while (parts_.size() - num_done_ > max_inflight) {
+    Part* part = parts_[num_done_++].get();
+    part->fb.join();
+    if (!part->status.ok() && status_.ok()) {
+      status_ = part->status;
+    }
+  }
+  return status_;
+}
+
+Status S3MultipartWriter::Close(bool abort_write) {
+  CHECK(!closed_);
+  closed_ = true;
+
+  if (upload_id_.empty()) {
+    if (abort_write || !status_.ok())
+      return abort_write ? Status::OK : status_;
+    GET_UNLESS_ERROR(s3, pool_->Get());
+    return s3->Put(bucket_, key_, strings::ToByteRange(buf_));
+  }
+
+  if (!abort_write && status_.ok() && !buf_.empty()) {
+    StartPart();
+  }
+  Status st = WaitParts(0);
+
+  vector<string> etags;
+  for (const auto& part : parts_) {
+    etags.push_back(part->etag);
+  }
+  parts_.clear();
+
+  GET_UNLESS_ERROR(s3, pool_->Get());
+  if (!abort_write && st.ok()) {
+    return s3->CompleteUpload(bucket_, key_, upload_id_, etags);
+  }
+
+  Status abort_st = s3->AbortUpload(bucket_, key_, upload_id_);
+  LOG_IF(WARNING, !abort_st.ok()) << "Could not abort upload of " << key_ << ": " << abort_st;
+  return abort_write ? Status::OK : st;
+}
+
+}  // namespace util
@@ -0,0 +1,147 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "file/file.h"
+#include "strings/stringpiece.h"
+#include "util/asio/client_pool.h"
+#include "util/aws/aws.h"
+#include "util/status.h"
+
+namespace util {
+
+class HttpsClient;
+class IoContext;
+
+// S3 client over the fiber https stack of util/gce. Objects are addressed in the path style
+// on the endpoint of AWS, i.e. all the buckets are reached over the same connections.
+// Single threaded, fiber blocking class. Should be created 1 instance per http connection.
+// All IO functions must run from IoContext thread passed to c'tor.
+class S3 {
+ public:
+  // Called with (size, key_name) pairs.
+  using ListObjectCb = std::function<void(size_t, absl::string_view)>;
+
+  S3(const AWS& aws, IoContext* context);
+  ~S3();
+
+  Status Connect(unsigned msec);
+
+  // Returns true if the connection can be reused without reconnecting.
+  bool IsHealthy() const;
+
+  // fs_mode = true - will return files only without "/" delimiter after the prefix.
+  // fs_mode = false - will return all files recursively containing the prefix.
+  Status List(absl::string_view bucket, absl::string_view prefix, bool fs_mode, ListObjectCb cb);
+
+  // Returns the size of the object.
+  StatusObject<size_t> Size(absl::string_view bucket, absl::string_view key);
+
+  // Reads range.size() bytes at offset ofs and returns the number of bytes read.
+  StatusObject<size_t> Read(absl::string_view bucket, absl::string_view key, size_t ofs,
+                            const strings::MutableByteRange& range);
+
+  Status Put(absl::string_view bucket, absl::string_view key, strings::ByteRange data);
+
+  // Multipart upload interface. Parts are numbered from 1, all of them but the last must be
+  // at least 5MB long.
+  StatusObject<std::string> InitUpload(absl::string_view bucket, absl::string_view key);
+
+  // Returns the ETag of the part.
+  StatusObject<std::string> UploadPart(absl::string_view bucket, absl::string_view key,
+                                       absl::string_view upload_id, unsigned part_num,
+                                       strings::ByteRange data);
+
+  Status CompleteUpload(absl::string_view bucket, absl::string_view key,
+                        absl::string_view upload_id, const std::vector<std::string>& etags);
+  Status AbortUpload(absl::string_view bucket, absl::string_view key,
+                     absl::string_view upload_id);
+
+  // Input: full s3 uri path that starts with "s3://"
+  // returns bucket and object paths accordingly.
+  static bool SplitToBucketPath(absl::string_view input, absl::string_view* bucket,
+                                absl::string_view* key);
+
+  // Inverse function. Returns full s3 URI that starts with "s3://".
+  static std::string ToS3Path(absl::string_view bucket, absl::string_view key);
+
+ private:
+  std::string ObjectUrl(absl::string_view bucket, absl::string_view key) const;
+
+  // Signs and sends the request. Resends it once over a new connection if the connection
+  // failed, since the servers close idle keep-alive connections.
+  template <typename Req, typename Resp> Status Send(Req* req, Resp* resp);
+
+  const AWS& aws_;
+  IoContext& io_context_;
+  std::unique_ptr<HttpsClient> https_client_;
+};
+
+bool IsS3Path(absl::string_view path);
+
+// Pool of connected S3 handles, see ClientPool.
+class S3Pool : public ClientPool<S3> {
+ public:
+  S3Pool(const AWS& aws, IoContextPool* io_pool, const Options& opts);
+};
+
+struct S3ReadOptions {
+  size_t range_size = 1 << 23;  // Size of every ranged request.
+  unsigned read_ahead = 4;      // Number of ranges that are fetched concurrently.
+};
+
+// Opens a sequential file that reads the object with up to opts.read_ahead ranged requests
+// in flight, each over its own connection that is taken from pool and is kept alive between
+// the ranges. Must be opened and read from the same IoContext thread.
+StatusObject<file::ReadonlyFile*> OpenS3ReadFile(absl::string_view full_path, S3Pool* pool,
+                                                 const S3ReadOptions& opts);
+
+// Uploads an object in parts of part_size bytes that are sent concurrently with multipart
+// upload over the handles of pool, each over its own connection. Objects smaller than
+// part_size are uploaded with a single request.
+// Must be created and used from a single IoContext thread of the pool.
+class S3MultipartWriter {
+ public:
+  struct Options {
+    size_t part_size = 1 << 26;  // at least 5MB.
+    unsigned max_parallel = 4;  // Number of parts that are uploaded concurrently.
+  };
+
+  S3MultipartWriter(S3Pool* pool, absl::string_view bucket, absl::string_view key,
+                    const Options& opts);
+  ~S3MultipartWriter();
+
+  Status Write(strings::ByteRange src);
+
+  // Uploads the rest of the data and completes the upload. If abort_write is true, aborts
+  // the upload instead.
+  Status Close(bool abort_write);
+
+ private:
+  struct Part;
+
+  // Starts uploading buf_ as the next part.
+  void StartPart();
+
+  // Waits until at most max_inflight parts are being uploaded.
+  Status WaitParts(size_t max_inflight);
+
+  S3Pool* pool_;
+  std::string bucket_, key_;
+  Options opts_;
+
+  std::string upload_id_;
+  std::string buf_;
+  std::vector<std::unique_ptr<Part>> parts_;
+  size_t num_done_ = 0;  // parts_ whose uploads were awaited.
+  Status status_;        // the first upload error.
+  bool closed_ = false;
+};
+
+}  // namespace util
@@ -3,6 +3,9 @@
 //
 #include <bzlib.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "base/logging.h"
 #include "util/bzip_source.h"
 #include "strings/strcat.h"
@@ -10,22 +13,291 @@
 namespace util {
 using strings::ByteRange;
 
+namespace {
+
+// The magics that start every compressed block and end the stream, see the bzip2 format.
+// They are not byte aligned.
+constexpr uint64_t kBlockMagic = 0x314159265359ULL;
+constexpr uint64_t kEndMagic = 0x177245385090ULL;
+constexpr uint64_t kMagicMask = (1ULL << 48) - 1;
+
+constexpr size_t kReadSize = 1 << 20;
+
+// Appends bits to dest, the most significant first.
+class BitWriter {
+ public:
+  explicit BitWriter(std::string* dest) : dest_(dest) {}
+
+  // nbits <= 32.
+  void Put(uint32_t val, unsigned nbits) {
+    acc_ = (acc_ << nbits) | (val & ((1ULL << nbits) - 1));
+    count_ += nbits;
+    while (count_ >= 8) {
+      count_ -= 8;
+      dest_->push_back(char(acc_ >> count_));
+    }
+  }
+
+  void Flush() {
+    if (count_)
+      dest_->push_back(char(acc_ << (8 - count_)));
+    count_ = 0;
+  }
+
+ private:
+  std::string* dest_;
+  uint64_t acc_ = 0;
+  unsigned count_ = 0;
+};
+
+// Returns the 8 bits of buf that start at bit pos.
+inline unsigned BitsAt(const std::string& buf, uint64_t pos) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf.data()) + (pos >> 3);
+  unsigned shift = pos & 7;
+  unsigned val = unsigned(p[0]) << shift;
+  if (shift && (pos >> 3) + 1 < buf.size())
+    val |= p[1] >> (8 - shift);
+  return val & 0xFF;
+}
+
+// Decodes the block at bits [begin, end) of in, which starts with the block magic, by wrapping
+// it into a stream of its own. The combined crc of a single block stream is the block crc.
+bool DecodeBlock(const std::string& in, uint64_t begin, uint64_t end, std::string* dest) {
+  if (end - begin < 80)  // the magic and the crc.
+    return false;
+
+  std::string stream("BZh9");  // level 9 fits the blocks of every level.
+  stream.reserve(4 + (end - begin) / 8 + 12);
+  BitWriter bw(&stream);
+  uint64_t pos = begin;
+  for (; pos + 8 <= end; pos += 8)
+    bw.Put(BitsAt(in, pos), 8);
+  if (pos < end)
+    bw.Put(BitsAt(in, pos) >> (8 - (end - pos)), end - pos);
+
+  uint32_t crc = 0;
+  for (unsigned i = 0; i < 4; ++i)
+    crc = (crc << 8) | BitsAt(in, begin + 48 + i * 8);
+  bw.Put(kEndMagic >> 24, 24);
+  bw.Put(kEndMagic & 0xFFFFFF, 24);
+  bw.Put(crc, 32);
+  bw.Flush();
+
+  bz_stream bz;
+  memset(&bz, 0, sizeof(bz));
+  if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+    return false;
+  bz.next_in = &stream[0];
+  bz.avail_in = stream.size();
+
+  // The output of a block is usually about the block size but repeated bytes may expand a lot.
+  if (dest->size() < (1 << 20))
+    dest->resize(1 << 20);
+  size_t produced = 0;
+  int res;
+  while (true) {
+    bz.next_out = &(*dest)[produced];
+    bz.avail_out = dest->size() - produced;
+    res = BZ2_bzDecompress(&bz);
+    produced = dest->size() - bz.avail_out;
+    if (res != BZ_OK)
+      break;
+    if (bz.avail_out == 0)
+      dest->resize(dest->size() * 2);
+    else if (bz.avail_in == 0)  // truncated block.
+      break;
+  }
+  BZ2_bzDecompressEnd(&bz);
+  dest->resize(produced);
+
+  return res == BZ_STREAM_END;
+}
+
+}  // namespace
+
 struct BzipSource::Rep {
   bz_stream stream;
 
   Rep() { memset(&stream, 0, sizeof(stream)); }
 };
 
+struct BzipSource::Parallel {
+  // Bit offset of a magic in the input.
+  struct Marker {
+    uint64_t bit;
+    bool block;  // false for the end of a stream.
+  };
+
+  struct Block {
+    uint64_t begin, end;
+    std::string data;
+    bool ok;
+  };
+
+  unsigned num_blocks;
+  BlockExecutor executor;
+
+  std::string in;    // compressed input that was not decoded yet.
+  size_t scanned = 0;  // bytes of in that were scanned for the magics.
+  uint64_t window = 0;  // the last 64 scanned bits.
+  unsigned window_bits = 0;
+  bool eof = false;
+  std::vector<Marker> markers;
+
+  std::vector<Block> blocks;
+  unsigned num_ready = 0, cur_block = 0;
+  size_t cur_pos = 0;
+
+  Parallel(unsigned n, BlockExecutor e) : num_blocks(std::max(1U, n)), executor(std::move(e)) {}
+
+  void Scan();
+
+  // Drops the input before the first pending marker.
+  void Trim();
+
+  // Number of the blocks whose both ends were found.
+  unsigned CompleteBlocks() const;
+};
+
+void BzipSource::Parallel::Scan() {
+  for (; scanned < in.size(); ++scanned) {
+    window = (window << 8) | uint8_t(in[scanned]);
+    window_bits = std::min(window_bits + 8, 64U);
+
+    // Shift 7 is the earliest position, so the markers stay sorted.
+    for (int shift = 7; shift >= 0; --shift) {
+      if (window_bits < 48U + shift)
+        continue;
+      uint64_t val = (window >> shift) & kMagicMask;
+      if (val == kBlockMagic || val == kEndMagic) {
+        markers.push_back(Marker{(scanned + 1) * 8 - shift - 48, val == kBlockMagic});
+      }
+    }
+  }
+}
+
+void BzipSource::Parallel::Trim() {
+  size_t cut = markers.empty() ? (scanned > 8 ? scanned - 8 : 0) : markers.front().bit / 8;
+  if (cut == 0)
+    return;
+  in.erase(0, cut);
+  scanned -= cut;
+  for (Marker& m : markers)
+    m.bit -= cut * 8;
+}
+
+unsigned BzipSource::Parallel::CompleteBlocks() const {
+  unsigned res = 0;
+  for (size_t i = 0; i + 1 < markers.size(); ++i)
+    res += markers[i].block;
+  return res;
+}
+
 BzipSource::BzipSource(Source* sub_source)
     : sub_stream_(sub_source), rep_(new Rep) {
   CHECK_EQ(BZ_OK, BZ2_bzDecompressInit(&rep_->stream, 0, 1));
 }
 
+BzipSource::BzipSource(Source* sub_source, unsigned num_blocks, BlockExecutor executor)
+    : sub_stream_(sub_source), par_(new Parallel(num_blocks, std::move(executor))) {}
+
 BzipSource::~BzipSource() {
-  BZ2_bzDecompressEnd(&rep_->stream);
+  if (rep_)
+    BZ2_bzDecompressEnd(&rep_->stream);
+}
+
+Status BzipSource::ReadBatch() {
+  Parallel& p = *par_;
+  p.num_ready = p.cur_block = 0;
+  p.cur_pos = 0;
+  p.Trim();
+
+  while (!p.eof && p.CompleteBlocks() < p.num_blocks) {
+    size_t size = p.in.size();
+    p.in.resize(size + kReadSize);
+    auto res = sub_stream_->Read(
+        strings::MutableByteRange(reinterpret_cast<uint8_t*>(&p.in[size]), kReadSize));
+    if (!res.ok())
+      return res.status;
+    p.in.resize(size + res.obj);
+    p.eof = res.obj == 0;
+    p.Scan();
+  }
+
+  size_t m = 0;
+  for (; m + 1 < p.markers.size() && p.num_ready < p.num_blocks; ++m) {
+    if (!p.markers[m].block)
+      continue;
+    if (p.blocks.size() == p.num_ready)
+      p.blocks.emplace_back();
+    Parallel::Block& b = p.blocks[p.num_ready++];
+    b.begin = p.markers[m].bit;
+    b.end = p.markers[m + 1].bit;
+  }
+
+  // Keeps the end of the last block, it may start the next one.
+  p.markers.erase(p.markers.begin(), p.markers.begin() + m);
+
+  if (p.num_ready == 0) {
+    if (!p.markers.empty() && p.markers.front().block)
+      return Status(StatusCode::IO_ERROR, "Truncated bzip2 stream");
+    return Status::OK;
+  }
+
+  auto decode = [&p](unsigned i) {
+    Parallel::Block& b = p.blocks[i];
+    b.ok = DecodeBlock(p.in, b.begin, b.end, &b.data);
+  };
+
+  if (p.executor && p.num_ready > 1) {
+    p.executor(p.num_ready, decode);
+  } else {
+    for (unsigned i = 0; i < p.num_ready; ++i)
+      decode(i);
+  }
+
+  for (unsigned i = 0; i < p.num_ready; ++i) {
+    Parallel::Block& b = p.blocks[i];
+
+    // The magic may appear inside the compressed data by chance. Then the block is split by it
+    // and is decoded again together with the following parts.
+    for (unsigned j = i + 1; !b.ok && j < p.num_ready && p.blocks[j].begin == b.end; ++j) {
+      b.end = p.blocks[j].end;
+      b.ok = DecodeBlock(p.in, b.begin, b.end, &b.data);
+      p.blocks[j].data.clear();
+      p.blocks[j].ok = true;
+    }
+    if (!b.ok)
+      return Status(StatusCode::IO_ERROR, "Corrupted bzip2 block");
+  }
+  return Status::OK;
 }
 
 StatusObject<size_t> BzipSource::ReadInternal(const strings::MutableByteRange& range) {
+  if (par_) {
+    Parallel& p = *par_;
+    size_t copied = 0;
+    while (copied < range.size()) {
+      if (p.cur_block == p.num_ready) {
+        RETURN_IF_ERROR(ReadBatch());
+        if (p.num_ready == 0)  // EOF
+          break;
+        continue;
+      }
+
+      const std::string& data = p.blocks[p.cur_block].data;
+      size_t sz = std::min(range.size() - copied, data.size() - p.cur_pos);
+      memcpy(range.begin() + copied, data.data() + p.cur_pos, sz);
+      copied += sz;
+      p.cur_pos += sz;
+      if (p.cur_pos == data.size()) {
+        ++p.cur_block;
+        p.cur_pos = 0;
+      }
+    }
+    return copied;
+  }
+
   std::array<unsigned char, 1024> buf;
   char* const begin = reinterpret_cast<char*>(range.begin());
 
@@ -4,6 +4,7 @@
 #ifndef BZIP_SOURCE_H
 #define BZIP_SOURCE_H
 
+#include <functional>
 #include <memory>
 #include "util/sinksource.h"
 
@@ -11,18 +12,32 @@ namespace util {
 
 class BzipSource : public Source {
 public:
+  // Runs fn(i) for every i in [0, count) and returns once all the calls finished.
+  typedef std::function<void(unsigned count, std::function<void(unsigned)> fn)> BlockExecutor;
+
   // Takes ownership over sub_source
   BzipSource(Source* sub_source);
+
+  // Decompresses up to num_blocks bzip2 blocks at once, concurrently if executor is set.
+  // The blocks are found by their 48 bit magic, which is not byte aligned, and every block is
+  // decoded as a stream of its own, like lbzip2 does. Also handles the concatenated streams
+  // of pbzip2 and lbzip2.
+  BzipSource(Source* sub_source, unsigned num_blocks, BlockExecutor executor);
   ~BzipSource() override;
 
   static bool IsBzipSource(Source* source);
 private:
   StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) override;
 
+  // Scans the input for the magics and decodes the next batch of blocks.
+  Status ReadBatch();
+
   struct Rep;
+  struct Parallel;
 
   std::unique_ptr<Source> sub_stream_;
   std::unique_ptr<Rep> rep_;
+  std::unique_ptr<Parallel> par_;
 };
 
 }  // namespace util
@@ -7,6 +7,9 @@
 
 #include <zstd.h>
 
+#include <atomic>
+
+#include "base/event_count.h"
 #include "base/logging.h"
 
 namespace util {
@@ -28,17 +31,99 @@ ostream& operator<<(ostream& os, const ZSTD_parameters& p) {
 #define CHECK_ZSTDERR(res) do { auto foo = (res); \
     CHECK(!ZSTD_isError(foo)) << ZSTD_getErrorName(foo); } while(false)
 
+namespace {
+
+constexpr int kCompressionLevel = 6;
+
+// Contexts of the tasks of the parallel modes, the tasks do not yield so a thread runs one of
+// them at a time.
+struct ThreadContexts {
+  ZSTD_CCtx* cctx = nullptr;
+  ZSTD_DCtx* dctx = nullptr;
+
+  ~ThreadContexts() {
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+  }
+
+  ZSTD_CCtx* compressor() {
+    if (!cctx)
+      cctx = ZSTD_createCCtx();
+    return cctx;
+  }
+
+  ZSTD_DCtx* decompressor() {
+    if (!dctx)
+      dctx = ZSTD_createDCtx();
+    return dctx;
+  }
+};
+
+thread_local ThreadContexts thread_contexts;
+
+}  // namespace
+
+// A ring of blocks that are compressed by the executor. Only done and output_size are
+// accessed by the tasks, the rest belongs to the thread of BlockCompressor.
+struct BlockCompressor::Parallel {
+  struct Job {
+    std::unique_ptr<uint8_t[]> input;
+    size_t input_size = 0;
+    std::unique_ptr<uint8_t[]> output;
+    size_t output_size = 0;
+    std::atomic_bool done{true};
+  };
+
+  Executor executor;
+  std::unique_ptr<Job[]> jobs;
+  unsigned size;
+  unsigned head = 0;
+  unsigned in_flight = 0;
+
+  folly::EventCount ec;
+
+  Parallel(Executor e, unsigned sz) : executor(std::move(e)), jobs(new Job[sz]), size(sz) {
+    for (unsigned i = 0; i < sz; ++i) {
+      jobs[i].input.reset(new uint8_t[BLOCK_SIZE]);
+    }
+  }
+
+  Job& tail() { return jobs[(head + in_flight) % size]; }
+};
+
 BlockCompressor::BlockCompressor() {
   zstd_cntx_ = ZSTD_createCCtx();
 }
 
 BlockCompressor::~BlockCompressor() {
+  if (parallel_) {
+    Parallel* p = parallel_.get();
+    for (unsigned i = 0; i < p->size; ++i) {
+      const Parallel::Job& job = p->jobs[i];
+      p->ec.await([&job] { return job.done.load(std::memory_order_acquire); });
+    }
+  }
   ZSTD_freeCCtx(HANDLE);
 }
 
+void BlockCompressor::SetParallel(Executor executor, unsigned max_in_flight) {
+  CHECK_EQ(0, compress_block_size_) << "Must be called before adding data";
+  CHECK_GT(max_in_flight, 0);
+
+  parallel_ = std::make_shared<Parallel>(std::move(executor), max_in_flight);
+}
+
 void BlockCompressor::Start() {
   CHECK(compressed_bufs_.empty() && compressed_blocks_.empty());
 
+  pos_ = 0;
+  compress_block_size_ = ZSTD_compressBound(BLOCK_SIZE);
+
+  if (parallel_) {
+    cur_buf_ = parallel_->tail().input.get();
+    return;
+  }
+
   ZSTD_parameters params{ZSTD_getCParams(6, 0, 0), ZSTD_frameParameters()};
 
   // To have 128KB window size we need to set twice more:
@@ -54,8 +139,7 @@ void BlockCompressor::Start() {
   if (!double_buf_) {
     double_buf_.reset(new uint8_t[BLOCK_SIZE * 2 + 1]);
   }
-  pos_ = 0;
-  compress_block_size_ = ZSTD_compressBound(BLOCK_SIZE);
+  cur_buf_ = double_buf_.get() + (BLOCK_SIZE + 1) * cur_buf_index_;
 }
 
 void BlockCompressor::Add(strings::ByteRange br) {
@@ -98,6 +182,14 @@ void BlockCompressor::Finalize() {
 }
 
 void BlockCompressor::CompressInternal(bool finalize_frame) {
+  if (parallel_) {
+    if (pos_ > 0)
+      DispatchBlock();
+    if (finalize_frame)
+      CollectBlocks(true);
+    return;
+  }
+
   if (!finalize_frame && pos_ == 0)
     return;
 
@@ -114,9 +206,57 @@ void BlockCompressor::CompressInternal(bool finalize_frame) {
   VLOG(1) << "Compressed from " << pos_ << " to " << res;
 
   cur_buf_index_ ^= 1;
+  cur_buf_ = double_buf_.get() + (BLOCK_SIZE + 1) * cur_buf_index_;
   pos_ = 0;
 }
 
+void BlockCompressor::DispatchBlock() {
+  Parallel* p = parallel_.get();
+  Parallel::Job& job = p->tail();
+  DCHECK_EQ(job.input.get(), cur_buf_);
+
+  job.input_size = pos_;
+  job.output.reset(new uint8_t[compress_block_size_]);
+  job.done.store(false, std::memory_order_relaxed);
+  ++p->in_flight;
+
+  // The task holds the state, so that notifyAll() is safe even if the compressor is destroyed
+  // as soon as the job is done.
+  p->executor([state = parallel_, &job, capacity = compress_block_size_] {
+    size_t res = ZSTD_compressCCtx(thread_contexts.compressor(), job.output.get(), capacity,
+                                   job.input.get(), job.input_size, kCompressionLevel);
+    CHECK_ZSTDERR(res);
+    job.output_size = res;
+    job.done.store(true, std::memory_order_release);
+    state->ec.notifyAll();
+  });
+
+  pos_ = 0;
+  CollectBlocks(false);
+  cur_buf_ = p->tail().input.get();
+}
+
+void BlockCompressor::CollectBlocks(bool wait_all) {
+  Parallel* p = parallel_.get();
+
+  while (p->in_flight > 0) {
+    Parallel::Job& job = p->jobs[p->head];
+    if (wait_all || p->in_flight == p->size) {
+      p->ec.await([&job] { return job.done.load(std::memory_order_acquire); });
+    } else if (!job.done.load(std::memory_order_acquire)) {
+      break;
+    }
+
+    compressed_blocks_.emplace_back(job.output.get(), job.output_size);
+    compressed_bufs_.push_back(std::move(job.output));
+    compressed_size_ += job.output_size;
+    VLOG(1) << "Compressed from " << job.input_size << " to " << job.output_size;
+
+    p->head = (p->head + 1) % p->size;
+    --p->in_flight;
+  }
+}
+
 
 strings::MutableByteRange BlockCompressor::BlockBuffer() {
   if (compress_block_size_ == 0) {
@@ -209,6 +349,87 @@ strings::ByteRange BlockDecompressor::GetDecompressedBlock() const {
   return ByteRange(buf_.get() + BLOCK_SIZE * bindex, decompress_size_);
 }
 
+namespace {
+
+// Similarly to BlockCompressor::Parallel, only done and result are accessed by the tasks.
+struct DecompressState {
+  struct Slot {
+    std::unique_ptr<uint8_t[]> buf{new uint8_t[BlockDecompressor::BLOCK_SIZE]};
+    ByteRange frame;
+    size_t result = 0;
+    std::atomic_bool done{true};
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  folly::EventCount ec;
+
+  explicit DecompressState(unsigned sz) : slots(new Slot[sz]) {}
+
+  void Wait(const Slot& slot) {
+    ec.await([&slot] { return slot.done.load(std::memory_order_acquire); });
+  }
+};
+
+}  // namespace
+
+int64_t BlockDecompressor::DecompressParallel(ByteRange src,
+                                              const BlockCompressor::Executor& executor,
+                                              unsigned max_in_flight,
+                                              std::function<void(ByteRange)> cb) {
+  CHECK_GT(max_in_flight, 0);
+
+  auto state = std::make_shared<DecompressState>(max_in_flight);
+  size_t offset = 0;
+  int64_t consumed = 0;
+  unsigned head = 0, in_flight = 0;
+  bool input_end = false;
+
+  while (true) {
+    while (!input_end && in_flight < max_in_flight && offset < src.size()) {
+      size_t frame_size = ZSTD_findFrameCompressedSize(src.data() + offset, src.size() - offset);
+      if (ZSTD_isError(frame_size)) {
+        input_end = true;  // the frame is incomplete.
+        break;
+      }
+
+      DecompressState::Slot& slot = state->slots[(head + in_flight) % max_in_flight];
+      slot.frame = ByteRange(src.data() + offset, frame_size);
+      slot.done.store(false, std::memory_order_relaxed);
+      offset += frame_size;
+      ++in_flight;
+
+      executor([state, &slot] {
+        slot.result = ZSTD_decompressDCtx(thread_contexts.decompressor(), slot.buf.get(),
+                                          BLOCK_SIZE, slot.frame.data(), slot.frame.size());
+        slot.done.store(true, std::memory_order_release);
+        state->ec.notifyAll();
+      });
+    }
+
+    if (in_flight == 0)
+      break;
+
+    DecompressState::Slot& slot = state->slots[head];
+    state->Wait(slot);
+    head = (head + 1) % max_in_flight;
+    --in_flight;
+
+    if (ZSTD_isError(slot.result)) {
+      LOG(ERROR) << "Could not decompress frame: " << ZSTD_getErrorName(slot.result);
+      for (; in_flight > 0; --in_flight) {
+        state->Wait(state->slots[head]);
+        head = (head + 1) % max_in_flight;
+      }
+      return -1;
+    }
+
+    cb(ByteRange(slot.buf.get(), slot.result));
+    consumed += slot.frame.size();
+  }
+
+  return consumed;
+}
+
 }  // namespace util
 
 
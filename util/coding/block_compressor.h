@@ -3,6 +3,7 @@
 //
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <vector>
 #include "strings/range.h"
@@ -16,6 +17,10 @@
 
    The flow sequence is: Add*, Finalize. Can be applied multiple times for the same
    block compressor object.
+
+   In the parallel mode, see SetParallel(), every block is an independent zstd frame instead,
+   so that the blocks are compressed and decompressed concurrently at the cost of the back
+   references between them.
 */
 namespace util {
 
@@ -23,10 +28,22 @@ class BlockCompressor {
  public:
   enum { BLOCK_SIZE_LOG = 17, BLOCK_SIZE = 1 << BLOCK_SIZE_LOG };
 
+  // Runs the task asynchronously, e.g. on FiberQueueThreadPool:
+  // [&pool](std::function<void()> f) { pool.Add(std::move(f)); }
+  using Executor = std::function<void(std::function<void()>)>;
+
   BlockCompressor();
 
+  // Waits for the blocks that are compressed in the parallel mode.
   ~BlockCompressor();
 
+  // Switches to the parallel mode, must be called before any data is added. Full blocks and
+  // the blocks flushed by Compress() are compressed by tasks of executor, at most max_in_flight
+  // at a time. Add() and Commit() block the calling thread while it is reached.
+  // compressed_blocks() returns the blocks in order, once they and all the blocks before them
+  // were compressed. Finalize() waits for all of them.
+  void SetParallel(Executor executor, unsigned max_in_flight);
+
   void Add(uint8_t b) {
     if (compress_block_size_ == 0) {
       Start();
@@ -70,16 +87,20 @@ class BlockCompressor {
   void ClearCompressedData();
 
  private:
+  struct Parallel;
+
   void Start();
   void CompressInternal(bool finalize_frame);
 
-  const uint8_t* buf_start() const {
-    return double_buf_.get() + (BLOCK_SIZE + 1) * cur_buf_index_;
-  }
+  // Passes the current block to the executor and sets cur_buf_ to the next one.
+  void DispatchBlock();
 
-  uint8_t* buf_start() {
-    return double_buf_.get() + (BLOCK_SIZE + 1) * cur_buf_index_;
-  }
+  // Moves the compressed blocks at the front of the parallel queue into compressed_blocks_.
+  // Waits for one block at least if the queue is full, for all of them if wait_all is true.
+  void CollectBlocks(bool wait_all);
+
+  const uint8_t* buf_start() const { return cur_buf_; }
+  uint8_t* buf_start() { return cur_buf_; }
 
   void* zstd_cntx_ = nullptr;
   size_t compress_block_size_ = 0;
@@ -90,6 +111,9 @@ class BlockCompressor {
   size_t compressed_size_ = 0;
   std::unique_ptr<uint8_t[]> double_buf_;
   unsigned cur_buf_index_ = 0; // 0 or 1
+  uint8_t* cur_buf_ = nullptr;
+
+  std::shared_ptr<Parallel> parallel_;  // shared with the tasks that run on the executor.
 };
 
 class BlockDecompressor {
@@ -109,6 +133,16 @@ class BlockDecompressor {
   // Can be called after successfuly Decompress call.
   strings::ByteRange GetDecompressedBlock() const;
 
+  // Decompresses the independent frames of the parallel mode of BlockCompressor that start
+  // at src, using tasks of executor, at most max_in_flight at a time. Calls cb with every
+  // decompressed block in order on the calling thread.
+  // Stops at the first incomplete frame and returns the number of bytes consumed so far,
+  // so that the caller can continue once it has more data. Returns -1 if a frame does not
+  // decompress into BLOCK_SIZE bytes at most.
+  static int64_t DecompressParallel(strings::ByteRange src, const BlockCompressor::Executor& executor,
+                                    unsigned max_in_flight,
+                                    std::function<void(strings::ByteRange)> cb);
+
  private:
   void* zstd_dcntx_ = nullptr;
   unsigned frame_state_ = 2;  // bit 1 for init state; bit 0 - which block to write to.
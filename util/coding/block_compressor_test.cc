@@ -4,6 +4,8 @@
 
 #include "util/coding/block_compressor.h"
 
+#include <thread>
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "strings/stringpiece.h"
@@ -66,5 +68,81 @@ TEST_F(BlockCompressorTest, Unaligned) {
   EXPECT_EQ(0, bdc_.Decompress(bc_.compressed_blocks().front(), &consumed));
 }
 
+static string Decompress(const vector<ByteRange>& blocks, BlockDecompressor* bdc) {
+  string res;
+  uint32_t consumed;
+  for (const auto& range : blocks) {
+    int32_t status = bdc->Decompress(range, &consumed);
+    EXPECT_GE(status, 0);
+    EXPECT_EQ(range.size(), consumed);
+    ByteRange block = bdc->GetDecompressedBlock();
+    res.append(reinterpret_cast<const char*>(block.data()), block.size());
+  }
+  return res;
+}
+
+TEST_F(BlockCompressorTest, Parallel) {
+  string inp;
+  for (unsigned i = 0; i < 9; ++i) {
+    inp.append(base::RandStr(BlockCompressor::BLOCK_SIZE / 2));
+    inp.append(inp, inp.size() - BlockCompressor::BLOCK_SIZE / 2, BlockCompressor::BLOCK_SIZE / 2);
+  }
+  inp.append(base::RandStr(1000));
+
+  bc_.SetParallel([](std::function<void()> f) { std::thread(std::move(f)).detach(); }, 3);
+  ByteRange br = ToByteRange(inp);
+  for (size_t i = 0; i < br.size(); i += 10000) {
+    bc_.Add(br.subpiece(i, 10000));
+  }
+  bc_.Finalize();
+
+  const auto& blocks = bc_.compressed_blocks();
+  ASSERT_EQ(10, blocks.size());
+  EXPECT_LT(bc_.compressed_size(), inp.size());
+  EXPECT_EQ(inp, Decompress(blocks, &bdc_));
+
+  string flat;
+  for (const auto& range : blocks)
+    flat.append(reinterpret_cast<const char*>(range.data()), range.size());
+  ByteRange src = ToByteRange(flat);
+
+  auto inline_exec = [](std::function<void()> f) { f(); };
+  auto thread_exec = [](std::function<void()> f) { std::thread(std::move(f)).detach(); };
+  for (const BlockCompressor::Executor& exec :
+       {BlockCompressor::Executor(inline_exec), BlockCompressor::Executor(thread_exec)}) {
+    string res;
+    int64_t consumed = BlockDecompressor::DecompressParallel(src, exec, 4, [&](ByteRange block) {
+      res.append(reinterpret_cast<const char*>(block.data()), block.size());
+    });
+    EXPECT_EQ(flat.size(), consumed);
+    EXPECT_EQ(inp, res);
+  }
+
+  // Stops at the incomplete frame.
+  unsigned num_blocks = 0;
+  int64_t consumed = BlockDecompressor::DecompressParallel(
+      src.subpiece(0, flat.size() - 1), thread_exec, 2, [&](ByteRange) { ++num_blocks; });
+  EXPECT_EQ(flat.size() - blocks.back().size(), consumed);
+  EXPECT_EQ(9, num_blocks);
+}
+
+TEST_F(BlockCompressorTest, ParallelZeroCopy) {
+  bc_.SetParallel([](std::function<void()> f) { f(); }, 2);
+
+  string inp = base::RandStr(BlockCompressor::BLOCK_SIZE * 2 + 500);
+  ByteRange br = ToByteRange(inp);
+  while (!br.empty()) {
+    auto dest = bc_.BlockBuffer();
+    size_t sz = std::min(dest.size(), br.size());
+    memcpy(dest.data(), br.data(), sz);
+    br.advance(sz);
+    EXPECT_EQ(sz == dest.size(), bc_.Commit(sz));
+  }
+  EXPECT_EQ(500, bc_.pending_size());
+  bc_.Finalize();
+  ASSERT_EQ(3, bc_.compressed_blocks().size());
+  EXPECT_EQ(inp, Decompress(bc_.compressed_blocks(), &bdc_));
+}
+
 }  // namespace util
 
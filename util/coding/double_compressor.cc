@@ -3,8 +3,10 @@
 //
 #include "util/coding/double_compressor.h"
 
+#include <atomic>
 #include <cmath>
 #include <numeric>
+#include <thread>
 
 #include <lz4.h>
 #include <shuffle.h>
@@ -29,6 +31,9 @@ static inline unsigned DecimalCost(unsigned dec_len) {
 
 constexpr uint8_t kRawBit = 1 << 7;
 constexpr uint8_t kHasExceptionsBit = 1 << 6;
+constexpr uint8_t kSplitBit = 1 << 5;
+
+constexpr uint32_t kSplitHeaderSize = 2;  // the number of doubles.
 
 double FromPositive(int64_t significand, int exponent) {
   while (significand % 10 == 0) {
@@ -80,6 +85,47 @@ inline void bitunshuffle2(const uint8_t* src, size_t sz, uint8_t* dest) {
   }
 }
 
+// Returns the size of the lz4 block [src, src + len) once decompressed by parsing its
+// sequences or -1 if it is malformed.
+int64_t Lz4DecompressedSize(const uint8_t* src, size_t len) {
+  const uint8_t* end = src + len;
+
+  // Reads the extension bytes of the length that is 15 in the token.
+  auto read_len = [&](size_t* len) {
+    uint8_t b;
+    do {
+      if (src == end)
+        return false;
+      b = *src++;
+      *len += b;
+    } while (b == 255);
+    return true;
+  };
+
+  int64_t res = 0;
+  while (src < end) {
+    uint8_t token = *src++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !read_len(&literals))
+      return -1;
+    if (size_t(end - src) < literals)
+      return -1;
+    src += literals;
+    res += literals;
+    if (src == end)
+      return res;  // The last sequence has only literals.
+
+    if (end - src < 2)
+      return -1;
+    src += 2;  // match offset.
+    size_t match = token & 15;
+    if (match == 15 && !read_len(&match))
+      return -1;
+    res += match + 4;
+  }
+  return -1;
+}
+
 }  // namespace
 
 struct DoubleCompressor::ExpInfo {
@@ -184,6 +230,10 @@ uint32_t DoubleCompressor::Commit(const double* src, uint32_t count, uint8_t* de
   if (!aux_)
     aux_.reset(new Aux);
 
+  if (mode_ == SPLIT) {
+    return WriteSplitDoubles(src, count, dest);
+  }
+
   ExponentMap exp_map;
 
   for (unsigned i = 0; i < count; ++i) {
@@ -202,7 +252,7 @@ uint32_t DoubleCompressor::Commit(const double* src, uint32_t count, uint8_t* de
 
   unsigned normal_cnt = NormalizeDecimals(count, src);
   if (normal_cnt < count / 2) {
-    return WriteRawDoubles(src, count, dest);
+    return WriteSplitDoubles(src, count, dest);
   }
   VLOG(1) << "Cost: " << cost << " normalized count: " << normal_cnt;
 
@@ -224,7 +274,7 @@ uint32_t DoubleCompressor::Commit(const double* src, uint32_t count, uint8_t* de
                               kByteSize, LZ4_COMPRESSBOUND(kByteSize), 3 /* level */);
   CHECK_GT(res, 0);
   if ((res + 8 * exc_count) * 1.1 > kByteSize) {
-    return WriteRawDoubles(src, count, dest);
+    return WriteSplitDoubles(src, count, dest);
   }
 
   aux_->header.lz4_size = res;
@@ -281,6 +331,36 @@ uint32_t DoubleCompressor::WriteRawDoubles(const double* src, uint32_t count, ui
   return sz + 3;
 }
 
+uint32_t DoubleCompressor::WriteSplitDoubles(const double* src, uint32_t count, uint8_t* dest) {
+  uint64_t* xored = reinterpret_cast<uint64_t*>(aux_->normalized);
+  uint64_t prev = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    uint64_t val;
+    memcpy(&val, src + i, sizeof(val));
+    xored[i] = val ^ prev;
+    prev = val;
+  }
+
+  uint8_t* shuffle_buf = reinterpret_cast<uint8_t*>(aux_->dec);
+  const unsigned kByteSize = sizeof(uint64_t) * count;
+  shuffle(sizeof(uint64_t), kByteSize, reinterpret_cast<const uint8_t*>(xored), shuffle_buf);
+
+  char* next = reinterpret_cast<char*>(dest) + 3 + kSplitHeaderSize;
+  int res = LZ4_compress_fast(reinterpret_cast<const char*>(shuffle_buf), next, kByteSize,
+                              LZ4_COMPRESSBOUND(kByteSize), 3 /* level */);
+  CHECK_GT(res, 0);
+  if (res * 1.1 > kByteSize) {
+    return WriteRawDoubles(src, count, dest);
+  }
+
+  uint32_t written = 3 + kSplitHeaderSize + res;
+  CHECK_LE(written, COMPRESS_BLOCK_BOUND);
+  *dest = kSplitBit;
+  LittleEndian::Store16(dest + 1, written - 3);
+  LittleEndian::Store16(dest + 3, count);
+  return written;
+}
+
 
 int32_t  DoubleDecompressor::Decompress(const uint8_t* src, uint32_t src_len, double* dest) {
   if (src_len < 3 || LittleEndian::Load16(src + 1) != src_len - 3)
@@ -296,11 +376,32 @@ int32_t  DoubleDecompressor::Decompress(const uint8_t* src, uint32_t src_len, do
     memcpy(dest, src, src_len);
     return src_len / sizeof(double);
   }
-  CHECK_GT(src_len, DoubleCompressor::DECIMAL_HEADER_MAX_SIZE);
 
   if (!aux_)
     aux_.reset(new Aux);
 
+  if (flags & kSplitBit) {
+    CHECK_GT(src_len, kSplitHeaderSize);
+    unsigned count = LittleEndian::Load16(src);
+    CHECK_LE(count, BLOCK_MAX_LEN);
+
+    int res = LZ4_decompress_safe(reinterpret_cast<const char*>(src + kSplitHeaderSize),
+                                  reinterpret_cast<char*>(aux_->z4buf), src_len - kSplitHeaderSize,
+                                  DoubleCompressor::BLOCK_MAX_BYTES);
+    CHECK_EQ(res, count * sizeof(double));
+    unshuffle(sizeof(uint64_t), res, aux_->z4buf, reinterpret_cast<uint8_t*>(dest));
+
+    uint64_t prev = 0;
+    for (unsigned i = 0; i < count; ++i) {
+      uint64_t val;
+      memcpy(&val, dest + i, sizeof(val));
+      prev ^= val;
+      memcpy(dest + i, &prev, sizeof(prev));
+    }
+    return count;
+  }
+  CHECK_GT(src_len, DoubleCompressor::DECIMAL_HEADER_MAX_SIZE);
+
   DoubleCompressor::DecimalHeader dh;
   uint32 read = dh.Parse(flags, src);
   src_len -= read;
@@ -347,4 +448,86 @@ int32_t  DoubleDecompressor::Decompress(const uint8_t* src, uint32_t src_len, do
   return count;
 }
 
+int32_t DoubleDecompressor::BlockLength(const uint8_t* src, uint32_t src_len) {
+  if (src_len < 3 || BlockSize(src) != src_len)
+    return -1;
+
+  uint8_t flags = *src;
+  src += 3;
+  src_len -= 3;
+
+  if (flags & kRawBit)
+    return src_len % sizeof(double) ? -1 : src_len / sizeof(double);
+
+  if (flags & kSplitBit)
+    return src_len < kSplitHeaderSize ? -1 : LittleEndian::Load16(src);
+
+  uint32_t header_size = (flags & kHasExceptionsBit) ? 14 : 12;
+  if (src_len < header_size)
+    return -1;
+
+  DoubleCompressor::DecimalHeader dh;
+  dh.Parse(flags, src);
+  if (dh.lz4_size > src_len - header_size)
+    return -1;
+
+  int64_t res = Lz4DecompressedSize(src + header_size, dh.lz4_size);
+  if (res < 0 || res % sizeof(double) || res > DoubleCompressor::BLOCK_MAX_BYTES)
+    return -1;
+  return res / sizeof(double);
+}
+
+int64_t DoubleDecompressor::PlanBlocks(const uint8_t* src, size_t src_len,
+                                       std::vector<BlockRef>* refs) {
+  refs->clear();
+
+  size_t total = 0;
+  while (src_len) {
+    if (src_len < 3 || BlockSize(src) > src_len)
+      return -1;
+    uint32_t size = BlockSize(src);
+    int32_t len = BlockLength(src, size);
+    if (len < 0)
+      return -1;
+
+    refs->push_back(BlockRef{src, size, total});
+    total += len;
+    src += size;
+    src_len -= size;
+  }
+  return total;
+}
+
+int64_t DoubleDecompressor::DecompressBlocks(const uint8_t* src, size_t src_len, double* dest,
+                                             size_t dest_len, unsigned num_threads) {
+  std::vector<BlockRef> refs;
+  int64_t total = PlanBlocks(src, src_len, &refs);
+  if (total < 0 || size_t(total) > dest_len)
+    return -1;
+
+  // The threads pick the blocks one by one, since their decoding costs differ.
+  std::atomic<size_t> next{0};
+  std::atomic_bool failed{false};
+  auto decompress = [&] {
+    DoubleDecompressor decompressor;
+    for (size_t i = next++; i < refs.size(); i = next++) {
+      const BlockRef& ref = refs[i];
+      size_t end = i + 1 < refs.size() ? refs[i + 1].dest_offset : total;
+      int32_t res = decompressor.Decompress(ref.src, ref.size, dest + ref.dest_offset);
+      if (res < 0 || size_t(res) != end - ref.dest_offset)
+        failed = true;
+    }
+  };
+
+  num_threads = std::max<size_t>(1, std::min<size_t>(num_threads, refs.size()));
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(decompress);
+  decompress();
+  for (auto& t : threads)
+    t.join();
+
+  return failed ? -1 : total;
+}
+
 }  // namespace util
@@ -3,14 +3,32 @@
 //
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <map>
 #include <memory>
+#include <vector>
 
 namespace util {
 
+/*
+  Compresses blocks of doubles, each one is independent and starts with a 3 byte header of its
+  flags and size. A block holds one of:
+
+  * Decimal: the doubles that are short decimals are normalized to integers of a common exponent,
+    bit-shuffled and compressed with lz4, the rest are exceptions.
+  * Split: every double is XOR-ed with the previous one like in Gorilla, so that the sign,
+    the exponent and the high bits of the mantissa of slowly changing series become zero bytes,
+    the bytes are split into 8 planes and the planes are compressed with lz4. Decoding does
+    not convert decimals, it is lz4, the SIMD unshuffle of blosc and a XOR scan.
+  * Raw doubles, if neither of them compresses.
+*/
 class DoubleCompressor {
  public:
+  // AUTO tries the decimal encoding first. SPLIT skips it, for the data that is decoded much
+  // more often than written, since its decoding is several times faster.
+  enum Mode { AUTO, SPLIT };
+
   enum { BLOCK_MAX_BYTES = 1U << 16, BLOCK_MAX_LEN = BLOCK_MAX_BYTES / sizeof(double) };  // 2^13
   enum { COMPRESS_BLOCK_BOUND = (1U << 16) + 3,
          DECIMAL_HEADER_MAX_SIZE = 14};
@@ -28,6 +46,8 @@ class DoubleCompressor {
   // more space in between.
   uint32_t Commit(const double* src, uint32_t sz, uint8_t* dest);
 
+  void set_mode(Mode mode) { mode_ = mode; }
+
  private:
   struct ExpInfo;
   typedef std::map<int16_t, ExpInfo> ExponentMap;
@@ -36,6 +56,9 @@ class DoubleCompressor {
   uint32_t Optimize(const ExponentMap& em);
   uint32_t WriteRawDoubles(const double* src, uint32_t sz, uint8_t* dest);
 
+  // Falls back to WriteRawDoubles if the split encoding does not compress.
+  uint32_t WriteSplitDoubles(const double* src, uint32_t sz, uint8_t* dest);
+
   struct __attribute__((aligned(4))) Decimal {
     int64_t val;
     int16_t exp;
@@ -65,6 +88,7 @@ class DoubleCompressor {
   };
 
   std::unique_ptr<Aux> aux_;
+  Mode mode_ = AUTO;
   friend class DoubleDecompressor;
 };
 
@@ -74,7 +98,7 @@ class DoubleDecompressor {
 
   DoubleDecompressor() {}
 
-  // dest must accomodate at least BLOCK_MAX_LEN.
+  // dest must accomodate at least BLOCK_MAX_LEN or BlockLength(src, src_len) doubles.
   // Returns -1 if it can not decompress src because src_len is not exact block size.
   // Fully consumes successfully decompressed block.
   // On success returns how many doubles were written to dest.
@@ -86,6 +110,29 @@ class DoubleDecompressor {
     return 3 + ((uint32_t(header[2]) << 8) | header[1]);
   }
 
+  // Returns the number of doubles in the block without decompressing it or -1 if
+  // the block is malformed. O(1) for all but the decimal blocks, for which it parses the lz4
+  // sequences.
+  static int32_t BlockLength(const uint8_t* src, uint32_t src_len);
+
+  // A block of a sequence and the offset of its first double in the decompressed sequence.
+  struct BlockRef {
+    const uint8_t* src;
+    uint32_t size;
+    size_t dest_offset;
+  };
+
+  // Splits the consecutive blocks of [src, src + src_len) into refs, so that they can be
+  // decompressed independently into their offsets of a single buffer, each thread with its own
+  // DoubleDecompressor. Returns the number of doubles in the sequence or -1 if it is malformed.
+  static int64_t PlanBlocks(const uint8_t* src, size_t src_len, std::vector<BlockRef>* refs);
+
+  // Decompresses the consecutive blocks of [src, src + src_len) into dest using the calling
+  // thread and up to num_threads - 1 additional threads. Returns the number of doubles or -1 if
+  // src is malformed or the doubles do not fit into dest_len.
+  static int64_t DecompressBlocks(const uint8_t* src, size_t src_len, double* dest,
+                                  size_t dest_len, unsigned num_threads);
+
  private:
   struct Aux {
     uint8_t z4buf[DoubleCompressor::BLOCK_MAX_BYTES];
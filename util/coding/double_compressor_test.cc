@@ -4,10 +4,15 @@
 #include "util/coding/double_compressor.h"
 #include <gmock/gmock.h>
 
+#include <cmath>
+#include <random>
+
 #include "base/logging.h"
 #include "util/math/float2decimal.h"
 
+using testing::DoubleEq;
 using testing::ElementsAreArray;
+using testing::Pointwise;
 
 namespace util {
 
@@ -78,4 +83,80 @@ TEST_F(DoubleCompressorTest, BigExp) {
   ASSERT_EQ(128, res);
 }
 
+TEST_F(DoubleCompressorTest, Split) {
+  std::vector<double> inp;
+  std::default_random_engine re;
+  std::normal_distribution<double> noise(0, 0.01);
+
+  // Slowly changing gauge, not decimal.
+  double val = 1000;
+  for (unsigned i = 0; i < 4096; ++i) {
+    val += noise(re);
+    inp.push_back(val);
+  }
+
+  for (auto mode : {DoubleCompressor::AUTO, DoubleCompressor::SPLIT}) {
+    dc_.set_mode(mode);
+    uint32_t sz = dc_.Commit(inp.data(), inp.size(), buf_);
+    EXPECT_LT(sz, inp.size() * sizeof(double) * 7 / 8);
+    EXPECT_EQ(inp.size(), DoubleDecompressor::BlockLength(buf_, sz));
+
+    int res = dd_.Decompress(buf_, sz, actual_);
+    ASSERT_EQ(inp.size(), res);
+    EXPECT_EQ(0, memcmp(inp.data(), actual_, sz));
+  }
+
+  // SPLIT mode does not try the decimal encoding.
+  inp.assign(1000, 0);
+  for (unsigned i = 0; i < inp.size(); ++i)
+    inp[i] = i * 0.25;
+  uint32_t sz = dc_.Commit(inp.data(), inp.size(), buf_);
+  ASSERT_EQ(inp.size(), dd_.Decompress(buf_, sz, actual_));
+  EXPECT_THAT(std::vector<double>(actual_, actual_ + inp.size()), ElementsAreArray(inp));
+}
+
+TEST_F(DoubleCompressorTest, Blocks) {
+  std::default_random_engine re;
+  std::uniform_real_distribution<double> dis(0, 1);
+
+  std::vector<double> inp;
+  std::vector<uint8_t> blocks;
+
+  // Raw, decimal and split blocks of different lengths.
+  for (unsigned b = 0; b < 30; ++b) {
+    size_t start = inp.size();
+    unsigned len = 10 + b * 211;
+    for (unsigned i = 0; i < len; ++i) {
+      double d = dis(re);
+      inp.push_back(b % 3 == 0 ? d : b % 3 == 1 ? std::round(d * 1000) / 100 : 5 + d * 1e-6);
+    }
+
+    size_t pos = blocks.size();
+    blocks.resize(pos + DoubleCompressor::CommitMaxSize(len));
+    uint32_t sz = dc_.Commit(inp.data() + start, len, blocks.data() + pos);
+    ASSERT_EQ(len, DoubleDecompressor::BlockLength(blocks.data() + pos, sz));
+    blocks.resize(pos + sz);
+  }
+
+  std::vector<DoubleDecompressor::BlockRef> refs;
+  ASSERT_EQ(inp.size(), DoubleDecompressor::PlanBlocks(blocks.data(), blocks.size(), &refs));
+  ASSERT_EQ(30, refs.size());
+  EXPECT_EQ(10 + 211, refs[2].dest_offset - refs[1].dest_offset);
+
+  for (unsigned threads : {1, 4}) {
+    std::vector<double> actual(inp.size() + 1, -1);
+    ASSERT_EQ(inp.size(), DoubleDecompressor::DecompressBlocks(blocks.data(), blocks.size(),
+                                                               actual.data(), actual.size(),
+                                                               threads));
+    EXPECT_EQ(-1, actual.back());
+    actual.pop_back();
+    EXPECT_THAT(actual, Pointwise(DoubleEq(), inp));  // the decimal blocks are not exact.
+  }
+
+  std::vector<double> small(inp.size() - 1);
+  EXPECT_EQ(-1, DoubleDecompressor::DecompressBlocks(blocks.data(), blocks.size(), small.data(),
+                                                     small.size(), 2));
+  EXPECT_EQ(-1, DoubleDecompressor::PlanBlocks(blocks.data(), blocks.size() - 1, &refs));
+}
+
 }  // namespace util
@@ -0,0 +1,951 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/coding/roaring_bitmap.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "base/endian.h"
+#include "base/logging.h"
+
+namespace util {
+
+using detail::kRoaringBitsetWords;
+using detail::kRoaringNoOffsetThreshold;
+using Container = detail::RoaringContainer;
+
+namespace {
+
+constexpr uint32_t kSerialCookieNoRuns = 12346;
+constexpr uint32_t kSerialCookie = 12347;
+constexpr uint32_t kMaxArraySize = RoaringBitmap::kMaxArraySize;
+constexpr uint32_t kContainerRange = 1 << 16;
+constexpr size_t kBitsetBytes = kRoaringBitsetWords * 8;
+
+inline void SetBit(uint16_t v, uint64_t* words) { words[v >> 6] |= 1ULL << (v & 63); }
+
+inline bool TestBit(uint16_t v, const uint64_t* words) { return (words[v >> 6] >> (v & 63)) & 1; }
+
+// Sets the bits [first, last].
+void SetRange(uint32_t first, uint32_t last, uint64_t* words) {
+  uint32_t fw = first >> 6, lw = last >> 6;
+  uint64_t fmask = ~0ULL << (first & 63);
+  uint64_t lmask = ~0ULL >> (63 - (last & 63));
+  if (fw == lw) {
+    words[fw] |= fmask & lmask;
+    return;
+  }
+  words[fw] |= fmask;
+  for (uint32_t i = fw + 1; i < lw; ++i)
+    words[i] = ~0ULL;
+  words[lw] |= lmask;
+}
+
+uint32_t Popcount(const uint64_t* words) {
+  uint32_t res = 0;
+  for (unsigned i = 0; i < kRoaringBitsetWords; ++i)
+    res += __builtin_popcountll(words[i]);
+  return res;
+}
+
+// Returns the position of the first set bit (or the clear one if flip is ~0) at pos or after
+// it, kContainerRange if there is none.
+uint32_t NextBit(const uint64_t* words, uint32_t pos, uint64_t flip) {
+  if (pos >= kContainerRange)
+    return kContainerRange;
+  unsigned i = pos >> 6;
+  uint64_t w = (words[i] ^ flip) & (~0ULL << (pos & 63));
+  while (!w) {
+    if (++i == kRoaringBitsetWords)
+      return kContainerRange;
+    w = words[i] ^ flip;
+  }
+  return i * 64 + __builtin_ctzll(w);
+}
+
+// Converts c to the array of card bits of words. words may point to c->words.
+void BitsetToArray(const uint64_t* words, uint32_t card, Container* c) {
+  std::vector<uint16_t> vals(card);
+  size_t n = 0;
+  for (unsigned i = 0; i < kRoaringBitsetWords; ++i) {
+    for (uint64_t w = words[i]; w; w &= w - 1)
+      vals[n++] = i * 64 + __builtin_ctzll(w);
+  }
+  DCHECK_EQ(card, n);
+
+  c->type = Container::ARRAY;
+  c->card = card;
+  c->vals.swap(vals);
+  std::vector<uint64_t>().swap(c->words);
+}
+
+void ArrayToBitset(Container* c) {
+  std::vector<uint64_t> words(kRoaringBitsetWords);
+  for (uint16_t v : c->vals)
+    SetBit(v, words.data());
+
+  c->type = Container::BITSET;
+  c->words.swap(words);
+  std::vector<uint16_t>().swap(c->vals);
+}
+
+void RunToNonRun(Container* c) {
+  DCHECK_EQ(Container::RUN, c->type);
+
+  std::vector<uint16_t> runs;
+  runs.swap(c->vals);
+  if (c->card <= kMaxArraySize) {
+    c->vals.reserve(c->card);
+    for (size_t i = 0; i < runs.size(); i += 2) {
+      uint32_t last = uint32_t(runs[i]) + runs[i + 1];
+      for (uint32_t v = runs[i]; v <= last; ++v)
+        c->vals.push_back(v);
+    }
+    c->type = Container::ARRAY;
+  } else {
+    c->words.assign(kRoaringBitsetWords, 0);
+    for (size_t i = 0; i < runs.size(); i += 2)
+      SetRange(runs[i], uint32_t(runs[i]) + runs[i + 1], c->words.data());
+    c->type = Container::BITSET;
+  }
+}
+
+// Returns c if it is not a run container, otherwise its equivalent that is stored in tmp.
+const Container& NonRun(const Container& c, Container* tmp) {
+  if (c.type != Container::RUN)
+    return c;
+  *tmp = c;
+  RunToNonRun(tmp);
+  return *tmp;
+}
+
+unsigned CountRuns(const Container& c) {
+  unsigned res = 0;
+  switch (c.type) {
+    case Container::ARRAY:
+      for (size_t i = 0; i < c.vals.size(); ++i) {
+        if (i == 0 || c.vals[i] != c.vals[i - 1] + 1)
+          ++res;
+      }
+      break;
+    case Container::BITSET: {
+      uint64_t carry = 0;
+      for (uint64_t w : c.words) {
+        res += __builtin_popcountll(w & ~((w << 1) | carry));
+        carry = w >> 63;
+      }
+    } break;
+    case Container::RUN:
+      res = c.vals.size() / 2;
+      break;
+  }
+  return res;
+}
+
+void ToRuns(unsigned num_runs, Container* c) {
+  std::vector<uint16_t> runs;
+  runs.reserve(num_runs * 2);
+
+  if (c->type == Container::ARRAY) {
+    for (size_t i = 0; i < c->vals.size();) {
+      size_t j = i;
+      while (j + 1 < c->vals.size() && c->vals[j + 1] == c->vals[j] + 1)
+        ++j;
+      runs.push_back(c->vals[i]);
+      runs.push_back(j - i);
+      i = j + 1;
+    }
+  } else {
+    const uint64_t* words = c->words.data();
+    for (uint32_t pos = NextBit(words, 0, 0); pos < kContainerRange;) {
+      uint32_t end = NextBit(words, pos, ~0ULL);
+      runs.push_back(pos);
+      runs.push_back(end - 1 - pos);
+      pos = NextBit(words, end, 0);
+    }
+    std::vector<uint64_t>().swap(c->words);
+  }
+  DCHECK_EQ(num_runs * 2, runs.size());
+
+  c->type = Container::RUN;
+  c->vals.swap(runs);
+}
+
+size_t SerializedContainerSize(const Container& c) {
+  switch (c.type) {
+    case Container::ARRAY:
+      return c.card * 2;
+    case Container::BITSET:
+      return kBitsetBytes;
+    case Container::RUN:
+      break;
+  }
+  return 2 + c.vals.size() * 2;
+}
+
+bool ContainsLow(const Container& c, uint16_t low) {
+  switch (c.type) {
+    case Container::ARRAY:
+      return std::binary_search(c.vals.begin(), c.vals.end(), low);
+    case Container::BITSET:
+      return TestBit(low, c.words.data());
+    case Container::RUN:
+      break;
+  }
+
+  // The first run that starts after low.
+  size_t lo = 0, hi = c.vals.size() / 2;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (c.vals[mid * 2] <= low)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 && low - c.vals[lo * 2 - 2] <= c.vals[lo * 2 - 1];
+}
+
+// Returns true if low was not in c, c is not a run container.
+bool AddLow(uint16_t low, Container* c) {
+  if (c->type == Container::BITSET) {
+    uint64_t& w = c->words[low >> 6];
+    uint64_t mask = 1ULL << (low & 63);
+    if (w & mask)
+      return false;
+    w |= mask;
+    ++c->card;
+    return true;
+  }
+
+  auto it = std::lower_bound(c->vals.begin(), c->vals.end(), low);
+  if (it != c->vals.end() && *it == low)
+    return false;
+  if (c->card == kMaxArraySize) {
+    ArrayToBitset(c);
+    SetBit(low, c->words.data());
+  } else {
+    c->vals.insert(it, low);
+  }
+  ++c->card;
+  return true;
+}
+
+// Intersections of the sorted arrays. dest must have room for min(size_a, size_b) + 8 values,
+// the vector version stores 8 values at a time.
+size_t IntersectScalar(const uint16_t* a, size_t size_a, const uint16_t* b, size_t size_b,
+                       uint16_t* dest) {
+  size_t ia = 0, ib = 0, n = 0;
+  while (ia < size_a && ib < size_b) {
+    if (a[ia] < b[ib]) {
+      ++ia;
+    } else if (b[ib] < a[ia]) {
+      ++ib;
+    } else {
+      dest[n++] = a[ia];
+      ++ia;
+      ++ib;
+    }
+  }
+  return n;
+}
+
+// For the small array a and the much larger b.
+size_t IntersectSkewed(const uint16_t* a, size_t size_a, const uint16_t* b, size_t size_b,
+                       uint16_t* dest) {
+  const uint16_t* it = b;
+  const uint16_t* end = b + size_b;
+  size_t n = 0;
+  for (size_t i = 0; i < size_a; ++i) {
+    it = std::lower_bound(it, end, a[i]);
+    if (it == end)
+      break;
+    if (*it == a[i])
+      dest[n++] = a[i];
+  }
+  return n;
+}
+
+#ifdef __SSE4_2__
+
+// The shuffles that move the 16-bit lanes selected by an 8-bit mask to the front.
+struct ShuffleTable {
+  uint8_t mask[256][16];
+
+  ShuffleTable() {
+    for (unsigned m = 0; m < 256; ++m) {
+      unsigned k = 0;
+      for (unsigned lane = 0; lane < 8; ++lane) {
+        if (m & (1 << lane)) {
+          mask[m][k++] = lane * 2;
+          mask[m][k++] = lane * 2 + 1;
+        }
+      }
+      while (k < 16)
+        mask[m][k++] = 0x80;
+    }
+  }
+};
+
+const ShuffleTable& GetShuffleTable() {
+  static const ShuffleTable table;
+  return table;
+}
+
+// Compares blocks of 8 values of a and b with pcmpestrm and compacts the matches of a with
+// pshufb, see Schlegel et al., "Fast Sorted-Set Intersection using SIMD Instructions".
+size_t IntersectVector(const uint16_t* a, size_t size_a, const uint16_t* b, size_t size_b,
+                       uint16_t* dest) {
+  constexpr int kMode = _SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+  const ShuffleTable& table = GetShuffleTable();
+
+  size_t ia = 0, ib = 0, n = 0;
+  const size_t end_a = size_a & ~size_t(7), end_b = size_b & ~size_t(7);
+
+  if (end_a && end_b) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+    while (true) {
+      // Bit i is set if va[i] is in vb.
+      unsigned r = _mm_cvtsi128_si32(_mm_cmpestrm(vb, 8, va, 8, kMode));
+      __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table.mask[r]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n), _mm_shuffle_epi8(va, shuffle));
+      n += __builtin_popcount(r);
+
+      uint16_t max_a = a[ia + 7], max_b = b[ib + 7];
+      if (max_a <= max_b) {
+        ia += 8;
+        if (ia == end_a)
+          break;
+        va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + ia));
+      }
+      if (max_b <= max_a) {
+        ib += 8;
+        if (ib == end_b)
+          break;
+        vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + ib));
+      }
+    }
+  }
+
+  return n + IntersectScalar(a + ia, size_a - ia, b + ib, size_b - ib, dest + n);
+}
+
+#endif
+
+size_t IntersectArrays(const uint16_t* a, size_t size_a, const uint16_t* b, size_t size_b,
+                       uint16_t* dest) {
+  if (size_a > size_b) {
+    std::swap(a, b);
+    std::swap(size_a, size_b);
+  }
+  if (size_a * 64 < size_b)
+    return IntersectSkewed(a, size_a, b, size_b, dest);
+#ifdef __SSE4_2__
+  return IntersectVector(a, size_a, b, size_b, dest);
+#else
+  return IntersectScalar(a, size_a, b, size_b, dest);
+#endif
+}
+
+// Returns false if the intersection is empty.
+bool AndContainers(const Container& a0, const Container& b0, Container* dest) {
+  Container tmp_a, tmp_b;
+  const Container& a = NonRun(a0, &tmp_a);
+  const Container& b = NonRun(b0, &tmp_b);
+
+  if (a.type == Container::ARRAY && b.type == Container::ARRAY) {
+    dest->vals.resize(std::min(a.card, b.card) + 8);
+    size_t n = IntersectArrays(a.vals.data(), a.card, b.vals.data(), b.card, dest->vals.data());
+    dest->vals.resize(n);
+    dest->type = Container::ARRAY;
+    dest->card = n;
+  } else if (a.type == Container::BITSET && b.type == Container::BITSET) {
+    dest->words.resize(kRoaringBitsetWords);
+    uint32_t card = 0;
+    for (unsigned i = 0; i < kRoaringBitsetWords; ++i) {
+      uint64_t w = a.words[i] & b.words[i];
+      dest->words[i] = w;
+      card += __builtin_popcountll(w);
+    }
+    dest->type = Container::BITSET;
+    dest->card = card;
+    if (card <= kMaxArraySize)
+      BitsetToArray(dest->words.data(), card, dest);
+  } else {
+    const Container& arr = a.type == Container::ARRAY ? a : b;
+    const uint64_t* words = a.type == Container::ARRAY ? b.words.data() : a.words.data();
+    dest->vals.resize(arr.card);
+    size_t n = 0;
+    for (uint16_t v : arr.vals) {
+      dest->vals[n] = v;
+      n += TestBit(v, words);
+    }
+    dest->vals.resize(n);
+    dest->type = Container::ARRAY;
+    dest->card = n;
+  }
+  return dest->card > 0;
+}
+
+uint32_t AndContainersCardinality(const Container& a0, const Container& b0) {
+  Container tmp_a, tmp_b;
+  const Container& a = NonRun(a0, &tmp_a);
+  const Container& b = NonRun(b0, &tmp_b);
+
+  uint32_t res = 0;
+  if (a.type == Container::ARRAY && b.type == Container::ARRAY) {
+    uint16_t buf[kMaxArraySize + 8];
+    res = IntersectArrays(a.vals.data(), a.card, b.vals.data(), b.card, buf);
+  } else if (a.type == Container::BITSET && b.type == Container::BITSET) {
+    for (unsigned i = 0; i < kRoaringBitsetWords; ++i)
+      res += __builtin_popcountll(a.words[i] & b.words[i]);
+  } else {
+    const Container& arr = a.type == Container::ARRAY ? a : b;
+    const uint64_t* words = a.type == Container::ARRAY ? b.words.data() : a.words.data();
+    for (uint16_t v : arr.vals)
+      res += TestBit(v, words);
+  }
+  return res;
+}
+
+void OrContainers(const Container& a0, const Container& b0, Container* dest) {
+  Container tmp_a, tmp_b;
+  const Container& a = NonRun(a0, &tmp_a);
+  const Container& b = NonRun(b0, &tmp_b);
+
+  if (a.type == Container::ARRAY && b.type == Container::ARRAY) {
+    if (a.card + b.card <= kMaxArraySize) {
+      dest->vals.resize(a.card + b.card);
+      auto end = std::set_union(a.vals.begin(), a.vals.end(), b.vals.begin(), b.vals.end(),
+                                dest->vals.begin());
+      dest->vals.erase(end, dest->vals.end());
+      dest->type = Container::ARRAY;
+      dest->card = dest->vals.size();
+      return;
+    }
+
+    dest->words.assign(kRoaringBitsetWords, 0);
+    for (uint16_t v : a.vals)
+      SetBit(v, dest->words.data());
+    for (uint16_t v : b.vals)
+      SetBit(v, dest->words.data());
+    dest->type = Container::BITSET;
+    dest->card = Popcount(dest->words.data());
+    if (dest->card <= kMaxArraySize)
+      BitsetToArray(dest->words.data(), dest->card, dest);
+  } else if (a.type == Container::BITSET && b.type == Container::BITSET) {
+    dest->words.resize(kRoaringBitsetWords);
+    for (unsigned i = 0; i < kRoaringBitsetWords; ++i)
+      dest->words[i] = a.words[i] | b.words[i];
+    dest->type = Container::BITSET;
+    dest->card = Popcount(dest->words.data());
+  } else {
+    const Container& arr = a.type == Container::ARRAY ? a : b;
+    const Container& bits = a.type == Container::ARRAY ? b : a;
+    dest->words = bits.words;
+    dest->type = Container::BITSET;
+    dest->card = bits.card;
+    for (uint16_t v : arr.vals) {
+      uint64_t& w = dest->words[v >> 6];
+      uint64_t mask = 1ULL << (v & 63);
+      dest->card += (w & mask) == 0;
+      w |= mask;
+    }
+  }
+}
+
+}  // namespace
+
+RoaringBitmap::Container* RoaringBitmap::Mutable(uint16_t key) {
+  auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+  size_t i = it - keys_.begin();
+  if (it == keys_.end() || *it != key) {
+    keys_.insert(it, key);
+    containers_.emplace(containers_.begin() + i);
+  }
+  return &containers_[i];
+}
+
+bool RoaringBitmap::Add(uint32_t val) {
+  Container* c = Mutable(val >> 16);
+  if (c->type == Container::RUN) {
+    if (ContainsLow(*c, val & 0xFFFF))
+      return false;
+    RunToNonRun(c);
+  }
+  return AddLow(val & 0xFFFF, c);
+}
+
+void RoaringBitmap::AddMany(const uint32_t* vals, size_t count) {
+  Container* c = nullptr;
+  uint16_t key = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!c || (vals[i] >> 16) != key) {
+      key = vals[i] >> 16;
+      c = Mutable(key);
+      if (c->type == Container::RUN)
+        RunToNonRun(c);
+    }
+
+    uint16_t low = vals[i] & 0xFFFF;
+    if (c->type == Container::ARRAY && c->card < kMaxArraySize &&
+        (c->vals.empty() || c->vals.back() < low)) {
+      c->vals.push_back(low);
+      ++c->card;
+    } else {
+      AddLow(low, c);
+    }
+  }
+}
+
+bool RoaringBitmap::Remove(uint32_t val) {
+  const uint16_t key = val >> 16, low = val & 0xFFFF;
+  auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+  if (it == keys_.end() || *it != key)
+    return false;
+
+  size_t i = it - keys_.begin();
+  Container* c = &containers_[i];
+  if (!ContainsLow(*c, low))
+    return false;
+
+  if (c->type == Container::RUN)
+    RunToNonRun(c);
+
+  if (c->type == Container::BITSET) {
+    c->words[low >> 6] &= ~(1ULL << (low & 63));
+    if (--c->card <= kMaxArraySize)
+      BitsetToArray(c->words.data(), c->card, c);
+  } else {
+    c->vals.erase(std::lower_bound(c->vals.begin(), c->vals.end(), low));
+    --c->card;
+  }
+
+  if (c->card == 0) {
+    keys_.erase(it);
+    containers_.erase(containers_.begin() + i);
+  }
+  return true;
+}
+
+bool RoaringBitmap::Contains(uint32_t val) const {
+  const uint16_t key = val >> 16;
+  auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+  if (it == keys_.end() || *it != key)
+    return false;
+  return ContainsLow(containers_[it - keys_.begin()], val & 0xFFFF);
+}
+
+uint64_t RoaringBitmap::Cardinality() const {
+  uint64_t res = 0;
+  for (const Container& c : containers_)
+    res += c.card;
+  return res;
+}
+
+bool RoaringBitmap::RunOptimize() {
+  bool has_runs = false;
+  for (Container& c : containers_) {
+    if (c.type != Container::RUN) {
+      unsigned num_runs = CountRuns(c);
+      if (2 + num_runs * 4 < SerializedContainerSize(c))
+        ToRuns(num_runs, &c);
+    }
+    has_runs |= (c.type == Container::RUN);
+  }
+  return has_runs;
+}
+
+std::vector<uint32_t> RoaringBitmap::ToVector() const {
+  std::vector<uint32_t> res;
+  res.reserve(Cardinality());
+  ForEach([&](uint32_t v) { res.push_back(v); });
+  return res;
+}
+
+RoaringBitmap RoaringBitmap::And(const RoaringBitmap& a, const RoaringBitmap& b) {
+  RoaringBitmap res;
+  size_t i = 0, j = 0;
+  while (i < a.keys_.size() && j < b.keys_.size()) {
+    if (a.keys_[i] < b.keys_[j]) {
+      ++i;
+    } else if (b.keys_[j] < a.keys_[i]) {
+      ++j;
+    } else {
+      Container c;
+      if (AndContainers(a.containers_[i], b.containers_[j], &c)) {
+        res.keys_.push_back(a.keys_[i]);
+        res.containers_.push_back(std::move(c));
+      }
+      ++i;
+      ++j;
+    }
+  }
+  return res;
+}
+
+RoaringBitmap RoaringBitmap::Or(const RoaringBitmap& a, const RoaringBitmap& b) {
+  RoaringBitmap res;
+  size_t i = 0, j = 0;
+  while (i < a.keys_.size() || j < b.keys_.size()) {
+    if (j == b.keys_.size() || (i < a.keys_.size() && a.keys_[i] < b.keys_[j])) {
+      res.keys_.push_back(a.keys_[i]);
+      res.containers_.push_back(a.containers_[i++]);
+    } else if (i == a.keys_.size() || b.keys_[j] < a.keys_[i]) {
+      res.keys_.push_back(b.keys_[j]);
+      res.containers_.push_back(b.containers_[j++]);
+    } else {
+      res.keys_.push_back(a.keys_[i]);
+      res.containers_.emplace_back();
+      OrContainers(a.containers_[i++], b.containers_[j++], &res.containers_.back());
+    }
+  }
+  return res;
+}
+
+uint64_t RoaringBitmap::AndCardinality(const RoaringBitmap& a, const RoaringBitmap& b) {
+  uint64_t res = 0;
+  size_t i = 0, j = 0;
+  while (i < a.keys_.size() && j < b.keys_.size()) {
+    if (a.keys_[i] < b.keys_[j]) {
+      ++i;
+    } else if (b.keys_[j] < a.keys_[i]) {
+      ++j;
+    } else {
+      res += AndContainersCardinality(a.containers_[i++], b.containers_[j++]);
+    }
+  }
+  return res;
+}
+
+bool RoaringBitmap::operator==(const RoaringBitmap& o) const {
+  if (keys_ != o.keys_)
+    return false;
+
+  for (size_t i = 0; i < containers_.size(); ++i) {
+    if (containers_[i].card != o.containers_[i].card)
+      return false;
+
+    // Both are arrays or both are bitsets since the cardinalities are equal.
+    Container tmp_a, tmp_b;
+    const Container& a = NonRun(containers_[i], &tmp_a);
+    const Container& b = NonRun(o.containers_[i], &tmp_b);
+    if (a.type == Container::ARRAY ? a.vals != b.vals : a.words != b.words)
+      return false;
+  }
+  return true;
+}
+
+/*
+  The portable format, all the fields are little-endian:
+
+    uint32 cookie            -- kSerialCookieNoRuns, or kSerialCookie | (size - 1) << 16.
+    uint32 size              -- for kSerialCookieNoRuns only.
+    uint8 run_flags[(size + 7) / 8]    -- for kSerialCookie only, bit i is set if the container
+                                          i is a run container.
+    (uint16 key, uint16 card - 1)[size]
+    uint32 offsets[size]     -- omitted for kSerialCookie and size < kRoaringNoOffsetThreshold,
+                                relative to the cookie.
+    containers               -- the runs as uint16 num_runs, (uint16 start, uint16 length - 1)
+                                pairs. Otherwise the arrays of card <= kMaxArraySize values
+                                and the bitsets of 1024 uint64 words.
+*/
+size_t RoaringBitmap::SerializedSize() const {
+  const size_t n = keys_.size();
+  bool has_runs = false;
+  size_t res = 0;
+  for (const Container& c : containers_) {
+    has_runs |= (c.type == Container::RUN);
+    res += SerializedContainerSize(c);
+  }
+
+  if (has_runs) {
+    res += 4 + (n + 7) / 8 + n * 4;
+    if (n >= kRoaringNoOffsetThreshold)
+      res += n * 4;
+  } else {
+    res += 8 + n * 8;
+  }
+  return res;
+}
+
+void RoaringBitmap::Serialize(std::string* dest) const {
+  const size_t n = keys_.size();
+  const size_t start = dest->size();
+  dest->resize(start + SerializedSize());
+
+  uint8_t* const base = reinterpret_cast<uint8_t*>(&(*dest)[start]);
+  uint8_t* next = base;
+
+  bool has_runs = std::any_of(containers_.begin(), containers_.end(),
+                              [](const Container& c) { return c.type == Container::RUN; });
+  if (has_runs) {
+    LittleEndian::Store32(next, kSerialCookie | (n - 1) << 16);
+    next += 4;
+    memset(next, 0, (n + 7) / 8);
+    for (size_t i = 0; i < n; ++i) {
+      if (containers_[i].type == Container::RUN)
+        next[i / 8] |= 1 << (i % 8);
+    }
+    next += (n + 7) / 8;
+  } else {
+    LittleEndian::Store32(next, kSerialCookieNoRuns);
+    LittleEndian::Store32(next + 4, n);
+    next += 8;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    LittleEndian::Store16(next, keys_[i]);
+    LittleEndian::Store16(next + 2, containers_[i].card - 1);
+    next += 4;
+  }
+
+  uint8_t* offsets = nullptr;
+  if (!has_runs || n >= kRoaringNoOffsetThreshold) {
+    offsets = next;
+    next += n * 4;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    const Container& c = containers_[i];
+    if (offsets)
+      LittleEndian::Store32(offsets + i * 4, next - base);
+
+    switch (c.type) {
+      case Container::ARRAY:
+        for (uint16_t v : c.vals) {
+          LittleEndian::Store16(next, v);
+          next += 2;
+        }
+        break;
+      case Container::BITSET:
+        for (uint64_t w : c.words) {
+          LittleEndian::Store64(next, w);
+          next += 8;
+        }
+        break;
+      case Container::RUN:
+        LittleEndian::Store16(next, c.vals.size() / 2);
+        next += 2;
+        for (uint16_t v : c.vals) {
+          LittleEndian::Store16(next, v);
+          next += 2;
+        }
+        break;
+    }
+  }
+  DCHECK_EQ(dest->size() - start, size_t(next - base));
+}
+
+bool RoaringBitmap::Deserialize(const void* buf, size_t size) {
+  RoaringBitmapView view;
+  return view.Open(buf, size) && view.ToBitmap(this);
+}
+
+uint16_t RoaringBitmapView::key(unsigned i) const { return LittleEndian::Load16(desc_ + i * 4); }
+
+uint32_t RoaringBitmapView::card(unsigned i) const {
+  return uint32_t(LittleEndian::Load16(desc_ + i * 4 + 2)) + 1;
+}
+
+Container::Type RoaringBitmapView::type(unsigned i) const {
+  if (run_flags_ && (run_flags_[i / 8] & (1 << (i % 8))))
+    return Container::RUN;
+  return card(i) <= kMaxArraySize ? Container::ARRAY : Container::BITSET;
+}
+
+uint32_t RoaringBitmapView::offset(unsigned i) const {
+  return offsets_ ? LittleEndian::Load32(offsets_ + i * 4) : local_offsets_[i];
+}
+
+bool RoaringBitmapView::Open(const void* buf, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(buf);
+  if (size < 4)
+    return false;
+
+  uint32_t cookie = LittleEndian::Load32(p);
+  size_t n, header;
+  bool has_offsets;
+  if ((cookie & 0xFFFF) == kSerialCookie) {
+    n = (cookie >> 16) + 1;
+    has_offsets = n >= kRoaringNoOffsetThreshold;
+    header = 4 + (n + 7) / 8;
+  } else if (cookie == kSerialCookieNoRuns) {
+    if (size < 8)
+      return false;
+    n = LittleEndian::Load32(p + 4);
+    if (n > kContainerRange)
+      return false;
+    has_offsets = true;
+    header = 8;
+  } else {
+    return false;
+  }
+
+  const size_t desc = header;
+  header += n * 4 * (has_offsets ? 2 : 1);
+  if (header > size)
+    return false;
+
+  buf_ = p;
+  run_flags_ = (cookie & 0xFFFF) == kSerialCookie ? p + 4 : nullptr;
+  desc_ = p + desc;
+  offsets_ = has_offsets ? desc_ + n * 4 : nullptr;
+  size_ = n;
+
+  size_t next = header;
+  unsigned i = 0;
+  for (; i < n; ++i) {
+    if (i > 0 && key(i) <= key(i - 1))
+      break;
+
+    size_t off = next;
+    if (has_offsets)
+      off = offset(i);
+    else
+      local_offsets_[i] = off;
+    if (off < header || off > size)
+      break;
+
+    size_t csize;
+    switch (type(i)) {
+      case Container::ARRAY:
+        csize = card(i) * 2;
+        break;
+      case Container::BITSET:
+        csize = kBitsetBytes;
+        break;
+      case Container::RUN:
+        if (size - off < 2)
+          csize = 2;
+        else
+          csize = 2 + LittleEndian::Load16(p + off) * 4;
+        break;
+    }
+    if (size - off < csize)
+      break;
+    next = off + csize;
+  }
+
+  if (i < n) {
+    size_ = 0;
+    return false;
+  }
+  return true;
+}
+
+bool RoaringBitmapView::Contains(uint32_t val) const {
+  const uint16_t key = val >> 16, low = val & 0xFFFF;
+
+  unsigned lo = 0, hi = size_;
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if (this->key(mid) < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == size_ || this->key(lo) != key)
+    return false;
+
+  const uint8_t* c = buf_ + offset(lo);
+  switch (type(lo)) {
+    case Container::ARRAY: {
+      uint32_t first = 0, last = card(lo);
+      while (first < last) {
+        uint32_t mid = (first + last) / 2;
+        if (LittleEndian::Load16(c + mid * 2) < low)
+          first = mid + 1;
+        else
+          last = mid;
+      }
+      return first < card(lo) && LittleEndian::Load16(c + first * 2) == low;
+    }
+    case Container::BITSET:
+      return (LittleEndian::Load64(c + (low >> 6) * 8) >> (low & 63)) & 1;
+    case Container::RUN:
+      break;
+  }
+
+  // The first run that starts after low.
+  const uint8_t* runs = c + 2;
+  uint32_t first = 0, last = LittleEndian::Load16(c);
+  while (first < last) {
+    uint32_t mid = (first + last) / 2;
+    if (LittleEndian::Load16(runs + mid * 4) <= low)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  if (first == 0)
+    return false;
+  const uint8_t* run = runs + (first - 1) * 4;
+  return low - LittleEndian::Load16(run) <= LittleEndian::Load16(run + 2);
+}
+
+uint64_t RoaringBitmapView::Cardinality() const {
+  uint64_t res = 0;
+  for (unsigned i = 0; i < size_; ++i)
+    res += card(i);
+  return res;
+}
+
+bool RoaringBitmapView::ToBitmap(RoaringBitmap* dest) const {
+  dest->clear();
+  dest->keys_.reserve(size_);
+  dest->containers_.reserve(size_);
+
+  for (unsigned i = 0; i < size_; ++i) {
+    const uint8_t* p = buf_ + offset(i);
+    Container c;
+    c.type = type(i);
+    c.card = card(i);
+
+    bool valid = true;
+    switch (c.type) {
+      case Container::ARRAY:
+        c.vals.resize(c.card);
+        for (uint32_t j = 0; j < c.card; ++j) {
+          c.vals[j] = LittleEndian::Load16(p + j * 2);
+          valid &= (j == 0 || c.vals[j - 1] < c.vals[j]);
+        }
+        break;
+      case Container::BITSET:
+        c.words.resize(kRoaringBitsetWords);
+        for (unsigned j = 0; j < kRoaringBitsetWords; ++j)
+          c.words[j] = LittleEndian::Load64(p + j * 8);
+        valid = Popcount(c.words.data()) == c.card;
+        break;
+      case Container::RUN: {
+        c.vals.resize(LittleEndian::Load16(p) * 2);
+        uint32_t total = 0, next_start = 0;
+        for (size_t j = 0; j < c.vals.size(); j += 2) {
+          c.vals[j] = LittleEndian::Load16(p + 2 + j * 2);
+          c.vals[j + 1] = LittleEndian::Load16(p + 4 + j * 2);
+
+          uint32_t last = uint32_t(c.vals[j]) + c.vals[j + 1];
+          valid &= (c.vals[j] >= next_start && last < kContainerRange);
+          next_start = last + 1;
+          total += c.vals[j + 1] + 1;
+        }
+        valid &= (total == c.card);
+      } break;
+    }
+
+    if (!valid) {
+      dest->clear();
+      return false;
+    }
+    dest->keys_.push_back(key(i));
+    dest->containers_.push_back(std::move(c));
+  }
+  return true;
+}
+
+}  // namespace util
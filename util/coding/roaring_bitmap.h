@@ -0,0 +1,180 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace util {
+
+namespace detail {
+
+constexpr unsigned kRoaringBitsetWords = (1 << 16) / 64;
+
+// The portable format omits the offsets of fewer containers if some of them are runs.
+constexpr unsigned kRoaringNoOffsetThreshold = 4;
+
+// The low 16 bits of the values that share the same high 16 bits.
+struct RoaringContainer {
+  enum Type : uint8_t { ARRAY, BITSET, RUN };
+
+  Type type = ARRAY;
+  uint32_t card = 0;
+
+  // ARRAY: the sorted values, RUN: sorted (start, length - 1) pairs.
+  std::vector<uint16_t> vals;
+
+  // BITSET: kRoaringBitsetWords words.
+  std::vector<uint64_t> words;
+};
+
+}  // namespace detail
+
+/*
+  Compressed set of uint32 values, e.g. ID sets that are deduplicated, tested and intersected
+  between pipeline stages or per-shard key presence summaries. The values are partitioned by
+  their high 16 bits into containers that keep the low 16 bits as:
+
+    array  -- a sorted array of up to kMaxArraySize values,
+    bitset -- 2^16 bits, for the denser containers,
+    run    -- sorted runs of consecutive values, created by RunOptimize().
+
+  A mutation of a run container converts it back to an array or a bitset.
+
+  Serialize() writes the portable roaring format, which is read and written by the other
+  roaring implementations, e.g. CRoaring and Java RoaringBitmap. RoaringBitmapView reads this
+  format in place, e.g. from a mapped file.
+*/
+class RoaringBitmap {
+ public:
+  static constexpr unsigned kMaxArraySize = 4096;
+
+  // Returns true if val was not in the set.
+  bool Add(uint32_t val);
+
+  // Faster than Add() for the sorted input.
+  void AddMany(const uint32_t* vals, size_t count);
+
+  // Returns true if val was in the set.
+  bool Remove(uint32_t val);
+
+  bool Contains(uint32_t val) const;
+
+  uint64_t Cardinality() const;
+  bool empty() const { return keys_.empty(); }
+
+  void clear() {
+    keys_.clear();
+    containers_.clear();
+  }
+
+  // Converts the containers to runs where it makes them smaller. Returns true if there are
+  // run containers afterwards.
+  bool RunOptimize();
+
+  // Calls f(uint32_t) for every value in increasing order.
+  template <typename F> void ForEach(F&& f) const;
+
+  std::vector<uint32_t> ToVector() const;
+
+  static RoaringBitmap And(const RoaringBitmap& a, const RoaringBitmap& b);
+  static RoaringBitmap Or(const RoaringBitmap& a, const RoaringBitmap& b);
+
+  // Cardinality of And(a, b) without building it.
+  static uint64_t AndCardinality(const RoaringBitmap& a, const RoaringBitmap& b);
+
+  RoaringBitmap& operator&=(const RoaringBitmap& o) {
+    *this = And(*this, o);
+    return *this;
+  }
+
+  RoaringBitmap& operator|=(const RoaringBitmap& o) {
+    *this = Or(*this, o);
+    return *this;
+  }
+
+  // Compares the sets regardless of the containers that hold them.
+  bool operator==(const RoaringBitmap& o) const;
+  bool operator!=(const RoaringBitmap& o) const { return !(*this == o); }
+
+  size_t SerializedSize() const;
+
+  // Appends the portable format to dest.
+  void Serialize(std::string* dest) const;
+
+  // Returns false if [buf, buf + size) is not a valid portable bitmap.
+  bool Deserialize(const void* buf, size_t size);
+
+ private:
+  friend class RoaringBitmapView;
+
+  using Container = detail::RoaringContainer;
+
+  // Returns the container of key, creates it if needed.
+  Container* Mutable(uint16_t key);
+
+  std::vector<uint16_t> keys_;
+  std::vector<Container> containers_;
+};
+
+// Read-only view of the portable format. Does not own the buffer.
+class RoaringBitmapView {
+ public:
+  // Returns false if [buf, buf + size) is not a valid layout. Validates the headers and
+  // that the containers fit into the buffer, so it takes O(number of containers).
+  bool Open(const void* buf, size_t size);
+
+  bool Contains(uint32_t val) const;
+
+  uint64_t Cardinality() const;
+
+  unsigned num_containers() const { return size_; }
+
+  // Copies the set into dest. Returns false if the containers are malformed, e.g. the array
+  // values are not sorted or the cardinalities do not match their contents.
+  bool ToBitmap(RoaringBitmap* dest) const;
+
+ private:
+  uint16_t key(unsigned i) const;
+  uint32_t card(unsigned i) const;
+  detail::RoaringContainer::Type type(unsigned i) const;
+  uint32_t offset(unsigned i) const;
+
+  const uint8_t* buf_ = nullptr;
+  const uint8_t* run_flags_ = nullptr;  // null if there are no run containers.
+  const uint8_t* desc_ = nullptr;       // (key, card - 1) pairs.
+  const uint8_t* offsets_ = nullptr;    // null if the format omits them.
+  uint32_t local_offsets_[detail::kRoaringNoOffsetThreshold];
+  unsigned size_ = 0;
+};
+
+template <typename F> void RoaringBitmap::ForEach(F&& f) const {
+  for (size_t i = 0; i < keys_.size(); ++i) {
+    const uint32_t high = uint32_t(keys_[i]) << 16;
+    const Container& c = containers_[i];
+
+    switch (c.type) {
+      case Container::ARRAY:
+        for (uint16_t v : c.vals)
+          f(high | v);
+        break;
+      case Container::BITSET:
+        for (unsigned j = 0; j < detail::kRoaringBitsetWords; ++j) {
+          for (uint64_t w = c.words[j]; w; w &= w - 1)
+            f(high | (j * 64 + __builtin_ctzll(w)));
+        }
+        break;
+      case Container::RUN:
+        for (size_t j = 0; j < c.vals.size(); j += 2) {
+          uint32_t last = uint32_t(c.vals[j]) + c.vals[j + 1];
+          for (uint32_t v = c.vals[j]; v <= last; ++v)
+            f(high | v);
+        }
+        break;
+    }
+  }
+}
+
+}  // namespace util
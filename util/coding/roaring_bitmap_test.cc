@@ -0,0 +1,311 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/coding/roaring_bitmap.h"
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <unordered_set>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+using testing::ElementsAre;
+
+namespace util {
+
+class RoaringBitmapTest : public testing::Test {
+ protected:
+  // count random values in [0, range).
+  static set<uint32_t> RandomSet(unsigned count, uint32_t range, unsigned seed) {
+    std::mt19937 rng(seed);
+    set<uint32_t> res;
+    while (res.size() < count)
+      res.insert(rng() % range);
+    return res;
+  }
+
+  static RoaringBitmap FromSet(const set<uint32_t>& vals) {
+    RoaringBitmap res;
+    for (uint32_t v : vals)
+      res.Add(v);
+    return res;
+  }
+
+  static vector<uint32_t> ToVector(const set<uint32_t>& vals) {
+    return vector<uint32_t>(vals.begin(), vals.end());
+  }
+
+  static string Serialize(const RoaringBitmap& bm) {
+    string res;
+    bm.Serialize(&res);
+    EXPECT_EQ(bm.SerializedSize(), res.size());
+    return res;
+  }
+
+  static string Bytes(std::initializer_list<uint8_t> bytes) {
+    return string(bytes.begin(), bytes.end());
+  }
+};
+
+TEST_F(RoaringBitmapTest, Basic) {
+  RoaringBitmap bm;
+  EXPECT_TRUE(bm.empty());
+  EXPECT_TRUE(bm.Add(5));
+  EXPECT_FALSE(bm.Add(5));
+  EXPECT_TRUE(bm.Add(1 << 20));
+  EXPECT_TRUE(bm.Add(0xFFFFFFFF));
+  EXPECT_TRUE(bm.Add(0));
+
+  EXPECT_EQ(4, bm.Cardinality());
+  EXPECT_TRUE(bm.Contains(5));
+  EXPECT_TRUE(bm.Contains(0xFFFFFFFF));
+  EXPECT_FALSE(bm.Contains(6));
+  EXPECT_FALSE(bm.Contains(1 << 21));
+  EXPECT_THAT(bm.ToVector(), ElementsAre(0, 5, 1 << 20, 0xFFFFFFFF));
+
+  EXPECT_TRUE(bm.Remove(1 << 20));
+  EXPECT_FALSE(bm.Remove(1 << 20));
+  EXPECT_FALSE(bm.Remove(7));
+  EXPECT_THAT(bm.ToVector(), ElementsAre(0, 5, 0xFFFFFFFF));
+}
+
+TEST_F(RoaringBitmapTest, Containers) {
+  // Grows past an array into a bitset and shrinks back.
+  RoaringBitmap bm;
+  for (uint32_t i = 0; i < 10000; ++i)
+    bm.Add(i * 3);
+  EXPECT_EQ(10000, bm.Cardinality());
+  for (uint32_t i = 0; i < 10000; i += 2)
+    EXPECT_TRUE(bm.Remove(i * 3));
+  EXPECT_EQ(5000, bm.Cardinality());
+
+  for (uint32_t i = 0; i < 30000; ++i)
+    ASSERT_EQ(i % 3 == 0 && (i / 3) % 2 == 1, bm.Contains(i)) << i;
+
+  RoaringBitmap other;
+  vector<uint32_t> vals = bm.ToVector();
+  other.AddMany(vals.data(), vals.size());
+  EXPECT_TRUE(bm == other);
+  EXPECT_TRUE(other.Remove(3));
+  EXPECT_TRUE(bm != other);
+}
+
+TEST_F(RoaringBitmapTest, RunOptimize) {
+  RoaringBitmap bm;
+  for (uint32_t i = 1000; i < 200000; ++i)
+    bm.Add(i);
+  bm.Add(300000);
+
+  RoaringBitmap copy = bm;
+  size_t before = bm.SerializedSize();
+  EXPECT_TRUE(bm.RunOptimize());
+  EXPECT_LT(bm.SerializedSize() * 100, before);
+  EXPECT_TRUE(bm == copy);
+  EXPECT_EQ(199001, bm.Cardinality());
+  EXPECT_TRUE(bm.Contains(1000));
+  EXPECT_TRUE(bm.Contains(199999));
+  EXPECT_FALSE(bm.Contains(999));
+  EXPECT_FALSE(bm.Contains(200000));
+
+  // A mutation converts the run container back.
+  EXPECT_FALSE(bm.Add(5000));
+  EXPECT_TRUE(bm.Remove(5000));
+  EXPECT_FALSE(bm.Contains(5000));
+  EXPECT_TRUE(bm.Add(5000));
+  EXPECT_TRUE(bm == copy);
+
+  RoaringBitmap sparse = FromSet(RandomSet(1000, 1 << 24, 1));
+  EXPECT_FALSE(sparse.RunOptimize());
+}
+
+TEST_F(RoaringBitmapTest, Ops) {
+  // Sparse, dense and mixed containers.
+  const uint32_t kRanges[] = {1 << 24, 1 << 18, 1 << 16};
+  for (uint32_t range_a : kRanges) {
+    for (uint32_t range_b : kRanges) {
+      set<uint32_t> sa = RandomSet(50000, range_a, range_a);
+      set<uint32_t> sb = RandomSet(30000, range_b, range_b + 1);
+
+      vector<uint32_t> expected_and, expected_or;
+      set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(),
+                       back_inserter(expected_and));
+      set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected_or));
+
+      for (bool runs : {false, true}) {
+        RoaringBitmap a = FromSet(sa), b = FromSet(sb);
+        if (runs) {
+          // Adds a run to the containers of a.
+          for (uint32_t i = 0; i < 1 << 16; ++i) {
+            sa.insert(i);
+            a.Add(i);
+          }
+          a.RunOptimize();
+          expected_and.clear();
+          expected_or.clear();
+          set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(),
+                           back_inserter(expected_and));
+          set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected_or));
+        }
+
+        RoaringBitmap res = RoaringBitmap::And(a, b);
+        ASSERT_EQ(expected_and, res.ToVector()) << range_a << " " << range_b;
+        EXPECT_EQ(expected_and.size(), RoaringBitmap::AndCardinality(a, b));
+        EXPECT_EQ(expected_or, RoaringBitmap::Or(a, b).ToVector());
+        EXPECT_TRUE(RoaringBitmap::Or(a, b) == RoaringBitmap::Or(b, a));
+
+        a &= b;
+        EXPECT_EQ(expected_and.size(), a.Cardinality());
+      }
+    }
+  }
+}
+
+TEST_F(RoaringBitmapTest, IntersectArrays) {
+  // Exercises the block and the tail paths of the array intersection.
+  for (unsigned size_a : {1, 7, 8, 9, 31, 100, 4000}) {
+    for (unsigned size_b : {1, 8, 15, 64, 1000, 4096}) {
+      set<uint32_t> sa = RandomSet(size_a, 8192, size_a), sb = RandomSet(size_b, 8192, size_b);
+      sa.insert(0);
+      sb.insert(0);
+      vector<uint32_t> expected;
+      set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(), back_inserter(expected));
+
+      RoaringBitmap res = RoaringBitmap::And(FromSet(sa), FromSet(sb));
+      ASSERT_EQ(expected, res.ToVector()) << size_a << " " << size_b;
+    }
+  }
+}
+
+TEST_F(RoaringBitmapTest, PortableFormat) {
+  RoaringBitmap bm;
+  for (uint32_t v : {1, 2, 3, 100000})
+    bm.Add(v);
+
+  string expected = Bytes({0x3A, 0x30, 0, 0, 2, 0, 0, 0,       // cookie, size
+                           0, 0, 2, 0, 1, 0, 0, 0,             // keys and cardinalities
+                           24, 0, 0, 0, 30, 0, 0, 0,           // offsets
+                           1, 0, 2, 0, 3, 0, 0xA0, 0x86});     // arrays
+  EXPECT_EQ(expected, Serialize(bm));
+
+  RoaringBitmap runs;
+  for (uint32_t v = 0; v < 100; ++v)
+    runs.Add(v);
+  EXPECT_TRUE(runs.RunOptimize());
+  expected = Bytes({0x3B, 0x30, 0, 0, 1,   // cookie with size - 1, run flags
+                    0, 0, 99, 0,           // key and cardinality
+                    1, 0, 0, 0, 99, 0});   // a single run
+  EXPECT_EQ(expected, Serialize(runs));
+
+  string empty = Serialize(RoaringBitmap());
+  EXPECT_EQ(Bytes({0x3A, 0x30, 0, 0, 0, 0, 0, 0}), empty);
+  RoaringBitmap res;
+  res.Add(1);
+  ASSERT_TRUE(res.Deserialize(empty.data(), empty.size()));
+  EXPECT_TRUE(res.empty());
+}
+
+TEST_F(RoaringBitmapTest, Serialize) {
+  for (bool runs : {false, true}) {
+    for (unsigned num_keys : {1, 3, 4, 50}) {
+      RoaringBitmap bm;
+      // Mixes sparse, dense and contiguous containers.
+      for (uint32_t key = 0; key < num_keys; ++key) {
+        uint32_t high = key * 3 << 16;
+        switch (key % 3) {
+          case 0:
+            for (uint32_t v : RandomSet(100, 1 << 16, key))
+              bm.Add(high | v);
+            break;
+          case 1:
+            for (uint32_t v : RandomSet(20000, 1 << 16, key))
+              bm.Add(high | v);
+            break;
+          case 2:
+            for (uint32_t v = 100; v < 5000; ++v)
+              bm.Add(high | v);
+            break;
+        }
+      }
+      if (runs)
+        bm.RunOptimize();
+
+      string buf = Serialize(bm);
+      RoaringBitmap res;
+      ASSERT_TRUE(res.Deserialize(buf.data(), buf.size()));
+      EXPECT_TRUE(res == bm);
+
+      RoaringBitmapView view;
+      ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+      EXPECT_EQ(num_keys, view.num_containers());
+      EXPECT_EQ(bm.Cardinality(), view.Cardinality());
+      for (uint32_t v = 0; v < (num_keys * 3 + 1) << 16; v += 7)
+        ASSERT_EQ(bm.Contains(v), view.Contains(v)) << v;
+      bm.ForEach([&](uint32_t v) { ASSERT_TRUE(view.Contains(v)); });
+    }
+  }
+}
+
+TEST_F(RoaringBitmapTest, Malformed) {
+  RoaringBitmap bm = FromSet(RandomSet(10000, 1 << 20, 7));
+  for (uint32_t v = 1 << 20; v < (1 << 20) + 10000; ++v)
+    bm.Add(v);
+  bm.RunOptimize();
+  string buf = Serialize(bm);
+
+  RoaringBitmapView view;
+  for (size_t len = 0; len < buf.size(); ++len)
+    ASSERT_FALSE(view.Open(buf.data(), len)) << len;
+
+  string bad = buf;
+  bad[0] = 0;
+  EXPECT_FALSE(view.Open(bad.data(), bad.size()));
+
+  // Unsorted array.
+  RoaringBitmap small;
+  small.Add(1);
+  small.Add(2);
+  bad = Serialize(small);
+  swap(bad[16], bad[18]);
+  RoaringBitmap res;
+  ASSERT_TRUE(view.Open(bad.data(), bad.size()));
+  EXPECT_FALSE(view.ToBitmap(&res));
+  EXPECT_FALSE(res.Deserialize(bad.data(), bad.size()));
+}
+
+static void BM_RoaringAnd(benchmark::State& state) {
+  std::mt19937 rng(0);
+  RoaringBitmap a, b;
+  for (unsigned i = 0; i < 1000000; ++i) {
+    a.Add(rng() % state.range(0));
+    b.Add(rng() % state.range(0));
+  }
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(RoaringBitmap::AndCardinality(a, b));
+  }
+}
+BENCHMARK(BM_RoaringAnd)->Arg(1 << 28)->Arg(1 << 22);
+
+static void BM_HashSetAnd(benchmark::State& state) {
+  std::mt19937 rng(0);
+  unordered_set<uint32_t> a, b;
+  for (unsigned i = 0; i < 1000000; ++i) {
+    a.insert(rng() % state.range(0));
+    b.insert(rng() % state.range(0));
+  }
+
+  while (state.KeepRunning()) {
+    size_t res = 0;
+    for (uint32_t v : a)
+      res += b.count(v);
+    benchmark::DoNotOptimize(res);
+  }
+}
+BENCHMARK(BM_HashSetAnd)->Arg(1 << 28)->Arg(1 << 22);
+
+}  // namespace util
@@ -6,9 +6,13 @@
 #define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "base/endian.h"
 #include "base/flit.h"
 #include "base/logging.h"
+#include "base/varint.h"
 
 namespace flit = base::flit;
 
@@ -28,6 +32,21 @@ inline size_t GetContentSizeChecked(const uint8_t* src, uint32_t size) {
   return content_size;
 }
 
+constexpr char kPrefixMagic[4] = {'G', 'S', 'Q', 'P'};
+constexpr uint16_t kPrefixVersion = 1;
+
+inline int Compare(strings::ByteRange a, strings::ByteRange b) {
+  size_t len = std::min(a.size(), b.size());
+  int res = len ? memcmp(a.data(), b.data(), len) : 0;
+  if (res)
+    return res;
+  return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+}
+
+inline strings::ByteRange ToByteRange(const std::string& s) {
+  return strings::ByteRange(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+}
+
 }  // namespace
 
 size_t SequenceArray::GetMaxSerializedSize() const {
@@ -96,6 +115,174 @@ void SequenceArray::SerializeFrom(const uint8_t* src, uint32_t count) {
   CHECK_EQ(buf_content_size, res);
 }
 
+std::string SequenceArray::SerializeFrozen() const {
+  base::FrozenArraysBuilder<uint8_t> builder(len_.size());
+  for (size_t i = 0; i < len_.size(); ++i) {
+    builder.set_length(i, len_[i]);
+  }
+  builder.Allocate();
+
+  // The sequences are contiguous in both layouts.
+  if (!data_.empty())
+    memcpy(builder.mutable_range(0), data_.data(), data_.size());
+  return builder.Finish();
+}
+
+PrefixSequenceBuilder::PrefixSequenceBuilder(unsigned restart_interval)
+    : restart_interval_(restart_interval) {
+  CHECK(restart_interval > 0 && restart_interval <= kuint16max) << restart_interval;
+}
+
+void PrefixSequenceBuilder::Add(strings::ByteRange seq) {
+  size_t shared = 0;
+  if (count_ % restart_interval_ == 0) {
+    restarts_.push_back(data_.size());
+  } else {
+    size_t len = std::min(last_.size(), seq.size());
+    while (shared < len && uint8_t(last_[shared]) == seq[shared])
+      ++shared;
+  }
+  CHECK(count_ == 0 || Compare(ToByteRange(last_), seq) <= 0) << "Sequences must be sorted";
+  CHECK_LE(seq.size(), kuint32max);
+
+  Varint::Append32(&data_, shared);
+  Varint::Append32(&data_, seq.size() - shared);
+  data_.append(reinterpret_cast<const char*>(seq.data()) + shared, seq.size() - shared);
+
+  last_.resize(shared);
+  last_.append(reinterpret_cast<const char*>(seq.data()) + shared, seq.size() - shared);
+  ++count_;
+}
+
+std::string PrefixSequenceBuilder::Finish() {
+  PrefixSequenceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kPrefixMagic, sizeof(header.magic));
+  header.version = base::detail::ToLittleEndian(kPrefixVersion);
+  header.restart_interval = base::detail::ToLittleEndian<uint16_t>(restart_interval_);
+  header.num_items = base::detail::ToLittleEndian(count_);
+  header.num_restarts = base::detail::ToLittleEndian<uint64_t>(restarts_.size());
+
+  restarts_.push_back(data_.size());
+  std::string res(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (uint64_t offset : restarts_) {
+    offset = base::detail::ToLittleEndian(offset);
+    res.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+  }
+  res.append(data_);
+
+  std::string().swap(data_);
+  return res;
+}
+
+PrefixSequenceView::Iterator::Iterator(const PrefixSequenceView* view, uint64_t index)
+    : view_(view), index_(index) {
+}
+
+void PrefixSequenceView::Iterator::Decode() {
+  uint32_t shared, unshared;
+
+  // The layout is trusted past Open(), see FrozenArraysView.
+  next_ = Varint::Parse32(next_, &shared);
+  next_ = Varint::Parse32(next_, &unshared);
+  DCHECK(next_ && shared <= cur_.size());
+
+  cur_.resize(shared);
+  cur_.append(reinterpret_cast<const char*>(next_), unshared);
+  next_ += unshared;
+}
+
+auto PrefixSequenceView::Iterator::operator++() -> Iterator& {
+  if (++index_ < view_->size_)
+    Decode();
+  return *this;
+}
+
+bool PrefixSequenceView::Open(const void* buf, size_t size) {
+#ifndef IS_LITTLE_ENDIAN
+  return false;  // the buffers can not be used in place.
+#endif
+  if (size < sizeof(PrefixSequenceHeader) ||
+      reinterpret_cast<uintptr_t>(buf) % alignof(PrefixSequenceHeader)) {
+    return false;
+  }
+
+  const PrefixSequenceHeader* header = reinterpret_cast<const PrefixSequenceHeader*>(buf);
+  if (memcmp(header->magic, kPrefixMagic, sizeof(header->magic)) ||
+      header->version != kPrefixVersion || header->restart_interval == 0) {
+    return false;
+  }
+
+  uint64_t num_restarts = header->num_restarts;
+  if (num_restarts != (header->num_items + header->restart_interval - 1) /
+                          header->restart_interval ||
+      num_restarts >= (size - sizeof(PrefixSequenceHeader)) / sizeof(uint64_t)) {
+    return false;
+  }
+
+  const uint64_t* restarts = reinterpret_cast<const uint64_t*>(header + 1);
+  size_t data_offset = sizeof(PrefixSequenceHeader) + (num_restarts + 1) * sizeof(uint64_t);
+  if (restarts[0] != 0 || restarts[num_restarts] != size - data_offset)
+    return false;
+
+  restarts_ = restarts;
+  data_ = reinterpret_cast<const uint8_t*>(buf) + data_offset;
+  size_ = header->num_items;
+  num_restarts_ = num_restarts;
+  restart_interval_ = header->restart_interval;
+  return true;
+}
+
+strings::ByteRange PrefixSequenceView::RestartKey(uint64_t r) const {
+  uint32_t shared, unshared;
+  const uint8_t* next = Varint::Parse32(data_ + restarts_[r], &shared);
+  next = Varint::Parse32(next, &unshared);
+  DCHECK(next && shared == 0);
+  return strings::ByteRange(next, unshared);
+}
+
+auto PrefixSequenceView::At(uint64_t index) const -> const_iterator {
+  DCHECK_LE(index, size_);
+  if (index == size_)
+    return end();
+
+  uint64_t r = index / restart_interval_;
+  Iterator it(this, r * restart_interval_);
+  it.next_ = data_ + restarts_[r];
+  it.Decode();
+  while (it.index_ < index)
+    ++it;
+  return it;
+}
+
+std::string PrefixSequenceView::Get(uint64_t index) const {
+  DCHECK_LT(index, size_);
+  return std::move(At(index).cur_);
+}
+
+uint64_t PrefixSequenceView::LowerBound(strings::ByteRange key) const {
+  // The first restart point whose key is not less than key.
+  uint64_t lo = 0, hi = num_restarts_;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (Compare(RestartKey(mid), key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0)
+    return 0;
+
+  // The answer is in the block of the previous restart point or it is lo's sequence.
+  uint64_t block_end = std::min<uint64_t>(lo * restart_interval_, size_);
+  for (Iterator it = At((lo - 1) * restart_interval_); it.index_ < block_end; ++it) {
+    if (Compare(*it, key) >= 0)
+      return it.index_;
+  }
+  return block_end;
+}
+
 
 }  // namespace util
 
@@ -3,6 +3,9 @@
 //
 #pragma once
 
+#include <string>
+
+#include "base/frozen_arrays.h"
 #include "base/pod_array.h"
 #include "strings/range.h"
 
@@ -67,6 +70,155 @@ class SequenceArray {
   size_t GetMaxSerializedSize() const;
   size_t SerializeTo(uint8* dest) const;
   void SerializeFrom(const uint8_t* src, uint32_t count);
+
+  // Returns the uncompressed layout of base::FrozenArraysView<uint8_t> that SequenceArrayView
+  // reads in place.
+  std::string SerializeFrozen() const;
+};
+
+// Read-only view of SequenceArray::SerializeFrozen() output, e.g. in a mapped file.
+// Does not own the buffer.
+class SequenceArrayView {
+ public:
+  class Iterator {
+    const SequenceArrayView* view_;
+    uint32 index_;
+
+   public:
+    Iterator(const SequenceArrayView* view, uint32 index) : view_(view), index_(index) {}
+
+    strings::ByteRange operator*() const { return (*view_)[index_]; }
+
+    Iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+
+    bool operator==(const Iterator& o) const { return index_ == o.index_; }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
+  };
+
+  typedef Iterator const_iterator;
+
+  // Returns false if [buf, buf + size) is not a valid layout. Takes O(1).
+  bool Open(const void* buf, size_t size) { return view_.Open(buf, size); }
+
+  strings::ByteRange operator[](uint32 index) const {
+    auto range = view_.range(index);
+    return strings::ByteRange(range.begin(), range.end() - range.begin());
+  }
+
+  uint32 size() const { return view_.size(); }
+  bool empty() const { return size() == 0; }
+
+  const_iterator begin() const { return Iterator(this, 0); }
+  const_iterator end() const { return Iterator(this, size()); }
+
+ private:
+  base::FrozenArraysView<uint8_t> view_;
+};
+
+/*
+  Front coding of sorted sequences, e.g. dictionaries or on-disk string columns that are
+  searched with LowerBound(). Every sequence is stored as the length of the prefix it shares
+  with the previous one, the length of the rest and the rest. Every restart_interval-th
+  sequence is stored in full, so the sequences are reached by a binary search over these
+  restart points and a scan of at most restart_interval sequences.
+
+    PrefixSequenceHeader (32 bytes)
+    uint64 restarts[num_restarts + 1]   -- offsets of the restart points, the last is the data size.
+    data                                -- varint32 shared, varint32 unshared, bytes[unshared].
+
+  All the fields are little-endian like in base/frozen_arrays.h. PrefixSequenceView reads the
+  layout in place.
+*/
+struct PrefixSequenceHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t restart_interval;
+  uint8_t reserved[8];
+  uint64_t num_items;
+  uint64_t num_restarts;
+};
+
+static_assert(sizeof(PrefixSequenceHeader) == 32, "");
+
+class PrefixSequenceBuilder {
+ public:
+  explicit PrefixSequenceBuilder(unsigned restart_interval = 16);
+
+  // Sequences must be added in non-decreasing lexicographic order of their unsigned bytes.
+  void Add(strings::ByteRange seq);
+
+  // Returns the serialized sequences. The builder must not be used afterwards.
+  std::string Finish();
+
+ private:
+  unsigned restart_interval_;
+  uint64_t count_ = 0;
+  std::string data_;
+  std::vector<uint64_t> restarts_;
+  std::string last_;
+};
+
+class PrefixSequenceView {
+ public:
+  // Reconstructs the sequences one by one, the returned range is valid until the iterator
+  // is advanced.
+  class Iterator {
+   public:
+    Iterator(const PrefixSequenceView* view, uint64_t index);
+
+    strings::ByteRange operator*() const {
+      return strings::ByteRange(reinterpret_cast<const uint8_t*>(cur_.data()), cur_.size());
+    }
+
+    Iterator& operator++();
+
+    bool operator==(const Iterator& o) const { return index_ == o.index_; }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
+
+   private:
+    friend class PrefixSequenceView;
+
+    void Decode();
+
+    const PrefixSequenceView* view_;
+    uint64_t index_;
+    const uint8_t* next_ = nullptr;
+    std::string cur_;
+  };
+
+  typedef Iterator const_iterator;
+
+  // Returns false if [buf, buf + size) is not a valid layout. Validates the header and the
+  // last restart point only, so it takes O(1).
+  bool Open(const void* buf, size_t size);
+
+  uint64_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  std::string Get(uint64_t index) const;
+
+  // Returns the index of the first sequence that is not less than key or size() if all of
+  // them are less.
+  uint64_t LowerBound(strings::ByteRange key) const;
+
+  // Iterator at sequence index, index <= size().
+  const_iterator At(uint64_t index) const;
+
+  const_iterator begin() const { return At(0); }
+  const_iterator end() const { return Iterator(this, size_); }
+
+ private:
+  // Returns the full sequence at restart point r.
+  strings::ByteRange RestartKey(uint64_t r) const;
+
+  const uint64_t* restarts_ = nullptr;
+  const uint8_t* data_ = nullptr;
+  uint64_t size_ = 0;
+  uint64_t num_restarts_ = 0;
+  unsigned restart_interval_ = 1;
 };
 
 
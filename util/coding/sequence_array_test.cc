@@ -0,0 +1,122 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/coding/sequence_array.h"
+
+#include <gmock/gmock.h>
+
+#include <algorithm>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace util {
+
+using strings::ByteRange;
+
+static ByteRange ToRange(const string& s) {
+  return ByteRange(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+}
+
+static string ToString(ByteRange br) {
+  return string(reinterpret_cast<const char*>(br.data()), br.size());
+}
+
+class SequenceArrayTest : public testing::Test {
+ protected:
+  static vector<string> SortedKeys(unsigned num) {
+    vector<string> res;
+    for (unsigned i = 0; i < num; ++i) {
+      res.push_back("user:" + to_string(i * 7));
+    }
+    res.push_back("");
+    res.push_back("user:");
+    res.push_back("user:");
+    res.push_back("\xff\xfe");
+    sort(res.begin(), res.end());
+    return res;
+  }
+};
+
+TEST_F(SequenceArrayTest, Frozen) {
+  SequenceArray arr;
+  vector<string> vals{"foo", "", "barbaz", string(1000, 'x')};
+  for (const string& s : vals)
+    arr.Add(s.data(), s.data() + s.size());
+
+  string buf = arr.SerializeFrozen();
+  SequenceArrayView view;
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  ASSERT_EQ(vals.size(), view.size());
+
+  vector<string> res;
+  for (ByteRange br : view)
+    res.push_back(ToString(br));
+  EXPECT_EQ(vals, res);
+  EXPECT_EQ("barbaz", ToString(view[2]));
+
+  EXPECT_FALSE(view.Open(buf.data(), buf.size() - 1));
+
+  SequenceArray empty;
+  buf = empty.SerializeFrozen();
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  EXPECT_TRUE(view.empty());
+  EXPECT_TRUE(view.begin() == view.end());
+}
+
+TEST_F(SequenceArrayTest, Prefix) {
+  vector<string> keys = SortedKeys(1000);
+
+  for (unsigned restart_interval : {1, 5, 16}) {
+    PrefixSequenceBuilder builder(restart_interval);
+    for (const string& k : keys)
+      builder.Add(ToRange(k));
+    string buf = builder.Finish();
+
+    PrefixSequenceView view;
+    ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+    ASSERT_EQ(keys.size(), view.size());
+
+    vector<string> res;
+    for (ByteRange br : view)
+      res.push_back(ToString(br));
+    ASSERT_EQ(keys, res);
+
+    for (unsigned i = 0; i < keys.size(); i += 37) {
+      EXPECT_EQ(keys[i], view.Get(i));
+      EXPECT_EQ(keys[i], ToString(*view.At(i)));
+    }
+
+    for (string probe : {"", "a", "user:", "user:0", "user:10", "user:100", "user:99999",
+                         "user;", "\xff\xff"}) {
+      uint64_t expected = lower_bound(keys.begin(), keys.end(), probe) - keys.begin();
+      EXPECT_EQ(expected, view.LowerBound(ToRange(probe))) << probe;
+    }
+  }
+
+  // Front coding pays off for the common prefixes.
+  PrefixSequenceBuilder builder;
+  size_t total = 0;
+  for (const string& k : keys) {
+    builder.Add(ToRange(k));
+    total += k.size();
+  }
+  string buf = builder.Finish();
+  EXPECT_LT(buf.size(), total * 3 / 4);
+
+  PrefixSequenceView view;
+  EXPECT_FALSE(view.Open(buf.data(), buf.size() - 1));
+}
+
+TEST_F(SequenceArrayTest, PrefixEmpty) {
+  string buf = PrefixSequenceBuilder().Finish();
+  PrefixSequenceView view;
+  ASSERT_TRUE(view.Open(buf.data(), buf.size()));
+  EXPECT_TRUE(view.empty());
+  EXPECT_TRUE(view.begin() == view.end());
+  EXPECT_EQ(0, view.LowerBound(ToRange("foo")));
+}
+
+}  // namespace util
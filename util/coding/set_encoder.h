@@ -87,7 +87,9 @@ template<typename T> class LiteralDict : public LiteralDictBase {
 
 
 struct BlockHeader {
-  enum { kDictBit = 0x1, kFinalBit = 0x2, kDictSeqBit = 0x4 };
+  // kPackedBit is defined for the blocks without dictionary only. Such a block holds the raw
+  // literals packed with internal::PackLiterals, instead of being compressed with zstd.
+  enum { kDictBit = 0x1, kFinalBit = 0x2, kDictSeqBit = 0x4, kPackedBit = 0x8 };
 
   uint8_t flags;  // use dictionary.
 
@@ -149,6 +151,10 @@ class SeqEncoderBase {
 
   void AddCompressedBuf(const BlockHeader& bh);
 
+  // Compresses a raw block of at most SEQ_BLOCK_SIZE bytes with zstd or packs it,
+  // whichever is smaller up to the slack that favours the faster decoding of the packed blocks.
+  void CompressRawBlock(const uint8_t* src, size_t size, bool final);
+
   void AnalyzeSequenceDict();
 
   // Checks if cnt literals can be added to batch buffers.
@@ -267,6 +273,9 @@ class SeqDecoderBase {
   virtual void SetLitDict(strings::ByteRange br) = 0;
   virtual bool AddFlitSeq(strings::ByteRange src) = 0;
 
+  // Unpacks the literals of a kPackedBit block to be returned by the next page.
+  virtual void UnpackBlock(strings::ByteRange src) = 0;
+
   BlockHeader bh_;
   bool read_header_ = false;
 
@@ -308,6 +317,7 @@ template<size_t INT_SIZE> class SeqDecoder: public SeqDecoderBase {
  private:
   void SetLitDict(strings::ByteRange br) override;
   bool AddFlitSeq(strings::ByteRange src) override;
+  void UnpackBlock(strings::ByteRange src) override;
 
   base::PODArray<UT> lit_dict_, int_buf_;
 
@@ -317,6 +327,29 @@ template<size_t INT_SIZE> class SeqDecoder: public SeqDecoderBase {
 namespace internal {
 constexpr unsigned kSmallNum = 5;
 
+/*
+  Patched frame-of-reference bit packing, in the spirit of FastPFor, of the raw literals.
+  The literals are split into mini-blocks of kPackedMiniBlock values, each one stores
+  its minimum and the differences from it in bit_width bits. The few differences that do not fit
+  are exceptions: their positions and high bits are stored after the mini-block.
+  bit_width is chosen per mini-block to minimize its size. If it makes the output smaller,
+  the literals are delta-encoded first, i.e. sorted or clustered columns pack into few bits.
+  Decoding unpacks with base::UnpackBits and undoes the deltas with
+  base::ComputePrefixSumInplace.
+*/
+constexpr unsigned kPackedMiniBlock = 128;
+
+// The upper bound of PackLiterals output for count literals.
+template <typename UT> size_t PackedMaxSize(size_t count);
+
+// Returns the number of bytes written into dest.
+template <typename UT> size_t PackLiterals(const UT* src, size_t count, uint8_t* dest);
+
+// Returns the number of literals unpacked into dest, CHECK-fails if src is malformed or
+// holds more than dest_capacity literals.
+template <typename UT>
+size_t UnpackLiterals(strings::ByteRange src, UT* dest, size_t dest_capacity);
+
 template<typename UT, typename MapperFn> uint32_t DeflateFlitAndMap(
   const uint8_t* src, uint32_t cnt, MapperFn mapper_fn,
   UT* dest, uint32_t dest_capacity) {
@@ -96,6 +96,56 @@ TEST(DeltaEncode, Parse) {
   EXPECT_THAT(parsed, ElementsAreArray(source));
 }
 
+template <typename UT> vector<UT> PackAndUnpack(const vector<UT>& src, size_t* packed_size) {
+  vector<uint8_t> buf(internal::PackedMaxSize<UT>(src.size()));
+  *packed_size = internal::PackLiterals(src.data(), src.size(), buf.data());
+  EXPECT_LE(*packed_size, buf.size());
+
+  vector<UT> res(src.size());
+  size_t cnt = internal::UnpackLiterals(strings::ByteRange(buf.data(), *packed_size),
+                                        res.data(), res.size());
+  EXPECT_EQ(src.size(), cnt);
+  return res;
+}
+
+TEST(PackLiterals, Basic) {
+  std::default_random_engine re;
+  size_t packed = 0;
+
+  vector<uint32_t> v32;
+  EXPECT_THAT(PackAndUnpack(v32, &packed), ElementsAreArray(v32));
+
+  // Frame of reference: a small range far from 0, with a tail that is not a full mini-block.
+  std::uniform_int_distribution<uint32_t> small(1000000, 1000255);
+  for (unsigned i = 0; i < 1000; ++i)
+    v32.push_back(small(re));
+  EXPECT_THAT(PackAndUnpack(v32, &packed), ElementsAreArray(v32));
+  EXPECT_LT(packed, v32.size() * 9 / 8 + 100);
+
+  // Exceptions.
+  for (unsigned i = 0; i < v32.size(); i += 50)
+    v32[i] = 0xFFFFFFFF - i;
+  EXPECT_THAT(PackAndUnpack(v32, &packed), ElementsAreArray(v32));
+  EXPECT_LT(packed, v32.size() * 3 / 2);
+
+  // Sorted, delta encoded.
+  v32.clear();
+  for (unsigned i = 0; i < 1000; ++i)
+    v32.push_back(i * 3 + (i & 1));
+  EXPECT_THAT(PackAndUnpack(v32, &packed), ElementsAreArray(v32));
+  EXPECT_LT(packed, v32.size() / 2);
+
+  vector<uint64_t> v64;
+  std::uniform_int_distribution<uint64_t> wide;
+  for (unsigned i = 0; i < 777; ++i)
+    v64.push_back(i % 10 ? (1ULL << 40) + i : wide(re));
+  EXPECT_THAT(PackAndUnpack(v64, &packed), ElementsAreArray(v64));
+
+  v64.assign(300, 0);
+  EXPECT_THAT(PackAndUnpack(v64, &packed), ElementsAreArray(v64));
+  EXPECT_LT(packed, 40);
+}
+
 TEST(CPP, StrictAliasBug) {
   std::vector<uint64> d(32);
 
@@ -211,6 +261,48 @@ TYPED_TEST(SetEncoderTest, Fallback) {
 
 }
 
+TYPED_TEST(SetEncoderTest, Packed) {
+  using UT = typename TestFixture::type_t;
+  if (!TestFixture::use_sequence) {
+    this->encoder_.DisableSeqDictionary();
+  }
+
+  // Too random for the literal dictionary, but packs into 20 bits.
+  std::default_random_engine re;
+  std::uniform_int_distribution<UT> dis(1 << 30, (1 << 30) + (1 << 20));
+  vector<UT> expected;
+  for (unsigned i = 0; i < 20000; ++i) {
+    this->arr_.clear();
+    for (unsigned j = 0; j < 20; ++j) {
+      this->arr_.push_back(dis(re));
+    }
+    this->encoder_.Add(this->arr_.data(), this->arr_.size());
+    expected.insert(expected.end(), this->arr_.begin(), this->arr_.end());
+  }
+  this->encoder_.Flush();
+
+  string dic_enc;
+  ASSERT_FALSE(this->encoder_.GetDictSerialized(&dic_enc));
+  EXPECT_LT(this->encoder_.Cost(), expected.size() * 3);
+
+  const auto& cb_vec = this->encoder_.compressed_blocks();
+  ASSERT_GT(cb_vec.size(), 1);
+
+  vector<UT> actual;
+  for (unsigned i = 0; i < cb_vec.size(); ++i) {
+    uint32_t consumed = 0;
+    int res = this->decoder_.Decompress(cb_vec[i], &consumed);
+    ASSERT_EQ(i + 1 == cb_vec.size() ? 0 : 1, res);
+    ASSERT_EQ(cb_vec[i].size(), consumed);
+    ASSERT_TRUE(cb_vec[i][2] & BlockHeader::kPackedBit);
+
+    for (auto page = this->decoder_.GetNextIntPage(); !page.empty();
+         page = this->decoder_.GetNextIntPage()) {
+      actual.insert(actual.end(), page.begin(), page.end());
+    }
+  }
+  EXPECT_EQ(expected, actual);
+}
 
 TYPED_TEST(SetEncoderTest, FewBlocks) {
   if (!TestFixture::use_sequence) {
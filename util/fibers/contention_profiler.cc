@@ -0,0 +1,95 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/fibers/contention_profiler.h"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "absl/debugging/stacktrace.h"
+#include "absl/strings/str_cat.h"
+#include "base/walltime.h"
+
+namespace util {
+namespace fibers_ext {
+
+using namespace std;
+
+namespace {
+
+constexpr int kMaxFrames = 32;
+
+struct Site {
+  uint64_t count = 0;
+  uint64_t delay_ns = 0;
+};
+
+// The raw frames are the keys.
+mutex profile_mu;
+unordered_map<string, Site> profile_sites;
+unsigned profile_period = 0;
+
+thread_local unsigned calls_to_sample = 0;
+
+}  // namespace
+
+atomic_uint ContentionProfiler::period_{0};
+
+void ContentionProfiler::Enable(unsigned period) {
+  lock_guard<mutex> lk(profile_mu);
+  profile_sites.clear();
+  profile_period = period;
+  period_.store(period, memory_order_relaxed);
+}
+
+void ContentionProfiler::Disable() {
+  period_.store(0, memory_order_relaxed);
+}
+
+uint64_t ContentionProfiler::SampleStart() {
+  if (calls_to_sample > 0) {
+    --calls_to_sample;
+    return 0;
+  }
+  unsigned period = period_.load(memory_order_relaxed);
+  if (period == 0)  // disabled meanwhile.
+    return 0;
+  calls_to_sample = period - 1;
+  return base::GetClockNanos<CLOCK_MONOTONIC>();
+}
+
+void ContentionProfiler::Finish(uint64_t start_ns) {
+  uint64_t delay = base::GetClockNanos<CLOCK_MONOTONIC>() - start_ns;
+
+  // Skips this function, the lock calls are usually inlined.
+  void* frames[kMaxFrames];
+  int depth = absl::GetStackTrace(frames, kMaxFrames, 1);
+  string key(reinterpret_cast<const char*>(frames), depth * sizeof(void*));
+
+  lock_guard<mutex> lk(profile_mu);
+  Site& site = profile_sites[key];
+  ++site.count;
+  site.delay_ns += delay;
+}
+
+string ContentionProfiler::Dump() {
+  string res = "--- contention:\ncycles/second=1000000000\n";
+
+  lock_guard<mutex> lk(profile_mu);
+  absl::StrAppend(&res, "sampling period=", profile_period, "\n");
+  for (const auto& k_v : profile_sites) {
+    absl::StrAppend(&res, k_v.second.delay_ns, " ", k_v.second.count, " @");
+    size_t depth = k_v.first.size() / sizeof(void*);
+    for (size_t i = 0; i < depth; ++i) {
+      uintptr_t pc;
+      memcpy(&pc, k_v.first.data() + i * sizeof(pc), sizeof(pc));
+      absl::StrAppend(&res, " 0x", absl::Hex(pc));
+    }
+    res.push_back('\n');
+  }
+  return res;
+}
+
+}  // namespace fibers_ext
+}  // namespace util
@@ -0,0 +1,43 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace util {
+namespace fibers_ext {
+
+/*
+  Contention profile of the fiber mutexes, i.e. of the lock calls that had to suspend.
+  While enabled, 1 of every period suspended calls per thread records its stack and the time
+  it was blocked. The mutexes pay for a single relaxed load when they suspend and profiling
+  is disabled, and they pay nothing when they do not suspend.
+*/
+class ContentionProfiler {
+ public:
+  // Starts a new profile. period must be positive.
+  static void Enable(unsigned period);
+  static void Disable();
+
+  static bool enabled() { return period_.load(std::memory_order_relaxed) != 0; }
+
+  // Returns the profile in the legacy contention format of pprof, with the blocking times in
+  // nanoseconds. The counts and the times are not scaled by the sampling period.
+  static std::string Dump();
+
+  // Called by the mutexes before they suspend. Returns the start time of a sampled call
+  // that must be passed to Finish() after it resumes, or 0.
+  static uint64_t MaybeStart() { return enabled() ? SampleStart() : 0; }
+  static void Finish(uint64_t start_ns);
+
+ private:
+  static uint64_t SampleStart();
+
+  static std::atomic_uint period_;
+};
+
+}  // namespace fibers_ext
+}  // namespace util
@@ -6,6 +6,9 @@
 // https://software.intel.com/en-us/forums/intel-threading-building-blocks/topic/299245
 #pragma once
 
+#include <boost/fiber/detail/cpu_relax.hpp>
+
+#include "base/event_count.h"  // for folly::detail::canSpin
 #include "base/macros.h"
 #include "util/fibers/condition_variable.h"
 
@@ -18,6 +21,10 @@ namespace fibers_ext {
 // spurious waits on the consumer side.
 // This class has another wonderful property: notification thread does not need to lock mutex,
 // which means it can be used from the io_context (ring0) fiber.
+// await() spins briefly before suspending because the notifying side is often another thread
+// that satisfies the condition within nanoseconds. The spin blocks the other fibers of the
+// thread, therefore it adapts to the recent waits: it doubles when spinning succeeds and halves
+// when the fiber had to suspend, e.g. when the notifying fiber runs in the same thread.
 class EventCount {
   using spinlock_lock_t = ::boost::fibers::detail::spinlock_lock;
   using wait_queue_t = ::boost::fibers::context::wait_queue_t;
@@ -71,6 +78,9 @@ class EventCount {
  private:
   friend class Key;
 
+  // Returns true if condition() became true within the spin budget.
+  template <typename Condition> bool spin(Condition& condition);
+
   static bool should_switch(::boost::fibers::context* ctx, std::intptr_t expected) {
     return ctx->twstatus.compare_exchange_strong(expected, static_cast<std::intptr_t>(-1),
                                                  std::memory_order_acq_rel) ||
@@ -95,6 +105,12 @@ class EventCount {
   static constexpr size_t kEpochShift = 32;
   static constexpr uint64_t kAddEpoch = uint64_t(1) << kEpochShift;
   static constexpr uint64_t kWaiterMask = kAddEpoch - 1;
+
+  static constexpr uint32_t kMinSpins = 8;
+  static constexpr uint32_t kMaxSpins = 1 << 10;
+
+  // The spin budget of await(), in pause instructions.
+  std::atomic<uint32_t> spin_limit_{kMinSpins};
 };
 
 inline bool EventCount::notify() noexcept {
@@ -171,9 +187,35 @@ inline void EventCount::wait(uint32_t epoch) noexcept {
   }
 }
 
+template <typename Condition> bool EventCount::spin(Condition& condition) {
+  if (!folly::detail::canSpin())
+    return false;
+
+  uint32_t limit = spin_limit_.load(std::memory_order_relaxed);
+  uint64_t epoch = val_.load(std::memory_order_acquire) >> kEpochShift;
+
+  // Polls the epoch, which the notifiers bump, rather than the data behind condition().
+  for (uint32_t i = 0; i < limit; ++i) {
+    cpu_relax();  // a macro of boost fibers.
+    uint64_t current = val_.load(std::memory_order_acquire) >> kEpochShift;
+    if (current == epoch)
+      continue;
+    if (condition()) {
+      if (limit < kMaxSpins)
+        spin_limit_.store(limit * 2, std::memory_order_relaxed);
+      return true;
+    }
+    epoch = current;
+  }
+
+  if (limit > kMinSpins)
+    spin_limit_.store(limit / 2, std::memory_order_relaxed);
+  return false;
+}
+
 // Returns true if had to preempt, false if no preemption happenned.
 template <typename Condition> bool EventCount::await(Condition condition) {
-  if (condition())
+  if (condition() || spin(condition))
     return false;  // fast path
 
   // condition() is the only thing that may throw, everything else is
@@ -3,8 +3,13 @@
 //
 #include "util/fibers/fiberqueue_threadpool.h"
 
+#include <chrono>
+#include <thread>
+
 #include "absl/strings/str_cat.h"
+#include "base/cpu_topology.h"
 #include "base/pthread_utils.h"
+#include "base/walltime.h"
 
 namespace util {
 namespace fibers_ext {
@@ -50,20 +55,28 @@ void FiberQueue::Shutdown() {
   pull_ec_.notify();
 }
 
-FiberQueueThreadPool::FiberQueueThreadPool(unsigned num_threads, unsigned queue_size) {
+FiberQueueThreadPool::FiberQueueThreadPool(unsigned num_threads, unsigned queue_size,
+                                           int numa_node) {
+  if (numa_node >= 0) {
+    cpus_ = base::CpuTopology::Get().NodeCpus(numa_node);
+    LOG_IF(WARNING, cpus_.empty()) << "No cpus on NUMA node " << numa_node;
+  }
+
   if (num_threads == 0) {
-    num_threads = std::thread::hardware_concurrency();
+    num_threads = cpus_.empty() ? std::thread::hardware_concurrency() : cpus_.size();
   }
   worker_size_ = num_threads;
   workers_.reset(new Worker[num_threads]);
 
+  // Every worker allocates its queue after it is pinned, hence we wait for all of them.
+  BlockingCounter bc(num_threads);
   for (unsigned i = 0; i < num_threads; ++i) {
     string name = absl::StrCat("fq_pool", i);
 
-    auto fn = std::bind(&FiberQueueThreadPool::WorkerFunction, this, i);
-    workers_[i].q.reset(new FiberQueue(queue_size));
+    auto fn = std::bind(&FiberQueueThreadPool::WorkerFunction, this, i, queue_size, bc);
     workers_[i].tid = base::StartThread(name.c_str(), fn);
   }
+  bc.Wait();
 }
 
 FiberQueueThreadPool::~FiberQueueThreadPool() {
@@ -72,10 +85,19 @@ FiberQueueThreadPool::~FiberQueueThreadPool() {
   Shutdown();
 }
 
+void FiberQueueThreadPool::EnableElasticSizing(unsigned max_extra_threads,
+                                               unsigned max_latency_usec) {
+  CHECK(!extra_);
+  max_extra_ = max_extra_threads;
+  max_latency_ns_ = uint64_t(max_latency_usec) * 1000;
+  extra_.reset(new ExtraWorker[max_extra_threads]);
+}
+
 void FiberQueueThreadPool::Shutdown() {
   if (!workers_)
     return;
 
+  is_closed_.store(true, memory_order_seq_cst);
   for (size_t i = 0; i < worker_size_; ++i) {
     workers_[i].q->is_closed_.store(true, memory_order_seq_cst);
     workers_[i].q->pull_ec_.notifyAll();
@@ -86,11 +108,103 @@ void FiberQueueThreadPool::Shutdown() {
     pthread_join(w.tid, nullptr);
   }
 
+  for (unsigned i = 0; i < max_extra_; ++i) {
+    if (extra_[i].state.load(memory_order_acquire) != EXTRA_FREE)
+      pthread_join(extra_[i].tid, nullptr);
+  }
+
   workers_.reset();
+  extra_.reset();
+  max_extra_ = 0;
   VLOG(1) << "FiberQueueThreadPool::ShutdownEnd";
 }
 
-void FiberQueueThreadPool::WorkerFunction(unsigned index) {
+void FiberQueueThreadPool::OnStealableAdded(size_t index) {
+  Worker& w = workers_[index];
+  w.q->pull_ec_.notify();
+
+  // If the worker is idle, it will run the task. Otherwise, it wakes a peer once it picks
+  // its next task. However, it may be blocked in its current task, hence we wake a peer too.
+  if (!w.idle.load(memory_order_acquire) && !WakeIdlePeer(index))
+    MaybeAddExtraWorker(index);
+}
+
+bool FiberQueueThreadPool::WakeIdlePeer(size_t index) {
+  for (size_t i = 1; i < worker_size_; ++i) {
+    Worker& peer = workers_[wrapped_idx(index + i)];
+    bool expected = true;
+
+    // Only one thread wakes the idle peer.
+    if (peer.idle.load(memory_order_relaxed) && peer.idle.compare_exchange_strong(expected, false)) {
+      peer.q->pull_ec_.notify();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool FiberQueueThreadPool::PopStealable(size_t index, Func* func) {
+  for (size_t i = 0; i < worker_size_; ++i) {
+    Worker& victim = workers_[wrapped_idx(index + i)];
+    if (victim.stealable_size.load(memory_order_acquire) == 0)
+      continue;
+    if (victim.stealable->try_dequeue(*func)) {
+      victim.stealable_size.fetch_sub(1, memory_order_acq_rel);
+      push_ec_.notify();
+      return true;
+    }
+  }
+  return false;
+}
+
+void FiberQueueThreadPool::MaybeAddExtraWorker(size_t index) {
+  uint64_t start_ns = workers_[index].task_start_ns.load(memory_order_relaxed);
+  if (max_extra_ == 0 || start_ns == 0 ||
+      base::GetClockNanos<CLOCK_MONOTONIC>() - start_ns < max_latency_ns_)
+    return;
+
+  for (unsigned i = 0; i < max_extra_; ++i) {
+    ExtraWorker& extra = extra_[i];
+    uint8_t state = extra.state.load(memory_order_acquire);
+    if (state == EXTRA_RUNNING || !extra.state.compare_exchange_strong(state, EXTRA_RUNNING))
+      continue;
+
+    // The previous thread of the slot has already exited.
+    if (state == EXTRA_EXITED)
+      pthread_join(extra.tid, nullptr);
+
+    num_extra_.fetch_add(1, memory_order_relaxed);
+    string name = absl::StrCat("fq_extra", i);
+    extra.tid = base::StartThread(name.c_str(), [this, i] { ExtraWorkerFunction(i); });
+    VLOG(1) << "Started extra worker " << i;
+    return;
+  }
+}
+
+void FiberQueueThreadPool::RunTask(std::atomic<uint64_t>* start_ns, Func* func) {
+  if (max_extra_)
+    start_ns->store(base::GetClockNanos<CLOCK_MONOTONIC>(), memory_order_relaxed);
+  try {
+    (*func)();
+  } catch (std::exception& e) {
+    LOG(FATAL) << "Exception " << e.what();
+  }
+  func->Reset();  // releases the captured state before the worker waits for the next task.
+  if (max_extra_)
+    start_ns->store(0, memory_order_relaxed);
+}
+
+void FiberQueueThreadPool::WorkerFunction(unsigned index, unsigned queue_size,
+                                          BlockingCounter bc) {
+  Worker& w = workers_[index];
+  if (!cpus_.empty()) {
+    int rc = base::SetThreadAffinity(pthread_self(), cpus_);
+    LOG_IF(WARNING, rc) << "Error calling pthread_setaffinity_np: " << strerror(rc);
+  }
+  w.q.reset(new FiberQueue(queue_size));
+  w.stealable.reset(new FuncQ(queue_size));
+  bc.Dec();
+
   /*
   sched_param param;
   param.sched_priority = 1;
@@ -99,10 +213,72 @@ void FiberQueueThreadPool::WorkerFunction(unsigned index) {
     LOG(INFO) << "Could not set FIFO priority in fiber-queue-thread";
   }*/
 
-  workers_[index].q->Run();
+  // Similar to FiberQueue::Run, but the worker also runs its stealable tasks and steals
+  // the tasks of the others.
+  FiberQueue* q = w.q.get();
+  bool is_closed = false;
+  Func func;
+
+  auto cb = [&] {
+    if (q->queue_.try_dequeue(func)) {
+      q->push_ec_.notify();
+      return true;
+    }
+
+    if (PopStealable(index, &func))
+      return true;
+
+    if (q->is_closed_.load(std::memory_order_acquire)) {
+      is_closed = true;
+      return true;
+    }
+    return false;
+  };
+
+  while (true) {
+    w.idle.store(true, memory_order_release);
+    q->pull_ec_.await(cb);
+    w.idle.store(false, memory_order_relaxed);
+
+    if (is_closed)
+      break;
+
+    // The producers could see us idle before we picked this task, so we let a peer run
+    // the stealable tasks that wait behind it.
+    if (w.stealable_size.load(memory_order_acquire) > 0)
+      WakeIdlePeer(index);
+    RunTask(&w.task_start_ns, &func);
+  }
 
   VLOG(1) << "FiberQueueThreadPool::Exit";
 }
 
+void FiberQueueThreadPool::ExtraWorkerFunction(unsigned slot) {
+  // Extra workers do not sleep on the queues, so that no producer waits for them to wake up.
+  // Instead they poll for a while before they exit.
+  constexpr unsigned kIdlePolls = 10;
+
+  if (!cpus_.empty()) {
+    int rc = base::SetThreadAffinity(pthread_self(), cpus_);
+    LOG_IF(WARNING, rc) << "Error calling pthread_setaffinity_np: " << strerror(rc);
+  }
+
+  std::atomic<uint64_t> start_ns{0};
+  Func func;
+  for (unsigned polls = 0; polls < kIdlePolls && !is_closed_.load(memory_order_relaxed);) {
+    if (PopStealable(slot % worker_size_, &func)) {
+      RunTask(&start_ns, &func);
+      polls = 0;
+    } else {
+      ++polls;
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  num_extra_.fetch_sub(1, memory_order_relaxed);
+  VLOG(1) << "Extra worker " << slot << " exits";
+  extra_[slot].state.store(EXTRA_EXITED, memory_order_release);
+}
+
 }  // namespace fibers_ext
 }  // namespace util
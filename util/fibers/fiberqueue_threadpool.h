@@ -3,8 +3,12 @@
 //
 #pragma once
 
+#include <vector>
+
+#include "base/integral_types.h"
 #include "base/mpmc_bounded_queue.h"
 #include "util/fibers/fibers_ext.h"
+#include "util/fibers/inline_task.h"
 
 namespace util {
 namespace fibers_ext {
@@ -14,11 +18,12 @@ class FiberQueueThreadPool;
 
 // MPSC task-queue that is consumed by a single consumer loop.
 // The loop is exposed as a function to incorporate into a thread or fiber of your choice.
+// The queue cells store the callbacks inline, so submitting small callbacks does not allocate.
 class FiberQueue {
   friend class FiberQueueThreadPool;
 
  public:
-  typedef std::function<void()> Func;
+  typedef InlineTask Func;
 
   explicit FiberQueue(unsigned queue_size = 128);
   FiberQueue();
@@ -72,14 +77,28 @@ class FiberQueue {
   std::atomic_bool is_closed_{false};
 };
 
-// This thread pool has a global fiber-friendly queue for incoming tasks.
+// This thread pool has fiber-friendly queues for incoming tasks.
+// The tasks that are added with a worker index run on that worker, in the order of their
+// submission. The rest are queued at the workers round-robin and the idle workers steal them
+// from the busy ones, so a slow task does not delay the tasks queued behind it while other
+// workers are idle.
 class FiberQueueThreadPool {
  public:
-  typedef std::function<void()> Func;
+  typedef InlineTask Func;
 
-  explicit FiberQueueThreadPool(unsigned num_threads = 0, unsigned queue_size = 128);
+  // If numa_node is not negative, the workers run on the cpus of that node and allocate
+  // their queues there, num_threads = 0 then means the number of the cpus of the node.
+  // Pass IoContext::numa_node() to co-locate the pool with the IO thread that uses it.
+  explicit FiberQueueThreadPool(unsigned num_threads = 0, unsigned queue_size = 128,
+                                int numa_node = -1);
   ~FiberQueueThreadPool();
 
+  // Lets the pool start up to max_extra_threads temporary workers when all the workers are
+  // busy and the worker that got a task has been running its current task for longer than
+  // max_latency_usec. The temporary workers run only the tasks without worker index and exit
+  // once there is nothing to steal. Must be called before any task is added.
+  void EnableElasticSizing(unsigned max_extra_threads, unsigned max_latency_usec = 2000);
+
   template <typename Func> auto Await(Func&& f) -> decltype(f()) {
     Done done;
     using ResultType = decltype(f());
@@ -110,14 +129,15 @@ class FiberQueueThreadPool {
 
   template <typename F> void Add(F&& f) {
     size_t start = next_index_.fetch_add(1, std::memory_order_relaxed) % worker_size_;
-    Worker& main_w = workers_[start];
     while (true) {
-      EventCount::Key key = main_w.q->push_ec_.prepareWait();
-      if (AddAnyWorker(start, std::forward<F>(f))) {
+      EventCount::Key key = push_ec_.prepareWait();
+      size_t index = AddAnyWorker(start, std::forward<F>(f));
+      if (index < worker_size_) {
+        OnStealableAdded(index);
         break;
       }
 
-      main_w.q->push_ec_.wait(key.epoch());
+      push_ec_.wait(key.epoch());
     }
   }
 
@@ -128,28 +148,73 @@ class FiberQueueThreadPool {
 
   void Shutdown();
 
+  // The number of the temporary workers that are currently running.
+  unsigned extra_threads() const { return num_extra_.load(std::memory_order_relaxed); }
+
  private:
+  using FuncQ = FiberQueue::FuncQ;
+
   size_t wrapped_idx(size_t i) { return i < worker_size_ ? i : i - worker_size_; }
 
-  template <typename F> bool AddAnyWorker(size_t start, F&& f) {
+  // Returns the index of the worker that got f or worker_size_ if all the queues are full.
+  template <typename F> size_t AddAnyWorker(size_t start, F&& f) {
     for (size_t i = 0; i < worker_size_; ++i) {
-      auto& w = workers_[wrapped_idx(start + i)];
-      if (w.q->TryAdd(std::forward<F>(f))) {
-        return true;
+      size_t index = wrapped_idx(start + i);
+      Worker& w = workers_[index];
+
+      // stealable_size is increased first so it never falls below the queue size.
+      w.stealable_size.fetch_add(1, std::memory_order_acq_rel);
+      if (w.stealable->try_enqueue(std::forward<F>(f))) {
+        return index;
       }
+      w.stealable_size.fetch_sub(1, std::memory_order_relaxed);
     }
-    return false;
+    return worker_size_;
   }
 
-  void WorkerFunction(unsigned index);
+  // Wakes the worker that got a stealable task or, if it's busy, an idle one.
+  void OnStealableAdded(size_t index);
+
+  // Returns false if no worker except "index" is idle.
+  bool WakeIdlePeer(size_t index);
+
+  // Pops a stealable task of the worker "index" or of the other workers.
+  bool PopStealable(size_t index, Func* func);
 
-  struct Worker {
+  void MaybeAddExtraWorker(size_t index);
+  void RunTask(std::atomic<uint64_t>* start_ns, Func* func);
+
+  void WorkerFunction(unsigned index, unsigned queue_size, BlockingCounter bc);
+  void ExtraWorkerFunction(unsigned slot);
+
+  struct alignas(base::CACHE_LINE_SIZE) Worker {
     pthread_t tid;
-    std::unique_ptr<FiberQueue> q;
+    std::unique_ptr<FiberQueue> q;     // the tasks pinned to the worker.
+    std::unique_ptr<FuncQ> stealable;  // the tasks that any worker may run.
+    std::atomic<size_t> stealable_size{0};  // not smaller than the size of stealable.
+    std::atomic_bool idle{false};      // waits for tasks.
+    std::atomic<uint64_t> task_start_ns{0};  // 0 if not running a task, see elastic sizing.
+  };
+
+  enum ExtraState : uint8_t { EXTRA_FREE, EXTRA_RUNNING, EXTRA_EXITED };
+
+  struct ExtraWorker {
+    pthread_t tid;
+    std::atomic<uint8_t> state{EXTRA_FREE};
   };
 
   std::unique_ptr<Worker[]> workers_;
   size_t worker_size_;
+  std::vector<unsigned> cpus_;  // the affinity of the workers, empty if they are not pinned.
+
+  // Producers of stealable tasks wait on it when all the queues are full.
+  EventCount push_ec_;
+
+  std::unique_ptr<ExtraWorker[]> extra_;
+  unsigned max_extra_ = 0;
+  uint64_t max_latency_ns_ = 0;
+  std::atomic_uint num_extra_{0};
+  std::atomic_bool is_closed_{false};
 
   std::atomic_ulong next_index_{0};
 };
@@ -4,8 +4,16 @@
 #include "base/gtest.h"
 #include "base/walltime.h"
 
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
 #include "util/fibers/fiberqueue_threadpool.h"
+#include "util/fibers/shared_mutex.h"
 #include "util/fibers/simple_channel.h"
+#include "util/fibers/stack_pool.h"
 
 using namespace boost;
 
@@ -40,6 +48,69 @@ TEST_F(FibersTest, SimpleChannel) {
   fb.join();
 }
 
+TEST_F(FibersTest, SimpleChannelBulk) {
+  SimpleChannel<int> channel(4);
+  constexpr int kCount = 100;
+
+  std::thread t([&] {
+    int items[7];
+    for (int i = 0; i < kCount; i += 7) {
+      int n = std::min(7, kCount - i);
+      for (int j = 0; j < n; ++j)
+        items[j] = i + j;
+      channel.PushBulk(items, n);
+    }
+    channel.StartClosing();
+  });
+
+  int dest[5], expected = 0;
+  while (size_t n = channel.PopBulk(dest, 5)) {
+    ASSERT_LE(n, 5u);
+    for (size_t j = 0; j < n; ++j)
+      ASSERT_EQ(expected++, dest[j]);
+  }
+  EXPECT_EQ(kCount, expected);
+  t.join();
+}
+
+TEST_F(FibersTest, MPSCChannel) {
+  constexpr unsigned kThreads = 4, kCount = 1000;
+  MPSCChannel<unsigned> channel(16);
+  std::thread ts[kThreads];
+  for (unsigned i = 0; i < kThreads; ++i) {
+    ts[i] = std::thread([&, i] {
+      for (unsigned j = 0; j < kCount; j += 2) {
+        if (j % 4) {
+          unsigned items[2] = {i * kCount + j, i * kCount + j + 1};
+          channel.PushBulk(items, 2);
+        } else {
+          channel.Push(i * kCount + j);
+          channel.Push(i * kCount + j + 1);
+        }
+      }
+    });
+  }
+
+  // Items of every producer arrive in order.
+  std::vector<unsigned> next(kThreads, 0);
+  unsigned dest[8];
+  for (unsigned total = 0; total < kThreads * kCount;) {
+    size_t n = channel.PopBulk(dest, 8);
+    ASSERT_GT(n, 0u);
+    for (size_t j = 0; j < n; ++j) {
+      unsigned producer = dest[j] / kCount;
+      ASSERT_EQ(next[producer]++, dest[j] % kCount);
+    }
+    total += n;
+  }
+
+  for (auto& t : ts)
+    t.join();
+  channel.StartClosing();
+  unsigned val;
+  EXPECT_FALSE(channel.Pop(val));
+}
+
 TEST_F(FibersTest, EventCount) {
   EventCount ec;
   bool signal = false;
@@ -89,6 +160,80 @@ TEST_F(FibersTest, FQTP) {
   }
 }
 
+TEST_F(FibersTest, FQTPStealing) {
+  FiberQueueThreadPool pool(2, 16);
+  Done blocked;
+  pool.Add(0, [blocked]() mutable { blocked.Wait(); });
+
+  // Half of the tasks are queued at the blocked worker and the other one steals them.
+  for (unsigned i = 0; i < 100; ++i) {
+    ASSERT_EQ(i, pool.Await([=] { return i; }));
+  }
+  blocked.Notify();
+}
+
+TEST_F(FibersTest, FQTPElastic) {
+  FiberQueueThreadPool pool(1, 16);
+  pool.EnableElasticSizing(1, 1000);
+  Done blocked;
+  pool.Add(0, [blocked]() mutable { blocked.Wait(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+  // The only worker is blocked for longer than the latency limit.
+  EXPECT_EQ(5, pool.Await([] { return 5; }));
+  EXPECT_EQ(1u, pool.extra_threads());
+  blocked.Notify();
+
+  // The extra worker exits when it is idle.
+  while (pool.extra_threads() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(6, pool.Await([] { return 6; }));
+}
+
+TEST_F(FibersTest, InlineTask) {
+  auto counter = std::make_shared<int>(0);
+  char big[128] = {1};
+
+  InlineTask small_task([counter] { ++*counter; });
+  InlineTask big_task([counter, big] { *counter += big[0]; });
+
+  InlineTask moved(std::move(big_task));
+  EXPECT_FALSE(big_task);
+  small_task();
+  moved();
+  EXPECT_EQ(2, *counter);
+
+  moved = std::move(small_task);
+  moved();
+  EXPECT_EQ(3, *counter);
+  EXPECT_EQ(2, counter.use_count());
+  moved.Reset();
+  EXPECT_EQ(1, counter.use_count());
+}
+
+TEST_F(FibersTest, PooledStack) {
+  PooledStack stack(32 << 10);
+  EXPECT_EQ(32u << 10, stack.size());
+
+  uintptr_t addr[2];
+  unsigned cached = PooledStack::CachedCount();
+  for (unsigned i = 0; i < 2; ++i) {
+    fibers::fiber(std::allocator_arg, stack, [&, i] {
+      char buf[1024];
+      addr[i] = reinterpret_cast<uintptr_t>(buf);
+      memset(buf, 0, sizeof(buf));
+    }).join();
+
+    // Terminated fibers are released by the dispatcher, let it run.
+    this_fiber::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(cached + 1, PooledStack::CachedCount());
+  }
+
+  // The second fiber reused the stack of the first.
+  EXPECT_EQ(addr[0], addr[1]);
+}
+
 TEST_F(FibersTest, SimpleChannelDone) {
   SimpleChannel<std::function<void()>> s(2);
   std::thread t([&] {
@@ -111,5 +256,90 @@ TEST_F(FibersTest, SimpleChannelDone) {
 
 
 
+// Fibers of several threads take the lock randomly as readers or writers and check that
+// writers exclude everybody.
+template <typename Mutex> void TestSharedMutex(Mutex* mu) {
+  constexpr unsigned kThreads = 4, kFibers = 4, kIters = 2000;
+  std::atomic_int readers{0}, writers{0};
+  unsigned value = 0;
+  std::atomic_uint writes{0};
+
+  std::thread threads[kThreads];
+  for (unsigned t = 0; t < kThreads; ++t) {
+    threads[t] = std::thread([&, t] {
+      fibers::fiber fbs[kFibers];
+      for (unsigned f = 0; f < kFibers; ++f) {
+        fbs[f] = fibers::fiber([&, seed = t * kFibers + f] {
+          for (unsigned i = 0; i < kIters; ++i) {
+            if ((i + seed) % 8 == 0) {
+              std::unique_lock<Mutex> lk(*mu);
+              EXPECT_EQ(1, ++writers);
+              EXPECT_EQ(0, readers.load());
+              ++value;
+              this_fiber::yield();
+              --writers;
+              ++writes;
+            } else {
+              std::shared_lock<Mutex> lk(*mu);
+              ++readers;
+              EXPECT_EQ(0, writers.load());
+              this_fiber::yield();
+              --readers;
+            }
+          }
+        });
+      }
+      for (auto& fb : fbs)
+        fb.join();
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  EXPECT_EQ(writes.load(), value);
+  EXPECT_GT(value, 0);
+}
+
+TEST_F(FibersTest, SharedMutex) {
+  SharedMutex mu;
+  TestSharedMutex(&mu);
+
+  SharedMutex spin_mu(100);
+  TestSharedMutex(&spin_mu);
+
+  EXPECT_TRUE(mu.try_lock_shared());
+  EXPECT_FALSE(mu.try_lock());
+  mu.unlock_shared();
+  EXPECT_TRUE(mu.try_lock());
+  EXPECT_FALSE(mu.try_lock_shared());
+  mu.unlock();
+}
+
+TEST_F(FibersTest, ShardedSharedMutex) {
+  ShardedSharedMutex mu(3);
+  TestSharedMutex(&mu);
+}
+
+TEST_F(FibersTest, ContentionProfiler) {
+  ContentionProfiler::Enable(1);
+  SharedMutex mu;
+  mu.lock();
+  fibers::fiber fb([&] {
+    mu.lock_shared();
+    mu.unlock_shared();
+  });
+  this_fiber::sleep_for(std::chrono::milliseconds(1));
+  mu.unlock();
+  fb.join();
+  ContentionProfiler::Disable();
+
+  std::string profile = ContentionProfiler::Dump();
+  EXPECT_EQ(0, profile.find("--- contention:\n")) << profile;
+
+  // A line of "<delay> <count> @ <frames>" per stack.
+  size_t pos = profile.find(" 1 @ 0x");
+  EXPECT_NE(std::string::npos, pos) << profile;
+}
+
 }  // namespace fibers_ext
 }  // namespace util
@@ -0,0 +1,117 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace util {
+namespace fibers_ext {
+
+/*
+  Move-only void() callable that keeps small functors inside the object itself.
+  Unlike std::function, tasks that capture up to kInlineSize bytes do not allocate, hence
+  the queues of InlineTask cells serve as preallocated storage for the submitted callbacks.
+  Bigger functors are moved to the heap.
+*/
+class InlineTask {
+ public:
+  static constexpr size_t kInlineSize = 48;
+
+  InlineTask() = default;
+
+  template <typename F,
+            typename = std::enable_if_t<!std::is_same<std::decay_t<F>, InlineTask>::value>>
+  InlineTask(F&& f) {
+    using T = std::decay_t<F>;
+    if (IsInline<T>()) {
+      new (&storage_) T(std::forward<F>(f));
+      ops_ = &InlineOps<T>::ops;
+    } else {
+      *reinterpret_cast<T**>(&storage_) = new T(std::forward<F>(f));
+      ops_ = &HeapOps<T>::ops;
+    }
+  }
+
+  InlineTask(InlineTask&& o) noexcept { MoveFrom(&o); }
+
+  InlineTask& operator=(InlineTask&& o) noexcept {
+    if (this != &o) {
+      Reset();
+      MoveFrom(&o);
+    }
+    return *this;
+  }
+
+  ~InlineTask() { Reset(); }
+
+  void operator()() { ops_->invoke(&storage_); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  void Reset() {
+    if (ops_) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  template <typename T> static constexpr bool IsInline() {
+    return sizeof(T) <= kInlineSize && alignof(T) <= alignof(Storage) &&
+           std::is_nothrow_move_constructible<T>::value;
+  }
+
+ private:
+  using Storage = std::aligned_storage_t<kInlineSize, alignof(std::max_align_t)>;
+
+  struct Ops {
+    void (*invoke)(void*);
+    void (*move)(void* from, void* to);  // also destroys 'from'.
+    void (*destroy)(void*);
+  };
+
+  template <typename T> struct InlineOps {
+    static T& Get(void* p) { return *reinterpret_cast<T*>(p); }
+
+    static void Invoke(void* p) { Get(p)(); }
+    static void Move(void* from, void* to) {
+      new (to) T(std::move(Get(from)));
+      Get(from).~T();
+    }
+    static void Destroy(void* p) { Get(p).~T(); }
+
+    static constexpr Ops ops{&Invoke, &Move, &Destroy};
+  };
+
+  template <typename T> struct HeapOps {
+    static T*& Get(void* p) { return *reinterpret_cast<T**>(p); }
+
+    static void Invoke(void* p) { (*Get(p))(); }
+    static void Move(void* from, void* to) { Get(to) = Get(from); }
+    static void Destroy(void* p) { delete Get(p); }
+
+    static constexpr Ops ops{&Invoke, &Move, &Destroy};
+  };
+
+  void MoveFrom(InlineTask* o) {
+    ops_ = o->ops_;
+    if (ops_) {
+      ops_->move(&o->storage_, &storage_);
+      o->ops_ = nullptr;
+    }
+  }
+
+  Storage storage_;
+  const Ops* ops_ = nullptr;
+};
+
+template <typename T> constexpr InlineTask::Ops InlineTask::InlineOps<T>::ops;
+template <typename T> constexpr InlineTask::Ops InlineTask::HeapOps<T>::ops;
+
+static_assert(sizeof(InlineTask) == 64, "InlineTask should fit a cache line");
+
+}  // namespace fibers_ext
+}  // namespace util
@@ -0,0 +1,167 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/fiber/detail/cpu_relax.hpp>
+#include <memory>
+
+#include "base/integral_types.h"
+#include "util/fibers/contention_profiler.h"
+#include "util/fibers/event_count.h"
+
+namespace util {
+namespace fibers_ext {
+
+/*
+  Reader-writer lock for fibers of any threads. Satisfies SharedMutex requirements,
+  i.e. works with std::shared_lock and std::unique_lock.
+  Writers are preferred: once a writer waits for the lock, new readers wait until it unlocks,
+  so a stream of readers can not starve the writers.
+  Blocked fibers are suspended via EventCount after trying spin_count more times, which helps
+  when the lock is held for short periods by fibers of other threads.
+  The suspended calls are sampled by ContentionProfiler.
+*/
+class SharedMutex {
+ public:
+  explicit SharedMutex(unsigned spin_count = 0) : spin_count_(spin_count) {}
+
+  SharedMutex(const SharedMutex&) = delete;
+  void operator=(const SharedMutex&) = delete;
+
+  void lock();
+  bool try_lock() {
+    uint32_t expected = 0;
+    return state_.compare_exchange_strong(expected, kWriter, std::memory_order_acquire);
+  }
+  void unlock();
+
+  void lock_shared();
+  bool try_lock_shared();
+  void unlock_shared();
+
+ private:
+  static constexpr uint32_t kWriter = 1U << 31;
+
+  // Spins up to spin_count_ times until f() succeeds.
+  template <typename F> bool Spin(F&& f);
+
+  friend class ShardedSharedMutex;
+
+  std::atomic_uint32_t state_{0};  // kWriter or the number of readers.
+  std::atomic_uint32_t writers_waiting_{0};
+  EventCount readers_ec_, writers_ec_;
+  unsigned spin_count_;
+};
+
+/*
+  SharedMutex that is split into shards, one per thread up to num_shards threads.
+  Readers lock only the shard of their thread, hence the readers of different threads do not
+  contend on the same cache line. Writers lock all the shards, which is proportionally slower.
+  Suits the read-mostly state that is accessed by fibers of many IoContext threads.
+  A fiber must unlock the shared lock in the thread it was locked, i.e. it should not be
+  migratable while holding the lock.
+*/
+class ShardedSharedMutex {
+ public:
+  explicit ShardedSharedMutex(unsigned num_shards, unsigned spin_count = 0);
+
+  void lock();
+  void unlock();
+
+  void lock_shared() { shard().mu.lock_shared(); }
+  bool try_lock_shared() { return shard().mu.try_lock_shared(); }
+  void unlock_shared() { shard().mu.unlock_shared(); }
+
+ private:
+  struct alignas(base::CACHE_LINE_SIZE) Shard {
+    SharedMutex mu;
+  };
+
+  // Threads are assigned to the shards in the order they first access any ShardedSharedMutex.
+  Shard& shard();
+
+  unsigned num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+template <typename F> bool SharedMutex::Spin(F&& f) {
+  for (unsigned i = 0; i < spin_count_; ++i) {
+    cpu_relax();  // a macro of boost fibers.
+    if (f())
+      return true;
+  }
+  return false;
+}
+
+inline void SharedMutex::lock() {
+  if (try_lock() || Spin([this] { return try_lock(); }))
+    return;
+
+  // Blocks new readers until we get the lock.
+  writers_waiting_.fetch_add(1);
+  uint64_t start_ns = ContentionProfiler::MaybeStart();
+  writers_ec_.await([this] { return try_lock(); });
+  writers_waiting_.fetch_sub(1);
+  if (start_ns)
+    ContentionProfiler::Finish(start_ns);
+}
+
+inline void SharedMutex::unlock() {
+  state_.store(0, std::memory_order_release);
+
+  // The waiting writer notifies the readers when it unlocks.
+  if (writers_waiting_.load() == 0 || !writers_ec_.notify())
+    readers_ec_.notifyAll();
+}
+
+inline bool SharedMutex::try_lock_shared() {
+  uint32_t st = state_.load(std::memory_order_relaxed);
+  while ((st & kWriter) == 0 && writers_waiting_.load() == 0) {
+    if (state_.compare_exchange_weak(st, st + 1, std::memory_order_acquire))
+      return true;
+  }
+  return false;
+}
+
+inline void SharedMutex::lock_shared() {
+  if (try_lock_shared() || Spin([this] { return try_lock_shared(); }))
+    return;
+
+  uint64_t start_ns = ContentionProfiler::MaybeStart();
+  readers_ec_.await([this] { return try_lock_shared(); });
+  if (start_ns)
+    ContentionProfiler::Finish(start_ns);
+}
+
+inline void SharedMutex::unlock_shared() {
+  if (state_.fetch_sub(1) == 1 && writers_waiting_.load() > 0)
+    writers_ec_.notify();
+}
+
+inline ShardedSharedMutex::ShardedSharedMutex(unsigned num_shards, unsigned spin_count)
+    : num_shards_(num_shards), shards_(new Shard[num_shards]) {
+  for (unsigned i = 0; i < num_shards_; ++i)
+    shards_[i].mu.spin_count_ = spin_count;
+}
+
+inline void ShardedSharedMutex::lock() {
+  // All writers lock the shards in the same order, hence they do not deadlock.
+  for (unsigned i = 0; i < num_shards_; ++i)
+    shards_[i].mu.lock();
+}
+
+inline void ShardedSharedMutex::unlock() {
+  for (unsigned i = 0; i < num_shards_; ++i)
+    shards_[i].mu.unlock();
+}
+
+inline auto ShardedSharedMutex::shard() -> Shard& {
+  static std::atomic_uint next_index{0};
+  thread_local unsigned thread_index = next_index.fetch_add(1, std::memory_order_relaxed);
+
+  return shards_[thread_index % num_shards_];
+}
+
+}  // namespace fibers_ext
+}  // namespace util
@@ -4,6 +4,7 @@
 #pragma once
 
 #include "base/ProducerConsumerQueue.h"
+#include "base/mpmc_bounded_queue.h"
 
 #include <boost/fiber/context.hpp>
 
@@ -62,9 +63,32 @@ template <typename T> class SimpleChannel {
     return false;
   }
 
+  // Blocking call. Moves n items into the channel and wakes the consumers once per batch
+  // instead of once per item.
+  void PushBulk(T* items, size_t n) noexcept;
+
+  // Non blocking. Moves up to n items into the channel and returns their number.
+  size_t TryPushBulk(T* items, size_t n) noexcept {
+    size_t res = q_.writeBulk(items, n);
+    if (res) {
+      throttled_pushes_ = 0;
+      pop_ec_.notify();
+    }
+    return res;
+  }
+
+  // Blocking call. Pops at least one and up to n items into dest and wakes the producers once.
+  // Returns the number of the popped items or 0 if the channel is closed.
+  size_t PopBulk(T* dest, size_t n);
+
   bool IsClosing() const { return is_closing_.load(std::memory_order_relaxed); }
 
+  // Approximate number of items in the channel.
+  size_t SizeGuess() const { return q_.sizeGuess(); }
+
  private:
+  size_t TryPopBulk(T* dest, size_t n) { return q_.readBulk(dest, n); }
+
   unsigned throttled_pushes_ = 0;
 
   folly::ProducerConsumerQueue<T> q_;
@@ -107,11 +131,162 @@ template <typename T> bool SimpleChannel<T>::Pop(T& dest) {
   }
 }
 
+template <typename T> void SimpleChannel<T>::PushBulk(T* items, size_t n) noexcept {
+  size_t i = 0;
+  while (true) {
+    i += TryPushBulk(items + i, n - i);
+    if (i == n)
+      return;
+
+    EventCount::Key key = push_ec_.prepareWait();
+    if (!q_.isFull())
+      continue;
+    push_ec_.wait(key.epoch());
+  }
+}
+
+template <typename T> size_t SimpleChannel<T>::PopBulk(T* dest, size_t n) {
+  size_t res = TryPopBulk(dest, n);  // fast path
+
+  while (res == 0) {
+    push_ec_.notify();
+    EventCount::Key key = pop_ec_.prepareWait();
+    res = TryPopBulk(dest, n);
+    if (res)
+      break;
+
+    if (is_closing_.load(std::memory_order_acquire)) {
+      return 0;
+    }
+
+    pop_ec_.wait(key.epoch());
+  }
+  push_ec_.notify();
+
+  return res;
+}
+
 template <typename T> void SimpleChannel<T>::StartClosing() {
   // Full barrier, StartClosing performance does not matter.
   is_closing_.store(true, std::memory_order_seq_cst);
   pop_ec_.notifyAll();
 }
 
+/*
+  Multiple producers - single consumer variant of SimpleChannel with the same interface.
+  Fibers of any threads can push, while the fibers of a single thread pop. Built on the
+  lock-free base::mpmc_bounded_queue, hence the producers do not lock each other.
+  Unlike SimpleChannel, every push notifies the consumer, which costs a single atomic add when
+  the consumer is not waiting. PushBulk amortizes it for the batches.
+  StartClosing() should be called after all the producers finished pushing.
+*/
+template <typename T> class MPSCChannel {
+ public:
+  // The capacity is rounded up to a power of 2.
+  explicit MPSCChannel(size_t n) : q_(RoundUp(n)) {}
+
+  template <typename U> void Push(U&& item) noexcept;
+
+  template <typename U> bool TryPush(U&& item) noexcept {
+    if (q_.try_enqueue(std::forward<U>(item))) {
+      pop_ec_.notify();
+      return true;
+    }
+    return false;
+  }
+
+  void PushBulk(T* items, size_t n) noexcept;
+
+  bool Pop(T& dest) { return PopBulk(&dest, 1) == 1; }
+
+  bool TryPop(T& val) {
+    if (q_.try_dequeue(val)) {
+      push_ec_.notify();
+      return true;
+    }
+    return false;
+  }
+
+  size_t PopBulk(T* dest, size_t n);
+
+  void StartClosing() {
+    is_closing_.store(true, std::memory_order_seq_cst);
+    pop_ec_.notifyAll();
+  }
+
+  bool IsClosing() const { return is_closing_.load(std::memory_order_relaxed); }
+
+ private:
+  static size_t RoundUp(size_t n) {
+    size_t res = 2;
+    while (res < n)
+      res *= 2;
+    return res;
+  }
+
+  size_t TryPopBulk(T* dest, size_t n) {
+    size_t i = 0;
+    while (i < n && q_.try_dequeue(dest[i]))
+      ++i;
+    return i;
+  }
+
+  base::mpmc_bounded_queue<T> q_;
+  std::atomic_bool is_closing_{false};
+
+  EventCount push_ec_, pop_ec_;
+};
+
+template <typename T> template <typename U> void MPSCChannel<T>::Push(U&& item) noexcept {
+  if (TryPush(std::forward<U>(item)))  // fast path.
+    return;
+
+  while (true) {
+    EventCount::Key key = push_ec_.prepareWait();
+    if (TryPush(std::forward<U>(item))) {
+      break;
+    }
+    push_ec_.wait(key.epoch());
+  }
+}
+
+template <typename T> void MPSCChannel<T>::PushBulk(T* items, size_t n) noexcept {
+  size_t i = 0;
+  while (true) {
+    for (; i < n && q_.try_enqueue(std::move(items[i])); ++i) {
+    }
+    pop_ec_.notify();
+    if (i == n)
+      return;
+
+    EventCount::Key key = push_ec_.prepareWait();
+    if (q_.try_enqueue(std::move(items[i]))) {
+      ++i;
+      continue;
+    }
+    push_ec_.wait(key.epoch());
+  }
+}
+
+template <typename T> size_t MPSCChannel<T>::PopBulk(T* dest, size_t n) {
+  size_t res = TryPopBulk(dest, n);  // fast path
+
+  while (res == 0) {
+    EventCount::Key key = pop_ec_.prepareWait();
+    res = TryPopBulk(dest, n);
+    if (res)
+      break;
+
+    if (is_closing_.load(std::memory_order_acquire)) {
+      return 0;
+    }
+
+    pop_ec_.wait(key.epoch());
+  }
+  push_ec_.notify();
+
+  return res;
+}
+
 }  // namespace fibers_ext
 }  // namespace util
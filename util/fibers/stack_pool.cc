@@ -0,0 +1,105 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/fibers/stack_pool.h"
+
+#include <sys/mman.h>
+
+#include <boost/context/stack_traits.hpp>
+#include <new>
+
+#include "base/logging.h"
+
+namespace util {
+namespace fibers_ext {
+
+using boost::context::stack_context;
+using boost::context::stack_traits;
+
+namespace {
+
+// Trivially destructible, so that fibers that exit during the thread shutdown still can access
+// it after the thread-local destructors ran.
+struct StackCache {
+  stack_context stacks[PooledStack::kMaxCached];
+  unsigned count;
+  bool closed;
+};
+
+thread_local StackCache stack_cache;
+
+size_t PageSize() {
+  static size_t page_size = stack_traits::page_size();
+  return page_size;
+}
+
+void Unmap(const stack_context& sctx) {
+  // The guard page lies below the stack.
+  char* base = static_cast<char*>(sctx.sp) - sctx.size - PageSize();
+  munmap(base, sctx.size + PageSize());
+}
+
+// Unmaps the cached stacks when the thread exits.
+struct CacheCleaner {
+  ~CacheCleaner() {
+    for (unsigned i = 0; i < stack_cache.count; ++i) {
+      Unmap(stack_cache.stacks[i]);
+    }
+    stack_cache.count = 0;
+    stack_cache.closed = true;
+  }
+};
+
+thread_local CacheCleaner cache_cleaner;
+
+}  // namespace
+
+constexpr unsigned PooledStack::kMaxCached;
+
+PooledStack::PooledStack(size_t size) {
+  if (size == 0)
+    size = stack_traits::default_size();
+  size_t page_size = PageSize();
+  size_ = (size + page_size - 1) / page_size * page_size;
+}
+
+stack_context PooledStack::allocate() {
+  StackCache& cache = stack_cache;
+
+  // The newest stacks are the most likely to be in the cpu caches.
+  for (unsigned i = cache.count; i > 0; --i) {
+    if (cache.stacks[i - 1].size == size_) {
+      stack_context res = cache.stacks[i - 1];
+      cache.stacks[i - 1] = cache.stacks[--cache.count];
+      return res;
+    }
+  }
+
+  size_t total = size_ + PageSize();
+  void* base = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    throw std::bad_alloc();
+  CHECK_EQ(0, mprotect(base, PageSize(), PROT_NONE));
+
+  // Touching the thread-local makes sure the cache is cleaned when the thread exits.
+  (void)&cache_cleaner;
+
+  stack_context res;
+  res.size = size_;
+  res.sp = static_cast<char*>(base) + total;
+  return res;
+}
+
+void PooledStack::deallocate(stack_context& sctx) noexcept {
+  StackCache& cache = stack_cache;
+  if (cache.closed || cache.count == kMaxCached) {
+    Unmap(sctx);
+    return;
+  }
+  cache.stacks[cache.count++] = sctx;
+}
+
+unsigned PooledStack::CachedCount() { return stack_cache.count; }
+
+}  // namespace fibers_ext
+}  // namespace util
@@ -0,0 +1,43 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/context/stack_context.hpp>
+#include <cstddef>
+
+namespace util {
+namespace fibers_ext {
+
+/*
+  StackAllocator for boost fibers that reuses the stacks of the exited fibers.
+  Stacks are mmapped with a guard page below them, like boost::fibers::protected_fixedsize_stack
+  does, and are returned into the cache of the thread that deallocates them. Threads keep up to
+  kMaxCached stacks, the rest are unmapped. Usage:
+
+    fibers::fiber(std::allocator_arg, PooledStack(64 << 10), func);
+
+  or with IoContext::LaunchFiber / IoContext::AsyncFiber that accept PooledStack as their
+  first argument.
+*/
+class PooledStack {
+ public:
+  static constexpr unsigned kMaxCached = 64;
+
+  // The stack size is rounded up to the page size. 0 means the default stack size of boost.
+  explicit PooledStack(size_t size = 0);
+
+  ::boost::context::stack_context allocate();
+  void deallocate(::boost::context::stack_context& sctx) noexcept;
+
+  size_t size() const { return size_; }
+
+  // The number of stacks that the calling thread has cached.
+  static unsigned CachedCount();
+
+ private:
+  size_t size_;
+};
+
+}  // namespace fibers_ext
+}  // namespace util
@@ -0,0 +1,92 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/gce/concurrency_limiter.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace util {
+
+ConcurrencyLimiter::ConcurrencyLimiter(const Options& opts) : opts_(opts) {
+  CHECK_GT(opts_.min_limit, 0);
+  CHECK_LE(opts_.min_limit, opts_.max_limit);
+  CHECK(opts_.decrease > 0 && opts_.decrease < 1) << opts_.decrease;
+
+  exact_limit_ = std::min(std::max(opts_.initial_limit, opts_.min_limit), opts_.max_limit);
+  limit_.store(exact_limit_, std::memory_order_relaxed);
+}
+
+void ConcurrencyLimiter::Acquire() {
+  ec_.await([this] {
+    unsigned cur = in_flight_.load(std::memory_order_acquire);
+    while (cur < limit_.load(std::memory_order_relaxed)) {
+      if (in_flight_.compare_exchange_weak(cur, cur + 1, std::memory_order_acq_rel))
+        return true;
+    }
+    return false;
+  });
+}
+
+void ConcurrencyLimiter::Release(uint64_t latency_usec, bool throttled) {
+  in_flight_.fetch_sub(1, std::memory_order_acq_rel);
+
+  requests_.Inc();
+  latency_usec_.IncBy(std::min<uint64_t>(latency_usec, kint32max));
+  if (throttled)
+    throttled_.Inc();
+  uint32 now = requests_.last_ts();
+
+  unsigned prev_limit = limit();
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (throttled) {
+      Decrease(now);
+    } else {
+      exact_limit_ = std::min<double>(exact_limit_ + 1 / exact_limit_, opts_.max_limit);
+    }
+    if (now != evaluated_sec_)
+      Evaluate(now);
+    limit_.store(exact_limit_, std::memory_order_relaxed);
+  }
+
+  if (limit() > prev_limit) {
+    ec_.notifyAll();
+  } else {
+    ec_.notify();
+  }
+}
+
+uint64_t ConcurrencyLimiter::baseline_usec() const {
+  std::lock_guard<std::mutex> lk(mu_);
+  return baseline_usec_;
+}
+
+void ConcurrencyLimiter::Decrease(uint32 now) {
+  // The requests that were in flight together are throttled together.
+  if (decreased_sec_ == now)
+    return;
+  decreased_sec_ = now;
+  exact_limit_ = std::max<double>(exact_limit_ * opts_.decrease, opts_.min_limit);
+  VLOG(1) << "Decreased the concurrency limit to " << exact_limit_;
+}
+
+// The first request of a second evaluates the latency of the previous one.
+void ConcurrencyLimiter::Evaluate(uint32 now) {
+  evaluated_sec_ = now;
+
+  uint32 count = requests_.SumLast(1, 1);
+  if (count == 0)
+    return;
+  double avg = double(latency_usec_.SumLast(1, 1)) / count;
+
+  if (baseline_usec_ > 0 && avg > baseline_usec_ * opts_.latency_factor) {
+    Decrease(now);
+  }
+  baseline_usec_ = (baseline_usec_ == 0 || avg < baseline_usec_)
+                       ? avg
+                       : baseline_usec_ * 0.95 + avg * 0.05;
+}
+
+}  // namespace util
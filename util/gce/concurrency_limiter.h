@@ -0,0 +1,74 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include "util/fibers/event_count.h"
+#include "util/stats/sliding_counter.h"
+
+namespace util {
+
+// Limits the number of the requests that are in flight to a server and adapts the limit to
+// the load of the server with additive increase and multiplicative decrease (AIMD):
+// every limit() successful requests grow the limit by one, while a throttled request
+// (429, 503) multiplies it by Options::decrease, at most once a second. A second whose average
+// latency exceeds Options::latency_factor times the baseline latency decreases it as well,
+// hence the limit backs off before the server starts rejecting the requests. The baseline
+// follows the minimal latency of the seconds and slowly forgets it.
+// Thread-safe, Acquire blocks the calling fiber.
+class ConcurrencyLimiter {
+ public:
+  struct Options {
+    unsigned initial_limit = 32;
+    unsigned min_limit = 2;
+    unsigned max_limit = 512;
+    double decrease = 0.7;
+    double latency_factor = 3;
+  };
+
+  explicit ConcurrencyLimiter(const Options& opts);
+
+  // Blocks the calling fiber while limit() requests are in flight.
+  void Acquire();
+
+  // Finishes a request that was acquired. throttled is set if the server rejected it because
+  // of its load.
+  void Release(uint64_t latency_usec, bool throttled);
+
+  unsigned limit() const { return limit_.load(std::memory_order_relaxed); }
+  unsigned in_flight() const { return in_flight_.load(std::memory_order_relaxed); }
+
+  // Over the last kWindowSec seconds.
+  uint32 requests() const { return requests_.Sum(); }
+  uint32 throttled() const { return throttled_.Sum(); }
+
+  uint64_t baseline_usec() const;
+
+  static constexpr unsigned kWindowSec = 10;
+
+ private:
+  // Both are called under mu_ with the current second.
+  void Decrease(uint32 now);
+  void Evaluate(uint32 now);
+
+  const Options opts_;
+
+  std::atomic<unsigned> in_flight_{0};
+  std::atomic<unsigned> limit_;
+
+  mutable std::mutex mu_;
+  double exact_limit_;  // limit_ before rounding.
+  double baseline_usec_ = 0;
+  uint32 decreased_sec_ = kuint32max;
+  uint32 evaluated_sec_ = 0;
+
+  SlidingSecondCounter<kWindowSec, 1> requests_, throttled_;
+  SlidingSecondCounterT<int64, kWindowSec, 1> latency_usec_;
+
+  fibers_ext::EventCount ec_;
+};
+
+}  // namespace util
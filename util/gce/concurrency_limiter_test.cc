@@ -0,0 +1,104 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/gce/concurrency_limiter.h"
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace util {
+
+class ConcurrencyLimiterTest : public testing::Test {
+ protected:
+  void SetUp() final { SlidingSecondBase::SetCurrentTime_Test(100); }
+  void TearDown() final { SlidingSecondBase::SetCurrentTime_Test(kuint32max); }
+
+  static void Run(ConcurrencyLimiter* cl, unsigned count, uint64_t latency_usec,
+                  bool throttled = false) {
+    for (unsigned i = 0; i < count; ++i) {
+      cl->Acquire();
+      cl->Release(latency_usec, throttled);
+    }
+  }
+};
+
+TEST_F(ConcurrencyLimiterTest, AdditiveIncrease) {
+  ConcurrencyLimiter::Options opts;
+  opts.initial_limit = 4;
+  opts.max_limit = 6;
+  ConcurrencyLimiter cl(opts);
+  EXPECT_EQ(4, cl.limit());
+
+  // Every request adds 1/limit.
+  Run(&cl, 4, 100);
+  EXPECT_EQ(4, cl.limit());
+  Run(&cl, 1, 100);
+  EXPECT_EQ(5, cl.limit());
+  EXPECT_EQ(0, cl.in_flight());
+
+  Run(&cl, 100, 100);
+  EXPECT_EQ(6, cl.limit());
+  EXPECT_EQ(105, cl.requests());
+}
+
+TEST_F(ConcurrencyLimiterTest, Throttled) {
+  ConcurrencyLimiter::Options opts;
+  opts.initial_limit = 100;
+  opts.min_limit = 40;
+  ConcurrencyLimiter cl(opts);
+
+  // The requests that are throttled in the same second decrease the limit once.
+  Run(&cl, 3, 100, true);
+  EXPECT_EQ(70, cl.limit());
+  EXPECT_EQ(3, cl.throttled());
+
+  SlidingSecondBase::SetCurrentTime_Test(101);
+  Run(&cl, 1, 100, true);
+  EXPECT_EQ(49, cl.limit());
+
+  SlidingSecondBase::SetCurrentTime_Test(102);
+  Run(&cl, 1, 100, true);
+  EXPECT_EQ(40, cl.limit());
+}
+
+TEST_F(ConcurrencyLimiterTest, Latency) {
+  ConcurrencyLimiter::Options opts;
+  opts.initial_limit = 100;
+  ConcurrencyLimiter cl(opts);
+
+  Run(&cl, 10, 100);
+  SlidingSecondBase::SetCurrentTime_Test(101);
+  Run(&cl, 10, 1000);
+  EXPECT_EQ(100, cl.baseline_usec());
+  unsigned limit = cl.limit();
+
+  // The slow second is evaluated by the first request of the next one.
+  SlidingSecondBase::SetCurrentTime_Test(102);
+  Run(&cl, 1, 100);
+  EXPECT_EQ(unsigned(limit * 0.7), cl.limit());
+}
+
+TEST_F(ConcurrencyLimiterTest, Blocks) {
+  ConcurrencyLimiter::Options opts;
+  opts.initial_limit = opts.min_limit = opts.max_limit = 1;
+  ConcurrencyLimiter cl(opts);
+
+  cl.Acquire();
+  std::atomic_bool acquired{false};
+  std::thread waiter([&] {
+    cl.Acquire();
+    acquired = true;
+    cl.Release(100, false);
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(acquired);
+  cl.Release(100, false);
+  waiter.join();
+  EXPECT_TRUE(acquired);
+  EXPECT_EQ(0, cl.in_flight());
+}
+
+}  // namespace util
@@ -4,6 +4,8 @@
 
 #include "util/gce/gce.h"
 
+#include <openssl/ssl.h>
+
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
 
@@ -22,6 +24,9 @@
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
 
+#include <mutex>
+#include <unordered_map>
+
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
@@ -29,6 +34,11 @@
 #include "file/file_util.h"
 #include "file/filesource.h"
 #include "util/asio/fiber_socket.h"
+#include "util/asio/io_context.h"
+
+DEFINE_uint32(gce_token_refresh_margin_sec, 300,
+              "The background refresher renews the access token that many seconds before "
+              "its expiry");
 
 namespace util {
 using namespace std;
@@ -40,6 +50,52 @@ using tcp = asio::ip::tcp;
 
 static const char kMetaDataHost[] = "metadata.google.internal";
 
+namespace {
+
+// The last TLS session of every host, shared by the connections of all threads.
+class SslSessionCache {
+ public:
+  ~SslSessionCache() {
+    for (const auto& k_v : sessions_)
+      SSL_SESSION_free(k_v.second);
+  }
+
+  // Takes the ownership of the reference to session.
+  void Put(const std::string& host, SSL_SESSION* session) {
+    std::lock_guard<std::mutex> lk(mu_);
+    SSL_SESSION*& dest = sessions_[host];
+    if (dest)
+      SSL_SESSION_free(dest);
+    dest = session;
+  }
+
+  // Returns a new reference to the session of host, or null.
+  SSL_SESSION* Get(const std::string& host) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = sessions_.find(host);
+    if (it == sessions_.end() || !SSL_SESSION_up_ref(it->second))
+      return nullptr;
+    return it->second;
+  }
+
+  void Erase(const std::string& host) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = sessions_.find(host);
+    if (it != sessions_.end()) {
+      SSL_SESSION_free(it->second);
+      sessions_.erase(it);
+    }
+  }
+
+ private:
+  std::mutex mu_;
+  std::unordered_map<std::string, SSL_SESSION*> sessions_;
+};
+
+SslSessionCache session_cache;
+
+}  // namespace
+
 static Status ToStatus(const system::error_code& ec) {
   return Status(StatusCode::IO_ERROR, absl::StrCat(ec.value(), ": ", ec.message()));
 }
@@ -92,16 +148,13 @@ Status GCE::ParseDefaultConfig() {
 }
 
 Status GCE::Init() {
+  auto ctx_res = SslClientContext();
+  if (!ctx_res.ok())
+    return ctx_res.status;
+  ssl_ctx_ = std::move(ctx_res.obj);
+
   string tmp_str;
-  if (!file_util::ReadFileToString("/etc/ssl/certs/ca-certificates.crt", &tmp_str)) {
-    return Status("Could not find certificates");
-  }
   system::error_code ec;
-  ssl_ctx_.reset(new SslContext{asio::ssl::context::tlsv12_client});
-  ssl_ctx_->set_verify_mode(asio::ssl::verify_peer);
-  ssl_ctx_->add_certificate_authority(asio::buffer(tmp_str), ec);
-  RETURN_ON_ERROR;
-
   string root_path = file_util::ExpandPath("~/.config/gcloud/");
   string gce_file = absl::StrCat(root_path, "gce");
 
@@ -185,20 +238,101 @@ util::Status GCE::ReadDevCreds(const std::string& root_path) {
   return Status::OK;
 }
 
+GCE::~GCE() { StopTokenRefresher(); }
+
 StatusObject<std::string> GCE::GetAccessToken(IoContext* context, bool force_refresh) const {
-  const char kDomain[] = "oauth2.googleapis.com";
-  const char kService[] = "443";
+  uint64_t version;
+  string token = CachedAccessToken(&version);
+  if (!force_refresh && !token.empty())
+    return token;
+
+  return RefreshAccessToken(context, version);
+}
+
+StatusObject<std::string> GCE::RefreshAccessToken(IoContext* context,
+                                                  uint64_t seen_version) const {
+  std::lock_guard<fibers::mutex> refresh_lk(refresh_mu_);
+
+  uint64_t version;
+  string token = CachedAccessToken(&version);
+  if (version != seen_version && !token.empty())
+    return token;  // refreshed while we waited for refresh_mu_.
+
+  auto res = FetchAccessToken(context);
+  if (!res.ok())
+    return res.status;
+
+  std::lock_guard<fibers::mutex> lk(mu_);
+  access_token_ = res.obj.access_token;
+  token_expire_ = clock_t::now() + res.obj.expires_in;
+  token_version_.fetch_add(1, std::memory_order_release);
 
-  if (!force_refresh) {
+  return access_token_;
+}
+
+std::string GCE::CachedAccessToken(uint64_t* version) const {
+  std::lock_guard<fibers::mutex> lk(mu_);
+  *version = token_version_.load(std::memory_order_relaxed);
+  return access_token_;
+}
+
+void GCE::StartTokenRefresher(IoContext* context) {
+  CHECK(!refresh_fiber_.joinable());
+  stop_refresh_ = false;
+  refresh_fiber_ = context->LaunchFiber([this, context] { RefreshLoop(context); });
+}
+
+void GCE::StopTokenRefresher() {
+  if (!refresh_fiber_.joinable())
+    return;
+  {
     std::lock_guard<fibers::mutex> lk(mu_);
-    if (!access_token_.empty())
-      return access_token_;
+    stop_refresh_ = true;
+  }
+  refresh_cv_.notify_one();
+  refresh_fiber_.join();
+}
+
+void GCE::RefreshLoop(IoContext* context) {
+  const auto margin = std::chrono::seconds(FLAGS_gce_token_refresh_margin_sec);
+  unsigned failures = 0;
+
+  while (true) {
+    uint64_t version;
+    {
+      std::unique_lock<fibers::mutex> lk(mu_);
+
+      // Tokens that live shorter than the margin are renewed at the half of their lifetime.
+      // Retries the failed refreshes with a backoff, the current token is still valid.
+      clock_t::time_point now = clock_t::now();
+      clock_t::time_point deadline = std::max(token_expire_ - margin,
+                                              now + (token_expire_ - now) / 2);
+      if (failures) {
+        deadline = clock_t::now() + std::chrono::seconds(1U << std::min(failures, 6U));
+      }
+      if (refresh_cv_.wait_until(lk, deadline, [this] { return stop_refresh_; }))
+        return;
+      version = token_version_.load(std::memory_order_relaxed);
+    }
+
+    auto res = RefreshAccessToken(context, version);
+    if (res.ok()) {
+      VLOG(1) << "Refreshed the access token";
+      failures = 0;
+    } else {
+      LOG(WARNING) << "Could not refresh the access token: " << res.status;
+      ++failures;
+    }
   }
+}
+
+auto GCE::FetchAccessToken(IoContext* context) const -> StatusObject<Token> {
+  const char kDomain[] = "oauth2.googleapis.com";
+  const char kService[] = "443";
 
   h2::response<h2::string_body> resp;
   error_code ec;
   beast::flat_buffer buffer;
-  access_token_.clear();
   if (is_prod_env_) {
     h2::request<h2::empty_body> req{
         h2::verb::get, "/computeMetadata/v1/instance/service-accounts/default/token", 11};
@@ -217,7 +351,7 @@ StatusObject<std::string> GCE::GetAccessToken(IoContext* context, bool force_ref
 
   } else {
     SslStream stream(FiberSyncSocket{kDomain, kService, context}, *ssl_ctx_);
-    ec = SslConnect(&stream, 2000);
+    ec = SslConnect(&stream, kDomain, 2000);
     RETURN_ON_ERROR;
 
     h2::request<h2::string_body> req{h2::verb::post, "/token", 11};
@@ -259,29 +393,43 @@ StatusObject<std::string> GCE::GetAccessToken(IoContext* context, bool force_ref
     return Status(rj::GetParseError_En(doc.GetParseError()));
   }
 
-  string access_token, token_type;
+  Token token{string{}, std::chrono::hours(1)};
+  string token_type;
   for (auto it = doc.MemberBegin(); it != doc.MemberEnd(); ++it) {
     if (it->name == "access_token") {
-      access_token = it->value.GetString();
+      token.access_token = it->value.GetString();
     } else if (it->name == "token_type") {
       token_type = it->value.GetString();
+    } else if (it->name == "expires_in" && it->value.IsInt()) {
+      token.expires_in = std::chrono::seconds(it->value.GetInt());
     }
   }
-  if (token_type != "Bearer" || access_token.empty()) {
+  if (token_type != "Bearer" || token.access_token.empty()) {
     return Status(absl::StrCat("Bad json response: ", doc.GetString()));
   }
 
-  std::lock_guard<fibers::mutex> lk(mu_);
-  access_token_ = access_token;
-  return access_token;
+  return token;
 }
 
 void GCE::Test_InjectAcessToken(std::string access_token) {
   std::lock_guard<fibers::mutex> lk(mu_);
   access_token_.swap(access_token);
+  token_expire_ = clock_t::now() + std::chrono::hours(1);
+  token_version_.fetch_add(1, std::memory_order_release);
 }
 
-::boost::system::error_code SslConnect(SslStream* stream, unsigned ms) {
+::boost::system::error_code SslConnect(SslStream* stream, const std::string& host,
+                                       unsigned ms) {
+  SSL* ssl = stream->native_handle();
+  bool resumed = false;
+  if (!host.empty()) {
+    SSL_set_tlsext_host_name(ssl, host.c_str());
+    if (SSL_SESSION* session = session_cache.Get(host)) {
+      resumed = SSL_set_session(ssl, session) == 1;
+      SSL_SESSION_free(session);
+    }
+  }
+
   system::error_code ec;
   for (unsigned i = 0; i < 2; ++i) {
     ec = stream->next_layer().ClientWaitToConnect(ms);
@@ -293,10 +441,48 @@ void GCE::Test_InjectAcessToken(std::string access_token) {
     }
 
     stream->handshake(asio::ssl::stream_base::client, ec);
+    if (ec && resumed) {
+      session_cache.Erase(host);  // do not offer the session again.
+    }
+    VLOG_IF(1, !ec) << "Handshake with " << host << ", resumed: " << SSL_session_reused(ssl);
     return ec;
   }
 
   return ec;
 }
 
+StatusObject<std::shared_ptr<asio::ssl::context>> SslClientContext() {
+  static std::mutex mu;
+  static std::shared_ptr<asio::ssl::context> shared_ctx;
+
+  std::lock_guard<std::mutex> lk(mu);
+  if (shared_ctx)
+    return shared_ctx;
+
+  string certs;
+  if (!file_util::ReadFileToString("/etc/ssl/certs/ca-certificates.crt", &certs)) {
+    return Status("Could not find certificates");
+  }
+  system::error_code ec;
+  auto ctx = std::make_shared<asio::ssl::context>(asio::ssl::context::tlsv12_client);
+  ctx->set_verify_mode(asio::ssl::verify_peer);
+  ctx->add_certificate_authority(asio::buffer(certs), ec);
+  RETURN_ON_ERROR;
+
+  // OpenSSL passes the new sessions to the callback instead of its internal store, which
+  // client contexts do not look up anyway.
+  SSL_CTX* native = ctx->native_handle();
+  SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(native, [](SSL* ssl, SSL_SESSION* session) {
+    const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!host)
+      return 0;
+    session_cache.Put(host, session);
+    return 1;  // the cache took the reference.
+  });
+
+  shared_ctx = std::move(ctx);
+  return shared_ctx;
+}
+
 }  // namespace util
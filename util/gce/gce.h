@@ -3,8 +3,12 @@
 //
 #pragma once
 
+#include <atomic>
 #include <boost/asio/ssl.hpp>
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/fiber.hpp>
 #include <boost/fiber/mutex.hpp>
+#include <chrono>
 #include <memory>
 
 #include "util/status.h"
@@ -20,6 +24,7 @@ class GCE {
   using SslContext = ::boost::asio::ssl::context;
   using error_code = ::boost::system::error_code;
   GCE() = default;
+  ~GCE();
 
   Status Init();
 
@@ -32,24 +37,71 @@ class GCE {
   SslContext& ssl_context() const { return *ssl_ctx_; }
 
   StatusObject<std::string> GetAccessToken(IoContext* context, bool force_refresh = false) const;
+
+  //! Fetches a new access token unless it changed since seen_version, i.e. another fiber already
+  //! refreshed it. Concurrent refreshes are coalesced into a single request.
+  StatusObject<std::string> RefreshAccessToken(IoContext* context, uint64_t seen_version) const;
+
+  //! Incremented whenever the access token changes. The handles that cache the token compare it
+  //! with the version they cached, hence they pick the renewed token without locking.
+  uint64_t token_version() const { return token_version_.load(std::memory_order_acquire); }
+
+  //! Returns the current token, possibly empty, and sets version to its version.
+  std::string CachedAccessToken(uint64_t* version) const;
+
+  //! Renews the access token in a fiber of context ahead of its expiry, so that the requests
+  //! never wait for a refresh and do not hit the expired token all at once.
+  void StartTokenRefresher(IoContext* context);
+
+  //! Stops the refresher and waits for its fiber. Called by the destructor as well.
+  void StopTokenRefresher();
+
   bool is_prod_env() const { return is_prod_env_; }
 
   void Test_InjectAcessToken(std::string access_token);
 
  private:
+  using clock_t = std::chrono::steady_clock;
+
+  struct Token {
+    std::string access_token;
+    clock_t::duration expires_in;
+  };
+
   util::Status ParseDefaultConfig();
   util::Status ReadDevCreds(const std::string& root_path);
 
+  StatusObject<Token> FetchAccessToken(IoContext* context) const;
+  void RefreshLoop(IoContext* context);
+
   std::string project_id_, client_id_, client_secret_, account_id_, refresh_token_;
 
+  // Guards the token, its expiry and the refresher state.
   mutable ::boost::fibers::mutex mu_;
   mutable std::string access_token_;
+  mutable clock_t::time_point token_expire_;
+  mutable std::atomic<uint64_t> token_version_{0};
+
+  mutable ::boost::fibers::mutex refresh_mu_;  // serializes the token requests.
+
+  ::boost::fibers::condition_variable refresh_cv_;
+  ::boost::fibers::fiber refresh_fiber_;
+  bool stop_refresh_ = false;
 
-  std::unique_ptr<SslContext> ssl_ctx_;
+  std::shared_ptr<SslContext> ssl_ctx_;
   bool is_prod_env_ = false;
 };
 
 // TODO: To move to dedicated header related to SSL/HTTPS.
-::boost::system::error_code SslConnect(SslStream* stream, unsigned msec);
+// Connects the stream and performs the TLS handshake with host, which is also sent as SNI.
+// If the context came from SslClientContext(), resumes the last session with host, if any,
+// in which case the handshake takes a single round trip.
+::boost::system::error_code SslConnect(SslStream* stream, const std::string& host,
+                                       unsigned msec);
+
+// Returns the process-wide TLS client context that verifies the peers with the system
+// certificates and caches the sessions of SslConnect by host. SSL contexts are thread-safe,
+// hence the clients of all IoContexts share the same context and its sessions.
+StatusObject<std::shared_ptr<::boost::asio::ssl::context>> SslClientContext();
 
 }  // namespace util
@@ -4,26 +4,50 @@
 
 #include "util/gce/gcs.h"
 
+#include <boost/asio/read.hpp>
 #include <boost/beast/http/buffer_body.hpp>
 #include <boost/beast/http/dynamic_body.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
 
+#include <boost/fiber/fiber.hpp>
+#include <deque>
+#include <mutex>
+
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "absl/types/optional.h"
+#include "base/crc32c.h"
 #include "base/logging.h"
 #include "base/walltime.h"
 #include "strings/escaping.h"
 #include "util/asio/fiber_socket.h"
 #include "util/asio/io_context.h"
+#include "util/gce/concurrency_limiter.h"
 #include "util/http/beast_rj_utils.h"
 #include "util/stats/varz_stats.h"
+#include "util/trace/trace.h"
 
 DEFINE_uint32(gcs_upload_buf_log_size, 20, "Upload buffer size is 2^k of this parameter.");
+DEFINE_bool(gcs_verify_crc32c, true,
+            "Verifies the crc32c checksums of the objects that are downloaded and uploaded");
+DEFINE_uint32(gcs_read_retries, 5,
+              "Number of consecutive times a failed read of an object is resumed from the offset "
+              "where it failed");
+DEFINE_uint32(gcs_read_backoff_ms, 200,
+              "Delay before resuming a failed read, doubled with every consecutive retry");
+DEFINE_uint32(gcs_max_concurrency, 0,
+              "If set, limits the concurrent requests of the process to every bucket. The limit "
+              "adapts up to this value, throttled or slow requests lower it");
 
 namespace util {
 using namespace std;
@@ -45,10 +69,135 @@ inline absl::string_view absl_sv(beast::string_view s) {
   return absl::string_view{s.data(), s.size()};
 }
 
+// The concurrency limiters of the buckets, shared by all the GCS handles of the process.
+class BucketLimiters {
+ public:
+  ConcurrencyLimiter* Get(absl::string_view bucket) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& res = limiters_[string(bucket)];
+    if (!res) {
+      ConcurrencyLimiter::Options opts;
+      opts.max_limit = FLAGS_gcs_max_concurrency;
+      opts.initial_limit = std::min(opts.initial_limit, opts.max_limit);
+      opts.min_limit = std::min(opts.min_limit, opts.max_limit);
+      res.reset(new ConcurrencyLimiter(opts));
+    }
+    return res.get();
+  }
+
+ private:
+  VarzValue::Map GetStats() const {
+    VarzValue::Map map;
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& k_v : limiters_) {
+      const ConcurrencyLimiter& cl = *k_v.second;
+      VarzValue::Map bucket;
+      bucket.emplace_back("limit", VarzValue::FromInt(cl.limit()));
+      bucket.emplace_back("in-flight", VarzValue::FromInt(cl.in_flight()));
+      bucket.emplace_back("requests", VarzValue::FromInt(cl.requests()));
+      bucket.emplace_back("throttled", VarzValue::FromInt(cl.throttled()));
+      bucket.emplace_back("baseline-usec", VarzValue::FromInt(cl.baseline_usec()));
+      map.emplace_back(k_v.first, VarzValue{std::move(bucket)});
+    }
+    return map;
+  }
+
+  mutable std::mutex mu_;
+  absl::flat_hash_map<string, std::unique_ptr<ConcurrencyLimiter>> limiters_;
+  VarzFunction varz_{"gcs-concurrency", [this] { return GetStats(); }};
+};
+
+// Holds a slot of the limiter of the bucket of the request while the request is in flight.
+// The bucket is taken from the target, e.g. "/storage/v1/b/<bucket>/o/...".
+class RequestSlot {
+ public:
+  explicit RequestSlot(beast::string_view target) {
+    if (!FLAGS_gcs_max_concurrency)
+      return;
+
+    absl::string_view bucket = absl_sv(target);
+    size_t pos = bucket.find("/b/");
+    if (pos == absl::string_view::npos)
+      return;
+    bucket.remove_prefix(pos + 3);
+    bucket = bucket.substr(0, bucket.find_first_of("/?"));
+
+    static BucketLimiters* limiters = new BucketLimiters;
+    limiter_ = limiters->Get(bucket);
+    limiter_->Acquire();
+    start_ = base::GetMonotonicMicrosFast();
+  }
+
+  RequestSlot(const RequestSlot&) = delete;
+  ~RequestSlot() { Finish(false); }
+
+  // throttled is set if the server rejected the request because of its load.
+  void Finish(bool throttled) {
+    if (limiter_) {
+      limiter_->Release(base::GetMonotonicMicrosFast() - start_, throttled);
+      limiter_ = nullptr;
+    }
+  }
+
+ private:
+  ConcurrencyLimiter* limiter_ = nullptr;
+  uint64_t start_ = 0;
+};
+
+// The delay before the retry of a failed read.
+inline chrono::milliseconds ReadBackoff(unsigned retry) {
+  return chrono::milliseconds(
+      std::min<uint64_t>(uint64_t(FLAGS_gcs_read_backoff_ms) << std::min(retry, 16U), 30000));
+}
+
+// GCS encodes crc32c values as base64 of their big-endian bytes.
+bool ParseCrc32c(absl::string_view b64, uint32_t* crc) {
+  string bytes;
+  if (!absl::Base64Unescape(b64, &bytes) || bytes.size() != 4)
+    return false;
+  *crc = 0;
+  for (char c : bytes) {
+    *crc = (*crc << 8) | uint8_t(c);
+  }
+  return true;
+}
+
+// Returns the crc32c of the object from "x-goog-hash: crc32c=...,md5=..." headers of msg.
+// The checksum describes the stored bytes, hence it is not returned for the objects that
+// are stored compressed since they may be transcoded by the server.
+template <typename Msg> absl::optional<uint32_t> GoogHashCrc32c(const Msg& msg) {
+  absl::optional<uint32_t> res;
+  auto enc_it = msg.find("x-goog-stored-content-encoding");
+  if (enc_it != msg.end() && absl_sv(enc_it->value()) != "identity")
+    return res;
+
+  auto range = msg.equal_range("x-goog-hash");
+  for (auto it = range.first; it != range.second; ++it) {
+    for (absl::string_view val : absl::StrSplit(absl_sv(it->value()), ',')) {
+      val = absl::StripAsciiWhitespace(val);
+      uint32_t crc;
+      if (absl::ConsumePrefix(&val, "crc32c=") && ParseCrc32c(val, &crc)) {
+        res = crc;
+      }
+    }
+  }
+  return res;
+}
+
+inline Status Crc32cMismatch(uint32_t expected, uint32_t actual) {
+  return Status(StatusCode::IO_ERROR,
+                absl::StrCat("crc32c mismatch, expected ", absl::Hex(expected, absl::kZeroPad8),
+                             " got ", absl::Hex(actual, absl::kZeroPad8)));
+}
+
 class GcsFile : public file::ReadonlyFile {
  public:
   // does not own gcs object, only wraps it with ReadonlyFile interface.
   GcsFile(GCS* gcs, size_t sz) : gcs_(gcs), size_(sz) {}
+
+  // Keeps the pooled handle until the file is deleted.
+  GcsFile(GcsPool::Handle handle, size_t sz)
+      : gcs_(handle.get()), size_(sz), handle_(std::move(handle)) {}
   ~GcsFile();
 
   // Reads upto length bytes and updates the result to point to the data.
@@ -67,6 +216,52 @@ class GcsFile : public file::ReadonlyFile {
   GCS* gcs_;
   size_t size_;
   size_t offs_ = 0;
+  GcsPool::Handle handle_;
+};
+
+// Fetches consecutive ranges of the object concurrently and returns them in order.
+// Range i is fetched over connection i % window, which is free by then because range i - window
+// has been consumed already.
+class GcsRangeFile : public file::ReadonlyFile {
+ public:
+  // gcs becomes the first connection of the file, the rest are taken from pool when needed.
+  // The data is verified against expected_crc if it is set.
+  GcsRangeFile(absl::string_view bucket, absl::string_view obj_path, size_t sz,
+               absl::optional<uint32_t> expected_crc, GcsPool::Handle gcs, GcsPool* pool,
+               const GcsRangeReadOptions& opts);
+  ~GcsRangeFile();
+
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range) final;
+
+  Status Close() final;
+
+  size_t Size() const final { return size_; }
+
+  int Handle() const final { return -1; }
+
+ private:
+  struct Range {
+    size_t offset = 0, len = 0, consumed = 0;
+    unique_ptr<uint8_t[]> buf;
+    Status status;
+    fibers::fiber fb;
+  };
+
+  void FillWindow();
+  void Fetch(unsigned index, Range* range);
+
+  GcsPool* pool_;
+  string bucket_, obj_path_;
+  size_t size_;
+  absl::optional<uint32_t> expected_crc_;
+  uint32_t crc_ = 0;
+  GcsRangeReadOptions opts_;
+
+  vector<GcsPool::Handle> conns_;  // lazily taken from the pool, one per window slot.
+  std::deque<Range> window_;       // deque keeps the ranges in place for their fibers.
+  size_t offs_ = 0, fetch_offs_ = 0;
+  unsigned next_conn_ = 0;
+  bool closed_ = false;
 };
 
 inline Status ToStatus(const ::boost::system::error_code& ec) {
@@ -136,6 +331,117 @@ GcsFile::~GcsFile() {
   }
 }
 
+GcsRangeFile::GcsRangeFile(absl::string_view bucket, absl::string_view obj_path, size_t sz,
+                           absl::optional<uint32_t> expected_crc, GcsPool::Handle gcs,
+                           GcsPool* pool, const GcsRangeReadOptions& opts)
+    : pool_(pool), bucket_(bucket), obj_path_(obj_path), size_(sz), expected_crc_(expected_crc),
+      opts_(opts) {
+  CHECK_GT(opts_.range_size, 0);
+
+  size_t num_ranges = (size_ + opts_.range_size - 1) / opts_.range_size;
+  conns_.resize(std::max<size_t>(1, std::min<size_t>(opts_.window, num_ranges)));
+  conns_[0] = std::move(gcs);
+}
+
+StatusObject<size_t> GcsRangeFile::Read(size_t offset, const strings::MutableByteRange& range) {
+  if (offset != offs_) {
+    return Status(StatusCode::INVALID_ARGUMENT, "Only sequential access supported");
+  }
+
+  size_t read = 0;
+  while (read < range.size() && offs_ < size_) {
+    FillWindow();
+
+    Range& front = window_.front();
+    if (front.fb.joinable())
+      front.fb.join();
+    if (!front.status.ok())
+      return front.status;
+
+    size_t sz = std::min(front.len - front.consumed, range.size() - read);
+    memcpy(range.data() + read, front.buf.get() + front.consumed, sz);
+    if (expected_crc_)
+      crc_ = crc32c::Extend(crc_, range.data() + read, sz);
+    front.consumed += sz;
+    read += sz;
+    offs_ += sz;
+
+    if (front.consumed == front.len) {
+      window_.pop_front();
+    }
+  }
+
+  if (expected_crc_ && offs_ == size_ && crc_ != *expected_crc_) {
+    LOG(ERROR) << "Corrupted download of " << GCS::ToGcsPath(bucket_, obj_path_);
+    return Crc32cMismatch(*expected_crc_, crc_);
+  }
+
+  return read;
+}
+
+void GcsRangeFile::FillWindow() {
+  while (window_.size() < conns_.size() && fetch_offs_ < size_) {
+    window_.emplace_back();
+    Range& r = window_.back();
+    r.offset = fetch_offs_;
+    r.len = std::min(opts_.range_size, size_ - fetch_offs_);
+    r.buf.reset(new uint8_t[r.len]);
+    fetch_offs_ += r.len;
+
+    unsigned index = next_conn_++ % conns_.size();
+    r.fb = fibers::fiber([this, index, &r] { Fetch(index, &r); });
+  }
+}
+
+void GcsRangeFile::Fetch(unsigned index, Range* range) {
+  GcsPool::Handle& gcs = conns_[index];
+  if (!gcs) {
+    auto res = pool_->Get();
+    if (!res.ok()) {
+      range->status = res.status;
+      return;
+    }
+    gcs = std::move(res.obj);
+  }
+
+  strings::MutableByteRange dest(range->buf.get(), range->len);
+  auto res = gcs->Read(bucket_, obj_path_, range->offset, dest);
+
+  // The range is read again as a whole, the reader has not consumed any part of it.
+  for (unsigned retry = 0; !res.ok() && retry < FLAGS_gcs_read_retries; ++retry) {
+    LOG(WARNING) << "Read of " << obj_path_ << " at " << range->offset << " failed with "
+                 << res.status << ", retrying";
+    FiberSleepFor(ReadBackoff(retry));
+    res = gcs->Read(bucket_, obj_path_, range->offset, dest);
+  }
+
+  if (!res.ok()) {
+    range->status = res.status;
+  } else if (res.obj != range->len) {
+    range->status = Status(StatusCode::IO_ERROR,
+                           absl::StrCat("Short read at ", range->offset, " of ", obj_path_));
+  }
+}
+
+Status GcsRangeFile::Close() {
+  for (auto& r : window_) {
+    if (r.fb.joinable())
+      r.fb.join();
+  }
+  window_.clear();
+  conns_.clear();
+  closed_ = true;
+
+  return Status::OK;
+}
+
+GcsRangeFile::~GcsRangeFile() {
+  if (!closed_) {
+    LOG(WARNING) << "Close was not called";
+    Close();
+  }
+}
+
 inline bool ShouldRetry(h2::status st) {
   return st == h2::status::too_many_requests ||
          h2::to_status_class(st) == h2::status_class::server_error;
@@ -144,12 +450,29 @@ inline bool ShouldRetry(h2::status st) {
 struct SeqReadHandler {
   SeqReadHandler(string url) : read_obj_url(std::move(url)) {}
 
+  // Bodies of known length are read directly into the caller buffers with
+  // HttpsClient::ReadBody, the rest go through the parser.
+  void ResetBody() {
+    body_left.reset();
+    if (!parser->chunked() && parser->content_length())
+      body_left = *parser->content_length();
+  }
+
   string read_obj_url;
   size_t offset = 0, file_size = 0;
-  uint32_t errors = 0;
+  uint32_t errors = 0;  // consecutive failures of the stream.
+
+  // The generation of the object that is read, 0 if the response did not have it.
+  // The stream is resumed from the same generation.
+  int64_t generation = 0;
+
+  // The checksum of the data that was read so far, verified once the whole object is read.
+  absl::optional<uint32_t> expected_crc;
+  uint32_t crc = 0;
 
   using OptParser = absl::optional<h2::response_parser<h2::buffer_body>>;
   OptParser parser;
+  absl::optional<size_t> body_left;  // set if the body is read directly.
 };
 
 //! [from, to) range. If to is kuint64max - then the range is unlimited from above.
@@ -205,6 +528,7 @@ struct WriteHandler {
 
   beast::multi_buffer body_mb;
   size_t uploaded = 0;
+  uint32_t crc = 0;  // of all the appended data.
 };
 
 bool WriteHandler::Append(strings::ByteRange* src) {
@@ -216,6 +540,7 @@ bool WriteHandler::Append(strings::ByteRange* src) {
     offs += mb.size();
   }
   CHECK_EQ(offs, prepare_size);
+  crc = crc32c::Extend(crc, src->data(), prepare_size);
   src->remove_prefix(prepare_size);
   body_mb.commit(prepare_size);
 
@@ -235,6 +560,13 @@ auto HttpsClient::Connect(unsigned msec) -> error_code {
   return InitSslClient();
 }
 
+bool HttpsClient::IsHealthy() const {
+  if (reconnect_needed_ || !client_)
+    return false;
+  const auto& socket = client_->next_layer();
+  return socket.is_open() && !socket.status();
+}
+
 auto HttpsClient::InitSslClient() -> error_code {
   VLOG(2) << "Https::InitSslClient " << reconnect_needed_;
 
@@ -244,7 +576,7 @@ auto HttpsClient::InitSslClient() -> error_code {
   client_.reset(new SslStream(FiberSyncSocket{host_name_, "443", &io_context_}, ssl_cntx_));
   client_->next_layer().set_keep_alive(true);
 
-  ec = SslConnect(client_.get(), reconnect_msec_);
+  ec = SslConnect(client_.get(), host_name_, reconnect_msec_);
   if (!ec) {
     reconnect_needed_ = false;
   } else {
@@ -279,6 +611,19 @@ auto HttpsClient::DrainResponse(h2::response_parser<h2::buffer_body>* parser) ->
   return error_code{};
 }
 
+auto HttpsClient::ReadBody(const asio::mutable_buffer& dest, size_t* read) -> error_code {
+  // ReadHeader may have read the beginning of the body into tmp_buffer_.
+  size_t buffered = asio::buffer_copy(dest, tmp_buffer_.data());
+  tmp_buffer_.consume(buffered);
+  *read = buffered;
+  if (buffered == dest.size())
+    return error_code{};
+
+  error_code ec;
+  *read += asio::read(*client_, dest + buffered, ec);
+  return HandleError(ec);
+}
+
 class GCS::ConnState : public absl::variant<absl::monostate, SeqReadHandler, WriteHandler> {
  public:
   ~ConnState() {
@@ -309,7 +654,7 @@ Status GCS::Connect(unsigned msec) {
   auto res = gce_.GetAccessToken(&io_context_);
   if (!res.ok())
     return res.status;
-  access_token_header_ = absl::StrCat("Bearer ", res.obj);
+  token_version_ = 0;  // access_token_header() picks the token.
 
   VLOG(1) << "GCS::Connect OK " << native_handle();
 
@@ -327,13 +672,18 @@ bool GCS::IsBusy() const {
   return !is_empty;
 }
 
+bool GCS::IsHealthy() const {
+  return !IsBusy() && https_client_->IsHealthy();
+}
+
 auto GCS::ListBuckets() -> ListBucketResult {
+  trace::ScopedSpan span("gcs.ListBuckets");
   RETURN_IF_ERROR(PrepareConnection());
 
   string url = absl::StrCat("/storage/v1/b?project=", gce_.project_id());
   absl::StrAppend(&url, "&fields=items,nextPageToken");
 
-  auto http_req = PrepareRequest(h2::verb::get, url, access_token_header_);
+  auto http_req = PrepareRequest(h2::verb::get, url, access_token_header());
 
   // TODO: to have a handler extracting what we need.
   rj::Document doc;
@@ -380,6 +730,14 @@ auto GCS::ListBuckets() -> ListBucketResult {
 
 auto GCS::List(absl::string_view bucket, absl::string_view prefix, bool fs_mode, ListObjectCb cb)
     -> ListObjectResult {
+  return ListRange(bucket, prefix, fs_mode, absl::string_view{}, absl::string_view{},
+                   std::move(cb));
+}
+
+auto GCS::ListRange(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
+                    absl::string_view start, absl::string_view end, ListObjectCb cb)
+    -> ListObjectResult {
+  trace::ScopedSpan span("gcs.List");
   CHECK(!bucket.empty());
   VLOG(1) << "GCS::List " << native_handle();
 
@@ -391,7 +749,15 @@ auto GCS::List(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
   if (fs_mode) {
     absl::StrAppend(&url, "&delimiter=%2f");
   }
-  auto http_req = PrepareRequest(h2::verb::get, url, access_token_header_);
+  if (!start.empty()) {
+    absl::StrAppend(&url, "&startOffset=");
+    strings::AppendEncodedUrl(start, &url);
+  }
+  if (!end.empty()) {
+    absl::StrAppend(&url, "&endOffset=");
+    strings::AppendEncodedUrl(end, &url);
+  }
+  auto http_req = PrepareRequest(h2::verb::get, url, access_token_header());
 
   // TODO: to have a handler extracting what we need.
   rj::Document doc;
@@ -441,36 +807,49 @@ auto GCS::List(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
 
 auto GCS::Read(absl::string_view bucket, absl::string_view obj_path, size_t ofs,
                const strings::MutableByteRange& range) -> ReadObjectResult {
+  trace::ScopedSpan span("gcs.Read");
   CHECK(!range.empty());
   RETURN_IF_ERROR(PrepareConnection());
 
   string read_obj_url = BuildGetObjUrl(bucket, obj_path);
 
-  auto req = PrepareRequest(h2::verb::get, read_obj_url, access_token_header_);
+  auto req = PrepareRequest(h2::verb::get, read_obj_url, access_token_header());
   SetRange(ofs, ofs + range.size(), &req);
 
-  h2::response<h2::buffer_body> resp_msg;
-  auto& body = resp_msg.body();
-  body.data = range.data();
-  body.size = range.size();
-  body.more = false;
+  ReusableParser parser;
+  OpenSeqResult res = OpenSequentialInternal(&req, &parser);
+  if (!res.ok()) {
+    https_client_->schedule_reconnect();
+    return res.status;
+  }
+  size_t content_sz = res.obj;
 
-  RETURN_IF_ERROR(HttpMessage(&req, &resp_msg));
-  if (resp_msg.result() != h2::status::partial_content) {
-    return Status(StatusCode::IO_ERROR, string(resp_msg.reason()));
+  const auto& msg = parser->get();
+  if (msg.result() != h2::status::partial_content || parser->chunked() ||
+      content_sz > range.size()) {
+    // We do not read the unexpected body, hence the connection can not be reused.
+    https_client_->schedule_reconnect();
+    return Status(StatusCode::IO_ERROR, string(msg.reason()));
   }
 
-  auto left_available = body.size;
-  return range.size() - left_available;  // how much written
+  // The body is read directly into range.
+  size_t read = 0;
+  error_code ec = https_client_->ReadBody(asio::buffer(range.data(), content_sz), &read);
+  RETURN_EC_STATUS(ec);
+
+  return read;
 }
 
 StatusObject<bool> GCS::SendRequestIterative(Request* req, Parser<h2::buffer_body>* parser) {
   VLOG(1) << "Req: " << *req;
 
+  // The body is streamed after the slot is released.
+  RequestSlot slot(req->target());
   error_code ec = https_client_->Send(*req);
   RETURN_EC_STATUS(ec);
 
   ec = https_client_->ReadHeader(parser);
+  slot.Finish(!ec && ShouldRetry(parser->get().result()));
 
   if (ec) {
     LOG(ERROR) << "Socket error: " << ec << "/" << ec.message();
@@ -493,7 +872,7 @@ StatusObject<bool> GCS::SendRequestIterative(Request* req, Parser<h2::buffer_bod
 
   if (ShouldRetry(msg.result())) {
     RETURN_EC_STATUS(https_client_->DrainResponse(parser));
-    this_fiber::sleep_for(1s);
+    FiberSleepFor(1s);
     return false;  // retry
   }
 
@@ -512,12 +891,13 @@ StatusObject<bool> GCS::SendRequestIterative(Request* req, Parser<h2::buffer_bod
 }
 
 auto GCS::OpenSequential(absl::string_view bucket, absl::string_view obj_path) -> OpenSeqResult {
+  trace::ScopedSpan span("gcs.OpenSequential");
   RETURN_IF_ERROR(PrepareConnection());
 
   CHECK(absl::holds_alternative<absl::monostate>(*conn_state_));
 
   string read_obj_url = BuildGetObjUrl(bucket, obj_path);
-  auto req = PrepareRequest(h2::verb::get, read_obj_url, access_token_header_);
+  auto req = PrepareRequest(h2::verb::get, read_obj_url, access_token_header());
 
   SeqReadHandler& handler = conn_state_->emplace<SeqReadHandler>(read_obj_url);
 
@@ -528,60 +908,120 @@ auto GCS::OpenSequential(absl::string_view bucket, absl::string_view obj_path) -
   }
 
   handler.file_size = res.obj;
+  handler.ResetBody();
+  if (FLAGS_gcs_verify_crc32c && handler.file_size > 0) {
+    handler.expected_crc = GoogHashCrc32c(handler.parser->get());
+  }
+
+  const auto& msg = handler.parser->get();
+  auto gen_it = msg.find("x-goog-generation");
+  if (gen_it != msg.end() && !absl::SimpleAtoi(absl_sv(gen_it->value()), &handler.generation)) {
+    handler.generation = 0;
+  }
 
   return res.obj;
 }
 
 auto GCS::ReadSequential(const strings::MutableByteRange& range) -> ReadObjectResult {
+  trace::ScopedSpan span("gcs.ReadSequential");
   SeqReadHandler* handler = absl::get_if<SeqReadHandler>(conn_state_.get());
   CHECK(handler && https_client_);
 
-  if (handler->parser->is_done()) {
-    return 0;
-  }
+  // Reopens the stream at the offset that was read so far, hence the readers of the file,
+  // e.g. the record parsers, continue in the middle of a record or a block as if nothing
+  // happened. Sets changed if the object was replaced meanwhile.
+  bool changed = false;
+  auto resume = [&]() -> Status {
+    string url = handler->read_obj_url;
+    if (handler->generation)
+      absl::StrAppend(&url, "&generation=", handler->generation);
+    auto req = PrepareRequest(h2::verb::get, url, access_token_header());
+    SetRange(handler->offset, kuint64max, &req);
 
-  for (unsigned iters = 0; iters < 3; ++iters) {
-    auto& body = handler->parser->get().body();
-    body.data = range.data();
-    auto& left_available = body.size;
-    left_available = range.size();
-
-    error_code ec = https_client_->Read(&handler->parser.value());
-    if (!ec || ec == h2::error::need_buffer || ec == h2::error::partial_message) {
-      size_t http_read = range.size() - left_available;
-      DVLOG(2) << "Read " << http_read << " bytes from " << handler->offset << " with capacity "
-               << range.size();
+    https_client_->schedule_reconnect();
+    OpenSeqResult res = OpenSequentialInternal(&req, &handler->parser);
+    if (!res.ok())
+      return res.status;
+    if (handler->file_size && res.obj && handler->offset + res.obj != handler->file_size) {
+      changed = true;
+      return Status(StatusCode::IO_ERROR, absl::StrCat(handler->read_obj_url, " has changed"));
+    }
+    handler->ResetBody();
+    VLOG(1) << "Reopened " << handler->read_obj_url << " at " << handler->offset;
+    return Status::OK;
+  };
+
+  while (true) {
+    error_code ec;
+    size_t http_read = 0;
+
+    if (handler->body_left) {
+      size_t& body_left = *handler->body_left;
+      if (body_left == 0)
+        return 0;
+
+      ec = https_client_->ReadBody(asio::buffer(range.data(), std::min(range.size(), body_left)),
+                                   &http_read);
+      body_left -= http_read;
+
+      // The data that was read before the error is returned, the next call reopens the stream.
+      if (http_read > 0)
+        ec.clear();
+    } else {
+      if (handler->parser->is_done())
+        return 0;
+
+      auto& body = handler->parser->get().body();
+      body.data = range.data();
+      auto& left_available = body.size;
+      left_available = range.size();
+
+      ec = https_client_->Read(&handler->parser.value());
+      if (ec == h2::error::need_buffer || ec == h2::error::partial_message)
+        ec.clear();
 
       // This check does not happen. See here why: https://github.com/boostorg/beast/issues/1662
       // DCHECK_EQ(sz_read, http_read) << " " << range.size() << "/" << left_available;
+      http_read = range.size() - left_available;
+    }
+
+    if (!ec) {
+      DVLOG(2) << "Read " << http_read << " bytes from " << handler->offset << " with capacity "
+               << range.size();
+      handler->errors = 0;
       handler->offset += http_read;
+      if (handler->expected_crc) {
+        handler->crc = crc32c::Extend(handler->crc, range.data(), http_read);
+        if (handler->offset == handler->file_size && handler->crc != *handler->expected_crc) {
+          LOG(ERROR) << "Corrupted download of " << handler->read_obj_url;
+          return Crc32cMismatch(*handler->expected_crc, handler->crc);
+        }
+      }
       return http_read;
     }
 
-    if (ec == asio::ssl::error::stream_truncated) {
-      LOG(WARNING) << "Stream " << handler->read_obj_url << " truncated at " << handler->offset
-                   << "/" << handler->file_size;
-
-      auto req = PrepareRequest(h2::verb::get, handler->read_obj_url, access_token_header_);
-      SetRange(handler->offset, kuint64max, &req);
-      OpenSeqResult res = OpenSequentialInternal(&req, &handler->parser);
+    // The connection is reset by the peer, times out or the server truncates a long stream.
+    LOG(WARNING) << "Read of " << handler->read_obj_url << " failed at " << handler->offset
+                 << "/" << handler->file_size << ": " << ec << "/" << ec.message();
+    VLOG(1) << "FiberSocket status: " << https_client_->client()->next_layer().status();
 
-      if (!res.ok())
-        return res.status;
-      VLOG(1) << "Reopened the file, new size: " << handler->offset + res.obj;
-      // I do not change seq_file_->offset,file_size fields.
-      // TODO: to validate that file version has not been changed between retries.
-      continue;
-    } else {
-      LOG(ERROR) << "ec: " << ec << "/" << ec.message() << " at " << handler->offset << "/"
-                 << handler->file_size;
-      LOG(ERROR) << "FiberSocket status: " << https_client_->client()->next_layer().status();
+    Status st = ToStatus(ec);
+    do {
+      if (handler->errors >= FLAGS_gcs_read_retries) {
+        LOG(ERROR) << "Giving up on " << handler->read_obj_url << " after " << handler->errors
+                   << " retries: " << st;
+        return st;
+      }
 
-      return ToStatus(ec);
-    }
+      // A truncated stream is resumed right away.
+      if (handler->errors || ec != asio::ssl::error::stream_truncated)
+        FiberSleepFor(ReadBackoff(handler->errors));
+      ++handler->errors;
+      st = resume();
+      if (changed)
+        return st;
+    } while (!st.ok());
   }
-
-  return Status(StatusCode::INTERNAL_ERROR, "Maximum iterations reached");
 }
 
 StatusObject<file::ReadonlyFile*> GCS::OpenGcsFile(absl::string_view full_path) {
@@ -600,7 +1040,192 @@ StatusObject<file::ReadonlyFile*> GCS::OpenGcsFile(absl::string_view full_path)
   return new GcsFile{this, res.obj};
 }
 
+StatusObject<file::ReadonlyFile*> OpenGcsFile(absl::string_view full_path, GcsPool* pool) {
+  GET_UNLESS_ERROR(gcs, pool->Get());
+
+  absl::string_view bucket, obj_path;
+  CHECK(GCS::SplitToBucketPath(full_path, &bucket, &obj_path));
+
+  auto res = gcs->OpenSequential(bucket, obj_path);
+  if (!res.ok()) {
+    return res.status;
+  }
+
+  return new GcsFile{std::move(gcs), res.obj};
+}
+
+StatusObject<file::ReadonlyFile*> OpenGcsRangeFile(absl::string_view full_path, GcsPool* pool,
+                                                   const GcsRangeReadOptions& opts) {
+  absl::string_view bucket, obj_path;
+  CHECK(GCS::SplitToBucketPath(full_path, &bucket, &obj_path));
+
+  GET_UNLESS_ERROR(gcs, pool->Get());
+
+  // Ranged reads do not report the object size, so we take it from the metadata.
+  GET_UNLESS_ERROR(meta, gcs->ReadMetadata(bucket, obj_path));
+
+  VLOG(1) << "Opened ranged gcs " << full_path << " of size " << meta.size;
+
+  absl::optional<uint32_t> expected_crc;
+  if (FLAGS_gcs_verify_crc32c)
+    expected_crc = meta.crc32c;
+
+  return new GcsRangeFile{bucket,         obj_path, meta.size, expected_crc,
+                          std::move(gcs), pool,     opts};
+}
+
+GcsPool::GcsPool(const GCE& gce, IoContextPool* io_pool, const Options& opts)
+    : ClientPool(
+          io_pool, [&gce](IoContext* cntx) { return new GCS(gce, cntx); }, opts),
+      gce_(gce) {}
+
+namespace {
+
+Status UploadObject(GcsPool* pool, absl::string_view bucket, absl::string_view obj_path,
+                    strings::ByteRange data) {
+  GET_UNLESS_ERROR(gcs, pool->Get());
+  RETURN_IF_ERROR(gcs->OpenForWrite(bucket, obj_path));
+
+  if (!data.empty()) {
+    Status st = gcs->Write(data);
+    if (!st.ok()) {
+      gcs->CloseWrite(true);
+      return st;
+    }
+  }
+  return gcs->CloseWrite(false);
+}
+
+}  // namespace
+
+struct GcsComposeWriter::Part {
+  string path;
+  string data;
+  Status status;
+  fibers::fiber fb;
+};
+
+GcsComposeWriter::GcsComposeWriter(GcsPool* pool, absl::string_view bucket,
+                                   absl::string_view obj_path, const Options& opts)
+    : pool_(pool), bucket_(bucket), obj_path_(obj_path), opts_(opts) {
+  CHECK_GT(opts_.part_size, 0);
+  CHECK_GT(opts_.max_parallel, 0);
+}
+
+GcsComposeWriter::~GcsComposeWriter() {
+  if (!closed_) {
+    LOG(WARNING) << "Close was not called";
+    Close(true);
+  }
+}
+
+Status GcsComposeWriter::Write(strings::ByteRange src) {
+  while (!src.empty()) {
+    RETURN_IF_ERROR(status_);
+
+    size_t sz = std::min(src.size(), opts_.part_size - buf_.size());
+    buf_.append(reinterpret_cast<const char*>(src.data()), sz);
+    src.remove_prefix(sz);
+
+    if (buf_.size() == opts_.part_size) {
+      RETURN_IF_ERROR(WaitParts(opts_.max_parallel - 1));
+      StartPart();
+    }
+  }
+  return Status::OK;
+}
+
+void GcsComposeWriter::StartPart() {
+  unique_ptr<Part> part(new Part);
+  part->path = absl::StrCat(obj_path_, ".__part", parts_.size());
+  part->data.swap(buf_);
+
+  Part* ptr = part.get();
+  ptr->fb = fibers::fiber([this, ptr] {
+    ptr->status = UploadObject(pool_, bucket_, ptr->path, strings::ToByteRange(ptr->data));
+    string().swap(ptr->data);
+  });
+  parts_.push_back(std::move(part));
+}
+
+Status GcsComposeWriter::WaitParts(size_t max_inflight) {
+  while (parts_.size() - num_done_ > max_inflight) {
+    Part* part = parts_[num_done_++].get();
+    part->fb.join();
+    if (!part->status.ok() && status_.ok()) {
+      status_ = part->status;
+    }
+  }
+  return status_;
+}
+
+Status GcsComposeWriter::Close(bool abort_write) {
+  CHECK(!closed_);
+  closed_ = true;
+
+  if (parts_.empty()) {
+    if (abort_write)
+      return Status::OK;
+    return UploadObject(pool_, bucket_, obj_path_, strings::ToByteRange(buf_));
+  }
+
+  if (!abort_write && status_.ok() && !buf_.empty()) {
+    StartPart();
+  }
+  Status st = WaitParts(0);
+
+  vector<string> paths;
+  for (const auto& part : parts_) {
+    paths.push_back(part->path);
+  }
+  parts_.clear();
+
+  GET_UNLESS_ERROR(gcs, pool_->Get());
+  if (!abort_write && st.ok()) {
+    st = ComposeAll(gcs.get(), paths);
+  }
+  DeleteAll(gcs.get(), paths);
+
+  return abort_write ? Status::OK : st;
+}
+
+Status GcsComposeWriter::ComposeAll(GCS* gcs, vector<string> sources) {
+  constexpr size_t kMax = GCS::kMaxComposeSources;
+  unsigned level = 0;
+
+  while (sources.size() > kMax) {
+    vector<string> next;
+    for (size_t i = 0; i < sources.size(); i += kMax) {
+      vector<string> group(sources.begin() + i,
+                           sources.begin() + std::min(sources.size(), i + kMax));
+      string path = absl::StrCat(obj_path_, ".__compose", level, "_", next.size());
+      RETURN_IF_ERROR(gcs->Compose(bucket_, path, group));
+      next.push_back(std::move(path));
+    }
+
+    // The parts are deleted by the caller, we delete only the intermediate objects.
+    if (level > 0)
+      DeleteAll(gcs, sources);
+    sources.swap(next);
+    ++level;
+  }
+
+  Status st = gcs->Compose(bucket_, obj_path_, sources);
+  if (level > 0)
+    DeleteAll(gcs, sources);
+  return st;
+}
+
+void GcsComposeWriter::DeleteAll(GCS* gcs, const vector<string>& paths) {
+  for (const auto& path : paths) {
+    Status st = gcs->Delete(bucket_, path);
+    LOG_IF(WARNING, !st.ok()) << "Could not delete " << GCS::ToGcsPath(bucket_, path) << ": "
+                              << st;
+  }
+}
+
 util::Status GCS::OpenForWrite(absl::string_view bucket, absl::string_view obj_path) {
+  trace::ScopedSpan span("gcs.OpenForWrite");
   RETURN_IF_ERROR(PrepareConnection());
 
   CHECK(absl::holds_alternative<absl::monostate>(*conn_state_));
@@ -614,7 +1239,7 @@ util::Status GCS::OpenForWrite(absl::string_view bucket, absl::string_view obj_p
   absl::StrAppend(&url, bucket, "/o?uploadType=resumable&name=");
   strings::AppendEncodedUrl(obj_path, &url);
 
-  auto req = PrepareRequest(h2::verb::post, url, access_token_header_);
+  auto req = PrepareRequest(h2::verb::post, url, access_token_header());
   h2::response<h2::dynamic_body> resp_msg;
 
   req.prepare_payload();
@@ -638,6 +1263,7 @@ util::Status GCS::OpenForWrite(absl::string_view bucket, absl::string_view obj_p
 }
 
 util::Status GCS::Write(strings::ByteRange src) {
+  trace::ScopedSpan span("gcs.Write");
   CHECK(!src.empty());
   WriteHandler* wh = absl::get_if<WriteHandler>(conn_state_.get());
   CHECK(wh && !wh->url.empty());
@@ -662,7 +1288,9 @@ util::Status GCS::Write(strings::ByteRange src) {
     for (; retry < 3; ++retry) {
       VLOG(1) << "UploadReq" << retry << ": " << req << " socket "
               << native_handle();
+      RequestSlot slot(req.target());
       ec = https_client_->Send(req, &resp_msg);
+      slot.Finish(!ec && ShouldRetry(resp_msg.result()));
       if (ec) {
         LOG(WARNING) << "retrying " << retry<< " after " << ec << "/" << ec.message();
         gcs_latency->IncBy("retry", base::GetMonotonicMicrosFast() - start);
@@ -677,7 +1305,7 @@ util::Status GCS::Write(strings::ByteRange src) {
       h2::status_class st_class = h2::to_status_class(resp_msg.result());
       if (st_class == h2::status_class::server_error) {
         VLOG(1) << "Retrying the service "<< retry;
-        this_fiber::sleep_for(10ms);
+        FiberSleepFor(10ms);
         https_client_->schedule_reconnect();
         gcs_latency->IncBy("retry", base::GetMonotonicMicrosFast() - start);
         continue;
@@ -716,6 +1344,7 @@ util::Status GCS::Write(strings::ByteRange src) {
 }
 
 util::Status GCS::CloseWrite(bool abort_write) {
+  trace::ScopedSpan span("gcs.CloseWrite");
   WriteHandler* wh = absl::get_if<WriteHandler>(conn_state_.get());
   CHECK(wh && !wh->url.empty());
 
@@ -737,8 +1366,170 @@ util::Status GCS::CloseWrite(bool abort_write) {
   RETURN_EC_STATUS(ec);
   VLOG(1) << "CloseWriteResp: " << resp_msg;
 
+  uint32_t crc = wh->crc;
+  string url = std::move(wh->url);
   conn_state_->emplace<absl::monostate>();
 
+  if (abort_write || !FLAGS_gcs_verify_crc32c)
+    return Status::OK;
+
+  if (h2::to_status_class(resp_msg.result()) != h2::status_class::successful) {
+    return HttpError(resp_msg);
+  }
+
+  // The finalized object is described by the headers and by the json resource in the body.
+  absl::optional<uint32_t> expected = GoogHashCrc32c(resp_msg);
+  if (!expected) {
+    rj::Document doc;
+    http::RjBufSequenceStream is(resp_msg.body().data());
+    doc.ParseStream<rj::kParseDefaultFlags>(is);
+    uint32_t val;
+    if (!doc.HasParseError() && doc.IsObject()) {
+      auto it = doc.FindMember("crc32c");
+      if (it != doc.MemberEnd() && it->value.IsString() &&
+          ParseCrc32c(absl::string_view(it->value.GetString(), it->value.GetStringLength()),
+                      &val)) {
+        expected = val;
+      }
+    }
+  }
+
+  if (!expected) {
+    VLOG(1) << "No crc32c in the upload response " << resp_msg;
+  } else if (*expected != crc) {
+    LOG(ERROR) << "Corrupted upload " << url;
+    return Crc32cMismatch(*expected, crc);
+  }
+
+  return Status::OK;
+}
+
+template <typename ReqBody, typename RespBody>
+Status GCS::SendAuthorized(h2::request<ReqBody>* req, Response<RespBody>* resp) {
+  for (unsigned i = 0; i < 2; ++i) {
+    VLOG(1) << "HttpReq" << i << ": " << *req << ", socket " << native_handle();
+
+    *resp = Response<RespBody>{};
+    RequestSlot slot(req->target());
+    RETURN_EC_STATUS(https_client_->Send(*req, resp));
+    slot.Finish(ShouldRetry(resp->result()));
+    VLOG(1) << "HttpResp" << i << ": " << *resp;
+
+    if (!IsUnauthorized(*resp))
+      break;
+    RETURN_IF_ERROR(RefreshToken(req));
+  }
+  return Status::OK;
+}
+
+Status GCS::Compose(absl::string_view bucket, absl::string_view obj_path,
+                    const vector<string>& src_paths) {
+  trace::ScopedSpan span("gcs.Compose");
+  CHECK(!src_paths.empty() && src_paths.size() <= kMaxComposeSources);
+  RETURN_IF_ERROR(PrepareConnection());
+
+  string url = absl::StrCat("/storage/v1/b/", bucket, "/o/");
+  strings::AppendEncodedUrl(obj_path, &url);
+  absl::StrAppend(&url, "/compose");
+
+  rj::StringBuffer sb;
+  rj::Writer<rj::StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.Key("sourceObjects");
+  writer.StartArray();
+  for (const auto& src : src_paths) {
+    writer.StartObject();
+    writer.Key("name");
+    writer.String(src.data(), src.size());
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.Key("destination");
+  writer.StartObject();
+  writer.Key("contentType");
+  writer.String("application/octet-stream");
+  writer.EndObject();
+  writer.EndObject();
+
+  h2::request<h2::string_body> req(h2::verb::post, url, 11);
+  req.set(h2::field::host, kDomain);
+  req.set(h2::field::authorization, access_token_header());
+  req.set(h2::field::content_type, "application/json");
+  req.keep_alive(true);
+  req.body().assign(sb.GetString(), sb.GetSize());
+  req.prepare_payload();
+
+  h2::response<h2::dynamic_body> resp_msg;
+  RETURN_IF_ERROR(SendAuthorized(&req, &resp_msg));
+  if (resp_msg.result() != h2::status::ok) {
+    return HttpError(resp_msg);
+  }
+  return Status::OK;
+}
+
+auto GCS::ReadMetadata(absl::string_view bucket, absl::string_view obj_path)
+    -> StatusObject<ObjectMetadata> {
+  trace::ScopedSpan span("gcs.ReadMetadata");
+  RETURN_IF_ERROR(PrepareConnection());
+
+  string url = absl::StrCat("/storage/v1/b/", bucket, "/o/");
+  strings::AppendEncodedUrl(obj_path, &url);
+  absl::StrAppend(&url, "?fields=size,generation,crc32c,contentEncoding");
+
+  auto req = PrepareRequest(h2::verb::get, url, access_token_header());
+  h2::response<h2::dynamic_body> resp_msg;
+  RETURN_IF_ERROR(SendAuthorized(&req, &resp_msg));
+  if (resp_msg.result() != h2::status::ok) {
+    return HttpError(resp_msg);
+  }
+
+  rj::Document doc;
+  http::RjBufSequenceStream is(resp_msg.body().data());
+  doc.ParseStream<rj::kParseDefaultFlags>(is);
+  if (doc.HasParseError()) {
+    LOG(ERROR) << rj::GetParseError_En(doc.GetParseError()) << resp_msg;
+    return Status(StatusCode::PARSE_ERROR, "Could not parse json response");
+  }
+
+  // Both fields are int64 values that are encoded as json strings.
+  ObjectMetadata res;
+  auto size_it = doc.FindMember("size");
+  auto gen_it = doc.FindMember("generation");
+  if (size_it == doc.MemberEnd() || gen_it == doc.MemberEnd() ||
+      !absl::SimpleAtoi(absl::string_view(size_it->value.GetString(),
+                                          size_it->value.GetStringLength()), &res.size) ||
+      !absl::SimpleAtoi(absl::string_view(gen_it->value.GetString(),
+                                          gen_it->value.GetStringLength()), &res.generation)) {
+    return Status(StatusCode::PARSE_ERROR, "Unexpected object metadata");
+  }
+
+  // Similarly to x-goog-hash, the checksum of compressed objects is not returned.
+  auto crc_it = doc.FindMember("crc32c");
+  auto enc_it = doc.FindMember("contentEncoding");
+  bool compressed = enc_it != doc.MemberEnd() && enc_it->value.IsString() &&
+                    absl::string_view(enc_it->value.GetString()) != "identity";
+  uint32_t crc;
+  if (crc_it != doc.MemberEnd() && crc_it->value.IsString() && !compressed &&
+      ParseCrc32c(absl::string_view(crc_it->value.GetString(), crc_it->value.GetStringLength()),
+                  &crc)) {
+    res.crc32c = crc;
+  }
+  return res;
+}
+
+Status GCS::Delete(absl::string_view bucket, absl::string_view obj_path) {
+  trace::ScopedSpan span("gcs.Delete");
+  RETURN_IF_ERROR(PrepareConnection());
+
+  string url = absl::StrCat("/storage/v1/b/", bucket, "/o/");
+  strings::AppendEncodedUrl(obj_path, &url);
+
+  auto req = PrepareRequest(h2::verb::delete_, url, access_token_header());
+  h2::response<h2::dynamic_body> resp_msg;
+  RETURN_IF_ERROR(SendAuthorized(&req, &resp_msg));
+  if (resp_msg.result() != h2::status::no_content) {
+    return HttpError(resp_msg);
+  }
   return Status::OK;
 }
 
@@ -768,11 +1559,22 @@ util::Status GCS::ClearConnState() {
     CHECK(https_client_);
     error_code ec;
 
-    if (seq_ptr->parser) {
-      ec = https_client_->DrainResponse(&seq_ptr->parser.value());
-      if (ec) {
-        https_client_->schedule_reconnect();
+    if (seq_ptr->body_left) {
+      // Drains the rest of the body to allow reusing the current connection.
+      constexpr size_t kBufSize = 1 << 16;
+      std::unique_ptr<uint8_t[]> buf(new uint8_t[kBufSize]);
+      size_t& body_left = *seq_ptr->body_left;
+      while (body_left > 0 && !ec) {
+        size_t read = 0;
+        ec = https_client_->ReadBody(asio::buffer(buf.get(), std::min(kBufSize, body_left)),
+                                     &read);
+        body_left -= read;
       }
+    } else if (seq_ptr->parser) {
+      ec = https_client_->DrainResponse(&seq_ptr->parser.value());
+    }
+    if (ec) {
+      https_client_->schedule_reconnect();
     }
 
     conn_state_->emplace<absl::monostate>();
@@ -811,25 +1613,36 @@ auto GCS::OpenSequentialInternal(Request* req, ReusableParser* parser) -> OpenSe
   return err_st;
 }
 
-Status GCS::RefreshToken(Request* req) {
-  auto res = gce_.GetAccessToken(&io_context_, true);
+// The handles that were rejected with the same token share a single refresh.
+template <typename Body> Status GCS::RefreshToken(h2::request<Body>* req) {
+  auto res = gce_.RefreshAccessToken(&io_context_, token_version_);
   if (!res.ok())
     return res.status;
 
-  access_token_header_ = absl::StrCat("Bearer ", res.obj);
-  req->set(h2::field::authorization, access_token_header_);
+  token_version_ = 0;  // access_token_header() picks the refreshed token.
+  req->set(h2::field::authorization, access_token_header());
 
   return Status::OK;
 }
 
+const string& GCS::access_token_header() {
+  if (gce_.token_version() != token_version_) {
+    string token = gce_.CachedAccessToken(&token_version_);
+    access_token_header_ = absl::StrCat("Bearer ", token);
+  }
+  return access_token_header_;
+}
+
 template <typename RespBody> Status GCS::HttpMessage(Request* req, Response<RespBody>* resp) {
   for (unsigned i = 0; i < 3; ++i) {
     VLOG(1) << "HttpReq" << i << ": " << *req << ", socket " << native_handle();
 
+    RequestSlot slot(req->target());
     error_code ec = https_client_->Send(*req, resp);
     if (ec) {
       return ToStatus(ec);
     }
+    slot.Finish(ShouldRetry(resp->result()));
     VLOG(1) << "HttpResp" << i << ": " << *resp;
 
     if (resp->result() == h2::status::ok) {
@@ -15,12 +15,14 @@
 #include <boost/beast/http/write.hpp>
 
 #include <memory>
+#include <vector>
 
 #include "absl/types/optional.h"
 #include "absl/types/variant.h"
 
 #include "file/file.h"
 #include "strings/stringpiece.h"
+#include "util/asio/client_pool.h"
 #include "util/asio/fiber_socket.h"
 #include "util/gce/gce.h"
 #include "util/status.h"
@@ -49,9 +51,19 @@ class HttpsClient {
   error_code DrainResponse(
       ::boost::beast::http::response_parser<::boost::beast::http::buffer_body>* parser);
 
+  // Reads exactly dest.size() bytes of a response body directly from the stream into dest,
+  // bypassing the parser, so the data is decrypted straight into the caller buffer.
+  // Must follow ReadHeader of a response whose body is not chunked and is at least that long.
+  // The parser is not updated, hence the caller must track the length of the body itself.
+  // Sets read to the number of bytes written into dest.
+  error_code ReadBody(const ::boost::asio::mutable_buffer& dest, size_t* read);
+
   SslStream* client() { return client_.get(); }
 
   void schedule_reconnect() { reconnect_needed_ = true;}
+
+  // Returns true if the connection is established and its socket did not fail.
+  bool IsHealthy() const;
   auto native_handle() { return client_->native_handle(); }
 
  private:
@@ -105,9 +117,24 @@ class GCS {
   ListObjectResult List(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
                         ListObjectCb cb);
 
+  // Same as List but returns only the objects whose names are in [start, end) range.
+  // Empty bounds are not applied. Listing disjoint ranges concurrently over several
+  // connections speeds up the listing of large prefixes.
+  ListObjectResult ListRange(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
+                             absl::string_view start, absl::string_view end, ListObjectCb cb);
+
   ReadObjectResult Read(absl::string_view bucket, absl::string_view path, size_t ofs,
                         const strings::MutableByteRange& range);
 
+  struct ObjectMetadata {
+    size_t size = 0;
+    int64_t generation = 0;  // changes whenever the object is overwritten.
+    absl::optional<uint32_t> crc32c;
+  };
+
+  util::StatusObject<ObjectMetadata> ReadMetadata(absl::string_view bucket,
+                                                  absl::string_view path);
+
   // Read API
 
   OpenSeqResult OpenSequential(absl::string_view bucket, absl::string_view path);
@@ -116,6 +143,9 @@ class GCS {
 
   bool IsBusy() const;
 
+  // Returns true if the handle is not busy and can be reused without reconnecting.
+  bool IsHealthy() const;
+
   util::StatusObject<file::ReadonlyFile*> OpenGcsFile(absl::string_view full_path);
 
   // Input: full gcs uri path that starts with "gs://"
@@ -131,6 +161,15 @@ class GCS {
   util::Status Write(strings::ByteRange data);
   util::Status CloseWrite(bool abort_write);
 
+  // Maximal number of source objects of a single Compose call.
+  static constexpr unsigned kMaxComposeSources = 32;
+
+  // Creates obj_path as the concatenation of src_paths, all in the same bucket.
+  util::Status Compose(absl::string_view bucket, absl::string_view obj_path,
+                       const std::vector<std::string>& src_paths);
+
+  util::Status Delete(absl::string_view bucket, absl::string_view obj_path);
+
  private:
   using Request = ::boost::beast::http::request<::boost::beast::http::empty_body>;
   template <typename Body> using Response = ::boost::beast::http::response<Body>;
@@ -141,7 +180,16 @@ class GCS {
 
   class ConnState;
 
-  util::Status RefreshToken(Request* req);
+  template <typename Body> util::Status RefreshToken(::boost::beast::http::request<Body>* req);
+
+  // Returns the authorization header with the latest token of gce_, which its refresher
+  // may have renewed since the previous request.
+  const std::string& access_token_header();
+
+  // Sends req and resends it once with a refreshed token if it was rejected as unauthorized.
+  template <typename ReqBody, typename RespBody>
+  util::Status SendAuthorized(::boost::beast::http::request<ReqBody>* req,
+                              Response<RespBody>* resp);
 
   std::string BuildGetObjUrl(absl::string_view bucket, absl::string_view path);
   util::Status PrepareConnection();
@@ -163,12 +211,90 @@ class GCS {
   }
 
   std::string access_token_header_;
+  // The GCE::token_version() of access_token_header_. The versions of the fetched tokens
+  // start from 1, hence 0 means that the header should be rebuilt.
+  uint64_t token_version_ = 0;
   std::unique_ptr<ConnState> conn_state_;
   std::unique_ptr<HttpsClient> https_client_;
 };
 
 bool IsGcsPath(absl::string_view path);
 
+// Pool of connected GCS handles that is shared by the readers, listers and writers of a
+// process, see ClientPool.
+class GcsPool : public ClientPool<GCS> {
+ public:
+  GcsPool(const GCE& gce, IoContextPool* io_pool, const Options& opts);
+
+  const GCE& gce() const { return gce_; }
+
+ private:
+  const GCE& gce_;
+};
+
+// Same as GCS::OpenGcsFile but over a handle of pool that is returned when the file is deleted.
+util::StatusObject<file::ReadonlyFile*> OpenGcsFile(absl::string_view full_path, GcsPool* pool);
+
+// Uploads an object as parts of part_size bytes that are written concurrently as temporary
+// objects over the handles of pool, each over its own connection, and composes them into the
+// object on Close. Objects smaller than part_size are uploaded directly.
+// Must be created and used from a single IoContext thread of the pool.
+class GcsComposeWriter {
+ public:
+  struct Options {
+    size_t part_size = 1 << 26;
+    unsigned max_parallel = 4;  // Number of parts that are uploaded concurrently.
+  };
+
+  GcsComposeWriter(GcsPool* pool, absl::string_view bucket, absl::string_view obj_path,
+                   const Options& opts);
+  ~GcsComposeWriter();
+
+  util::Status Write(strings::ByteRange src);
+
+  // Uploads the rest of the data and composes the object. If abort_write is true, deletes
+  // the uploaded parts instead.
+  util::Status Close(bool abort_write);
+
+ private:
+  struct Part;
+
+  // Starts uploading buf_ as the next part.
+  void StartPart();
+
+  // Waits until at most max_inflight parts are being uploaded.
+  util::Status WaitParts(size_t max_inflight);
+
+  // Composes the sources into the object, through intermediate objects if there are more than
+  // GCS::kMaxComposeSources of them.
+  util::Status ComposeAll(GCS* gcs, std::vector<std::string> sources);
+
+  void DeleteAll(GCS* gcs, const std::vector<std::string>& paths);
+
+  GcsPool* pool_;
+  std::string bucket_, obj_path_;
+  Options opts_;
+
+  std::string buf_;
+  std::vector<std::unique_ptr<Part>> parts_;
+  size_t num_done_ = 0;  // parts_ whose uploads were awaited.
+  util::Status status_;  // the first upload error.
+  bool closed_ = false;
+};
+
+struct GcsRangeReadOptions {
+  size_t range_size = 1 << 23;  // Size of every ranged request.
+  unsigned window = 4;          // Number of ranges that are fetched concurrently.
+};
+
+// Opens a sequential file that downloads the object with up to opts.window ranged requests
+// in flight, each over its own connection that is taken from pool. The ranges are
+// reassembled in order, hence a single large object is fetched at the aggregated bandwidth
+// of several connections. Must be opened and read from the same IoContext thread.
+util::StatusObject<file::ReadonlyFile*> OpenGcsRangeFile(absl::string_view full_path,
+                                                         GcsPool* pool,
+                                                         const GcsRangeReadOptions& opts);
+
 template <typename Req, typename Resp>
 auto HttpsClient::Send(const Req& req, Resp* resp) -> error_code {
   namespace h2 = ::boost::beast::http;
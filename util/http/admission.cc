@@ -0,0 +1,157 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/admission.h"
+
+#include <atomic>
+#include <chrono>
+
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "util/stats/varz_stats.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+using namespace boost;
+namespace h2 = beast::http;
+
+namespace {
+
+VarzShardedMapCount admission_varz("http-admission");
+
+std::atomic<uint64_t> next_admission_id{1};
+
+inline uint64_t NowNanos() {
+  return base::GetClockNanos<CLOCK_MONOTONIC>();
+}
+
+}  // namespace
+
+TokenBucket::TokenBucket(double rate, double burst, uint64_t now_ns)
+    : tokens_per_ns_(rate / 1e9), burst_(burst > 0 ? burst : rate), tokens_(burst_),
+      last_ns_(now_ns) {}
+
+bool TokenBucket::TryTake(uint64_t now_ns) {
+  if (now_ns > last_ns_) {
+    tokens_ = std::min(burst_, tokens_ + (now_ns - last_ns_) * tokens_per_ns_);
+    last_ns_ = now_ns;
+  }
+  if (tokens_ < 1)
+    return false;
+  tokens_ -= 1;
+  return true;
+}
+
+bool TokenBucket::IsFull(uint64_t now_ns) const {
+  return tokens_ + (now_ns - std::min(now_ns, last_ns_)) * tokens_per_ns_ >= burst_;
+}
+
+struct AdmissionControl::ThreadState {
+  uint32_t inflight = 0;
+  fibers::mutex mu;  // for cv only, all the fibers of the state run in the same thread.
+  fibers::condition_variable cv;
+
+  absl::flat_hash_map<string, TokenBucket> paths;
+  absl::flat_hash_map<ClientKey, TokenBucket> clients;
+};
+
+AdmissionControl::Ticket::~Ticket() {
+  if (state_) {
+    --state_->inflight;
+    state_->cv.notify_one();
+  }
+}
+
+AdmissionControl::AdmissionControl(const Options& opts)
+    : opts_(opts), id_(next_admission_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+AdmissionControl::~AdmissionControl() {}
+
+void AdmissionControl::SetPathRate(StringPiece path, double rate, double burst) {
+  CHECK_GT(rate, 0);
+  path_rates_[path] = make_pair(rate, burst);
+}
+
+auto AdmissionControl::GetThreadState() -> ThreadState* {
+  // Keyed by the ids, which are never reused, rather than by the addresses of the controls.
+  thread_local absl::flat_hash_map<uint64_t, ThreadState*> thread_states;
+
+  ThreadState*& st = thread_states[id_];
+  if (!st) {
+    std::unique_ptr<ThreadState> state(new ThreadState);
+    uint64_t now = NowNanos();
+    for (const auto& k_v : path_rates_) {
+      state->paths.emplace(k_v.first, TokenBucket(k_v.second.first, k_v.second.second, now));
+    }
+    st = state.get();
+
+    std::lock_guard<std::mutex> lk(mu_);
+    states_.push_back(std::move(state));
+  }
+  return st;
+}
+
+bool AdmissionControl::TakeClientToken(const asio::ip::address& client, uint64_t now_ns,
+                                       ThreadState* st) const {
+  ClientKey key = client.is_v4() ? asio::ip::make_address_v6(asio::ip::v4_mapped, client.to_v4())
+                                       .to_bytes()
+                                 : client.to_v6().to_bytes();
+
+  auto it = st->clients.find(key);
+  if (it == st->clients.end()) {
+    if (st->clients.size() >= opts_.max_clients) {
+      // The full buckets are in the same state as the new ones.
+      for (auto cit = st->clients.begin(); cit != st->clients.end();) {
+        if (cit->second.IsFull(now_ns)) {
+          st->clients.erase(cit++);
+        } else {
+          ++cit;
+        }
+      }
+    }
+    it = st->clients.emplace(key, TokenBucket(opts_.client_rate, opts_.client_burst, now_ns)).first;
+  }
+  return it->second.TryTake(now_ns);
+}
+
+h2::status AdmissionControl::Admit(StringPiece path, const asio::ip::address& client,
+                                   Ticket* ticket) {
+  ThreadState* st = GetThreadState();
+  uint64_t now = NowNanos();
+
+  auto pit = st->paths.find(path);
+  if (pit != st->paths.end() && !pit->second.TryTake(now)) {
+    admission_varz.Inc("path-limited");
+    return h2::status::too_many_requests;
+  }
+
+  if (opts_.client_rate > 0 && !TakeClientToken(client, now, st)) {
+    admission_varz.Inc("client-limited");
+    return h2::status::too_many_requests;
+  }
+
+  if (opts_.max_inflight && st->inflight >= opts_.max_inflight) {
+    bool admitted = false;
+    if (opts_.max_queue_ms) {
+      std::unique_lock<fibers::mutex> lk(st->mu);
+      admitted = st->cv.wait_for(lk, chrono::milliseconds(opts_.max_queue_ms),
+                                 [&] { return st->inflight < opts_.max_inflight; });
+    }
+    if (!admitted) {
+      admission_varz.Inc("shed");
+      return h2::status::service_unavailable;
+    }
+  }
+
+  ++st->inflight;
+  ticket->state_ = st;
+  return h2::status::ok;
+}
+
+}  // namespace http
+}  // namespace util
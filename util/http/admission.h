@@ -0,0 +1,100 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/beast/http/status.hpp>
+
+#include "absl/container/flat_hash_map.h"
+#include "strings/stringpiece.h"
+
+namespace util {
+namespace http {
+
+// Token bucket of rate tokens per second that holds up to burst tokens. Starts full.
+class TokenBucket {
+ public:
+  TokenBucket(double rate, double burst, uint64_t now_ns);
+
+  // Takes a token if there is one at now_ns.
+  bool TryTake(uint64_t now_ns);
+
+  bool IsFull(uint64_t now_ns) const;
+
+ private:
+  double tokens_per_ns_, burst_, tokens_;
+  uint64_t last_ns_;
+};
+
+/*
+  Admission control of the requests of a Listener, see ListenerBase::set_admission_control.
+  The requests that exceed the rate of their path or of their client IP are rejected with 429.
+  Once max_inflight requests run in an IO thread, the new ones wait up to max_queue_ms for
+  a slot and are rejected with 503 afterwards, i.e. the excess load is shed instead of
+  slowing down all the requests.
+  The state is kept per IO thread without locks, hence all the limits apply per IO thread.
+  A client with a single keep-alive connection is limited to exactly client_rate.
+*/
+class AdmissionControl {
+  struct ThreadState;
+
+ public:
+  struct Options {
+    double client_rate = 0;   // requests per second of a client IP, 0 for unlimited.
+    double client_burst = 0;  // 0 for a second worth of client_rate.
+
+    // The clients whose buckets are full are forgotten once a thread tracks more of them.
+    uint32_t max_clients = 10000;
+
+    uint32_t max_inflight = 0;  // 0 for unlimited.
+    uint32_t max_queue_ms = 0;  // how long a request may wait for an in-flight slot.
+  };
+
+  // The admitted request occupies an in-flight slot until its ticket is destroyed.
+  class Ticket {
+   public:
+    Ticket() = default;
+    Ticket(const Ticket&) = delete;
+    ~Ticket();
+
+   private:
+    friend class AdmissionControl;
+    ThreadState* state_ = nullptr;
+  };
+
+  explicit AdmissionControl(const Options& opts);
+  ~AdmissionControl();
+
+  // Limits the requests of path to rate per second, burst 0 for a second worth of requests.
+  // Must be called before the requests are admitted.
+  void SetPathRate(StringPiece path, double rate, double burst = 0);
+
+  // Returns ok and fills ticket if the request is admitted, otherwise the status to reject
+  // it with. Must be called from an IO thread, may block the calling fiber up to max_queue_ms.
+  ::boost::beast::http::status Admit(StringPiece path, const ::boost::asio::ip::address& client,
+                                     Ticket* ticket);
+
+ private:
+  using ClientKey = std::array<unsigned char, 16>;
+
+  ThreadState* GetThreadState();
+  bool TakeClientToken(const ::boost::asio::ip::address& client, uint64_t now_ns,
+                       ThreadState* st) const;
+
+  Options opts_;
+  absl::flat_hash_map<std::string, std::pair<double, double>> path_rates_;
+  const uint64_t id_;
+
+  std::mutex mu_;  // guards states_, which the threads add once.
+  std::vector<std::unique_ptr<ThreadState>> states_;
+};
+
+}  // namespace http
+}  // namespace util
@@ -14,6 +14,7 @@
 #include "base/logging.h"
 #include "util/asio/fiber_socket.h"
 #include "util/asio/yield.h"
+#include "util/trace/trace.h"
 
 namespace util {
 namespace http {
@@ -31,7 +32,11 @@ system::error_code Client::Connect(StringPiece host, StringPiece service) {
   socket_.reset(
       new FiberSyncSocket(strings::AsString(host), strings::AsString(service), &io_context_));
 
-  return socket_->ClientWaitToConnect(connect_timeout_ms_);
+  num_sent_ = 0;
+  system::error_code ec = socket_->ClientWaitToConnect(connect_timeout_ms_);
+  reusable_ = !ec;
+
+  return ec;
 }
 
 ::boost::system::error_code Client::Send(Verb verb, StringPiece url, StringPiece body,
@@ -46,12 +51,20 @@ system::error_code Client::Connect(StringPiece host, StringPiece service) {
   req.body().assign(body.begin(), body.end());
   req.prepare_payload();
 
+  // The sampled traces continue in the server.
+  trace::ScopedSpan span(url);
+  if (span.context().sampled())
+    req.set("traceparent", trace::ToTraceParent(span.context()));
+
   system::error_code ec;
 
   // Send the HTTP request to the remote host.
+  ++num_sent_;
+  reusable_ = false;
   h2::write(*socket_, req, ec);
   if (ec) {
     VLOG(1) << "Error " << ec;
+    span.set_error();
     return ec;
   }
 
@@ -60,6 +73,9 @@ system::error_code Client::Connect(StringPiece host, StringPiece service) {
 
   h2::read(*socket_, buffer, *response, ec);
   VLOG(2) << "Resp: " << *response;
+  reusable_ = !ec && response->keep_alive();
+  if (ec || response->result_int() >= 500)
+    span.set_error();
 
   return ec;
 }
@@ -38,6 +38,13 @@ class Client {
 
   bool IsConnected() const;
 
+  // True if the connection can carry more requests, i.e. the last request succeeded and
+  // the server did not ask to close the connection.
+  bool IsReusable() const { return reusable_ && IsConnected(); }
+
+  // Number of requests that were sent over the current connection.
+  unsigned num_sent() const { return num_sent_; }
+
   void set_connect_timeout_ms(uint32_t ms) { connect_timeout_ms_ = ms; }
 
   // Adds header to all future requests.
@@ -48,6 +55,8 @@ class Client {
  private:
   IoContext& io_context_;
   uint32_t connect_timeout_ms_ = 2000;
+  unsigned num_sent_ = 0;
+  bool reusable_ = false;
 
   using HeaderPair = std::pair<std::string, std::string>;
 
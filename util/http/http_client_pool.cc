@@ -0,0 +1,124 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/http_client_pool.h"
+
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+using namespace boost;
+
+namespace {
+
+Status ToStatus(const system::error_code& ec) {
+  return Status(StatusCode::IO_ERROR, absl::StrCat(ec.value(), ": ", ec.message()));
+}
+
+bool IsIdempotent(Client::Verb verb) {
+  using Verb = Client::Verb;
+  switch (verb) {
+    case Verb::get:
+    case Verb::head:
+    case Verb::put:
+    case Verb::delete_:
+    case Verb::options:
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+Status PooledClient::Connect(unsigned msec) {
+  set_connect_timeout_ms(msec);
+  system::error_code ec = Client::Connect(host_, service_);
+  if (ec) {
+    VLOG(1) << "Could not connect to " << host_ << ":" << service_ << " " << ec.message();
+    return ToStatus(ec);
+  }
+  return Status::OK;
+}
+
+ConnectionPool::ConnectionPool(IoContextPool* io_pool, const Options& opts)
+    : io_pool_(io_pool), opts_(opts) {}
+
+ConnectionPool::~ConnectionPool() {}
+
+auto ConnectionPool::GetServerPool(StringPiece host, StringPiece service) -> ServerPool* {
+  string key = absl::StrCat(host, ":", service);
+
+  lock_guard<mutex> lk(mu_);
+  auto& pool = servers_[key];
+  if (!pool) {
+    string h = strings::AsString(host), s = strings::AsString(service);
+    auto factory = [this, h, s](IoContext* cntx) {
+      PooledClient* client = new PooledClient(h, s, cntx);
+      for (const auto& k_v : headers_) {
+        client->AddHeader(k_v.first, k_v.second);
+      }
+      return client;
+    };
+    pool.reset(new ServerPool(io_pool_, std::move(factory), opts_));
+  }
+  return pool.get();
+}
+
+auto ConnectionPool::Get(StringPiece host, StringPiece service) -> StatusObject<Handle> {
+  // Not under mu_, since Get may block on the connection.
+  return GetServerPool(host, service)->Get();
+}
+
+Status ConnectionPool::Send(StringPiece host, StringPiece service, Verb verb, StringPiece url,
+                            StringPiece body, Response* response) {
+  ServerPool* pool = GetServerPool(host, service);
+
+  // Every failed connection is dropped, hence the loop ends once a new one is used.
+  while (true) {
+    auto res = pool->Get();
+    if (!res.ok())
+      return res.status;
+
+    Handle& client = res.obj;
+    bool reused = client->num_sent() > 0;
+    *response = Response{};
+    system::error_code ec = client->Send(verb, url, body, response);
+    if (!ec)
+      return Status::OK;
+
+    if (!reused || !IsIdempotent(verb))
+      return ToStatus(ec);
+    VLOG(1) << "Retrying over another connection after " << ec.message();
+  }
+}
+
+void ConnectionPool::ClearThisContext() {
+  vector<ServerPool*> pools;
+  {
+    lock_guard<mutex> lk(mu_);
+    for (auto& k_v : servers_) {
+      pools.push_back(k_v.second.get());
+    }
+  }
+
+  // Closing the connections may block, hence not under mu_.
+  for (ServerPool* pool : pools) {
+    pool->ClearThisContext();
+  }
+}
+
+size_t ConnectionPool::IdleCount() const {
+  size_t res = 0;
+  lock_guard<mutex> lk(mu_);
+  for (const auto& k_v : servers_) {
+    res += k_v.second->IdleCount();
+  }
+  return res;
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,85 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "util/asio/client_pool.h"
+#include "util/http/http_client.h"
+
+namespace util {
+namespace http {
+
+// Client of a fixed server, with the interface that util::ClientPool requires.
+class PooledClient : public Client {
+ public:
+  PooledClient(std::string host, std::string service, IoContext* io_context)
+      : Client(io_context), host_(std::move(host)), service_(std::move(service)) {}
+
+  Status Connect(unsigned msec);
+
+  bool IsHealthy() const { return IsReusable(); }
+
+ private:
+  std::string host_, service_;
+};
+
+/*
+  Keep-alive connections to HTTP servers that are shared by the fibers of a process.
+  The connections are kept per server ("host:service") and per IoContext of io_pool, see
+  util::ClientPool for the eviction of the idle connections and the limits of their number.
+  Connection is reused only if its last response succeeded and allowed keep-alive.
+  Thread-safe, but Get, Send and the handles must be used from the IoContext threads of io_pool.
+*/
+class ConnectionPool {
+  using ServerPool = ::util::ClientPool<PooledClient>;
+
+ public:
+  using Options = ServerPool::Options;
+  using Handle = ServerPool::Handle;
+  using Response = Client::Response;
+  using Verb = Client::Verb;
+
+  ConnectionPool(IoContextPool* io_pool, const Options& opts);
+  ~ConnectionPool();
+
+  // Adds header to all the requests of the connections. Must be called before the pool is used.
+  void AddHeader(std::string name, std::string value) {
+    headers_.emplace_back(std::move(name), std::move(value));
+  }
+
+  // Returns an idle connection of the calling IoContext to the server or connects a new one.
+  StatusObject<Handle> Get(StringPiece host, StringPiece service);
+
+  // Sends the request over a pooled connection. An idempotent request that fails over
+  // a reused connection, which the server might have closed meanwhile, is retried.
+  Status Send(StringPiece host, StringPiece service, Verb verb, StringPiece url,
+              StringPiece body, Response* response);
+  Status Send(StringPiece host, StringPiece service, Verb verb, StringPiece url,
+              Response* response) {
+    return Send(host, service, verb, url, StringPiece{}, response);
+  }
+
+  // Closes the idle connections of the calling IoContext. Must be called from every IoContext
+  // thread before the pool is destroyed.
+  void ClearThisContext();
+
+  // Number of idle connections to all the servers.
+  size_t IdleCount() const;
+
+ private:
+  ServerPool* GetServerPool(StringPiece host, StringPiece service);
+
+  IoContextPool* io_pool_;
+  Options opts_;
+  std::vector<std::pair<std::string, std::string>> headers_;
+
+  mutable std::mutex mu_;
+  std::unordered_map<std::string, std::unique_ptr<ServerPool>> servers_;
+};
+
+}  // namespace http
+}  // namespace util
@@ -6,12 +6,31 @@
 #include <boost/beast/core.hpp>  // for flat_buffer.
 #include <boost/beast/http.hpp>
 
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
 #include "base/logging.h"
 #include "strings/stringpiece.h"
 #include "util/asio/yield.h"
+#include "util/http/static_files.h"
 #include "util/http/status_page.h"
+#include "util/stats/varz_prometheus.h"
+#include "util/stats/varz_shm.h"
+#include "util/trace/trace.h"
+#include "util/zlib_source.h"
+#include "util/zstd_sinksource.h"
+
+DEFINE_bool(http_compress, true,
+            "Compresses the responses with gzip or zstd if the client accepts them");
+DEFINE_uint32(http_compress_min_bytes, 1024,
+              "The string responses that are shorter than this are not compressed");
+DEFINE_uint32(http_body_cache_kb, 64,
+              "The request body buffers up to this size are kept by the connection and "
+              "reused by its next requests");
 
 using namespace std;
 
@@ -29,6 +48,10 @@ const char kTextMime[] = "text/plain";
 
 namespace {
 
+// Favor the speed, the responses are compressed on the IO threads.
+constexpr unsigned kGzipLevel = 1;
+constexpr int kZstdLevel = 1;
+
 inline absl::string_view as_absl(::boost::string_view s) {
   return absl::string_view(s.data(), s.size());
 }
@@ -115,6 +138,21 @@ void ParseFlagz(const QueryArgs& args, h2::response<h2::string_body>* response)
   }
 }
 
+// Returns the recorded spans as OTLP JSON, only those of ?trace=<trace id> if it's given.
+void TracezHandler(const QueryArgs& args, StringResponse* response) {
+  uint64_t trace_id = 0;
+  for (const auto& k_v : args) {
+    if (k_v.first == "trace") {
+      // The OTLP ids are 128 bits, of which the low 64 bits are ours.
+      StringPiece id = k_v.second.size() > 16 ? k_v.second.substr(k_v.second.size() - 16)
+                                                : k_v.second;
+      trace_id = strtoull(strings::AsString(id).c_str(), nullptr, 16);
+    }
+  }
+  SetMime(kJsonMime, response);
+  response->body() = trace::SpansToJson(trace::CollectSpans(trace_id));
+}
+
 void FilezHandler(const QueryArgs& args, HttpHandler::SendFunction* send) {
   StringPiece file_name;
   for (const auto& k_v : args) {
@@ -158,28 +196,138 @@ void FilezHandler(const QueryArgs& args, HttpHandler::SendFunction* send) {
   return send->Invoke(std::move(file_resp));
 }
 
+// Returns the content encoding of the compressor or nullptr if none of accepted can be used.
+const char* NewCompressSink(uint8_t accepted, Sink* upstream, std::unique_ptr<Sink>* res) {
+  if (accepted & detail::kAcceptZstd) {
+    ZStdSink* zsink = new ZStdSink(upstream);
+    res->reset(zsink);
+    CHECK_STATUS(zsink->Init(kZstdLevel));
+    return "zstd";
+  }
+  if (accepted & detail::kAcceptGzip) {
+    res->reset(new ZlibSink(upstream, kGzipLevel));
+    return "gzip";
+  }
+  return nullptr;
+}
+
+bool ShouldCompress(uint8_t accepted, const h2::fields& header) {
+  return FLAGS_http_compress && accepted &&
+         header.find(h2::field::content_encoding) == header.end();
+}
+
+}  // namespace
+
+namespace detail {
+
+uint8_t ParseAcceptEncoding(StringPiece header) {
+  uint8_t res = 0;
+  for (StringPiece item : absl::StrSplit(header, ',')) {
+    StringPiece coding = item, params;
+    size_t pos = item.find(';');
+    if (pos != StringPiece::npos) {
+      coding = item.substr(0, pos);
+      params = absl::StripAsciiWhitespace(item.substr(pos + 1));
+    }
+    coding = absl::StripAsciiWhitespace(coding);
+
+    // q=0 rejects the coding.
+    double q = 1;
+    if (absl::ConsumePrefix(&params, "q=") && (!absl::SimpleAtod(params, &q) || q <= 0))
+      continue;
+
+    if (absl::EqualsIgnoreCase(coding, "gzip") || coding == "*") {
+      res |= kAcceptGzip;
+    } else if (absl::EqualsIgnoreCase(coding, "zstd")) {
+      res |= kAcceptZstd;
+    }
+  }
+  return res;
+}
+
+void CompressBody(uint8_t accepted, h2::fields* header, string* body) {
+  if (!ShouldCompress(accepted, *header) || body->size() < FLAGS_http_compress_min_bytes)
+    return;
+
+  StringSink* dest = new StringSink;
+  std::unique_ptr<Sink> zsink;
+  const char* encoding = NewCompressSink(accepted, dest, &zsink);
+  strings::ByteRange src(reinterpret_cast<const uint8_t*>(body->data()), body->size());
+  Status st = zsink->Append(src);
+  if (st.ok())
+    st = zsink->Flush();
+  if (!st.ok()) {
+    LOG(ERROR) << "Could not compress the response: " << st;
+    return;
+  }
+  VLOG(1) << "Compressed " << body->size() << " bytes into " << dest->contents().size();
+
+  body->swap(dest->contents());
+  header->set(h2::field::content_encoding, encoding);
+  header->set(h2::field::vary, "Accept-Encoding");
+}
+
+bool WrapCompressSink(uint8_t accepted, h2::fields* header, std::unique_ptr<Sink>* sink) {
+  if (!ShouldCompress(accepted, *header))
+    return false;
+
+  std::unique_ptr<Sink> zsink;
+  const char* encoding = NewCompressSink(accepted, sink->get(), &zsink);
+  sink->release();  // owned by zsink.
+  sink->swap(zsink);
+  header->set(h2::field::content_encoding, encoding);
+  header->set(h2::field::vary, "Accept-Encoding");
+  return true;
+}
+
+}  // namespace detail
+
+namespace {
+
+base::MemoryAccount* BodyAccount() {
+  static base::MemoryAccount* res = base::MemoryAccount::Get("http.request_bodies");
+  return res;
+}
+
 }  // namespace
 
 HttpHandler::HttpHandler(const ListenerBase* lb, IoContext* cntx)
-    : ConnectionHandler(cntx), registry_(lb) {
+    : ConnectionHandler(cntx), registry_(lb), body_charge_(BodyAccount()) {
   favicon_ = "https://rawcdn.githack.com/romange/gaia/master/util/http/favicon-32x32.png";
   resource_prefix_ = "https://cdn.jsdelivr.net/gh/romange/gaia/util/http";
 }
 
 system::error_code HttpHandler::HandleRequest() {
-  beast::flat_buffer buffer;
-  RequestType request;
+  // The body is appended to the buffer of the previous request.
+  body_cache_.clear();
+  parser_.emplace(std::piecewise_construct, std::make_tuple(std::move(body_cache_)));
 
   system::error_code ec;
 
-  h2::read(*socket_, buffer, request, ec);
+  // Pipelined requests are parsed from buffer_ without reading the socket.
+  h2::read(*socket_, buffer_, *parser_, ec);
   if (ec) {
+    parser_.reset();
     return to_asio(ec);
   }
+  RequestType& request = parser_->get();
   VLOG(1) << "Full Url: " << request.target();
+  body_charge_.Set(request.body().capacity());
 
   SendFunction send(*socket_);
+  send.close = draining();
+  auto ae = request.find(h2::field::accept_encoding);
+  if (ae != request.end())
+    send.accept_encodings = detail::ParseAcceptEncoding(as_absl(ae->value()));
+  RequestStarted();
   HandleRequestInternal(request, &send);
+  RequestFinished();
+
+  if (request.body().capacity() <= size_t(FLAGS_http_body_cache_kb) << 10) {
+    body_cache_ = std::move(request.body());
+  }
+  parser_.reset();
+  body_charge_.Set(body_cache_.capacity());
 
   return to_asio(send.ec);
 }
@@ -225,8 +373,56 @@ void HttpHandler::HandleRequestInternal(const RequestType& request, SendFunction
     return;
   }
 
+  if (path == "/metrics") {
+    // Scrapers are served the periodic snapshot, without walking the varz.
+    h2::response<h2::string_body> resp(h2::status::ok, request.version());
+    resp.set(h2::field::content_type, "text/plain; version=0.0.4");
+    resp.body() = *VarzPrometheusSnapshot();
+    return send->Invoke(std::move(resp));
+  }
+
+  if (path == "/tracez") {
+    h2::response<h2::string_body> resp(h2::status::ok, request.version());
+    TracezHandler(args, &resp);
+    return send->Invoke(std::move(resp));
+  }
+
+  if (path == "/fiberz") {
+    h2::response<h2::string_body> resp(h2::status::ok, request.version());
+    BuildFiberzPage(args, &resp);
+    return send->Invoke(std::move(resp));
+  }
+
   if (registry_) {
+    AdmissionControl::Ticket ticket;
+    if (registry_->admission_) {
+      if (client_.is_unspecified()) {
+        system::error_code ec;
+        client_ = socket_->remote_endpoint(ec).address();
+      }
+      h2::status st = registry_->admission_->Admit(path, client_, &ticket);
+      if (st != h2::status::ok) {
+        StringResponse resp(st, request.version());
+        resp.set(h2::field::retry_after, "1");
+        SetMime(kTextMime, &resp);
+        resp.body() = absl::StrCat(as_absl(h2::obsolete_reason(st)), "\n");
+        return send->Invoke(std::move(resp));
+      }
+    }
+
+    // The requests of the sampled callers continue their traces, the others may start new ones.
+    auto tp = request.find("traceparent");
+    trace::ScopedSpan span(path, tp != request.end() ? trace::ParseTraceParent(as_absl(tp->value()))
+                                                     : trace::NewTrace());
+
     auto it = registry_->cb_map_.find(path);
+    if (it == registry_->cb_map_.end()) {
+      for (const auto& pi : registry_->prefix_cbs_) {
+        if (absl::StartsWith(path, pi.prefix) && (!pi.is_protected || Authorize(args))) {
+          return pi.cb(request, path.substr(pi.prefix.size()), send);
+        }
+      }
+    }
     if (it == registry_->cb_map_.end() || (it->second.is_protected && !Authorize(args))) {
       h2::response<h2::string_body> resp(h2::status::unauthorized, request.version());
       return send->Invoke(std::move(resp));
@@ -235,11 +431,28 @@ void HttpHandler::HandleRequestInternal(const RequestType& request, SendFunction
   }
 }
 
+ListenerBase::ListenerBase() {
+  StartContinuousProfiling();
+  StartVarzShm();
+}
+
 bool ListenerBase::RegisterCb(StringPiece path, bool protect, RequestCb cb) {
   CbInfo info{protect, cb};
   auto res = cb_map_.emplace(path, info);
   return res.second;
 }
 
+void ListenerBase::RegisterPrefixCb(StringPiece prefix, bool protect, PrefixCb cb) {
+  prefix_cbs_.push_back(PrefixInfo{strings::AsString(prefix), protect, std::move(cb)});
+}
+
+void ListenerBase::RegisterStaticDir(StringPiece prefix, bool protect, std::string dir) {
+  RegisterPrefixCb(prefix, protect,
+                   [dir = std::move(dir)](const StringRequest& req, StringPiece rel_path,
+                                          SendFunction* send) {
+                     ServeStaticFile(req, dir, rel_path, send);
+                   });
+}
+
 }  // namespace http
 }  // namespace util
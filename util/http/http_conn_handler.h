@@ -3,13 +3,22 @@
 //
 #pragma once
 
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/chunk_encode.hpp>
+#include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/message.hpp>
+#include <boost/beast/http/parser.hpp>
 #include <boost/beast/http/serializer.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
 
+#include "absl/types/optional.h"
+#include "base/memory_account.h"
 #include "strings/unique_strings.h"
 #include "util/asio/connection_handler.h"
+#include "util/http/admission.h"
+#include "util/sinksource.h"
 
 namespace util {
 namespace http {
@@ -20,6 +29,7 @@ namespace http {
 // In case there is not '=' delimiter, only the first field is filled.
 typedef std::vector<std::pair<StringPiece, StringPiece>> QueryArgs;
 
+typedef ::boost::beast::http::request<::boost::beast::http::string_body> StringRequest;
 typedef ::boost::beast::http::response<::boost::beast::http::string_body> StringResponse;
 
 inline StringResponse MakeStringResponse(
@@ -36,6 +46,24 @@ extern const char kJsonMime[];
 extern const char kSvgMime[];
 extern const char kTextMime[];
 
+namespace detail {
+
+// The response encodings of Accept-Encoding that the server supports.
+enum : uint8_t { kAcceptGzip = 1, kAcceptZstd = 2 };
+
+uint8_t ParseAcceptEncoding(StringPiece header);
+
+// Compresses the body with one of the accepted encodings if it is at least
+// --http_compress_min_bytes long and sets the Content-Encoding header.
+void CompressBody(uint8_t accepted, ::boost::beast::http::fields* header, std::string* body);
+
+// Wraps sink with a compressor of one of the accepted encodings and sets the Content-Encoding
+// header. Returns false and keeps sink if the stream should not be compressed.
+bool WrapCompressSink(uint8_t accepted, ::boost::beast::http::fields* header,
+                      std::unique_ptr<Sink>* sink);
+
+}  // namespace detail
+
 // This is the C++11 equivalent of a generic lambda.
 // The function object is used to send an HTTP message.
 template <typename FiberSyncStream>
@@ -46,6 +74,11 @@ struct SendLambda {
 
   FiberSyncStream& stream_;
   error_code ec;
+  bool close = false;  // Set by draining connections to send "Connection: close".
+
+  // Accept-Encoding of the request, see detail::ParseAcceptEncoding. The string bodies and
+  // the streamed bodies are compressed with one of them.
+  uint8_t accept_encodings = 0;
 
   explicit SendLambda(FiberSyncStream& stream) : stream_(stream) {
   }
@@ -58,11 +91,112 @@ struct SendLambda {
     // We need the serializer here because the serializer requires
     // a non-const file_body, and the message oriented version of
     // http::write only works with const messages.
+    if (close)
+      msg.keep_alive(false);
+    MaybeCompress(&msg);
     msg.prepare_payload();
     ::boost::beast::http::response_serializer<Body> sr{msg};
 
     ::boost::beast::http::write(stream_, sr, ec);
   }
+
+  // Streams the body of a large response instead of buffering it. BeginStream sends
+  // the header, WriteBody sends the next part of the body and EndStream completes it.
+  // If the header has a content length, exactly that many bytes must be written,
+  // otherwise the body is sent with the chunked transfer encoding.
+  // The body may be produced by other fibers of the connection thread, as long as a single
+  // fiber writes at a time and the callback returns after EndStream.
+  // Once ec is set, the calls do nothing. The chunked bodies may be compressed.
+  void BeginStream(Response<::boost::beast::http::empty_body>&& msg) {
+    if (close)
+      msg.keep_alive(false);
+    chunked_ = !msg.has_content_length();
+    if (chunked_) {
+      msg.chunked(true);
+
+      std::unique_ptr<Sink> sink(new ChunkSink(this));
+      if (detail::WrapCompressSink(accept_encodings, &msg, &sink))
+        compressor_ = std::move(sink);
+    }
+    ::boost::beast::http::response_serializer<::boost::beast::http::empty_body> sr{msg};
+
+    ::boost::beast::http::write_header(stream_, sr, ec);
+  }
+
+  void WriteBody(::boost::asio::const_buffer buf) {
+    if (ec)
+      return;
+    if (compressor_) {
+      strings::ByteRange br(static_cast<const uint8_t*>(buf.data()), buf.size());
+      CheckStatus(compressor_->Append(br));
+    } else {
+      WriteRaw(buf);
+    }
+  }
+
+  void EndStream() {
+    if (compressor_) {
+      if (!ec)
+        CheckStatus(compressor_->Flush());
+      compressor_.reset();
+    }
+    if (!ec && chunked_)
+      ::boost::asio::write(stream_, ::boost::beast::http::make_chunk_last(), ec);
+  }
+
+  // Sends the header and len bytes of file fd from offset as the body, with sendfile.
+  void SendFile(Response<::boost::beast::http::empty_body>&& msg, int fd, off_t offset,
+                size_t len) {
+    if (close)
+      msg.keep_alive(false);
+    msg.content_length(len);
+    ::boost::beast::http::response_serializer<::boost::beast::http::empty_body> sr{msg};
+
+    ::boost::beast::http::write_header(stream_, sr, ec);
+    if (!ec && len)
+      stream_.SendFile(fd, offset, len, ec);
+  }
+
+ private:
+  // Writes the compressed body as chunks.
+  class ChunkSink : public Sink {
+   public:
+    explicit ChunkSink(SendLambda* owner) : owner_(owner) {}
+
+    Status Append(const strings::ByteRange& slice) final {
+      owner_->WriteRaw(::boost::asio::const_buffer(slice.data(), slice.size()));
+      return owner_->ec ? Status(StatusCode::IO_ERROR, owner_->ec.message()) : Status::OK;
+    }
+
+   private:
+    SendLambda* owner_;
+  };
+
+  void WriteRaw(::boost::asio::const_buffer buf) {
+    // An empty chunk would end the body.
+    if (ec || buf.size() == 0)
+      return;
+    if (chunked_) {
+      ::boost::asio::write(stream_, ::boost::beast::http::make_chunk(buf), ec);
+    } else {
+      ::boost::asio::write(stream_, buf, ec);
+    }
+  }
+
+  // The socket errors are already in ec.
+  void CheckStatus(const Status& st) {
+    if (!st.ok() && !ec)
+      ec = ::boost::system::errc::make_error_code(::boost::system::errc::io_error);
+  }
+
+  template <typename Body> void MaybeCompress(Response<Body>* msg) {}
+
+  void MaybeCompress(Response<::boost::beast::http::string_body>* msg) {
+    detail::CompressBody(accept_encodings, msg, &msg->body());
+  }
+
+  bool chunked_ = false;
+  std::unique_ptr<Sink> compressor_;
 };
 
 // Should be one per process. Represents http server interface.
@@ -75,20 +209,50 @@ class ListenerBase : public ListenerInterface {
   typedef SendLambda<FiberSyncSocket> SendFunction;
   typedef std::function<void(const QueryArgs&, SendFunction*)> RequestCb;
 
+  // Gets the whole request and the part of its path after the prefix.
+  typedef std::function<void(const StringRequest&, StringPiece, SendFunction*)> PrefixCb;
+
+  // Starts the continuous profiling of the process, see --profilez_continuous_sec, and
+  // the publishing of the varz into the shared memory, see --varz_shm.
+  ListenerBase();
+
   // Returns true if a callback was registered.
   bool RegisterCb(StringPiece path, bool protect, RequestCb cb);
 
+  // Handles the requests whose paths start with prefix and have no callback of their own.
+  // The first registered prefix that matches is used.
+  void RegisterPrefixCb(StringPiece prefix, bool protect, PrefixCb cb);
+
+  // Serves the files of dir for the paths that start with prefix and have no callback,
+  // e.g. prefix "/files/" maps "/files/a/b.tgz" to dir + "/a/b.tgz". The files are sent
+  // without copying them through user space and support ETag revalidation and byte ranges.
+  void RegisterStaticDir(StringPiece prefix, bool protect, std::string dir);
+
+  // Rate-limits and sheds the requests of the registered callbacks, the built-in pages
+  // are always served. Must be set before the listener serves.
+  void set_admission_control(std::unique_ptr<AdmissionControl> ac) {
+    admission_ = std::move(ac);
+  }
+
  private:
   struct CbInfo {
     bool is_protected;
     RequestCb cb;
   };
   StringPieceMap<CbInfo> cb_map_;
+
+  struct PrefixInfo {
+    std::string prefix;
+    bool is_protected;
+    PrefixCb cb;
+  };
+  std::vector<PrefixInfo> prefix_cbs_;
+  std::unique_ptr<AdmissionControl> admission_;
 };
 
 class HttpHandler : public ConnectionHandler {
  public:
-  using RequestType = ::boost::beast::http::request<::boost::beast::http::string_body>;
+  using RequestType = StringRequest;
   using SendFunction = ListenerBase::SendFunction;
 
   HttpHandler(const ListenerBase* registry, IoContext* cntx);
@@ -105,6 +269,20 @@ class HttpHandler : public ConnectionHandler {
   void HandleRequestInternal(const RequestType& req, SendFunction* send);
 
   const ListenerBase* registry_;
+  ::boost::asio::ip::address client_;  // resolved by the first request that needs it.
+
+  // Persists between the requests, since it may hold the next pipelined requests.
+  ::boost::beast::flat_buffer buffer_;
+
+  // Beast parsers can not be reset, hence each request emplaces a new one in place.
+  absl::optional<::boost::beast::http::request_parser<::boost::beast::http::string_body>> parser_;
+
+  // The body buffer of the previous request, reused by the next one if it is not larger
+  // than --http_body_cache_kb.
+  std::string body_cache_;
+
+  // The body of the current request or body_cache_ between the requests.
+  base::MemoryCharge body_charge_;
 };
 
 // http Listener + handler factory. By default creates HttpHandler.
@@ -1,21 +1,30 @@
 // Copyright 2018, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
+#include <sys/stat.h>
+
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/write.hpp>
 
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
 
+#include "absl/strings/str_cat.h"
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "file/file_util.h"
 
 #include "util/asio/accept_server.h"
 #include "util/asio/asio_utils.h"
 #include "util/asio/io_context_pool.h"
 #include "util/http/http_client.h"
+#include "util/http/http_client_pool.h"
 #include "util/http/http_testing.h"
 #include "util/http/beast_rj_utils.h"
+#include "util/zlib_source.h"
+#include "util/zstd_sinksource.h"
 
 namespace util {
 namespace http {
@@ -58,6 +67,309 @@ TEST_F(HttpTest, Client) {
 }
 
 
+TEST_F(HttpTest, ReusePort) {
+  Listener<> listener;
+  AcceptServer server(pool_.get());
+  uint16_t port = server.AddReusePortListener(0, &listener, true);
+  server.Run();
+
+  // Every connection is served by the thread that accepted it.
+  for (unsigned i = 0; i < pool_->size() * 4; ++i) {
+    Client client(&pool_->GetNextContext());
+    system::error_code ec = client.Connect("localhost", std::to_string(port));
+    ASSERT_FALSE(ec) << ec.message();
+
+    Client::Response res;
+    ec = client.Send(h2::verb::get, "/", &res);
+    ASSERT_FALSE(ec) << ec.message();
+    EXPECT_EQ(h2::status::ok, res.result());
+  }
+
+  server.Stop(true);
+}
+
+TEST_F(HttpTest, ConnectionPool) {
+  ConnectionPool::Options opts;
+  opts.max_active = 1;
+  ConnectionPool conn_pool(pool_.get(), opts);
+  const string port = std::to_string(port_);
+
+  IoContext& io_context = pool_->GetNextContext();
+  io_context.AwaitSafe([&] {
+    Client::Response res;
+    for (unsigned i = 0; i < 3; ++i) {
+      Status st = conn_pool.Send("localhost", port, h2::verb::get, "/", &res);
+      ASSERT_TRUE(st.ok()) << st;
+      EXPECT_EQ(h2::status::ok, res.result());
+    }
+    EXPECT_EQ(1, conn_pool.IdleCount());
+
+    // The same connection carries all the requests.
+    auto handle = conn_pool.Get("localhost", port);
+    ASSERT_TRUE(handle.ok());
+    EXPECT_EQ(3, handle.obj->num_sent());
+
+    // Waits for the connection in use.
+    bool done = false;
+    fibers::fiber fb([&] {
+      auto other = conn_pool.Get("localhost", port);
+      ASSERT_TRUE(other.ok());
+      done = true;
+    });
+    this_fiber::yield();
+    EXPECT_FALSE(done);
+    handle.obj.reset();
+    fb.join();
+    EXPECT_TRUE(done);
+  });
+
+  // The idle connection is closed by the server, it's dropped instead of being reused.
+  server_->Stop();
+  server_->Wait();
+  io_context.AwaitSafe([&] {
+    Client::Response res;
+    EXPECT_FALSE(conn_pool.Send("localhost", port, h2::verb::get, "/", &res).ok());
+    EXPECT_EQ(0, conn_pool.IdleCount());
+  });
+}
+
+TEST_F(HttpTest, PipelinedAndStreamed) {
+  Listener<> listener;
+  listener.RegisterCb("/ping", false, [](const QueryArgs& args, HttpHandler::SendFunction* send) {
+    StringResponse resp = MakeStringResponse();
+    resp.body() = "pong";
+    send->Invoke(std::move(resp));
+  });
+  listener.RegisterCb("/stream", false,
+                      [](const QueryArgs& args, HttpHandler::SendFunction* send) {
+                        send->BeginStream(h2::response<h2::empty_body>(h2::status::ok, 11));
+                        for (unsigned i = 0; i < 100; ++i) {
+                          string part = std::to_string(i) + ",";
+                          send->WriteBody(asio::buffer(part));
+                        }
+                        send->EndStream();
+                      });
+  AcceptServer server(pool_.get());
+  uint16_t port = server.AddListener(0, &listener);
+  server.Run();
+
+  // Both requests are sent at once and are read into the same buffer by the server.
+  asio::io_context io;
+  tcp::socket sock(io);
+  sock.connect(tcp::endpoint(address::from_string("127.0.0.1"), port));
+  string reqs;
+  for (const char* path : {"/ping", "/stream", "/ping"}) {
+    absl::StrAppend(&reqs, "GET ", path, " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  }
+  asio::write(sock, asio::buffer(reqs));
+
+  string expected;
+  for (unsigned i = 0; i < 100; ++i) {
+    expected += std::to_string(i) + ",";
+  }
+
+  beast::flat_buffer buffer;
+  for (const char* body : {"pong", expected.c_str(), "pong"}) {
+    h2::response<h2::string_body> resp;
+    h2::read(sock, buffer, resp);
+    EXPECT_EQ(h2::status::ok, resp.result());
+    EXPECT_EQ(body, resp.body());
+  }
+  EXPECT_EQ(0, buffer.size());
+
+  sock.close();
+  server.Stop(true);
+}
+
+TEST_F(HttpTest, ReusedBodies) {
+  Listener<> listener;
+  auto echo_cb = [](const StringRequest& req, StringPiece, HttpHandler::SendFunction* send) {
+    StringResponse resp = MakeStringResponse();
+    resp.body() = req.body();
+    send->Invoke(std::move(resp));
+  };
+  listener.RegisterPrefixCb("/echo", false, echo_cb);
+  AcceptServer server(pool_.get());
+  uint16_t port = server.AddListener(0, &listener);
+  server.Run();
+
+  // The bodies of the connection share a buffer, the large one is not kept.
+  vector<string> bodies{"abc", "", string(200 << 10, 'x'), "d", "efgh"};
+  asio::io_context io;
+  tcp::socket sock(io);
+  sock.connect(tcp::endpoint(address::from_string("127.0.0.1"), port));
+  string reqs;
+  for (const string& body : bodies) {
+    absl::StrAppend(&reqs, "POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: ",
+                    body.size(), "\r\n\r\n", body);
+  }
+  asio::write(sock, asio::buffer(reqs));
+
+  beast::flat_buffer buffer;
+  for (const string& body : bodies) {
+    h2::response<h2::string_body> resp;
+    h2::read(sock, buffer, resp);
+    EXPECT_EQ(h2::status::ok, resp.result());
+    EXPECT_EQ(body, resp.body());
+  }
+
+  sock.close();
+  server.Stop(true);
+}
+
+TEST_F(HttpTest, StaticFiles) {
+  string dir = file_util::JoinPath(base::GetTestTempDir(), "static");
+  mkdir(dir.c_str(), 0755);
+  string contents;
+  for (unsigned i = 0; i < 100; ++i) {
+    contents += "0123456789";
+  }
+  file_util::WriteStringToFileOrDie(contents, file_util::JoinPath(dir, "a.txt"));
+
+  Listener<> listener;
+  listener.RegisterStaticDir("/static/", false, dir);
+  AcceptServer server(pool_.get());
+  uint16_t port = server.AddListener(0, &listener);
+  server.Run();
+
+  asio::io_context io;
+  tcp::socket sock(io);
+  sock.connect(tcp::endpoint(address::from_string("127.0.0.1"), port));
+  beast::flat_buffer buffer;
+
+  auto fetch = [&](h2::verb verb, const char* target, h2::field field, const string& value) {
+    h2::request<h2::empty_body> req(verb, target, 11);
+    if (!value.empty())
+      req.set(field, value);
+    h2::write(sock, req);
+
+    h2::response_parser<h2::string_body> parser;
+    parser.skip(verb == h2::verb::head);
+    h2::read(sock, buffer, parser);
+    return parser.release();
+  };
+
+  auto resp = fetch(h2::verb::get, "/static/a.txt", h2::field::range, "");
+  EXPECT_EQ(h2::status::ok, resp.result());
+  EXPECT_EQ(contents, resp.body());
+  EXPECT_EQ("text/plain", resp[h2::field::content_type]);
+  string etag = resp[h2::field::etag].to_string();
+  ASSERT_FALSE(etag.empty());
+
+  resp = fetch(h2::verb::get, "/static/a.txt", h2::field::if_none_match, etag);
+  EXPECT_EQ(h2::status::not_modified, resp.result());
+  EXPECT_EQ("", resp.body());
+
+  resp = fetch(h2::verb::get, "/static/a.txt", h2::field::range, "bytes=15-24");
+  EXPECT_EQ(h2::status::partial_content, resp.result());
+  EXPECT_EQ("5678901234", resp.body());
+  EXPECT_EQ("bytes 15-24/1000", resp[h2::field::content_range]);
+
+  resp = fetch(h2::verb::get, "/static/a.txt", h2::field::range, "bytes=-3");
+  EXPECT_EQ("789", resp.body());
+
+  resp = fetch(h2::verb::get, "/static/a.txt", h2::field::range, "bytes=1000-");
+  EXPECT_EQ(h2::status::range_not_satisfiable, resp.result());
+
+  resp = fetch(h2::verb::head, "/static/a.txt", h2::field::range, "");
+  EXPECT_EQ(h2::status::ok, resp.result());
+  EXPECT_EQ("1000", resp[h2::field::content_length]);
+
+  resp = fetch(h2::verb::get, "/static/../static/a.txt", h2::field::range, "");
+  EXPECT_EQ(h2::status::not_found, resp.result());
+
+  resp = fetch(h2::verb::get, "/static/b.txt", h2::field::range, "");
+  EXPECT_EQ(h2::status::not_found, resp.result());
+
+  sock.close();
+  server.Stop(true);
+}
+
+string ReadAll(Source* source) {
+  string res;
+  uint8_t buf[1024];
+  while (true) {
+    auto st = source->Read(strings::MutableByteRange(buf, sizeof(buf)));
+    CHECK_STATUS(st.status);
+    if (st.obj == 0)
+      break;
+    res.append(strings::charptr(buf), st.obj);
+  }
+  return res;
+}
+
+TEST_F(HttpTest, Compression) {
+  string big;
+  for (unsigned i = 0; i < 1000; ++i) {
+    absl::StrAppend(&big, "\"varz-", i, "\": ", i * 7, ",\n");
+  }
+
+  Listener<> listener;
+  listener.RegisterCb("/big", false, [&](const QueryArgs& args, HttpHandler::SendFunction* send) {
+    StringResponse resp = MakeStringResponse();
+    resp.body() = big;
+    send->Invoke(std::move(resp));
+  });
+  listener.RegisterCb("/small", false,
+                      [](const QueryArgs& args, HttpHandler::SendFunction* send) {
+                        StringResponse resp = MakeStringResponse();
+                        resp.body() = "pong";
+                        send->Invoke(std::move(resp));
+                      });
+  listener.RegisterCb("/stream", false,
+                      [&](const QueryArgs& args, HttpHandler::SendFunction* send) {
+                        send->BeginStream(h2::response<h2::empty_body>(h2::status::ok, 11));
+                        for (size_t i = 0; i < big.size(); i += 100) {
+                          size_t sz = std::min<size_t>(100, big.size() - i);
+                          send->WriteBody(asio::buffer(big.data() + i, sz));
+                        }
+                        send->EndStream();
+                      });
+  AcceptServer server(pool_.get());
+  uint16_t port = server.AddListener(0, &listener);
+  server.Run();
+
+  asio::io_context io;
+  tcp::socket sock(io);
+  sock.connect(tcp::endpoint(address::from_string("127.0.0.1"), port));
+  beast::flat_buffer buffer;
+
+  auto fetch = [&](const char* target, const char* accept_encoding) {
+    h2::request<h2::empty_body> req(h2::verb::get, target, 11);
+    req.set(h2::field::accept_encoding, accept_encoding);
+    h2::write(sock, req);
+
+    h2::response<h2::string_body> resp;
+    h2::read(sock, buffer, resp);
+    EXPECT_EQ(h2::status::ok, resp.result());
+    return resp;
+  };
+
+  for (const char* target : {"/big", "/stream"}) {
+    auto resp = fetch(target, "deflate, gzip;q=0.8");
+    EXPECT_EQ("gzip", resp[h2::field::content_encoding]);
+    EXPECT_LT(resp.body().size(), big.size() / 2);
+    ZlibSource zsrc(new StringSource(resp.body()), ZlibSource::GZIP);
+    EXPECT_EQ(big, ReadAll(&zsrc));
+
+    resp = fetch(target, "gzip, zstd");
+    EXPECT_EQ("zstd", resp[h2::field::content_encoding]);
+    ZStdSource zstd_src(new StringSource(resp.body()));
+    EXPECT_EQ(big, ReadAll(&zstd_src));
+
+    resp = fetch(target, "gzip;q=0, identity");
+    EXPECT_EQ("", resp[h2::field::content_encoding]);
+    EXPECT_EQ(big, resp.body());
+  }
+
+  auto resp = fetch("/small", "gzip");
+  EXPECT_EQ("", resp[h2::field::content_encoding]);
+  EXPECT_EQ("pong", resp.body());
+
+  sock.close();
+  server.Stop(true);
+}
+
 void AddToMB(const char* str, beast::multi_buffer* dest) {
   size_t sz = strlen(str);
   size_t req_sz = sz * 2 + 10;
@@ -69,6 +381,62 @@ void AddToMB(const char* str, beast::multi_buffer* dest) {
   dest->commit(sz);
 }
 
+TEST_F(HttpTest, Admission) {
+  Listener<> listener;
+  auto ok_cb = [](const QueryArgs& args, HttpHandler::SendFunction* send) {
+    send->Invoke(MakeStringResponse());
+  };
+  listener.RegisterCb("/limited", false, ok_cb);
+  listener.RegisterCb("/slow", false, [](const QueryArgs& args, HttpHandler::SendFunction* send) {
+    this_fiber::sleep_for(100ms);
+    send->Invoke(MakeStringResponse());
+  });
+
+  AdmissionControl::Options opts;
+  opts.max_inflight = 1;
+  std::unique_ptr<AdmissionControl> ac(new AdmissionControl(opts));
+  ac->SetPathRate("/limited", 0.1, 2);
+  listener.set_admission_control(std::move(ac));
+
+  // A single IO thread, so that both connections share its in-flight slots.
+  IoContextPool server_pool(1);
+  server_pool.Run();
+  AcceptServer server(&server_pool);
+  uint16_t port = server.AddListener(0, &listener);
+  server.Run();
+
+  IoContext& io_context = pool_->GetNextContext();
+  io_context.AwaitSafe([&] {
+    Client client1(&io_context), client2(&io_context);
+    ASSERT_FALSE(client1.Connect("localhost", std::to_string(port)));
+    ASSERT_FALSE(client2.Connect("localhost", std::to_string(port)));
+
+    // The burst of the path passes, the rest is rate limited.
+    Client::Response res;
+    for (h2::status expected : {h2::status::ok, h2::status::ok, h2::status::too_many_requests}) {
+      ASSERT_FALSE(client1.Send(h2::verb::get, "/limited", &res));
+      EXPECT_EQ(expected, res.result());
+    }
+    EXPECT_EQ("1", res[h2::field::retry_after]);
+
+    // The second slow request is shed while the first one runs.
+    Client::Response res1;
+    fibers::fiber fb([&] { ASSERT_FALSE(client1.Send(h2::verb::get, "/slow", &res1)); });
+    this_fiber::sleep_for(30ms);
+    ASSERT_FALSE(client2.Send(h2::verb::get, "/slow", &res));
+    EXPECT_EQ(h2::status::service_unavailable, res.result());
+    fb.join();
+    EXPECT_EQ(h2::status::ok, res1.result());
+
+    // The built-in pages are not limited.
+    ASSERT_FALSE(client2.Send(h2::verb::get, "/", &res));
+    EXPECT_EQ(h2::status::ok, res.result());
+  });
+
+  server.Stop(true);
+  server_pool.Stop();
+}
+
 TEST_F(HttpTest, JsonParse) {
   const char kPart1[] = R"({ "key1" : "val1", "key2)";
   const char kPart2[] = R"(" : "val2", "key)";
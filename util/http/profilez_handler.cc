@@ -1,27 +1,51 @@
 // Copyright 2018, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
+#include <chrono>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include <gperftools/heap-profiler.h>
 #include <gperftools/malloc_extension.h>
 #include <gperftools/profiler.h>
 
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "base/logging.h"
+#include "base/pthread_utils.h"
 #include "base/walltime.h"
+#include "file/file_util.h"
 #include "strings/human_readable.h"
 #include "strings/numbers.h"
 #include "strings/split.h"
 #include "strings/strcat.h"
+#include "util/fibers/contention_profiler.h"
 #include "util/fibers/fibers_ext.h"
 #include "util/http/http_conn_handler.h"
+#include "util/http/status_page.h"
 #include "util/spawn.h"
 
+DEFINE_uint32(profilez_hz, 0,
+              "Frequency of the CPU profiles, 0 for the default of gperftools. "
+              "The profiler reads it once, hence it must be set on startup");
+DEFINE_uint32(profilez_continuous_sec, 0,
+              "If positive, the CPU is profiled continuously and /profilez?profile=recent "
+              "returns the last window of that many seconds. Use with a low --profilez_hz");
+
 namespace util {
 namespace http {
 namespace {
 char last_profile_suffix[100] = {0};
-}
+
+constexpr unsigned kMaxProfileSec = 600;
+
+// gperftools runs a single CPU profile at a time.
+std::mutex cpu_mu;
+bool cpu_busy = false;       // a timed or a continuous profile runs.
+std::string recent_profile;  // the file of the last continuous window.
+std::once_flag continuous_once;
+}  // namespace
 
 using namespace std;
 using namespace boost;
@@ -29,6 +53,142 @@ using beast::http::field;
 namespace h2 = beast::http;
 typedef h2::response<h2::string_body> StringResponse;
 
+static bool StartCpuProfiler(const string& profile_name) {
+  if (FLAGS_profilez_hz > 0) {
+    // The profiler reads the frequency when it is first started.
+    setenv("CPUPROFILE_FREQUENCY", absl::StrCat(FLAGS_profilez_hz).c_str(), 0);
+  }
+  return ProfilerStart(profile_name.c_str()) != 0;
+}
+
+// Converts the profile with pprof and returns the name of the svg file.
+static string RenderSvg(const string& profile_name) {
+  string cmd("nice -n 15 pprof -noinlines -lines -unit ms --svg ");
+  string symbols_name = base::ProgramAbsoluteFileName() + ".debug";
+  LOG(INFO) << "Symbols " << symbols_name << ", profile: " << profile_name;
+  if (access(symbols_name.c_str(), R_OK) != 0) {
+    symbols_name = base::ProgramAbsoluteFileName();
+  }
+  cmd.append(symbols_name).append(" ");
+  cmd.append(profile_name).append(" > ");
+
+  string err_log = profile_name + ".err";
+  string svg_name = profile_name + ".svg";
+
+  cmd.append(svg_name).append(" 2> ").append(err_log);
+
+  LOG(INFO) << "Running command: " << cmd;
+
+  int sh_res = util::sh_exec(cmd.c_str());
+  if (sh_res != 0) {
+    LOG(ERROR) << "Error running sh_exec, status: " << errno << " " << strerror(errno);
+  }
+  return svg_name;
+}
+
+// Responds with the profile file, either as is or as svg.
+static void SendProfile(const string& profile_name, bool svg, StringResponse* response) {
+  string fname = svg ? RenderSvg(profile_name) : profile_name;
+  if (!file_util::ReadFileToString(fname, &response->body())) {
+    response->result(h2::status::internal_server_error);
+    response->body() = absl::StrCat("Could not read ", fname, "\n");
+    return;
+  }
+  if (svg) {
+    response->set(field::content_type, kSvgMime);
+  } else {
+    response->set(field::content_type, "application/octet-stream");
+    response->set(field::content_disposition,
+                  absl::StrCat("attachment; filename=", base::ProgramBaseName(), ".prof"));
+  }
+}
+
+static void SendText(h2::status status, StringPiece text, StringResponse* response) {
+  response->result(status);
+  response->set(field::content_type, kTextMime);
+  response->body() = absl::StrCat(text, "\n");
+}
+
+// Profiles the CPU for seconds, while the calling thread waits.
+static void HandleTimedCpuProfile(unsigned seconds, bool svg, StringResponse* response) {
+  string profile_name = absl::StrCat("/tmp/", base::ProgramBaseName(),
+                                     base::LocalTimeNow("_%d%m%Y_%H%M%S_"), seconds, "s.prof");
+  {
+    std::lock_guard<std::mutex> lk(cpu_mu);
+    if (cpu_busy || last_profile_suffix[0] || !StartCpuProfiler(profile_name)) {
+      return SendText(h2::status::conflict, "The CPU is already being profiled", response);
+    }
+    cpu_busy = true;
+  }
+  LOG(INFO) << "Profiling for " << seconds << "s into " << profile_name;
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  ProfilerStop();
+  {
+    std::lock_guard<std::mutex> lk(cpu_mu);
+    cpu_busy = false;
+  }
+  SendProfile(profile_name, svg, response);
+}
+
+static void HandleRecentCpuProfile(bool svg, StringResponse* response) {
+  string profile_name;
+  {
+    std::lock_guard<std::mutex> lk(cpu_mu);
+    profile_name = recent_profile;
+  }
+  if (profile_name.empty()) {
+    return SendText(h2::status::not_found,
+                    "No continuous profile yet, see --profilez_continuous_sec", response);
+  }
+  SendProfile(profile_name, svg, response);
+}
+
+// The windows alternate between two files, hence the recent one is not overwritten
+// while it is sent.
+static void ProfileContinuously(unsigned window_sec) {
+  for (unsigned i = 0;; i ^= 1) {
+    string profile_name = absl::StrCat("/tmp/", base::ProgramBaseName(), "_continuous", i, ".prof");
+    if (!StartCpuProfiler(profile_name)) {
+      LOG(ERROR) << "Could not start the continuous profiling into " << profile_name;
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(window_sec));
+    ProfilerStop();
+
+    std::lock_guard<std::mutex> lk(cpu_mu);
+    recent_profile = profile_name;
+  }
+}
+
+// The heap is sampled only if tcmalloc was started with TCMALLOC_SAMPLE_PARAMETER,
+// e.g. 524288 bytes, which is cheap enough to be always on.
+static void HandleHeapSnapshot(bool growth, StringResponse* response) {
+  string& body = response->body();
+  if (growth) {
+    MallocExtension::instance()->GetHeapGrowthStacks(&body);
+  } else {
+    MallocExtension::instance()->GetHeapSample(&body);
+  }
+  response->set(field::content_type, "application/octet-stream");
+  response->set(field::content_disposition,
+                absl::StrCat("attachment; filename=", base::ProgramBaseName(), ".heap"));
+}
+
+static void HandleContention(StringPiece action, unsigned period, StringResponse* response) {
+  using fibers_ext::ContentionProfiler;
+
+  if (action == "on") {
+    ContentionProfiler::Enable(std::max(1U, period));
+    SendText(h2::status::ok, absl::StrCat("Sampling 1 of ", std::max(1U, period),
+                                          " contended fiber locks"), response);
+  } else if (action == "off") {
+    ContentionProfiler::Disable();
+    SendText(h2::status::ok, "Contention profiling is off", response);
+  } else {
+    SendText(h2::status::ok, ContentionProfiler::Dump(), response);
+  }
+}
+
 static void HandleCpuProfile(bool enable, StringResponse* response) {
   string profile_name = "/tmp/" + base::ProgramBaseName();
   response->set(h2::field::cache_control, "no-cache, no-store, must-revalidate");
@@ -38,13 +198,14 @@ static void HandleCpuProfile(bool enable, StringResponse* response) {
   auto& body = response->body();
 
   if (enable) {
-    if (last_profile_suffix[0]) {
+    std::lock_guard<std::mutex> lk(cpu_mu);
+    if (last_profile_suffix[0] || cpu_busy) {
       body.append("<p> Yo, already profiling, stupid!</p>\n");
     } else {
       string suffix = base::LocalTimeNow("_%d%m%Y_%H%M%S.prof");
       profile_name.append(suffix);
       strcpy(last_profile_suffix, suffix.c_str());
-      int res = ProfilerStart(profile_name.c_str());
+      int res = StartCpuProfiler(profile_name);
       LOG(INFO) << "Starting profiling into " << profile_name << " " << res;
       body.append(
           "<p> Yeah, let's profile this bitch, baby!</p> \n"
@@ -54,34 +215,21 @@ static void HandleCpuProfile(bool enable, StringResponse* response) {
     }
     return;
   }
+  {
+    std::lock_guard<std::mutex> lk(cpu_mu);
+    if (cpu_busy) {
+      body.append("<h3>A timed or continuous profile runs, commander!</h3> \n");
+      return;
+    }
+  }
   ProfilerStop();
   if (last_profile_suffix[0] == '\0') {
     body.append("<h3>Profiling is off, commander!</h3> \n");
     return;
   }
-  string cmd("nice -n 15 pprof -noinlines -lines -unit ms --svg ");
-  string symbols_name = base::ProgramAbsoluteFileName() + ".debug";
-  LOG(INFO) << "Symbols " << symbols_name << ", suffix: " << last_profile_suffix;
-  if (access(symbols_name.c_str(), R_OK) != 0) {
-    symbols_name = base::ProgramAbsoluteFileName();
-  }
-  cmd.append(symbols_name).append(" ");
-
   profile_name.append(last_profile_suffix);
-  cmd.append(profile_name).append(" > ");
-
-  string err_log = profile_name + ".err";
-  profile_name.append(".svg");
-
-  cmd.append(profile_name).append(" 2> ").append(err_log);
-
-  LOG(INFO) << "Running command: " << cmd;
   last_profile_suffix[0] = '\0';
-
-  int sh_res = util::sh_exec(cmd.c_str());
-  if (sh_res != 0) {
-    LOG(ERROR) << "Error running sh_exec, status: " << errno << " " << strerror(errno);
-  }
+  profile_name = RenderSvg(profile_name);
 
   // Redirect browser to show this file.
   string url("filez?file=");
@@ -119,24 +267,43 @@ static void HandleHeapProfile(bool enable, StringResponse* response) {
 }
 
 void ProfilezHandler(const QueryArgs& args, HttpHandler::SendFunction* send) {
-  bool enable = false;
-  bool heap = false;
+  StringPiece profile, heap, contention;
+  unsigned seconds = 30, period = 1;
+  bool svg = false;
   for (const auto& k_v : args) {
-    if (k_v.first == "profile" && k_v.second == "on")
-      enable = true;
-    if (k_v.first == "heap" && k_v.second == "on") {
-      heap = true;
+    if (k_v.first == "profile") {
+      profile = k_v.second;
+    } else if (k_v.first == "heap") {
+      heap = k_v.second;
+    } else if (k_v.first == "contention") {
+      contention = k_v.second;
+    } else if (k_v.first == "seconds") {
+      if (!absl::SimpleAtoi(k_v.second, &seconds) || seconds == 0)
+        seconds = 30;
+    } else if (k_v.first == "period") {
+      absl::SimpleAtoi(k_v.second, &period);
+    } else if (k_v.first == "format") {
+      svg = k_v.second == "svg";
     }
   }
+  seconds = std::min(seconds, kMaxProfileSec);
 
   fibers_ext::Done done;
   std::thread([=]() mutable {
     StringResponse response;
 
-    if (!heap) {
-      HandleCpuProfile(enable, &response);
+    if (!contention.empty()) {
+      HandleContention(contention, period, &response);
+    } else if (heap == "snapshot" || heap == "growth") {
+      HandleHeapSnapshot(heap == "growth", &response);
+    } else if (!heap.empty()) {
+      HandleHeapProfile(heap == "on", &response);
+    } else if (profile == "cpu") {
+      HandleTimedCpuProfile(seconds, svg, &response);
+    } else if (profile == "recent") {
+      HandleRecentCpuProfile(svg, &response);
     } else {
-      HandleHeapProfile(enable, &response);
+      HandleCpuProfile(profile == "on", &response);
     }
     send->Invoke(std::move(response));
     done.Notify();
@@ -148,5 +315,20 @@ void ProfilezHandler(const QueryArgs& args, HttpHandler::SendFunction* send) {
   done.Wait();
 }
 
+void StartContinuousProfiling() {
+  if (FLAGS_profilez_continuous_sec == 0)
+    return;
+
+  std::call_once(continuous_once, [] {
+    {
+      std::lock_guard<std::mutex> lk(cpu_mu);
+      cpu_busy = true;
+    }
+    unsigned window_sec = FLAGS_profilez_continuous_sec;
+    pthread_t tid = base::StartThread("profilez", [window_sec] { ProfileContinuously(window_sec); });
+    PTHREAD_CHECK(detach(tid));
+  });
+}
+
 }  // namespace http
 }  // namespace util
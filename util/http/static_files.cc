@@ -0,0 +1,197 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/static_files.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include <boost/beast/http/string_body.hpp>
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "base/logging.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+using namespace boost;
+namespace h2 = beast::http;
+
+namespace {
+
+inline absl::string_view as_absl(::boost::string_view s) {
+  return absl::string_view(s.data(), s.size());
+}
+
+const char* MimeOf(StringPiece path) {
+  static const pair<const char*, const char*> kMimes[] = {
+      {".html", kHtmlMime}, {".css", "text/css"},   {".js", "application/javascript"},
+      {".json", kJsonMime}, {".svg", kSvgMime},     {".png", "image/png"},
+      {".gif", "image/gif"}, {".jpg", "image/jpeg"}, {".txt", kTextMime}};
+
+  for (const auto& ext_mime : kMimes) {
+    if (absl::EndsWith(path, ext_mime.first))
+      return ext_mime.second;
+  }
+  return "application/octet-stream";
+}
+
+// Rejects the paths that could escape the directory.
+bool IsSafePath(StringPiece rel_path) {
+  if (rel_path.empty() || rel_path.find('\0') != StringPiece::npos)
+    return false;
+  for (StringPiece part : absl::StrSplit(rel_path, '/')) {
+    if (part == "..")
+      return false;
+  }
+  return true;
+}
+
+// The ETag changes whenever the file is modified or replaced.
+string MakeETag(const struct stat& st) {
+  uint64_t mtime_ns = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  return absl::StrCat("\"", absl::Hex(st.st_ino), "-", absl::Hex(st.st_size), "-",
+                      absl::Hex(mtime_ns), "\"");
+}
+
+bool MatchesETag(StringPiece header, StringPiece etag) {
+  for (StringPiece tag : absl::StrSplit(header, ',')) {
+    tag = absl::StripAsciiWhitespace(tag);
+    absl::ConsumePrefix(&tag, "W/");  // weak comparison, as If-None-Match requires.
+    if (tag == "*" || tag == etag)
+      return true;
+  }
+  return false;
+}
+
+enum class RangeResult { FULL, PARTIAL, UNSATISFIABLE };
+
+// Parses a single "bytes=" range of a file of size bytes into [*begin, *end).
+// Malformed and multiple ranges are ignored, i.e. the whole file is sent.
+RangeResult ParseRange(StringPiece header, size_t size, size_t* begin, size_t* end) {
+  if (!absl::ConsumePrefix(&header, "bytes=") || header.find(',') != StringPiece::npos)
+    return RangeResult::FULL;
+
+  size_t dash = header.find('-');
+  if (dash == StringPiece::npos)
+    return RangeResult::FULL;
+  StringPiece first = absl::StripAsciiWhitespace(header.substr(0, dash));
+  StringPiece last = absl::StripAsciiWhitespace(header.substr(dash + 1));
+  uint64_t a = 0, b = 0;
+
+  if (first.empty()) {  // suffix range: the last b bytes.
+    if (!absl::SimpleAtoi(last, &b))
+      return RangeResult::FULL;
+    if (b == 0 || size == 0)
+      return RangeResult::UNSATISFIABLE;
+    *begin = size - std::min<uint64_t>(b, size);
+    *end = size;
+    return RangeResult::PARTIAL;
+  }
+
+  if (!absl::SimpleAtoi(first, &a))
+    return RangeResult::FULL;
+  if (last.empty()) {
+    b = size;
+  } else if (!absl::SimpleAtoi(last, &b) || b < a) {
+    return RangeResult::FULL;
+  } else {
+    b = std::min<uint64_t>(b + 1, size);
+  }
+  if (a >= size)
+    return RangeResult::UNSATISFIABLE;
+
+  *begin = a;
+  *end = b;
+  return RangeResult::PARTIAL;
+}
+
+void SendStatus(h2::status status, unsigned version, HttpHandler::SendFunction* send) {
+  StringResponse resp(status, version);
+  SetMime(kTextMime, &resp);
+  resp.body() = absl::StrCat(as_absl(h2::obsolete_reason(status)), "\n");
+  send->Invoke(std::move(resp));
+}
+
+}  // namespace
+
+void ServeStaticFile(const HttpHandler::RequestType& request, const string& dir,
+                     StringPiece rel_path, HttpHandler::SendFunction* send) {
+  const unsigned version = request.version();
+  const bool is_head = request.method() == h2::verb::head;
+  if (!is_head && request.method() != h2::verb::get) {
+    return SendStatus(h2::status::method_not_allowed, version, send);
+  }
+  if (!IsSafePath(rel_path)) {
+    return SendStatus(h2::status::not_found, version, send);
+  }
+
+  string fname = absl::StrCat(dir, "/", rel_path);
+  int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0) {
+    int err = errno;
+    VLOG(1) << "Could not open " << fname << ": " << strerror(err);
+    return SendStatus(err == EACCES ? h2::status::forbidden : h2::status::not_found, version,
+                      send);
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return SendStatus(h2::status::not_found, version, send);
+  }
+
+  const size_t size = st.st_size;
+  const string etag = MakeETag(st);
+
+  h2::response<h2::empty_body> resp(h2::status::ok, version);
+  resp.set(h2::field::etag, etag);
+  resp.set(h2::field::accept_ranges, "bytes");
+
+  auto inm = request.find(h2::field::if_none_match);
+  if (inm != request.end() && MatchesETag(as_absl(inm->value()), etag)) {
+    close(fd);
+    resp.result(h2::status::not_modified);
+    return send->Invoke(std::move(resp));
+  }
+
+  size_t begin = 0, end = size;
+  auto range = request.find(h2::field::range);
+  auto if_range = request.find(h2::field::if_range);
+
+  // A stale If-Range asks for the whole new version of the file.
+  if (range != request.end() &&
+      (if_range == request.end() || as_absl(if_range->value()) == etag)) {
+    RangeResult rr = ParseRange(as_absl(range->value()), size, &begin, &end);
+    if (rr == RangeResult::UNSATISFIABLE) {
+      close(fd);
+      StringResponse err(h2::status::range_not_satisfiable, version);
+      err.set(h2::field::content_range, absl::StrCat("bytes */", size));
+      return send->Invoke(std::move(err));
+    }
+    if (rr == RangeResult::PARTIAL) {
+      resp.result(h2::status::partial_content);
+      resp.set(h2::field::content_range, absl::StrCat("bytes ", begin, "-", end - 1, "/", size));
+    }
+  }
+
+  SetMime(MimeOf(rel_path), &resp);
+  if (is_head) {
+    resp.content_length(end - begin);
+    send->BeginStream(std::move(resp));
+    send->EndStream();
+  } else {
+    send->SendFile(std::move(resp), fd, begin, end - begin);
+  }
+  close(fd);
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,20 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+
+#include "util/http/http_conn_handler.h"
+
+namespace util {
+namespace http {
+
+// Responds with file rel_path of dir, see ListenerBase::RegisterStaticDir.
+// Supports GET and HEAD, If-None-Match with the ETag of the file and a single byte range,
+// the other ranges are ignored and the whole file is sent.
+void ServeStaticFile(const HttpHandler::RequestType& request, const std::string& dir,
+                     StringPiece rel_path, HttpHandler::SendFunction* send);
+
+}  // namespace http
+}  // namespace util
@@ -3,8 +3,13 @@
 //
 #include "util/http/status_page.h"
 
+#include <algorithm>
+
+#include "absl/strings/str_format.h"
 #include "absl/strings/str_replace.h"
 #include "base/walltime.h"
+#include "util/asio/io_context.h"
+#include "util/asio/stall_detector.h"
 #include "util/proc_stats.h"
 #include "util/stats/varz_stats.h"
 
@@ -33,6 +38,27 @@ string StatusLine(const string& name, const string& val) {
   res.append(name).append(":<span class='key_text'>").append(val).append("</span></div>\n");
   return res;
 }
+
+// The recent stalls of the IO threads with their stacks, see --io_stall_threshold_ms.
+string IoStallsPanel() {
+  auto stalls = GetIoStalls();
+  if (stalls.empty())
+    return string{};
+
+  string res("<div class='styled_border'>IO stalls:<pre>\n");
+  for (const IoStall& stall : stalls) {
+    absl::StrAppend(&res, base::PrintLocalTime(stall.at), " thread ", stall.thread, ", fiber ",
+                    stall.fiber, ", stuck for ", stall.stuck_ms, "ms\n");
+    for (const string& frame : stall.stack) {
+      // Symbols of templates have angle brackets.
+      absl::StrAppend(&res, "    ",
+                      absl::StrReplaceAll(frame, {{"&", "&amp;"}, {"<", "&lt;"}, {">", "&gt;"}}),
+                      "\n");
+    }
+  }
+  res.append("</pre></div>\n");
+  return res;
+}
 }  // namespace
 
 void BuildStatusPage(const QueryArgs& args, const char* resource_prefix,
@@ -82,8 +108,10 @@ void BuildStatusPage(const QueryArgs& args, const char* resource_prefix,
   }
   a += StatusLine("Started on", base::PrintLocalTime(start_time));
   a += StatusLine("Uptime", GetTimerString(time(NULL) - start_time));
+  a += "</div>\n";
+  a += IoStallsPanel();
 
-  a += R"(</div>
+  a += R"(
 </body>
 <script>
 var json_text1 = {)";
@@ -96,5 +124,36 @@ document.querySelector('.left_panel').innerHTML = JsonToHTML(json_text1);
   response->body() = std::move(a);
 }
 
+void BuildFiberzPage(const QueryArgs& args, StringResponse* response) {
+  auto stats = GetFiberStats();
+
+  // The fibers that hog the IO threads come first.
+  std::sort(stats.begin(), stats.end(), [](const auto& a, const auto& b) {
+    return a.second.cpu_nanos > b.second.cpu_nanos;
+  });
+
+  string& body = response->body();
+  if (stats.empty()) {
+    body = "No fiber stats, run with --fiber_stats\n";
+  } else {
+    absl::StrAppendFormat(&body, "%-32s %12s %12s %10s %10s %10s %10s\n", "fiber", "cpu-ms",
+                          "switches", "ready-avg", "ready-p50", "ready-p99", "ready-max");
+  }
+  for (const auto& k_v : stats) {
+    const FiberStats& st = k_v.second;
+    const base::Histogram& h = st.ready_micros;
+    bool has_ready = h.count() > 0;
+    absl::StrAppendFormat(&body, "%-32s %12.1f %12d %10.0f %10.0f %10.0f %10.0f\n",
+                          k_v.first.empty() ? "unnamed" : k_v.first, st.cpu_nanos / 1e6,
+                          st.switches, has_ready ? h.Average() : 0,
+                          has_ready ? h.Median() : 0, has_ready ? h.Percentile(99) : 0,
+                          has_ready ? h.max() : 0);
+  }
+  if (!stats.empty())
+    body.append("\nready-* are the microseconds from becoming ready until running.\n");
+
+  response->set(field::content_type, kTextMime);
+}
+
 }  // namespace http
 }  // namespace util
@@ -11,8 +11,21 @@ namespace http {
 void BuildStatusPage(const QueryArgs& args, const char* resource_prefix,
                      StringResponse* response);
 
+// Toggles the CPU and the heap profilers with "profile=on|off" and "heap=on|off".
+// Besides:
+//   "profile=cpu&seconds=N[&format=svg]" responds with a CPU profile of the next N seconds.
+//   "profile=recent[&format=svg]" responds with the last window of the continuous profiling.
+//   "heap=snapshot" and "heap=growth" respond with the sampled heap of tcmalloc.
+//   "contention=on[&period=N]|off|dump" samples the contended fiber locks.
+// The profiles are in the pprof format unless format=svg.
 void ProfilezHandler(const QueryArgs& args, HttpHandler::SendFunction* send);
 
+// Starts the continuous CPU profiling if --profilez_continuous_sec is set. Idempotent.
+void StartContinuousProfiling();
+
+// Prints the runtime stats of the IO fibers, see --fiber_stats.
+void BuildFiberzPage(const QueryArgs& args, StringResponse* response);
+
 }  // namespace http
 }  // namespace util
 
@@ -2,6 +2,9 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 #include "util/math/float2decimal.h"
+
+#include <vector>
+
 #include "base/logging.h"
 
 #define FAST_DTOA_UNREACHABLE() __builtin_unreachable();
@@ -586,6 +589,292 @@ std::pair<unsigned, int> Grisu2(Fp m_minus, Fp v, Fp m_plus, char* buf) {
   return Grisu2DigitGen(buf, -cached.k, M_minus, w, M_plus);
 }
 
+namespace {
+
+// Ryu, see d2s.c of https://github.com/ulfjack/ryu.
+using uint128_t = unsigned __int128;
+
+constexpr int kDoubleMantissaBits = 52;
+constexpr int kDoubleBias = 1023;
+constexpr int kPow5InvBitCount = 125;
+constexpr int kPow5BitCount = 125;
+constexpr unsigned kPow5TableSize = 326;
+constexpr unsigned kPow5InvTableSize = 342;
+
+// Little-endian multiprecision integer, just enough to compute the tables below.
+class BigUint {
+ public:
+  explicit BigUint(uint32_t v) : limbs_(1, v) {}
+
+  static BigUint Pow2(unsigned e) {
+    BigUint res(0);
+    res.limbs_.assign(e / 32 + 1, 0);
+    res.limbs_.back() = 1u << (e % 32);
+    return res;
+  }
+
+  void MulSmall(uint32_t m) {
+    uint64_t carry = 0;
+    for (uint32_t& limb : limbs_) {
+      uint64_t v = uint64_t(limb) * m + carry;
+      limb = uint32_t(v);
+      carry = v >> 32;
+    }
+    if (carry)
+      limbs_.push_back(carry);
+  }
+
+  void DivSmall(uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = limbs_.size(); i-- > 0;) {
+      uint64_t v = (rem << 32) | limbs_[i];
+      limbs_[i] = v / d;
+      rem = v % d;
+    }
+    while (limbs_.size() > 1 && limbs_.back() == 0)
+      limbs_.pop_back();
+  }
+
+  unsigned BitLength() const {
+    return (limbs_.size() - 1) * 32 + 32 - __builtin_clz(limbs_.back());
+  }
+
+  // Returns bits [shift, shift + 128) of the number.
+  uint128_t Bits(unsigned shift) const {
+    uint128_t res = 0;
+    for (unsigned i = 0; i < 128; i += 32) {
+      res |= uint128_t(Limb32(shift + i)) << i;
+    }
+    return res;
+  }
+
+ private:
+  // 32 bits starting at bit pos.
+  uint32_t Limb32(unsigned pos) const {
+    unsigned idx = pos / 32, off = pos % 32;
+    uint64_t v = idx < limbs_.size() ? limbs_[idx] : 0;
+    if (idx + 1 < limbs_.size())
+      v |= uint64_t(limbs_[idx + 1]) << 32;
+    return uint32_t(v >> off);
+  }
+
+  std::vector<uint32_t> limbs_;
+};
+
+// pow5[i] holds the top kPow5BitCount bits of 5^i and pow5_inv[i] holds
+// floor(2^(bitlength(5^i) - 1 + kPow5InvBitCount) / 5^i) + 1, as (low, high) words.
+// Computed once instead of being spelled out as in the reference implementation.
+struct RyuTables {
+  uint64_t pow5[kPow5TableSize][2];
+  uint64_t pow5_inv[kPow5InvTableSize][2];
+
+  RyuTables() {
+    constexpr unsigned kInvShift = 1024;  // larger than the bit length of 2^j.
+
+    BigUint pow(1);
+    BigUint inv = BigUint::Pow2(kInvShift);  // floor(2^kInvShift / 5^i)
+    for (unsigned i = 0; i < kPow5InvTableSize; ++i) {
+      unsigned len = pow.BitLength();
+      if (i < kPow5TableSize) {
+        uint128_t v = len >= kPow5BitCount ? pow.Bits(len - kPow5BitCount)
+                                           : pow.Bits(0) << (kPow5BitCount - len);
+        Store(v, pow5[i]);
+      }
+
+      unsigned j = len - 1 + kPow5InvBitCount;
+      Store(inv.Bits(kInvShift - j) + 1, pow5_inv[i]);
+
+      pow.MulSmall(5);
+      inv.DivSmall(5);
+    }
+  }
+
+  static void Store(uint128_t v, uint64_t* dest) {
+    dest[0] = uint64_t(v);
+    dest[1] = uint64_t(v >> 64);
+  }
+};
+
+const RyuTables& GetRyuTables() {
+  static const RyuTables tables;
+  return tables;
+}
+
+// Returns e == 0 ? 1 : ceil(log_2(5^e)) for 0 <= e <= 3528.
+inline int32_t Pow5Bits(int32_t e) {
+  return int32_t((uint32_t(e) * 1217359) >> 19) + 1;
+}
+
+// Returns floor(log_10(2^e)) for 0 <= e <= 1650.
+inline uint32_t Log10Pow2(int32_t e) {
+  return (uint32_t(e) * 78913) >> 18;
+}
+
+// Returns floor(log_10(5^e)) for 0 <= e <= 2620.
+inline uint32_t Log10Pow5(int32_t e) {
+  return (uint32_t(e) * 732923) >> 20;
+}
+
+inline uint32_t Pow5Factor(uint64_t value) {
+  uint32_t count = 0;
+  while (value % 5 == 0) {
+    value /= 5;
+    ++count;
+  }
+  return count;
+}
+
+inline bool MultipleOfPowerOf5(uint64_t value, uint32_t p) {
+  return Pow5Factor(value) >= p;
+}
+
+inline bool MultipleOfPowerOf2(uint64_t value, uint32_t p) {
+  return (value & ((1ull << p) - 1)) == 0;
+}
+
+inline uint64_t MulShift64(uint64_t m, const uint64_t* mul, int32_t j) {
+  const uint128_t b0 = uint128_t(m) * mul[0];
+  const uint128_t b2 = uint128_t(m) * mul[1];
+  return uint64_t(((b0 >> 64) + b2) >> (j - 64));
+}
+
+}  // namespace
+
+std::pair<unsigned, int> Ryu(double v, char* buf) {
+  const IEEEFloat<double> bits(v);
+  const uint64_t ieee_mantissa = bits.SignificandBits();
+  const uint32_t ieee_exponent = bits.ExponentBits();
+  DCHECK(!bits.IsNegative() && !bits.IsZero() && !bits.IsNaN() && !bits.IsInf());
+
+  const RyuTables& tables = GetRyuTables();
+
+  // Step 1: decode, the value is m2 * 2^e2. The two extra bits of e2 are for the bounds.
+  int32_t e2;
+  uint64_t m2;
+  if (ieee_exponent == 0) {
+    e2 = 1 - kDoubleBias - kDoubleMantissaBits - 2;
+    m2 = ieee_mantissa;
+  } else {
+    e2 = int32_t(ieee_exponent) - kDoubleBias - kDoubleMantissaBits - 2;
+    m2 = (1ull << kDoubleMantissaBits) | ieee_mantissa;
+  }
+  const bool accept_bounds = (m2 & 1) == 0;
+
+  // Step 2: the interval of the valid decimal representations is [mm, mp] * 2^e2.
+  const uint64_t mv = 4 * m2;
+  const uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+  // Step 3: convert the interval to a decimal power base.
+  uint64_t vr, vp, vm;
+  int32_t e10;
+  bool vm_is_trailing_zeros = false;
+  bool vr_is_trailing_zeros = false;
+
+  if (e2 >= 0) {
+    const uint32_t q = Log10Pow2(e2) - (e2 > 3);
+    e10 = int32_t(q);
+    const int32_t k = kPow5InvBitCount + Pow5Bits(int32_t(q)) - 1;
+    const int32_t i = -e2 + int32_t(q) + k;
+    const uint64_t* mul = tables.pow5_inv[q];
+    vr = MulShift64(4 * m2, mul, i);
+    vp = MulShift64(4 * m2 + 2, mul, i);
+    vm = MulShift64(4 * m2 - 1 - mm_shift, mul, i);
+
+    if (q <= 21) {
+      // Only one of mp, mv and mm can be a multiple of 5, if any.
+      if (mv % 5 == 0) {
+        vr_is_trailing_zeros = MultipleOfPowerOf5(mv, q);
+      } else if (accept_bounds) {
+        vm_is_trailing_zeros = MultipleOfPowerOf5(mv - 1 - mm_shift, q);
+      } else {
+        vp -= MultipleOfPowerOf5(mv + 2, q);
+      }
+    }
+  } else {
+    const uint32_t q = Log10Pow5(-e2) - (-e2 > 1);
+    e10 = int32_t(q) + e2;
+    const int32_t i = -e2 - int32_t(q);
+    const int32_t k = Pow5Bits(i) - kPow5BitCount;
+    const int32_t j = int32_t(q) - k;
+    const uint64_t* mul = tables.pow5[i];
+    vr = MulShift64(4 * m2, mul, j);
+    vp = MulShift64(4 * m2 + 2, mul, j);
+    vm = MulShift64(4 * m2 - 1 - mm_shift, mul, j);
+
+    if (q <= 1) {
+      // mv = 4 * m2 has at least 2 trailing zero bits, mm has one iff mm_shift is 1.
+      vr_is_trailing_zeros = true;
+      if (accept_bounds) {
+        vm_is_trailing_zeros = mm_shift == 1;
+      } else {
+        --vp;  // mp = mv + 2 has one.
+      }
+    } else if (q < 63) {
+      vr_is_trailing_zeros = MultipleOfPowerOf2(mv, q);
+    }
+  }
+
+  // Step 4: find the shortest decimal representation in the interval.
+  int32_t removed = 0;
+  uint8_t last_removed_digit = 0;
+  uint64_t output;
+
+  if (vm_is_trailing_zeros || vr_is_trailing_zeros) {
+    // The general case, happens rarely.
+    while (vp / 10 > vm / 10) {
+      vm_is_trailing_zeros &= vm % 10 == 0;
+      vr_is_trailing_zeros &= last_removed_digit == 0;
+      last_removed_digit = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      ++removed;
+    }
+    if (vm_is_trailing_zeros) {
+      while (vm % 10 == 0) {
+        vr_is_trailing_zeros &= last_removed_digit == 0;
+        last_removed_digit = vr % 10;
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
+        ++removed;
+      }
+    }
+    if (vr_is_trailing_zeros && last_removed_digit == 5 && vr % 2 == 0) {
+      last_removed_digit = 4;  // round to even if the exact number is .....50..0.
+    }
+    output = vr + ((vr == vm && (!accept_bounds || !vm_is_trailing_zeros)) ||
+                   last_removed_digit >= 5);
+  } else {
+    bool round_up = false;
+    if (vp / 100 > vm / 100) {  // removes two digits at a time.
+      round_up = vr % 100 >= 50;
+      vr /= 100;
+      vp /= 100;
+      vm /= 100;
+      removed += 2;
+    }
+    while (vp / 10 > vm / 10) {
+      round_up = vr % 10 >= 5;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      ++removed;
+    }
+    output = vr + (vr == vm || round_up);
+  }
+
+  unsigned len = 1;
+  for (uint64_t t = output; t >= 10; t /= 10)
+    ++len;
+  for (unsigned i = len; i-- > 0;) {
+    buf[i] = '0' + output % 10;
+    output /= 10;
+  }
+
+  return std::make_pair(len, e10 + removed);
+}
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
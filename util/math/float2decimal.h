@@ -34,6 +34,12 @@
 // [2]  Burger, Dybvig, "Printing Floating-Point Numbers Quickly and Accurately",
 //      Proceedings of the ACM SIGPLAN 1996 Conference on Programming Language Design and
 //      Implementation, PLDI 1996
+// [3]  Adams, "Ryu: Fast Float-to-String Conversion",
+//      Proceedings of the ACM SIGPLAN 2018 Conference on Programming Language Design and
+//      Implementation, PLDI 2018
+//
+// Doubles are converted with Ryu [3], which unlike Grisu2 always returns the shortest
+// representation. Floats still use Grisu2.
 
 // Header-only U+1F926 U+1F937
 
@@ -148,6 +154,10 @@ template<typename Float> struct FpTraits {  // explicit division of mantissa by
 // Returns (filled buffer len, decimal_exponent) pair.
 std::pair<unsigned, int> Grisu2(Fp m_minus, Fp v, Fp m_plus, char* buf);
 
+// Writes the shortest decimal digits that round-trip to v into buf, the closest to v among
+// them, and returns the same pair as Grisu2. v must be finite and positive.
+std::pair<unsigned, int> Ryu(double v, char* buf);
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
@@ -259,6 +269,15 @@ inline BoundedFp ComputeBoundedFp(Float v_ieee) {
 
 char* FormatBuffer(char* buf, int k, int n);
 
+inline std::pair<unsigned, int> DecimalDigits(double v, char* buf) {
+  return Ryu(v, buf);
+}
+
+inline std::pair<unsigned, int> DecimalDigits(float v, char* buf) {
+  BoundedFp w = ComputeBoundedFp(v);
+  return Grisu2(w.minus, w.w, w.plus, buf);
+}
+
 //
 // Generates a decimal representation of the input floating-point number V in
 // BUF.
@@ -306,11 +325,9 @@ template <typename Float> char* ToString(Float value, char* dest) {
   if (v.IsZero()) {
     *dest++ = '0';
   } else {
-    BoundedFp w = ComputeBoundedFp(v.Abs());
-
     // Compute the decimal digits of v = digits * 10^decimal_exponent.
     // len is the length of the buffer, i.e. the number of decimal digits
-    std::pair<unsigned, int> res = Grisu2(w.minus, w.w, w.plus, dest);
+    std::pair<unsigned, int> res = DecimalDigits(v.Abs(), dest);
 
     // Compute the position of the decimal point relative to the start of the buffer.
     int n = res.first + res.second;
@@ -336,13 +353,11 @@ template <typename Float> bool ToDecimal(Float value, int64_t* val, int16_t* exp
     *exponent = 0;
     *decimal_len = 1;
   } else {
-    BoundedFp w = ComputeBoundedFp(v.Abs());
-
     // Compute the decimal digits of v = digits * 10^decimal_exponent.
     // len is the length of the buffer, i.e. the number of decimal digits
     char dest[20];
 
-    std::pair<unsigned, int> res = Grisu2(w.minus, w.w, w.plus, dest);
+    std::pair<unsigned, int> res = DecimalDigits(v.Abs(), dest);
     assert(res.first < 18);
     for (unsigned i = 0; i < res.first; ++i) {
       decimal = decimal * 10 + (dest[i] - '0');
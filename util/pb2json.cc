@@ -9,13 +9,16 @@
 #include <rapidjson/reader.h>
 #include <rapidjson/writer.h>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/container/inlined_vector.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/types/optional.h"
 #include "absl/types/variant.h"
 
+#include "base/hash.h"
 #include "base/logging.h"
+#include "base/simd.h"
 #include "util/pb/refl.h"
 
 using std::string;
@@ -29,90 +32,23 @@ typedef gpb::FieldDescriptor FD;
 using RapidWriter =
     rj::Writer<rj::StringBuffer, rj::UTF8<>, rj::UTF8<>, rj::CrtAllocator, rj::kWriteNanAndInfFlag>;
 
-void PrintValue(const gpb::Message& msg, const Pb2JsonOptions& options,
-                const gpb::FieldDescriptor* fd, const gpb::Reflection* refl, RapidWriter* res);
-void PrintRepeated(const gpb::Message& msg, const Pb2JsonOptions& options,
-                   const gpb::FieldDescriptor* fd, const gpb::Reflection* refl, RapidWriter* res);
+// The serialization plan of a message type, compiled once by Pb2JsonPrinter.
+struct MessagePlan;
 
-void Pb2JsonInternal(const ::google::protobuf::Message& msg, const Pb2JsonOptions& options,
-                     RapidWriter* res) {
-  const gpb::Descriptor* descr = msg.GetDescriptor();
-  const gpb::Reflection* refl = msg.GetReflection();
-  res->StartObject();
-  for (int i = 0; i < descr->field_count(); ++i) {
-    const gpb::FieldDescriptor* fd = descr->field(i);
-    bool is_set = (fd->is_repeated() && refl->FieldSize(msg, fd) > 0) || fd->is_required() ||
-                  (fd->is_optional() && refl->HasField(msg, fd));
-    if (!is_set)
-      continue;
-
-    const string& fname = options.field_name_cb ? options.field_name_cb(*fd) : fd->name();
-    if (fname.empty())
-      continue;
-    res->Key(fname.c_str(), fname.size());
-    if (fd->is_repeated()) {
-      PrintRepeated(msg, options, fd, refl, res);
-    } else {
-      PrintValue(msg, options, fd, refl, res);
-    }
-  }
-  res->EndObject();
-}
+struct FieldPlan {
+  const FD* fd;
+  FD::CppType cpp_type;
+  bool is_repeated;
+  bool is_required;
+  bool bool_as_int = false;
 
-void PrintValue(const gpb::Message& msg, const Pb2JsonOptions& options,
-                const gpb::FieldDescriptor* fd, const gpb::Reflection* refl, RapidWriter* res) {
-  switch (fd->cpp_type()) {
-    case FD::CPPTYPE_INT32:
-      res->Int(refl->GetInt32(msg, fd));
-      break;
-    case FD::CPPTYPE_UINT32:
-      res->Uint(refl->GetUInt32(msg, fd));
-      break;
-    case FD::CPPTYPE_INT64:
-      res->Int64(refl->GetInt64(msg, fd));
-      break;
-    case FD::CPPTYPE_UINT64:
-      res->Uint64(refl->GetUInt64(msg, fd));
-      break;
-    case FD::CPPTYPE_FLOAT: {
-      float fval = refl->GetFloat(msg, fd);
-      char buf[40];
-      int sz = absl::SNPrintF(buf, sizeof(buf), "%.7g", fval);
-      res->RawValue(buf, sz, rj::kNumberType);
-    } break;
-    case FD::CPPTYPE_DOUBLE:
-      res->Double(refl->GetDouble(msg, fd));
-      break;
-    case FD::CPPTYPE_STRING: {
-      string scratch;
-      const string& value = refl->GetStringReference(msg, fd, &scratch);
-      res->String(value.c_str(), value.size());
-    } break;
-    case FD::CPPTYPE_BOOL: {
-      bool b = refl->GetBool(msg, fd);
-      // Unfortunate hack in our company code.
-      if (options.bool_as_int && options.bool_as_int(*fd)) {
-        res->Int(int(b));
-      } else {
-        res->Bool(b);
-      }
-    } break;
+  string key;  // the escaped json key with its quotes.
+  const MessagePlan* msg_plan = nullptr;  // for the message fields.
+};
 
-    case FD::CPPTYPE_ENUM:
-      if (options.enum_as_ints) {
-        res->Int(refl->GetEnum(msg, fd)->number());
-      } else {
-        const auto& tmp = refl->GetEnum(msg, fd)->name();
-        res->String(tmp.c_str(), tmp.size());
-      }
-      break;
-    case FD::CPPTYPE_MESSAGE:
-      Pb2JsonInternal(refl->GetMessage(msg, fd), options, res);
-      break;
-    default:
-      LOG(FATAL) << "Not supported field " << fd->cpp_type_name();
-  }
-}
+struct MessagePlan {
+  std::vector<FieldPlan> fields;
+};
 
 template <FD::CppType t, typename Cb>
 void UnwindArr(const gpb::Message& msg, const gpb::FieldDescriptor* fd, const gpb::Reflection* refl,
@@ -122,55 +58,57 @@ void UnwindArr(const gpb::Message& msg, const gpb::FieldDescriptor* fd, const gp
   std::for_each(std::begin(arr), std::end(arr), cb);
 }
 
-void PrintRepeated(const gpb::Message& msg, const Pb2JsonOptions& options,
-                   const gpb::FieldDescriptor* fd, const gpb::Reflection* refl, RapidWriter* res) {
-  res->StartArray();
-  switch (fd->cpp_type()) {
-    case FD::CPPTYPE_INT32:
-      UnwindArr<FD::CPPTYPE_INT32>(msg, fd, refl, [res](auto val) { res->Int(val); });
-      break;
-    case FD::CPPTYPE_UINT32:
-      UnwindArr<FD::CPPTYPE_UINT32>(msg, fd, refl, [res](auto val) { res->Uint(val); });
-      break;
-    case FD::CPPTYPE_INT64:
-      UnwindArr<FD::CPPTYPE_INT64>(msg, fd, refl, [res](auto val) { res->Int64(val); });
-      break;
-    case FD::CPPTYPE_UINT64:
-      UnwindArr<FD::CPPTYPE_UINT64>(msg, fd, refl, [res](auto val) { res->Uint64(val); });
-      break;
-    case FD::CPPTYPE_FLOAT:
-      UnwindArr<FD::CPPTYPE_FLOAT>(msg, fd, refl, [res](auto val) { res->Double(val); });
-      break;
-    case FD::CPPTYPE_DOUBLE:
-      UnwindArr<FD::CPPTYPE_DOUBLE>(msg, fd, refl, [res](auto val) { res->Double(val); });
-      break;
-    case FD::CPPTYPE_STRING:
-      UnwindArr<FD::CPPTYPE_STRING>(
-          msg, fd, refl, [res](const string& val) { res->String(val.c_str(), val.size()); });
-      break;
-    case FD::CPPTYPE_BOOL:
-      UnwindArr<FD::CPPTYPE_BOOL>(msg, fd, refl, [res](auto val) { res->Bool(val); });
-      break;
+// Maps the field names of a message type to its fields with a perfect hash: the seed is
+// chosen so that the names do not collide in the table.
+class FieldTable {
+ public:
+  explicit FieldTable(const gpb::Descriptor* descr);
 
-    case FD::CPPTYPE_ENUM: {
-      int sz = refl->FieldSize(msg, fd);
-      for (int i = 0; i < sz; ++i) {
-        const gpb::EnumValueDescriptor* edescr = refl->GetRepeatedEnum(msg, fd, i);
-        const string& name = edescr->name();
-        res->String(name.c_str(), name.size());
-      }
-    } break;
-    case FD::CPPTYPE_MESSAGE: {
-      const auto& arr = refl->GetRepeatedFieldRef<gpb::Message>(msg, fd);
-      std::unique_ptr<gpb::Message> scratch_space(arr.NewMessage());
-      for (int i = 0; i < arr.size(); ++i) {
-        Pb2JsonInternal(arr.Get(i, scratch_space.get()), options, res);
+  const FD* Find(absl::string_view name) const {
+    unsigned index = slots_[Hash(name, seed_) & mask_];
+    if (index == 0)
+      return nullptr;
+    const FD* fd = descr_->field(index - 1);
+    return fd->name() == name ? fd : nullptr;
+  }
+
+ private:
+  static uint32_t Hash(absl::string_view name, uint32_t seed) {
+    return base::MurmurHash3_x86_32(reinterpret_cast<const uint8_t*>(name.data()), name.size(),
+                                    seed);
+  }
+
+  const gpb::Descriptor* descr_;
+  std::vector<uint16_t> slots_;  // field index + 1 or 0 for the empty slots.
+  uint32_t seed_ = 0, mask_ = 0;
+};
+
+FieldTable::FieldTable(const gpb::Descriptor* descr) : descr_(descr) {
+  const unsigned count = descr->field_count();
+  CHECK_LT(count, 1u << 16);
+
+  // Starts with the load factor of at most 1/2 and doubles the table if no seed out of
+  // kNumSeeds works.
+  constexpr uint32_t kNumSeeds = 64;
+  uint32_t size = 2;
+  while (size < count * 2)
+    size *= 2;
+
+  for (;; size *= 2) {
+    mask_ = size - 1;
+    for (seed_ = 0; seed_ < kNumSeeds; ++seed_) {
+      slots_.assign(size, 0);
+      unsigned i = 0;
+      for (; i < count; ++i) {
+        uint16_t& slot = slots_[Hash(descr->field(i)->name(), seed_) & mask_];
+        if (slot)
+          break;
+        slot = i + 1;
       }
-    } break;
-    default:
-      LOG(FATAL) << "Not supported field " << fd->cpp_type_name();
+      if (i == count)
+        return;
+    }
   }
-  res->EndArray();
 }
 
 class PbHandler {
@@ -180,9 +118,10 @@ class PbHandler {
   string err_msg;
   using Ch = char;
 
-  PbHandler(const Json2PbOptions& opts, ::google::protobuf::Message* msg) : opts_(opts) {
-    stack_.emplace_back(msg->GetReflection(), msg);
-  }
+  explicit PbHandler(const Json2PbOptions& opts) : opts_(opts) {}
+
+  // Prepares the handler for parsing into msg. Keeps the field tables and the buffers.
+  void Reset(::google::protobuf::Message* msg);
 
   bool Key(const Ch* str, size_t len, bool copy);
 
@@ -223,10 +162,11 @@ class PbHandler {
   struct Object {
     const gpb::Reflection* refl;
     gpb::Message* msg;
+    const FieldTable* fields;
 
     absl::optional<std::pair<const FD*, ArrRef>> arr_ref;
 
-    Object(const gpb::Reflection* r, gpb::Message* m) : refl(r), msg(m) {}
+    Object(gpb::Message* m, const FieldTable* f) : refl(m->GetReflection()), msg(m), fields(f) {}
 
     template <FD::CppType t> auto& GetArray() {
       return absl::get<MRFR<pb::FD_Traits_t<t>>>(arr_ref->second);
@@ -237,13 +177,33 @@ class PbHandler {
     return std::pair<const FD*, ArrRef>{f, pb::GetMutableArray<t>(o.refl, f, o.msg)};
   }
 
+  void PushObject(gpb::Message* msg);
+
   absl::InlinedVector<Object, 16> stack_;
+  absl::flat_hash_map<const gpb::Descriptor*, std::unique_ptr<FieldTable>> tables_;
   const gpb::FieldDescriptor* field_ = nullptr;
   string key_name_;
 
   unsigned disabled_level_ = 0;
 };
 
+void PbHandler::Reset(::google::protobuf::Message* msg) {
+  stack_.clear();
+  field_ = nullptr;
+  key_name_.clear();
+  disabled_level_ = 0;
+  err_msg.clear();
+
+  PushObject(msg);
+}
+
+void PbHandler::PushObject(gpb::Message* msg) {
+  auto& table = tables_[msg->GetDescriptor()];
+  if (!table)
+    table.reset(new FieldTable(msg->GetDescriptor()));
+  stack_.emplace_back(msg, table.get());
+}
+
 bool PbHandler::Key(const Ch* str, size_t len, bool copy) {
   if (disabled_level_ > 1) {
     return true;
@@ -254,8 +214,7 @@ bool PbHandler::Key(const Ch* str, size_t len, bool copy) {
   DCHECK(!stack_.empty());
   auto& obj = stack_.back();
 
-  const auto& msg = *obj.msg;
-  field_ = msg.GetDescriptor()->FindFieldByName(key_name_);
+  field_ = obj.fields->Find(key_name_);
 
   return field_ != nullptr || opts_.skip_unknown_fields;
 }
@@ -303,8 +262,7 @@ bool PbHandler::StartObject() {
       err_msg = absl::StrCat("Expected msg type but found ", field->cpp_type_name());
       return false;
     }
-    gpb::Message* child = obj.refl->AddMessage(obj.msg, field);
-    stack_.emplace_back(child->GetReflection(), child);
+    PushObject(obj.refl->AddMessage(obj.msg, field));
     return true;
   }
 
@@ -318,8 +276,7 @@ bool PbHandler::StartObject() {
     return false;
   }
 
-  gpb::Message* child = obj.refl->MutableMessage(obj.msg, field_);
-  stack_.emplace_back(child->GetReflection(), child);
+  PushObject(obj.refl->MutableMessage(obj.msg, field_));
   return true;
 }
 
@@ -690,22 +647,253 @@ bool PbHandler::EndArray(size_t elementCount) {
 
 }  // namespace
 
-std::string Pb2Json(const ::google::protobuf::Message& msg, const Pb2JsonOptions& options) {
+struct Pb2JsonPrinter::Rep {
+  Pb2JsonOptions options;
+  absl::flat_hash_map<const gpb::Descriptor*, std::unique_ptr<MessagePlan>> plans;
+
   rj::StringBuffer sb;
-  RapidWriter rw(sb);
-  rw.SetMaxDecimalPlaces(9);
+  RapidWriter writer;
 
-  Pb2JsonInternal(msg, options, &rw);
-  return string(sb.GetString(), sb.GetSize());
+  explicit Rep(const Pb2JsonOptions& opts) : options(opts), writer(sb) {
+    writer.SetMaxDecimalPlaces(9);
+  }
+
+  const MessagePlan* GetPlan(const gpb::Descriptor* descr);
+
+  void PrintMessage(const gpb::Message& msg, const MessagePlan& plan);
+  void PrintValue(const gpb::Message& msg, const FieldPlan& field, const gpb::Reflection* refl);
+  void PrintRepeated(const gpb::Message& msg, const FieldPlan& field,
+                     const gpb::Reflection* refl);
+};
+
+const MessagePlan* Pb2JsonPrinter::Rep::GetPlan(const gpb::Descriptor* descr) {
+  auto res = plans.emplace(descr, nullptr);
+  if (!res.second)
+    return res.first->second.get();
+
+  // The plan is registered before its fields are compiled to break the cycles of
+  // the recursive message types.
+  MessagePlan* plan = new MessagePlan;
+  res.first->second.reset(plan);
+
+  rj::StringBuffer key_buf;
+  std::vector<FieldPlan> fields;
+  for (int i = 0; i < descr->field_count(); ++i) {
+    const gpb::FieldDescriptor* fd = descr->field(i);
+    const string fname = options.field_name_cb ? options.field_name_cb(*fd) : fd->name();
+    if (fname.empty())
+      continue;
+
+    FieldPlan field;
+    field.fd = fd;
+    field.cpp_type = fd->cpp_type();
+    field.is_repeated = fd->is_repeated();
+    field.is_required = fd->is_required();
+    if (field.cpp_type == FD::CPPTYPE_BOOL && options.bool_as_int)
+      field.bool_as_int = options.bool_as_int(*fd);
+
+    key_buf.Clear();
+    rj::Writer<rj::StringBuffer> key_writer(key_buf);
+    key_writer.String(fname.c_str(), fname.size());
+    field.key.assign(key_buf.GetString(), key_buf.GetSize());
+
+    if (field.cpp_type == FD::CPPTYPE_MESSAGE)
+      field.msg_plan = GetPlan(fd->message_type());  // may invalidate res.
+    fields.push_back(std::move(field));
+  }
+  plan->fields = std::move(fields);
+
+  return plan;
 }
 
-Status Json2Pb(std::string json, ::google::protobuf::Message* msg, const Json2PbOptions& opts) {
+void Pb2JsonPrinter::Rep::PrintMessage(const gpb::Message& msg, const MessagePlan& plan) {
+  const gpb::Reflection* refl = msg.GetReflection();
+  writer.StartObject();
+  for (const FieldPlan& field : plan.fields) {
+    const FD* fd = field.fd;
+    if (field.is_repeated) {
+      if (refl->FieldSize(msg, fd) == 0)
+        continue;
+    } else if (!field.is_required && !refl->HasField(msg, fd)) {
+      continue;
+    }
+
+    writer.RawValue(field.key.data(), field.key.size(), rj::kStringType);
+    if (field.is_repeated) {
+      PrintRepeated(msg, field, refl);
+    } else {
+      PrintValue(msg, field, refl);
+    }
+  }
+  writer.EndObject();
+}
+
+void Pb2JsonPrinter::Rep::PrintValue(const gpb::Message& msg, const FieldPlan& field,
+                                     const gpb::Reflection* refl) {
+  const FD* fd = field.fd;
+  switch (field.cpp_type) {
+    case FD::CPPTYPE_INT32:
+      writer.Int(refl->GetInt32(msg, fd));
+      break;
+    case FD::CPPTYPE_UINT32:
+      writer.Uint(refl->GetUInt32(msg, fd));
+      break;
+    case FD::CPPTYPE_INT64:
+      writer.Int64(refl->GetInt64(msg, fd));
+      break;
+    case FD::CPPTYPE_UINT64:
+      writer.Uint64(refl->GetUInt64(msg, fd));
+      break;
+    case FD::CPPTYPE_FLOAT: {
+      float fval = refl->GetFloat(msg, fd);
+      char buf[40];
+      int sz = absl::SNPrintF(buf, sizeof(buf), "%.7g", fval);
+      writer.RawValue(buf, sz, rj::kNumberType);
+    } break;
+    case FD::CPPTYPE_DOUBLE:
+      writer.Double(refl->GetDouble(msg, fd));
+      break;
+    case FD::CPPTYPE_STRING: {
+      string scratch;
+      const string& value = refl->GetStringReference(msg, fd, &scratch);
+      writer.String(value.c_str(), value.size());
+    } break;
+    case FD::CPPTYPE_BOOL: {
+      bool b = refl->GetBool(msg, fd);
+      // Unfortunate hack in our company code.
+      if (field.bool_as_int) {
+        writer.Int(int(b));
+      } else {
+        writer.Bool(b);
+      }
+    } break;
+
+    case FD::CPPTYPE_ENUM:
+      if (options.enum_as_ints) {
+        writer.Int(refl->GetEnumValue(msg, fd));
+      } else {
+        const auto& tmp = refl->GetEnum(msg, fd)->name();
+        writer.String(tmp.c_str(), tmp.size());
+      }
+      break;
+    case FD::CPPTYPE_MESSAGE:
+      PrintMessage(refl->GetMessage(msg, fd), *field.msg_plan);
+      break;
+    default:
+      LOG(FATAL) << "Not supported field " << fd->cpp_type_name();
+  }
+}
+
+void Pb2JsonPrinter::Rep::PrintRepeated(const gpb::Message& msg, const FieldPlan& field,
+                                        const gpb::Reflection* refl) {
+  const FD* fd = field.fd;
+  RapidWriter* res = &writer;
+
+  res->StartArray();
+  switch (field.cpp_type) {
+    case FD::CPPTYPE_INT32:
+      UnwindArr<FD::CPPTYPE_INT32>(msg, fd, refl, [res](auto val) { res->Int(val); });
+      break;
+    case FD::CPPTYPE_UINT32:
+      UnwindArr<FD::CPPTYPE_UINT32>(msg, fd, refl, [res](auto val) { res->Uint(val); });
+      break;
+    case FD::CPPTYPE_INT64:
+      UnwindArr<FD::CPPTYPE_INT64>(msg, fd, refl, [res](auto val) { res->Int64(val); });
+      break;
+    case FD::CPPTYPE_UINT64:
+      UnwindArr<FD::CPPTYPE_UINT64>(msg, fd, refl, [res](auto val) { res->Uint64(val); });
+      break;
+    case FD::CPPTYPE_FLOAT:
+      UnwindArr<FD::CPPTYPE_FLOAT>(msg, fd, refl, [res](auto val) { res->Double(val); });
+      break;
+    case FD::CPPTYPE_DOUBLE:
+      UnwindArr<FD::CPPTYPE_DOUBLE>(msg, fd, refl, [res](auto val) { res->Double(val); });
+      break;
+    case FD::CPPTYPE_STRING: {
+      string scratch;
+      int sz = refl->FieldSize(msg, fd);
+      for (int i = 0; i < sz; ++i) {
+        const string& val = refl->GetRepeatedStringReference(msg, fd, i, &scratch);
+        res->String(val.c_str(), val.size());
+      }
+    } break;
+    case FD::CPPTYPE_BOOL:
+      UnwindArr<FD::CPPTYPE_BOOL>(msg, fd, refl, [res](auto val) { res->Bool(val); });
+      break;
+
+    case FD::CPPTYPE_ENUM: {
+      int sz = refl->FieldSize(msg, fd);
+      for (int i = 0; i < sz; ++i) {
+        const gpb::EnumValueDescriptor* edescr = refl->GetRepeatedEnum(msg, fd, i);
+        const string& name = edescr->name();
+        res->String(name.c_str(), name.size());
+      }
+    } break;
+    case FD::CPPTYPE_MESSAGE: {
+      int sz = refl->FieldSize(msg, fd);
+      for (int i = 0; i < sz; ++i) {
+        PrintMessage(refl->GetRepeatedMessage(msg, fd, i), *field.msg_plan);
+      }
+    } break;
+    default:
+      LOG(FATAL) << "Not supported field " << fd->cpp_type_name();
+  }
+  res->EndArray();
+}
+
+Pb2JsonPrinter::Pb2JsonPrinter(const Pb2JsonOptions& options) : rep_(new Rep(options)) {}
+
+Pb2JsonPrinter::~Pb2JsonPrinter() {}
+
+absl::string_view Pb2JsonPrinter::Print(const ::google::protobuf::Message& msg) {
+  rep_->sb.Clear();
+  rep_->writer.Reset(rep_->sb);
+  rep_->PrintMessage(msg, *rep_->GetPlan(msg.GetDescriptor()));
+
+  return absl::string_view(rep_->sb.GetString(), rep_->sb.GetSize());
+}
+
+std::string Pb2Json(const ::google::protobuf::Message& msg, const Pb2JsonOptions& options) {
+  // The cached plans must not outlive their descriptors, hence only the generated ones are
+  // cached. The options with callbacks can not be compared, so their plans are not kept.
+  if (options.field_name_cb || options.bool_as_int ||
+      msg.GetDescriptor()->file()->pool() != gpb::DescriptorPool::generated_pool()) {
+    Pb2JsonPrinter printer(options);
+    return string(printer.Print(msg));
+  }
+
+  static thread_local std::unique_ptr<Pb2JsonPrinter> printers[2];
+  auto& printer = printers[options.enum_as_ints];
+  if (!printer) {
+    printer.reset(new Pb2JsonPrinter(options));
+  }
+  return string(printer->Print(msg));
+}
+
+struct Json2PbParser::Rep {
+  Json2PbOptions options;
   rj::Reader reader;
+  PbHandler handler;
+
+  explicit Rep(const Json2PbOptions& opts) : options(opts), handler(options) {}
+};
+
+Json2PbParser::Json2PbParser(const Json2PbOptions& options) : rep_(new Rep(options)) {}
 
-  PbHandler h(opts, msg);
-  rj::InsituStringStream stream(&json.front());
+Json2PbParser::~Json2PbParser() {}
+
+Status Json2PbParser::ParseInsitu(std::string* json, ::google::protobuf::Message* msg) {
+  if (rep_->options.validate_utf8 &&
+      !base::ValidateUtf8(reinterpret_cast<const uint8_t*>(json->data()), json->size())) {
+    return Status(StatusCode::PARSE_ERROR, "Invalid UTF-8");
+  }
 
-  rj::ParseResult pr = reader.Parse<rj::kParseInsituFlag | rj::kParseTrailingCommasFlag>(stream, h);
+  PbHandler& h = rep_->handler;
+  h.Reset(msg);
+  rj::InsituStringStream stream(&(*json)[0]);
+
+  rj::ParseResult pr =
+      rep_->reader.Parse<rj::kParseInsituFlag | rj::kParseTrailingCommasFlag>(stream, h);
   if (pr.IsError()) {
     Status st(StatusCode::PARSE_ERROR,
               absl::StrCat(rj::GetParseError_En(pr.Code()), "/", h.err_msg));
@@ -714,4 +902,19 @@ Status Json2Pb(std::string json, ::google::protobuf::Message* msg, const Json2Pb
   return Status::OK;
 }
 
+Status Json2Pb(std::string json, ::google::protobuf::Message* msg, const Json2PbOptions& opts) {
+  // Like in Pb2Json, only the tables of the generated descriptors are cached.
+  if (msg->GetDescriptor()->file()->pool() != gpb::DescriptorPool::generated_pool()) {
+    Json2PbParser parser(opts);
+    return parser.ParseInsitu(&json, msg);
+  }
+
+  static thread_local std::unique_ptr<Json2PbParser> parsers[4];
+  auto& parser = parsers[opts.skip_unknown_fields + 2 * opts.validate_utf8];
+  if (!parser) {
+    parser.reset(new Json2PbParser(opts));
+  }
+  return parser->ParseInsitu(&json, msg);
+}
+
 }  // namespace util
@@ -4,10 +4,12 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 #include <string>
 
 #include <google/protobuf/message.h>
 
+#include "absl/strings/string_view.h"
 #include "util/status.h"
 
 namespace util {
@@ -23,17 +25,58 @@ struct Pb2JsonOptions {
   BoolAsIntegerPred bool_as_int;
 };
 
+// Reuses a thread-local Pb2JsonPrinter for the generated messages and the options without
+// callbacks.
 std::string Pb2Json(const ::google::protobuf::Message& msg,
                     const Pb2JsonOptions& options = Pb2JsonOptions());
 
+// Serializes messages into json with the plans that are compiled once per message descriptor:
+// the fields to check, their escaped keys and the output types. Reuses the output buffer.
+// The descriptors of the printed messages must outlive the printer. Not thread-safe.
+class Pb2JsonPrinter {
+ public:
+  explicit Pb2JsonPrinter(const Pb2JsonOptions& options = Pb2JsonOptions());
+  ~Pb2JsonPrinter();
+
+  // The result is valid until the next call.
+  absl::string_view Print(const ::google::protobuf::Message& msg);
+
+ private:
+  struct Rep;
+
+  std::unique_ptr<Rep> rep_;
+};
+
 struct Json2PbOptions {
   bool skip_unknown_fields;
 
+  // Fails the inputs that are not valid UTF-8 with PARSE_ERROR. The whole input is validated
+  // with SIMD before parsing, see base::ValidateUtf8.
+  bool validate_utf8 = false;
+
   Json2PbOptions(bool sk = true) : skip_unknown_fields(sk) {}
 };
 
+// Reuses a thread-local Json2PbParser for the generated messages.
 Status Json2Pb(std::string json, ::google::protobuf::Message* msg, const Json2PbOptions& options);
 
+// Parses json into messages with the handler state and the field name tables kept across the
+// calls. The tables are perfect hashes of the field names, built once per message descriptor.
+// The descriptors of the parsed messages must outlive the parser. Not thread-safe.
+class Json2PbParser {
+ public:
+  explicit Json2PbParser(const Json2PbOptions& options = Json2PbOptions());
+  ~Json2PbParser();
+
+  // Parses json in place, i.e. without copying the strings, and destroys its contents.
+  Status ParseInsitu(std::string* json, ::google::protobuf::Message* msg);
+
+ private:
+  struct Rep;
+
+  std::unique_ptr<Rep> rep_;
+};
+
 inline Status Json2Pb(std::string json, ::google::protobuf::Message* msg,
                       bool skip_unknown_fields = true) {
   return Json2Pb(std::move(json), msg, Json2PbOptions(skip_unknown_fields));
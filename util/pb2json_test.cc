@@ -166,6 +166,30 @@ TEST_F(Pb2JsonTest, Options) {
   EXPECT_EQ(R"({"bval":1})", res);
 }
 
+TEST_F(Pb2JsonTest, Printer) {
+  Pb2JsonPrinter printer;
+  AddressBook book;
+  book.add_ts(1);
+  book.add_ts(2);
+  *book.add_person() = Person();
+  Person* p = book.add_person();
+  p->set_name("Roman");
+  Person::PhoneNumber* n = p->add_phone();
+  n->set_number("1");
+  n->set_type(Person::WORK);
+  p->mutable_account()->add_activity_id(7);
+
+  string expected = R"({"person":[{"name":"","id":0,"dval":0.0},{"name":"Roman","id":0,)"
+                    R"("phone":[{"number":"1","type":"WORK"}],"account":{"activity_id":[7]},)"
+                    R"("dval":0.0}],"ts":[1,2]})";
+  EXPECT_EQ(expected, string(printer.Print(book)));
+  EXPECT_EQ(expected, Pb2Json(book));
+
+  Person person;
+  person.set_name("Roman");
+  EXPECT_EQ(R"({"name":"Roman","id":0,"dval":0.0})", string(printer.Print(person)));
+}
+
 TEST_F(Pb2JsonTest, ParseBasic) {
   Person person;
   auto status =
@@ -226,6 +250,26 @@ TEST_F(Pb2JsonTest, ParseRepeated) {
   )"));
 }
 
+TEST_F(Pb2JsonTest, Parser) {
+  Json2PbParser parser;
+  AddressBook book;
+  string json = R"({"person": [{"name": "foo", "id": 1, "phone": [{"number": "2"}]}],
+                    "tmp": [3], "fd1": 4, "baz": 5})";
+  ASSERT_THAT(parser.ParseInsitu(&json, &book), StatusOk());
+  EXPECT_THAT(book, ProtoMatchTo(R"(
+      person: { name: "foo" id: 1 phone { number: "2" } } tmp: 3 fd1: 4
+  )"));
+
+  json = R"({"name": 1})";
+  Person person;
+  ASSERT_FALSE(parser.ParseInsitu(&json, &person).ok());
+
+  json = R"({"name": "bar", "account": {"bank_name": "Leumi"}, "id": 2})";
+  person.Clear();
+  ASSERT_THAT(parser.ParseInsitu(&json, &person), StatusOk());
+  EXPECT_THAT(person, ProtoMatchTo(R"(name: "bar" id: 2 account { bank_name: "Leumi" })"));
+}
+
 TEST_F(Pb2JsonTest, Unknown) {
   JsonParse parse;
   Json2PbOptions opts(true);
@@ -245,5 +289,18 @@ TEST_F(Pb2JsonTest, Invalid) {
   ASSERT_FALSE(status.ok());
 }
 
+TEST_F(Pb2JsonTest, Utf8) {
+  Json2PbOptions opts;
+  opts.validate_utf8 = true;
+
+  Person person;
+  ASSERT_THAT(Json2Pb("{\"name\": \"caf\xc3\xa9\", \"id\": 1}", &person, opts), StatusOk());
+  EXPECT_EQ("caf\xc3\xa9", person.name());
+
+  auto status = Json2Pb("{\"name\": \"caf\xc3\", \"id\": 1}", &person, opts);
+  EXPECT_EQ(StatusCode::PARSE_ERROR, status.code());
+  EXPECT_THAT(Json2Pb("{\"name\": \"caf\xc3\", \"id\": 1}", &person), StatusOk());
+}
+
 
 }  // namespace util
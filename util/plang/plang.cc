@@ -6,10 +6,13 @@
 #include <regex>
 
 #include "absl/strings/ascii.h"
+#include "absl/strings/str_split.h"
 #include "base/logging.h"
+#include "base/simd.h"
 #include "strings/hash.h"
 #include "util/math/mathutil.h"
 
+#include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/repeated_field.h>
 
@@ -406,4 +409,523 @@ bool EvaluateBoolExpr(const Expr& e, const gpb::Message& msg) {
   return res;
 }
 
+
+typedef gpb::FieldDescriptor FD;
+
+struct CompiledExpr::Node {
+  enum Kind { CONST, FIELD, IS_DEF, CMP, AND, OR, NOT, HASH } kind;
+  BinOp::Type op = BinOp::EQ;  // of CMP.
+  int left = -1, right = -1;   // child nodes.
+
+  std::vector<const FD*> path;        // of FIELD and IS_DEF.
+  std::unique_ptr<std::regex> regex;  // of RLIKE with a constant pattern.
+
+  // The values of the last evaluation, CONST keeps its single value.
+  mutable std::vector<ExprValue> values;
+
+  // CMP of a singular numeric field with a constant, evaluated in EvalBatch as
+  // "column op constant" over the values of column_field.
+  enum Column { NO_COLUMN, INT_COLUMN, DOUBLE_COLUMN } column = NO_COLUMN;
+  int column_field = -1;
+  base::CmpOp column_op = base::CMP_EQ;
+  int64 column_int = 0;
+  double column_double = 0;
+
+  mutable std::vector<uint64_t> mask;  // the bitmap of the right operand in EvalBatch.
+};
+
+// Appends the values of the field the same way EvalField passes them.
+static void AppendFieldValues(const gpb::Message& msg, const FD* fd,
+                              std::deque<string>* scratch, std::vector<ExprValue>* dest) {
+  const gpb::Reflection* refl = msg.GetReflection();
+
+  if (fd->is_repeated()) {
+    int sz = refl->FieldSize(msg, fd);
+    for (int i = 0; i < sz; ++i) {
+      switch (fd->cpp_type()) {
+        case FD::CPPTYPE_INT32:
+          dest->push_back(ExprValue::fromInt(refl->GetRepeatedInt32(msg, fd, i)));
+          break;
+        case FD::CPPTYPE_UINT32:
+          dest->push_back(ExprValue::fromInt(refl->GetRepeatedUInt32(msg, fd, i)));
+          break;
+        case FD::CPPTYPE_INT64:
+          dest->push_back(ExprValue::fromInt(refl->GetRepeatedInt64(msg, fd, i)));
+          break;
+        case FD::CPPTYPE_UINT64:
+          dest->push_back(ExprValue::fromUInt(refl->GetRepeatedUInt64(msg, fd, i)));
+          break;
+        default:
+          LOG(FATAL) << "Not supported repeated " << fd->cpp_type_name();
+      }
+    }
+    return;
+  }
+
+  switch (fd->cpp_type()) {
+    case FD::CPPTYPE_INT32:
+      dest->push_back(ExprValue::fromInt(refl->GetInt32(msg, fd)));
+      break;
+    case FD::CPPTYPE_UINT32:
+      dest->push_back(ExprValue::fromUInt(refl->GetUInt32(msg, fd)));
+      break;
+    case FD::CPPTYPE_INT64:
+      dest->push_back(ExprValue::fromInt(refl->GetInt64(msg, fd)));
+      break;
+    case FD::CPPTYPE_UINT64:
+      dest->push_back(ExprValue::fromUInt(refl->GetUInt64(msg, fd)));
+      break;
+    case FD::CPPTYPE_STRING: {
+      string tmp;
+      const string& val = refl->GetStringReference(msg, fd, &tmp);
+      if (&val == &tmp) {
+        scratch->push_back(std::move(tmp));
+        dest->emplace_back(scratch->back());
+      } else {
+        dest->emplace_back(val);
+      }
+    } break;
+    case FD::CPPTYPE_FLOAT:
+      dest->push_back(ExprValue::fromDouble(refl->GetFloat(msg, fd)));
+      break;
+    case FD::CPPTYPE_DOUBLE:
+      dest->push_back(ExprValue::fromDouble(refl->GetDouble(msg, fd)));
+      break;
+    case FD::CPPTYPE_BOOL:
+      dest->push_back(ExprValue::fromInt(refl->GetBool(msg, fd)));
+      break;
+    case FD::CPPTYPE_ENUM:
+      dest->emplace_back(refl->GetEnum(msg, fd));
+      break;
+    default:
+      LOG(FATAL) << "Not supported yet " << fd->cpp_type_name();
+  }
+}
+
+// The message of the last field of the singular path.
+static const gpb::Message& PathParent(const gpb::Message& msg,
+                                      const std::vector<const FD*>& path) {
+  const gpb::Message* cur = &msg;
+  for (size_t i = 0; i + 1 < path.size(); ++i) {
+    cur = &cur->GetReflection()->GetMessage(*cur, path[i]);
+  }
+  return *cur;
+}
+
+// The integer values as AppendFieldValues passes them, i.e. uint64 is reinterpreted.
+static int64 GetIntField(const gpb::Message& msg, const FD* fd) {
+  const gpb::Reflection* refl = msg.GetReflection();
+  switch (fd->cpp_type()) {
+    case FD::CPPTYPE_INT32:
+      return refl->GetInt32(msg, fd);
+    case FD::CPPTYPE_UINT32:
+      return refl->GetUInt32(msg, fd);
+    case FD::CPPTYPE_INT64:
+      return refl->GetInt64(msg, fd);
+    case FD::CPPTYPE_UINT64:
+      return refl->GetUInt64(msg, fd);
+    case FD::CPPTYPE_BOOL:
+      return refl->GetBool(msg, fd);
+    default:
+      LOG(FATAL) << "Not an integer " << fd->cpp_type_name();
+  }
+  return 0;
+}
+
+static double GetDoubleField(const gpb::Message& msg, const FD* fd) {
+  const gpb::Reflection* refl = msg.GetReflection();
+  switch (fd->cpp_type()) {
+    case FD::CPPTYPE_FLOAT:
+      return refl->GetFloat(msg, fd);
+    case FD::CPPTYPE_DOUBLE:
+      return refl->GetDouble(msg, fd);
+    default:
+      return GetIntField(msg, fd);
+  }
+}
+
+static bool AnyTrue(const std::vector<ExprValue>& vals) {
+  for (const ExprValue& v : vals) {
+    CHECK_EQ(ExprValue::CPPTYPE_BOOL, v.type);
+    if (v.val.bool_val)
+      return true;
+  }
+  return false;
+}
+
+CompiledExpr::CompiledExpr(const Expr& expr, const gpb::Descriptor* descr) : descr_(descr) {
+  CHECK(descr);
+  Compile(expr);
+}
+
+CompiledExpr::~CompiledExpr() {}
+
+int CompiledExpr::Compile(const Expr& e) {
+  Node node;
+
+  if (const auto* lit = dynamic_cast<const NumericLiteral*>(&e)) {
+    return AddConst(lit->value());
+  } else if (const auto* term = dynamic_cast<const StringTerm*>(&e)) {
+    if (term->type() == StringTerm::CONST) {
+      strings_.push_back(term->val());
+      return AddConst(ExprValue(strings_.back()));
+    }
+    node.kind = Node::FIELD;
+    BindPath(term->val(), &node);
+    CHECK_NE(FD::CPPTYPE_MESSAGE, node.path.back()->cpp_type()) << term->val()
+                                                                 << " is a message";
+  } else if (const auto* def = dynamic_cast<const IsDefFun*>(&e)) {
+    node.kind = Node::IS_DEF;
+    BindPath(def->name(), &node);
+  } else if (const auto* fun = dynamic_cast<const FunctionTerm*>(&e)) {
+    CHECK_EQ("hash", fun->name()) << "Unknown function";
+    CHECK_EQ(1u, fun->args().size()) << "hash() accepts a single argument";
+    node.kind = Node::HASH;
+    node.left = Compile(*fun->args()[0]);
+  } else if (const auto* bin_op = dynamic_cast<const BinOp*>(&e)) {
+    switch (bin_op->type()) {
+      case BinOp::AND:
+        node.kind = Node::AND;
+        break;
+      case BinOp::OR:
+        node.kind = Node::OR;
+        break;
+      case BinOp::NOT:
+        node.kind = Node::NOT;
+        break;
+      default:
+        node.kind = Node::CMP;
+        node.op = bin_op->type();
+    }
+    node.left = Compile(bin_op->left());
+    if (node.kind != Node::NOT)
+      node.right = Compile(bin_op->right());
+
+    if (node.op == BinOp::RLIKE && nodes_[node.right].kind == Node::CONST) {
+      const ExprValue& pattern = nodes_[node.right].values.front();
+      CHECK_EQ(ExprValue::CPPTYPE_STRING, pattern.type);
+      node.regex.reset(new std::regex(pattern.val.str.begin(), pattern.val.str.end()));
+    }
+  } else {
+    LOG(FATAL) << "Unsupported expression";
+  }
+
+  nodes_.push_back(std::move(node));
+  int index = nodes_.size() - 1;
+  if (!FoldConst(index) && nodes_[index].kind == Node::CMP)
+    BindColumn(&nodes_[index]);
+
+  return index;
+}
+
+int CompiledExpr::AddConst(ExprValue val) {
+  Node node;
+  node.kind = Node::CONST;
+  node.values.push_back(val);
+  nodes_.push_back(std::move(node));
+  return nodes_.size() - 1;
+}
+
+void CompiledExpr::BindPath(const string& path, Node* node) const {
+  const gpb::Descriptor* cur = descr_;
+  for (StringPiece part : absl::StrSplit(path, '.')) {
+    CHECK(cur) << "Could not find field " << part << " of " << path << ", not a message";
+    const FD* fd = cur->FindFieldByName(AsString(part));
+    CHECK(fd) << "Could not find field " << part << " of " << path << " in "
+              << cur->full_name();
+    node->path.push_back(fd);
+    cur = fd->cpp_type() == FD::CPPTYPE_MESSAGE ? fd->message_type() : nullptr;
+  }
+}
+
+// Evaluates the operators of the constant operands during the compilation.
+bool CompiledExpr::FoldConst(int index) {
+  Node& node = nodes_[index];
+  if (node.kind == Node::CONST || node.kind == Node::FIELD || node.kind == Node::IS_DEF)
+    return false;
+
+  for (int child : {node.left, node.right}) {
+    if (child >= 0 && nodes_[child].kind != Node::CONST)
+      return false;
+  }
+
+  ExprValue val = Eval(index, nullptr).front();  // the operands do not read the message.
+  node.kind = Node::CONST;
+  node.left = node.right = -1;
+  node.regex.reset();
+  node.values.assign(1, val);
+
+  return true;
+}
+
+// Only the comparisons that are exact over the column values: the integers with the integer
+// constants and the strict comparisons of the doubles, since Equal of doubles is approximate.
+void CompiledExpr::BindColumn(Node* node) {
+  if (node->op == BinOp::RLIKE)
+    return;
+
+  int field = node->left, cst = node->right;
+  bool swapped = nodes_[field].kind != Node::FIELD;  // the constant is the left operand.
+  if (swapped)
+    std::swap(field, cst);
+  if (nodes_[field].kind != Node::FIELD || nodes_[cst].kind != Node::CONST)
+    return;
+
+  for (const FD* fd : nodes_[field].path) {
+    if (fd->is_repeated())
+      return;
+  }
+
+  bool int_field = false;
+  switch (nodes_[field].path.back()->cpp_type()) {
+    case FD::CPPTYPE_INT32:
+    case FD::CPPTYPE_UINT32:
+    case FD::CPPTYPE_INT64:
+    case FD::CPPTYPE_UINT64:
+    case FD::CPPTYPE_BOOL:
+      int_field = true;
+      break;
+    case FD::CPPTYPE_FLOAT:
+    case FD::CPPTYPE_DOUBLE:
+      break;
+    default:
+      return;
+  }
+
+  const ExprValue& val = nodes_[cst].values.front();
+  if (int_field && val.type == ExprValue::CPPTYPE_INT64) {
+    node->column = Node::INT_COLUMN;
+    node->column_int = val.val.int_val;
+    switch (node->op) {
+      case BinOp::EQ:
+        node->column_op = base::CMP_EQ;
+        break;
+      case BinOp::LT:
+        node->column_op = swapped ? base::CMP_GT : base::CMP_LT;
+        break;
+      default:
+        node->column_op = swapped ? base::CMP_GE : base::CMP_LE;
+    }
+  } else if (node->op == BinOp::LT &&
+             (val.type == ExprValue::CPPTYPE_INT64 || val.type == ExprValue::CPPTYPE_DOUBLE)) {
+    node->column = Node::DOUBLE_COLUMN;
+    node->column_double =
+        val.type == ExprValue::CPPTYPE_DOUBLE ? val.val.d_val : double(val.val.int_val);
+    node->column_op = swapped ? base::CMP_GT : base::CMP_LT;
+  } else {
+    return;
+  }
+  node->column_field = field;
+}
+
+const std::vector<ExprValue>& CompiledExpr::Eval(int index, const gpb::Message* msg) const {
+  const Node& node = nodes_[index];
+  std::vector<ExprValue>& res = node.values;
+
+  switch (node.kind) {
+    case Node::CONST:
+      return res;
+    case Node::FIELD:
+    case Node::IS_DEF:
+      res.clear();
+      CollectPath(node, *msg, 0);
+      return res;
+    case Node::HASH: {
+      const auto& arg = Eval(node.left, msg);
+      size_t hash = 0;
+      if (!arg.empty()) {  // Only the first value of a repeated field is hashed.
+        CHECK_EQ(ExprValue::CPPTYPE_STRING, arg.front().type);
+        hash = std::hash<StringPiece>()(arg.front().val.str);
+      }
+      res.assign(1, ExprValue::fromUInt(hash));
+      return res;
+    }
+    default:
+      break;
+  }
+
+  bool b = EvalBool(node, msg);
+  res.assign(1, ExprValue::fromBool(b));
+  return res;
+}
+
+bool CompiledExpr::EvalBool(const Node& node, const gpb::Message* msg) const {
+  switch (node.kind) {
+    case Node::AND:
+      return AnyTrue(Eval(node.left, msg)) && AnyTrue(Eval(node.right, msg));
+    case Node::OR: {
+      const auto& left = Eval(node.left, msg);
+      return !left.empty() && (AnyTrue(left) || AnyTrue(Eval(node.right, msg)));
+    }
+    case Node::NOT:
+      for (const ExprValue& v : Eval(node.left, msg)) {
+        CHECK_EQ(ExprValue::CPPTYPE_BOOL, v.type);
+        if (!v.val.bool_val)
+          return true;
+      }
+      return false;
+    default:
+      break;
+  }
+  DCHECK_EQ(Node::CMP, node.kind);
+
+  const auto& left = Eval(node.left, msg);
+  if (left.empty())
+    return false;
+  const auto& right = Eval(node.right, msg);
+
+  for (const ExprValue& l : left) {
+    for (const ExprValue& r : right) {
+      bool res = false;
+      switch (node.op) {
+        case BinOp::EQ:
+          res = l.Equal(r);
+          break;
+        case BinOp::LT:
+          res = l.Less(r);
+          break;
+        case BinOp::LE:
+          res = l.Less(r) || l.Equal(r);
+          break;
+        case BinOp::RLIKE:
+          if (node.regex) {
+            CHECK_EQ(ExprValue::CPPTYPE_STRING, l.type);
+            res = std::regex_match(l.val.str.begin(), l.val.str.end(), *node.regex);
+          } else {
+            res = l.RLike(r);
+          }
+          break;
+        default:
+          LOG(FATAL) << "Unexpected op " << node.op;
+      }
+      if (res)
+        return true;
+    }
+  }
+  return false;
+}
+
+void CompiledExpr::CollectPath(const Node& node, const gpb::Message& msg, size_t depth) const {
+  const FD* fd = node.path[depth];
+  const gpb::Reflection* refl = msg.GetReflection();
+
+  if (depth + 1 < node.path.size()) {
+    if (fd->is_repeated()) {
+      int sz = refl->FieldSize(msg, fd);
+      for (int i = 0; i < sz; ++i) {
+        CollectPath(node, refl->GetRepeatedMessage(msg, fd, i), depth + 1);
+      }
+    } else {
+      CollectPath(node, refl->GetMessage(msg, fd), depth + 1);
+    }
+    return;
+  }
+
+  if (node.kind == Node::IS_DEF) {
+    bool res = fd->is_repeated() ? refl->FieldSize(msg, fd) > 0 : refl->HasField(msg, fd);
+    node.values.push_back(ExprValue::fromBool(res));
+  } else {
+    AppendFieldValues(msg, fd, &scratch_, &node.values);
+  }
+}
+
+bool CompiledExpr::EvaluateBool(const gpb::Message& msg) const {
+  DCHECK_EQ(descr_, msg.GetDescriptor());
+  scratch_.clear();
+
+  const auto& res = Eval(nodes_.size() - 1, &msg);
+  if (res.empty())
+    return false;
+  CHECK_EQ(ExprValue::CPPTYPE_BOOL, res.front().type);
+  return res.front().val.bool_val;
+}
+
+bool CompiledExpr::IsSingleBool(int index) const {
+  const Node& node = nodes_[index];
+  switch (node.kind) {
+    case Node::CMP:
+    case Node::AND:
+    case Node::OR:
+    case Node::NOT:
+      return true;
+    case Node::CONST:
+      return node.values.front().type == ExprValue::CPPTYPE_BOOL;
+    default:
+      return false;
+  }
+}
+
+void CompiledExpr::EvalBatch(int index, const gpb::Message* const* msgs, size_t n,
+                             uint64_t* dest) const {
+  const Node& node = nodes_[index];
+  const size_t words = (n + 63) / 64;
+
+  if (node.column == Node::INT_COLUMN) {
+    const Node& field = nodes_[node.column_field];
+    int_column_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      int_column_[i] = GetIntField(PathParent(*msgs[i], field.path), field.path.back());
+    }
+    base::CompareInt64(int_column_.data(), n, node.column_int, node.column_op, dest);
+    return;
+  }
+
+  if (node.column == Node::DOUBLE_COLUMN) {
+    const Node& field = nodes_[node.column_field];
+    double_column_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      double_column_[i] = GetDoubleField(PathParent(*msgs[i], field.path), field.path.back());
+    }
+    base::CompareDouble(double_column_.data(), n, node.column_double, node.column_op, dest);
+    return;
+  }
+
+  // With the single bool operands AND, OR and NOT are the bitwise operators.
+  switch (node.kind) {
+    case Node::AND:
+    case Node::OR:
+      if (IsSingleBool(node.left) && IsSingleBool(node.right)) {
+        EvalBatch(node.left, msgs, n, dest);
+        node.mask.resize(words);
+        EvalBatch(node.right, msgs, n, node.mask.data());
+        for (size_t w = 0; w < words; ++w) {
+          dest[w] = node.kind == Node::AND ? dest[w] & node.mask[w] : dest[w] | node.mask[w];
+        }
+        return;
+      }
+      break;
+    case Node::NOT:
+      if (IsSingleBool(node.left)) {
+        EvalBatch(node.left, msgs, n, dest);
+        for (size_t w = 0; w < words; ++w) {
+          dest[w] = ~dest[w];
+        }
+        if (n % 64)
+          dest[words - 1] &= (uint64_t(1) << (n % 64)) - 1;
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+
+  std::fill(dest, dest + words, 0);
+  for (size_t i = 0; i < n; ++i) {
+    scratch_.clear();
+    const auto& res = Eval(index, msgs[i]);
+    if (res.empty())
+      continue;
+    CHECK_EQ(ExprValue::CPPTYPE_BOOL, res.front().type);
+    dest[i / 64] |= uint64_t(res.front().val.bool_val) << (i % 64);
+  }
+}
+
+void CompiledExpr::EvaluateBatch(const gpb::Message* const* msgs, size_t n,
+                                 uint64_t* dest) const {
+  for (size_t i = 0; i < n; ++i) {
+    DCHECK_EQ(descr_, msgs[i]->GetDescriptor());
+  }
+  EvalBatch(nodes_.size() - 1, msgs, n, dest);
+}
+
 }  // namespace plang
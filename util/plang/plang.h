@@ -4,16 +4,21 @@
 #ifndef _PLANG_H
 #define _PLANG_H
 
+#include <deque>
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "base/integral_types.h"
 #include "strings/stringpiece.h"
 
 namespace google {
 namespace protobuf {
+class Descriptor;
 class Message;
 class EnumValueDescriptor;
+class FieldDescriptor;
 }  // namespace protobuf
 }  // namespace google
 
@@ -139,17 +144,20 @@ public:
     return lit;
   }
 
-  virtual void eval(const gpb::Message& msg, ExprValueCb cb) const override {
+  ExprValue value() const {
     switch (val_type_) {
     case ValType::UINT64:
-      cb(ExprValue::fromUInt(val_.uval));
-      break;
+      return ExprValue::fromUInt(val_.uval);
     case ValType::SINT64:
-      cb(ExprValue::fromInt(val_.signed_val));
-      break;
+      return ExprValue::fromInt(val_.signed_val);
     case ValType::DOUBLE:
-      cb(ExprValue::fromDouble(val_.dval));
+      break;
     }
+    return ExprValue::fromDouble(val_.dval);
+  }
+
+  virtual void eval(const gpb::Message& msg, ExprValueCb cb) const override {
+    cb(value());
   }
 };
 
@@ -163,6 +171,7 @@ public:
 
   virtual void eval(const gpb::Message& msg, ExprValueCb cb) const override;
   const std::string& val() const { return val_; }
+  Type type() const { return type_; }
 private:
   Type type_;
 };
@@ -191,6 +200,8 @@ public:
   ~FunctionTerm();
 
   virtual void eval(const gpb::Message& msg, ExprValueCb cb) const override;
+  const std::string& name() const { return name_; }
+  const ArgList& args() const { return args_; }
 };
 
 class IsDefFun : public Expr {
@@ -198,10 +209,59 @@ class IsDefFun : public Expr {
 public:
   IsDefFun(const std::string& name) : name_(name) {};
   virtual void eval(const gpb::Message& msg, ExprValueCb cb) const override;
+  const std::string& name() const { return name_; }
 };
 
 bool EvaluateBoolExpr(const Expr& e, const gpb::Message& msg);
 
+// An expression compiled for the messages of a single type. The field paths are bound to
+// their descriptors once and the tree is lowered to a flat array of nodes, with the constant
+// subexpressions folded and the constant regular expressions compiled.
+// Evaluates like EvaluateBoolExpr. Not thread-safe since the nodes keep their value buffers.
+class CompiledExpr {
+public:
+  // Dies if expr references fields that descr does not have. expr is not referenced later.
+  CompiledExpr(const Expr& expr, const gpb::Descriptor* descr);
+  ~CompiledExpr();
+
+  // msg must be of the compiled type.
+  bool EvaluateBool(const gpb::Message& msg) const;
+
+  // Evaluates the batch of n messages of the compiled type into the selection bitmap dest:
+  // sets bit i % 64 of dest[i / 64] to the result of msgs[i] and clears the bits past n.
+  // The comparisons of the singular numeric fields with constants are evaluated over
+  // the column of the batch with SIMD and the operators combine whole words of the bitmaps.
+  // The rest of the subexpressions are evaluated per message.
+  void EvaluateBatch(const gpb::Message* const* msgs, size_t n, uint64_t* dest) const;
+
+private:
+  struct Node;
+
+  int Compile(const Expr& e);
+  int AddConst(ExprValue val);
+  void BindPath(const std::string& path, Node* node) const;
+  bool FoldConst(int index);
+
+  // Returns the values of the node for msg, which is null for the constant operands.
+  const std::vector<ExprValue>& Eval(int index, const gpb::Message* msg) const;
+  bool EvalBool(const Node& node, const gpb::Message* msg) const;
+  void CollectPath(const Node& node, const gpb::Message& msg, size_t depth) const;
+
+  // Sets the column comparison of the CMP node if it has one.
+  void BindColumn(Node* node);
+
+  // Whether the node yields a single bool per message, so its bitmap can be combined.
+  bool IsSingleBool(int index) const;
+  void EvalBatch(int index, const gpb::Message* const* msgs, size_t n, uint64_t* dest) const;
+
+  const gpb::Descriptor* descr_;
+  std::vector<Node> nodes_;  // the root is the last node.
+  std::deque<std::string> strings_;  // for the string constants.
+  mutable std::deque<std::string> scratch_;  // for the string values that are not referenced.
+  mutable std::vector<int64> int_column_;
+  mutable std::vector<double> double_column_;
+};
+
 }  // namespace plang
 
 #endif  // _PLANG_H
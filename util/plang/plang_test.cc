@@ -32,7 +32,11 @@ protected:
 
   bool eval(const ::google::protobuf::Message &msg) {
     CHECK(res_val_);
-    return EvaluateBoolExpr(*res_val_, msg);
+    bool res = EvaluateBoolExpr(*res_val_, msg);
+
+    CompiledExpr compiled(*res_val_, msg.GetDescriptor());
+    EXPECT_EQ(res, compiled.EvaluateBool(msg));
+    return res;
   }
 
   const Expr& get_parsed() {
@@ -287,6 +291,57 @@ TEST_F(PlangTest, RepeatedMsgs) {
   EXPECT_FALSE(eval(person));
 }
 
+TEST_F(PlangTest, Compiled) {
+  Person person;
+  person.set_name("Roman");
+  person.add_phone()->set_number("1");
+  person.add_phone()->set_number("2");
+
+  parse("phone.number = '2' && (1 < 2 || id = 1) && name rlike 'R.*'");
+  CompiledExpr compiled(get_parsed(), person.GetDescriptor());
+  EXPECT_TRUE(compiled.EvaluateBool(person));
+
+  person.mutable_phone(1)->set_number("3");
+  EXPECT_FALSE(compiled.EvaluateBool(person));
+
+  person.add_phone()->set_number("2");
+  EXPECT_TRUE(compiled.EvaluateBool(person));
+
+  person.set_name("Anna");
+  EXPECT_FALSE(compiled.EvaluateBool(person));
+
+  parse("def(phone.type) || hash('a') = hash('a')");
+  EXPECT_TRUE(eval(person));
+}
+
+TEST_F(PlangTest, Batch) {
+  std::vector<Person> persons(100);
+  std::vector<const ::google::protobuf::Message*> msgs;
+  for (size_t i = 0; i < persons.size(); ++i) {
+    persons[i].set_name(i % 3 ? "Roman" : "Anna");
+    persons[i].set_id(int64(i) - 20);
+    persons[i].set_dval(i / 4.0);
+    for (size_t j = 0; j < i % 3; ++j)
+      persons[i].add_phone()->set_number(std::to_string(j));
+    msgs.push_back(&persons[i]);
+  }
+
+  uint64_t mask[2];
+  for (const char* expr : {"id < 7", "7 <= id && id = 9 || dval < 3.5", "not 2.5 < dval",
+                           "id < 30 && name = 'Roman'", "def(phone) || id = -1"}) {
+    parse(expr);
+    CompiledExpr compiled(get_parsed(), persons[0].GetDescriptor());
+    for (size_t n : {size_t(0), size_t(64), size_t(70)}) {
+      std::fill(mask, mask + 2, ~0ULL);
+      compiled.EvaluateBatch(msgs.data(), n, mask);
+      for (size_t i = 0; i < 128; ++i) {
+        bool expected = i < n && EvaluateBoolExpr(get_parsed(), persons[i]);
+        ASSERT_EQ(expected, (mask[i / 64] >> (i % 64)) & 1) << expr << " " << n << " " << i;
+      }
+    }
+  }
+}
+
 TEST_F(PlangTest, Precedence) {
   parse("a = 1 && b = 2 || c = 3 && d < 4 || not e < 5 || f = 6");
   const BinOp& n = dynamic_cast<const BinOp &>(get_parsed());
@@ -5,11 +5,17 @@
 
 #include <google/protobuf/compiler/importer.h>
 
+#include <condition_variable>
+#include <map>
+#include <thread>
+
 #include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
 #include "base/flags.h"
 #include "base/hash.h"
 #include "base/logging.h"
 #include "base/map-util.h"
+#include "file/fiber_file.h"
 #include "file/list_file.h"
 #include "file/proto_writer.h"
 #include "util/pb2json.h"
@@ -27,7 +33,11 @@ DEFINE_bool(json, false, "");
 DEFINE_bool(raw, false, "");
 DEFINE_string(sample_key, "", "");
 DEFINE_int32(sample_factor, 0, "If bigger than 0 samples and outputs record once in k times");
-DEFINE_bool(parallel, true, "");
+DEFINE_bool(parallel, true, "Reads, filters and formats the file chunks in parallel, the "
+            "output is ordered like the records");
+DEFINE_uint32(workers, 10, "Number of the parallel threads");
+DEFINE_uint32(chunk_mb, 64, "Size in MB of the file chunks that are processed in parallel");
+DEFINE_uint32(read_ahead, 8, "Number of list file blocks that are decompressed in parallel");
 DEFINE_bool(count, false, "");
 
 
@@ -102,9 +112,12 @@ class FilePrinter::PrintTask {
 
   void InitShared(SharedData d) {
     shared_data_ = d;
+    if (d->expr && local_msg_) {
+      expr_.reset(new plang::CompiledExpr(*d->expr, local_msg_->GetDescriptor()));
+    }
   }
 
-  PrintTask(const gpb::Message* to_clone, const Pb2JsonOptions& opts) : options_(opts) {
+  PrintTask(const gpb::Message* to_clone, const Pb2JsonOptions& opts) : json_printer_(opts) {
     if (to_clone) {
       local_msg_.reset(to_clone->New());
     }
@@ -115,30 +128,69 @@ class FilePrinter::PrintTask {
     }
   }
 
+  // Makes Format sum the sizes in the task, instead of locking the shared summarizer for every
+  // record. MergeSizes adds them to the shared summarizer once the task is done.
+  void UseLocalSizes() {
+    if (FLAGS_sizes)
+      local_sizes_.reset(new SizeSummarizer(local_msg_->GetDescriptor()));
+  }
+
+  void MergeSizes() {
+    if (local_sizes_) {
+      std::lock_guard<mutex> lock(shared_data_->m);
+      shared_data_->size_summarizer->Merge(*local_sizes_);
+      local_sizes_.reset();
+    }
+  }
+
   void operator()(const std::string& obj) {
-    if (FLAGS_raw) {
+    output_.clear();
+    Format(obj, &output_);
+    if (!output_.empty()) {
       std::lock_guard<mutex> lock(shared_data_->m);
-      std::cout << absl::Utf8SafeCEscape(obj) << "\n";
+      std::cout << output_;
+    }
+  }
+
+  // Appends the output of the record to dest.
+  void Format(StringPiece obj, std::string* dest) {
+    if (FLAGS_raw) {
+      absl::StrAppend(dest, absl::Utf8SafeCEscape(obj), "\n");
       return;
     }
-    CHECK(local_msg_->ParseFromString(obj));
-    if (shared_data_->expr && !plang::EvaluateBoolExpr(*shared_data_->expr, *local_msg_))
+
+    // Without the filters the sizes are summed from the wire format, the record is not parsed.
+    if (FLAGS_sizes && !expr_ && (FLAGS_sample_factor <= 0 || FLAGS_sample_key.empty())) {
+      if (local_sizes_) {
+        CHECK(local_sizes_->AddWireSizes(obj));
+      } else {
+        std::lock_guard<mutex> lock(shared_data_->m);
+        CHECK(shared_data_->size_summarizer->AddWireSizes(obj));
+      }
+      return;
+    }
+
+    CHECK(local_msg_->ParseFromArray(obj.data(), obj.size()));
+    if (expr_ && !expr_->EvaluateBool(*local_msg_))
       return;
 
     if (ShouldSkip(*local_msg_, fd_path_))
       return;
-    std::lock_guard<mutex> lock(shared_data_->m);
 
     if (FLAGS_sizes) {
-      shared_data_->size_summarizer->AddSizes(*local_msg_);
+      if (local_sizes_) {
+        local_sizes_->AddSizes(*local_msg_);
+      } else {
+        std::lock_guard<mutex> lock(shared_data_->m);
+        shared_data_->size_summarizer->AddSizes(*local_msg_);
+      }
       return;
     }
 
     if (FLAGS_json) {
-      string str = Pb2Json(*local_msg_, options_);
-      std::cout << str << "\n";
+      absl::StrAppend(dest, json_printer_.Print(*local_msg_), "\n");
     } else {
-      shared_data_->printer->Output(*local_msg_);
+      shared_data_->printer->Output(*local_msg_, dest);
     }
   }
 
@@ -146,7 +198,10 @@ class FilePrinter::PrintTask {
   std::unique_ptr<gpb::Message> local_msg_;
   FdPath fd_path_;
   SharedData shared_data_;
-  Pb2JsonOptions options_;
+  std::unique_ptr<plang::CompiledExpr> expr_;
+  Pb2JsonPrinter json_printer_;
+  std::string output_;
+  std::unique_ptr<SizeSummarizer> local_sizes_;
 };
 
 FilePrinter::FilePrinter() {}
@@ -172,11 +227,19 @@ void FilePrinter::Init(const string& fname) {
     CHECK(!FLAGS_sizes);
   }
 
-  pool_.reset(new TaskPool("pool", 10));
-
   shared_data_.size_summarizer = size_summarizer_.get();
   shared_data_.printer = printer_.get();
   shared_data_.expr = test_expr_.get();
+
+  CHECK_GT(FLAGS_workers, 0);
+  num_chunks_ = FLAGS_parallel ? NumChunks() : 0;
+  if (num_chunks_) {
+    LOG(INFO) << "Running " << num_chunks_ << " chunks in parallel "
+              << std::min(FLAGS_workers, num_chunks_) << " threads";
+    return;
+  }
+
+  pool_.reset(new TaskPool("pool", FLAGS_workers));
   pool_->SetSharedData(&shared_data_);
   pool_->Launch(descr_msg_.get(), options_);
 
@@ -190,7 +253,18 @@ auto FilePrinter::GetDescriptor() const -> const Descriptor* {
 }
 
 Status FilePrinter::Run() {
+  if (num_chunks_) {
+    RETURN_IF_ERROR(RunChunks());
+    if (size_summarizer_.get())
+      std::cout << *size_summarizer_ << "\n";
+    return Status::OK;
+  }
+
   StringPiece record;
+
+  // The workers are woken up per queue-full of records instead of per record.
+  if (FLAGS_parallel)
+    pool_->BeginBatch();
   while (true) {
     util::StatusObject<bool> res = Next(&record);
     if (!res.ok())
@@ -214,11 +288,89 @@ Status FilePrinter::Run() {
   return Status::OK;
 }
 
+Status FilePrinter::RunChunks() {
+  const unsigned num_workers = std::min(FLAGS_workers, num_chunks_);
+
+  // The workers do not run ahead of the output by more than that, which bounds the memory of
+  // the chunks that wait for their predecessors.
+  const unsigned window = num_workers * 2;
+
+  std::mutex mu;
+  std::condition_variable cv;
+  unsigned next_chunk = 0, next_output = 0;
+  std::map<unsigned, string> ready;  // formatted chunks that wait for their predecessors.
+  Status status;
+
+  auto worker = [&] {
+    PrintTask task(descr_msg_.get(), options_);
+    task.InitShared(&shared_data_);
+    task.UseLocalSizes();
+
+    std::unique_lock<std::mutex> lock(mu);
+    while (status.ok() && next_chunk < num_chunks_) {
+      unsigned chunk = next_chunk++;
+      cv.wait(lock, [&] { return !status.ok() || chunk < next_output + window; });
+      if (!status.ok())
+        break;
+      lock.unlock();
+
+      string output;
+      uint64_t count = 0;
+      Status st = ReadChunk(chunk, [&](StringPiece record) {
+        ++count;
+        if (!FLAGS_count)
+          task.Format(record, &output);
+      });
+
+      lock.lock();
+      count_ += count;
+      if (!st.ok()) {
+        status = st;
+        cv.notify_all();
+        break;
+      }
+
+      ready.emplace(chunk, std::move(output));
+      for (auto it = ready.begin(); it != ready.end() && it->first == next_output;
+           it = ready.erase(it)) {
+        std::cout << it->second;
+        ++next_output;
+      }
+      cv.notify_all();
+    }
+    lock.unlock();
+    task.MergeSizes();
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    threads.emplace_back(worker);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  return status;
+}
+
+ListReaderPrinter::ListReaderPrinter() {}
+
+ListReaderPrinter::~ListReaderPrinter() {}
 
 void ListReaderPrinter::LoadFile(const std::string& fname) {
   auto corrupt_cb = [this](size_t bytes, const util::Status& status) { st_ = status; };
 
-  reader_.reset(new ListReader(fname, false, corrupt_cb));
+  auto res = ReadonlyFile::Open(fname);
+  CHECK(res.ok()) << res.status << ", file name: " << fname;
+  fname_ = fname;
+  file_size_ = res.obj->Size();
+
+  reader_.reset(new ListReader(res.obj, TAKE_OWNERSHIP, false, corrupt_cb));
+  if (FLAGS_read_ahead) {
+    if (!fq_pool_)
+      fq_pool_.reset(new fibers_ext::FiberQueueThreadPool);
+    reader_->SetReadAhead(FLAGS_read_ahead, file::FiberBlockExecutor(fq_pool_.get()));
+  }
 
   if (!FLAGS_raw && !FLAGS_count) {
     std::map<std::string, std::string> meta;
@@ -242,6 +394,30 @@ util::StatusObject<bool> ListReaderPrinter::Next(StringPiece* record) {
   return res;
 }
 
+unsigned ListReaderPrinter::NumChunks() {
+  const size_t chunk_size = size_t(FLAGS_chunk_mb) << 20;
+  CHECK_GT(chunk_size, 0);
+  return (file_size_ + chunk_size - 1) / chunk_size;
+}
+
+Status ListReaderPrinter::ReadChunk(unsigned chunk, std::function<void(StringPiece)> cb) {
+  Status st;
+  auto corrupt_cb = [&st](size_t bytes, const util::Status& status) { st = status; };
+
+  const size_t chunk_size = size_t(FLAGS_chunk_mb) << 20;
+  ListReader reader(fname_, false, corrupt_cb);
+  reader.SetRange(chunk * chunk_size, chunk_size);
+
+  string record_buf;
+  StringPiece record;
+  while (reader.ReadRecord(&record, &record_buf)) {
+    if (!st.ok())
+      return st;
+    cb(record);
+  }
+  return st;
+}
+
 void ListReaderPrinter::PostRun() {
   LOG(INFO) << "Data bytes: " << reader_->read_data_bytes()
             << " header bytes: " << reader_->read_header_bytes();
@@ -19,6 +19,10 @@ class ListReader;
 }  // namespace file
 
 namespace util {
+namespace fibers_ext {
+class FiberQueueThreadPool;
+}  // namespace fibers_ext
+
 namespace pprint {
 
 class SizeSummarizer;
@@ -62,6 +66,17 @@ class FilePrinter {
   virtual void PostRun() {
   }
 
+  // Splits the input into the chunks whose records are read independently, ordered like
+  // the records. Returns 0 if the input is read only sequentially with Next.
+  virtual unsigned NumChunks() {
+    return 0;
+  }
+
+  // Calls cb for the records of the chunk. Called concurrently for different chunks.
+  virtual util::Status ReadChunk(unsigned chunk, std::function<void(StringPiece)> cb) {
+    return util::Status::OK;
+  }
+
   std::unique_ptr<const ::google::protobuf::Message> descr_msg_;
 
  private:
@@ -76,6 +91,10 @@ class FilePrinter {
 
   using TaskPool = util::SingleProducerTaskPool<PrintTask>;
 
+  // Runs the workers that read, filter and format whole chunks, and outputs the chunks in
+  // their order.
+  util::Status RunChunks();
+
   std::unique_ptr<TaskPool> pool_;
   std::unique_ptr<Printer> printer_;
   std::unique_ptr<SizeSummarizer> size_summarizer_;
@@ -90,16 +109,28 @@ class FilePrinter {
 
   FieldPrinterPredicate field_printer_cb_;
   uint64_t count_ = 0;
+  unsigned num_chunks_ = 0;  // with --parallel, otherwise the records are read with Next.
 };
 
 class ListReaderPrinter final : public FilePrinter {
+ public:
+  ListReaderPrinter();
+  ~ListReaderPrinter();
+
  protected:
   void LoadFile(const std::string& fname) override;
   util::StatusObject<bool> Next(StringPiece* record) override;
   void PostRun() override;
 
+  // The chunks are the ranges of --chunk_mb, see ListReader::SetRange.
+  unsigned NumChunks() override;
+  util::Status ReadChunk(unsigned chunk, std::function<void(StringPiece)> cb) override;
+
  private:
+  std::string fname_;
+  size_t file_size_ = 0;
   std::unique_ptr<file::ListReader> reader_;
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> fq_pool_;  // decompresses read-ahead blocks.
   std::string record_buf_;
   util::Status st_;
 };
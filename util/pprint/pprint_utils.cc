@@ -8,6 +8,8 @@
 #include <glog/stl_logging.h>
 #include <google/protobuf/compiler/importer.h>
 #include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
@@ -38,6 +40,8 @@ using absl::StrCat;
 namespace util {
 namespace pprint {
 
+using gpb::internal::WireFormatLite;
+
 FdPath::FdPath(const gpb::Descriptor* root, StringPiece path) {
   std::vector<StringPiece> parts = absl::StrSplit(path, ".");
   CHECK(!parts.empty()) << path;
@@ -266,20 +270,25 @@ Printer::Printer(const gpb::Descriptor* descriptor, FieldPrinterPredicate pred)
 }
 
 void Printer::Output(const gpb::Message& msg) const {
-  string text_output;
+  string output;
+  Output(msg, &output);
+  std::cout << output;
+}
+
+void Printer::Output(const gpb::Message& msg, string* dest) const {
   if (fds_.empty()) {
+    string text_output;
     CHECK(printer_.PrintToString(msg, &text_output));
-    std::cout << type_name_ << " {" << (FLAGS_short ? " " : "\n")
-              << text_output << "}\n";
+    absl::StrAppend(dest, type_name_, " {", (FLAGS_short ? " " : "\n"), text_output, "}\n");
   } else {
-    PrintValueRecur(0, "", false, msg);
+    PrintValueRecur(0, "", false, msg, dest);
   }
 }
 
 void Printer::PrintValueRecur(size_t path_index, const string& prefix,
-                              bool has_value, const gpb::Message& msg) const {
+                              bool has_value, const gpb::Message& msg, string* dest) const {
   CHECK_LT(path_index, fds_.size());
-  auto cb_fun = [path_index, this, has_value, &prefix, &msg](
+  auto cb_fun = [path_index, this, has_value, &prefix, &msg, dest](
     // num_items - #items in leaf repeated field. if given (!-1): aggregate all values: "xx,yy,.."
     // item_index - item index in leaf repeated field. if given (!-1): print line with this item.
     const gpb::Message& parent, const gpb::FieldDescriptor* fd, int item_index, int num_items) {
@@ -312,9 +321,9 @@ void Printer::PrintValueRecur(size_t path_index, const string& prefix,
     bool next_has_value = has_value | !val.empty();
     if (path_index + 1 == fds_.size()) {
       if (next_has_value)
-        cout << next_val << std::endl;
+        absl::StrAppend(dest, next_val, "\n");
     } else {
-      PrintValueRecur(path_index + 1, next_val, next_has_value, msg);
+      PrintValueRecur(path_index + 1, next_val, next_has_value, msg, dest);
     }
   };
   fds_[path_index].ExtractValue(msg, cb_fun);
@@ -393,12 +402,37 @@ static std::vector<const gpb::FieldDescriptor *> ListFields(const gpb::Message &
   return initialized_fields;
 }
 
+// The estimated size of a single value of the numeric field, 0 for the other types.
+static size_t ValueSize(const gpb::FieldDescriptor *field) {
+  // TODO(ORI): Need to handle variant encoding in protobufs
+  // (otherwise our calculation of the integral fields is very inaccurate)
+  switch (field->type()) {
+    case gpb::FieldDescriptor::TYPE_DOUBLE:
+    case gpb::FieldDescriptor::TYPE_INT64:
+    case gpb::FieldDescriptor::TYPE_UINT64:
+    case gpb::FieldDescriptor::TYPE_FIXED64:
+    case gpb::FieldDescriptor::TYPE_SFIXED64:
+    case gpb::FieldDescriptor::TYPE_SINT64:
+      return 8;
+    case gpb::FieldDescriptor::TYPE_FLOAT:
+    case gpb::FieldDescriptor::TYPE_INT32:
+    case gpb::FieldDescriptor::TYPE_UINT32:
+    case gpb::FieldDescriptor::TYPE_FIXED32:
+    case gpb::FieldDescriptor::TYPE_SFIXED32:
+    case gpb::FieldDescriptor::TYPE_SINT32:
+    case gpb::FieldDescriptor::TYPE_ENUM: // TODO(ORI): Is this correct?
+      return 4;
+    case gpb::FieldDescriptor::TYPE_BOOL:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
 static size_t GetSize(const gpb::Message &msg,
                       const gpb::FieldDescriptor *field) {
   const gpb::Reflection *reflect = msg.GetReflection();
   const size_t field_size = field->is_repeated() ? reflect->FieldSize(msg, field) : 1;
-  // TODO(ORI): Need to handle variant encoding in protobufs
-  // (otherwise our calculation of the integral fields is very inaccurate)
   switch (field->type()) {
     case gpb::FieldDescriptor::TYPE_DOUBLE:
     case gpb::FieldDescriptor::TYPE_INT64:
@@ -406,17 +440,15 @@ static size_t GetSize(const gpb::Message &msg,
     case gpb::FieldDescriptor::TYPE_FIXED64:
     case gpb::FieldDescriptor::TYPE_SFIXED64:
     case gpb::FieldDescriptor::TYPE_SINT64:
-      return 8 * field_size;
     case gpb::FieldDescriptor::TYPE_FLOAT:
     case gpb::FieldDescriptor::TYPE_INT32:
     case gpb::FieldDescriptor::TYPE_UINT32:
     case gpb::FieldDescriptor::TYPE_FIXED32:
     case gpb::FieldDescriptor::TYPE_SFIXED32:
     case gpb::FieldDescriptor::TYPE_SINT32:
-    case gpb::FieldDescriptor::TYPE_ENUM: // TODO(ORI): Is this correct?
-      return 4 * field_size;
+    case gpb::FieldDescriptor::TYPE_ENUM:
     case gpb::FieldDescriptor::TYPE_BOOL:
-      return field_size;
+      return ValueSize(field) * field_size;
     case gpb::FieldDescriptor::TYPE_STRING:
     case gpb::FieldDescriptor::TYPE_BYTES: {
       std::string temp;
@@ -450,7 +482,7 @@ static SizeSummarizer::Trie FillTrie(const gpb::Descriptor *descr) {
 }
 
 SizeSummarizer::SizeSummarizer(const gpb::Descriptor *descr)
-    : trie_(FillTrie(descr)) {}
+    : descr_(descr), trie_(FillTrie(descr)) {}
 
 static size_t AddSizesImpl(const gpb::Message &msg,
                          SizeSummarizer::Trie *trie) {
@@ -484,6 +516,98 @@ void SizeSummarizer::AddSizes(const gpb::Message &msg) {
   AddSizesImpl(msg, &trie_);
 }
 
+// Counts the values of the packed repeated field, the stream is limited to the field.
+static bool CountPacked(const gpb::FieldDescriptor *field, gpb::io::CodedInputStream *is,
+                        size_t *count) {
+  switch (WireFormatLite::WireTypeForFieldType(WireFormatLite::FieldType(field->type()))) {
+    case WireFormatLite::WIRETYPE_FIXED32:
+      *count = is->BytesUntilLimit() / 4;
+      return is->Skip(is->BytesUntilLimit());
+    case WireFormatLite::WIRETYPE_FIXED64:
+      *count = is->BytesUntilLimit() / 8;
+      return is->Skip(is->BytesUntilLimit());
+    default:
+      break;
+  }
+
+  *count = 0;
+  uint64 val;
+  while (is->BytesUntilLimit() > 0) {
+    if (!is->ReadVarint64(&val))
+      return false;
+    ++(*count);
+  }
+  return true;
+}
+
+// Follows AddSizesImpl: the fields that are not in the descriptor and the groups are skipped.
+static bool AddWireSizesImpl(const gpb::Descriptor *descr, gpb::io::CodedInputStream *is,
+                             SizeSummarizer::Trie *trie, size_t *total) {
+  while (uint32 tag = is->ReadTag()) {
+    const gpb::FieldDescriptor *field =
+        descr->FindFieldByNumber(WireFormatLite::GetTagFieldNumber(tag));
+    WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+    if (!field || field->type() == gpb::FieldDescriptor::TYPE_GROUP ||
+        (wire_type != WireFormatLite::WireTypeForFieldType(
+                          WireFormatLite::FieldType(field->type())) &&
+         !(field->is_packable() && wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))) {
+      if (!WireFormatLite::SkipField(is, tag))
+        return false;
+      continue;
+    }
+
+    auto subtrie = trie->Get(field->index());
+    size_t sz = 0;
+    if (wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      uint32 length;
+      if (!is->ReadVarint32(&length))
+        return false;
+
+      auto limit = is->PushLimit(length);
+      bool res;
+      if (field->type() == gpb::FieldDescriptor::TYPE_MESSAGE) {
+        res = AddWireSizesImpl(field->message_type(), is, subtrie, &sz);
+      } else if (field->type() == gpb::FieldDescriptor::TYPE_STRING ||
+                 field->type() == gpb::FieldDescriptor::TYPE_BYTES) {
+        sz = length;
+        res = is->Skip(length);
+      } else {
+        res = CountPacked(field, is, &sz);
+        sz *= ValueSize(field);
+      }
+      is->PopLimit(limit);
+      if (!res)
+        return false;
+    } else {
+      if (!WireFormatLite::SkipField(is, tag))
+        return false;
+      sz = ValueSize(field);
+    }
+
+    subtrie->bytes += sz;
+    *total += sz;
+  }
+  return is->ConsumedEntireMessage();
+}
+
+bool SizeSummarizer::AddWireSizes(StringPiece record) {
+  gpb::io::CodedInputStream is(reinterpret_cast<const uint8*>(record.data()), record.size());
+  size_t total = 0;
+  return AddWireSizesImpl(descr_, &is, &trie_, &total);
+}
+
+static void MergeImpl(const SizeSummarizer::Trie &src, SizeSummarizer::Trie *dest) {
+  CHECK_EQ(src.Size(), dest->Size());
+  dest->bytes += src.bytes;
+  for (size_t i = 0; i < src.Size(); ++i)
+    MergeImpl(*src.Get(i), dest->Get(i));
+}
+
+void SizeSummarizer::Merge(const SizeSummarizer &other) {
+  CHECK_EQ(descr_, other.descr_);
+  MergeImpl(other.trie_, &trie_);
+}
+
 static void GetSizesImpl(const SizeSummarizer::Trie &trie,
                          const std::string &path,
                          std::map<std::string, size_t> *out) {
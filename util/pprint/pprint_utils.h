@@ -82,7 +82,7 @@ class Printer {
   // void ExtractValueRecur(const gpb::Message& msg, const FdPath& fd_path, uint32 index, ValueCb
   // cb);
   void PrintValueRecur(size_t path_index, const std::string& prefix, bool has_value,
-                       const gpb::Message& msg) const;
+                       const gpb::Message& msg, std::string* dest) const;
 
  public:
   using FieldPrinterPredicate =
@@ -90,6 +90,9 @@ class Printer {
 
   explicit Printer(const gpb::Descriptor* descriptor, FieldPrinterPredicate pred = nullptr);
   void Output(const gpb::Message& msg) const;
+
+  // Appends the output of msg to dest. Thread-safe.
+  void Output(const gpb::Message& msg, std::string* dest) const;
 };
 
 struct PrintBqSchemaOptions {
@@ -131,10 +134,20 @@ class SizeSummarizer {
 
   explicit SizeSummarizer(const gpb::Descriptor* descr);
   void AddSizes(const gpb::Message& msg);
+
+  // Adds the sizes of the serialized message of descr by scanning its wire format, without
+  // parsing it. The sizes are estimated like AddSizes(msg) does. Returns false if the record
+  // is malformed.
+  bool AddWireSizes(StringPiece record);
+
+  // Adds the sizes of other, which must have the same descriptor.
+  void Merge(const SizeSummarizer& other);
+
   std::map<std::string, size_t> GetSizes() const;
   void Print(std::ostream* out) const;
 
  private:
+  const gpb::Descriptor* descr_;
   Trie trie_;
 };
 
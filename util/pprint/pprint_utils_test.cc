@@ -97,6 +97,12 @@ TEST_F(PprintUtilsTest, SizeSummarizerNestedString) {
   ss.AddSizes(m1);
   ss.AddSizes(m2);
   std::map<std::string, size_t> sizes = ss.GetSizes();
+
+  SizeSummarizer wire_ss(m1.GetDescriptor());
+  ASSERT_TRUE(wire_ss.AddWireSizes(m1.SerializeAsString()));
+  ASSERT_TRUE(wire_ss.AddWireSizes(m2.SerializePartialAsString()));
+  EXPECT_EQ(sizes, wire_ss.GetSizes());
+
   auto expected_a1_s1 = m1.a1().s1().size() + m2.a1().s1().size();
   auto expected_a1_s2 = m1.a1().s2(0).size() + m1.a1().s2(1).size();
   auto expected_a2_s1 = (m1.a2(0).s1().size() + m1.a2(1).s1().size() +
@@ -133,5 +139,37 @@ TEST_F(PprintUtilsTest, SizeSummarizerNestedString) {
   ASSERT_EQ(sizes["c1"],expected_c1_s1 + expected_c1_s2 + expected_c1_d1);
 }
 
+TEST_F(PprintUtilsTest, WireSizes) {
+  Numbers m1;
+  Numbers m2;
+  m1.set_i64(-1);
+  m1.set_b(false);
+  m1.add_packed_i32(1);
+  m1.add_packed_i32(-100000);
+  m1.add_packed_f64(7);
+  m1.add_d(0.5);
+  m1.add_d(1.5);
+  m1.mutable_a()->set_s1("ori");
+  m2.mutable_a()->set_s1("");
+  m2.mutable_a()->add_s2("alex");
+  m2.add_packed_i32(300);
+
+  SizeSummarizer ss(m1.GetDescriptor()), wire_ss(m1.GetDescriptor());
+  for (const Numbers* m : {&m1, &m2}) {
+    ss.AddSizes(*m);
+    ASSERT_TRUE(wire_ss.AddWireSizes(m->SerializeAsString()));
+  }
+  EXPECT_EQ(ss.GetSizes(), wire_ss.GetSizes());
+  EXPECT_EQ(12, wire_ss.GetSizes()["packed_i32"]);
+
+  std::string record = m1.SerializeAsString();
+  EXPECT_FALSE(wire_ss.AddWireSizes(StringPiece(record).substr(0, record.size() - 1)));
+
+  SizeSummarizer merged(m1.GetDescriptor());
+  merged.Merge(ss);
+  merged.Merge(ss);
+  EXPECT_EQ(2 * ss.GetSizes()["a.s1"], merged.GetSizes()["a.s1"]);
+}
+
 }
 }
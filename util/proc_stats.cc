@@ -4,11 +4,14 @@
 #include "util/proc_stats.h"
 
 #include <mutex>
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "base/walltime.h"
 #include "strings/stringpiece.h"
 #include "strings/numbers.h"
 #include "strings/strip.h"
 
+#include <dirent.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -97,6 +100,91 @@ ProcessStats ProcessStats::Read() {
   return stats;
 }
 
+namespace {
+
+// Reads a small /proc file into buf. Returns an empty string if it could not be read.
+StringPiece ReadProcFile(const std::string& path, char* buf, size_t size) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == nullptr)
+    return StringPiece();
+  size_t bytes_read = fread(buf, 1, size, f);
+  fclose(f);
+  return StringPiece(buf, bytes_read);
+}
+
+// Returns the value of the "key: value" line of the proc file contents or 0.
+uint64 ProcValue(StringPiece contents, StringPiece key) {
+  for (size_t pos = 0; pos < contents.size();) {
+    StringPiece line = contents.substr(pos);
+    line = line.substr(0, line.find('\n'));
+    pos += line.size() + 1;
+    if (line.size() > key.size() && absl::StartsWith(line, key) && line[key.size()] == ':') {
+      line = absl::StripLeadingAsciiWhitespace(line.substr(key.size() + 1));
+      return ParseLeadingUDec64Value(line, 0);
+    }
+  }
+  return 0;
+}
+
+// Returns false if the thread exited.
+bool ReadThreadStats(StringPiece tid_str, ThreadStats* stats) {
+  static const long jiffies_per_second = sysconf(_SC_CLK_TCK);
+
+  char buf[4096];  // status is over 1KB.
+  std::string prefix = absl::StrCat("/proc/self/task/", tid_str, "/");
+
+  // pid (name) state ppid ... utime stime, the name may contain spaces and parentheses.
+  StringPiece str = ReadProcFile(prefix + "stat", buf, sizeof(buf));
+  size_t open = str.find('('), close = str.rfind(')');
+  if (open == StringPiece::npos || close == StringPiece::npos || close < open)
+    return false;
+  stats->tid = ParseLeadingUDec32Value(str, 0);
+  stats->name = std::string(str.substr(open + 1, close - open - 1));
+  StringPiece fields = str.substr(std::min(close + 2, str.size()));
+  size_t utime = find_nth(fields, ' ', 10), stime = find_nth(fields, ' ', 11);
+  if (stime != StringPiece::npos) {
+    stats->user_ms = ParseLeadingUDec64Value(fields.substr(utime + 1), 0) * 1000 /
+                     jiffies_per_second;
+    stats->system_ms = ParseLeadingUDec64Value(fields.substr(stime + 1), 0) * 1000 /
+                       jiffies_per_second;
+  }
+
+  str = ReadProcFile(prefix + "status", buf, sizeof(buf));
+  stats->voluntary_switches = ProcValue(str, "voluntary_ctxt_switches");
+  stats->involuntary_switches = ProcValue(str, "nonvoluntary_ctxt_switches");
+
+  str = ReadProcFile(prefix + "schedstat", buf, sizeof(buf));
+  size_t wait = find_nth(str, ' ', 0);
+  if (wait != StringPiece::npos) {
+    stats->run_ns = ParseLeadingUDec64Value(str, 0);
+    stats->runq_wait_ns = ParseLeadingUDec64Value(str.substr(wait + 1), 0);
+  }
+
+  str = ReadProcFile(prefix + "io", buf, sizeof(buf));
+  stats->read_bytes = ProcValue(str, "read_bytes");
+  stats->write_bytes = ProcValue(str, "write_bytes");
+
+  return true;
+}
+
+}  // namespace
+
+std::vector<ThreadStats> ThreadStats::ReadAll() {
+  std::vector<ThreadStats> res;
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == nullptr)
+    return res;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.')
+      continue;
+    ThreadStats stats;
+    if (ReadThreadStats(entry->d_name, &stats))
+      res.push_back(std::move(stats));
+  }
+  closedir(dir);
+  return res;
+}
+
 namespace sys {
 
 unsigned int NumCPUs() {
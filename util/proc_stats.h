@@ -4,7 +4,11 @@
 #ifndef PROC_STATUS_H
 #define PROC_STATUS_H
 
+#include <sys/types.h>
+
 #include <ostream>
+#include <string>
+#include <vector>
 
 #include "base/integral_types.h"
 
@@ -21,6 +25,29 @@ struct ProcessStats {
   static ProcessStats Read();
 };
 
+// The counters of a single thread of the process since it started, see ReadAll().
+struct ThreadStats {
+  pid_t tid = 0;
+  std::string name;  // as set by pthread_setname_np, e.g. IoPool3 or fq_pool0.
+
+  uint64 user_ms = 0, system_ms = 0;
+
+  // How long the thread ran on a cpu and how long it waited for one while runnable.
+  // Both are 0 if the kernel does not provide schedstat.
+  uint64 run_ns = 0, runq_wait_ns = 0;
+
+  // The involuntary switches are preemptions, the voluntary are mostly blocking calls.
+  uint64 voluntary_switches = 0, involuntary_switches = 0;
+
+  // The bytes the thread caused to be read from or written to the storage. 0 if the process
+  // is not allowed to read its io accounting.
+  uint64 read_bytes = 0, write_bytes = 0;
+
+  // Reads /proc/self/task/*/{stat,status,schedstat,io}. The threads that exit meanwhile
+  // are skipped.
+  static std::vector<ThreadStats> ReadAll();
+};
+
 namespace sys {
   unsigned int NumCPUs();
 }  // namespace sys
@@ -0,0 +1,51 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/proc_stats.h"
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+
+namespace util {
+
+using namespace std;
+
+TEST(ProcStatsTest, Threads) {
+  atomic_bool done{false};
+  atomic<pid_t> tid{0};
+  thread busy([&] {
+    pthread_setname_np(pthread_self(), "busy (1) x");
+    tid = syscall(SYS_gettid);
+    while (!done) {
+      // spin
+    }
+  });
+  while (tid == 0) {
+    this_thread::yield();
+  }
+  SleepForMilliseconds(100);
+
+  vector<ThreadStats> stats = ThreadStats::ReadAll();
+  done = true;
+  busy.join();
+
+  ASSERT_GE(stats.size(), 2);
+  const ThreadStats* found = nullptr;
+  for (const ThreadStats& st : stats) {
+    if (st.tid == tid)
+      found = &st;
+  }
+  ASSERT_TRUE(found);
+  EXPECT_EQ("busy (1) x", found->name);
+  EXPECT_GT(found->user_ms + found->system_ms, 0);
+}
+
+}  // namespace util
@@ -0,0 +1,285 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/balanced_channel.h"
+
+#include <boost/fiber/fiber.hpp>
+#include <random>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "util/asio/io_context_pool.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace util {
+namespace rpc {
+
+DEFINE_uint32(rpc_replica_eject_failures, 3,
+              "After how many consecutive failed calls a replica of BalancedChannel is ejected");
+DEFINE_uint32(rpc_replica_eject_ms, 1000, "For how long the ejected replicas get no calls");
+DEFINE_double(rpc_hedge_percentile, 0,
+              "The idempotent calls of BalancedChannel that take longer than this percentile "
+              "of the recent latencies, e.g. 95, are duplicated to another replica. "
+              "0 disables hedging");
+DEFINE_double(rpc_retry_budget_ratio, 0.1,
+              "How many retries of the idempotent calls every successful call earns");
+DEFINE_uint32(rpc_retry_budget_max, 10, "The maximal number of the retries that are saved up");
+
+using namespace boost;
+
+namespace {
+
+unsigned RandomIndex(unsigned n) {
+  static thread_local std::minstd_rand rnd(std::random_device{}());
+  return rnd() % n;
+}
+
+// The number of the latencies from which the hedging delay is computed.
+constexpr unsigned kLatencyWindow = 1000;
+
+void CopyEnvelope(const Envelope& src, Envelope* dest) {
+  dest->Resize(src.header.size(), src.letter.size());
+  std::copy(src.header.begin(), src.header.end(), dest->header.begin());
+  std::copy(src.letter.begin(), src.letter.end(), dest->letter.begin());
+}
+
+// The remaining time until the deadline, at least 1ms.
+uint32_t RemainingMs(uint64_t deadline_usec) {
+  uint64_t now = GetMonotonicMicros();
+  return now + 1000 < deadline_usec ? (deadline_usec - now) / 1000 : 1;
+}
+
+}  // namespace
+
+// A hedged attempt of a call. Shared with the fiber that waits for its response, which
+// may outlive the call.
+struct BalancedChannel::Attempt {
+  Envelope envelope;
+  error_code ec;
+  std::atomic_bool finished{false};
+};
+
+BalancedChannel::BalancedChannel(
+    const std::vector<std::pair<std::string, std::string>>& endpoints, IoContextPool* pool) {
+  CHECK(!endpoints.empty());
+  for (const auto& ep : endpoints) {
+    Channel* channel = new Channel(ep.first, ep.second, &pool->GetNextContext());
+    replicas_.emplace_back(new Replica(channel));
+  }
+}
+
+BalancedChannel::~BalancedChannel() {
+  Shutdown();
+}
+
+auto BalancedChannel::Connect(uint32_t ms) -> error_code {
+  error_code res;
+  bool connected = false;
+  for (auto& r : replicas_) {
+    error_code ec = r->channel->Connect(ms);
+    LOG_IF(WARNING, ec) << "Could not connect a replica: " << ec.message();
+    if (ec)
+      res = ec;
+    else
+      connected = true;
+  }
+  return connected ? error_code{} : res;
+}
+
+auto BalancedChannel::Send(uint32_t deadline_msec, Envelope* envelope,
+                           const MethodRecorder* recorder) -> future_code_t {
+  return Pick()->channel->Send(deadline_msec, envelope, recorder);
+}
+
+auto BalancedChannel::SendSync(uint32_t deadline_msec, Envelope* envelope,
+                               const CallOptions& opts) -> error_code {
+  Replica* r = Pick();
+  if (!opts.idempotent) {
+    error_code ec = r->channel->SendSync(deadline_msec, envelope, opts.recorder);
+    Report(r, ec);
+    return ec;
+  }
+
+  // The responses overwrite the envelopes, hence every attempt sends a copy of the request.
+  Envelope request;
+  request.Swap(envelope);
+  const uint64_t start = GetMonotonicMicros();
+  const uint64_t deadline = start + deadline_msec * 1000ULL;
+
+  uint64_t hedge_usec = hedge_usec_.load(std::memory_order_relaxed);
+  bool hedge = FLAGS_rpc_hedge_percentile > 0 && hedge_usec && replicas_.size() > 1;
+  error_code ec = hedge ? SendHedged(r, deadline_msec, hedge_usec, request, envelope, opts)
+                        : SendAttempt(r, deadline_msec, request, envelope, opts);
+
+  // A timed out call has no time left for a retry.
+  while (ec && ec != asio::error::timed_out && GetMonotonicMicros() + 1000 < deadline &&
+         TakeRetry()) {
+    VLOG(1) << "Retrying a call after " << ec.message();
+    r = Pick(r);
+    ec = SendAttempt(r, RemainingMs(deadline), request, envelope, opts);
+  }
+
+  // The hedged calls add their own latency, which is longer than the hedging delay.
+  // Hence the percentile is not skewed by the calls that were cut short by hedging.
+  if (!ec && FLAGS_rpc_hedge_percentile > 0)
+    AddLatency(GetMonotonicMicros() - start);
+  return ec;
+}
+
+auto BalancedChannel::SendAndReadStream(Envelope* msg, Channel::MessageCallback cb,
+                                        const MethodRecorder* recorder) -> error_code {
+  Replica* r = Pick();
+  error_code ec = r->channel->SendAndReadStream(msg, std::move(cb), recorder);
+  Report(r, ec);
+  return ec;
+}
+
+void BalancedChannel::Shutdown() {
+  for (auto& r : replicas_) {
+    r->channel->Shutdown();
+  }
+}
+
+bool BalancedChannel::Healthy(const Replica& r, uint64_t now) const {
+  return now >= r.ejected_until.load(std::memory_order_relaxed) && !r.channel->status();
+}
+
+auto BalancedChannel::Pick(const Replica* exclude) -> Replica* {
+  unsigned n = replicas_.size();
+  if (n == 1)
+    return replicas_.front().get();
+
+  unsigned i = RandomIndex(n), j = RandomIndex(n - 1);
+  if (j >= i)
+    ++j;
+  Replica* a = replicas_[i].get();
+  Replica* b = replicas_[j].get();
+  if (a == exclude)
+    std::swap(a, b);
+  if (b == exclude)
+    b = a;
+
+  uint64_t now = GetMonotonicMicros();
+  bool healthy_a = Healthy(*a, now), healthy_b = Healthy(*b, now);
+  if (healthy_a != healthy_b)
+    return healthy_a ? a : b;
+
+  if (!healthy_a) {
+    // Both are unhealthy, falls back to any healthy replica.
+    for (unsigned k = 1; k < n; ++k) {
+      Replica* r = replicas_[(i + k) % n].get();
+      if (r != exclude && Healthy(*r, now))
+        return r;
+    }
+  }
+  return a->channel->outstanding() <= b->channel->outstanding() ? a : b;
+}
+
+void BalancedChannel::Report(Replica* r, error_code ec) {
+  if (!ec) {
+    r->failures.store(0, std::memory_order_relaxed);
+
+    // Earns the retry budget, it may exceed the maximum by the concurrent updates.
+    if (retry_budget_.load(std::memory_order_relaxed) < FLAGS_rpc_retry_budget_max * 1000)
+      retry_budget_.fetch_add(FLAGS_rpc_retry_budget_ratio * 1000, std::memory_order_relaxed);
+    return;
+  }
+
+  if (r->failures.fetch_add(1, std::memory_order_relaxed) + 1 < FLAGS_rpc_replica_eject_failures)
+    return;
+  VLOG(1) << "Ejecting a replica after " << ec.message();
+  r->failures.store(0, std::memory_order_relaxed);
+  r->ejected_until.store(GetMonotonicMicros() + uint64_t(FLAGS_rpc_replica_eject_ms) * 1000,
+                         std::memory_order_relaxed);
+}
+
+auto BalancedChannel::SendAttempt(Replica* r, uint32_t deadline_msec, const Envelope& request,
+                                  Envelope* envelope, const CallOptions& opts) -> error_code {
+  CopyEnvelope(request, envelope);
+  error_code ec = r->channel->SendSync(deadline_msec, envelope, opts.recorder);
+  Report(r, ec);
+  return ec;
+}
+
+auto BalancedChannel::SendHedged(Replica* r, uint32_t deadline_msec, uint64_t hedge_usec,
+                                 const Envelope& request, Envelope* envelope,
+                                 const CallOptions& opts) -> error_code {
+  const uint64_t deadline = GetMonotonicMicros() + deadline_msec * 1000ULL;
+
+  // The attempt that loses the race still writes its response, hence it has its own envelope.
+  auto first = std::make_shared<Attempt>();
+  CopyEnvelope(request, &first->envelope);
+  future_code_t first_res = r->channel->Send(deadline_msec, &first->envelope, opts.recorder);
+
+  if (first_res.wait_for(std::chrono::microseconds(hedge_usec)) == fibers::future_status::ready ||
+      GetMonotonicMicros() + 1000 >= deadline) {
+    error_code ec = first_res.get();
+    Report(r, ec);
+    if (!ec)
+      envelope->Swap(&first->envelope);
+    return ec;
+  }
+
+  VLOG(1) << "Hedging a call after " << hedge_usec << "us";
+  Replica* r2 = Pick(r);
+  auto second = std::make_shared<Attempt>();
+  CopyEnvelope(request, &second->envelope);
+  future_code_t second_res =
+      r2->channel->Send(RemainingMs(deadline), &second->envelope, opts.recorder);
+
+  fibers_ext::Done done;
+  auto wait = [done](std::shared_ptr<Attempt> attempt, future_code_t res) mutable {
+    attempt->ec = res.get();
+    attempt->finished.store(true, std::memory_order_release);
+    done.Notify();
+  };
+  fibers::fiber(wait, first, std::move(first_res)).detach();
+  fibers::fiber(wait, second, std::move(second_res)).detach();
+
+  // Waits for the first successful response or for both attempts to fail.
+  Attempt* winner = nullptr;
+  bool first_done = false, second_done = false;
+  while (!winner && !(first_done && second_done)) {
+    done.Wait(AND_RESET);
+    first_done = first->finished.load(std::memory_order_acquire);
+    second_done = second->finished.load(std::memory_order_acquire);
+    if (first_done && !first->ec)
+      winner = first.get();
+    else if (second_done && !second->ec)
+      winner = second.get();
+  }
+
+  if (first_done)
+    Report(r, first->ec);
+  if (second_done)
+    Report(r2, second->ec);
+  if (!winner)
+    return second->ec;
+
+  envelope->Swap(&winner->envelope);
+  return error_code{};
+}
+
+void BalancedChannel::AddLatency(uint64_t usec) {
+  std::lock_guard<std::mutex> lk(latency_mu_);
+  latencies_.Add(usec);
+  if (latencies_.count() < kLatencyWindow)
+    return;
+
+  uint64_t hedge_usec = std::max(latencies_.Percentile(FLAGS_rpc_hedge_percentile), 1.0);
+  hedge_usec_.store(hedge_usec, std::memory_order_relaxed);
+  latencies_.Clear();
+}
+
+bool BalancedChannel::TakeRetry() {
+  int64_t budget = retry_budget_.load(std::memory_order_relaxed);
+  while (budget >= 1000) {
+    if (retry_budget_.compare_exchange_weak(budget, budget - 1000, std::memory_order_relaxed))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace rpc
+}  // namespace util
@@ -0,0 +1,113 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/histogram.h"
+#include "util/rpc/channel.h"
+
+namespace util {
+
+class IoContextPool;
+
+namespace rpc {
+
+// Rpc client over the replicas of a service, one Channel per replica.
+// Every call goes to one replica, chosen by the power of two choices: of two random replicas
+// it picks the healthy one with less outstanding calls. A replica is unhealthy while
+// its connection is broken - the channel reconnects it in the background - and for
+// --rpc_replica_eject_ms after --rpc_replica_eject_failures consecutive failed calls.
+// If all the replicas are unhealthy, the calls still go to one of them.
+//
+// The idempotent calls may run more than once. With --rpc_hedge_percentile, such a call
+// sends a duplicate to another replica once it takes longer than that percentile of the
+// latencies of the recent calls, and returns the first response. The failed idempotent calls
+// are retried on another replica while their deadline has not passed. The retries are
+// limited by a budget: every successful call earns --rpc_retry_budget_ratio of a retry,
+// up to --rpc_retry_budget_max, so that the retries do not multiply the load of an outage.
+// Thread-safe like Channel.
+class BalancedChannel {
+ public:
+  using error_code = Channel::error_code;
+  using future_code_t = Channel::future_code_t;
+
+  struct CallOptions {
+    // The call may be hedged and retried, see ServiceDescriptor::MethodOptions::idempotent.
+    bool idempotent = false;
+    const MethodRecorder* recorder = nullptr;  // records every attempt of the call.
+  };
+
+  // endpoints are (hostname, service) pairs. The replicas are spread over the threads of pool.
+  BalancedChannel(const std::vector<std::pair<std::string, std::string>>& endpoints,
+                  IoContextPool* pool);
+  ~BalancedChannel();
+
+  // Connects to all the replicas, blocks at least for 'ms' milliseconds.
+  // Succeeds if at least one replica is connected, returns the last error otherwise.
+  error_code Connect(uint32_t ms);
+
+  // See Channel::Send. Since the returned future is not observed, only SendSync and
+  // SendAndReadStream eject the replicas whose calls fail.
+  future_code_t Send(uint32_t deadline_msec, Envelope* envelope,
+                     const MethodRecorder* recorder = nullptr);
+
+  error_code SendSync(uint32_t deadline_msec, Envelope* envelope,
+                      const MethodRecorder* recorder = nullptr) {
+    return SendSync(deadline_msec, envelope, CallOptions{false, recorder});
+  }
+
+  error_code SendSync(uint32_t deadline_msec, Envelope* envelope, const CallOptions& opts);
+
+  error_code SendAndReadStream(Envelope* msg, Channel::MessageCallback cb,
+                               const MethodRecorder* recorder = nullptr);
+
+  // Blocks the calling fiber until all the background processes finish.
+  void Shutdown();
+
+  size_t size() const { return replicas_.size(); }
+
+ private:
+  struct Replica {
+    std::unique_ptr<Channel> channel;
+    std::atomic<uint32_t> failures{0};        // consecutive.
+    std::atomic<uint64_t> ejected_until{0};  // monotonic micros.
+
+    explicit Replica(Channel* c) : channel(c) {}
+  };
+
+  struct Attempt;
+
+  bool Healthy(const Replica& r, uint64_t now) const;
+  Replica* Pick(const Replica* exclude = nullptr);
+  void Report(Replica* r, error_code ec);
+
+  // Sends a copy of request to r and waits until it returns.
+  error_code SendAttempt(Replica* r, uint32_t deadline_msec, const Envelope& request,
+                         Envelope* envelope, const CallOptions& opts);
+
+  // Sends the request to r and, if it does not return within hedge_usec, to another replica.
+  error_code SendHedged(Replica* r, uint32_t deadline_msec, uint64_t hedge_usec,
+                        const Envelope& request, Envelope* envelope, const CallOptions& opts);
+
+  void AddLatency(uint64_t usec);
+  bool TakeRetry();
+
+  std::vector<std::unique_ptr<Replica>> replicas_;
+
+  // The latencies of the recent successful calls, from which hedge_usec_ is updated.
+  std::mutex latency_mu_;
+  base::Histogram latencies_;
+  std::atomic<uint64_t> hedge_usec_{0};  // 0 until enough calls returned.
+
+  std::atomic<int64_t> retry_budget_{0};  // in thousandths of a retry.
+};
+
+}  // namespace rpc
+}  // namespace util
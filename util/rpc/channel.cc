@@ -8,9 +8,16 @@
 #include "util/rpc/channel.h"
 
 #include "base/logging.h"
+#include "base/walltime.h"
 #include "util/asio/asio_utils.h"
 #include "util/rpc/frame_format.h"
+#include "util/rpc/rpc_compression.h"
 #include "util/rpc/rpc_envelope.h"
+#include "util/stats/varz_stats.h"
+
+// The average number of the calls per write is rpc_client_flushed_calls / rpc_client_flushes.
+DEFINE_VARZ(VarzShardedCount, rpc_client_flushes);
+DEFINE_VARZ(VarzShardedCount, rpc_client_flushed_calls);
 
 namespace util {
 namespace rpc {
@@ -22,6 +29,15 @@ DEFINE_uint32(rpc_client_pending_limit, 1 << 17,
 DEFINE_uint32(rpc_client_queue_size, 128,
               "The size of the outgoing batch queue that contains envelopes waiting to send.");
 
+DEFINE_uint32(rpc_stream_window, 0,
+              "How many stream items the server may send ahead of their processing by the client. "
+              "0 disables the flow control. The servers that predate the credit frames reject "
+              "the flow-controlled streams.");
+
+DEFINE_bool(rpc_send_deadline, false,
+            "Sends the deadlines of the calls to the server, which cancels the calls that "
+            "passed them. The servers that predate the deadlines reject such calls.");
+
 using namespace boost;
 using namespace std;
 using asio::ip::tcp;
@@ -37,8 +53,38 @@ bool IsExpectedFinish(system::error_code ec) {
 
 constexpr uint32_t kTickPrecision = 3;  // 3ms per timer tick.
 
+// For how long the calls held after goaway wait for the socket to reconnect.
+constexpr uint32_t kGoAwayReconnectMs = 1000;
+
 }  // namespace
 
+Channel::EcPromise::EcPromise(const MethodRecorder* recorder, const Envelope& request,
+                              DoneCallback done)
+    : done_(std::move(done)), recorder_(recorder) {
+  if (recorder_)
+    start_ns_ = recorder_->Start(request.header.size() + request.letter.size());
+
+  trace::SpanContext parent = trace::CurrentSpan();
+  if (parent.sampled()) {
+    span_ = trace::NewChild(parent);
+    parent_span_id_ = parent.span_id;
+    span_start_usec_ = GetCurrentTimeMicros();
+  }
+}
+
+void Channel::EcPromise::set_value(error_code ec) {
+  if (recorder_)
+    recorder_->Finish(start_ns_, bool(ec), response_bytes_);
+  if (span_.sampled()) {
+    trace::RecordSpan(span_, parent_span_id_, recorder_ ? recorder_->name() : "rpc",
+                      span_start_usec_, GetCurrentTimeMicros(), bool(ec));
+  }
+  if (done_)
+    done_(ec);
+  else
+    promise_.set_value(ec);
+}
+
 Channel::~Channel() {
   Shutdown();
 
@@ -51,6 +97,7 @@ Channel::~Channel() {
 void Channel::Shutdown() {
   error_code ec;
   socket_->Shutdown(ec);
+  flush_ec_.notify();
 }
 
 auto Channel::Connect(uint32_t ms) -> error_code {
@@ -86,20 +133,27 @@ auto Channel::PresendChecks() -> error_code {
     return asio::error::no_buffer_space;
   }
 
-  error_code ec;
-
-  if (outgoing_buf_size_.load(std::memory_order_relaxed) >= FLAGS_rpc_client_queue_size) {
-    ec = FlushSends();
+  // A full batch is flushed by the sending fiber.
+  size_t queued = outgoing_buf_size_.load(std::memory_order_relaxed);
+  bool queue_full = queued >= FLAGS_rpc_client_queue_size;
+  if (!queue_full &&
+      !FlushBatcher::Full(queued, outgoing_buf_bytes_.load(std::memory_order_relaxed))) {
+    return error_code{};
   }
-  return ec;
+
+  // We can not flush the calls held after goaway.
+  if (goaway_.load(std::memory_order_relaxed))
+    return queue_full ? asio::error::no_buffer_space : error_code{};
+  return FlushSends();
 }
 
-auto Channel::Send(uint32 deadline_msec, Envelope* envelope) -> future_code_t {
+auto Channel::Send(uint32 deadline_msec, Envelope* envelope, const MethodRecorder* recorder)
+    -> future_code_t {
   DCHECK(read_fiber_.joinable()) << "Call Channel::Connect(), stupid.";
   DCHECK_GT(deadline_msec, 0);
 
   // ----
-  fibers::promise<error_code> p;
+  EcPromise p(recorder, *envelope);
   fibers::future<error_code> res = p.get_future();
   error_code ec = PresendChecks();
 
@@ -107,7 +161,27 @@ auto Channel::Send(uint32 deadline_msec, Envelope* envelope) -> future_code_t {
     p.set_value(ec);
     return res;
   }
+  Enqueue(deadline_msec, envelope, std::move(p));
+
+  return res;
+}
+
+void Channel::SendAsync(uint32_t deadline_msec, Envelope* envelope, DoneCallback done,
+                        const MethodRecorder* recorder) {
+  DCHECK(read_fiber_.joinable()) << "Call Channel::Connect(), stupid.";
+  DCHECK_GT(deadline_msec, 0);
+  DCHECK(done);
 
+  EcPromise p(recorder, *envelope, std::move(done));
+  error_code ec = PresendChecks();
+  if (ec) {
+    p.set_value(ec);
+    return;
+  }
+  Enqueue(deadline_msec, envelope, std::move(p));
+}
+
+void Channel::Enqueue(uint32_t deadline_msec, Envelope* envelope, EcPromise p) {
   uint32_t ticks = (deadline_msec + kTickPrecision - 1) / kTickPrecision;
   std::unique_ptr<ExpiryEvent> ev(new ExpiryEvent(this));
 
@@ -125,23 +199,29 @@ auto Channel::Send(uint32 deadline_msec, Envelope* envelope) -> future_code_t {
 
   outgoing_buf_.emplace_back(SendItem(id, PendingCall{std::move(p), envelope}));
   outgoing_buf_.back().second.expiry_event = std::move(ev);
+  outgoing_buf_.back().second.deadline_usec = GetMonotonicMicros() + deadline_msec * 1000ULL;
   outgoing_buf_size_.store(outgoing_buf_.size(), std::memory_order_relaxed);
+  outgoing_buf_bytes_.fetch_add(envelope->header.size() + envelope->letter.size(),
+                                std::memory_order_relaxed);
+  bool wake_flusher = outgoing_buf_.size() == 1;
 
   OutgoingBufUnlock(lock_exclusive);
-
-  return res;
+  if (wake_flusher)
+    flush_ec_.notify();
 }
 
-auto Channel::SendAndReadStream(Envelope* msg, MessageCallback cb) -> error_code {
+auto Channel::SendAndReadStream(Envelope* msg, MessageCallback cb,
+                                const MethodRecorder* recorder) -> error_code {
   DCHECK(read_fiber_.joinable());
 
   // ----
+  EcPromise p(recorder, *msg);
   error_code ec = PresendChecks();
   if (ec) {
+    p.set_value(ec);
     return ec;
   }
 
-  fibers::promise<error_code> p;
   fibers::future<error_code> future = p.get_future();
 
   // We protect against Send thread vs IoContext thread data races.
@@ -154,9 +234,17 @@ auto Channel::SendAndReadStream(Envelope* msg, MessageCallback cb) -> error_code
   RpcId id = next_send_rpc_id_++;
 
   outgoing_buf_.emplace_back(SendItem(id, PendingCall{std::move(p), msg, std::move(cb)}));
+  // Empty frames with credits are grants, so the empty requests are not flow-controlled.
+  if (msg->header.size() + msg->letter.size())
+    outgoing_buf_.back().second.window = FLAGS_rpc_stream_window;
   outgoing_buf_size_.store(outgoing_buf_.size(), std::memory_order_relaxed);
+  outgoing_buf_bytes_.fetch_add(msg->header.size() + msg->letter.size(),
+                                std::memory_order_relaxed);
+  bool wake_flusher = outgoing_buf_.size() == 1;
 
   OutgoingBufUnlock(exclusive);
+  if (wake_flusher)
+    flush_ec_.notify();
   ec = future.get();
 
   return ec;
@@ -175,11 +263,17 @@ void Channel::ReadFiber() {
           << "Error reading envelope " << ec << " " << ec.message();
 
       CancelPendingCalls(ec);
+      peer_accepts_compression_.store(false, std::memory_order_relaxed);
+      if (goaway_.load(std::memory_order_relaxed)) {
+        // The server closed the drained connection, the held calls go to the next one.
+        socket_->ClientWaitToConnect(kGoAwayReconnectMs);
+        goaway_.store(false, std::memory_order_relaxed);
+      }
       // Required for few reasons:
       // 1. To preempt the fiber, otherwise it has busy loop in case socket returns the error
       //    preventing other fibers to run.
       // 2. To throttle cpu.
-      this_fiber::sleep_for(10ms);
+      FiberSleepFor(10ms);
       continue;
     }
   }
@@ -195,15 +289,30 @@ void Channel::FlushFiber() {
   this_fiber::properties<IoFiberProperties>().SetNiceLevel(IoFiberProperties::MAX_NICE_LEVEL - 1);
 
   while (true) {
-    this_fiber::sleep_for(300us);
+    flush_ec_.await([this] {
+      return outgoing_buf_size_.load(std::memory_order_acquire) > 0 || !socket_->is_open();
+    });
     if (!socket_->is_open())
       break;
 
-    if (outgoing_buf_size_.load(std::memory_order_acquire) == 0 || !send_mu_.try_lock())
+    // Lets more calls join the batch, see FlushBatcher.
+    size_t queued = outgoing_buf_size_.load(std::memory_order_relaxed);
+    uint32_t delay = batcher_.delay_usec();
+    size_t bytes = outgoing_buf_bytes_.load(std::memory_order_relaxed);
+    if (delay && !FlushBatcher::Full(queued, bytes))
+      this_fiber::sleep_for(chrono::microseconds(delay));
+
+    // The calls held after goaway wait for the reconnect, and a concurrent flush takes
+    // the current batch.
+    if (goaway_.load(std::memory_order_relaxed) || !send_mu_.try_lock()) {
+      this_fiber::sleep_for(300us);
       continue;
-    VLOG(1) << "FlushFiber::FlushSendsGuarded";
+    }
+    size_t count = outgoing_buf_size_.load(std::memory_order_relaxed);
+    VLOG(1) << "FlushFiber::FlushSendsGuarded " << count;
     FlushSendsGuarded();
     outgoing_buf_size_.store(outgoing_buf_.size(), std::memory_order_release);
+    batcher_.OnFlush(queued, count);
 
     send_mu_.unlock();  // releases the fence
   }
@@ -218,7 +327,9 @@ auto Channel::FlushSends() -> error_code {
 
   // We use `while` because multiple fibers might fill outgoing_buf_
   // and when the current fiber resumes, the buffer might be full again.
-  while (outgoing_buf_.size() >= FLAGS_rpc_client_queue_size) {
+  while (outgoing_buf_.size() >= FLAGS_rpc_client_queue_size ||
+         FlushBatcher::Full(outgoing_buf_.size(),
+                            outgoing_buf_bytes_.load(std::memory_order_relaxed))) {
     ec = FlushSendsGuarded();
   }
   outgoing_buf_size_.store(outgoing_buf_.size(), std::memory_order_relaxed);
@@ -245,14 +356,39 @@ auto Channel::FlushSendsGuarded() -> error_code {
     size_t count = outgoing_buf_.size();
     write_seq_.resize(count * 3);
     frame_buf_.resize(count);
+
+    // The requests stay intact, their compressed letters are written from compressed_.
+    const bool accepts = CompressionEnabled();
+    const bool compress = accepts && peer_accepts_compression_.load(std::memory_order_relaxed);
+    compressed_.clear();
+    const bool send_deadline = FLAGS_rpc_send_deadline;
+    const int64_t now = GetMonotonicMicros();
     for (size_t i = 0; i < count; ++i) {
       auto& p = outgoing_buf_[i];
-      Frame f(p.first, p.second.envelope->header.size(), p.second.envelope->letter.size());
+      const BufferType* letter = &p.second.envelope->letter;
+      uint8_t flags = accepts ? Frame::kAcceptsCompressionFlag : 0;
+      if (compress) {
+        compressed_.emplace_back();
+        if (CompressLetter(*letter, &compressed_.back().letter)) {
+          letter = &compressed_.back().letter;
+          flags |= Frame::kCompressedFlag;
+        }
+      }
+
+      Frame f(p.first, p.second.envelope->header.size(), letter->size());
+      f.credits = p.second.window;
+      f.flags = flags;
+      if (send_deadline && p.second.deadline_usec) {
+        int64_t remaining_ms = (int64_t(p.second.deadline_usec) - now) / 1000;
+        f.deadline_ms = std::max<int64_t>(remaining_ms, 1);  // 0 means no deadline.
+      }
+      f.trace_id = p.second.promise.span().trace_id;
+      f.span_id = p.second.promise.span().span_id;
       size_t sz = f.Write(frame_buf_[i].data());
 
       write_seq_[3 * i] = asio::buffer(frame_buf_[i].data(), sz);
       write_seq_[3 * i + 1] = asio::buffer(p.second.envelope->header);
-      write_seq_[3 * i + 2] = asio::buffer(p.second.envelope->letter);
+      write_seq_[3 * i + 2] = asio::buffer(*letter);
     }
 
     // Fill the pending call before the socket.Write() because otherwise in case it blocks
@@ -265,7 +401,10 @@ auto Channel::FlushSendsGuarded() -> error_code {
       CHECK(emplace_res.second);
     }
     outgoing_buf_.clear();
+    outgoing_buf_bytes_.store(0, std::memory_order_relaxed);
   }
+  rpc_client_flushes.Inc();
+  rpc_client_flushed_calls.IncBy(write_seq_.size() / 3);
 
   // Interrupt point during which outgoing_buf_ could grow.
   // We do not lock because this function is the only one that writes into channel and it's
@@ -291,6 +430,7 @@ void Channel::ExpirePending(RpcId id) {
   // The order is important to eliminate interrupts.
   EcPromise pr = std::move(it->second.promise);
   this->pending_calls_.erase(it);
+  pending_calls_size_.fetch_sub(1, std::memory_order_relaxed);
   pr.set_value(asio::error::timed_out);
 }
 
@@ -299,6 +439,7 @@ void Channel::CancelSentBufferGuarded(error_code ec) {
 
   buf_lock_.lock_shared();
   tmp.swap(outgoing_buf_);
+  outgoing_buf_bytes_.store(0, std::memory_order_relaxed);
   buf_lock_.unlock_shared();
 
   for (auto& item : tmp) {
@@ -314,6 +455,18 @@ auto Channel::ReadEnvelope() -> error_code {
     return ec;
 
   VLOG(2) << "Got rpc_id " << f.rpc_id << " from socket " << socket_->native_handle();
+  if (f.flags & Frame::kAcceptsCompressionFlag)
+    peer_accepts_compression_.store(true, std::memory_order_relaxed);
+  const bool compressed = f.flags & Frame::kCompressedFlag;
+
+  if (f.rpc_id == kGoAwayRpcId) {
+    // The responses to the pending calls still come, we stop sending the new ones.
+    VLOG(1) << "Got goaway from socket " << socket_->native_handle();
+    goaway_.store(true, std::memory_order_relaxed);
+    Envelope envelope(f.header_size, f.letter_size);
+    asio::read(*socket_, envelope.buf_seq(), ec);
+    return ec;
+  }
 
   auto it = pending_calls_.find(f.rpc_id);
   if (it == pending_calls_.end()) {
@@ -337,14 +490,17 @@ auto Channel::ReadEnvelope() -> error_code {
   if (is_stream) {
     VLOG(1) << "Processing stream";
     asio::read(*socket_, env->buf_seq(), ec);
+    if (!ec && compressed && !UncompressLetter(&env->letter))
+      ec = system::errc::make_error_code(system::errc::illegal_byte_sequence);
     if (!ec) {
+      call.promise.AddResponse(*env);
       HandleStreamResponse(f.rpc_id);
     }
 
     return ec;
   }
 
-  fibers::promise<error_code> promise = std::move(call.promise);
+  EcPromise promise = std::move(call.promise);
   // We erase before reading from the socket/setting promise because pending_calls_ might change
   // when we resume after IO and 'it' will be invalidated.
   pending_calls_.erase(it);
@@ -352,6 +508,10 @@ auto Channel::ReadEnvelope() -> error_code {
   // -- NO interrupt section end
 
   asio::read(*socket_, env->buf_seq(), ec);
+  if (!ec && compressed && !UncompressLetter(&env->letter))
+    ec = system::errc::make_error_code(system::errc::illegal_byte_sequence);
+  if (!ec)
+    promise.AddResponse(*env);
   promise.set_value(ec);
 
   return ec;
@@ -364,8 +524,15 @@ void Channel::HandleStreamResponse(RpcId rpc_id) {
   }
   PendingCall& call = it->second;
   error_code ec = call.cb(*call.envelope);
-  if (!ec)
+  if (!ec) {
+    // Grants the processed items back in batches.
+    if (call.window && ++call.consumed >= std::max(call.window / 2, 1u)) {
+      uint32_t credits = call.consumed;
+      call.consumed = 0;
+      GrantCredits(rpc_id, credits);  // may switch fibers, 'it' is invalid afterwards.
+    }
     return;
+  }
 
   // eof - means successful finish of stream receival.
   if (ec == error::eof) {
@@ -377,9 +544,23 @@ void Channel::HandleStreamResponse(RpcId rpc_id) {
   // set_value might context switch and invalidate 'it'.
   auto promise = std::move(call.promise);
   pending_calls_.erase(it);
+  pending_calls_size_.fetch_sub(1, std::memory_order_relaxed);
   promise.set_value(ec);
 }
 
+void Channel::GrantCredits(RpcId rpc_id, uint32_t credits) {
+  Frame f(rpc_id, 0, 0);
+  f.credits = credits;
+  uint8_t buf[Frame::kMaxByteSize];
+  size_t sz = f.Write(buf);
+
+  // Does not interleave with the writes of FlushSendsGuarded.
+  std::lock_guard<fibers::mutex> guard(send_mu_);
+  error_code ec;
+  asio::write(*socket_, asio::buffer(buf, sz), ec);
+  VLOG_IF(1, ec) << "Could not grant credits to " << rpc_id << ": " << ec;
+}
+
 void Channel::CancelPendingCalls(error_code ec) {
   if (pending_calls_.empty())
     return;
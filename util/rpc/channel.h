@@ -12,9 +12,13 @@
 
 #include "util/asio/fiber_socket.h"
 #include "util/asio/periodic_task.h"
+#include "util/fibers/event_count.h"
 
+#include "util/rpc/flush_batcher.h"
 #include "util/rpc/frame_format.h"
 #include "util/rpc/rpc_envelope.h"
+#include "util/rpc/rpc_stats.h"
+#include "util/trace/trace.h"
 
 namespace util {
 namespace rpc {
@@ -32,6 +36,9 @@ class Channel {
   // if bool(error_code) returns true, aborts receiving the stream and returns the error.
   using MessageCallback = std::function<error_code(Envelope&)>;
 
+  // Called once with the status of the call sent by SendAsync.
+  using DoneCallback = std::function<void(error_code)>;
+
   Channel(FiberSyncSocket* socket) : socket_(socket) {
   }
 
@@ -49,12 +56,27 @@ class Channel {
   // Sends the envelope and returns the future to the response status code.
   // Future is realized when response is received and serialized into the same envelope.
   // Send() might block therefore it should not be called directly from IoContext loop (post).
-  future_code_t Send(uint32_t deadline_msec, Envelope* envelope);
+  // With --rpc_send_deadline the server cancels the call once the deadline passes.
+  // If recorder is set, the call is recorded in the stats of its method. The recorder must
+  // outlive the call.
+  future_code_t Send(uint32_t deadline_msec, Envelope* envelope,
+                     const MethodRecorder* recorder = nullptr);
+
+  // Stackless variant of Send: nothing waits for the response, done is called instead once
+  // the response is received into the envelope, the call fails or its deadline passes.
+  // It does not need a fiber per outstanding call, hence a caller can keep many more calls
+  // in flight than with Send. done is called from the IoContext thread of the channel,
+  // or before SendAsync returns if the call can not be sent. It runs in the reading loop of
+  // the channel, hence it must not block; it may post the continuation to the IoContext.
+  // Like Send, it may block the calling fiber while it flushes a full batch.
+  void SendAsync(uint32_t deadline_msec, Envelope* envelope, DoneCallback done,
+                 const MethodRecorder* recorder = nullptr);
 
   // Fiber-blocking call. Sends and waits until the response is back.
   // Similarly to Send, the response is written into the same envelope.
-  error_code SendSync(uint32_t deadline_msec, Envelope* envelope) {
-    return Send(deadline_msec, envelope).get();
+  error_code SendSync(uint32_t deadline_msec, Envelope* envelope,
+                      const MethodRecorder* recorder = nullptr) {
+    return Send(deadline_msec, envelope, recorder).get();
   }
 
   // Sends a msg and wait to receive a stream of envelopes.
@@ -62,11 +84,22 @@ class Channel {
   // MessageCallback should return True if more items are expected in the stream.
   // i.e. Envelope should contain stream-related information to allow MessageCallback to
   // decide whether more envelopes should come.
-  error_code SendAndReadStream(Envelope* msg, MessageCallback cb);
+  // The server sends at most --rpc_stream_window envelopes ahead of the processed ones.
+  error_code SendAndReadStream(Envelope* msg, MessageCallback cb,
+                               const MethodRecorder* recorder = nullptr);
 
   // Blocks the calling fiber until all the background processes finish.
   void Shutdown();
 
+  // The status of the connection, it reconnects in the background after the failures.
+  error_code status() const { return socket_->status(); }
+
+  // The number of calls that were sent or queued and are not finished yet.
+  size_t outstanding() const {
+    return pending_calls_size_.load(std::memory_order_relaxed) +
+           outgoing_buf_size_.load(std::memory_order_relaxed);
+  }
+
  private:
   void ReadFiber();
   void FlushFiber();
@@ -100,6 +133,12 @@ class Channel {
 
   void HandleStreamResponse(RpcId rpc_id);
 
+  class EcPromise;
+  void Enqueue(uint32_t deadline_msec, Envelope* envelope, EcPromise p);
+
+  // Allows the server to send credits more items of the stream rpc_id.
+  void GrantCredits(RpcId rpc_id, uint32_t credits);
+
   class ExpiryEvent : public base::TimerEventInterface {
    public:
     explicit ExpiryEvent(Channel* me) : me_(me) {
@@ -116,9 +155,44 @@ class Channel {
   };
 
   RpcId next_send_rpc_id_ = 1;
+
+  // Set when the server drains the connection, see kGoAwayRpcId. The new calls wait in
+  // outgoing_buf_ until the socket reconnects.
+  std::atomic_bool goaway_{false};
+
+  // Set once the server marked its responses with Frame::kAcceptsCompressionFlag, reset when
+  // the connection breaks. See rpc_compression.h.
+  std::atomic_bool peer_accepts_compression_{false};
   std::unique_ptr<FiberSyncSocket> socket_;
 
-  typedef boost::fibers::promise<error_code> EcPromise;
+  // The promise of a call. Records the call in the stats of its method once it is realized.
+  // The calls of the sampled traces are recorded as the child spans of the calling fiber.
+  // If done is set, the promise calls it instead of realizing the future.
+  class EcPromise {
+   public:
+    EcPromise(const MethodRecorder* recorder, const Envelope& request,
+              DoneCallback done = DoneCallback{});
+
+    future_code_t get_future() { return promise_.get_future(); }
+
+    void AddResponse(const Envelope& response) {
+      response_bytes_ += response.header.size() + response.letter.size();
+    }
+
+    void set_value(error_code ec);
+
+    const trace::SpanContext& span() const { return span_; }
+
+   private:
+    boost::fibers::promise<error_code> promise_;
+    DoneCallback done_;
+    const MethodRecorder* recorder_;
+    uint64_t start_ns_ = 0;
+    size_t response_bytes_ = 0;
+
+    trace::SpanContext span_;
+    uint64_t parent_span_id_ = 0, span_start_usec_ = 0;
+  };
 
   struct PendingCall {
     EcPromise promise;
@@ -126,6 +200,11 @@ class Channel {
 
     MessageCallback cb;  // for Stream response.
 
+    // The flow control window of the stream and the items processed since the last grant.
+    uint32_t window = 0, consumed = 0;
+
+    uint64_t deadline_usec = 0;  // monotonic, 0 for the streams.
+
     PendingCall(EcPromise p, Envelope* env, MessageCallback mcb = MessageCallback{})
       : promise(std::move(p)), envelope(env), cb(std::move(mcb)) {
     }
@@ -142,14 +221,20 @@ class Channel {
 
   folly::RWSpinLock buf_lock_;
   std::vector<SendItem> outgoing_buf_;  // protected by buf_lock_.
-  std::atomic_ulong outgoing_buf_size_{0};
+  std::atomic_ulong outgoing_buf_size_{0}, outgoing_buf_bytes_{0};
+
+  // Notified when outgoing_buf_ becomes non-empty and when the channel shuts down.
+  fibers_ext::EventCount flush_ec_;
+  FlushBatcher batcher_;  // used by FlushFiber.
 
   boost::fibers::fiber read_fiber_, flush_fiber_;
   boost::fibers::mutex send_mu_;  // protects FlushSendsGuarded.
 
   // Used in FlushSendsGuarded to flush buffers efficiently.
   std::vector<boost::asio::const_buffer> write_seq_;
-  base::PODArray<std::array<uint8_t, rpc::Frame::kMaxByteSize>> frame_buf_;
+  // Frame headers of a flush, usually there are just a few.
+  base::InlinedPODArray<std::array<uint8_t, rpc::Frame::kMaxByteSize>, 8> frame_buf_;
+  std::vector<Envelope> compressed_;  // only the letters, which replace those of the requests.
 
   typedef absl::flat_hash_map<RpcId, PendingCall> PendingMap;
   PendingMap pending_calls_;
@@ -0,0 +1,50 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/flush_batcher.h"
+
+#include <algorithm>
+
+#include "base/flags.h"
+
+namespace util {
+namespace rpc {
+
+DEFINE_uint32(rpc_flush_batch_msgs, 64,
+              "The number of the queued rpc messages that are flushed without waiting for more");
+DEFINE_uint32(rpc_flush_batch_bytes, 1 << 16,
+              "The size of the queued rpc messages that are flushed without waiting for more");
+DEFINE_uint32(rpc_flush_max_delay_usec, 300,
+              "For how long the queued rpc messages may wait for more messages to share their "
+              "write into the socket. 0 disables the waiting");
+
+namespace {
+
+// The delays below it are not worth waking the fiber twice.
+constexpr uint32_t kMinDelayUsec = 10;
+
+}  // namespace
+
+bool FlushBatcher::Full(size_t msgs, size_t bytes) {
+  return msgs >= FLAGS_rpc_flush_batch_msgs || bytes >= FLAGS_rpc_flush_batch_bytes;
+}
+
+void FlushBatcher::OnFlush(size_t queued, size_t flushed) {
+  if (delay_usec_ == 0) {
+    // The messages that were queued concurrently suggest that a delay may batch more of them.
+    if (flushed > 1)
+      delay_usec_ = std::min(kMinDelayUsec, FLAGS_rpc_flush_max_delay_usec);
+    return;
+  }
+
+  if (flushed > queued) {
+    delay_usec_ = std::min(delay_usec_ * 2, FLAGS_rpc_flush_max_delay_usec);
+  } else {
+    delay_usec_ /= 2;
+    if (delay_usec_ < kMinDelayUsec)
+      delay_usec_ = 0;
+  }
+}
+
+}  // namespace rpc
+}  // namespace util
@@ -0,0 +1,35 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace util {
+namespace rpc {
+
+// Decides when the queued messages of an rpc connection are flushed into its socket.
+// A full batch, of --rpc_flush_batch_msgs messages or --rpc_flush_batch_bytes bytes, is flushed
+// right away. Otherwise the flusher waits for delay_usec() once a message is queued, so that
+// the messages queued meanwhile share the write. The delay adapts to the load: it doubles,
+// up to --rpc_flush_max_delay_usec, while more messages arrive during the delay and halves
+// when the delay did not batch anything, for example when the clients wait for
+// the responses before sending more. Therefore the messages are not delayed at low QPS
+// and are batched under load. Not thread-safe, used by the flushing fiber.
+class FlushBatcher {
+ public:
+  static bool Full(size_t msgs, size_t bytes);
+
+  uint32_t delay_usec() const { return delay_usec_; }
+
+  // queued - the messages that were queued before the delay, flushed - the messages that
+  // were flushed after it.
+  void OnFlush(size_t queued, size_t flushed);
+
+ private:
+  uint32_t delay_usec_ = 0;
+};
+
+}  // namespace rpc
+}  // namespace util
@@ -22,6 +22,7 @@ using namespace system;
 namespace {
 
 constexpr uint8 kHeader[] = "URPC";
+constexpr uint8 kTracedHeader[] = "URPT";
 
 inline uint8 SizeByteCountMinus1(uint32 size) {
   return size <= 255 ? 0 : Bits::FindMSBSetNonZero(size) / 8;
@@ -40,30 +41,54 @@ std::ostream& operator<<(std::ostream& o, const Frame& frame) {
 }
 
 const uint32 Frame::kHeaderVal = LittleEndian::Load32(kHeader);
+const uint32 Frame::kTracedHeaderVal = LittleEndian::Load32(kTracedHeader);
 
-uint8_t Frame::DecodeStart(const uint8_t* src, ::boost::system::error_code& ec) {
-  if (kHeaderVal != LittleEndian::Load32(src)) {
+uint8_t Frame::DecodeStart(const uint8_t* src, bool* traced,
+                           ::boost::system::error_code& ec) {
+  uint32 header = LittleEndian::Load32(src);
+  *traced = header == kTracedHeaderVal;
+  if (kHeaderVal != header && !*traced) {
     ec = errc::make_error_code(errc::illegal_byte_sequence);
     return 0;
   }
 
-  if (src[4] >> 4 != 0) {  // version check
+  constexpr uint8_t kKnownFlags =
+      kCreditsFlag | kCompressedFlag | kAcceptsCompressionFlag | kDeadlineFlag;
+  if ((src[4] >> 4) & ~kKnownFlags) {  // version check
     ec = errc::make_error_code(errc::illegal_byte_sequence);
     return 0;
   }
+  flags = (src[4] >> 4) & ~(kCreditsFlag | kDeadlineFlag);
   rpc_id = UNALIGNED_LOAD64(src + 4);
   rpc_id >>= 8;
 
-  return src[4] & 15;
+  return src[4];
 }
 
-void Frame::DecodeEnd(const uint8_t* src, uint8_t hsz_len, uint8_t lsz_len) {
+void Frame::DecodeEnd(const uint8_t* src, uint8_t hsz_len, uint8_t lsz_len, uint8_t all_flags,
+                      bool traced) {
   header_size = LittleEndian::Load32(src) & byte_mask(hsz_len);
   letter_size = LittleEndian::Load32(src + hsz_len + 1) & byte_mask(lsz_len);
+  src += hsz_len + lsz_len + 2;
+  credits = 0;
+  if (all_flags & kCreditsFlag) {
+    credits = LittleEndian::Load32(src);
+    src += 4;
+  }
+  deadline_ms = 0;
+  if (all_flags & kDeadlineFlag) {
+    deadline_ms = LittleEndian::Load32(src);
+    src += 4;
+  }
+  trace_id = span_id = 0;
+  if (traced) {
+    trace_id = LittleEndian::Load64(src);
+    span_id = LittleEndian::Load64(src + 8);
+  }
 }
 
 unsigned Frame::Write(uint8* dest) const {
-  LittleEndian::Store32(dest, kHeaderVal);
+  LittleEndian::Store32(dest, trace_id ? kTracedHeaderVal : kHeaderVal);
   dest += 4;
   const uint8 msg_bytes_minus1 = SizeByteCountMinus1(letter_size);
   const uint8 cntrl_bytes_minus1 = SizeByteCountMinus1(header_size);
@@ -71,7 +96,9 @@ unsigned Frame::Write(uint8* dest) const {
   DCHECK_LT(msg_bytes_minus1, 4);
   DCHECK_LT(cntrl_bytes_minus1, 4);
 
-  uint64_t version = cntrl_bytes_minus1 | (msg_bytes_minus1 << 2) | (0 << 4);
+  const uint8 all_flags =
+      flags | (credits ? kCreditsFlag : 0) | (deadline_ms ? kDeadlineFlag : 0);
+  uint64_t version = cntrl_bytes_minus1 | (msg_bytes_minus1 << 2) | (all_flags << 4);
 
   LittleEndian::Store64(dest, (rpc_id << 8) | version);
   dest += 8;
@@ -79,8 +106,25 @@ unsigned Frame::Write(uint8* dest) const {
   LittleEndian::Store32(dest, header_size);
   dest += (cntrl_bytes_minus1 + 1);
   LittleEndian::Store32(dest, letter_size);
+  unsigned res = 4 + 1 /* version */ + 7 /* rpc_id */ + cntrl_bytes_minus1 + msg_bytes_minus1 + 2;
+  dest += (msg_bytes_minus1 + 1);
+  if (credits) {
+    LittleEndian::Store32(dest, credits);
+    dest += 4;
+    res += 4;
+  }
+  if (deadline_ms) {
+    LittleEndian::Store32(dest, deadline_ms);
+    dest += 4;
+    res += 4;
+  }
+  if (trace_id) {
+    LittleEndian::Store64(dest, trace_id);
+    LittleEndian::Store64(dest + 8, span_id);
+    res += 16;
+  }
 
-  return 4 + 1 /* version */ + 7 /* rpc_id */ + cntrl_bytes_minus1 + msg_bytes_minus1 + 2;
+  return res;
 }
 
 }  // namespace rpc
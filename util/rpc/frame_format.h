@@ -18,21 +18,45 @@ namespace rpc {
 
 /*
   Frame structure:
-    header str ("URPC") - 4 bytes
-    uint8 version + control size length + message size length 1 byte (4bits + 2bits + 2bits)
+    header str ("URPC" or "URPT") - 4 bytes
+    uint8 flags + control size length + message size length 1 byte (4bits + 2bits + 2bits)
     uint56 rpc_id - LE56
     header_size - LE of control size length
     message size - LE on message size length
+    credits - LE32, present only if kCreditsFlag is set.
+    deadline - LE32, present only if kDeadlineFlag is set.
+    trace_id, span_id - LE64 each, present only in the "URPT" frames.
     BLOB char[header_size + message_size]:
       PB - control packet of size header_size
       PB - message request of size message_size
+
+  The flags were the version, 0, before the credits were added. They are:
+    kCreditsFlag - the credits follow the sizes.
+    kCompressedFlag - the message is compressed, see rpc_compression.h.
+    kAcceptsCompressionFlag - the sender accepts the compressed messages.
+    kDeadlineFlag - the deadline follows the sizes and the credits.
+
+  Streams are flow-controlled by the credits. The client sends the initial window of the stream
+  in the frame of its request. The server sends one stream item per credit and waits for more
+  once they run out. The client grants them with empty frames of the same rpc_id.
+
+  The deadline of a request is in how many milliseconds the client stops waiting for it.
+  The server cancels the requests that passed their deadline, see CallContext.
+
+  The requests of the sampled traces carry the span of the caller, see util/trace/trace.h.
+  The flags have no room left for it, hence the traced frames have their own header string.
+  The other frames are unchanged, so only the traced calls require the servers that know it.
 */
 
 // Also defined in rpc_connection.h. Seems to work.
 typedef uint64_t RpcId;
 
+// Channels number their calls from 1. The server sends an empty frame with this id when it
+// drains the connection: it answers the calls it has read and closes the connection afterwards.
+constexpr RpcId kGoAwayRpcId = 0;
+
 class Frame {
-  static const uint32 kHeaderVal;
+  static const uint32 kHeaderVal, kTracedHeaderVal;
 
  public:
   typedef ::boost::asio::ip::tcp::socket socket_t;
@@ -40,15 +64,32 @@ class Frame {
   RpcId rpc_id;
   uint32_t header_size;
   uint32_t letter_size;
+  uint32_t credits = 0;      // granted stream items, see above. Written only if positive.
+  uint32_t deadline_ms = 0;  // see above. Written only if positive.
+
+  // The span of the caller, see above. Written only if trace_id is set.
+  uint64_t trace_id = 0, span_id = 0;
+
+  enum : uint8_t {
+    kCreditsFlag = 1,
+    kCompressedFlag = 2,
+    kAcceptsCompressionFlag = 4,
+    kDeadlineFlag = 8
+  };
+
+  // The compression flags, kCreditsFlag and kDeadlineFlag are derived from their fields instead.
+  uint8_t flags = 0;
 
   Frame() : rpc_id(1), header_size(0), letter_size(0) {}
   Frame(RpcId r, uint32_t cs, uint32_t ms) : rpc_id(r), header_size(cs), letter_size(ms) {}
 
-  enum { kMinByteSize = 4 + 1 + 7 + 2, kMaxByteSize = 4 + 1 + 7 + 4 * 2 };
+  enum { kMinByteSize = 4 + 1 + 7 + 2, kMaxByteSize = 4 + 1 + 7 + 4 * 2 + 4 * 2 + 8 * 2 };
 
   bool operator==(const Frame& other) const {
     return other.rpc_id == rpc_id && other.header_size == header_size &&
-           other.letter_size == letter_size;
+           other.letter_size == letter_size && other.credits == credits &&
+           other.deadline_ms == deadline_ms && other.flags == flags &&
+           other.trace_id == trace_id && other.span_id == span_id;
   }
 
   // friend std::ostream& operator<<(std::ostream& o, const Frame& frame);
@@ -70,30 +111,36 @@ class Frame {
     asio::read(*input, asio::buffer(buf, kMinByteSize), ec);
     if (ec)
       return ec;
-    uint8_t code = DecodeStart(buf, ec);
+    bool traced = false;
+    uint8_t code = DecodeStart(buf, &traced, ec);
     if (ec)
       return ec;
 
     const uint8 header_sz_len_minus1 = code & 3;
-    const uint8 msg_sz_len_minus1 = code >> 2;
+    const uint8 msg_sz_len_minus1 = (code >> 2) & 3;
+    const uint8_t all_flags = code >> 4;
+    const size_t extra = (all_flags & kCreditsFlag ? 4 : 0) + (all_flags & kDeadlineFlag ? 4 : 0) +
+                         (traced ? 16 : 0);
 
     // We stored 2 necessary bytes of boths lens, if it was not enough lets fill em up.
-    if (code) {
-      size_t to_read = header_sz_len_minus1 + msg_sz_len_minus1;
+    if (code || traced) {
+      size_t to_read = header_sz_len_minus1 + msg_sz_len_minus1 + extra;
       auto mbuf = asio::buffer(buf + kMinByteSize, to_read);
       asio::read(*input, mbuf, ec);
       if (ec)
         return ec;
     }
 
-    DecodeEnd(buf + 12, header_sz_len_minus1, msg_sz_len_minus1);
+    DecodeEnd(buf + 12, header_sz_len_minus1, msg_sz_len_minus1, all_flags, traced);
 
     return ec;
   }
 
  private:
-  uint8_t DecodeStart(const uint8_t* src, ::boost::system::error_code& ec);
-  void DecodeEnd(const uint8_t* src, uint8_t hsz_len, uint8_t lsz_len);
+  // Returns the flags and the size lengths.
+  uint8_t DecodeStart(const uint8_t* src, bool* traced, ::boost::system::error_code& ec);
+  void DecodeEnd(const uint8_t* src, uint8_t hsz_len, uint8_t lsz_len, uint8_t all_flags,
+                 bool traced);
 };
 
 }  // namespace rpc
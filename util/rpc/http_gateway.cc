@@ -0,0 +1,154 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/http_gateway.h"
+
+#include <boost/beast/http/empty_body.hpp>
+
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "util/pb2json.h"
+
+namespace util {
+namespace rpc {
+
+using namespace std;
+using namespace boost;
+namespace h2 = beast::http;
+using http::StringResponse;
+using Message = ServiceDescriptor::Message;
+
+namespace {
+
+h2::status HttpStatusOf(StatusCode::Code code) {
+  switch (code) {
+    case StatusCode::INVALID_ARGUMENT:
+    case StatusCode::PARSE_ERROR:
+    case StatusCode::RPC_PARSE_ERROR:
+      return h2::status::bad_request;
+    case StatusCode::RPC_INVALID_METHOD:
+      return h2::status::not_found;
+    case StatusCode::NOT_IMPLEMENTED_ERROR:
+      return h2::status::not_implemented;
+    case StatusCode::IO_TIMEOUT:
+    case StatusCode::RPC_DEADLINE_EXCEEDED:
+      return h2::status::gateway_timeout;
+    default:
+      return h2::status::internal_server_error;
+  }
+}
+
+void SendError(const Status& st, unsigned version, http::ListenerBase::SendFunction* send) {
+  StatusProto sp;
+  sp.set_status_code(st.code());
+  vector<string> msgs;
+  st.GetErrorMsgs(&msgs);
+  for (auto& msg : msgs) {
+    sp.add_error_msg(std::move(msg));
+  }
+
+  StringResponse resp(HttpStatusOf(st.code()), version);
+  http::SetMime(http::kJsonMime, &resp);
+  resp.body() = Pb2Json(sp);
+  send->Invoke(std::move(resp));
+}
+
+void SendJson(const Message& msg, unsigned version, http::ListenerBase::SendFunction* send) {
+  StringResponse resp(h2::status::ok, version);
+  http::SetMime(http::kJsonMime, &resp);
+  resp.body() = Pb2Json(msg);
+  send->Invoke(std::move(resp));
+}
+
+}  // namespace
+
+HttpGateway::HttpGateway(http::ListenerBase* listener, StringPiece prefix) {
+  listener->RegisterPrefixCb(prefix, false,
+                             [this](const http::StringRequest& req, StringPiece path,
+                                    http::ListenerBase::SendFunction* send) {
+                               Handle(req, path, send);
+                             });
+}
+
+void HttpGateway::AddService(StringPiece name, const ServiceDescriptor* service) {
+  for (size_t i = 0; i < service->size(); ++i) {
+    string key = absl::StrCat(name, "/", service->method(i).name);
+    bool inserted = methods_.emplace(std::move(key), Target{service, i}).second;
+    CHECK(inserted) << "Duplicate method " << service->method(i).name << " of " << name;
+  }
+}
+
+void HttpGateway::Handle(const http::StringRequest& req, StringPiece path,
+                         http::ListenerBase::SendFunction* send) const {
+  const unsigned version = req.version();
+  if (req.method() != h2::verb::post) {
+    StringResponse resp(h2::status::method_not_allowed, version);
+    resp.set(h2::field::allow, "POST");
+    return send->Invoke(std::move(resp));
+  }
+
+  auto it = methods_.find(path);
+  if (it == methods_.end()) {
+    return SendError(Status(StatusCode::RPC_INVALID_METHOD, absl::StrCat("Unknown method ", path)),
+                     version, send);
+  }
+
+  const ServiceDescriptor* service = it->second.service;
+  const size_t index = it->second.index;
+  const ServiceDescriptor::Method& method = service->method(index);
+
+  const string& body = req.body();
+  std::unique_ptr<Message> request(method.default_req->New());
+  Status st = Json2Pb(body.empty() ? string("{}") : body, request.get());
+  if (!st.ok()) {
+    return SendError(Status(StatusCode::INVALID_ARGUMENT, st.ToString()), version, send);
+  }
+
+  if (method.single_rpc_method) {
+    std::unique_ptr<Message> response(method.default_resp->New());
+    st = service->Invoke(index, *request, response.get(), body.size());
+    if (!st.ok())
+      return SendError(st, version, send);
+    return SendJson(*response, version, send);
+  }
+
+  // Streaming method: every item is sent as a line of JSON. The header is sent with the first
+  // item, so that the methods that fail before writing anything respond with an error status.
+  bool streaming = false;
+  auto writer = [&](const Message* item) {
+    if (!item)
+      return;
+    if (!streaming) {
+      h2::response<h2::empty_body> resp(h2::status::ok, version);
+      http::SetMime("application/x-ndjson", &resp);
+      send->BeginStream(std::move(resp));
+      streaming = true;
+    }
+    string line = Pb2Json(*item);
+    line.push_back('\n');
+    send->WriteBody(asio::buffer(line));
+  };
+  st = service->InvokeStream(index, *request, writer, body.size());
+
+  if (streaming) {
+    // The status of the response was sent already, hence a failure closes the connection
+    // without the last chunk and the client sees a truncated stream.
+    if (!st.ok()) {
+      LOG(WARNING) << "Stream " << path << " failed with " << st;
+      if (!send->ec)
+        send->ec = asio::error::connection_aborted;
+    }
+    return send->EndStream();
+  }
+  if (!st.ok())
+    return SendError(st, version, send);
+
+  h2::response<h2::empty_body> resp(h2::status::ok, version);
+  http::SetMime("application/x-ndjson", &resp);
+  resp.content_length(0);
+  send->BeginStream(std::move(resp));
+  send->EndStream();
+}
+
+}  // namespace rpc
+}  // namespace util
@@ -0,0 +1,44 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include "absl/container/flat_hash_map.h"
+#include "util/http/http_conn_handler.h"
+#include "util/rpc/service_descriptor.h"
+
+namespace util {
+namespace rpc {
+
+/*
+  Serves the methods of rpc services to HTTP/JSON clients in-process, without a network hop.
+  "POST <prefix><service>/<method>" parses the body as the JSON of the request message, runs
+  the method and responds with the JSON of its response message. Streaming methods respond with
+  a chunked body of newline delimited JSON items. Failed calls respond with an HTTP error status
+  and the JSON of their StatusProto.
+  The methods are resolved by a single hash lookup and their messages are created from
+  the prototypes of the service descriptors, hence the gateway costs the JSON conversion only.
+  The methods run in the fiber of the http connection and are recorded in their "server/" stats.
+*/
+class HttpGateway {
+ public:
+  // Serves the requests of listener under prefix. The gateway must outlive the serving.
+  explicit HttpGateway(http::ListenerBase* listener, StringPiece prefix = "/rpc/");
+
+  // Does not take ownership of service. Must be called before the listener serves.
+  void AddService(StringPiece name, const ServiceDescriptor* service);
+
+ private:
+  struct Target {
+    const ServiceDescriptor* service;
+    size_t index;
+  };
+
+  void Handle(const http::StringRequest& req, StringPiece path,
+              http::ListenerBase::SendFunction* send) const;
+
+  absl::flat_hash_map<std::string, Target> methods_;  // by "<service>/<method>".
+};
+
+}  // namespace rpc
+}  // namespace util
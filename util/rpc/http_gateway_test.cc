@@ -0,0 +1,175 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/http_gateway.h"
+
+#include <boost/beast/core/buffers_to_string.hpp>
+
+#include "absl/strings/str_split.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/asio/accept_server.h"
+#include "util/asio/io_context_pool.h"
+#include "util/http/http_client.h"
+#include "util/pb2json.h"
+#include "util/plang/addressbook.pb.h"
+
+namespace util {
+namespace rpc {
+
+using namespace std;
+using namespace boost;
+namespace h2 = beast::http;
+using tutorial::AddressBook;
+using tutorial::Person;
+
+namespace {
+
+// Hand-written, like the generated services are.
+class BookService : public ServiceDescriptor {
+ public:
+  BookService() {
+    methods_.emplace_back("Echo", RpcMethodCb(&BookService::Echo), Person::default_instance(),
+                          Person::default_instance());
+    methods_.emplace_back("Fail", RpcMethodCb(&BookService::Fail), Person::default_instance(),
+                          Person::default_instance());
+    methods_.emplace_back("List", RpcStreamMethodCb(&BookService::List),
+                          AddressBook::default_instance());
+  }
+
+  size_t GetMethodByHash(absl::string_view method) const final {
+    for (size_t i = 0; i < methods_.size(); ++i) {
+      if (methods_[i].name == method)
+        return i;
+    }
+    return size_t(-1);
+  }
+
+ private:
+  static Status Echo(const Message& req, Message* resp) {
+    Person* person = static_cast<Person*>(resp);
+    person->CopyFrom(req);
+    person->set_email(person->name() + "@example.com");
+    return Status::OK;
+  }
+
+  static Status Fail(const Message& req, Message* resp) {
+    return Status(StatusCode::INVALID_ARGUMENT, "bad person");
+  }
+
+  static Status List(const Message& req, StreamItemWriter writer) {
+    const AddressBook& book = static_cast<const AddressBook&>(req);
+    if (book.person_size() == 0)
+      return Status(StatusCode::NOT_IMPLEMENTED_ERROR, "empty book");
+    for (const Person& p : book.person()) {
+      writer(&p);
+    }
+    return Status::OK;
+  }
+};
+
+}  // namespace
+
+class HttpGatewayTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    pool_.reset(new IoContextPool(1));
+    pool_->Run();
+    gateway_.reset(new HttpGateway(&listener_));
+    gateway_->AddService("Book", &service_);
+
+    server_.reset(new AcceptServer(pool_.get()));
+    port_ = server_->AddListener(0, &listener_);
+    server_->Run();
+
+    client_.reset(new http::Client(&pool_->GetNextContext()));
+    system::error_code ec = client_->Connect("localhost", std::to_string(port_));
+    ASSERT_FALSE(ec) << ec.message();
+  }
+
+  void TearDown() override {
+    client_.reset();
+    server_->Stop(true);
+    pool_->Stop();
+  }
+
+  http::Client::Response Post(StringPiece url, StringPiece body) {
+    http::Client::Response resp;
+    system::error_code ec = client_->Send(h2::verb::post, url, body, &resp);
+    EXPECT_FALSE(ec) << ec.message();
+    return resp;
+  }
+
+  static string Body(const http::Client::Response& resp) {
+    return beast::buffers_to_string(resp.body().data());
+  }
+
+  std::unique_ptr<IoContextPool> pool_;
+  http::Listener<> listener_;
+  BookService service_;
+  std::unique_ptr<HttpGateway> gateway_;
+  std::unique_ptr<AcceptServer> server_;
+  std::unique_ptr<http::Client> client_;
+  uint16_t port_ = 0;
+};
+
+TEST_F(HttpGatewayTest, Unary) {
+  auto resp = Post("/rpc/Book/Echo", R"({"name": "bob", "id": 5, "dval": 1})");
+  ASSERT_EQ(h2::status::ok, resp.result());
+
+  Person person;
+  ASSERT_TRUE(Json2Pb(Body(resp), &person).ok()) << Body(resp);
+  EXPECT_EQ("bob", person.name());
+  EXPECT_EQ(5, person.id());
+  EXPECT_EQ("bob@example.com", person.email());
+
+  uint64_t calls = 0;
+  for (const auto& name_stats : GetMethodStats()) {
+    if (name_stats.first == "server/Echo")
+      calls = name_stats.second.calls;
+  }
+  EXPECT_EQ(1, calls);
+}
+
+TEST_F(HttpGatewayTest, Errors) {
+  auto resp = Post("/rpc/Book/Fail", R"({"name": "bob", "id": 5, "dval": 1})");
+  EXPECT_EQ(h2::status::bad_request, resp.result());
+  StatusProto sp;
+  ASSERT_TRUE(Json2Pb(Body(resp), &sp).ok()) << Body(resp);
+  EXPECT_EQ(StatusCode::INVALID_ARGUMENT, sp.status_code());
+  ASSERT_EQ(1, sp.error_msg_size());
+  EXPECT_EQ("bad person", sp.error_msg(0));
+
+  EXPECT_EQ(h2::status::not_found, Post("/rpc/Book/Missing", "{}").result());
+  EXPECT_EQ(h2::status::not_found, Post("/rpc/Other/Echo", "{}").result());
+  EXPECT_EQ(h2::status::bad_request, Post("/rpc/Book/Echo", "{not json").result());
+
+  http::Client::Response get_resp;
+  ASSERT_FALSE(client_->Send(h2::verb::get, "/rpc/Book/Echo", &get_resp));
+  EXPECT_EQ(h2::status::method_not_allowed, get_resp.result());
+}
+
+TEST_F(HttpGatewayTest, Stream) {
+  AddressBook book;
+  for (const char* name : {"a", "b", "c"}) {
+    Person* p = book.add_person();
+    p->set_name(name);
+    p->set_id(1);
+    p->set_dval(0);
+  }
+  auto resp = Post("/rpc/Book/List", Pb2Json(book));
+  ASSERT_EQ(h2::status::ok, resp.result());
+  EXPECT_EQ("application/x-ndjson", resp[h2::field::content_type]);
+
+  vector<string> lines = absl::StrSplit(Body(resp), '\n', absl::SkipEmpty());
+  ASSERT_EQ(3, lines.size());
+  Person person;
+  ASSERT_TRUE(Json2Pb(lines[2], &person).ok());
+  EXPECT_EQ("c", person.name());
+
+  // Fails before streaming, hence with an error status.
+  EXPECT_EQ(h2::status::not_implemented, Post("/rpc/Book/List", "").result());
+}
+
+}  // namespace rpc
+}  // namespace util
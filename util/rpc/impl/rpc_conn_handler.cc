@@ -11,6 +11,14 @@
 
 #include "util/asio/asio_utils.h"
 #include "util/asio/io_context.h"
+#include "util/rpc/flush_batcher.h"
+#include "util/rpc/rpc_compression.h"
+#include "util/stats/varz_stats.h"
+
+// The average number of the responses per write is rpc_server_flushed_envelopes /
+// rpc_server_flushes.
+DEFINE_VARZ(VarzShardedCount, rpc_server_flushes);
+DEFINE_VARZ(VarzShardedCount, rpc_server_flushed_envelopes);
 
 namespace util {
 namespace rpc {
@@ -22,6 +30,7 @@ namespace {
 using RpcConnList = detail::slist<RpcConnectionHandler, RpcConnectionHandler::rpc_hook_t,
                                   detail::constant_time_size<false>, detail::cache_last<false>>;
 
+// Flushes the responses of the connections of its thread, see FlushBatcher.
 class Flusher : public IoContext::Cancellable {
  public:
   Flusher() {}
@@ -29,12 +38,19 @@ class Flusher : public IoContext::Cancellable {
   void Run() final;
   void Cancel() final;
 
+  // Called by the connections of the thread when they queue a response into an empty queue.
+  void Wake() {
+    woken_ = true;
+    cv_.notify_one();
+  }
+
   RpcConnList flush_conn_list;
 
  private:
-  bool stop_ = false;
+  bool stop_ = false, woken_ = false;
   fibers::condition_variable cv_;
   fibers::mutex mu_;
+  FlushBatcher batcher_;
 };
 
 void Flusher::Run() {
@@ -43,11 +59,35 @@ void Flusher::Run() {
   uint64_t num_flushes = 0;
 
   while (!stop_) {
-    cv_.wait_for(lock, 300us);
+    // Polls the connections also without the wakeups, as it did before them.
+    cv_.wait_for(lock, 300us, [this] { return woken_ || stop_; });
+    woken_ = false;
+
+    // Lets more responses join the batch.
+    const bool delay = batcher_.delay_usec() > 0;
+    if (delay) {
+      for (auto& conn : flush_conn_list) {
+        conn.MarkQueued();
+      }
+      this_fiber::sleep_for(std::chrono::microseconds(batcher_.delay_usec()));
+    }
 
+    // Batching saves writes only within a connection, hence the batcher sees the connections
+    // that had queued responses before the delay, or the largest batch without the delay.
+    size_t queued = 0, flushed = 0;
     for (auto it = flush_conn_list.begin(); it != flush_conn_list.end(); ++it) {
-      num_flushes += uint64_t(it->PollAndFlushWrites());
+      size_t mark = delay ? it->marked_queued() : 0;
+      size_t envelopes = it->PollAndFlushWrites();
+      num_flushes += envelopes > 0;
+      if (!delay) {
+        flushed = std::max(flushed, envelopes);
+      } else if (mark) {
+        queued += mark;
+        flushed += envelopes;
+      }
     }
+    if (flushed)
+      batcher_.OnFlush(queued, flushed);
   }
   VLOG(1) << "Flusher exited " << num_flushes;
 }
@@ -68,16 +108,28 @@ thread_local Flusher* flusher = nullptr;
 using asio::ip::tcp;
 using fibers_ext::yield;
 
-constexpr size_t kRpcPoolSize = 32;
+// A connection that holds that many items flushes before it reads more requests.
+constexpr size_t kRpcMaxItemsInUse = 32;
+
+// The items with larger envelopes drop their buffers before they become idle in the pool.
+constexpr size_t kMaxPooledEnvelopeSize = 64 << 10;
+
+inline int64_t EnvelopeSize(const Envelope& env) {
+  return env.header.size() + env.letter.size();
+}
+constexpr size_t kFlusherStackSize = 64 << 10;
 
 RpcConnectionHandler::RpcConnectionHandler(ConnectionBridge* bridge, IoContext* context)
     : ConnectionHandler(context),
-      bridge_(bridge), rpc_items_(kRpcPoolSize) {}
+      bridge_(bridge) {}
 
 RpcConnectionHandler::~RpcConnectionHandler() {
+  if (stream_fiber_.joinable())
+    stream_fiber_.join();
   bridge_->Join();
 
-  outgoing_buf_.clear_and_dispose([this](RpcItem* i) { rpc_items_.Release(i); });
+  outgoing_buf_.clear_and_dispose([this](RpcItem* i) { ReleaseItem(i); });
+  deferred_.clear_and_dispose([this](RpcItem* i) { ReleaseItem(i); });
 }
 
 void RpcConnectionHandler::OnOpenSocket() {
@@ -85,7 +137,7 @@ void RpcConnectionHandler::OnOpenSocket() {
 
   if (!flusher) {
     flusher = new Flusher;
-    io_context_.AttachCancellable(flusher);
+    io_context_.AttachCancellable(flusher, fibers_ext::PooledStack(kFlusherStackSize));
   }
   flusher->flush_conn_list.push_front(*this);
 
@@ -101,12 +153,25 @@ void RpcConnectionHandler::OnCloseSocket() {
   // 1. Flusher is outside this->FlushWrites()- then we can just remove ourselves.
   //    and RpcConnList::iterator will be still valid where it point to.
   // 2. We are inside this->FlushWrites(). In that case we want to wait till it finishes to run.
+  closed_->store(true, std::memory_order_relaxed);  // cancels the calls in flight.
+  credits_ec_.notifyAll();  // the streams waiting for credits recheck is_open().
+
   std::lock_guard<fibers::mutex> ul(wr_mu_);
   flusher->flush_conn_list.erase(RpcConnList::s_iterator_to(*this));
 
   VLOG(1) << "After flush fiber join " << req_flushes_;
 }
 
+void RpcConnectionHandler::OnDrain() {
+  // Sends the goaway frame right away, ahead of the responses that are not queued yet.
+  RpcItem* item = GetItem();
+  item->id = kGoAwayRpcId;
+  item->frame_flags = 0;
+  item->envelope.Clear();
+  outgoing_buf_.push_back(*item);
+  FlushWrites();
+}
+
 system::error_code RpcConnectionHandler::HandleRequest() {
   VLOG(2) << "HandleRequest " << socket_->is_open() << " / "
           << (socket_->is_open() ? socket_->remote_endpoint(ec_) : tcp::endpoint());
@@ -122,12 +187,27 @@ system::error_code RpcConnectionHandler::HandleRequest() {
 
   DCHECK_NE(-1, socket_->native_handle());
 
-  if (rpc_items_.empty() && !outgoing_buf_.empty()) {
-    req_flushes_ += FlushWrites();
+  // The credits of a stream come in empty frames of the same id. They may arrive after
+  // the stream finished.
+  if (frame.credits && frame.total_size() == 0) {
+    auto it = stream_credits_.find(frame.rpc_id);
+    if (it != stream_credits_.end()) {
+      it->second += frame.credits;
+      credits_ec_.notifyAll();
+    }
+    return ec_;
+  }
+
+  // The request is in flight once we started reading it, so that draining does not cut it.
+  RequestStarted();
+
+  if (items_in_use_ >= kRpcMaxItemsInUse && !outgoing_buf_.empty()) {
+    req_flushes_ += FlushWrites() > 0;
   }
 
   // We use item for reading the envelope.
-  auto item_ptr = rpc_items_.make_unique();
+  auto release = [this](RpcItem* i) { ReleaseItem(i); };
+  std::unique_ptr<RpcItem, decltype(release)> item_ptr(GetItem(), release);
 
   Envelope* envelope = &item_ptr->envelope;
   envelope->Resize(frame.header_size, frame.letter_size);
@@ -135,10 +215,55 @@ system::error_code RpcConnectionHandler::HandleRequest() {
   asio::read(*socket_, rbuf_seq, ec_);
   if (ec_) {
     VLOG(1) << "async_read " << ec_ << " /" << socket_->native_handle();
+    RequestFinished();
     return ec_;
   }
   DCHECK_NE(-1, socket_->native_handle());
 
+  if ((frame.flags & Frame::kCompressedFlag) && !UncompressLetter(&envelope->letter)) {
+    LOG(ERROR) << "Malformed compressed letter of " << frame.rpc_id << " from "
+               << socket_->native_handle();
+    ec_ = system::errc::make_error_code(system::errc::illegal_byte_sequence);
+    RequestFinished();
+    return ec_;
+  }
+
+  RpcItem* item = item_ptr.release();
+  item->id = frame.rpc_id;
+  item->frame_flags = frame.flags;
+  item->deadline = frame.deadline_ms
+                       ? CallContext::clock_t::now() + std::chrono::milliseconds(frame.deadline_ms)
+                       : CallContext::clock_t::time_point::max();
+  item->caller_span.trace_id = frame.trace_id;
+  item->caller_span.span_id = frame.span_id;
+  item->flow_controlled = frame.credits > 0;
+  if (item->flow_controlled) {
+    // The grants may arrive before the stream starts.
+    stream_credits_[frame.rpc_id] = frame.credits;
+  }
+
+  if (stream_running_) {
+    deferred_.push_back(*item);
+  } else if (item->flow_controlled) {
+    if (stream_fiber_.joinable())
+      stream_fiber_.join();  // it has finished already.
+    stream_running_ = true;
+    stream_fiber_ = fibers::fiber(&RpcConnectionHandler::StreamFiber, this, item);
+  } else {
+    Dispatch(item);
+  }
+
+  return ec_;
+}
+
+void RpcConnectionHandler::Dispatch(RpcItem* item) {
+  // The stream is not flow-controlled anymore once the bridge releases the writer.
+  std::shared_ptr<void> stream_guard;
+  if (item->flow_controlled) {
+    stream_guard.reset(static_cast<void*>(nullptr),
+                       [this, rpc_id = item->id](void*) { stream_credits_.erase(rpc_id); });
+  }
+
   // To support streaming we have this writer that creq_flushes_an write multiple envelopes per
   // single rpc request. We pass captures by value to allow asynchronous invocation
   // of ConnectionBridge::HandleEnvelope. We move writer object into HandleEnvelope,
@@ -146,27 +271,110 @@ system::error_code RpcConnectionHandler::HandleRequest() {
   // Please note that writer changes the value of 'item' field (it's mutable),
   // so only for the first outgoing envelope it uses the same RpcItem used for reading the data
   // to reduce allocations.
-  auto writer = [rpc_id = frame.rpc_id, item = item_ptr.release(), this](Envelope&& env) mutable {
-    RpcItem* next = item ? item : rpc_items_.Get();
+  // The request is in flight until its first response is queued, and the responses hold
+  // their queued bytes until they are flushed, see AdmissionLimits.
+  // The responses are compressed only for the clients that accept it.
+  const bool accepts = item->frame_flags & Frame::kAcceptsCompressionFlag;
+  auto ctx = std::make_shared<const CallContext>(item->deadline, closed_);
+
+  // The responses of the cancelled calls are dropped, nobody waits for them.
+  auto writer = [rpc_id = item->id, item, flow = item->flow_controlled, accepts, stream_guard, ctx,
+                 this](Envelope&& env) mutable {
+    if (flow && !ctx->cancelled())
+      WaitForCredit(rpc_id);
+
+    if (ctx->cancelled()) {
+      VLOG(1) << "Dropping the response of the cancelled call " << rpc_id;
+      if (item) {
+        ReleaseItem(item);
+        RequestFinished();
+      }
+      item = nullptr;
+      return;
+    }
+
+    RpcItem* next = item ? item : GetItem();
 
     next->envelope = std::move(env);
     next->id = rpc_id;
+    next->frame_flags = 0;
+    if (accepts) {
+      next->frame_flags = Frame::kAcceptsCompressionFlag;
+      BufferType compressed{EnvelopeBufferResource()};
+      if (CompressLetter(next->envelope.letter, &compressed)) {
+        next->envelope.letter.swap(compressed);
+        next->frame_flags |= Frame::kCompressedFlag;
+      }
+    }
+    bool was_empty = outgoing_buf_.empty();
     outgoing_buf_.push_back(*next);
+    outgoing_bytes_ += EnvelopeSize(next->envelope);
+    AddQueuedBytes(EnvelopeSize(next->envelope));
+    if (item)
+      RequestFinished();
     item = nullptr;
+
+    // A full batch is flushed right away, otherwise Flusher takes it.
+    if (FlushBatcher::Full(outgoing_buf_.size(), outgoing_bytes_)) {
+      FlushWrites();
+    } else if (was_empty) {
+      flusher->Wake();
+    }
   };
 
-  // Might by asynchronous, depends on the bridge_.
-  bridge_->HandleEnvelope(frame.rpc_id, envelope, std::move(writer));
+  // Might by asynchronous, depends on the bridge_. The span covers the asynchronous calls
+  // only until HandleEnvelope returns.
+  trace::ScopedSpan span("rpc_server", item->caller_span);
+  bridge_->HandleEnvelope(item->id, &item->envelope, std::move(writer), std::move(ctx));
+}
 
-  return ec_;
+void RpcConnectionHandler::StreamFiber(RpcItem* item) {
+  this_fiber::properties<IoFiberProperties>().set_name("RpcStream");
+
+  Dispatch(item);
+  while (!deferred_.empty()) {
+    item = &deferred_.front();
+    deferred_.pop_front();
+    Dispatch(item);
+  }
+  stream_running_ = false;
+}
+
+void RpcConnectionHandler::WaitForCredit(RpcId rpc_id) {
+  auto it = stream_credits_.find(rpc_id);
+  DCHECK(it != stream_credits_.end());
+
+  // The references to the values of unordered_map stay valid when it grows.
+  int64_t& credits = it->second;
+  if (credits <= 0) {
+    // Lets the client process what it has been sent so far.
+    FlushWrites();
+    credits_ec_.await([&] { return credits > 0 || !socket_->is_open(); });
+  }
+  --credits;
+}
+
+auto RpcConnectionHandler::GetItem() -> RpcItem* {
+  ++items_in_use_;
+  return ItemPool::Get();
+}
+
+void RpcConnectionHandler::ReleaseItem(RpcItem* item) {
+  DCHECK_GT(items_in_use_, 0u);
+  --items_in_use_;
+
+  const Envelope& env = item->envelope;
+  if (env.header.capacity() + env.letter.capacity() > kMaxPooledEnvelopeSize)
+    Envelope().Swap(&item->envelope);
+  ItemPool::Release(item);
 }
 
-bool RpcConnectionHandler::FlushWrites() {
+size_t RpcConnectionHandler::FlushWrites() {
   // Serves as critical section. We can not allow interleaving writes into the socket.
   // If another fiber flushes - we just exit without blocking.
   std::unique_lock<fibers::mutex> ul(wr_mu_, std::try_to_lock_t{});
   if (!ul || outgoing_buf_.empty() || !socket_->is_open())
-    return false;
+    return 0;
 
   VLOG(2) << "FlushWritesGuarded: " << outgoing_buf_.size();
   size_t count = outgoing_buf_.size();
@@ -177,6 +385,7 @@ bool RpcConnectionHandler::FlushWrites() {
   size_t item_index = 0;
   for (RpcItem& item : outgoing_buf_) {  // iterate over intrusive list.
     Frame f(item.id, item.envelope.header.size(), item.envelope.letter.size());
+    f.flags = item.frame_flags;
 
     uint8_t* buf = frame_buf_[item_index].data();
     size_t frame_sz = f.Write(buf);
@@ -186,14 +395,22 @@ bool RpcConnectionHandler::FlushWrites() {
     ++item_index;
   }
   tmp.swap(outgoing_buf_);
+  outgoing_bytes_ = 0;
+  rpc_server_flushes.Inc();
+  rpc_server_flushed_envelopes.IncBy(count);
 
   size_t write_sz = asio::write(*socket_, write_seq_, ec_);
 
   // We should use clear_and_dispose to delete items safely while unlinking them from tmp.
-  tmp.clear_and_dispose([this](RpcItem* i) { rpc_items_.Release(i); });
+  int64_t flushed = 0;
+  tmp.clear_and_dispose([&](RpcItem* i) {
+    flushed += EnvelopeSize(i->envelope);
+    ReleaseItem(i);
+  });
+  AddQueuedBytes(-flushed);
 
   VLOG(2) << "Wrote " << count << " requests with " << write_sz << " bytes";
-  return true;
+  return count;
 }
 
 }  // namespace rpc
@@ -4,12 +4,15 @@
 
 #pragma once
 
+#include <unordered_map>
+
 #include "base/object_pool.h"
 
 #include "util/asio/io_context.h"
 #include "util/asio/connection_handler.h"
 #include "util/rpc/frame_format.h"
 #include "util/rpc/rpc_connection.h"
+#include "util/trace/trace.h"
 
 namespace util {
 namespace rpc {
@@ -34,26 +37,54 @@ class RpcConnectionHandler : public ConnectionHandler {
                                         &RpcConnectionHandler::flush_hook_> ;
 
   // Called by Flusher fiber to flush the outgoing writes.
-  bool PollAndFlushWrites() {
+  size_t PollAndFlushWrites() {
     if (!socket_->is_open() || outgoing_buf_.empty())
-      return false;
+      return 0;
     return FlushWrites();
   }
 
+  // Flusher marks the size of the queue before it waits for more responses, see FlushBatcher.
+  void MarkQueued() { flush_mark_ = outgoing_buf_.size(); }
+  size_t marked_queued() const { return flush_mark_; }
+
  private:
   // protected by wr_mu_ to preserve transcational semantics.
-  // Returns true if the flush ocurred.
-  bool FlushWrites();
+  // Returns the number of the flushed envelopes, 0 if the flush did not occur.
+  size_t FlushWrites();
 
   // The following methods are run in the socket thread (thread that calls HandleRequest.)
   void OnOpenSocket() final;
   void OnCloseSocket() final;
+  void OnDrain() final;
+
+  struct RpcItem;
+
+  // Passes the request in item to the bridge.
+  void Dispatch(RpcItem* item);
+
+  // Runs the flow-controlled stream in item and then the requests deferred meanwhile.
+  void StreamFiber(RpcItem* item);
+
+  // Blocks the calling fiber until the client grants credits for another item of the stream.
+  void WaitForCredit(RpcId rpc_id);
+
+  // The items come from the pool shared by all the connections of the process.
+  RpcItem* GetItem();
+  void ReleaseItem(RpcItem* item);
 
   std::unique_ptr<ConnectionBridge> bridge_;
 
   struct RpcItem : public intrusive::slist_base_hook<intrusive::link_mode<intrusive::normal_link>> {
     RpcId id;
     Envelope envelope;
+    bool flow_controlled = false;  // a stream request that came with credits.
+
+    // The compression flags of the frame, see rpc_compression.h. Of a request until
+    // the writer reuses the item for the response.
+    uint8_t frame_flags = 0;
+
+    CallContext::clock_t::time_point deadline;  // of a request.
+    trace::SpanContext caller_span;              // of a request, see Frame::trace_id.
 
     RpcItem() = default;
     RpcItem(RpcId i, Envelope env) : id(i), envelope(std::move(env)) {
@@ -64,14 +95,30 @@ class RpcConnectionHandler : public ConnectionHandler {
     }
   };
   using ItemList = intrusive::slist<RpcItem, intrusive::cache_last<true>>;
+  using ItemPool = base::SharedObjectPool<RpcItem>;
 
   system::error_code ec_;
-  base::ObjectPool<RpcItem> rpc_items_;
+  size_t items_in_use_ = 0;
   ItemList outgoing_buf_;
+  size_t outgoing_bytes_ = 0;  // of the envelopes in outgoing_buf_.
+  size_t flush_mark_ = 0;
+
+  // A flow-controlled stream runs in stream_fiber_ so that the connection fiber keeps reading
+  // the credits of the client. The requests that the connection fiber reads meanwhile wait in
+  // deferred_, since a bridge serves a single fiber at a time.
+  std::unordered_map<RpcId, int64_t> stream_credits_;
+  fibers_ext::EventCount credits_ec_;
+  ::boost::fibers::fiber stream_fiber_;
+  ItemList deferred_;
+  bool stream_running_ = false;
+
+  // Set when the connection closes, shared with the contexts of its calls.
+  std::shared_ptr<std::atomic_bool> closed_{std::make_shared<std::atomic_bool>(false)};
 
   fibers::mutex wr_mu_;
   std::vector<asio::const_buffer> write_seq_;
-  base::PODArray<std::array<uint8_t, rpc::Frame::kMaxByteSize>> frame_buf_;
+  // Frame headers of a flush, usually there are just a few.
+  base::InlinedPODArray<std::array<uint8_t, rpc::Frame::kMaxByteSize>, 8> frame_buf_;
   uint64_t req_flushes_ = 0;
 };
 
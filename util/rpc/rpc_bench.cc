@@ -0,0 +1,121 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+// Loopback benchmarks of the rpc stack, run with --bench. The server and the clients
+// share the same IoContextPool.
+//
+#include <memory>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/histogram.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+
+#include "util/asio/accept_server.h"
+#include "util/fibers/fibers_ext.h"
+#include "util/rpc/channel.h"
+#include "util/rpc/rpc_test_utils.h"
+
+DEFINE_uint32(rpc_bench_duration_ms, 1000, "For how long every benchmark configuration runs");
+
+namespace util {
+namespace rpc {
+
+using namespace std;
+using namespace boost;
+
+namespace {
+
+// Arguments: payload bytes, connections, calls in flight per connection, IO threads.
+void BenchArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"payload", "conns", "depth", "io"});
+  for (int payload : {64, 4096, 65536}) {
+    for (int conns : {1, 8}) {
+      for (int depth : {1, 16}) {
+        for (int io : {1, 4}) {
+          b->Args({payload, conns, depth, io});
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+// Every connection runs depth fibers, each of them sends its next call once the previous one
+// returns. Reports the rate of the calls and their latency percentiles in microseconds.
+static void BM_RpcLatency(benchmark::State& state) {
+  const size_t payload = state.range(0);
+  const unsigned conns = state.range(1), depth = state.range(2);
+
+  IoContextPool pool(state.range(3));
+  pool.Run();
+  AcceptServer server(&pool);
+  TestInterface ti;
+  uint16_t port = server.AddListener(0, &ti);
+  server.Run();
+
+  vector<unique_ptr<Channel>> channels;
+  vector<IoContext*> cntxs;
+  for (unsigned i = 0; i < conns; ++i) {
+    cntxs.push_back(&pool.GetNextContext());
+    channels.emplace_back(new Channel("localhost", std::to_string(port), cntxs.back()));
+    auto ec = channels.back()->Connect(1000);
+    CHECK(!ec) << ec.message();
+  }
+
+  // A histogram per fiber, merged once they finish.
+  vector<base::Histogram> hists(conns * depth);
+  vector<uint64_t> errors(conns * depth, 0);
+
+  for (auto _ : state) {
+    const uint64_t start = base::GetClockNanos<CLOCK_MONOTONIC>();
+    const uint64_t end = start + uint64_t(FLAGS_rpc_bench_duration_ms) * 1000000;
+    fibers_ext::BlockingCounter bc(hists.size());
+
+    for (unsigned i = 0; i < hists.size(); ++i) {
+      Channel* channel = channels[i / depth].get();
+      cntxs[i / depth]->AsyncFiber([&, channel, i] {
+        Envelope envelope;
+        while (true) {
+          uint64_t now = base::GetClockNanos<CLOCK_MONOTONIC>();
+          if (now >= end)
+            break;
+          envelope.Clear();
+          envelope.letter.resize(payload);
+          auto ec = channel->SendSync(1000, &envelope);
+          errors[i] += bool(ec);
+          hists[i].Add((base::GetClockNanos<CLOCK_MONOTONIC>() - now) / 1000.0);
+        }
+        bc.Dec();
+      });
+    }
+    bc.Wait();
+    state.SetIterationTime((base::GetClockNanos<CLOCK_MONOTONIC>() - start) * 1e-9);
+  }
+
+  base::Histogram total;
+  uint64_t total_errors = 0;
+  for (unsigned i = 0; i < hists.size(); ++i) {
+    total.Merge(hists[i]);
+    total_errors += errors[i];
+  }
+
+  // The letter is echoed back, so every call moves its payload twice.
+  state.SetItemsProcessed(total.count());
+  state.SetBytesProcessed(total.count() * payload * 2);
+  state.counters["p50"] = total.Percentile(50);
+  state.counters["p99"] = total.Percentile(99);
+  state.counters["p999"] = total.Percentile(99.9);
+  state.counters["errors"] = total_errors;
+
+  channels.clear();
+  server.Stop(true);
+  pool.Stop();
+}
+BENCHMARK(BM_RpcLatency)->Apply(BenchArgs)->Iterations(1)->UseManualTime()->Unit(
+    benchmark::kMillisecond);
+
+}  // namespace rpc
+}  // namespace util
@@ -0,0 +1,109 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/rpc_compression.h"
+
+#include "base/endian.h"
+#include "base/flags.h"
+#include "base/logging.h"
+#include "file/compressors.h"
+
+namespace util {
+namespace rpc {
+
+DEFINE_string(rpc_compression, "",
+              "The compression of the RPC letters: lz4, zstd or zlib. Empty disables it. "
+              "The letters are compressed only if the peer supports it, see rpc_compression.h");
+DEFINE_uint32(rpc_compression_min_bytes, 1024, "The smallest RPC letter that is compressed.");
+
+using namespace file::list_file;
+
+namespace {
+
+constexpr unsigned kPrefixSize = 1 + 4;  // the method and the raw size.
+constexpr int kCompressLevel = 1;        // RPCs favour speed over the ratio.
+
+CompressMethod FlagMethod() {
+  const std::string& name = FLAGS_rpc_compression;
+  if (name.empty() || name == "none")
+    return kCompressionNone;
+  if (name == "lz4")
+    return kCompressionLZ4;
+  if (name == "zstd")
+    return kCompressionZstd;
+  if (name == "zlib")
+    return kCompressionZlib;
+  LOG_FIRST_N(ERROR, 1) << "Unknown --rpc_compression " << name << ", not compressing";
+  return kCompressionNone;
+}
+
+// The compressors are not thread-safe, therefore every thread has its own.
+struct Compressor {
+  CompressMethod method = kCompressionNone;
+  file::CompressFunction compress;
+  file::CompressBoundFunction bound;
+};
+
+Compressor* ThreadCompressor(CompressMethod method) {
+  static thread_local Compressor compressor;
+  if (compressor.method != method) {
+    compressor.method = method;
+    compressor.compress = file::GetCompress(method);
+    compressor.bound = file::GetCompressBound(method);
+  }
+  return &compressor;
+}
+
+}  // namespace
+
+bool CompressionEnabled() {
+  return FlagMethod() != kCompressionNone;
+}
+
+bool CompressLetter(const BufferType& letter, BufferType* dest) {
+  CompressMethod method = FlagMethod();
+  if (method == kCompressionNone || letter.size() < FLAGS_rpc_compression_min_bytes)
+    return false;
+
+  Compressor* c = ThreadCompressor(method);
+  dest->resize(kPrefixSize + c->bound(letter.size()));
+  size_t compress_size = dest->size() - kPrefixSize;
+  Status st = c->compress(kCompressLevel, letter.data(), letter.size(),
+                          dest->data() + kPrefixSize, &compress_size);
+  if (!st.ok()) {
+    VLOG(1) << "Could not compress the letter: " << st;
+    return false;
+  }
+  if (kPrefixSize + compress_size >= letter.size())
+    return false;
+
+  (*dest)[0] = method;
+  LittleEndian::Store32(dest->data() + 1, letter.size());
+  dest->resize(kPrefixSize + compress_size);
+  return true;
+}
+
+bool UncompressLetter(BufferType* letter) {
+  if (letter->size() < kPrefixSize)
+    return false;
+
+  file::UncompressFunction uncompress = file::GetUncompress(CompressMethod((*letter)[0]));
+  if (!uncompress)
+    return false;
+
+  size_t raw_size = LittleEndian::Load32(letter->data() + 1);
+  BufferType dest{EnvelopeBufferResource()};
+  dest.resize(raw_size);
+  size_t uncompress_size = raw_size;
+  Status st = uncompress(letter->data() + kPrefixSize, letter->size() - kPrefixSize, dest.data(),
+                         &uncompress_size);
+  if (!st.ok() || uncompress_size != raw_size) {
+    VLOG(1) << "Could not uncompress the letter: " << st;
+    return false;
+  }
+  letter->swap(dest);
+  return true;
+}
+
+}  // namespace rpc
+}  // namespace util
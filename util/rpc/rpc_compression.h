@@ -0,0 +1,32 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include "util/rpc/rpc_envelope.h"
+
+namespace util {
+namespace rpc {
+
+// Compression of the envelope letters, see --rpc_compression.
+// A compressed letter starts with its list_file::CompressMethod byte followed by the LE32 size
+// of the raw letter. The frames of the compressed letters carry Frame::kCompressedFlag.
+// The peers negotiate it per connection: the clients with --rpc_compression mark their requests
+// with Frame::kAcceptsCompressionFlag, the servers answer them with marked responses, which
+// they may compress, and the clients compress their requests only once they got marked
+// responses from the connection. Hence the peers that predate the compression never get
+// compressed letters.
+
+// Whether --rpc_compression selects a compression method.
+bool CompressionEnabled();
+
+// Compresses letter into dest if it has at least --rpc_compression_min_bytes and
+// the compression shrinks it. Returns true if it did, otherwise dest is unspecified.
+// dest must use EnvelopeBufferResource(), so that it can be swapped with the letters.
+bool CompressLetter(const BufferType& letter, BufferType* dest);
+
+// Replaces the compressed letter with the raw one. Returns false if the letter is malformed.
+bool UncompressLetter(BufferType* letter);
+
+}  // namespace rpc
+}  // namespace util
@@ -10,6 +10,10 @@
 namespace util {
 namespace rpc {
 
+void ConnectionBridge::HandleEnvelope(RpcId rpc_id, Envelope* input, EnvelopeWriter writer) {
+  LOG(FATAL) << "The bridge must override one of the HandleEnvelope functions";
+}
+
 ConnectionHandler* ServiceInterface::NewConnection(IoContext& context) {
   ConnectionBridge* bridge = CreateConnectionBridge();
   return new RpcConnectionHandler(bridge, &context);
@@ -3,6 +3,8 @@
 //
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 
 #include "util/asio/connection_handler.h"
@@ -19,6 +21,29 @@ namespace rpc {
 // Also defined in frame_format.h. Seems to work.
 typedef uint64_t RpcId;
 
+// The deadline of a call and whether its client still waits for the response.
+// The bridges check it to stop working on the calls that nobody waits for anymore.
+class CallContext {
+ public:
+  using clock_t = std::chrono::steady_clock;
+
+  CallContext(clock_t::time_point deadline, std::shared_ptr<const std::atomic_bool> closed)
+      : deadline_(deadline), closed_(std::move(closed)) {}
+
+  // When the client stops waiting, time_point::max() if it sent no deadline.
+  clock_t::time_point deadline() const { return deadline_; }
+
+  // True once the deadline passed or the client disconnected.
+  // The responses of the cancelled calls are not sent.
+  bool cancelled() const {
+    return closed_->load(std::memory_order_relaxed) || clock_t::now() >= deadline_;
+  }
+
+ private:
+  clock_t::time_point deadline_;
+  std::shared_ptr<const std::atomic_bool> closed_;  // set when the connection closes.
+};
+
 // ConnectionBridge is responsible to abstract higher level server-app logic and to provide
 // an interface that allows to map Envelope to ServiceInterface methods.
 // ConnectionBridge is a single-fiber creature, so currently only one caller fiber can
@@ -41,8 +66,14 @@ class ConnectionBridge {
   // back one or more envelopes via the writer. Specifics of the protocol are defined
   // in the derived class. Since HandleEnvelope can be asynchronous,
   // the caller should make sure the writer is valid through the call.
-  virtual void HandleEnvelope(RpcId rpc_id, Envelope* input,
-                              EnvelopeWriter writer) = 0;
+  virtual void HandleEnvelope(RpcId rpc_id, Envelope* input, EnvelopeWriter writer);
+
+  // The entry function that is actually called. The bridges that watch the cancellation of
+  // their calls override it instead of the one above, ctx may be kept until the call finishes.
+  virtual void HandleEnvelope(RpcId rpc_id, Envelope* input, EnvelopeWriter writer,
+                              std::shared_ptr<const CallContext> ctx) {
+    HandleEnvelope(rpc_id, input, std::move(writer));
+  }
 
   // In case HandleEnvelope is asynchronous, waits for all the issued calls to finish.
   // HandleEnvelope should not be called after calling Join().
@@ -0,0 +1,113 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/rpc_envelope.h"
+
+#include <new>
+
+#include "base/memory_account.h"
+
+namespace util {
+namespace rpc {
+
+namespace {
+
+constexpr unsigned kMinBlockShift = 6;   // 64 bytes.
+constexpr unsigned kMaxBlockShift = 16;  // 64KB, the larger buffers go to the heap directly.
+constexpr unsigned kNumClasses = kMaxBlockShift - kMinBlockShift + 1;
+constexpr size_t kMaxCachedBytes = 4 << 20;  // per thread.
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+// Trivially destructible, hence they stay valid until the thread exits even after
+// the drainer below has been destroyed.
+thread_local FreeBlock* free_blocks[kNumClasses] = {nullptr};
+thread_local size_t cached_bytes = 0;
+thread_local bool cache_drained = false;
+
+inline size_t BlockSize(unsigned cls) { return size_t(1) << (cls + kMinBlockShift); }
+
+// Returns the cached buffers of the thread to the heap when it exits.
+struct CacheDrainer {
+  ~CacheDrainer() {
+    for (unsigned i = 0; i < kNumClasses; ++i) {
+      while (FreeBlock* b = free_blocks[i]) {
+        free_blocks[i] = b->next;
+        ::operator delete(b);
+      }
+    }
+    cached_bytes = 0;
+    cache_drained = true;
+  }
+};
+
+thread_local CacheDrainer cache_drainer;
+
+// Returns kNumClasses for the sizes that are not pooled.
+inline unsigned SizeClass(size_t bytes) {
+  if (bytes <= BlockSize(0))
+    return 0;
+  if (bytes > BlockSize(kNumClasses - 1))
+    return kNumClasses;
+  return 64 - __builtin_clzl(bytes - 1) - kMinBlockShift;
+}
+
+// The buffers in use, the thread caches are not counted.
+base::MemoryAccount* EnvelopeAccount() {
+  static base::MemoryAccount* res = base::MemoryAccount::Get("rpc.envelopes");
+  return res;
+}
+
+class EnvelopeResource final : public pmr::memory_resource {
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    EnvelopeAccount()->Charge(bytes);
+    if (alignment > alignof(std::max_align_t))
+      return ::operator new(bytes, std::align_val_t(alignment));
+
+    unsigned cls = SizeClass(bytes);
+    if (cls == kNumClasses)
+      return ::operator new(bytes);
+
+    if (FreeBlock* b = free_blocks[cls]) {
+      free_blocks[cls] = b->next;
+      cached_bytes -= BlockSize(cls);
+      return b;
+    }
+    return ::operator new(BlockSize(cls));
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    EnvelopeAccount()->Release(bytes);
+    if (alignment > alignof(std::max_align_t)) {
+      ::operator delete(p, std::align_val_t(alignment));
+      return;
+    }
+
+    unsigned cls = SizeClass(bytes);
+    if (cls == kNumClasses || cache_drained || cached_bytes + BlockSize(cls) > kMaxCachedBytes) {
+      ::operator delete(p);
+      return;
+    }
+
+    (void)&cache_drainer;  // the first caching registers the drainer of the thread.
+    FreeBlock* b = static_cast<FreeBlock*>(p);
+    b->next = free_blocks[cls];
+    free_blocks[cls] = b;
+    cached_bytes += BlockSize(cls);
+  }
+
+  bool do_is_equal(const pmr::memory_resource& o) const noexcept override { return this == &o; }
+};
+
+}  // namespace
+
+pmr::memory_resource* EnvelopeBufferResource() {
+  static EnvelopeResource* resource = new EnvelopeResource;  // outlives the buffers.
+  return resource;
+}
+
+}  // namespace rpc
+}  // namespace util
@@ -11,9 +11,15 @@ namespace rpc {
 
 typedef base::PODArray<uint8_t> BufferType;
 
+// The memory resource of the envelope buffers. It recycles the buffers via size-classed
+// free lists of the calling thread, so that the RPCs do not hit the heap per message once
+// the IO threads warmed up. Since every IoContext runs a single thread, every IoContext
+// effectively has its own pool. The buffers may be freed by any thread.
+pmr::memory_resource* EnvelopeBufferResource();
+
 class Envelope {
  public:
-  BufferType header, letter;
+  BufferType header{EnvelopeBufferResource()}, letter{EnvelopeBufferResource()};
 
   Envelope() = default;
 
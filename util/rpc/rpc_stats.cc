@@ -0,0 +1,173 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/rpc/rpc_stats.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "base/walltime.h"
+#include "util/stats/varz_stats.h"
+
+namespace util {
+namespace rpc {
+
+using namespace std;
+
+namespace {
+
+class ThreadStats;
+
+// All the method names and the stats of all the threads of the process.
+struct Registry {
+  mutex mu;
+  vector<string> names;  // indexed by the method ids.
+  unordered_map<string, unsigned> ids;
+  vector<const ThreadStats*> threads;
+  vector<MethodStats> exited;  // indexed by the method ids.
+};
+
+Registry& registry() {
+  static Registry* reg = new Registry;  // never destroyed since threads may outlive statics.
+  return *reg;
+}
+
+void MergeStats(const vector<MethodStats>& src, vector<MethodStats>* dest) {
+  if (dest->size() < src.size())
+    dest->resize(src.size());
+  for (size_t i = 0; i < src.size(); ++i) {
+    (*dest)[i].Merge(src[i]);
+  }
+}
+
+// The stats of the calls that were recorded by a single thread. Only the thread itself
+// updates them, hence the lock is uncontended unless GetMethodStats() reads them.
+class ThreadStats {
+ public:
+  ThreadStats() {
+    Registry& reg = registry();
+    lock_guard<mutex> lk(reg.mu);
+    reg.threads.push_back(this);
+  }
+
+  ~ThreadStats() {
+    Registry& reg = registry();
+    lock_guard<mutex> lk(reg.mu);
+    MergeInto(&reg.exited);
+    reg.threads.erase(std::find(reg.threads.begin(), reg.threads.end(), this));
+  }
+
+  template <typename Func> void Update(unsigned id, Func&& f) {
+    lock_guard<mutex> lk(mu_);
+    if (id >= methods_.size())
+      methods_.resize(id + 1);
+    f(&methods_[id]);
+  }
+
+  void MergeInto(vector<MethodStats>* dest) const {
+    lock_guard<mutex> lk(mu_);
+    MergeStats(methods_, dest);
+  }
+
+ private:
+  mutable mutex mu_;
+  vector<MethodStats> methods_;  // indexed by the method ids.
+};
+
+thread_local ThreadStats this_thread_stats;
+
+unique_ptr<VarzFunction> method_varz;
+once_flag method_varz_flag;
+
+VarzValue::Map GetMethodVarz() {
+  VarzValue::Map res;
+  for (const auto& k_v : GetMethodStats()) {
+    const MethodStats& st = k_v.second;
+    VarzValue::Map method;
+    method.emplace_back("calls", VarzValue::FromInt(st.calls));
+    method.emplace_back("errors", VarzValue::FromInt(st.errors));
+    method.emplace_back("inflight", VarzValue::FromInt(st.inflight));
+    method.emplace_back("request-bytes", VarzValue::FromInt(st.request_bytes));
+    method.emplace_back("response-bytes", VarzValue::FromInt(st.response_bytes));
+    method.emplace_back("p50-us", VarzValue::FromDouble(st.latency_micros.Percentile(50)));
+    method.emplace_back("p99-us", VarzValue::FromDouble(st.latency_micros.Percentile(99)));
+    method.emplace_back("max-us", VarzValue::FromDouble(st.latency_micros.max()));
+    method.emplace_back("latency-us", VarzValue::FromHistogram(st.latency_micros));
+    res.emplace_back(k_v.first, std::move(method));
+  }
+  return res;
+}
+
+}  // namespace
+
+void MethodStats::Merge(const MethodStats& other) {
+  calls += other.calls;
+  errors += other.errors;
+  inflight += other.inflight;
+  request_bytes += other.request_bytes;
+  response_bytes += other.response_bytes;
+  latency_micros.Merge(other.latency_micros);
+}
+
+MethodRecorder::MethodRecorder(const string& name) {
+  Registry& reg = registry();
+  unique_lock<mutex> lk(reg.mu);
+  auto res = reg.ids.emplace(name, reg.names.size());
+  if (res.second)
+    reg.names.push_back(name);
+  id_ = res.first->second;
+  lk.unlock();
+
+  // Not under reg.mu, since the varz are read under their own lock, which comes first.
+  std::call_once(method_varz_flag,
+                 [] { method_varz.reset(new VarzFunction("rpc-methods", &GetMethodVarz)); });
+}
+
+uint64_t MethodRecorder::Start(size_t request_bytes) const {
+  this_thread_stats.Update(id_, [&](MethodStats* st) {
+    ++st->inflight;
+    st->request_bytes += request_bytes;
+  });
+  return base::GetClockNanos<CLOCK_MONOTONIC>();
+}
+
+void MethodRecorder::Finish(uint64_t start_ns, bool error, size_t response_bytes) const {
+  double micros = (base::GetClockNanos<CLOCK_MONOTONIC>() - start_ns) / 1000.0;
+  this_thread_stats.Update(id_, [&](MethodStats* st) {
+    --st->inflight;
+    ++st->calls;
+    st->errors += error;
+    st->response_bytes += response_bytes;
+    st->latency_micros.Add(micros);
+  });
+}
+
+string MethodRecorder::name() const {
+  Registry& reg = registry();
+  lock_guard<mutex> lk(reg.mu);
+  return reg.names[id_];
+}
+
+vector<pair<string, MethodStats>> GetMethodStats() {
+  Registry& reg = registry();
+  vector<MethodStats> merged;
+  vector<pair<string, MethodStats>> res;
+
+  lock_guard<mutex> lk(reg.mu);
+  MergeStats(reg.exited, &merged);
+  for (const ThreadStats* ts : reg.threads) {
+    ts->MergeInto(&merged);
+  }
+
+  for (size_t i = 0; i < merged.size(); ++i) {
+    res.emplace_back(reg.names[i], std::move(merged[i]));
+  }
+  std::sort(res.begin(), res.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+  return res;
+}
+
+}  // namespace rpc
+}  // namespace util
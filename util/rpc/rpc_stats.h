@@ -0,0 +1,51 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/histogram.h"
+
+namespace util {
+namespace rpc {
+
+// The stats of the calls of an rpc method.
+struct MethodStats {
+  uint64_t calls = 0;    // the finished calls.
+  uint64_t errors = 0;   // the finished calls that failed.
+  int64_t inflight = 0;  // the calls that started and did not finish yet.
+  uint64_t request_bytes = 0, response_bytes = 0;
+  base::Histogram latency_micros;
+
+  void Merge(const MethodStats& other);
+};
+
+// Records the calls of a method into the stats of its name. The recorders of the same name
+// share the stats. By convention the names are prefixed with "server/" or "client/".
+// Every thread records into its own copy of the stats under an uncontended lock, and
+// GetMethodStats() merges them. The stats are exported as the "rpc-methods" varz.
+// Thread-safe, a call may finish in a different thread than the one it started in.
+class MethodRecorder {
+ public:
+  explicit MethodRecorder(const std::string& name);
+
+  // Returns the start time of the call that is passed to Finish().
+  uint64_t Start(size_t request_bytes) const;
+
+  void Finish(uint64_t start_ns, bool error, size_t response_bytes) const;
+
+  std::string name() const;
+
+ private:
+  unsigned id_;
+};
+
+// Returns the stats of all the methods in the process, sorted by name.
+// Includes the threads that have exited.
+std::vector<std::pair<std::string, MethodStats>> GetMethodStats();
+
+}  // namespace rpc
+}  // namespace util
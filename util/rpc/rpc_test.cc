@@ -2,10 +2,13 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 #include <chrono>
+#include <map>
 #include <memory>
+#include <thread>
 
 #include <boost/asio/write.hpp>
 
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/strip.h"
 
@@ -17,13 +20,25 @@
 #include "util/asio/asio_utils.h"
 #include "util/asio/yield.h"
 
+#include "util/fibers/fibers_ext.h"
+
+#include "util/rpc/balanced_channel.h"
 #include "util/rpc/channel.h"
 #include "util/rpc/frame_format.h"
+#include "util/rpc/rpc_compression.h"
 #include "util/rpc/rpc_test_utils.h"
+#include "util/trace/trace.h"
+
+DECLARE_double(trace_sample_rate);
 
 namespace util {
 namespace rpc {
 
+DECLARE_uint32(rpc_stream_window);
+DECLARE_string(rpc_compression);
+DECLARE_bool(rpc_send_deadline);
+DECLARE_double(rpc_hedge_percentile);
+
 using namespace std;
 using namespace boost;
 using asio::ip::tcp;
@@ -56,6 +71,99 @@ class RpcTest : public ServerTest {
   std::unique_ptr<Channel> channel_;
 };
 
+TEST(EnvelopeTest, Pool) {
+  const uint8_t* header;
+  const uint8_t* letter;
+  {
+    Envelope env(100, 1000);
+    header = env.header.data();
+    letter = env.letter.data();
+  }
+
+  // The buffers of the same size classes are recycled.
+  Envelope env(120, 900);
+  EXPECT_EQ(header, env.header.data());
+  EXPECT_EQ(letter, env.letter.data());
+
+  Envelope large(0, 1 << 20);  // not pooled.
+  EXPECT_EQ(1u << 20, large.letter.size());
+}
+
+// A SyncReadStream over a memory buffer.
+struct BufferStream {
+  asio::const_buffer buf;
+
+  template <typename MutableBufferSequence>
+  size_t read_some(const MutableBufferSequence& mbs, system::error_code& ec) {
+    size_t sz = asio::buffer_copy(mbs, buf);
+    buf += sz;
+    ec = sz ? system::error_code{} : asio::error::eof;
+    return sz;
+  }
+};
+
+TEST(FrameTest, Credits) {
+  uint8_t buf[Frame::kMaxByteSize];
+  for (uint32_t letter_size : {0u, 7u, 300u, 1u << 20}) {
+    Frame frame(17, 290, letter_size);
+    frame.credits = 9;
+    BufferStream stream{asio::buffer(buf, frame.Write(buf))};
+
+    Frame res;
+    ASSERT_FALSE(res.Read(&stream));
+    EXPECT_EQ(frame, res);
+    EXPECT_EQ(0u, stream.buf.size());
+  }
+}
+
+TEST(FrameTest, Flags) {
+  uint8_t buf[Frame::kMaxByteSize];
+  Frame frame(17, 3, 1000);
+  frame.flags = Frame::kCompressedFlag | Frame::kAcceptsCompressionFlag;
+  frame.credits = 1;
+  frame.deadline_ms = 300;
+  BufferStream stream{asio::buffer(buf, frame.Write(buf))};
+
+  Frame res;
+  ASSERT_FALSE(res.Read(&stream));
+  EXPECT_EQ(frame, res);
+}
+
+TEST(FrameTest, Traced) {
+  uint8_t buf[Frame::kMaxByteSize];
+  for (uint32_t deadline_ms : {0u, 300u}) {
+    Frame frame(17, 0, 5);
+    frame.deadline_ms = deadline_ms;
+    frame.trace_id = 0x123456789abcdefULL;
+    frame.span_id = 42;
+    BufferStream stream{asio::buffer(buf, frame.Write(buf))};
+    EXPECT_EQ(0, memcmp(buf, "URPT", 4));
+
+    Frame res;
+    ASSERT_FALSE(res.Read(&stream));
+    EXPECT_EQ(frame, res);
+    EXPECT_EQ(0u, stream.buf.size());
+  }
+}
+
+TEST(EnvelopeTest, Compression) {
+  FLAGS_rpc_compression = "lz4";
+  BufferType letter{EnvelopeBufferResource()}, compressed{EnvelopeBufferResource()};
+  letter.resize_fill(100, 7);
+  EXPECT_FALSE(CompressLetter(letter, &compressed));  // too small.
+
+  letter.resize_fill(1 << 16, 7);
+  ASSERT_TRUE(CompressLetter(letter, &compressed));
+  EXPECT_LT(compressed.size(), letter.size() / 10);
+  ASSERT_TRUE(UncompressLetter(&compressed));
+  ASSERT_EQ(letter.size(), compressed.size());
+  EXPECT_EQ(0, memcmp(letter.data(), compressed.data(), letter.size()));
+
+  compressed.resize(3);
+  EXPECT_FALSE(UncompressLetter(&compressed));
+  FLAGS_rpc_compression = "";
+}
+
 TEST_F(RpcTest, BadHeader) {
   // Must be large enough to pass the initial RPC server read.
   string control("Hello "), message("world!!!");
@@ -150,6 +258,55 @@ TEST_F(RpcTest, SendOk) {
   EXPECT_FALSE(fc.get());
 }
 
+TEST_F(RpcTest, SendAsync) {
+  constexpr unsigned kCalls = 100;
+  std::vector<Envelope> envelopes(kCalls);
+  std::atomic_uint ok{0};
+  fibers_ext::BlockingCounter bc(kCalls);
+
+  for (unsigned i = 0; i < kCalls; ++i) {
+    envelopes[i].letter.resize_fill(10 + i, 1);
+    channel_->SendAsync(100, &envelopes[i], [&](system::error_code ec) {
+      ok.fetch_add(!ec, std::memory_order_relaxed);
+      bc.Dec();
+    });
+  }
+  bc.Wait();
+  EXPECT_EQ(kCalls, ok.load());
+  for (unsigned i = 0; i < kCalls; ++i) {
+    EXPECT_EQ(10 + i, envelopes[i].letter.size());
+  }
+}
+
+TEST_F(RpcTest, Traced) {
+  FLAGS_trace_sample_rate = 1;
+  MethodRecorder recorder("client/traced");
+  trace::SpanContext root;
+  Envelope envelope;
+  {
+    trace::ScopedSpan span("root", trace::NewTrace());
+    root = span.context();
+    envelope.letter.resize_fill(42, 2);
+    EXPECT_FALSE(channel_->SendSync(100, &envelope, &recorder));
+  }
+  FLAGS_trace_sample_rate = 0;
+
+  // The client span is recorded when the response arrives, the server span may come later.
+  std::vector<trace::SpanRecord> spans;
+  for (unsigned i = 0; i < 100 && spans.size() < 3; ++i) {
+    this_thread::sleep_for(1ms);
+    spans = trace::CollectSpans(root.trace_id);
+  }
+  ASSERT_EQ(3, spans.size());
+
+  std::map<string, trace::SpanRecord> by_name;
+  for (const auto& s : spans) {
+    by_name[s.name] = s;
+  }
+  EXPECT_EQ(root.span_id, by_name["client/traced"].parent_id);
+  EXPECT_EQ(by_name["client/traced"].span_id, by_name["rpc_server"].parent_id);
+}
+
 TEST_F(RpcTest, ServerStopped) {
   Envelope envelope;
   envelope.header.resize_fill(14, 1);
@@ -192,6 +349,153 @@ TEST_F(RpcTest, Stream) {
   EXPECT_EQ(3, times);
 }
 
+TEST_F(RpcTest, FlowControlledStream) {
+  FLAGS_rpc_stream_window = 2;
+
+  string header("repeat20");
+  Envelope envelope;
+  Copy(header, &envelope.header);
+
+  // Processing the items slowly, the server sends at most 2 items ahead of us.
+  int times = 0;
+  auto cb = [&](Envelope& env) -> system::error_code {
+    ++times;
+    this_fiber::sleep_for(1ms);
+    absl::string_view header(strings::charptr(env.header.data()), env.header.size());
+    return absl::EndsWith(header, "1") ? system::error_code{} : asio::error::eof;
+  };
+  system::error_code ec = channel_->SendAndReadStream(&envelope, cb);
+  EXPECT_FALSE(ec) << ec.message();
+  EXPECT_EQ(20, times);
+
+  // The connection serves the other requests afterwards.
+  envelope.header.clear();
+  envelope.letter.resize_fill(42, 1);
+  ec = channel_->SendSync(1000, &envelope);
+  EXPECT_FALSE(ec) << ec.message();
+  FLAGS_rpc_stream_window = 0;
+}
+
+TEST_F(RpcTest, Compression) {
+  FLAGS_rpc_compression = "lz4";
+
+  // The first call negotiates the compression, the next ones compress their letters.
+  Envelope envelope;
+  for (char c : {'a', 'b', 'c'}) {
+    envelope.Clear();
+    envelope.letter.resize_fill(1 << 16, c);
+    system::error_code ec = channel_->SendSync(1000, &envelope);
+    ASSERT_FALSE(ec) << ec.message();
+
+    absl::string_view letter(strings::charptr(envelope.letter.data()), envelope.letter.size());
+    EXPECT_EQ(string(1 << 16, c), letter);
+  }
+  FLAGS_rpc_compression = "";
+}
+
+TEST_F(RpcTest, MethodStats) {
+  MethodRecorder recorder("client/stats_test");
+  Envelope envelope;
+  for (unsigned i = 0; i < 3; ++i) {
+    envelope.Clear();
+    envelope.letter.resize_fill(10, 'a');
+    system::error_code ec = channel_->SendSync(1000, &envelope, &recorder);
+    ASSERT_FALSE(ec) << ec.message();
+  }
+  Copy(string("sleep100"), &envelope.header);
+  EXPECT_EQ(asio::error::timed_out, channel_->SendSync(10, &envelope, &recorder));
+
+  bool found = false;
+  for (const auto& k_v : GetMethodStats()) {
+    if (k_v.first != "client/stats_test")
+      continue;
+    found = true;
+    const MethodStats& st = k_v.second;
+    EXPECT_EQ(4, st.calls);
+    EXPECT_EQ(1, st.errors);
+    EXPECT_EQ(0, st.inflight);
+    EXPECT_EQ(48, st.request_bytes);
+    EXPECT_EQ(30, st.response_bytes);
+    EXPECT_EQ(4, st.latency_micros.count());
+  }
+  EXPECT_TRUE(found);
+}
+
+TEST_F(RpcTest, Balanced) {
+  // Nothing listens on the port of the second replica, hence the calls go to the first one.
+  BalancedChannel balanced({{"localhost", std::to_string(port_)}, {"localhost", "1"}},
+                           pool_.get());
+  system::error_code ec = balanced.Connect(100);
+  ASSERT_FALSE(ec) << ec.message();
+
+  Envelope envelope;
+  for (unsigned i = 0; i < 20; ++i) {
+    envelope.Clear();
+    envelope.letter.resize_fill(10, i);
+    ec = balanced.SendSync(1000, &envelope);
+    ASSERT_FALSE(ec) << ec.message();
+    EXPECT_EQ(10, envelope.letter.size());
+  }
+}
+
+TEST_F(RpcTest, Hedged) {
+  FLAGS_rpc_hedge_percentile = 50;
+  string port = std::to_string(port_);
+  BalancedChannel balanced({{"localhost", port}, {"localhost", port}}, pool_.get());
+  system::error_code ec = balanced.Connect(100);
+  ASSERT_FALSE(ec) << ec.message();
+
+  MethodRecorder recorder("client/hedged_test");
+  BalancedChannel::CallOptions opts{true, &recorder};
+
+  // Learns the latencies of the calls.
+  Envelope envelope;
+  for (unsigned i = 0; i < 1000; ++i) {
+    envelope.Clear();
+    envelope.letter.resize_fill(10, 'a');
+    ec = balanced.SendSync(1000, &envelope, opts);
+    ASSERT_FALSE(ec) << ec.message();
+  }
+
+  // The slow call is duplicated to the other replica.
+  envelope.Clear();
+  Copy(string("sleep50"), &envelope.header);
+  ec = balanced.SendSync(1000, &envelope, opts);
+  ASSERT_FALSE(ec) << ec.message();
+  EXPECT_EQ("sleep50", string(strings::charptr(envelope.header.data()), envelope.header.size()));
+
+  for (const auto& k_v : GetMethodStats()) {
+    if (k_v.first == "client/hedged_test") {
+      EXPECT_EQ(1000 * 10 + 2 * 7, k_v.second.request_bytes);
+    }
+  }
+  FLAGS_rpc_hedge_percentile = 0;
+}
+
+TEST(UnixSocketTest, Call) {
+  IoContextPool pool(1);
+  pool.Run();
+  TestInterface service;
+  std::unique_ptr<AcceptServer> server(new AcceptServer(&pool));
+  string path = absl::StrCat(testing::TempDir(), "rpc_test_", getpid(), ".sock");
+  server->AddUnixListener(path, &service);
+  server->Run();
+
+  std::unique_ptr<Channel> channel(new Channel("unix:" + path, "", &pool.GetNextContext()));
+  system::error_code ec = channel->Connect(1000);
+  ASSERT_FALSE(ec) << ec.message();
+
+  Envelope envelope;
+  envelope.letter.resize_fill(1000, 3);
+  ec = channel->SendSync(1000, &envelope);
+  EXPECT_FALSE(ec) << ec.message();
+  EXPECT_EQ(1000, envelope.letter.size());
+
+  channel.reset();
+  server.reset();
+  pool.Stop();
+}
+
 TEST_F(RpcTest, Sleep) {
   string header("sleep20");
 
@@ -207,6 +511,60 @@ TEST_F(RpcTest, Sleep) {
   ASSERT_FALSE(ec) << ec.message();  // expect normal execution.
 }
 
+TEST_F(RpcTest, Deadline) {
+  FLAGS_rpc_send_deadline = true;
+
+  Envelope envelope;
+  Copy(string("wait"), &envelope.header);
+  system::error_code ec = channel_->SendSync(20, &envelope);
+  ASSERT_EQ(asio::error::timed_out, ec) << ec.message();
+
+  // The bridge serves one call at a time, so this one runs only once the server cancelled
+  // the previous call.
+  envelope.Clear();
+  envelope.letter.resize_fill(10, 1);
+  ec = channel_->SendSync(1000, &envelope);
+  EXPECT_FALSE(ec) << ec.message();
+  FLAGS_rpc_send_deadline = false;
+}
+
+TEST_F(RpcTest, Throttled) {
+  // Every connection waits for its responses to be flushed before it reads the next request.
+  AdmissionLimits limits;
+  limits.max_inflight = 1;
+  limits.max_queued_bytes = 1;
+  service_->set_connection_limits(limits);
+
+  // The responses are written into the envelopes, hence every call has its own.
+  std::vector<Envelope> envelopes(20);
+  std::vector<Channel::future_code_t> fcs;
+  for (Envelope& envelope : envelopes) {
+    envelope.header.resize_fill(14, 1);
+    envelope.letter.resize_fill(42, 2);
+    fcs.push_back(channel_->Send(1000, &envelope));
+  }
+  for (auto& fc : fcs) {
+    EXPECT_FALSE(fc.get());
+  }
+}
+
+TEST_F(RpcTest, Drain) {
+  server_->set_drain_timeout(chrono::milliseconds(1000));
+
+  Envelope envelope;
+  Copy(string("sleep50"), &envelope.header);
+  envelope.letter.resize_fill(42, 2);
+  Channel::future_code_t fc = channel_->Send(1000, &envelope);
+
+  // Stops the server while the call is in flight, it still gets its response.
+  std::this_thread::sleep_for(chrono::milliseconds(10));
+  uint64_t start = GetMonotonicMicros();
+  server_->Stop(true);
+  EXPECT_GT(GetMonotonicMicros() - start, 20000u);
+  EXPECT_FALSE(fc.get());
+  EXPECT_EQ(42u, envelope.letter.size());
+}
+
 static void BM_ChannelConnection(benchmark::State& state) {
   IoContextPool pool(1);
   pool.Run();
@@ -58,6 +58,18 @@ void TestBridge::HandleEnvelope(uint64_t rpc_id, Envelope* envelope, EnvelopeWri
   writer(std::move(*envelope));
 }
 
+void TestBridge::HandleEnvelope(uint64_t rpc_id, Envelope* envelope, EnvelopeWriter writer,
+                                std::shared_ptr<const CallContext> ctx) {
+  absl::string_view header(strings::charptr(envelope->header.data()), envelope->header.size());
+  if (header != "wait")
+    return HandleEnvelope(rpc_id, envelope, std::move(writer));
+
+  for (unsigned i = 0; i < 5000 && !ctx->cancelled(); ++i) {
+    this_fiber::sleep_for(milliseconds(1));
+  }
+  writer(std::move(*envelope));
+}
+
 ServerTest::ServerTest() {}
 
 void ServerTest::SetUp() {
@@ -35,6 +35,10 @@ class TestBridge final : public ConnectionBridge {
   // HandleEnvelope reads first the input and if everything is parsed fine, it sends
   // back another header, letter pair.
   void HandleEnvelope(uint64_t rpc_id, Envelope* envelope, EnvelopeWriter writer) final;
+
+  // Handles "wait" requests, which wait until they are cancelled.
+  void HandleEnvelope(uint64_t rpc_id, Envelope* envelope, EnvelopeWriter writer,
+                      std::shared_ptr<const CallContext> ctx) final;
 };
 
 class TestInterface final : public ServiceInterface {
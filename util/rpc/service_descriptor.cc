@@ -3,6 +3,8 @@
 //
 #include "util/rpc/service_descriptor.h"
 
+#include "util/trace/trace.h"
+
 namespace util {
 
 // RPC-Server side part.
@@ -19,6 +21,35 @@ void ServiceDescriptor::SetOptions(size_t index, const MethodOptions& opts) {
   methods_[index].options = opts;
 }
 
+util::Status ServiceDescriptor::Invoke(size_t i, const Message& req, Message* resp,
+                                       size_t request_bytes) const {
+  const Method& m = methods_[i];
+  trace::ScopedSpan span(m.name);
+  uint64_t start = m.recorder.Start(request_bytes);
+  util::Status st = m.single_rpc_method(req, resp);
+  if (!st.ok())
+    span.set_error();
+  m.recorder.Finish(start, !st.ok(), st.ok() ? resp->ByteSizeLong() : 0);
+  return st;
+}
+
+util::Status ServiceDescriptor::InvokeStream(size_t i, const Message& req,
+                                             StreamItemWriter writer,
+                                             size_t request_bytes) const {
+  const Method& m = methods_[i];
+  trace::ScopedSpan span(m.name);
+  size_t response_bytes = 0;
+  uint64_t start = m.recorder.Start(request_bytes);
+  util::Status st = m.stream_rpc_method(req, [&](const Message* item) {
+    if (item)
+      response_bytes += item->ByteSizeLong();
+    writer(item);
+  });
+  m.recorder.Finish(start, !st.ok(), response_bytes);
+  if (!st.ok())
+    span.set_error();
+  return st;
+}
 
 }  // namespace rpc
 }  // namespace util
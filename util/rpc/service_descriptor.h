@@ -8,6 +8,7 @@
 #include <google/protobuf/message.h>
 
 #include "absl/strings/string_view.h"
+#include "util/rpc/rpc_stats.h"
 #include "util/status.h"
 
 namespace util {
@@ -21,12 +22,18 @@ class ServiceDescriptor {
   struct MethodOptions {
     // Must be power of 2. If not - will be quietly rounded up to power of 2.
     uint32_t async_level = 0;
+
+    // Running the method more than once has the same effect as running it once, hence
+    // the clients may hedge and retry its calls. See BalancedChannel::CallOptions.
+    bool idempotent = false;
   };
 
   using Message = ::google::protobuf::Message;
   using StreamItemWriter = std::function<void(const Message*)>;
-  using RpcMethodCb = std::function<util::Status(const Message&, Message* msg) noexcept>;
-  using RpcStreamMethodCb = std::function<util::Status(const Message&, StreamItemWriter) noexcept>;
+  // The callbacks must not throw. noexcept is not part of the signatures since std::function
+  // does not support noexcept function types in C++17.
+  using RpcMethodCb = std::function<util::Status(const Message&, Message* msg)>;
+  using RpcStreamMethodCb = std::function<util::Status(const Message&, StreamItemWriter)>;
 
   ServiceDescriptor();
 
@@ -40,6 +47,12 @@ class ServiceDescriptor {
 
   void SetOptions(size_t index, const MethodOptions& opts);
 
+  // Runs the method i and records the call in its stats, which are named "server/<method name>".
+  // request_bytes is the size of the request envelope.
+  util::Status Invoke(size_t i, const Message& req, Message* resp, size_t request_bytes) const;
+  util::Status InvokeStream(size_t i, const Message& req, StreamItemWriter writer,
+                            size_t request_bytes) const;
+
   // Must be in header file due to size() accessor.
   // Must be public because RpcBridge needs to access it.
   // Static descriptor helping rpc framework to reroute generic on-wire envelopes to
@@ -56,17 +69,21 @@ class ServiceDescriptor {
     const Message* default_req = nullptr;
     const Message* default_resp = nullptr;
 
+    MethodRecorder recorder;
+
     // Simple RPC
     Method(std::string n, RpcMethodCb c, const Message& dreq, const Message& dresp)
         : name(std::move(n)),
           single_rpc_method(std::move(c)),
           default_req(&dreq),
-          default_resp(&dresp) {
+          default_resp(&dresp),
+          recorder("server/" + name) {
     }
 
     // Streaming RPC.
     Method(std::string n, RpcStreamMethodCb c, const Message& dreq)
-        : name(std::move(n)), stream_rpc_method(std::move(c)), default_req(&dreq) {
+        : name(std::move(n)), stream_rpc_method(std::move(c)), default_req(&dreq),
+          recorder("server/" + name) {
     }
   };
 
@@ -4,16 +4,28 @@
 #include "util/sentry/sentry.h"
 
 #include <boost/beast/http/write.hpp>  // For serializing req/resp to ostream
+#include <boost/fiber/condition_variable.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <boost/fiber/operations.hpp>
 #include <cstring>
+#include <unordered_map>
 
 #include "base/logging.h"
 #include <glog/raw_logging.h>
 
+#include "absl/strings/str_format.h"
 #include "strings/strcat.h"
 #include "util/asio/glog_asio_sink.h"
 #include "util/http/http_client.h"
+#include "util/stats/varz_stats.h"
 
 DEFINE_string(sentry_dsn, "", "Sentry DSN in the format <pivatekey>@hostname/<project_id>");
+DEFINE_uint32(sentry_flush_ms, 1000, "How often the pending sentry events are sent");
+DEFINE_uint32(sentry_max_events_per_min, 60,
+              "The events above the rate are dropped. The repeats of an event within "
+              "--sentry_flush_ms are sent as a single event and count once");
+
+DEFINE_VARZ(VarzMapCount, sentry_events);
 
 namespace util {
 using namespace ::boost;
@@ -21,16 +33,39 @@ using namespace ::std;
 
 namespace {
 
+void AppendJsonString(StringPiece src, string* dest) {
+  dest->push_back('"');
+  for (char c : src) {
+    if (c == '"' || c == '\\') {
+      dest->push_back('\\');
+      dest->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      absl::StrAppendFormat(dest, "\\u%04x", c);
+    } else {
+      dest->push_back(c);
+    }
+  }
+  dest->push_back('"');
+}
+
 struct Dsn {
   string key;
   string hostname;
   string url;
 };
 
+/*
+  The logging threads only push the errors into the bounded queue of GlogAsioSink, so that the
+  error storms do not slow down the requests. HandleItem() collects them by culprit, i.e. by the
+  file and the line, and the flush fiber sends every --sentry_flush_ms the distinct ones with
+  their repeat counts over a keep-alive connection, limited to --sentry_max_events_per_min.
+*/
 class SentrySink : public GlogAsioSink {
  public:
   explicit SentrySink(Dsn dsn, IoContext* io_context);
 
+  void Run() final;
+
  protected:
   void HandleItem(const Item& item) final;
 
@@ -40,16 +75,39 @@ class SentrySink : public GlogAsioSink {
 
   void Cancel() final {
     GlogAsioSink::Cancel();
-    client_.Shutdown();
     VLOG(1) << "Sentry::Cancel End";
   }
 
  private:
-  string GenSentryBody(const Item& item);
+  struct Event {
+    Item item;
+    unsigned repeats = 0;
+  };
+
+  // Since the events are collected and flushed by the fibers of the same thread, the pending
+  // ones need no locking.
+  static constexpr unsigned kMaxPending = 128;
+
+  void FlushLoop();
+  void Flush();
+  void SendEvent(const Event& event);
+  bool TakeToken();
+
+  string GenSentryBody(const Event& event);
 
   http::Client client_;
   Dsn dsn_;
   string port_;
+
+  std::vector<Event> pending_;
+  std::unordered_map<string, size_t> pending_index_;  // culprit -> index in pending_.
+
+  double tokens_;
+  std::chrono::steady_clock::time_point last_refill_;
+
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable stop_cv_;
+  bool stopped_ = false;
 };
 
 /* The structure is as follows:
@@ -61,7 +119,9 @@ curl  -H 'X-Sentry-Auth: Sentry sentry_version=6, sentry_key=<private-key>' -i
 
 */
 
-SentrySink::SentrySink(Dsn dsn, IoContext* io_context) : client_(io_context), dsn_(std::move(dsn)) {
+SentrySink::SentrySink(Dsn dsn, IoContext* io_context)
+    : client_(io_context), dsn_(std::move(dsn)), tokens_(FLAGS_sentry_max_events_per_min),
+      last_refill_(std::chrono::steady_clock::now()) {
   size_t pos = dsn_.hostname.find(':');
   if (pos != string::npos) {
     port_ = dsn_.hostname.substr(pos + 1);
@@ -77,34 +137,112 @@ SentrySink::SentrySink(Dsn dsn, IoContext* io_context) : client_(io_context), ds
   dsn_.url = absl::StrCat("/api", dsn_.url, "/store/");
 }
 
+void SentrySink::Run() {
+  fibers::fiber flush_fiber(&SentrySink::FlushLoop, this);
+
+  GlogAsioSink::Run();
+
+  {
+    std::lock_guard<fibers::mutex> lk(mu_);
+    stopped_ = true;
+  }
+  stop_cv_.notify_one();
+  flush_fiber.join();
+  client_.Shutdown();
+}
+
 void SentrySink::HandleItem(const Item& item) {
-  auto ec = client_.Connect(dsn_.hostname, port_);
-  if (ec) {
-    auto msg = ec.message();
-    RAW_VLOG(1, "Could not connect %s", msg.c_str());
-    ++lost_messages_;
+  string culprit = absl::StrCat(item.base_filename, ":", item.line);
+  auto it = pending_index_.find(culprit);
+  if (it != pending_index_.end()) {
+    ++pending_[it->second].repeats;
+    sentry_events.Inc("deduped");
     return;
   }
+  if (pending_.size() >= kMaxPending) {
+    sentry_events.Inc("dropped");
+    return;
+  }
+  pending_index_.emplace(std::move(culprit), pending_.size());
+  pending_.push_back(Event{item, 1});
+}
+
+void SentrySink::FlushLoop() {
+  const auto period = std::chrono::milliseconds(std::max(1u, FLAGS_sentry_flush_ms));
+  bool stopped = false;
+  while (!stopped) {
+    {
+      std::unique_lock<fibers::mutex> lk(mu_);
+      stopped = stop_cv_.wait_for(lk, period, [this] { return stopped_; });
+    }
+    Flush();
+  }
+}
+
+void SentrySink::Flush() {
+  std::vector<Event> events;
+  events.swap(pending_);
+  pending_index_.clear();
+
+  for (const Event& event : events) {
+    if (!TakeToken()) {
+      sentry_events.Inc("rate_limited");
+      continue;
+    }
+    SendEvent(event);
+  }
+}
+
+bool SentrySink::TakeToken() {
+  auto now = std::chrono::steady_clock::now();
+  double minutes = std::chrono::duration<double>(now - last_refill_).count() / 60;
+  last_refill_ = now;
+
+  double limit = FLAGS_sentry_max_events_per_min;
+  tokens_ = std::min(limit, tokens_ + minutes * limit);
+  if (tokens_ < 1)
+    return false;
+  tokens_ -= 1;
+  return true;
+}
+
+void SentrySink::SendEvent(const Event& event) {
+  // The connection is kept alive between the events and the flushes.
+  if (!client_.IsReusable()) {
+    client_.Shutdown();
+    auto ec = client_.Connect(dsn_.hostname, port_);
+    if (ec) {
+      auto msg = ec.message();
+      RAW_VLOG(1, "Could not connect %s", msg.c_str());
+      ++lost_messages_;
+      sentry_events.Inc("failed");
+      return;
+    }
+  }
 
   http::Client::Response resp;
-  string body = GenSentryBody(item);
-  ec = client_.Send(http::Client::Verb::post, dsn_.url, body, &resp);
+  string body = GenSentryBody(event);
+  auto ec = client_.Send(http::Client::Verb::post, dsn_.url, body, &resp);
 
   if (ec) {
     RAW_VLOG(1, "Could not send ");
     ++lost_messages_;
+    sentry_events.Inc("failed");
+  } else {
+    sentry_events.Inc("sent");
   }
 }
 
-string SentrySink::GenSentryBody(const Item& item) {
-  string res = absl::StrCat(R"({"culprit":")", item.base_filename, ":", item.line,
-                            R"(", "server_name":"TBD")");
+string SentrySink::GenSentryBody(const Event& event) {
+  const Item& item = event.item;
+  string culprit = absl::StrCat(item.base_filename, ":", item.line);
+  string res = absl::StrCat(R"({"culprit":")", culprit, R"(", "server_name":"TBD")");
 
-  absl::StrAppend(&res,
-                  ",\n"
-                  R"( "message":")",
-                  item.message,
-                  R"(", "level":"error", "platform": "c++", "sdk": {"name": "sentry-cpp",
+  absl::StrAppend(&res, ",\n", R"( "message":)");
+  AppendJsonString(item.message, &res);
+  absl::StrAppend(&res, R"(, "fingerprint":[")", culprit, R"("], "extra":{"repeats":)",
+                  event.repeats, "},\n");
+  absl::StrAppend(&res, R"( "level":"error", "platform": "c++", "sdk": {"name": "sentry-cpp",
                   "version": "1.0.0"}, "timestamp":")");
   absl::StrAppend(&res, 1900 + item.tm_time.tm_year, "-", item.tm_time.tm_mon + 1, "-",
                   item.tm_time.tm_mday, "T", item.tm_time.tm_hour, ":", item.tm_time.tm_min, ":",
@@ -9,6 +9,7 @@
 #include "util/http/http_testing.h"
 
 DECLARE_string(sentry_dsn);
+DECLARE_uint32(sentry_flush_ms);
 
 namespace util {
 
@@ -48,5 +49,29 @@ TEST_F(SentryTest, Basic) {
   EXPECT_EQ(1, req_);
 }
 
+TEST_F(SentryTest, Dedup) {
+  listener_.RegisterCb("/api/id/store/", false,
+      [this](const http::QueryArgs& args, http::HttpHandler::SendFunction* send) mutable {
+    this->req_++;
+    return send->Invoke(http::MakeStringResponse(h2::status::ok));
+  });
+
+  FLAGS_sentry_dsn = absl::StrCat("foo@localhost:", port_, "/id");
+  FLAGS_sentry_flush_ms = 50;
+  EnableSentry(&pool_->GetNextContext());
+
+  // The repeats of the same error are sent once.
+  for (unsigned i = 0; i < 10; ++i) {
+    LOG(ERROR) << "Repeated " << i;
+  }
+  for (unsigned i = 0; i < 100 && req_ == 0; ++i) {
+    this_fiber::sleep_for(10ms);
+  }
+  this_fiber::sleep_for(100ms);
+  FLAGS_sentry_flush_ms = 1000;
+
+  EXPECT_EQ(1, req_);
+}
+
 
 }  // namespace util
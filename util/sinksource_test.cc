@@ -1,13 +1,16 @@
+#include <bzlib.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <gtest/gtest.h>
 #include <algorithm>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "base/fixed.h"
 #include "base/logging.h"
 
+#include "util/bzip_source.h"
 #include "util/zlib_source.h"
 #include "util/zstd_sinksource.h"
 
@@ -155,6 +158,78 @@ TEST_F(SourceTest, MultipleStreams) {
   EXPECT_EQ(original_.size() * 2, read);
 }
 
+static string BzipCompress(const string& src, int level) {
+  unsigned int dest_len = src.size() + src.size() / 100 + 600;
+  string dest(dest_len, '\0');
+  CHECK_EQ(BZ_OK, BZ2_bzBuffToBuffCompress(&dest[0], &dest_len, const_cast<char*>(src.data()),
+                                           src.size(), level, 0, 0));
+  dest.resize(dest_len);
+  return dest;
+}
+
+static string ReadAll(Source* src) {
+  string res;
+  std::array<uint8, 4097> buf;
+  while (true) {
+    auto result = src->Read(strings::MutableByteRange(buf));
+    CHECK(result.ok()) << result.status;
+    if (result.obj == 0)
+      break;
+    res.append(reinterpret_cast<const char*>(buf.data()), result.obj);
+  }
+  return res;
+}
+
+TEST(BzipSourceTest, Blocks) {
+  std::mt19937 rand(10);
+  string data;
+  for (unsigned i = 0; i < 150000; ++i) {
+    data.append(std::to_string(rand() % 1000)).push_back(i % 10 ? ' ' : '\n');
+  }
+  data.append(3000000, 'x');  // expands a lot more than the block size.
+  for (unsigned i = 0; i < 100000; ++i) {
+    data.push_back('a' + rand() % 26);
+  }
+
+  // Two streams, like pbzip2 writes, with several blocks each.
+  string compressed = BzipCompress(data, 1) + BzipCompress(data, 2);
+  string expected = data + data;
+
+  BzipSource::BlockExecutor thread_executor = [](unsigned count,
+                                                 std::function<void(unsigned)> fn) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < count; ++i)
+      threads.emplace_back(fn, i);
+    for (auto& t : threads)
+      t.join();
+  };
+
+  for (unsigned num_blocks : {1, 3, 8}) {
+    BzipSource src(new StringSource(compressed, 10000), num_blocks, thread_executor);
+    EXPECT_EQ(expected, ReadAll(&src)) << num_blocks;
+  }
+
+  BzipSource seq_src(new StringSource(compressed), 4, nullptr);
+  EXPECT_EQ(expected, ReadAll(&seq_src));
+
+  string single = BzipCompress(data, 1);
+  BzipSource stream_src(new StringSource(single, 10000));
+  EXPECT_EQ(data, ReadAll(&stream_src));
+
+  // Truncated input.
+  string truncated = single.substr(0, single.size() / 2);
+  BzipSource trunc_src(new StringSource(truncated), 4, nullptr);
+  std::array<uint8, 1 << 16> buf;
+  Status status;
+  while (status.ok()) {
+    auto result = trunc_src.Read(strings::MutableByteRange(buf));
+    status = result.status;
+    if (result.ok() && result.obj == 0)
+      break;
+  }
+  EXPECT_FALSE(status.ok());
+}
+
 class ZstdSourceTest : public testing::Test {};
 
 TEST_F(ZstdSourceTest, Basic) {
@@ -185,4 +260,63 @@ TEST_F(ZstdSourceTest, Basic) {
   }
 }
 
+TEST_F(ZstdSourceTest, Seekable) {
+  string original;
+  std::mt19937 rng(0);
+  for (unsigned i = 0; i < 300000; ++i) {
+    original.append(std::to_string(rng() % 1000)).push_back(',');
+  }
+
+  StringSink* compressed = new StringSink;
+  ZStdSink zstd_compress(compressed);
+
+  ZStdSink::Options opts;
+  opts.level = 3;
+  opts.workers = 2;
+  opts.long_distance = true;
+  opts.window_log = 28;
+  opts.seekable_frame_size = 100000;
+  ASSERT_TRUE(zstd_compress.Init(opts).ok());
+  for (size_t pos = 0; pos < original.size(); pos += 7777) {
+    auto status = zstd_compress.Append(ToByteRange(original.substr(pos, 7777)));
+    ASSERT_TRUE(status.ok()) << status;
+  }
+  ASSERT_TRUE(zstd_compress.Flush().ok());
+  const string& contents = compressed->contents();
+
+  // The stream decompresses as a whole.
+  {
+    ZStdSource zstd_src(new StringSource(contents, 1000));
+    string buf(original.size() + 10, '\0');
+    auto result = zstd_src.Read(AsMutableByteRange(buf));
+    ASSERT_TRUE(result.ok()) << result.status;
+    buf.resize(result.obj);
+    EXPECT_TRUE(original == buf);
+  }
+
+  // And every frame decompresses by itself.
+  vector<ZStdSeekEntry> entries;
+  ASSERT_TRUE(ParseZStdSeekTable(ToByteRange(contents), &entries));
+  ASSERT_EQ((original.size() + 99999) / 100000, entries.size());
+
+  size_t offset = 0, raw_offset = 0;
+  for (const ZStdSeekEntry& e : entries) {
+    string frame = contents.substr(offset, e.compressed_size);
+    ZStdSource zstd_src(new StringSource(frame));
+    string buf(e.decompressed_size + 10, '\0');
+    auto result = zstd_src.Read(AsMutableByteRange(buf));
+    ASSERT_TRUE(result.ok()) << result.status;
+    ASSERT_EQ(e.decompressed_size, result.obj);
+    buf.resize(result.obj);
+    EXPECT_TRUE(original.substr(raw_offset, e.decompressed_size) == buf);
+
+    offset += e.compressed_size;
+    raw_offset += e.decompressed_size;
+  }
+  EXPECT_EQ(original.size(), raw_offset);
+
+  StringPiece truncated(contents.data(), contents.size() - 1);
+  EXPECT_FALSE(ParseZStdSeekTable(ToByteRange(truncated), &entries));
+}
+
 }  // namespace util
@@ -90,9 +90,17 @@ class SingleProducerTaskPoolBase {
   // This function blocks until the pool in the state where each thread was in the state of
   // not having eny tasks to run at least one. It does not guarantee that tasks were added later.
   // It's for responsibility of the calling thread not to run tasks while waiting on
-  // WaitForTasksToComplete.
+  // WaitForTasksToComplete. Ends the current batch, if any.
   void WaitForTasksToComplete();
 
+  // Between BeginBatch() and EndBatch() the pool does not wake up the worker threads per task.
+  // Instead EndBatch() wakes up once every thread that got tasks during the batch, so that
+  // a burst of small tasks does not cost a wake up per task. The threads whose queues become
+  // full are woken up right away. The workers that are running already pick up the tasks
+  // without being woken up.
+  void BeginBatch() { batching_ = true; }
+  void EndBatch();
+
   unsigned thread_count() const {
     return thread_count_;
   }
@@ -114,7 +122,25 @@ class SingleProducerTaskPoolBase {
   void LaunchThreads();
   void JoinThreads();
 
-  unsigned FindMostFreeThread() const;
+  // Picks the less loaded of two threads: the next one in round robin order and a random one.
+  // Balances almost as well as scanning all the threads but in O(1).
+  unsigned FindMostFreeThread();
+
+  // Wakes up the thread or defers it until the end of the batch.
+  void WakeThread(unsigned index) {
+    if (batching_)
+      wake_pending_[index] = true;
+    else
+      thread_info_[index].Wake();
+  }
+
+  // Wakes up the thread if it has a deferred wake up.
+  void WakePending(unsigned index) {
+    if (wake_pending_[index]) {
+      wake_pending_[index] = false;
+      thread_info_[index].Wake();
+    }
+  }
 
   // We use this Interface in order to separate work pool base code from c++ template wrapping
   // logic.
@@ -156,6 +182,15 @@ class SingleProducerTaskPoolBase {
 
   std::unique_ptr<ThreadInfo[]> thread_info_;
   std::vector<std::unique_ptr<ThreadLocalInterface>> thread_interfaces_;
+
+ private:
+  unsigned Score(unsigned index) const;
+
+  // Producer state.
+  bool batching_ = false;
+  std::unique_ptr<bool[]> wake_pending_;
+  unsigned next_thread_ = 0;
+  uint32_t rand_state_ = 1;
 };
 
 GENERATE_TYPE_MEMBER_WITH_DEFAULT(SharedDataOrEmptyTuple, SharedData, std::tuple<>);
@@ -251,11 +286,10 @@ class SingleProducerTaskPool : public detail::SingleProducerTaskPoolBase {
     QueueTaskImpl* t = static_cast<QueueTaskImpl*>(thread_interfaces_[index].get());
 
     if (t->queue_.write(std::forward<Args>(args)...)) {
-      auto& ti = thread_info_[index];
-      ti.Wake();
-
+      WakeThread(index);
       return true;
     }
+    WakePending(index);  // The full queue can not wait for the end of the batch.
 
     return false;
   }
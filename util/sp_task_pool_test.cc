@@ -3,6 +3,8 @@
 //
 #include <gmock/gmock.h>
 
+#include <thread>
+
 #include "base/logging.h"
 
 #include "util/sp_task_pool.h"
@@ -114,6 +116,62 @@ TEST_F(SPTaskPoolTest, Queue) {
   EXPECT_THAT(dest.ops, ElementsAre(CONST_ARG, MOVE_ASSIGN));
 }
 
+TEST_F(SPTaskPoolTest, QueueBulk) {
+  folly::ProducerConsumerQueue<string> q(5);
+  string items[6] = {"a", "b", "c", "d", "e", "f"};
+  string dest[6];
+
+  EXPECT_EQ(0, q.readBulk(dest, 6));
+  ASSERT_EQ(4, q.writeBulk(items, 6));  // one slot is always free.
+  EXPECT_TRUE(q.isFull());
+  EXPECT_EQ(0, q.writeBulk(items + 4, 2));
+
+  ASSERT_EQ(3, q.readBulk(dest, 3));
+  EXPECT_THAT(vector<string>(dest, dest + 3), ElementsAre("a", "b", "c"));
+
+  // Wraps around the end of the ring.
+  ASSERT_EQ(2, q.writeBulk(items + 4, 2));
+  ASSERT_TRUE(q.write("g"));
+  EXPECT_FALSE(q.write("h"));
+
+  ASSERT_EQ(4, q.readBulk(dest, 6));
+  EXPECT_THAT(vector<string>(dest, dest + 4), ElementsAre("d", "e", "f", "g"));
+  EXPECT_TRUE(q.isEmpty());
+}
+
+TEST_F(SPTaskPoolTest, QueueThreads) {
+  constexpr unsigned kItems = 20000;
+  folly::ProducerConsumerQueue<unsigned> q(64);
+
+  std::thread producer([&] {
+    unsigned items[7];
+    for (unsigned i = 0; i < kItems;) {
+      unsigned n = std::min(7U, kItems - i);
+      for (unsigned j = 0; j < n; ++j)
+        items[j] = i + j;
+      for (unsigned j = 0; j < n;) {
+        size_t res = q.writeBulk(items + j, n - j);
+        if (!res)
+          std::this_thread::yield();
+        j += res;
+      }
+      i += n;
+    }
+  });
+
+  unsigned dest[10], next = 0;
+  while (next < kItems) {
+    size_t n = q.readBulk(dest, 10);
+    if (!n)
+      std::this_thread::yield();
+    for (size_t j = 0; j < n; ++j) {
+      ASSERT_EQ(next++, dest[j]);
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(q.isEmpty());
+}
+
 TEST_F(SPTaskPoolTest, Basic) {
   SingleProducerTaskPool<CheckCtorTask> pool("test", 2, 1);
   vector<Op> result;
@@ -182,6 +240,40 @@ TEST_F(SPTaskPoolTest, Finalize) {
   EXPECT_GT(count, 0);
 }
 
+struct CountTask {
+  typedef std::atomic<int>* SharedData;
+  SharedData count = nullptr;
+
+  void operator()(int val) {
+    count->fetch_add(val, std::memory_order_relaxed);
+  }
+
+  void InitShared(const SharedData& s) {
+    count = s;
+  }
+};
+
+TEST_F(SPTaskPoolTest, Batch) {
+  SingleProducerTaskPool<CountTask> pool("batch", 4, 3);
+  std::atomic<int> count{0};
+  pool.SetSharedData(&count);
+  pool.Launch();
+
+  // Overflows the queues, their threads are woken up before the end of the batch.
+  pool.BeginBatch();
+  for (int i = 0; i < 1000; ++i)
+    pool.RunTask(1);
+  pool.EndBatch();
+  pool.WaitForTasksToComplete();
+  EXPECT_EQ(1000, count.load());
+
+  // WaitForTasksToComplete ends the batch.
+  pool.BeginBatch();
+  pool.RunTask(1);
+  pool.WaitForTasksToComplete();
+  EXPECT_EQ(1001, count.load());
+}
+
 struct NoOpTask {
   void operator()(int ) {
   }
@@ -202,6 +294,20 @@ static void BM_PoolRun(benchmark::State& state) {
 }
 BENCHMARK(BM_PoolRun)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(16);
 
+static void BM_PoolRunBatch(benchmark::State& state) {
+  NoOpPool pool("test", 40, state.range(0));
+  pool.Launch();
+  volatile int val = 10;
+
+  pool.BeginBatch();
+  while (state.KeepRunning()) {
+    pool.RunTask(val);
+  }
+
+  pool.WaitForTasksToComplete();
+}
+BENCHMARK(BM_PoolRunBatch)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(16);
+
 
 static void BM_PoolTryRun(benchmark::State& state) {
   TaskNoSharedPool pool("test", 40);
@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "base/atomic_wrapper.h"
+#include "base/hdr_histogram.h"
 #include "base/integral_types.h"
 #include "base/logging.h"
 
@@ -93,6 +94,31 @@ public:
 template<unsigned NUM, unsigned PRECISION> using SlidingSecondCounter =
     SlidingSecondCounterT<uint32, NUM, PRECISION>;
 
+// Rotates HdrHistograms like SlidingSecondCounterT rotates its counts, hence the quantiles of
+// the recent bins. Not thread-safe.
+template<unsigned NUM, unsigned PRECISION> class SlidingHistogramT : public SlidingSecondBase {
+  mutable base::HdrHistogram hist_[NUM];
+
+  // Clears the bins that became stale and returns the latest bin.
+  unsigned MoveTsIfNeeded() const;
+
+public:
+  static constexpr unsigned SIZE = NUM;
+  static constexpr unsigned SPAN = PRECISION*NUM;
+
+  SlidingHistogramT() {
+    static_assert(NUM > 1, "Invalid window size");
+  }
+
+  void Add(uint64 value) { hist_[MoveTsIfNeeded()].Add(value); }
+
+  // Merges last count bins into dest, starting from (last_ts_ - offset) and going back.
+  // offset + cnt must be less or equal to NUM.
+  void MergeLast(unsigned offset, unsigned count, base::HdrHistogram* dest) const;
+
+  static unsigned bin_span() {return PRECISION; }
+};
+
 class QPSCount {
   // We store 1s resolution in 10 cells window.
   // This way we can reliable read 9 already finished counts when we have another 1
@@ -160,6 +186,34 @@ T SlidingSecondCounterT<T, NUM, PRECISION>::SumLast(unsigned offset, unsigned co
   return sum;
 }
 
+template<unsigned NUM, unsigned PRECISION>
+    unsigned SlidingHistogramT<NUM, PRECISION>::MoveTsIfNeeded() const {
+  uint32 current_time = CurrentTime() / PRECISION;
+  uint32 last_ts = last_ts_.load(std::memory_order_relaxed);
+  if (last_ts >= current_time) {
+    return last_ts % NUM;
+  }
+  uint32 start = last_ts + NUM <= current_time ? current_time + 1 - NUM : last_ts + 1;
+  for (uint32 i = start; i <= current_time; ++i) {
+    hist_[i % NUM].Clear();
+  }
+  last_ts_.store(current_time, std::memory_order_relaxed);
+  return current_time % NUM;
+}
+
+template<unsigned NUM, unsigned PRECISION>
+void SlidingHistogramT<NUM, PRECISION>::MergeLast(unsigned offset, unsigned count,
+                                                  base::HdrHistogram* dest) const {
+  if (count > NUM - offset) {
+    count = NUM - offset;
+  }
+  int32 start = MoveTsIfNeeded() - offset - count + 1;
+  if (start < 0) start += NUM;
+  for (unsigned i = 0; i < count; ++i) {
+    dest->Merge(hist_[(start + i) % NUM]);
+  }
+}
+
 }  // namespace util
 
 #endif  // _UTIL_SLIDING_COUNTER_H
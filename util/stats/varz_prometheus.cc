@@ -0,0 +1,186 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/stats/varz_prometheus.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "base/pthread_utils.h"
+#include "util/stats/varz_stats.h"
+
+DEFINE_uint32(varz_snapshot_ms, 5000, "Period of rebuilding the varz snapshot for /metrics");
+
+namespace util {
+
+using namespace std;
+using absl::StrAppend;
+
+namespace {
+
+// 1, 2 and 5 times the powers of 10 are limits of base::Histogram buckets.
+constexpr double kBucketBounds[] = {1,   2,   5,   1e1, 2e1, 5e1, 1e2, 2e2, 5e2, 1e3,
+                                    2e3, 5e3, 1e4, 2e4, 5e4, 1e5, 2e5, 5e5, 1e6, 2e6,
+                                    5e6, 1e7, 2e7, 5e7, 1e8, 2e8, 5e8, 1e9};
+
+string SanitizeName(StringPiece name) {
+  string res(name);
+  for (char& c : res) {
+    if (!absl::ascii_isalnum(c) && c != '_' && c != ':')
+      c = '_';
+  }
+  if (res.empty() || absl::ascii_isdigit(res[0]))
+    res.insert(0, 1, '_');
+  return res;
+}
+
+string EscapeLabel(StringPiece val) {
+  string res;
+  for (char c : val) {
+    switch (c) {
+      case '\\':
+        res.append("\\\\");
+        break;
+      case '"':
+        res.append("\\\"");
+        break;
+      case '\n':
+        res.append("\\n");
+        break;
+      default:
+        res.push_back(c);
+    }
+  }
+  return res;
+}
+
+string FormatDouble(double d) {
+  if (std::isnan(d))
+    return "NaN";
+  if (std::isinf(d))
+    return d > 0 ? "+Inf" : "-Inf";
+  return absl::StrCat(d);
+}
+
+// labels are the comma separated label pairs, possibly empty.
+string LabelSet(const string& labels, StringPiece extra = StringPiece{}) {
+  if (labels.empty() && extra.empty())
+    return string{};
+  return absl::StrCat("{", labels, !labels.empty() && !extra.empty() ? "," : "", extra, "}");
+}
+
+// The text format requires the samples of a family to be contiguous, while the nested
+// maps interleave them.
+class FamilyWriter {
+ public:
+  void Write(const string& name, const string& labels, const VarzValue& val, unsigned depth);
+
+  string Finish() const;
+
+ private:
+  struct Family {
+    string name;
+    bool histogram;
+    string samples;
+  };
+
+  string* Samples(const string& name, bool histogram);
+
+  vector<Family> families_;
+  unordered_map<string, size_t> index_;
+};
+
+string* FamilyWriter::Samples(const string& name, bool histogram) {
+  auto res = index_.emplace(name, families_.size());
+  if (res.second)
+    families_.push_back(Family{name, histogram, string{}});
+  return &families_[res.first->second].samples;
+}
+
+void FamilyWriter::Write(const string& name, const string& labels, const VarzValue& val,
+                         unsigned depth) {
+  switch (val.type) {
+    case VarzValue::NUM:
+    case VarzValue::TIME:
+      StrAppend(Samples(name, false), name, LabelSet(labels), " ", val.num, "\n");
+      break;
+    case VarzValue::DOUBLE:
+      StrAppend(Samples(name, false), name, LabelSet(labels), " ", FormatDouble(val.dbl), "\n");
+      break;
+    case VarzValue::STRING:
+      StrAppend(Samples(name, false), name,
+                LabelSet(labels, absl::StrCat("value=\"", EscapeLabel(val.str), "\"")), " 1\n");
+      break;
+    case VarzValue::HISTOGRAM: {
+      const base::Histogram& hist = *val.hist;
+      string* dest = Samples(name, true);
+      for (double bound : kBucketBounds) {
+        StrAppend(dest, name, "_bucket", LabelSet(labels, absl::StrCat("le=\"", bound, "\"")), " ",
+                  hist.CountBelow(bound), "\n");
+      }
+      StrAppend(dest, name, "_bucket", LabelSet(labels, "le=\"+Inf\""), " ", hist.count(), "\n");
+      StrAppend(dest, name, "_sum", LabelSet(labels), " ", FormatDouble(hist.sum()), "\n");
+      StrAppend(dest, name, "_count", LabelSet(labels), " ", hist.count(), "\n");
+      break;
+    }
+    case VarzValue::MAP:
+      for (const auto& k_v : val.key_value_array) {
+        if (depth == 0) {
+          Write(name, absl::StrCat("key=\"", EscapeLabel(k_v.first), "\""), k_v.second, 1);
+        } else {
+          Write(absl::StrCat(name, "_", SanitizeName(k_v.first)), labels, k_v.second, depth + 1);
+        }
+      }
+      break;
+  }
+}
+
+string FamilyWriter::Finish() const {
+  string res;
+  for (const Family& f : families_) {
+    if (f.histogram)
+      StrAppend(&res, "# TYPE ", f.name, " histogram\n");
+    res.append(f.samples);
+  }
+  return res;
+}
+
+shared_ptr<const string> snapshot;  // accessed with atomic_load and atomic_store.
+once_flag snapshot_once;
+
+void RefreshSnapshot() {
+  while (true) {
+    this_thread::sleep_for(chrono::milliseconds(FLAGS_varz_snapshot_ms));
+    atomic_store(&snapshot, shared_ptr<const string>(make_shared<string>(VarzToPrometheus())));
+  }
+}
+
+}  // namespace
+
+string VarzToPrometheus() {
+  FamilyWriter writer;
+  VarzListNode::Iterate([&](const char* name, VarzValue&& val) {
+    writer.Write(SanitizeName(name), string{}, val, 0);
+  });
+  return writer.Finish();
+}
+
+shared_ptr<const string> VarzPrometheusSnapshot() {
+  call_once(snapshot_once, [] {
+    atomic_store(&snapshot, shared_ptr<const string>(make_shared<string>(VarzToPrometheus())));
+
+    // Runs for the lifetime of the process.
+    pthread_t tid = base::StartThread("varz_snapshot", &RefreshSnapshot);
+    PTHREAD_CHECK(detach(tid));
+  });
+  return atomic_load(&snapshot);
+}
+
+}  // namespace util
@@ -0,0 +1,23 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <memory>
+#include <string>
+
+namespace util {
+
+// Returns the varz in the Prometheus text format. Every varz is a metric family named after it.
+// The keys of its map values become the label "key", and the keys of the nested maps become
+// the suffixes of the family names, e.g. rpc_methods_calls{key="server/Get"}.
+// Histograms are exported as cumulative buckets of 1, 2 and 5 times the powers of 10.
+// Walks the live varz, hence is expensive. See VarzPrometheusSnapshot.
+std::string VarzToPrometheus();
+
+// Returns the latest output of VarzToPrometheus, which is rebuilt by a background thread
+// every --varz_snapshot_ms, so frequent scrapers do not walk the varz.
+// The first call builds the snapshot and starts the thread. Thread-safe.
+std::shared_ptr<const std::string> VarzPrometheusSnapshot();
+
+}  // namespace util
@@ -0,0 +1,81 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/stats/varz_prometheus.h"
+
+#include <gmock/gmock.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/stats/varz_stats.h"
+
+namespace util {
+
+using namespace std;
+using testing::HasSubstr;
+using testing::Not;
+
+class VarzPrometheusTest : public testing::Test {};
+
+TEST_F(VarzPrometheusTest, Format) {
+  VarzCount count("test-count");
+  count.IncBy(7);
+  VarzMapCount map_count("test_map");
+  map_count.IncBy("a\"b", 3);
+  VarzFunction func("test_func", [] {
+    base::Histogram hist;
+    hist.Add(1.5);
+    hist.Add(30);
+    hist.Add(3000);
+
+    VarzValue::Map method;
+    method.emplace_back("calls", VarzValue::FromInt(3));
+    method.emplace_back("latency-us", VarzValue::FromHistogram(hist));
+    VarzValue::Map res;
+    res.emplace_back("server/Get", VarzValue(std::move(method)));
+    return res;
+  });
+
+  string text = VarzToPrometheus();
+  EXPECT_THAT(text, HasSubstr("test_count 7\n"));
+  EXPECT_THAT(text, HasSubstr("test_map{key=\"a\\\"b\"} 3\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_calls{key=\"server/Get\"} 3\n"));
+
+  EXPECT_THAT(text, HasSubstr("# TYPE test_func_latency_us histogram\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_latency_us_bucket{key=\"server/Get\",le=\"1\"} 0\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_latency_us_bucket{key=\"server/Get\",le=\"2\"} 1\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_latency_us_bucket{key=\"server/Get\",le=\"50\"} 2\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_latency_us_bucket{key=\"server/Get\",le=\"+Inf\"} 3\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_latency_us_sum{key=\"server/Get\"} 3031.5\n"));
+  EXPECT_THAT(text, HasSubstr("test_func_latency_us_count{key=\"server/Get\"} 3\n"));
+}
+
+TEST_F(VarzPrometheusTest, GroupedFamilies) {
+  VarzFunction func("grouped", [] {
+    VarzValue::Map res;
+    for (const char* method : {"m1", "m2"}) {
+      VarzValue::Map stats;
+      stats.emplace_back("calls", VarzValue::FromInt(1));
+      stats.emplace_back("errors", VarzValue::FromInt(0));
+      res.emplace_back(method, VarzValue(std::move(stats)));
+    }
+    return res;
+  });
+
+  // The samples of a family are contiguous.
+  string text = VarzToPrometheus();
+  EXPECT_THAT(text, HasSubstr("grouped_calls{key=\"m1\"} 1\ngrouped_calls{key=\"m2\"} 1\n"));
+  EXPECT_THAT(text, HasSubstr("grouped_errors{key=\"m1\"} 0\ngrouped_errors{key=\"m2\"} 0\n"));
+}
+
+TEST_F(VarzPrometheusTest, Snapshot) {
+  auto first = VarzPrometheusSnapshot();
+  ASSERT_TRUE(first);
+
+  // Varz that were added after the snapshot show up in the next one only.
+  VarzCount count("snapshot_count");
+  EXPECT_THAT(*VarzPrometheusSnapshot(), Not(HasSubstr("snapshot_count")));
+  EXPECT_EQ(first, VarzPrometheusSnapshot());
+}
+
+}  // namespace util
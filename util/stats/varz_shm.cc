@@ -0,0 +1,363 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/stats/varz_shm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "base/pthread_utils.h"
+#include "base/varint.h"
+#include "base/walltime.h"
+#include "util/stats/varz_stats.h"
+
+DEFINE_string(varz_shm, "",
+              "If set, the varz are published into the shared memory segment of this name, "
+              "e.g. /dev/shm/<name>, for the local readers, see varz_shm_cat");
+DEFINE_uint32(varz_shm_size, 1 << 20, "Capacity of the varz shared memory segment in bytes");
+DEFINE_uint32(varz_shm_ms, 1000, "Period of publishing the varz into the shared memory");
+
+namespace util {
+
+using namespace std;
+
+namespace detail {
+
+// The first page of the segment, followed by the data. The fields after seq are written
+// by the writer while seq is odd.
+struct VarzShmHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t capacity;  // of the data.
+  std::atomic<uint64_t> seq;
+
+  uint64_t publish_usec;
+  uint32_t pid;
+  uint32_t size;  // of the data of the snapshot.
+  uint32_t num_entries;
+  uint32_t truncated;
+};
+
+}  // namespace detail
+
+namespace {
+
+using detail::VarzShmHeader;
+
+constexpr uint64_t kMagic = 0x5a52415641494147ULL;
+constexpr size_t kHeaderSize = 4096;
+
+static_assert(sizeof(VarzShmHeader) <= kHeaderSize, "");
+
+string ShmName(const string& name) { return name[0] == '/' ? name : "/" + name; }
+
+void Flatten(string name, const VarzValue& val, vector<VarzShmEntry>* dest) {
+  auto add_num = [&](string n, int64_t num) {
+    dest->emplace_back();
+    dest->back().name = std::move(n);
+    dest->back().num = num;
+  };
+  auto add_dbl = [&](string n, double dbl) {
+    dest->emplace_back();
+    dest->back().name = std::move(n);
+    dest->back().type = VarzShmEntry::DOUBLE;
+    dest->back().dbl = dbl;
+  };
+
+  switch (val.type) {
+    case VarzValue::NUM:
+    case VarzValue::TIME:
+      add_num(std::move(name), val.num);
+      break;
+    case VarzValue::DOUBLE:
+      add_dbl(std::move(name), val.dbl);
+      break;
+    case VarzValue::STRING:
+      dest->emplace_back();
+      dest->back().name = std::move(name);
+      dest->back().type = VarzShmEntry::STRING;
+      dest->back().str = val.str;
+      break;
+    case VarzValue::HISTOGRAM: {
+      const base::Histogram& hist = *val.hist;
+      add_num(absl::StrCat(name, "/count"), hist.count());
+      add_dbl(absl::StrCat(name, "/sum"), hist.sum());
+      add_dbl(absl::StrCat(name, "/avg"), hist.Average());
+      add_dbl(absl::StrCat(name, "/p50"), hist.Percentile(50));
+      add_dbl(absl::StrCat(name, "/p90"), hist.Percentile(90));
+      add_dbl(absl::StrCat(name, "/p99"), hist.Percentile(99));
+      break;
+    }
+    case VarzValue::MAP:
+      for (const auto& k_v : val.key_value_array) {
+        Flatten(absl::StrCat(name, "/", k_v.first), k_v.second, dest);
+      }
+      break;
+  }
+}
+
+// Every entry is a varint of the name size, the name, the type byte and either 8 bytes of
+// the number or a varint of the string size and the string.
+void Encode(const VarzShmEntry& e, string* dest) {
+  Varint::Append64(dest, e.name.size());
+  dest->append(e.name);
+  dest->push_back(char(e.type));
+  switch (e.type) {
+    case VarzShmEntry::INT:
+      dest->append(reinterpret_cast<const char*>(&e.num), sizeof(e.num));
+      break;
+    case VarzShmEntry::DOUBLE:
+      dest->append(reinterpret_cast<const char*>(&e.dbl), sizeof(e.dbl));
+      break;
+    case VarzShmEntry::STRING:
+      Varint::Append64(dest, e.str.size());
+      dest->append(e.str);
+      break;
+  }
+}
+
+const uint8_t* ParseString(const uint8_t* ptr, const uint8_t* end, string* dest) {
+  uint64_t size = 0;
+  ptr = Varint::Parse64WithLimit(ptr, end, &size);
+  if (!ptr || size > uint64_t(end - ptr))
+    return nullptr;
+  dest->assign(reinterpret_cast<const char*>(ptr), size);
+  return ptr + size;
+}
+
+bool Decode(const string& data, uint32_t num_entries, vector<VarzShmEntry>* dest) {
+  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data.data());
+  const uint8_t* end = ptr + data.size();
+
+  dest->resize(num_entries);
+  for (VarzShmEntry& e : *dest) {
+    ptr = ParseString(ptr, end, &e.name);
+    if (!ptr || ptr == end)
+      return false;
+    e.type = VarzShmEntry::Type(*ptr++);
+    switch (e.type) {
+      case VarzShmEntry::INT:
+      case VarzShmEntry::DOUBLE:
+        if (end - ptr < 8)
+          return false;
+        memcpy(e.type == VarzShmEntry::INT ? static_cast<void*>(&e.num) : &e.dbl, ptr, 8);
+        ptr += 8;
+        break;
+      case VarzShmEntry::STRING:
+        ptr = ParseString(ptr, end, &e.str);
+        if (!ptr)
+          return false;
+        break;
+      default:
+        return false;
+    }
+  }
+  return ptr == end;
+}
+
+bool StartPublisher() {
+  VarzShmWriter* writer = new VarzShmWriter;  // Lives for the lifetime of the process.
+  if (!writer->Open(FLAGS_varz_shm, FLAGS_varz_shm_size)) {
+    delete writer;
+    return false;
+  }
+  writer->Publish(FlattenVarz());
+
+  pthread_t tid = base::StartThread("varz_shm", [writer] {
+    while (true) {
+      this_thread::sleep_for(chrono::milliseconds(FLAGS_varz_shm_ms));
+      writer->Publish(FlattenVarz());
+    }
+  });
+  PTHREAD_CHECK(detach(tid));
+  return true;
+}
+
+}  // namespace
+
+vector<VarzShmEntry> FlattenVarz() {
+  vector<VarzShmEntry> res;
+  VarzListNode::Iterate([&](const char* name, VarzValue&& val) { Flatten(name, val, &res); });
+  return res;
+}
+
+VarzShmWriter::~VarzShmWriter() {
+  if (header_)
+    munmap(header_, map_size_);
+}
+
+bool VarzShmWriter::Open(const string& name, size_t capacity) {
+  CHECK(!header_);
+  CHECK(!name.empty());
+  CHECK_LE(capacity, kuint32max);
+
+  string shm_name = ShmName(name);
+  int fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not open " << shm_name << ": " << strerror(errno);
+    return false;
+  }
+
+  // Resizing a segment that is mapped by the readers would crash them, hence the segment of
+  // another capacity is replaced. Its readers keep reading the previous one until they reopen.
+  size_t map_size = kHeaderSize + capacity;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size != 0 && size_t(st.st_size) != map_size) {
+    close(fd);
+    shm_unlink(shm_name.c_str());
+    fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      LOG(ERROR) << "Could not recreate " << shm_name << ": " << strerror(errno);
+      return false;
+    }
+  }
+
+  void* ptr = MAP_FAILED;
+  if (ftruncate(fd, map_size) == 0)
+    ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    LOG(ERROR) << "Could not map " << shm_name << ": " << strerror(errno);
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  map_size_ = map_size;
+  header_ = reinterpret_cast<VarzShmHeader*>(ptr);
+  data_ = reinterpret_cast<char*>(ptr) + kHeaderSize;
+
+  // Keeps the sequence of the previous process, so that the readers see it growing.
+  uint64_t seq = 0;
+  if (header_->magic == kMagic && header_->version == kVarzShmFormatVersion &&
+      header_->capacity == capacity) {
+    seq = header_->seq.load(std::memory_order_relaxed);
+  }
+  header_->version = kVarzShmFormatVersion;
+  header_->capacity = capacity;
+  header_->seq.store((seq + 1) & ~1ULL, std::memory_order_relaxed);  // Even if it crashed.
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = kMagic;
+
+  return true;
+}
+
+void VarzShmWriter::Publish(const vector<VarzShmEntry>& entries) {
+  CHECK(header_);
+
+  buf_.clear();
+  uint32_t num_entries = 0;
+  for (const VarzShmEntry& e : entries) {
+    size_t prev_size = buf_.size();
+    Encode(e, &buf_);
+    if (buf_.size() > header_->capacity) {
+      buf_.resize(prev_size);
+      break;
+    }
+    ++num_entries;
+  }
+  LOG_IF(WARNING, num_entries < entries.size())
+      << "Dropped " << entries.size() - num_entries << " varz entries, increase --varz_shm_size";
+
+  uint64_t seq = header_->seq.load(std::memory_order_relaxed);
+  header_->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  header_->publish_usec = GetCurrentTimeMicros();
+  header_->pid = getpid();
+  header_->size = buf_.size();
+  header_->num_entries = num_entries;
+  header_->truncated = num_entries < entries.size();
+  memcpy(data_, buf_.data(), buf_.size());
+
+  header_->seq.store(seq + 2, std::memory_order_release);
+}
+
+VarzShmReader::~VarzShmReader() {
+  if (header_)
+    munmap(const_cast<VarzShmHeader*>(header_), map_size_);
+}
+
+bool VarzShmReader::Open(const string& name) {
+  CHECK(!header_);
+
+  string shm_name = ShmName(name);
+  int fd = shm_open(shm_name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    VLOG(1) << "Could not open " << shm_name << ": " << strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  void* ptr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) > kHeaderSize)
+    ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return false;
+
+  const VarzShmHeader* header = reinterpret_cast<const VarzShmHeader*>(ptr);
+  if (header->magic != kMagic || header->version != kVarzShmFormatVersion ||
+      kHeaderSize + header->capacity != size_t(st.st_size)) {
+    VLOG(1) << shm_name << " is not a varz segment of version " << kVarzShmFormatVersion;
+    munmap(ptr, st.st_size);
+    return false;
+  }
+
+  header_ = header;
+  data_ = reinterpret_cast<const char*>(ptr) + kHeaderSize;
+  map_size_ = st.st_size;
+  return true;
+}
+
+bool VarzShmReader::Read(VarzShmSnapshot* dest, unsigned max_attempts) const {
+  CHECK(header_);
+
+  string data;
+  for (unsigned i = 0; i < max_attempts; ++i) {
+    if (i > 0)
+      this_thread::yield();
+
+    uint64_t seq = header_->seq.load(std::memory_order_acquire);
+    if (seq & 1)
+      continue;
+
+    // The fields may be torn by a concurrent publication, hence the size is bounded before
+    // the copy and the copy is validated by seq.
+    dest->publish_usec = header_->publish_usec;
+    dest->pid = header_->pid;
+    dest->truncated = header_->truncated;
+    uint32_t num_entries = header_->num_entries;
+    data.assign(data_, std::min<size_t>(header_->size, header_->capacity));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->seq.load(std::memory_order_relaxed) != seq)
+      continue;
+
+    dest->seq = seq;
+    return Decode(data, num_entries, &dest->entries);
+  }
+  return false;
+}
+
+bool StartVarzShm() {
+  static once_flag once;
+  static bool res = false;
+
+  call_once(once, [] {
+    if (!FLAGS_varz_shm.empty())
+      res = StartPublisher();
+  });
+  return res;
+}
+
+}  // namespace util
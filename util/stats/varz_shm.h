@@ -0,0 +1,98 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace util {
+
+constexpr uint32_t kVarzShmFormatVersion = 1;
+
+namespace detail {
+struct VarzShmHeader;
+}  // namespace detail
+
+// A scalar of the varz snapshot. The maps of the varz are flattened into the names
+// joined by '/', e.g. "rpc-methods/server/Get/calls", and their histograms into the scalars
+// "<name>/count", "/sum", "/avg", "/p50", "/p90" and "/p99".
+struct VarzShmEntry {
+  enum Type : uint8_t { INT = 0, DOUBLE = 1, STRING = 2 };
+
+  std::string name;
+  Type type = INT;
+  int64_t num = 0;
+  double dbl = 0;
+  std::string str;
+};
+
+struct VarzShmSnapshot {
+  uint64_t seq = 0;           // Grows with every publication.
+  uint64_t publish_usec = 0;  // Wall time of the publication.
+  uint32_t pid = 0;           // Of the publishing process, which may have exited since.
+  bool truncated = false;     // Some entries did not fit into the segment.
+  std::vector<VarzShmEntry> entries;
+};
+
+// Returns the live varz as entries. Walks the varz, hence is as expensive as /varz.
+std::vector<VarzShmEntry> FlattenVarz();
+
+// Publishes the snapshots into a POSIX shared memory segment, /dev/shm/<name>, so that
+// the local agents read the varz without a request to the process. The segment holds
+// the latest snapshot in a binary format versioned by kVarzShmFormatVersion and is protected by
+// a sequence lock: the writer never waits for the readers and the readers retry the copies that
+// overlapped a publication. The segment persists after the process exits and is reused by
+// the next process of the same name.
+// Not thread-safe, a writer is used by a single thread.
+class VarzShmWriter {
+ public:
+  VarzShmWriter() = default;
+  ~VarzShmWriter();
+
+  VarzShmWriter(const VarzShmWriter&) = delete;
+  void operator=(const VarzShmWriter&) = delete;
+
+  // Creates the segment with room for capacity bytes of entries or reuses the existing one
+  // of the same capacity. Returns false and logs the error if it fails.
+  bool Open(const std::string& name, size_t capacity);
+
+  // Replaces the snapshot of the segment. The entries that do not fit are dropped.
+  void Publish(const std::vector<VarzShmEntry>& entries);
+
+ private:
+  detail::VarzShmHeader* header_ = nullptr;
+  char* data_ = nullptr;
+  size_t map_size_ = 0;
+  std::string buf_;
+};
+
+// Reads the snapshots of a segment published by VarzShmWriter. Thread-compatible.
+class VarzShmReader {
+ public:
+  VarzShmReader() = default;
+  ~VarzShmReader();
+
+  VarzShmReader(const VarzShmReader&) = delete;
+  void operator=(const VarzShmReader&) = delete;
+
+  // Maps the segment for reading. Returns false if it does not exist or has another format.
+  bool Open(const std::string& name);
+
+  // Copies the latest snapshot into dest. Returns false if the snapshot was being published
+  // during max_attempts copies or is malformed, e.g. the writer crashed in the middle.
+  bool Read(VarzShmSnapshot* dest, unsigned max_attempts = 100) const;
+
+ private:
+  const detail::VarzShmHeader* header_ = nullptr;
+  const char* data_ = nullptr;
+  size_t map_size_ = 0;
+};
+
+// Starts a thread that publishes the varz into the segment --varz_shm every --varz_shm_ms.
+// Returns false if --varz_shm is not set or the segment could not be opened.
+// Only the first call starts the thread, the other calls return its result. Thread-safe.
+bool StartVarzShm();
+
+}  // namespace util
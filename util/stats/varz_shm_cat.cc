@@ -0,0 +1,70 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+// Prints the varz that a process publishes with --varz_shm=<name>:
+//   varz_shm_cat <name> [<prefix>]
+// Prints the entries whose names start with prefix, every entry as "name value".
+
+#include <unistd.h>
+
+#include <iostream>
+
+#include "absl/strings/match.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "util/stats/varz_shm.h"
+
+DEFINE_bool(header, false, "Print the pid and the age of the snapshot first");
+
+using namespace std;
+using namespace util;
+
+int main(int argc, char** argv) {
+  MainInitGuard guard(&argc, &argv);
+
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <name> [<prefix>]\n";
+    return 1;
+  }
+
+  VarzShmReader reader;
+  if (!reader.Open(argv[1])) {
+    cerr << "Could not open the varz segment " << argv[1] << "\n";
+    return 1;
+  }
+
+  VarzShmSnapshot snapshot;
+  if (!reader.Read(&snapshot)) {
+    cerr << "Could not read a consistent snapshot of " << argv[1] << "\n";
+    return 1;
+  }
+
+  if (FLAGS_header) {
+    int64_t age_ms = (GetCurrentTimeMicros() - snapshot.publish_usec) / 1000;
+    cout << "# pid " << snapshot.pid << ", seq " << snapshot.seq << ", age " << age_ms << "ms"
+         << (snapshot.truncated ? ", truncated" : "") << "\n";
+  }
+
+  const char* prefix = argc > 2 ? argv[2] : "";
+  for (const VarzShmEntry& e : snapshot.entries) {
+    if (!absl::StartsWith(e.name, prefix))
+      continue;
+    cout << e.name << " ";
+    switch (e.type) {
+      case VarzShmEntry::INT:
+        cout << e.num;
+        break;
+      case VarzShmEntry::DOUBLE:
+        cout << e.dbl;
+        break;
+      case VarzShmEntry::STRING:
+        cout << e.str;
+        break;
+    }
+    cout << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/stats/varz_shm.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/stats/varz_stats.h"
+
+namespace util {
+
+using namespace std;
+
+class VarzShmTest : public testing::Test {
+ protected:
+  void SetUp() final { name_ = absl::StrCat("varz_shm_test.", getpid()); }
+  void TearDown() final { shm_unlink(("/" + name_).c_str()); }
+
+  static const VarzShmEntry* Find(const VarzShmSnapshot& snapshot, const string& name) {
+    for (const auto& e : snapshot.entries) {
+      if (e.name == name)
+        return &e;
+    }
+    return nullptr;
+  }
+
+  string name_;
+};
+
+TEST_F(VarzShmTest, Flatten) {
+  VarzCount count("test-count");
+  count.IncBy(7);
+  VarzMapCount map_count("test-map");
+  map_count.IncBy("foo", 3);
+  VarzFunction func("test-func", [] {
+    base::Histogram hist;
+    hist.Add(10);
+    VarzValue::Map res;
+    res.emplace_back("name", VarzValue("bar"));
+    res.emplace_back("latency", VarzValue::FromHistogram(hist));
+    return res;
+  });
+
+  VarzShmWriter writer;
+  ASSERT_TRUE(writer.Open(name_, 1 << 16));
+  writer.Publish(FlattenVarz());
+
+  VarzShmReader reader;
+  ASSERT_TRUE(reader.Open(name_));
+  VarzShmSnapshot snapshot;
+  ASSERT_TRUE(reader.Read(&snapshot));
+  EXPECT_EQ(getpid(), snapshot.pid);
+  EXPECT_FALSE(snapshot.truncated);
+  EXPECT_GT(snapshot.publish_usec, 0);
+
+  const VarzShmEntry* e = Find(snapshot, "test-count");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(VarzShmEntry::INT, e->type);
+  EXPECT_EQ(7, e->num);
+
+  e = Find(snapshot, "test-map/foo");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(3, e->num);
+
+  e = Find(snapshot, "test-func/name");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(VarzShmEntry::STRING, e->type);
+  EXPECT_EQ("bar", e->str);
+
+  e = Find(snapshot, "test-func/latency/count");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(1, e->num);
+  EXPECT_TRUE(Find(snapshot, "test-func/latency/p99"));
+}
+
+TEST_F(VarzShmTest, Reopen) {
+  VarzShmEntry entry;
+  entry.name = "a";
+  entry.num = 1;
+
+  uint64_t seq = 0;
+  {
+    VarzShmWriter writer;
+    ASSERT_TRUE(writer.Open(name_, 1024));
+    writer.Publish({entry});
+    writer.Publish({entry});
+
+    VarzShmReader reader;
+    ASSERT_TRUE(reader.Open(name_));
+    VarzShmSnapshot snapshot;
+    ASSERT_TRUE(reader.Read(&snapshot));
+    seq = snapshot.seq;
+  }
+
+  // The segment outlives its writer and the next writer continues its sequence.
+  VarzShmReader reader;
+  ASSERT_TRUE(reader.Open(name_));
+  VarzShmSnapshot snapshot;
+  ASSERT_TRUE(reader.Read(&snapshot));
+  ASSERT_EQ(1, snapshot.entries.size());
+
+  VarzShmWriter writer;
+  ASSERT_TRUE(writer.Open(name_, 1024));
+  entry.num = 2;
+  writer.Publish({entry});
+  ASSERT_TRUE(reader.Read(&snapshot));
+  EXPECT_GT(snapshot.seq, seq);
+  EXPECT_EQ(2, snapshot.entries[0].num);
+
+  // Another capacity replaces the segment.
+  VarzShmWriter writer2;
+  ASSERT_TRUE(writer2.Open(name_, 2048));
+  VarzShmReader reader2;
+  ASSERT_TRUE(reader2.Open(name_));
+  ASSERT_TRUE(reader2.Read(&snapshot));
+  EXPECT_TRUE(snapshot.entries.empty());
+}
+
+TEST_F(VarzShmTest, Truncated) {
+  vector<VarzShmEntry> entries(100);
+  for (unsigned i = 0; i < entries.size(); ++i) {
+    entries[i].name = absl::StrCat("entry", i);
+    entries[i].num = i;
+  }
+
+  VarzShmWriter writer;
+  ASSERT_TRUE(writer.Open(name_, 256));
+  writer.Publish(entries);
+
+  VarzShmReader reader;
+  ASSERT_TRUE(reader.Open(name_));
+  VarzShmSnapshot snapshot;
+  ASSERT_TRUE(reader.Read(&snapshot));
+  EXPECT_TRUE(snapshot.truncated);
+  ASSERT_GT(snapshot.entries.size(), 0);
+  ASSERT_LT(snapshot.entries.size(), entries.size());
+  EXPECT_EQ("entry1", snapshot.entries[1].name);
+}
+
+TEST_F(VarzShmTest, Concurrent) {
+  VarzShmWriter writer;
+  ASSERT_TRUE(writer.Open(name_, 1 << 16));
+  writer.Publish({});
+
+  std::atomic_bool done{false};
+  std::thread publisher([&] {
+    vector<VarzShmEntry> entries(50);
+    for (int64_t i = 0; !done; ++i) {
+      for (auto& e : entries) {
+        e.name = absl::StrCat("entry", i % 7);
+        e.num = i;
+      }
+      writer.Publish(entries);
+    }
+  });
+
+  VarzShmReader reader;
+  ASSERT_TRUE(reader.Open(name_));
+  VarzShmSnapshot snapshot;
+  uint64_t first_seq = 0;
+  unsigned reads = 0, torn = 0;
+
+  // Reads the snapshots of the publisher until it publishes 1000 more of them.
+  while (reads == 0 || snapshot.seq < first_seq + 2000) {
+    if (!reader.Read(&snapshot, 1000) || snapshot.entries.empty())
+      continue;
+    if (reads++ == 0)
+      first_seq = snapshot.seq;
+    for (const auto& e : snapshot.entries) {
+      torn += (e.num != snapshot.entries[0].num || e.name != snapshot.entries[0].name);
+    }
+  }
+  done = true;
+  publisher.join();
+  EXPECT_GT(reads, 1);
+  EXPECT_EQ(0, torn);
+}
+
+}  // namespace util
@@ -4,6 +4,9 @@
 
 #include "util/stats/varz_stats.h"
 
+#include <array>
+
+#include "base/memory_account.h"
 #include "base/walltime.h"
 #include "strings/strcat.h"
 #include "strings/stringprintf.h"
@@ -17,6 +20,15 @@ namespace util {
 
 folly::RWSpinLock VarzListNode::g_varz_lock;
 
+namespace detail {
+
+unsigned NewVarzShard() {
+  static std::atomic_uint next_shard{0};
+  return next_shard.fetch_add(1, std::memory_order_relaxed) % kNumVarzShards;
+}
+
+}  // namespace detail
+
 VarzListNode::VarzListNode(const char* name) : name_(name), prev_(nullptr) {
   folly::RWSpinLock::WriteHolder guard(g_varz_lock);
 
@@ -55,6 +67,10 @@ string VarzListNode::Format(const AnyValue& av) {
     case VarzValue::DOUBLE:
       StrAppend(&result, av.dbl);
       break;
+    case VarzValue::HISTOGRAM:
+      StrAppend(&result, "{ \"count\": ", av.hist->count(), ", \"p50\": ", av.hist->Percentile(50),
+                ", \"p99\": ", av.hist->Percentile(99), ", \"max\": ", av.hist->max(), " }");
+      break;
     case VarzValue::MAP:
       result.append("{ ");
       for (const auto& k_v : av.key_value_array) {
@@ -157,6 +173,159 @@ VarzValue VarzCount::GetData() const {
   return VarzValue::FromInt(val_.load());
 }
 
+long VarzShardedCount::Sum() const {
+  long res = 0;
+  for (const Shard& shard : shards_) {
+    res += shard.val.load(std::memory_order_relaxed);
+  }
+  return res;
+}
+
+VarzValue VarzShardedCount::GetData() const {
+  return VarzValue::FromInt(Sum());
+}
+
+VarzShardedMapCount::~VarzShardedMapCount() {}
+
+void VarzShardedMapCount::IncBy(StringPiece key, int32 delta) {
+  if (key.empty()) {
+    LOG(DFATAL) << "Empty varz key";
+    return;
+  }
+
+  Shard& shard = shards_[detail::VarzShard()];
+  folly::RWSpinLock::WriteHolder guard(shard.lock);
+  if (!shard.counts) {
+    shard.counts.reset(new Map);
+    shard.counts->set_empty_key(StringPiece());
+  }
+  (*shard.counts)[key] += delta;
+}
+
+VarzValue VarzShardedMapCount::GetData() const {
+  StringPieceDenseMap<long> merged;
+  merged.set_empty_key(StringPiece());
+
+  for (const Shard& shard : shards_) {
+    folly::RWSpinLock::ReadHolder guard(shard.lock);
+    if (!shard.counts)
+      continue;
+    for (const auto& k_v : *shard.counts) {
+      merged[k_v.first] += k_v.second;
+    }
+  }
+
+  AnyValue::Map result;
+  for (const auto& k_v : merged) {
+    result.emplace_back(AsString(k_v.first), VarzValue::FromInt(k_v.second));
+  }
+  typedef AnyValue::Map::value_type vt;
+  std::sort(result.begin(), result.end(),
+            [](const vt& l, const vt& r) { return l.first < r.first; });
+
+  return AnyValue{std::move(result)};
+}
+
+double VarzShardedRate::Rate(unsigned minutes) const {
+  unsigned bins = minutes * 60 / kBinSec;
+  int64 sum = 0;
+  for (const Shard& shard : shards_) {
+    sum += shard.counter.SumLast(1, bins);
+  }
+  return double(sum) / (bins * kBinSec);
+}
+
+VarzValue VarzShardedRate::GetData() const {
+  AnyValue::Map result;
+  for (unsigned minutes : {1, 5, 15}) {
+    result.emplace_back(absl::StrCat(minutes, "m"), VarzValue::FromDouble(Rate(minutes)));
+  }
+  return AnyValue{std::move(result)};
+}
+
+VarzMapQuantiles::~VarzMapQuantiles() {
+  for (Shard& shard : shards_) {
+    if (!shard.windows)
+      continue;
+    for (const auto& k_v : *shard.windows) {
+      delete k_v.second;
+    }
+  }
+}
+
+void VarzMapQuantiles::Add(StringPiece key, uint64 value) {
+  if (key.empty()) {
+    LOG(DFATAL) << "Empty varz key";
+    return;
+  }
+
+  Shard& shard = shards_[detail::VarzShard()];
+  folly::RWSpinLock::WriteHolder guard(shard.lock);
+  if (!shard.windows) {
+    shard.windows.reset(new Map);
+    shard.windows->set_empty_key(StringPiece());
+  }
+  Window*& window = (*shard.windows)[key];
+  if (!window) {
+    window = new Window;
+  }
+  window->Add(value);
+}
+
+void VarzMapQuantiles::MergeLast(StringPiece key, unsigned minutes,
+                                 base::HdrHistogram* dest) const {
+  for (const Shard& shard : shards_) {
+    // The windows rotate when read, hence the write lock.
+    folly::RWSpinLock::WriteHolder guard(shard.lock);
+    if (!shard.windows)
+      continue;
+    auto it = shard.windows->find(key);
+    if (it != shard.windows->end()) {
+      it->second->MergeLast(1, minutes, dest);
+    }
+  }
+}
+
+VarzValue VarzMapQuantiles::GetData() const {
+  constexpr unsigned kMinutes[] = {1, 5, 15};
+  typedef std::array<base::HdrHistogram, 3> Hists;
+
+  StringPieceDenseMap<Hists> merged;
+  merged.set_empty_key(StringPiece());
+
+  for (const Shard& shard : shards_) {
+    folly::RWSpinLock::WriteHolder guard(shard.lock);
+    if (!shard.windows)
+      continue;
+    for (const auto& k_v : *shard.windows) {
+      Hists& hists = merged[k_v.first];
+      for (unsigned i = 0; i < hists.size(); ++i) {
+        k_v.second->MergeLast(1, kMinutes[i], &hists[i]);
+      }
+    }
+  }
+
+  AnyValue::Map result;
+  for (const auto& k_v : merged) {
+    AnyValue::Map items;
+    for (unsigned i = 0; i < k_v.second.size(); ++i) {
+      const base::HdrHistogram& hist = k_v.second[i];
+      string suffix = absl::StrCat("_", kMinutes[i], "m");
+      items.emplace_back("count" + suffix, VarzValue::FromInt(hist.count()));
+      items.emplace_back("p50" + suffix, VarzValue::FromInt(hist.Percentile(50)));
+      items.emplace_back("p90" + suffix, VarzValue::FromInt(hist.Percentile(90)));
+      items.emplace_back("p99" + suffix, VarzValue::FromInt(hist.Percentile(99)));
+      items.emplace_back("max" + suffix, VarzValue::FromInt(hist.max()));
+    }
+    result.emplace_back(AsString(k_v.first), AnyValue(std::move(items)));
+  }
+  typedef AnyValue::Map::value_type vt;
+  std::sort(result.begin(), result.end(),
+            [](const vt& l, const vt& r) { return l.first < r.first; });
+
+  return AnyValue{std::move(result)};
+}
+
 VarzValue VarzQps::GetData() const {
   return VarzValue::FromInt(val_.Get());
 }
@@ -166,4 +335,22 @@ VarzValue VarzFunction::GetData() const {
   return AnyValue(result);
 }
 
+namespace {
+
+// Live and peak bytes of every subsystem, see base::MemoryAccount.
+VarzValue::Map GetMemoryVarz() {
+  VarzValue::Map res;
+  base::MemoryAccount::ForEach([&](const base::MemoryAccount& acc) {
+    VarzValue::Map account;
+    account.emplace_back("live-bytes", VarzValue::FromInt(acc.live()));
+    account.emplace_back("peak-bytes", VarzValue::FromInt(acc.peak()));
+    res.emplace_back(acc.name(), std::move(account));
+  });
+  return res;
+}
+
+VarzFunction memory_varz("memory", &GetMemoryVarz);
+
+}  // namespace
+
 }  // namespace util
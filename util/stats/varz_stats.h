@@ -5,6 +5,7 @@
 
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
@@ -110,6 +111,122 @@ class VarzCount : public VarzListNode {
   std::atomic_long val_;
 };
 
+namespace detail {
+
+constexpr unsigned kNumVarzShards = 64;
+
+unsigned NewVarzShard();
+
+// Returns the shard of the calling thread. The threads are assigned to the shards round robin,
+// hence up to kNumVarzShards threads never share a shard.
+inline unsigned VarzShard() {
+  static thread_local unsigned shard = NewVarzShard();
+  return shard;
+}
+
+}  // namespace detail
+
+// Same as VarzCount but each thread increments a counter on its own cache line. The counters
+// are summed only when the varz are read, hence suits the counters that all the IO threads
+// update on hot paths.
+class VarzShardedCount : public VarzListNode {
+ public:
+  explicit VarzShardedCount(const char* varname) : VarzListNode(varname) {}
+
+  void IncBy(int32 delta) {
+    shards_[detail::VarzShard()].val.fetch_add(delta, std::memory_order_relaxed);
+  }
+  void Inc() { IncBy(1); }
+
+  long Sum() const;
+
+ private:
+  virtual AnyValue GetData() const override;
+
+  struct alignas(64) Shard {
+    std::atomic_long val{0};
+  };
+  Shard shards_[detail::kNumVarzShards];
+};
+
+// Same as VarzMapCount but each thread updates its own map, merged when the varz are read.
+// The lock of a shard is contended only by its reader or when more than kNumVarzShards threads
+// update the map.
+class VarzShardedMapCount : public VarzListNode {
+ public:
+  explicit VarzShardedMapCount(const char* varname) : VarzListNode(varname) {}
+  ~VarzShardedMapCount();
+
+  // Increments key by delta.
+  void IncBy(StringPiece key, int32 delta);
+
+  void Inc(StringPiece key) { IncBy(key, 1); }
+
+ private:
+  virtual AnyValue GetData() const override;
+
+  typedef StringPieceDenseMap<long> Map;
+
+  struct alignas(64) Shard {
+    mutable folly::RWSpinLock lock;
+    std::unique_ptr<Map> counts;  // allocated by the first update.
+  };
+  Shard shards_[detail::kNumVarzShards];
+};
+
+// Rates per second over the last 1, 5 and 15 minutes. Each thread increments its own sliding
+// counter like VarzShardedCount does.
+class VarzShardedRate : public VarzListNode {
+ public:
+  explicit VarzShardedRate(const char* varname) : VarzListNode(varname) {}
+
+  void IncBy(int32 delta) { shards_[detail::VarzShard()].counter.IncBy(delta); }
+  void Inc() { IncBy(1); }
+
+  // The rate over the last minutes that ended, hence lags by up to kBinSec seconds.
+  double Rate(unsigned minutes) const;
+
+ private:
+  virtual AnyValue GetData() const override;
+
+  static constexpr unsigned kBinSec = 15;
+
+  // 15 minutes and the current bin.
+  typedef SlidingSecondCounterT<int64, 15 * 60 / kBinSec + 1, kBinSec> Counter;
+
+  struct alignas(64) Shard {
+    Counter counter;
+  };
+  Shard shards_[detail::kNumVarzShards];
+};
+
+// A family of latency quantiles over the last 1, 5 and 15 minutes, keyed by e.g. the endpoint.
+// Each thread records into its own minute histograms, merged when the varz are read. Minutes
+// are reported once they end, e.g. p99_1m is the 99th percentile of the last full minute.
+class VarzMapQuantiles : public VarzListNode {
+ public:
+  explicit VarzMapQuantiles(const char* varname) : VarzListNode(varname) {}
+  ~VarzMapQuantiles();
+
+  // Usually value is the latency in microseconds.
+  void Add(StringPiece key, uint64 value);
+
+  // Merges the histograms of key over the last minutes into dest.
+  void MergeLast(StringPiece key, unsigned minutes, base::HdrHistogram* dest) const;
+
+ private:
+  virtual AnyValue GetData() const override;
+
+  typedef SlidingHistogramT<16, 60> Window;
+  typedef StringPieceDenseMap<Window*> Map;  // owns the windows.
+
+  struct alignas(64) Shard {
+    mutable folly::RWSpinLock lock;
+    std::unique_ptr<Map> windows;  // allocated by the first update.
+  };
+  Shard shards_[detail::kNumVarzShards];
+};
+
 class VarzQps : public VarzListNode {
  public:
   explicit VarzQps(const char* varname) : VarzListNode(varname) {}
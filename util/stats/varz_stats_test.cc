@@ -0,0 +1,104 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/stats/varz_stats.h"
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace util {
+
+using namespace std;
+
+class VarzStatsTest : public testing::Test {
+ protected:
+  static string Get(const char* name) {
+    string res;
+    VarzListNode::IterateValues([&](const string& key, const string& val) {
+      if (key == name)
+        res = val;
+    });
+    return res;
+  }
+};
+
+TEST_F(VarzStatsTest, Sharded) {
+  VarzShardedCount count("sharded-count");
+  VarzShardedMapCount map_count("sharded-map");
+
+  // More threads than shards, so that some of them share their shards.
+  constexpr unsigned kThreads = detail::kNumVarzShards + 8;
+  vector<thread> threads;
+  for (unsigned i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&, i] {
+      for (unsigned j = 0; j < 1000; ++j) {
+        count.Inc();
+        map_count.Inc("a");
+      }
+      map_count.IncBy(i % 2 ? "odd" : "even", 2);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(long(kThreads) * 1000, count.Sum());
+  EXPECT_EQ(absl::StrCat(kThreads * 1000), Get("sharded-count"));
+  EXPECT_EQ(absl::StrCat("{ \"a\": ", kThreads * 1000, ",\"even\": ", kThreads, ",\"odd\": ",
+                         kThreads, " }"),
+            Get("sharded-map"));
+}
+
+TEST_F(VarzStatsTest, Windowed) {
+  SlidingSecondBase::SetCurrentTime_Test(6000);
+
+  VarzShardedRate rate("rate");
+  VarzMapQuantiles quantiles("latency");
+
+  for (unsigned i = 1; i <= 100; ++i) {
+    rate.IncBy(60);
+    quantiles.Add("get", i);
+  }
+  for (unsigned i = 0; i < 10; ++i) {
+    quantiles.Add("put", 1000);
+  }
+
+  // The minute has not ended yet.
+  EXPECT_EQ(0, rate.Rate(1));
+  base::HdrHistogram hist;
+  quantiles.MergeLast("get", 1, &hist);
+  EXPECT_EQ(0, hist.count());
+
+  SlidingSecondBase::SetCurrentTime_Test(6060);
+  EXPECT_DOUBLE_EQ(100, rate.Rate(1));
+  EXPECT_DOUBLE_EQ(20, rate.Rate(5));
+  quantiles.MergeLast("get", 1, &hist);
+  EXPECT_EQ(100, hist.count());
+  EXPECT_EQ(99, hist.Percentile(99));
+
+  string val = Get("latency");
+  EXPECT_NE(string::npos, val.find("\"get\": { \"count_1m\": 100,")) << val;
+  EXPECT_NE(string::npos, val.find("\"p99_15m\": 1000,")) << val;
+
+  // The records of another thread are merged as well.
+  thread([&] { quantiles.Add("get", 1); }).join();
+  SlidingSecondBase::SetCurrentTime_Test(6120);
+  hist.Clear();
+  quantiles.MergeLast("get", 1, &hist);
+  EXPECT_EQ(1, hist.count());
+  hist.Clear();
+  quantiles.MergeLast("get", 5, &hist);
+  EXPECT_EQ(101, hist.count());
+
+  // The window slides past all the records.
+  SlidingSecondBase::SetCurrentTime_Test(7200);
+  hist.Clear();
+  quantiles.MergeLast("get", 15, &hist);
+  EXPECT_EQ(0, hist.count());
+  EXPECT_EQ(0, rate.Rate(15));
+  SlidingSecondBase::SetCurrentTime_Test(kuint32max);
+}
+
+}  // namespace util
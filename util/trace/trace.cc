@@ -0,0 +1,323 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/trace/trace.h"
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "base/flags.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "util/asio/fiber_local.h"
+
+DEFINE_double(trace_sample_rate, 0,
+              "The fraction of the root requests that are traced, in [0, 1]. "
+              "The requests of the sampled callers are traced regardless.");
+DEFINE_uint32(trace_ring_size, 1024, "How many of the last spans each thread keeps.");
+
+namespace util {
+namespace trace {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kRecordWords = sizeof(SpanRecord) / 8;
+static_assert(sizeof(SpanRecord) % 8 == 0, "");
+
+/*
+  The spans of a single thread. The thread overwrites the oldest slots, the readers copy them
+  and drop the slots that changed meanwhile: the sequence of a slot is odd while its writer
+  updates it. The words are atomic so that the racy copies are well defined.
+*/
+class SpanRing {
+ public:
+  explicit SpanRing(unsigned size) : size_(size), slots_(new Slot[size]) {}
+
+  void Push(const SpanRecord& rec);
+  void Collect(uint64_t trace_id, vector<SpanRecord>* dest) const;
+
+ private:
+  struct Slot {
+    atomic<uint64_t> seq{0};
+    atomic<uint64_t> words[kRecordWords];
+  };
+
+  const unsigned size_;
+  unique_ptr<Slot[]> slots_;
+  uint64_t next_ = 0;  // accessed only by the writer.
+};
+
+void SpanRing::Push(const SpanRecord& rec) {
+  uint64_t src[kRecordWords];
+  memcpy(src, &rec, sizeof(rec));
+
+  Slot& slot = slots_[next_ % size_];
+  uint64_t seq = slot.seq.load(memory_order_relaxed);
+  slot.seq.store(seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (unsigned i = 0; i < kRecordWords; ++i) {
+    slot.words[i].store(src[i], memory_order_relaxed);
+  }
+  slot.seq.store(seq + 2, memory_order_release);
+  ++next_;
+}
+
+void SpanRing::Collect(uint64_t trace_id, vector<SpanRecord>* dest) const {
+  uint64_t words[kRecordWords];
+  for (unsigned i = 0; i < size_; ++i) {
+    const Slot& slot = slots_[i];
+    uint64_t seq = slot.seq.load(memory_order_acquire);
+    if (seq == 0 || (seq & 1))
+      continue;
+    for (unsigned j = 0; j < kRecordWords; ++j) {
+      words[j] = slot.words[j].load(memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.seq.load(memory_order_relaxed) != seq)
+      continue;
+
+    SpanRecord rec;
+    memcpy(&rec, words, sizeof(rec));
+    if (trace_id == 0 || rec.trace_id == trace_id)
+      dest->push_back(rec);
+  }
+}
+
+// The rings of the exited threads are reused by the new ones, since the readers may still
+// read them.
+struct Registry {
+  mutex mu;
+  vector<SpanRing*> rings, free_rings;
+};
+
+Registry& registry() {
+  static Registry* reg = new Registry;  // never destroyed since threads may outlive statics.
+  return *reg;
+}
+
+class ThreadRing {
+ public:
+  SpanRing* get() {
+    if (!ring_) {
+      Registry& reg = registry();
+      lock_guard<mutex> lk(reg.mu);
+      if (reg.free_rings.empty()) {
+        reg.rings.push_back(new SpanRing(std::max(1u, FLAGS_trace_ring_size)));
+        ring_ = reg.rings.back();
+      } else {
+        ring_ = reg.free_rings.back();
+        reg.free_rings.pop_back();
+      }
+    }
+    return ring_;
+  }
+
+  ~ThreadRing() {
+    if (ring_) {
+      Registry& reg = registry();
+      lock_guard<mutex> lk(reg.mu);
+      reg.free_rings.push_back(ring_);
+    }
+  }
+
+ private:
+  SpanRing* ring_ = nullptr;
+};
+
+thread_local ThreadRing this_thread_ring;
+
+uint64_t RandomId() {
+  static thread_local mt19937_64 rng{random_device{}()};
+  uint64_t res;
+  do {
+    res = rng();
+  } while (res == 0);
+  return res;
+}
+
+// The current span of the fibers that run in IoContext threads.
+FiberLocal<SpanContext>& fiber_span() {
+  static FiberLocal<SpanContext> local;
+  return local;
+}
+
+// The current span of the other threads.
+thread_local SpanContext thread_span;
+
+bool InIoFiber() {
+  return ::boost::fibers::context::active()->get_properties() != nullptr;
+}
+
+void SetCurrentSpan(const SpanContext& span) {
+  if (!InIoFiber()) {
+    thread_span = span;
+    return;
+  }
+  SpanContext* current = fiber_span().get();
+  if (current) {
+    *current = span;
+  } else if (span.sampled()) {
+    fiber_span().reset(new SpanContext(span));
+  }
+}
+
+bool ParseHex(absl::string_view src, uint64_t* dest) {
+  *dest = 0;
+  for (char c : src) {
+    int val = absl::ascii_isdigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+    if (val < 0)
+      return false;
+    *dest = (*dest << 4) | val;
+  }
+  return true;
+}
+
+string HexId(uint64_t id) { return absl::StrFormat("%016x", id); }
+
+void AppendJsonString(absl::string_view src, string* dest) {
+  dest->push_back('"');
+  for (char c : src) {
+    if (c == '"' || c == '\\') {
+      dest->push_back('\\');
+      dest->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      absl::StrAppendFormat(dest, "\\u%04x", c);
+    } else {
+      dest->push_back(c);
+    }
+  }
+  dest->push_back('"');
+}
+
+}  // namespace
+
+SpanContext NewTrace() {
+  SpanContext res;
+  double rate = FLAGS_trace_sample_rate;
+  if (rate <= 0)
+    return res;
+
+  if (rate < 1) {
+    static thread_local mt19937_64 rng{random_device{}()};
+    if (uniform_real_distribution<double>{}(rng) >= rate)
+      return res;
+  }
+  res.trace_id = RandomId();
+  return res;
+}
+
+SpanContext NewChild(const SpanContext& parent) {
+  SpanContext res;
+  if (parent.sampled()) {
+    res.trace_id = parent.trace_id;
+    res.span_id = RandomId();
+  }
+  return res;
+}
+
+SpanContext CurrentSpan() {
+  if (!InIoFiber())
+    return thread_span;
+  SpanContext* current = fiber_span().get();
+  return current ? *current : SpanContext{};
+}
+
+void RecordSpan(const SpanContext& span, uint64_t parent_id, absl::string_view name,
+                uint64_t start_usec, uint64_t end_usec, bool error) {
+  DCHECK(span.sampled());
+
+  SpanRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.trace_id = span.trace_id;
+  rec.span_id = span.span_id;
+  rec.parent_id = parent_id;
+  rec.start_usec = start_usec;
+  rec.end_usec = end_usec;
+  rec.error = error;
+  memcpy(rec.name, name.data(), std::min(name.size(), sizeof(rec.name) - 1));
+
+  this_thread_ring.get()->Push(rec);
+}
+
+vector<SpanRecord> CollectSpans(uint64_t trace_id) {
+  vector<SpanRecord> res;
+  Registry& reg = registry();
+  lock_guard<mutex> lk(reg.mu);
+  for (const SpanRing* ring : reg.rings) {
+    ring->Collect(trace_id, &res);
+  }
+  return res;
+}
+
+string SpansToJson(const vector<SpanRecord>& spans) {
+  string res = R"({"resourceSpans":[{"scopeSpans":[{"scope":{"name":"gaia"},"spans":[)";
+  for (size_t i = 0; i < spans.size(); ++i) {
+    const SpanRecord& s = spans[i];
+    absl::StrAppend(&res, i ? "," : "", R"({"traceId":")", HexId(0), HexId(s.trace_id),
+                    R"(","spanId":")", HexId(s.span_id), "\"");
+    if (s.parent_id) {
+      absl::StrAppend(&res, R"(,"parentSpanId":")", HexId(s.parent_id), "\"");
+    }
+    res.append(R"(,"name":)");
+    AppendJsonString(s.name, &res);
+    absl::StrAppend(&res, R"(,"startTimeUnixNano":")", s.start_usec * 1000,
+                    R"(","endTimeUnixNano":")", s.end_usec * 1000,
+                    R"(","status":{"code":)", s.error ? 2 : 1, "}}");
+  }
+  res.append("]}]}]}");
+  return res;
+}
+
+string ToTraceParent(const SpanContext& span) {
+  return absl::StrCat("00-", HexId(0), HexId(span.trace_id), "-", HexId(span.span_id), "-01");
+}
+
+SpanContext ParseTraceParent(absl::string_view header) {
+  // version-trace_id-parent_id-flags
+  SpanContext res;
+  if (header.size() < 55 || header[2] != '-' || header[35] != '-' || header[52] != '-')
+    return res;
+
+  uint64_t trace_high, trace_low, span_id, flags;
+  if (!ParseHex(header.substr(3, 16), &trace_high) ||
+      !ParseHex(header.substr(19, 16), &trace_low) || !ParseHex(header.substr(36, 16), &span_id) ||
+      !ParseHex(header.substr(53, 2), &flags)) {
+    return res;
+  }
+  if ((flags & 1) && trace_low && span_id) {
+    res.trace_id = trace_low;
+    res.span_id = span_id;
+  }
+  return res;
+}
+
+ScopedSpan::ScopedSpan(absl::string_view name, const SpanContext& parent) {
+  if (!parent.sampled())
+    return;
+
+  span_ = NewChild(parent);
+  prev_ = CurrentSpan();
+  parent_id_ = parent.span_id;
+  start_usec_ = GetCurrentTimeMicros();
+  name_.assign(name.data(), name.size());
+  SetCurrentSpan(span_);
+}
+
+ScopedSpan::~ScopedSpan() {
+  if (!span_.sampled())
+    return;
+
+  RecordSpan(span_, parent_id_, name_, start_usec_, GetCurrentTimeMicros(), error_);
+  SetCurrentSpan(prev_);
+}
+
+}  // namespace trace
+}  // namespace util
@@ -0,0 +1,95 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace util {
+namespace trace {
+
+/*
+  Lightweight distributed tracing. A trace is the tree of the spans, e.g. RPCs, HTTP requests
+  and file reads, that serve a root request. Roots are sampled with --trace_sample_rate
+  when they start and only the sampled traces propagate: in the RPC frames, see Frame, and in
+  the traceparent HTTP header of the W3C trace context. The spans are recorded into per-thread
+  rings without locks and exported by the /tracez page of the http server as OTLP JSON.
+
+  The current span is per fiber in IoContext threads and per thread elsewhere:
+
+    trace::ScopedSpan span("ReadIndex", trace::NewTrace());
+    ...  // the RPCs sent from this fiber are the children of span.
+*/
+
+// The ids of a sampled span. The default context is not sampled.
+struct SpanContext {
+  uint64_t trace_id = 0;
+  uint64_t span_id = 0;
+
+  bool sampled() const { return trace_id != 0; }
+};
+
+// Starts a new trace with probability --trace_sample_rate. The returned context has no span,
+// its children are the roots of the trace.
+SpanContext NewTrace();
+
+// Returns a new span of the trace of parent, not sampled if parent is not.
+SpanContext NewChild(const SpanContext& parent);
+
+// The span of the calling fiber, see ScopedSpan.
+SpanContext CurrentSpan();
+
+struct SpanRecord {
+  uint64_t trace_id, span_id, parent_id;  // parent_id is 0 for the roots.
+  uint64_t start_usec, end_usec;          // wall time.
+  uint32_t error;
+  char name[44];  // truncated, null-terminated.
+};
+
+// Records a finished span into the ring of the calling thread. The rings keep the last
+// --trace_ring_size spans of each thread.
+void RecordSpan(const SpanContext& span, uint64_t parent_id, absl::string_view name,
+                uint64_t start_usec, uint64_t end_usec, bool error = false);
+
+// Returns the spans in the rings of all the threads, only of trace_id if it's not 0.
+std::vector<SpanRecord> CollectSpans(uint64_t trace_id = 0);
+
+// Formats the spans as an OTLP/JSON ExportTraceServiceRequest, so that they can be posted
+// as is to the /v1/traces endpoint of an OpenTelemetry collector.
+std::string SpansToJson(const std::vector<SpanRecord>& spans);
+
+// The traceparent header value: "00-<trace id>-<span id>-01".
+std::string ToTraceParent(const SpanContext& span);
+
+// Returns a not sampled context if the header is malformed or is not sampled. Only the low
+// 64 bits of the 128 bit trace ids are kept.
+SpanContext ParseTraceParent(absl::string_view header);
+
+// Runs the calling fiber in a new child span of parent until the scope ends and records it.
+// Does nothing if parent is not sampled, so the untraced requests pay for a check only.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(absl::string_view name) : ScopedSpan(name, CurrentSpan()) {}
+  ScopedSpan(absl::string_view name, const SpanContext& parent);
+  ~ScopedSpan();
+
+  ScopedSpan(const ScopedSpan&) = delete;
+  void operator=(const ScopedSpan&) = delete;
+
+  const SpanContext& context() const { return span_; }
+
+  void set_error() { error_ = true; }
+
+ private:
+  SpanContext span_, prev_;
+  uint64_t parent_id_ = 0;
+  uint64_t start_usec_ = 0;
+  std::string name_;
+  bool error_ = false;
+};
+
+}  // namespace trace
+}  // namespace util
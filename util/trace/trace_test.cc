@@ -0,0 +1,123 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/trace/trace.h"
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+DECLARE_double(trace_sample_rate);
+
+namespace util {
+namespace trace {
+
+using namespace std;
+
+class TraceTest : public testing::Test {
+ protected:
+  void TearDown() override { FLAGS_trace_sample_rate = 0; }
+};
+
+TEST_F(TraceTest, TraceParent) {
+  SpanContext span{0x0af7651916cd43ddULL, 0x00f067aa0ba902b7ULL};
+  string header = ToTraceParent(span);
+  EXPECT_EQ("00-00000000000000000af7651916cd43dd-00f067aa0ba902b7-01", header);
+
+  SpanContext parsed = ParseTraceParent(header);
+  EXPECT_EQ(span.trace_id, parsed.trace_id);
+  EXPECT_EQ(span.span_id, parsed.span_id);
+
+  parsed = ParseTraceParent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+  EXPECT_EQ(0xa3ce929d0e0e4736ULL, parsed.trace_id);
+
+  // Not sampled.
+  EXPECT_FALSE(ParseTraceParent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-00").sampled());
+  EXPECT_FALSE(ParseTraceParent("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7").sampled());
+  EXPECT_FALSE(ParseTraceParent("00-4bf92f3577b34da6a3ce929d0e0e473X-00f067aa0ba902b7-01").sampled());
+  EXPECT_FALSE(ParseTraceParent("").sampled());
+}
+
+TEST_F(TraceTest, Sampling) {
+  EXPECT_FALSE(NewTrace().sampled());
+  {
+    ScopedSpan span("unsampled", NewTrace());
+    EXPECT_FALSE(span.context().sampled());
+    EXPECT_FALSE(CurrentSpan().sampled());
+  }
+
+  FLAGS_trace_sample_rate = 1;
+  SpanContext root = NewTrace();
+  ASSERT_TRUE(root.sampled());
+  EXPECT_EQ(0, root.span_id);
+  EXPECT_NE(root.trace_id, NewTrace().trace_id);
+}
+
+TEST_F(TraceTest, Spans) {
+  FLAGS_trace_sample_rate = 1;
+  SpanContext parent, child;
+  {
+    ScopedSpan root("root", NewTrace());
+    parent = root.context();
+    EXPECT_EQ(parent.span_id, CurrentSpan().span_id);
+    {
+      ScopedSpan span("child");
+      child = span.context();
+      span.set_error();
+      EXPECT_EQ(parent.trace_id, child.trace_id);
+      EXPECT_EQ(child.span_id, CurrentSpan().span_id);
+    }
+    EXPECT_EQ(parent.span_id, CurrentSpan().span_id);
+
+    // Recorded by another thread.
+    thread([&] { RecordSpan(NewChild(parent), parent.span_id, "remote", 10, 20); }).join();
+  }
+  EXPECT_FALSE(CurrentSpan().sampled());
+
+  vector<SpanRecord> spans = CollectSpans(parent.trace_id);
+  ASSERT_EQ(3, spans.size());
+  unsigned found = 0;
+  for (const SpanRecord& s : spans) {
+    if (s.span_id == parent.span_id) {
+      EXPECT_STREQ("root", s.name);
+      EXPECT_EQ(0, s.parent_id);
+      EXPECT_LE(s.start_usec, s.end_usec);
+      ++found;
+    } else if (s.span_id == child.span_id) {
+      EXPECT_STREQ("child", s.name);
+      EXPECT_EQ(parent.span_id, s.parent_id);
+      EXPECT_TRUE(s.error);
+      ++found;
+    } else {
+      EXPECT_STREQ("remote", s.name);
+      EXPECT_EQ(20, s.end_usec);
+    }
+  }
+  EXPECT_EQ(2, found);
+
+  string json = SpansToJson(spans);
+  EXPECT_NE(string::npos, json.find(R"("name":"child")")) << json;
+  EXPECT_NE(string::npos, json.find(R"("status":{"code":2})")) << json;
+  EXPECT_EQ(0, CollectSpans(1).size());
+}
+
+TEST_F(TraceTest, RingWraps) {
+  FLAGS_trace_sample_rate = 1;
+  SpanContext root = NewTrace();
+  thread([&] {
+    for (unsigned i = 0; i < 5000; ++i) {
+      RecordSpan(NewChild(root), 0, string(100, 'a'), i, i + 1);
+    }
+  }).join();
+
+  vector<SpanRecord> spans = CollectSpans(root.trace_id);
+  EXPECT_EQ(1024, spans.size());
+  for (const SpanRecord& s : spans) {
+    EXPECT_GE(s.start_usec, 5000 - 1024);
+    EXPECT_EQ(sizeof(s.name) - 1, strlen(s.name));
+  }
+}
+
+}  // namespace trace
+}  // namespace util
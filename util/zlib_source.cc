@@ -5,9 +5,13 @@
 #include "util/zlib_source.h"
 
 #include <memory>
+
 #include "base/logging.h"
 #include "strings/strcat.h"
 
+// After absl headers, since its macros clash with absl internal endian functions.
+#include "base/endian.h"
+
 namespace util {
 
 inline Status ToStatus(int err, StringPiece msg) {
@@ -170,4 +174,130 @@ Status ZlibSink::Flush() {
   return sub_->Flush();
 }
 
+namespace {
+
+// Offsets of the extra field within the member header.
+constexpr size_t kXlenOffset = 10;
+constexpr size_t kSubfieldOffset = 12;
+constexpr size_t kMemberSizeOffset = 16;
+constexpr uint8_t kFlagExtra = 4;
+constexpr uint8_t kSubfieldLen = 8;
+
+// BGZF blocks have a "BC" subfield holding the size of the block minus 1, see SAMv1.pdf.
+constexpr uint8_t kBgzfSubfieldLen = 2;
+
+}  // namespace
+
+Status GzipMemberCompress(const strings::ByteRange& src, unsigned level, std::string* dest) {
+  CHECK_LT(src.size(), kuint32max);
+
+  z_stream zcontext;
+  InitCtx(&zcontext);
+
+  int lev = level == 0 ? Z_DEFAULT_COMPRESSION : level;
+  int zerror = deflateInit2(&zcontext, lev, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+  CHECK_EQ(Z_OK, zerror);
+
+  // The sizes are filled once the member is compressed.
+  uint8_t extra[4 + kSubfieldLen] = {'G', 'M', kSubfieldLen, 0};
+  gz_header header;
+  memset(&header, 0, sizeof(header));
+  header.extra = extra;
+  header.extra_len = sizeof(extra);
+  header.os = 3;  // unix
+  CHECK_EQ(Z_OK, deflateSetHeader(&zcontext, &header));
+
+  size_t start = dest->size();
+  size_t bound = deflateBound(&zcontext, src.size()) + kGzipMemberHeaderSize;
+  dest->resize(start + bound);
+
+  zcontext.next_in = const_cast<Bytef*>(src.data());
+  zcontext.avail_in = src.size();
+  zcontext.next_out = reinterpret_cast<Bytef*>(&(*dest)[start]);
+  zcontext.avail_out = bound;
+
+  zerror = deflate(&zcontext, Z_FINISH);
+  if (zerror != Z_STREAM_END) {
+    Status st = ToStatus(zerror, zcontext.msg);
+    deflateEnd(&zcontext);
+    dest->resize(start);
+    return st;
+  }
+  size_t member_size = zcontext.total_out;
+  deflateEnd(&zcontext);
+
+  dest->resize(start + member_size);
+  uint8_t* hdr = reinterpret_cast<uint8_t*>(&(*dest)[start]);
+  DCHECK(hdr[3] & kFlagExtra);
+  CHECK_LT(member_size, kuint32max);
+  LittleEndian::Store32(hdr + kMemberSizeOffset, member_size);
+  LittleEndian::Store32(hdr + kMemberSizeOffset + 4, src.size());
+
+  return Status::OK;
+}
+
+bool ParseGzipMemberHeader(const strings::ByteRange& header, uint32_t* member_size,
+                           uint32_t* raw_size) {
+  if (header.size() < kGzipMemberHeaderSize)
+    return false;
+  const uint8_t* hdr = header.data();
+  if (hdr[0] != 0x1f || hdr[1] != 0x8b || hdr[2] != Z_DEFLATED || (hdr[3] & kFlagExtra) == 0)
+    return false;
+
+  const uint8_t* sub = hdr + kSubfieldOffset;
+  uint16_t xlen = LittleEndian::Load16(hdr + kXlenOffset);
+  if (xlen == 4 + kBgzfSubfieldLen && sub[0] == 'B' && sub[1] == 'C' &&
+      LittleEndian::Load16(sub + 2) == kBgzfSubfieldLen) {
+    *member_size = LittleEndian::Load16(sub + 4) + 1U;
+    *raw_size = 0;
+    return *member_size > kGzipMemberHeaderSize;
+  }
+
+  // We write only the GM subfield.
+  if (xlen != 4 + kSubfieldLen)
+    return false;
+  if (sub[0] != 'G' || sub[1] != 'M' || LittleEndian::Load16(sub + 2) != kSubfieldLen)
+    return false;
+
+  *member_size = LittleEndian::Load32(hdr + kMemberSizeOffset);
+  *raw_size = LittleEndian::Load32(hdr + kMemberSizeOffset + 4);
+
+  return *member_size > kGzipMemberHeaderSize;
+}
+
+Status GzipMemberUncompress(const strings::ByteRange& member, std::string* dest) {
+  uint32_t member_size = 0, raw_size = 0;
+  if (!ParseGzipMemberHeader(member, &member_size, &raw_size) || member_size != member.size())
+    return Status(StatusCode::IO_ERROR, "Invalid gzip member");
+
+  // ISIZE of the trailer.
+  if (raw_size == 0)
+    raw_size = LittleEndian::Load32(member.data() + member.size() - 4);
+
+  z_stream zcontext;
+  InitCtx(&zcontext);
+  CHECK_EQ(Z_OK, internalInflateInit2(ZlibSource::GZIP, &zcontext));
+
+  size_t start = dest->size();
+  dest->resize(start + raw_size);
+
+  zcontext.next_in = const_cast<Bytef*>(member.data());
+  zcontext.avail_in = member.size();
+  zcontext.next_out = reinterpret_cast<Bytef*>(&(*dest)[start]);
+  zcontext.avail_out = raw_size;
+
+  int zerror = inflate(&zcontext, Z_FINISH);
+  Status st;
+  if (zerror != Z_STREAM_END) {
+    st = ToStatus(zerror, zcontext.msg ? zcontext.msg : "truncated member");
+  } else if (zcontext.avail_out || zcontext.avail_in) {
+    st = Status(StatusCode::IO_ERROR, "Gzip member size mismatch");
+  }
+  inflateEnd(&zcontext);
+
+  if (!st.ok())
+    dest->resize(start);
+  return st;
+}
+
 }  // namespace util
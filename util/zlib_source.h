@@ -6,6 +6,8 @@
 
 #include <zlib.h>
 
+#include <string>
+
 #include "base/macros.h"
 #include "util/sinksource.h"
 
@@ -65,5 +67,24 @@ class ZlibSink : public Sink {
   z_stream zcontext_;
 };
 
+// Gzip members whose header has a "GM" extra subfield holding the compressed size of the member
+// and the size of its data, both little endian uint32, similarly to BGZF. Files made of such
+// members are regular gzip streams that can also be split into members without inflating them,
+// which allows compressing and inflating the members concurrently.
+// The blocks of BGZF files (bgzip, samtools) are read the same way.
+constexpr size_t kGzipMemberHeaderSize = 24;
+
+// Compresses src as a single member and appends it to dest.
+Status GzipMemberCompress(const strings::ByteRange& src, unsigned level, std::string* dest);
+
+// Returns false if header does not start a member written by GzipMemberCompress or a BGZF block.
+// BGZF headers do not hold the size of the data, hence raw_size is 0 for them and the gzip
+// trailer of the member holds it.
+bool ParseGzipMemberHeader(const strings::ByteRange& header, uint32_t* member_size,
+                           uint32_t* raw_size);
+
+// Inflates a single member and appends its data to dest.
+Status GzipMemberUncompress(const strings::ByteRange& member, std::string* dest);
+
 }  // namespace util
 
@@ -5,8 +5,11 @@
 
 #include <zstd.h>
 
+#include <algorithm>
+
 #include "util/zstd_sinksource.h"
 
+#include "base/endian.h"
 #include "base/logging.h"
 
 namespace util {
@@ -17,6 +20,11 @@ inline Status ZstdStatus(size_t res) {
   return Status(StatusCode::IO_ERROR, ZSTD_getErrorName(res));
 }
 
+// The seekable format, see contrib/seekable_format/zstd_seekable_compression_format.md of zstd.
+constexpr uint32_t kSkippableFrameMagic = 0x184D2A5E;
+constexpr uint32_t kSeekableMagic = 0x8F92EAB1;
+constexpr unsigned kSeekTableFooterSize = 9;
+
 
 size_t ZStdSink::CompressBound(size_t src_size) {
   return ZSTD_compressBound(src_size);
@@ -38,39 +46,148 @@ ZStdSink::~ZStdSink() {
 
 
 Status ZStdSink::Init(int level) {
-  size_t const res = ZSTD_initCStream_srcSize(HANDLE, level, 0);
-  if (ZSTD_isError(res)) {
-    return ZstdStatus(res);
+  Options opts;
+  opts.level = level;
+  return Init(opts);
+}
+
+Status ZStdSink::Init(const Options& opts) {
+  if (opts.seekable_frame_size > kuint32max)
+    return Status(StatusCode::INVALID_ARGUMENT, "seekable frames must be smaller than 4GB");
+
+  ZSTD_CCtx_reset(HANDLE, ZSTD_reset_session_and_parameters);
+
+  std::pair<ZSTD_cParameter, int> params[] = {
+      {ZSTD_c_compressionLevel, opts.level},
+      {ZSTD_c_nbWorkers, int(opts.workers)},
+      {ZSTD_c_enableLongDistanceMatching, opts.long_distance},
+      {ZSTD_c_windowLog, int(opts.window_log)},
+  };
+  for (const auto& p : params) {
+    size_t const res = ZSTD_CCtx_setParameter(HANDLE, p.first, p.second);
+    if (ZSTD_isError(res)) {
+      return ZstdStatus(res);
+    }
   }
+
+  frame_size_ = opts.seekable_frame_size;
+  frame_raw_ = frame_compressed_ = 0;
+  seek_table_.clear();
   VLOG(1) << "allocated " << ZSTD_sizeof_CStream(HANDLE);
   return Status::OK;
 }
 
 Status ZStdSink::Append(const strings::ByteRange& slice) {
+  if (!frame_size_)
+    return Compress(slice, false);
+
+  strings::ByteRange rest = slice;
+  while (!rest.empty()) {
+    size_t len = std::min(rest.size(), frame_size_ - frame_raw_);
+    RETURN_IF_ERROR(Compress(strings::ByteRange(rest.data(), len), false));
+    frame_raw_ += len;
+    rest.advance(len);
+    if (frame_raw_ == frame_size_) {
+      RETURN_IF_ERROR(EndFrame());
+    }
+  }
+  return Status::OK;
+}
+
+Status ZStdSink::Flush() {
+  if (!frame_size_) {
+    RETURN_IF_ERROR(Compress(strings::ByteRange(), true));
+    return upstream_->Flush();
+  }
+
+  if (frame_raw_ || seek_table_.empty()) {
+    RETURN_IF_ERROR(EndFrame());
+  }
+
+  // The seek table is a skippable frame, so the regular decoders ignore it.
+  const size_t num_frames = seek_table_.size() / 2;
+  const uint32_t table_size = seek_table_.size() * 4 + kSeekTableFooterSize;
+  std::unique_ptr<uint8_t[]> table(new uint8_t[table_size + 8]);
+  uint8_t* next = table.get();
+
+  LittleEndian::Store32(next, kSkippableFrameMagic);
+  LittleEndian::Store32(next + 4, table_size);
+  next += 8;
+  for (uint32_t v : seek_table_) {
+    LittleEndian::Store32(next, v);
+    next += 4;
+  }
+  LittleEndian::Store32(next, num_frames);
+  next[4] = 0;  // descriptor, the entries have no checksums.
+  LittleEndian::Store32(next + 5, kSeekableMagic);
+
+  seek_table_.clear();
+  RETURN_IF_ERROR(upstream_->Append(strings::ByteRange(table.get(), table_size + 8)));
+  return upstream_->Flush();
+}
+
+Status ZStdSink::Compress(const strings::ByteRange& slice, bool end_frame) {
   ZSTD_inBuffer input = { slice.data(), slice.size(), 0 };
-  while (input.pos < input.size) {
+  const ZSTD_EndDirective mode = end_frame ? ZSTD_e_end : ZSTD_e_continue;
+  while (true) {
     ZSTD_outBuffer out_buf{ buf_.get(), buf_sz_, 0};
-    size_t res = ZSTD_compressStream(HANDLE, &out_buf , &input);
+    size_t res = ZSTD_compressStream2(HANDLE, &out_buf, &input, mode);
     if (ZSTD_isError(res)) {
       return ZstdStatus(res);
     }
-    RETURN_IF_ERROR(upstream_->Append(strings::ByteRange(buf_.get(), out_buf.pos)));
+    if (out_buf.pos) {
+      frame_compressed_ += out_buf.pos;
+      RETURN_IF_ERROR(upstream_->Append(strings::ByteRange(buf_.get(), out_buf.pos)));
+    }
+
+    // For ZSTD_e_end res is the size of the data that is still buffered.
+    if (end_frame ? res == 0 : input.pos == input.size)
+      break;
   }
   return Status::OK;
 }
 
-Status ZStdSink::Flush() {
-  ZSTD_outBuffer out_buf{buf_.get(), buf_sz_, 0};
+Status ZStdSink::EndFrame() {
+  RETURN_IF_ERROR(Compress(strings::ByteRange(), true));
+  if (frame_compressed_ > kuint32max)
+    return Status(StatusCode::IO_ERROR, "compressed seekable frame exceeds 4GB");
+
+  seek_table_.push_back(frame_compressed_);
+  seek_table_.push_back(frame_raw_);
+  frame_raw_ = frame_compressed_ = 0;
+  return Status::OK;
+}
 
-  size_t res = ZSTD_endStream(HANDLE, &out_buf);
-  if (ZSTD_isError(res)) {
-    return ZstdStatus(res);
+bool ParseZStdSeekTable(const strings::ByteRange& data, std::vector<ZStdSeekEntry>* entries) {
+  if (data.size() < 8 + kSeekTableFooterSize)
+    return false;
+
+  const uint8_t* footer = data.end() - kSeekTableFooterSize;
+  uint8_t descriptor = footer[4];
+  if (LittleEndian::Load32(footer + 5) != kSeekableMagic || (descriptor & 0x7F) != 0)
+    return false;
+
+  // The entries have 4 byte checksums if bit 7 of the descriptor is set.
+  const uint64_t num_frames = LittleEndian::Load32(footer);
+  const unsigned entry_size = (descriptor & 0x80) ? 12 : 8;
+  const uint64_t table_size = num_frames * entry_size + kSeekTableFooterSize;
+  if (data.size() < table_size + 8)
+    return false;
+
+  const uint8_t* next = data.end() - table_size - 8;
+  if (LittleEndian::Load32(next) != kSkippableFrameMagic ||
+      LittleEndian::Load32(next + 4) != table_size) {
+    return false;
   }
-  CHECK_EQ(0, res);
-  if (out_buf.pos) {
-    RETURN_IF_ERROR(upstream_->Append(strings::ByteRange(buf_.get(), out_buf.pos)));
+  next += 8;
+
+  entries->resize(num_frames);
+  for (ZStdSeekEntry& e : *entries) {
+    e.compressed_size = LittleEndian::Load32(next);
+    e.decompressed_size = LittleEndian::Load32(next + 4);
+    next += entry_size;
   }
-  return upstream_->Flush();
+  return true;
 }
 
 
@@ -93,7 +210,11 @@ ZStdSource::ZStdSource(Source* upstream)
     : sub_stream_(upstream) {
   CHECK(upstream);
   zstd_handle_ = ZSTD_createDStream();
-  size_t const res = ZSTD_initDStream(DC_HANDLE);
+  size_t res = ZSTD_initDStream(DC_HANDLE);
+  CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
+
+  // Accepts the windows of ZStdSink::Options::window_log.
+  res = ZSTD_DCtx_setParameter(DC_HANDLE, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX);
   CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
   buf_.reset(new uint8_t[kReadBuf]);
 }
@@ -124,6 +245,9 @@ StatusObject<size_t> ZStdSource::ReadInternal(const strings::MutableByteRange& r
 
     buf_range_.advance(input.pos);
     if (input.pos < input.size) {
+      // The frame has ended, the next one follows, e.g. in the seekable format.
+      if (to_read == 0)
+        continue;
       CHECK_EQ(output.pos, output.size);
       break;
     }
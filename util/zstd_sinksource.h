@@ -4,28 +4,72 @@
 #pragma once
 
 #include <memory>
+#include <vector>
+
 #include "util/sinksource.h"
 
 namespace util {
 
 class ZStdSink : public Sink {
  public:
+  struct Options {
+    int level = 1;
+
+    // Number of zstd worker threads, 0 compresses in the calling thread. With workers Append()
+    // hands the data to them and returns before it is compressed.
+    unsigned workers = 0;
+
+    // Long distance matching finds the repetitions that are further apart than the window,
+    // e.g. in large shards of similar records. Raises the window log to 27 unless it is set.
+    bool long_distance = false;
+
+    // log2 of the match window, 0 keeps the default of the level. Windows above 2^27 are
+    // rejected by the decoders with the default limits, ZStdSource accepts them.
+    unsigned window_log = 0;
+
+    // If positive, the data is written in the zstd seekable format: the data is split into
+    // independent frames of seekable_frame_size uncompressed bytes, followed by a seek table
+    // (see ParseZStdSeekTable), so the frames may be decompressed in parallel. The output is
+    // still a valid zstd stream.
+    size_t seekable_frame_size = 0;
+  };
+
   // Takes ownership over upstream.
   ZStdSink(Sink* upstream);
   ~ZStdSink();
 
   Status Init(int level);
+  Status Init(const Options& opts);
+
   Status Append(const strings::ByteRange& slice) override;
   Status Flush() override;
   static size_t CompressBound(size_t src_size);
 
  private:
+  Status Compress(const strings::ByteRange& slice, bool end_frame);
+  Status EndFrame();
+
   size_t buf_sz_;
   std::unique_ptr<uint8_t[]> buf_;
   std::unique_ptr<Sink> upstream_;
   void* zstd_handle_;
+
+  // Seekable format.
+  size_t frame_size_ = 0;
+  size_t frame_raw_ = 0, frame_compressed_ = 0;
+  std::vector<uint32_t> seek_table_;  // (compressed, decompressed) size pairs.
 };
 
+struct ZStdSeekEntry {
+  uint32_t compressed_size;
+  uint32_t decompressed_size;
+};
+
+// Parses the seek table of the zstd seekable format. data must end with the table, e.g. it
+// may be the tail of a file. Returns false if it does not. The frame i starts at the sum of
+// the compressed sizes of the frames before it.
+bool ParseZStdSeekTable(const strings::ByteRange& data, std::vector<ZStdSeekEntry>* entries);
+
 class ZStdSource : public Source {
  public:
   explicit ZStdSource(Source* upstream);